@@ -15,8 +15,10 @@
 -- To use this stored procedure the corresponding queries.conf statements must
 -- be configured as follows:
 --
--- allocate_begin = ""
--- allocate_find = "\
+-- alloc_begin = ""
+-- alloc_existing = ""
+-- alloc_requested = ""
+-- alloc_find = "\
 --	SELECT fr_ippool_allocate_previous_or_new_address( \
 --		'%{control.${pool_name}}', \
 --		'${gateway}', \
@@ -24,8 +26,8 @@
 --		${offer_duration}, \
 --		'%{${requested_address}:-0.0.0.0}' \
 --	)"
--- allocate_update = ""
--- allocate_commit = ""
+-- alloc_update = ""
+-- alloc_commit = ""
 --
 
 CREATE OR REPLACE FUNCTION fr_ippool_allocate_previous_or_new_address (
@@ -46,7 +46,6 @@ readline
 talloc
 unbound
 unixodbc
-ykclient
 "
 
 if ! which brew > /dev/null; then
@@ -58,6 +58,10 @@ static bool do_output = true;
 
 static rc_stats_t stats;
 
+static char const *report_file = NULL;
+static fr_time_delta_t *rtt = NULL;		//!< Round trip time of each reply, for the report.
+static size_t rtt_num = 0;
+
 static uint16_t server_port = 0;
 static int packet_code = FR_RADIUS_CODE_UNDEFINED;
 static fr_ipaddr_t server_ipaddr;
@@ -150,13 +154,16 @@ static NEVER_RETURNS void usage(void)
 	fprintf(stderr, "  -F                     Print the file name, packet number and reply code.\n");
 	fprintf(stderr, "  -h                     Print usage help information.\n");
 	fprintf(stderr, "  -i <id>                Set request id to 'id'.  Values may be 0..255\n");
+	fprintf(stderr, "  -L <num>               Generate load, sending 'num' requests/s from multiple threads.\n");
 	fprintf(stderr, "  -n <num>               Send N requests/s\n");
+	fprintf(stderr, "  -o <file>              Write throughput and latency statistics to 'file'.\n");
 	fprintf(stderr, "  -p <num>               Send 'num' packets from a file in parallel.\n");
 	fprintf(stderr, "  -P <proto>             Use proto (tcp or udp) for transport.\n");
 	fprintf(stderr, "  -r <retries>           If timeout, retry sending the packet 'retries' times.\n");
 	fprintf(stderr, "  -s                     Print out summary information of auth results.\n");
 	fprintf(stderr, "  -S <file>              read secret from file, not command line.\n");
 	fprintf(stderr, "  -t <timeout>           Wait 'timeout' seconds before retrying (may be a floating point number).\n");
+	fprintf(stderr, "  -T <threads>           Number of threads to use with -L.\n");
 	fprintf(stderr, "  -v                     Show program version information.\n");
 	fprintf(stderr, "  -x                     Debugging mode.\n");
 
@@ -1029,6 +1036,8 @@ static int recv_one_packet(fr_time_t wait_time)
 		RDEBUG("%s response code %d", request->files->packets, reply->code);
 	}
 
+	if (report_file) rtt_record(fr_time() - request->timestamp);
+
 	deallocate_id(request);
 	request->reply = reply;
 	reply = NULL;
@@ -1108,6 +1117,78 @@ packet_done:
 	return 0;
 }
 
+/** Record the round trip time of a reply
+ *
+ */
+static void rtt_record(fr_time_delta_t delta)
+{
+	if (rtt_num == talloc_array_length(rtt)) {
+		fr_time_delta_t *tmp;
+
+		tmp = talloc_realloc(NULL, rtt, fr_time_delta_t, rtt_num ? (rtt_num * 2) : 1024);
+		if (!tmp) return;
+		rtt = tmp;
+	}
+
+	rtt[rtt_num++] = delta;
+}
+
+static int rtt_cmp(void const *one, void const *two)
+{
+	fr_time_delta_t const *a = one, *b = two;
+
+	return CMP(*a, *b);
+}
+
+/** Return a percentile of the sorted round trip times, in microseconds
+ *
+ */
+static uint64_t rtt_percentile(double pct)
+{
+	size_t i;
+
+	if (!rtt_num) return 0;
+
+	i = (size_t) ((pct * rtt_num) / 100);
+	if (i >= rtt_num) i = rtt_num - 1;
+
+	return fr_time_delta_to_usec(rtt[i]);
+}
+
+/** Write the statistics for this run, one "name<TAB>value" per line
+ *
+ */
+static int report_write(char const *file, fr_time_delta_t elapsed)
+{
+	FILE	*fp;
+	double	secs = (double) elapsed / NSEC;
+
+	fp = fopen(file, "w");
+	if (!fp) {
+		ERROR("Failed opening %s: %s", file, fr_syserror(errno));
+		return -1;
+	}
+
+	qsort(rtt, rtt_num, sizeof(rtt[0]), rtt_cmp);
+
+	fprintf(fp, "count.replies\t%zu\n", rtt_num);
+	fprintf(fp, "count.accepted\t%" PRIu64 "\n", stats.accepted);
+	fprintf(fp, "count.rejected\t%" PRIu64 "\n", stats.rejected);
+	fprintf(fp, "count.lost\t%" PRIu64 "\n", stats.lost);
+	fprintf(fp, "time.elapsed\t%.6f\n", secs);
+	fprintf(fp, "rate\t%.1f\n", (secs > 0) ? (rtt_num / secs) : 0);
+	fprintf(fp, "latency.min\t%" PRIu64 "\n", rtt_num ? (uint64_t) fr_time_delta_to_usec(rtt[0]) : 0);
+	fprintf(fp, "latency.p50\t%" PRIu64 "\n", rtt_percentile(50));
+	fprintf(fp, "latency.p90\t%" PRIu64 "\n", rtt_percentile(90));
+	fprintf(fp, "latency.p99\t%" PRIu64 "\n", rtt_percentile(99));
+	fprintf(fp, "latency.p999\t%" PRIu64 "\n", rtt_percentile(99.9));
+	fprintf(fp, "latency.max\t%" PRIu64 "\n", rtt_num ? (uint64_t) fr_time_delta_to_usec(rtt[rtt_num - 1]) : 0);
+
+	fclose(fp);
+
+	return 0;
+}
+
 /**
  *
  * @hidecallgraph
@@ -1122,10 +1203,13 @@ int main(int argc, char **argv)
 	int		do_summary = false;
 	int		persec = 0;
 	int		parallel = 1;
+	int		load_rate = 0;
+	int		load_threads = 1;
 	rc_request_t	*this;
 	int		force_af = AF_UNSPEC;
 	TALLOC_CTX	*autofree;
 	fr_rb_tree_t	*filename_tree = NULL;
+	fr_time_t	start;
 
 	/*
 	 *	It's easier having two sets of flags to set the
@@ -1165,7 +1249,7 @@ int main(int argc, char **argv)
 	default_log.fd = STDOUT_FILENO;
 	default_log.print_level = false;
 
-	while ((c = getopt(argc, argv, "46c:C:d:D:f:Fhi:n:p:P:r:sS:t:vx")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "46c:C:d:D:f:Fhi:L:n:o:p:P:r:sS:t:T:vx")) != -1) switch (c) {
 		case '4':
 			force_af = AF_INET;
 			break;
@@ -1240,6 +1324,20 @@ int main(int argc, char **argv)
 			if (persec <= 0) usage();
 			break;
 
+		case 'o':
+			report_file = optarg;
+			break;
+
+		case 'L':
+			load_rate = atoi(optarg);
+			if (load_rate <= 0) usage();
+			break;
+
+		case 'T':
+			load_threads = atoi(optarg);
+			if (load_threads <= 0) usage();
+			break;
+
 			/*
 			 *	Note that sending MANY requests in
 			 *	parallel can over-run the kernel
@@ -1448,6 +1546,33 @@ int main(int argc, char **argv)
 
 	if (client_port == 0) client_port = request_head->packet->socket.inet.src_port;
 
+	/*
+	 *	Load generator mode does its own sending and
+	 *	receiving.
+	 */
+	if (load_rate) {
+		rc_load_config_t	load = {
+						.rate = load_rate,
+						.threads = load_threads,
+						.timeout = timeout,
+						.server_ipaddr = server_ipaddr,
+						.server_port = server_port,
+						.client_ipaddr = client_ipaddr,
+						.secret = secret,
+						.requests = request_head,
+						.report_file = report_file
+					};
+
+		if (ipproto != IPPROTO_UDP) {
+			ERROR("Load generator mode only supports UDP");
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		for (this = request_head; this; this = this->next) load.count += resend_count;
+
+		fr_exit_now((rc_load_run(&load) < 0) ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
 	if (ipproto == IPPROTO_TCP) {
 		sockfd = fr_socket_client_tcp(NULL, &server_ipaddr, server_port, false);
 		if (sockfd < 0) {
@@ -1501,6 +1626,7 @@ int main(int argc, char **argv)
 	 *	send packet, get time to wait, select for time, etc.
 	 *	loop.
 	 */
+	start = fr_time();
 	do {
 		int n = parallel;
 		rc_request_t *next;
@@ -1563,7 +1689,7 @@ int main(int argc, char **argv)
 				if (persec) {
 					fr_time_delta_t psec;
 
-					psec = (persec == 1) ? fr_time_delta_from_sec(1) : (1000000 / persec);
+					psec = fr_time_delta_from_sec(1) / persec;
 
 					/*
 					 *	Don't sleep elsewhere.
@@ -1625,6 +1751,9 @@ int main(int argc, char **argv)
 		}
 	} while (!done);
 
+	if (report_file && (report_write(report_file, fr_time() - start) < 0)) fr_exit_now(EXIT_FAILURE);
+	TALLOC_FREE(rtt);
+
 	talloc_free(filename_tree);
 
 	fr_packet_list_free(packet_list);
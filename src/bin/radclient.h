@@ -94,6 +94,26 @@ struct rc_request {
 	char const		*name;		//!< Test name (as specified in the request).
 };
 
+/** Configuration for the load generator mode
+ *
+ */
+typedef struct {
+	uint32_t		rate;		//!< Packets per second, over all threads.
+	uint32_t		threads;	//!< Number of threads sending packets.
+	uint64_t		count;		//!< Total number of packets to send.
+	fr_time_delta_t		timeout;	//!< How long to wait for each reply.
+
+	fr_ipaddr_t		server_ipaddr;	//!< Where to send packets.
+	uint16_t		server_port;
+	fr_ipaddr_t		client_ipaddr;	//!< Source address, AF_UNSPEC for any.
+
+	char const		*secret;	//!< Shared secret (talloced).
+	rc_request_t		*requests;	//!< Packets to send, in turn.
+	char const		*report_file;	//!< Where to write statistics, or NULL.
+} rc_load_config_t;
+
+int rc_load_run(rc_load_config_t const *config);
+
 #ifdef __cplusplus
 }
 #endif
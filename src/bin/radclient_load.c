@@ -0,0 +1,690 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/bin/radclient_load.c
+ * @brief Load generator mode for radclient.
+ *
+ * Each thread sends its share of the packets on a fixed schedule,
+ * whether or not replies have arrived.  Latency is measured from
+ * when a packet should have been sent, not from when it was sent,
+ * so a slow server can't hide its latency by slowing the client
+ * down (coordinated omission).
+ *
+ * Each thread has enough UDP sockets (and therefore source ports)
+ * that it doesn't run out of RADIUS IDs, and reads and writes
+ * packets in batches with recvmmsg() and sendmmsg().
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/conf.h>
+#include <freeradius-devel/util/hist.h>
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/radius/list.h>
+#include <freeradius-devel/radius/radius.h>
+
+#include <poll.h>
+#include <pthread.h>
+
+#include "radclient.h"
+
+#define LOAD_BATCH_SIZE		64	//!< Packets per sendmmsg() or recvmmsg().
+#define LOAD_MAX_SOCKETS	256	//!< Per thread.
+#define LOAD_IDS		256	//!< RADIUS IDs per socket.
+
+
+/** A packet which has been sent, and is waiting for a reply
+ *
+ */
+typedef struct {
+	bool			in_use;
+	fr_time_t		scheduled;	//!< When the packet should have been sent.
+	uint8_t			header[RADIUS_HEADER_LENGTH];	//!< To verify the reply.
+} rc_load_slot_t;
+
+typedef struct {
+	int			fd;
+	int			next_id;	//!< Where to start looking for a free ID.
+	int			outstanding;	//!< Number of IDs in use.
+	rc_load_slot_t		slot[LOAD_IDS];
+} rc_load_socket_t;
+
+/** A string attribute whose value changes for every packet
+ *
+ */
+typedef struct {
+	fr_pair_t		*vp;
+	char const		*fmt;		//!< The value from the file.
+} rc_load_var_t;
+
+typedef struct {
+	int			code;
+	fr_pair_list_t		vps;		//!< Each thread has its own copy.
+	rc_load_var_t		*var;		//!< talloc array of attributes to vary.
+} rc_load_template_t;
+
+typedef struct {
+	rc_load_config_t const	*config;
+	pthread_t		thread;
+	int			num;		//!< Thread number.
+
+	uint64_t		count;		//!< Packets this thread sends.
+	uint64_t		next;		//!< Next packet to send.
+	fr_time_t		start;
+
+	rc_load_socket_t	*sockets;
+	struct pollfd		*pfd;
+	int			num_sockets;
+	int			current;	//!< Socket we're sending on.
+	int			outstanding;	//!< Packets waiting for a reply.
+
+	rc_load_template_t	*templates;
+	int			num_templates;
+
+	uint8_t			buffer[LOAD_BATCH_SIZE][MAX_PACKET_LEN];
+	struct iovec		iov[LOAD_BATCH_SIZE];
+	struct mmsghdr		mmsg[LOAD_BATCH_SIZE];
+
+	uint64_t		sent;
+	uint64_t		replies;
+	uint64_t		accepted;
+	uint64_t		rejected;
+	uint64_t		lost;
+	uint64_t		invalid;	//!< Replies which we didn't expect, or which failed verification.
+
+	fr_hist_t		hist;
+} rc_load_thread_t;
+
+/** Print the histogram in the HdrHistogram percentile distribution format
+ *
+ *  Values are in microseconds.  There are five lines for each halving
+ *  of the distance to 100%.
+ */
+static void hist_print(FILE *fp, fr_hist_t const *hist)
+{
+	double		remaining = 1.0;	/* fraction of values above the percentile */
+
+	fprintf(fp, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+
+	for (;;) {
+		double		pct = 100.0 * (1.0 - remaining);
+		uint64_t	value = fr_hist_percentile(hist, pct);
+		uint64_t	count = fr_hist_count_le(hist, value);
+
+		if ((value >= hist->max) || (count >= hist->total)) {
+			fprintf(fp, "%12.3f %14.12f %10" PRIu64 "\n", (double) hist->max, 1.0, hist->total);
+			break;
+		}
+
+		fprintf(fp, "%12.3f %14.12f %10" PRIu64 " %14.2f\n", (double) value, 1.0 - remaining, count,
+			1.0 / remaining);
+
+		remaining *= 0.87055056329612413;	/* 2^(-1/5) */
+	}
+
+	fprintf(fp, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", fr_hist_mean(hist), fr_hist_stddev(hist));
+	fprintf(fp, "#[Max     = %12.3f, Total count    = %12" PRIu64 "]\n", (double) hist->max, hist->total);
+	fprintf(fp, "#[Buckets = %12d, SubBuckets     = %12d]\n", FR_HIST_NUM_BUCKETS / FR_HIST_SUB_HALF, FR_HIST_SUB_HALF * 2);
+}
+
+/** Substitute the packet number for %n, and a random number for %r
+ *
+ */
+static size_t load_expand(char *out, size_t outlen, char const *fmt, uint64_t n)
+{
+	char const	*p = fmt;
+	char		*q = out, *end = out + outlen - 1;
+	int		len;
+
+	while (*p && (q < end)) {
+		if ((p[0] != '%') || !p[1]) {
+			*q++ = *p++;
+			continue;
+		}
+
+		switch (p[1]) {
+		case 'n':
+			len = snprintf(q, end - q + 1, "%" PRIu64, n);
+			break;
+
+		case 'r':
+			len = snprintf(q, end - q + 1, "%08x", fr_rand());
+			break;
+
+		case '%':
+			*q = '%';
+			len = 1;
+			break;
+
+		default:
+			*q = '%';
+			len = 1;
+			p--;		/* copy the next character as-is */
+			break;
+		}
+
+		if (len < 0) break;
+		q += len;
+		if (q > end) q = end;
+		p += 2;
+	}
+	*q = '\0';
+
+	return q - out;
+}
+
+/** Copy the packets from the file, and find the attributes which vary
+ *
+ */
+static int load_templates(rc_load_thread_t *t, rc_request_t *requests)
+{
+	rc_request_t	*request;
+	int		i;
+
+	for (request = requests; request; request = request->next) t->num_templates++;
+
+	t->templates = talloc_zero_array(t, rc_load_template_t, t->num_templates);
+	if (!t->templates) return -1;
+
+	for (request = requests, i = 0; request; request = request->next, i++) {
+		rc_load_template_t	*tmpl = &t->templates[i];
+		fr_pair_t		*vp;
+
+		tmpl->code = request->packet->code;
+		fr_pair_list_init(&tmpl->vps);
+		if (fr_pair_list_copy(t->templates, &tmpl->vps, &request->request_list) < 0) return -1;
+
+		tmpl->var = talloc_zero_array(t->templates, rc_load_var_t, 0);
+		for (vp = fr_pair_list_head(&tmpl->vps);
+		     vp;
+		     vp = fr_pair_list_next(&tmpl->vps, vp)) {
+			size_t n;
+
+			if ((vp->vp_type != FR_TYPE_STRING) || !strchr(vp->vp_strvalue, '%')) continue;
+
+			n = talloc_array_length(tmpl->var);
+			tmpl->var = talloc_realloc(t->templates, tmpl->var, rc_load_var_t, n + 1);
+			if (!tmpl->var) return -1;
+
+			tmpl->var[n].vp = vp;
+			tmpl->var[n].fmt = talloc_typed_strdup(t->templates, vp->vp_strvalue);
+		}
+	}
+
+	return 0;
+}
+
+static int load_sockets(rc_load_thread_t *t)
+{
+	rc_load_config_t const	*config = t->config;
+	double			outstanding;
+	int			i;
+
+	/*
+	 *	Enough sockets for every packet sent during one
+	 *	timeout, plus one.
+	 */
+	outstanding = ((double) config->rate / config->threads) * ((double) config->timeout / NSEC);
+	if (outstanding < 1) outstanding = 1;
+	t->num_sockets = (int) (outstanding / LOAD_IDS) + 1;
+	if (t->num_sockets > LOAD_MAX_SOCKETS) t->num_sockets = LOAD_MAX_SOCKETS;
+
+	t->sockets = talloc_zero_array(t, rc_load_socket_t, t->num_sockets);
+	t->pfd = talloc_zero_array(t, struct pollfd, t->num_sockets);
+	if (!t->sockets || !t->pfd) return -1;
+
+	for (i = 0; i < t->num_sockets; i++) {
+		fr_ipaddr_t	src = config->client_ipaddr;
+		int		fd;
+
+		fd = fr_socket_client_udp(&src, NULL, &config->server_ipaddr, config->server_port, true);
+		if (fd < 0) return -1;
+
+		t->sockets[i].fd = fd;
+		t->pfd[i].fd = fd;
+		t->pfd[i].events = POLLIN;
+	}
+
+	return 0;
+}
+
+/** When packet "n" of this thread should be sent
+ *
+ *  The packets of all threads are interleaved.
+ */
+static inline fr_time_t load_scheduled(rc_load_thread_t *t, uint64_t n)
+{
+	double when = ((double) (n * t->config->threads + t->num) * NSEC) / t->config->rate;
+
+	return t->start + (fr_time_delta_t) when;
+}
+
+/** How many packets of this thread should have been sent by now
+ *
+ */
+static inline uint64_t load_due(rc_load_thread_t *t, fr_time_t now)
+{
+	double		n;
+
+	if (now < t->start) return 0;
+
+	n = (((double) (now - t->start) * t->config->rate / NSEC) - t->num) / t->config->threads;
+	if (n < 0) return 0;
+
+	if ((uint64_t) n + 1 > t->count) return t->count;
+
+	return (uint64_t) n + 1;
+}
+
+static rc_load_socket_t *load_socket_next(rc_load_thread_t *t)
+{
+	int i;
+
+	for (i = 0; i < t->num_sockets; i++) {
+		rc_load_socket_t *s = &t->sockets[t->current];
+
+		if (s->outstanding < LOAD_IDS) return s;
+
+		t->current++;
+		if (t->current == t->num_sockets) t->current = 0;
+	}
+
+	return NULL;
+}
+
+static int load_id_alloc(rc_load_socket_t *s)
+{
+	int i;
+
+	for (i = 0; i < LOAD_IDS; i++) {
+		int id = (s->next_id + i) & 0xff;
+
+		if (s->slot[id].in_use) continue;
+
+		s->slot[id].in_use = true;
+		s->outstanding++;
+		s->next_id = (id + 1) & 0xff;
+		return id;
+	}
+
+	return -1;
+}
+
+static void load_id_free(rc_load_thread_t *t, rc_load_socket_t *s, int id)
+{
+	s->slot[id].in_use = false;
+	s->outstanding--;
+	t->outstanding--;
+}
+
+/** Encode a packet from a template
+ *
+ */
+static ssize_t load_encode(rc_load_thread_t *t, uint8_t *buffer, int id, uint64_t n)
+{
+	rc_load_template_t	*tmpl = &t->templates[n % t->num_templates];
+	char const		*secret = t->config->secret;
+	size_t			i;
+	ssize_t			len;
+
+	for (i = 0; i < talloc_array_length(tmpl->var); i++) {
+		char	value[256];
+		size_t	vlen;
+
+		vlen = load_expand(value, sizeof(value), tmpl->var[i].fmt, (n * t->config->threads) + t->num);
+		fr_pair_value_bstrndup(tmpl->var[i].vp, value, vlen, false);
+	}
+
+	if ((tmpl->code == FR_RADIUS_CODE_ACCESS_REQUEST) || (tmpl->code == FR_RADIUS_CODE_STATUS_SERVER)) {
+		fr_rand_buffer(buffer + 4, RADIUS_AUTH_VECTOR_LENGTH);
+	}
+
+	len = fr_radius_encode(buffer, MAX_PACKET_LEN, NULL, secret, talloc_array_length(secret) - 1,
+			       tmpl->code, id, &tmpl->vps);
+	if (len < 0) return -1;
+
+	if (fr_radius_sign(buffer, NULL, (uint8_t const *) secret, talloc_array_length(secret) - 1, NULL) < 0) return -1;
+
+	return len;
+}
+
+/** Send all of the packets which are due
+ *
+ *  If we've run out of IDs, the packets are sent later.  Their
+ *  latency is still measured from when they should have been sent.
+ */
+static int load_send(rc_load_thread_t *t, uint64_t due)
+{
+	while (t->next < due) {
+		rc_load_socket_t	*s;
+		int			num = 0, ret, i;
+
+		s = load_socket_next(t);
+		if (!s) return 0;
+
+		while ((t->next < due) && (num < LOAD_BATCH_SIZE) && (s->outstanding < LOAD_IDS)) {
+			int		id;
+			ssize_t		len;
+
+			id = load_id_alloc(s);
+			len = load_encode(t, t->buffer[num], id, t->next);
+			if (len < 0) {
+				fr_perror("radclient: Failed encoding packet");
+				return -1;
+			}
+
+			s->slot[id].scheduled = load_scheduled(t, t->next);
+			memcpy(s->slot[id].header, t->buffer[num], RADIUS_HEADER_LENGTH);
+			t->outstanding++;
+
+			t->iov[num].iov_base = t->buffer[num];
+			t->iov[num].iov_len = len;
+			memset(&t->mmsg[num].msg_hdr, 0, sizeof(t->mmsg[num].msg_hdr));
+			t->mmsg[num].msg_hdr.msg_iov = &t->iov[num];
+			t->mmsg[num].msg_hdr.msg_iovlen = 1;
+
+			num++;
+			t->next++;
+		}
+
+		ret = sendmmsg(s->fd, t->mmsg, num, 0);
+		if (ret < 0) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != ENOBUFS)) {
+				fr_perror("radclient: Failed sending packets: %s", fr_syserror(errno));
+				return -1;
+			}
+			ret = 0;
+		}
+		t->sent += ret;
+
+		/*
+		 *	The socket is full.  Put the packets back, and
+		 *	try again after reading some replies.
+		 */
+		if (ret < num) {
+			for (i = ret; i < num; i++) load_id_free(t, s, t->buffer[i][1]);
+			t->next -= (num - ret);
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+static void load_reply(rc_load_thread_t *t, rc_load_socket_t *s, uint8_t *data, size_t len, fr_time_t now)
+{
+	rc_load_slot_t	*slot;
+	char const	*secret = t->config->secret;
+	fr_time_t	scheduled;
+
+	if ((len < RADIUS_HEADER_LENGTH) || (len != (size_t) ((data[2] << 8) | data[3]))) {
+	invalid:
+		t->invalid++;
+		return;
+	}
+
+	slot = &s->slot[data[1]];
+	if (!slot->in_use) goto invalid;
+
+	if (fr_radius_verify(data, slot->header, (uint8_t const *) secret,
+			     talloc_array_length(secret) - 1, NULL) < 0) goto invalid;
+
+	scheduled = slot->scheduled;
+	load_id_free(t, s, data[1]);
+
+	t->replies++;
+	fr_hist_add(&t->hist, (now > scheduled) ? fr_time_delta_to_usec(now - scheduled) : 0);
+
+	switch (data[0]) {
+	case FR_RADIUS_CODE_ACCESS_ACCEPT:
+	case FR_RADIUS_CODE_ACCOUNTING_RESPONSE:
+	case FR_RADIUS_CODE_COA_ACK:
+	case FR_RADIUS_CODE_DISCONNECT_ACK:
+		t->accepted++;
+		break;
+
+	case FR_RADIUS_CODE_ACCESS_CHALLENGE:
+		break;
+
+	default:
+		t->rejected++;
+		break;
+	}
+}
+
+static void load_recv(rc_load_thread_t *t, int timeout)
+{
+	int	i, ready;
+
+	ready = poll(t->pfd, t->num_sockets, timeout);
+	if (ready <= 0) return;
+
+	for (i = 0; (i < t->num_sockets) && (ready > 0); i++) {
+		int		num, j;
+		fr_time_t	now;
+
+		if (!(t->pfd[i].revents & POLLIN)) continue;
+		ready--;
+
+		do {
+			for (j = 0; j < LOAD_BATCH_SIZE; j++) {
+				t->iov[j].iov_base = t->buffer[j];
+				t->iov[j].iov_len = MAX_PACKET_LEN;
+				memset(&t->mmsg[j].msg_hdr, 0, sizeof(t->mmsg[j].msg_hdr));
+				t->mmsg[j].msg_hdr.msg_iov = &t->iov[j];
+				t->mmsg[j].msg_hdr.msg_iovlen = 1;
+			}
+
+			num = recvmmsg(t->sockets[i].fd, t->mmsg, LOAD_BATCH_SIZE, MSG_DONTWAIT, NULL);
+			if (num <= 0) break;
+
+			now = fr_time();
+			for (j = 0; j < num; j++) {
+				load_reply(t, &t->sockets[i], t->buffer[j], t->mmsg[j].msg_len, now);
+			}
+		} while (num == LOAD_BATCH_SIZE);
+	}
+}
+
+/** Give up on packets which have had no reply
+ *
+ */
+static void load_timeouts(rc_load_thread_t *t, fr_time_t now)
+{
+	int i, id;
+
+	for (i = 0; i < t->num_sockets; i++) {
+		rc_load_socket_t *s = &t->sockets[i];
+
+		if (!s->outstanding) continue;
+
+		for (id = 0; id < LOAD_IDS; id++) {
+			if (!s->slot[id].in_use) continue;
+			if ((now - s->slot[id].scheduled) < t->config->timeout) continue;
+
+			load_id_free(t, s, id);
+			t->lost++;
+		}
+	}
+}
+
+static void *load_thread(void *arg)
+{
+	rc_load_thread_t	*t = arg;
+	fr_time_t		next_timeout = 0;
+
+	for (;;) {
+		fr_time_t	now = fr_time();
+		int		timeout;
+
+		if ((t->next < t->count) && (load_send(t, load_due(t, now)) < 0)) break;
+
+		if (now >= next_timeout) {
+			load_timeouts(t, now);
+			next_timeout = now + fr_time_delta_from_msec(100);
+		}
+
+		if ((t->next == t->count) && (t->outstanding == 0)) break;
+
+		/*
+		 *	Sleep until the next packet is due, or until
+		 *	we have to check for timeouts.
+		 */
+		if (t->next < t->count) {
+			fr_time_t when = load_scheduled(t, t->next);
+
+			timeout = (when > now) ? (int) fr_time_delta_to_msec(when - now) : 0;
+		} else {
+			timeout = 100;
+		}
+
+		load_recv(t, timeout);
+	}
+
+	return NULL;
+}
+
+/** Run radclient as a load generator
+ *
+ * @param[in] config	for the run.
+ * @return
+ *	- 0 if every packet received a reply.
+ *	- -1 on error, or if any packets were lost.
+ */
+int rc_load_run(rc_load_config_t const *config)
+{
+	rc_load_thread_t	**threads;
+	fr_hist_t		*hist;
+	uint64_t		sent = 0, replies = 0, accepted = 0, rejected = 0, lost = 0, invalid = 0;
+	fr_time_t		start;
+	fr_time_delta_t		elapsed;
+	double			secs;
+	uint32_t		i, started = 0;
+	int			ret = 0;
+
+	threads = talloc_zero_array(NULL, rc_load_thread_t *, config->threads);
+	hist = talloc_zero(threads, fr_hist_t);
+	if (!threads || !hist) {
+	oom:
+		fr_perror("radclient: Out of memory");
+		talloc_free(threads);
+		return -1;
+	}
+
+	/*
+	 *	Start slightly in the future, so that all of the
+	 *	threads start on the same schedule.
+	 */
+	start = fr_time() + fr_time_delta_from_msec(100);
+
+	for (i = 0; i < config->threads; i++) {
+		rc_load_thread_t *t;
+
+		t = threads[i] = talloc_zero(threads, rc_load_thread_t);
+		if (!t) goto oom;
+
+		t->config = config;
+		t->num = i;
+		t->start = start;
+		t->count = config->count / config->threads;
+		if (i < (config->count % config->threads)) t->count++;
+
+		if ((load_templates(t, config->requests) < 0) || (load_sockets(t) < 0)) {
+			fr_perror("radclient: Failed setting up thread %u", i);
+			ret = -1;
+			goto done;
+		}
+	}
+
+	for (i = 0; i < config->threads; i++) {
+		if (pthread_create(&threads[i]->thread, NULL, load_thread, threads[i]) != 0) {
+			fr_perror("radclient: Failed creating thread: %s", fr_syserror(errno));
+			ret = -1;
+			break;
+		}
+		started++;
+	}
+
+	for (i = 0; i < started; i++) {
+		rc_load_thread_t *t = threads[i];
+
+		pthread_join(t->thread, NULL);
+
+		sent += t->sent;
+		replies += t->replies;
+		accepted += t->accepted;
+		rejected += t->rejected;
+		lost += t->lost;
+		invalid += t->invalid;
+		fr_hist_merge(hist, &t->hist);
+	}
+	elapsed = fr_time() - start;
+	secs = (double) elapsed / NSEC;
+
+	printf("Sent       : %" PRIu64 " in %.3fs (%.1f/s)\n", sent, secs, sent / secs);
+	printf("Replies    : %" PRIu64 " (%.1f/s)\n", replies, replies / secs);
+	printf("Accepted   : %" PRIu64 "\n", accepted);
+	printf("Rejected   : %" PRIu64 "\n", rejected);
+	printf("Lost       : %" PRIu64 "\n", lost);
+	printf("Invalid    : %" PRIu64 "\n", invalid);
+	printf("\nLatency (microseconds, from when each packet was scheduled)\n\n");
+	hist_print(stdout, hist);
+
+	if (config->report_file) {
+		FILE *fp;
+
+		fp = fopen(config->report_file, "w");
+		if (!fp) {
+			fr_perror("radclient: Failed opening %s: %s", config->report_file, fr_syserror(errno));
+			ret = -1;
+			goto done;
+		}
+
+		fprintf(fp, "count.replies\t%" PRIu64 "\n", replies);
+		fprintf(fp, "count.accepted\t%" PRIu64 "\n", accepted);
+		fprintf(fp, "count.rejected\t%" PRIu64 "\n", rejected);
+		fprintf(fp, "count.lost\t%" PRIu64 "\n", lost);
+		fprintf(fp, "time.elapsed\t%.6f\n", secs);
+		fprintf(fp, "rate\t%.1f\n", replies / secs);
+		fprintf(fp, "latency.min\t%" PRIu64 "\n", hist->min);
+		fprintf(fp, "latency.p50\t%" PRIu64 "\n", fr_hist_percentile(hist, 50));
+		fprintf(fp, "latency.p90\t%" PRIu64 "\n", fr_hist_percentile(hist, 90));
+		fprintf(fp, "latency.p99\t%" PRIu64 "\n", fr_hist_percentile(hist, 99));
+		fprintf(fp, "latency.p999\t%" PRIu64 "\n", fr_hist_percentile(hist, 99.9));
+		fprintf(fp, "latency.max\t%" PRIu64 "\n", hist->max);
+		fclose(fp);
+	}
+
+	if ((lost > 0) || (replies < sent)) ret = -1;
+
+done:
+	for (i = 0; i < config->threads; i++) {
+		int j;
+
+		if (!threads[i] || !threads[i]->sockets) continue;
+
+		for (j = 0; j < threads[i]->num_sockets; j++) {
+			if (threads[i]->sockets[j].fd > 0) close(threads[i]->sockets[j].fd);
+		}
+	}
+	talloc_free(threads);
+
+	return ret;
+}
@@ -29,13 +29,16 @@
  */
 RCSID("$Id$")
 
+#include <freeradius-devel/io/ring_buffer.h>
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/dependency.h>
 #include <freeradius-devel/server/map_proc.h>
+#include <freeradius-devel/server/metrics.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/server/radmin.h>
 #include <freeradius-devel/server/state.h>
+#include <freeradius-devel/server/state_replicate.h>
 #include <freeradius-devel/server/virtual_servers.h>
 
 #include <freeradius-devel/tls/base.h>
@@ -43,7 +46,9 @@ RCSID("$Id$")
 
 #include <freeradius-devel/unlang/base.h>
 
+#include <freeradius-devel/util/allocator.h>
 #include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/resolve.h>
 #include <freeradius-devel/util/syserror.h>
 
 #include <ctype.h>
@@ -73,6 +78,11 @@ RCSID("$Id$")
 char const *radiusd_version = RADIUSD_VERSION_STRING_BUILD("FreeRADIUS");
 static pid_t radius_pid;
 
+static pid_t *process_pids;		//!< Server processes, indexed by process number.
+static fr_time_t *process_started;	//!< When each server process was forked.
+static uint32_t process_index;		//!< Which server process we are.
+static bool supervised;			//!< Whether we were forked by a supervisor.
+
 /*
  *  Configuration items.
  */
@@ -139,6 +149,221 @@ static void thread_detach(UNUSED void *uctx)
 	xlat_thread_detach();
 }
 
+/** Fork one server process
+ *
+ * @param[in] i		the process number.
+ * @return
+ *	- 0 in the child.
+ *	- 1 in the supervisor.
+ *	- -1 on error.
+ */
+static int supervise_fork(uint32_t i)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		ERROR("Couldn't fork server process %u: %s", i, fr_syserror(errno));
+		return -1;
+	}
+
+	if (pid == 0) {
+		process_index = i;
+		supervised = true;
+		return 0;
+	}
+
+	process_pids[i] = pid;
+	process_started[i] = fr_time();
+
+	return 1;
+}
+
+/** Send a signal to all running server processes
+ *
+ */
+static void supervise_kill(uint32_t num, int sig)
+{
+	uint32_t i;
+
+	for (i = 0; i < num; i++) {
+		if (process_pids[i] > 0) kill(process_pids[i], sig);
+	}
+}
+
+/** Fork the server processes, and supervise them until they all exit
+ *
+ * This is called after the configuration has been compiled, so that
+ * the dictionaries, policies and clients are shared with the server
+ * processes as copy on write pages.  Threads are started by each
+ * server process, as they don't survive fork().
+ *
+ * The supervisor passes SIGHUP on to the server processes, restarts
+ * any which exit unexpectedly, and stops them all on SIGTERM.
+ *
+ * @param[in] config		The main config.
+ * @param[in] parent_fd		to tell the daemonizing parent we've started, or -1.
+ * @param[out] ready_fd		in the server process, to tell the supervisor it has started.
+ * @param[out] exit_status	in the supervisor, what to exit with.
+ * @return
+ *	- 0 in a server process, which should continue starting up.
+ *	- 1 in the supervisor, once all server processes have exited.
+ */
+static int supervise(main_config_t const *config, int parent_fd, int *ready_fd, int *exit_status)
+{
+	uint32_t	i, num = config->num_processes, running = 0;
+	sigset_t	set, old;
+	int		ready[2], sig, stat_loc;
+	pid_t		pid;
+	bool		exiting = false;
+	uint8_t		c;
+
+	*exit_status = EXIT_SUCCESS;
+
+	/*
+	 *	Signals are handled synchronously with sigwait(),
+	 *	so that we don't need an event loop.  The server
+	 *	processes restore the original mask.
+	 */
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGINT);
+#ifdef SIGQUIT
+	sigaddset(&set, SIGQUIT);
+#endif
+	sigprocmask(SIG_BLOCK, &set, &old);
+
+	if (pipe(ready) != 0) {
+		ERROR("Couldn't open pipe for server process status: %s", fr_syserror(errno));
+		*exit_status = EXIT_FAILURE;
+		return 1;
+	}
+
+	MEM(process_pids = talloc_zero_array(NULL, pid_t, num));
+	MEM(process_started = talloc_zero_array(NULL, fr_time_t, num));
+
+	for (i = 0; i < num; i++) {
+		switch (supervise_fork(i)) {
+		case 0:
+			sigprocmask(SIG_SETMASK, &old, NULL);
+			close(ready[0]);
+			*ready_fd = ready[1];
+			return 0;
+
+		case 1:
+			running++;
+			continue;
+
+		default:
+			exiting = true;
+			*exit_status = EXIT_FAILURE;
+			supervise_kill(num, SIGTERM);
+			break;
+		}
+		break;
+	}
+	close(ready[1]);
+
+	/*
+	 *	Each server process writes one byte when it has
+	 *	started, and closes the pipe on error.
+	 */
+	if (!exiting) {
+		for (i = 0; i < num; i++) {
+			if (read(ready[0], &c, 1) != 1) break;
+		}
+
+		if (i < num) {
+			ERROR("Only %u of %u server processes started", i, num);
+			exiting = true;
+			*exit_status = EXIT_FAILURE;
+			supervise_kill(num, SIGTERM);
+		} else {
+			INFO("Started %u server processes", num);
+
+			if ((parent_fd >= 0) && (write(parent_fd, "\001", 1) < 0)) {
+				WARN("Failed informing parent of successful start: %s", fr_syserror(errno));
+			}
+		}
+	}
+	close(ready[0]);
+	if (parent_fd >= 0) close(parent_fd);
+
+	while (running > 0) {
+		if (sigwait(&set, &sig) != 0) continue;
+
+		switch (sig) {
+		case SIGHUP:
+			if (exiting) break;
+
+			INFO("Received HUP signal, passing it to the server processes");
+			supervise_kill(num, SIGHUP);
+			break;
+
+		case SIGCHLD:
+			while ((pid = waitpid(-1, &stat_loc, WNOHANG)) > 0) {
+				for (i = 0; i < num; i++) if (process_pids[i] == pid) break;
+				if (i == num) continue;
+
+				process_pids[i] = 0;
+				running--;
+
+				if (exiting) continue;
+
+				/*
+				 *	A process which dies straight
+				 *	away will keep on dying, so
+				 *	give up.
+				 */
+				if ((fr_time() - process_started[i]) < fr_time_delta_from_sec(1)) {
+					ERROR("Server process %u (pid %u) exited immediately, stopping the server",
+					      i, (unsigned int) pid);
+					exiting = true;
+					*exit_status = EXIT_FAILURE;
+					supervise_kill(num, SIGTERM);
+					continue;
+				}
+
+				WARN("Server process %u (pid %u) exited with status %i, restarting it",
+				     i, (unsigned int) pid, WIFEXITED(stat_loc) ? WEXITSTATUS(stat_loc) : -1);
+
+				switch (supervise_fork(i)) {
+				case 0:
+					sigprocmask(SIG_SETMASK, &old, NULL);
+					*ready_fd = -1;
+					return 0;
+
+				case 1:
+					running++;
+					break;
+
+				default:
+					exiting = true;
+					*exit_status = EXIT_FAILURE;
+					supervise_kill(num, SIGTERM);
+					break;
+				}
+			}
+			break;
+
+		default:
+			if (exiting) break;
+
+			INFO("Signalled to terminate, stopping the server processes");
+			exiting = true;
+			supervise_kill(num, SIGTERM);
+			break;
+		}
+	}
+
+	TALLOC_FREE(process_pids);
+	TALLOC_FREE(process_started);
+
+	return 1;
+}
+
 #define EXIT_WITH_FAILURE \
 do { \
 	ret = EXIT_FAILURE; \
@@ -754,6 +979,46 @@ int main(int argc, char *argv[])
 		goto cleanup;
 	}
 
+	/*
+	 *  Fork the server processes.  Everything from here on
+	 *  is done in each of them, and the supervisor only
+	 *  returns when they have all exited.
+	 */
+	if (config->num_processes > 1) {
+		int ready_fd = -1;
+
+		if (!config->spawn_workers) {
+			WARN("Ignoring 'num_processes' in single threaded mode");
+
+		} else {
+			/*
+			 *  Write the PID of the supervisor, so that
+			 *  signals are sent to it.
+			 */
+			if (config->write_pid) {
+				FILE *fp;
+
+				fp = fopen(config->pid_file, "w");
+				if (!fp) {
+					ERROR("Failed creating PID file %s: %s", config->pid_file, fr_syserror(errno));
+					EXIT_WITH_FAILURE;
+				}
+				fprintf(fp, "%d\n", (int) radius_pid);
+				fclose(fp);
+			}
+
+			if (supervise(config, config->daemonize ? from_child[1] : -1, &ready_fd, &ret) != 0) {
+				if (config->daemonize) unlink(config->pid_file);
+				main_config_exclusive_proc_done(main_config);
+				goto cleanup;
+			}
+
+			if (config->daemonize) close(from_child[1]);
+			from_child[1] = ready_fd;
+			radius_pid = getpid();
+		}
+	}
+
 	/*
 	 *	Initialise the SNMP stats structures
 	 */
@@ -779,6 +1044,43 @@ int main(int argc, char *argv[])
 	 */
 	if (log_global_init(&default_log, config->daemonize) < 0) EXIT_WITH_FAILURE;
 
+	/*
+	 *  Write log messages from a background thread, if asked.
+	 *  This has to be done post-fork, as threads don't survive
+	 *  fork().
+	 */
+	if (config->log_async && (fr_log_async_start(config->log_async_ring_size) < 0)) {
+		PERROR("Failed starting log writer");
+		EXIT_WITH_FAILURE;
+	}
+
+	/*
+	 *  Serve statistics over HTTP, if asked.  For the same
+	 *  reason, this has to be done post-fork.
+	 */
+	if (config->metrics_port && (process_index == 0) && (fr_metrics_start(&config->metrics_ipaddr, config->metrics_port) < 0)) {
+		PERROR("Failed starting metrics listener");
+		EXIT_WITH_FAILURE;
+	}
+
+	/*
+	 *  Fork trigger programs from a dedicated thread, so
+	 *  workers don't have to.
+	 */
+	if (trigger_enabled() && (trigger_executor_start() < 0)) {
+		PERROR("Failed starting trigger executor");
+		EXIT_WITH_FAILURE;
+	}
+
+	/*
+	 *  Send and receive replicated sessions.  The port can
+	 *  only be bound once, so other server processes don't.
+	 */
+	if ((process_index == 0) && (fr_state_replicate_start() < 0)) {
+		PERROR("Failed starting session replication");
+		EXIT_WITH_FAILURE;
+	}
+
 	/*
 	 *	Start the network / worker threads.
 	 */
@@ -786,14 +1088,46 @@ int main(int argc, char *argv[])
 		fr_event_list_t *el = NULL;
 		fr_schedule_config_t *schedule;
 
+		/*
+		 *	Tune malloc before the workers start
+		 *	allocating from it.
+		 */
+		DEBUG("Using the %s memory allocator", fr_allocator_name(fr_allocator_type()));
+		if (fr_allocator_init(&(fr_allocator_conf_t){ .arenas = config->malloc_arenas }) < 0) {
+			PWARN("Ignoring 'thread pool { malloc_arenas = %u }'", config->malloc_arenas);
+		}
+
 		schedule = talloc_zero(global_ctx, fr_schedule_config_t);
 		schedule->max_workers = config->max_workers;
 		schedule->max_networks = config->max_networks;
 		schedule->stats_interval = config->stats_interval;
 
 		schedule->network.max_outstanding = config->max_requests;
+		schedule->network.worker_select = fr_table_value_by_str(fr_network_worker_select_table,
+									config->worker_select, FR_NETWORK_WORKER_SELECT_MAX);
+		if (schedule->network.worker_select == FR_NETWORK_WORKER_SELECT_MAX) {
+			ERROR("Invalid value '%s' for 'thread pool { worker_select = ... }'", config->worker_select);
+			EXIT_WITH_FAILURE;
+		}
 		schedule->worker.max_requests = config->max_requests;
 		schedule->worker.max_request_time = config->max_request_time;
+		schedule->worker.talloc_pool_size = config->talloc_pool_size;
+		schedule->worker.steal_requests = config->steal_requests;
+		schedule->numa = config->numa;
+		schedule->worker.spin_budget = config->spin_budget;
+		schedule->timer_resolution = config->timer_resolution;
+		schedule->worker.zero_copy = config->zero_copy;
+		schedule->worker.request_deadline = config->request_deadline;
+		schedule->worker.queue_watermark = config->queue_watermark;
+		schedule->worker.concurrency = config->concurrency;
+		schedule->worker.fair_queue = config->fair_queue;
+		schedule->worker.request_arena_size = config->request_arena_size;
+		schedule->worker.debug_sample_rate = config->debug_sample_rate;
+		schedule->worker.debug_sample_src = config->debug_sample_src;
+		schedule->worker.debug_sample_lvl = config->debug_sample_level;
+		schedule->worker.debug_sample_ring_size = config->debug_sample_ring_size;
+
+		fr_ring_buffer_memory_set(config->huge_pages, config->prefault);
 
 		/*
 		 *	Single server mode: use the global event list.
@@ -863,7 +1197,7 @@ int main(int argc, char *argv[])
 	/*
 	 *  Write the PID after we've forked, so that we write the correct one.
 	 */
-	if (config->write_pid) {
+	if (config->write_pid && !supervised) {
 		FILE *fp;
 
 		fp = fopen(config->pid_file, "w");
@@ -888,7 +1222,7 @@ int main(int argc, char *argv[])
 	 *  If we don't get this far, then we just close the pipe on exit, and the
 	 *  parent gets a read failure.
 	 */
-	if (config->daemonize) {
+	if (from_child[1] >= 0) {
 		if (write(from_child[1], "\001", 1) < 0) {
 			WARN("Failed informing parent of successful start: %s",
 			     fr_syserror(errno));
@@ -979,7 +1313,7 @@ int main(int argc, char *argv[])
 	 *  We're exiting, so we can delete the PID file.
 	 *  (If it doesn't exist, we can ignore the error returned by unlink)
 	 */
-	if (config->daemonize) unlink(config->pid_file);
+	if (config->daemonize && !supervised) unlink(config->pid_file);
 
 	/*
 	 *  Free memory in an explicit and consistent order
@@ -1015,9 +1349,11 @@ int main(int argc, char *argv[])
 	 *	to start.  We do this before the cleanup label
 	 *	as the parent process MUST NOT call this
 	 *	function as it exits, otherwise the semaphore
-	 *	is removed and there's no exclusivity.
+	 *	is removed and there's no exclusivity.  The
+	 *	same goes for server processes, the supervisor
+	 *	removes it.
 	 */
-	main_config_exclusive_proc_done(main_config);
+	if (!supervised) main_config_exclusive_proc_done(main_config);
 
 cleanup:
 	/*
@@ -1026,6 +1362,21 @@ cleanup:
 	 */
 	(void) fr_schedule_destroy(&sc);
 
+	/*
+	 *	Run any triggers which are still queued.
+	 */
+	trigger_executor_stop();
+
+	fr_state_replicate_stop();
+
+	fr_metrics_stop();
+
+	/*
+	 *	Write anything still queued, now that the
+	 *	threads producing log messages have exited.
+	 */
+	fr_log_async_stop();
+
 	/*
 	 *  Frees request specific logging resources which is OK
 	 *  because all the requests will have been stopped.
@@ -1036,6 +1387,11 @@ cleanup:
 
 	server_free();
 
+	/*
+	 *	Stop the resolver threads.
+	 */
+	fr_resolve_free();
+
 	/*
 	 *	Free any resources used by the unlang interpreter.
 	 */
@@ -30,6 +30,7 @@ RCSID("$Id$")
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/server/radmin.h>
 
+#include <freeradius-devel/util/allocator.h>
 #include <freeradius-devel/util/dict.h>
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/socket.h>
@@ -467,6 +468,22 @@ static int cmd_uptime(FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx, UNUSED fr
 
 static int cmd_stats_memory(FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
 {
+	/*
+	 *	The allocator keeps its own statistics, so
+	 *	these don't need talloc memory reporting.
+	 */
+	if (strcmp(info->argv[0], "allocator") == 0) {
+		fr_allocator_stats_t stats;
+
+		if (fr_allocator_stats(&stats) < 0) {
+			fprintf(fp_err, "%s\n", fr_strerror());
+			return -1;
+		}
+
+		fr_allocator_stats_print(fp, &stats);
+		return 0;
+	}
+
 	if (!radmin_main_config->talloc_memory_report) {
 		fprintf(fp, "Statistics are only available when the server is started with '-M'.\n");
 		return -1;
@@ -492,7 +509,7 @@ static int cmd_stats_memory(FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_inf
 	 *	Should never reach here.  The command parser will
 	 *	ensure that.
 	 */
-	fprintf(fp_err, "Must use 'stats memory (blocks|full|total)'\n");
+	fprintf(fp_err, "Must use 'stats memory (allocator|blocks|full|total)'\n");
 	return -1;
 }
 
@@ -986,7 +1003,7 @@ static fr_cmd_table_t cmd_table[] = {
 	{
 		.parent = "stats",
 		.name = "memory",
-		.syntax = "(blocks|full|total)",
+		.syntax = "(allocator|blocks|full|total)",
 		.func = cmd_stats_memory,
 		.help = "Show memory statistics.",
 		.read_only = true,
@@ -48,13 +48,21 @@ RCSID("$Id$")
 
 static rs_t *conf;
 static struct timeval start_pcap = {0, 0};
-static char timestr[50];
+static _Thread_local char timestr[50];
 
-static fr_rb_tree_t *request_tree = NULL;
-static fr_rb_tree_t *link_tree = NULL;
+/*
+ *	Each worker thread has its own trees.  Without workers,
+ *	the main thread uses them.
+ */
+static _Thread_local fr_rb_tree_t *request_tree = NULL;
+static _Thread_local fr_rb_tree_t *link_tree = NULL;
 static fr_event_list_t *events;
 static bool cleanup;
 
+static rs_worker_t *workers;			//!< Array of conf->workers worker threads.
+static pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;	//!< Serialises packet logging and pcap output.
+static _Atomic(uint64_t) captured;		//!< Packets processed, for the capture limit.
+
 static int self_pipe[2] = {-1, -1};		//!< Signals from sig handlers
 
 static char const *radsniff_version = RADIUSD_VERSION_STRING_BUILD("radsniff");
@@ -105,6 +113,9 @@ fr_dict_attr_autoload_t radsniff_dict_attr[] = {
 };
 
 static NEVER_RETURNS void usage(int status);
+static void rs_signal_self(int sig);
+static void rs_stats_merge_workers(rs_stats_t *stats, struct timeval *now);
+static void _unmark_request(void *request);
 
 /** Fork and kill the parent process, writing out our PID
  *
@@ -478,7 +489,10 @@ static inline void rs_packet_print(rs_request_t *request, uint64_t count, rs_sta
 	if (!conf->logger) return;
 
 	if (request) request->logged = true;
+
+	if (workers) pthread_mutex_lock(&output_mutex);
 	conf->logger(count, status, handle, packet, list, elapsed, latency, response, body);
+	if (workers) pthread_mutex_unlock(&output_mutex);
 }
 
 /** Query libpcap to see if it dropped any packets
@@ -803,6 +817,8 @@ static void rs_stats_process(fr_event_list_t *el, fr_time_t now_t, void *ctx)
 
 	stats->intervals++;
 
+	if (workers) rs_stats_merge_workers(stats, &now);
+
 	for (in_p = this->in;
 	     in_p;
 	     in_p = in_p->next) {
@@ -1097,6 +1113,8 @@ static inline int rs_response_to_pcap(rs_event_t *event, rs_request_t *request,
 {
 	if (!event->out) return 0;
 
+	if (workers) pthread_mutex_lock(&output_mutex);
+
 	/*
 	 *	If we're filtering by response then the requests then the capture buffer
 	 *	associated with the request should contain buffered request packets.
@@ -1139,6 +1157,8 @@ static inline int rs_response_to_pcap(rs_event_t *event, rs_request_t *request,
 	 */
 	pcap_dump((void *)event->out->dumper, header, data);
 
+	if (workers) pthread_mutex_unlock(&output_mutex);
+
 	return 0;
 }
 
@@ -1174,7 +1194,9 @@ static inline int rs_request_to_pcap(rs_event_t *event, rs_request_t *request, s
 		return 0;
 	}
 
+	if (workers) pthread_mutex_lock(&output_mutex);
 	pcap_dump((void *)event->out->dumper, header, data);
+	if (workers) pthread_mutex_unlock(&output_mutex);
 
 	return 0;
 }
@@ -1221,7 +1243,6 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	bool			response;		/* Was it a response code */
 
 	decode_fail_t		reason;			/* Why we failed decoding the packet */
-	static uint64_t		captured = 0;
 
 	rs_status_t		status = RS_NORMAL;	/* Any special conditions (RTX, Unlinked, ID-Reused) */
 	fr_radius_packet_t	*packet;		/* Current packet were processing */
@@ -1332,7 +1353,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	 *	recover once some requests timeout, so make an effort to deal
 	 *	with allocation failures gracefully.
 	 */
-	packet = fr_radius_packet_alloc(conf, false);
+	packet = fr_radius_packet_alloc(event->ctx, false);
 	if (!packet) {
 		REDEBUG("Failed allocating memory to hold decoded packet");
 		rs_tv_add_ms(&header->ts, conf->stats.timeout, &stats->quiet);
@@ -1689,7 +1710,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 *	...nope it's a new request.
 		 */
 		} else {
-			original = rs_request_alloc(conf);
+			original = rs_request_alloc(event->ctx);
 			original->id = count;
 			original->in = event->in;
 			original->stats_req = &stats->exchange[packet->code];
@@ -1845,13 +1866,363 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		fr_radius_packet_free(&packet);	/* Also frees decoded */
 	}
 
-	captured++;
 	/*
-	 *	We've hit our capture limit, break out of the event loop
+	 *	We've hit our capture limit, break out of the event loop.
+	 *	Workers can't touch the main event list, so they signal
+	 *	it instead.
 	 */
-	if ((conf->limit > 0) && (captured >= conf->limit)) {
-		INFO("Captured %" PRIu64 " packets, exiting...", captured);
-		fr_event_loop_exit(events, 1);
+	if ((conf->limit > 0) && ((atomic_fetch_add(&captured, 1) + 1) == conf->limit)) {
+		INFO("Captured %" PRIu64 " packets, exiting...", conf->limit);
+		if (workers) {
+			rs_signal_self(SIGTERM);
+		} else {
+			fr_event_loop_exit(events, 1);
+		}
+	}
+}
+
+/** Pick the worker for a frame
+ *
+ * The addresses, ports and RADIUS ID are hashed so that a request and
+ * its response go to the same worker.  Each endpoint is hashed
+ * separately, and the results are combined with XOR, so the direction
+ * of the packet doesn't matter.
+ *
+ * Frames which we can't parse go to the first worker, which will
+ * complain about them.
+ */
+static rs_worker_t *rs_worker_select(fr_pcap_t *in, struct pcap_pkthdr const *header, uint8_t const *data)
+{
+	uint8_t const		*p = data, *end = data + header->caplen;
+	uint8_t const		*src, *dst;
+	size_t			addr_len;
+	udp_header_t const	*udp;
+	ssize_t			len;
+	uint32_t		hash;
+
+	if (conf->workers == 1) return &workers[0];
+
+	len = fr_pcap_link_layer_offset(data, header->caplen, in->link_layer);
+	if ((len < 0) || ((p + len) >= end)) return &workers[0];
+	p += len;
+
+	switch ((p[0] & 0xf0) >> 4) {
+	case 4:
+	{
+		ip_header_t const *ip = (ip_header_t const *) p;
+
+		if ((p + sizeof(*ip)) > end) return &workers[0];
+
+		src = (uint8_t const *) &ip->ip_src;
+		dst = (uint8_t const *) &ip->ip_dst;
+		addr_len = sizeof(ip->ip_src);
+		p += (0x0f & ip->ip_vhl) * 4;
+	}
+		break;
+
+	case 6:
+	{
+		ip_header6_t const *ip6 = (ip_header6_t const *) p;
+
+		if ((p + sizeof(*ip6)) > end) return &workers[0];
+
+		src = ip6->ip_src.s6_addr;
+		dst = ip6->ip_dst.s6_addr;
+		addr_len = sizeof(ip6->ip_src.s6_addr);
+		p += sizeof(*ip6);
+	}
+		break;
+
+	default:
+		return &workers[0];
+	}
+
+	/*
+	 *	UDP header, then the RADIUS code and ID.
+	 */
+	if ((p + sizeof(udp_header_t) + 2) > end) return &workers[0];
+	udp = (udp_header_t const *) p;
+
+	hash = fr_hash_update(&udp->src, sizeof(udp->src), fr_hash(src, addr_len)) ^
+	       fr_hash_update(&udp->dst, sizeof(udp->dst), fr_hash(dst, addr_len));
+	hash = fr_hash_update(p + sizeof(udp_header_t) + 1, 1, hash);
+
+	return &workers[hash % conf->workers];
+}
+
+/** Copy a frame into a worker's ring
+ *
+ * If the worker has fallen behind, the frame is dropped, and counted
+ * so that the stats can be muted, as with libpcap drops.
+ */
+static void rs_worker_queue(rs_worker_t *worker, uint64_t count, fr_pcap_t *in,
+			    struct pcap_pkthdr const *header, uint8_t const *data)
+{
+	uint64_t	head = atomic_load_explicit(&worker->head, memory_order_relaxed);
+	rs_slot_t	*slot;
+
+	if ((head - atomic_load_explicit(&worker->tail, memory_order_acquire)) >= RS_WORKER_RING_SIZE) {
+		worker->dropped++;
+		return;
+	}
+
+	slot = &worker->slots[head & (RS_WORKER_RING_SIZE - 1)];
+	slot->count = count;
+	slot->in = in;
+	slot->header = *header;
+	if (slot->header.caplen > sizeof(slot->data)) slot->header.caplen = sizeof(slot->data);
+	memcpy(slot->data, data, slot->header.caplen);
+
+	atomic_store_explicit(&worker->head, head + 1, memory_order_release);
+	worker->pending = true;
+}
+
+/** Wake the workers which have had frames queued since they were last woken
+ *
+ */
+static void rs_workers_wake(void)
+{
+	int i;
+
+	for (i = 0; i < conf->workers; i++) {
+		uint8_t c = 0;
+
+		if (!workers[i].pending) continue;
+		workers[i].pending = false;
+
+		/*
+		 *	If the pipe is full, the worker has plenty of
+		 *	wakeups already.
+		 */
+		if ((write(workers[i].wake[1], &c, sizeof(c)) < 0) && (errno != EAGAIN)) {
+			ERROR("Failed waking worker %i: %s", i, fr_syserror(errno));
+		}
+	}
+}
+
+/** Process all of the frames in a worker's ring
+ *
+ */
+static void rs_worker_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	rs_worker_t	*worker = uctx;
+	uint8_t		buffer[64];
+	uint64_t	head, tail;
+
+	while (read(fd, buffer, sizeof(buffer)) > 0);
+
+	tail = atomic_load_explicit(&worker->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&worker->head, memory_order_acquire);
+
+	while (tail != head) {
+		rs_slot_t *slot = &worker->slots[tail & (RS_WORKER_RING_SIZE - 1)];
+
+		worker->event->in = slot->in;
+		rs_packet_process(slot->count, worker->event, &slot->header, slot->data);
+
+		/*
+		 *	Give the slot back as soon as possible, so the
+		 *	capture thread doesn't drop frames.
+		 */
+		atomic_store_explicit(&worker->tail, ++tail, memory_order_release);
+		if (tail == head) head = atomic_load_explicit(&worker->head, memory_order_acquire);
+	}
+}
+
+static void *rs_worker_thread(void *arg)
+{
+	rs_worker_t	*worker = arg;
+	sigset_t	sigset;
+
+	/*
+	 *	Signals are handled by the main thread.
+	 */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+	request_tree = fr_rb_inline_talloc_alloc(worker->ctx, rs_request_t, request_node,
+						 rs_packet_cmp, _unmark_request);
+	if (!request_tree) {
+		ERROR("Worker %i failed creating request tree", worker->id);
+		return NULL;
+	}
+
+	/*
+	 *	Take the lock whenever we're doing something, so
+	 *	that the stats thread sees consistent stats.
+	 */
+	while (!atomic_load(&worker->stop)) {
+		if (fr_event_corral(worker->el, fr_time(), true) < 0) break;
+
+		pthread_mutex_lock(&worker->mutex);
+		fr_event_service(worker->el);
+		pthread_mutex_unlock(&worker->mutex);
+	}
+
+	/*
+	 *	Outstanding requests are freed silently, as
+	 *	"cleanup" is set.
+	 */
+	talloc_free(worker->ctx);
+
+	return NULL;
+}
+
+/** Start the worker threads
+ *
+ * Must be called after daemonizing, as threads don't survive fork().
+ */
+static int rs_workers_start(fr_pcap_t *out)
+{
+	int i;
+
+	workers = talloc_zero_array(conf, rs_worker_t, conf->workers);
+	if (!workers) {
+		ERROR("Out of memory");
+		return -1;
+	}
+
+	for (i = 0; i < conf->workers; i++) workers[i].wake[0] = workers[i].wake[1] = -1;
+
+	for (i = 0; i < conf->workers; i++) {
+		rs_worker_t *worker = &workers[i];
+
+		worker->id = i;
+
+		/*
+		 *	Not parented, as talloc isn't thread safe.
+		 */
+		worker->ctx = talloc_init_const("radsniff worker");
+		worker->stats = talloc_zero(worker->ctx, rs_stats_t);
+		worker->slots = talloc_array(worker->ctx, rs_slot_t, RS_WORKER_RING_SIZE);
+		worker->el = fr_event_list_alloc(worker->ctx, NULL, NULL);
+		worker->event = talloc_zero(worker->ctx, rs_event_t);
+		if (!worker->stats || !worker->slots || !worker->el || !worker->event) {
+			ERROR("Out of memory");
+			return -1;
+		}
+
+		worker->event->list = worker->el;
+		worker->event->ctx = worker->ctx;
+		worker->event->out = out;
+		worker->event->stats = worker->stats;
+
+		if (pipe(worker->wake) < 0) {
+			ERROR("Couldn't open worker pipe: %s", fr_syserror(errno));
+			return -1;
+		}
+		(void) fr_nonblock(worker->wake[0]);
+		(void) fr_nonblock(worker->wake[1]);
+
+		if (fr_event_fd_insert(NULL, worker->el, worker->wake[0], rs_worker_read, NULL, NULL, worker) < 0) {
+			fr_perror("Failed inserting worker pipe descriptor");
+			return -1;
+		}
+
+		pthread_mutex_init(&worker->mutex, NULL);
+
+		if (pthread_create(&worker->thread, NULL, rs_worker_thread, worker) != 0) {
+			ERROR("Failed creating worker thread: %s", fr_syserror(errno));
+			pthread_mutex_destroy(&worker->mutex);
+			return -1;
+		}
+		worker->started = true;
+	}
+
+	return 0;
+}
+
+/** Stop the worker threads, and wait for them to exit
+ *
+ */
+static void rs_workers_stop(void)
+{
+	int i;
+
+	if (!workers) return;
+
+	for (i = 0; i < conf->workers; i++) {
+		rs_worker_t *worker = &workers[i];
+
+		/*
+		 *	The worker frees its own context.
+		 */
+		if (worker->started) {
+			uint8_t c = 0;
+
+			atomic_store(&worker->stop, true);
+			if (write(worker->wake[1], &c, sizeof(c)) < 0) {
+				ERROR("Failed stopping worker %i: %s", i, fr_syserror(errno));
+			}
+			pthread_join(worker->thread, NULL);
+			pthread_mutex_destroy(&worker->mutex);
+		} else {
+			talloc_free(worker->ctx);
+		}
+
+		if (worker->wake[0] >= 0) close(worker->wake[0]);
+		if (worker->wake[1] >= 0) close(worker->wake[1]);
+	}
+
+	TALLOC_FREE(workers);
+}
+
+/** Add the stats for one packet type from a worker
+ *
+ */
+static void rs_stats_merge_latency(rs_latency_t *to, rs_latency_t const *from)
+{
+	int i;
+
+	to->interval.received_total += from->interval.received_total;
+	to->interval.linked_total += from->interval.linked_total;
+	to->interval.unlinked_total += from->interval.unlinked_total;
+	to->interval.reused_total += from->interval.reused_total;
+	to->interval.lost_total += from->interval.lost_total;
+
+	for (i = 0; i <= RS_RETRANSMIT_MAX; i++) to->interval.rt_total[i] += from->interval.rt_total[i];
+
+	to->interval.latency_total += from->interval.latency_total;
+
+	if (from->interval.latency_high > to->interval.latency_high) {
+		to->interval.latency_high = from->interval.latency_high;
+	}
+	if (from->interval.latency_low &&
+	    (!to->interval.latency_low || (from->interval.latency_low < to->interval.latency_low))) {
+		to->interval.latency_low = from->interval.latency_low;
+	}
+}
+
+/** Move the interval stats from the workers into the main stats
+ *
+ */
+static void rs_stats_merge_workers(rs_stats_t *stats, struct timeval *now)
+{
+	size_t		i;
+	int		j;
+	uint64_t	dropped = 0;
+
+	for (j = 0; j < conf->workers; j++) {
+		rs_worker_t *worker = &workers[j];
+
+		pthread_mutex_lock(&worker->mutex);
+		for (i = 0; i < NUM_ELEMENTS(rs_useful_codes); i++) {
+			rs_latency_t *latency = &worker->stats->exchange[rs_useful_codes[i]];
+
+			rs_stats_merge_latency(&stats->exchange[rs_useful_codes[i]], latency);
+			memset(&latency->interval, 0, sizeof(latency->interval));
+		}
+		if (timercmp(&worker->stats->quiet, &stats->quiet, >)) stats->quiet = worker->stats->quiet;
+		pthread_mutex_unlock(&worker->mutex);
+
+		dropped += worker->dropped;
+		worker->dropped = 0;
+	}
+
+	if (dropped) {
+		ERROR("Dropped %" PRIu64 " packets: Worker queues full", dropped);
+		ERROR("Muting stats for the next %i milliseconds", conf->stats.timeout);
+		rs_tv_add_ms(now, conf->stats.timeout, &stats->quiet);
 	}
 }
 
@@ -1936,16 +2307,30 @@ static void rs_got_packet(fr_event_list_t *el, int fd, UNUSED int flags, void *c
 		ret = pcap_next_ex(handle, &header, &data);
 		if (ret == 0) {
 			/* No more packets available at this time */
-			return;
+			break;
 		}
 		if (ret < 0) {
 			ERROR("Error requesting next packet, got (%i): %s", ret, pcap_geterr(handle));
-			return;
+			break;
 		}
 
 		count++;
+
+		/*
+		 *	Hand the packet off to a worker, and wake
+		 *	them all at the end of the batch.
+		 */
+		if (workers) {
+			if (!start_pcap.tv_sec) start_pcap = header->ts;
+
+			rs_worker_queue(rs_worker_select(event->in, header, data), count, event->in, header, data);
+			continue;
+		}
+
 		rs_packet_process(count, event, header, data);
 	}
+
+	if (workers) rs_workers_wake();
 }
 
 static int  _rs_event_status(fr_time_delta_t wake_t, UNUSED void *uctx)
@@ -2215,6 +2600,7 @@ static NEVER_RETURNS void usage(int status)
 	fprintf(output, "  -h                    This help message.\n");
 	fprintf(output, "  -i <interface>        Capture packets from interface (defaults to all if supported).\n");
 	fprintf(output, "  -I <file>             Read packets from <file>\n");
+	fprintf(output, "  -j <threads>          Decode packets in <threads> worker threads (live capture only).\n");
 	fprintf(output, "  -l <attr>[,<attr>]    Output packet sig and a list of attributes.\n");
 	fprintf(output, "  -L <attr>[,<attr>]    Detect retransmissions using these attributes to link requests.\n");
 	fprintf(output, "  -m                    Don't put interface(s) into promiscuous mode.\n");
@@ -2311,7 +2697,7 @@ int main(int argc, char *argv[])
 	/*
 	 *  Get options
 	 */
-	while ((c = getopt(argc, argv, "ab:c:C:d:D:e:Ef:hi:I:l:L:mp:P:qr:R:s:Svw:xXW:T:P:N:O:")) != -1) {
+	while ((c = getopt(argc, argv, "ab:c:C:d:D:e:Ef:hi:I:j:l:L:mp:P:qr:R:s:Svw:xXW:T:P:N:O:")) != -1) {
 		switch (c) {
 		case 'a':
 		{
@@ -2405,6 +2791,14 @@ int main(int argc, char *argv[])
 			conf->from_file = true;
 			break;
 
+		case 'j':
+			conf->workers = atoi(optarg);
+			if ((conf->workers < 1) || (conf->workers > RS_MAX_WORKERS)) {
+				ERROR("Number of worker threads must be between 1 and %i", RS_MAX_WORKERS);
+				usage(64);
+			}
+			break;
+
 		case 'l':
 			conf->list_attributes = optarg;
 			break;
@@ -2548,6 +2942,26 @@ int main(int argc, char *argv[])
 		conf->from_stdin = false;
 	}
 
+	/*
+	 *	Files are processed as fast as we can read them, and
+	 *	drive the event loop with the packet timestamps, so
+	 *	there's nothing for workers to do.
+	 */
+	if (conf->workers && (conf->from_file || conf->from_stdin)) {
+		INFO("Ignoring -j, worker threads are only used for live capture");
+		conf->workers = 0;
+	}
+
+	/*
+	 *	Linked requests (e.g. proxied ones) have different
+	 *	addresses and IDs, so they may be seen by different
+	 *	workers.
+	 */
+	if ((conf->workers > 1) && conf->link_attributes) {
+		ERROR("Linking requests with -L requires a single worker thread");
+		usage(64);
+	}
+
 	/* Writing to file overrides stdout */
 	if (conf->to_file && conf->to_stdout) {
 		conf->to_stdout = false;
@@ -2981,6 +3395,7 @@ int main(int argc, char *argv[])
 
 			event = talloc_zero(events, rs_event_t);
 			event->list = events;
+			event->ctx = conf;
 			event->in = in_p;
 			event->out = out;
 			event->stats = stats;
@@ -3032,6 +3447,18 @@ int main(int argc, char *argv[])
 #ifdef SIGQUIT
 	fr_set_signal(SIGQUIT, rs_signal_self);
 #endif
+	/*
+	 *	Threads don't survive daemonizing, so start them as
+	 *	late as possible.
+	 */
+	if (conf->workers) {
+		DEBUG2("Starting %i worker threads", conf->workers);
+		if (rs_workers_start(out) < 0) {
+			ret = EXIT_FAILURE;
+			goto finish;
+		}
+	}
+
 	DEBUG2("Entering event loop");
 
 	fr_event_loop(events);	/* Enter the main event loop */
@@ -3041,6 +3468,8 @@ int main(int argc, char *argv[])
 finish:
 	cleanup = true;
 
+	rs_workers_stop();
+
 	if (conf->daemonize) unlink(conf->pidfile);
 
 	/*
@@ -28,6 +28,13 @@
 RCSIDH(radsniff_h, "$Id$")
 
 #include <sys/types.h>
+#include <pthread.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
 
 #include <freeradius-devel/util/base.h>
 #include <freeradius-devel/util/pcap.h>
@@ -45,6 +52,9 @@ RCSIDH(radsniff_h, "$Id$")
 #define RS_RETRANSMIT_MAX	5		//!< Maximum number of times we expect to see a packet retransmitted
 #define RS_MAX_ATTRS		50		//!< Maximum number of attributes we can filter on.
 #define RS_SOCKET_REOPEN_DELAY  5000		//!< How long we delay re-opening a collectd socket.
+#define RS_MAX_WORKERS		64		//!< Maximum number of worker threads.
+#define RS_WORKER_RING_SIZE	4096		//!< Packets which can be queued for each worker.  Must be a power of 2.
+#define RS_WORKER_SLOT_SIZE	(RADIUS_MAX_PACKET_SIZE + 256)	//!< Largest frame we copy to a worker.
 
 /*
  *	Logging macros
@@ -224,6 +234,7 @@ typedef struct {
  */
 typedef struct {
 	fr_event_list_t		*list;			//!< The event list.
+	TALLOC_CTX		*ctx;			//!< Where requests and packets are allocated.
 
 	fr_pcap_t		*in;			//!< PCAP handle event occurred on.
 	fr_pcap_t		*out;			//!< Where to write output.
@@ -231,6 +242,48 @@ typedef struct {
 	rs_stats_t		*stats;			//!< Where to write stats.
 } rs_event_t;
 
+/** A captured frame, queued for a worker
+ *
+ */
+typedef struct {
+	uint64_t		count;			//!< Packet counter from the capture thread.
+	fr_pcap_t		*in;			//!< PCAP handle the frame was received on.
+	struct pcap_pkthdr	header;			//!< PCAP packet header, caplen is truncated to the slot.
+	uint8_t			data[RS_WORKER_SLOT_SIZE];	//!< PCAP packet data.
+} rs_slot_t;
+
+/** A thread which decodes packets and links requests with responses
+ *
+ * The capture thread sends each frame to a worker by hashing the
+ * addresses, ports and RADIUS ID.  The hash is the same for a request
+ * and its response, so each worker can keep its own request tree
+ * without locking.
+ *
+ * The ring has a single producer (the capture thread) and a single
+ * consumer (the worker).
+ */
+typedef struct {
+	int			id;			//!< Worker number, for debugging.
+	pthread_t		thread;
+	bool			started;		//!< Whether the thread was created.
+	TALLOC_CTX		*ctx;			//!< Only used by the worker thread.
+	fr_event_list_t		*el;			//!< For request timeouts.
+	rs_event_t		*event;			//!< Passed to rs_packet_process().
+
+	pthread_mutex_t		mutex;			//!< Held by the worker while it's processing packets.
+							///< The stats thread takes it to merge the stats.
+	rs_stats_t		*stats;			//!< Stats for the packets this worker processed.
+
+	int			wake[2];		//!< Pipe used to wake the worker.
+	bool			pending;		//!< Capture thread has queued packets since the last wakeup.
+	atomic_bool		stop;			//!< Tell the worker to exit.
+
+	_Atomic(uint64_t)	head;			//!< Next slot to write.  Only written by the capture thread.
+	_Atomic(uint64_t)	tail;			//!< Next slot to read.  Only written by the worker.
+	uint64_t		dropped;		//!< Frames dropped because the ring was full.
+	rs_slot_t		*slots;
+} rs_worker_t;
+
 typedef struct rs_update rs_update_t;
 
 /** Callback for printing stats header.
@@ -301,6 +354,7 @@ struct rs {
 	rs_packet_logger_t	logger;			//!< Packet logger
 
 	int			buffer_pkts;		//!< Size of the ring buffer to setup for live capture.
+	int			workers;		//!< Number of threads decoding packets, 0 for none.
 	uint64_t		limit;			//!< Maximum number of packets to capture
 
 	struct {
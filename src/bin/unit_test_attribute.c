@@ -247,6 +247,7 @@ static xlat_action_t xlat_test(UNUSED TALLOC_CTX *ctx, UNUSED fr_dcursor_t *out,
 }
 
 static char		proto_name_prev[128];
+static unsigned int	bench_reps;		//!< Repeat encode-proto and decode-proto, and print timings.
 static dl_t		*dl;
 static dl_loader_t	*dl_loader;
 
@@ -1373,6 +1374,50 @@ static size_t command_decode_pair(command_result_t *result, command_file_ctx_t *
 	RETURN_OK(p - data);
 }
 
+/** Print the results of benchmarking one encode-proto or decode-proto command
+ *
+ * Lines are "name<TAB>value", as used by src/tests/performance/bench.
+ * "blocks_per_op" is the number of talloc blocks which the codec leaves
+ * allocated after each call, which for decoders includes the pairs.
+ * Allocations which the codec frees before returning are not counted.
+ */
+static void bench_print(command_file_ctx_t *cc, char const *op, fr_time_delta_t elapsed, size_t blocks)
+{
+	char const *file = strrchr(cc->filename, '/');
+
+	file = file ? file + 1 : cc->filename;
+
+	printf("codec.%s.%s.%s:%u.ns_per_op\t%.1f\n", proto_name_prev, op, file, cc->lineno,
+	       (double) elapsed / bench_reps);
+	printf("codec.%s.%s.%s:%u.blocks_per_op\t%zu\n", proto_name_prev, op, file, cc->lineno, blocks);
+}
+
+/** Decode a packet bench_reps times
+ *
+ * The time includes freeing the decoded pairs, as the server has to
+ * do that for every request.
+ */
+static void bench_decode_proto(command_file_ctx_t *cc, fr_test_point_proto_decode_t *tp,
+			       uint8_t const *data, size_t data_len, void *decode_ctx)
+{
+	TALLOC_CTX	*bench_ctx = talloc_new(cc->tmp_ctx);
+	fr_pair_list_t	head;
+	size_t		blocks = 0;
+	unsigned int	i;
+	fr_time_t	start;
+
+	start = fr_time();
+	for (i = 0; i < bench_reps; i++) {
+		fr_pair_list_init(&head);
+		(void) tp->func(bench_ctx, &head, data, data_len, decode_ctx);
+		if (i == 0) blocks = talloc_total_blocks(bench_ctx) - 1;
+		talloc_free_children(bench_ctx);
+	}
+	bench_print(cc, "decode", fr_time() - start, blocks);
+
+	talloc_free(bench_ctx);
+}
+
 static size_t command_decode_proto(command_result_t *result, command_file_ctx_t *cc,
 				  char *data, size_t data_used, char *in, size_t inlen)
 {
@@ -1442,6 +1487,8 @@ static size_t command_decode_proto(command_result_t *result, command_file_ctx_t
 	fr_strerror_clear();
 	ASAN_UNPOISON_MEMORY_REGION(to_dec_end, COMMAND_OUTPUT_MAX - slen);
 
+	if (bench_reps) bench_decode_proto(cc, tp, to_dec, to_dec_end - to_dec, decode_ctx);
+
 	/*
 	 *	Output may be an error, and we ignore
 	 *	it if so.
@@ -1764,6 +1811,33 @@ static size_t command_returned(command_result_t *result, command_file_ctx_t *cc,
 	RETURN_OK(snprintf(data, COMMAND_OUTPUT_MAX, "%zd", cc->last_ret));
 }
 
+/** Encode a list of pairs bench_reps times
+ *
+ * Encodes into a separate buffer, so the output of the command isn't
+ * changed by encoders which add random data.
+ */
+static void bench_encode_proto(command_file_ctx_t *cc, fr_test_point_proto_encode_t *tp,
+			       fr_pair_list_t *head, void *encode_ctx)
+{
+	TALLOC_CTX	*bench_ctx = talloc_new(cc->tmp_ctx);
+	size_t		len = cc->buffer_end - cc->buffer_start;
+	uint8_t		*buffer = talloc_array(cc->tmp_ctx, uint8_t, len);
+	size_t		blocks = 0;
+	unsigned int	i;
+	fr_time_t	start;
+
+	start = fr_time();
+	for (i = 0; i < bench_reps; i++) {
+		(void) tp->func(bench_ctx, head, buffer, len, encode_ctx);
+		if (i == 0) blocks = talloc_total_blocks(bench_ctx) - 1;
+		talloc_free_children(bench_ctx);
+	}
+	bench_print(cc, "encode", fr_time() - start, blocks);
+
+	talloc_free(bench_ctx);
+	talloc_free(buffer);
+}
+
 static size_t command_encode_proto(command_result_t *result, command_file_ctx_t *cc,
 				  char *data, UNUSED size_t data_used, char *in, size_t inlen)
 {
@@ -1798,12 +1872,15 @@ static size_t command_encode_proto(command_result_t *result, command_file_ctx_t
 	}
 
 	slen = tp->func(cc->tmp_ctx, &head, cc->buffer_start, cc->buffer_end - cc->buffer_start, encode_ctx);
-	fr_pair_list_free(&head);
 	cc->last_ret = slen;
 	if (slen < 0) {
+		fr_pair_list_free(&head);
 		CLEAR_TEST_POINT(cc);
 		RETURN_OK_WITH_ERROR();
 	}
+
+	if (bench_reps) bench_encode_proto(cc, tp, &head, encode_ctx);
+	fr_pair_list_free(&head);
 	/*
 	 *	Clear any spurious errors
 	 */
@@ -2883,6 +2960,8 @@ static void usage(char const *name)
 {
 	INFO("usage: %s [options] (-|<filename>[:<lines>] [ <filename>[:<lines>]])", name);
 	INFO("options:");
+	INFO("  -B <reps>          Run each encode-proto and decode-proto command <reps> times, and");
+	INFO("                     print the time per call, and the talloc blocks allocated per call.");
 	INFO("  -d <raddb>         Set user dictionary path (defaults to " RADDBDIR ").");
 	INFO("  -D <dictdir>       Set main dictionary path (defaults to " DICTDIR ").");
 	INFO("  -x                 Debugging mode.");
@@ -3070,7 +3149,11 @@ int main(int argc, char *argv[])
 	default_log.fd = STDOUT_FILENO;
 	default_log.print_level = false;
 
-	while ((c = getopt(argc, argv, "cd:D:fxMhr:")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "B:cd:D:fxMhr:")) != -1) switch (c) {
+		case 'B':
+			bench_reps = strtoul(optarg, NULL, 10);
+			break;
+
 		case 'c':
 			do_commands = true;
 			break;
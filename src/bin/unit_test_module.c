@@ -459,6 +459,29 @@ static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, UNUSED void *proc_inst, U
 	return RLM_MODULE_FAIL;
 }
 
+/** Run a request, and print the memory it allocated if memory profiling is enabled
+ *
+ * The counts are net, i.e. allocations minus frees, of memory parented
+ * by the request.  Run with -x to see what each instruction allocated.
+ */
+static void request_run(request_t *request)
+{
+	size_t	blocks = 0, bytes = 0;
+
+	if (unlang_profile_memory) {
+		blocks = talloc_total_blocks(request);
+		bytes = talloc_total_size(request);
+	}
+
+	unlang_interpret_synchronous(request);
+
+	if (unlang_profile_memory) {
+		INFO("Request allocated %zd blocks, %zd bytes, and now holds %zu blocks, %zu bytes",
+		     (ssize_t) (talloc_total_blocks(request) - blocks), (ssize_t) (talloc_total_size(request) - bytes),
+		     talloc_total_blocks(request), talloc_total_size(request));
+	}
+}
+
 static request_t *request_clone(request_t *old)
 {
 	request_t *request;
@@ -563,8 +586,13 @@ int main(int argc, char *argv[])
 	default_log.print_level = true;
 
 	/*  Process the options.  */
-	while ((c = getopt(argc, argv, "c:d:D:f:hi:mMn:o:O:p:r:xXz")) != -1) {
+	while ((c = getopt(argc, argv, "Ac:d:D:f:hi:mMn:o:O:p:r:xXz")) != -1) {
 		switch (c) {
+			case 'A':
+				unlang_profile = true;
+				unlang_profile_memory = true;
+				break;
+
 			case 'c':
 				count = atoi(optarg);
 				break;
@@ -886,7 +914,7 @@ int main(int argc, char *argv[])
 	}
 
 	if (count == 1) {
-		unlang_interpret_synchronous(request);
+		request_run(request);
 	} else {
 		int i;
 		request_t *old = request_clone(request);
@@ -894,7 +922,7 @@ int main(int argc, char *argv[])
 
 		for (i = 0; i < count; i++) {
 			request = request_clone(old);
-			unlang_interpret_synchronous(request);
+			request_run(request);
 			talloc_free(request);
 		}
 	}
@@ -1023,6 +1051,7 @@ static NEVER_RETURNS void usage(main_config_t const *config, int status)
 
 	fprintf(output, "Usage: %s [options]\n", config->name);
 	fprintf(output, "Options:\n");
+	fprintf(output, "  -A                 Print the talloc memory allocated by each request.\n");
 	fprintf(output, "  -c <count>         Run packets through the interpreter <count> times\n");
 	fprintf(output, "  -d <raddb_dir>     Configuration files are in \"raddb_dir/*\".\n");
 	fprintf(output, "  -D <dict_dir>      Dictionary files are in \"dict_dir/*\".\n");
@@ -90,17 +90,31 @@ typedef struct {
 	fr_event_timer_t const	*ev;			//!< Multi-Handle timer.
 	uint64_t		transfers;		//!< How many transfers are current in progress.
 	CURLM			*mandle;		//!< The multi handle.
+	CURLSH			*share;			//!< DNS and TLS session caches shared by all
+							///< easy handles using this multi handle.
 } fr_curl_handle_t;
 
+typedef struct fr_curl_io_request_s fr_curl_io_request_t;
+
+/** Called when a transfer which isn't associated with a request completes
+ *
+ * @param[in] randle	that completed.  randle->result contains the result
+ *			of the transfer.  May be freed by the callback.
+ */
+typedef void (*fr_curl_io_complete_t)(fr_curl_io_request_t *randle);
+
 /** Structure representing an individual request being passed to curl for processing
  *
  */
-typedef struct {
+struct fr_curl_io_request_s {
 	CURL			*candle;		//!< Request specific handle.
 	CURLcode		result;			//!< Result of executing the request.
 	request_t		        *request;		//!< Current request.
+	fr_curl_io_complete_t	complete;		//!< Called instead of resuming a request, for
+							///< transfers performed in the background.
 	void			*uctx;			//!< Private data for the module using the API.
-} fr_curl_io_request_t;
+	fr_dlist_t		entry;			//!< Entry in the module's list of idle handles.
+};
 
 typedef struct {
 	char const		*certificate_file;
@@ -121,6 +135,9 @@ extern CONF_PARSER	 fr_curl_tls_config[];
 int			fr_curl_io_request_enqueue(fr_curl_handle_t *mhandle,
 						   request_t *request, fr_curl_io_request_t *creq);
 
+int			fr_curl_io_background_enqueue(fr_curl_handle_t *mhandle, fr_curl_io_request_t *randle,
+						      fr_curl_io_complete_t complete);
+
 fr_curl_io_request_t	*fr_curl_io_request_alloc(TALLOC_CTX *ctx);
 
 fr_curl_handle_t	*fr_curl_io_init(TALLOC_CTX *ctx, fr_event_list_t *el, bool multiplex);
@@ -43,6 +43,14 @@ do {\
 	}\
 } while (0)
 
+#define SET_SHOPTION(_share, _opt, _val)\
+do {\
+	if ((shret = curl_share_setopt(_share, _opt, _val)) != CURLSHE_OK) {\
+		option = STRINGIFY(_val);\
+		goto share_error;\
+	}\
+} while (0)
+
 /** De-queue curl requests and wake up the requests that initiated them
  *
  * @param[in] mhandle	containing the event loop and request counter.
@@ -74,14 +82,14 @@ static inline void _fr_curl_io_demux(fr_curl_handle_t *mhandle, CURLM *mandle)
 			}
 			request = randle->request;
 
-			REQUEST_VERIFY(request);
+			if (request) REQUEST_VERIFY(request);
 
 			/*
 			 *	If the request failed, say why...
 			 */
 			if (m->data.result != CURLE_OK) {
-				REDEBUG("curl request failed: %s (%i)",
-					curl_easy_strerror(m->data.result), m->data.result);
+				ROPTIONAL(REDEBUG, ERROR, "curl request failed: %s (%i)",
+					  curl_easy_strerror(m->data.result), m->data.result);
 			}
 			randle->result = m->data.result;
 
@@ -91,6 +99,14 @@ static inline void _fr_curl_io_demux(fr_curl_handle_t *mhandle, CURLM *mandle)
 			 */
 			curl_multi_remove_handle(mandle, candle);
 
+			/*
+			 *	Background transfer, nothing to resume.
+			 */
+			if (!request) {
+				randle->complete(randle);
+				break;
+			}
+
 			unlang_interpret_mark_runnable(request);
 		}
 			break;
@@ -444,7 +460,8 @@ static int curl_debug_log(UNUSED CURL *candle, curl_infotype type, char *data, s
  * the numerous callbacks configured for the easy handle.
  *
  * @param[in] mhandle			Thread-specific mhandle wrapper.
- * @param[in] request			Current request.
+ * @param[in] request			Current request.  NULL for background transfers,
+ *					see #fr_curl_io_background_enqueue.
  * @param[in] randle			representing the request.
  * @return
  *	- 0 on success.
@@ -455,7 +472,7 @@ int fr_curl_io_request_enqueue(fr_curl_handle_t *mhandle, request_t *request, fr
 	CURLcode		ret;
 	CURLMcode		mret;
 
-	REQUEST_VERIFY(request);
+	if (request) REQUEST_VERIFY(request);
 
 	randle->request = request;
 
@@ -463,12 +480,24 @@ int fr_curl_io_request_enqueue(fr_curl_handle_t *mhandle, request_t *request, fr
 	 *	Set debugging functions so we can track the
 	 *	IO request's progress.
 	 */
-	if (RDEBUG_ENABLED3) {
+	if (request && RDEBUG_ENABLED3) {
 		FR_CURL_REQUEST_SET_OPTION(CURLOPT_DEBUGFUNCTION, curl_debug_log);
 		FR_CURL_REQUEST_SET_OPTION(CURLOPT_DEBUGDATA, request);
 		FR_CURL_REQUEST_SET_OPTION(CURLOPT_VERBOSE, 1L);
 	}
 
+	/*
+	 *	Share DNS results and TLS sessions with
+	 *	all other handles serviced by this thread.
+	 */
+	if (mhandle->share) {
+		ret = curl_easy_setopt(randle->candle, CURLOPT_SHARE, mhandle->share);
+		if (ret != CURLE_OK) {
+			ROPTIONAL(REDEBUG, ERROR, "Request failed: %i - %s", ret, curl_easy_strerror(ret));
+			return -1;
+		}
+	}
+
 	/*
 	 *	Stick the current request in the curl handle's
 	 *	private data.  This makes it simple to resume
@@ -476,7 +505,7 @@ int fr_curl_io_request_enqueue(fr_curl_handle_t *mhandle, request_t *request, fr
 	 */
 	ret = curl_easy_setopt(randle->candle, CURLOPT_PRIVATE, randle);
 	if (ret != CURLE_OK) {
-		REDEBUG("Request failed: %i - %s", ret, curl_easy_strerror(ret));
+		ROPTIONAL(REDEBUG, ERROR, "Request failed: %i - %s", ret, curl_easy_strerror(ret));
 		return -1;
 	}
 
@@ -489,7 +518,7 @@ int fr_curl_io_request_enqueue(fr_curl_handle_t *mhandle, request_t *request, fr
 	mret = curl_multi_add_handle(mhandle->mandle, randle->candle);
 	if (mret != CURLM_OK) {
 		mhandle->transfers--;
-		REDEBUG("Request failed: %i - %s", mret, curl_multi_strerror(mret));
+		ROPTIONAL(REDEBUG, ERROR, "Request failed: %i - %s", mret, curl_multi_strerror(mret));
 		return -1;
 	}
 
@@ -499,6 +528,26 @@ error:
 	return -1;
 }
 
+/** Sends a request to curl, which isn't associated with a request
+ *
+ * Used for transfers which should complete without delaying any request,
+ * such as refreshing cached data before it expires.
+ *
+ * @param[in] mhandle		Thread-specific mhandle wrapper.
+ * @param[in] randle		representing the transfer.
+ * @param[in] complete		Called when the transfer completes.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_curl_io_background_enqueue(fr_curl_handle_t *mhandle, fr_curl_io_request_t *randle,
+				  fr_curl_io_complete_t complete)
+{
+	randle->complete = complete;
+
+	return fr_curl_io_request_enqueue(mhandle, NULL, randle);
+}
+
 static int _fr_curl_io_request_free(fr_curl_io_request_t *randle)
 {
 	curl_easy_cleanup(randle->candle);
@@ -533,6 +582,7 @@ fr_curl_io_request_t *fr_curl_io_request_alloc(TALLOC_CTX *ctx)
 static int _mhandle_free(fr_curl_handle_t *mhandle)
 {
 	curl_multi_cleanup(mhandle->mandle);
+	if (mhandle->share) curl_share_cleanup(mhandle->share);
 
 	return 0;
 }
@@ -555,6 +605,7 @@ fr_curl_handle_t *fr_curl_io_init(TALLOC_CTX *ctx,
 				   bool multiplex)
 {
 	CURLMcode		ret;
+	CURLSHcode		shret;
 	CURLM			*mandle;
 	fr_curl_handle_t	*mhandle;
 	char const		*option = "unknown";
@@ -587,8 +638,32 @@ fr_curl_handle_t *fr_curl_io_init(TALLOC_CTX *ctx,
 	SET_MOPTION(mandle, CURLMOPT_PIPELINING, multiplex ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
 #endif
 
+	/*
+	 *	Connections are already cached by the multi handle,
+	 *	and any easy handle added to it may reuse them.
+	 *
+	 *	The share handle extends this to resolved addresses
+	 *	and TLS sessions, so new connections to the same
+	 *	server avoid a full handshake.  Only this thread
+	 *	uses the share handle, so no locking is needed.
+	 */
+	mhandle->share = curl_share_init();
+	if (!mhandle->share) {
+		ERROR("Curl share-handle instantiation failed");
+		talloc_free(mhandle);
+		return NULL;
+	}
+	SET_SHOPTION(mhandle->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	SET_SHOPTION(mhandle->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
 	return mhandle;
 
+share_error:
+	ERROR("Failed setting curl share option %s: %s (%i)", option, curl_share_strerror(shret), shret);
+	talloc_free(mhandle);
+
+	return NULL;
+
 error:
 	ERROR("Failed setting curl option %s: %s (%i)", option, curl_multi_strerror(ret), ret);
 
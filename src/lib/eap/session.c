@@ -22,16 +22,116 @@
  * @copyright 2019 The FreeRADIUS server project
  */
 #include <freeradius-devel/server/pair.h>
+#include <freeradius-devel/util/rand.h>
 #include <freeradius-devel/radius/radius.h>
 
 #include "attrs.h"
 #include "compose.h"
 #include "session.h"
 
+/** Per-worker table of parked EAP sessions
+ *
+ * Between rounds, only a #eap_session_handle_t is stored in the state tree.
+ * The eap_session_t itself, and everything hanging off it (TLS sessions,
+ * method state etc...) stays in the table of the worker which last ran it.
+ *
+ * The table is only ever accessed by its own worker, so it needs no locking.
+ * It relies on the network threads sending every round of a conversation to
+ * the same worker, i.e. `worker_select = affinity`.
+ */
+struct eap_session_table_s {
+	fr_rb_tree_t		*tree;			//!< Parked sessions, keyed by eap_session_t->id.
+	fr_dlist_head_t		expire;			//!< Parked sessions, oldest first.
+	fr_time_delta_t		timeout;		//!< How long a session may be parked for.
+};
+
+/** What's frozen in the state tree in place of a parked eap_session_t
+ *
+ */
+typedef struct {
+	uint64_t		id;			//!< Key of the session in the worker's table.
+} eap_session_handle_t;
+
+static int8_t eap_session_id_cmp(void const *one, void const *two)
+{
+	eap_session_t const *a = one, *b = two;
+
+	return CMP(a->id, b->id);
+}
+
+/** Remove a session from the table it's parked in
+ *
+ */
+static void eap_session_unpark(eap_session_t *eap_session)
+{
+	if (!eap_session->parked) return;
+
+	fr_rb_delete(eap_session->table->tree, eap_session);
+	fr_dlist_remove(&eap_session->table->expire, eap_session);
+	eap_session->parked = false;
+}
+
+/** Free sessions which have been parked for longer than the timeout
+ *
+ * Their handles are still in the state tree, and will fail to
+ * thaw if the supplicant ever sends another round.
+ */
+static void eap_session_table_expire(eap_session_table_t *table, fr_time_t now)
+{
+	eap_session_t *eap_session;
+
+	while ((eap_session = fr_dlist_head(&table->expire))) {
+		if ((eap_session->updated + table->timeout) > now) break;
+
+		DEBUG3("Expiring parked EAP session %016" PRIxPTR, (uintptr_t)eap_session);
+		talloc_free(eap_session);	/* Destructor unparks */
+	}
+}
+
+static int _eap_session_table_free(eap_session_table_t *table)
+{
+	eap_session_t *eap_session;
+
+	while ((eap_session = fr_dlist_head(&table->expire))) talloc_free(eap_session);
+
+	return 0;
+}
+
+/** Allocate a table to park EAP sessions in between rounds
+ *
+ * @param[in] ctx	to allocate the table in.  Should be thread specific.
+ * @param[in] timeout	How long a session may be parked for.  Should be
+ *			longer than the timeout of the state tree.
+ * @return
+ *	- A new table on success.
+ *	- NULL on failure.
+ */
+eap_session_table_t *eap_session_table_alloc(TALLOC_CTX *ctx, fr_time_delta_t timeout)
+{
+	eap_session_table_t *table;
+
+	table = talloc_zero(ctx, eap_session_table_t);
+	if (!table) return NULL;
+
+	table->tree = fr_rb_inline_talloc_alloc(table, eap_session_t, node, eap_session_id_cmp, NULL);
+	if (!table->tree) {
+		talloc_free(table);
+		return NULL;
+	}
+	fr_dlist_talloc_init(&table->expire, eap_session_t, entry);
+	table->timeout = timeout;
+
+	talloc_set_destructor(table, _eap_session_table_free);
+
+	return table;
+}
+
 static int _eap_session_free(eap_session_t *eap_session)
 {
 	request_t *request = eap_session->request;
 
+	eap_session_unpark(eap_session);
+
 	if (eap_session->identity) {
 		talloc_free(eap_session->identity);
 		eap_session->identity = NULL;
@@ -133,6 +233,68 @@ void eap_session_destroy(eap_session_t **eap_session)
 	TALLOC_FREE(*eap_session);
 }
 
+/** Park an #eap_session_t in its worker's table
+ *
+ * The eap_session_t is removed from the request data, and replaced
+ * with a small handle, which is all the state API has to store.
+ */
+static void eap_session_park(eap_session_t *eap_session)
+{
+	request_t		*request = eap_session->request;
+	eap_session_table_t	*table = eap_session->table;
+	eap_session_handle_t	*handle;
+
+	eap_session_table_expire(table, fr_time());
+
+	MEM(handle = talloc_zero(NULL, eap_session_handle_t));
+
+	(void) request_data_get(request, NULL, REQUEST_DATA_EAP_SESSION);
+
+	do {
+		eap_session->id = ((uint64_t) fr_rand() << 32) | fr_rand();
+	} while (!fr_rb_insert(table->tree, eap_session));
+	fr_dlist_insert_tail(&table->expire, eap_session);
+	eap_session->parked = true;
+
+	handle->id = eap_session->id;
+	request_data_talloc_add(request, NULL, REQUEST_DATA_EAP_SESSION_HANDLE, eap_session_handle_t,
+				handle, true, true, true);
+
+	RDEBUG4("Parked eap_session_t %p as %016" PRIx64, eap_session, eap_session->id);
+}
+
+/** Retrieve a parked #eap_session_t using the handle in the request data
+ *
+ * @return
+ *	- The eap_session_t, which is added back to the request data.
+ *	- NULL if there's no handle, or the session isn't in this worker's table.
+ */
+static eap_session_t *eap_session_retrieve(request_t *request, eap_session_table_t *table)
+{
+	eap_session_handle_t	*handle;
+	eap_session_t		find, *eap_session;
+
+	handle = request_data_get(request, NULL, REQUEST_DATA_EAP_SESSION_HANDLE);
+	if (!handle) return NULL;
+
+	find.id = handle->id;
+	talloc_free(handle);
+
+	eap_session = fr_rb_find(table->tree, &find);
+	if (!eap_session) {
+		RWDEBUG("EAP session %016" PRIx64 " is not parked in this worker.  It has either expired, "
+			"or the previous round was processed by a different worker", find.id);
+		RWDEBUG("Set 'worker_select = affinity' so every round is sent to the same worker");
+		return NULL;
+	}
+	eap_session_unpark(eap_session);
+
+	request_data_talloc_add(request, NULL, REQUEST_DATA_EAP_SESSION, eap_session_t,
+				eap_session, true, true, true);
+
+	return eap_session;
+}
+
 /** Freeze an #eap_session_t so that it can continue later
  *
  * Sets the request and pointer to the eap_session to NULL. Primarily here to help track
@@ -142,6 +304,9 @@ void eap_session_destroy(eap_session_t **eap_session)
  * rounds of EAP) of the #eap_session_t associated with REQUEST_DATA_EAP_SESSION, is
  * done by the state API.
  *
+ * If the #eap_session_t has a table, it's parked there instead, and only a handle
+ * is frozen by the state API.
+ *
  * @note must be called before mod_* functions in rlm_eap return.
  *
  * @see eap_session_continue
@@ -155,6 +320,7 @@ void eap_session_freeze(eap_session_t **eap_session)
 	if (!*eap_session) return;
 
 	fr_assert((*eap_session)->request);
+	if ((*eap_session)->table) eap_session_park(*eap_session);
 	(*eap_session)->request = NULL;
 	*eap_session = NULL;
 }
@@ -175,6 +341,7 @@ void eap_session_freeze(eap_session_t **eap_session)
  * @see eap_session_destroy
  *
  * @param request to retrieve session from.
+ * @param table	 the session may be parked in.  May be NULL.
  * @return
  *	- The #eap_session_t associated with this request.
  *	  MUST be freed with #eap_session_destroy if being disposed of, OR
@@ -182,11 +349,12 @@ void eap_session_freeze(eap_session_t **eap_session)
  *	  continue when a future request is received.
  *	- NULL if no #eap_session_t associated with this request.
  */
-eap_session_t *eap_session_thaw(request_t *request)
+eap_session_t *eap_session_thaw(request_t *request, eap_session_table_t *table)
 {
 	eap_session_t *eap_session;
 
 	eap_session = request_data_reference(request, NULL, REQUEST_DATA_EAP_SESSION);
+	if (!eap_session && table) eap_session = eap_session_retrieve(request, table);
 	if (!eap_session) return NULL;
 
 	if (!fr_cond_assert(eap_session->inst)) return NULL;
@@ -272,6 +440,9 @@ static char *eap_identity(request_t *request, eap_session_t *eap_session, eap_pa
  * @see eap_session_destroy
  *
  * @param[in] instance		of rlm_eap that created the session.
+ * @param[in] table		to park the session in between rounds.
+ *				May be NULL, in which case the whole
+ *				session is frozen by the state API.
  * @param[in] eap_packet_p	extracted from the RADIUS Access-Request.
  *      			Consumed or freed by this function.
  *				Do not access after calling this function.
@@ -285,7 +456,8 @@ static char *eap_identity(request_t *request, eap_session_t *eap_session, eap_pa
  *	  continue when a future request is received.
  *	- NULL on error.
  */
-eap_session_t *eap_session_continue(void const *instance, eap_packet_raw_t **eap_packet_p, request_t *request)
+eap_session_t *eap_session_continue(void const *instance, eap_session_table_t *table,
+				    eap_packet_raw_t **eap_packet_p, request_t *request)
 {
 	eap_session_t		*eap_session = NULL;
 	eap_packet_raw_t	*eap_packet;
@@ -303,7 +475,7 @@ eap_session_t *eap_session_continue(void const *instance, eap_packet_raw_t **eap
 	 *	This means that if there is no State attribute, we should
 	 *	consider this as the start of a new session.
 	 */
-	eap_session = eap_session_thaw(request);
+	eap_session = eap_session_thaw(request, table);
 	if (!eap_session) {
 		eap_session = eap_session_alloc(request);
 		if (!eap_session) {
@@ -314,6 +486,13 @@ eap_session_t *eap_session_continue(void const *instance, eap_packet_raw_t **eap
 		}
 		eap_session->inst = instance;
 
+		/*
+		 *	Only outer sessions are parked.  Tunneled
+		 *	sessions are frozen along with their parent's
+		 *	session-state.
+		 */
+		if (!request->parent) eap_session->table = table;
+
 		if (RDEBUG_ENABLED4) {
 			RDEBUG4("New EAP session - eap_session_t %p", eap_session);
 		} else {
@@ -25,15 +25,23 @@
 #include <freeradius-devel/server/request.h>
 #include <freeradius-devel/server/request_data.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/rb.h>
 
 #include "compose.h"
 #include "types.h"
 
 #define REQUEST_DATA_EAP_SESSION	 (1)
 #define REQUEST_DATA_EAP_SESSION_PROXIED (2)
+#define REQUEST_DATA_EAP_SESSION_HANDLE	 (3)
 
 typedef struct eap_session_s eap_session_t;
 
+/** Per-worker table of EAP sessions which are waiting for their next round
+ *
+ */
+typedef struct eap_session_table_s eap_session_table_t;
+
 /** Tracks the progress of a single session of any EAP method
  *
  */
@@ -67,17 +75,27 @@ struct eap_session_s {
 
 	fr_time_t	updated;			//!< The last time we received a packet for this EAP session.
 
+	eap_session_table_t *table;			//!< Table to park the session in between rounds.
+							///< NULL if the session is frozen in the state tree.
+	uint64_t	id;				//!< Key of the session in #table.
+	fr_rb_node_t	node;				//!< Entry in #table, whilst parked.
+	fr_dlist_t	entry;				//!< Entry in the expiry list of #table, whilst parked.
+	bool		parked;				//!< Whether the session is currently in #table.
+
 	bool		tls;				//!< Whether EAP method uses TLS.
 	bool		finished;			//!< Whether we consider this session complete.
 };
 
+eap_session_table_t *eap_session_table_alloc(TALLOC_CTX *ctx, fr_time_delta_t timeout);
+
 void		eap_session_destroy(eap_session_t **eap_session);
 
 void		eap_session_freeze(eap_session_t **eap_session);
 
-eap_session_t	*eap_session_thaw(request_t *request);
+eap_session_t	*eap_session_thaw(request_t *request, eap_session_table_t *table);
 
-eap_session_t 	*eap_session_continue(void const *instance, eap_packet_raw_t **eap_packet, request_t *request) CC_HINT(nonnull);
+eap_session_t 	*eap_session_continue(void const *instance, eap_session_table_t *table,
+				      eap_packet_raw_t **eap_packet, request_t *request) CC_HINT(nonnull(1,3,4));
 
 static inline eap_session_t *eap_session_get(request_t *request)
 {
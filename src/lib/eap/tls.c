@@ -1003,7 +1003,7 @@ unlang_action_t eap_tls_process(request_t *request, eap_session_t *eap_session)
 	 *	If the length included flag is set, we need to skip over the 4 byte
 	 *	message length field.
 	 *
-	 *	Next - Copy the fragment data into OpenSSL's dirty in buffer so that it
+	 *	Next - Copy the fragment data into OpenSSL's input BIO so that it
 	 *	can process it in a later call.
 	 */
 	case EAP_TLS_RECORD_RECV_FIRST:
@@ -1018,13 +1018,16 @@ unlang_action_t eap_tls_process(request_t *request, eap_session_t *eap_session)
 		}
 
 		/*
-		 *	Update the dirty_in buffer (data for reading by OpenSSL)
+		 *	Append the fragment to OpenSSL's input BIO.
 		 *
-		 *	This buffer will contain partial data when M bit is set, and should
-		 * 	should only be reinitialized when M bit is not set.
+		 *	The BIO is a chain of segments, so the record is
+		 *	reassembled there as fragments arrive, without
+		 *	being copied into dirty_in first, or reallocated.
+		 *	OpenSSL doesn't read from the BIO until the
+		 *	record is complete.
 		 */
-		if ((tls_session->record_from_buff)(&tls_session->dirty_in, data, data_len) != data_len) {
-			REDEBUG("Exceeded maximum record size");
+		if ((data_len > 0) && (BIO_write(tls_session->into_ssl, data, data_len) != (int)data_len)) {
+			REDEBUG("Failed buffering TLS record fragment");
 			eap_tls_session->state = EAP_TLS_FAIL;
 			goto done;
 		}
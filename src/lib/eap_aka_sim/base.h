@@ -166,6 +166,8 @@ typedef struct {
 				fr_aka_sim_vector_gsm_t	vector[3];	//!< GSM vectors.
 				uint32_t		num_vectors;	//!< Number of input vectors
 									//!< we're using (2 or 3).
+				uint32_t		num_pregenerated; //!< Vectors derived from Ki
+									//!< in a single batch.
 
 				uint8_t	nonce_mt[EAP_SIM_NONCE_MT_SIZE];//!< Nonce provided by the client.
 				uint8_t	version_list[FR_MAX_STRING_LEN];//!< Version list from negotiation.
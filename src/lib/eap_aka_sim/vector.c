@@ -75,6 +75,19 @@ static int vector_opc_from_op(request_t *request, uint8_t const **out, uint8_t o
 	return 1;
 }
 
+/** Fill a GSM RAND with random data
+ *
+ */
+static inline void vector_gsm_rand(uint8_t rand[AKA_SIM_VECTOR_GSM_RAND_SIZE])
+{
+	unsigned int i;
+
+	for (i = 0; i < AKA_SIM_VECTOR_GSM_RAND_SIZE; i += sizeof(uint32_t)) {
+		uint32_t r = fr_rand();
+		memcpy(&rand[i], &r, sizeof(r));
+	}
+}
+
 static int vector_gsm_from_ki(request_t *request, fr_pair_list_t *vps, int idx, fr_aka_sim_keys_t *keys)
 {
 	fr_pair_t	*ki_vp, *version_vp;
@@ -83,6 +96,12 @@ static int vector_gsm_from_ki(request_t *request, fr_pair_list_t *vps, int idx,
 	uint32_t	version;
 	unsigned int	i;
 
+	/*
+	 *	Already generated along with an earlier vector.
+	 */
+	if ((idx > 0) && ((uint32_t)idx < keys->gsm.num_pregenerated)) return 0;
+	keys->gsm.num_pregenerated = 0;
+
 	/*
 	 *	Generate a new RAND value, and derive Kc and SRES from Ki
 	 */
@@ -120,10 +139,7 @@ static int vector_gsm_from_ki(request_t *request, fr_pair_list_t *vps, int idx,
 		}
 	}
 
-	for (i = 0; i < AKA_SIM_VECTOR_GSM_RAND_SIZE; i += sizeof(uint32_t)) {
-		uint32_t rand = fr_rand();
-		memcpy(&keys->gsm.vector[idx].rand[i], &rand, sizeof(rand));
-	}
+	vector_gsm_rand(keys->gsm.vector[idx].rand);
 
 	switch (version) {
 	case FR_SIM_ALGO_VERSION_VALUE_COMP128_1:
@@ -147,15 +163,32 @@ static int vector_gsm_from_ki(request_t *request, fr_pair_list_t *vps, int idx,
 			   keys->gsm.vector[idx].rand, false);
 		break;
 
+	/*
+	 *	Milenage has to expand Ki into an AES key schedule
+	 *	for every call, so derive this triplet and all the
+	 *	ones after it at the same time.  Later calls for the
+	 *	other indexes return the pregenerated triplets.
+	 */
 	case FR_SIM_ALGO_VERSION_VALUE_COMP128_4:
-		if (milenage_gsm_generate(keys->gsm.vector[idx].sres,
-					  keys->gsm.vector[idx].kc,
-					  opc_p,
-					  ki_vp->vp_octets,
-					  keys->gsm.vector[idx].rand) < 0) {
+	{
+		milenage_gsm_vector_t	batch[NUM_ELEMENTS(keys->gsm.vector)];
+		size_t			num = NUM_ELEMENTS(batch) - idx;
+
+		memcpy(batch[0].rand, keys->gsm.vector[idx].rand, sizeof(batch[0].rand));
+		for (i = 1; i < num; i++) vector_gsm_rand(batch[i].rand);
+
+		if (milenage_gsm_generate_multi(batch, num, opc_p, ki_vp->vp_octets) < 0) {
 			RPEDEBUG2("Failed deriving GSM triplet");
 			return -1;
 		}
+
+		for (i = 0; i < num; i++) {
+			memcpy(keys->gsm.vector[idx + i].rand, batch[i].rand, sizeof(keys->gsm.vector[idx + i].rand));
+			memcpy(keys->gsm.vector[idx + i].sres, batch[i].sres, sizeof(keys->gsm.vector[idx + i].sres));
+			memcpy(keys->gsm.vector[idx + i].kc, batch[i].kc, sizeof(keys->gsm.vector[idx + i].kc));
+		}
+		keys->gsm.num_pregenerated = NUM_ELEMENTS(keys->gsm.vector);
+	}
 		break;
 
 	default:
@@ -66,11 +66,14 @@ typedef struct {
 
 	fr_io_track_create_t		track;		//!< create a tracking structure
 	fr_io_track_cmp_t		compare;	//!< compare two tracking structures
+	fr_io_track_hash_t		hash;		//!< hash a tracking structure.  If set, duplicate
+							///< detection uses a hash table instead of a tree.
 
 	fr_io_connection_set_t		connection_set;	//!< set src/dst IP/port of a connection
 	fr_io_network_get_t		network_get;	//!< get dynamic network information
 	fr_io_client_find_t		client_find;	//!< find radclient
 	fr_io_name_t			get_name;	//!< get the socket name
+	fr_io_affinity_t		affinity;	//!< hash the packet origin, for worker affinity
 
 	void				*private;	//!< any private APIs it needs to export.
 } fr_app_io_t;
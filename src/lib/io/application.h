@@ -81,6 +81,38 @@ typedef int (*fr_app_open_t)(void *instance, fr_schedule_t *sc, CONF_SECTION *cs
  */
 typedef int (*fr_app_priority_get_t)(void const *instance, uint8_t const *buffer, size_t buflen);
 
+/** Set the reply for a request which is refused because the server is overloaded
+ *
+ * Called by the worker instead of running the virtual server.  The
+ * request has been decoded, and the reply will be encoded as usual.
+ *
+ * @param[in] instance	of the #fr_app_t.
+ * @param[in] request	which is being refused.
+ * @return
+ *	- 0 the reply has been set, and should be sent.
+ *	- <0 no reply should be sent.
+ */
+typedef int (*fr_app_overload_t)(void const *instance, request_t *request);
+
+/** Reply to a packet from the network thread, without sending it to a worker
+ *
+ * Called by the network thread for each new packet from a defined
+ * client.  This is for packets which are cheap to answer, and which
+ * should be answered even when the workers are busy, e.g. Status-Server.
+ *
+ * @param[in] instance		of the #fr_app_t.
+ * @param[in] packet_ctx	the tracking context for the packet.
+ * @param[in] packet		raw packet.
+ * @param[in] packet_len	length of the packet.
+ * @param[out] buffer		where to write the reply.
+ * @param[in] buffer_len	length of the buffer.
+ * @return
+ *	- >0 the length of the reply, which is sent instead of processing the packet.
+ *	- 0 the packet should be processed as usual.
+ */
+typedef ssize_t (*fr_app_status_t)(void const *instance, void *packet_ctx, uint8_t *packet, size_t packet_len,
+				   uint8_t *buffer, size_t buffer_len);
+
 /** Called by the network thread to pass an event list for the module to use for timer events
  */
 typedef void (*fr_app_event_list_set_t)(fr_listen_t *li, fr_event_list_t *el, void *nr);
@@ -119,6 +151,13 @@ typedef struct {
 							///< to all #fr_app_io_t can be performed by the #fr_app_t.
 
 	fr_app_priority_get_t		priority;	//!< Assign a priority to the packet.
+
+	fr_app_overload_t		overload;	//!< Reply to a request which is refused because
+							///< we're overloaded.  May be NULL, in which case
+							///< no reply is sent.
+
+	fr_app_status_t			status;		//!< Reply to a packet from the network thread.
+							///< May be NULL.
 } fr_app_t;
 
 /** Public structure describing an application (protocol) specialisation
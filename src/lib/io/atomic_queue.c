@@ -20,6 +20,11 @@
  * @brief Thread-safe queues.
  * @file io/atomic_queue.c
  *
+ * The queues are bounded, and are safe for multiple producers and
+ * multiple consumers.  Each entry carries a sequence number, which
+ * says whether it is free, or holds data for the current lap of the
+ * queue.
+ *
  * @copyright 2016 Alan DeKok (aland@freeradius.org)
  * @copyright 2016 Alister Winfield
  */
@@ -260,6 +265,133 @@ bool fr_atomic_queue_pop(fr_atomic_queue_t *aq, void **p_data)
 	return true;
 }
 
+/** Push multiple pointers into the atomic queue
+ *
+ * A contiguous range of entries is claimed with one CAS, so this is
+ * cheaper than calling fr_atomic_queue_push() in a loop.  If there is
+ * room for only some of the pointers, only those are pushed.
+ *
+ * @param[in] aq	The atomic queue to add data to.
+ * @param[in] data	array of pointers to push.  None may be NULL.
+ * @param[in] num	number of pointers in the array.
+ * @return the number of pointers which were pushed.  0 means the queue is full.
+ */
+size_t fr_atomic_queue_push_n(fr_atomic_queue_t *aq, void * const *data, size_t num)
+{
+	int64_t head;
+	size_t	i, claimed;
+
+	if (!num) return 0;
+
+	if (num > aq->size) num = aq->size;
+
+	head = load(aq->head);
+
+	for (;;) {
+		int64_t seq, diff;
+
+		seq = aquire(aq->entry[ head % aq->size ].seq);
+		diff = (seq - head);
+
+		/*
+		 *	The queue is full.
+		 */
+		if (diff < 0) return 0;
+
+		/*
+		 *	Someone else has already written to this entry.
+		 */
+		if (diff > 0) {
+			head = load(aq->head);
+			continue;
+		}
+
+		/*
+		 *	Consumers may free entries out of order, so we
+		 *	check each entry we want.  We stop at the first
+		 *	one which isn't free.
+		 */
+		for (claimed = 1; claimed < num; claimed++) {
+			seq = aquire(aq->entry[ (head + claimed) % aq->size ].seq);
+			if (seq != (int64_t) (head + claimed)) break;
+		}
+
+		if (cas_add(aq->head, head, (int64_t) claimed)) break;
+	}
+
+	/*
+	 *	The entries are now ours.  Fill them in, and make them
+	 *	visible to the consumers.
+	 */
+	for (i = 0; i < claimed; i++) {
+		fr_atomic_queue_entry_t *entry = &aq->entry[ (head + i) % aq->size ];
+
+		entry->data = data[i];
+		store(entry->seq, head + i + 1);
+	}
+
+	return claimed;
+}
+
+/** Pop multiple pointers from the atomic queue
+ *
+ * A contiguous range of entries is claimed with one CAS, so this is
+ * cheaper than calling fr_atomic_queue_pop() in a loop.
+ *
+ * @param[in] aq	the atomic queue to retrieve data from.
+ * @param[out] p_data	array where the data is written.
+ * @param[in] num	maximum number of pointers to pop.
+ * @return the number of pointers which were popped.  0 means the queue is empty.
+ */
+size_t fr_atomic_queue_pop_n(fr_atomic_queue_t *aq, void **p_data, size_t num)
+{
+	int64_t tail;
+	size_t	i, claimed;
+
+	if (!num) return 0;
+
+	if (num > aq->size) num = aq->size;
+
+	tail = load(aq->tail);
+
+	for (;;) {
+		int64_t seq, diff;
+
+		seq = aquire(aq->entry[ tail % aq->size ].seq);
+		diff = (seq - (tail + 1));
+
+		/*
+		 *	The queue is empty.
+		 */
+		if (diff < 0) return 0;
+
+		if (diff > 0) {
+			tail = load(aq->tail);
+			continue;
+		}
+
+		/*
+		 *	Producers may fill entries out of order, so we
+		 *	check each entry we want.
+		 */
+		for (claimed = 1; claimed < num; claimed++) {
+			seq = aquire(aq->entry[ (tail + claimed) % aq->size ].seq);
+			if (seq != (int64_t) (tail + claimed + 1)) break;
+		}
+
+		if (cas_add(aq->tail, tail, (int64_t) claimed)) break;
+	}
+
+	for (i = 0; i < claimed; i++) {
+		fr_atomic_queue_entry_t *entry = &aq->entry[ (tail + i) % aq->size ];
+
+		p_data[i] = entry->data;
+		store(entry->seq, tail + i + aq->size);
+	}
+
+	return claimed;
+}
+
 size_t fr_atomic_queue_size(fr_atomic_queue_t *aq)
 {
 	return aq->size;
@@ -298,6 +298,29 @@ typedef void *(*fr_io_track_create_t)(TALLOC_CTX *ctx, uint8_t const *packet, si
  */
 typedef int (*fr_io_track_cmp_t)(void const *instance, void *thread_instance, RADCLIENT *client, void const *one, void const *two);
 
+/** Hash a tracking structure for storing in a duplicate detection table.
+ *
+ * The hash MUST only use the fields which are checked by the
+ * fr_io_track_cmp_t function.  i.e. two tracking structures which
+ * compare as identical MUST have the same hash.
+ *
+ * @param[in] instance		the context for this function
+ * @param[in] packet		packet tracking structure
+ * @return the hash of the tracking structure.
+ */
+typedef uint32_t (*fr_io_track_hash_t)(void const *instance, void const *packet);
+
+/** Return a hash of where a packet came from.
+ *
+ *  Used by the network side to send packets from the same origin
+ *  to the same worker, where possible.
+ *
+ * @param[in] li		the listener for this socket
+ * @param[in] packet_ctx	as returned by the read function.
+ * @return a hash of the packet origin.
+ */
+typedef uint32_t (*fr_io_affinity_t)(fr_listen_t const *li, void const *packet_ctx);
+
 /**  Handle an error on the socket.
  *
  *  In general, the only thing to do on errors is to close the
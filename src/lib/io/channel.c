@@ -28,6 +28,7 @@ RCSID("$Id$")
 #include <freeradius-devel/io/control.h>
 #include <freeradius-devel/util/log.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/probe.h>
 
 #ifdef HAVE_STDATOMIC_H
 #  include <stdatomic.h>
@@ -131,6 +132,9 @@ typedef struct {
 
 	atomic_bool		active;		//!< Whether the channel is active.
 
+	atomic_bool		polling;	//!< The owner of this end is polling the other
+						///< end's queue, and doesn't need to be signalled.
+
 	fr_channel_stats_t	stats;		//!< channel statistics
 } fr_channel_end_t;
 
@@ -354,8 +358,23 @@ int fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cd)
 	requestor->stats.outstanding++;
 	requestor->stats.packets++;
 
+	FR_PROBE3(channel_send_request, ch, sequence, when);
+
 	MPRINT("REQUESTOR requests %"PRIu64", num_outstanding %"PRIu64"\n", requestor->stats.packets, requestor->stats.outstanding);
 
+	/*
+	 *	The responder is polling its queue, so it will see
+	 *	the message without a signal.  The fence pairs with
+	 *	the one in fr_channel_responder_poll_stop(), so that
+	 *	either we see it polling, or it sees our message.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&ch->end[TO_REQUESTOR].polling, memory_order_relaxed)) {
+		MPRINT("REQUESTOR SKIPS signal, responder is polling\n");
+		requestor->stats.polled++;
+		return 0;
+	}
+
 #if ENABLE_SKIPS
 	/*
 	 *	We just sent the first packet.  There can't possibly be a reply, so don't bother looking.
@@ -437,19 +456,35 @@ bool fr_channel_recv_reply(fr_channel_t *ch)
 	if (cd->reply.processing_time) {
 		ch->processing_time = RTT(ch->processing_time, cd->reply.processing_time);
 	}
+
 	ch->cpu_time = cd->reply.cpu_time;
 
 	/*
-	 *	Update the outbound channel with the knowledge that
-	 *	we've received one more reply, and with the responders
-	 *	ACK.
+	 *	The reply is for a request which we sent on a
+	 *	different channel, and which this channel's responder
+	 *	stole.  The request is outstanding on the other
+	 *	channel, and the reply doesn't use our sequence
+	 *	numbers.
 	 */
-	fr_assert(requestor->stats.outstanding > 0);
-	fr_assert(cd->live.sequence > requestor->ack);
-	fr_assert(cd->live.sequence <= requestor->sequence); /* must have fewer replies than requests */
+	if (cd->reply.stolen_from) {
+		fr_channel_end_t *sent_on = &(cd->reply.stolen_from->end[TO_RESPONDER]);
+
+		fr_assert(sent_on->stats.outstanding > 0);
+		sent_on->stats.outstanding--;
+
+	} else {
+		/*
+		 *	Update the outbound channel with the knowledge that
+		 *	we've received one more reply, and with the responders
+		 *	ACK.
+		 */
+		fr_assert(requestor->stats.outstanding > 0);
+		fr_assert(cd->live.sequence > requestor->ack);
+		fr_assert(cd->live.sequence <= requestor->sequence); /* must have fewer replies than requests */
 
-	requestor->stats.outstanding--;
-	requestor->ack = cd->live.sequence;
+		requestor->stats.outstanding--;
+		requestor->ack = cd->live.sequence;
+	}
 	requestor->their_view_of_my_sequence = cd->live.ack;
 
 	fr_assert(requestor->stats.last_read_other <= cd->m.when);
@@ -501,6 +536,10 @@ bool fr_channel_recv_request(fr_channel_t *ch)
  *
  * The message should be initialized, other than "sequence" and "ack".
  *
+ * If the request was stolen with fr_channel_steal_request(),
+ * "reply.stolen_from" MUST be set to the channel it was stolen from.
+ * Otherwise it MUST be NULL.
+ *
  * @param[in] ch		the channel to send the reply on.
  * @param[in] cd		the message to send
  * @return
@@ -527,7 +566,13 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd)
 
 	when = cd->m.when;
 
-	sequence = responder->sequence + 1;
+	/*
+	 *	A reply to a stolen request doesn't use up a sequence
+	 *	number, as the requestor sent the request on a
+	 *	different channel.
+	 */
+	sequence = responder->sequence;
+	if (!cd->reply.stolen_from) sequence++;
 	cd->live.sequence = sequence;
 	cd->live.ack = responder->ack;
 
@@ -542,6 +587,8 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd)
 	responder->stats.outstanding--;
 	responder->stats.packets++;
 
+	FR_PROBE3(channel_send_reply, ch, sequence, when);
+
 	MPRINT("\tRESPONDER replies %"PRIu64", num_outstanding %"PRIu64"\n", responder->stats.packets, responder->stats.outstanding);
 
 	responder->sequence = sequence;
@@ -610,6 +657,51 @@ int fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd)
 }
 
 
+/** Take a request which was sent to a different responder
+ *
+ * This is called by an idle responder, to take a request which the
+ * requestor sent to a busy responder.  Both channels MUST have the
+ * same requestor.  "via" is the idle responder's own channel to
+ * that requestor.
+ *
+ * Only the inbound queue of "ch" is used.  It's safe for multiple
+ * consumers, so nothing else in "ch" has to be shared with the other
+ * responder.  The request is accounted for on "via", and the reply
+ * is sent on "via", with "reply.stolen_from" set to "ch".  The
+ * requestor then finishes the request on "ch".
+ *
+ * "ch" is owned by the requestor, so it's valid for as long as
+ * "via" is, even after the other responder has closed it.
+ *
+ * @param[in] ch	the channel to steal a request from.
+ * @param[in] via	our channel to the same requestor.
+ * @return
+ *	- NULL if there was nothing to steal.
+ *	- the stolen message.
+ */
+fr_channel_data_t *fr_channel_steal_request(fr_channel_t *ch, fr_channel_t *via)
+{
+	fr_channel_data_t	*cd;
+	fr_channel_end_t	*responder = &(via->end[TO_REQUESTOR]);
+
+	if ((ch == via) || ch->same_thread || via->same_thread) return NULL;
+
+	if (ch->end[TO_REQUESTOR].control != responder->control) return NULL;
+
+	if (!atomic_load(&ch->end[TO_RESPONDER].active) ||
+	    !atomic_load(&ch->end[TO_REQUESTOR].active) ||
+	    !atomic_load(&responder->active)) return NULL;
+
+	if (!fr_atomic_queue_pop(ch->end[TO_RESPONDER].aq, (void **) &cd)) return NULL;
+
+	responder->stats.outstanding++;
+
+	cd->channel.ch = via;
+	cd->channel.stolen_from = ch;
+
+	return cd;
+}
+
 /** Don't send a reply message into the channel
  *
  * The message should be the one we received from the network.
@@ -631,6 +723,33 @@ int fr_channel_null_reply(fr_channel_t *ch)
 
 
 
+/** Tell the requestor that the responder is polling the channel
+ *
+ * While the responder is polling, the requestor does not signal it
+ * when it sends a request.  The responder MUST call
+ * fr_channel_responder_poll_stop() before it goes to sleep.
+ *
+ * @param[in] ch	the channel we're polling.
+ */
+void fr_channel_responder_poll_start(fr_channel_t *ch)
+{
+	atomic_store_explicit(&ch->end[TO_REQUESTOR].polling, true, memory_order_relaxed);
+}
+
+/** Tell the requestor that the responder has stopped polling the channel
+ *
+ * A request may have been queued just before the requestor saw that
+ * we stopped polling.  The caller MUST therefore call
+ * fr_channel_recv_request() again after calling this function.
+ *
+ * @param[in] ch	the channel we were polling.
+ */
+void fr_channel_responder_poll_stop(fr_channel_t *ch)
+{
+	atomic_store_explicit(&ch->end[TO_REQUESTOR].polling, false, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
 /** Signal a channel that the responder is sleeping
  *
  * This function should be called from the responders idle loop.
@@ -963,6 +1082,7 @@ void fr_channel_stats_log(fr_channel_t const *ch, fr_log_t const *log, char cons
 	fr_log(log, L_INFO, file, line, "requestor\n");
 	fr_log(log, L_INFO, file, line, "\tsignals sent = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.signals);
 	fr_log(log, L_INFO, file, line, "\tsignals re-sent = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.resignals);
+	fr_log(log, L_INFO, file, line, "\tsignals avoided = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.polled);
 	fr_log(log, L_INFO, file, line, "\tkevents checked = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.kevents);
 	fr_log(log, L_INFO, file, line, "\toutstanding = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.outstanding);
 	fr_log(log, L_INFO, file, line, "\tpackets processed = %" PRIu64 "\n", ch->end[TO_RESPONDER].stats.packets);
@@ -81,6 +81,8 @@ typedef struct {
 	uint64_t       		outstanding; 	//!< Number of outstanding requests with no reply.
 	uint64_t		signals;	//!< Number of kevent signals we've sent.
 	uint64_t		resignals;	//!< Number of signals resent.
+	uint64_t		polled;		//!< Number of signals we didn't send, because
+						///< the other end was polling.
 
 	uint64_t		packets;	//!< Number of actual data packets.
 
@@ -121,6 +123,8 @@ typedef struct {
 		struct {
 			fr_channel_t		*ch;		//!< channel where this messages was received
 			int32_t			heap_id;	//!< for the various queues
+			fr_channel_t		*stolen_from;	//!< channel the request was sent on, if it
+								///< was stolen by another responder.
 		} channel;
 	};
 
@@ -134,6 +138,8 @@ typedef struct {
 			fr_time_delta_t		cpu_time;	//!<  total CPU time, including predicted work, (only worker -> network)
 			fr_time_delta_t		processing_time;  //!< actual processing time for this packet (only worker -> network)
 			fr_time_t		request_time;	//!< timestamp of the request packet
+			fr_channel_t		*stolen_from;	//!< channel the request was sent on, if it
+								///< was stolen by this responder.
 	        } reply;
 	};
 
@@ -162,6 +168,8 @@ int	fr_channel_send_request(fr_channel_t *ch, fr_channel_data_t *cm) CC_HINT(non
 bool	fr_channel_recv_request(fr_channel_t *ch) CC_HINT(nonnull);
 
 int	fr_channel_send_reply(fr_channel_t *ch, fr_channel_data_t *cd) CC_HINT(nonnull);
+
+fr_channel_data_t *fr_channel_steal_request(fr_channel_t *ch, fr_channel_t *via) CC_HINT(nonnull);
 int	fr_channel_null_reply(fr_channel_t *ch) CC_HINT(nonnull);
 
 bool	fr_channel_recv_reply(fr_channel_t *ch) CC_HINT(nonnull);
@@ -170,6 +178,10 @@ typedef void (*fr_channel_recv_callback_t)(void *ctx, fr_channel_t *ch, fr_chann
 int	fr_channel_set_recv_reply(fr_channel_t *ch, void *ctx, fr_channel_recv_callback_t recv_reply) CC_HINT(nonnull(1,3));
 int	fr_channel_set_recv_request(fr_channel_t *ch, void *ctx, fr_channel_recv_callback_t recv_reply) CC_HINT(nonnull(1,3));
 
+void	fr_channel_responder_poll_start(fr_channel_t *ch) CC_HINT(nonnull);
+
+void	fr_channel_responder_poll_stop(fr_channel_t *ch) CC_HINT(nonnull);
+
 int	fr_channel_responder_sleeping(fr_channel_t *ch) CC_HINT(nonnull);
 
 int	fr_channel_service_kevent(fr_channel_t *ch, fr_control_t *c, struct kevent const *kev) CC_HINT(nonnull);
@@ -41,6 +41,10 @@ struct fr_listen {
 
 	bool			connected;		//!< is this for a connected socket?
 	bool			track_duplicates;	//!< do we track duplicate packets?
+	bool			read_pending;		//!< app_io has buffered packets which can be read
+							///< without waiting for the FD to become readable.
+	uint32_t		shard;			//!< which SO_REUSEPORT shard this socket is.
+	uint32_t		num_shards;		//!< total number of shards bound to this address and port.
 	size_t			default_message_size;	//!< copied from app_io, but may be changed
 	size_t			num_messages;		//!< for the message ring buffer
 };
@@ -57,11 +61,23 @@ struct fr_async_s {
 
 	fr_time_tracking_t	tracking;
 	fr_channel_t		*channel;
+	fr_channel_t		*stolen_from;	//!< Channel the request was sent on, if it was
+						//!< stolen from another worker.
 
 	void			*packet_ctx;
 	fr_listen_t		*listen;	//!< How we received this request,
 						//!< and how we'll send the reply.
 	uint32_t		priority;	//!< higher == higher priority
+	fr_time_t		deadline;	//!< when the client stops waiting for a reply.
+	bool			started;	//!< the request has started running.
+
+	fr_time_delta_t		vtime;		//!< virtual start time, for fair queueing between clients.
+	fr_time_delta_t		fair_charge;	//!< virtual time charged to the client when queued.
+	void			*fair;		//!< fair queueing state of the client, or NULL.
+
+	bool			zero_copy;	//!< The decoder may point packet->data at the
+						//!< received message, instead of copying it.
+	void			*pinned;	//!< Holds the received message until we reply.
 };
 
 int fr_io_listen_free(fr_listen_t *li);
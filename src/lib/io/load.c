@@ -25,6 +25,7 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/io/load.h>
+#include <freeradius-devel/util/hist.h>
 
 /*
  *	We use *inverse* numbers to avoid numerical calculation issues.
@@ -372,3 +373,116 @@ fr_load_stats_t const * fr_load_generator_stats(fr_load_t const *l)
 {
 	return &l->stats;
 }
+
+fr_table_num_sorted_t const fr_load_latency_format_table[] = {
+	{ L("csv"),	FR_LOAD_LATENCY_CSV },
+	{ L("json"),	FR_LOAD_LATENCY_JSON },
+};
+size_t fr_load_latency_format_table_len = NUM_ELEMENTS(fr_load_latency_format_table);
+
+#define LOAD_LATENCY_CODES (256)
+
+struct fr_load_latency_s {
+	fr_hist_t		*hist[LOAD_LATENCY_CODES];	//!< Latency in microseconds, allocated on first use.
+};
+
+fr_load_latency_t *fr_load_latency_alloc(TALLOC_CTX *ctx)
+{
+	return talloc_zero(ctx, fr_load_latency_t);
+}
+
+/** Record the round trip time of a packet
+ *
+ *  Codes which don't fit in the table are recorded as code 0.
+ */
+void fr_load_latency_add(fr_load_latency_t *lat, uint32_t code, fr_time_delta_t rtt)
+{
+	if (code >= LOAD_LATENCY_CODES) code = 0;
+
+	if (!lat->hist[code]) {
+		lat->hist[code] = talloc_zero(lat, fr_hist_t);
+		if (!lat->hist[code]) return;
+	}
+
+	fr_hist_add(lat->hist[code], (rtt > 0) ? fr_time_delta_to_usec(rtt) : 0);
+}
+
+/** Print the latency histograms
+ *
+ * @param[in] ctx		to allocate the output in.
+ * @param[in] lat		the histograms to print.
+ * @param[in] packet_type	attribute used to name the codes.  If NULL,
+ *				codes are printed as numbers.
+ * @param[in] format		CSV or JSON.
+ * @return
+ *	- the output, which may be empty if nothing has been recorded.
+ *	- NULL on allocation failure.
+ */
+char *fr_load_latency_print(TALLOC_CTX *ctx, fr_load_latency_t const *lat, fr_dict_attr_t const *packet_type,
+			    fr_load_latency_format_t format)
+{
+	char		*out;
+	char const	*name;
+	char		number[16];
+	uint32_t	code;
+	bool		first = true;
+
+	if (format == FR_LOAD_LATENCY_CSV) {
+		out = talloc_strdup(ctx, "\"packet_type\",\"le_usec\",\"count\"\n");
+	} else {
+		out = talloc_strdup(ctx, "{");
+	}
+
+	for (code = 0; out && (code < LOAD_LATENCY_CODES); code++) {
+		fr_hist_t const	*hist = lat->hist[code];
+		size_t		i;
+		bool		first_bucket = true;
+
+		if (!hist || !hist->total) continue;
+
+		name = packet_type ? fr_dict_enum_name_by_value(packet_type, fr_box_uint32(code)) : NULL;
+		if (!name) {
+			snprintf(number, sizeof(number), "%u", code);
+			name = number;
+		}
+
+		if (format == FR_LOAD_LATENCY_JSON) {
+			out = talloc_asprintf_append_buffer(out, "%s\n\t\"%s\": { \"count\": %" PRIu64 ", "
+							    "\"min\": %" PRIu64 ", \"mean\": %.3f, \"stddev\": %.3f, "
+							    "\"p50\": %" PRIu64 ", \"p90\": %" PRIu64 ", "
+							    "\"p99\": %" PRIu64 ", \"p999\": %" PRIu64 ", "
+							    "\"max\": %" PRIu64 ", \"buckets\": [",
+							    first ? "" : ",", name, hist->total,
+							    hist->min, fr_hist_mean(hist), fr_hist_stddev(hist),
+							    fr_hist_percentile(hist, 50), fr_hist_percentile(hist, 90),
+							    fr_hist_percentile(hist, 99), fr_hist_percentile(hist, 99.9),
+							    hist->max);
+			first = false;
+		}
+
+		/*
+		 *	Each bucket is printed as its upper bound, so
+		 *	that the counts can be summed to get the number
+		 *	of packets at or below any latency.
+		 */
+		for (i = 0; out && (i < FR_HIST_NUM_BUCKETS); i++) {
+			if (!hist->count[i]) continue;
+
+			if (format == FR_LOAD_LATENCY_CSV) {
+				out = talloc_asprintf_append_buffer(out, "\"%s\",%" PRIu64 ",%" PRIu64 "\n",
+								    name, fr_hist_value(i), hist->count[i]);
+			} else {
+				out = talloc_asprintf_append_buffer(out, "%s[%" PRIu64 ", %" PRIu64 "]",
+								    first_bucket ? "" : ", ",
+								    fr_hist_value(i), hist->count[i]);
+				first_bucket = false;
+			}
+		}
+
+		if (out && (format == FR_LOAD_LATENCY_JSON)) out = talloc_strdup_append_buffer(out, "] }");
+	}
+
+	if (out && (format == FR_LOAD_LATENCY_JSON)) out = talloc_strdup_append_buffer(out, "\n}\n");
+
+	return out;
+}
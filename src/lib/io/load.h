@@ -25,7 +25,9 @@
  */
 RCSIDH(load_h, "$Id$")
 
+#include <freeradius-devel/util/dict.h>
 #include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/table.h>
 #include <freeradius-devel/util/talloc.h>
 
 /** Load generation configuration.
@@ -120,3 +122,28 @@ fr_load_reply_t fr_load_generator_have_reply(fr_load_t *l, fr_time_t request_tim
 size_t fr_load_generator_stats_sprint(fr_load_t *l, fr_time_t now, char *buffer, size_t buflen);
 
 fr_load_stats_t const * fr_load_generator_stats(fr_load_t const *l) CC_HINT(nonnull);
+
+/** Latency histograms, one per packet type
+ *
+ *  The load generator only knows how many replies it has received.
+ *  The transports which send packets also record how long each one
+ *  took, keyed by the request packet code.  The histograms can then
+ *  be printed as CSV (one line per non-empty bucket), or as JSON
+ *  (summary statistics and buckets for each packet type).
+ */
+typedef struct fr_load_latency_s fr_load_latency_t;
+
+typedef enum {
+	FR_LOAD_LATENCY_CSV = 0,
+	FR_LOAD_LATENCY_JSON
+} fr_load_latency_format_t;
+
+extern fr_table_num_sorted_t const fr_load_latency_format_table[];
+extern size_t fr_load_latency_format_table_len;
+
+fr_load_latency_t *fr_load_latency_alloc(TALLOC_CTX *ctx);
+
+void fr_load_latency_add(fr_load_latency_t *lat, uint32_t code, fr_time_delta_t rtt) CC_HINT(nonnull);
+
+char *fr_load_latency_print(TALLOC_CTX *ctx, fr_load_latency_t const *lat, fr_dict_attr_t const *packet_type,
+			    fr_load_latency_format_t format) CC_HINT(nonnull(2));
@@ -33,6 +33,12 @@
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/syserror.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 typedef struct {
 	fr_event_list_t			*el;				//!< event list, for the master socket.
 	fr_network_t			*nr;				//!< network for the master socket
@@ -48,8 +54,87 @@ typedef struct {
 	// @todo - count num_nak_clients, and num_nak_connections, too
 	uint32_t			num_connections;		//!< number of dynamic connections
 	uint32_t			num_pending_packets;   		//!< number of pending packets
+
+	fr_time_t			rate_tat;			//!< theoretical arrival time for the network token bucket.
+	uint64_t			rate_dropped;			//!< packets discarded by the network rate limit
+									///< and the client rate limits.
+	uint64_t			rate_deferred;			//!< packets deferred by the rate limits.
+
+	fr_dlist_head_t			track_free;			//!< tracking entries which can be re-used.
 } fr_io_thread_t;
 
+/** Maximum number of free tracking entries we keep for re-use
+ *
+ */
+#define TRACK_FREE_MAX		(4096)
+
+/** Maximum size of a reply written by fr_app_t->status()
+ *
+ */
+#define STATUS_REPLY_MAX	(4096)
+
+/** The marker for a deleted entry in the tracking hash table
+ *
+ */
+#define TRACK_DELETED		((fr_io_track_t *) (uintptr_t) 1)
+
+/** Open addressing hash table for duplicate detection
+ *
+ *  This is much cheaper than a tree at high packet rates, as there
+ *  is no pointer chasing, and no allocation on insert.
+ */
+typedef struct {
+	fr_io_track_t			**slot;		//!< Array of entries.  The size is a power of 2.
+	uint32_t			mask;		//!< Number of slots - 1.
+	uint32_t			num;		//!< Number of entries.
+	uint32_t			used;		//!< Number of entries, plus deleted markers.
+} fr_io_track_table_t;
+
+typedef struct fr_io_shared_client_s fr_io_shared_client_t;
+
+/** A dynamic client definition, shared across network threads
+ *
+ *  Entries are never modified once they have been published.  Readers
+ *  copy the definition, and do not hold a pointer to the entry past
+ *  the current packet.
+ */
+struct fr_io_shared_client_s {
+	fr_ipaddr_t			ipaddr;		//!< of the client
+	fr_time_t			expires;	//!< when other threads stop using this definition.
+	fr_time_t			retired;	//!< when the entry was removed from the table.
+	RADCLIENT			*radclient;	//!< the definition
+	fr_io_shared_client_t		*next;		//!< in the retired list
+};
+
+typedef _Atomic(fr_io_shared_client_t *) fr_io_shared_client_ptr_t;
+
+/** How long retired entries are kept before being freed
+ *
+ *  Readers never hold an entry for more than the time it takes to
+ *  copy it.  This is much longer than that.
+ */
+#define CLIENT_CACHE_GRACE	(fr_time_delta_from_sec(10))
+
+/** Read-mostly table of dynamic clients
+ *
+ *  When a listener has one socket per network thread, each thread has
+ *  its own clients.  Without this table, each thread would run the
+ *  "dynamic_clients" section for the same client.
+ *
+ *  Readers don't lock.  Writers lock the mutex, replace slots
+ *  atomically, and retire the old entries.  Retired entries are freed
+ *  after a grace period, in the style of RCU.
+ *
+ *  The table is open addressed, and does not grow.  Entries are
+ *  replaced, but never deleted, so lookups are never cut short.
+ */
+struct fr_io_client_cache_s {
+	pthread_mutex_t			mutex;		//!< serializes writers.
+	uint32_t			mask;		//!< number of slots - 1.
+	fr_io_shared_client_ptr_t	*slot;		//!< array of entries.
+	fr_io_shared_client_t		*retired;	//!< entries waiting to be freed, newest first.
+};
+
 /** A saved packet
  *
  */
@@ -99,8 +184,17 @@ struct fr_io_client_s {
 	fr_io_thread_t			*thread;
 	fr_event_timer_t const		*ev;		//!< when we clean up the client
 	fr_rb_tree_t			*table;		//!< tracking table for packets
+	fr_io_track_table_t		*hash_table;	//!< or a hash table, if the protocol can hash packets.
+
+	fr_dlist_head_t			expiring;	//!< tracking entries in expiry order.
+	fr_event_timer_t const		*ev_expire;	//!< when the first entry in "expiring" expires.
 
 	fr_heap_t			*pending;	//!< pending packets for this client
+
+	fr_time_t			rate_tat;	//!< theoretical arrival time for the token bucket.
+	fr_event_timer_t const		*ev_rate;	//!< when deferred packets can be processed.
+	uint64_t			rate_dropped;	//!< packets discarded by the rate limit.
+	uint64_t			rate_deferred;	//!< packets deferred by the rate limit.
 	fr_hash_table_t			*addresses;	//!< list of src/dst addresses used by this client
 
 	pthread_mutex_t			mutex;		//!< for parent / child signaling
@@ -146,25 +240,62 @@ static fr_event_update_t resume_read[] = {
 	{ 0 }
 };
 
+static void track_table_delete(fr_io_client_t *client, fr_io_track_t *track);
+
 static int track_free(fr_io_track_t *track)
 {
-	if (track->ev) (void) fr_event_timer_delete(&track->ev);
+	if (track->tracked) track_table_delete(track->client, track);
+
+	if (fr_dlist_entry_in_list(&track->entry)) fr_dlist_remove(&track->client->expiring, track);
 
 	talloc_free_children(track);
 
 	return 0;
 }
 
-static int track_dedup_free(fr_io_track_t *track)
+/** Allocate a tracking entry, re-using a free one if possible
+ *
+ *  Only unconnected clients use the free list, as connected clients
+ *  may be serviced by a different network thread.
+ */
+static fr_io_track_t *track_alloc(fr_io_client_t *client)
+{
+	fr_io_track_t *track;
+
+	if (!client->connection) {
+		track = fr_dlist_pop_head(&client->thread->track_free);
+		if (track) {
+			(void) talloc_steal(client, track);
+			goto done;
+		}
+	}
+
+	MEM(track = talloc_zero_pooled_object(client, fr_io_track_t, 1, sizeof(*track) + sizeof(track->address) + 64));
+
+done:
+	talloc_set_destructor(track, track_free);
+	return track;
+}
+
+/** Release a tracking entry
+ *
+ *  The entry is put onto the free list, if there is room.
+ */
+static void track_release(fr_io_track_t *track)
 {
-	fr_assert(track->client->table != NULL);
-	fr_assert(fr_rb_find(track->client->table, track) != NULL);
+	fr_io_thread_t *thread = track->client->thread;
 
-	if (!fr_rb_delete(track->client->table, track)) {
-		fr_assert(0);
+	if (track->client->connection || (fr_dlist_num_elements(&thread->track_free) >= TRACK_FREE_MAX)) {
+		talloc_free(track);
+		return;
 	}
 
-	return track_free(track);
+	(void) track_free(track);
+	talloc_set_destructor(track, NULL);
+
+	memset(track, 0, sizeof(*track));
+	(void) talloc_steal(thread, track);
+	fr_dlist_insert_head(&thread->track_free, track);
 }
 
 /*
@@ -313,11 +444,280 @@ static int8_t track_connected_cmp(void const *one, void const *two)
 	return CMP(ret, 0);
 }
 
+/** Hash a tracking entry
+ *
+ *  This hashes the same fields which track_cmp() compares.
+ */
+static uint32_t track_hash(fr_io_track_t const *track)
+{
+	uint32_t		hash;
+	fr_io_address_t const	*address = track->address;
+	fr_io_instance_t const	*inst = track->client->inst;
+
+	hash = fr_hash(&address->socket.inet.src_ipaddr, sizeof(address->socket.inet.src_ipaddr));
+	hash = fr_hash_update(&address->socket.inet.src_port, sizeof(address->socket.inet.src_port), hash);
+	hash = fr_hash_update(&address->socket.inet.dst_port, sizeof(address->socket.inet.dst_port), hash);
+	hash = fr_hash_update(&address->socket.inet.ifindex, sizeof(address->socket.inet.ifindex), hash);
+	hash = fr_hash_update(&address->socket.inet.dst_ipaddr, sizeof(address->socket.inet.dst_ipaddr), hash);
+
+	return hash ^ inst->app_io->hash(inst->app_io_instance, track->packet);
+}
+
+static fr_io_track_table_t *track_table_alloc(TALLOC_CTX *ctx, uint32_t size)
+{
+	fr_io_track_table_t *table;
+
+	MEM(table = talloc_zero(ctx, fr_io_track_table_t));
+	MEM(table->slot = talloc_zero_array(table, fr_io_track_t *, size));
+	table->mask = size - 1;
+
+	return table;
+}
+
+/** Re-hash all of the entries into a new array
+ *
+ *  This also removes all of the deleted markers.
+ */
+static void track_table_resize(fr_io_track_table_t *table, uint32_t size)
+{
+	uint32_t	i, j;
+	fr_io_track_t	**slot;
+
+	MEM(slot = talloc_zero_array(table, fr_io_track_t *, size));
+
+	for (i = 0; i <= table->mask; i++) {
+		fr_io_track_t *track = table->slot[i];
+
+		if (!track || (track == TRACK_DELETED)) continue;
+
+		for (j = track->hash & (size - 1); slot[j] != NULL; j = (j + 1) & (size - 1));
+		slot[j] = track;
+	}
+
+	talloc_free(table->slot);
+	table->slot = slot;
+	table->mask = size - 1;
+	table->used = table->num;
+}
+
+/** Find a tracking entry which matches the packet in "track"
+ *
+ */
+static fr_io_track_t *track_table_find(fr_io_client_t *client, fr_io_track_t *track)
+{
+	uint32_t		i;
+	fr_io_track_table_t	*table = client->hash_table;
+
+	if (!table) return fr_rb_find(client->table, track);
+
+	track->hash = track_hash(track);
+
+	for (i = track->hash & table->mask; table->slot[i] != NULL; i = (i + 1) & table->mask) {
+		fr_io_track_t *old = table->slot[i];
+
+		if ((old == TRACK_DELETED) || (old->hash != track->hash)) continue;
+
+		if (track_cmp(old, track) == 0) return old;
+	}
+
+	return NULL;
+}
+
+/** Insert a tracking entry
+ *
+ *  The caller MUST have called track_table_find() first, to check
+ *  that there isn't a matching entry, and to set the hash.
+ */
+static void track_table_insert(fr_io_client_t *client, fr_io_track_t *track)
+{
+	uint32_t		i;
+	fr_io_track_table_t	*table = client->hash_table;
+
+	fr_assert(!track->tracked);
+
+	if (!table) {
+		if (!fr_rb_insert(client->table, track)) {
+			fr_assert(0);
+			return;
+		}
+		track->tracked = true;
+		return;
+	}
+
+	/*
+	 *	Keep the table no more than 3/4 full, including
+	 *	deleted markers.  If it's mostly deleted markers,
+	 *	re-hash at the same size.
+	 */
+	if (((table->used + 1) * 4) > ((table->mask + 1) * 3)) {
+		uint32_t size = table->mask + 1;
+
+		if (((table->num + 1) * 2) > size) size *= 2;
+		track_table_resize(table, size);
+	}
+
+	for (i = track->hash & table->mask;
+	     (table->slot[i] != NULL) && (table->slot[i] != TRACK_DELETED);
+	     i = (i + 1) & table->mask);
+
+	if (!table->slot[i]) table->used++;
+	table->slot[i] = track;
+	table->num++;
+	track->tracked = true;
+}
+
+static void track_table_delete(fr_io_client_t *client, fr_io_track_t *track)
+{
+	uint32_t		i;
+	fr_io_track_table_t	*table = client->hash_table;
+
+	fr_assert(track->tracked);
+	track->tracked = false;
+
+	if (!table) {
+		fr_assert(client->table != NULL);
+
+		if (!fr_rb_delete(client->table, track)) {
+			fr_assert(0);
+		}
+		return;
+	}
+
+	for (i = track->hash & table->mask; table->slot[i] != NULL; i = (i + 1) & table->mask) {
+		if (table->slot[i] != track) continue;
+
+		table->slot[i] = TRACK_DELETED;
+		table->num--;
+		return;
+	}
+
+	fr_assert(0);
+}
+
+
+/** Check a token bucket
+ *
+ *  The bucket is implemented as a "generic cell rate algorithm",
+ *  which needs only one timestamp per bucket.  Each packet pushes the
+ *  theoretical arrival time (TAT) forward by one interval.  A packet
+ *  conforms if the TAT is no more than "tolerance" in the future.
+ *
+ * @param[in] tat	theoretical arrival time for the bucket.
+ * @param[in] interval	between packets.  0 means "no limit".
+ * @param[in] tolerance	how far ahead of time packets may arrive, i.e. the burst size.
+ * @param[in] now	the current time.
+ * @return
+ *	- 0 if the packet conforms.
+ *	- >0 the delay until a packet will conform.
+ */
+static inline fr_time_delta_t rate_limit_delay(fr_time_t tat, fr_time_delta_t interval,
+					       fr_time_delta_t tolerance, fr_time_t now)
+{
+	if (!interval || (tat <= now)) return 0;
+
+	if ((tat - now) <= tolerance) return 0;
+
+	return (tat - now) - tolerance;
+}
+
+/** Take one token from a bucket
+ *
+ */
+static inline void rate_limit_take(fr_time_t *tat, fr_time_delta_t interval, fr_time_t now)
+{
+	if (!interval) return;
+
+	if (*tat < now) *tat = now;
+	*tat += interval;
+}
+
+/** Apply the client and network rate limits to one packet
+ *
+ *  A token is only taken when both buckets have one.
+ *
+ * @return
+ *	- 0 if the packet conforms.
+ *	- >0 the delay until a packet will conform.
+ */
+static fr_time_delta_t client_rate_limit(fr_io_client_t *client, fr_time_t now)
+{
+	fr_io_instance_t const	*inst = client->inst;
+	fr_io_thread_t		*thread = client->thread;
+	fr_time_delta_t		client_delay, network_delay;
+
+	client_delay = rate_limit_delay(client->rate_tat, inst->packet_interval, inst->packet_tolerance, now);
+	network_delay = rate_limit_delay(thread->rate_tat, inst->network_interval, inst->network_tolerance, now);
+
+	if (client_delay || network_delay) return (client_delay > network_delay) ? client_delay : network_delay;
+
+	rate_limit_take(&client->rate_tat, inst->packet_interval, now);
+	rate_limit_take(&thread->rate_tat, inst->network_interval, now);
+
+	return 0;
+}
+
+/** Deferred packets for a client can now be processed
+ *
+ *  Add the client back to the pending heap, and tell the network
+ *  side to call our read() function again.
+ */
+static void client_rate_timer(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_io_client_t	*client = talloc_get_type_abort(uctx, fr_io_client_t);
+	fr_io_thread_t	*thread = client->thread;
+
+	if (!client->pending || (fr_heap_num_elements(client->pending) == 0)) return;
+
+	if (!thread->pending_clients) {
+		MEM(thread->pending_clients = fr_heap_alloc(thread, pending_client_cmp,
+							   fr_io_client_t, pending_id));
+	}
+
+	if (client->pending_id < 0) (void) fr_heap_insert(thread->pending_clients, client);
+
+	fr_network_listen_read(thread->nr, thread->listen);
+}
+
+/** Wait for the rate limit before processing more packets from a client
+ *
+ */
+static void client_rate_timer_set(fr_io_client_t *client, fr_time_t now, fr_time_delta_t delay)
+{
+	if (client->ev_rate) return;
+
+	if (fr_event_timer_at(client, client->thread->el, &client->ev_rate,
+			      now + delay, client_rate_timer, client) < 0) {
+		ERROR("proto_%s - Failed adding rate limit timer for client %s",
+		      client->inst->app_io->name, client->radclient->shortname);
+	}
+}
 
 static fr_io_pending_packet_t *pending_packet_pop(fr_io_thread_t *thread)
 {
 	fr_io_client_t *client;
 	fr_io_pending_packet_t *pending;
+	fr_time_t now = 0;
+
+	/*
+	 *	Clients which have been dynamically defined, or which
+	 *	have deferred packets, are subject to the rate limits.
+	 *	If a client is over the limit, take it out of the heap
+	 *	until its next packet conforms.
+	 */
+	while ((client = fr_heap_peek(thread->pending_clients)) != NULL) {
+		fr_time_delta_t delay;
+
+		if ((client->state == PR_CLIENT_PENDING) ||
+		    (!client->inst->packet_interval && !client->inst->network_interval)) break;
+
+		if (!now) now = fr_time();
+
+		delay = client_rate_limit(client, now);
+		if (!delay) break;
+
+		(void) fr_heap_extract(thread->pending_clients, client);
+		client_rate_timer_set(client, now, delay);
+	}
 
 	client = fr_heap_pop(thread->pending_clients);
 	if (!client) {
@@ -373,6 +773,11 @@ static RADCLIENT *radclient_clone(TALLOC_CTX *ctx, RADCLIENT const *parent)
 	DUP_FIELD(server);
 	DUP_FIELD(nas_type);
 
+	if (c->secret) {
+		c->secret_hmac = fr_hmac_md5_key_alloc(c, (uint8_t const *) c->secret, talloc_array_length(c->secret) - 1);
+		if (!c->secret_hmac) goto error;
+	}
+
 	COPY_FIELD(message_authenticator);
 	/* dynamic MUST be false */
 	COPY_FIELD(server_cs);
@@ -380,6 +785,8 @@ static RADCLIENT *radclient_clone(TALLOC_CTX *ctx, RADCLIENT const *parent)
 	COPY_FIELD(proto);
 
 	COPY_FIELD(use_connected);
+	COPY_FIELD(request_deadline);
+	COPY_FIELD(fair_share);
 
 #ifdef WITH_TLS
 	COPY_FIELD(tls_required);
@@ -519,6 +926,7 @@ static fr_io_connection_t *fr_io_connection_alloc(fr_io_instance_t const *inst,
 	connection->client->pending_id = -1;
 	connection->client->alive_id = -1;
 	connection->client->connection = connection;
+	fr_dlist_talloc_init(&connection->client->expiring, fr_io_track_t, entry);
 
 	/*
 	 *	Create the packet tracking table for this client.
@@ -824,6 +1232,169 @@ static void get_inst(fr_listen_t *li, fr_io_instance_t const **inst, fr_io_threa
 }
 
 
+static int _client_cache_free(fr_io_client_cache_t *cache)
+{
+	pthread_mutex_destroy(&cache->mutex);
+	return 0;
+}
+
+/** Allocate a table of dynamic clients, shared across network threads
+ *
+ * @param[in] ctx		to allocate the table in.
+ * @param[in] max_clients	Maximum number of dynamic clients per thread.  0 means "no limit".
+ * @return
+ *	- the new table.
+ *	- NULL on error.
+ */
+static fr_io_client_cache_t *client_cache_alloc(TALLOC_CTX *ctx, uint32_t max_clients)
+{
+	fr_io_client_cache_t	*cache;
+	uint64_t		want;
+	uint32_t		size;
+
+	/*
+	 *	Keep the table no more than half full.
+	 */
+	want = (uint64_t) (max_clients ? max_clients : 32768) * 2;
+	for (size = 64; (size < want) && (size < (1 << 24)); size <<= 1);
+
+	cache = talloc_zero(ctx, fr_io_client_cache_t);
+	if (!cache) return NULL;
+
+	cache->slot = talloc_zero_array(cache, fr_io_shared_client_ptr_t, size);
+	if (!cache->slot) {
+		talloc_free(cache);
+		return NULL;
+	}
+	cache->mask = size - 1;
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	talloc_set_destructor(cache, _client_cache_free);
+
+	return cache;
+}
+
+static inline uint32_t client_cache_hash(fr_ipaddr_t const *ipaddr)
+{
+	return fr_hash(&ipaddr->addr, (ipaddr->af == AF_INET6) ? sizeof(ipaddr->addr.v6) : sizeof(ipaddr->addr.v4));
+}
+
+/** Find a client which was defined by another network thread
+ *
+ *  This function does not lock.
+ *
+ * @param[in] ctx	to allocate the copy of the client in.
+ * @param[in] cache	of dynamic clients.
+ * @param[in] ipaddr	of the client.
+ * @param[in] now	the current time.
+ * @return
+ *	- a copy of the client definition.
+ *	- NULL if the client isn't in the table, or it has expired.
+ */
+static RADCLIENT *client_cache_find(TALLOC_CTX *ctx, fr_io_client_cache_t *cache, fr_ipaddr_t const *ipaddr, fr_time_t now)
+{
+	uint32_t		i, j;
+	fr_io_shared_client_t	*shared;
+	RADCLIENT		*radclient;
+
+	for (i = client_cache_hash(ipaddr) & cache->mask, j = 0;
+	     j <= cache->mask;
+	     i = (i + 1) & cache->mask, j++) {
+		shared = atomic_load_explicit(&cache->slot[i], memory_order_acquire);
+		if (!shared) return NULL;
+
+		if (fr_ipaddr_cmp(&shared->ipaddr, ipaddr) != 0) continue;
+
+		if (shared->expires <= now) return NULL;
+
+		radclient = radclient_clone(ctx, shared->radclient);
+		if (!radclient) return NULL;
+
+		radclient->dynamic = true;
+		radclient->active = true;
+
+		return radclient;
+	}
+
+	return NULL;
+}
+
+/** Publish a newly defined client to the other network threads
+ *
+ * @param[in] cache	of dynamic clients.
+ * @param[in] radclient	which has just been defined.
+ * @param[in] now	the current time.
+ * @param[in] lifetime	of the shared definition.
+ */
+static void client_cache_insert(fr_io_client_cache_t *cache, RADCLIENT const *radclient,
+				fr_time_t now, fr_time_delta_t lifetime)
+{
+	uint32_t		i, j, free_slot = UINT32_MAX;
+	fr_io_shared_client_t	*shared, *old, **last;
+
+	pthread_mutex_lock(&cache->mutex);
+
+	/*
+	 *	Free the entries which have been retired for long
+	 *	enough that no reader can still be using them.
+	 */
+	for (last = &cache->retired; *last != NULL; last = &(*last)->next) {
+		if ((now - (*last)->retired) < CLIENT_CACHE_GRACE) continue;
+
+		while (*last) {
+			old = *last;
+			*last = old->next;
+			talloc_free(old);
+		}
+		break;
+	}
+
+	for (i = client_cache_hash(&radclient->ipaddr) & cache->mask, j = 0;
+	     j <= cache->mask;
+	     i = (i + 1) & cache->mask, j++) {
+		old = atomic_load_explicit(&cache->slot[i], memory_order_relaxed);
+		if (!old) {
+			if (free_slot == UINT32_MAX) free_slot = i;
+			break;
+		}
+
+		/*
+		 *	Replace any entry for the same client in place,
+		 *	so that lookups can't find a stale copy of it.
+		 */
+		if (fr_ipaddr_cmp(&old->ipaddr, &radclient->ipaddr) == 0) {
+			free_slot = i;
+			break;
+		}
+
+		/*
+		 *	Otherwise re-use the first expired slot.
+		 */
+		if ((free_slot == UINT32_MAX) && (old->expires <= now)) free_slot = i;
+	}
+
+	if (free_slot == UINT32_MAX) {
+		DEBUG("Dynamic client cache is full - not sharing client %s", radclient->shortname);
+		pthread_mutex_unlock(&cache->mutex);
+		return;
+	}
+
+	MEM(shared = talloc_zero(cache, fr_io_shared_client_t));
+	MEM(shared->radclient = radclient_clone(shared, radclient));
+	shared->radclient->ipaddr = radclient->ipaddr;
+	shared->ipaddr = radclient->ipaddr;
+	shared->expires = now + lifetime;
+
+	old = atomic_exchange_explicit(&cache->slot[free_slot], shared, memory_order_release);
+	if (old) {
+		old->retired = now;
+		old->next = cache->retired;
+		cache->retired = old;
+	}
+
+	pthread_mutex_unlock(&cache->mutex);
+}
+
 static RADCLIENT *radclient_alloc(TALLOC_CTX *ctx, int ipproto, fr_io_address_t *address)
 {
 	RADCLIENT	*radclient;
@@ -862,7 +1433,7 @@ static fr_io_track_t *fr_io_track_add(fr_io_client_t *client,
 	 *	Allocate a new tracking structure.  Most of the time
 	 *	there are no duplicates, so this is fine.
 	 */
-	MEM(track = talloc_zero_pooled_object(client, fr_io_track_t, 1, sizeof(*track) + sizeof(track->address) + 64));
+	track = track_alloc(client);
 	MEM(track->address = my_address = talloc_zero(track, fr_io_address_t));
 
 	memcpy(my_address, address, sizeof(*address));
@@ -881,10 +1452,7 @@ static fr_io_track_t *fr_io_track_add(fr_io_client_t *client,
 	 *	tracking entry.  This tracks src/dst IP/port, client,
 	 *	receive time, etc.
 	 */
-	if (!client->inst->app_io->track_duplicates) {
-		talloc_set_destructor(track, track_free);
-		return track;
-	}
+	if (!client->inst->app_io->track_duplicates) return track;
 
 	/*
 	 *	We are checking for duplicates, see if there is a dup
@@ -892,14 +1460,14 @@ static fr_io_track_t *fr_io_track_add(fr_io_client_t *client,
 	 */
 	track->packet = client->inst->app_io->track(track, packet, packet_len);
 	if (!track->packet) {
-		talloc_free(track);
+		track_release(track);
 		return NULL;
 	}
 
 	/*
 	 *	No existing duplicate.  Return the new tracking entry.
 	 */
-	old = fr_rb_find(client->table, track);
+	old = track_table_find(client, track);
 	if (!old) goto do_insert;
 
 	fr_assert(old->client == client);
@@ -936,12 +1504,13 @@ static fr_io_track_t *fr_io_track_add(fr_io_client_t *client,
 		if (client->state == PR_CLIENT_PENDING) {
 			DEBUG("Ignoring duplicate packet while client %s is still pending dynamic definition",
 			      client->radclient->shortname);
+			track_release(track);
 			return NULL;
 		}
 
 		*is_dup = true;
 		old->packets++;
-		talloc_free(track);
+		track_release(track);
 
 		/*
 		 *	Retransmits can sit in the outbound queue for
@@ -949,7 +1518,7 @@ static fr_io_track_t *fr_io_track_add(fr_io_client_t *client,
 		 *	struct while the packet is in the outbound
 		 *	queue.
 		 */
-		if (old->ev) (void) fr_event_timer_delete(&old->ev);
+		if (fr_dlist_entry_in_list(&old->entry)) fr_dlist_remove(&client->expiring, old);
 		return old;
 	}
 
@@ -963,27 +1532,19 @@ static fr_io_track_t *fr_io_track_add(fr_io_client_t *client,
 	 *	and return the new one.
 	 */
 	if (old->reply_len || old->do_not_respond) {
-		talloc_free(old);
+		track_release(old);
 
 	} else {
 		fr_assert(client == old->client);
 
-		if (!fr_rb_delete(client->table, old)) {
-			fr_assert(0);
-		}
-		if (old->ev) (void) fr_event_timer_delete(&old->ev);
-
-		talloc_set_destructor(old, track_free);
+		track_table_delete(client, old);
+		if (fr_dlist_entry_in_list(&old->entry)) fr_dlist_remove(&client->expiring, old);
 
 		old->discard = true; /* don't send any reply, there's nowhere for it to go */
 	}
 
 do_insert:
-	if (!fr_rb_insert(client->table, track)) {
-		fr_assert(0);
-	}
-
-	talloc_set_destructor(track, track_dedup_free);
+	track_table_insert(client, track);
 	return track;
 }
 
@@ -1007,7 +1568,7 @@ static int pending_free(fr_io_pending_packet_t *pending)
 	 *	No more packets using this tracking entry,
 	 *	delete it.
 	 */
-	if (track->packets == 0) talloc_free(track);
+	if (track->packets == 0) track_release(track);
 
 	return 0;
 }
@@ -1079,18 +1640,45 @@ static int _client_live_free(fr_io_client_t *client)
 
 	if (client->pending) TALLOC_FREE(client->pending);
 
+	/*
+	 *	Clients with deferred packets may still be in the
+	 *	pending heap.
+	 */
+	if ((client->pending_id >= 0) && client->thread->pending_clients) {
+		(void) fr_heap_extract(client->thread->pending_clients, client);
+	}
+
 	(void) fr_trie_remove_by_key(client->thread->trie, &client->src_ipaddr.addr, client->src_ipaddr.prefix);
 	(void) fr_heap_extract(client->thread->alive_clients, client);
 
 	return 0;
 }
 
+/** Find the allowed network for a source address
+ *
+ *  Full length addresses are looked up in the frozen copies of the
+ *  networks.
+ */
+static fr_ipaddr_t const *network_lookup(fr_io_instance_t const *inst, fr_ipaddr_t const *ipaddr)
+{
+	if ((ipaddr->af == AF_INET) && (ipaddr->prefix == 32) && inst->networks_v4) {
+		return fr_trie_frozen_lookup_by_key(inst->networks_v4, &ipaddr->addr, 32);
+	}
+
+	if ((ipaddr->af == AF_INET6) && (ipaddr->prefix == 128) && inst->networks_v6) {
+		return fr_trie_frozen_lookup_by_key(inst->networks_v6, &ipaddr->addr, 128);
+	}
+
+	return fr_trie_lookup_by_key(inst->networks, &ipaddr->addr, ipaddr->prefix);
+}
+
 /**  Implement 99% of the read routines.
  *
  *  The app_io->read does the transport-specific data read.
  */
-static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time_p,
-			uint8_t *buffer, size_t buffer_len, size_t *leftover, uint32_t *priority, bool *is_dup)
+static ssize_t master_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time_p,
+			   uint8_t *buffer, size_t buffer_len, size_t *leftover, uint32_t *priority, bool *is_dup,
+			   size_t *consumed)
 {
 	fr_io_instance_t const *inst;
 	fr_io_thread_t *thread;
@@ -1274,10 +1862,19 @@ do_read:
 		 */
 		packet_len = inst->app_io->read(child, (void **) &local_address, &recv_time,
 					  buffer, buffer_len, leftover, priority, is_dup);
+
+		/*
+		 *	The child may have read more than one packet.
+		 *	Tell the network side to keep reading.
+		 */
+		li->read_pending = child->read_pending;
+
 		if (packet_len <= 0) {
 			return packet_len;
 		}
 
+		*consumed = packet_len;
+
 		/*
 		 *	Not allowed?  Discard it.  The priority()
 		 *	function has done any complaining, if
@@ -1389,8 +1986,7 @@ do_read:
 			/*
 			 *	Look up the allowed networks.
 			 */
-			network = fr_trie_lookup_by_key(inst->networks, &address.socket.inet.src_ipaddr.addr,
-						 address.socket.inet.src_ipaddr.prefix);
+			network = network_lookup(inst, &address.socket.inet.src_ipaddr);
 			if (!network) goto ignore;
 
 			/*
@@ -1399,11 +1995,25 @@ do_read:
 			if (network->af == AF_UNSPEC) goto ignore;
 
 			/*
-			 *	Allocate our local radclient as a
-			 *	placeholder for the dynamic client.
+			 *	Another network thread may have defined
+			 *	this client already.  If so, use that
+			 *	definition instead of running the
+			 *	"dynamic_clients" section again.
 			 */
-			radclient = radclient_alloc(thread, inst->ipproto, &address);
-			state = PR_CLIENT_PENDING;
+			if (inst->client_cache &&
+			    (radclient = client_cache_find(thread, inst->client_cache, &address.socket.inet.src_ipaddr,
+							   recv_time ? recv_time : fr_time()))) {
+				radclient->src_ipaddr = address.socket.inet.dst_ipaddr;
+				state = PR_CLIENT_DYNAMIC;
+
+			} else {
+				/*
+				 *	Allocate our local radclient as a
+				 *	placeholder for the dynamic client.
+				 */
+				radclient = radclient_alloc(thread, inst->ipproto, &address);
+				state = PR_CLIENT_PENDING;
+			}
 
 		} else {
 		ignore:
@@ -1437,6 +2047,7 @@ do_read:
 		client->radclient = radclient;
 		client->inst = inst;
 		client->thread = thread;
+		fr_dlist_talloc_init(&client->expiring, fr_io_track_t, entry);
 
 		if (network) {
 			client->network = *network;
@@ -1464,7 +2075,12 @@ do_read:
 		 */
 		if (inst->app_io->track_duplicates) {
 			fr_assert(inst->app_io->compare != NULL);
-			MEM(client->table = fr_rb_inline_talloc_alloc(client, fr_io_track_t, node, track_cmp, NULL));
+
+			if (inst->app_io->hash) {
+				client->hash_table = track_table_alloc(client, 64);
+			} else {
+				MEM(client->table = fr_rb_inline_talloc_alloc(client, fr_io_track_t, node, track_cmp, NULL));
+			}
 		}
 
 		/*
@@ -1588,6 +2204,61 @@ have_client:
 			 *	Got to free this if we don't process the packet.
 			 */
 			new_track = track;
+
+			/*
+			 *	Apply the rate limits to new packets from
+			 *	defined clients.  Pending clients are
+			 *	already limited by max_pending_packets.
+			 *
+			 *	Packets are either discarded here, before
+			 *	they are copied to a worker, or they are put
+			 *	onto the pending heap for this client, and
+			 *	processed when the rate limit allows.
+			 */
+			if (!connection && (client->state != PR_CLIENT_PENDING) &&
+			    (inst->packet_interval || inst->network_interval)) {
+				fr_time_t now = recv_time ? recv_time : fr_time();
+				fr_time_delta_t delay;
+
+				/*
+				 *	Keep deferred packets in order.
+				 */
+				if (client->pending && (fr_heap_num_elements(client->pending) > 0)) {
+					delay = 1;
+				} else {
+					delay = client_rate_limit(client, now);
+				}
+
+				if (delay) {
+					if (!inst->rate_limit_defer ||
+					    (inst->max_pending_packets && (thread->num_pending_packets >= inst->max_pending_packets))) {
+						client->rate_dropped++;
+						thread->rate_dropped++;
+						DEBUG3("Client %s is over the rate limit - discarding packet (%" PRIu64 " discarded)",
+						       client->radclient->shortname, client->rate_dropped);
+						goto done;
+					}
+
+					if (!client->pending) {
+						MEM(client->pending = fr_heap_alloc(client, pending_packet_cmp,
+										     fr_io_pending_packet_t, heap_id));
+					}
+
+					if (!fr_io_pending_alloc(client, buffer, packet_len, track, *priority)) {
+						DEBUG("Failed tracking packet from client %s - discarding packet",
+						      client->radclient->shortname);
+						goto done;
+					}
+
+					client->rate_deferred++;
+					thread->rate_deferred++;
+					DEBUG3("Client %s is over the rate limit - deferring packet (%" PRIu64 " deferred)",
+					       client->radclient->shortname, client->rate_deferred);
+
+					if (client->pending_id < 0) client_rate_timer_set(client, now, delay);
+					return 0;
+				}
+			}
 		}
 
 		/*
@@ -1657,6 +2328,29 @@ have_client:
 			client->ready_to_delete = false;
 		}
 
+		/*
+		 *	Some packets can be answered here, without
+		 *	sending them to a worker.  The reply goes
+		 *	through mod_write() as usual, so it's cached
+		 *	for duplicates, and the tracking entry expires
+		 *	as usual.
+		 */
+		if (inst->app->status && (client->state != PR_CLIENT_PENDING)) {
+			uint8_t		reply[STATUS_REPLY_MAX];
+			ssize_t		reply_len;
+			fr_network_t	*nr;
+
+			reply_len = inst->app->status(inst->app_instance, track, buffer, packet_len,
+						      reply, sizeof(reply));
+			if (reply_len > 0) {
+				nr = connection ? connection->nr : thread->nr;
+
+				DEBUG3("Replying to client %s from the network thread", client->radclient->shortname);
+				fr_network_listen_write(nr, li, reply, reply_len, track, track->timestamp);
+				return 0;
+			}
+		}
+
 		/*
 		 *	Return the packet.
 		 */
@@ -1731,10 +2425,30 @@ have_client:
 					buffer, packet_len, recv_time);
 
 done:
-	talloc_free(new_track);
+	if (new_track) track_release(new_track);
 	return 0;
 }
 
+static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time_p,
+			uint8_t *buffer, size_t buffer_len, size_t *leftover, uint32_t *priority, bool *is_dup)
+{
+	ssize_t	packet_len;
+	size_t	consumed = 0;
+
+	packet_len = master_read(li, packet_ctx, recv_time_p, buffer, buffer_len, leftover, priority, is_dup,
+				 &consumed);
+
+	/*
+	 *	We discarded a packet from a stream.  The network
+	 *	side re-uses the buffer for the next read, so move
+	 *	the bytes after the discarded packet to the start of
+	 *	the buffer.
+	 */
+	if ((packet_len == 0) && consumed && *leftover) memmove(buffer, buffer + consumed, *leftover);
+
+	return packet_len;
+}
+
 /** Inject a packet to a connection.
  *
  *  Always called in the context of the network.
@@ -1852,7 +2566,7 @@ static void mod_event_list_set(fr_listen_t *li, fr_event_list_t *el, void *nr)
 	 *	No dynamic clients AND no packet cleanups?  We don't
 	 *	need timers.
 	 */
-	if (!inst->dynamic_clients && !inst->cleanup_delay) {
+	if (!inst->dynamic_clients && !inst->cleanup_delay && !inst->rate_limit_defer) {
 		return;
 	}
 
@@ -2075,6 +2789,68 @@ reset_timer:
 /*
  *	Expire cached packets after cleanup_delay time
  */
+static void packet_expiry_timer(fr_event_list_t *el, fr_time_t now, void *uctx);
+
+/** Expire the cached packets for a client
+ *
+ *  All packets for a client use the same cleanup_delay, so the
+ *  expiry list is in time order.  We only need one timer, for the
+ *  first entry in the list.
+ */
+static void track_expiry_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	fr_io_client_t	*client = talloc_get_type_abort(uctx, fr_io_client_t);
+	fr_io_track_t	*track;
+	bool		now_all = false;
+
+	while ((track = fr_dlist_head(&client->expiring)) != NULL) {
+		bool last;
+
+		if (!now_all && (track->expires > now)) {
+			if (fr_event_timer_at(client, el, &client->ev_expire,
+					      track->expires, track_expiry_timer, client) == 0) return;
+
+			DEBUG("proto_%s - Failed adding cleanup_delay timer.  Discarding packets immediately",
+			      client->inst->app_io->name);
+			now_all = true;
+		}
+
+		fr_dlist_remove(&client->expiring, track);
+
+		/*
+		 *	Expiring the last packet may free the client.
+		 */
+		last = (fr_dlist_num_elements(&client->expiring) == 0);
+		packet_expiry_timer(el, now, track);
+		if (last) return;
+	}
+}
+
+/** Add a tracking entry to the tail of the client's expiry list
+ *
+ * @return
+ *	- 0 on success.
+ *	- <0 on failure to insert the timer.
+ */
+static int track_expiry_insert(fr_event_list_t *el, fr_io_track_t *track)
+{
+	fr_io_client_t *client = track->client;
+
+	if (fr_dlist_entry_in_list(&track->entry)) fr_dlist_remove(&client->expiring, track);
+
+	fr_dlist_insert_tail(&client->expiring, track);
+
+	if (client->ev_expire) return 0;
+
+	if (fr_event_timer_at(client, el, &client->ev_expire,
+			      track->expires, track_expiry_timer, client) < 0) {
+		fr_dlist_remove(&client->expiring, track);
+		return -1;
+	}
+
+	return 0;
+}
+
 static void packet_expiry_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
 {
 	fr_io_track_t *track = talloc_get_type_abort(uctx, fr_io_track_t);
@@ -2097,8 +2873,7 @@ static void packet_expiry_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
 		 *	will be cleaned up when the timer
 		 *	fires.
 		 */
-		if (fr_event_timer_at(track, el, &track->ev,
-				      track->expires, packet_expiry_timer, track) == 0) {
+		if (track_expiry_insert(el, track) == 0) {
 			DEBUG("proto_%s - cleaning up request in %d.%06ds", inst->app_io->name,
 			      (int) (inst->cleanup_delay / NSEC), (int) (inst->cleanup_delay % NSEC));
 			return;
@@ -2121,7 +2896,7 @@ static void packet_expiry_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
 	/*
 	 *	Delete the tracking entry.
 	 */
-	talloc_free(track);
+	track_release(track);
 
 	fr_assert(client->packets > 0);
 	client->packets--;
@@ -2276,6 +3051,7 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, fr_time_t request_ti
 		client->state = PR_CLIENT_NAK;
 		TALLOC_FREE(client->pending);
 		if (client->table) TALLOC_FREE(client->table);
+		if (client->hash_table) TALLOC_FREE(client->hash_table);
 		fr_assert(client->packets == 0);
 
 		/*
@@ -2478,6 +3254,14 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, fr_time_t request_ti
 		 */
 		client->state = PR_CLIENT_DYNAMIC;
 		client->radclient->active = true;
+
+		/*
+		 *	Let the other network threads use this
+		 *	definition.
+		 */
+		if (inst->client_cache) {
+			client_cache_insert(inst->client_cache, client->radclient, fr_time(), inst->idle_timeout);
+		}
 	}
 
 	/*
@@ -2520,6 +3304,22 @@ reread:
 	return buffer_len;
 }
 
+/** Write any packets which the child has queued
+ *
+ */
+static int mod_flush(fr_listen_t *li)
+{
+	fr_io_instance_t const *inst;
+	fr_io_connection_t *connection;
+	fr_listen_t *child;
+
+	get_inst(li, &inst, NULL, &connection, &child);
+
+	if (!inst->app_io->flush) return 0;
+
+	return inst->app_io->flush(child);
+}
+
 /** Close the socket.
  *
  */
@@ -2587,6 +3387,22 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 		}
 	}
 
+	/*
+	 *	Convert the rate limits to intervals between packets.
+	 *	The burst defaults to one second of packets.
+	 */
+	if (inst->max_packet_rate) {
+		if (!inst->max_packet_burst) inst->max_packet_burst = inst->max_packet_rate;
+
+		inst->packet_interval = NSEC / inst->max_packet_rate;
+		inst->packet_tolerance = inst->packet_interval * (inst->max_packet_burst - 1);
+	}
+
+	if (inst->max_network_packet_rate) {
+		inst->network_interval = NSEC / inst->max_network_packet_rate;
+		inst->network_tolerance = inst->network_interval * (inst->max_network_packet_rate - 1);
+	}
+
 	if (inst->app_io->bootstrap && (inst->app_io->bootstrap(inst->app_io_instance,
 								inst->app_io_conf) < 0)) {
 		cf_log_err(inst->app_io_conf, "Bootstrap failed for proto_%s", inst->app_io->name);
@@ -2601,6 +3417,19 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 		inst->app_io->network_get(inst->app_io_instance, &inst->ipproto, &inst->dynamic_clients, &inst->networks);
 	}
 
+	/*
+	 *	The allowed networks don't change, so make read-only
+	 *	copies which are faster to search.
+	 */
+	if (inst->networks) {
+		inst->networks_v4 = fr_trie_freeze(inst, inst->networks, 32);
+		inst->networks_v6 = fr_trie_freeze(inst, inst->networks, 128);
+		if (!inst->networks_v4 || !inst->networks_v6) {
+			cf_log_err(cs, "Failed freezing networks for proto_%s - %s", inst->app_io->name, fr_strerror());
+			return -1;
+		}
+	}
+
 	/*
 	 *	The caller determines if we have dynamic clients.
 	 */
@@ -2634,6 +3463,23 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 }
 
 
+/** Hash the source IP of the client which sent a packet
+ *
+ *  All packets from one client then go to the same worker, which
+ *  keeps per-client caches warm.
+ */
+static uint32_t mod_affinity(UNUSED fr_listen_t const *li, void const *packet_ctx)
+{
+	fr_io_track_t const *track = packet_ctx;
+	fr_ipaddr_t const *ipaddr;
+
+	if (!track || !track->address) return 0;
+
+	ipaddr = &track->address->socket.inet.src_ipaddr;
+
+	return fr_hash(&ipaddr->addr, (ipaddr->af == AF_INET6) ? sizeof(ipaddr->addr.v6) : sizeof(ipaddr->addr.v4));
+}
+
 static char const *mod_name(fr_listen_t *li)
 {
 	fr_io_thread_t *thread;
@@ -2661,6 +3507,19 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	/*
+	 *	Each network thread has its own socket, and its own
+	 *	clients.  Share the dynamic client definitions, so
+	 *	that each client is only defined once.
+	 */
+	if (inst->dynamic_clients && inst->network_shards) {
+		inst->client_cache = client_cache_alloc(inst, inst->max_clients);
+		if (!inst->client_cache) {
+			cf_log_err(conf, "Failed allocating dynamic client cache");
+			return -1;
+		}
+	}
+
 	/*
 	 *	Instantiate the dynamic client processor.
 	 */
@@ -2891,25 +3750,26 @@ int fr_io_listen_free(fr_listen_t *li)
 	return 0;
 }
 
-int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *sc,
-			size_t default_message_size, size_t num_messages)
+/** Open one master / child listener pair, and add it to a network thread
+ *
+ * @param[in] ctx			to allocate the listener in.
+ * @param[in] inst			of the master IO handler.
+ * @param[in] sc			to add the listener to.
+ * @param[in] default_message_size	for the message ring buffer.
+ * @param[in] num_messages		for the message ring buffer.
+ * @param[in] shard			which SO_REUSEPORT shard this is.
+ * @param[in] num_shards		total number of shards, or 0 for no sharding.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int master_io_listen_shard(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *sc,
+				  size_t default_message_size, size_t num_messages,
+				  uint32_t shard, uint32_t num_shards)
 {
 	fr_listen_t	*li, *child;
 	fr_io_thread_t	*thread;
 
-	/*
-	 *	No IO paths, so we don't initialize them.
-	 */
-	if (!inst->app_io) {
-		fr_assert(!inst->dynamic_clients);
-		return 0;
-	}
-
-	if (!inst->app_io->thread_inst_size) {
-		fr_strerror_const("IO modules MUST set 'thread_inst_size' when using the master IO handler.");
-		return -1;
-	}
-
 	/*
 	 *	Build the #fr_listen_t.  This describes the complete
 	 *	path data takes from the socket to the decoder and
@@ -2940,12 +3800,16 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 	li->default_message_size = default_message_size;
 	li->num_messages = num_messages;
 
+	li->shard = shard;
+	li->num_shards = num_shards;
+
 	/*
 	 *	Per-socket data lives here.
 	 */
 	thread = talloc_zero(NULL, fr_io_thread_t);
 	thread->listen = li;
 	thread->sc = sc;
+	fr_dlist_talloc_init(&thread->track_free, fr_io_track_t, entry);
 
 	talloc_set_destructor(thread, _thread_io_free);
 
@@ -3024,9 +3888,11 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 	li->name = child->name;
 
 	/*
-	 *	Record which socket we opened.
+	 *	Record which socket we opened.  The other shards are
+	 *	bound to the same address and port on purpose, so only
+	 *	the first one is recorded.
 	 */
-	if (child->app_io_addr) {
+	if (child->app_io_addr && (shard == 0)) {
 		fr_listen_t *other;
 
 		other = listen_find_any(thread->child);
@@ -3045,9 +3911,16 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 
 	/*
 	 *	Add the socket to the scheduler, where it might end up
-	 *	in a different thread.
+	 *	in a different thread.  Shards are pinned to their own
+	 *	network thread, so that the per-client state in
+	 *	fr_io_thread_t is never shared across threads.
 	 */
-	if (!fr_schedule_listen_add(sc, li)) {
+	if (num_shards) {
+		if (!fr_schedule_listen_add_shard(sc, li, shard)) {
+			talloc_free(li);
+			return -1;
+		}
+	} else if (!fr_schedule_listen_add(sc, li)) {
 		talloc_free(li);
 		return -1;
 	}
@@ -3055,6 +3928,48 @@ int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *
 	return 0;
 }
 
+int fr_master_io_listen(TALLOC_CTX *ctx, fr_io_instance_t *inst, fr_schedule_t *sc,
+			size_t default_message_size, size_t num_messages)
+{
+	uint32_t	i, num_shards;
+
+	/*
+	 *	No IO paths, so we don't initialize them.
+	 */
+	if (!inst->app_io) {
+		fr_assert(!inst->dynamic_clients);
+		return 0;
+	}
+
+	if (!inst->app_io->thread_inst_size) {
+		fr_strerror_const("IO modules MUST set 'thread_inst_size' when using the master IO handler.");
+		return -1;
+	}
+
+	if (!inst->network_shards) {
+		return master_io_listen_shard(ctx, inst, sc, default_message_size, num_messages, 0, 0);
+	}
+
+	/*
+	 *	Sharding relies on the kernel distributing datagrams
+	 *	across SO_REUSEPORT sockets.  Connected transports
+	 *	hand new connections to the scheduler themselves.
+	 */
+	if (inst->ipproto != IPPROTO_UDP) {
+		cf_log_warn(inst->app_io_conf, "Ignoring 'network_shards' for non-UDP transport %s",
+			    inst->app_io->name);
+		return master_io_listen_shard(ctx, inst, sc, default_message_size, num_messages, 0, 0);
+	}
+
+	num_shards = fr_schedule_num_networks(sc);
+	for (i = 0; i < num_shards; i++) {
+		if (master_io_listen_shard(ctx, inst, sc, default_message_size, num_messages,
+					   i, num_shards) < 0) return -1;
+	}
+
+	return 0;
+}
+
 
 fr_app_io_t fr_master_app_io = {
 	.magic			= RLM_MODULE_INIT,
@@ -3068,10 +3983,12 @@ fr_app_io_t fr_master_app_io = {
 
 	.read			= mod_read,
 	.write			= mod_write,
+	.flush			= mod_flush,
 	.inject			= mod_inject,
 
 	.open			= mod_open,
 	.close			= mod_close,
 	.event_list_set		= mod_event_list_set,
 	.get_name		= mod_name,
+	.affinity		= mod_affinity,
 };
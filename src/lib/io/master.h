@@ -36,9 +36,13 @@ extern "C" {
 #endif
 
 typedef struct fr_io_client_s fr_io_client_t;
+typedef struct fr_io_client_cache_s fr_io_client_cache_t;
 
 typedef struct {
 	fr_rb_node_t			node;		//!< rbtree node in the tracking tree.
+	fr_dlist_t			entry;		//!< in the client's expiry list, or the free list.
+	uint32_t			hash;		//!< for the duplicate detection hash table.
+	bool				tracked;	//!< in the duplicate detection table.
 	fr_event_timer_t const		*ev;		//!< when we clean up this tracking entry
 	fr_time_t			timestamp;	//!< when this packet was received
 	fr_time_t			expires;	//!< when this packet expires
@@ -83,12 +87,25 @@ typedef struct {
 	uint32_t			max_clients;			//!< maximum number of dynamic clients to allow
 	uint32_t			max_pending_packets;		//!< maximum number of pending packets
 
+	uint32_t			max_packet_rate;		//!< maximum packets per second, per client
+	uint32_t			max_packet_burst;		//!< maximum burst of packets, per client
+	uint32_t			max_network_packet_rate;	//!< maximum packets per second, per network
+	bool				rate_limit_defer;		//!< defer rate limited packets, instead of
+									///< discarding them.
+
+	fr_time_delta_t			packet_interval;		//!< derived from max_packet_rate
+	fr_time_delta_t			packet_tolerance;		//!< derived from max_packet_burst
+	fr_time_delta_t			network_interval;		//!< derived from max_network_packet_rate
+	fr_time_delta_t			network_tolerance;		//!< one second of packets at max_network_packet_rate
+
 	fr_time_delta_t			cleanup_delay;			//!< for Access-Request packets
 	fr_time_delta_t			idle_timeout;			//!< for dynamic clients
 	fr_time_delta_t			nak_lifetime;			//!< lifetime of NAKed clients
 	fr_time_delta_t			check_interval;			//!< polling for closed sockets
 
 	bool				dynamic_clients;		//!< do we have dynamic clients.
+	bool				network_shards;			//!< open one SO_REUSEPORT socket per
+									///< network thread.
 
 	CONF_SECTION			*server_cs;			//!< server CS for this listener
 
@@ -108,6 +125,10 @@ typedef struct {
 	char const			*transport;			//!< transport, typically name of IP proto
 
 	fr_trie_t const			*networks;     			//!< trie of allowed networks
+	fr_trie_frozen_t const		*networks_v4;			//!< frozen copy of networks, for IPv4 lookups
+	fr_trie_frozen_t const		*networks_v6;			//!< frozen copy of networks, for IPv6 lookups
+
+	fr_io_client_cache_t		*client_cache;			//!< dynamic clients, shared across network threads
 } fr_io_instance_t;
 
 extern fr_app_io_t fr_master_app_io;
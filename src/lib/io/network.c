@@ -31,6 +31,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/util/event.h>
 #include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/probe.h>
 #include <freeradius-devel/util/rand.h>
 #include <freeradius-devel/util/rb.h>
 #include <freeradius-devel/util/syserror.h>
@@ -44,6 +45,7 @@ RCSID("$Id$")
 #include <freeradius-devel/io/queue.h>
 #include <freeradius-devel/io/ring_buffer.h>
 #include <freeradius-devel/io/worker.h>
+#include <freeradius-devel/server/metrics.h>
 
 #define MAX_WORKERS 64
 
@@ -65,6 +67,7 @@ typedef struct {
 	fr_time_t		predicted;		//!< predicted processing time for one packet
 
 	bool			blocked;		//!< is this worker blocked?
+	int			numa_node;		//!< NUMA node the worker runs on, or -1.
 
 	fr_channel_t		*channel;		//!< channel to the worker
 	fr_worker_t		*worker;		//!< worker pointer
@@ -74,6 +77,7 @@ typedef struct {
 typedef struct {
 	fr_rb_node_t		listen_node;		//!< rbtree node for looking up by listener.
 	fr_rb_node_t		num_node;		//!< rbtree node for looking up by number.
+	fr_dlist_t		write_entry;		//!< in the list of sockets with replies to write.
 
 	fr_network_t		*nr;			//!< O(N) issues in talloc
 	int			number;			//!< unique ID
@@ -128,6 +132,7 @@ struct fr_network_s {
 	fr_event_list_t		*el;			//!< our event list
 
 	fr_heap_t		*replies;		//!< replies from the worker, ordered by priority / origin time
+	fr_dlist_head_t		write_pending;		//!< sockets which have replies waiting to be written.
 
 	fr_io_stats_t		stats;
 
@@ -145,8 +150,25 @@ struct fr_network_s {
 
 	fr_network_config_t	config;			//!< configuration
 	fr_network_worker_t	*workers[MAX_WORKERS]; 	//!< each worker
+
+	uint64_t		select[FR_NETWORK_WORKER_SELECT_MAX];	//!< requests routed by each policy.
+	uint64_t		select_blocked;		//!< requests routed while some workers were blocked.
+
+	int			numa_node;		//!< NUMA node we run on, or -1.
+	int			num_local_workers;	//!< workers on our NUMA node.
+	uint64_t		select_local;		//!< requests routed to a worker on our NUMA node.
+
+	fr_metrics_source_t	*metrics;		//!< our statistics, as seen by the metrics exporter.
 };
 
+fr_table_num_sorted_t const fr_network_worker_select_table[] = {
+	{ L("affinity"),	FR_NETWORK_WORKER_SELECT_AFFINITY	},
+	{ L("cpu_time"),	FR_NETWORK_WORKER_SELECT_CPU_TIME	},
+	{ L("outstanding"),	FR_NETWORK_WORKER_SELECT_OUTSTANDING	},
+	{ L("service_time"),	FR_NETWORK_WORKER_SELECT_SERVICE_TIME	}
+};
+size_t fr_network_worker_select_table_len = NUM_ELEMENTS(fr_network_worker_select_table);
+
 static void fr_network_post_event(fr_event_list_t *el, fr_time_t now, void *uctx);
 static int fr_network_pre_event(fr_time_t wake, void *uctx);
 static void fr_network_socket_dead(fr_network_t *nr, fr_network_socket_t *s);
@@ -438,15 +460,19 @@ static void fr_network_unsuspend(fr_network_t *nr)
 static void fr_network_recv_reply(void *ctx, fr_channel_t *ch, fr_channel_data_t *cd)
 {
 	fr_network_t *nr = ctx;
-	fr_network_worker_t *worker;
+	fr_network_worker_t *worker, *sent_to;
 
 	cd->channel.ch = ch;
 
 	/*
-	 *	Update stats for the worker.
+	 *	Update stats for the worker.  Stolen requests are
+	 *	counted against the worker they were sent to, but the
+	 *	CPU time is the worker which replied.
 	 */
 	worker = fr_channel_requestor_uctx_get(ch);
-	worker->stats.out++;
+	sent_to = cd->reply.stolen_from ? fr_channel_requestor_uctx_get(cd->reply.stolen_from) : worker;
+	sent_to->stats.out++;
+
 	worker->cpu_time = cd->reply.cpu_time;
 	if (!worker->predicted) {
 		worker->predicted = cd->reply.processing_time;
@@ -457,8 +483,8 @@ static void fr_network_recv_reply(void *ctx, fr_channel_t *ch, fr_channel_data_t
 	/*
 	 *	Unblock the worker.
 	 */
-	if (worker->blocked) {
-		worker->blocked = false;
+	if (sent_to->blocked) {
+		sent_to->blocked = false;
 		nr->num_blocked--;
 		fr_network_unsuspend(nr);
 	}
@@ -524,6 +550,8 @@ static void fr_network_channel_callback(void *ctx, void const *data, size_t data
 		/*
 		 *	Remove this worker from the array
 		 */
+		if ((nr->numa_node >= 0) && (w->numa_node == nr->numa_node)) nr->num_local_workers--;
+
 		for (i = 0; i < nr->num_workers; i++) {
 			DEBUG3("Worker acked our close request");
 			if (nr->workers[i] == w) {
@@ -544,6 +572,86 @@ static void fr_network_channel_callback(void *ctx, void const *data, size_t data
 	}
 }
 
+/** Return the load of a worker, as seen by the selection policy
+ *
+ *  Smaller is better.
+ */
+static inline uint64_t fr_network_worker_load(fr_network_t const *nr, fr_network_worker_t const *worker)
+{
+	uint64_t outstanding = worker->stats.in - worker->stats.out;
+
+	switch (nr->config.worker_select) {
+	case FR_NETWORK_WORKER_SELECT_OUTSTANDING:
+		return outstanding;
+
+	/*
+	 *	"predicted" is an EWMA of the processing time.  A
+	 *	worker which is stuck in a slow module has a large
+	 *	one, and is avoided even if it has few outstanding
+	 *	requests.
+	 */
+	case FR_NETWORK_WORKER_SELECT_SERVICE_TIME:
+		return (outstanding + 1) * (uint64_t) worker->predicted;
+
+	default:
+		return worker->cpu_time;
+	}
+}
+
+/** Pick a worker by highest random weight for the packet origin
+ *
+ *  This is a consistent hash.  When a worker becomes blocked, only
+ *  the packets which would have gone to it are moved elsewhere.
+ */
+static fr_network_worker_t *fr_network_worker_affinity(fr_network_t *nr, uint32_t key)
+{
+	int			i;
+	uint32_t		weight, best = 0;
+	fr_network_worker_t	*worker, *found = NULL;
+
+	for (i = 0; i < nr->num_workers; i++) {
+		worker = nr->workers[i];
+		if (worker->blocked) continue;
+
+		weight = fr_hash_update(&worker->worker, sizeof(worker->worker), key);
+		if (!found || (weight > best)) {
+			found = worker;
+			best = weight;
+		}
+	}
+
+	return found;
+}
+
+/** Pick the least loaded worker on our NUMA node
+ *
+ *  Workers which are blocked, or which have hit max_outstanding, are
+ *  saturated.  When all local workers are saturated we return NULL,
+ *  and the caller looks at all of the workers.
+ */
+static fr_network_worker_t *fr_network_worker_local(fr_network_t *nr)
+{
+	int			i;
+	uint64_t		load, best = UINT64_MAX;
+	fr_network_worker_t	*worker, *found = NULL;
+
+	for (i = 0; i < nr->num_workers; i++) {
+		worker = nr->workers[i];
+		if (worker->blocked || (worker->numa_node != nr->numa_node)) continue;
+
+		if (nr->config.max_outstanding &&
+		    ((worker->stats.in - worker->stats.out) >= nr->config.max_outstanding)) continue;
+
+		load = fr_network_worker_load(nr, worker);
+		if (!found || (load < best)) {
+			found = worker;
+			best = load;
+		}
+	}
+
+	return found;
+}
+
 /** Send a message on the "best" channel.
  *
  * @param nr the network
@@ -551,11 +659,19 @@ static void fr_network_channel_callback(void *ctx, void const *data, size_t data
  */
 static int fr_network_send_request(fr_network_t *nr, fr_channel_data_t *cd)
 {
-	fr_network_worker_t *worker;
+	fr_network_worker_t		*worker;
+	fr_network_worker_select_t	policy;
 
 	(void) talloc_get_type_abort(nr, fr_network_t);
 
 retry:
+	/*
+	 *	Listeners which don't provide an affinity key fall
+	 *	back to the default policy.
+	 */
+	policy = (nr->config.worker_select == FR_NETWORK_WORKER_SELECT_AFFINITY) ?
+		 FR_NETWORK_WORKER_SELECT_CPU_TIME : nr->config.worker_select;
+
 	if (nr->num_workers == 1) {
 		worker = nr->workers[0];
 		if (worker->blocked) {
@@ -566,6 +682,18 @@ retry:
 			return -1;
 		}
 
+	} else if ((nr->config.worker_select == FR_NETWORK_WORKER_SELECT_AFFINITY) &&
+		   cd->listen->app_io->affinity) {
+		worker = fr_network_worker_affinity(nr, cd->listen->app_io->affinity(cd->listen, cd->packet_ctx));
+		if (!worker) goto none;
+		policy = FR_NETWORK_WORKER_SELECT_AFFINITY;
+
+		if (nr->num_blocked) nr->select_blocked++;
+
+	} else if ((nr->num_local_workers > 0) &&
+		   ((worker = fr_network_worker_local(nr)) != NULL)) {
+		nr->select_local++;
+
 	} else if (nr->num_blocked == 0) {
 		uint32_t one, two;
 
@@ -574,36 +702,40 @@ retry:
 			two = fr_rand() % nr->num_workers;
 		} while (two == one);
 
-		if (nr->workers[one]->cpu_time < nr->workers[two]->cpu_time) {
+		if (fr_network_worker_load(nr, nr->workers[one]) < fr_network_worker_load(nr, nr->workers[two])) {
 			worker = nr->workers[one];
 		} else {
 			worker = nr->workers[two];
 		}
 	} else {
 		int i;
-		fr_time_t cpu_time = ~((fr_time_t) 0);
+		uint64_t load, best = UINT64_MAX;
 		fr_network_worker_t *found = NULL;
 
 		/*
-		 *	Some workers are blocked.  Pick an active
-		 *	worker with low CPU time.
+		 *	Some workers are blocked.  Pick the active
+		 *	worker with the lowest load.
 		 */
 		for (i = 0; i < nr->num_workers; i++) {
 			worker = nr->workers[i];
 			if (worker->blocked) continue;
 
-			if (worker->cpu_time < cpu_time) {
+			load = fr_network_worker_load(nr, worker);
+			if (!found || (load < best)) {
 				found = worker;
+				best = load;
 			}
 		}
 
 		if (!found) {
+		none:
 			 RATE_LIMIT_GLOBAL(PERROR, "Failed sending packet to worker - Couldn't find active worker, "
 			 		   "%u/%u workers are blocked", nr->num_blocked, nr->num_workers);
 			 return -1;
 		}
 
 		worker = found;
+		nr->select_blocked++;
 	}
 
 	(void) talloc_get_type_abort(worker, fr_network_worker_t);
@@ -645,6 +777,9 @@ retry:
 	}
 
 	worker->stats.in++;
+	nr->select[policy]++;
+
+	FR_PROBE3(network_send_request, cd, cd->priority, cd->m.when);
 
 	/*
 	 *	We're projecting that the worker will use more CPU
@@ -749,6 +884,12 @@ next_message:
 	data_size = s->listen->app_io->read(s->listen, &cd->packet_ctx, &cd->request.recv_time,
 					    cd->m.data, cd->m.rb_size, &s->leftover, &cd->priority, &cd->request.is_dup);
 	if (data_size == 0) {
+		/*
+		 *	The app_io discarded a packet from a batch
+		 *	read.  Re-use the buffer for the next one.
+		 */
+		if (s->listen->read_pending) goto next_message;
+
 		/*
 		 *	Cache the message for later.  This is
 		 *	important for stream sockets, which can do
@@ -796,6 +937,8 @@ next_message:
 #endif
 	cd->listen = s->listen;
 
+	FR_PROBE4(network_read, sockfd, data_size, cd->m.data[0], cd->m.when);
+
 	/*
 	 *	Nothing in the buffer yet.  Allocate room for one
 	 *	packet.
@@ -848,7 +991,34 @@ next_message:
 	 */
 	if (next) {
 		cd = next;
-		num_messages++;
+
+		/*
+		 *	The app_io has already found complete
+		 *	packets in the buffer.  The socket won't
+		 *	become readable for them, so drain them all
+		 *	now.
+		 */
+		if (!s->listen->read_pending) num_messages++;
+		goto next_message;
+	}
+
+	/*
+	 *	The app_io read multiple packets from the socket in
+	 *	one system call.  They've been removed from the
+	 *	kernel, so the FD won't become readable for them.
+	 *	Drain them all now.
+	 *
+	 *	This doesn't count towards "num_messages", as the
+	 *	number of buffered packets is limited by the app_io.
+	 */
+	if (s->listen->read_pending) {
+		cd = (fr_channel_data_t *) fr_message_reserve(s->ms, s->listen->default_message_size);
+		if (!cd) {
+			ERROR("Failed allocating message size %zd! - Closing socket",
+			      s->listen->default_message_size);
+			fr_network_socket_dead(nr, s);
+			return;
+		}
 		goto next_message;
 	}
 }
@@ -1025,6 +1195,35 @@ static void fr_network_write(UNUSED fr_event_list_t *el, UNUSED int sockfd, UNUS
 		cd = fr_heap_pop(s->waiting);
 	}
 
+	/*
+	 *	The app_io may have queued the packets, in order to
+	 *	write them all at once.  If the socket is full, we
+	 *	wait until it's writable, and then flush it again.
+	 */
+	if (li->app_io->flush && (li->app_io->flush(li) < 0)) {
+		if (errno == EWOULDBLOCK) {
+			if (!s->blocked) {
+				if (fr_event_fd_insert(nr, nr->el, s->listen->fd,
+						       fr_network_read,
+						       fr_network_write,
+						       fr_network_error,
+						       s) < 0) {
+					PERROR("Failed adding write callback to event loop");
+					fr_network_socket_dead(nr, s);
+					return;
+				}
+
+				s->blocked = true;
+			}
+			return;
+		}
+
+		PERROR("Failed flushing socket %s", s->listen->name);
+		if (li->app_io->error) li->app_io->error(li);
+		fr_network_socket_dead(nr, s);
+		return;
+	}
+
 	/*
 	 *	We've successfully written all of the packets.  Remove
 	 *	the write callback.
@@ -1048,6 +1247,7 @@ static int _network_socket_free(fr_network_socket_t *s)
 
 	fr_rb_delete(nr->sockets, s);
 	fr_rb_delete(nr->sockets_by_num, s);
+	if (fr_dlist_entry_in_list(&s->write_entry)) fr_dlist_remove(&nr->write_pending, s);
 
 	fr_event_fd_delete(nr->el, s->listen->fd, s->filter);
 
@@ -1112,6 +1312,15 @@ static void fr_network_listen_callback(void *ctx, void const *data, size_t data_
 	num_messages = s->listen->num_messages;
 	if (num_messages < 8) num_messages = 8;
 
+	/*
+	 *	Make room for every request which can be outstanding,
+	 *	so that the message set doesn't have to grow (and take
+	 *	page faults) at steady state.
+	 */
+	while ((num_messages < (1 << 16)) && ((uint32_t) num_messages < nr->config.max_outstanding)) {
+		num_messages <<= 1;
+	}
+
 	size = s->listen->default_message_size * num_messages;
 	if (size < (1 << 17)) size = (1 << 17);
 	if (size > (100 * 1024 * 1024)) size = (100 * 1024 * 1024);
@@ -1248,6 +1457,9 @@ static void fr_network_worker_started_callback(void *ctx, void const *data, size
 	MEM(w = talloc_zero(nr, fr_network_worker_t));
 
 	w->worker = worker;
+	w->numa_node = fr_worker_numa_node(worker);
+	if ((nr->numa_node >= 0) && (w->numa_node == nr->numa_node)) nr->num_local_workers++;
+
 	w->channel = fr_worker_channel_create(worker, w, nr->control);
 	fr_fatal_assert_msg(w->channel, "Failed creating new channel");
 
@@ -1334,6 +1546,7 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t n
 {
 	fr_channel_data_t *cd;
 	fr_network_t *nr = talloc_get_type_abort(uctx, fr_network_t);
+	fr_network_socket_t *s;
 
 	/*
 	 *	Pull the replies off of our global heap, and try to
@@ -1341,7 +1554,6 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t n
 	 */
 	while ((cd = fr_heap_pop(nr->replies)) != NULL) {
 		fr_listen_t *li;
-		fr_network_socket_t *s;
 
 		li = cd->listen;
 
@@ -1388,17 +1600,25 @@ static void fr_network_post_event(UNUSED fr_event_list_t *el, UNUSED fr_time_t n
 		}
 
 		/*
-		 *	No pending message, let's try writing it.
-		 *
-		 *	If there is a pending message, then we're
-		 *	waiting for IO write to become ready.
+		 *	Queue the reply.  If we're waiting for IO
+		 *	write to become ready, the write callback will
+		 *	get to it.  Otherwise we write it below, along
+		 *	with any other replies for this socket.
 		 */
-		if (!s->pending) {
-			fr_assert(!s->blocked);
-			(void) fr_heap_insert(s->waiting, cd);
-			fr_network_write(nr->el, s->listen->fd, 0, s);
+		(void) fr_heap_insert(s->waiting, cd);
+
+		if (!s->pending && !s->blocked && !fr_dlist_entry_in_list(&s->write_entry)) {
+			fr_dlist_insert_tail(&nr->write_pending, s);
 		}
 	}
+
+	/*
+	 *	Write all of the replies for each socket in one go.
+	 *	This lets the app_io batch the writes.
+	 */
+	while ((s = fr_dlist_pop_head(&nr->write_pending)) != NULL) {
+		fr_network_write(nr->el, s->listen->fd, 0, s);
+	}
 }
 
 /** Stop a network thread in an orderly way
@@ -1411,6 +1631,8 @@ int fr_network_destroy(fr_network_t *nr)
 
 	(void) talloc_get_type_abort(nr, fr_network_t);
 
+	TALLOC_FREE(nr->metrics);
+
 	/*
 	 *	Close the network sockets
 	 */
@@ -1571,6 +1793,38 @@ static int _fr_network_free(fr_network_t *nr)
 	return 0;
 }
 
+static fr_metric_def_t const network_metrics[] = {
+	{ .name = "requests", .help = "Packets read from sockets, and sent to workers.", .type = FR_METRIC_COUNTER },
+	{ .name = "replies", .help = "Replies received from workers.", .type = FR_METRIC_COUNTER },
+	{ .name = "duplicates", .help = "Duplicate packets received.", .type = FR_METRIC_COUNTER },
+	{ .name = "dropped", .help = "Packets dropped.", .type = FR_METRIC_COUNTER },
+	{ .name = "select_blocked", .help = "Requests routed while some workers were blocked.", .type = FR_METRIC_COUNTER },
+	{ .name = "workers", .help = "Workers this network thread sends requests to.", .type = FR_METRIC_GAUGE },
+	{ .name = "blocked_workers", .help = "Workers which are not accepting requests.", .type = FR_METRIC_GAUGE },
+	{ .name = "pending_replies", .help = "Replies waiting to be written to sockets.", .type = FR_METRIC_GAUGE },
+};
+
+static void network_metrics_snapshot(uint64_t *values, void const *uctx)
+{
+	fr_network_t const *nr = uctx;
+
+	values[0] = nr->stats.in;
+	values[1] = nr->stats.out;
+	values[2] = nr->stats.dup;
+	values[3] = nr->stats.dropped;
+	values[4] = nr->select_blocked;
+	values[5] = nr->num_workers;
+	values[6] = nr->num_blocked;
+	values[7] = fr_heap_num_elements(nr->replies);
+}
+
+static fr_metrics_class_t const network_metrics_class = {
+	.name = "network",
+	.defs = network_metrics,
+	.num_defs = NUM_ELEMENTS(network_metrics),
+	.snapshot = network_metrics_snapshot
+};
+
 /** Create a network
  *
  * @param[in] ctx 	The talloc ctx
@@ -1604,6 +1858,7 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const
 	nr->num_workers = 0;
 	nr->signal_pipe[0] = -1;
 	nr->signal_pipe[1] = -1;
+	nr->numa_node = -1;
 	if (config) nr->config = *config;
 
 	nr->aq_control = fr_atomic_queue_alloc(nr, 1024);
@@ -1674,6 +1929,8 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const
 		goto fail2;
 	}
 
+	fr_dlist_init(&nr->write_pending, fr_network_socket_t, write_entry);
+
 	nr->replies = fr_heap_alloc(nr, reply_cmp, fr_channel_data_t, channel.heap_id);
 	if (!nr->replies) {
 		fr_strerror_const_push("Failed creating heap for replies");
@@ -1702,6 +1959,12 @@ fr_network_t *fr_network_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const
 		goto fail2;
 	}
 
+	nr->metrics = fr_metrics_source_add(nr, &network_metrics_class, nr, "network", nr->name, NULL);
+	if (!nr->metrics) {
+		fr_strerror_const("Failed registering network metrics");
+		goto fail2;
+	}
+
 	return nr;
 }
 
@@ -1721,6 +1984,21 @@ int fr_network_stats(fr_network_t const *nr, int num, uint64_t *stats)
 	return 5;
 }
 
+/** Set the NUMA node which this network runs on
+ *
+ * This should be called before any workers are added.  Requests are
+ * then preferentially sent to workers on the same node.
+ *
+ * @param[in] nr	the network.
+ * @param[in] node	the NUMA node, or -1 for none.
+ */
+void fr_network_numa_node_set(fr_network_t *nr, int node)
+{
+	fr_assert(nr->num_workers == 0);
+
+	nr->numa_node = node;
+}
+
 void fr_network_stats_log(fr_network_t const *nr, fr_log_t const *log)
 {
 	int i;
@@ -1738,6 +2016,7 @@ void fr_network_stats_log(fr_network_t const *nr, fr_log_t const *log)
 static int cmd_stats_self(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
 {
 	fr_network_t const *nr = ctx;
+	int i;
 
 	fprintf(fp, "count.in\t%" PRIu64 "\n", nr->stats.in);
 	fprintf(fp, "count.out\t%" PRIu64 "\n", nr->stats.out);
@@ -1745,6 +2024,19 @@ static int cmd_stats_self(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cm
 	fprintf(fp, "count.dropped\t%" PRIu64 "\n", nr->stats.dropped);
 	fprintf(fp, "count.sockets\t%u\n", fr_rb_num_elements(nr->sockets));
 
+	fprintf(fp, "select.policy\t%s\n", fr_table_str_by_value(fr_network_worker_select_table,
+								 nr->config.worker_select, "<INVALID>"));
+	for (i = 0; i < FR_NETWORK_WORKER_SELECT_MAX; i++) {
+		fprintf(fp, "select.%s\t%" PRIu64 "\n",
+			fr_table_str_by_value(fr_network_worker_select_table, i, "<INVALID>"), nr->select[i]);
+	}
+	fprintf(fp, "select.blocked\t%" PRIu64 "\n", nr->select_blocked);
+	if (nr->numa_node >= 0) {
+		fprintf(fp, "numa.node\t%d\n", nr->numa_node);
+		fprintf(fp, "numa.local_workers\t%d\n", nr->num_local_workers);
+		fprintf(fp, "select.local\t%" PRIu64 "\n", nr->select_local);
+	}
+
 	return 0;
 }
 
@@ -37,13 +37,30 @@ typedef struct fr_network_s fr_network_t;
 
 #include <freeradius-devel/io/worker.h>
 #include <freeradius-devel/util/log.h>
+#include <freeradius-devel/util/table.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/** How the network thread chooses a worker for a new request
+ *
+ */
+typedef enum {
+	FR_NETWORK_WORKER_SELECT_CPU_TIME = 0,		//!< two random choices, lowest predicted CPU time.
+	FR_NETWORK_WORKER_SELECT_OUTSTANDING,		//!< two random choices, fewest outstanding requests.
+	FR_NETWORK_WORKER_SELECT_SERVICE_TIME,		//!< two random choices, lowest outstanding requests
+							///< multiplied by the average service time.
+	FR_NETWORK_WORKER_SELECT_AFFINITY,		//!< consistent hash of the packet origin.
+	FR_NETWORK_WORKER_SELECT_MAX
+} fr_network_worker_select_t;
+
+extern fr_table_num_sorted_t const fr_network_worker_select_table[];
+extern size_t fr_network_worker_select_table_len;
+
 typedef struct {
-	uint32_t	max_outstanding;
+	uint32_t			max_outstanding;
+	fr_network_worker_select_t	worker_select;	//!< how to choose a worker.
 } fr_network_config_t;
 
 int		fr_network_listen_add(fr_network_t *nr, fr_listen_t *li) CC_HINT(nonnull);
@@ -75,6 +92,8 @@ int		fr_network_stats(fr_network_t const *nr, int num, uint64_t *stats) CC_HINT(
 
 void		fr_network_stats_log(fr_network_t const *nr, fr_log_t const *log) CC_HINT(nonnull);
 
+void		fr_network_numa_node_set(fr_network_t *nr, int node) CC_HINT(nonnull);
+
 extern fr_cmd_table_t cmd_network_table[];
 
 #ifdef __cplusplus
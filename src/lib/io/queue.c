@@ -221,7 +221,6 @@ done:
  */
 int fr_queue_localize_atomic(fr_queue_t *fq, fr_atomic_queue_t *aq)
 {
-	void *data;
 	int i, room;
 
 	(void) talloc_get_type_abort(fq, fr_queue_t);
@@ -233,20 +232,29 @@ int fr_queue_localize_atomic(fr_queue_t *fq, fr_atomic_queue_t *aq)
 	if (!room) return 0;
 
 	/*
-	 *	Pop as many entries as we have room for.
+	 *	Pop as many entries as we have room for.  The free
+	 *	space may wrap around the end of the array, so we pop
+	 *	at most two batches.
 	 */
-	for (i = 0; i < room; i++) {
-		if (!fr_atomic_queue_pop(aq, &data)) {
-			return i;
-		}
+	for (i = 0; i < room; ) {
+		int want, got;
 
-		fq->entry[fq->head++] = data;
+		want = room - i;
+		if (want > (fq->size - fq->head)) want = fq->size - fq->head;
+
+		got = fr_atomic_queue_pop_n(aq, &fq->entry[fq->head], want);
+		if (!got) break;
+
+		fq->head += got;
 		if (fq->head >= fq->size) fq->head = 0;
-		fq->num++;
+		fq->num += got;
 		fr_assert(fq->num <= fq->size);
+
+		i += got;
+		if (got < want) break;
 	}
 
-	return room;
+	return i;
 }
 
 #ifndef NDEBUG
@@ -28,6 +28,12 @@ RCSID("$Id$")
 #include <freeradius-devel/util/strerror.h>
 #include <freeradius-devel/util/debug.h>
 #include <string.h>
+#include <sys/mman.h>
+
+#define HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+
+static bool	ring_buffer_huge_pages = false;
+static bool	ring_buffer_prefault = false;
 
 /*
  *	Ring buffers are allocated in a block.
@@ -43,8 +49,90 @@ struct fr_ring_buffer_s {
 	size_t		reserved;	//!< amount of reserved data at write_offset
 
 	bool		closed;		//!< whether allocations are closed
+
+	void		*mmap_base;	//!< start of the mapping, if the buffer was mmap'd
+	size_t		mmap_size;	//!< size of the mapping
 };
 
+/** Control how ring buffer memory is allocated
+ *
+ *  This function is not thread-safe.  It should be called at startup,
+ *  before any threads are created.
+ *
+ * @param[in] huge_pages	back large ring buffers with huge pages.
+ * @param[in] prefault		touch all of the memory when the ring buffer
+ *				is created, so that using it never takes a
+ *				page fault.
+ */
+void fr_ring_buffer_memory_set(bool huge_pages, bool prefault)
+{
+	ring_buffer_huge_pages = huge_pages;
+	ring_buffer_prefault = prefault;
+}
+
+static int _ring_buffer_free(fr_ring_buffer_t *rb)
+{
+	if (rb->mmap_base) munmap(rb->mmap_base, rb->mmap_size);
+
+	return 0;
+}
+
+/** Allocate the buffer from huge pages
+ *
+ *  We try explicit huge pages first.  Those need to be reserved by the
+ *  administrator, so when there are none, we fall back to a mapping
+ *  which is aligned for transparent huge pages.
+ *
+ * @param[in] rb	the ring buffer.
+ * @param[in] size	of the buffer.  A power of 2, and at least HUGE_PAGE_SIZE.
+ * @return
+ *	- the buffer on success.
+ *	- NULL on failure.  The caller should use normal memory.
+ */
+static uint8_t *ring_buffer_mmap(fr_ring_buffer_t *rb, size_t size)
+{
+	uint8_t	*p, *aligned;
+	size_t	head;
+	int	flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+#ifdef MAP_POPULATE
+	if (ring_buffer_prefault) flags |= MAP_POPULATE;
+#endif
+
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED) {
+		rb->mmap_base = p;
+		rb->mmap_size = size;
+		return p;
+	}
+#endif
+
+	/*
+	 *	Over-allocate, and then trim the mapping so that it
+	 *	starts on a huge page boundary.
+	 */
+	p = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) return NULL;
+
+	aligned = (uint8_t *) (((uintptr_t) p + HUGE_PAGE_SIZE - 1) & ~((uintptr_t) HUGE_PAGE_SIZE - 1));
+	head = aligned - p;
+
+	if (head) munmap(p, head);
+	munmap(aligned + size, HUGE_PAGE_SIZE - head);
+
+#ifdef MADV_HUGEPAGE
+	(void) madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+
+	rb->mmap_base = aligned;
+	rb->mmap_size = size;
+
+	if (ring_buffer_prefault) memset(aligned, 0, size);
+
+	return aligned;
+}
+
 /** Create a ring buffer.
  *
  *  The size provided will be rounded up to the next highest power of
@@ -91,10 +179,19 @@ fr_ring_buffer_t *fr_ring_buffer_create(TALLOC_CTX *ctx, size_t size)
 	size |= size >> 16;
 	size++;
 
-	rb->buffer = talloc_array(rb, uint8_t, size);
+	if (ring_buffer_huge_pages && (size >= HUGE_PAGE_SIZE)) {
+		rb->buffer = ring_buffer_mmap(rb, size);
+		if (rb->buffer) talloc_set_destructor(rb, _ring_buffer_free);
+	}
+
 	if (!rb->buffer) {
-		talloc_free(rb);
-		goto fail;
+		rb->buffer = talloc_array(rb, uint8_t, size);
+		if (!rb->buffer) {
+			talloc_free(rb);
+			goto fail;
+		}
+
+		if (ring_buffer_prefault) memset(rb->buffer, 0, size);
 	}
 	rb->size = size;
 
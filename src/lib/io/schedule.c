@@ -36,6 +36,14 @@ RCSID("$Id$")
 
 #include <pthread.h>
 
+#ifdef __linux__
+#  include <sched.h>
+#  include <sys/syscall.h>
+#  include <linux/mempolicy.h>
+#  define HAVE_NUMA_SCHEDULE (1)
+#  define MAX_NUMA_NODES (64)
+#endif
+
 /*
  *	Other OS's have sem_init, OS X doesn't.
  */
@@ -146,6 +154,13 @@ struct fr_schedule_s {
 
 	fr_network_t	*single_network;	//!< for single-threaded mode
 	fr_worker_t	*single_worker;		//!< for single-threaded mode
+
+	fr_worker_steal_t *steal;		//!< workers which steal requests from each other.
+
+	int		num_numa_nodes;		//!< number of NUMA nodes we pin threads to, or 0.
+#ifdef HAVE_NUMA_SCHEDULE
+	cpu_set_t	*numa_cpus;		//!< CPUs for each NUMA node.
+#endif
 };
 
 static _Thread_local int worker_id;		//!< Internal ID of the current worker thread.
@@ -159,6 +174,94 @@ int fr_schedule_worker_id(void)
 	return worker_id;
 }
 
+#ifdef HAVE_NUMA_SCHEDULE
+/** Find the NUMA nodes, and which CPUs belong to each one
+ *
+ * @param[in] sc	the scheduler.
+ * @return the number of NUMA nodes found.
+ */
+static int schedule_numa_init(fr_schedule_t *sc)
+{
+	int	node;
+
+	MEM(sc->numa_cpus = talloc_zero_array(sc, cpu_set_t, MAX_NUMA_NODES));
+
+	for (node = 0; node < MAX_NUMA_NODES; node++) {
+		char	path[64], buffer[1024], *p, *q;
+		FILE	*fp;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		fp = fopen(path, "r");
+		if (!fp) break;
+
+		p = fgets(buffer, sizeof(buffer), fp);
+		fclose(fp);
+		if (!p) break;
+
+		/*
+		 *	Format is "0-7,16-23\n"
+		 */
+		CPU_ZERO(&sc->numa_cpus[node]);
+		while (*p && (*p != '\n')) {
+			unsigned long first, last;
+
+			first = last = strtoul(p, &q, 10);
+			if (q == p) break;
+
+			if (*q == '-') {
+				p = q + 1;
+				last = strtoul(p, &q, 10);
+			}
+
+			while ((first <= last) && (first < CPU_SETSIZE)) CPU_SET(first++, &sc->numa_cpus[node]);
+
+			p = q;
+			if (*p == ',') p++;
+		}
+
+		if (CPU_COUNT(&sc->numa_cpus[node]) == 0) break;
+	}
+
+	return node;
+}
+
+/** Pin the current thread to a NUMA node
+ *
+ * The thread is bound to the CPUs of the node, and its memory
+ * allocations prefer that node.  All of the message sets and ring
+ * buffers which the thread creates are then node-local.
+ *
+ * @param[in] sc	the scheduler.
+ * @param[in] id	of the network or worker.
+ * @return
+ *	- the NUMA node we were pinned to.
+ *	- -1 if NUMA scheduling is disabled, or on error.
+ */
+static int schedule_numa_bind(fr_schedule_t *sc, unsigned int id)
+{
+	int		node;
+	unsigned long	mask;
+
+	if (!sc->num_numa_nodes) return -1;
+
+	node = id % sc->num_numa_nodes;
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &sc->numa_cpus[node]) != 0) {
+		ERROR("Failed pinning thread to NUMA node %d", node);
+		return -1;
+	}
+
+	mask = 1UL << node;
+	if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8) < 0) {
+		WARN("Failed setting memory policy for NUMA node %d: %s", node, fr_syserror(errno));
+	}
+
+	return node;
+}
+#else
+#define schedule_numa_bind(_sc, _id) (-1)
+#endif
+
 /** Entry point for worker threads
  *
  * @param[in] arg	the fr_schedule_worker_t
@@ -172,11 +275,18 @@ static void *fr_schedule_worker_thread(void *arg)
 	fr_schedule_child_status_t	status = FR_CHILD_FAIL;
 	fr_schedule_network_t		*sn;
 	char				worker_name[32];
+	int				numa_node;
 
 	worker_id = sw->id;		/* Store the current worker ID */
 
 	snprintf(worker_name, sizeof(worker_name), "Worker %d", sw->id);
 
+	/*
+	 *	Bind first, so that all of our memory is allocated
+	 *	on the correct node.
+	 */
+	numa_node = schedule_numa_bind(sc, sw->id);
+
 	sw->ctx = ctx = talloc_init("%s", worker_name);
 	if (!ctx) {
 		ERROR("%s - Failed allocating memory", worker_name);
@@ -191,12 +301,19 @@ static void *fr_schedule_worker_thread(void *arg)
 		goto fail;
 	}
 
+	if (sc->config->timer_resolution &&
+	    (fr_event_list_set_timer_wheel(sw->el, sc->config->timer_resolution) < 0)) {
+		PERROR("%s - Failed creating timer wheel", worker_name);
+		goto fail;
+	}
+
 
 	sw->worker = fr_worker_create(ctx, sw->el, worker_name, sc->log, sc->lvl, &sc->config->worker);
 	if (!sw->worker) {
 		PERROR("%s - Failed creating worker", worker_name);
 		goto fail;
 	}
+	fr_worker_numa_node_set(sw->worker, numa_node);
 
 	/*
 	 *	@todo make this a registry
@@ -216,6 +333,11 @@ static void *fr_schedule_worker_thread(void *arg)
 		}
 	}
 
+	if (sc->steal && (fr_worker_steal_add(sc->steal, sw->worker) < 0)) {
+		PERROR("%s - Failed enabling request stealing", worker_name);
+		goto fail;
+	}
+
 	sw->status = FR_CHILD_RUNNING;
 
 	/*
@@ -293,11 +415,14 @@ static void *fr_schedule_network_thread(void *arg)
 	fr_schedule_child_status_t	status = FR_CHILD_FAIL;
 	fr_event_list_t			*el;
 	char				network_name[32];
+	int				numa_node;
 
 	snprintf(network_name, sizeof(network_name), "Network %d", sn->id);
 
 	INFO("%s - Starting", network_name);
 
+	numa_node = schedule_numa_bind(sc, sn->id);
+
 	sn->ctx = ctx = talloc_init("%s", network_name);
 	if (!ctx) {
 		ERROR("%s - Failed allocating memory", network_name);
@@ -310,11 +435,18 @@ static void *fr_schedule_network_thread(void *arg)
 		goto fail;
 	}
 
+	if (sc->config->timer_resolution &&
+	    (fr_event_list_set_timer_wheel(el, sc->config->timer_resolution) < 0)) {
+		PERROR("%s - Failed creating timer wheel", network_name);
+		goto fail;
+	}
+
 	sn->nr = fr_network_create(ctx, el, network_name, sc->log, sc->lvl, &sc->config->network);
 	if (!sn->nr) {
 		PERROR("%s - Failed creating network", network_name);
 		goto fail;
 	}
+	fr_network_numa_node_set(sn->nr, numa_node);
 
 	sn->status = FR_CHILD_RUNNING;
 
@@ -513,6 +645,24 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 		if (sc->config->max_workers > 64) sc->config->max_workers = 64;
 	}
 
+#ifdef HAVE_NUMA_SCHEDULE
+	/*
+	 *	Spread the networks and workers across the NUMA
+	 *	nodes.  Network N and worker N are on the same node.
+	 */
+	if (sc->config->numa) {
+		sc->num_numa_nodes = schedule_numa_init(sc);
+		if (sc->num_numa_nodes < 2) {
+			DEBUG("NUMA scheduling disabled - only %d node(s) found", sc->num_numa_nodes);
+			sc->num_numa_nodes = 0;
+		} else {
+			INFO("NUMA scheduling across %d nodes", sc->num_numa_nodes);
+		}
+	}
+#else
+	if (sc->config->numa) WARN("NUMA scheduling is not supported on this platform");
+#endif
+
 	/*
 	 *	Create the lists which hold the workers and networks.
 	 */
@@ -592,6 +742,19 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 		return NULL;
 	}
 
+	/*
+	 *	Idle workers take requests which are queued for busy
+	 *	ones.
+	 */
+	if (sc->config->worker.steal_requests && (sc->config->max_workers > 1)) {
+		sc->steal = fr_worker_steal_alloc(sc, sc->config->max_workers, sc->config->max_networks);
+		if (!sc->steal) {
+			ERROR("Failed allocating memory");
+			fr_schedule_destroy(&sc);
+			return NULL;
+		}
+	}
+
 	/*
 	 *	Create all of the workers.
 	 */
@@ -708,6 +871,11 @@ int fr_schedule_destroy(fr_schedule_t **sc_to_free)
 
 	sc->running = false;
 
+	/*
+	 *	Stop stealing before the channels start closing.
+	 */
+	if (sc->steal) fr_worker_steal_stop(sc->steal);
+
 	/*
 	 *	Single threaded mode: kill the only network / worker we have.
 	 */
@@ -842,6 +1010,61 @@ fr_network_t *fr_schedule_listen_add(fr_schedule_t *sc, fr_listen_t *li)
 	return nr;
 }
 
+/** Return the number of network threads which can take listeners
+ *
+ * @param[in] sc the scheduler
+ * @return the number of network threads.
+ */
+uint32_t fr_schedule_num_networks(fr_schedule_t const *sc)
+{
+	if (sc->el) return 1;
+
+	return fr_dlist_num_elements(&sc->networks);
+}
+
+/** Add a fr_listen_t to a specific network thread
+ *
+ * This is used for SO_REUSEPORT sharding, where each network thread
+ * gets its own socket bound to the same address and port.
+ *
+ * @param[in] sc the scheduler
+ * @param[in] li the ctx and callbacks for the transport.
+ * @param[in] shard which network to add the listener to.  This is
+ *	taken modulo the number of networks.
+ * @return
+ *	- NULL on error
+ *	- the fr_network_t that the socket was added to.
+ */
+fr_network_t *fr_schedule_listen_add_shard(fr_schedule_t *sc, fr_listen_t *li, uint32_t shard)
+{
+	fr_network_t *nr;
+
+	(void) talloc_get_type_abort(sc, fr_schedule_t);
+
+	if (sc->el) {
+		nr = sc->single_network;
+	} else {
+		fr_schedule_network_t *sn = NULL;
+
+		shard %= fr_dlist_num_elements(&sc->networks);
+
+		while ((sn = fr_dlist_next(&sc->networks, sn)) != NULL) {
+			if (sn->id == shard) break;
+		}
+
+		if (!sn) {
+			fr_strerror_printf("No network thread for shard %u", shard);
+			return NULL;
+		}
+
+		nr = sn->nr;
+	}
+
+	if (fr_network_listen_add(nr, li) < 0) return NULL;
+
+	return nr;
+}
+
 /** Add a directory NOTE_EXTEND to a scheduler.
  *
  * @param[in] sc the scheduler
@@ -68,6 +68,10 @@ typedef struct {
 	fr_network_config_t network;		//!< configuration for each network;
 
 	fr_time_delta_t	stats_interval;		//!< print channel statistics
+
+	bool		numa;			//!< pin networks and workers to NUMA nodes.
+
+	fr_time_delta_t	timer_resolution;	//!< if non-zero, use timer wheels with this resolution.
 } fr_schedule_config_t;
 
 int			fr_schedule_worker_id(void);
@@ -81,6 +85,8 @@ fr_schedule_t		*fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el, fr_log_
 int			fr_schedule_destroy(fr_schedule_t **sc);
 
 fr_network_t		*fr_schedule_listen_add(fr_schedule_t *sc, fr_listen_t *li) CC_HINT(nonnull);
+fr_network_t		*fr_schedule_listen_add_shard(fr_schedule_t *sc, fr_listen_t *li, uint32_t shard) CC_HINT(nonnull);
+uint32_t		fr_schedule_num_networks(fr_schedule_t const *sc) CC_HINT(nonnull);
 fr_network_t		*fr_schedule_directory_add(fr_schedule_t *sc, fr_listen_t *li) CC_HINT(nonnull);
 #ifdef __cplusplus
 }
@@ -57,10 +57,15 @@ RCSID("$Id$")
 #include <freeradius-devel/io/message.h>
 #include <freeradius-devel/io/time_tracking.h>
 #include <freeradius-devel/io/worker.h>
+#include <freeradius-devel/server/client.h>
+#include <freeradius-devel/server/metrics.h>
 #include <freeradius-devel/unlang/call.h>
 #include <freeradius-devel/unlang/interpret.h>
 #include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/probe.h>
+#include <freeradius-devel/util/rand.h>
 
+#include <sched.h>
 #include <stdalign.h>
 
 #ifdef WITH_VERIFY_PTR
@@ -73,6 +78,20 @@ static void worker_verify(fr_worker_t *worker);
 #define CACHE_LINE_SIZE	64
 static alignas(CACHE_LINE_SIZE) atomic_uint64_t request_number = 0;
 
+/** The debug output of sampled requests
+ *
+ *  When full, the oldest output is overwritten.  The worker writes
+ *  to it, and radmin reads it, so it's protected by a mutex.  Only
+ *  sampled requests touch it, so the mutex is rarely contended.
+ */
+typedef struct {
+	pthread_mutex_t		mutex;		//!< held while reading or writing.
+	char			*buffer;	//!< of debug output.
+	size_t			size;		//!< of the buffer.
+	size_t			head;		//!< where the next output is written.
+	bool			wrapped;	//!< old output has been overwritten.
+} worker_debug_ring_t;
+
 /**
  *  A worker which takes packets from a master, and processes them.
  */
@@ -117,6 +136,79 @@ struct fr_worker_s {
 	fr_event_timer_t const	*ev_cleanup;	//!< timer for max_request_time
 
 	fr_channel_t		**channel;	//!< list of channels
+
+	fr_worker_steal_t	*steal;		//!< workers we can steal requests from.
+	int			steal_id;	//!< our slot in the steal group.
+	uint64_t		num_stolen;	//!< number of requests we stole from other workers.
+
+	int			numa_node;	//!< NUMA node we run on, or -1.
+
+	fr_time_delta_t		spin_budget;	//!< how long we currently poll the channels before sleeping.
+	uint64_t		num_spin_hits;	//!< number of times polling found a request.
+	uint64_t		num_spin_misses; //!< number of times polling found nothing.
+
+	uint64_t		num_expired;	//!< requests discarded because the client had given up.
+	uint64_t		num_shed;	//!< low priority requests discarded because we were busy.
+
+	fr_limiter_t		limiter;	//!< adaptive limit on the number of active requests.
+
+	fr_rb_tree_t		*fair_clients;	//!< fair queueing state of clients with active requests.
+	fr_time_delta_t		vtime;		//!< virtual time of the last request we started running.
+
+	request_pool_t		*request_pool;	//!< free list and talloc pools for our requests.
+
+	worker_debug_ring_t	*debug_ring;	//!< debug output of sampled requests.
+	uint32_t		debug_sample_count; //!< requests since we last sampled one.
+	uint64_t		num_sampled;	//!< number of requests which were sampled.
+
+	fr_metrics_source_t	*metrics;	//!< our statistics, as seen by the metrics exporter.
+};
+
+/** Fair queueing state of one client
+ *
+ *  Each request is given a virtual start time when it's queued, and
+ *  requests with earlier start times are run first.  Clients are
+ *  charged virtual time for the CPU time their requests use, divided
+ *  by their fair_share, so a client which uses more than its share
+ *  has its new requests queued behind those of other clients.
+ */
+typedef struct {
+	fr_rb_node_t		node;		//!< entry in the worker's fair_clients tree.
+	RADCLIENT const		*client;	//!< the requests are from.
+	uint32_t		share;		//!< of the worker, relative to other clients.
+	uint32_t		active;		//!< number of requests we're processing for the client.
+	fr_time_delta_t		finish;		//!< virtual time at which the client's work is done.
+} worker_fair_client_t;
+
+/** One worker's entry in a steal group
+ *
+ */
+typedef struct {
+	atomic_bool		busy;		//!< running requests.  Idle workers may steal from us.
+	atomic_bool		stealing;	//!< looking at the channels of other workers.
+} worker_steal_slot_t;
+
+/** Workers which can steal requests from each other
+ *
+ *  Everything which other workers look at is owned by the group, and
+ *  not by the workers, so it's valid for as long as the group is.
+ *  There are no locks.  A worker publishes its channels in the
+ *  group's channel array, and sets "stealing" in its slot while it
+ *  looks at the channels of other workers.
+ *
+ *  To remove a channel, a worker clears it from the array, and then
+ *  waits until every other worker has been seen not stealing.  Any
+ *  later steal can't find the channel, so once the wait is over, no
+ *  other worker refers to it.  Stealing takes a few atomic operations,
+ *  so the wait is short, and it's only done when a channel closes.
+ */
+struct fr_worker_steal_s {
+	atomic_bool		stopped;	//!< no more stealing.
+	atomic_int		num_workers;	//!< number of slots used.
+	int			max_workers;	//!< number of slots.
+	int			max_channels;	//!< number of channels per slot.
+	worker_steal_slot_t	*slot;		//!< one for each worker.
+	_Atomic(fr_channel_t *)	*channel;	//!< max_channels for each worker.
 };
 
 static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now);
@@ -137,13 +229,80 @@ static void worker_recv_request(void *ctx, fr_channel_t *ch, fr_channel_data_t *
 	worker->stats.in++;
 	DEBUG3("Received request %" PRIu64 "", worker->stats.in);
 	cd->channel.ch = ch;
+	cd->channel.stolen_from = NULL;
 	worker_request_bootstrap(worker, cd, fr_time());
 }
 
+/** Wait until no other worker is in the middle of stealing
+ *
+ * Workers which start stealing after this is called don't see any
+ * channel which was removed from the group before it was called.
+ *
+ * @param[in] steal	the steal group.
+ * @param[in] self	our slot, or -1 if we're not a worker.
+ */
+static void worker_steal_sync(fr_worker_steal_t *steal, int self)
+{
+	int i, num;
+
+	num = atomic_load(&steal->num_workers);
+	for (i = 0; i < num; i++) {
+		if (i == self) continue;
+
+		while (atomic_load(&steal->slot[i].stealing)) sched_yield();
+	}
+}
+
+/** Remove a worker from its steal group
+ *
+ * Once this returns, no other worker can look at our channels.
+ * Requests which were already stolen hold their own references to
+ * the channels, which are valid until the network thread exits.
+ */
+static void worker_steal_remove(fr_worker_t *worker)
+{
+	int			i;
+	fr_worker_steal_t	*steal = worker->steal;
+
+	if (!steal) return;
+
+	atomic_store(&steal->slot[worker->steal_id].busy, false);
+	for (i = 0; i < steal->max_channels; i++) {
+		atomic_store(&steal->channel[(worker->steal_id * steal->max_channels) + i], NULL);
+	}
+	worker_steal_sync(steal, worker->steal_id);
+
+	worker->steal = NULL;
+}
+
+/** Add or remove one of our channels
+ *
+ * If we're in a steal group, the channel is published to, or removed
+ * from, the other workers.  Channels which don't fit in our slot of
+ * the group are never stolen from.
+ */
+static void worker_channel_set(fr_worker_t *worker, int i, fr_channel_t *ch)
+{
+	fr_worker_steal_t *steal = worker->steal;
+
+	worker->channel[i] = ch;
+
+	if (!steal || (i >= steal->max_channels)) return;
+
+	atomic_store(&steal->channel[(worker->steal_id * steal->max_channels) + i], ch);
+	if (!ch) worker_steal_sync(steal, worker->steal_id);
+}
+
 static void worker_exit(fr_worker_t *worker)
 {
 	worker->exiting = true;
 
+	/*
+	 *	Our channels are going away, so other workers can't
+	 *	steal from them any more.
+	 */
+	worker_steal_remove(worker);
+
 	/*
 	 *	Don't allow the post event to run
 	 *	any more requests.  They'll be
@@ -198,6 +357,11 @@ static void worker_channel_callback(void *ctx, void const *data, size_t data_siz
 	case FR_CHANNEL_DATA_READY_RESPONDER:
 		fr_assert(ch != NULL);
 
+		/*
+		 *	We were signalled, so there's traffic again.
+		 */
+		worker->spin_budget = worker->config.spin_budget;
+
 		if (!fr_channel_recv_request(ch)) {
 			worker->was_sleeping = was_sleeping;
 
@@ -213,7 +377,6 @@ static void worker_channel_callback(void *ctx, void const *data, size_t data_siz
 
 			if (worker->channel[i] != NULL) continue;
 
-			worker->channel[i] = ch;
 			DEBUG3("Received channel %p into array entry %d", ch, i);
 
 			ms = fr_message_set_create(worker, worker->config.message_set_size,
@@ -221,6 +384,7 @@ static void worker_channel_callback(void *ctx, void const *data, size_t data_siz
 						   worker->config.ring_buffer_size);
 			fr_assert(ms != NULL);
 			fr_channel_responder_uctx_add(ch, ms);
+			worker_channel_set(worker, i, ch);
 
 			worker->num_channels++;
 			ok = true;
@@ -244,14 +408,18 @@ static void worker_channel_callback(void *ctx, void const *data, size_t data_siz
 
 			if (worker->channel[i] != ch) continue;
 
+			/*
+			 *	Stop other workers stealing from the
+			 *	channel before we close it.
+			 */
+			worker_channel_set(worker, i, NULL);
+
 			ms = fr_channel_responder_uctx_get(ch);
 
 			fr_channel_responder_ack_close(ch);
 			fr_assert(ms != NULL);
 			fr_message_set_gc(ms);
 			talloc_free(ms);
-
-			worker->channel[i] = NULL;
 			fr_assert(worker->num_channels > 0);
 			worker->num_channels--;
 			ok = true;
@@ -285,6 +453,7 @@ static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now
 	size_t			size;
 	fr_channel_data_t	*reply;
 	fr_channel_t		*ch;
+	fr_channel_t		*stolen_from;
 	fr_message_set_t	*ms;
 	fr_listen_t		*listen;
 
@@ -294,6 +463,7 @@ static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now
 	 *	Cache the outbound channel.  We'll need it later.
 	 */
 	ch = cd->channel.ch;
+	stolen_from = cd->channel.stolen_from;
 	listen = cd->listen;
 
 	/*
@@ -348,6 +518,8 @@ static void worker_nak(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now
 	 */
 	fr_message_done(&cd->m);
 
+	reply->reply.stolen_from = stolen_from;
+
 	/*
 	 *	Send the reply, which also polls the request queue.
 	 */
@@ -451,6 +623,71 @@ static void worker_max_request_timer(fr_worker_t *worker)
 	}
 }
 
+static int8_t worker_fair_client_cmp(void const *one, void const *two)
+{
+	worker_fair_client_t const *a = one, *b = two;
+
+	return CMP(a->client, b->client);
+}
+
+/** Give a new request its virtual start time
+ *
+ * The client is charged our prediction of how long the request will
+ * take.  That is corrected by worker_fair_end(), when we know how long
+ * it actually took.
+ */
+static void worker_fair_start(fr_worker_t *worker, request_t *request)
+{
+	worker_fair_client_t	*fc;
+	fr_time_delta_t		charge;
+
+	request->async->vtime = worker->vtime;
+
+	if (!worker->config.fair_queue || !request->client || !request_is_external(request)) return;
+
+	fc = fr_rb_find(worker->fair_clients, &(worker_fair_client_t){ .client = request->client });
+	if (!fc) {
+		MEM(fc = talloc_zero(worker->fair_clients, worker_fair_client_t));
+		fc->client = request->client;
+		fc->share = request->client->fair_share ? request->client->fair_share : 1;
+		fc->finish = worker->vtime;
+		(void) fr_rb_insert(worker->fair_clients, fc);
+	}
+
+	/*
+	 *	A client which has been idle doesn't get credit for
+	 *	the time it wasn't using.
+	 */
+	if (fc->finish > worker->vtime) request->async->vtime = fc->finish;
+
+	charge = worker->predicted / fc->share;
+	if (charge < 1) charge = 1;
+
+	request->async->fair_charge = charge;
+	request->async->fair = fc;
+	fc->finish = request->async->vtime + charge;
+	fc->active++;
+}
+
+/** Charge the client for the CPU time the request actually used
+ *
+ */
+static void worker_fair_end(fr_worker_t *worker, request_t *request)
+{
+	worker_fair_client_t	*fc = request->async->fair;
+
+	if (!fc) return;
+	request->async->fair = NULL;
+
+	fc->finish += (request->async->tracking.running_total / fc->share) - request->async->fair_charge;
+
+	fr_assert(fc->active > 0);
+	if (--fc->active > 0) return;
+
+	(void) fr_rb_delete(worker->fair_clients, fc);
+	talloc_free(fc);
+}
+
 /** Start time tracking for a request, and mark it as runnable.
  *
  */
@@ -472,6 +709,8 @@ static void worker_request_time_tracking_start(fr_worker_t *worker, request_t *r
 	fr_time_tracking_yield(&request->async->tracking, now);
 	worker->num_active++;
 
+	worker_fair_start(worker, request);
+
 	fr_assert(request->runnable_id < 0);
 	(void) fr_heap_insert(worker->runnable, request);
 
@@ -484,6 +723,8 @@ static void worker_request_time_tracking_end(fr_worker_t *worker, request_t *req
 	fr_assert(worker->num_active > 0);
 	worker->num_active--;
 
+	worker_fair_end(worker, request);
+
 	if (fr_heap_entry_inserted(request->time_order_id)) (void) fr_heap_extract(worker->time_order, request);
 }
 
@@ -564,6 +805,16 @@ static void worker_send_reply(fr_worker_t *worker, request_t *request, size_t si
 		(void) fr_message_alloc(ms, &reply->m, slen);
 	}
 
+	/*
+	 *	The reply has been encoded, so we no longer need the
+	 *	original packet.  Let the network thread re-use it.
+	 */
+	if (request->async->pinned) {
+		TALLOC_FREE(request->async->pinned);
+		request->packet->data = NULL;
+		request->packet->data_len = 0;
+	}
+
 	/*
 	 *	Fill in the rest of the fields in the channel message.
 	 *
@@ -576,6 +827,7 @@ static void worker_send_reply(fr_worker_t *worker, request_t *request, size_t si
 
 	reply->listen = request->async->listen;
 	reply->packet_ctx = request->async->packet_ctx;
+	reply->reply.stolen_from = request->async->stolen_from;
 
 	/*
 	 *	Update the various timers.
@@ -585,6 +837,9 @@ static void worker_send_reply(fr_worker_t *worker, request_t *request, size_t si
 
 	RDEBUG("Finished request");
 
+	FR_PROBE4(worker_reply, request->number, request->reply->code,
+		  now - reply->reply.request_time, reply->reply.processing_time);
+
 	/*
 	 *	Send the reply, which also polls the request queue.
 	 */
@@ -608,6 +863,7 @@ static void worker_send_reply(fr_worker_t *worker, request_t *request, size_t si
 	request->async->el = NULL;
 	request->async->process = NULL;
 	request->async->channel = NULL;
+	request->async->stolen_from = NULL;
 	request->async->packet_ctx = NULL;
 	request->async->listen = NULL;
 #endif
@@ -657,6 +913,32 @@ void worker_request_init(fr_worker_t *worker, request_t *request, fr_time_t now)
 	request->async->el = worker->el;
 }
 
+static int _worker_message_unpin(fr_message_t **pinned)
+{
+	fr_message_done(*pinned);
+	return 0;
+}
+
+/** Keep a received message until the request is done with it
+ *
+ *  The decoder pointed packet->data at the message, instead of
+ *  copying it.  The message is released when we send the reply, or
+ *  when the request is freed, whichever is first.
+ *
+ * @param[in] request	which uses the message.
+ * @param[in] m		the message.
+ */
+static void worker_message_pin(request_t *request, fr_message_t *m)
+{
+	fr_message_t **pinned;
+
+	MEM(pinned = talloc(request->async, fr_message_t *));
+	*pinned = m;
+	talloc_set_destructor(pinned, _worker_message_unpin);
+
+	request->async->pinned = pinned;
+}
+
 static inline CC_HINT(always_inline)
 void worker_request_name_number(request_t *request)
 {
@@ -665,6 +947,162 @@ void worker_request_name_number(request_t *request)
 	request->name = itoa_internal(request, request->number);
 }
 
+static int _worker_debug_ring_free(worker_debug_ring_t *ring)
+{
+	pthread_mutex_destroy(&ring->mutex);
+	return 0;
+}
+
+/** Allocate the ring for the debug output of sampled requests
+ *
+ */
+static worker_debug_ring_t *worker_debug_ring_alloc(TALLOC_CTX *ctx, size_t size)
+{
+	worker_debug_ring_t *ring;
+
+	ring = talloc_zero(ctx, worker_debug_ring_t);
+	if (!ring) return NULL;
+
+	ring->buffer = talloc_array(ring, char, size);
+	if (!ring->buffer) {
+		talloc_free(ring);
+		return NULL;
+	}
+	ring->size = size;
+
+	pthread_mutex_init(&ring->mutex, NULL);
+	talloc_set_destructor(ring, _worker_debug_ring_free);
+
+	return ring;
+}
+
+/** Append output to the ring, overwriting the oldest output if necessary
+ *
+ */
+static void worker_debug_ring_write(worker_debug_ring_t *ring, char const *msg, size_t len)
+{
+	size_t chunk;
+
+	if (len > ring->size) {
+		msg += len - ring->size;
+		len = ring->size;
+	}
+
+	pthread_mutex_lock(&ring->mutex);
+	chunk = ring->size - ring->head;
+	if (chunk > len) chunk = len;
+
+	memcpy(ring->buffer + ring->head, msg, chunk);
+	if (chunk < len) memcpy(ring->buffer, msg + chunk, len - chunk);
+
+	ring->head += len;
+	if (ring->head >= ring->size) {
+		ring->head -= ring->size;
+		ring->wrapped = true;
+	}
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+/** Log function for sampled requests
+ *
+ *  Messages which would have been logged anyway are sent to the
+ *  normal destination.  Everything up to the sampling level is
+ *  written to the worker's ring.
+ */
+static void worker_debug_sample_log(fr_log_type_t type, fr_log_lvl_t lvl, request_t *request,
+				    char const *file, int line,
+				    char const *fmt, va_list ap, void *uctx)
+{
+	fr_worker_t	*worker = talloc_get_type_abort(uctx, fr_worker_t);
+	char		*msg, *out;
+	char const	*extra = "";
+	va_list		aq;
+
+	if (lvl <= fr_debug_lvl) {
+		va_copy(aq, ap);
+		vlog_request(type, lvl, request, file, line, fmt, aq, UNCONST(fr_log_t *, worker->log));
+		va_end(aq);
+	}
+
+	if (!log_rdebug_enabled(lvl, request)) return;
+
+	va_copy(aq, ap);
+	msg = fr_vasprintf(NULL, fmt, aq);
+	va_end(aq);
+	if (!msg) return;
+
+	switch (type) {
+	case L_DBG_WARN:
+	case L_DBG_WARN_REQ:
+	case L_WARN:
+		extra = "WARNING: ";
+		break;
+
+	case L_DBG_ERR:
+	case L_DBG_ERR_REQ:
+	case L_ERR:
+		extra = "ERROR: ";
+		break;
+
+	default:
+		break;
+	}
+
+	out = talloc_asprintf(msg, "(%s)  %*s%s%s%s%s\n",
+			      request->name, request->log.unlang_indent, "",
+			      request->module ? request->module : "",
+			      request->module ? " - " : "",
+			      extra, msg);
+	if (out) worker_debug_ring_write(worker->debug_ring, out, talloc_array_length(out) - 1);
+
+	talloc_free(msg);
+}
+
+/** Tell the channel that we've "eaten" a request, and won't reply to it
+ *
+ * Stolen requests didn't use up a sequence number on our channel, so
+ * there's nothing to do for them.
+ */
+static inline CC_HINT(always_inline) void worker_null_reply(request_t *request)
+{
+	if (request->async->stolen_from) return;
+
+	fr_channel_null_reply(request->async->channel);
+}
+
+/** Decide whether a new request should have its debug output sampled
+ *
+ *  Requests are sampled if they come from the configured network,
+ *  and then one in every debug_sample_rate of those.
+ */
+static void worker_debug_sample(fr_worker_t *worker, request_t *request)
+{
+	if (!worker->debug_ring) return;
+
+	if (fr_debug_lvl >= worker->config.debug_sample_lvl) return;
+
+	if (worker->config.debug_sample_src.af != AF_UNSPEC) {
+		fr_ipaddr_t src = request->packet->socket.inet.src_ipaddr;
+
+		if (src.af != worker->config.debug_sample_src.af) return;
+
+		fr_ipaddr_mask(&src, worker->config.debug_sample_src.prefix);
+		src.scope_id = worker->config.debug_sample_src.scope_id;
+		if (fr_ipaddr_cmp(&src, &worker->config.debug_sample_src) != 0) return;
+	}
+
+	if (worker->config.debug_sample_rate > 1) {
+		if (++worker->debug_sample_count < worker->config.debug_sample_rate) return;
+		worker->debug_sample_count = 0;
+	}
+
+	worker->num_sampled++;
+
+	request->log.lvl = worker->config.debug_sample_lvl;
+	request->log.dst->func = worker_debug_sample_log;
+	request->log.dst->uctx = worker;
+}
+
 static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd, fr_time_t now)
 {
 	bool			is_dup;
@@ -672,9 +1110,31 @@ static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd,
 	request_t		*request;
 	TALLOC_CTX		*ctx;
 	fr_listen_t const	*listen;
+	bool			overloaded;
 
 	if (fr_heap_num_elements(worker->time_order) >= (uint32_t) worker->config.max_requests) goto nak;
 
+	/*
+	 *	We're busy.  Don't spend CPU decoding low priority
+	 *	requests (e.g. Accounting-Request), so that the high
+	 *	priority ones (e.g. Access-Request) are processed.
+	 */
+	if (worker->config.queue_watermark && (cd->priority < PRIORITY_NORMAL) &&
+	    (fr_heap_num_elements(worker->runnable) >= worker->config.queue_watermark)) {
+		worker->num_shed++;
+		goto nak;
+	}
+
+	/*
+	 *	Latency shows that we already have as many requests as
+	 *	we can usefully run.  Refuse this one now, instead of
+	 *	queueing it until the client gives up.  If the
+	 *	protocol can't send a "go away" reply, then we don't
+	 *	need to decode the packet.
+	 */
+	overloaded = !fr_limiter_allow(&worker->limiter, worker->num_active);
+	if (overloaded && !cd->listen->app->overload) goto nak;
+
 	ctx = request = request_alloc_external(NULL, NULL);
 	if (!request) goto nak;
 
@@ -698,11 +1158,13 @@ static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd,
 	 *	Update the transport-specific fields.
 	 */
 	request->async->channel = cd->channel.ch;
+	request->async->stolen_from = cd->channel.stolen_from;
 
 	request->async->recv_time = cd->request.recv_time;
 
 	request->async->listen = cd->listen;
 	request->async->packet_ctx = cd->packet_ctx;
+	request->async->zero_copy = worker->config.zero_copy;
 	listen = request->async->listen;
 
 	/*
@@ -723,6 +1185,41 @@ nak:
 		return;
 	}
 
+	worker_debug_sample(worker, request);
+
+	FR_PROBE3(worker_request, request->number, request->packet->code, request->async->recv_time);
+
+	/*
+	 *	Let the protocol set a reply, and send it without
+	 *	running the virtual server.
+	 */
+	if (overloaded) {
+		if (listen->app->overload(listen->app_instance, request) < 0) {
+			talloc_free(ctx);
+			goto nak;
+		}
+
+		RDEBUG("Server is overloaded - refusing request");
+		worker_send_reply(worker, request, 0, now);
+		fr_message_done(&cd->m);
+		talloc_free(request);
+		return;
+	}
+
+	/*
+	 *	The request is no use if the client has given up on
+	 *	it.  Clients without their own deadline use the
+	 *	worker default, and then max_request_time.
+	 */
+	if (request->client && request->client->request_deadline) {
+		request->async->deadline = request->async->recv_time + request->client->request_deadline;
+	} else if (worker->config.request_deadline) {
+		request->async->deadline = request->async->recv_time + worker->config.request_deadline;
+	} else {
+		request->async->deadline = request->async->recv_time + worker->config.max_request_time;
+	}
+	request->deadline = request->async->deadline;
+
 	/*
 	 *	Set the entry point for this virtual server.
 	 */
@@ -733,10 +1230,15 @@ nak:
 	}
 
 	/*
-	 *	We're done with this message.
+	 *	We're done with this message, unless the decoder
+	 *	used it in place.
 	 */
 	is_dup = cd->request.is_dup;
-	fr_message_done(&cd->m);
+	if (request->packet->data && (request->packet->data == cd->m.data)) {
+		worker_message_pin(request, &cd->m);
+	} else {
+		fr_message_done(&cd->m);
+	}
 
 	/*
 	 *	Look for conflicting / duplicate packets, but only if
@@ -753,7 +1255,7 @@ nak:
 			 */
 			if (is_dup) {
 				RDEBUG("Got duplicate packet notice after we had sent a reply - ignoring");
-				fr_channel_null_reply(request->async->channel);
+				worker_null_reply(request);
 				talloc_free(request);
 				return;
 			}
@@ -783,7 +1285,7 @@ nak:
 		if (old->async->recv_time == request->async->recv_time) {
 			RWARN("Discarding duplicate of request (%"PRIu64")", old->number);
 
-			fr_channel_null_reply(request->async->channel);
+			worker_null_reply(request);
 			talloc_free(request);
 
 			/*
@@ -826,7 +1328,30 @@ static int8_t worker_runnable_cmp(void const *one, void const *two)
 	request_t const *a = one, *b = two;
 	int ret;
 
-	ret = CMP(a->async->priority, b->async->priority);
+	/*
+	 *	Higher priority requests run first.
+	 */
+	ret = CMP(b->async->priority, a->async->priority);
+	if (ret != 0) return ret;
+
+	/*
+	 *	Finish the requests we've started, before starting
+	 *	new ones.
+	 */
+	ret = CMP(b->async->started, a->async->started);
+	if (ret != 0) return ret;
+
+	/*
+	 *	Then the request with the earliest virtual start
+	 *	time.  Without fair queueing, these are all the same.
+	 */
+	ret = CMP(a->async->vtime, b->async->vtime);
+	if (ret != 0) return ret;
+
+	/*
+	 *	Then run the request whose client will give up first.
+	 */
+	ret = CMP(a->async->deadline, b->async->deadline);
 	if (ret != 0) return ret;
 
 	return CMP(a->async->recv_time, b->async->recv_time);
@@ -875,6 +1400,18 @@ void fr_worker_destroy(fr_worker_t *worker)
 
 //	WORKER_VERIFY;
 
+	/*
+	 *	Stop exporting our statistics before we start
+	 *	freeing the structures they're read from.
+	 */
+	TALLOC_FREE(worker->metrics);
+
+	/*
+	 *	Other workers must not see our channels while we
+	 *	free them.
+	 */
+	worker_steal_remove(worker);
+
 	/*
 	 *	Stop any new requests running with this interpreter
 	 */
@@ -973,6 +1510,8 @@ static void _worker_request_done_external(request_t *request, UNUSED rlm_rcode_t
 		      "Request %s stack depth %u > 0", request->name, unlang_interpret_stack_depth(request));
 	RDEBUG("Done request");
 
+	fr_limiter_sample(&worker->limiter, now - request->async->recv_time, worker->num_active);
+
 	/*
 	 *	The request is done.  Track that.
 	 */
@@ -1160,6 +1699,10 @@ static inline CC_HINT(always_inline) void worker_run_request(fr_worker_t *worker
 
 	now = start;
 
+	if (fr_heap_num_elements(worker->runnable) == 0) return;
+
+	if (worker->steal) atomic_store_explicit(&worker->steal->slot[worker->steal_id].busy, true, memory_order_relaxed);
+
 	/*
 	 *	Busy-loop running requests for 0.1ms.  another
 	 *	request.  This change means that the worker checks the
@@ -1178,15 +1721,160 @@ static inline CC_HINT(always_inline) void worker_run_request(fr_worker_t *worker
 		 */
 		if (request->async->channel && !fr_channel_active(request->async->channel)) {
 			worker_stop_request(&request);
-			return;
+			break;
 		}
 
+		/*
+		 *	The request waited so long that the client has
+		 *	given up on it.  Don't waste any more time on
+		 *	it.  Once a request has started running, it
+		 *	runs to completion, or until max_request_time.
+		 */
+		if (!request->async->started) {
+			if (request->async->deadline && (now > request->async->deadline)) {
+				RDEBUG("Request waited %pV to run, and the client has given up on it - discarding",
+				       fr_box_time_delta(now - request->async->recv_time));
+				worker->num_expired++;
+				worker_stop_request(&request);
+				continue;
+			}
+			request->async->started = true;
+		}
+
+		if (request->async->vtime > worker->vtime) worker->vtime = request->async->vtime;
+
 		(void)unlang_interpret(request);
 
 		now = fr_time();
 	}
+
+	if (worker->steal) atomic_store_explicit(&worker->steal->slot[worker->steal_id].busy, false, memory_order_relaxed);
 }
 
+/** Steal a request which is queued for a busy worker
+ *
+ *  Only requests which are still in the other worker's inbound
+ *  channel are taken.  Those haven't been bootstrapped, so nothing
+ *  else in the other worker refers to them.
+ *
+ *  Duplicate detection still works for stolen requests.  The
+ *  network side tracks each packet until it's been replied to, and
+ *  deals with retransmissions itself, so duplicates don't need to go
+ *  to the worker which has the original.
+ *
+ * @param[in] worker	the idle worker.
+ * @param[in] now	the current time.
+ * @return
+ *	- true if a request was stolen.
+ *	- false if there was nothing to steal.
+ */
+static bool worker_steal(fr_worker_t *worker, fr_time_t now)
+{
+	int			i, j, k, num, start, id;
+	fr_channel_t		*ch;
+	fr_channel_data_t	*cd = NULL;
+	fr_worker_steal_t	*steal = worker->steal;
+	worker_steal_slot_t	*slot;
+
+	if (!steal) return false;
+
+	num = atomic_load(&steal->num_workers);
+	if (num < 2) return false;
+
+	/*
+	 *	Tell workers which are removing channels to wait for
+	 *	us.  This has to be done before we look at the
+	 *	channels, so that either they see us stealing, or we
+	 *	see the channel removed.
+	 */
+	slot = &steal->slot[worker->steal_id];
+	atomic_store(&slot->stealing, true);
+	if (atomic_load(&steal->stopped)) goto done;
+
+	/*
+	 *	Start at a random worker, so that all of the idle
+	 *	workers don't pick on the same busy one.
+	 */
+	start = fr_rand() % num;
+
+	for (i = 0; i < num; i++) {
+		id = (start + i) % num;
+		if (id == worker->steal_id) continue;
+
+		if (!atomic_load_explicit(&steal->slot[id].busy, memory_order_relaxed)) continue;
+
+		for (j = 0; j < steal->max_channels; j++) {
+			ch = atomic_load(&steal->channel[(id * steal->max_channels) + j]);
+			if (!ch) continue;
+
+			/*
+			 *	Find our channel to the same network.
+			 */
+			for (k = 0; k < worker->config.max_channels; k++) {
+				if (!worker->channel[k]) continue;
+
+				cd = fr_channel_steal_request(ch, worker->channel[k]);
+				if (cd) goto done;
+			}
+		}
+	}
+
+done:
+	atomic_store(&slot->stealing, false);
+	if (!cd) return false;
+
+	worker->stats.in++;
+	worker->num_stolen++;
+	DEBUG3("Stole request from worker %d", id);
+	worker_request_bootstrap(worker, cd, now);
+
+	return true;
+}
+
+static fr_metric_def_t const worker_metrics[] = {
+	{ .name = "requests", .help = "Requests received from the network threads.", .type = FR_METRIC_COUNTER },
+	{ .name = "replies", .help = "Replies sent to the network threads.", .type = FR_METRIC_COUNTER },
+	{ .name = "duplicates", .help = "Duplicate requests received.", .type = FR_METRIC_COUNTER },
+	{ .name = "dropped", .help = "Requests dropped.", .type = FR_METRIC_COUNTER },
+	{ .name = "naks", .help = "Requests refused, and sent back to the network threads.", .type = FR_METRIC_COUNTER },
+	{ .name = "stolen", .help = "Requests stolen from other workers.", .type = FR_METRIC_COUNTER },
+	{ .name = "expired", .help = "Requests discarded because the client had given up.", .type = FR_METRIC_COUNTER },
+	{ .name = "shed", .help = "Low priority requests discarded because the worker was busy.", .type = FR_METRIC_COUNTER },
+	{ .name = "limited", .help = "Requests refused by the adaptive concurrency limit.", .type = FR_METRIC_COUNTER },
+	{ .name = "concurrency_limit", .help = "Current adaptive limit on active requests.", .type = FR_METRIC_GAUGE },
+	{ .name = "active", .help = "Requests currently being processed.", .type = FR_METRIC_GAUGE },
+	{ .name = "runnable", .help = "Requests waiting to run.", .type = FR_METRIC_GAUGE },
+	{ .name = "request_cpu_seconds", .help = "CPU time spent processing each request.", .type = FR_METRIC_HISTOGRAM },
+	{ .name = "request_seconds", .help = "Time from receiving each request to sending its reply.", .type = FR_METRIC_HISTOGRAM },
+};
+
+static void worker_metrics_snapshot(uint64_t *values, void const *uctx)
+{
+	fr_worker_t const *worker = uctx;
+
+	values[0] = worker->stats.in;
+	values[1] = worker->stats.out;
+	values[2] = worker->stats.dup;
+	values[3] = worker->stats.dropped;
+	values[4] = worker->num_naks;
+	values[5] = worker->num_stolen;
+	values[6] = worker->num_expired;
+	values[7] = worker->num_shed;
+	values[8] = worker->limiter.rejected;
+	values[9] = fr_limiter_limit(&worker->limiter);
+	values[10] = worker->num_active;
+	values[11] = fr_heap_num_elements(worker->runnable);
+	memcpy(values + 12, worker->cpu_time.array, sizeof(worker->cpu_time.array));
+	memcpy(values + 12 + FR_METRIC_HISTOGRAM_BUCKETS, worker->wall_clock.array, sizeof(worker->wall_clock.array));
+}
+
+static fr_metrics_class_t const worker_metrics_class = {
+	.name = "worker",
+	.defs = worker_metrics,
+	.num_defs = NUM_ELEMENTS(worker_metrics),
+	.snapshot = worker_metrics_snapshot
+};
+
 /** Create a worker
  *
  * @param[in] ctx the talloc context
@@ -1228,6 +1916,11 @@ nomem:
 	CHECK_CONFIG(ring_buffer_size, (1 << 17), (1 << 20));
 	CHECK_CONFIG(max_request_time, fr_time_delta_from_sec(30), fr_time_delta_from_sec(60));
 
+	if (worker->config.spin_budget > fr_time_delta_from_msec(1)) worker->config.spin_budget = fr_time_delta_from_msec(1);
+	worker->spin_budget = worker->config.spin_budget;
+
+	fr_limiter_init(&worker->limiter, &worker->config.concurrency);
+
 	worker->channel = talloc_zero_array(worker, fr_channel_t *, worker->config.max_channels);
 	if (!worker->channel) {
 		talloc_free(worker);
@@ -1235,10 +1928,34 @@ nomem:
 	}
 
 	worker->thread_id = pthread_self();
+	worker->numa_node = -1;
+
+	/*
+	 *	Keep enough free requests for our peak load, up to
+	 *	the maximum number of requests we will process.
+	 */
+	worker->request_pool = request_pool_thread_init(worker->config.max_requests, worker->config.talloc_pool_size,
+							worker->config.request_arena_size);
 	worker->el = el;
 	worker->log = logger;
 	worker->lvl = lvl;
 
+	/*
+	 *	Sample requests for debugging if we're told which
+	 *	ones, or how many.
+	 */
+	if (worker->config.debug_sample_rate || (worker->config.debug_sample_src.af != AF_UNSPEC)) {
+		if (!worker->config.debug_sample_lvl) worker->config.debug_sample_lvl = L_DBG_LVL_2;
+		if (worker->config.debug_sample_lvl > L_DBG_LVL_MAX) worker->config.debug_sample_lvl = L_DBG_LVL_MAX;
+		CHECK_CONFIG(debug_sample_ring_size, 4096, (1 << 30));
+
+		worker->debug_ring = worker_debug_ring_alloc(worker, worker->config.debug_sample_ring_size);
+		if (!worker->debug_ring) {
+			talloc_free(worker);
+			goto nomem;
+		}
+	}
+
 	/*
 	 *	The worker thread starts now.  Manually initialize it,
 	 *	because we're tracking request time, not the time that
@@ -1283,6 +2000,13 @@ nomem:
 		goto fail;
 	}
 
+	worker->fair_clients = fr_rb_inline_talloc_alloc(worker, worker_fair_client_t, node,
+							 worker_fair_client_cmp, NULL);
+	if (!worker->fair_clients) {
+		fr_strerror_const("Failed creating fair queueing tree");
+		goto fail;
+	}
+
 	worker->intp = unlang_interpret_init(worker, el,
 					     &(unlang_request_func_t){
 							.init_internal = _worker_request_internal_init,
@@ -1306,10 +2030,76 @@ nomem:
 	}
 	unlang_interpret_set_thread_default(worker->intp);
 
+	worker->metrics = fr_metrics_source_add(worker, &worker_metrics_class, worker, "worker", worker->name, NULL);
+	if (!worker->metrics) {
+		fr_strerror_const("Failed registering worker metrics");
+		goto fail;
+	}
+
 	return worker;
 }
 
 
+/** Poll the channels for new requests, before going to sleep
+ *
+ *  The requestors don't signal us while we're polling, which saves
+ *  a kevent wakeup for every packet at high packet rates.
+ *
+ *  The time we spend polling adapts to the traffic.  It's halved
+ *  every time we find nothing, and reset to the configured budget
+ *  when we find a request, or when we're signalled.  An idle worker
+ *  therefore stops polling quickly.
+ *
+ * @param[in] worker	the worker.
+ * @return
+ *	- true if we received a request.
+ *	- false if there was nothing to do.
+ */
+static bool worker_spin(fr_worker_t *worker)
+{
+	int		i;
+	bool		found = false;
+	fr_time_t	end;
+
+	if (!worker->spin_budget) return false;
+
+	for (i = 0; i < worker->config.max_channels; i++) {
+		if (worker->channel[i]) fr_channel_responder_poll_start(worker->channel[i]);
+	}
+
+	end = fr_time() + worker->spin_budget;
+	do {
+		for (i = 0; i < worker->config.max_channels; i++) {
+			if (!worker->channel[i]) continue;
+
+			while (fr_channel_recv_request(worker->channel[i])) found = true;
+		}
+
+		if (!found && worker_steal(worker, fr_time())) found = true;
+	} while (!found && (fr_time() < end));
+
+	/*
+	 *	A requestor may have pushed a request without
+	 *	signalling us, just before we stopped polling.
+	 */
+	for (i = 0; i < worker->config.max_channels; i++) {
+		if (!worker->channel[i]) continue;
+
+		fr_channel_responder_poll_stop(worker->channel[i]);
+		while (fr_channel_recv_request(worker->channel[i])) found = true;
+	}
+
+	if (found) {
+		worker->num_spin_hits++;
+		worker->spin_budget = worker->config.spin_budget;
+	} else {
+		worker->num_spin_misses++;
+		worker->spin_budget /= 2;
+	}
+
+	return found;
+}
+
 /** The main loop and entry point of the worker thread.
  *
  * @param[in] worker the worker data structure to manage
@@ -1329,6 +2119,9 @@ void fr_worker(fr_worker_t *worker)
 		 *	the event loop, but we don't wait for events.
 		 */
 		wait_for_event = (fr_heap_num_elements(worker->runnable) == 0);
+		if (wait_for_event && worker_spin(worker)) wait_for_event = false;
+
+		if (wait_for_event && worker_steal(worker, fr_time())) wait_for_event = false;
 		if (wait_for_event) {
 			DEBUG4("Ready to process requests");
 		}
@@ -1451,6 +2244,109 @@ fr_channel_t *fr_worker_channel_create(fr_worker_t *worker, TALLOC_CTX *ctx, fr_
 	return ch;
 }
 
+/** Set the NUMA node which this worker runs on
+ *
+ * @param[in] worker	the worker.
+ * @param[in] node	the NUMA node, or -1 for none.
+ */
+void fr_worker_numa_node_set(fr_worker_t *worker, int node)
+{
+	worker->numa_node = node;
+}
+
+/** Return the NUMA node which this worker runs on
+ *
+ * @param[in] worker	the worker.
+ * @return the NUMA node, or -1 for none.
+ */
+int fr_worker_numa_node(fr_worker_t const *worker)
+{
+	return worker->numa_node;
+}
+
+/** Allocate a group of workers which can steal requests from each other
+ *
+ * @param[in] ctx		to allocate the group in.  Must outlive all of the workers.
+ * @param[in] max_workers	the maximum number of workers in the group.
+ * @param[in] max_channels	the maximum number of channels each worker has,
+ *				i.e. the number of network threads.
+ * @return
+ *	- NULL on error.
+ *	- the steal group.
+ */
+fr_worker_steal_t *fr_worker_steal_alloc(TALLOC_CTX *ctx, int max_workers, int max_channels)
+{
+	fr_worker_steal_t *steal;
+
+	steal = talloc_zero(ctx, fr_worker_steal_t);
+	if (!steal) return NULL;
+
+	steal->slot = talloc_zero_array(steal, worker_steal_slot_t, max_workers);
+	steal->channel = talloc_zero_array(steal, _Atomic(fr_channel_t *), max_workers * max_channels);
+	if (!steal->slot || !steal->channel) {
+		talloc_free(steal);
+		return NULL;
+	}
+
+	steal->max_workers = max_workers;
+	steal->max_channels = max_channels;
+
+	return steal;
+}
+
+/** Add a worker to a steal group
+ *
+ * This should be called from the worker's thread, before the worker
+ * starts processing requests.
+ *
+ * @param[in] steal	the steal group.
+ * @param[in] worker	to add.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int fr_worker_steal_add(fr_worker_steal_t *steal, fr_worker_t *worker)
+{
+	int i, id;
+
+	if (!worker->config.steal_requests) return 0;
+
+	/*
+	 *	The slot is zeroed, so other workers ignore it until
+	 *	we publish our channels.
+	 */
+	id = atomic_load(&steal->num_workers);
+	do {
+		if (id >= steal->max_workers) {
+			fr_strerror_const("Too many workers in steal group");
+			return -1;
+		}
+	} while (!atomic_compare_exchange_weak(&steal->num_workers, &id, id + 1));
+
+	worker->steal = steal;
+	worker->steal_id = id;
+
+	for (i = 0; i < worker->config.max_channels; i++) {
+		if (worker->channel[i]) worker_channel_set(worker, i, worker->channel[i]);
+	}
+
+	return 0;
+}
+
+/** Stop all stealing in a group
+ *
+ * This MUST be called before the channels between the workers and
+ * the network threads are closed.  Once it returns, no worker is in
+ * the middle of stealing a request.
+ *
+ * @param[in] steal	the steal group.
+ */
+void fr_worker_steal_stop(fr_worker_steal_t *steal)
+{
+	atomic_store(&steal->stopped, true);
+	worker_steal_sync(steal, -1);
+}
+
 #ifdef WITH_VERIFY_PTR
 /** Verify the worker data structures.
  *
@@ -1513,6 +2409,19 @@ static int cmd_stats_worker(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_inf
 		fprintf(fp, "count.naks\t\t\t%" PRIu64 "\n", worker->num_naks);
 		fprintf(fp, "count.active\t\t\t%" PRIu64 "\n", worker->num_active);
 		fprintf(fp, "count.runnable\t\t\t%u\n", fr_heap_num_elements(worker->runnable));
+		fprintf(fp, "count.stolen\t\t\t%" PRIu64 "\n", worker->num_stolen);
+		fprintf(fp, "count.expired\t\t\t%" PRIu64 "\n", worker->num_expired);
+		fprintf(fp, "count.shed\t\t\t%" PRIu64 "\n", worker->num_shed);
+		if (fr_limiter_enabled(&worker->limiter)) {
+			fprintf(fp, "count.limited\t\t\t%" PRIu64 "\n", worker->limiter.rejected);
+			fprintf(fp, "concurrency.limit\t\t%u\n", fr_limiter_limit(&worker->limiter));
+		}
+		if (worker->debug_ring) fprintf(fp, "count.sampled\t\t\t%" PRIu64 "\n", worker->num_sampled);
+		if (worker->config.spin_budget) {
+			fprintf(fp, "spin.budget\t\t\t%" PRId64 "\n", worker->spin_budget);
+			fprintf(fp, "spin.hits\t\t\t%" PRIu64 "\n", worker->num_spin_hits);
+			fprintf(fp, "spin.misses\t\t\t%" PRIu64 "\n", worker->num_spin_misses);
+		}
 	}
 
 	if ((info->argc == 0) || (strcmp(info->argv[0], "cpu") == 0)) {
@@ -1533,9 +2442,86 @@ static int cmd_stats_worker(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_inf
 		fr_time_elapsed_fprint(fp, &worker->wall_clock, "time.requests", 4);
 	}
 
+	if (((info->argc == 0) || (strcmp(info->argv[0], "requests") == 0)) && worker->request_pool) {
+		request_pool_stats_t pool;
+
+		request_pool_stats(worker->request_pool, &pool);
+
+		fprintf(fp, "requests.free_list_hits\t\t%" PRIu64 "\n", pool.hits);
+		fprintf(fp, "requests.free_list_misses\t%" PRIu64 "\n", pool.misses);
+		fprintf(fp, "requests.pool_overflows\t\t%" PRIu64 "\n", pool.overflows);
+		fprintf(fp, "requests.active\t\t\t%u\n", pool.active);
+		fprintf(fp, "requests.peak\t\t\t%u\n", pool.peak);
+		fprintf(fp, "requests.free\t\t\t%u\n", pool.free);
+		fprintf(fp, "requests.pool_size\t\t%zu\n", pool.pool_size);
+		fprintf(fp, "requests.arena_size\t\t%zu\n", pool.arena_size);
+	}
+
+	return 0;
+}
+
+static int cmd_show_worker_debug(FILE *fp, FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	fr_worker_t const	*worker = ctx;
+	worker_debug_ring_t	*ring = worker->debug_ring;
+	char			*out, *start;
+	size_t			len;
+
+	if (!ring) {
+		fprintf(fp_err, "Debug sampling is not enabled.\n");
+		return -1;
+	}
+
+	/*
+	 *	Copy the output so that we don't block the worker
+	 *	while writing to radmin.
+	 */
+	out = talloc_array(NULL, char, ring->size);
+	if (!out) return -1;
+
+	pthread_mutex_lock(&ring->mutex);
+	if (ring->wrapped) {
+		len = ring->size;
+		memcpy(out, ring->buffer + ring->head, ring->size - ring->head);
+		memcpy(out + (ring->size - ring->head), ring->buffer, ring->head);
+	} else {
+		len = ring->head;
+		memcpy(out, ring->buffer, len);
+	}
+	pthread_mutex_unlock(&ring->mutex);
+
+	/*
+	 *	The oldest line was partly overwritten.
+	 */
+	start = out;
+	if (ring->wrapped) {
+		char *p;
+
+		p = memchr(out, '\n', len);
+		start = p ? p + 1 : out + len;
+	}
+
+	fwrite(start, 1, len - (start - out), fp);
+	talloc_free(out);
+
 	return 0;
 }
 
+static int cmd_show_worker_profile(FILE *fp, FILE *fp_err, void *ctx, fr_cmd_info_t const *info)
+{
+	fr_worker_t const *worker = ctx;
+
+	return unlang_interpret_profile_print(fp, fp_err, worker->intp,
+					      (info->argc > 0) && (strcmp(info->argv[0], "folded") == 0));
+}
+
+static int cmd_show_worker_memory(FILE *fp, FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	fr_worker_t const *worker = ctx;
+
+	return unlang_interpret_memory_print(fp, fp_err, worker->intp);
+}
+
 fr_cmd_table_t cmd_worker_table[] = {
 	{
 		.parent = "stats",
@@ -1548,11 +2534,46 @@ fr_cmd_table_t cmd_worker_table[] = {
 		.parent = "stats worker",
 		.add_name = true,
 		.name = "self",
-		.syntax = "[(count|cpu)]",
+		.syntax = "[(count|cpu|requests)]",
 		.func = cmd_stats_worker,
 		.help = "Show statistics for a specific worker thread.",
 		.read_only = true
 	},
 
+	{
+		.parent = "show",
+		.name = "worker",
+		.help = "Show information about worker threads.",
+		.read_only = true
+	},
+
+	{
+		.parent = "show worker",
+		.add_name = true,
+		.name = "debug",
+		.func = cmd_show_worker_debug,
+		.help = "Show the debug output of sampled requests.",
+		.read_only = true
+	},
+
+	{
+		.parent = "show worker",
+		.add_name = true,
+		.name = "profile",
+		.syntax = "[folded]",
+		.func = cmd_show_worker_profile,
+		.help = "Show the time spent in each module call and section.  'folded' prints stacks for flame graphs.",
+		.read_only = true
+	},
+
+	{
+		.parent = "show worker",
+		.add_name = true,
+		.name = "memory",
+		.func = cmd_show_worker_memory,
+		.help = "Show the most memory used by a request in each virtual server, and how many exceeded the budgets.",
+		.read_only = true
+	},
+
 	CMD_TABLE_END
 };
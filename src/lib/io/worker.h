@@ -45,6 +45,7 @@ typedef struct fr_worker_s fr_worker_t;
 #include <freeradius-devel/server/command.h>
 #include <freeradius-devel/util/event.h>
 #include <freeradius-devel/util/heap.h>
+#include <freeradius-devel/util/limiter.h>
 #include <freeradius-devel/util/log.h>
 #include <freeradius-devel/util/talloc.h>
 
@@ -66,8 +67,32 @@ typedef struct {
 	fr_time_delta_t	max_request_time;	//!< maximum time a request can be processed
 
 	size_t		talloc_pool_size;	//!< for each request
+	size_t		request_arena_size;	//!< for the request-scoped allocations of each request.
+
+	bool		steal_requests;		//!< take queued requests from busy workers when idle.
+
+	fr_time_delta_t	spin_budget;		//!< maximum time to poll the channels before sleeping.
+
+	bool		zero_copy;		//!< decode packets in place, without copying them.
+
+	fr_time_delta_t	request_deadline;	//!< discard requests which haven't started running
+						///< this long after they were received.
+	uint32_t	queue_watermark;	//!< discard low priority requests when this many
+						///< requests are runnable.
+	fr_limiter_conf_t concurrency;		//!< adaptive limit on the number of active requests.
+	bool		fair_queue;		//!< share the worker between clients, by their fair_share.
+
+	uint32_t	debug_sample_rate;	//!< debug one in this many requests.
+	fr_ipaddr_t	debug_sample_src;	//!< only debug requests from this network.
+	fr_log_lvl_t	debug_sample_lvl;	//!< debug level of sampled requests.
+	size_t		debug_sample_ring_size;	//!< how much debug output to keep.
 } fr_worker_config_t;
 
+/** A group of workers which can steal requests from each other
+ *
+ */
+typedef struct fr_worker_steal_s fr_worker_steal_t;
+
 fr_worker_t	*fr_worker_create(TALLOC_CTX *ctx, fr_event_list_t *el, char const *name,
 				  fr_log_t const *logger, fr_log_lvl_t lvl, fr_worker_config_t *config) CC_HINT(nonnull(2,3,4));
 
@@ -85,6 +110,16 @@ fr_channel_t	*fr_worker_channel_create(fr_worker_t *worker, TALLOC_CTX *ctx, fr_
 
 int		fr_worker_stats(fr_worker_t const *worker, int num, uint64_t *stats) CC_HINT(nonnull);
 
+void		fr_worker_numa_node_set(fr_worker_t *worker, int node) CC_HINT(nonnull);
+
+int		fr_worker_numa_node(fr_worker_t const *worker) CC_HINT(nonnull);
+
+fr_worker_steal_t *fr_worker_steal_alloc(TALLOC_CTX *ctx, int max_workers, int max_channels);
+
+int		fr_worker_steal_add(fr_worker_steal_t *steal, fr_worker_t *worker) CC_HINT(nonnull);
+
+void		fr_worker_steal_stop(fr_worker_steal_t *steal) CC_HINT(nonnull);
+
 #include <freeradius-devel/server/module.h>
 
 int		fr_worker_subrequest_add(request_t *request) CC_HINT(nonnull);
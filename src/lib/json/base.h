@@ -235,6 +235,7 @@ extern CONF_PARSER const fr_json_format_config[];
 
 /* jpath .c */
 typedef struct fr_jpath_node fr_jpath_node_t;
+typedef struct fr_jpath_set_s fr_jpath_set_t;
 
 size_t		fr_jpath_escape_func(UNUSED request_t *request, char *out, size_t outlen,
 				     char const *in, UNUSED void *arg);
@@ -243,6 +244,16 @@ int		fr_jpath_evaluate_leaf(TALLOC_CTX *ctx, fr_value_box_list_t *out,
 				       fr_type_t dst_type, fr_dict_attr_t const *dst_enumv,
 				       json_object *root, fr_jpath_node_t const *jpath);
 
+fr_jpath_set_t	*fr_jpath_set_alloc(TALLOC_CTX *ctx);
+
+unsigned int	fr_jpath_set_num(fr_jpath_set_t const *set);
+
+unsigned int	fr_jpath_set_add(fr_jpath_set_t *set, fr_jpath_node_t const *jpath,
+				 fr_type_t dst_type, fr_dict_attr_t const *dst_enumv);
+
+int		fr_jpath_set_evaluate(TALLOC_CTX *ctx, fr_value_box_list_t *out,
+				      fr_jpath_set_t const *set, json_object *root);
+
 char		*fr_jpath_asprint(TALLOC_CTX *ctx, fr_jpath_node_t const *head);
 
 ssize_t		fr_jpath_parse(TALLOC_CTX *ctx, fr_jpath_node_t **head, char const *in, size_t inlen);
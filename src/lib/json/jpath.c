@@ -399,6 +399,312 @@ int fr_jpath_evaluate_leaf(TALLOC_CTX *ctx, fr_value_box_list_t *out,
 	return jpath_evaluate(ctx, out, dst_type, dst_enumv, root, jpath->next);
 }
 
+/** One step in a set of merged jpath expressions
+ *
+ * Expressions which start with the same steps share the nodes for
+ * those steps, so the document is only walked once for each of them.
+ */
+typedef struct jpath_trie_node_s jpath_trie_node_t;
+struct jpath_trie_node_s {
+	fr_jpath_node_t const	*step;		//!< Selectors for this step.  NULL for the root.
+	jpath_trie_node_t	**children;	//!< Steps which follow this one.
+	unsigned int		*leaves;	//!< Expressions which end at this step.
+};
+
+/** An expression in a set, and the type its values are converted to
+ *
+ */
+typedef struct {
+	fr_type_t		dst_type;
+	fr_dict_attr_t const	*dst_enumv;
+} jpath_set_leaf_t;
+
+struct fr_jpath_set_s {
+	jpath_trie_node_t	root;		//!< The current (or root) node of the document.
+	jpath_set_leaf_t	*leaves;	//!< One per expression.
+};
+
+/** Allocate a set of jpath expressions
+ *
+ * @param[in] ctx	to allocate the set in.
+ * @return a new, empty set.
+ */
+fr_jpath_set_t *fr_jpath_set_alloc(TALLOC_CTX *ctx)
+{
+	fr_jpath_set_t *set;
+
+	MEM(set = talloc_zero(ctx, fr_jpath_set_t));
+	MEM(set->root.children = talloc_array(set, jpath_trie_node_t *, 0));
+	MEM(set->root.leaves = talloc_array(set, unsigned int, 0));
+	MEM(set->leaves = talloc_array(set, jpath_set_leaf_t, 0));
+
+	return set;
+}
+
+/** Return the number of expressions in a set
+ *
+ */
+unsigned int fr_jpath_set_num(fr_jpath_set_t const *set)
+{
+	return talloc_array_length(set->leaves);
+}
+
+/** Whether two steps select the same children
+ *
+ */
+static bool jpath_step_cmp(fr_jpath_node_t const *a, fr_jpath_node_t const *b)
+{
+	jpath_selector_t const *sa, *sb;
+
+	for (sa = a->selector, sb = b->selector; sa && sb; sa = sa->next, sb = sb->next) {
+		if (sa->type != sb->type) return false;
+
+		switch (sa->type) {
+		case JPATH_SELECTOR_FIELD:
+			if (strcmp(sa->field, sb->field) != 0) return false;
+			break;
+
+		case JPATH_SELECTOR_INDEX:
+		case JPATH_SELECTOR_SLICE:
+			if (memcmp(sa->slice, sb->slice, sizeof(sa->slice)) != 0) return false;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return (!sa && !sb);
+}
+
+/** Add an expression to a set
+ *
+ * @param[in] set	to add the expression to.
+ * @param[in] jpath	to add.  Must stay valid for the lifetime of the set.
+ * @param[in] dst_type	to convert matched values to.
+ * @param[in] dst_enumv	Enumeration values to allow string to integer conversions.
+ * @return the index of the expression's values in the output of #fr_jpath_set_evaluate.
+ */
+unsigned int fr_jpath_set_add(fr_jpath_set_t *set, fr_jpath_node_t const *jpath,
+			      fr_type_t dst_type, fr_dict_attr_t const *dst_enumv)
+{
+	jpath_trie_node_t	*parent = &set->root;
+	fr_jpath_node_t const	*node;
+	unsigned int		idx, i, num;
+
+	fr_assert((jpath->selector->type == JPATH_SELECTOR_ROOT) ||
+		  (jpath->selector->type == JPATH_SELECTOR_CURRENT));
+
+	for (node = jpath->next; node; node = node->next) {
+		jpath_trie_node_t *child = NULL;
+
+		num = talloc_array_length(parent->children);
+		for (i = 0; i < num; i++) {
+			if (jpath_step_cmp(parent->children[i]->step, node)) {
+				child = parent->children[i];
+				break;
+			}
+		}
+
+		if (!child) {
+			MEM(child = talloc_zero(set, jpath_trie_node_t));
+			child->step = node;
+			MEM(child->children = talloc_array(child, jpath_trie_node_t *, 0));
+			MEM(child->leaves = talloc_array(child, unsigned int, 0));
+
+			MEM(parent->children = talloc_realloc(set, parent->children, jpath_trie_node_t *, num + 1));
+			parent->children[num] = child;
+		}
+
+		parent = child;
+	}
+
+	idx = talloc_array_length(set->leaves);
+	MEM(set->leaves = talloc_realloc(set, set->leaves, jpath_set_leaf_t, idx + 1));
+	set->leaves[idx] = (jpath_set_leaf_t) { .dst_type = dst_type, .dst_enumv = dst_enumv };
+
+	num = talloc_array_length(parent->leaves);
+	MEM(parent->leaves = talloc_realloc(set, parent->leaves, unsigned int, num + 1));
+	parent->leaves[num] = idx;
+
+	return idx;
+}
+
+static int jpath_set_step(TALLOC_CTX *ctx, fr_value_box_list_t *out, fr_jpath_set_t const *set,
+			  json_object *object, jpath_trie_node_t const *tnode);
+
+/** Record values for expressions which end here, and apply the steps which follow
+ *
+ * @return
+ *	- 1 on match.
+ *	- 0 on no match.
+ *	- -1 on error.
+ */
+static int jpath_set_children(TALLOC_CTX *ctx, fr_value_box_list_t *out, fr_jpath_set_t const *set,
+			      json_object *object, jpath_trie_node_t const *tnode)
+{
+	unsigned int	i, num;
+	int		ret;
+	bool		matched = false;
+
+	num = talloc_array_length(tnode->leaves);
+	for (i = 0; i < num; i++) {
+		jpath_set_leaf_t const	*leaf = &set->leaves[tnode->leaves[i]];
+		fr_value_box_t		*value;
+
+		value = fr_value_box_alloc_null(ctx);
+		if (fr_json_object_to_value_box(value, value, object, leaf->dst_enumv, true) < 0) {
+		error:
+			talloc_free(value);
+			return -1;
+		}
+
+		if (fr_value_box_cast_in_place(value, value, leaf->dst_type, leaf->dst_enumv) < 0) goto error;
+
+		fr_dlist_insert_tail(&out[tnode->leaves[i]], value);
+		matched = true;
+	}
+
+	num = talloc_array_length(tnode->children);
+	for (i = 0; i < num; i++) {
+		ret = jpath_set_step(ctx, out, set, object, tnode->children[i]);
+		if (ret < 0) return ret;
+		if (ret == 1) matched = true;
+	}
+
+	return matched ? 1 : 0;
+}
+
+/** Apply one step to a node of the document
+ *
+ * Mirrors jpath_evaluate(), so that values come out in the same order.
+ */
+static int jpath_set_step(TALLOC_CTX *ctx, fr_value_box_list_t *out, fr_jpath_set_t const *set,
+			  json_object *object, jpath_trie_node_t const *tnode)
+{
+	jpath_selector_t const	*selector;
+	bool			matched = false;
+	int			ret = 0;
+	int32_t			i;
+
+#define JPATH_SET_NEXT(_object, _tnode) \
+do { \
+	ret = jpath_set_children(ctx, out, set, _object, _tnode); \
+	if (ret < 0) return ret; \
+	if (ret == 1) matched = true; \
+} while (0)
+
+	switch (tnode->step->selector->type) {
+	case JPATH_SELECTOR_FIELD:
+		if (!json_object_is_type(object, json_type_object)) return 0;
+		if (!json_object_object_get_ex(object, tnode->step->selector->field, &object)) return 0;
+		return jpath_set_children(ctx, out, set, object, tnode);
+
+	case JPATH_SELECTOR_INDEX:
+	case JPATH_SELECTOR_SLICE:
+	{
+		struct array_list *array_obj;
+
+		if (!json_object_is_type(object, json_type_array)) return 0;
+		array_obj = json_object_get_array(object);
+
+		for (selector = tnode->step->selector; selector; selector = selector->next) {
+			int32_t len = (int32_t)(array_obj->length & INT32_MAX);
+			int32_t start, end, step;
+
+			if (selector->type == JPATH_SELECTOR_INDEX) {
+				if ((selector->slice[0] < 0) || (selector->slice[0] >= len)) continue;
+
+				JPATH_SET_NEXT(array_obj->array[selector->slice[0]], tnode);
+				continue;
+			}
+
+			step = selector->slice[2];
+			if (step == SELECTOR_INDEX_UNSET) step = 1;
+
+			start = selector->slice[0];
+			if (start == SELECTOR_INDEX_UNSET) start = (step < 0) ? len - 1 : 0;
+			else if (start < 0) start = len + start;
+
+			end = selector->slice[1];
+			if (end == SELECTOR_INDEX_UNSET) end = (step < 0) ? -1 : len - 1;
+			else if (end < 0) end = len + end;
+
+			if (step < 0) {
+				for (i = start; (i > end) && (i >= 0); i += step) JPATH_SET_NEXT(array_obj->array[i], tnode);
+			} else {
+				for (i = start; (i < end) && (i < len); i += step) JPATH_SET_NEXT(array_obj->array[i], tnode);
+			}
+		}
+	}
+		return matched ? 1 : 0;
+
+	case JPATH_SELECTOR_WILDCARD:
+		if (json_object_is_type(object, json_type_array)) {
+			struct array_list *array_obj;
+
+			array_obj = json_object_get_array(object);
+			for (i = 0; i < (int32_t)(array_obj->length & INT32_MAX); i++) {
+				JPATH_SET_NEXT(array_obj->array[i], tnode);
+			}
+		} else if (json_object_is_type(object, json_type_object)) {
+			json_object_object_foreach(object, field_name, field_value) {
+				UNUSED_VAR(field_name);
+				JPATH_SET_NEXT(field_value, tnode);
+			}
+		}
+		return matched ? 1 : 0;
+
+	/*
+	 *	Descend first, then evaluate the following steps
+	 *	against this node on the way back up.
+	 */
+	case JPATH_SELECTOR_RECURSIVE_DESCENT:
+		if (json_object_is_type(object, json_type_array)) {
+			struct array_list *array_obj;
+
+			array_obj = json_object_get_array(object);
+			for (i = 0; i < (int32_t)(array_obj->length & INT32_MAX); i++) {
+				ret = jpath_set_step(ctx, out, set, array_obj->array[i], tnode);
+				if (ret < 0) return ret;
+				if (ret == 1) matched = true;
+			}
+		} else if (json_object_is_type(object, json_type_object)) {
+			json_object_object_foreach(object, field_name, field_value) {
+				UNUSED_VAR(field_name);
+				ret = jpath_set_step(ctx, out, set, field_value, tnode);
+				if (ret < 0) return ret;
+				if (ret == 1) matched = true;
+			}
+		}
+		JPATH_SET_NEXT(object, tnode);
+		return matched ? 1 : 0;
+
+	default:
+		fr_assert(0);
+		return -1;
+	}
+}
+
+/** Evaluate all of the expressions in a set, with one walk of a json-c tree
+ *
+ * @param[in,out] ctx	to allocate fr_value_box_t in.
+ * @param[out] out	Array of #fr_jpath_set_num lists, one for each expression,
+ *			in the order they were added.  Must be initialised.
+ * @param[in] set	of expressions to evaluate.
+ * @param[in] root	of the json-c tree.
+ * @return
+ *	- 1 if any expression matched.
+ *	- 0 on no match.
+ *	- -1 on error.
+ */
+int fr_jpath_set_evaluate(TALLOC_CTX *ctx, fr_value_box_list_t *out, fr_jpath_set_t const *set, json_object *root)
+{
+	if (!root) return -1;
+
+	return jpath_set_children(ctx, out, set, root, &set->root);
+}
+
 /** Print a node list to a string for debugging
  *
  * Will not be identical to the original parsed string, but should be sufficient
@@ -524,7 +524,8 @@ fr_ldap_rcode_t fr_ldap_bind(request_t *request,
 		/* We got a valid message ID */
 		if ((ret == 0) && (msgid >= 0)) ROPTIONAL(RDEBUG2, DEBUG2, "Waiting for bind result...");
 
-		status = fr_ldap_result(NULL, NULL, *pconn, msgid, 0, dn, 0);
+		status = fr_ldap_result(NULL, NULL, *pconn, msgid, 0, dn,
+					request_deadline_limit(request, timeout ? timeout : (*pconn)->config->res_timeout));
 	}
 
 	switch (status) {
@@ -634,7 +635,8 @@ fr_ldap_rcode_t fr_ldap_search(LDAPMessage **result, request_t *request,
 			       0, our_serverctrls, our_clientctrls, NULL, 0, &msgid);
 
 	ROPTIONAL(RDEBUG2, DEBUG2, "Waiting for search result...");
-	status = fr_ldap_result(&our_result, NULL, *pconn, msgid, 1, dn, 0);
+	status = fr_ldap_result(&our_result, NULL, *pconn, msgid, 1, dn,
+				request_deadline_limit(request, (*pconn)->config->res_timeout));
 	switch (status) {
 	case LDAP_PROC_SUCCESS:
 		break;
@@ -820,7 +822,8 @@ fr_ldap_rcode_t fr_ldap_modify(request_t *request, fr_ldap_connection_t **pconn,
 	(void) ldap_modify_ext((*pconn)->handle, dn, mods, our_serverctrls, our_clientctrls, &msgid);
 
 	RDEBUG2("Waiting for modify result...");
-	status = fr_ldap_result(NULL, NULL, *pconn, msgid, 0, dn, 0);
+	status = fr_ldap_result(NULL, NULL, *pconn, msgid, 0, dn,
+				request_deadline_limit(request, (*pconn)->config->res_timeout));
 	switch (status) {
 	case LDAP_PROC_SUCCESS:
 		break;
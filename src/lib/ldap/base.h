@@ -12,6 +12,7 @@
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/connection.h>
 #include <freeradius-devel/server/map.h>
+#include <freeradius-devel/server/trunk.h>
 
 #define LDAP_DEPRECATED 0	/* Quiet warnings about LDAP_DEPRECATED not being defined */
 
@@ -302,6 +303,9 @@ typedef struct {
 
 	fr_ldap_state_t		state;			//!< LDAP connection state machine.
 
+	fr_rb_tree_t		*queries;		//!< Outstanding queries sent on this connection,
+							///< keyed by msgid.  Only used for trunk connections.
+
 	void			*uctx;			//!< User data associated with the handle.
 } fr_ldap_connection_t;
 
@@ -354,6 +358,40 @@ typedef enum {
 							//!< exit, and retry the operation with a NULL cookie.
 } fr_ldap_rcode_t;
 
+/** Thread specific trunk of LDAP connections
+ *
+ */
+typedef struct {
+	fr_trunk_t		*trunk;			//!< Trunk of connections to the directory.
+	fr_ldap_config_t const	*config;		//!< Connection configuration.
+	fr_event_list_t		*el;			//!< Event list of the thread the trunk belongs to.
+} fr_ldap_thread_trunk_t;
+
+/** An LDAP search, multiplexed onto a trunk connection
+ *
+ * Allocated with #fr_ldap_query_alloc, which copies the search parameters,
+ * as the search may not be sent immediately.
+ */
+typedef struct {
+	fr_rb_node_t		node;			//!< Entry in the connection's tree of outstanding queries.
+	int			msgid;			//!< libldap msgid, -1 if the query hasn't been sent.
+
+	request_t		*request;		//!< The request the query is being performed for.
+
+	char const		*base_dn;		//!< DN to search in.
+	int			scope;			//!< Search scope.
+	char const		*filter;		//!< Search filter, must be pre-escaped.
+	char const * const	*attrs;			//!< Attributes to retrieve.
+	LDAPControl		*serverctrls[LDAP_MAX_CONTROLS];	//!< Controls to pass to the server.
+									///< Freed with the query.
+
+	fr_trunk_request_t	*treq;			//!< Trunk request the query is associated with.
+	fr_ldap_connection_t	*ldap_conn;		//!< The connection the query was sent on.
+
+	fr_ldap_rcode_t		ret;			//!< Result of the query.
+	LDAPMessage		*result;		//!< Messages returned by the directory, freed with the query.
+} fr_ldap_query_t;
+
 /*
  *	Tables for resolving strings to LDAP constants
  */
@@ -497,7 +535,7 @@ fr_ldap_rcode_t	 fr_ldap_sasl_interactive(request_t *request,
 fr_ldap_connection_t *fr_ldap_connection_alloc(TALLOC_CTX *ctx);
 
 fr_connection_t	*fr_ldap_connection_state_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
-					        fr_ldap_config_t const *config, char *log_prefix);
+					        fr_ldap_config_t const *config, char const *log_prefix);
 
 int		fr_ldap_connection_configure(fr_ldap_connection_t *c, fr_ldap_config_t const *config);
 
@@ -505,6 +543,18 @@ int		fr_ldap_connection_timeout_set(fr_ldap_connection_t const *conn, fr_time_de
 
 int		fr_ldap_connection_timeout_reset(fr_ldap_connection_t const *conn);
 
+/*
+ *	trunk.c - Multiplexing searches over trunked connections
+ */
+fr_ldap_thread_trunk_t	*fr_ldap_thread_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+						    fr_ldap_config_t const *config, fr_trunk_conf_t const *trunk_conf,
+						    char const *log_prefix);
+
+fr_ldap_query_t	*fr_ldap_query_alloc(TALLOC_CTX *ctx, request_t *request,
+				     char const *base_dn, int scope, char const *filter, char const * const *attrs);
+
+fr_ldap_rcode_t	fr_ldap_trunk_search(fr_ldap_thread_trunk_t *ttrunk, fr_ldap_query_t *query);
+
 /*
  *	state.c - Connection state machine
  */
@@ -553,4 +603,4 @@ char		*fr_ldap_berval_to_string(TALLOC_CTX *ctx, struct berval const *in);
 uint8_t		*fr_ldap_berval_to_bin(TALLOC_CTX *ctx, struct berval const *in);
 
 int		fr_ldap_parse_url_extensions(LDAPControl **sss, request_t *request,
-					     fr_ldap_connection_t *conn, char **extensions);
+					     LDAP *handle, char **extensions);
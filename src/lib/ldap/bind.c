@@ -70,13 +70,14 @@ static void _ldap_bind_io_read(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED
 {
 	fr_ldap_bind_ctx_t	*bind_ctx = talloc_get_type_abort(uctx, fr_ldap_bind_ctx_t);
 	fr_ldap_connection_t	*c = bind_ctx->c;
+	char const		*bind_dn = bind_ctx->bind_dn;
 
 	fr_ldap_rcode_t		status;
 
 	/*
 	 *	We're I/O driven, if there's no data someone lied to us
 	 */
-	status = fr_ldap_result(NULL, NULL, c, bind_ctx->msgid, LDAP_MSG_ALL, bind_ctx->bind_dn, 0);
+	status = fr_ldap_result(NULL, NULL, c, bind_ctx->msgid, LDAP_MSG_ALL, bind_dn, 0);
 	talloc_free(bind_ctx);			/* Also removes fd events */
 
 	switch (status) {
@@ -87,13 +88,13 @@ static void _ldap_bind_io_read(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED
 
 	case LDAP_PROC_NOT_PERMITTED:
 		PERROR("Bind as \"%s\" to \"%s\" not permitted",
-		       *bind_ctx->bind_dn ? bind_ctx->bind_dn : "(anonymous)", c->config->server);
+		       *bind_dn ? bind_dn : "(anonymous)", c->config->server);
 		fr_ldap_state_error(c);		/* Restart the connection state machine */
 		break;
 
 	default:
 		PERROR("Bind as \"%s\" to \"%s\" failed",
-		       *bind_ctx->bind_dn ? bind_ctx->bind_dn : "(anonymous)", c->config->server);
+		       *bind_dn ? bind_dn : "(anonymous)", c->config->server);
 		fr_ldap_state_error(c);		/* Restart the connection state machine */
 		break;
 	}
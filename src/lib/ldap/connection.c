@@ -436,6 +436,7 @@ static fr_connection_state_t _ldap_connection_init(void **h, fr_connection_t *co
 	fr_ldap_state_t		state;
 
 	c = fr_ldap_connection_alloc(conn);
+	c->conn = conn;
 
 	/*
 	 *	Configure/allocate the libldap handle
@@ -466,7 +467,7 @@ static fr_connection_state_t _ldap_connection_init(void **h, fr_connection_t *co
  * @param[in] log_prefix	to prepend to connection state messages.
  */
 fr_connection_t	*fr_ldap_connection_state_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
-					        fr_ldap_config_t const *config, char *log_prefix)
+					        fr_ldap_config_t const *config, char const *log_prefix)
 {
 	fr_connection_t *conn;
 
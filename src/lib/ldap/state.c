@@ -104,17 +104,13 @@ again:
 		break;
 
 	/*
-	 *	After binding install the mux (write) and
-	 *	demux (read) I/O functions.
+	 *	After binding, tell the connection API we're
+	 *	connected, so the trunk can install its mux
+	 *	(write) and demux (read) I/O functions.
 	 */
 	case FR_LDAP_STATE_BIND:
 		STATE_TRANSITION(FR_LDAP_STATE_RUN);
-	/*
-		if (fr_ldap_mux_async(c) < 0) {
-			STATE_TRANSITION(FR_LDAP_STATE_ERROR);
-			goto again;
-		}
-	 */
+		fr_connection_signal_connected(c->conn);
 		break;
 
 	/*
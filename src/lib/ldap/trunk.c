@@ -0,0 +1,471 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file lib/ldap/trunk.c
+ * @brief Multiplex LDAP searches over trunked connections.
+ *
+ * libldap matches responses to requests using msgids, so any number of
+ * searches can be outstanding on a single connection.  Each connection
+ * tracks its outstanding queries in a tree keyed by msgid, and the
+ * demuxer hands each complete result to the query that requested it.
+ *
+ * @copyright 2021 The FreeRADIUS Server Project.
+ */
+RCSID("$Id$")
+
+USES_APPLE_DEPRECATED_API
+
+#include <freeradius-devel/ldap/base.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/debug.h>
+
+/** Compare two queries by msgid
+ *
+ */
+static int8_t _ldap_query_cmp(void const *one, void const *two)
+{
+	fr_ldap_query_t const *a = one, *b = two;
+
+	return CMP(a->msgid, b->msgid);
+}
+
+/** Cancel a query which is still in the trunk, and free its controls
+ *
+ */
+static int _ldap_query_free(fr_ldap_query_t *query)
+{
+	size_t i;
+
+	/*
+	 *	There's no cancel muxer, so this
+	 *	releases the treq immediately, and
+	 *	the trunk won't touch the query again.
+	 */
+	if (query->treq) fr_trunk_request_signal_cancel(query->treq);
+
+	for (i = 0; (i < NUM_ELEMENTS(query->serverctrls)) && query->serverctrls[i]; i++) {
+		ldap_control_free(query->serverctrls[i]);
+	}
+
+	if (query->result) ldap_msgfree(query->result);
+
+	return 0;
+}
+
+/** Allocate a new search query
+ *
+ * The search parameters are copied into the query, so the caller doesn't
+ * need to keep them around until the search is sent.
+ *
+ * If the query is freed before it completes, it's cancelled, and any
+ * search sent to the directory is abandoned.
+ *
+ * @param[in] ctx	to allocate the query in.
+ * @param[in] request	the query is being performed for.
+ * @param[in] base_dn	to search in.
+ * @param[in] scope	of the search (LDAP_SCOPE_BASE, LDAP_SCOPE_ONE, LDAP_SCOPE_SUB).
+ * @param[in] filter	to use, should be pre-escaped.  May be NULL.
+ * @param[in] attrs	to retrieve.  May be NULL.
+ * @return
+ *	- A new query on success.
+ *	- NULL on failure.
+ */
+fr_ldap_query_t *fr_ldap_query_alloc(TALLOC_CTX *ctx, request_t *request,
+				     char const *base_dn, int scope, char const *filter, char const * const *attrs)
+{
+	fr_ldap_query_t	*query;
+	char		**our_attrs = NULL;
+
+	query = talloc_zero(ctx, fr_ldap_query_t);
+	if (!query) return NULL;
+	talloc_set_destructor(query, _ldap_query_free);
+
+	query->request = request;
+	query->msgid = -1;
+	query->scope = scope;
+	query->ret = LDAP_PROC_CONTINUE;
+
+	query->base_dn = talloc_strdup(query, base_dn ? base_dn : "");
+	if (!query->base_dn) goto error;
+
+	if (filter) {
+		query->filter = talloc_strdup(query, filter);
+		if (!query->filter) goto error;
+	}
+
+	if (attrs) {
+		size_t i, count;
+
+		for (count = 0; attrs[count]; count++);
+
+		our_attrs = talloc_zero_array(query, char *, count + 1);
+		if (!our_attrs) goto error;
+
+		for (i = 0; i < count; i++) {
+			our_attrs[i] = talloc_strdup(our_attrs, attrs[i]);
+			if (!our_attrs[i]) goto error;
+		}
+		query->attrs = (char const * const *)our_attrs;
+	}
+
+	return query;
+
+error:
+	talloc_free(query);
+	return NULL;
+}
+
+/** Allocate a connection for the trunk
+ *
+ */
+static fr_connection_t *ldap_trunk_connection_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
+						    UNUSED fr_connection_conf_t const *conf,
+						    char const *log_prefix, void *uctx)
+{
+	fr_ldap_thread_trunk_t	*ttrunk = talloc_get_type_abort(uctx, fr_ldap_thread_trunk_t);
+
+	return fr_ldap_connection_state_alloc(tconn, el, ttrunk->config, log_prefix);
+}
+
+static void _ldap_trunk_conn_readable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	fr_trunk_connection_signal_readable(tconn);
+}
+
+static void _ldap_trunk_conn_writable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	fr_trunk_connection_signal_writable(tconn);
+}
+
+static void _ldap_trunk_conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+				   int fd_errno, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	ERROR("LDAP connection failed: %s", fr_syserror(fd_errno));
+
+	fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+}
+
+/** Install I/O handlers for the events the trunk is interested in
+ *
+ */
+static void ldap_trunk_connection_notify(fr_trunk_connection_t *tconn, fr_connection_t *conn,
+					 fr_event_list_t *el,
+					 fr_trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	fr_ldap_connection_t	*ldap_conn = talloc_get_type_abort(conn->h, fr_ldap_connection_t);
+	fr_event_fd_cb_t	read_fn = NULL;
+	fr_event_fd_cb_t	write_fn = NULL;
+	int			fd = -1;
+
+	if ((ldap_get_option(ldap_conn->handle, LDAP_OPT_DESC, &fd) != LDAP_OPT_SUCCESS) || (fd < 0)) {
+		ERROR("Failed retrieving LDAP connection file descriptor");
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	switch (notify_on) {
+	case FR_TRUNK_CONN_EVENT_NONE:
+		fr_event_fd_delete(el, fd, FR_EVENT_FILTER_IO);
+		return;
+
+	case FR_TRUNK_CONN_EVENT_READ:
+		read_fn = _ldap_trunk_conn_readable;
+		break;
+
+	case FR_TRUNK_CONN_EVENT_WRITE:
+		write_fn = _ldap_trunk_conn_writable;
+		break;
+
+	case FR_TRUNK_CONN_EVENT_BOTH:
+		read_fn = _ldap_trunk_conn_readable;
+		write_fn = _ldap_trunk_conn_writable;
+		break;
+	}
+
+	if (fr_event_fd_insert(ldap_conn, el, fd,
+			       read_fn,
+			       write_fn,
+			       _ldap_trunk_conn_error,
+			       tconn) < 0) {
+		PERROR("Failed inserting LDAP connection FD event");
+
+		/*
+		 *	May free the connection!
+		 */
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+	}
+}
+
+/** Send pending searches to the directory
+ *
+ */
+static void ldap_trunk_request_mux(UNUSED fr_event_list_t *el,
+				   fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	fr_ldap_connection_t	*ldap_conn = talloc_get_type_abort(conn->h, fr_ldap_connection_t);
+
+	if (!ldap_conn->queries) {
+		ldap_conn->queries = fr_rb_inline_talloc_alloc(ldap_conn, fr_ldap_query_t, node,
+								_ldap_query_cmp, NULL);
+		if (!ldap_conn->queries) {
+			ERROR("Failed allocating query tracking tree");
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+		}
+	}
+
+	for (;;) {
+		fr_trunk_request_t	*treq;
+		fr_ldap_query_t		*query;
+		request_t		*request;
+
+		if (unlikely(fr_trunk_connection_pop_request(&treq, tconn) < 0)) return;
+
+		/*
+		 *	No more requests to send
+		 */
+		if (!treq) break;
+
+		query = talloc_get_type_abort(treq->preq, fr_ldap_query_t);
+		request = query->request;
+
+		if (fr_ldap_search_async(&query->msgid, request, &ldap_conn,
+					 query->base_dn, query->scope, query->filter, query->attrs,
+					 query->serverctrls, NULL) != LDAP_PROC_SUCCESS) {
+			query->msgid = -1;
+			fr_trunk_request_signal_fail(treq);
+			continue;
+		}
+
+		query->ldap_conn = ldap_conn;
+		if (!fr_rb_insert(ldap_conn->queries, query)) {
+			ROPTIONAL(REDEBUG, ERROR, "Duplicate LDAP msgid %i", query->msgid);
+			ldap_abandon_ext(ldap_conn->handle, query->msgid, NULL, NULL);
+			query->msgid = -1;
+			query->ldap_conn = NULL;
+			fr_trunk_request_signal_fail(treq);
+			continue;
+		}
+
+		fr_trunk_request_signal_sent(treq);
+	}
+}
+
+/** Read any complete results from the directory, and pass them back to their queries
+ *
+ */
+static void ldap_trunk_request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	fr_ldap_connection_t	*ldap_conn = talloc_get_type_abort(conn->h, fr_ldap_connection_t);
+
+	for (;;) {
+		LDAPMessage		*result = NULL, *msg;
+		fr_ldap_query_t		find = { .msgid = -1 }, *query;
+		fr_ldap_rcode_t		status = LDAP_PROC_SUCCESS;
+		int			ret;
+
+		/*
+		 *	Only poll, the event loop tells us when
+		 *	there's more data to read.
+		 */
+		ret = ldap_result(ldap_conn->handle, LDAP_RES_ANY, LDAP_MSG_ALL,
+				  &fr_time_delta_to_timeval(0), &result);
+		if (ret == 0) return;	/* No more complete results */
+		if (ret < 0) {
+			ERROR("Failed reading LDAP result: %s", fr_ldap_error_str(ldap_conn));
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+		}
+
+		find.msgid = ldap_msgid(result);
+		query = ldap_conn->queries ? fr_rb_find(ldap_conn->queries, &find) : NULL;
+		if (!query) {
+			WARN("Ignoring LDAP msgid %i - doesn't match any outstanding queries", find.msgid);
+			ldap_msgfree(result);
+			continue;
+		}
+
+		for (msg = ldap_first_message(ldap_conn->handle, result);
+		     msg;
+		     msg = ldap_next_message(ldap_conn->handle, msg)) {
+			status = fr_ldap_error_check(NULL, ldap_conn, msg, query->base_dn);
+			if (status != LDAP_PROC_SUCCESS) break;
+		}
+
+		fr_rb_delete(ldap_conn->queries, query);
+		query->msgid = -1;
+
+		if (status < 0) {
+			ldap_msgfree(result);
+			result = NULL;
+		}
+		query->ret = status;
+		query->result = result;
+
+		fr_trunk_request_signal_complete(query->treq);
+	}
+}
+
+/** Remove a query from the connection it was sent on, abandoning it if it's still outstanding
+ *
+ */
+static void ldap_trunk_request_conn_release(UNUSED fr_connection_t *conn, void *preq_to_reset, UNUSED void *uctx)
+{
+	fr_ldap_query_t		*query = talloc_get_type_abort(preq_to_reset, fr_ldap_query_t);
+	fr_ldap_connection_t	*ldap_conn = query->ldap_conn;
+
+	if (!ldap_conn) return;
+
+	if (fr_rb_node_inline_in_tree(&query->node)) {
+		ldap_abandon_ext(ldap_conn->handle, query->msgid, NULL, NULL);
+		fr_rb_delete(ldap_conn->queries, query);
+	}
+
+	query->msgid = -1;
+	query->ldap_conn = NULL;
+}
+
+/** The result has already been written to the query, so just resume the request
+ *
+ */
+static void ldap_trunk_request_complete(request_t *request, void *preq, UNUSED void *rctx, UNUSED void *uctx)
+{
+	fr_ldap_query_t		*query = talloc_get_type_abort(preq, fr_ldap_query_t);
+
+	query->treq = NULL;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Record the failure, and resume the request
+ *
+ */
+static void ldap_trunk_request_fail(request_t *request, void *preq, UNUSED void *rctx,
+				    UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
+{
+	fr_ldap_query_t		*query = talloc_get_type_abort(preq, fr_ldap_query_t);
+
+	query->treq = NULL;
+	query->ret = LDAP_PROC_ERROR;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** The query is owned by the caller, so only break the link to the treq
+ *
+ */
+static void ldap_trunk_request_free(UNUSED request_t *request, void *preq_to_free, UNUSED void *uctx)
+{
+	fr_ldap_query_t		*query = talloc_get_type_abort(preq_to_free, fr_ldap_query_t);
+
+	query->treq = NULL;
+}
+
+/** Allocate a trunk of connections to a directory for the current thread
+ *
+ * @param[in] ctx		to allocate the trunk in.
+ * @param[in] el		of the current thread.
+ * @param[in] config		of the LDAP connections.
+ * @param[in] trunk_conf	Trunk configuration.
+ * @param[in] log_prefix	to prepend to connection state messages.
+ * @return
+ *	- A new thread trunk on success.
+ *	- NULL on failure.
+ */
+fr_ldap_thread_trunk_t *fr_ldap_thread_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+						   fr_ldap_config_t const *config, fr_trunk_conf_t const *trunk_conf,
+						   char const *log_prefix)
+{
+	fr_ldap_thread_trunk_t		*ttrunk;
+
+	static fr_trunk_io_funcs_t	io_funcs = {
+						.connection_alloc = ldap_trunk_connection_alloc,
+						.connection_notify = ldap_trunk_connection_notify,
+						.request_mux = ldap_trunk_request_mux,
+						.request_demux = ldap_trunk_request_demux,
+						.request_conn_release = ldap_trunk_request_conn_release,
+						.request_complete = ldap_trunk_request_complete,
+						.request_fail = ldap_trunk_request_fail,
+						.request_free = ldap_trunk_request_free
+					};
+
+	ttrunk = talloc_zero(ctx, fr_ldap_thread_trunk_t);
+	if (!ttrunk) return NULL;
+
+	ttrunk->config = config;
+	ttrunk->el = el;
+	ttrunk->trunk = fr_trunk_alloc(ttrunk, el, &io_funcs, trunk_conf, log_prefix, ttrunk, false);
+	if (!ttrunk->trunk) {
+		talloc_free(ttrunk);
+		return NULL;
+	}
+
+	return ttrunk;
+}
+
+/** Enqueue a search on a thread trunk
+ *
+ * When the search completes, or fails, the request is marked runnable,
+ * and the outcome is available in query->ret and query->result.
+ *
+ * If query->ret is no longer LDAP_PROC_CONTINUE when this function
+ * returns, the query finished before the caller had a chance to yield.
+ *
+ * @param[in] ttrunk	to enqueue the search on.
+ * @param[in] query	to enqueue, allocated with #fr_ldap_query_alloc.
+ * @return
+ *	- LDAP_PROC_SUCCESS if the search was enqueued.
+ *	- LDAP_PROC_ERROR if it couldn't be enqueued.
+ */
+fr_ldap_rcode_t fr_ldap_trunk_search(fr_ldap_thread_trunk_t *ttrunk, fr_ldap_query_t *query)
+{
+	fr_trunk_request_t	*treq;
+	request_t		*request = query->request;
+
+	treq = fr_trunk_request_alloc(ttrunk->trunk, request);
+	if (!treq) {
+		ROPTIONAL(REDEBUG, ERROR, "Failed allocating LDAP trunk request");
+		return LDAP_PROC_ERROR;
+	}
+
+	/*
+	 *	Set before enqueueing, as the trunk may
+	 *	call our callbacks before it returns.
+	 */
+	query->treq = treq;
+
+	switch (fr_trunk_request_enqueue(&treq, ttrunk->trunk, request, query, query)) {
+	case FR_TRUNK_ENQUEUE_OK:
+	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
+		break;
+
+	default:
+		ROPTIONAL(REDEBUG, ERROR, "Unable to enqueue LDAP search");
+		query->treq = NULL;
+		fr_trunk_request_free(&treq);
+		return LDAP_PROC_ERROR;
+	}
+
+	return LDAP_PROC_SUCCESS;
+}
@@ -264,13 +264,14 @@ bool fr_ldap_util_is_dn(char const *in, size_t inlen)
  * @param[out] sss		Where to write a pointer to the server side sort control
  *				we created.
  * @param[in] request		The current request.
- * @param[in] conn		Handle to allocate controls under.
+ * @param[in] handle		libldap handle to create controls with.  Controls don't
+ *				depend on the connection, so this may be #ldap_global_handle.
  * @param[in] extensions	A NULL terminated array of extensions.
  * @return
  *	- 0 on success.
  *	- -1 on failure.
  */
-int fr_ldap_parse_url_extensions(LDAPControl **sss, request_t *request, fr_ldap_connection_t *conn, char **extensions)
+int fr_ldap_parse_url_extensions(LDAPControl **sss, request_t *request, LDAP *handle, char **extensions)
 {
 	int i;
 
@@ -315,7 +316,7 @@ int fr_ldap_parse_url_extensions(LDAPControl **sss, request_t *request, fr_ldap_
 
 			if (*sss) ldap_control_free(*sss);
 
-			ret = ldap_create_sort_control(conn->handle, keys, is_critical ? 1 : 0, sss);
+			ret = ldap_create_sort_control(handle, keys, is_critical ? 1 : 0, sss);
 			ldap_free_sort_keylist(keys);
 			if (ret != LDAP_SUCCESS) {
 				ERROR("Failed creating server sort control: %s", ldap_err2string(ret));
@@ -153,11 +153,16 @@
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/rand.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 #include "base.h"
 #include "cluster.h"
 #include "crc16.h"
 
-#define KEY_SLOTS		16384			//!< Maximum number of keyslots (should not change).
 
 #define MAX_SLAVES		5			//!< Maximum number of slaves associated
 							//!< with a keyslot.
@@ -247,6 +252,8 @@ struct fr_redis_cluster {
 	bool			remap_needed;		//!< Set true if at least one cluster node is definitely
 							//!< unreachable. Set false on successful remap.
 	time_t			last_updated;		//!< Last time the cluster mappings were updated.
+	atomic_uint_fast32_t	map_version;		//!< Incremented each time a new cluster map is applied.
+							///< Used by threads to invalidate cached copies.
 	CONF_SECTION		*module;		//!< Module configuration.
 
 	fr_redis_conf_t		*conf;			//!< Base configuration data such as the database number
@@ -747,6 +754,7 @@ do { \
 
 	cluster->remapping = false;
 	cluster->last_updated = time(NULL);
+	atomic_fetch_add_explicit(&cluster->map_version, 1, memory_order_release);
 
 	/*
 	 *	Sanity checks
@@ -831,49 +839,18 @@ static int cluster_map_node_validate(redisReply *node, int map_idx, int node_idx
 	return FR_REDIS_CLUSTER_RCODE_SUCCESS;
 }
 
-/** Learn a new cluster layout by querying the node that issued the -MOVE
- *
- * Also validates the response from the Redis cluster, so we can be sure that
- * it's well formed, before doing more expensive operations.
+/** Validate a cluster map returned by the 'cluster slots' command
  *
  * @note Errors may be retrieved with fr_strerror().
  *
- * @param[out] out Where to write cluster map.
- * @param[in] conn to use for learning the new cluster map.
+ * @param[in] reply to validate.
  * @return
- *	- FR_REDIS_CLUSTER_RCODE_IGNORED if 'cluster slots' returned an error (indicating clustering not supported).
  *	- FR_REDIS_CLUSTER_RCODE_SUCCESS on success.
- *	- FR_REDIS_CLUSTER_RCODE_FAILED if issuing the command resulted in an error.
- *	- FR_REDIS_CLUSTER_RCODE_NO_CONNECTION connection failure.
  *	- FR_REDIS_CLUSTER_RCODE_BAD_INPUT on validation failure (bad data returned from Redis).
  */
-static fr_redis_cluster_rcode_t cluster_map_get(redisReply **out, fr_redis_conn_t *conn)
+static fr_redis_cluster_rcode_t cluster_map_validate(redisReply *reply)
 {
-	redisReply	*reply;
-	size_t		i = 0;
-
-	*out = NULL;
-
-	reply = redisCommand(conn->handle, "cluster slots");
-	switch (fr_redis_command_status(conn, reply)) {
-	case REDIS_RCODE_RECONNECT:
-		fr_redis_reply_free(&reply);
-		fr_strerror_const("No connections available");
-		return FR_REDIS_CLUSTER_RCODE_NO_CONNECTION;
-
-	case REDIS_RCODE_ERROR:
-	default:
-		if (reply && reply->type == REDIS_REPLY_ERROR) {
-			fr_strerror_printf("%.*s", (int)reply->len, reply->str);
-			fr_redis_reply_free(&reply);
-			return FR_REDIS_CLUSTER_RCODE_IGNORED;
-		}
-		fr_strerror_const("Unknown client error");
-		return FR_REDIS_CLUSTER_RCODE_FAILED;
-
-	case REDIS_RCODE_SUCCESS:
-		break;
-	}
+	size_t		i;
 
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		fr_strerror_printf("Bad response to \"cluster slots\" command, expected array got %s",
@@ -901,7 +878,6 @@ static fr_redis_cluster_rcode_t cluster_map_get(redisReply **out, fr_redis_conn_
 			fr_strerror_printf("Cluster map %zu is wrong type, expected array got %s",
 				   	   i, fr_table_str_by_value(redis_reply_types, map->type, "<UNKNOWN>"));
 		error:
-			fr_redis_reply_free(&reply);
 			return FR_REDIS_CLUSTER_RCODE_BAD_INPUT;
 		}
 
@@ -972,11 +948,132 @@ static fr_redis_cluster_rcode_t cluster_map_get(redisReply **out, fr_redis_conn_
 			if (cluster_map_node_validate(map->element[j], i, j - 2) < 0) goto error;
 		}
 	}
+	return FR_REDIS_CLUSTER_RCODE_SUCCESS;
+}
+
+/** Learn a new cluster layout by querying the node that issued the -MOVE
+ *
+ * Also validates the response from the Redis cluster, so we can be sure that
+ * it's well formed, before doing more expensive operations.
+ *
+ * @note Errors may be retrieved with fr_strerror().
+ *
+ * @param[out] out Where to write cluster map.
+ * @param[in] conn to use for learning the new cluster map.
+ * @return
+ *	- FR_REDIS_CLUSTER_RCODE_IGNORED if 'cluster slots' returned an error (indicating clustering not supported).
+ *	- FR_REDIS_CLUSTER_RCODE_SUCCESS on success.
+ *	- FR_REDIS_CLUSTER_RCODE_FAILED if issuing the command resulted in an error.
+ *	- FR_REDIS_CLUSTER_RCODE_NO_CONNECTION connection failure.
+ *	- FR_REDIS_CLUSTER_RCODE_BAD_INPUT on validation failure (bad data returned from Redis).
+ */
+static fr_redis_cluster_rcode_t cluster_map_get(redisReply **out, fr_redis_conn_t *conn)
+{
+	redisReply	*reply;
+
+	*out = NULL;
+
+	reply = redisCommand(conn->handle, "cluster slots");
+	switch (fr_redis_command_status(conn, reply)) {
+	case REDIS_RCODE_RECONNECT:
+		fr_redis_reply_free(&reply);
+		fr_strerror_const("No connections available");
+		return FR_REDIS_CLUSTER_RCODE_NO_CONNECTION;
+
+	case REDIS_RCODE_ERROR:
+	default:
+		if (reply && reply->type == REDIS_REPLY_ERROR) {
+			fr_strerror_printf("%.*s", (int)reply->len, reply->str);
+			fr_redis_reply_free(&reply);
+			return FR_REDIS_CLUSTER_RCODE_IGNORED;
+		}
+		fr_strerror_const("Unknown client error");
+		return FR_REDIS_CLUSTER_RCODE_FAILED;
+
+	case REDIS_RCODE_SUCCESS:
+		break;
+	}
+
+	if (cluster_map_validate(reply) < 0) {
+		fr_redis_reply_free(&reply);
+		return FR_REDIS_CLUSTER_RCODE_BAD_INPUT;
+	}
 	*out = reply;
 
 	return FR_REDIS_CLUSTER_RCODE_SUCCESS;
 }
 
+/** Print and apply a validated cluster map
+ *
+ * @note Must be called with the cluster mutex free.
+ *
+ * @param[in] request The current request.
+ * @param[in,out] cluster to remap.
+ * @param[in] map to apply.  Will be freed.
+ * @param[in] now The time the remap was initiated.
+ * @return
+ *	- FR_REDIS_CLUSTER_RCODE_IGNORED if the cluster is already being remapped, or was remapped very recently.
+ *	- FR_REDIS_CLUSTER_RCODE_SUCCESS on success.
+ *	- FR_REDIS_CLUSTER_RCODE_FAILED if the map couldn't be applied.
+ */
+static fr_redis_cluster_rcode_t cluster_remap_apply(request_t *request, fr_redis_cluster_t *cluster,
+						    redisReply *map, time_t now)
+{
+	fr_redis_cluster_rcode_t	ret;
+	size_t				i, j;
+
+	/*
+	 *	Print the mapping we received
+	 */
+	ROPTIONAL(RINFO, INFO, "Cluster map consists of %zu key ranges", map->elements);
+	for (i = 0; i < map->elements; i++) {
+		redisReply *map_node = map->element[i];
+
+		ROPTIONAL(RINFO, INFO, "%zu - keys %lli-%lli", i,
+			  map_node->element[0]->integer,
+			  map_node->element[1]->integer);
+
+		if (request) RINDENT();
+		ROPTIONAL(RINFO, INFO, "master: %s:%lli",
+			  map_node->element[2]->element[0]->str,
+			  map_node->element[2]->element[1]->integer);
+		for (j = 3; j < map_node->elements; j++) {
+			ROPTIONAL(RINFO, INFO, "slave%zu: %s:%lli", j - 3,
+				  map_node->element[j]->element[0]->str,
+				  map_node->element[j]->element[1]->integer);
+		}
+		if (request) REXDENT();
+	}
+
+	/*
+	 *	Check again that the cluster isn't being
+	 *	remapped, or was remapped too recently,
+	 *	now we hold the mutex and the state of
+	 *	those variables is synchronized.
+	 */
+	pthread_mutex_lock(&cluster->mutex);
+	if (cluster->remapping) {
+		pthread_mutex_unlock(&cluster->mutex);
+		fr_redis_reply_free(&map);	/* Free the map */
+		ROPTIONAL(RDEBUG2, DEBUG2, "Cluster remapping in progress, ignoring remap request");
+		return FR_REDIS_CLUSTER_RCODE_IGNORED;
+	}
+	if (now == cluster->last_updated) {
+		pthread_mutex_unlock(&cluster->mutex);
+		fr_redis_reply_free(&map);	/* Free the map */
+		ROPTIONAL(RWARN, WARN, "Cluster was updated less than a second ago, ignoring remap request");
+		return FR_REDIS_CLUSTER_RCODE_IGNORED;
+	}
+	ret = cluster_map_apply(cluster, map);
+	if (ret == FR_REDIS_CLUSTER_RCODE_SUCCESS) cluster->remap_needed = false;	/* Change on successful remap */
+	pthread_mutex_unlock(&cluster->mutex);
+
+	fr_redis_reply_free(&map);	/* Free the map */
+	if (ret < 0) return FR_REDIS_CLUSTER_RCODE_FAILED;
+
+	return FR_REDIS_CLUSTER_RCODE_SUCCESS;
+}
+
 /** Perform a runtime remap of the cluster
  *
  * @note Errors may be retrieved with fr_strerror().
@@ -997,21 +1094,18 @@ fr_redis_cluster_rcode_t fr_redis_cluster_remap(request_t *request, fr_redis_clu
 	time_t		now;
 	redisReply	*map;
 	fr_redis_cluster_rcode_t	ret;
-	size_t		i, j;
 
 	/*
 	 *	If the cluster was remapped very recently, or is being
 	 *	remapped it's unlikely that it needs remapping again.
 	 */
 	if (cluster->remapping) {
-	in_progress:
 		ROPTIONAL(RDEBUG2, DEBUG2, "Cluster remapping in progress, ignoring remap request");
 		return FR_REDIS_CLUSTER_RCODE_IGNORED;
 	}
 
 	now = time(NULL);
 	if (now == cluster->last_updated) {
-	too_soon:
 		ROPTIONAL(RWARN, WARN, "Cluster was updated less than a second ago, ignoring remap request");
 		return FR_REDIS_CLUSTER_RCODE_IGNORED;
 	}
@@ -1036,54 +1130,60 @@ fr_redis_cluster_rcode_t fr_redis_cluster_remap(request_t *request, fr_redis_clu
 		break;
 	}
 
-	/*
-	 *	Print the mapping we received
-	 */
-	ROPTIONAL(RINFO, INFO, "Cluster map consists of %zu key ranges", map->elements);
-	for (i = 0; i < map->elements; i++) {
-		redisReply *map_node = map->element[i];
+	return cluster_remap_apply(request, cluster, map, now);
+}
 
-		ROPTIONAL(RINFO, INFO, "%zu - keys %lli-%lli", i,
-			  map_node->element[0]->integer,
-			  map_node->element[1]->integer);
+/** Perform a runtime remap of the cluster using a map retrieved asynchronously
+ *
+ * Allows callers which don't hold a synchronous connection to the cluster
+ * (i.e. those using the pipeline trunks) to issue the 'cluster slots'
+ * command themselves, and then apply the result.
+ *
+ * @note Errors may be retrieved with fr_strerror().
+ * @note Must be called with the cluster mutex free.
+ *
+ * @param[in] request The current request.  May be NULL.
+ * @param[in,out] cluster to remap.
+ * @param[in] map reply to the 'cluster slots' command.  Will be freed.
+ * @return
+ *	- FR_REDIS_CLUSTER_RCODE_IGNORED if 'cluster slots' returned an error (indicating clustering not
+ *	  supported), or the cluster was remapped very recently.
+ *	- FR_REDIS_CLUSTER_RCODE_SUCCESS on success.
+ *	- FR_REDIS_CLUSTER_RCODE_FAILED if the map couldn't be applied.
+ *	- FR_REDIS_CLUSTER_RCODE_BAD_INPUT on validation failure (bad data returned from Redis).
+ */
+fr_redis_cluster_rcode_t fr_redis_cluster_remap_from_map(request_t *request, fr_redis_cluster_t *cluster,
+							  redisReply *map)
+{
+	time_t		now;
 
-		if (request) RINDENT();
-		ROPTIONAL(RINFO, INFO, "master: %s:%lli",
-			  map_node->element[2]->element[0]->str,
-			  map_node->element[2]->element[1]->integer);
-		for (j = 3; j < map_node->elements; j++) {
-			ROPTIONAL(RINFO, INFO, "slave%zu: %s:%lli", j - 3,
-				  map_node->element[j]->element[0]->str,
-				  map_node->element[j]->element[1]->integer);
-		}
-		if (request) REXDENT();
+	if (!map) {
+		fr_strerror_const("No connections available");
+		return FR_REDIS_CLUSTER_RCODE_NO_CONNECTION;
 	}
 
-	/*
-	 *	Check again that the cluster isn't being
-	 *	remapped, or was remapped too recently,
-	 *	now we hold the mutex and the state of
-	 *	those variables is synchronized.
-	 */
-	pthread_mutex_lock(&cluster->mutex);
-	if (cluster->remapping) {
-		pthread_mutex_unlock(&cluster->mutex);
-		fr_redis_reply_free(&map);	/* Free the map */
-		goto in_progress;
+	if (map->type == REDIS_REPLY_ERROR) {
+		fr_strerror_printf("%.*s", (int)map->len, map->str);
+		fr_redis_reply_free(&map);
+		cluster->remap_needed = false;
+		return FR_REDIS_CLUSTER_RCODE_IGNORED;
 	}
-	if (now == cluster->last_updated) {
-		pthread_mutex_unlock(&cluster->mutex);
-		fr_redis_reply_free(&map);	/* Free the map */
-		goto too_soon;
+
+	if (cluster_map_validate(map) < 0) {
+		fr_redis_reply_free(&map);
+		return FR_REDIS_CLUSTER_RCODE_BAD_INPUT;
 	}
-	ret = cluster_map_apply(cluster, map);
-	if (ret == FR_REDIS_CLUSTER_RCODE_SUCCESS) cluster->remap_needed = false;	/* Change on successful remap */
-	pthread_mutex_unlock(&cluster->mutex);
 
-	fr_redis_reply_free(&map);	/* Free the map */
-	if (ret < 0) return FR_REDIS_CLUSTER_RCODE_FAILED;
+	now = time(NULL);
+	if (cluster->remapping || (now == cluster->last_updated)) {
+		fr_redis_reply_free(&map);
+		ROPTIONAL(RDEBUG2, DEBUG2, "Cluster recently remapped, ignoring remap request");
+		return FR_REDIS_CLUSTER_RCODE_IGNORED;
+	}
 
-	return FR_REDIS_CLUSTER_RCODE_SUCCESS;
+	ROPTIONAL(RINFO, INFO, "Applying cluster map");
+
+	return cluster_remap_apply(request, cluster, map, now);
 }
 
 /** Retrieve or associate a node with the server indicated in the redirect
@@ -1647,6 +1747,58 @@ int fr_redis_cluster_port(uint16_t *out, fr_redis_cluster_node_t const *node)
 	return 0;
 }
 
+/** Return the index of a key slot
+ *
+ * @param[in] cluster		the key slot belongs to.
+ * @param[in] key_slot		to return the index of.
+ * @return The index of the key slot, 0..16383.
+ */
+uint16_t fr_redis_cluster_key_slot_num(fr_redis_cluster_t *cluster, fr_redis_cluster_key_slot_t const *key_slot)
+{
+	return (uint16_t)(key_slot - cluster->key_slot);
+}
+
+/** Return the version of the current cluster map
+ *
+ * Changes each time a new cluster map is applied, so that threads can
+ * tell whether any information they've cached about the cluster's
+ * layout is still valid.
+ *
+ * @param[in] cluster		to return the map version of.
+ * @return The current map version.
+ */
+uint32_t fr_redis_cluster_map_version(fr_redis_cluster_t *cluster)
+{
+	return atomic_load_explicit(&cluster->map_version, memory_order_acquire);
+}
+
+/** Extract the key slot and node address from a MOVED or ASK redirect
+ *
+ * @note Errors may be retrieved with fr_strerror().
+ *
+ * @param[out] key_slot		extracted from the redirect (may be NULL).
+ * @param[out] ipaddr		of the node we were redirected to.
+ * @param[out] port		of the node we were redirected to.
+ * @param[in] redirect		Error reply to process.
+ * @return
+ *	- FR_REDIS_CLUSTER_RCODE_SUCCESS on success.
+ *	- FR_REDIS_CLUSTER_RCODE_BAD_INPUT if the reply wasn't a valid redirect.
+ */
+fr_redis_cluster_rcode_t fr_redis_cluster_redirect_parse(uint16_t *key_slot, fr_ipaddr_t *ipaddr, uint16_t *port,
+							 redisReply *redirect)
+{
+	fr_socket_t			addr;
+	fr_redis_cluster_rcode_t	ret;
+
+	ret = cluster_node_conf_from_redirect(key_slot, &addr, redirect);
+	if (ret != FR_REDIS_CLUSTER_RCODE_SUCCESS) return ret;
+
+	*ipaddr = addr.inet.dst_ipaddr;
+	*port = addr.inet.dst_port;
+
+	return FR_REDIS_CLUSTER_RCODE_SUCCESS;
+}
+
 /** Resolve a key to a pool, and reserve a connection in that pool
  *
  * This should be used with #fr_redis_cluster_state_next, and #fr_redis_command_status, to
@@ -35,6 +35,8 @@ RCSIDH(cluster_h, "$Id$")
 extern "C" {
 #endif
 
+#define KEY_SLOTS		16384			//!< Maximum number of keyslots (should not change).
+
 typedef struct fr_redis_cluster fr_redis_cluster_t;
 typedef struct fr_redis_cluster_key_slot_s fr_redis_cluster_key_slot_t;
 typedef struct fr_redis_cluster_node_s fr_redis_cluster_node_t;
@@ -78,6 +80,9 @@ extern size_t fr_redis_cluster_rcodes_table_len;
 
 fr_redis_cluster_rcode_t fr_redis_cluster_remap(request_t *request, fr_redis_cluster_t *cluster, fr_redis_conn_t *conn);
 
+fr_redis_cluster_rcode_t fr_redis_cluster_remap_from_map(request_t *request, fr_redis_cluster_t *cluster,
+							  redisReply *map);
+
 /*
  *	Callback for the connection pool to create a new connection
  */
@@ -100,6 +105,12 @@ int fr_redis_cluster_ipaddr(fr_ipaddr_t *out, fr_redis_cluster_node_t const *nod
 
 int fr_redis_cluster_port(uint16_t *out, fr_redis_cluster_node_t const *node);
 
+uint16_t fr_redis_cluster_key_slot_num(fr_redis_cluster_t *cluster, fr_redis_cluster_key_slot_t const *key_slot);
+
+uint32_t fr_redis_cluster_map_version(fr_redis_cluster_t *cluster);
+
+fr_redis_cluster_rcode_t fr_redis_cluster_redirect_parse(uint16_t *key_slot, fr_ipaddr_t *ipaddr, uint16_t *port,
+							 redisReply *redirect);
 
 
 /*
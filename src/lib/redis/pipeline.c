@@ -27,6 +27,8 @@
 
 #include <freeradius-devel/server/connection.h>
 #include <freeradius-devel/server/trunk.h>
+#include <freeradius-devel/util/inet.h>
+#include <freeradius-devel/util/rb.h>
 
 #include "pipeline.h"
 #include "io.h"
@@ -42,6 +44,18 @@ struct fr_redis_cluster_thread_s {
 	char				*log_prefix;	//!< Common log prefix to use for all cluster related
 							///< messages.
 	bool				delay_start;	//!< Prevent connections from spawning immediately.
+
+	fr_redis_cluster_t		*cluster;	//!< Shared cluster state.  Holds the authoritative
+							///< cluster map.
+	fr_redis_conf_t const		*conf;		//!< Common configuration for connections to
+							///< cluster nodes.
+	fr_rb_tree_t			*trunks;	//!< Trunks to individual cluster nodes, keyed on
+							///< the node's address and port.
+	fr_redis_trunk_t		**slots;	//!< Key slot to trunk map.  Populated lazily from
+							///< the cluster map, and updated by MOVED redirects.
+	uint32_t			map_version;	//!< Version of the cluster map the slot map
+							///< was populated from.
+	bool				remapping;	//!< A 'cluster slots' command is in flight.
 };
 
 /** The thread local free list
@@ -72,6 +86,9 @@ struct fr_redis_command_s {
 
 	char const			*str;		//!< The command string.
 	size_t				len;		//!< Length of the command string.
+	bool				formatted;	//!< str is already in the redis wire protocol format.
+	bool				asking;		//!< ASKING command inserted to follow an ASK
+							///< redirect.  The reply isn't passed to the caller.
 
 	uint64_t			sqn;		//!< The sequence number of the command.  This is only
 							///< valid for a specific handle, and is unique within
@@ -96,6 +113,10 @@ struct fr_redis_command_set_s {
 	/** @} */
 
 	uint8_t				redirected;	//!< How many times this command set was redirected.
+	bool				redirecting;	//!< Command set is being moved to another trunk.
+	fr_redis_trunk_t		*rtrunk;	//!< Trunk the command set is enqueued on.
+	fr_event_timer_t const		*ev;		//!< Enqueues the command set on the trunk it was
+							///< redirected to.
 
 	/** @name Request state
 	 *
@@ -142,6 +163,10 @@ struct fr_redis_command_set_s {
 };
 
 struct fr_redis_trunk_s {
+	fr_rb_node_t			node;		//!< Entry in the cluster thread's tree of trunks.
+	fr_ipaddr_t			ipaddr;		//!< Address of the cluster node.
+	uint16_t			port;		//!< Port of the cluster node.
+
 	fr_redis_io_conf_t const	*io_conf;	//!< Redis I/O configuration.  Specifies how to connect
 							///< to the host this trunk is used to communicate with.
 	fr_trunk_t			*trunk;		//!< Trunk containing all the connections to a specific
@@ -260,7 +285,7 @@ fr_redis_command_set_t *fr_redis_command_set_alloc(TALLOC_CTX *ctx,
  *
  * @param[in] cmd to free.  Frees any redis results associated with the command.
  */
-static int _redis_command_free(fr_redis_command_t *cmd)
+static int _redis_command_free(UNUSED fr_redis_command_t *cmd)
 {
 	//if (cmd->result) fr_redis_reply_free(&cmd->result);
 
@@ -272,27 +297,21 @@ redisReply *fr_redis_command_get_result(fr_redis_command_t *cmd)
 	return cmd->result;
 }
 
-/** Add a preformatted/expanded command to the command set
- *
- * The command must either be entirely static, or parented by the command set.
- *
- * @note Caller should disallow "SUBSCRIBE" et al, if they're not appropriate.
- * 	 As subscribing to a stream where we're not expecting it would break
- * 	 things, badly.
+/** Perform transaction sanity checks, and add a command to a command set
  *
  * @param[in] cmds	Command set to add command to.
- * @param[in] cmd_str	A fully expanded/formatted command to send to redis.
- *			Must be static, or have the same lifetime as the
- *			command set (allocated with the command set as the parent).
+ * @param[in] name	String beginning with the command name.
+ * @param[in] cmd_str	Command to send to redis.
  * @param[in] cmd_len	Length of the command.
+ * @param[in] formatted	Whether cmd_str is already in the redis wire protocol format.
  * @return
  *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued.
  *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
  */
-fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_set_t *cmds,
-							     char const *cmd_str, size_t cmd_len)
+static fr_redis_pipeline_status_t redis_command_add(fr_redis_command_set_t *cmds, char const *name,
+						    char const *cmd_str, size_t cmd_len, bool formatted)
 {
-	request_t			*request = cmds->request;
+	request_t		*request = cmds->request;
 	fr_redis_command_t	*cmd;
 	fr_redis_command_type_t	type = FR_REDIS_COMMAND_NORMAL;
 
@@ -306,10 +325,10 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 	 *	We try very hard to do this without incurring a performance penalty
 	 *      for non-transactional commands.
 	 */
-	switch (tolower(cmd_str[0])) {
+	switch (tolower(name[0])) {
 	case 'm':
-		if (tolower(cmd_str[1] != 'u')) break;
-		if (strncasecmp(cmd_str, "multi", sizeof("multi") - 1) != 0) break;
+		if (tolower(name[1]) != 'u') break;
+		if (strncasecmp(name, "multi", sizeof("multi") - 1) != 0) break;
 		/*
 		 *	There should only ever be a difference of
 		 *	1 between txn starts and txn ends.
@@ -328,8 +347,8 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 		break;
 
 	case 'e':
-		if (tolower(cmd_str[1] != 'e')) break;
-		if (strncasecmp(cmd_str, "exec", sizeof("exec") - 1) != 0) break;
+		if (tolower(name[1]) != 'x') break;
+		if (strncasecmp(name, "exec", sizeof("exec") - 1) != 0) break;
 		goto txn_end;
 
 	/*
@@ -338,8 +357,8 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 	 *	executing the commands.
 	 */
 	case 'd':
-		if (tolower(cmd_str[1] != 'i')) break;
-		if (strncasecmp(cmd_str, "discard", sizeof("discard") - 1) != 0) break;
+		if (tolower(name[1]) != 'i') break;
+		if (strncasecmp(name, "discard", sizeof("discard") - 1) != 0) break;
 	txn_end:
 		if (cmds->txn_start <= cmds->txn_end) {
 			ROPTIONAL(ERROR, REDEBUG, "Transaction not started, missing \"MULTI\" command");
@@ -350,8 +369,8 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 		break;
 
 	case 'w':
-		if (tolower(cmd_str[1] != 'a')) break;
-		if (strncasecmp(cmd_str, "watch", sizeof("watch") - 1) != 0) break;
+		if (tolower(name[1]) != 'a') break;
+		if (strncasecmp(name, "watch", sizeof("watch") - 1) != 0) break;
 		if (cmds->txn_watch) {
 			ROPTIONAL(ERROR, REDEBUG, "Too many consecutive \"WATCH\" commands");
 			return FR_REDIS_PIPELINE_BAD_CMDS;
@@ -372,11 +391,75 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 	cmd->type = type;
 	cmd->str = cmd_str;
 	cmd->len = cmd_len;
+	cmd->formatted = formatted;
 	fr_dlist_insert_tail(&cmds->pending, cmd);
 
 	return FR_REDIS_PIPELINE_OK;
 }
 
+/** Add a preformatted/expanded command to the command set
+ *
+ * The command must either be entirely static, or parented by the command set.
+ *
+ * @note Caller should disallow "SUBSCRIBE" et al, if they're not appropriate.
+ * 	 As subscribing to a stream where we're not expecting it would break
+ * 	 things, badly.
+ *
+ * @param[in] cmds	Command set to add command to.
+ * @param[in] cmd_str	A fully expanded/formatted command to send to redis.
+ *			Must be static, or have the same lifetime as the
+ *			command set (allocated with the command set as the parent).
+ * @param[in] cmd_len	Length of the command.
+ * @return
+ *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued.
+ *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
+ */
+fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_set_t *cmds,
+							     char const *cmd_str, size_t cmd_len)
+{
+	return redis_command_add(cmds, cmd_str, cmd_str, cmd_len, false);
+}
+
+/** Format a command, and add it to a command set
+ *
+ * Unlike #fr_redis_command_preformatted_add, arguments are passed separately
+ * to the REDIS server, so they may contain spaces and binary data.
+ *
+ * @param[in] cmds	Command set to add command to.
+ * @param[in] fmt	hiredis format string, i.e. "EVALSHA %s 1 %b".
+ *			The first word must be the command name.
+ * @param[in] ...	Arguments for the format string.
+ * @return
+ *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued,
+ *	  or the command could not be formatted.
+ *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
+ */
+fr_redis_pipeline_status_t fr_redis_command_add(fr_redis_command_set_t *cmds, char const *fmt, ...)
+{
+	request_t			*request = cmds->request;
+	va_list				ap;
+	char				*formatted;
+	char				*cmd_str;
+	int				cmd_len;
+	fr_redis_pipeline_status_t	status;
+
+	va_start(ap, fmt);
+	cmd_len = redisvFormatCommand(&formatted, fmt, ap);
+	va_end(ap);
+	if (cmd_len < 0) {
+		ROPTIONAL(ERROR, REDEBUG, "Failed formatting command \"%s\"", fmt);
+		return FR_REDIS_PIPELINE_BAD_CMDS;
+	}
+
+	MEM(cmd_str = talloc_memdup(cmds, formatted, (size_t)cmd_len));
+	redisFreeCommand(formatted);
+
+	status = redis_command_add(cmds, fmt, cmd_str, (size_t)cmd_len, true);
+	if (status != FR_REDIS_PIPELINE_OK) talloc_free(cmd_str);
+
+	return status;
+}
+
 /** Enqueue a command set on a specific trunk
  *
  * The command set may be passed around several trunks before it is complete.
@@ -396,6 +479,8 @@ fr_redis_pipeline_status_t redis_command_set_enqueue(fr_redis_trunk_t *rtrunk, f
 		return FR_REDIS_PIPELINE_BAD_CMDS;
 	}
 
+	cmds->rtrunk = rtrunk;
+
 	switch (fr_trunk_request_enqueue(&cmds->treq, rtrunk->trunk, cmds->request, cmds, cmds->rctx)) {
 	case FR_TRUNK_ENQUEUE_OK:
 	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
@@ -409,6 +494,222 @@ fr_redis_pipeline_status_t redis_command_set_enqueue(fr_redis_trunk_t *rtrunk, f
 	}
 }
 
+/** Cancel a command set which was previously enqueued
+ *
+ * Should be called if the request the command set belongs to is cancelled
+ * whilst waiting for the results.  Any replies subsequently received for
+ * the command set will be ignored, and neither the complete nor the fail
+ * callbacks will be called.
+ *
+ * @param[in] cmds	Command set to cancel.  Will be freed.
+ */
+void fr_redis_command_set_signal_cancel(fr_redis_command_set_t *cmds)
+{
+	if (!cmds->treq) {
+		talloc_free(cmds);
+		return;
+	}
+
+	fr_trunk_request_signal_cancel(cmds->treq);
+}
+
+static fr_redis_trunk_t *redis_cluster_thread_trunk_by_addr(fr_redis_cluster_thread_t *cluster_thread,
+							    request_t *request, fr_ipaddr_t const *ipaddr, uint16_t port);
+
+/** Apply a cluster map retrieved in the background
+ *
+ */
+static void _redis_cluster_remap_complete(UNUSED request_t *request, fr_dlist_head_t *completed, void *rctx)
+{
+	fr_redis_cluster_thread_t	*cluster_thread = talloc_get_type_abort(rctx, fr_redis_cluster_thread_t);
+	fr_redis_command_t		*cmd;
+
+	cluster_thread->remapping = false;
+
+	cmd = fr_dlist_head(completed);
+	if (!cmd) return;
+
+	switch (fr_redis_cluster_remap_from_map(NULL, cluster_thread->cluster, cmd->result)) {
+	case FR_REDIS_CLUSTER_RCODE_SUCCESS:
+	case FR_REDIS_CLUSTER_RCODE_IGNORED:
+		break;
+
+	default:
+		PERROR("Failed applying cluster map");
+		break;
+	}
+	cmd->result = NULL;	/* Freed by fr_redis_cluster_remap_from_map */
+}
+
+/** Allow another remap to be attempted
+ *
+ */
+static void _redis_cluster_remap_fail(UNUSED request_t *request, UNUSED fr_dlist_head_t *completed, void *rctx)
+{
+	fr_redis_cluster_thread_t	*cluster_thread = talloc_get_type_abort(rctx, fr_redis_cluster_thread_t);
+
+	cluster_thread->remapping = false;
+}
+
+/** Refresh the cluster map without blocking the worker
+ *
+ * The 'cluster slots' command is pipelined on a trunk like any other
+ * command, and the result is applied to the shared cluster state when
+ * the reply arrives.  Other threads pick up the new map the next time
+ * they resolve a key.
+ *
+ * @param[in] cluster_thread	requesting the remap.
+ * @param[in] rtrunk		to send the 'cluster slots' command on.
+ */
+static void redis_cluster_thread_remap(fr_redis_cluster_thread_t *cluster_thread, fr_redis_trunk_t *rtrunk)
+{
+	fr_redis_command_set_t	*cmds;
+
+	if (cluster_thread->remapping) return;
+
+	MEM(cmds = fr_redis_command_set_alloc(NULL, NULL,
+					      _redis_cluster_remap_complete, _redis_cluster_remap_fail,
+					      cluster_thread));
+	if ((fr_redis_command_add(cmds, "CLUSTER SLOTS") != FR_REDIS_PIPELINE_OK) ||
+	    (redis_command_set_enqueue(rtrunk, cmds) != FR_REDIS_PIPELINE_OK)) {
+		talloc_free(cmds);
+		return;
+	}
+	cluster_thread->remapping = true;
+}
+
+/** Enqueue a redirected command set on the trunk of the node it was redirected to
+ *
+ */
+static void _redis_command_set_requeue(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_redis_command_set_t	*cmds = talloc_get_type_abort(uctx, fr_redis_command_set_t);
+
+	cmds->redirecting = false;
+	if (redis_command_set_enqueue(cmds->rtrunk, cmds) == FR_REDIS_PIPELINE_OK) return;
+
+	if (cmds->fail) cmds->fail(cmds->request, &cmds->completed, cmds->rctx);
+	talloc_free(cmds);
+}
+
+/** Check whether a completed command set was redirected, and if so, move it to the correct trunk
+ *
+ * If any of the replies are MOVED or ASK redirects, all the commands in the
+ * set are sent again to the node indicated by the redirect.  For ASK
+ * redirects each command is preceded by an ASKING command.  For MOVED
+ * redirects the thread's slot map is updated, and the cluster map is
+ * refreshed in the background.
+ *
+ * @param[in] cmds	Command set to check.
+ * @return
+ *	- true if the command set is being redirected.
+ *	- false if the command set should be completed.  The caller will
+ *	  receive any redirect replies as errors.
+ */
+static bool redis_command_set_redirect(fr_redis_command_set_t *cmds)
+{
+	request_t			*request = cmds->request;
+	fr_redis_cluster_thread_t	*cluster_thread = cmds->rtrunk->cluster;
+	fr_redis_trunk_t		*target;
+	fr_redis_command_t		*cmd;
+	redisReply			*redirect = NULL;
+	bool				ask = false;
+	uint16_t			key_slot, port;
+	fr_ipaddr_t			ipaddr;
+
+	fr_dlist_foreach(&cmds->completed, fr_redis_command_t, completed) {
+		redisReply *reply = completed->result;
+
+		if (!reply || (reply->type != REDIS_REPLY_ERROR)) continue;
+
+		if (strncmp(REDIS_ERROR_MOVED_STR, reply->str, sizeof(REDIS_ERROR_MOVED_STR) - 1) == 0) {
+			redirect = reply;
+			break;
+		}
+
+		if (strncmp(REDIS_ERROR_ASK_STR, reply->str, sizeof(REDIS_ERROR_ASK_STR) - 1) == 0) {
+			redirect = reply;
+			ask = true;
+			break;
+		}
+	}
+	if (!redirect) return false;
+
+	/*
+	 *	Trunk wasn't allocated for a cluster,
+	 *	so there's nowhere to redirect to.
+	 */
+	if (!cluster_thread || !cluster_thread->cluster) return false;
+
+	if (cmds->redirected >= cluster_thread->conf->max_redirects) {
+		ROPTIONAL(REDEBUG, ERROR, "Too many redirects (%u)", cmds->redirected);
+		return false;
+	}
+
+	if (fr_redis_cluster_redirect_parse(&key_slot, &ipaddr, &port, redirect) != FR_REDIS_CLUSTER_RCODE_SUCCESS) {
+		ROPTIONAL(RPEDEBUG, PERROR, "Failed processing redirect");
+		return false;
+	}
+
+	target = redis_cluster_thread_trunk_by_addr(cluster_thread, request, &ipaddr, port);
+	if (!target) return false;
+
+	ROPTIONAL(RDEBUG2, DEBUG2, "%s redirect for key slot %u to %s:%u", ask ? "ASK" : "MOVED",
+		  key_slot, target->io_conf->hostname, port);
+
+	/*
+	 *	The key slot has permanently moved, so
+	 *	the cluster map is out of date.
+	 */
+	if (!ask) {
+		cluster_thread->slots[key_slot] = target;
+		redis_cluster_thread_remap(cluster_thread, target);
+	}
+
+	/*
+	 *	Reset the command set so it can be sent again
+	 */
+	while ((cmd = fr_dlist_pop_head(&cmds->completed))) {
+		fr_redis_reply_free(&cmd->result);
+
+		if (ask) {
+			fr_redis_command_t *asking;
+
+			MEM(asking = talloc_zero(cmds, fr_redis_command_t));
+			asking->cmds = cmds;
+			asking->str = "ASKING";
+			asking->len = sizeof("ASKING") - 1;
+			asking->asking = true;
+			fr_dlist_insert_tail(&cmds->pending, asking);
+		}
+		fr_dlist_insert_tail(&cmds->pending, cmd);
+	}
+	cmds->redirected++;
+	cmds->rtrunk = target;
+
+	/*
+	 *	Release the treq on the original trunk,
+	 *	the complete and free callbacks ignore
+	 *	command sets which are being redirected.
+	 *
+	 *	The command set is enqueued on the new
+	 *	trunk from a timer, so we're not calling
+	 *	back into the trunk code from within
+	 *	its own callbacks.
+	 */
+	cmds->redirecting = true;
+	fr_trunk_request_signal_complete(cmds->treq);
+	cmds->treq = NULL;
+
+	if (fr_event_timer_in(cmds, cluster_thread->el, &cmds->ev, 0, _redis_command_set_requeue, cmds) < 0) {
+		ROPTIONAL(RPEDEBUG, PERROR, "Failed inserting redirect timer");
+		if (cmds->fail) cmds->fail(cmds->request, &cmds->completed, cmds->rctx);
+		talloc_free(cmds);
+	}
+
+	return true;
+}
+
 /** Callback for for receiving Redis replies
  *
  * This is called by hiredis for each response is receives.  privData is set to the
@@ -447,18 +748,30 @@ static void _redis_pipeline_demux(struct redisAsyncContext *ac, void *vreply, vo
 	 */
 	cmd = talloc_get_type_abort(privdata, fr_redis_command_t);
 	cmds = cmd->cmds;
-	cmd->result = reply;
 
 	fr_dlist_remove(&cmds->sent, cmd);
-	fr_dlist_insert_tail(&cmds->completed, cmd);
+
+	/*
+	 *	Replies to the ASKING commands we inserted
+	 *	aren't interesting to the caller.
+	 */
+	if (cmd->asking) {
+		fr_redis_reply_free(&reply);
+		talloc_free(cmd);
+	} else {
+		cmd->result = reply;
+		fr_dlist_insert_tail(&cmds->completed, cmd);
+	}
 
 	/*
 	 *	Check is the command set is complete,
 	 *	and if it is, tell the trunk the treq
-	 *	is complete.
+	 *	is complete, unless we're following
+	 *	a redirect.
 	 */
 	if ((fr_dlist_num_elements(&cmds->pending) == 0) &&
-	    (fr_dlist_num_elements(&cmds->sent) == 0)) fr_trunk_request_signal_complete(cmds->treq);
+	    (fr_dlist_num_elements(&cmds->sent) == 0) &&
+	    !redis_command_set_redirect(cmds)) fr_trunk_request_signal_complete(cmds->treq);
 }
 
 static fr_connection_t *_redis_pipeline_connection_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
@@ -480,37 +793,52 @@ static fr_connection_t *_redis_pipeline_connection_alloc(fr_trunk_connection_t *
  * @param[in] conn		Connection handle containing the fr_redis_handle_t.
  * @param[in] uctx		fr_redis_cluster_t.  Unused.
  */
-static void _redis_pipeline_mux(fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+static void _redis_pipeline_mux(UNUSED fr_event_list_t *el,
+				fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
 {
-	fr_trunk_request_t	*treq;
-	fr_redis_command_set_t 	*cmds;
-	fr_redis_command_t	*cmd;
 	fr_redis_handle_t	*h = talloc_get_type_abort(conn->h, fr_redis_handle_t);
-	request_t			*request;
 
-	treq = fr_trunk_connection_pop_request(&request, (void *)&cmds, NULL, tconn);
-	while ((cmd = fr_dlist_head(&cmds->pending))) {
+	for (;;) {
+		fr_trunk_request_t	*treq;
+		fr_redis_command_set_t 	*cmds;
+		fr_redis_command_t	*cmd;
+		request_t		*request;
+
+		if (unlikely(fr_trunk_connection_pop_request(&treq, tconn) < 0)) return;
+
 		/*
-		 *	If this fails it probably means the connection
-		 *	is disconnecting, but if that's happening then
-		 *	we shouldn't be enqueueing new requests?
+		 *	No more command sets to send
 		 */
-		if (unlikely(redisAsyncCommand(h->ac, _redis_pipeline_demux, cmd, "%s", cmd->str) != REDIS_OK)) {
-			ROPTIONAL(ERROR, REDEBUG, "Unexpected error queueing REDIS command");
-
-			while ((cmd = fr_dlist_head(&cmds->sent))) {
-				fr_redis_connection_ignore_response(h, cmd->sqn);
-				fr_dlist_remove(&cmds->sent, cmd);
-				fr_dlist_insert_tail(&cmds->pending, cmd);
+		if (!treq) break;
+
+		cmds = talloc_get_type_abort(treq->preq, fr_redis_command_set_t);
+		request = cmds->request;
+
+		while ((cmd = fr_dlist_head(&cmds->pending))) {
+			/*
+			 *	If this fails it probably means the connection
+			 *	is disconnecting, but if that's happening then
+			 *	we shouldn't be enqueueing new requests?
+			 */
+			if (unlikely((cmd->formatted ?
+				      redisAsyncFormattedCommand(h->ac, _redis_pipeline_demux, cmd, cmd->str, cmd->len) :
+				      redisAsyncCommand(h->ac, _redis_pipeline_demux, cmd, "%s", cmd->str)) != REDIS_OK)) {
+				ROPTIONAL(ERROR, REDEBUG, "Unexpected error queueing REDIS command");
+
+				while ((cmd = fr_dlist_head(&cmds->sent))) {
+					fr_redis_connection_ignore_response(h, cmd->sqn);
+					fr_dlist_remove(&cmds->sent, cmd);
+					fr_dlist_insert_tail(&cmds->pending, cmd);
+				}
+				fr_trunk_request_signal_fail(treq);
+				return;
 			}
-			fr_trunk_request_signal_fail(treq);
-			return;
+			cmd->sqn = fr_redis_connection_sent_request(h);
+			fr_dlist_remove(&cmds->pending, cmd);
+			fr_dlist_insert_tail(&cmds->sent, cmd);
 		}
-		cmd->sqn = fr_redis_connection_sent_request(h);
-		fr_dlist_remove(&cmds->pending, cmd);
-		fr_dlist_insert_tail(&cmds->sent, cmd);
+		fr_trunk_request_signal_sent(treq);
 	}
-	fr_trunk_request_signal_sent(treq);
 }
 
 /** Deal with cancellation of sent requests
@@ -519,7 +847,7 @@ static void _redis_pipeline_mux(fr_trunk_connection_t *tconn, fr_connection_t *c
  * on why the commands were cancelled, we either tell the handle to ignore
  * them, or move them back into the pending list.
  */
-static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_trunk_request_t *treq, void *preq,
+static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, void *preq,
 					       fr_trunk_cancel_reason_t reason, UNUSED void *uctx)
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
@@ -541,6 +869,7 @@ static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_
 	 *	execution by another handle.
 	 */
 	case FR_TRUNK_CANCEL_REASON_MOVE:
+	case FR_TRUNK_CANCEL_REASON_REQUEUE:
 		fr_dlist_move(&cmds->pending, &cmds->sent);
 		return;
 
@@ -564,6 +893,7 @@ static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_
 			fr_redis_connection_ignore_response(h, cmd->sqn);
 		}
 	}
+		return;
 
 	case FR_TRUNK_CANCEL_REASON_NONE:
 		fr_assert(0);
@@ -579,6 +909,8 @@ static void _redis_pipeline_command_set_complete(UNUSED request_t *request, void
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
 
+	if (cmds->redirecting) return;
+
 	if (cmds->complete) cmds->complete(cmds->request, &cmds->completed, cmds->rctx);
 }
 
@@ -586,7 +918,8 @@ static void _redis_pipeline_command_set_complete(UNUSED request_t *request, void
  *
  */
 static void _redis_pipeline_command_set_fail(UNUSED request_t *request, void *preq,
-					     UNUSED void *rctx, UNUSED void *uctx)
+					     UNUSED void *rctx, UNUSED fr_trunk_request_state_t state,
+					     UNUSED void *uctx)
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
 
@@ -601,6 +934,8 @@ static void _redis_pipeline_command_set_free(UNUSED request_t *request, void *pr
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
 
+	if (cmds->redirecting) return;	/* Freed once the redirect has been followed */
+
 	talloc_free(cmds);
 }
 
@@ -627,6 +962,7 @@ fr_redis_trunk_t *fr_redis_trunk_alloc(fr_redis_cluster_thread_t *cluster_thread
 
 	MEM(rtrunk = talloc_zero(cluster_thread, fr_redis_trunk_t));
 	rtrunk->io_conf = io_conf;
+	rtrunk->cluster = cluster_thread;
 	rtrunk->trunk = fr_trunk_alloc(rtrunk, cluster_thread->el,
 				       &io_funcs, cluster_thread->tconf, cluster_thread->log_prefix, rtrunk,
 				       cluster_thread->delay_start);
@@ -638,13 +974,144 @@ fr_redis_trunk_t *fr_redis_trunk_alloc(fr_redis_cluster_thread_t *cluster_thread
 	return rtrunk;
 }
 
+/** Return the trunk connected to a particular node, allocating it if required
+ *
+ * Trunks are created lazily, the first time a particular node is used,
+ * and persist for the lifetime of the cluster thread.
+ *
+ * @param[in] cluster_thread	to retrieve or allocate the trunk in.
+ * @param[in] request		The current request.  May be NULL.
+ * @param[in] ipaddr		of the node.
+ * @param[in] port		of the node.
+ * @return
+ *	- A trunk connected to the node.
+ *	- NULL if the trunk could not be allocated.
+ */
+static fr_redis_trunk_t *redis_cluster_thread_trunk_by_addr(fr_redis_cluster_thread_t *cluster_thread,
+							    request_t *request, fr_ipaddr_t const *ipaddr, uint16_t port)
+{
+	fr_redis_conf_t const	*conf = cluster_thread->conf;
+	fr_redis_trunk_t	find = { .ipaddr = *ipaddr, .port = port }, *rtrunk;
+	fr_redis_io_conf_t	*io_conf;
+	char			buffer[FR_IPADDR_STRLEN];
+
+	rtrunk = fr_rb_find(cluster_thread->trunks, &find);
+	if (rtrunk) return rtrunk;
+
+	MEM(io_conf = talloc_zero(cluster_thread, fr_redis_io_conf_t));
+	MEM(io_conf->hostname = talloc_strdup(io_conf, fr_inet_ntop(buffer, sizeof(buffer), ipaddr)));
+	io_conf->port = port;
+	io_conf->database = conf->database;
+	io_conf->password = conf->password;
+	io_conf->connection_timeout = conf->connection_timeout;
+	io_conf->reconnection_delay = conf->reconnection_delay;
+	io_conf->log_prefix = conf->log_prefix;
+
+	rtrunk = fr_redis_trunk_alloc(cluster_thread, io_conf);
+	if (!rtrunk) {
+		ROPTIONAL(REDEBUG, ERROR, "Failed allocating trunk for %s:%u", io_conf->hostname, io_conf->port);
+		talloc_free(io_conf);
+		return NULL;
+	}
+	talloc_steal(rtrunk, io_conf);
+	rtrunk->ipaddr = *ipaddr;
+	rtrunk->port = port;
+
+	if (!fr_rb_insert(cluster_thread->trunks, rtrunk)) {
+		talloc_free(rtrunk);
+		return NULL;
+	}
+
+	ROPTIONAL(RDEBUG2, DEBUG2, "Allocated trunk for cluster node %s:%u", io_conf->hostname, io_conf->port);
+
+	return rtrunk;
+}
+
+/** Return the trunk connected to the master node for a key, allocating it if required
+ *
+ * The thread keeps its own key slot to trunk map, which is populated lazily
+ * from the cluster map, and discarded whenever a new cluster map is applied.
+ *
+ * If the map is stale, commands will be redirected with MOVED or ASK.  These
+ * redirects are followed transparently, and MOVED redirects cause the cluster
+ * map to be refreshed in the background.
+ *
+ * @param[in] cluster_thread	to retrieve or allocate the trunk in.
+ * @param[in] request		The current request.
+ * @param[in] key		to resolve.
+ * @param[in] key_len		the length of the key.
+ * @return
+ *	- A trunk connected to the node responsible for key.
+ *	- NULL if no node is responsible for the key, or the trunk could not be allocated.
+ */
+fr_redis_trunk_t *fr_redis_cluster_thread_trunk_by_key(fr_redis_cluster_thread_t *cluster_thread,
+						       request_t *request, uint8_t const *key, size_t key_len)
+{
+	fr_redis_cluster_key_slot_t const	*key_slot;
+	fr_redis_cluster_node_t const		*node;
+	fr_redis_trunk_t			*rtrunk;
+	fr_ipaddr_t				ipaddr;
+	uint16_t				port, slot;
+	uint32_t				map_version;
+
+	fr_assert(cluster_thread->cluster);
+
+	/*
+	 *	Discard our copy of the slot map if
+	 *	the cluster has been remapped.
+	 */
+	map_version = fr_redis_cluster_map_version(cluster_thread->cluster);
+	if (map_version != cluster_thread->map_version) {
+		memset(cluster_thread->slots, 0, sizeof(*cluster_thread->slots) * KEY_SLOTS);
+		cluster_thread->map_version = map_version;
+	}
+
+	key_slot = fr_redis_cluster_slot_by_key(cluster_thread->cluster, request, key, key_len);
+	slot = fr_redis_cluster_key_slot_num(cluster_thread->cluster, key_slot);
+	if (cluster_thread->slots[slot]) return cluster_thread->slots[slot];
+
+	node = fr_redis_cluster_master(cluster_thread->cluster, key_slot);
+	if ((fr_redis_cluster_ipaddr(&ipaddr, node) < 0) || (fr_redis_cluster_port(&port, node) < 0)) {
+		ROPTIONAL(REDEBUG, ERROR, "No master node available for key");
+		return NULL;
+	}
+
+	rtrunk = redis_cluster_thread_trunk_by_addr(cluster_thread, request, &ipaddr, port);
+	if (!rtrunk) return NULL;
+
+	cluster_thread->slots[slot] = rtrunk;
+
+	return rtrunk;
+}
+
+static int8_t _redis_trunk_cmp(void const *one, void const *two)
+{
+	fr_redis_trunk_t const	*a = one, *b = two;
+	int8_t			ret;
+
+	ret = fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+	if (ret != 0) return ret;
+
+	return CMP(a->port, b->port);
+}
+
 /** Allocate per-thread, per-cluster instance
  *
  * This structure represents all the connections for a given thread for a given cluster.
  * The structures holds the trunk connections to talk to each cluster member.
  *
+ * @param[in] ctx		to allocate the cluster thread in.
+ * @param[in] el		to run trunk connections in.
+ * @param[in] tconf		Configuration for all trunks in the cluster.
+ * @param[in] cluster		Shared cluster state.  May be NULL if trunks are
+ *				only allocated with #fr_redis_trunk_alloc.
+ * @param[in] conf		Common configuration for connections to cluster nodes.
+ *				Must be provided if cluster is not NULL.
+ * @return A new cluster thread.
  */
-fr_redis_cluster_thread_t *fr_redis_cluster_thread_alloc(TALLOC_CTX *ctx, fr_event_list_t *el, fr_trunk_conf_t const *tconf)
+fr_redis_cluster_thread_t *fr_redis_cluster_thread_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+							 fr_trunk_conf_t const *tconf,
+							 fr_redis_cluster_t *cluster, fr_redis_conf_t const *conf)
 {
 	fr_redis_cluster_thread_t *cluster_thread;
 	fr_trunk_conf_t *our_tconf;
@@ -655,8 +1122,16 @@ fr_redis_cluster_thread_t *fr_redis_cluster_thread_alloc(TALLOC_CTX *ctx, fr_eve
 
 	cluster_thread->el = el;
 	cluster_thread->tconf = our_tconf;
+	cluster_thread->cluster = cluster;
+	cluster_thread->conf = conf;
+	if (conf && conf->log_prefix) MEM(cluster_thread->log_prefix = talloc_strdup(cluster_thread, conf->log_prefix));
+	MEM(cluster_thread->trunks = fr_rb_inline_talloc_alloc(cluster_thread, fr_redis_trunk_t, node,
+							       _redis_trunk_cmp, NULL));
+	if (cluster) {
+		fr_assert(conf);
+		MEM(cluster_thread->slots = talloc_zero_array(cluster_thread, fr_redis_trunk_t *, KEY_SLOTS));
+		cluster_thread->map_version = fr_redis_cluster_map_version(cluster);
+	}
 
 	return cluster_thread;
 }
-
-
@@ -67,7 +67,7 @@ static void test_basic_connection(void)
 		TEST_CHECK(fr_redis_command_preformatted_add(cmds, "PING", sizeof("PING") - 1) == FR_REDIS_PIPELINE_OK);
 	}
 
-	cluster_thread = fr_redis_cluster_thread_alloc(ctx, el, &trunk_conf);
+	cluster_thread = fr_redis_cluster_thread_alloc(ctx, el, &trunk_conf, NULL, NULL);
 	rtrunk = fr_redis_trunk_alloc(cluster_thread,  &(fr_redis_io_conf_t){ .hostname = "127.0.0.1", .port = 30001 });
 
 	stats.enqueued = 1000000;
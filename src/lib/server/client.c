@@ -41,8 +41,15 @@ RCSID("$Id$")
 
 #include <ctype.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 //#define WITH_TRIE (1)
 
 /** Group of clients
@@ -50,6 +57,8 @@ RCSID("$Id$")
  */
 struct rad_client_list {
 	char const	*name;			//!< Name of the client list.
+	pthread_rwlock_t lock;			//!< Clients may be added and removed while
+						///< the network threads are looking them up.
 #ifdef WITH_TRIE
 	fr_trie_t	*v4_udp;
 	fr_trie_t	*v6_udp;
@@ -62,6 +71,16 @@ struct rad_client_list {
 
 static RADCLIENT_LIST	*root_clients = NULL;	//!< Global client list.
 
+/** Protects root_clients, and the per-server lists, while they're being created
+ *
+ */
+static pthread_mutex_t	client_lists_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Incremented whenever a client is added to, or removed from, any list
+ *
+ */
+static atomic_uint_fast64_t client_lists_version;
+
 #ifndef WITH_TRIE
 static int8_t client_cmp(void const *one, void const *two)
 {
@@ -98,6 +117,12 @@ void client_free(RADCLIENT *client)
 	talloc_free(client);
 }
 
+static int _client_list_free(RADCLIENT_LIST *clients)
+{
+	pthread_rwlock_destroy(&clients->lock);
+	return 0;
+}
+
 /** Return a new client list
  *
  * @note The container won't contain any clients.
@@ -113,6 +138,8 @@ RADCLIENT_LIST *client_list_init(CONF_SECTION *cs)
 	if (!clients) return NULL;
 
 	clients->name = talloc_strdup(clients, cs ? cf_section_name1(cs) : "root");
+	pthread_rwlock_init(&clients->lock, NULL);
+	talloc_set_destructor(clients, _client_list_free);
 
 #ifdef WITH_TRIE
 	clients->v4_udp = fr_trie_alloc(clients, NULL, NULL);
@@ -172,6 +199,90 @@ static fr_trie_t *clients_trie(RADCLIENT_LIST const *clients, fr_ipaddr_t const
 }
 #endif	/* WITH_TRIE */
 
+/** Find the list a client should be added to
+ *
+ * If "clients" is NULL, it means add to the global list,
+ * unless we're trying to add it to a virtual server...
+ *
+ * @param clients list passed to #client_add.
+ * @param client to find the list for.
+ * @return
+ *	- The list.
+ *	- NULL on error.
+ */
+static RADCLIENT_LIST *client_list_for(RADCLIENT_LIST *clients, RADCLIENT const *client)
+{
+	CONF_SECTION *cs;
+	CONF_SECTION *subcs;
+
+	if (clients) return clients;
+
+	pthread_mutex_lock(&client_lists_mutex);
+	if (client->server != NULL) {
+		/*
+		 *	Clients which weren't built from a CONF_SECTION
+		 *	have the virtual server resolved already.
+		 */
+		cs = client->server_cs;
+		if (!cs) {
+			if (!client->cs) {
+				ERROR("Failed to find configuration section in client.  Ignoring 'virtual_server' directive");
+				goto error;
+			}
+
+			cs = cf_section_find(cf_root(client->cs), "server", client->server);
+			if (!cs) {
+				ERROR("Failed to find virtual server %s", client->server);
+				goto error;
+			}
+		}
+
+		/*
+		 *	If this server has no "listen" section, add the clients
+		 *	to the global client list.
+		 */
+		subcs = cf_section_find(cs, "listen", NULL);
+		if (!subcs) goto global_clients;
+
+		/*
+		 *	If the client list already exists, use that.
+		 *	Otherwise, create a new client list.
+		 */
+		clients = cf_data_value(cf_data_find(cs, RADCLIENT_LIST, NULL));
+		if (!clients) {
+			clients = client_list_init(cs);
+			if (!clients) {
+				ERROR("Out of memory");
+				goto error;
+			}
+
+			if (!cf_data_add(cs, clients, NULL, true)) {
+				ERROR("Failed to associate clients with virtual server %s", client->server);
+				talloc_free(clients);
+				goto error;
+			}
+		}
+
+	} else {
+	global_clients:
+		/*
+		 *	Initialize the global list, if not done already.
+		 */
+		if (!root_clients) {
+			root_clients = client_list_init(NULL);
+			if (!root_clients) goto error;
+		}
+		clients = root_clients;
+	}
+	pthread_mutex_unlock(&client_lists_mutex);
+
+	return clients;
+
+error:
+	pthread_mutex_unlock(&client_lists_mutex);
+	return NULL;
+}
+
 /** Add a client to a RADCLIENT_LIST
  *
  * @param clients list to add client to, may be NULL if global client list is being used.
@@ -215,64 +326,10 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	fr_inet_ntop_prefix(buffer, sizeof(buffer), &client->ipaddr);
 	DEBUG3("Adding client %s (%s) to prefix tree %i", buffer, client->longname, client->ipaddr.prefix);
 
-	/*
-	 *	If "clients" is NULL, it means add to the global list,
-	 *	unless we're trying to add it to a virtual server...
-	 */
-	if (!clients) {
-		if (client->server != NULL) {
-			CONF_SECTION *cs;
-			CONF_SECTION *subcs;
+	clients = client_list_for(clients, client);
+	if (!clients) return false;
 
-			if (!client->cs) {
-				ERROR("Failed to find configuration section in client.  Ignoring 'virtual_server' directive");
-				return false;
-			}
-
-			cs = cf_section_find(cf_root(client->cs), "server", client->server);
-			if (!cs) {
-				ERROR("Failed to find virtual server %s", client->server);
-				return false;
-			}
-
-			/*
-			 *	If this server has no "listen" section, add the clients
-			 *	to the global client list.
-			 */
-			subcs = cf_section_find(cs, "listen", NULL);
-			if (!subcs) goto global_clients;
-
-			/*
-			 *	If the client list already exists, use that.
-			 *	Otherwise, create a new client list.
-			 */
-			clients = cf_data_value(cf_data_find(cs, RADCLIENT_LIST, NULL));
-			if (!clients) {
-				clients = client_list_init(cs);
-				if (!clients) {
-					ERROR("Out of memory");
-					return false;
-				}
-
-				if (!cf_data_add(cs, clients, NULL, true)) {
-					ERROR("Failed to associate clients with virtual server %s", client->server);
-					talloc_free(clients);
-					return false;
-				}
-			}
-
-		} else {
-		global_clients:
-			/*
-			 *	Initialize the global list, if not done already.
-			 */
-			if (!root_clients) {
-				root_clients = client_list_init(NULL);
-				if (!root_clients) return false;
-			}
-			clients = root_clients;
-		}
-	}
+	pthread_rwlock_wrlock(&clients->lock);
 
 #define namecmp(a) ((!old->a && !client->a) || (old->a && client->a && (strcmp(old->a, client->a) == 0)))
 
@@ -290,6 +347,7 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 		clients->tree[client->ipaddr.prefix] = fr_rb_inline_talloc_alloc(clients, RADCLIENT, node, client_cmp,
 										 NULL);
 		if (!clients->tree[client->ipaddr.prefix]) {
+			pthread_rwlock_unlock(&clients->lock);
 			return false;
 		}
 	}
@@ -305,11 +363,13 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 		    namecmp(shortname) && namecmp(nas_type) &&
 		    namecmp(server) &&
 		    (old->message_authenticator == client->message_authenticator)) {
+			pthread_rwlock_unlock(&clients->lock);
 			WARN("Ignoring duplicate client %s", client->longname);
 			client_free(client);
 			return true;
 		}
 
+		pthread_rwlock_unlock(&clients->lock);
 		ERROR("Failed to add duplicate client %s", client->shortname);
 		client_free(client);
 		return false;
@@ -321,21 +381,28 @@ bool client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	 *	Other error adding client: likely is fatal.
 	 */
 	if (fr_trie_insert_by_key(trie, &client->ipaddr.addr, client->ipaddr.prefix, client) < 0) {
+		pthread_rwlock_unlock(&clients->lock);
 		client_free(client);
 		return false;
 	}
 #else
 	if (!fr_rb_insert(clients->tree[client->ipaddr.prefix], client)) {
+		pthread_rwlock_unlock(&clients->lock);
 		client_free(client);
 		return false;
 	}
 #endif
+	client->list = clients;
 
 	/*
 	 *	@todo - do we want to do this for dynamic clients?
 	 */
 	(void) talloc_steal(clients, client); /* reparent it */
 
+	pthread_rwlock_unlock(&clients->lock);
+
+	atomic_fetch_add_explicit(&client_lists_version, 1, memory_order_relaxed);
+
 	return true;
 }
 
@@ -348,10 +415,12 @@ void client_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
 
 	if (!client) return;
 
-	if (!clients) clients = root_clients;
+	if (!clients) clients = client->list ? client->list : root_clients;
+	if (!clients) return;
 
 	fr_assert(client->ipaddr.prefix <= 128);
 
+	pthread_rwlock_wrlock(&clients->lock);
 #ifdef WITH_TRIE
 	trie = clients_trie(clients, &client->ipaddr, client->proto);
 
@@ -361,12 +430,202 @@ void client_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
 	(void) fr_trie_remove_by_key(trie, &client->ipaddr.addr, client->ipaddr.prefix);
 #else
 
-	if (!clients->tree[client->ipaddr.prefix]) return;
+	if (clients->tree[client->ipaddr.prefix]) (void) fr_rb_remove(clients->tree[client->ipaddr.prefix], client);
+#endif
+	pthread_rwlock_unlock(&clients->lock);
 
-	(void) fr_rb_delete(clients->tree[client->ipaddr.prefix], client);
+	atomic_fetch_add_explicit(&client_lists_version, 1, memory_order_relaxed);
+}
+
+/** Return a number which changes whenever clients are added or removed
+ *
+ * Lets callers which cache information about clients, such as socket
+ * filters, cheaply check whether they need to rebuild it.
+ */
+uint64_t client_list_version(void)
+{
+	return atomic_load_explicit(&client_lists_version, memory_order_relaxed);
+}
+
+/** Return the networks of all the clients in a list
+ *
+ * @param[in] ctx	to allocate the array in.
+ * @param[out] out	talloc array of client networks.
+ * @param[in] clients	list to return networks from, or NULL for the global list.
+ * @param[in] af	only return clients of this address family.
+ * @param[in] proto	only return clients which accept this protocol.
+ * @return
+ *	- The number of networks.
+ *	- -1 on error.
+ */
+int client_list_networks(TALLOC_CTX *ctx, fr_ipaddr_t **out, RADCLIENT_LIST const *clients, int af, int proto)
+{
+	fr_ipaddr_t	*networks;
+	size_t		num = 0;
+#ifndef WITH_TRIE
+	int		i;
+#endif
+
+	if (!clients) clients = root_clients;
+
+	MEM(networks = talloc_array(ctx, fr_ipaddr_t, 0));
+	if (!clients) {
+		*out = networks;
+		return 0;
+	}
+
+#ifdef WITH_TRIE
+	talloc_free(networks);
+	fr_strerror_const("Listing clients is not supported");
+	return -1;
+#else
+	pthread_rwlock_rdlock(&UNCONST(RADCLIENT_LIST *, clients)->lock);
+	for (i = 0; i <= 128; i++) {
+		fr_rb_iter_inorder_t	iter;
+		RADCLIENT		*client;
+
+		if (!clients->tree[i]) continue;
+
+		for (client = fr_rb_iter_init_inorder(&iter, clients->tree[i]);
+		     client;
+		     client = fr_rb_iter_next_inorder(&iter)) {
+			if (client->ipaddr.af != af) continue;
+			if ((client->proto != IPPROTO_IP) && (client->proto != proto)) continue;
+
+			MEM(networks = talloc_realloc(ctx, networks, fr_ipaddr_t, num + 1));
+			networks[num++] = client->ipaddr;
+		}
+	}
+	pthread_rwlock_unlock(&UNCONST(RADCLIENT_LIST *, clients)->lock);
+
+	*out = networks;
+	return num;
 #endif
 }
 
+/** Replace the clients loaded by a module with a new set, without a restart
+ *
+ * Clients in the new set which are the same as existing clients are freed,
+ * and the existing clients are kept.  Clients which have changed are replaced,
+ * and clients which are no longer in the set are removed.
+ *
+ * Removed clients aren't freed, as the network threads may still be using
+ * them.  They're freed with the client list.
+ *
+ * @param[in] ctx		to allocate the array of loaded clients in.
+ * @param[out] out		Clients the owner has loaded after the sync, a talloc array.
+ * @param[in] current		Clients the owner loaded previously, a talloc array.
+ *				NULL on the first load.  The caller should free it
+ *				after the sync.
+ * @param[in] owner		of the clients, usually a module instance.  Only clients
+ *				with this owner are replaced or removed.
+ * @param[in] update		New set of clients.  Ownership of all of them passes to
+ *				this function.
+ * @param[in] num_update	How many clients there are in update.
+ * @return
+ *	- The number of clients which were added, changed, or removed.
+ *	- -1 on error.  Clients which could be updated are, and the rest are freed.
+ */
+int client_list_sync(TALLOC_CTX *ctx, RADCLIENT ***out, RADCLIENT * const *current, void const *owner,
+		     RADCLIENT **update, size_t num_update)
+{
+	static uint64_t	generation;
+	uint64_t	gen;
+	RADCLIENT	**loaded;
+	size_t		i, num_loaded = 0, num_current;
+	int		changes = 0;
+	bool		failed = false;
+
+	pthread_mutex_lock(&client_lists_mutex);
+	gen = ++generation;
+	pthread_mutex_unlock(&client_lists_mutex);
+
+	MEM(loaded = talloc_array(ctx, RADCLIENT *, num_update));
+
+	for (i = 0; i < num_update; i++) {
+		RADCLIENT	*client = update[i], *old;
+		RADCLIENT_LIST	*clients;
+
+		client->owner = owner;
+		client->generation = gen;
+
+		clients = client_list_for(NULL, client);
+		if (!clients) {
+			client_free(client);
+			failed = true;
+			continue;
+		}
+
+#ifdef WITH_TRIE
+		old = NULL;
+#else
+		pthread_rwlock_rdlock(&clients->lock);
+		old = clients->tree[client->ipaddr.prefix] ? fr_rb_find(clients->tree[client->ipaddr.prefix], client) : NULL;
+		pthread_rwlock_unlock(&clients->lock);
+#endif
+
+#define namecmp(a) ((!old->a && !client->a) || (old->a && client->a && (strcmp(old->a, client->a) == 0)))
+		if (old && (old->owner == owner)) {
+			/*
+			 *	Unchanged, keep the existing client,
+			 *	so any connections using it are unaffected.
+			 */
+			if (namecmp(longname) && namecmp(secret) &&
+			    namecmp(shortname) && namecmp(nas_type) &&
+			    namecmp(server) && (old->proto == client->proto) &&
+			    (old->message_authenticator == client->message_authenticator)) {
+				old->generation = gen;
+				loaded[num_loaded++] = old;
+				client_free(client);
+				continue;
+			}
+
+			old->generation = gen;
+			client_delete(clients, old);
+			changes++;
+			DEBUG("Client %s changed, replacing it", client->longname);
+		} else {
+			DEBUG("Client %s added", client->longname);
+		}
+#undef namecmp
+
+		if (!client_add(clients, client)) {
+			failed = true;
+			continue;
+		}
+		if (!old) changes++;
+		loaded[num_loaded++] = client;
+	}
+
+	/*
+	 *	Anything which wasn't in the update has been removed.
+	 */
+	num_current = current ? talloc_array_length(current) : 0;
+	for (i = 0; i < num_current; i++) {
+		RADCLIENT *old = current[i];
+
+		if (old->generation == gen) continue;
+
+		DEBUG("Client %s removed", old->longname);
+		client_delete(old->list, old);
+		changes++;
+	}
+
+	/*
+	 *	talloc_realloc() frees the array if it's
+	 *	shrunk to zero.
+	 */
+	if (num_loaded == 0) {
+		talloc_free(loaded);
+		MEM(loaded = talloc_array(ctx, RADCLIENT *, 0));
+	} else if (num_loaded < num_update) {
+		MEM(loaded = talloc_realloc(ctx, loaded, RADCLIENT *, num_loaded));
+	}
+	*out = loaded;
+
+	return failed ? -1 : changes;
+}
+
 RADCLIENT *client_findbynumber(UNUSED const RADCLIENT_LIST *clients, UNUSED int number)
 {
 	return NULL;
@@ -378,21 +637,27 @@ RADCLIENT *client_findbynumber(UNUSED const RADCLIENT_LIST *clients, UNUSED int
  */
 RADCLIENT *client_find(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr, int proto)
 {
+	RADCLIENT *client;
 #ifdef WITH_TRIE
 	fr_trie_t *trie;
 #else
 	int i, max;
-	RADCLIENT my_client, *client;
+	RADCLIENT my_client;
 #endif
 
 	if (!clients) clients = root_clients;
 
 	if (!clients || !ipaddr) return NULL;
 
+	/*
+	 *	The lock is only ever contended while clients
+	 *	are being reloaded.
+	 */
+	pthread_rwlock_rdlock(&UNCONST(RADCLIENT_LIST *, clients)->lock);
 #ifdef WITH_TRIE
 	trie = clients_trie(clients, ipaddr, proto);
 
-	return fr_trie_lookup_by_key(trie, &ipaddr->addr, ipaddr->prefix);
+	client = fr_trie_lookup_by_key(trie, &ipaddr->addr, ipaddr->prefix);
 #else
 
 	if (proto == AF_INET) {
@@ -403,6 +668,7 @@ RADCLIENT *client_find(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr,
 
 	if (max > ipaddr->prefix) max = ipaddr->prefix;
 
+	client = NULL;
 	my_client.proto = proto;
 	for (i = max; i >= 0; i--) {
 		if (!clients->tree[i]) continue;
@@ -410,13 +676,12 @@ RADCLIENT *client_find(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr,
 		my_client.ipaddr = *ipaddr;
 		fr_ipaddr_mask(&my_client.ipaddr, i);
 		client = fr_rb_find(clients->tree[i], &my_client);
-		if (client) {
-			return client;
-		}
+		if (client) break;
 	}
-
-	return NULL;
 #endif
+	pthread_rwlock_unlock(&UNCONST(RADCLIENT_LIST *, clients)->lock);
+
+	return client;
 }
 
 static fr_ipaddr_t cl_ipaddr;
@@ -448,6 +713,8 @@ static const CONF_PARSER client_config[] = {
 
 	{ FR_CONF_OFFSET("virtual_server", FR_TYPE_STRING, RADCLIENT, server) },
 	{ FR_CONF_OFFSET("response_window", FR_TYPE_TIME_DELTA, RADCLIENT, response_window) },
+	{ FR_CONF_OFFSET("request_deadline", FR_TYPE_TIME_DELTA, RADCLIENT, request_deadline) },
+	{ FR_CONF_OFFSET("fair_share", FR_TYPE_UINT32, RADCLIENT, fair_share), .dflt = "1" },
 
 	{ FR_CONF_OFFSET("track_connections", FR_TYPE_BOOL, RADCLIENT, use_connected) },
 
@@ -864,6 +1131,18 @@ RADCLIENT *client_afrom_cs(TALLOC_CTX *ctx, CONF_SECTION *cs, CONF_SECTION *serv
 		FR_TIME_DELTA_BOUND_CHECK("response_window", c->response_window, <=, main_config->max_request_time);
 	}
 
+	/*
+	 *	A request_deadline of zero means "use the worker
+	 *	default".
+	 */
+	if (c->request_deadline) {
+		FR_TIME_DELTA_BOUND_CHECK("request_deadline", c->request_deadline, >=, fr_time_delta_from_msec(100));
+		FR_TIME_DELTA_BOUND_CHECK("request_deadline", c->request_deadline, <=, main_config->max_request_time);
+	}
+
+	FR_INTEGER_BOUND_CHECK("fair_share", c->fair_share, >=, 1);
+	FR_INTEGER_BOUND_CHECK("fair_share", c->fair_share, <=, 1000);
+
 #ifdef WITH_TLS
 	/*
 	 *	If the client is TLS only, the secret can be
@@ -884,6 +1163,19 @@ RADCLIENT *client_afrom_cs(TALLOC_CTX *ctx, CONF_SECTION *cs, CONF_SECTION *serv
 			c->limit.idle_timeout = 0;
 	}
 
+	/*
+	 *	The secret is fixed for the lifetime of the
+	 *	client, so only absorb it into the HMAC-MD5
+	 *	state once.
+	 */
+	if (c->secret) {
+		c->secret_hmac = fr_hmac_md5_key_alloc(c, (uint8_t const *) c->secret, talloc_array_length(c->secret) - 1);
+		if (!c->secret_hmac) {
+			cf_log_err(cs, "Failed precomputing HMAC state for secret");
+			goto error;
+		}
+	}
+
 	return c;
 }
 
@@ -924,6 +1216,11 @@ RADCLIENT *client_afrom_query(TALLOC_CTX *ctx, char const *identifier, char cons
 	 *	Other values (secret, shortname, nas_type, virtual_server)
 	 */
 	c->secret = talloc_typed_strdup(c, secret);
+	c->secret_hmac = fr_hmac_md5_key_alloc(c, (uint8_t const *) c->secret, talloc_array_length(c->secret) - 1);
+	if (!c->secret_hmac) {
+		talloc_free(c);
+		return NULL;
+	}
 	if (shortname) c->shortname = talloc_typed_strdup(c, shortname);
 	if (type) c->nas_type = talloc_typed_strdup(c, type);
 	if (server) c->server = talloc_typed_strdup(c, server);
@@ -932,6 +1229,160 @@ RADCLIENT *client_afrom_query(TALLOC_CTX *ctx, char const *identifier, char cons
 	return c;
 }
 
+/** Whether clients can be built from a map with #client_afrom_map
+ *
+ * Building a CONF_SECTION for each client and parsing it is slow when
+ * there are a lot of clients.  If the template is empty, and the map only
+ * sets simple client fields, the client can be built directly.
+ *
+ * @param[in] tmpl	Section with default values for new clients.  May be NULL.
+ * @param[in] map	Section mapping client fields to result fields.
+ * @return
+ *	- true if #client_afrom_map can be used.
+ *	- false if the client must be built with #client_map_section and #client_afrom_cs.
+ */
+bool client_map_is_direct(CONF_SECTION const *tmpl, CONF_SECTION const *map)
+{
+	static char const * const direct[] = {
+		"ipaddr", "ipv4addr", "ipv6addr", "secret", "shortname", "nas_type",
+		"virtual_server", "require_message_authenticator", "proto"
+	};
+	CONF_ITEM const *ci;
+
+	if (tmpl && cf_item_next(tmpl, NULL)) return false;
+
+	for (ci = cf_item_next(map, NULL);
+	     ci != NULL;
+	     ci = cf_item_next(map, ci)) {
+		char const	*attr;
+		size_t		i;
+
+		if (!cf_item_is_pair(ci)) return false;
+
+		attr = cf_pair_attr(cf_item_to_pair(ci));
+		for (i = 0; i < NUM_ELEMENTS(direct); i++) {
+			if (strcmp(attr, direct[i]) == 0) break;
+		}
+		if (i == NUM_ELEMENTS(direct)) return false;
+	}
+
+	return true;
+}
+
+/** Build a client directly from a result, without creating a CONF_SECTION
+ *
+ * The map must have been checked with #client_map_is_direct.
+ *
+ * @param[in] ctx	to allocate the client in.
+ * @param[in] name	of the client.  Used as the shortname if the map doesn't set one.
+ * @param[in] map	Section mapping client fields to result fields.
+ * @param[in] func	to call to retrieve values.
+ * @param[in] data	to pass to func.
+ * @return
+ *	- New client.
+ *	- NULL on error.
+ */
+RADCLIENT *client_afrom_map(TALLOC_CTX *ctx, char const *name, CONF_SECTION const *map,
+			    client_value_cb_t func, void *data)
+{
+	RADCLIENT	*c;
+	CONF_ITEM const	*ci;
+	bool		have_ipaddr = false;
+	char		buffer[128];
+
+	MEM(c = talloc_zero(ctx, RADCLIENT));
+	c->proto = IPPROTO_UDP;
+
+	for (ci = cf_item_next(map, NULL);
+	     ci != NULL;
+	     ci = cf_item_next(map, ci)) {
+		CONF_PAIR const	*cp = cf_item_to_pair(ci);
+		char const	*attr = cf_pair_attr(cp);
+		char		*value;
+
+		if (func(&value, cp, data) < 0) {
+			fr_strerror_printf("Failed performing mapping \"%s\" = \"%s\"", attr, cf_pair_value(cp));
+		error:
+			talloc_free(c);
+			return NULL;
+		}
+		if (!value) continue;
+
+		if ((strcmp(attr, "ipaddr") == 0) || (strcmp(attr, "ipv4addr") == 0) ||
+		    (strcmp(attr, "ipv6addr") == 0)) {
+			int af = (attr[2] == '4') ? AF_INET : (attr[2] == '6') ? AF_INET6 : AF_UNSPEC;
+
+			if (fr_inet_pton(&c->ipaddr, value, -1, af, true, true) < 0) {
+				fr_strerror_printf_push("Failed parsing %s for client %s", attr, name);
+				talloc_free(value);
+				goto error;
+			}
+			have_ipaddr = true;
+			talloc_free(value);
+
+		} else if (strcmp(attr, "secret") == 0) {
+			c->secret = talloc_steal(c, value);
+
+		} else if (strcmp(attr, "shortname") == 0) {
+			c->shortname = talloc_steal(c, value);
+
+		} else if (strcmp(attr, "nas_type") == 0) {
+			c->nas_type = talloc_steal(c, value);
+
+		} else if (strcmp(attr, "virtual_server") == 0) {
+			c->server = talloc_steal(c, value);
+
+		} else if (strcmp(attr, "require_message_authenticator") == 0) {
+			c->message_authenticator = (strcmp(value, "yes") == 0) || (strcmp(value, "true") == 0) ||
+						   (strcmp(value, "1") == 0);
+			talloc_free(value);
+
+		} else if (strcmp(attr, "proto") == 0) {
+			if (strcmp(value, "tcp") == 0) {
+				c->proto = IPPROTO_TCP;
+			} else if (strcmp(value, "*") == 0) {
+				c->proto = IPPROTO_IP;
+			} else if (strcmp(value, "udp") != 0) {
+				fr_strerror_printf("Unknown proto \"%s\" for client %s", value, name);
+				talloc_free(value);
+				goto error;
+			}
+			talloc_free(value);
+
+		} else {
+			fr_assert_msg(0, "Map not checked with client_map_is_direct");
+			talloc_free(value);
+		}
+	}
+
+	if (!have_ipaddr) {
+		fr_strerror_printf("No 'ipaddr' or 'ipv4addr' or 'ipv6addr' found for client %s", name);
+		goto error;
+	}
+
+	if (c->server) {
+		c->server_cs = virtual_server_find(c->server);
+		if (!c->server_cs) {
+			fr_strerror_printf("Failed to find virtual server %s for client %s", c->server, name);
+			goto error;
+		}
+	}
+
+	fr_inet_ntoh(&c->ipaddr, buffer, sizeof(buffer));
+	c->longname = talloc_typed_strdup(c, buffer);
+	if (!c->shortname) c->shortname = talloc_typed_strdup(c, name);
+
+	if (c->secret) {
+		c->secret_hmac = fr_hmac_md5_key_alloc(c, (uint8_t const *) c->secret, talloc_array_length(c->secret) - 1);
+		if (!c->secret_hmac) {
+			fr_strerror_printf("Failed precomputing HMAC state for client %s", name);
+			goto error;
+		}
+	}
+
+	return c;
+}
+
 /** Create a new client, consuming all attributes in the control list of the request
  *
  * @param ctx the talloc context
@@ -70,6 +70,7 @@ typedef int (*client_value_cb_t)(char **out, CONF_PAIR const *cp, void *data);
 #include <freeradius-devel/server/socket.h>
 #include <freeradius-devel/server/stats.h>
 #include <freeradius-devel/util/inet.h>
+#include <freeradius-devel/util/md5.h>
 
 /** Describes a host allowed to send packets to the server
  *
@@ -85,6 +86,7 @@ struct rad_client {
 	char const		*shortname;		//!< Client nickname.
 
 	char const		*secret;		//!< Secret PSK.
+	fr_hmac_md5_key_t	*secret_hmac;		//!< HMAC-MD5 state precomputed from the secret.
 
 	bool			message_authenticator;	//!< Require RADIUS message authenticator in requests.
 	bool			dynamic;		//!< Whether the client was dynamically defined.
@@ -110,9 +112,16 @@ struct rad_client {
 #endif
 
 	fr_time_delta_t		response_window;	//!< How long the client has to respond.
+	fr_time_delta_t		request_deadline;	//!< How long the client waits for a reply.
+	uint32_t		fair_share;		//!< Relative share of each worker, when fair
+							///< queueing is enabled.
 
 	int			proto;			//!< Protocol number.
 	fr_socket_limit_t	limit;			//!< Connections per client (TCP clients only).
+
+	RADCLIENT_LIST		*list;			//!< The client was added to.
+	void const		*owner;			//!< Which loaded the client, for #client_list_sync.
+	uint64_t		generation;		//!< Sync the client was last seen in.
 };
 
 RADCLIENT_LIST	*client_list_init(CONF_SECTION *cs);
@@ -127,12 +136,25 @@ bool		client_add(RADCLIENT_LIST *clients, RADCLIENT *client);
 
 void		client_delete(RADCLIENT_LIST *clients, RADCLIENT *client);
 
+uint64_t	client_list_version(void);
+
+int		client_list_networks(TALLOC_CTX *ctx, fr_ipaddr_t **out, RADCLIENT_LIST const *clients,
+				     int af, int proto) CC_HINT(nonnull(2));
+
+int		client_list_sync(TALLOC_CTX *ctx, RADCLIENT ***out, RADCLIENT * const *current, void const *owner,
+				 RADCLIENT **update, size_t num_update) CC_HINT(nonnull(2));
+
 RADCLIENT	*client_afrom_request(TALLOC_CTX *ctx, request_t *request);
 
 int		client_map_section(CONF_SECTION *out, CONF_SECTION const *map, client_value_cb_t func, void *data);
 
 RADCLIENT	*client_afrom_cs(TALLOC_CTX *ctx, CONF_SECTION *cs, CONF_SECTION *server_cs);
 
+bool		client_map_is_direct(CONF_SECTION const *tmpl, CONF_SECTION const *map) CC_HINT(nonnull(2));
+
+RADCLIENT	*client_afrom_map(TALLOC_CTX *ctx, char const *name, CONF_SECTION const *map,
+				  client_value_cb_t func, void *data) CC_HINT(nonnull(2,3,4));
+
 RADCLIENT	*client_afrom_query(TALLOC_CTX *ctx, char const *identifier, char const *secret, char const *shortname,
 				    char const *type, char const *server, bool require_ma)
 		CC_HINT(nonnull(2, 3));
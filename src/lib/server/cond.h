@@ -60,6 +60,8 @@ typedef enum {
 	COND_TYPE_CHILD
 } fr_cond_type_t;
 
+typedef struct fr_cond_stats_s fr_cond_stats_t;
+
 typedef enum {
 	PASS2_FIXUP_NONE = 0,
 	PASS2_FIXUP_ATTR,
@@ -91,6 +93,11 @@ struct fr_cond_s {
 	bool			negate;		//!< Invert the result of the expression.
 	fr_cond_pass2_t		pass2_fixup;
 
+	fr_value_box_cmp_op_func_t cmp;		//!< Comparison specialised for the data types of
+						///< an attribute and a literal, or NULL.
+
+	fr_cond_stats_t		*stats;		//!< Profiling counters for leaf conditions.
+
 	fr_cond_t		*parent;
 	fr_cond_t		*next;
 };
@@ -110,6 +117,8 @@ fr_cond_t *fr_cond_iter_next(fr_cond_iter_t *iter);
 
 void fr_cond_async_update(fr_cond_t *cond);
 
+int fr_cond_profile_add(fr_cond_t *head, CONF_SECTION *cs);
+
 #ifdef __cplusplus
 }
 #endif
@@ -31,16 +31,114 @@ RCSID("$Id$")
 #include <freeradius-devel/server/paircmp.h>
 #include <freeradius-devel/server/regex.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/util/print.h>
 
 #include <ctype.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 #ifdef WITH_EVAL_DEBUG
 #  define EVAL_DEBUG(fmt, ...) printf("EVAL: ");fr_fprintf(stdout, fmt, ## __VA_ARGS__);printf("\n");fflush(stdout)
 #else
 #  define EVAL_DEBUG(...)
 #endif
 
+/** Profiling counters for a leaf condition
+ *
+ * Conditions are shared by all workers, so the counters are atomic.
+ */
+struct fr_cond_stats_s {
+	atomic_uint_fast64_t	evaluated;	//!< Number of times the condition was evaluated.
+	atomic_uint_fast64_t	matched;	//!< Number of times it was true, after negation.
+	atomic_uint_fast64_t	time;		//!< Total time spent evaluating it.
+};
+
+/** A condition which can be profiled
+ *
+ */
+typedef struct {
+	fr_cond_t const		*head;		//!< Root of the condition.
+	char const		*filename;	//!< Where the condition was defined.
+	int			lineno;		//!< Line the condition was defined on.
+	fr_dlist_t		entry;		//!< Entry in the list of all conditions.
+} cond_profile_t;
+
+/** Whether the evaluation of leaf conditions is profiled
+ *
+ * Changed with `set condition profile (on|off)` in radmin.
+ */
+bool cond_profile = false;
+
+static fr_dlist_head_t	cond_profile_list;
+
+static inline CC_HINT(always_inline) void cond_profile_record(fr_cond_t const *c, fr_time_t start, int rcode)
+{
+	fr_cond_stats_t *stats = c->stats;
+
+	if (!stats) return;
+
+	atomic_fetch_add_explicit(&stats->evaluated, 1, memory_order_relaxed);
+	if (rcode > 0) atomic_fetch_add_explicit(&stats->matched, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&stats->time, fr_time() - start, memory_order_relaxed);
+}
+
+static int _cond_profile_free(cond_profile_t *cp)
+{
+	fr_dlist_remove(&cond_profile_list, cp);
+
+	return 0;
+}
+
+/** Allocate profiling counters for a condition, and make it visible to radmin
+ *
+ * Called when the condition is parsed, which happens before any workers
+ * are started.  The counters are freed with the condition.
+ *
+ * @param[in] head	of the condition.
+ * @param[in] cs	the condition was parsed from.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_cond_profile_add(fr_cond_t *head, CONF_SECTION *cs)
+{
+	cond_profile_t	*cp;
+	fr_cond_iter_t	iter;
+	fr_cond_t	*c;
+
+	if (!fr_dlist_initialised(&cond_profile_list)) fr_dlist_init(&cond_profile_list, cond_profile_t, entry);
+
+	for (c = fr_cond_iter_init(&iter, head);
+	     c;
+	     c = fr_cond_iter_next(&iter)) {
+		if ((c->type == COND_TYPE_AND) || (c->type == COND_TYPE_OR)) continue;
+
+		c->stats = talloc_zero(c, fr_cond_stats_t);
+		if (!c->stats) {
+		oom:
+			fr_strerror_const("Out of memory");
+			return -1;
+		}
+	}
+
+	cp = talloc(head, cond_profile_t);
+	if (!cp) goto oom;
+	*cp = (cond_profile_t){
+		.head = head,
+		.filename = cf_filename(cs),
+		.lineno = cf_lineno(cs)
+	};
+	fr_dlist_insert_tail(&cond_profile_list, cp);
+	talloc_set_destructor(cp, _cond_profile_free);
+
+	return 0;
+}
+
 static int cond_realize_tmpl(request_t *request,
 			     fr_value_box_t **out, fr_value_box_t **to_free,
 			     tmpl_t *in, tmpl_t *other, fr_value_box_t *async);
@@ -611,7 +709,7 @@ static int cond_eval_map(request_t *request, fr_cond_t const *c,
 
 	fr_value_box_t *lhs, *lhs_free;
 	fr_value_box_t *rhs, *rhs_free;
-	regex_t		*preg, *preg_free;
+	regex_t		*preg;
 
 #ifndef NDEBUG
 	/*
@@ -630,7 +728,7 @@ static int cond_eval_map(request_t *request, fr_cond_t const *c,
 #endif
 
 	MAP_VERIFY(map);
-	preg = preg_free = NULL;
+	preg = NULL;
 
 	/*
 	 *	Realize the LHS of a condition.
@@ -661,14 +759,18 @@ static int cond_eval_map(request_t *request, fr_cond_t const *c,
 
 			if (!fr_cond_assert(rhs && tmpl_contains_regex(map->rhs))) goto done;
 
-			slen = regex_compile(request, &preg_free, rhs->vb_strvalue, rhs->vb_length,
-					     tmpl_regex_flags(map->rhs), true, true);
+			/*
+			 *	Dynamic expressions are often the same
+			 *	from one request to the next, so get
+			 *	them from the per-thread cache.
+			 */
+			slen = regex_compile_cached(&preg, rhs->vb_strvalue, rhs->vb_length,
+						    tmpl_regex_flags(map->rhs), true);
 			if (slen <= 0) {
 				REMARKER(rhs->vb_strvalue, -slen, "%s", fr_strerror());
 				EVAL_DEBUG("FAIL %d", __LINE__);
 				return -1;
 			}
-			preg = preg_free;
 		}
 
 		/*
@@ -762,6 +864,19 @@ check_attrs:
 	     	     vp = fr_dcursor_next(&cursor)) {
 			fr_value_box_t lhs_cast;
 
+			/*
+			 *	The comparison was chosen when the
+			 *	condition was compiled, and works on
+			 *	the attribute's own data.
+			 */
+			if (c->cmp && rhs) {
+				fr_assert(vp->vp_type == tmpl_da(map->lhs)->type);
+
+				rcode = c->cmp(&vp->data, rhs);
+				if (rcode != 0) goto done;
+				continue;
+			}
+
 			/*
 			 *	Take the value box directly from the
 			 *	attribute, _unless_ there's a cast.
@@ -834,11 +949,6 @@ done:
 	talloc_free(lhs_free);
 	talloc_free(rhs_free);
 
-	/*
-	 *	Capture groups may have grabbed preg and put it into
-	 *	request data, in which case we don't free it.
-	 */
-	if (preg) talloc_free(preg_free);
 	return rcode;
 }
 
@@ -857,6 +967,7 @@ done:
 int cond_eval(request_t *request, rlm_rcode_t modreturn, fr_cond_t const *c)
 {
 	int rcode = -1;
+	fr_time_t start = 0;
 
 #ifdef WITH_EVAL_DEBUG
 	char buffer[1024];
@@ -866,6 +977,8 @@ int cond_eval(request_t *request, rlm_rcode_t modreturn, fr_cond_t const *c)
 #endif
 
 	while (c) {
+		if (cond_profile) start = fr_time();
+
 		switch (c->type) {
 		case COND_TYPE_TMPL:
 			rcode = cond_eval_tmpl(request, c->data.vpt, NULL);
@@ -902,6 +1015,8 @@ int cond_eval(request_t *request, rlm_rcode_t modreturn, fr_cond_t const *c)
 
 		if (c->negate) rcode = !rcode;
 
+		if (cond_profile) cond_profile_record(c, start, rcode);
+
 		/*
 		 *	We've fallen off of the end of this evaluation
 		 *	string.  Go back up to the parent, and then to
@@ -1031,6 +1146,10 @@ redo:
 	} /* INIT state */
 
 	if (a->state == COND_EVAL_STATE_EVAL) {
+		fr_time_t start = 0;
+
+		if (cond_profile) start = fr_time();
+
 		switch (c->type) {
 		case COND_TYPE_TMPL:
 			fr_assert(a->vb_lhs);
@@ -1045,6 +1164,8 @@ redo:
 
 			rcode = cond_eval_map(request, c, a->vb_lhs, a->vb_rhs);
 			if (rcode < 0) return rcode;
+
+			a->result = (rcode == 1);
 			break;
 
 		default:
@@ -1057,6 +1178,8 @@ redo:
 		a->tmpl_lhs = a->tmpl_rhs = NULL;
 
 		if (c->negate) a->result = !a->result;
+
+		if (cond_profile) cond_profile_record(c, start, a->result);
 	} /* EVAL state */
 
 	/*
@@ -1139,3 +1262,87 @@ int fr_cond_eval_map(request_t *request, map_t const *map)
 
 	return cond_eval(request, RLM_MODULE_NOOP, &cond);
 }
+
+static int cmd_show_condition_profile(FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	cond_profile_t	*cp = NULL;
+	char		buffer[1024];
+
+	if (!fr_dlist_initialised(&cond_profile_list)) return 0;
+
+	while ((cp = fr_dlist_next(&cond_profile_list, cp))) {
+		fr_cond_iter_t	iter;
+		fr_cond_t	*c;
+
+		cond_print(&FR_SBUFF_OUT(buffer, sizeof(buffer)), cp->head);
+		fprintf(fp, "%s[%d]: %s\n", cp->filename, cp->lineno, buffer);
+
+		for (c = fr_cond_iter_init(&iter, UNCONST(fr_cond_t *, cp->head));
+		     c;
+		     c = fr_cond_iter_next(&iter)) {
+			fr_cond_t	leaf;
+			uint64_t	evaluated, matched, time;
+
+			if (!c->stats) continue;
+
+			evaluated = atomic_load_explicit(&c->stats->evaluated, memory_order_relaxed);
+			matched = atomic_load_explicit(&c->stats->matched, memory_order_relaxed);
+			time = atomic_load_explicit(&c->stats->time, memory_order_relaxed);
+
+			/*
+			 *	Print just this condition, not the
+			 *	ones which follow it.
+			 */
+			leaf = *c;
+			leaf.next = NULL;
+			cond_print(&FR_SBUFF_OUT(buffer, sizeof(buffer)), &leaf);
+
+			fprintf(fp, "\t%s\tevaluated %" PRIu64 " matched %" PRIu64 " avg %" PRIu64 "ns\n",
+				buffer, evaluated, matched, evaluated ? time / evaluated : 0);
+		}
+	}
+
+	return 0;
+}
+
+static int cmd_set_condition_profile(UNUSED FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
+{
+	cond_profile = (strcmp(info->argv[0], "on") == 0);
+
+	return 0;
+}
+
+fr_cmd_table_t cond_cmd_table[] = {
+	{
+		.parent = "show",
+		.name = "condition",
+		.help = "Show information about conditions.",
+		.read_only = true,
+	},
+
+	{
+		.parent = "show condition",
+		.name = "profile",
+		.func = cmd_show_condition_profile,
+		.help = "Show how often each condition was evaluated and matched, and how long it took.",
+		.read_only = true,
+	},
+
+	{
+		.parent = "set",
+		.name = "condition",
+		.help = "Change condition settings.",
+		.read_only = false,
+	},
+
+	{
+		.parent = "set condition",
+		.name = "profile",
+		.syntax = "(on|off)",
+		.func = cmd_set_condition_profile,
+		.help = "Enable or disable profiling of conditions.",
+		.read_only = false,
+	},
+
+	CMD_TABLE_END
+};
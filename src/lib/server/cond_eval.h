@@ -26,6 +26,7 @@
  */
 RCSIDH(cond_eval_h, "$Id$")
 
+#include <freeradius-devel/server/command.h>
 #include <freeradius-devel/server/request.h>
 #include <freeradius-devel/server/map.h>
 #include <freeradius-devel/util/value.h>
@@ -37,6 +38,9 @@ extern "C" {
 /* evaluate.c */
 typedef struct fr_cond_s fr_cond_t;
 
+extern bool		cond_profile;
+extern fr_cmd_table_t	cond_cmd_table[];
+
 void	cond_debug(fr_cond_t const *cond);
 
 int	cond_eval(request_t *request, rlm_rcode_t modreturn, fr_cond_t const *c);
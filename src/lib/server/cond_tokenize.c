@@ -1583,6 +1583,8 @@ ssize_t fr_cond_tokenize(CONF_SECTION *cs, fr_cond_t **head, tmpl_rules_t const
 		}
 
 		cond_reparent(*head, NULL);
+
+		if (fr_cond_profile_add(*head, cs) < 0) return 0;
 	}
 
 	return slen + diff;
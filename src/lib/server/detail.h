@@ -0,0 +1,117 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/detail.h
+ * @brief Binary detail file record format.
+ *
+ * Shared by rlm_detail, which writes binary records, and proto_detail,
+ * which replays them.
+ *
+ * Each record is a fixed size header, followed by a pair list encoded with
+ * #fr_internal_encode_list.  All header fields are in network byte order.
+ *
+ @verbatim
+   0                   1                   2                   3
+   0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  |                     Magic ("FRDR")                            |
+  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  |    Version    |     Flags     |           Reserved            |
+  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  |                     Payload length                            |
+  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  |                     Timestamp (seconds)                       |
+  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+  |                     Payload checksum                          |
+  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ @endverbatim
+ *
+ * The checksum covers the payload only, so that the flags can be updated
+ * in place when the record has been processed.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(server_detail_h, "$Id$")
+
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/net.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FR_DETAIL_MAGIC			"FRDR"
+#define FR_DETAIL_MAGIC_LEN		4
+#define FR_DETAIL_VERSION		1
+
+#define FR_DETAIL_HDR_VERSION		4	//!< Offset of the version field.
+#define FR_DETAIL_HDR_FLAGS		5	//!< Offset of the flags field.
+#define FR_DETAIL_HDR_LENGTH		8	//!< Offset of the payload length field.
+#define FR_DETAIL_HDR_TIMESTAMP		12	//!< Offset of the timestamp field.
+#define FR_DETAIL_HDR_CHECKSUM		16	//!< Offset of the payload checksum field.
+#define FR_DETAIL_HDR_LEN		20	//!< Length of the record header.
+
+#define FR_DETAIL_FLAG_DONE		0x01	//!< Record has been processed by a reader.
+
+/** Whether data starts with a binary detail record
+ *
+ * @param[in] data	to check.
+ * @param[in] data_len	Length of data.
+ * @return true if data starts with the binary record magic.
+ */
+static inline bool fr_detail_is_binary(uint8_t const *data, size_t data_len)
+{
+	return (data_len >= FR_DETAIL_MAGIC_LEN) && (memcmp(data, FR_DETAIL_MAGIC, FR_DETAIL_MAGIC_LEN) == 0);
+}
+
+/** Calculate the checksum of a binary detail record payload
+ *
+ * @param[in] payload		to checksum.
+ * @param[in] payload_len	Length of the payload.
+ * @return the checksum.
+ */
+static inline uint32_t fr_detail_checksum(uint8_t const *payload, size_t payload_len)
+{
+	return fr_hash(payload, payload_len);
+}
+
+/** Write a binary detail record header
+ *
+ * @param[out] hdr		to write.  Must be #FR_DETAIL_HDR_LEN bytes.
+ * @param[in] timestamp		When the packet was originally received.
+ * @param[in] payload		the header describes.
+ * @param[in] payload_len	Length of the payload.
+ */
+static inline void fr_detail_hdr_encode(uint8_t hdr[static FR_DETAIL_HDR_LEN], uint32_t timestamp,
+					uint8_t const *payload, uint32_t payload_len)
+{
+	memcpy(hdr, FR_DETAIL_MAGIC, FR_DETAIL_MAGIC_LEN);
+	hdr[FR_DETAIL_HDR_VERSION] = FR_DETAIL_VERSION;
+	hdr[FR_DETAIL_HDR_FLAGS] = 0;
+	hdr[FR_DETAIL_HDR_FLAGS + 1] = 0;
+	hdr[FR_DETAIL_HDR_FLAGS + 2] = 0;
+	fr_net_from_uint32(hdr + FR_DETAIL_HDR_LENGTH, payload_len);
+	fr_net_from_uint32(hdr + FR_DETAIL_HDR_TIMESTAMP, timestamp);
+	fr_net_from_uint32(hdr + FR_DETAIL_HDR_CHECKSUM, fr_detail_checksum(payload, payload_len));
+}
+
+#ifdef __cplusplus
+}
+#endif
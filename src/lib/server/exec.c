@@ -96,7 +96,6 @@ static void fr_exec_pair_to_env(request_t *request, fr_pair_list_t *input_pairs,
 {
 	char			*p;
 	size_t			i;
-	fr_dcursor_t		cursor;
 	fr_dict_attr_t const	*da;
 	fr_pair_t		*vp;
 	char			buffer[1024];
@@ -139,11 +138,11 @@ static void fr_exec_pair_to_env(request_t *request, fr_pair_list_t *input_pairs,
 	if (request) {
 		da = fr_dict_attr_child_by_num(fr_dict_root(fr_dict_internal()), FR_EXEC_EXPORT);
 		if (da) {
-			for (vp = fr_dcursor_iter_by_da_init(&cursor, &request->control_pairs, da);
-			     vp && (i < (envlen - 1));
-			     vp = fr_dcursor_next(&cursor)) {
-				DEBUG3("export %pV", &vp->data);
-				memcpy(&envp[i++], &vp->vp_strvalue, sizeof(*envp));
+			fr_pair_list_foreach_by_da(&request->control_pairs, export, da) {
+				if (i >= (envlen - 1)) break;
+
+				DEBUG3("export %pV", &export->data);
+				memcpy(&envp[i++], &export->vp_strvalue, sizeof(*envp));
 			}
 
 			/*
@@ -662,6 +661,67 @@ wait:
 }
 
 
+/** Flatten the output of xlat_frame_eval() into an argv array
+ *
+ * @param[in] ctx	to allocate the argv array in.
+ * @param[out] argv_p	where the argv array is written.
+ * @param[in] vb_list	as returned by xlat_frame_eval()
+ * @return
+ *	- >= 0 number of arguments.
+ *	- <0 on error, including when the program comes from a tainted source.
+ */
+int fr_exec_argv_afrom_value_box_list(TALLOC_CTX *ctx, char ***argv_p, fr_value_box_list_t *vb_list)
+{
+	fr_value_box_t	*first;
+
+	first = fr_dlist_head(vb_list);
+	if (!first) {
+		fr_strerror_const("No program to run");
+		return -1;
+	}
+	if (first->type == FR_TYPE_GROUP) first = fr_dlist_head(&first->vb_group);
+	if (first && first->tainted) {
+		fr_strerror_printf("Program to run comes from tainted source - %pV", first);
+		return -1;
+	}
+
+	return fr_exec_value_box_list_to_argv(ctx, argv_p, vb_list);
+}
+
+/** Execute a program from an argv array, without a request
+ *
+ * The child has an empty environment, and /dev/null for stdin, stdout
+ * and stderr.  The caller must reap the child with waitpid().
+ *
+ * @param[in] argv	Program and its arguments.  NULL terminated.
+ * @return
+ *	- PID of the child process.
+ *	- -1 on failure.
+ */
+pid_t fr_exec_argv_nowait(char **argv)
+{
+	char		*envp[] = { NULL };
+	pid_t		pid;
+
+	pid = fork();
+
+	/*
+	 *	The child never returns from calling fr_exec_child();
+	 */
+	if (pid == 0) {
+		int unused[2];
+
+		fr_exec_child(NULL, argv, envp, false, unused, unused, unused);
+	}
+
+	if (pid < 0) {
+		fr_strerror_printf("Couldn't fork %s: %s", argv[0], fr_syserror(errno));
+		return -1;
+	}
+
+	return pid;
+}
+
 /** Execute a program without waiting for the program to finish.
  *
  * @param request	the request
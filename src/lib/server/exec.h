@@ -85,6 +85,10 @@ int	radius_exec_program(TALLOC_CTX *ctx, char *out, size_t outlen, fr_pair_list_
 			    request_t *request, char const *cmd, fr_pair_list_t *input_pairs,
 			    bool exec_wait, bool shell_escape, fr_time_delta_t timeout) CC_HINT(nonnull (5, 6));
 
+int	fr_exec_argv_afrom_value_box_list(TALLOC_CTX *ctx, char ***argv_p, fr_value_box_list_t *vb_list);
+
+pid_t	fr_exec_argv_nowait(char **argv) CC_HINT(nonnull);
+
 int	fr_exec_nowait(request_t *request, fr_value_box_list_t *vb_list, fr_pair_list_t *env_pairs);
 
 int	fr_exec_wait_start(pid_t *pid_p, int *stdin_fd, int *stdout_fd, int *stderr_fd,
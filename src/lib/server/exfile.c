@@ -44,13 +44,25 @@ typedef struct {
 	char			*filename;		//!< Filename.
 } exfile_entry_t;
 
+/** A subset of the file descriptors managed by an exfile_t
+ *
+ * Each filename maps to exactly one shard, so threads writing to files in
+ * different shards don't contend on the same mutex.
+ */
+typedef struct {
+	pthread_mutex_t		mutex;			//!< Held from exfile_open() until exfile_close().
+	exfile_entry_t		*entries;		//!< Entries in this shard.
+	uint32_t		max_entries;		//!< How many entries this shard holds.
+	time_t			last_cleaned;		//!< Last time idle entries were closed.
+	exfile_entry_t		*reserved;		//!< Entry currently reserved by the mutex holder.
+	pthread_t		owner;			//!< Thread holding the mutex.
+} exfile_shard_t;
 
 struct exfile_s {
 	uint32_t		max_entries;		//!< How many file descriptors we keep track of.
 	uint32_t		max_idle;		//!< Maximum idle time for a descriptor.
-	time_t			last_cleaned;
-	pthread_mutex_t		mutex;
-	exfile_entry_t		*entries;
+	exfile_shard_t		*shards;		//!< Entries, split by filename hash.
+	uint32_t		num_shards;		//!< How many shards have been initialised.
 	bool			locking;
 	CONF_SECTION		*conf;			//!< Conf section to search for triggers.
 	char const		*trigger_prefix;	//!< Trigger path in the global trigger section.
@@ -60,6 +72,9 @@ struct exfile_s {
 #define MAX_TRY_LOCK 4			//!< How many times we attempt to acquire a lock
 					//!< before giving up.
 
+#define MAX_SHARDS 16			//!< Maximum number of independently locked
+					//!< sets of entries.
+
 /** Send an exfile trigger.
  *
  * @param[in] ef to send trigger for.
@@ -123,18 +138,22 @@ static void exfile_cleanup_entry(exfile_t *ef, request_t *request, exfile_entry_
 
 static int _exfile_free(exfile_t *ef)
 {
-	uint32_t i;
+	uint32_t i, j;
 
-	pthread_mutex_lock(&ef->mutex);
+	for (i = 0; i < ef->num_shards; i++) {
+		exfile_shard_t *shard = &ef->shards[i];
 
-	for (i = 0; i < ef->max_entries; i++) {
-		if (!ef->entries[i].filename) continue;
+		pthread_mutex_lock(&shard->mutex);
 
-		exfile_cleanup_entry(ef, NULL, &ef->entries[i]);
-	}
+		for (j = 0; j < shard->max_entries; j++) {
+			if (!shard->entries[j].filename) continue;
 
-	pthread_mutex_unlock(&ef->mutex);
-	pthread_mutex_destroy(&ef->mutex);
+			exfile_cleanup_entry(ef, NULL, &shard->entries[j]);
+		}
+
+		pthread_mutex_unlock(&shard->mutex);
+		pthread_mutex_destroy(&shard->mutex);
+	}
 
 	return 0;
 }
@@ -151,7 +170,8 @@ static int _exfile_free(exfile_t *ef)
  */
 exfile_t *exfile_init(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t max_idle, bool locking)
 {
-	exfile_t *ef;
+	exfile_t	*ef;
+	uint32_t	i, num_shards, per_shard;
 
 	ef = talloc_zero(NULL, exfile_t);
 	if (!ef) return NULL;
@@ -170,19 +190,36 @@ exfile_t *exfile_init(TALLOC_CTX *ctx, uint32_t max_entries, uint32_t max_idle,
 	 */
 	if (!ef->locking) return ef;
 
-	ef->entries = talloc_zero_array(ef, exfile_entry_t, max_entries);
-	if (!ef->entries) {
-		talloc_free(ef);
-		return NULL;
-	}
+	if (max_entries == 0) max_entries = 1;
 
-	if (pthread_mutex_init(&ef->mutex, NULL) != 0) {
+	/*
+	 *	Split the entries between shards, so that
+	 *	writes to different files don't serialise
+	 *	on a single mutex.
+	 */
+	num_shards = (max_entries < MAX_SHARDS) ? max_entries : MAX_SHARDS;
+	per_shard = (max_entries + num_shards - 1) / num_shards;
+
+	ef->shards = talloc_zero_array(ef, exfile_shard_t, num_shards);
+	if (!ef->shards) {
+	error:
 		talloc_free(ef);
 		return NULL;
 	}
 
 	talloc_set_destructor(ef, _exfile_free);
 
+	for (i = 0; i < num_shards; i++) {
+		exfile_shard_t *shard = &ef->shards[i];
+
+		shard->entries = talloc_zero_array(ef->shards, exfile_entry_t, per_shard);
+		if (!shard->entries) goto error;
+		shard->max_entries = per_shard;
+
+		if (pthread_mutex_init(&shard->mutex, NULL) != 0) goto error;
+		ef->num_shards++;
+	}
+
 	return ef;
 }
 
@@ -281,11 +318,13 @@ static int exfile_open_mkdir(exfile_t *ef, char const *filename, mode_t permissi
  */
 int exfile_open(exfile_t *ef, request_t *request, char const *filename, mode_t permissions)
 {
-	int i, tries, unused = -1, found = -1, oldest = -1;
-	bool do_cleanup = false;
-	uint32_t hash;
-	time_t now;
-	struct stat st;
+	int		i, tries, unused = -1, found = -1, oldest = -1;
+	bool		do_cleanup = false;
+	uint32_t	hash;
+	time_t		now;
+	struct stat	st;
+	exfile_shard_t	*shard;
+	exfile_entry_t	*entries;
 
 	if (!ef || !filename) return -1;
 
@@ -308,9 +347,12 @@ int exfile_open(exfile_t *ef, request_t *request, char const *filename, mode_t p
 	now = time(NULL);
 	unused = -1;
 
-	pthread_mutex_lock(&ef->mutex);
+	shard = &ef->shards[hash % ef->num_shards];
+	entries = shard->entries;
+
+	pthread_mutex_lock(&shard->mutex);
 
-	if (now > (ef->last_cleaned + 1)) do_cleanup = true;
+	if (now > (shard->last_cleaned + 1)) do_cleanup = true;
 
 	/*
 	 *	Find the matching entry, or an unused one.
@@ -318,14 +360,14 @@ int exfile_open(exfile_t *ef, request_t *request, char const *filename, mode_t p
 	 *	Also track which entry is the oldest, in case there
 	 *	are no unused entries.
 	 */
-	for (i = 0; i < (int) ef->max_entries; i++) {
-		if (!ef->entries[i].filename) {
+	for (i = 0; i < (int) shard->max_entries; i++) {
+		if (!entries[i].filename) {
 			if (unused < 0) unused = i;
 			continue;
 		}
 
 		if ((oldest < 0) ||
-		    (ef->entries[i].last_used < ef->entries[oldest].last_used)) {
+		    (entries[i].last_used < entries[oldest].last_used)) {
 			oldest = i;
 		}
 
@@ -339,8 +381,8 @@ int exfile_open(exfile_t *ef, request_t *request, char const *filename, mode_t p
 		 *	ensure that it happens.
 		 */
 		if ((found < 0) &&
-		    (ef->entries[i].hash == hash) &&
-		    (strcmp(ef->entries[i].filename, filename) == 0)) {
+		    (entries[i].hash == hash) &&
+		    (strcmp(entries[i].filename, filename) == 0)) {
 			found = i;
 
 			/*
@@ -354,13 +396,13 @@ int exfile_open(exfile_t *ef, request_t *request, char const *filename, mode_t p
 			 *	do so now.
 			 */
 		} else if (do_cleanup) {
-			if ((ef->entries[i].last_used + ef->max_idle) >= now) continue;
+			if ((entries[i].last_used + ef->max_idle) >= now) continue;
 
-			exfile_cleanup_entry(ef, request, &ef->entries[i]);
+			exfile_cleanup_entry(ef, request, &entries[i]);
 		}
 	}
 
-	if (do_cleanup) ef->last_cleaned = now;
+	if (do_cleanup) shard->last_cleaned = now;
 
 	/*
 	 *	We found an existing entry, return that.
@@ -373,13 +415,13 @@ int exfile_open(exfile_t *ef, request_t *request, char const *filename, mode_t p
 		 *	If that's not the file we opened, then go back
 		 *	and re-open the file.
 		 */
-		if (stat(ef->entries[i].filename, &st) < 0) {
+		if (stat(entries[i].filename, &st) < 0) {
 			goto reopen;
 		}
 
-		if ((st.st_dev != ef->entries[i].st_dev) ||
-		    (st.st_ino != ef->entries[i].st_ino)) {
-			close(ef->entries[i].fd);
+		if ((st.st_dev != entries[i].st_dev) ||
+		    (st.st_ino != entries[i].st_ino)) {
+			close(entries[i].fd);
 			goto reopen;
 		}
 
@@ -390,7 +432,7 @@ int exfile_open(exfile_t *ef, request_t *request, char const *filename, mode_t p
 	 *	There are no unused entries, free the oldest one.
 	 */
 	if (unused < 0) {
-		exfile_cleanup_entry(ef, request, &ef->entries[oldest]);
+		exfile_cleanup_entry(ef, request, &entries[oldest]);
 		unused = oldest;
 	}
 
@@ -399,26 +441,26 @@ int exfile_open(exfile_t *ef, request_t *request, char const *filename, mode_t p
 	 */
 	i = unused;
 
-	ef->entries[i].hash = hash;
-	ef->entries[i].filename = talloc_typed_strdup(ef->entries, filename);
-	ef->entries[i].fd = -1;
+	entries[i].hash = hash;
+	entries[i].filename = talloc_typed_strdup(entries, filename);
+	entries[i].fd = -1;
 
 reopen:
-	ef->entries[i].fd = exfile_open_mkdir(ef, filename, permissions);
-	if (ef->entries[i].fd < 0) goto error;
+	entries[i].fd = exfile_open_mkdir(ef, filename, permissions);
+	if (entries[i].fd < 0) goto error;
 
-	exfile_trigger_exec(ef, request, &ef->entries[i], "open");
+	exfile_trigger_exec(ef, request, &entries[i], "open");
 
 try_lock:
 	/*
 	 *	Lock from the start of the file.
 	 */
-	if (lseek(ef->entries[i].fd, 0, SEEK_SET) < 0) {
+	if (lseek(entries[i].fd, 0, SEEK_SET) < 0) {
 		fr_strerror_printf("Failed to seek in file %s: %s", filename, fr_syserror(errno));
 
 	error:
-		exfile_cleanup_entry(ef, request, &ef->entries[i]);
-		pthread_mutex_unlock(&(ef->mutex));
+		exfile_cleanup_entry(ef, request, &entries[i]);
+		pthread_mutex_unlock(&shard->mutex);
 		return -1;
 	}
 
@@ -429,16 +471,16 @@ try_lock:
 	 *	and try again/
 	 */
 	for (tries = 0; tries < MAX_TRY_LOCK; tries++) {
-		if (rad_lockfd_nonblock(ef->entries[i].fd, 0) >= 0) break;
+		if (rad_lockfd_nonblock(entries[i].fd, 0) >= 0) break;
 
 		if (errno != EAGAIN) {
 			fr_strerror_printf("Failed to lock file %s: %s", filename, fr_syserror(errno));
 			goto error;
 		}
 
-		close(ef->entries[i].fd);
-		ef->entries[i].fd = open(filename, O_RDWR | O_CREAT, permissions);
-		if (ef->entries[i].fd < 0) {
+		close(entries[i].fd);
+		entries[i].fd = open(filename, O_RDWR | O_CREAT, permissions);
+		if (entries[i].fd < 0) {
 			fr_strerror_printf("Failed to open file %s: %s", filename, fr_syserror(errno));
 			goto error;
 		}
@@ -453,13 +495,13 @@ try_lock:
 	 *	Maybe someone deleted the file while we were waiting
 	 *	for the lock.  If so, re-open it.
 	 */
-	if (fstat(ef->entries[i].fd, &st) < 0) {
+	if (fstat(entries[i].fd, &st) < 0) {
 		fr_strerror_printf("Failed to stat file %s: %s", filename, fr_syserror(errno));
 		goto reopen;
 	}
 
 	if (st.st_nlink == 0) {
-		close(ef->entries[i].fd);
+		close(entries[i].fd);
 		goto reopen;
 	}
 
@@ -467,8 +509,8 @@ try_lock:
 	 *	Remember which device and inode this file is
 	 *	for.
 	 */
-	ef->entries[i].st_dev = st.st_dev;
-	ef->entries[i].st_ino = st.st_ino;
+	entries[i].st_dev = st.st_dev;
+	entries[i].st_ino = st.st_ino;
 
 	/*
 	 *	Sometimes the file permissions are changed externally.
@@ -488,7 +530,7 @@ try_lock:
 		     oct_have, str_have, oct_need, str_need);
 
 		if (((st.st_mode | permissions) != st.st_mode) &&
-		    (fchmod(ef->entries[i].fd, (st.st_mode & ~S_IFMT) | permissions) < 0)) {
+		    (fchmod(entries[i].fd, (st.st_mode & ~S_IFMT) | permissions) < 0)) {
 			fr_perm_mode_to_oct(oct_need, (st.st_mode & ~S_IFMT) | permissions);
 			fr_perm_mode_to_str(str_need, (st.st_mode & ~S_IFMT) | permissions);
 
@@ -501,17 +543,19 @@ try_lock:
 	 *	Seek to the end of the file before returning the FD to
 	 *	the caller.
 	 */
-	(void) lseek(ef->entries[i].fd, 0, SEEK_END);
+	(void) lseek(entries[i].fd, 0, SEEK_END);
 
 	/*
 	 *	Return holding the mutex for the entry.
 	 */
-	ef->entries[i].last_used = now;
+	entries[i].last_used = now;
+	shard->reserved = &entries[i];
+	shard->owner = pthread_self();
 
-	exfile_trigger_exec(ef, request, &ef->entries[i], "reserve");
+	exfile_trigger_exec(ef, request, &entries[i], "reserve");
 
 	/* coverity[missing_unlock] */
-	return ef->entries[i].fd;
+	return entries[i].fd;
 }
 
 /** Close the log file.  Really just return it to the pool.
@@ -530,6 +574,7 @@ try_lock:
 int exfile_close(exfile_t *ef, request_t *request, int fd)
 {
 	uint32_t i;
+	pthread_t self;
 
 	/*
 	 *	No locking: just close the file.
@@ -540,21 +585,29 @@ int exfile_close(exfile_t *ef, request_t *request, int fd)
 	}
 
 	/*
-	 *	Unlock the bytes that we had previously locked.
+	 *	Find the shard we hold the mutex for.  Only the
+	 *	owner of a shard modifies reserved and owner, so
+	 *	any match must be a shard we reserved.
 	 */
-	for (i = 0; i < ef->max_entries; i++) {
-		if (ef->entries[i].fd != fd) continue;
+	self = pthread_self();
+	for (i = 0; i < ef->num_shards; i++) {
+		exfile_shard_t *shard = &ef->shards[i];
+		exfile_entry_t *entry = shard->reserved;
+
+		if (!entry || !pthread_equal(shard->owner, self) || (entry->fd != fd)) continue;
 
-		(void) lseek(ef->entries[i].fd, 0, SEEK_SET);
-		(void) rad_unlockfd(ef->entries[i].fd, 0);
-		pthread_mutex_unlock(&(ef->mutex));
+		/*
+		 *	Unlock the bytes that we had previously locked.
+		 */
+		(void) lseek(entry->fd, 0, SEEK_SET);
+		(void) rad_unlockfd(entry->fd, 0);
+		shard->reserved = NULL;
+		pthread_mutex_unlock(&shard->mutex);
 
-		exfile_trigger_exec(ef, request, &ef->entries[i], "release");
+		exfile_trigger_exec(ef, request, entry, "release");
 		return 0;
 	}
 
-	pthread_mutex_unlock(&(ef->mutex));
-
 	fr_strerror_const("Attempt to unlock file which is not tracked");
 	return -1;
 }
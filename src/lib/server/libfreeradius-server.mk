@@ -23,6 +23,7 @@ SOURCES	:= \
 	map_async.c \
 	map_proc.c \
 	method.c \
+	metrics.c \
 	module.c \
 	paircmp.c \
 	pairmove.c \
@@ -30,10 +31,13 @@ SOURCES	:= \
 	pool.c \
 	rcode.c \
 	regex.c \
+	reload.c \
 	request.c \
 	request_data.c \
+	singleflight.c \
 	snmp.c \
 	state.c \
+	state_replicate.c \
 	stats.c \
 	tmpl_eval.c \
 	tmpl_tokenize.c \
@@ -53,7 +57,7 @@ ifneq ($(OPENSSL_LIBS),)
 TGT_PREREQS	:= libfreeradius-tls.a
 endif
 
-TGT_PREREQS	+= libfreeradius-util.a
+TGT_PREREQS	+= libfreeradius-internal.a libfreeradius-util.a
 
 ifneq ($(MAKECMDGOALS),scan)
 SRC_CFLAGS	+= -DBUILT_WITH_CPPFLAGS=\"$(CPPFLAGS)\" -DBUILT_WITH_CFLAGS=\"$(CFLAGS)\" -DBUILT_WITH_LDFLAGS=\"$(LDFLAGS)\" -DBUILT_WITH_LIBS=\"$(LIBS)\"
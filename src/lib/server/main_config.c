@@ -36,11 +36,14 @@ RCSID("$Id$")
 #include <freeradius-devel/server/util.h>
 #include <freeradius-devel/server/virtual_servers.h>
 
+#include <freeradius-devel/unlang/interpret.h>
+
 #include <freeradius-devel/util/conf.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/dict.h>
 #include <freeradius-devel/util/file.h>
 #include <freeradius-devel/util/perm.h>
+#include <freeradius-devel/util/resolve.h>
 #include <freeradius-devel/util/sem.h>
 
 #include <sys/stat.h>
@@ -77,6 +80,11 @@ fr_log_t		debug_log = { .fd = -1, .dst = L_DST_NULL };
 
 static int reverse_lookups_parse(TALLOC_CTX *ctx, void *out, void *parent,CONF_ITEM *ci, CONF_PARSER const *rule);
 static int hostname_lookups_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
+static int resolver_ttl_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
+static int resolver_negative_ttl_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
+static int resolver_prefetch_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
+
+static int lazy_modules_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
 
 static int num_networks_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
 static int num_workers_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
@@ -85,6 +93,8 @@ static int lib_dir_on_read(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *
 static int talloc_pool_size_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
 
 static int max_request_time_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
+static int soft_request_memory_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
+static int max_request_memory_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
 
 static int name_parse(TALLOC_CTX *ctx, void *out, void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
 
@@ -141,11 +151,22 @@ static const CONF_PARSER lib_dir_on_read_config[] = {
  *	items, we can parse the rest of the configuration items.
  *
  **********************************************************************/
+static const CONF_PARSER log_debug_sample_config[] = {
+	{ FR_CONF_OFFSET("rate", FR_TYPE_UINT32, main_config_t, debug_sample_rate), .dflt = "0" },
+	{ FR_CONF_OFFSET("src_ipaddr", FR_TYPE_COMBO_IP_PREFIX, main_config_t, debug_sample_src) },
+	{ FR_CONF_OFFSET("level", FR_TYPE_UINT32, main_config_t, debug_sample_level), .dflt = "2" },
+	{ FR_CONF_OFFSET("ring_size", FR_TYPE_SIZE, main_config_t, debug_sample_ring_size), .dflt = "1M" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER log_config[] = {
 	{ FR_CONF_OFFSET("colourise", FR_TYPE_BOOL, main_config_t, do_colourise) },
 	{ FR_CONF_OFFSET("line_number", FR_TYPE_BOOL, main_config_t, log_line_number) },
 	{ FR_CONF_OFFSET("timestamp", FR_TYPE_BOOL, main_config_t, log_timestamp) },
 	{ FR_CONF_OFFSET("use_utc", FR_TYPE_BOOL, main_config_t, log_dates_utc) },
+	{ FR_CONF_OFFSET("async", FR_TYPE_BOOL, main_config_t, log_async), .dflt = "no" },
+	{ FR_CONF_OFFSET("async_ring_size", FR_TYPE_SIZE, main_config_t, log_async_ring_size), .dflt = "1M" },
+	{ FR_CONF_POINTER("debug_sample", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) log_debug_sample_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -161,11 +182,47 @@ static const CONF_PARSER resources[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER resolver_config[] = {
+	{ FR_CONF_OFFSET("ttl", FR_TYPE_TIME_DELTA, main_config_t, resolver_ttl), .dflt = "300", .func = resolver_ttl_parse },
+	{ FR_CONF_OFFSET("negative_ttl", FR_TYPE_TIME_DELTA, main_config_t, resolver_negative_ttl), .dflt = "30", .func = resolver_negative_ttl_parse },
+	{ FR_CONF_OFFSET("prefetch", FR_TYPE_BOOL, main_config_t, resolver_prefetch), .dflt = "yes", .func = resolver_prefetch_parse },
+	CONF_PARSER_TERMINATOR
+};
+
+static const CONF_PARSER metrics_config[] = {
+	{ FR_CONF_OFFSET("ipaddr", FR_TYPE_COMBO_IP_ADDR, main_config_t, metrics_ipaddr), .dflt = "127.0.0.1" },
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, main_config_t, metrics_port), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
+static const CONF_PARSER thread_concurrency_config[] = {
+	{ FR_CONF_OFFSET("max", FR_TYPE_UINT32, main_config_t, concurrency.max), .dflt = "0" },
+	{ FR_CONF_OFFSET("min", FR_TYPE_UINT32, main_config_t, concurrency.min), .dflt = "8" },
+	{ FR_CONF_OFFSET("initial", FR_TYPE_UINT32, main_config_t, concurrency.initial), .dflt = "64" },
+	{ FR_CONF_OFFSET("tolerance", FR_TYPE_FLOAT32, main_config_t, concurrency.tolerance), .dflt = "2.0" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER thread_config[] = {
+	{ FR_CONF_OFFSET("num_processes", FR_TYPE_UINT32, main_config_t, num_processes), .dflt = STRINGIFY(1) },
 	{ FR_CONF_OFFSET("num_networks", FR_TYPE_UINT32, main_config_t, max_networks), .dflt = STRINGIFY(1),
 	  .func = num_networks_parse },
 	{ FR_CONF_OFFSET("num_workers", FR_TYPE_UINT32, main_config_t, max_workers), .dflt = STRINGIFY(4),
 	  .func = num_workers_parse },
+	{ FR_CONF_OFFSET("worker_select", FR_TYPE_STRING, main_config_t, worker_select), .dflt = "cpu_time" },
+	{ FR_CONF_OFFSET("steal_requests", FR_TYPE_BOOL, main_config_t, steal_requests), .dflt = "no" },
+	{ FR_CONF_OFFSET("numa", FR_TYPE_BOOL, main_config_t, numa), .dflt = "no" },
+	{ FR_CONF_OFFSET("spin_budget", FR_TYPE_TIME_DELTA, main_config_t, spin_budget), .dflt = "0" },
+	{ FR_CONF_OFFSET("huge_pages", FR_TYPE_BOOL, main_config_t, huge_pages), .dflt = "no" },
+	{ FR_CONF_OFFSET("prefault", FR_TYPE_BOOL, main_config_t, prefault), .dflt = "no" },
+	{ FR_CONF_OFFSET("zero_copy", FR_TYPE_BOOL, main_config_t, zero_copy), .dflt = "no" },
+	{ FR_CONF_OFFSET("timer_resolution", FR_TYPE_TIME_DELTA, main_config_t, timer_resolution), .dflt = "0" },
+	{ FR_CONF_OFFSET("request_deadline", FR_TYPE_TIME_DELTA, main_config_t, request_deadline), .dflt = "0" },
+	{ FR_CONF_OFFSET("queue_watermark", FR_TYPE_UINT32, main_config_t, queue_watermark), .dflt = "0" },
+	{ FR_CONF_OFFSET("fair_queue", FR_TYPE_BOOL, main_config_t, fair_queue), .dflt = "no" },
+	{ FR_CONF_OFFSET("malloc_arenas", FR_TYPE_UINT32, main_config_t, malloc_arenas), .dflt = "0" },
+	{ FR_CONF_OFFSET("request_arena_size", FR_TYPE_SIZE, main_config_t, request_arena_size), .dflt = "0" },
+	{ FR_CONF_POINTER("concurrency", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) thread_concurrency_config },
 
 	{ FR_CONF_OFFSET("stats_interval", FR_TYPE_TIME_DELTA | FR_TYPE_HIDDEN, main_config_t, stats_interval), },
 
@@ -195,6 +252,9 @@ static const CONF_PARSER server_config[] = {
 	{ FR_CONF_OFFSET("reverse_lookups", FR_TYPE_BOOL, main_config_t, reverse_lookups), .dflt = "no", .func = reverse_lookups_parse },
 	{ FR_CONF_OFFSET("hostname_lookups", FR_TYPE_BOOL, main_config_t, hostname_lookups), .dflt = "yes", .func = hostname_lookups_parse },
 	{ FR_CONF_OFFSET("max_request_time", FR_TYPE_TIME_DELTA, main_config_t, max_request_time), .dflt = STRINGIFY(MAX_REQUEST_TIME), .func = max_request_time_parse },
+	{ FR_CONF_OFFSET("soft_request_memory", FR_TYPE_SIZE, main_config_t, soft_request_memory), .dflt = "0", .func = soft_request_memory_parse },
+	{ FR_CONF_OFFSET("max_request_memory", FR_TYPE_SIZE, main_config_t, max_request_memory), .dflt = "0", .func = max_request_memory_parse },
+	{ FR_CONF_OFFSET("lazy_modules", FR_TYPE_BOOL, main_config_t, lazy_modules), .dflt = "no", .func = lazy_modules_parse },
 	{ FR_CONF_OFFSET("pidfile", FR_TYPE_STRING, main_config_t, pid_file), .dflt = "${run_dir}/radiusd.pid"},
 
 	{ FR_CONF_OFFSET("debug_level", FR_TYPE_UINT32 | FR_TYPE_HIDDEN, main_config_t, debug_level), .dflt = "0" },
@@ -204,8 +264,12 @@ static const CONF_PARSER server_config[] = {
 
 	{ FR_CONF_POINTER("resources", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) resources },
 
+	{ FR_CONF_POINTER("resolver", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) resolver_config },
+
 	{ FR_CONF_POINTER("thread", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) thread_config, .ident2 = CF_IDENT_ANY },
 
+	{ FR_CONF_POINTER("metrics", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) metrics_config },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -289,6 +353,54 @@ static int hostname_lookups_parse(TALLOC_CTX *ctx, void *out, void *parent,
 	return 0;
 }
 
+static int resolver_ttl_parse(TALLOC_CTX *ctx, void *out, void *parent,
+			      CONF_ITEM *ci, CONF_PARSER const *rule)
+{
+	int	ret;
+
+	if ((ret = cf_pair_parse_value(ctx, out, parent, ci, rule)) < 0) return ret;
+
+	memcpy(&fr_resolve_ttl, out, sizeof(fr_resolve_ttl));
+
+	return 0;
+}
+
+static int resolver_negative_ttl_parse(TALLOC_CTX *ctx, void *out, void *parent,
+				       CONF_ITEM *ci, CONF_PARSER const *rule)
+{
+	int	ret;
+
+	if ((ret = cf_pair_parse_value(ctx, out, parent, ci, rule)) < 0) return ret;
+
+	memcpy(&fr_resolve_negative_ttl, out, sizeof(fr_resolve_negative_ttl));
+
+	return 0;
+}
+
+static int resolver_prefetch_parse(TALLOC_CTX *ctx, void *out, void *parent,
+				   CONF_ITEM *ci, CONF_PARSER const *rule)
+{
+	int	ret;
+
+	if ((ret = cf_pair_parse_value(ctx, out, parent, ci, rule)) < 0) return ret;
+
+	memcpy(&fr_resolve_prefetch, out, sizeof(fr_resolve_prefetch));
+
+	return 0;
+}
+
+static int lazy_modules_parse(TALLOC_CTX *ctx, void *out, void *parent,
+			      CONF_ITEM *ci, CONF_PARSER const *rule)
+{
+	int	ret;
+
+	if ((ret = cf_pair_parse_value(ctx, out, parent, ci, rule)) < 0) return ret;
+
+	memcpy(&modules_lazy_load, out, sizeof(modules_lazy_load));
+
+	return 0;
+}
+
 static int talloc_pool_size_parse(TALLOC_CTX *ctx, void *out, void *parent,
 				  CONF_ITEM *ci, CONF_PARSER const *rule)
 {
@@ -324,6 +436,30 @@ static int max_request_time_parse(TALLOC_CTX *ctx, void *out, void *parent,
 	return 0;
 }
 
+static int soft_request_memory_parse(TALLOC_CTX *ctx, void *out, void *parent,
+				     CONF_ITEM *ci, CONF_PARSER const *rule)
+{
+	int	ret;
+
+	if ((ret = cf_pair_parse_value(ctx, out, parent, ci, rule)) < 0) return ret;
+
+	memcpy(&unlang_request_memory_soft, out, sizeof(unlang_request_memory_soft));
+
+	return 0;
+}
+
+static int max_request_memory_parse(TALLOC_CTX *ctx, void *out, void *parent,
+				    CONF_ITEM *ci, CONF_PARSER const *rule)
+{
+	int	ret;
+
+	if ((ret = cf_pair_parse_value(ctx, out, parent, ci, rule)) < 0) return ret;
+
+	memcpy(&unlang_request_memory_hard, out, sizeof(unlang_request_memory_hard));
+
+	return 0;
+}
+
 static int lib_dir_on_read(UNUSED TALLOC_CTX *ctx, UNUSED void *out, UNUSED void *parent,
 			 CONF_ITEM *ci, UNUSED CONF_PARSER const *rule)
 {
@@ -1374,6 +1510,11 @@ void main_config_hup(main_config_t *config)
 	 */
 	hup_logfile(config);
 
+	/*
+	 *	Names may now resolve differently.
+	 */
+	fr_resolve_flush();
+
 	/*
 	 *	Only check the config files every few seconds.
 	 */
@@ -42,6 +42,7 @@ extern main_config_t const *main_config;		//!< Global configuration singleton.
 #include <freeradius-devel/server/tmpl.h>
 
 #include <freeradius-devel/util/dict.h>
+#include <freeradius-devel/util/limiter.h>
 
 
 /** Main server configuration
@@ -63,6 +64,13 @@ struct main_config_s {
 
 	bool		drop_requests;			//!< Administratively disable request processing.
 
+	bool		lazy_modules;			//!< Only load modules which are referenced.
+
+	size_t		soft_request_memory;		//!< Memory a request may use before the module
+							///< which exceeded it fails.  0 for no limit.
+	size_t		max_request_memory;		//!< Memory a request may use before it's stopped.
+							///< 0 for no limit.
+
 	char const	*log_dir;
 	char const	*local_state_dir;
 	char const	*chroot_dir;
@@ -70,6 +78,10 @@ struct main_config_s {
 	bool		reverse_lookups;
 	bool		hostname_lookups;
 
+	fr_time_delta_t	resolver_ttl;			//!< How long successful lookups are cached for.
+	fr_time_delta_t	resolver_negative_ttl;		//!< How long failed lookups are cached for.
+	bool		resolver_prefetch;		//!< Refresh busy names before they expire.
+
 	char const	*radacct_dir;
 	char const	*lib_dir;
 	char const	*sbin_dir;
@@ -88,6 +100,17 @@ struct main_config_s {
 	bool		log_timestamp;
 	bool		log_timestamp_is_set;
 
+	bool		log_async;			//!< Write log messages from a background thread.
+	size_t		log_async_ring_size;		//!< Size of each thread's queue of log messages.
+
+	uint32_t	debug_sample_rate;		//!< Debug one in this many requests.
+	fr_ipaddr_t	debug_sample_src;		//!< Only debug requests from this network.
+	uint32_t	debug_sample_level;		//!< Debug level of sampled requests.
+	size_t		debug_sample_ring_size;		//!< Debug output kept by each worker.
+
+	fr_ipaddr_t	metrics_ipaddr;			//!< Where to serve metrics from.
+	uint16_t	metrics_port;			//!< Port to serve metrics on, or 0 for none.
+
 	int32_t		syslog_facility;
 
 	char const	*dict_dir;			//!< Where to load dictionaries from.
@@ -146,8 +169,23 @@ struct main_config_s {
 	int		multi_proc_sem_id;		//!< Semaphore we use to prevent multiple processes running.
 	char		*multi_proc_sem_path;		//!< Semaphore path.
 
+	uint32_t	num_processes;			//!< number of server processes to fork.
 	uint32_t	max_networks;			//!< for the scheduler
 	uint32_t	max_workers;			//!< for the scheduler
+	char const	*worker_select;			//!< how network threads choose a worker.
+	bool		steal_requests;			//!< idle workers take requests queued for busy ones.
+	bool		numa;				//!< pin networks and workers to NUMA nodes.
+	fr_time_delta_t	spin_budget;			//!< how long idle workers poll before sleeping.
+	bool		huge_pages;			//!< back large ring buffers with huge pages.
+	bool		prefault;			//!< touch ring buffer memory when it's allocated.
+	bool		zero_copy;			//!< decode packets in place, without copying them.
+	fr_time_delta_t	timer_resolution;		//!< use timer wheels with this resolution, if set.
+	fr_time_delta_t	request_deadline;		//!< discard requests which have waited this long.
+	uint32_t	queue_watermark;		//!< discard low priority requests above this queue depth.
+	fr_limiter_conf_t concurrency;			//!< adaptive limit on requests per worker.
+	bool		fair_queue;			//!< share workers between clients.
+	uint32_t	malloc_arenas;			//!< maximum number of malloc arenas.
+	size_t		request_arena_size;		//!< allocate request-scoped data from a pool this large.
 	fr_time_delta_t	stats_interval;			//!< for the scheduler
 
 };
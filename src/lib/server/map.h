@@ -96,6 +96,9 @@ struct vp_list_mod_s {
 
 	fr_map_list_t		mod;		//!< New map containing the destination (LHS) and
 						///< values (RHS).
+	fr_pair_list_t		pairs;		//!< Copies of the source list for list to list
+						///< operations.  Moved into the destination
+						///< when the modification is applied.
 	fr_dlist_t		entry;		//!< Entry into dlist
 };
 
@@ -46,6 +46,7 @@ static inline vp_list_mod_t *list_mod_alloc(TALLOC_CTX *ctx)
 	vp_list_mod_t *mod;
 	mod = talloc_zero(ctx, vp_list_mod_t);
 	fr_map_list_init(&mod->mod);
+	fr_pair_list_init(&mod->pairs);
 	return mod;
 }
 
@@ -367,6 +368,8 @@ int map_to_list_mod(TALLOC_CTX *ctx, vp_list_mod_t **out,
 	if (tmpl_is_list(mutated->lhs) && tmpl_is_list(mutated->rhs)) {
 		fr_pair_list_t	*list = NULL;
 		fr_pair_t	*vp = NULL;
+		map_t		*n_mod;
+		TALLOC_CTX	*pool;
 
 		/*
 		 *	Check source list
@@ -388,50 +391,31 @@ int map_to_list_mod(TALLOC_CTX *ctx, vp_list_mod_t **out,
 		}
 
 		n = list_mod_alloc(ctx);
+		if (!n) goto error;
 		n->map = original;
 
 		/*
-		 *	Iterate over all attributes in that list
+		 *	A single mod describes the destination,
+		 *	the values are the copied pairs.
 		 */
-		do {
-			map_t 	*n_mod;
-
-			n_mod = map_alloc(n);
-			if (!n_mod) goto error;
-
-			n_mod->op = mutated->op;
-
-			/*
-			 *	For the LHS we need to create a reference to
-			 *	the attribute, with the same destination list
-			 *	as the current LHS map.
-			 */
-			n_mod->lhs = tmpl_alloc(n, TMPL_TYPE_ATTR, T_BARE_WORD, mutated->lhs->name, mutated->lhs->len);
-			if (!n_mod->lhs) goto error;
-
-			if (tmpl_attr_copy(n_mod->lhs, mutated->lhs) < 0) goto error;
-
-			tmpl_attr_set_leaf_da(n_mod->lhs, vp->da);
+		n_mod = map_alloc(n);
+		if (!n_mod) goto error;
+		n_mod->lhs = mutated->lhs;
+		n_mod->op = mutated->op;
+		n_mod->rhs = mutated->rhs;
+		fr_dlist_insert_tail(&n->mod, n_mod);
 
-			/*
-			 *	For the RHS we copy the value of the attribute
-			 *	we just found, creating data (literal) tmpl.
-			 */
-			n_mod->rhs = tmpl_alloc(n_mod, TMPL_TYPE_DATA,
-					        vp->data.type == FR_TYPE_STRING ? T_DOUBLE_QUOTED_STRING : T_BARE_WORD,
-					        NULL, 0);
-			if (!n_mod->rhs) goto error;
-
-			/*
-			 *	Have to do a full copy, as the attribute we're
-			 *	getting the buffer value from may be freed
-			 *	before this map is applied.
-			 */
-			if (fr_value_box_copy(n_mod->rhs, tmpl_value(n_mod->rhs), &vp->data) < 0) goto error;
-			fr_dlist_insert_tail(&n->mod, n_mod);
+		/*
+		 *	Copy the whole list in one go.  The copies
+		 *	are made now, as the source may be modified
+		 *	by another map before this one is applied.
+		 *	Allocate them from one pool, as they're
+		 *	moved into the destination list as a block.
+		 */
+		pool = talloc_pool(n, fr_pair_list_len(list) * (sizeof(fr_pair_t) + 64));
+		if (!pool) goto error;
 
-			MAP_VERIFY(n_mod);
-		} while ((vp = fr_pair_list_next(list, vp)));
+		if (fr_pair_list_copy(pool, &n->pairs, list) < 0) goto error;
 
 		goto finish;
 	}
@@ -943,6 +927,91 @@ static inline void map_list_mod_debug(request_t *request,
 	talloc_free(rhs);
 }
 
+/** Move the pairs copied by a list to list #vp_list_mod_t into the destination list
+ *
+ * @param[in] request	to modify.
+ * @param[in] vlm	whose pairs are moved.  They're removed from the vlm,
+ *			so it can only be applied once.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int map_list_mod_apply_pairs(request_t *request, vp_list_mod_t const *vlm)
+{
+	map_t const		*map = vlm->map, *mod = fr_dlist_head(&vlm->mod);
+	fr_pair_list_t		*from = UNCONST(fr_pair_list_t *, &vlm->pairs);
+	fr_pair_list_t		*vp_list, tmp_list;
+	fr_pair_t		*vp;
+	request_t		*context;
+	TALLOC_CTX		*parent;
+
+	fr_assert(tmpl_is_list(mod->lhs) && tmpl_is_list(mod->rhs));
+
+	if (RDEBUG_ENABLED2) {
+		char buffer[256];
+
+		tmpl_print(&FR_SBUFF_OUT(buffer, sizeof(buffer)), mod->rhs, TMPL_ATTR_REF_PREFIX_YES, NULL);
+
+		for (vp = fr_pair_list_head(from); vp; vp = fr_pair_list_next(from, vp)) {
+			char const *quote = (vp->vp_type == FR_TYPE_STRING) ? "\"" : "";
+
+			RDEBUG2("%s %s %s -> %s%pV%s", map->lhs->name,
+				fr_table_str_by_value(fr_tokens_table, mod->op, "<INVALID>"),
+				buffer, quote, &vp->data, quote);
+		}
+	}
+
+	context = request;
+	if (!fr_cond_assert(tmpl_request_ptr(&context, tmpl_request(mod->lhs)) == 0)) return -1;
+
+	vp_list = tmpl_list_head(context, tmpl_list(mod->lhs));
+	if (!fr_cond_assert(vp_list)) return -1;
+
+	parent = tmpl_list_ctx(context, tmpl_list(mod->lhs));
+	fr_assert(parent);
+
+	switch (mod->op) {
+	case T_OP_SET:
+		fr_pair_list_free(vp_list);
+		fr_pair_list_steal(parent, vp_list, from);
+		break;
+
+	case T_OP_ADD:
+		fr_pair_list_steal(parent, vp_list, from);
+		break;
+
+	case T_OP_PREPEND:
+		fr_pair_list_init(&tmp_list);
+		fr_pair_list_steal(parent, &tmp_list, from);
+		fr_pair_list_prepend(vp_list, &tmp_list);
+		break;
+
+	/*
+	 *	Only add attributes which don't already
+	 *	exist in the destination.
+	 */
+	case T_OP_EQ:
+		fr_pair_list_init(&tmp_list);
+
+		while ((vp = fr_pair_list_head(from))) {
+			fr_pair_remove(from, vp);
+
+			if (fr_pair_find_by_da(vp_list, vp->da, 0)) {
+				talloc_free(vp);	/* Don't overwrite */
+				continue;
+			}
+			fr_pair_steal_append(parent, &tmp_list, vp);
+		}
+		fr_pair_list_append(vp_list, &tmp_list);	/* Do this last so we don't expand the 'to' set */
+		break;
+
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Apply the output of #map_to_list_mod to a request
  *
  * @param request	to modify.
@@ -966,6 +1035,11 @@ int map_list_mod_apply(request_t *request, vp_list_mod_t const *vlm)
 	MAP_VERIFY(map);
 	fr_assert(!fr_dlist_empty(&vlm->mod));
 
+	/*
+	 *	List to list copies carry pairs rather than values
+	 */
+	if (!fr_pair_list_empty(&vlm->pairs)) return map_list_mod_apply_pairs(request, vlm);
+
 	/*
 	 *	Print debug information for the mods being applied
 	 */
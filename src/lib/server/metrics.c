@@ -0,0 +1,500 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/lib/server/metrics.c
+ * @brief Export statistics in OpenMetrics format over HTTP.
+ *
+ * Workers, networks, trunks, etc. register themselves as sources of
+ * metrics when they're created, and are removed when they're freed.
+ * A separate thread accepts HTTP connections, and for each scrape, asks
+ * every source for a copy of its counters.
+ *
+ * The counters are owned, and written, by the thread which owns the
+ * source.  They're read without taking any locks, in the same way as
+ * radmin reads them.  The registry mutex is only taken when a source
+ * is added or removed, and by the metrics thread, so it's never on the
+ * request path.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/log.h>
+#include <freeradius-devel/server/metrics.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/log.h>
+#include <freeradius-devel/util/socket.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+struct fr_metrics_source_s {
+	fr_metrics_class_t const	*mc;		//!< What kind of source this is.
+	void const			*uctx;		//!< Passed to the snapshot function.
+	char const			*labels;	//!< Pre-formatted, and escaped labels.
+	uint64_t			*values;	//!< Written by the snapshot function.
+	fr_dlist_t			entry;		//!< Entry in the list of sources.
+};
+
+static pthread_mutex_t		metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fr_dlist_head_t		metrics_sources;
+
+static pthread_t		metrics_thread;
+static int			metrics_fd = -1;
+static int			metrics_wakeup[2] = { -1, -1 };
+static atomic_bool		metrics_running;
+static fr_metrics_source_t	*metrics_log_source;
+
+/*
+ *	Bucket upper bounds for #fr_time_elapsed_t.
+ */
+static char const *metrics_le[] = {
+	"0.000001", "0.00001", "0.0001", "0.001", "0.01", "0.1", "1.0", "+Inf"
+};
+
+static_assert(NUM_ELEMENTS(metrics_le) == FR_METRIC_HISTOGRAM_BUCKETS,
+	      "metrics_le must have a bound for each bucket of fr_time_elapsed_t");
+
+static size_t metrics_num_values(fr_metrics_class_t const *mc)
+{
+	size_t i, num = 0;
+
+	for (i = 0; i < mc->num_defs; i++) {
+		num += (mc->defs[i].type == FR_METRIC_HISTOGRAM) ? FR_METRIC_HISTOGRAM_BUCKETS : 1;
+	}
+
+	return num;
+}
+
+static int _metrics_source_free(fr_metrics_source_t *ms)
+{
+	pthread_mutex_lock(&metrics_mutex);
+	fr_dlist_remove(&metrics_sources, ms);
+	pthread_mutex_unlock(&metrics_mutex);
+
+	return 0;
+}
+
+/** Add a source of metrics
+ *
+ * The source is removed when it's freed, or when ctx is freed.
+ * Sources which are part of a larger structure should therefore be
+ * parented by that structure, so that they're removed before the
+ * counters are freed.
+ *
+ * @param[in] ctx	to allocate the source in.
+ * @param[in] mc	what kind of source this is.
+ * @param[in] uctx	passed to the snapshot function.
+ * @param[in] label	name of the first label, followed by its value, and
+ *			any further name / value pairs.  Terminated with NULL.
+ * @return
+ *	- The new source.
+ *	- NULL on error.
+ */
+fr_metrics_source_t *fr_metrics_source_add(TALLOC_CTX *ctx, fr_metrics_class_t const *mc, void const *uctx,
+					   char const *label, ...)
+{
+	fr_metrics_source_t	*ms;
+	char			*labels;
+	char const		*name;
+	va_list			ap;
+
+	ms = talloc_zero(ctx, fr_metrics_source_t);
+	if (!ms) return NULL;
+
+	ms->mc = mc;
+	ms->uctx = uctx;
+	ms->values = talloc_zero_array(ms, uint64_t, metrics_num_values(mc));
+	if (!ms->values) {
+	error:
+		talloc_free(ms);
+		return NULL;
+	}
+
+	labels = talloc_strdup(ms, "");
+	if (!labels) goto error;
+
+	va_start(ap, label);
+	for (name = label; name; name = va_arg(ap, char const *)) {
+		char const *value = va_arg(ap, char const *);
+		char const *p;
+
+		labels = talloc_asprintf_append_buffer(labels, "%s%s=\"", (labels[0] != '\0') ? "," : "", name);
+		for (p = value ? value : ""; labels && *p; p++) {
+			switch (*p) {
+			case '\\':
+				labels = talloc_strdup_append_buffer(labels, "\\\\");
+				break;
+
+			case '"':
+				labels = talloc_strdup_append_buffer(labels, "\\\"");
+				break;
+
+			case '\n':
+				labels = talloc_strdup_append_buffer(labels, "\\n");
+				break;
+
+			default:
+				labels = talloc_asprintf_append_buffer(labels, "%c", *p);
+				break;
+			}
+		}
+		if (labels) labels = talloc_strdup_append_buffer(labels, "\"");
+		if (!labels) {
+			va_end(ap);
+			goto error;
+		}
+	}
+	va_end(ap);
+	ms->labels = labels;
+
+	pthread_mutex_lock(&metrics_mutex);
+	if (!fr_dlist_initialised(&metrics_sources)) fr_dlist_init(&metrics_sources, fr_metrics_source_t, entry);
+	fr_dlist_insert_tail(&metrics_sources, ms);
+	pthread_mutex_unlock(&metrics_mutex);
+
+	talloc_set_destructor(ms, _metrics_source_free);
+
+	return ms;
+}
+
+/** Print one value, converting nanoseconds to seconds if necessary
+ *
+ */
+static char *metrics_value_print(char *out, fr_metric_def_t const *def, uint64_t value)
+{
+	if (def->nsec) {
+		return talloc_asprintf_append_buffer(out, "%" PRIu64 ".%09" PRIu64 "\n",
+						     value / NSEC, value % NSEC);
+	}
+
+	return talloc_asprintf_append_buffer(out, "%" PRIu64 "\n", value);
+}
+
+/** Print all metrics, in OpenMetrics text format
+ *
+ * Samples from every source of the same class are printed together,
+ * as OpenMetrics requires all samples in a family to be contiguous.
+ *
+ * @param[in] ctx	to allocate the text in.
+ * @return
+ *	- The metrics, terminated with "# EOF".
+ *	- NULL on error.
+ */
+char *fr_metrics_print(TALLOC_CTX *ctx)
+{
+	fr_metrics_source_t		*ms = NULL, *first;
+	fr_metrics_class_t const	*done[64];
+	size_t				num_done = 0;
+	char				*out;
+
+	out = talloc_strdup(ctx, "");
+	if (!out) return NULL;
+
+	pthread_mutex_lock(&metrics_mutex);
+	if (!fr_dlist_initialised(&metrics_sources)) goto finish;
+
+	/*
+	 *	Copy the counters first, so that the values
+	 *	printed for each source are as close to each other
+	 *	in time as we can make them.
+	 */
+	while ((ms = fr_dlist_next(&metrics_sources, ms))) ms->mc->snapshot(ms->values, ms->uctx);
+
+	/*
+	 *	Print each class in the order in which the first
+	 *	source of that class was added.
+	 */
+	for (first = fr_dlist_head(&metrics_sources);
+	     first && out;
+	     first = fr_dlist_next(&metrics_sources, first)) {
+		fr_metrics_class_t const	*mc = first->mc;
+		size_t				i, j, offset = 0;
+
+		for (i = 0; i < num_done; i++) if (done[i] == mc) break;
+		if (i < num_done) continue;
+		if (num_done == NUM_ELEMENTS(done)) break;
+		done[num_done++] = mc;
+
+		for (i = 0; (i < mc->num_defs) && out; i++) {
+			fr_metric_def_t const	*def = &mc->defs[i];
+
+			out = talloc_asprintf_append_buffer(out, "# TYPE freeradius_%s_%s %s\n"
+							    "# HELP freeradius_%s_%s %s\n",
+							    mc->name, def->name,
+							    (def->type == FR_METRIC_COUNTER) ? "counter" :
+							    (def->type == FR_METRIC_GAUGE) ? "gauge" : "histogram",
+							    mc->name, def->name, def->help);
+
+			for (ms = first; ms && out; ms = fr_dlist_next(&metrics_sources, ms)) {
+				uint64_t	count = 0;
+
+				if (ms->mc != mc) continue;
+
+				switch (def->type) {
+				case FR_METRIC_COUNTER:
+					out = talloc_asprintf_append_buffer(out, "freeradius_%s_%s_total{%s} ",
+									    mc->name, def->name, ms->labels);
+					if (out) out = metrics_value_print(out, def, ms->values[offset]);
+					break;
+
+				case FR_METRIC_GAUGE:
+					out = talloc_asprintf_append_buffer(out, "freeradius_%s_%s{%s} ",
+									    mc->name, def->name, ms->labels);
+					if (out) out = metrics_value_print(out, def, ms->values[offset]);
+					break;
+
+				case FR_METRIC_HISTOGRAM:
+					for (j = 0; (j < FR_METRIC_HISTOGRAM_BUCKETS) && out; j++) {
+						count += ms->values[offset + j];
+						out = talloc_asprintf_append_buffer(out,
+										    "freeradius_%s_%s_bucket{%s%sle=\"%s\"} %" PRIu64 "\n",
+										    mc->name, def->name, ms->labels,
+										    ms->labels[0] ? "," : "", metrics_le[j], count);
+					}
+					if (out) out = talloc_asprintf_append_buffer(out, "freeradius_%s_%s_count{%s} %" PRIu64 "\n",
+										     mc->name, def->name, ms->labels, count);
+					break;
+				}
+			}
+
+			offset += (def->type == FR_METRIC_HISTOGRAM) ? FR_METRIC_HISTOGRAM_BUCKETS : 1;
+		}
+	}
+
+finish:
+	pthread_mutex_unlock(&metrics_mutex);
+
+	if (out) out = talloc_strdup_append_buffer(out, "# EOF\n");
+
+	return out;
+}
+
+static fr_metric_def_t const log_metrics[] = {
+	{ .name = "dropped", .help = "Log messages discarded because a thread's queue was full.", .type = FR_METRIC_COUNTER },
+};
+
+static void log_metrics_snapshot(uint64_t *values, UNUSED void const *uctx)
+{
+	values[0] = fr_log_async_dropped();
+}
+
+static fr_metrics_class_t const log_metrics_class = {
+	.name = "log",
+	.defs = log_metrics,
+	.num_defs = NUM_ELEMENTS(log_metrics),
+	.snapshot = log_metrics_snapshot
+};
+
+/** Write all of a buffer to a blocking socket
+ *
+ */
+static int metrics_write(int fd, char const *buffer, size_t len)
+{
+	while (len > 0) {
+		ssize_t slen;
+
+		slen = write(fd, buffer, len);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		buffer += slen;
+		len -= slen;
+	}
+
+	return 0;
+}
+
+/** Read one HTTP request, and send the response
+ *
+ * We only support "GET /metrics".  The connection is closed after
+ * each response, which is what scrapers expect from a simple exporter.
+ */
+static void metrics_request(int fd)
+{
+	char		buffer[4096], header[256];
+	size_t		len = 0;
+	char		*body = NULL;
+	char const	*status;
+	struct pollfd	pfd = { .fd = fd, .events = POLLIN };
+
+	/*
+	 *	Read the request line and headers.  Slow clients
+	 *	get one second, so that they can't hold up other
+	 *	scrapes.
+	 */
+	while (len < (sizeof(buffer) - 1)) {
+		ssize_t	slen;
+
+		if (poll(&pfd, 1, 1000) <= 0) return;
+
+		slen = read(fd, buffer + len, sizeof(buffer) - 1 - len);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return;
+		}
+		if (slen == 0) return;
+
+		len += slen;
+		buffer[len] = '\0';
+		if (strstr(buffer, "\r\n\r\n") || strstr(buffer, "\n\n")) break;
+	}
+	buffer[len] = '\0';
+
+	if (strncmp(buffer, "GET ", 4) != 0) {
+		status = "405 Method Not Allowed";
+
+	} else if ((strncmp(buffer + 4, "/metrics", 8) != 0) ||
+		   ((buffer[12] != ' ') && (buffer[12] != '?'))) {
+		status = "404 Not Found";
+
+	} else {
+		body = fr_metrics_print(NULL);
+		status = body ? "200 OK" : "500 Internal Server Error";
+	}
+
+	snprintf(header, sizeof(header),
+		 "HTTP/1.1 %s\r\n"
+		 "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+		 "Content-Length: %zu\r\n"
+		 "Connection: close\r\n"
+		 "\r\n", status, body ? talloc_array_length(body) - 1 : 0);
+
+	if ((metrics_write(fd, header, strlen(header)) == 0) && body) {
+		(void) metrics_write(fd, body, talloc_array_length(body) - 1);
+	}
+
+	talloc_free(body);
+}
+
+static void *metrics_thread_main(UNUSED void *arg)
+{
+	struct pollfd	pfd[2] = {
+		{ .fd = metrics_fd, .events = POLLIN },
+		{ .fd = metrics_wakeup[0], .events = POLLIN }
+	};
+
+	while (atomic_load(&metrics_running)) {
+		int fd;
+
+		if (poll(pfd, NUM_ELEMENTS(pfd), -1) < 0) {
+			if (errno == EINTR) continue;
+			ERROR("Metrics listener failed: %s", fr_syserror(errno));
+			break;
+		}
+
+		if (pfd[1].revents) break;
+		if (!(pfd[0].revents & POLLIN)) continue;
+
+		fd = accept(metrics_fd, NULL, NULL);
+		if (fd < 0) continue;
+
+		metrics_request(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/** Start the thread which serves metrics
+ *
+ * This has to be called after daemonizing, as threads don't survive
+ * fork().
+ *
+ * @param[in] ipaddr	to listen on.
+ * @param[in] port	to listen on.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_metrics_start(fr_ipaddr_t const *ipaddr, uint16_t port)
+{
+	int	ret;
+
+	if (atomic_load(&metrics_running)) return 0;
+
+	metrics_fd = fr_socket_server_tcp(ipaddr, &port, NULL, false);
+	if (metrics_fd < 0) return -1;
+
+	if (fr_socket_bind(metrics_fd, ipaddr, &port, NULL) < 0) {
+	error:
+		close(metrics_fd);
+		metrics_fd = -1;
+		return -1;
+	}
+
+	if (listen(metrics_fd, 8) < 0) {
+		fr_strerror_printf("Failed listening on metrics socket: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	if (pipe(metrics_wakeup) < 0) {
+		fr_strerror_printf("Failed creating metrics pipe: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	metrics_log_source = fr_metrics_source_add(NULL, &log_metrics_class, NULL, NULL, (char const *) NULL);
+
+	atomic_store(&metrics_running, true);
+
+	ret = pthread_create(&metrics_thread, NULL, metrics_thread_main, NULL);
+	if (ret != 0) {
+		fr_strerror_printf("Failed creating metrics thread: %s", fr_syserror(ret));
+		atomic_store(&metrics_running, false);
+		TALLOC_FREE(metrics_log_source);
+		close(metrics_wakeup[0]);
+		close(metrics_wakeup[1]);
+		metrics_wakeup[0] = metrics_wakeup[1] = -1;
+		goto error;
+	}
+
+	return 0;
+}
+
+/** Stop serving metrics
+ *
+ */
+void fr_metrics_stop(void)
+{
+	uint8_t c = 0;
+
+	if (!atomic_load(&metrics_running)) return;
+
+	atomic_store(&metrics_running, false);
+	if (write(metrics_wakeup[1], &c, 1) < 0) { /* Thread exits anyway */ }
+
+	pthread_join(metrics_thread, NULL);
+
+	TALLOC_FREE(metrics_log_source);
+
+	close(metrics_fd);
+	close(metrics_wakeup[0]);
+	close(metrics_wakeup[1]);
+	metrics_fd = metrics_wakeup[0] = metrics_wakeup[1] = -1;
+}
@@ -0,0 +1,92 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/metrics.h
+ * @brief Export statistics in OpenMetrics format over HTTP.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(metrics_h, "$Id$")
+
+#include <freeradius-devel/util/inet.h>
+#include <freeradius-devel/util/talloc.h>
+#include <freeradius-devel/util/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	FR_METRIC_COUNTER = 0,				//!< Monotonic count.
+	FR_METRIC_GAUGE,				//!< Value which may go up or down.
+	FR_METRIC_HISTOGRAM				//!< A #fr_time_elapsed_t, which takes
+							///< #FR_METRIC_HISTOGRAM_BUCKETS values.
+} fr_metric_type_t;
+
+#define FR_METRIC_HISTOGRAM_BUCKETS	NUM_ELEMENTS(((fr_time_elapsed_t *)NULL)->array)
+
+/** Definition of one metric
+ *
+ */
+typedef struct {
+	char const		*name;			//!< Appended to the class name, e.g. "requests".
+	char const		*help;			//!< Printed in the # HELP line.
+	fr_metric_type_t	type;			//!< How the value is exported.
+	bool			nsec;			//!< The value is in nanoseconds, and is exported
+							///< in seconds.
+} fr_metric_def_t;
+
+/** Copy the current values of a source's metrics
+ *
+ * Called from the metrics thread, while the thread which owns uctx is
+ * running.  It must only read counters, and must not take locks which
+ * the owning thread holds while processing requests.
+ *
+ * @param[out] values	One per metric, in the order of the class's definitions.
+ *			Histograms take #FR_METRIC_HISTOGRAM_BUCKETS values.
+ * @param[in] uctx	passed to #fr_metrics_source_add.
+ */
+typedef void (*fr_metrics_snapshot_t)(uint64_t *values, void const *uctx);
+
+/** A type of thing which produces metrics, e.g. a worker or a trunk
+ *
+ */
+typedef struct {
+	char const		*name;			//!< Prefix for metric names.  Names are
+							///< freeradius_<name>_<metric>.
+	fr_metric_def_t const	*defs;			//!< Metrics which each source produces.
+	size_t			num_defs;		//!< How many metrics there are.
+	fr_metrics_snapshot_t	snapshot;		//!< Copy the metric values.
+} fr_metrics_class_t;
+
+typedef struct fr_metrics_source_s fr_metrics_source_t;
+
+fr_metrics_source_t	*fr_metrics_source_add(TALLOC_CTX *ctx, fr_metrics_class_t const *mc, void const *uctx,
+					       char const *label, ...) CC_HINT(nonnull(2)) CC_HINT(sentinel);
+
+char			*fr_metrics_print(TALLOC_CTX *ctx);
+
+int			fr_metrics_start(fr_ipaddr_t const *ipaddr, uint16_t port) CC_HINT(nonnull);
+
+void			fr_metrics_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -58,8 +58,63 @@ static fr_rb_tree_t *module_instance_data_tree;
  */
 static fr_cmd_table_t cmd_module_table[];
 
+/** Maximum number of connections opened at once when starting pools
+ */
+#define MODULE_POOL_START_THREADS	32
+
+/** Pools whose initial connections are opened once all modules are instantiated
+ */
+static fr_pool_t **module_pools_pending;
+
+/** Whether module_connection_pool_init() should defer opening connections
+ */
+static bool module_pools_defer;
+
+/** Time spent bootstrapping or instantiating modules called by the current one
+ *
+ * Used so that each module is only charged for its own work.
+ */
+static fr_time_delta_t module_nested_time;
+
+/** Only load modules when something references them
+ *
+ * Set from the main configuration.  If true, modules_bootstrap() only
+ * records the module sections, and each module is loaded the first
+ * time it's looked up by name, or its xlat is used.
+ */
+bool modules_lazy_load = false;
+
+/** A module section which hasn't been loaded yet
+ */
+typedef struct {
+	char			*name;		//!< Instance name of the module.
+	CONF_SECTION		*cs;		//!< Configuration for the module.
+	fr_rb_node_t		node;		//!< Entry in the pending tree.
+} module_pending_t;
+
+/** Modules which nothing has referenced yet
+ *
+ * Only allocated if #modules_lazy_load is true.  Freed by
+ * modules_instantiate(), after which no more modules are loaded.
+ */
+static fr_rb_tree_t *module_pending_tree;
+
+/** Whether modules_instantiate() is running
+ *
+ * Modules loaded while it runs must be instantiated immediately.
+ */
+static bool module_instantiating;
+
+/** Whether a module failed to load when it was first referenced
+ */
+static bool module_lazy_failed;
+
 static int _module_instantiate(void *instance);
 
+static void modules_timing_report(fr_time_delta_t pools_time);
+
+static void modules_lazy_report(void);
+
 /*
  *	Ordered by component
  */
@@ -537,7 +592,19 @@ fr_pool_t *module_connection_pool_init(CONF_SECTION *module,
 
 		fr_pool_enable_triggers(pool, trigger_prefix, trigger_args);
 
-		if (fr_pool_start(pool) < 0) {
+		/*
+		 *	If all the modules are being instantiated,
+		 *	open the connections for every pool at the
+		 *	same time, once they're done.  Connections
+		 *	needed before then are opened on demand.
+		 */
+		if (module_pools_defer) {
+			size_t num = talloc_array_length(module_pools_pending);
+
+			MEM(module_pools_pending = talloc_realloc(NULL, module_pools_pending, fr_pool_t *, num + 1));
+			module_pools_pending[num] = pool;
+
+		} else if (fr_pool_start(pool) < 0) {
 			ERROR("%s: Starting initial connections failed", log_prefix);
 			return NULL;
 		}
@@ -651,7 +718,7 @@ module_instance_t *module_by_name(module_instance_t const *parent, char const *a
 					.dl_inst = &(dl_module_inst_t){ .parent = parent ? parent->dl_inst : NULL },
 					.name = inst_name
 			       });
-	if (!inst) return NULL;
+	if (!inst) return parent ? NULL : module_lazy_bootstrap(inst_name);
 
 	return talloc_get_type_abort(inst, module_instance_t);
 }
@@ -1132,6 +1199,7 @@ void modules_free(void)
 		TALLOC_FREE(module_instance_name_tree);
 	}
 
+	TALLOC_FREE(module_pending_tree);
 	TALLOC_FREE(module_instance_data_tree);
 	TALLOC_FREE(instance_ctx);
 }
@@ -1290,12 +1358,24 @@ static int _module_instantiate(void *instance)
 	 *	Call the instantiate method, if any.
 	 */
 	if (mi->module->instantiate) {
+		fr_time_delta_t	nested = module_nested_time;
+		fr_time_t	start;
+		int		ret;
+
 		cf_log_debug(mi->dl_inst->conf, "Instantiating module \"%s\"", mi->name);
 
 		/*
 		 *	Call the module's instantiation routine.
+		 *	It may instantiate other modules, which
+		 *	are timed separately.
 		 */
-		if ((mi->module->instantiate)(mi->dl_inst->data, mi->dl_inst->conf) < 0) {
+		module_nested_time = 0;
+		start = fr_time();
+		ret = (mi->module->instantiate)(mi->dl_inst->data, mi->dl_inst->conf);
+		mi->instantiate_time = (fr_time() - start) - module_nested_time;
+		module_nested_time = nested + (fr_time() - start);
+
+		if (ret < 0) {
 			cf_log_err(mi->dl_inst->conf, "Instantiation failed for module \"%s\"",
 				   mi->name);
 
@@ -1335,20 +1415,128 @@ int modules_instantiate(void)
 {
 	void				*instance;
 	fr_rb_iter_inorder_t	iter;
+	fr_time_delta_t			pools_time = 0;
 
 	DEBUG2("#### Instantiating modules ####");
 
+	module_pools_defer = true;
+	module_instantiating = true;
 	for (instance = fr_rb_iter_init_inorder(&iter, module_instance_name_tree);
 	     instance;
 	     instance = fr_rb_iter_next_inorder(&iter)) {
-		if (_module_instantiate(instance) < 0) {
+		if ((_module_instantiate(instance) < 0) || module_lazy_failed) {
+		error:
+			module_instantiating = false;
+			module_pools_defer = false;
+			TALLOC_FREE(module_pools_pending);
 			return -1;
 		}
 	}
+	module_instantiating = false;
+	module_pools_defer = false;
+
+	/*
+	 *	Covers modules which failed to load when they were
+	 *	referenced with '-', which doesn't produce an error.
+	 */
+	if (module_lazy_failed) goto error;
+
+	if (module_pending_tree) modules_lazy_report();
+
+	/*
+	 *	Opening connections is usually the slowest part of
+	 *	starting up, as each one waits for a remote server.
+	 *	So we open them all in parallel.
+	 */
+	if (module_pools_pending) {
+		fr_time_t	start = fr_time();
+		int		ret;
+
+		DEBUG2("#### Opening connection pools ####");
+
+		ret = fr_pool_start_many(module_pools_pending, talloc_array_length(module_pools_pending),
+					 MODULE_POOL_START_THREADS);
+		pools_time = fr_time() - start;
+		TALLOC_FREE(module_pools_pending);
+
+		if (ret < 0) return -1;
+	}
+
+	if (DEBUG_ENABLED2) modules_timing_report(pools_time);
 
 	return 0;
 }
 
+/** Log the modules which weren't loaded, because nothing referenced them
+ *
+ * After this no more modules will be loaded.
+ */
+static void modules_lazy_report(void)
+{
+	fr_rb_iter_inorder_t	iter;
+	module_pending_t	*mp;
+	uint32_t		num;
+
+	num = fr_rb_num_elements(module_pending_tree);
+	if (num > 0) {
+		INFO("Skipped loading %u module(s) which are not referenced by any virtual server, "
+		     "policy, or other module", num);
+
+		for (mp = fr_rb_iter_init_inorder(&iter, module_pending_tree);
+		     mp;
+		     mp = fr_rb_iter_next_inorder(&iter)) {
+			cf_log_info(mp->cs, "  %s", mp->name);
+		}
+	}
+
+	TALLOC_FREE(module_pending_tree);
+}
+
+static int module_time_cmp(void const *one, void const *two)
+{
+	module_instance_t const *a = *((module_instance_t const * const *)one);
+	module_instance_t const *b = *((module_instance_t const * const *)two);
+	fr_time_delta_t a_time = a->bootstrap_time + a->instantiate_time;
+	fr_time_delta_t b_time = b->bootstrap_time + b->instantiate_time;
+
+	return (a_time < b_time) - (a_time > b_time);
+}
+
+/** Log how long each module took to bootstrap and instantiate, slowest first
+ *
+ * @param[in] pools_time	how long it took to open the initial connections
+ *				for all of the connection pools.
+ */
+static void modules_timing_report(fr_time_delta_t pools_time)
+{
+	module_instance_t	**mis;
+	module_instance_t	*mi;
+	fr_rb_iter_inorder_t	iter;
+	fr_time_delta_t		total = 0;
+	size_t			num = 0, i;
+
+	MEM(mis = talloc_array(NULL, module_instance_t *, fr_rb_num_elements(module_instance_name_tree)));
+
+	for (mi = fr_rb_iter_init_inorder(&iter, module_instance_name_tree);
+	     mi;
+	     mi = fr_rb_iter_next_inorder(&iter)) {
+		mis[num++] = mi;
+		total += mi->bootstrap_time + mi->instantiate_time;
+	}
+
+	qsort(mis, num, sizeof(mis[0]), module_time_cmp);
+
+	DEBUG2("#### Module startup times ####");
+	for (i = 0; i < num; i++) {
+		DEBUG2("%-32s bootstrap %pVs instantiate %pVs", mis[i]->name,
+		       fr_box_time_delta(mis[i]->bootstrap_time), fr_box_time_delta(mis[i]->instantiate_time));
+	}
+	DEBUG2("Total %pVs in %zu modules, plus %pVs opening connection pools",
+	       fr_box_time_delta(total), num, fr_box_time_delta(pools_time));
+
+	talloc_free(mis);
+}
+
 /** Recursive component of module_instance_name
  *
  */
@@ -1552,9 +1740,19 @@ module_instance_t *module_bootstrap(module_instance_t const *parent, CONF_SECTIO
 	 *	submodules.
 	 */
 	if (mi->module->bootstrap) {
+		fr_time_delta_t	nested = module_nested_time;
+		fr_time_t	start;
+		int		ret;
+
 		cf_log_debug(mi->dl_inst->conf, "Bootstrapping module \"%s\"", mi->name);
 
-	    	if ((mi->module->bootstrap)(mi->dl_inst->data, cs) < 0) {
+		module_nested_time = 0;
+		start = fr_time();
+		ret = (mi->module->bootstrap)(mi->dl_inst->data, cs);
+		mi->bootstrap_time = (fr_time() - start) - module_nested_time;
+		module_nested_time = nested + (fr_time() - start);
+
+	    	if (ret < 0) {
 			cf_log_err(cs, "Bootstrap failed for module \"%s\"", mi->name);
 			talloc_free(mi);
 			return NULL;
@@ -1564,6 +1762,97 @@ module_instance_t *module_bootstrap(module_instance_t const *parent, CONF_SECTIO
 	return mi;
 }
 
+static int8_t module_pending_cmp(void const *one, void const *two)
+{
+	module_pending_t const *a = one;
+	module_pending_t const *b = two;
+
+	return CMP(strcmp(a->name, b->name), 0);
+}
+
+/** Record a module section, so that it can be loaded when it's first referenced
+ *
+ * @param[in] cs	module's configuration section.
+ * @return
+ *	- 0 on success.
+ *	- -1 if there's already a module with the same name.
+ */
+static int module_pending_add(CONF_SECTION *cs)
+{
+	module_pending_t	*mp, *old;
+
+	MEM(mp = talloc_zero(module_pending_tree, module_pending_t));
+	module_instance_name(mp, &mp->name, NULL, cs);
+	mp->cs = cs;
+
+	old = fr_rb_find(module_pending_tree, mp);
+	if (old) {
+		ERROR("Duplicate module \"%s\" in file %s[%d] and file %s[%d]",
+		      mp->name,
+		      cf_filename(cs),
+		      cf_lineno(cs),
+		      cf_filename(old->cs),
+		      cf_lineno(old->cs));
+		talloc_free(mp);
+		return -1;
+	}
+
+	if (!fr_cond_assert(fr_rb_insert(module_pending_tree, mp))) {
+		talloc_free(mp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Load a module which modules_bootstrap() skipped, because nothing referenced it yet
+ *
+ * Called when a top level module isn't found by name.  If modules
+ * aren't being lazily loaded, or the server has finished starting,
+ * this does nothing.
+ *
+ * @param[in] name	of the module instance.
+ * @return
+ *	- The module instance.
+ *	- NULL if there's no module with that name waiting to be loaded,
+ *	  or it failed to load.
+ */
+module_instance_t *module_lazy_bootstrap(char const *name)
+{
+	module_pending_t	*mp;
+	module_instance_t	*mi;
+
+	if (!module_pending_tree) return NULL;
+
+	mp = fr_rb_find(module_pending_tree, &(module_pending_t){ .name = UNCONST(char *, name) });
+	if (!mp) return NULL;
+
+	/*
+	 *	Remove it first, as module_bootstrap() checks for
+	 *	duplicates by looking the module up by name.
+	 */
+	fr_rb_remove(module_pending_tree, mp);
+
+	cf_log_debug(mp->cs, "Loading module \"%s\" on first reference", mp->name);
+
+	mi = module_bootstrap(NULL, mp->cs);
+	talloc_free(mp);
+	if (!mi) {
+		module_lazy_failed = true;
+		return NULL;
+	}
+
+	/*
+	 *	Referenced by another module's instantiate callback.
+	 */
+	if (module_instantiating && (_module_instantiate(mi) < 0)) {
+		module_lazy_failed = true;
+		return NULL;
+	}
+
+	return mi;
+}
+
 /** Bootstrap a virtual module from an instantiate section
  *
  * @param[in] vm_cs	that defines the virtual module.
@@ -1680,6 +1969,11 @@ int modules_bootstrap(CONF_SECTION *root)
 
 	cf_log_debug(modules, " modules {");
 
+	if (modules_lazy_load) {
+		MEM(module_pending_tree = fr_rb_inline_alloc(NULL, module_pending_t, node,
+							     module_pending_cmp, NULL));
+	}
+
 	/*
 	 *	Loop over module definitions, looking for duplicates.
 	 *
@@ -1709,6 +2003,15 @@ int modules_bootstrap(CONF_SECTION *root)
 		name = cf_section_name1(subcs);
 		if (unlang_compile_is_keyword(name)) goto invalid_name;
 
+		/*
+		 *	Loaded by module_by_name() when something
+		 *	references it.
+		 */
+		if (modules_lazy_load) {
+			if (module_pending_add(subcs) < 0) return -1;
+			continue;
+		}
+
 		instance = module_bootstrap(NULL, subcs);
 		if (!instance) return -1;
 
@@ -1738,8 +2041,23 @@ int modules_bootstrap(CONF_SECTION *root)
 			 *	they're referenced at all...
 			 */
 			if (cf_item_is_pair(ci)) {
-				cf_log_warn(ci, "Only virtual modules can be instantiated "
-					    "with the instantiate section");
+				char const *name = cf_pair_attr(cf_item_to_pair(ci));
+
+				if (!modules_lazy_load) {
+					cf_log_warn(ci, "Only virtual modules can be instantiated "
+						    "with the instantiate section");
+					continue;
+				}
+
+				/*
+				 *	Load modules which are listed here,
+				 *	even if nothing else references them.
+				 */
+				if (!module_by_name(NULL, name)) {
+					cf_log_err(ci, "Module \"%s\" listed in the instantiate section does not exist",
+						   name);
+					return -1;
+				}
 				continue;
 			}
 
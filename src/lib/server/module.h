@@ -141,6 +141,8 @@ extern "C" {
  */
 extern const char *section_type_value[MOD_COUNT];
 
+extern bool modules_lazy_load;
+
 /** Common fields for submodules
  *
  * This should either be the first field in the structure exported from
@@ -209,6 +211,9 @@ struct module_instance_s {
 
 	bool				instantiated;	//!< Whether the module has been instantiated yet.
 
+	fr_time_delta_t			bootstrap_time;	//!< How long the module took to bootstrap.
+	fr_time_delta_t			instantiate_time; //!< How long the module took to instantiate.
+
 	/** @name Return code overrides
 	 * @{
  	 */
@@ -331,6 +336,8 @@ int		modules_instantiate(void) CC_HINT(nonnull);
 
 module_instance_t *module_bootstrap(module_instance_t const *parent, CONF_SECTION *cs) CC_HINT(nonnull(2));
 
+module_instance_t *module_lazy_bootstrap(char const *name) CC_HINT(nonnull);
+
 int		modules_bootstrap(CONF_SECTION *root) CC_HINT(nonnull);
 /** @} */
 
@@ -249,7 +249,7 @@ static password_info_t password_info[] = {
 						.no_normify = true
 					},
 	[FR_CRYPT]			= {
-						.type = PASSWORD_HASH,
+						.type = PASSWORD_HASH_VARIABLE,
 						.da = &attr_crypt
 					},
 	[FR_LM]				= {
@@ -960,12 +960,7 @@ static fr_pair_t *password_normalise_and_recheck(TALLOC_CTX *ctx, request_t *req
 fr_pair_t *password_find(bool *ephemeral, TALLOC_CTX *ctx, request_t *request,
 			  fr_dict_attr_t const *allowed_attrs[], size_t allowed_attrs_len, bool normify)
 {
-	fr_dcursor_t	cursor;
-	fr_pair_t	*known_good;
-
-	for (known_good = fr_dcursor_iter_by_ancestor_init(&cursor, &request->control_pairs, attr_root);
-	     known_good;
-	     known_good = fr_dcursor_next(&cursor)) {
+	fr_pair_list_foreach_by_ancestor(&request->control_pairs, known_good, attr_root) {
 		password_info_t		*info;
 		fr_pair_t		*out;
 		size_t			i;
@@ -1079,35 +1079,150 @@ fr_pool_t *fr_pool_init(TALLOC_CTX *ctx,
 	return pool;
 }
 
-int fr_pool_start(fr_pool_t *pool)
+/** Work shared by the threads opening initial connections
+ *
+ */
+typedef struct {
+	pthread_mutex_t		mutex;		//!< Protects the fields below.
+	fr_pool_t		**pools;	//!< Pools to open connections for.
+	size_t			num;		//!< How many pools there are.
+	size_t			next_pool;	//!< The pool we're currently opening connections for.
+	uint32_t		next_conn;	//!< How many connections we've started opening for that pool.
+	bool			*failed;	//!< Whether opening a connection failed, one per pool.
+} fr_pool_start_work_t;
+
+/** Pick the next initial connection to open
+ *
+ * @return
+ *	- true if there's a connection to open, with out and idx set.
+ *	- false if there's nothing left to do.
+ */
+static bool pool_start_next(fr_pool_start_work_t *work, fr_pool_t **out, size_t *idx)
 {
-	uint32_t		i;
-	fr_pool_connection_t 	*this;
+	pthread_mutex_lock(&work->mutex);
+	while (work->next_pool < work->num) {
+		fr_pool_t *pool = work->pools[work->next_pool];
+
+		/*
+		 *	Once one connection fails, the pool will refuse
+		 *	to open more until retry_delay has passed, so
+		 *	there's no point in trying.
+		 */
+		if (!work->failed[work->next_pool] && (work->next_conn < pool->start)) {
+			*out = pool;
+			*idx = work->next_pool;
+			work->next_conn++;
+			pthread_mutex_unlock(&work->mutex);
+			return true;
+		}
+
+		work->next_pool++;
+		work->next_conn = 0;
+	}
+	pthread_mutex_unlock(&work->mutex);
+
+	return false;
+}
+
+static void *pool_start_thread(void *arg)
+{
+	fr_pool_start_work_t	*work = arg;
+	fr_pool_t		*pool;
+	size_t			idx;
+
+	while (pool_start_next(work, &pool, &idx)) {
+		if (connection_spawn(pool, NULL, fr_time(), false, true)) continue;
+
+		pthread_mutex_lock(&work->mutex);
+		work->failed[idx] = true;
+		pthread_mutex_unlock(&work->mutex);
+	}
+
+	return NULL;
+}
+
+/** Open the initial connections for many pools at once
+ *
+ * Opening a connection usually means waiting for a remote server, so the
+ * 'start' connections of every pool are opened by up to max_threads threads
+ * in parallel.  The caller's thread is one of them.
+ *
+ * @note Will call the 'start' trigger for each pool.
+ *
+ * @param[in] pools		to open connections for.
+ * @param[in] num		number of pools.
+ * @param[in] max_threads	maximum number of connections to open at once.
+ * @return
+ *	- 0 on success.
+ *	- -1 if any pool failed to open its initial connections.
+ */
+int fr_pool_start_many(fr_pool_t **pools, size_t num, uint32_t max_threads)
+{
+	fr_pool_start_work_t	work = { .pools = pools, .num = num };
+	pthread_t		*threads = NULL;
+	uint32_t		num_threads = 0, total = 0, i;
+	size_t			j;
+	int			ret = 0;
 
 	/*
 	 *	Don't spawn any connections
 	 */
-	if (check_config) return 0;
+	if (check_config || !num) return 0;
+
+	for (j = 0; j < num; j++) total += pools[j]->start;
+	if (max_threads > total) max_threads = total;
+
+	MEM(work.failed = talloc_zero_array(NULL, bool, num));
+	pthread_mutex_init(&work.mutex, NULL);
 
 	/*
-	 *	Create all of the connections, unless the admin says
-	 *	not to.
+	 *	If we can't create a thread, the threads we
+	 *	already have do the work.  It just takes longer.
 	 */
-	for (i = 0; i < pool->start; i++) {
-		/*
-		 *	Call time() once for each spawn attempt as there
-		 *	could be a significant delay.
-		 */
-		this = connection_spawn(pool, NULL, time(NULL), false, true);
-		if (!this) {
+	if (max_threads > 1) {
+		MEM(threads = talloc_array(work.failed, pthread_t, max_threads - 1));
+		for (i = 0; i < (max_threads - 1); i++) {
+			if (pthread_create(&threads[i], NULL, pool_start_thread, &work) != 0) break;
+			num_threads++;
+		}
+	}
+
+	(void) pool_start_thread(&work);
+
+	for (i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+
+	for (j = 0; j < num; j++) {
+		fr_pool_t *pool = pools[j];
+
+		if (work.failed[j]) {
 			ERROR("Failed spawning initial connections");
-			return -1;
+			ret = -1;
+			continue;
 		}
+
+		fr_pool_trigger_exec(pool, NULL, "start");
 	}
 
-	fr_pool_trigger_exec(pool, NULL, "start");
+	pthread_mutex_destroy(&work.mutex);
+	talloc_free(work.failed);
 
-	return 0;
+	return ret;
+}
+
+/** Open the initial connections for a pool
+ *
+ * The 'start' connections are opened in parallel.
+ *
+ * @note Will call the 'start' trigger.
+ *
+ * @param[in] pool	to open connections for.
+ * @return
+ *	- 0 on success.
+ *	- -1 if we couldn't open all the connections.
+ */
+int fr_pool_start(fr_pool_t *pool)
+{
+	return fr_pool_start_many(&pool, 1, pool->start);
 }
 
 /** Allocate a new pool using an existing one as a template
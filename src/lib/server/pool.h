@@ -136,6 +136,8 @@ fr_pool_t	*fr_pool_init(TALLOC_CTX *ctx,
 			      char const *log_prefix);
 int		fr_pool_start(fr_pool_t *pool);
 
+int		fr_pool_start_many(fr_pool_t **pools, size_t num, uint32_t max_threads);
+
 fr_pool_t	*fr_pool_copy(TALLOC_CTX *ctx, fr_pool_t *pool, void *opaque);
 
 
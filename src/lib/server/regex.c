@@ -88,6 +88,13 @@ void regex_sub_to_request(request_t *request, regex_t **preg, fr_regmatch_t **re
 	if (!(*preg)->precompiled) {
 		new_rc->preg = talloc_steal(new_rc, *preg);
 		*preg = NULL;
+	} else if ((*preg)->cached) {
+		/*
+		 *	The runtime cache may evict the
+		 *	expression before the captures are
+		 *	done with it.
+		 */
+		MEM(new_rc->preg = talloc_reference(new_rc, *preg));
 	} else {
 		new_rc->preg = *preg;	/* Compiled on startup, will hopefully stick around */
 	}
@@ -0,0 +1,468 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Reload module data in the background, and publish it to workers.
+ * @file src/lib/server/reload.c
+ *
+ * Modules which load their data from files at instantiation (users files,
+ * passwd files) can use this to pick up changes without a HUP.  The data
+ * is reloaded in a dedicated thread, either when a radmin command asks for
+ * it, or when one of the files changes.  The workers keep using the current
+ * data while the new copy is being built.
+ *
+ * The new data is published by swapping a pointer.  The old data is freed
+ * once no worker can still be using it, which is tracked with epochs.  Each
+ * worker has a #fr_reload_reader_t, which records the epoch the worker saw
+ * when it started using the data, or zero if it's not using it.  After the
+ * swap the epoch is incremented, and the reload thread waits until no reader
+ * has an older epoch.  Workers only use the data for the duration of a
+ * module call, so the wait is short, and workers never wait at all.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/command.h>
+#include <freeradius-devel/server/log.h>
+#include <freeradius-devel/server/reload.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/syserror.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** A file we watch for changes
+ *
+ */
+typedef struct {
+	char const		*filename;	//!< To stat.
+	time_t			mtime;		//!< When it was last modified.
+	ino_t			ino;		//!< So we notice files being replaced.
+	off_t			size;		//!< So we notice files being truncated.
+} fr_reload_file_t;
+
+struct fr_reload_s {
+	char const		*name;		//!< Of the module instance, for logging and radmin.
+	fr_reload_load_t	load;		//!< Builds a new copy of the data.
+	void			*uctx;		//!< Passed to load.
+
+	_Atomic(void *)		data;		//!< Current data.
+	atomic_uint_fast64_t	epoch;		//!< Incremented each time the data is replaced.
+
+	pthread_mutex_t		mutex;		//!< Protects everything below.
+	pthread_cond_t		wake;		//!< Signalled when a reload is triggered, or on shutdown.
+
+	fr_dlist_head_t		readers;	//!< Of the data.
+
+	fr_reload_file_t	*files;		//!< Files to watch, a talloc array.
+	fr_time_delta_t		interval;	//!< How often to check the files.  Zero to never check.
+
+	bool			triggered;	//!< A reload was requested.
+	bool			shutdown;	//!< Tells the thread to exit.
+	bool			running;	//!< The thread was started.
+	pthread_t		thread;		//!< Which reloads the data.
+
+	uint64_t		reloads;	//!< Successful reloads.
+	uint64_t		failures;	//!< Failed reloads.
+	fr_time_t		last;		//!< When the data was last replaced.
+};
+
+struct fr_reload_reader_s {
+	fr_dlist_t		entry;		//!< Entry in the reload's list of readers.
+	fr_reload_t		*reload;	//!< We read the data of.
+	atomic_uint_fast64_t	epoch;		//!< Epoch when we started using the data, zero when not using it.
+};
+
+/** Record the current state of a file
+ *
+ * @return
+ *	- true if the file changed since it was last checked.
+ *	- false if it's the same.
+ */
+static bool reload_file_changed(fr_reload_file_t *file)
+{
+	struct stat	st;
+	bool		changed;
+
+	/*
+	 *	Editors often remove and recreate files,
+	 *	so a missing file may be about to reappear.
+	 */
+	if (stat(file->filename, &st) < 0) return false;
+
+	changed = (st.st_mtime != file->mtime) || (st.st_ino != file->ino) || (st.st_size != file->size);
+
+	file->mtime = st.st_mtime;
+	file->ino = st.st_ino;
+	file->size = st.st_size;
+
+	return changed;
+}
+
+/** Wait for all readers of the previous data to finish with it
+ *
+ */
+static void reload_synchronize(fr_reload_t *reload, uint64_t epoch)
+{
+	for (;;) {
+		fr_reload_reader_t	*reader = NULL;
+		bool			busy = false;
+
+		pthread_mutex_lock(&reload->mutex);
+		while ((reader = fr_dlist_next(&reload->readers, reader))) {
+			uint64_t seen = atomic_load(&reader->epoch);
+
+			if (seen && (seen < epoch)) {
+				busy = true;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&reload->mutex);
+
+		if (!busy) return;
+
+		/*
+		 *	Readers only hold the data for a single
+		 *	module call, so poll rather than making
+		 *	them signal us.
+		 */
+		usleep(100);
+	}
+}
+
+/** Load a new copy of the data, publish it, and free the old copy
+ *
+ */
+static void reload_run(fr_reload_t *reload)
+{
+	void		*data, *old;
+	uint64_t	epoch;
+	fr_time_t	start = fr_time();
+
+	INFO("%s - Reloading", reload->name);
+
+	data = reload->load(reload->uctx);
+	if (!data) {
+		PERROR("%s - Reload failed, continuing with the current data", reload->name);
+		pthread_mutex_lock(&reload->mutex);
+		reload->failures++;
+		pthread_mutex_unlock(&reload->mutex);
+		return;
+	}
+
+	old = atomic_exchange(&reload->data, data);
+	epoch = atomic_fetch_add(&reload->epoch, 1) + 1;
+
+	reload_synchronize(reload, epoch);
+	talloc_free(old);
+
+	pthread_mutex_lock(&reload->mutex);
+	reload->reloads++;
+	reload->last = fr_time();
+	pthread_mutex_unlock(&reload->mutex);
+
+	INFO("%s - Reloaded in %" PRId64 "ms", reload->name, fr_time_delta_to_msec(reload->last - start));
+}
+
+static void *reload_thread(void *arg)
+{
+	fr_reload_t	*reload = talloc_get_type_abort(arg, fr_reload_t);
+	sigset_t	sigset;
+
+	/*
+	 *	Signals are handled by the main thread only.
+	 */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+	pthread_mutex_lock(&reload->mutex);
+	for (;;) {
+		size_t	i, num_files;
+		bool	changed = false;
+
+		if (!reload->triggered && !reload->shutdown) {
+			if (reload->interval > 0) {
+				struct timespec	ts;
+				int64_t		nsec;
+
+				clock_gettime(CLOCK_REALTIME, &ts);
+				nsec = (int64_t)ts.tv_nsec + reload->interval;
+				ts.tv_sec += nsec / NSEC;
+				ts.tv_nsec = nsec % NSEC;
+
+				pthread_cond_timedwait(&reload->wake, &reload->mutex, &ts);
+			} else {
+				pthread_cond_wait(&reload->wake, &reload->mutex);
+			}
+		}
+		if (reload->shutdown) break;
+
+		/*
+		 *	Check all the files, so their state is
+		 *	current when we start the reload.
+		 */
+		num_files = talloc_array_length(reload->files);
+		for (i = 0; i < num_files; i++) {
+			if (reload_file_changed(&reload->files[i])) changed = true;
+		}
+
+		/*
+		 *	With nothing to watch, the data is
+		 *	reloaded every interval.
+		 */
+		if (!reload->triggered && !changed && (num_files || !reload->interval)) continue;
+
+		reload->triggered = false;
+		pthread_mutex_unlock(&reload->mutex);
+
+		reload_run(reload);
+
+		pthread_mutex_lock(&reload->mutex);
+	}
+	pthread_mutex_unlock(&reload->mutex);
+
+	return NULL;
+}
+
+static int cmd_reload(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	fr_reload_t *reload = talloc_get_type_abort(ctx, fr_reload_t);
+
+	fr_reload_trigger(reload);
+	fprintf(fp, "Reload of %s started\n", reload->name);
+
+	return 0;
+}
+
+static int cmd_show_reload(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	fr_reload_t *reload = talloc_get_type_abort(ctx, fr_reload_t);
+
+	pthread_mutex_lock(&reload->mutex);
+	fprintf(fp, "reloads\t%" PRIu64 "\n", reload->reloads);
+	fprintf(fp, "failures\t%" PRIu64 "\n", reload->failures);
+	if (reload->last) {
+		fprintf(fp, "last\t%" PRId64 "s ago\n", fr_time_delta_to_sec(fr_time() - reload->last));
+	}
+	pthread_mutex_unlock(&reload->mutex);
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_reload_table[] = {
+	{
+		.parent = "set module",
+		.add_name = true,
+		.name = "reload",
+		.func = cmd_reload,
+		.help = "Reload the module's files in the background.",
+		.read_only = false,
+	},
+
+	{
+		.parent = "show module",
+		.add_name = true,
+		.name = "reload",
+		.func = cmd_show_reload,
+		.help = "Show statistics for reloads of the module's files.",
+		.read_only = true,
+	},
+
+	CMD_TABLE_END
+};
+
+static int _reload_free(fr_reload_t *reload)
+{
+	if (reload->running) {
+		pthread_mutex_lock(&reload->mutex);
+		reload->shutdown = true;
+		pthread_cond_signal(&reload->wake);
+		pthread_mutex_unlock(&reload->mutex);
+
+		pthread_join(reload->thread, NULL);
+	}
+
+	fr_assert_msg(fr_dlist_empty(&reload->readers), "Reload freed with readers still registered");
+
+	talloc_free(atomic_load(&reload->data));
+
+	pthread_cond_destroy(&reload->wake);
+	pthread_mutex_destroy(&reload->mutex);
+
+	return 0;
+}
+
+/** Start reloading data in the background
+ *
+ * @param[in] ctx		to allocate the reload in.
+ * @param[in] name		of the module instance.  Used in log messages,
+ *				and radmin commands.
+ * @param[in] data		initial data, as returned by load.  Must be in the
+ *				NULL talloc ctx.  It's freed when it's replaced,
+ *				or when the reload is freed.
+ * @param[in] load		builds a new copy of the data.
+ * @param[in] uctx		passed to load.
+ * @param[in] files		to watch for changes.  NULL entries are ignored.
+ * @param[in] num_files		how many entries there are in files.
+ * @param[in] interval		how often to check the files for changes.  If there
+ *				are no files, how often to reload the data.
+ *				Zero to only reload when asked to via radmin.
+ * @return
+ *	- The reload.
+ *	- NULL on error.
+ */
+fr_reload_t *fr_reload_alloc(TALLOC_CTX *ctx, char const *name, void *data,
+			     fr_reload_load_t load, void *uctx,
+			     char const * const *files, size_t num_files, fr_time_delta_t interval)
+{
+	fr_reload_t	*reload;
+	size_t		i, used = 0;
+	int		ret;
+
+	MEM(reload = talloc_zero(ctx, fr_reload_t));
+	MEM(reload->name = talloc_strdup(reload, name));
+	reload->load = load;
+	reload->uctx = uctx;
+	reload->interval = interval;
+	atomic_init(&reload->data, data);
+	atomic_init(&reload->epoch, 1);
+
+	pthread_mutex_init(&reload->mutex, NULL);
+	pthread_cond_init(&reload->wake, NULL);
+	fr_dlist_talloc_init(&reload->readers, fr_reload_reader_t, entry);
+	talloc_set_destructor(reload, _reload_free);
+
+	MEM(reload->files = talloc_zero_array(reload, fr_reload_file_t, num_files));
+	for (i = 0; i < num_files; i++) {
+		if (!files || !files[i]) continue;
+
+		MEM(reload->files[used].filename = talloc_strdup(reload->files, files[i]));
+		(void) reload_file_changed(&reload->files[used]);
+		used++;
+	}
+	if (used == 0) {
+		TALLOC_FREE(reload->files);	/* talloc_realloc() would return NULL */
+	} else {
+		MEM(reload->files = talloc_realloc(reload, reload->files, fr_reload_file_t, used));
+	}
+
+	if (fr_command_register_hook(NULL, name, reload, cmd_reload_table) < 0) {
+		fr_strerror_printf_push("Failed registering radmin commands");
+	error:
+		/*
+		 *	The caller still owns the data.
+		 */
+		atomic_store(&reload->data, NULL);
+		talloc_free(reload);
+		return NULL;
+	}
+
+	ret = pthread_create(&reload->thread, NULL, reload_thread, reload);
+	if (ret != 0) {
+		fr_strerror_printf("Failed creating reload thread: %s", fr_syserror(ret));
+		goto error;
+	}
+	reload->running = true;
+
+	return reload;
+}
+
+/** Reload the data now, instead of waiting for the files to change
+ *
+ * The reload happens in the background.  If one is already in progress,
+ * another one is done after it completes.
+ */
+void fr_reload_trigger(fr_reload_t *reload)
+{
+	pthread_mutex_lock(&reload->mutex);
+	reload->triggered = true;
+	pthread_cond_signal(&reload->wake);
+	pthread_mutex_unlock(&reload->mutex);
+}
+
+static int _reload_reader_free(fr_reload_reader_t *reader)
+{
+	fr_reload_t *reload = reader->reload;
+
+	pthread_mutex_lock(&reload->mutex);
+	fr_dlist_remove(&reload->readers, reader);
+	pthread_mutex_unlock(&reload->mutex);
+
+	return 0;
+}
+
+/** Register a reader of the data
+ *
+ * Should be called in each worker's thread_instantiate, and stored in the
+ * module's thread instance data.
+ *
+ * @param[in] ctx	to allocate the reader in.
+ * @param[in] reload	to read the data of.
+ */
+fr_reload_reader_t *fr_reload_reader_alloc(TALLOC_CTX *ctx, fr_reload_t *reload)
+{
+	fr_reload_reader_t *reader;
+
+	MEM(reader = talloc_zero(ctx, fr_reload_reader_t));
+	reader->reload = reload;
+	atomic_init(&reader->epoch, 0);
+
+	pthread_mutex_lock(&reload->mutex);
+	fr_dlist_insert_tail(&reload->readers, reader);
+	pthread_mutex_unlock(&reload->mutex);
+	talloc_set_destructor(reader, _reload_reader_free);
+
+	return reader;
+}
+
+/** Start using the data
+ *
+ * The data remains valid until #fr_reload_exit is called.  Calls must
+ * not be nested, and the request must not yield in between.
+ *
+ * @param[in] reader	for this thread.
+ * @return the current data.
+ */
+void *fr_reload_enter(fr_reload_reader_t *reader)
+{
+	/*
+	 *	Sequentially consistent, so either the reload
+	 *	thread sees our epoch, or we see its new data.
+	 */
+	atomic_store(&reader->epoch, atomic_load(&reader->reload->epoch));
+
+	return atomic_load(&reader->reload->data);
+}
+
+/** Stop using the data
+ *
+ * @param[in] reader	for this thread.
+ */
+void fr_reload_exit(fr_reload_reader_t *reader)
+{
+	atomic_store(&reader->epoch, 0);
+}
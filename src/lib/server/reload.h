@@ -0,0 +1,66 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/reload.h
+ * @brief Reload module data in the background, and publish it to workers.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(reload_h, "$Id$")
+
+#include <freeradius-devel/util/talloc.h>
+#include <freeradius-devel/util/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_reload_s fr_reload_t;
+typedef struct fr_reload_reader_s fr_reload_reader_t;
+
+/** Load a new copy of the data
+ *
+ * Called in the reload thread.  Must not modify anything shared with
+ * the workers, and must allocate the data in the NULL talloc ctx.
+ *
+ * @param[in] uctx	passed to #fr_reload_alloc.
+ * @return
+ *	- The new data.
+ *	- NULL on error, with the error in fr_strerror.  The current
+ *	  data continues to be used.
+ */
+typedef void *(*fr_reload_load_t)(void *uctx);
+
+fr_reload_t		*fr_reload_alloc(TALLOC_CTX *ctx, char const *name, void *data,
+					 fr_reload_load_t load, void *uctx,
+					 char const * const *files, size_t num_files, fr_time_delta_t interval)
+			CC_HINT(nonnull(2,3,4));
+
+void			fr_reload_trigger(fr_reload_t *reload) CC_HINT(nonnull);
+
+fr_reload_reader_t	*fr_reload_reader_alloc(TALLOC_CTX *ctx, fr_reload_t *reload) CC_HINT(nonnull(2));
+
+void			*fr_reload_enter(fr_reload_reader_t *reader) CC_HINT(nonnull);
+
+void			fr_reload_exit(fr_reload_reader_t *reader) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
@@ -54,11 +54,40 @@ fr_dict_attr_autoload_t request_dict_attr[] = {
 	{ NULL }
 };
 
+/** The default maximum number of requests in the free list
+ *
+ */
+#define REQUEST_FREE_MAX	(256)
+
+/** The largest talloc pool we will allocate for a request
+ *
+ */
+#define REQUEST_POOL_SIZE_MAX	(1024 * 1024)
+
+/** Check the memory used by one in this many freed requests
+ *
+ * talloc_total_size() walks every chunk of the request, which is
+ * too expensive to do on every free.
+ */
+#define REQUEST_POOL_SAMPLE	(64)
+
+/** Free list, and talloc pool sizing for one thread
+ *
+ */
+struct request_pool_s {
+	fr_dlist_head_t		free_list;	//!< Requests which can be re-used.
+	uint32_t		max_free;	//!< Maximum number of requests in the free list.
+	uint32_t		num_freed;	//!< Requests freed since we last checked one's size.
+	request_pool_stats_t	stats;
+};
+
 /** The thread local free list
  *
  * Any entries remaining in the list will be freed when the thread is joined
  */
-static _Thread_local fr_dlist_head_t *request_free_list; /* macro */
+static _Thread_local request_pool_t *request_pool; /* macro */
+
+static request_pool_t *request_pool_alloc(void);
 
 #ifndef NDEBUG
 static int _state_ctx_free(fr_pair_t *state)
@@ -133,6 +162,7 @@ static inline CC_HINT(always_inline) int request_child_init(request_t *child, re
 	}
 	child->seq_start = 0;	/* children always start with their own sequence */
 	child->parent = parent;
+	child->deadline = parent->deadline;
 
 	/*
 	 *	For new server support.
@@ -163,10 +193,12 @@ static inline CC_HINT(always_inline) int request_child_init(request_t *child, re
  * @param[in] request		to (re)-initialise.
  * @param[in] type		of request to initialise.
  * @param[in] args		Other optional arguments.
+ * @param[in] arena_size	Size of the arena for external requests.
+ *				0 to allocate everything directly in the request.
  */
 static inline CC_HINT(always_inline) int request_init(char const *file, int line,
 						      request_t *request, request_type_t type,
-						      request_init_args_t const *args)
+						      request_init_args_t const *args, size_t arena_size)
 {
 
 	/*
@@ -218,13 +250,29 @@ static inline CC_HINT(always_inline) int request_init(char const *file, int line
 	{
 		fr_pair_t *vp = NULL, *pair_root;
 
+		/*
+		 *	Pairs in the request lists are
+		 *	freed when the request is, so
+		 *	external requests can allocate
+		 *	them from a single talloc pool.
+		 *
+		 *	Child requests don't get arenas,
+		 *	as their pairs are frequently
+		 *	moved into the parent, which
+		 *	would keep the whole child arena
+		 *	allocated.
+		 */
+		if (arena_size && (type == REQUEST_TYPE_EXTERNAL)) {
+			MEM(request->arena = talloc_pool(request, arena_size));
+		}
+
 		/*
 		 *	Alloc the pair root this is a
 		 *	special pair which does not
 		 *	free its children when it is
 		 *	freed.
 		 */
-		pair_root = fr_pair_root_afrom_da(request, request_attr_root);
+		pair_root = fr_pair_root_afrom_da(request->arena ? request->arena : request, request_attr_root);
 		if (unlikely(!pair_root)) return -1;
 		request->pair_root = pair_root;
 
@@ -248,9 +296,20 @@ static inline CC_HINT(always_inline) int request_init(char const *file, int line
 		request->pair_list._list = vp; \
 	} while(0)
 
-		if (!request->pair_list.request) list_init(request->pair_root, request);
-		if (!request->pair_list.reply) list_init(request->pair_root, reply);
-		if (!request->pair_list.control) list_init(request->pair_root, control);
+	/*
+	 *	The request, reply and control lists
+	 *	are searched often enough to be worth
+	 *	indexing.
+	 */
+#define list_init_indexed(_ctx, _list) \
+	do { \
+		list_init(_ctx, _list); \
+		(void)fr_pair_list_index_enable(vp, &vp->vp_group); \
+	} while (0)
+
+		if (!request->pair_list.request) list_init_indexed(request->pair_root, request);
+		if (!request->pair_list.reply) list_init_indexed(request->pair_root, reply);
+		if (!request->pair_list.control) list_init_indexed(request->pair_root, control);
 		if (!request->pair_list.state) {
 			list_init(NULL, state);
 #ifndef NDEBUG
@@ -288,6 +347,9 @@ static inline CC_HINT(always_inline) int request_init(char const *file, int line
  */
 static int _request_free(request_t *request)
 {
+	request_pool_t	*pool;
+	size_t		size;
+
 	fr_assert_msg(!fr_heap_entry_inserted(request->time_order_id),
 		      "alloced %s:%i: %s still in the time_order heap ID %i",
 		      request->alloc_file,
@@ -312,18 +374,40 @@ static int _request_free(request_t *request)
 		goto really_free;
 	}
 
+	pool = request_pool;
+	if (unlikely(!pool)) pool = request_pool_alloc();
+
+	if (pool->stats.active > 0) pool->stats.active--;
+
 	/*
-	 *	We keep a buffer of <active> + N requests per
-	 *	thread, to avoid spurious allocations.
+	 *	The request used more memory than its talloc pool,
+	 *	so the rest was allocated from the heap.  Make the
+	 *	pools for new requests larger.
+	 *
+	 *	The arena and its contents are sized separately.
 	 */
-	if (fr_dlist_num_elements(request_free_list) <= 256) {
-		fr_dlist_head_t		*free_list;
+	if (++pool->num_freed >= REQUEST_POOL_SAMPLE) {
+		pool->num_freed = 0;
+
+		size = talloc_total_size(request);
+		if (request->arena) size -= talloc_total_size(request->arena);
+		if (size > pool->stats.pool_size) {
+			pool->stats.overflows++;
+			if (size <= REQUEST_POOL_SIZE_MAX) pool->stats.pool_size = size;
+		}
+	}
 
+	/*
+	 *	We keep a buffer of requests per thread, to avoid
+	 *	spurious allocations.  The buffer is large enough to
+	 *	hold the peak number of requests which were in use at
+	 *	the same time.
+	 */
+	if (fr_dlist_num_elements(&pool->free_list) < pool->max_free) {
 		if (request->session_state_ctx) {
 			fr_assert(talloc_parent(request->session_state_ctx) != request);	/* Should never be directly parented */
 			TALLOC_FREE(request->session_state_ctx);				/* Not parented from the request */
 		}
-		free_list = request_free_list;
 
 		/*
 		 *	Reinitialise the request
@@ -345,8 +429,7 @@ static int _request_free(request_t *request)
 		/*
 		 *	Reinsert into the free list
 		 */
-		fr_dlist_insert_head(free_list, request);
-		request_free_list = free_list;
+		fr_dlist_insert_head(&pool->free_list, request);
 
 		return -1;	/* Prevent free */
  	}
@@ -376,17 +459,82 @@ really_free:
  */
 static void _request_free_list_free_on_exit(void *arg)
 {
-	fr_dlist_head_t *list = talloc_get_type_abort(arg, fr_dlist_head_t);
-	request_t		*request;
+	request_pool_t	*pool = talloc_get_type_abort(arg, request_pool_t);
+	request_t	*request;
 
 	/*
 	 *	See the destructor for why this works
 	 */
-	while ((request = fr_dlist_head(list))) talloc_free(request);
-	talloc_free(list);
+	while ((request = fr_dlist_head(&pool->free_list))) talloc_free(request);
+	talloc_free(pool);
 }
 
-static inline CC_HINT(always_inline) request_t *request_alloc_pool(TALLOC_CTX *ctx)
+/** The size of the talloc pool we allocate for each request, by default
+ *
+ */
+#define REQUEST_POOL_SIZE	((UNLANG_FRAME_PRE_ALLOC * UNLANG_STACK_MAX) +	/* Stack memory */ \
+				 (sizeof(fr_pair_t) * 5) +			/* pair lists and root*/ \
+				 (sizeof(fr_radius_packet_t) * 2) +		/* packets */ \
+				 128)						/* extra */
+
+/** Allocate the request pool for this thread
+ *
+ */
+static request_pool_t *request_pool_alloc(void)
+{
+	request_pool_t *pool;
+
+	MEM(pool = talloc_zero(NULL, request_pool_t));
+	fr_dlist_init(&pool->free_list, request_t, free_entry);
+	pool->max_free = REQUEST_FREE_MAX;
+	pool->stats.pool_size = sizeof(request_t) + REQUEST_POOL_SIZE;
+
+	fr_atexit_thread_local(request_pool, _request_free_list_free_on_exit, pool);
+
+	return pool;
+}
+
+/** Size the free list and talloc pools for requests allocated by this thread
+ *
+ * This function should be called by each worker thread, before it
+ * allocates any requests.
+ *
+ * @param[in] max_free	Maximum number of requests to keep in the free list.
+ *			The free list only grows as large as the peak number
+ *			of requests which are in use at the same time.
+ * @param[in] pool_size	Minimum size of the talloc pool for each request.  The
+ *			pools grow if requests use more memory than this.
+ * @param[in] arena_size	Size of the arena (see #request_arena) for each
+ *			external request.  0 disables arenas.
+ * @return the request pool for this thread, which can be passed to #request_pool_stats.
+ */
+request_pool_t *request_pool_thread_init(uint32_t max_free, size_t pool_size, size_t arena_size)
+{
+	request_pool_t *pool = request_pool;
+
+	if (!pool) pool = request_pool_alloc();
+
+	if (max_free) pool->max_free = max_free;
+	if (pool_size > REQUEST_POOL_SIZE_MAX) pool_size = REQUEST_POOL_SIZE_MAX;
+	if (pool_size > pool->stats.pool_size) pool->stats.pool_size = pool_size;
+	if (arena_size > REQUEST_POOL_SIZE_MAX) arena_size = REQUEST_POOL_SIZE_MAX;
+	pool->stats.arena_size = arena_size;
+
+	return pool;
+}
+
+/** Return statistics for the request pool of a thread
+ *
+ * @param[in] pool	returned by #request_pool_thread_init.
+ * @param[out] stats	the statistics.
+ */
+void request_pool_stats(request_pool_t const *pool, request_pool_stats_t *stats)
+{
+	*stats = pool->stats;
+	stats->free = fr_dlist_num_elements(&pool->free_list);
+}
+
+static inline CC_HINT(always_inline) request_t *request_alloc_pool(TALLOC_CTX *ctx, size_t pool_size)
 {
 	request_t *request;
 
@@ -399,16 +547,14 @@ static inline CC_HINT(always_inline) request_t *request_alloc_pool(TALLOC_CTX *c
 	 *	cannot be returned to a free list
 	 *	and would have to be freed.
 	 */
+	if (pool_size < (sizeof(request_t) + REQUEST_POOL_SIZE)) pool_size = sizeof(request_t) + REQUEST_POOL_SIZE;
+
 	MEM(request = talloc_pooled_object(ctx, request_t,
 					   1 + 					/* Stack pool */
 					   UNLANG_STACK_MAX + 			/* Stack Frames */
 					   2 + 					/* packets */
 					   10,					/* extra */
-					   (UNLANG_FRAME_PRE_ALLOC * UNLANG_STACK_MAX) +	/* Stack memory */
-					   (sizeof(fr_pair_t) * 5) +		/* pair lists and root*/
-					   (sizeof(fr_radius_packet_t) * 2) +	/* packets */
-					   128					/* extra */
-					   ));
+					   pool_size - sizeof(request_t)));
 	fr_assert(ctx != request);
 
 	return request;
@@ -429,7 +575,7 @@ request_t *_request_alloc(char const *file, int line, TALLOC_CTX *ctx,
 			  request_type_t type, request_init_args_t const *args)
 {
 	request_t		*request;
-	fr_dlist_head_t		*free_list;
+	request_pool_t		*pool;
 
 	if (!args) args = &default_args;
 
@@ -437,31 +583,35 @@ request_t *_request_alloc(char const *file, int line, TALLOC_CTX *ctx,
 	 *	Setup the free list, or return the free
 	 *	list for this thread.
 	 */
-	if (unlikely(!request_free_list)) {
-		MEM(free_list = talloc(NULL, fr_dlist_head_t));
-		fr_dlist_init(free_list, request_t, free_entry);
-		fr_atexit_thread_local(request_free_list, _request_free_list_free_on_exit, free_list);
-	} else {
-		free_list = request_free_list;
-	}
+	pool = request_pool;
+	if (unlikely(!pool)) pool = request_pool_alloc();
 
-	request = fr_dlist_head(free_list);
+	request = fr_dlist_head(&pool->free_list);
 	if (!request) {
 		/*
 		 *	Must be allocated with in the NULL ctx
 		 *	as chunk is returned to the free list.
 		 */
-		request = request_alloc_pool(NULL);
+		request = request_alloc_pool(NULL, pool->stats.pool_size);
 		talloc_set_destructor(request, _request_free);
+		pool->stats.misses++;
 	} else {
 		/*
 		 *	Remove from the free list, as we're
 		 *	about to use it!
 		 */
-		fr_dlist_remove(free_list, request);
+		fr_dlist_remove(&pool->free_list, request);
+		pool->stats.hits++;
 	}
 
-	if (request_init(file, line, request, type, args) < 0) {
+	/*
+	 *	The destructor decrements this, even if
+	 *	request_init() fails.
+	 */
+	pool->stats.active++;
+	if (pool->stats.active > pool->stats.peak) pool->stats.peak = pool->stats.active;
+
+	if (request_init(file, line, request, type, args, pool->stats.arena_size) < 0) {
 		talloc_free(request);
 		return NULL;
 	}
@@ -534,8 +684,8 @@ request_t *_request_local_alloc(char const *file, int line, TALLOC_CTX *ctx,
 
 	if (!args) args = &default_args;
 
-	request = request_alloc_pool(ctx);
-	if (request_init(file, line, request, type, args) < 0) return NULL;
+	request = request_alloc_pool(ctx, 0);
+	if (request_init(file, line, request, type, args, 0) < 0) return NULL;
 
 	talloc_set_destructor(request, _request_local_free);
 
@@ -572,6 +722,11 @@ int request_detach(request_t *child)
 
 	child->parent = NULL;
 
+	/*
+	 *	Nothing is waiting for the result any more.
+	 */
+	child->deadline = 0;
+
 	/*
 	 *	Request is now detached
 	 */
@@ -174,6 +174,9 @@ struct request_s {
 	fr_pair_t		*pair_root;	//!< Root atribute which contains the
 						///< other list attributes as children.
 
+	TALLOC_CTX		*arena;		//!< talloc pool holding the pair lists and other
+						///< request-scoped allocations.  NULL if disabled.
+
 	/** Pair lists associated with the request
 	 *
 	 * @warn DO NOT allocate pairs directly beneath the root
@@ -228,6 +231,14 @@ struct request_s {
 
 	fr_async_t		*async;		//!< for new async listeners
 
+	fr_time_t		deadline;	//!< After which the client will have given up on the request.
+						///< 0 if there is no deadline.  Children inherit their parent's.
+
+	size_t			memory_hwm;	//!< Most talloc memory seen in use by this request, and the
+						///< children allocated in its context.  Only updated when a
+						///< request memory budget is set.
+	bool			memory_warned;	//!< Whether the soft memory budget has been exceeded.
+
 	char const		*alloc_file;	//!< File the request was allocated in.
 
 	int			alloc_line;	//!< Line the request was allocated on.
@@ -316,6 +327,87 @@ request_t	*_request_local_alloc(char const *file, int line, TALLOC_CTX *ctx,
 
 int		request_detach(request_t *child);
 
+/** Return a ctx for temporary allocations which never outlive the request
+ *
+ * Memory in the arena is handed out sequentially, and is only
+ * released when the request is freed.  Freeing an allocation made
+ * in the arena does not make its memory available for re-use, so
+ * this should only be used for small, short lived, temporaries.
+ *
+ * When the arena is full, talloc falls back to allocating from
+ * the heap.
+ *
+ * @param[in] request	to return the arena for.
+ * @return
+ *	- The arena of the request.
+ *	- NULL if the request has no arena.  Temporaries allocated
+ *	  in the NULL ctx must be freed explicitly, which callers
+ *	  must do anyway.
+ */
+static inline CC_HINT(always_inline) TALLOC_CTX *request_arena(request_t const *request)
+{
+	return request->arena;
+}
+
+/** Whether the client has given up on the request
+ *
+ * @param[in] request	to check.
+ * @return
+ *	- true if the request's deadline has passed.
+ *	- false if it hasn't, or the request has no deadline.
+ */
+static inline CC_HINT(always_inline) bool request_expired(request_t const *request)
+{
+	return request->deadline && (fr_time() > request->deadline);
+}
+
+/** Limit a backend timeout to what remains of the request's deadline
+ *
+ * There is no point waiting for a database, directory or home server
+ * after the client has given up, so backends pass their configured
+ * timeout through this before starting an operation.
+ *
+ * @param[in] request	the operation is being performed for.  May be NULL.
+ * @param[in] timeout	configured for the backend.  0 means no timeout.
+ * @return
+ *	- timeout if the request has no deadline, or the deadline is further away.
+ *	- The time remaining until the deadline, but at least 1ms, so that the
+ *	  result is never mistaken for "no timeout".
+ */
+static inline fr_time_delta_t request_deadline_limit(request_t const *request, fr_time_delta_t timeout)
+{
+	fr_time_delta_t remaining;
+
+	if (!request || !request->deadline) return timeout;
+
+	remaining = request->deadline - fr_time();
+	if (remaining < fr_time_delta_from_msec(1)) remaining = fr_time_delta_from_msec(1);
+
+	if (timeout && (timeout < remaining)) return timeout;
+
+	return remaining;
+}
+
+/** Statistics for the request pool of one thread
+ *
+ */
+typedef struct {
+	uint64_t		hits;		//!< Requests taken from the free list.
+	uint64_t		misses;		//!< Requests which had to be allocated.
+	uint64_t		overflows;	//!< Sampled requests which used more memory than their talloc pool.
+	uint32_t		active;		//!< Requests currently in use.
+	uint32_t		peak;		//!< Maximum number of requests in use at once.
+	uint32_t		free;		//!< Requests in the free list.
+	size_t			pool_size;	//!< Size of the talloc pool for new requests.
+	size_t			arena_size;	//!< Size of the arena for new external requests.
+} request_pool_stats_t;
+
+typedef struct request_pool_s request_pool_t;
+
+request_pool_t	*request_pool_thread_init(uint32_t max_free, size_t pool_size, size_t arena_size);
+
+void		request_pool_stats(request_pool_t const *pool, request_pool_stats_t *stats) CC_HINT(nonnull);
+
 int		request_global_init(void);
 void		request_global_free(void);
 
@@ -0,0 +1,242 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Coalesce identical concurrent backend calls.
+ * @file src/lib/server/singleflight.c
+ *
+ * When multiple requests on the same thread need the result of an identical
+ * backend call (the same fully expanded query), only the first request (the
+ * leader) performs it.  Requests arriving while the call is in flight (the
+ * followers) yield, and are marked runnable when the leader completes the
+ * call.  Each follower then copies the result.
+ *
+ * Once a call completes it's removed from the lookup tree, so requests
+ * arriving afterwards start a new call.  Results are never cached.
+ *
+ * All functions must be called from the thread which owns the
+ * #fr_singleflight_t.  Usually it's stored in a module's thread instance
+ * data.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/singleflight.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/rb.h>
+
+/** Calls currently in flight
+ *
+ */
+struct fr_singleflight_s {
+	fr_rb_tree_t		*calls;		//!< In-flight calls, keyed on the expanded query.
+};
+
+/** A request waiting on the result of an in-flight call
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< Entry in the call's list of followers.
+	request_t		*request;	//!< Request to mark runnable when the call completes.
+} fr_singleflight_follower_t;
+
+/** A single backend call, shared by one or more requests
+ *
+ */
+struct fr_singleflight_call_s {
+	fr_rb_node_t		node;		//!< Entry in the tree of in-flight calls.
+	fr_singleflight_t	*sf;		//!< The table this call belongs to.
+	char const		*key;		//!< The expanded query.
+	request_t		*leader;	//!< Request performing the call.
+	fr_dlist_head_t		followers;	//!< Requests waiting on the result.
+	unsigned int		refs;		//!< Number of requests which haven't left the call.
+
+	bool			complete;	//!< The leader has provided a result.
+	int			rcode;		//!< Result code provided by the leader.
+	void			*result;	//!< Result provided by the leader.
+};
+
+static int8_t _singleflight_cmp(void const *one, void const *two)
+{
+	fr_singleflight_call_t const	*a = one, *b = two;
+
+	return CMP(strcmp(a->key, b->key), 0);
+}
+
+/** Allocate a table of in-flight calls
+ *
+ * @param[in] ctx	to allocate the table in.  Usually a module's thread instance.
+ * @return
+ *	- A new table.
+ *	- NULL on error.
+ */
+fr_singleflight_t *fr_singleflight_alloc(TALLOC_CTX *ctx)
+{
+	fr_singleflight_t *sf;
+
+	sf = talloc_zero(ctx, fr_singleflight_t);
+	if (unlikely(!sf)) return NULL;
+
+	sf->calls = fr_rb_inline_talloc_alloc(sf, fr_singleflight_call_t, node, _singleflight_cmp, NULL);
+	if (unlikely(!sf->calls)) {
+		talloc_free(sf);
+		return NULL;
+	}
+
+	return sf;
+}
+
+/** Join an in-flight call, or start a new one
+ *
+ * If leader is true, the caller must perform the backend call, then call
+ * #fr_singleflight_complete followed by #fr_singleflight_leave.
+ *
+ * If leader is false, the caller must yield.  The request will be marked
+ * runnable when the leader completes the call.  It must then retrieve the
+ * result with #fr_singleflight_result, and call #fr_singleflight_leave.
+ * If the request is cancelled before then, it must still call
+ * #fr_singleflight_leave.
+ *
+ * @param[out] leader	Whether the caller is responsible for performing the call.
+ * @param[in] sf	table of in-flight calls.
+ * @param[in] request	joining the call.
+ * @param[in] key	Fully expanded query.  Will be copied.
+ * @return
+ *	- The call.
+ *	- NULL on error.
+ */
+fr_singleflight_call_t *fr_singleflight_join(bool *leader, fr_singleflight_t *sf,
+					     request_t *request, char const *key)
+{
+	fr_singleflight_call_t		*call;
+	fr_singleflight_follower_t	*follower;
+
+	call = fr_rb_find(sf->calls, &(fr_singleflight_call_t){ .key = key });
+	if (call) {
+		follower = talloc_zero(call, fr_singleflight_follower_t);
+		if (unlikely(!follower)) return NULL;
+
+		follower->request = request;
+		fr_dlist_insert_tail(&call->followers, follower);
+		call->refs++;
+
+		RDEBUG2("Waiting on identical call already in progress");
+		*leader = false;
+
+		return call;
+	}
+
+	call = talloc_zero(sf, fr_singleflight_call_t);
+	if (unlikely(!call)) return NULL;
+
+	call->sf = sf;
+	call->key = talloc_strdup(call, key);
+	if (unlikely(!call->key)) {
+		talloc_free(call);
+		return NULL;
+	}
+	call->leader = request;
+	call->refs = 1;
+	fr_dlist_talloc_init(&call->followers, fr_singleflight_follower_t, entry);
+
+	if (unlikely(!fr_rb_insert(sf->calls, call))) {
+		talloc_free(call);
+		return NULL;
+	}
+
+	*leader = true;
+
+	return call;
+}
+
+/** Provide the result of a call, and wake up all followers
+ *
+ * New requests will no longer join this call.
+ *
+ * @param[in] call	to complete.
+ * @param[in] rcode	Result code.  Caller defined, returned by #fr_singleflight_result.
+ * @param[in] result	talloced result.  Ownership is transferred to the call,
+ *			and it's freed once all requests have left the call.  May be NULL.
+ */
+void fr_singleflight_complete(fr_singleflight_call_t *call, int rcode, void *result)
+{
+	if (!fr_cond_assert(!call->complete)) return;
+
+	fr_rb_delete(call->sf->calls, call);
+
+	call->complete = true;
+	call->rcode = rcode;
+	call->result = talloc_steal(call, result);
+
+	fr_dlist_foreach(&call->followers, fr_singleflight_follower_t, follower) {
+		unlang_interpret_mark_runnable(follower->request);
+	}
+}
+
+/** Retrieve the result of a completed call
+ *
+ * @param[out] result	provided by the leader.  Must be copied before the
+ *			caller leaves the call.
+ * @param[in] call	to retrieve the result of.
+ * @return The rcode provided by the leader.
+ */
+int fr_singleflight_result(void const **result, fr_singleflight_call_t const *call)
+{
+	fr_assert(call->complete);
+
+	*result = call->result;
+
+	return call->rcode;
+}
+
+/** Leave a call
+ *
+ * If the leader leaves before completing the call, it's completed with
+ * an rcode of -1 and no result.
+ *
+ * The call is freed once all requests have left.
+ *
+ * @param[in] call	to leave.
+ * @param[in] request	leaving the call.
+ */
+void fr_singleflight_leave(fr_singleflight_call_t *call, request_t *request)
+{
+	if (request == call->leader) {
+		if (!call->complete) fr_singleflight_complete(call, -1, NULL);
+		call->leader = NULL;
+	} else {
+		fr_dlist_foreach(&call->followers, fr_singleflight_follower_t, follower) {
+			if (follower->request != request) continue;
+
+			fr_dlist_talloc_free_item(&call->followers, follower);
+			break;
+		}
+	}
+
+	fr_assert(call->refs > 0);
+	if (--call->refs > 0) return;
+
+	/*
+	 *	Only the leader can complete the call,
+	 *	and it must have left.
+	 */
+	fr_assert(call->complete);
+	talloc_free(call);
+}
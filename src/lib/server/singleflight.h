@@ -0,0 +1,50 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/singleflight.h
+ * @brief Coalesce identical concurrent backend calls.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(singleflight_h, "$Id$")
+
+#include <freeradius-devel/server/request.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fr_singleflight_s fr_singleflight_t;
+typedef struct fr_singleflight_call_s fr_singleflight_call_t;
+
+fr_singleflight_t	*fr_singleflight_alloc(TALLOC_CTX *ctx);
+
+fr_singleflight_call_t	*fr_singleflight_join(bool *leader, fr_singleflight_t *sf,
+					      request_t *request, char const *key);
+
+void			fr_singleflight_complete(fr_singleflight_call_t *call, int rcode, void *result);
+
+int			fr_singleflight_result(void const **result, fr_singleflight_call_t const *call);
+
+void			fr_singleflight_leave(fr_singleflight_call_t *call, request_t *request);
+
+#ifdef __cplusplus
+}
+#endif
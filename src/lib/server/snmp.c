@@ -980,6 +980,7 @@ int fr_snmp_process(request_t *request)
 		}
 		vp->da = da;
 	}
+	fr_pair_list_index_invalidate(&request->request_pairs);
 
 	for (vp = fr_dcursor_iter_by_ancestor_init(&request_cursor, &request->request_pairs, attr_snmp_root);
 	     vp;
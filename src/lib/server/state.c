@@ -50,11 +50,54 @@ RCSID("$Id$")
 #include <freeradius-devel/server/request.h>
 #include <freeradius-devel/server/state.h>
 
+#include <freeradius-devel/internal/internal.h>
+
+#include <freeradius-devel/util/dbuff.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/md5.h>
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+/** Number of shards used by thread safe state trees
+ *
+ * Must be a power of 2.
+ */
+#define STATE_SHARDS		32
+
+/*
+ *	Header for state tree snapshots
+ *
+ *	0                   1                   2                   3
+ *	0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|      'F'      |      'R'      |      'S'      |    version    |
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|                          context_id                           |
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *
+ *	Followed by zero or more entries of:
+ *
+ *	state (16 bytes) || tries (1 byte) || ttl in nanoseconds (8 bytes) ||
+ *	length (4 bytes) || session-state in the internal format (length bytes)
+ */
+#define STATE_SNAPSHOT_MAGIC		"FRS"
+#define STATE_SNAPSHOT_MAGIC_LEN	3
+#define STATE_SNAPSHOT_VERSION		1
+
+typedef struct fr_state_shard_s fr_state_shard_t;
 
 /** Holds a state value, and associated fr_pair_ts and data
  *
@@ -62,6 +105,7 @@ RCSID("$Id$")
 typedef struct {
 	uint64_t		id;				//!< State number within state heap.
 	fr_rb_node_t		node;				//!< Entry in the state rbtree.
+	fr_state_shard_t	*shard;				//!< Shard the entry was inserted into.
 	union {
 		/** Server ID components
 		 *
@@ -131,30 +175,62 @@ typedef struct {
 	request_t		*thawed;			//!< The request that thawed this entry.
 } state_child_entry_t;
 
-struct fr_state_tree_s {
-	uint64_t		id;				//!< Next ID to assign.
-	uint64_t		timed_out;			//!< Number of states that were cleaned up due to
-								//!< timeout.
-	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
+/** One shard of the state tree
+ *
+ * Entries are assigned to shards by a hash of their state value, so
+ * that requests for different sessions rarely contend for the same
+ * mutex.
+ */
+struct fr_state_shard_s {
+	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
 	fr_rb_tree_t		*tree;				//!< rbtree used to lookup state value.
 	fr_dlist_head_t		to_expire;			//!< Linked list of entries to free.
 
+	fr_state_shard_stats_t	stats;				//!< Counters for this shard.
+};
+
+struct fr_state_tree_s {
+	atomic_uint_fast64_t	id;				//!< Next ID to assign.
+	atomic_uint_fast32_t	tracked;			//!< Number of entries in all the shards.
+	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
+
+	fr_state_shard_t	*shards;			//!< Array of shards.
+	uint32_t		num_shards;			//!< Number of shards.  Always a power of 2.
+
 	fr_time_delta_t		timeout;			//!< How long to wait before cleaning up state entires.
 
-	bool			thread_safe;			//!< Whether we lock the tree whilst modifying it.
-	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+	bool			thread_safe;			//!< Whether we lock the shards whilst modifying them.
 
 	uint8_t			server_id;			//!< ID to use for load balancing.
 	uint32_t		context_id;			//!< ID binding state values to a context such
 								///< as a virtual server.
 
 	fr_dict_attr_t const	*da;				//!< State attribute used.
-};
 
-#define PTHREAD_MUTEX_LOCK if (state->thread_safe) pthread_mutex_lock
-#define PTHREAD_MUTEX_UNLOCK if (state->thread_safe) pthread_mutex_unlock
+	fr_state_publish_t	publish;			//!< Called with each new entry.
+	void			*publish_uctx;			//!< Passed to publish.
+};
 
 static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry);
+static ssize_t state_entry_encode(fr_dbuff_t *dbuff, fr_state_entry_t const *entry, fr_time_t now);
+
+/** Lock a shard, recording whether another thread held it
+ *
+ */
+static inline CC_HINT(always_inline) void state_shard_lock(fr_state_tree_t *state, fr_state_shard_t *shard)
+{
+	if (!state->thread_safe) return;
+
+	if (pthread_mutex_trylock(&shard->mutex) == 0) return;
+
+	pthread_mutex_lock(&shard->mutex);
+	shard->stats.contended++;
+}
+
+static inline CC_HINT(always_inline) void state_shard_unlock(fr_state_tree_t *state, fr_state_shard_t *shard)
+{
+	if (state->thread_safe) pthread_mutex_unlock(&shard->mutex);
+}
 
 /** Compare two fr_state_entry_t based on their state value i.e. the value of the attribute
  *
@@ -173,27 +249,39 @@ static int8_t state_entry_cmp(void const *one, void const *two)
  */
 static int _state_tree_free(fr_state_tree_t *state)
 {
-	fr_state_entry_t *entry;
-
-	if (state->thread_safe) pthread_mutex_destroy(&state->mutex);
+	fr_state_entry_t	*entry;
+	uint32_t		i;
 
 	DEBUG4("Freeing state tree %p", state);
 
-	while ((entry = fr_dlist_head(&state->to_expire))) {
-		DEBUG4("Freeing state entry %p (%"PRIu64")", entry, entry->id);
-		state_entry_unlink(state, entry);
-		talloc_free(entry);
-	}
+	if (!state->shards) return 0;
 
-	/*
-	 *	Free the rbtree
-	 */
-	talloc_free(state->tree);
+	for (i = 0; i < state->num_shards; i++) {
+		fr_state_shard_t *shard = &state->shards[i];
+
+		if (!shard->tree) break;	/* Partially initialised */
+
+		while ((entry = fr_dlist_head(&shard->to_expire))) {
+			DEBUG4("Freeing state entry %p (%"PRIu64")", entry, entry->id);
+			state_entry_unlink(state, entry);
+			talloc_free(entry);
+		}
+
+		/*
+		 *	Free the rbtree
+		 */
+		talloc_free(shard->tree);
+
+		if (state->thread_safe) pthread_mutex_destroy(&shard->mutex);
+	}
 
 	return 0;
 }
 
 /** Initialise a new state tree
+ *
+ * Thread safe trees are split into #STATE_SHARDS shards, each with its
+ * own mutex, rbtree and expiry list.
  *
  * @param[in] ctx		to link the lifecycle of the state tree to.
  * @param[in] da		Attribute used to store and retrieve state from.
@@ -212,12 +300,15 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, b
 				    uint8_t server_id, uint32_t context_id)
 {
 	fr_state_tree_t *state;
+	uint32_t	i;
 
 	state = talloc_zero(NULL, fr_state_tree_t);
 	if (!state) return 0;
 
 	state->max_sessions = max_sessions;
 	state->timeout = timeout;
+	atomic_init(&state->id, 0);
+	atomic_init(&state->tracked, 0);
 
 	/*
 	 *	Create a break in the contexts.
@@ -228,30 +319,42 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, b
 	 */
 	talloc_link_ctx(ctx, state);
 
-	if (thread_safe && (pthread_mutex_init(&state->mutex, NULL) != 0)) {
+	state->thread_safe = thread_safe;
+	state->num_shards = thread_safe ? STATE_SHARDS : 1;
+	state->shards = talloc_zero_array(state, fr_state_shard_t, state->num_shards);
+	if (!state->shards) {
 		talloc_free(state);
 		return NULL;
 	}
+	talloc_set_destructor(state, _state_tree_free);
 
-	fr_dlist_talloc_init(&state->to_expire, fr_state_entry_t, list);
+	for (i = 0; i < state->num_shards; i++) {
+		fr_state_shard_t *shard = &state->shards[i];
 
-	/*
-	 *	We need to do controlled freeing of the
-	 *	rbtree, so that all the state entries
-	 *	are freed before it's destroyed.  Hence
-	 *	it being parented from the NULL ctx.
-	 */
-	state->tree = fr_rb_inline_talloc_alloc(NULL, fr_state_entry_t, node, state_entry_cmp, NULL);
-	if (!state->tree) {
-		talloc_free(state);
-		return NULL;
+		if (thread_safe && (pthread_mutex_init(&shard->mutex, NULL) != 0)) {
+			talloc_free(state);
+			return NULL;
+		}
+
+		fr_dlist_talloc_init(&shard->to_expire, fr_state_entry_t, list);
+
+		/*
+		 *	We need to do controlled freeing of the
+		 *	rbtree, so that all the state entries
+		 *	are freed before it's destroyed.  Hence
+		 *	it being parented from the NULL ctx.
+		 */
+		shard->tree = fr_rb_inline_talloc_alloc(NULL, fr_state_entry_t, node, state_entry_cmp, NULL);
+		if (!shard->tree) {
+			if (thread_safe) pthread_mutex_destroy(&shard->mutex);
+			talloc_free(state);
+			return NULL;
+		}
 	}
-	talloc_set_destructor(state, _state_tree_free);
 
 	state->da = da;		/* Remember which attribute we use to load/store state */
 	state->server_id = server_id;
 	state->context_id = context_id;
-	state->thread_safe = thread_safe;
 
 	return state;
 }
@@ -266,13 +369,23 @@ static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
 	 */
 	(void) talloc_get_type_abort(entry, fr_state_entry_t);
 
-	fr_dlist_remove(&state->to_expire, entry);
+	fr_dlist_remove(&entry->shard->to_expire, entry);
 
-	fr_rb_delete(state->tree, entry);
+	fr_rb_delete(entry->shard->tree, entry);
+	atomic_fetch_sub_explicit(&state->tracked, 1, memory_order_relaxed);
 
 	DEBUG4("State ID %" PRIu64 " unlinked", entry->id);
 }
 
+/** Return the shard which holds a state value
+ *
+ */
+static inline CC_HINT(always_inline) fr_state_shard_t *state_shard(fr_state_tree_t *state,
+								   fr_state_entry_t const *entry)
+{
+	return &state->shards[fr_hash(entry->state, sizeof(entry->state)) & (state->num_shards - 1)];
+}
+
 /** Frees any data associated with a state
  *
  */
@@ -311,44 +424,34 @@ static int _state_entry_free(fr_state_entry_t *entry)
 	return 0;
 }
 
-/** Create a new state entry
+/** Unlink expired entries from a shard
  *
- * @note Called with the mutex held.
+ * @note Called with the shard mutex held.
+ *
+ * @param[in] state	tree the shard belongs to.
+ * @param[in] shard	to clean up.
+ * @param[out] to_free	list of entries to free once the mutex is released.
+ * @param[in] now	the current time.
+ * @return the number of entries which timed out.
  */
-static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *request,
-					    fr_pair_list_t *reply_list, fr_state_entry_t *old)
+static uint64_t state_shard_expire(fr_state_tree_t *state, fr_state_shard_t *shard,
+				   fr_dlist_head_t *to_free, fr_time_t now)
 {
-	size_t			i;
-	uint32_t		x;
-	fr_time_t		now = fr_time();
-	fr_pair_t		*vp;
 	fr_state_entry_t	*entry, *next;
-
-	uint8_t			old_state[sizeof(old->state)];
-	int			old_tries = 0;
 	uint64_t		timed_out = 0;
-	bool			too_many = false;
-	fr_dlist_head_t		to_free;
-
-	fr_dlist_init(&to_free, fr_state_entry_t, list);
 
-	/*
-	 *	Clean up old entries.
-	 */
-	for (entry = fr_dlist_head(&state->to_expire);
+	for (entry = fr_dlist_head(&shard->to_expire);
 	     entry != NULL;
 	     entry = next) {
 		(void)talloc_get_type_abort(entry, fr_state_entry_t);	/* Allow examination */
-		next = fr_dlist_next(&state->to_expire, entry);		/* Advance *before* potential unlinking */
-
-		if (entry == old) continue;
+		next = fr_dlist_next(&shard->to_expire, entry);		/* Advance *before* potential unlinking */
 
 		/*
 		 *	Too old, we can delete it.
 		 */
 		if (entry->cleanup < now) {
 			state_entry_unlink(state, entry);
-			fr_dlist_insert_tail(&to_free, entry);
+			fr_dlist_insert_tail(to_free, entry);
 			timed_out++;
 			continue;
 		}
@@ -356,9 +459,42 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 		break;
 	}
 
-	state->timed_out += timed_out;
+	shard->stats.timed_out += timed_out;
+
+	return timed_out;
+}
 
-	if (!old && (fr_rb_num_elements(state->tree) >= (uint32_t) state->max_sessions)) too_many = true;
+/** Create a new state entry
+ *
+ * The entry is not inserted into the tree, so the caller can fill
+ * it in without holding any mutexes.
+ *
+ * @note Called with the mutex of old_shard held, if old is not NULL.
+ *	 The mutex is released before returning.
+ *
+ * @param[in] state		tree the entry will be inserted into.
+ * @param[in] request		the entry is being created for.
+ * @param[in] reply_list	to add the State attribute to.
+ * @param[in] old		entry the new entry replaces.  May be NULL.
+ * @param[in] old_shard		holding the old entry.
+ * @return the new entry.
+ */
+static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *request,
+					    fr_pair_list_t *reply_list,
+					    fr_state_entry_t *old, fr_state_shard_t *old_shard)
+{
+	size_t			i;
+	uint32_t		x;
+	fr_time_t		now = fr_time();
+	fr_pair_t		*vp;
+	fr_state_entry_t	*entry;
+
+	uint8_t			old_state[sizeof(old->state)];
+	int			old_tries = 0;
+	uint64_t		timed_out = 0;
+	fr_dlist_head_t		to_free;
+
+	fr_dlist_init(&to_free, fr_state_entry_t, list);
 
 	/*
 	 *	Record the information from the old state, we may base the
@@ -379,8 +515,13 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 			state_entry_unlink(state, old);
 			fr_dlist_insert_tail(&to_free, old);
 		}
+
+		/*
+		 *	Clean up old entries.
+		 */
+		timed_out = state_shard_expire(state, old_shard, &to_free, now);
+		state_shard_unlock(state, old_shard);
 	}
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
 
 	if (timed_out > 0) RWDEBUG("Cleaning up %"PRIu64" timed out state entries", timed_out);
 
@@ -399,18 +540,6 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 		talloc_free(entry);
 	}
 
-	/*
-	 *	Have to do this post-cleanup, else we end up returning with
-	 *	a list full of entries to free with none of them being
-	 *	freed which is bad...
-	 */
-	if (too_many) {
-		RERROR("Failed inserting state entry - At maximum ongoing session limit (%u)",
-		       state->max_sessions);
-		PTHREAD_MUTEX_LOCK(&state->mutex);	/* Caller expects this to be locked */
-		return NULL;
-	}
-
 	/*
 	 *	Allocation doesn't need to occur inside the critical region
 	 *	and would add significantly to contention.
@@ -419,7 +548,7 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 
 	request_data_list_init(&entry->data);
 	talloc_set_destructor(entry, _state_entry_free);
-	entry->id = state->id++;
+	entry->id = atomic_fetch_add_explicit(&state->id, 1, memory_order_relaxed);
 
 	/*
 	 *	Limit the lifetime of this entry based on how long the
@@ -506,8 +635,6 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 	DEBUG4("State ID %" PRIu64 " created, value 0x%pH, expires %" PRIu64 "s",
 	       entry->id, fr_box_octets(entry->state, sizeof(entry->state)), (uint64_t)entry->cleanup - now);
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-
 	/*
 	 *	XOR the server hash with four bytes of random data.
 	 *	We XOR is again before resolving, to ensure state lookups
@@ -516,57 +643,131 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 	 */
 	*((uint32_t *)(&entry->state_comp.context_id)) ^= state->context_id;
 
-	if (!fr_rb_insert(state->tree, entry)) {
+	return entry;
+}
+
+/** Insert a new state entry into its shard
+ *
+ * @note Called with the mutex free.
+ *
+ * @param[in] state		tree to insert the entry into.
+ * @param[in] request		the entry was created for.
+ * @param[in] entry		to insert.
+ * @param[in] check_max		whether the entry starts a new session, and
+ *				should be checked against max_sessions.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int state_entry_insert(fr_state_tree_t *state, request_t *request, fr_state_entry_t *entry, bool check_max)
+{
+	fr_state_shard_t	*shard;
+	fr_state_entry_t	*old;
+	fr_time_t		now = fr_time();
+	uint64_t		timed_out;
+	fr_dlist_head_t		to_free;
+	int			ret = 0;
+
+	fr_dlist_init(&to_free, fr_state_entry_t, list);
+
+	/*
+	 *	The new entry may hash to a different
+	 *	shard than the entry it replaces.
+	 */
+	shard = state_shard(state, entry);
+
+	state_shard_lock(state, shard);
+
+	/*
+	 *	Clean up old entries.
+	 */
+	timed_out = state_shard_expire(state, shard, &to_free, now);
+
+	if (check_max && (atomic_load_explicit(&state->tracked, memory_order_relaxed) >= state->max_sessions)) {
+		state_shard_unlock(state, shard);
+		RERROR("Failed inserting state entry - At maximum ongoing session limit (%u)",
+		       state->max_sessions);
+		ret = -1;
+		goto done;
+	}
+
+	entry->shard = shard;
+	if (!fr_rb_insert(shard->tree, entry)) {
+		state_shard_unlock(state, shard);
 		RERROR("Failed inserting state entry - Insertion into state tree failed");
-		fr_pair_delete_by_da(reply_list, state->da);
-		talloc_free(entry);
-		return NULL;
+		ret = -1;
+		goto done;
 	}
+	atomic_fetch_add_explicit(&state->tracked, 1, memory_order_relaxed);
+	shard->stats.created++;
 
 	/*
 	 *	Link it to the end of the list, which is implicitely
 	 *	ordered by cleanup time.
 	 */
-	fr_dlist_insert_tail(&state->to_expire, entry);
+	fr_dlist_insert_tail(&shard->to_expire, entry);
 
-	return entry;
+	state_shard_unlock(state, shard);
+
+done:
+	if (timed_out > 0) RWDEBUG("Cleaning up %"PRIu64" timed out state entries", timed_out);
+
+	while ((old = fr_dlist_head(&to_free)) != NULL) {
+		fr_dlist_remove(&to_free, old);
+		talloc_free(old);
+	}
+
+	return ret;
 }
 
-/** Find the entry, based on the State attribute
+/** Build the key for a State value
  *
+ * @param[out] key	entry to write the key into.
+ * @param[in] state	tree the State value belongs to.
+ * @param[in] vb	value of the State attribute.
+ * @return the shard which would hold an entry for the State value.
  */
-static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, fr_value_box_t const *vb)
+static fr_state_shard_t *state_entry_key(fr_state_entry_t *key, fr_state_tree_t *state, fr_value_box_t const *vb)
 {
-	fr_state_entry_t *entry, my_entry;
-
 	/*
 	 *	Assume our own State first.
 	 */
-	if (vb->vb_length == sizeof(my_entry.state)) {
-		memcpy(my_entry.state, vb->vb_octets, sizeof(my_entry.state));
+	if (vb->vb_length == sizeof(key->state)) {
+		memcpy(key->state, vb->vb_octets, sizeof(key->state));
 
 		/*
 		 *	Too big?  Get the MD5 hash, in order
 		 *	to depend on the entire contents of State.
 		 */
-	} else if (vb->vb_length > sizeof(my_entry.state)) {
-		fr_md5_calc(my_entry.state, vb->vb_octets, vb->vb_length);
+	} else if (vb->vb_length > sizeof(key->state)) {
+		fr_md5_calc(key->state, vb->vb_octets, vb->vb_length);
 
 		/*
 		 *	Too small?  Use the whole thing, and
-		 *	set the rest of my_entry.state to zero.
+		 *	set the rest of key.state to zero.
 		 */
 	} else {
-		memcpy(my_entry.state, vb->vb_octets, vb->vb_length);
-		memset(&my_entry.state[vb->vb_length], 0, sizeof(my_entry.state) - vb->vb_length);
+		memcpy(key->state, vb->vb_octets, vb->vb_length);
+		memset(&key->state[vb->vb_length], 0, sizeof(key->state) - vb->vb_length);
 	}
 
 	/*
 	 *	Make it unique for different virtual servers handling the same request
 	 */
-	my_entry.state_comp.context_id ^= state->context_id;
+	key->state_comp.context_id ^= state->context_id;
 
-	entry = fr_rb_find(state->tree, &my_entry);
+	return state_shard(state, key);
+}
+
+/** Find the entry, based on the State attribute
+ *
+ * @note Called with the shard mutex held.
+ */
+static fr_state_entry_t *state_entry_find(fr_state_shard_t *shard, fr_state_entry_t const *key)
+{
+	fr_state_entry_t *entry;
+
+	entry = fr_rb_find(shard->tree, key);
 
 	if (entry) (void) talloc_get_type_abort(entry, fr_state_entry_t);
 
@@ -578,20 +779,23 @@ static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, fr_value_box_t
  */
 void fr_state_discard(fr_state_tree_t *state, request_t *request)
 {
-	fr_state_entry_t	*entry;
+	fr_state_entry_t	*entry, my_entry;
+	fr_state_shard_t	*shard;
 	fr_pair_t		*vp;
 
 	vp = fr_pair_find_by_da(&request->request_pairs, state->da, 0);
 	if (!vp) return;
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	entry = state_entry_find(state, &vp->data);
+	shard = state_entry_key(&my_entry, state, &vp->data);
+
+	state_shard_lock(state, shard);
+	entry = state_entry_find(shard, &my_entry);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		state_shard_unlock(state, shard);
 		return;
 	}
 	state_entry_unlink(state, entry);
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	state_shard_unlock(state, shard);
 
 	/*
 	 *	If fr_state_to_request was never called, this ensures
@@ -635,7 +839,8 @@ void fr_state_discard(fr_state_tree_t *state, request_t *request)
  */
 int fr_state_to_request(fr_state_tree_t *state, request_t *request)
 {
-	fr_state_entry_t	*entry;
+	fr_state_entry_t	*entry, my_entry;
+	fr_state_shard_t	*shard;
 	TALLOC_CTX		*old_ctx = NULL;
 	fr_pair_t		*vp;
 
@@ -649,13 +854,15 @@ int fr_state_to_request(fr_state_tree_t *state, request_t *request)
 		return 1;
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	entry = state_entry_find(state, &vp->data);
+	shard = state_entry_key(&my_entry, state, &vp->data);
+
+	state_shard_lock(state, shard);
+	entry = state_entry_find(shard, &my_entry);
 	if (entry) {
 		(void)talloc_get_type_abort(entry, fr_state_entry_t);
 		if (entry->thawed) {
 			REDEBUG("State entry has already been thawed by a request %"PRIu64, entry->thawed->number);
-			PTHREAD_MUTEX_UNLOCK(&state->mutex);
+			state_shard_unlock(state, shard);
 			return -2;
 		}
 		if (request->session_state_ctx) old_ctx = request->session_state_ctx;	/* Store for later freeing */
@@ -668,9 +875,9 @@ int fr_state_to_request(fr_state_tree_t *state, request_t *request)
 
 		entry->ctx = NULL;
 		entry->thawed = request;
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		state_shard_unlock(state, shard);
 	} else {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		state_shard_unlock(state, shard);
 		RDEBUG2("No state entry matching &request.%pP found", vp);
 		return 2;
 	}
@@ -701,9 +908,13 @@ int fr_state_to_request(fr_state_tree_t *state, request_t *request)
  */
 int fr_request_to_state(fr_state_tree_t *state, request_t *request)
 {
-	fr_state_entry_t	*entry, *old = NULL;
+	fr_state_entry_t	*entry, *old = NULL, my_entry;
+	fr_state_shard_t	*old_shard = NULL;
 	fr_dlist_head_t		data;
 	fr_pair_t		*vp;
+	fr_dbuff_t		publish_dbuff;
+	fr_dbuff_uctx_talloc_t	publish_tctx;
+	bool			publish = false;
 
 	request_data_list_init(&data);
 	request_data_by_persistance(&data, request, true);
@@ -717,25 +928,57 @@ int fr_request_to_state(fr_state_tree_t *state, request_t *request)
 
 	vp = fr_pair_find_by_da(&request->request_pairs, state->da, 0);
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-	if (vp) old = state_entry_find(state, &vp->data);
+	if (vp) {
+		old_shard = state_entry_key(&my_entry, state, &vp->data);
 
-	entry = state_entry_create(state, request, &request->reply_pairs, old);
-	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
-		RERROR("Creating state entry failed");
-		request_data_restore(request, &data);	/* Put it back again */
-		return -1;
+		state_shard_lock(state, old_shard);
+		old = state_entry_find(old_shard, &my_entry);
+		if (!old) state_shard_unlock(state, old_shard);
 	}
 
+	entry = state_entry_create(state, request, &request->reply_pairs, old, old_shard);
+
 	fr_assert(entry->ctx == NULL);
 	fr_assert(request->session_state_ctx);
 
+	/*
+	 *	The entry isn't in the tree yet, so
+	 *	we don't need to hold a mutex.
+	 */
 	entry->seq_start = request->seq_start;
 	entry->ctx = request->session_state_ctx;
 	fr_dlist_move(&entry->data, &data);
 
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	/*
+	 *	Encode the entry for publishing whilst we
+	 *	still own it.  Once it's inserted another
+	 *	thread may thaw it.
+	 */
+	if (state->publish) {
+		MEM(fr_dbuff_init_talloc(NULL, &publish_dbuff, &publish_tctx, 256, 65535));
+		publish = (state_entry_encode(&publish_dbuff, entry, fr_time()) > 0);
+		if (!publish) fr_dbuff_free_talloc(&publish_dbuff);
+	}
+
+	if (state_entry_insert(state, request, entry, !old) < 0) {
+		RERROR("Creating state entry failed");
+		fr_pair_delete_by_da(&request->reply_pairs, state->da);
+
+		/*
+		 *	Put it back again
+		 */
+		entry->ctx = NULL;
+		fr_dlist_move(&data, &entry->data);
+		talloc_free(entry);
+		request_data_restore(request, &data);
+		if (publish) fr_dbuff_free_talloc(&publish_dbuff);
+		return -1;
+	}
+
+	if (publish) {
+		state->publish(fr_dbuff_start(&publish_dbuff), fr_dbuff_used(&publish_dbuff), state->publish_uctx);
+		fr_dbuff_free_talloc(&publish_dbuff);
+	}
 
 	MEM(request->session_state_ctx = fr_pair_afrom_da(NULL, request_attr_state));	/* fixme - should use a pool */
 
@@ -888,7 +1131,7 @@ void fr_state_discard_child(request_t *parent, void const *unique_ptr, int uniqu
  */
 uint64_t fr_state_entries_created(fr_state_tree_t *state)
 {
-	return state->id;
+	return atomic_load_explicit(&state->id, memory_order_relaxed);
 }
 
 /** Return number of entries that timed out
@@ -896,7 +1139,16 @@ uint64_t fr_state_entries_created(fr_state_tree_t *state)
  */
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
 {
-	return state->timed_out;
+	fr_state_shard_stats_t	stats;
+	uint64_t		timed_out = 0;
+	uint32_t		i;
+
+	for (i = 0; i < state->num_shards; i++) {
+		fr_state_shard_stats(&stats, state, i);
+		timed_out += stats.timed_out;
+	}
+
+	return timed_out;
 }
 
 /** Return number of entries we're currently tracking
@@ -904,5 +1156,430 @@ uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
  */
 uint64_t fr_state_entries_tracked(fr_state_tree_t *state)
 {
-	return fr_rb_num_elements(state->tree);
+	return atomic_load_explicit(&state->tracked, memory_order_relaxed);
+}
+
+/** Return the number of shards in a state tree
+ *
+ */
+uint32_t fr_state_num_shards(fr_state_tree_t *state)
+{
+	return state->num_shards;
+}
+
+/** Return the statistics for one shard of a state tree
+ *
+ * @param[out] stats	Where to write the statistics.
+ * @param[in] state	tree to return statistics for.
+ * @param[in] shard_id	to return statistics for, from 0 to
+ *			#fr_state_num_shards - 1.
+ * @return
+ *	- 0 on success.
+ *	- -1 if shard_id is invalid.
+ */
+int fr_state_shard_stats(fr_state_shard_stats_t *stats, fr_state_tree_t *state, uint32_t shard_id)
+{
+	fr_state_shard_t *shard;
+
+	if (shard_id >= state->num_shards) {
+		fr_strerror_printf("Invalid shard %u, state tree has %u shards", shard_id, state->num_shards);
+		return -1;
+	}
+	shard = &state->shards[shard_id];
+
+	state_shard_lock(state, shard);
+	*stats = shard->stats;
+	stats->tracked = fr_rb_num_elements(shard->tree);
+	state_shard_unlock(state, shard);
+
+	return 0;
+}
+
+/** Write the header of a snapshot, or of a batch of replicated entries
+ *
+ * @param[out] dbuff	to write the header to.
+ * @param[in] state	tree the entries belong to.
+ * @return
+ *	- >0 the number of bytes written.
+ *	- <0 on error.
+ */
+ssize_t fr_state_tree_header_encode(fr_dbuff_t *dbuff, fr_state_tree_t *state)
+{
+	fr_dbuff_t	work_dbuff = FR_DBUFF(dbuff);
+
+	FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, (uint8_t const *)STATE_SNAPSHOT_MAGIC, STATE_SNAPSHOT_MAGIC_LEN);
+	FR_DBUFF_IN_RETURN(&work_dbuff, (uint8_t)STATE_SNAPSHOT_VERSION);
+	FR_DBUFF_IN_RETURN(&work_dbuff, state->context_id);
+
+	return fr_dbuff_set(dbuff, &work_dbuff);
+}
+
+/** Encode a state entry
+ *
+ * @note The entry must not be modified by another thread while it's encoded.
+ *
+ * @param[out] dbuff	to write the entry to.
+ * @param[in] entry	to encode.
+ * @param[in] now	used to calculate how much longer the entry has to live.
+ * @return
+ *	- >0 the number of bytes written.
+ *	- 0 if the entry can't be encoded, because it has expired,
+ *	  has been thawed, or holds request data.
+ *	- <0 on error.
+ */
+static ssize_t state_entry_encode(fr_dbuff_t *dbuff, fr_state_entry_t const *entry, fr_time_t now)
+{
+	fr_dbuff_t		work_dbuff = FR_DBUFF(dbuff);
+	fr_dbuff_marker_t	len_m;
+	fr_time_delta_t		ttl = entry->cleanup - now;
+	ssize_t			slen;
+
+	if ((ttl <= 0) || entry->thawed || !entry->ctx || !fr_dlist_empty(&entry->data)) return 0;
+
+	FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, entry->state, sizeof(entry->state));
+	FR_DBUFF_IN_RETURN(&work_dbuff, (uint8_t)entry->tries);
+	FR_DBUFF_IN_RETURN(&work_dbuff, (uint64_t)ttl);
+
+	fr_dbuff_marker(&len_m, &work_dbuff);
+	FR_DBUFF_IN_RETURN(&work_dbuff, (uint32_t)0);
+
+	slen = fr_internal_encode_list(&work_dbuff, &entry->ctx->children, NULL);
+	if (slen < 0) {
+		fr_dbuff_marker_release(&len_m);
+		return slen;
+	}
+
+	fr_dbuff_in(&len_m, (uint32_t)slen);
+	fr_dbuff_marker_release(&len_m);
+
+	return fr_dbuff_set(dbuff, &work_dbuff);
+}
+
+/** Insert entries written by #fr_state_tree_save, or received from a peer
+ *
+ * Entries are decoded from a header written by #fr_state_tree_header_encode,
+ * followed by zero or more entries.  Entries whose State value is already
+ * in the tree replace the existing entry, unless the existing entry is
+ * in use.
+ *
+ * @param[in] state	tree to insert entries into.
+ * @param[in] dict	to decode &session-state with.
+ * @param[in] dbuff	to decode.
+ * @return
+ *	- >= 0 the number of entries inserted.
+ *	- -1 on failure.  Entries before the failure are still inserted.
+ */
+int fr_state_tree_import(fr_state_tree_t *state, fr_dict_t const *dict, fr_dbuff_t *dbuff)
+{
+	fr_time_t		now = fr_time();
+	uint8_t			magic[STATE_SNAPSHOT_MAGIC_LEN];
+	uint8_t			version;
+	uint32_t		context_id;
+	int			imported = 0;
+
+	if ((fr_dbuff_out_memcpy(magic, dbuff, sizeof(magic)) < 0) ||
+	    (memcmp(magic, STATE_SNAPSHOT_MAGIC, sizeof(magic)) != 0) ||
+	    (fr_dbuff_out(&version, dbuff) < 0) || (version != STATE_SNAPSHOT_VERSION) ||
+	    (fr_dbuff_out(&context_id, dbuff) < 0)) {
+		fr_strerror_const("Not state entries, or an unsupported version");
+		return -1;
+	}
+
+	/*
+	 *	State values are bound to the virtual server
+	 *	which created them.
+	 */
+	if (context_id != state->context_id) {
+		fr_strerror_const("State entries were created by a different virtual server");
+		return -1;
+	}
+
+	while (fr_dbuff_remaining(dbuff) > 0) {
+		fr_state_entry_t	*entry, *old;
+		fr_state_shard_t	*shard;
+		uint64_t		ttl;
+		uint8_t			tries;
+		uint32_t		len;
+		fr_dbuff_t		pairs_dbuff;
+
+		MEM(entry = talloc_zero(NULL, fr_state_entry_t));
+		request_data_list_init(&entry->data);
+		talloc_set_destructor(entry, _state_entry_free);
+
+		if ((fr_dbuff_out_memcpy(entry->state, dbuff, sizeof(entry->state)) < 0) ||
+		    (fr_dbuff_out(&tries, dbuff) < 0) ||
+		    (fr_dbuff_out(&ttl, dbuff) < 0) ||
+		    (fr_dbuff_out(&len, dbuff) < 0) ||
+		    (fr_dbuff_remaining(dbuff) < len)) {
+			fr_strerror_const("State entries are truncated");
+		error:
+			talloc_free(entry);
+			return -1;
+		}
+
+		MEM(entry->ctx = fr_pair_afrom_da(NULL, request_attr_state));
+		pairs_dbuff = FR_DBUFF_MAX(dbuff, len);
+		if (fr_internal_decode_list_dbuff(entry->ctx, &entry->ctx->children, dict, &pairs_dbuff, NULL) < 0) {
+			fr_strerror_printf_push("Failed decoding session-state");
+			goto error;
+		}
+		fr_dbuff_advance(dbuff, len);
+
+		entry->tries = tries;
+		entry->id = atomic_fetch_add_explicit(&state->id, 1, memory_order_relaxed);
+		entry->cleanup = now + (fr_time_delta_t)ttl;
+
+		shard = state_shard(state, entry);
+		state_shard_lock(state, shard);
+
+		old = fr_rb_find(shard->tree, entry);
+		if (old) {
+			if (old->thawed) {
+				state_shard_unlock(state, shard);
+				talloc_free(entry);
+				continue;
+			}
+			state_entry_unlink(state, old);
+		} else if (atomic_load_explicit(&state->tracked, memory_order_relaxed) >= state->max_sessions) {
+			state_shard_unlock(state, shard);
+			talloc_free(entry);
+			continue;
+		}
+
+		entry->shard = shard;
+		if (!fr_rb_insert(shard->tree, entry)) {
+			state_shard_unlock(state, shard);
+			talloc_free(old);
+			talloc_free(entry);
+			continue;
+		}
+		atomic_fetch_add_explicit(&state->tracked, 1, memory_order_relaxed);
+		shard->stats.created++;
+
+		/*
+		 *	Entries from elsewhere may expire before
+		 *	entries we created, so the expiry list
+		 *	is no longer strictly ordered.  That only
+		 *	delays cleaning up some entries.
+		 */
+		fr_dlist_insert_tail(&shard->to_expire, entry);
+		state_shard_unlock(state, shard);
+
+		talloc_free(old);
+		imported++;
+	}
+
+	return imported;
+}
+
+/** Set a function to call whenever a state entry is created
+ *
+ * Used to replicate entries to other servers, which insert them with
+ * #fr_state_tree_import.  Only entries which #fr_state_tree_save would
+ * write are published.
+ *
+ * @note Must be called before the tree is used to process requests.
+ *
+ * @param[in] state	tree to publish entries from.
+ * @param[in] publish	function to call with each encoded entry.
+ *			Called from worker threads.  NULL to stop publishing.
+ * @param[in] uctx	passed to publish.
+ */
+void fr_state_tree_publish_set(fr_state_tree_t *state, fr_state_publish_t publish, void *uctx)
+{
+	state->publish = publish;
+	state->publish_uctx = uctx;
+}
+
+/** Write the entries of a state tree to a snapshot file
+ *
+ * Called on shutdown, so that a new server process can pick up the
+ * sessions with #fr_state_tree_load, and multi-round authentication
+ * in progress survives a restart.
+ *
+ * Only &session-state is written.  Entries holding persistable
+ * request data are skipped, as request data is opaque to us.
+ *
+ * The snapshot is written to a temporary file, which is renamed
+ * into place once complete.
+ *
+ * @param[in] state	tree to save.
+ * @param[in] filename	to write the snapshot to.
+ * @return
+ *	- >= 0 the number of entries written.
+ *	- -1 on failure.
+ */
+int fr_state_tree_save(fr_state_tree_t *state, char const *filename)
+{
+	fr_dbuff_t		dbuff;
+	fr_dbuff_uctx_talloc_t	tctx;
+	fr_time_t		now = fr_time();
+	uint32_t		i;
+	int			saved = 0, skipped = 0;
+	char			*tmp;
+	int			fd;
+	ssize_t			slen;
+	uint8_t const		*p, *end;
+
+	MEM(fr_dbuff_init_talloc(NULL, &dbuff, &tctx, 4096, SIZE_MAX));
+
+	if (fr_state_tree_header_encode(&dbuff, state) < 0) {
+		fr_dbuff_free_talloc(&dbuff);
+		return -1;
+	}
+
+	for (i = 0; i < state->num_shards; i++) {
+		fr_state_shard_t	*shard = &state->shards[i];
+		fr_state_entry_t	*entry = NULL;
+
+		state_shard_lock(state, shard);
+
+		/*
+		 *	Walk the expiry list, so entries are
+		 *	loaded back in the same order.
+		 */
+		while ((entry = fr_dlist_next(&shard->to_expire, entry))) {
+			slen = state_entry_encode(&dbuff, entry, now);
+			if (slen < 0) {
+				state_shard_unlock(state, shard);
+				fr_dbuff_free_talloc(&dbuff);
+				return -1;
+			}
+			if (slen == 0) {
+				if (entry->cleanup > now) skipped++;
+				continue;
+			}
+			saved++;
+		}
+
+		state_shard_unlock(state, shard);
+	}
+
+	/*
+	 *	Write to a temporary file first, so a new
+	 *	process never sees a partial snapshot.
+	 */
+	MEM(tmp = talloc_asprintf(NULL, "%s.tmp", filename));
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening \"%s\": %s", tmp, fr_syserror(errno));
+	file_error:
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		talloc_free(tmp);
+		fr_dbuff_free_talloc(&dbuff);
+		return -1;
+	}
+
+	for (p = fr_dbuff_start(&dbuff), end = fr_dbuff_current(&dbuff); p < end; p += slen) {
+		slen = write(fd, p, end - p);
+		if (slen < 0) {
+			if (errno == EINTR) {
+				slen = 0;
+				continue;
+			}
+			fr_strerror_printf("Failed writing \"%s\": %s", tmp, fr_syserror(errno));
+			goto file_error;
+		}
+	}
+	fr_dbuff_free_talloc(&dbuff);
+
+	if ((fsync(fd) < 0) || (close(fd) < 0)) {
+		fr_strerror_printf("Failed writing \"%s\": %s", tmp, fr_syserror(errno));
+		unlink(tmp);
+		talloc_free(tmp);
+		return -1;
+	}
+
+	if (rename(tmp, filename) < 0) {
+		fr_strerror_printf("Failed renaming \"%s\" to \"%s\": %s", tmp, filename, fr_syserror(errno));
+		unlink(tmp);
+		talloc_free(tmp);
+		return -1;
+	}
+	talloc_free(tmp);
+
+	if (skipped > 0) WARN("Not saving %i state entries holding request data", skipped);
+	DEBUG2("Saved %i state entries to \"%s\"", saved, filename);
+
+	return saved;
+}
+
+/** Load the entries written by #fr_state_tree_save into a state tree
+ *
+ * Must be called before the tree is used to process requests.  The
+ * snapshot file is removed once it has been read, so that it's only
+ * loaded once.  Entries which expired while the server was restarting
+ * are discarded when they're next cleaned up, as normal.
+ *
+ * @param[in] state	tree to load entries into.
+ * @param[in] dict	to decode &session-state with.
+ * @param[in] filename	to read the snapshot from.
+ * @return
+ *	- >= 0 the number of entries loaded.  0 if there was no snapshot.
+ *	- -1 on failure.
+ */
+int fr_state_tree_load(fr_state_tree_t *state, fr_dict_t const *dict, char const *filename)
+{
+	int			fd;
+	struct stat		st;
+	uint8_t			*buff;
+	fr_dbuff_t		dbuff;
+	ssize_t			slen;
+	size_t			done;
+	int			loaded;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT) return 0;
+		fr_strerror_printf("Failed opening \"%s\": %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		fr_strerror_printf("Failed reading \"%s\": %s", filename, fr_syserror(errno));
+		close(fd);
+		return -1;
+	}
+
+	MEM(buff = talloc_array(NULL, uint8_t, st.st_size));
+	for (done = 0; done < (size_t)st.st_size; done += slen) {
+		slen = read(fd, buff + done, st.st_size - done);
+		if (slen < 0) {
+			if (errno == EINTR) {
+				slen = 0;
+				continue;
+			}
+			fr_strerror_printf("Failed reading \"%s\": %s", filename, fr_syserror(errno));
+		error:
+			close(fd);
+			talloc_free(buff);
+			return -1;
+		}
+		if (slen == 0) {
+			fr_strerror_printf("Failed reading \"%s\": File truncated", filename);
+			goto error;
+		}
+	}
+	close(fd);
+
+	/*
+	 *	Whatever happens, don't load the
+	 *	same snapshot twice.
+	 */
+	unlink(filename);
+
+	fr_dbuff_init(&dbuff, buff, done);
+	loaded = fr_state_tree_import(state, dict, &dbuff);
+	talloc_free(buff);
+	if (loaded < 0) {
+		fr_strerror_printf_push("Failed loading \"%s\"", filename);
+		return -1;
+	}
+
+	DEBUG2("Loaded %i state entries from \"%s\"", loaded, filename);
+
+	return loaded;
 }
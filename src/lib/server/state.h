@@ -30,11 +30,22 @@ RCSIDH(state_h, "$Id$")
 extern "C" {
 #endif
 
+#include <freeradius-devel/util/dbuff.h>
 #include <freeradius-devel/util/dict.h>
 #include <freeradius-devel/server/request.h>
 
 typedef struct fr_state_tree_s fr_state_tree_t;
 
+/** Statistics for one shard of a state tree
+ *
+ */
+typedef struct {
+	uint64_t	created;		//!< Entries inserted into the shard.
+	uint64_t	timed_out;		//!< Entries cleaned up due to timeout.
+	uint64_t	tracked;		//!< Entries currently in the shard.
+	uint64_t	contended;		//!< Times the shard mutex was held by another thread.
+} fr_state_shard_stats_t;
+
 fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, bool thread_safe,
 				    uint32_t max_sessions, fr_time_delta_t timeout,
 				    uint8_t server_id, uint32_t context_id);
@@ -44,6 +55,22 @@ void	fr_state_discard(fr_state_tree_t *state, request_t *request);
 int	fr_state_to_request(fr_state_tree_t *state, request_t *request);
 int	fr_request_to_state(fr_state_tree_t *state, request_t *request);
 
+/** Called with each state entry created, so it can be replicated
+ *
+ * @param[in] data	The entry, encoded for #fr_state_tree_import.
+ *			Only valid for the duration of the call.
+ * @param[in] data_len	Length of the encoded entry.
+ * @param[in] uctx	passed to #fr_state_tree_publish_set.
+ */
+typedef void (*fr_state_publish_t)(uint8_t const *data, size_t data_len, void *uctx);
+
+ssize_t	fr_state_tree_header_encode(fr_dbuff_t *dbuff, fr_state_tree_t *state) CC_HINT(nonnull);
+int	fr_state_tree_import(fr_state_tree_t *state, fr_dict_t const *dict, fr_dbuff_t *dbuff) CC_HINT(nonnull);
+void	fr_state_tree_publish_set(fr_state_tree_t *state, fr_state_publish_t publish, void *uctx) CC_HINT(nonnull(1));
+
+int	fr_state_tree_save(fr_state_tree_t *state, char const *filename) CC_HINT(nonnull);
+int	fr_state_tree_load(fr_state_tree_t *state, fr_dict_t const *dict, char const *filename) CC_HINT(nonnull);
+
 void	fr_state_store_in_parent(request_t *request, void const *unique_ptr, int unique_int);
 void	fr_state_restore_to_child(request_t *child, void const *unique_ptr, int unique_int);
 void	fr_state_discard_child(request_t *parent, void const *unique_ptr, int unique_int);
@@ -55,6 +82,9 @@ uint64_t fr_state_entries_created(fr_state_tree_t *state);
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state);
 uint64_t fr_state_entries_tracked(fr_state_tree_t *state);
 
+uint32_t fr_state_num_shards(fr_state_tree_t *state);
+int	fr_state_shard_stats(fr_state_shard_stats_t *stats, fr_state_tree_t *state, uint32_t shard_id);
+
 #ifdef __cplusplus
 }
 #endif
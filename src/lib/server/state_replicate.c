@@ -0,0 +1,380 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file src/lib/server/state_replicate.c
+ * @brief Replicate state entries to other servers.
+ *
+ * When servers sit behind a load balancer which doesn't keep sessions
+ * sticky, the next round of a multi-round authentication may arrive at
+ * a different server to the one which created the State value.
+ *
+ * Every state entry a server creates is published to its peers, which
+ * insert it into their own tree.  Entries are queued by the worker
+ * which created them, and a separate thread sends the queue as a single
+ * UDP datagram per peer every interval, so the cost to a worker is one
+ * memcpy.  The same thread receives entries from peers.
+ *
+ * Datagrams are signed with HMAC-SHA1, using a secret shared by all the
+ * peers, and are only accepted from configured peers.  Replication is
+ * best-effort.  Entries which are lost, or which arrive after the next
+ * round, result in the session failing, as it would without replication.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/log.h>
+#include <freeradius-devel/server/state_replicate.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/sha1.h>
+#include <freeradius-devel/util/socket.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <poll.h>
+#include <pthread.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+/*
+ *	Keep datagrams below the IPv6 minimum reassembly
+ *	size, less the UDP header.
+ */
+#define STATE_REPLICATE_MAX	1450
+
+struct fr_state_replicate_s {
+	fr_state_tree_t			*state;		//!< Tree to publish from, and import into.
+	fr_dict_t const			*dict;		//!< To decode &session-state with.
+	fr_state_replicate_conf_t const	*conf;		//!< Peers, secret etc.
+
+	int				sockfd;		//!< Bound to conf->ipaddr:port.
+	pthread_t			thread;		//!< Sending and receiving entries.
+	bool				running;	//!< Whether the thread was started.
+
+	pthread_mutex_t			mutex;		//!< Protects the pending queue.
+	uint8_t				pending[STATE_REPLICATE_MAX];	//!< Header, entries, and space for the HMAC.
+	size_t				pending_len;	//!< Including the header.
+	size_t				header_len;	//!< Of the header at the start of pending.
+
+	fr_dlist_t			entry;		//!< Entry in the list of replicators.
+};
+
+static pthread_mutex_t	replicate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fr_dlist_head_t	replicate_list;
+static bool		replicate_list_init;
+static int		replicate_wakeup[2] = { -1, -1 };
+static atomic_bool	replicate_running;
+
+const CONF_PARSER fr_state_replicate_config[] = {
+	{ FR_CONF_OFFSET("ipaddr", FR_TYPE_COMBO_IP_ADDR, fr_state_replicate_conf_t, ipaddr), .dflt = "*" },
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, fr_state_replicate_conf_t, port), .dflt = "1815" },
+	{ FR_CONF_OFFSET("peer", FR_TYPE_COMBO_IP_ADDR | FR_TYPE_MULTI, fr_state_replicate_conf_t, peers) },
+	{ FR_CONF_OFFSET("secret", FR_TYPE_STRING | FR_TYPE_SECRET, fr_state_replicate_conf_t, secret) },
+	{ FR_CONF_OFFSET("interval", FR_TYPE_TIME_DELTA, fr_state_replicate_conf_t, interval), .dflt = "0.005" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+/** Sign the pending entries, and send them to every peer
+ *
+ * @note Called with the replicator's mutex held.
+ */
+static void state_replicate_flush(fr_state_replicate_t *sr)
+{
+	size_t	i;
+
+	if (sr->pending_len == sr->header_len) return;
+
+	fr_hmac_sha1(sr->pending + sr->pending_len, sr->pending, sr->pending_len,
+		     (uint8_t const *)sr->conf->secret, talloc_array_length(sr->conf->secret) - 1);
+
+	for (i = 0; i < talloc_array_length(sr->conf->peers); i++) {
+		struct sockaddr_storage	sa;
+		socklen_t		salen;
+
+		if (fr_ipaddr_to_sockaddr(&sa, &salen, &sr->conf->peers[i], sr->conf->port) < 0) continue;
+
+		if (sendto(sr->sockfd, sr->pending, sr->pending_len + SHA1_DIGEST_LENGTH, 0,
+			   (struct sockaddr *)&sa, salen) < 0) {
+			RATE_LIMIT_GLOBAL(WARN, "Failed replicating state entries to %pV: %s",
+					  fr_box_ipaddr(sr->conf->peers[i]), fr_syserror(errno));
+		}
+	}
+
+	sr->pending_len = sr->header_len;
+}
+
+/** Queue a new state entry for sending to peers
+ *
+ */
+static void _state_replicate_publish(uint8_t const *data, size_t data_len, void *uctx)
+{
+	fr_state_replicate_t	*sr = talloc_get_type_abort(uctx, fr_state_replicate_t);
+
+	if ((sr->header_len + data_len + SHA1_DIGEST_LENGTH) > sizeof(sr->pending)) {
+		RATE_LIMIT_GLOBAL(WARN, "State entry too large to replicate (%zu bytes)", data_len);
+		return;
+	}
+
+	pthread_mutex_lock(&sr->mutex);
+
+	/*
+	 *	Full, so send what we have now, rather
+	 *	than waiting for the thread.
+	 */
+	if ((sr->pending_len + data_len + SHA1_DIGEST_LENGTH) > sizeof(sr->pending)) state_replicate_flush(sr);
+
+	memcpy(sr->pending + sr->pending_len, data, data_len);
+	sr->pending_len += data_len;
+
+	pthread_mutex_unlock(&sr->mutex);
+}
+
+/** Check and import a datagram from a peer
+ *
+ */
+static void state_replicate_recv(fr_state_replicate_t *sr)
+{
+	uint8_t			buffer[STATE_REPLICATE_MAX];
+	uint8_t			digest[SHA1_DIGEST_LENGTH];
+	struct sockaddr_storage	sa;
+	socklen_t		salen = sizeof(sa);
+	fr_ipaddr_t		src;
+	uint16_t		port;
+	ssize_t			len;
+	size_t			i;
+	fr_dbuff_t		dbuff;
+
+	len = recvfrom(sr->sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)&sa, &salen);
+	if (len < 0) return;
+
+	if (fr_ipaddr_from_sockaddr(&src, &port, &sa, salen) < 0) return;
+
+	for (i = 0; i < talloc_array_length(sr->conf->peers); i++) {
+		if (fr_ipaddr_cmp(&src, &sr->conf->peers[i]) == 0) break;
+	}
+	if (i == talloc_array_length(sr->conf->peers)) {
+		RATE_LIMIT_GLOBAL(WARN, "Ignoring state entries from unknown peer %pV", fr_box_ipaddr(src));
+		return;
+	}
+
+	if (len <= SHA1_DIGEST_LENGTH) return;
+	len -= SHA1_DIGEST_LENGTH;
+
+	fr_hmac_sha1(digest, buffer, len,
+		     (uint8_t const *)sr->conf->secret, talloc_array_length(sr->conf->secret) - 1);
+	if (fr_digest_cmp(digest, buffer + len, sizeof(digest)) != 0) {
+		RATE_LIMIT_GLOBAL(WARN, "Ignoring state entries from %pV with invalid signature", fr_box_ipaddr(src));
+		return;
+	}
+
+	fr_dbuff_init(&dbuff, buffer, (size_t)len);
+	if (fr_state_tree_import(sr->state, sr->dict, &dbuff) < 0) {
+		RATE_LIMIT_GLOBAL(PWARN, "Failed importing state entries from %pV", fr_box_ipaddr(src));
+	}
+}
+
+static void *state_replicate_thread(void *arg)
+{
+	fr_state_replicate_t	*sr = talloc_get_type_abort(arg, fr_state_replicate_t);
+	struct pollfd		pfd[2] = {
+		{ .fd = sr->sockfd, .events = POLLIN },
+		{ .fd = replicate_wakeup[0], .events = POLLIN }
+	};
+	int			timeout = fr_time_delta_to_msec(sr->conf->interval);
+
+	if (timeout <= 0) timeout = 1;
+
+	while (atomic_load(&replicate_running)) {
+		int ret;
+
+		ret = poll(pfd, NUM_ELEMENTS(pfd), timeout);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			ERROR("State replication failed: %s", fr_syserror(errno));
+			break;
+		}
+
+		if (pfd[1].revents) break;
+
+		if (pfd[0].revents & POLLIN) state_replicate_recv(sr);
+
+		/*
+		 *	Send whatever the workers queued
+		 *	since the last time.
+		 */
+		pthread_mutex_lock(&sr->mutex);
+		state_replicate_flush(sr);
+		pthread_mutex_unlock(&sr->mutex);
+	}
+
+	return NULL;
+}
+
+static int _state_replicate_free(fr_state_replicate_t *sr)
+{
+	fr_state_tree_publish_set(sr->state, NULL, NULL);
+
+	/*
+	 *	Threads only exit when they're all told to.
+	 */
+	if (sr->running) fr_state_replicate_stop();
+
+	pthread_mutex_lock(&replicate_mutex);
+	fr_dlist_remove(&replicate_list, sr);
+	pthread_mutex_unlock(&replicate_mutex);
+
+	close(sr->sockfd);
+	pthread_mutex_destroy(&sr->mutex);
+
+	return 0;
+}
+
+/** Replicate the entries of a state tree to, and from, other servers
+ *
+ * The socket is bound here, but entries aren't sent or received until
+ * #fr_state_replicate_start is called.
+ *
+ * @param[in] ctx	to allocate the replicator in.  Must be freed
+ *			before the state tree.
+ * @param[in] state	tree to replicate.
+ * @param[in] dict	to decode &session-state with.
+ * @param[in] conf	Where to send and receive entries.  Must remain
+ *			valid for the lifetime of the replicator.
+ * @return
+ *	- A new replicator.
+ *	- NULL on error.
+ */
+fr_state_replicate_t *fr_state_replicate_alloc(TALLOC_CTX *ctx, fr_state_tree_t *state, fr_dict_t const *dict,
+					       fr_state_replicate_conf_t const *conf)
+{
+	fr_state_replicate_t	*sr;
+	fr_dbuff_t		dbuff;
+	uint16_t		port = conf->port;
+	ssize_t			slen;
+
+	MEM(sr = talloc_zero(ctx, fr_state_replicate_t));
+	sr->state = state;
+	sr->dict = dict;
+	sr->conf = conf;
+
+	fr_dbuff_init(&dbuff, sr->pending, sizeof(sr->pending));
+	slen = fr_state_tree_header_encode(&dbuff, state);
+	if (slen < 0) {
+		talloc_free(sr);
+		return NULL;
+	}
+	sr->header_len = sr->pending_len = slen;
+
+	sr->sockfd = fr_socket_server_udp(&conf->ipaddr, &port, NULL, false);
+	if (sr->sockfd < 0) {
+		talloc_free(sr);
+		return NULL;
+	}
+
+	if (fr_socket_bind(sr->sockfd, &conf->ipaddr, &port, NULL) < 0) {
+		close(sr->sockfd);
+		talloc_free(sr);
+		return NULL;
+	}
+
+	pthread_mutex_init(&sr->mutex, NULL);
+
+	pthread_mutex_lock(&replicate_mutex);
+	if (!replicate_list_init) {
+		fr_dlist_init(&replicate_list, fr_state_replicate_t, entry);
+		replicate_list_init = true;
+	}
+	fr_dlist_insert_tail(&replicate_list, sr);
+	pthread_mutex_unlock(&replicate_mutex);
+
+	talloc_set_destructor(sr, _state_replicate_free);
+
+	fr_state_tree_publish_set(state, _state_replicate_publish, sr);
+
+	return sr;
+}
+
+/** Start the threads which send and receive state entries
+ *
+ * This has to be called after daemonizing, as threads don't survive
+ * fork().
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_state_replicate_start(void)
+{
+	fr_state_replicate_t	*sr = NULL;
+	int			ret;
+
+	if (!replicate_list_init || atomic_load(&replicate_running)) return 0;
+
+	if (pipe(replicate_wakeup) < 0) {
+		fr_strerror_printf("Failed creating replication pipe: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	atomic_store(&replicate_running, true);
+
+	pthread_mutex_lock(&replicate_mutex);
+	while ((sr = fr_dlist_next(&replicate_list, sr))) {
+		ret = pthread_create(&sr->thread, NULL, state_replicate_thread, sr);
+		if (ret != 0) {
+			pthread_mutex_unlock(&replicate_mutex);
+			fr_strerror_printf("Failed creating replication thread: %s", fr_syserror(ret));
+			fr_state_replicate_stop();
+			return -1;
+		}
+		sr->running = true;
+	}
+	pthread_mutex_unlock(&replicate_mutex);
+
+	return 0;
+}
+
+/** Stop sending and receiving state entries
+ *
+ */
+void fr_state_replicate_stop(void)
+{
+	fr_state_replicate_t	*sr = NULL;
+	uint8_t			c = 0;
+
+	if (!atomic_load(&replicate_running)) return;
+
+	atomic_store(&replicate_running, false);
+	if (write(replicate_wakeup[1], &c, 1) < 0) { /* Threads exit anyway */ }
+
+	pthread_mutex_lock(&replicate_mutex);
+	while ((sr = fr_dlist_next(&replicate_list, sr))) {
+		if (!sr->running) continue;
+		pthread_join(sr->thread, NULL);
+		sr->running = false;
+	}
+	pthread_mutex_unlock(&replicate_mutex);
+
+	close(replicate_wakeup[0]);
+	close(replicate_wakeup[1]);
+	replicate_wakeup[0] = replicate_wakeup[1] = -1;
+}
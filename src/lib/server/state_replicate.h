@@ -0,0 +1,60 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/state_replicate.h
+ * @brief Replicate state entries to other servers.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(state_replicate_h, "$Id$")
+
+#include <freeradius-devel/server/cf_parse.h>
+#include <freeradius-devel/server/state.h>
+#include <freeradius-devel/util/inet.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Replication configuration
+ *
+ */
+typedef struct {
+	fr_ipaddr_t		ipaddr;			//!< To receive entries on.
+	uint16_t		port;			//!< To send and receive entries on.
+	fr_ipaddr_t		*peers;			//!< To send entries to.
+	char const		*secret;		//!< Used to sign entries.
+	fr_time_delta_t		interval;		//!< How long to batch entries for.
+} fr_state_replicate_conf_t;
+
+extern const CONF_PARSER fr_state_replicate_config[];
+
+typedef struct fr_state_replicate_s fr_state_replicate_t;
+
+fr_state_replicate_t	*fr_state_replicate_alloc(TALLOC_CTX *ctx, fr_state_tree_t *state, fr_dict_t const *dict,
+						  fr_state_replicate_conf_t const *conf) CC_HINT(nonnull);
+
+int			fr_state_replicate_start(void);
+
+void			fr_state_replicate_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1278,6 +1278,61 @@ done:
 }
 
 
+/** Find the first pair for a reference to a single known attribute
+ *
+ * References like &User-Name or &reply.Reply-Message[1] are by far the most
+ * common.  For those we go straight to the list and use #fr_pair_find_by_da,
+ * which uses the index of the list if it has one.  The index is only rebuilt
+ * when the generation of the list changes, so repeated references to the same
+ * attribute don't walk the list.
+ *
+ * @param[out] out	Where to write the pair.  NULL if none was found.
+ * @param[in] request	The current #request_t.
+ * @param[in] vpt	to evaluate.
+ * @return
+ *	- true if the reference was simple, and out has been written.
+ *	- false if the reference needs the full cursor.
+ */
+static inline CC_HINT(always_inline)
+bool tmpl_find_vp_simple(fr_pair_t **out, request_t *request, tmpl_t const *vpt)
+{
+	tmpl_attr_t const	*ar;
+	tmpl_request_t		*rr = NULL;
+	fr_pair_list_t		*list_head;
+	unsigned int		n;
+
+	if (!tmpl_is_attr(vpt) || (fr_dlist_num_elements(&vpt->data.attribute.ar) != 1)) return false;
+
+	ar = fr_dlist_head(&vpt->data.attribute.ar);
+	if ((ar->type != TMPL_ATTR_TYPE_NORMAL) || ar->ar_da->flags.is_unknown || ar->ar_da->flags.is_raw) return false;
+
+	switch (ar->ar_num) {
+	case NUM_ANY:
+		n = 0;
+		break;
+
+	default:
+		if (ar->ar_num < 0) return false;
+		n = ar->ar_num;
+		break;
+	}
+
+	/*
+	 *	Errors are left to the full cursor, which
+	 *	produces the error messages.
+	 */
+	while ((rr = fr_dlist_next(&vpt->data.attribute.rr, rr))) {
+		if (tmpl_request_ptr(&request, rr->request) < 0) return false;
+	}
+
+	list_head = tmpl_list_head(request, tmpl_list(vpt));
+	if (!list_head) return false;
+
+	*out = fr_pair_find_by_da(list_head, ar->ar_da, n);
+
+	return true;
+}
+
 /** Returns the first VP matching a #tmpl_t
  *
  * @param[out] out where to write the retrieved vp.
@@ -1301,6 +1356,14 @@ int tmpl_find_vp(fr_pair_t **out, request_t *request, tmpl_t const *vpt)
 
 	TMPL_VERIFY(vpt);
 
+	if (tmpl_find_vp_simple(&vp, request, vpt)) {
+		if (out) *out = vp;
+		if (vp) return 0;
+
+		fr_strerror_printf("No matching \"%s\" pairs found", tmpl_da(vpt)->name);
+		return -1;
+	}
+
 	vp = tmpl_pair_cursor_init(&err, request, &cc, &cursor, request, vpt);
 	tmpl_pair_cursor_clear(&cc);
 
@@ -1333,8 +1396,12 @@ int tmpl_find_or_add_vp(fr_pair_t **out, request_t *request, tmpl_t const *vpt)
 
 	*out = NULL;
 
-	vp = tmpl_pair_cursor_init(&err, NULL, &cc, &cursor, request, vpt);
-	tmpl_pair_cursor_clear(&cc);
+	if (tmpl_find_vp_simple(&vp, request, vpt)) {
+		err = vp ? 0 : -1;
+	} else {
+		vp = tmpl_pair_cursor_init(&err, NULL, &cc, &cursor, request, vpt);
+		tmpl_pair_cursor_clear(&cc);
+	}
 
 	switch (err) {
 	case 0:
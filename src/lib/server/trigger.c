@@ -31,6 +31,11 @@ RCSID("$Id$")
 #include <freeradius-devel/unlang/function.h>
 #include <freeradius-devel/unlang/interpret.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/wait.h>
 
 /** Whether triggers are enabled globally
@@ -38,8 +43,6 @@ RCSID("$Id$")
  */
 static bool			triggers_init;
 static CONF_SECTION const	*trigger_exec_main, *trigger_exec_subcs;
-static fr_rb_tree_t			*trigger_last_fired_tree;
-static pthread_mutex_t		*trigger_mutex;
 
 #define REQUEST_INDEX_TRIGGER_NAME	1
 #define REQUEST_INDEX_TRIGGER_ARGS	2
@@ -48,11 +51,39 @@ static pthread_mutex_t		*trigger_mutex;
  *
  */
 typedef struct {
-	fr_rb_node_t	node;		//!< Entry in the trigger last fired tree.
-	CONF_ITEM	*ci;		//!< Config item this rate limit counter is associated with.
-	time_t		last_fired;	//!< When this trigger last fired.
+	CONF_ITEM const		*ci;		//!< Config item this rate limit counter is associated with.
+	_Atomic(time_t)		last_fired;	//!< When this trigger last fired.
+	_Atomic(uint32_t)	suppressed;	//!< How many times the trigger was rate limited
+						///< since it last fired.
 } trigger_last_fired_t;
 
+#define TRIGGER_LAST_FIRED_SLOTS	1024	//!< Must be a power of 2.
+
+/** Rate limiting entries, in an open addressed table
+ *
+ * Slots are filled with compare and swap, and entries are never
+ * removed while the server is running, so lookups don't need a lock.
+ */
+static _Atomic(trigger_last_fired_t *)	trigger_last_fired[TRIGGER_LAST_FIRED_SLOTS];
+
+/** A program to run on the executor thread
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< Entry in the executor queue.
+	char			**argv;		//!< Program and arguments.
+} trigger_job_t;
+
+#define TRIGGER_EXECUTOR_MAX_QUEUED	1024	//!< Drop triggers if the executor falls this far behind.
+
+static pthread_t		trigger_executor;
+static pthread_mutex_t		trigger_executor_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		trigger_executor_cond = PTHREAD_COND_INITIALIZER;
+static fr_dlist_head_t		trigger_executor_queue;		//!< trigger_job_t waiting to run.
+static uint32_t			trigger_executor_queued;	//!< Length of the queue.
+static bool			trigger_executor_running;	//!< Whether the thread has been started.
+static bool			trigger_executor_stopping;	//!< Tell the thread to exit.
+
 /** Retrieve attributes from a special trigger list
  *
  */
@@ -96,28 +127,232 @@ xlat_action_t trigger_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out, request_t *reques
 	return XLAT_ACTION_DONE;
 }
 
-static int _mutex_free(pthread_mutex_t *mutex)
+/** Find or create the rate limiting entry for a trigger
+ *
+ * @param[in] ci	of the trigger.
+ * @return
+ *	- The rate limiting entry.
+ *	- NULL if the table is full, in which case the trigger isn't rate limited.
+ */
+static trigger_last_fired_t *trigger_last_fired_find(CONF_ITEM const *ci)
+{
+	uint32_t	hash = fr_hash(&ci, sizeof(ci));
+	uint32_t	i;
+
+	for (i = 0; i < TRIGGER_LAST_FIRED_SLOTS; i++) {
+		_Atomic(trigger_last_fired_t *)	*slot = &trigger_last_fired[(hash + i) & (TRIGGER_LAST_FIRED_SLOTS - 1)];
+		trigger_last_fired_t		*found, *new;
+
+		found = atomic_load_explicit(slot, memory_order_acquire);
+		if (!found) {
+			MEM(new = talloc_zero(NULL, trigger_last_fired_t));
+			new->ci = ci;
+
+			if (atomic_compare_exchange_strong(slot, &found, new)) return new;
+
+			/*
+			 *	Another thread filled the slot first,
+			 *	found is now what it inserted.
+			 */
+			talloc_free(new);
+		}
+
+		if (found->ci == ci) return found;
+	}
+
+	return NULL;
+}
+
+/** Check whether a trigger is allowed to fire, recording it if it's not
+ *
+ * Triggers fire at most once per second.  Triggers which are rate limited
+ * are counted, and the count is passed to the next trigger which fires.
+ *
+ * @param[out] suppressed	How many times the trigger was rate limited
+ *				since it last fired.
+ * @param[in] ci		of the trigger.
+ * @return
+ *	- true if the trigger should fire.
+ *	- false if it's rate limited.
+ */
+static bool trigger_rate_limit_allow(uint32_t *suppressed, CONF_ITEM const *ci)
 {
-	pthread_mutex_destroy(mutex);
+	trigger_last_fired_t	*found;
+	time_t			now = time(NULL);
+	time_t			last;
+
+	*suppressed = 0;
+
+	found = trigger_last_fired_find(ci);
+	if (!found) return true;
+
+	last = atomic_load_explicit(&found->last_fired, memory_order_relaxed);
+	if ((last == now) || !atomic_compare_exchange_strong(&found->last_fired, &last, now)) {
+		atomic_fetch_add_explicit(&found->suppressed, 1, memory_order_relaxed);
+		return false;
+	}
+
+	*suppressed = atomic_exchange_explicit(&found->suppressed, 0, memory_order_relaxed);
+
+	return true;
+}
+
+/** Reap any children of the executor which have exited
+ *
+ */
+static void trigger_executor_reap(pid_t *children, unsigned int *num_children)
+{
+	unsigned int i = 0;
+
+	while (i < *num_children) {
+		if (waitpid(children[i], NULL, WNOHANG) == 0) {
+			i++;
+			continue;
+		}
+
+		children[i] = children[--(*num_children)];
+	}
+}
+
+/** Run trigger programs, so that workers don't have to fork
+ *
+ * The thread waits for jobs, and wakes up once a second while it has
+ * children to reap.
+ */
+static void *trigger_executor_thread(UNUSED void *arg)
+{
+	pid_t		*children = NULL;
+	unsigned int	num_children = 0;
+	bool		stop;
+
+	for (;;) {
+		trigger_job_t	*job;
+		pid_t		pid;
+
+		pthread_mutex_lock(&trigger_executor_mutex);
+		while (!(job = fr_dlist_pop_head(&trigger_executor_queue)) && !trigger_executor_stopping) {
+			struct timespec ts;
+
+			if (!num_children) {
+				pthread_cond_wait(&trigger_executor_cond, &trigger_executor_mutex);
+				continue;
+			}
+
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += 1;
+			if (pthread_cond_timedwait(&trigger_executor_cond, &trigger_executor_mutex, &ts) == ETIMEDOUT) break;
+		}
+		if (job) trigger_executor_queued--;
+		stop = trigger_executor_stopping;
+		pthread_mutex_unlock(&trigger_executor_mutex);
+
+		if (job) {
+			pid = fr_exec_argv_nowait(job->argv);
+			if (pid < 0) {
+				PERROR("Failed running trigger %s", job->argv[0]);
+			} else {
+				if ((num_children % 64) == 0) {
+					MEM(children = talloc_realloc(NULL, children, pid_t, num_children + 64));
+				}
+				children[num_children++] = pid;
+			}
+			talloc_free(job);
+		}
+
+		trigger_executor_reap(children, &num_children);
+
+		if (!job && stop) break;
+	}
+
+	talloc_free(children);
+
+	return NULL;
+}
+
+/** Start the thread which runs trigger programs
+ *
+ * This must be called after the server has forked, as threads
+ * don't survive fork().  If it isn't called, triggers are run by
+ * the thread which fires them.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int trigger_executor_start(void)
+{
+	int ret;
+
+	if (!triggers_init || trigger_executor_running) return 0;
+
+	fr_dlist_talloc_init(&trigger_executor_queue, trigger_job_t, entry);
+	trigger_executor_queued = 0;
+	trigger_executor_stopping = false;
+
+	ret = pthread_create(&trigger_executor, NULL, trigger_executor_thread, NULL);
+	if (ret != 0) {
+		fr_strerror_printf("Failed creating trigger executor thread: %s", fr_syserror(ret));
+		return -1;
+	}
+
+	pthread_mutex_lock(&trigger_executor_mutex);
+	trigger_executor_running = true;
+	pthread_mutex_unlock(&trigger_executor_mutex);
+
 	return 0;
 }
 
-static void _trigger_last_fired_free(void *data)
+/** Run any queued triggers, and stop the executor thread
+ *
+ */
+void trigger_executor_stop(void)
 {
-	talloc_free(data);
+	pthread_mutex_lock(&trigger_executor_mutex);
+	if (!trigger_executor_running) {
+		pthread_mutex_unlock(&trigger_executor_mutex);
+		return;
+	}
+	trigger_executor_running = false;
+	trigger_executor_stopping = true;
+	pthread_cond_signal(&trigger_executor_cond);
+	pthread_mutex_unlock(&trigger_executor_mutex);
+
+	pthread_join(trigger_executor, NULL);
 }
 
-/** Compares two last fired structures
+/** Queue a program to be run by the executor thread
  *
- * @param one first pointer to compare.
- * @param two second pointer to compare.
- * @return CMP(one, two)
+ * @param[in] argv	Program and arguments.  Ownership passes to the executor.
+ * @return
+ *	- 1 if the executor isn't running.  The caller should run the program.
+ *	- 0 if the program was queued.
+ *	- -1 if the queue is full.
  */
-static int8_t _trigger_last_fired_cmp(void const *one, void const *two)
+static int trigger_executor_enqueue(char **argv)
 {
-	trigger_last_fired_t const *a = one, *b = two;
+	trigger_job_t *job;
+
+	pthread_mutex_lock(&trigger_executor_mutex);
+	if (!trigger_executor_running) {
+		pthread_mutex_unlock(&trigger_executor_mutex);
+		return 1;
+	}
 
-	return CMP(a->ci, b->ci);
+	if (trigger_executor_queued >= TRIGGER_EXECUTOR_MAX_QUEUED) {
+		pthread_mutex_unlock(&trigger_executor_mutex);
+		fr_strerror_const("Too many triggers waiting to run");
+		return -1;
+	}
+
+	MEM(job = talloc_zero(NULL, trigger_job_t));
+	job->argv = talloc_steal(job, argv);
+	fr_dlist_insert_tail(&trigger_executor_queue, job);
+	trigger_executor_queued++;
+
+	pthread_cond_signal(&trigger_executor_cond);
+	pthread_mutex_unlock(&trigger_executor_mutex);
+
+	return 0;
 }
 
 /** Set the global trigger section trigger_exec will search in, and register xlats
@@ -149,13 +384,6 @@ int trigger_exec_init(CONF_SECTION const *cs)
 		return 0;
 	}
 
-	MEM(trigger_last_fired_tree = fr_rb_inline_talloc_alloc(talloc_null_ctx(),
-								trigger_last_fired_t, node,
-								_trigger_last_fired_cmp, _trigger_last_fired_free));
-
-	trigger_mutex = talloc(talloc_null_ctx(), pthread_mutex_t);
-	pthread_mutex_init(trigger_mutex, 0);
-	talloc_set_destructor(trigger_mutex, _mutex_free);
 	triggers_init = true;
 
 	return 0;
@@ -166,8 +394,13 @@ int trigger_exec_init(CONF_SECTION const *cs)
  */
 void trigger_exec_free(void)
 {
-	TALLOC_FREE(trigger_last_fired_tree);
-	TALLOC_FREE(trigger_mutex);
+	size_t i;
+
+	trigger_executor_stop();
+
+	for (i = 0; i < TRIGGER_LAST_FIRED_SLOTS; i++) {
+		talloc_free(atomic_exchange(&trigger_last_fired[i], NULL));
+	}
 }
 
 /** Return whether triggers are enabled
@@ -214,12 +447,33 @@ static unlang_action_t trigger_resume(rlm_rcode_t *p_result, UNUSED int *priorit
 		waitpid(trigger->pid, NULL, 0);
 	/*
 	 *	Execute the program without waiting for the result.
+	 *	If there's an executor thread, it does the fork,
+	 *	so the worker doesn't have to.
 	 */
 	} else {
-		if (fr_exec_nowait(request, &trigger->args, NULL) < 0) {
+		char	**argv;
+		int	ret;
+
+		if (fr_exec_argv_afrom_value_box_list(NULL, &argv, &trigger->args) < 0) {
+			RPERROR("Failed running trigger %s", trigger->name);
+			RETURN_MODULE_FAIL;
+		}
+
+		ret = trigger_executor_enqueue(argv);
+		if (ret < 0) {
+			talloc_free(argv);
 			RPERROR("Failed running trigger %s", trigger->name);
 			RETURN_MODULE_FAIL;
 		}
+
+		if (ret > 0) {
+			talloc_free(argv);
+
+			if (fr_exec_nowait(request, &trigger->args, NULL) < 0) {
+				RPERROR("Failed running trigger %s", trigger->name);
+				RETURN_MODULE_FAIL;
+			}
+		}
 	}
 
 	RETURN_MODULE_OK;
@@ -272,6 +526,7 @@ int trigger_exec(unlang_interpret_t *intp, request_t *request,
 	request_t		*child;
 	fr_trigger_t		*trigger;
 	ssize_t			slen;
+	uint32_t		suppressed = 0;
 
 	/*
 	 *	noop if trigger_exec_init was never called
@@ -336,33 +591,9 @@ int trigger_exec(unlang_interpret_t *intp, request_t *request,
 	if (check_config) return 0;
 
 	/*
-	 *	Perform periodic rate_limiting.
+	 *	Send the rate_limited traps at most once per second.
 	 */
-	if (rate_limit) {
-		trigger_last_fired_t	find, *found;
-		time_t			now = time(NULL);
-
-		find.ci = ci;
-
-		pthread_mutex_lock(trigger_mutex);
-
-		found = fr_rb_find(trigger_last_fired_tree, &find);
-		if (!found) {
-			MEM(found = talloc(NULL, trigger_last_fired_t));
-			found->ci = ci;
-			found->last_fired = 0;
-
-			fr_rb_insert(trigger_last_fired_tree, found);
-		}
-
-		pthread_mutex_unlock(trigger_mutex);
-
-		/*
-		 *	Send the rate_limited traps at most once per second.
-		 */
-		if (found->last_fired == now) return -1;
-		found->last_fired = now;
-	}
+	if (rate_limit && !trigger_rate_limit_allow(&suppressed, ci)) return -1;
 
 	/*
 	 *	radius_exec_program always needs a request.
@@ -372,11 +603,35 @@ int trigger_exec(unlang_interpret_t *intp, request_t *request,
 	/*
 	 *	Add the args to the request data, so they can be picked up by the
 	 *	trigger_xlat function.
+	 *
+	 *	The trigger may run after the caller has returned, so
+	 *	the child gets its own copy.  If earlier triggers were
+	 *	rate limited, the count is added as Trigger-Suppressed.
 	 */
-	if (args && (request_data_add(child, &trigger_exec_main, REQUEST_INDEX_TRIGGER_ARGS, args,
-				      false, false, false) < 0)) {
-		talloc_free(child);
-		return -1;
+	if (args || suppressed) {
+		fr_pair_list_t	*child_args;
+
+		MEM(child_args = talloc(child, fr_pair_list_t));
+		fr_pair_list_init(child_args);
+		if (args) (void) fr_pair_list_copy(child, child_args, args);
+
+		if (suppressed) {
+			fr_dict_attr_t const	*da;
+			fr_pair_t		*vp;
+
+			da = fr_dict_attr_child_by_num(fr_dict_root(fr_dict_internal()), FR_TRIGGER_SUPPRESSED);
+			if (da) {
+				MEM(vp = fr_pair_afrom_da(child, da));
+				vp->vp_uint32 = suppressed;
+				fr_pair_append(child_args, vp);
+			}
+		}
+
+		if (request_data_add(child, &trigger_exec_main, REQUEST_INDEX_TRIGGER_ARGS, child_args,
+				     false, false, false) < 0) {
+			talloc_free(child);
+			return -1;
+		}
 	}
 
 	{
@@ -49,6 +49,10 @@ int		trigger_exec(unlang_interpret_t *intp,
 
 void		trigger_exec_free(void);
 
+int		trigger_executor_start(void);
+
+void		trigger_executor_stop(void);
+
 bool		trigger_enabled(void);
 
 void		trigger_args_afrom_server(TALLOC_CTX *ctx, fr_pair_list_t *list, char const *server, uint16_t port);
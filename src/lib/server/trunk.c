@@ -38,12 +38,16 @@ typedef struct fr_trunk_s fr_trunk_t;
 #include <freeradius-devel/server/trunk.h>
 
 #include <freeradius-devel/server/connection.h>
+#include <freeradius-devel/server/metrics.h>
 #include <freeradius-devel/server/trigger.h>
 #include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/probe.h>
 #include <freeradius-devel/util/syserror.h>
 #include <freeradius-devel/util/table.h>
 
+#include <pthread.h>
+
 #ifdef HAVE_STDATOMIC_H
 #  include <stdatomic.h>
 #else
@@ -71,10 +75,10 @@ static fr_time_t test_time(void)
 
 /** Trace state machine changes for a particular request
  *
+ * Entries are held in a fixed size ring in the request, so recording
+ * state changes never allocates memory.
  */
 typedef struct {
-	fr_dlist_head_t			*log_head;	//!< To allow the log entry to remove itself on free.
-	fr_dlist_t			entry;		//!< Entry in the linked list.
 	fr_trunk_request_state_t	from;		//!< What state we transitioned from.
 	fr_trunk_request_state_t	to;		//!< What state we transitioned to.
 
@@ -111,15 +115,39 @@ struct fr_trunk_request_s {
 
 	fr_time_t		last_freed;		//!< Last time this request was freed.
 
+	fr_time_t		last_sent;		//!< Last time this request was sent.
+
 	bool			bound_to_conn;		//!< Fail the request if there's an attempt to
 							///< re-enqueue it.
 
 #ifndef NDEBUG
-	fr_dlist_head_t		log;			//!< State change log.
+	fr_trunk_request_state_log_t log[FR_TRUNK_REQUEST_STATE_LOG_MAX];	//!< State change log.  Used as a ring.
+	unsigned int		log_start;		//!< Index of the oldest entry in the log.
+	unsigned int		log_count;		//!< Number of entries in the log.
 #endif
 };
 
 
+/** Connections open across all trunks allocated with the same configuration
+ *
+ * Each worker thread has its own trunk, so without a budget a backend sees
+ * `max` connections from every worker.  Trunks share a budget if they
+ * were allocated with the same #fr_trunk_conf_t, and it has `max_total` set.
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the list of budgets.
+
+	fr_trunk_conf_t const	*conf;			//!< Configuration the trunks were allocated with.
+
+	uint32_t		open;			//!< Connections currently allocated against the budget.
+
+	uint32_t		refs;			//!< Trunks and connections using the budget.
+} trunk_budget_t;
+
+static pthread_mutex_t	trunk_budget_mutex = PTHREAD_MUTEX_INITIALIZER;
+static fr_dlist_head_t	trunk_budgets;			//!< Budgets in use, protected by #trunk_budget_mutex.
+static bool		trunk_budgets_init;
+
 /** Associates request queues with a connection
  *
  * @dotfile src/lib/server/trunk_conn.gv "Trunk connection state machine"
@@ -162,6 +190,9 @@ struct fr_trunk_connection_s {
  	 */
  	uint64_t		sent_count;		//!< The number of requests that have been sent using
  							///< this connection.
+
+	uint64_t		rtt_count;		//!< The number of responses used to calculate
+							///< the response time.
  	/** @} */
 
 	/** @name Timers
@@ -169,6 +200,9 @@ struct fr_trunk_connection_s {
  	 */
   	fr_event_timer_t const	*lifetime_ev;		//!< Maximum time this connection can be open.
   	/** @} */
+
+	trunk_budget_t		*budget;		//!< Budget this connection holds a slot in.
+							///< NULL if it doesn't hold one.
 };
 
 /** Main trunk management handle
@@ -254,8 +288,17 @@ struct fr_trunk_s {
 	fr_rate_limit_t		limit_max_requests_alloc_log;	//!< Rate limit on "Refusing to alloc requests - Limit of * requests reached"
 
 	fr_rate_limit_t		limit_last_failure_log;	//!< Rate limit on "Refusing to enqueue requests - No active conns"
+
+	fr_rate_limit_t		limit_concurrency_log;	//!< Rate limit on "Refusing to enqueue requests - Concurrency limit"
  	/** @} */
 
+	trunk_budget_t		*budget;		//!< Connection budget shared with other trunks.
+							///< NULL if max_total is not set.
+
+	fr_metrics_source_t	*metrics;		//!< Our statistics, as seen by the metrics exporter.
+
+	fr_limiter_t		limiter;		//!< Adaptive limit on outstanding requests.
+
 	/** @name State
 	 * @{
  	 */
@@ -275,6 +318,16 @@ static CONF_PARSER const fr_trunk_config_request[] = {
 	{ FR_CONF_OFFSET("per_connection_max", FR_TYPE_UINT32, fr_trunk_conf_t, max_req_per_conn), .dflt = "2000" },
 	{ FR_CONF_OFFSET("per_connection_target", FR_TYPE_UINT32, fr_trunk_conf_t, target_req_per_conn), .dflt = "1000" },
 	{ FR_CONF_OFFSET("free_delay", FR_TYPE_TIME_DELTA, fr_trunk_conf_t, req_cleanup_delay), .dflt = "10.0" },
+	{ FR_CONF_OFFSET("preallocate", FR_TYPE_UINT32, fr_trunk_conf_t, req_prealloc), .dflt = "0" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static CONF_PARSER const fr_trunk_config_concurrency[] = {
+	{ FR_CONF_OFFSET("max", FR_TYPE_UINT32, fr_trunk_conf_t, concurrency.max), .dflt = "0" },
+	{ FR_CONF_OFFSET("min", FR_TYPE_UINT32, fr_trunk_conf_t, concurrency.min), .dflt = "8" },
+	{ FR_CONF_OFFSET("initial", FR_TYPE_UINT32, fr_trunk_conf_t, concurrency.initial), .dflt = "64" },
+	{ FR_CONF_OFFSET("tolerance", FR_TYPE_FLOAT32, fr_trunk_conf_t, concurrency.tolerance), .dflt = "2.0" },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -290,6 +343,8 @@ CONF_PARSER const fr_trunk_config[] = {
 	{ FR_CONF_OFFSET("start", FR_TYPE_UINT16, fr_trunk_conf_t, start), .dflt = "5" },
 	{ FR_CONF_OFFSET("min", FR_TYPE_UINT16, fr_trunk_conf_t, min), .dflt = "1" },
 	{ FR_CONF_OFFSET("max", FR_TYPE_UINT16, fr_trunk_conf_t, max), .dflt = "5" },
+	{ FR_CONF_OFFSET("max_total", FR_TYPE_UINT16, fr_trunk_conf_t, max_total), .dflt = "0" },
+	{ FR_CONF_OFFSET("least_latency", FR_TYPE_BOOL, fr_trunk_conf_t, least_latency), .dflt = "no" },
 	{ FR_CONF_OFFSET("connecting", FR_TYPE_UINT16, fr_trunk_conf_t, connecting), .dflt = "2" },
 	{ FR_CONF_OFFSET("uses", FR_TYPE_UINT64, fr_trunk_conf_t, max_uses), .dflt = "0" },
 	{ FR_CONF_OFFSET("lifetime", FR_TYPE_TIME_DELTA, fr_trunk_conf_t, lifetime), .dflt = "0" },
@@ -301,6 +356,7 @@ CONF_PARSER const fr_trunk_config[] = {
 
 	{ FR_CONF_OFFSET("connection", FR_TYPE_SUBSECTION, fr_trunk_conf_t, conn_conf), .subcs = (void const *) fr_trunk_config_connection, .subcs_size = sizeof(fr_trunk_config_connection) },
 	{ FR_CONF_POINTER("request", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) fr_trunk_config_request },
+	{ FR_CONF_POINTER("concurrency", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) fr_trunk_config_concurrency },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -621,6 +677,85 @@ do { \
 	} \
 } while(0)
 
+/** Find or create the budget shared by trunks with the same configuration
+ *
+ */
+static trunk_budget_t *trunk_budget_acquire(fr_trunk_conf_t const *conf)
+{
+	trunk_budget_t *budget = NULL;
+
+	pthread_mutex_lock(&trunk_budget_mutex);
+	if (!trunk_budgets_init) {
+		fr_dlist_init(&trunk_budgets, trunk_budget_t, entry);
+		trunk_budgets_init = true;
+	}
+
+	while ((budget = fr_dlist_next(&trunk_budgets, budget))) {
+		if (budget->conf == conf) break;
+	}
+
+	if (!budget) {
+		MEM(budget = talloc_zero(NULL, trunk_budget_t));
+		budget->conf = conf;
+		fr_dlist_insert_tail(&trunk_budgets, budget);
+	}
+	budget->refs++;
+	pthread_mutex_unlock(&trunk_budget_mutex);
+
+	return budget;
+}
+
+/** Drop a reference to a budget, freeing it if it's no longer used
+ *
+ * Must be called with #trunk_budget_mutex held.
+ */
+static void trunk_budget_unref(trunk_budget_t *budget)
+{
+	fr_assert(budget->refs > 0);
+
+	if (--budget->refs > 0) return;
+
+	fr_dlist_remove(&trunk_budgets, budget);
+	talloc_free(budget);
+}
+
+/** Reserve a connection slot in the trunk's budget
+ *
+ * Connections hold a reference to the budget, as they may be freed
+ * after the trunk that allocated them.
+ *
+ * @return
+ *	- true if the connection may be opened.
+ *	- false if the budget is exhausted.
+ */
+static bool trunk_budget_reserve(fr_trunk_t *trunk)
+{
+	trunk_budget_t	*budget = trunk->budget;
+	bool		ret = false;
+
+	pthread_mutex_lock(&trunk_budget_mutex);
+	if (budget->open < trunk->conf.max_total) {
+		budget->open++;
+		budget->refs++;
+		ret = true;
+	}
+	pthread_mutex_unlock(&trunk_budget_mutex);
+
+	return ret;
+}
+
+/** Return a connection slot to a budget
+ *
+ */
+static void trunk_budget_release(trunk_budget_t *budget)
+{
+	pthread_mutex_lock(&trunk_budget_mutex);
+	fr_assert(budget->open > 0);
+	budget->open--;
+	trunk_budget_unref(budget);
+	pthread_mutex_unlock(&trunk_budget_mutex);
+}
+
 /** Allocate a new connection
  *
  */
@@ -638,6 +773,7 @@ do { \
 	(_tconn)->pub.trunk->in_handler = _prev; \
 	if (!(_tconn)->pub.conn) { \
 		ERROR("Failed creating new connection"); \
+		if ((_tconn)->budget) trunk_budget_release((_tconn)->budget); \
 		talloc_free(tconn); \
 		return -1; \
 	} \
@@ -1078,6 +1214,43 @@ static void trunk_request_enter_partial(fr_trunk_request_t *treq)
 	REQUEST_STATE_TRANSITION(FR_TRUNK_REQUEST_STATE_PARTIAL);
 }
 
+/** Weight given to each new response time sample, as a shift (1/8)
+ *
+ */
+#define TRUNK_RTT_SHIFT	3
+
+/** Fold a response time sample into the connection's and the trunk's moving averages
+ *
+ * Uses the same exponentially weighted moving average as TCP's smoothed RTT,
+ * so a connection which suddenly slows down (i.e. a replica pausing for GC)
+ * is deprioritised within a few responses.
+ *
+ * @param[in] tconn	the response was received on.
+ * @param[in] rtt	time between the request being sent and completed.
+ */
+static inline void trunk_connection_rtt_update(fr_trunk_connection_t *tconn, fr_time_delta_t rtt)
+{
+	fr_trunk_t *trunk = tconn->pub.trunk;
+
+	if (rtt < 0) rtt = 0;
+
+	if (tconn->rtt_count++ == 0) {
+		tconn->pub.rtt = rtt;
+	} else {
+		tconn->pub.rtt += (rtt - tconn->pub.rtt) >> TRUNK_RTT_SHIFT;
+	}
+
+	if (trunk->pub.rtt_count++ == 0) {
+		trunk->pub.rtt = rtt;
+	} else {
+		trunk->pub.rtt += (rtt - trunk->pub.rtt) >> TRUNK_RTT_SHIFT;
+	}
+
+	fr_time_elapsed_update(&trunk->pub.rtt_elapsed, 0, rtt);
+
+	fr_limiter_sample(&trunk->limiter, rtt, trunk->pub.req_alloc);
+}
+
 /** Transition a request to the sent state, indicating that it's been sent in its entirety
  *
  * @note treq->tconn and treq may be inviable after calling
@@ -1113,6 +1286,7 @@ static void trunk_request_enter_sent(fr_trunk_request_t *treq)
 	 *	Update the connection's sent stats
 	 */
 	tconn->sent_count++;
+	treq->last_sent = fr_time();
 
 	/*
 	 *	Enforces max_uses
@@ -1323,6 +1497,15 @@ static void trunk_request_enter_complete(fr_trunk_request_t *treq)
 
 	switch (treq->pub.state) {
 	case FR_TRUNK_REQUEST_STATE_SENT:
+		/*
+		 *	Update the response time before the request
+		 *	is removed, so the connection is reordered
+		 *	using the new value.
+		 */
+		trunk_connection_rtt_update(tconn, fr_time() - treq->last_sent);
+		trunk_request_remove_from_conn(treq);
+		break;
+
 	case FR_TRUNK_REQUEST_STATE_PENDING:
 		trunk_request_remove_from_conn(treq);
 		break;
@@ -1866,6 +2049,8 @@ void fr_trunk_request_signal_complete(fr_trunk_request_t *treq)
 	 */
 	if (IN_REQUEST_DEMUX(trunk)) trunk->pub.last_read_success = fr_time();
 
+	FR_PROBE3(trunk_request_complete, treq, treq->pub.request ? treq->pub.request->number : 0, treq->last_sent);
+
 	switch (treq->pub.state) {
 	case FR_TRUNK_REQUEST_STATE_SENT:
 	case FR_TRUNK_REQUEST_STATE_PENDING:	/* Got immediate response, i.e. cached */
@@ -2108,28 +2293,13 @@ void fr_trunk_request_free(fr_trunk_request_t **treq_to_free)
 	if (fr_cond_assert(trunk->pub.req_alloc > 0)) trunk->pub.req_alloc--;
 
 	/*
-	 *	No cleanup delay, means cleanup immediately
+	 *	No cleanup delay, means cleanup immediately,
+	 *	unless we're keeping the request as one of
+	 *	the preallocated set.
 	 */
-	if (trunk->conf.req_cleanup_delay == 0) {
+	if ((trunk->conf.req_cleanup_delay == 0) &&
+	    (fr_dlist_num_elements(&trunk->free_requests) >= trunk->conf.req_prealloc)) {
 		treq->pub.state = FR_TRUNK_REQUEST_STATE_INIT;
-
-#ifndef NDEBUG
-		/*
-		 *	Ensure anything parented off the treq
-		 *	is freed.  We do this to trigger
-		 *	the destructors for the log entries.
-		 */
-		talloc_free_children(treq);
-
-		/*
-		 *	State log should now be empty as entries
-		 *	remove themselves from the dlist
-		 *	on free.
-		 */
-		fr_assert_msg(fr_dlist_num_elements(&treq->log) == 0,
-			      "Should have 0 remaining log entries, have %zu", fr_dlist_num_elements(&treq->log));
-#endif
-
 		talloc_free(treq);
 		return;
 	}
@@ -2140,31 +2310,27 @@ void fr_trunk_request_free(fr_trunk_request_t **treq_to_free)
 	 */
 	talloc_free_children(treq);
 
-#ifndef NDEBUG
-	/*
-	 *	State log should now be empty as entries
-	 *	remove themselves from the dlist
-	 *	on free.
-	 */
-	fr_assert_msg(fr_dlist_num_elements(&treq->log) == 0,
-		      "Should have 0 remaining log entries, have %zu", fr_dlist_num_elements(&treq->log));
-#endif
-
 	/*
 	 *
 	 *  Return the trunk request back to the init state.
+	 *
+	 *  The state log doesn't need to be cleared, as
+	 *  entries beyond log_count are never read.
 	 */
-	*treq = (fr_trunk_request_t){
-		.pub = {
-			.state = FR_TRUNK_REQUEST_STATE_INIT,
-			.trunk = treq->pub.trunk,
-		},
-		.cancel_reason = FR_TRUNK_CANCEL_REASON_NONE,
-		.last_freed = fr_time(),
+	treq->pub = (struct fr_trunk_request_pub_s){
+		.state = FR_TRUNK_REQUEST_STATE_INIT,
+		.trunk = trunk
+	};
+	treq->id = 0;
+	treq->heap_id = 0;
+	treq->cancel_reason = FR_TRUNK_CANCEL_REASON_NONE;
+	treq->last_freed = fr_time();
+	treq->last_sent = 0;
+	treq->bound_to_conn = false;
 #ifndef NDEBUG
-		.log = treq->log        /* Keep the list head, to save reinitialisation */
+	treq->log_start = 0;
+	treq->log_count = 0;
 #endif
-	};
 
 	/*
 	 *	Insert at the head, so that we can free
@@ -2196,6 +2362,28 @@ static int _trunk_request_free(fr_trunk_request_t *treq)
 	return 0;
 }
 
+/** Allocate memory for a new trunk request
+ *
+ */
+static fr_trunk_request_t *trunk_request_alloc_new(fr_trunk_t *trunk)
+{
+	fr_trunk_request_t *treq;
+
+	MEM(treq = talloc_pooled_object(trunk, fr_trunk_request_t,
+					trunk->conf.req_pool_headers, trunk->conf.req_pool_size));
+	talloc_set_destructor(treq, _trunk_request_free);
+
+	*treq = (fr_trunk_request_t){
+		.pub = {
+			.state = FR_TRUNK_REQUEST_STATE_INIT,
+			.trunk = trunk
+		},
+		.cancel_reason = FR_TRUNK_CANCEL_REASON_NONE
+	};
+
+	return treq;
+}
+
 /** (Pre-)Allocate a new trunk request
  *
  * If trunk->conf.req_pool_headers or trunk->conf.req_pool_size are not zero then the
@@ -2245,21 +2433,8 @@ fr_trunk_request_t *fr_trunk_request_alloc(fr_trunk_t *trunk, request_t *request
 		fr_assert(treq->last_freed > 0);
 		trunk->pub.req_alloc_reused++;
 	} else {
-		MEM(treq = talloc_pooled_object(trunk, fr_trunk_request_t,
-						trunk->conf.req_pool_headers, trunk->conf.req_pool_size));
-		talloc_set_destructor(treq, _trunk_request_free);
-
-		*treq = (fr_trunk_request_t){
-			.pub = {
-				.state = FR_TRUNK_REQUEST_STATE_INIT,
-				.trunk = trunk
-			},
-			.cancel_reason = FR_TRUNK_CANCEL_REASON_NONE
-		};
+		treq = trunk_request_alloc_new(trunk);
 		trunk->pub.req_alloc_new++;
-#ifndef NDEBUG
-		fr_dlist_init(&treq->log, fr_trunk_request_state_log_t, entry);
-#endif
 	}
 
 	trunk->pub.req_alloc++;
@@ -2343,7 +2518,20 @@ fr_trunk_enqueue_t fr_trunk_request_enqueue(fr_trunk_request_t **treq_out, fr_tr
 		if (fr_trunk_start(trunk) < 0) return FR_TRUNK_ENQUEUE_FAIL;
 	}
 
-	ret = trunk_request_check_enqueue(&tconn, trunk, request);
+	/*
+	 *	Response times show that the destination is already
+	 *	handling as many requests as it usefully can.  Fail
+	 *	now, rather than adding to its queue.
+	 */
+	if (!fr_limiter_allow(&trunk->limiter, trunk->pub.req_alloc - (*treq_out != NULL))) {
+		RATE_LIMIT_LOCAL_ROPTIONAL(&trunk->limit_concurrency_log,
+					   RWARN, WARN, "Refusing to enqueue requests - "
+					   "Concurrency limit of %u requests reached", fr_limiter_limit(&trunk->limiter));
+		ret = FR_TRUNK_ENQUEUE_NO_CAPACITY;
+	} else {
+		ret = trunk_request_check_enqueue(&tconn, trunk, request);
+	}
+
 	switch (ret) {
 	case FR_TRUNK_ENQUEUE_OK:
 		if (*treq_out) {
@@ -2390,6 +2578,8 @@ fr_trunk_enqueue_t fr_trunk_request_enqueue(fr_trunk_request_t **treq_out, fr_tr
 		return ret;
 	}
 
+	FR_PROBE3(trunk_request_enqueue, treq, request ? request->number : 0, ret);
+
 	return ret;
 }
 
@@ -2519,30 +2709,23 @@ fr_trunk_enqueue_t fr_trunk_request_enqueue_on_conn(fr_trunk_request_t **treq_ou
 /** Used for sanity checks to ensure all log entries have been freed
  *
  */
-static int _state_log_entry_free(fr_trunk_request_state_log_t *slog)
-{
-	fr_dlist_remove(slog->log_head, slog);
-
-	return 0;
-}
-
 void trunk_request_state_log_entry_add(char const *function, int line,
 				       fr_trunk_request_t *treq, fr_trunk_request_state_t new)
 {
-	fr_trunk_request_state_log_t	*slog = NULL;
-
-	if (fr_dlist_num_elements(&treq->log) >= FR_TRUNK_REQUEST_STATE_LOG_MAX) {
-		slog = fr_dlist_head(&treq->log);
-		fr_assert_msg(slog, "slog list head NULL but element counter was %zu",
-			      fr_dlist_num_elements(&treq->log));
-		(void)fr_dlist_remove(&treq->log, slog);	/* Returns NULL when removing the list head */
-		memset(slog, 0, sizeof(*slog));
+	fr_trunk_request_state_log_t	*slog;
+
+	/*
+	 *	Once the ring is full, overwrite
+	 *	the oldest entry.
+	 */
+	slog = &treq->log[(treq->log_start + treq->log_count) % FR_TRUNK_REQUEST_STATE_LOG_MAX];
+	if (treq->log_count < FR_TRUNK_REQUEST_STATE_LOG_MAX) {
+		treq->log_count++;
 	} else {
-		MEM(slog = talloc_zero(treq, fr_trunk_request_state_log_t));
-		talloc_set_destructor(slog, _state_log_entry_free);
+		treq->log_start = (treq->log_start + 1) % FR_TRUNK_REQUEST_STATE_LOG_MAX;
 	}
+	memset(slog, 0, sizeof(*slog));
 
-	slog->log_head = &treq->log;
 	slog->from = treq->pub.state;
 	slog->to = new;
 	slog->function = function;
@@ -2552,21 +2735,17 @@ void trunk_request_state_log_entry_add(char const *function, int line,
 		slog->tconn_id = treq->pub.tconn->pub.conn->id;
 		slog->tconn_state = treq->pub.tconn->pub.state;
 	}
-
-	fr_dlist_insert_tail(&treq->log, slog);
-
 }
 
 void fr_trunk_request_state_log(fr_log_t const *log, fr_log_type_t log_type, char const *file, int line,
 				fr_trunk_request_t const *treq)
 {
-	fr_trunk_request_state_log_t	*slog = NULL;
+	fr_trunk_request_state_log_t	const *slog;
 
-	int i;
+	unsigned int i;
 
-	for (slog = fr_dlist_head(&treq->log), i = 0;
-	     slog;
-	     slog = fr_dlist_next(&treq->log, slog), i++) {
+	for (i = 0; i < treq->log_count; i++) {
+		slog = &treq->log[(treq->log_start + i) % FR_TRUNK_REQUEST_STATE_LOG_MAX];
 		fr_log(log, log_type, file, line, "[%u] %s:%i - in conn %"PRIu64" in state %s - %s -> %s",
 		       i, slog->function, slog->line,
 		       slog->tconn_id,
@@ -3452,6 +3631,11 @@ static int _trunk_connection_free(fr_trunk_connection_t *tconn)
 	(void)talloc_free(tconn->pub.conn);
 	tconn->pub.conn = NULL;
 
+	if (tconn->budget) {
+		trunk_budget_release(tconn->budget);
+		tconn->budget = NULL;
+	}
+
 	return 0;
 }
 
@@ -3462,11 +3646,25 @@ static int _trunk_connection_free(fr_trunk_connection_t *tconn)
  *
  * @param[in] trunk	to spawn connection in.
  * @param[in] now	The current time.
+ * @return
+ *	- 0 on success.
+ *	- 1 if the trunk's connection budget is exhausted.
+ *	- -1 on failure.
  */
 static int trunk_connection_spawn(fr_trunk_t *trunk, fr_time_t now)
 {
 	fr_trunk_connection_t	*tconn;
 
+	/*
+	 *	Other trunks sharing our budget may
+	 *	already hold all the connections
+	 *	we're allowed.
+	 */
+	if (trunk->budget && !trunk_budget_reserve(trunk)) {
+		DEBUG3("Not opening connection - All %u connections allowed by max_total are in use",
+		       trunk->conf.max_total);
+		return 1;
+	}
 
 	/*
 	 *	Call the API client's callback to create
@@ -3476,6 +3674,7 @@ static int trunk_connection_spawn(fr_trunk_t *trunk, fr_time_t now)
 	tconn->pub.trunk = trunk;
 	tconn->pub.state = FR_TRUNK_CONN_HALTED;	/* All connections start in the halted state */
 	tconn->heap_id = -1;	/* Helps with asserts */
+	tconn->budget = trunk->budget;
 
 	/*
 	 *	Allocate a new fr_connection_t or fail.
@@ -3590,6 +3789,9 @@ int fr_trunk_connection_pop_cancellation(fr_trunk_request_t **treq_out, fr_trunk
  *
  * - #fr_trunk_request_signal_sent Successfully sent a request.
  *
+ * Pending requests whose deadline has already passed are failed here,
+ * and never returned to the muxer.
+ *
  * @param[out] treq_out	to process
  * @param[in] tconn	to pop a request from.
  * @return
@@ -3607,10 +3809,25 @@ int fr_trunk_connection_pop_request(fr_trunk_request_t **treq_out, fr_trunk_conn
 				"%s can only be called from within request_mux handler",
 				__FUNCTION__)) return -2;
 
-	*treq_out = tconn->partial ? tconn->partial : fr_heap_peek(tconn->pending);
-	if (!*treq_out) return 1;
+	if (tconn->partial) {
+		*treq_out = tconn->partial;
+		return 0;
+	}
 
-	return 0;
+	/*
+	 *	Don't bother sending requests the client has
+	 *	already given up on.
+	 */
+	while ((*treq_out = fr_heap_peek(tconn->pending))) {
+		request_t *request = (*treq_out)->pub.request;
+
+		if (!request || !request_expired(request)) return 0;
+
+		RDEBUG2("Request deadline passed before it could be sent, failing it");
+		trunk_request_enter_failed(*treq_out);
+	}
+
+	return 1;
 }
 
 /** Signal that a trunk connection is writable
@@ -3858,7 +4075,8 @@ static void trunk_manage(fr_trunk_t *trunk, fr_time_t now)
 	 *	Cleanup requests in our request cache which
 	 *	have been idle for too long.
 	 */
-	while ((treq = fr_dlist_tail(&trunk->free_requests)) &&
+	while ((fr_dlist_num_elements(&trunk->free_requests) > trunk->conf.req_prealloc) &&
+	       (treq = fr_dlist_tail(&trunk->free_requests)) &&
 	       ((treq->last_freed + trunk->conf.req_cleanup_delay) <= now)) talloc_free(treq);
 
 	/*
@@ -4395,8 +4613,12 @@ int fr_trunk_start(fr_trunk_t *trunk)
 	 *	Spawn the initial set of connections
 	 */
 	for (i = 0; i < trunk->conf.start; i++) {
+		int ret;
+
 		DEBUG("[%i] Starting initial connection", i);
-		if (trunk_connection_spawn(trunk, fr_time()) != 0) return -1;
+		ret = trunk_connection_spawn(trunk, fr_time());
+		if (ret < 0) return -1;
+		if (ret > 0) break;	/* Other trunks hold the rest of the budget */
 	}
 
 	if (trunk->conf.manage_interval > 0) {
@@ -4468,6 +4690,35 @@ static int8_t _trunk_connection_order_by_shortest_queue(void const *one, void co
 	return 0;
 }
 
+/** Order connections by the expected latency of a new request
+ *
+ * The expected latency is the connection's average response time
+ * multiplied by the number of requests which would be outstanding on it.
+ * Connections which haven't completed any requests yet are assumed to
+ * perform like the average connection in the trunk.
+ */
+static int8_t _trunk_connection_order_by_expected_latency(void const *one, void const *two)
+{
+	fr_trunk_connection_t	const *a = talloc_get_type_abort_const(one, fr_trunk_connection_t);
+	fr_trunk_connection_t	const *b = talloc_get_type_abort_const(two, fr_trunk_connection_t);
+	fr_trunk_t		const *trunk = a->pub.trunk;
+	uint64_t		a_rtt, b_rtt, a_cost, b_cost;
+
+	a_rtt = a->rtt_count ? a->pub.rtt : trunk->pub.rtt;
+	b_rtt = b->rtt_count ? b->pub.rtt : trunk->pub.rtt;
+
+	/*
+	 *	Nothing to go on yet, fall back
+	 *	to comparing queue lengths.
+	 */
+	if (!a_rtt || !b_rtt) return _trunk_connection_order_by_shortest_queue(one, two);
+
+	a_cost = (fr_trunk_request_count_by_connection(a, FR_TRUNK_REQUEST_STATE_ALL) + 1) * a_rtt;
+	b_cost = (fr_trunk_request_count_by_connection(b, FR_TRUNK_REQUEST_STATE_ALL) + 1) * b_rtt;
+
+	return CMP(a_cost, b_cost);
+}
+
 /** Free a trunk, gracefully closing all connections.
  *
  */
@@ -4480,6 +4731,8 @@ static int _trunk_free(fr_trunk_t *trunk)
 
 	trunk->freeing = true;	/* Prevent re-enqueuing */
 
+	TALLOC_FREE(trunk->metrics);
+
 	/*
 	 *	We really don't want this firing after
 	 *	we've freed everything.
@@ -4517,9 +4770,57 @@ static int _trunk_free(fr_trunk_t *trunk)
 	 */
 	while ((treq = fr_dlist_head(&trunk->free_requests))) talloc_free(treq);
 
+	/*
+	 *	Connections we couldn't free yet keep
+	 *	their own reference to the budget.
+	 */
+	if (trunk->budget) {
+		pthread_mutex_lock(&trunk_budget_mutex);
+		trunk_budget_unref(trunk->budget);
+		pthread_mutex_unlock(&trunk_budget_mutex);
+		trunk->budget = NULL;
+	}
+
 	return 0;
 }
 
+static fr_metric_def_t const trunk_metrics[] = {
+	{ .name = "requests", .help = "Requests allocated.", .type = FR_METRIC_COUNTER },
+	{ .name = "responses", .help = "Responses received.", .type = FR_METRIC_COUNTER },
+	{ .name = "outstanding", .help = "Requests allocated, and not yet freed.", .type = FR_METRIC_GAUGE },
+	{ .name = "backlog", .help = "Requests waiting for a connection.", .type = FR_METRIC_GAUGE },
+	{ .name = "connections", .help = "Connections which can accept requests.", .type = FR_METRIC_GAUGE },
+	{ .name = "rtt_seconds", .help = "Moving average of the time between requests being sent and completed.",
+	  .type = FR_METRIC_GAUGE, .nsec = true },
+	{ .name = "limited", .help = "Requests refused by the adaptive concurrency limit.", .type = FR_METRIC_COUNTER },
+	{ .name = "concurrency_limit", .help = "Current adaptive limit on outstanding requests.", .type = FR_METRIC_GAUGE },
+	{ .name = "response_seconds", .help = "Time between requests being sent and completed.", .type = FR_METRIC_HISTOGRAM },
+};
+
+static void trunk_metrics_snapshot(uint64_t *values, void const *uctx)
+{
+	fr_trunk_t const *trunk = uctx;
+
+	values[0] = trunk->pub.req_alloc_new + trunk->pub.req_alloc_reused;
+	values[1] = trunk->pub.rtt_count;
+	values[2] = trunk->pub.req_alloc;
+	values[3] = fr_heap_num_elements(trunk->backlog);
+	values[4] = fr_heap_num_elements(trunk->active);
+	values[5] = trunk->pub.rtt;
+	values[6] = trunk->limiter.rejected;
+	values[7] = fr_limiter_limit(&trunk->limiter);
+	memcpy(values + 8, trunk->pub.rtt_elapsed.array, sizeof(trunk->pub.rtt_elapsed.array));
+}
+
+static fr_metrics_class_t const trunk_metrics_class = {
+	.name = "trunk",
+	.defs = trunk_metrics,
+	.num_defs = NUM_ELEMENTS(trunk_metrics),
+	.snapshot = trunk_metrics_snapshot
+};
+
+static atomic_uint trunk_instance;
+
 /** Allocate a new collection of connections
  *
  * This function should be called first to allocate a new trunk connection.
@@ -4563,11 +4864,20 @@ fr_trunk_t *fr_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
 
 	memcpy(&trunk->funcs, funcs, sizeof(trunk->funcs));
 	if (!trunk->funcs.connection_prioritise) {
-		trunk->funcs.connection_prioritise = _trunk_connection_order_by_shortest_queue;
+		trunk->funcs.connection_prioritise = conf->least_latency ?
+						     _trunk_connection_order_by_expected_latency :
+						     _trunk_connection_order_by_shortest_queue;
 	}
 	if (!trunk->funcs.request_prioritise) trunk->funcs.request_prioritise = fr_pointer_cmp;
 
 	memcpy(&trunk->conf, conf, sizeof(trunk->conf));
+	fr_limiter_init(&trunk->limiter, &trunk->conf.concurrency);
+
+	/*
+	 *	Trunks allocated with the same configuration
+	 *	share a limit on the number of connections.
+	 */
+	if (conf->max_total) trunk->budget = trunk_budget_acquire(conf);
 
 	memcpy(&trunk->uctx, &uctx, sizeof(trunk->uctx));
 	talloc_set_destructor(trunk, _trunk_free);
@@ -4577,6 +4887,29 @@ fr_trunk_t *fr_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
 	 */
 	fr_dlist_talloc_init(&trunk->free_requests, fr_trunk_request_t, entry);
 
+	/*
+	 *	Fill the request cache up front, so
+	 *	steady state operation doesn't need
+	 *	to allocate requests.
+	 */
+	if (trunk->conf.req_prealloc > 0) {
+		uint32_t	i, prealloc = trunk->conf.req_prealloc;
+		fr_time_t	now = fr_time();
+
+		if (trunk->conf.max_req_per_conn && trunk->conf.max &&
+		    (prealloc > ((uint64_t)trunk->conf.max_req_per_conn * trunk->conf.max))) {
+			prealloc = trunk->conf.max_req_per_conn * trunk->conf.max;
+		}
+		trunk->conf.req_prealloc = prealloc;
+
+		for (i = 0; i < prealloc; i++) {
+			fr_trunk_request_t *treq = trunk_request_alloc_new(trunk);
+
+			treq->last_freed = now;
+			fr_dlist_insert_tail(&trunk->free_requests, treq);
+		}
+	}
+
 	/*
 	 *	Request backlog queue
 	 */
@@ -4598,6 +4931,18 @@ fr_trunk_t *fr_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
 	fr_dlist_talloc_init(&trunk->draining_to_free, fr_trunk_connection_t, entry);
 	fr_dlist_talloc_init(&trunk->to_free, fr_trunk_connection_t, entry);
 
+	/*
+	 *	Trunks with the same name run in each worker,
+	 *	so they're told apart with a unique number.
+	 */
+	{
+		char instance[20];
+
+		snprintf(instance, sizeof(instance), "%u", atomic_fetch_add(&trunk_instance, 1));
+		MEM(trunk->metrics = fr_metrics_source_add(trunk, &trunk_metrics_class, trunk,
+							   "trunk", trunk->log_prefix, "instance", instance, NULL));
+	}
+
 	DEBUG4("Trunk allocated %p", trunk);
 
 	if (!delay_start) {
@@ -29,6 +29,7 @@ RCSIDH(server_trunk_h, "$Id$")
 #include <freeradius-devel/server/connection.h>
 #include <freeradius-devel/server/request.h>
 #include <freeradius-devel/server/cf_parse.h>
+#include <freeradius-devel/util/limiter.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -199,6 +200,13 @@ typedef struct {
 
 	uint16_t		max;			//!< Maximum number of connections in the trunk.
 
+	uint16_t		max_total;		//!< Maximum number of connections across all trunks
+							///< allocated with this configuration, i.e. across all
+							///< worker threads.  0 means no limit.
+
+	bool			least_latency;		//!< Place requests on the connection with the lowest
+							///< expected latency, instead of the shortest queue.
+
 	uint16_t		connecting;		//!< Maximum number of connections that can be in the
 							///< connecting state.  Used to throttle connection spawning.
 
@@ -233,6 +241,10 @@ typedef struct {
 
 	size_t			req_pool_size;		//!< The size of the talloc pool allocated with the treq.
 
+	uint32_t		req_prealloc;		//!< How many requests to allocate when the trunk is
+							///< allocated.  These are kept in the request cache,
+							///< and not freed by the cleanup delay.
+
 	bool			always_writable;	//!< Set to true if our ability to write requests to
 							///< a connection handle is not dependant on the state
 							///< of the underlying connection, i.e. if the library
@@ -246,6 +258,9 @@ typedef struct {
 	bool			backlog_on_failed_conn;	//!< Assign requests to the backlog when there are no
 							//!< available connections and the last connection event
 							//!< was a failure, instead of failing them immediately.
+
+	fr_limiter_conf_t	concurrency;		//!< Adaptive limit on the number of outstanding
+							///< requests, sized from the response times.
 } fr_trunk_conf_t;
 
 /** Public fields for the trunk
@@ -289,6 +304,14 @@ struct fr_trunk_pub_s {
 	uint64_t _CONST		req_alloc_new;		//!< How many requests we've allocated.
 
 	uint64_t _CONST		req_alloc_reused;	//!< How many requests were reused.
+
+	fr_time_delta_t _CONST	rtt;			//!< Moving average of the time between requests
+							///< being sent and completed, across all connections.
+
+	uint64_t _CONST		rtt_count;		//!< The number of responses used to calculate rtt.
+
+	fr_time_elapsed_t _CONST rtt_elapsed;		//!< Histogram of the time between requests being
+							///< sent and completed.
 	/** @} */
 
 	bool _CONST		triggers;		//!< do we run the triggers?
@@ -330,6 +353,9 @@ struct fr_trunk_connection_pub_s {
 	fr_connection_t		* _CONST conn;		//!< The underlying connection.
 
 	fr_trunk_t		* _CONST trunk;		//!< Trunk this connection belongs to.
+
+	fr_time_delta_t _CONST	rtt;			//!< Moving average of the time between requests
+							///< being sent and completed on this connection.
 };
 
 /** Config parser definitions to populate a fr_trunk_conf_t
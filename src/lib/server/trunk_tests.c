@@ -1828,6 +1828,83 @@ static void test_enqueue_and_io_speed(void)
 
 	talloc_free(ctx);
 }
+
+/*
+ *	Measure steady state throughput, where every request
+ *	comes from the preallocated request cache.
+ */
+static void test_enqueue_and_complete_prealloc_speed(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_trunk_t		*trunk;
+	fr_event_list_t		*el;
+	fr_trunk_conf_t		conf = {
+					.start = 1,
+					.min = 1,
+					.max = 0,
+					.max_req_per_conn = 0,
+					.target_req_per_conn = 0,	/* One request per connection */
+					.req_pool_headers = 1,
+					.req_pool_size = sizeof(test_proto_request_t),
+					.req_prealloc = 10000,
+					.manage_interval = NSEC * 0.5
+				};
+	size_t			i, round, rounds = 10, requests = 10000;
+	fr_time_t		start, stop;
+	fr_time_delta_t		total_time;
+	test_proto_stats_t	stats;
+
+	DEBUG_LVL_SET;
+
+	el = fr_event_list_alloc(ctx, NULL, NULL);
+	fr_event_list_set_time_func(el, test_time);
+
+	test_time_base += NSEC * 0.5;	/* Need to provide a timer starting value above zero */
+
+	memset(&stats, 0, sizeof(stats));
+	trunk = test_setup_trunk(ctx, el, &conf, true, &stats);
+
+	/*
+	 *	Open the connections
+	 */
+	fr_event_corral(el, test_time_base, false);
+	fr_event_service(el);
+
+	TEST_CASE("Enqueue and complete requests");
+	start = fr_time();
+	for (round = 0; round < rounds; round++) {
+		for (i = 0; i < requests; i++) {
+			fr_trunk_request_t	*treq;
+			test_proto_request_t	*preq = NULL;
+
+			treq = fr_trunk_request_alloc(trunk, NULL);
+			preq = talloc_zero(treq, test_proto_request_t);
+			preq->treq = treq;
+			fr_trunk_request_enqueue(&treq, trunk, NULL, preq, NULL);
+		}
+
+		while (fr_event_corral(el, test_time_base, false)) fr_event_service(el);
+	}
+	stop = fr_time();
+	total_time = stop - start;
+
+	if (test_verbose_level_ >= 1) {
+		INFO("Total time %pV (%u rps) (%"PRIu64"/%"PRIu64")",
+		     fr_box_time_delta(total_time),
+		     (uint32_t)((requests * rounds) / ((float)total_time / NSEC)),
+		     trunk->pub.req_alloc_new, trunk->pub.req_alloc_reused);
+	}
+
+	TEST_CHECK(stats.completed == (requests * rounds));
+	TEST_CHECK(stats.failed == 0);
+	TEST_CHECK(stats.freed == (requests * rounds));
+
+	TEST_CASE("No requests allocated after the trunk was");
+	TEST_CHECK(trunk->pub.req_alloc_new == 0);
+	TEST_CHECK(trunk->pub.req_alloc_reused == (requests * rounds));
+
+	talloc_free(ctx);
+}
 #endif
 
 /*
@@ -1871,6 +1948,7 @@ TEST_LIST = {
 	 *	Performance tests
 	 */
 	{ "Speed Test - Enqueue, and I/O",		test_enqueue_and_io_speed },
+	{ "Speed Test - Enqueue and complete, preallocated", test_enqueue_and_complete_prealloc_speed },
 #endif
 	{ NULL }
 };
@@ -32,6 +32,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/dl_module.h>
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/server/cond.h>
+#include <freeradius-devel/server/cond_eval.h>
 #include <freeradius-devel/server/protocol.h>
 #include <freeradius-devel/server/process.h>
 #include <freeradius-devel/server/virtual_servers.h>
@@ -777,6 +778,16 @@ int virtual_servers_instantiate(void)
 		return -1;
 	}
 
+	if (fr_command_register_hook(NULL, NULL, NULL, cond_cmd_table) < 0) {
+		PERROR("Failed registering radmin commands for conditions");
+		return -1;
+	}
+
+	if (fr_command_register_hook(NULL, NULL, NULL, unlang_cmd_table) < 0) {
+		PERROR("Failed registering radmin commands for the interpreter");
+		return -1;
+	}
+
 	for (i = 0; i < server_cnt; i++) {
 		fr_virtual_listen_t	**listener;
 		size_t			j, listen_cnt;
@@ -1440,6 +1451,7 @@ int virtual_server_compile_sections(CONF_SECTION *server, virtual_server_compile
 {
 	int i, found;
 	CONF_SECTION *subcs = NULL;
+	fr_time_t start = fr_time();
 
 	found = 0;
 
@@ -1543,6 +1555,9 @@ int virtual_server_compile_sections(CONF_SECTION *server, virtual_server_compile
 		}
 	}
 
+	DEBUG2("Compiled %d section(s) of %s %s { ... } in %pVs", found,
+	       cf_section_name1(server), cf_section_name2(server), fr_box_time_delta(fr_time() - start));
+
 	return found;
 }
 
@@ -29,11 +29,13 @@
 #define MILENAGE_MAC_A_SIZE	8
 #define MILENAGE_MAC_S_SIZE	8
 
-static inline int aes_128_encrypt_block(EVP_CIPHER_CTX *evp_ctx,
-					uint8_t const key[16], uint8_t const in[16], uint8_t out[16])
+/** Expand a key into an AES-128-ECB context
+ *
+ * The context can then be used to encrypt any number of blocks
+ * with #aes_128_encrypt_blocks, without expanding the key again.
+ */
+static inline int aes_128_ecb_init(EVP_CIPHER_CTX *evp_ctx, uint8_t const key[16])
 {
-	size_t len;
-
 	if (unlikely(EVP_EncryptInit_ex(evp_ctx, EVP_aes_128_ecb(), NULL, key, NULL) != 1)) {
 		fr_tls_log_strerror_printf("Failed initialising AES-128-ECB context");
 		return -1;
@@ -50,8 +52,25 @@ static inline int aes_128_encrypt_block(EVP_CIPHER_CTX *evp_ctx,
 	 *	when decrypting.
 	 */
 	EVP_CIPHER_CTX_set_padding(evp_ctx, 0);
-	if (unlikely(EVP_EncryptUpdate(evp_ctx, out, (int *)&len, in, 16) != 1) ||
-	    unlikely(EVP_EncryptFinal_ex(evp_ctx, out + len, (int *)&len) != 1)) {
+
+	return 0;
+}
+
+/** Encrypt one or more 16 byte blocks
+ *
+ * Blocks passed in one call are independent in ECB mode, so OpenSSL's
+ * AES-NI code can interleave them, which is several times faster than
+ * encrypting them one at a time.
+ *
+ * As there's no padding, all of the output is produced by EVP_EncryptUpdate,
+ * and the context can be reused for the next call.
+ */
+static inline int aes_128_encrypt_blocks(EVP_CIPHER_CTX *evp_ctx, uint8_t const *in, uint8_t *out, size_t num)
+{
+	int len;
+
+	if (unlikely(EVP_EncryptUpdate(evp_ctx, out, &len, in, (int)(num * 16)) != 1) ||
+	    unlikely((size_t)len != (num * 16))) {
 		fr_tls_log_strerror_printf("Failed encrypting data");
 		return -1;
 	}
@@ -59,6 +78,37 @@ static inline int aes_128_encrypt_block(EVP_CIPHER_CTX *evp_ctx,
 	return 0;
 }
 
+static inline int aes_128_encrypt_block(EVP_CIPHER_CTX *evp_ctx,
+					uint8_t const key[16], uint8_t const in[16], uint8_t out[16])
+{
+	if (aes_128_ecb_init(evp_ctx, key) < 0) return -1;
+
+	return aes_128_encrypt_blocks(evp_ctx, in, out, 1);
+}
+
+/** Build the inputs for f2 and f5, f3, and f4
+ *
+ * @param[out] in	Three blocks, for f2 and f5 (which share an output), f3 and f4.
+ * @param[in] temp	TEMP = E_K(RAND XOR OP_C).
+ * @param[in] opc	128-bit value derived from OP and K.
+ */
+static inline void milenage_f234_input(uint8_t in[3][16], uint8_t const temp[16], uint8_t const opc[16])
+{
+	int i;
+
+	/* rotate by r2 (= 0, i.e., NOP) */
+	for (i = 0; i < 16; i++) in[0][i] = temp[i] ^ opc[i];
+	in[0][15] ^= 1; /* XOR c2 (= ..01) */
+
+	/* rotate by r3 = 0x20 = 4 bytes */
+	for (i = 0; i < 16; i++) in[1][(i + 12) % 16] = temp[i] ^ opc[i];
+	in[1][15] ^= 2; /* XOR c3 (= ..02) */
+
+	/* rotate by r4 = 0x40 = 8 bytes */
+	for (i = 0; i < 16; i++) in[2][(i + 8) % 16] = temp[i] ^ opc[i];
+	in[2][15] ^= 4; /* XOR c4 (= ..04) */
+}
+
 /** milenage_f1 - Milenage f1 and f1* algorithms
  *
  * @param[in] opc	128-bit value derived from OP and K.
@@ -93,7 +143,7 @@ static int milenage_f1(uint8_t mac_a[MILENAGE_MAC_A_SIZE],
 		return -1;
 	}
 
- 	if (aes_128_encrypt_block(evp_ctx, k, tmp1, tmp1) < 0) {
+ 	if ((aes_128_ecb_init(evp_ctx, k) < 0) || (aes_128_encrypt_blocks(evp_ctx, tmp1, tmp1, 1) < 0)) {
  	error:
 		EVP_CIPHER_CTX_free(evp_ctx);
 		return -1;
@@ -120,7 +170,7 @@ static int milenage_f1(uint8_t mac_a[MILENAGE_MAC_A_SIZE],
 	/*
 	 *	f1 || f1* = E_K(tmp3) XOR OP_c
 	 */
- 	if (aes_128_encrypt_block(evp_ctx, k, tmp3, tmp1) < 0) goto error; /* Reuses existing key */
+ 	if (aes_128_encrypt_blocks(evp_ctx, tmp3, tmp1, 1) < 0) goto error; /* Reuses existing key */
 
 	for (i = 0; i < 16; i++) tmp1[i] ^= opc[i];
 
@@ -168,7 +218,7 @@ static int milenage_f2345(uint8_t res[MILENAGE_RES_SIZE],
 		return -1;
 	}
 
-	if (aes_128_encrypt_block(evp_ctx, k, tmp1, tmp2) < 0) {
+	if ((aes_128_ecb_init(evp_ctx, k) < 0) || (aes_128_encrypt_blocks(evp_ctx, tmp1, tmp2, 1) < 0)) {
 	error:
 		EVP_CIPHER_CTX_free(evp_ctx);
 		return -1;
@@ -185,7 +235,7 @@ static int milenage_f2345(uint8_t res[MILENAGE_RES_SIZE],
 	tmp1[15] ^= 1; /* XOR c2 (= ..01) */
 	/* f5 || f2 = E_K(tmp1) XOR OP_c */
 
-	if (aes_128_encrypt_block(evp_ctx, k, tmp1, tmp3) < 0) goto error;
+	if (aes_128_encrypt_blocks(evp_ctx, tmp1, tmp3, 1) < 0) goto error;
 
 	for (i = 0; i < 16; i++) tmp3[i] ^= opc[i];
 	if (res) memcpy(res, tmp3 + 8, 8); /* f2 */
@@ -197,7 +247,7 @@ static int milenage_f2345(uint8_t res[MILENAGE_RES_SIZE],
 		for (i = 0; i < 16; i++) tmp1[(i + 12) % 16] = tmp2[i] ^ opc[i];
 		tmp1[15] ^= 2; /* XOR c3 (= ..02) */
 
-		if (aes_128_encrypt_block(evp_ctx, k, tmp1, ck) < 0) goto error;
+		if (aes_128_encrypt_blocks(evp_ctx, tmp1, ck, 1) < 0) goto error;
 
 		for (i = 0; i < 16; i++) ck[i] ^= opc[i];
 	}
@@ -208,7 +258,7 @@ static int milenage_f2345(uint8_t res[MILENAGE_RES_SIZE],
 		for (i = 0; i < 16; i++) tmp1[(i + 8) % 16] = tmp2[i] ^ opc[i];
 		tmp1[15] ^= 4; /* XOR c4 (= ..04) */
 
-		if (aes_128_encrypt_block(evp_ctx, k, tmp1, ik) < 0) goto error;
+		if (aes_128_encrypt_blocks(evp_ctx, tmp1, ik, 1) < 0) goto error;
 
 		for (i = 0; i < 16; i++) ik[i] ^= opc[i];
 	}
@@ -219,7 +269,7 @@ static int milenage_f2345(uint8_t res[MILENAGE_RES_SIZE],
 		for (i = 0; i < 16; i++) tmp1[(i + 4) % 16] = tmp2[i] ^ opc[i];
 		tmp1[15] ^= 8; /* XOR c5 (= ..08) */
 
-		if (aes_128_encrypt_block(evp_ctx, k, tmp1, tmp1) < 0) goto error;
+		if (aes_128_encrypt_blocks(evp_ctx, tmp1, tmp1, 1) < 0) goto error;
 
 		for (i = 0; i < 6; i++) ak_resync[i] = tmp1[i] ^ opc[i];
 	}
@@ -261,6 +311,96 @@ int milenage_opc_generate(uint8_t opc[MILENAGE_OPC_SIZE],
  	return 0;
 }
 
+/** Generate multiple AKA quintuplets for one subscriber
+ *
+ * The subscriber key is expanded once, and the AES operations for all of
+ * the vectors are done together, two batches in total, which lets OpenSSL
+ * use AES-NI on several blocks in parallel.
+ *
+ * @param[in,out] vectors	rand and sqn are read from each vector, the other
+ *				fields are written.
+ * @param[in] num		Number of vectors.  At most #MILENAGE_VECTORS_MAX.
+ * @param[in] opc		128-bit operator variant algorithm configuration field (encr.).
+ * @param[in] amf		16-bit authentication management field.
+ * @param[in] ki		128-bit subscriber key.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int milenage_umts_generate_multi(milenage_umts_vector_t *vectors, size_t num,
+				 uint8_t const opc[MILENAGE_OPC_SIZE],
+				 uint8_t const amf[MILENAGE_AMF_SIZE],
+				 uint8_t const ki[MILENAGE_KI_SIZE])
+{
+	uint8_t		temp[MILENAGE_VECTORS_MAX][16];
+	uint8_t		in[MILENAGE_VECTORS_MAX][4][16];	/* f1, f2 and f5, f3, f4 */
+	uint8_t		out[MILENAGE_VECTORS_MAX][4][16];
+	EVP_CIPHER_CTX	*evp_ctx;
+	size_t		i, j, k;
+
+	if (num > MILENAGE_VECTORS_MAX) {
+		fr_strerror_printf("Too many vectors, expected <= %u, got %zu", MILENAGE_VECTORS_MAX, num);
+		return -1;
+	}
+
+	evp_ctx = EVP_CIPHER_CTX_new();
+	if (!evp_ctx) {
+		fr_tls_log_strerror_printf("Failed allocating EVP context");
+		return -1;
+	}
+
+	/* TEMP = E_K(RAND XOR OP_C) */
+	for (i = 0; i < num; i++) for (j = 0; j < 16; j++) temp[i][j] = vectors[i].rand[j] ^ opc[j];
+
+	if ((aes_128_ecb_init(evp_ctx, ki) < 0) || (aes_128_encrypt_blocks(evp_ctx, temp[0], temp[0], num) < 0)) {
+	error:
+		EVP_CIPHER_CTX_free(evp_ctx);
+		return -1;
+	}
+
+	for (i = 0; i < num; i++) {
+		uint8_t in1[16];
+
+		/* IN1 = SQN || AMF || SQN || AMF */
+		uint48_to_buff(in1, vectors[i].sqn);
+		memcpy(in1 + 6, amf, 2);
+		memcpy(in1 + 8, in1, 8);
+
+		/* f1 = E_K(TEMP XOR rot(IN1 XOR OP_C, r1) XOR c1), r1 = 8 bytes, c1 = 0 */
+		for (j = 0; j < 16; j++) in[i][0][(j + 8) % 16] = in1[j] ^ opc[j];
+		for (j = 0; j < 16; j++) in[i][0][j] ^= temp[i][j];
+
+		milenage_f234_input(&in[i][1], temp[i], opc);
+	}
+
+	if (aes_128_encrypt_blocks(evp_ctx, in[0][0], out[0][0], num * 4) < 0) goto error;
+	EVP_CIPHER_CTX_free(evp_ctx);
+
+	for (i = 0; i < num; i++) {
+		milenage_umts_vector_t	*v = &vectors[i];
+		uint8_t			*p = v->autn;
+		uint8_t			sqn_buff[MILENAGE_SQN_SIZE];
+
+		for (k = 0; k < 4; k++) for (j = 0; j < 16; j++) out[i][k][j] ^= opc[j];
+
+		memcpy(v->res, out[i][1] + 8, MILENAGE_RES_SIZE);	/* f2 */
+		memcpy(v->ak, out[i][1], MILENAGE_AK_SIZE);		/* f5 */
+		memcpy(v->ck, out[i][2], MILENAGE_CK_SIZE);		/* f3 */
+		memcpy(v->ik, out[i][3], MILENAGE_IK_SIZE);		/* f4 */
+
+		/*
+		 *	AUTN = (SQN ^ AK) || AMF || MAC_A
+		 */
+		uint48_to_buff(sqn_buff, v->sqn);
+		for (j = 0; j < sizeof(sqn_buff); j++) *p++ = sqn_buff[j] ^ v->ak[j];
+		memcpy(p, amf, MILENAGE_AMF_SIZE);
+		p += MILENAGE_AMF_SIZE;
+		memcpy(p, out[i][0], MILENAGE_MAC_A_SIZE);		/* f1 */
+	}
+
+	return 0;
+}
+
 /** Generate AKA AUTN, IK, CK, RES
  *
  * @param[out] autn	Buffer for AUTN = 128-bit authentication token.
@@ -288,27 +428,17 @@ int milenage_umts_generate(uint8_t autn[MILENAGE_AUTN_SIZE],
 			   uint64_t sqn,
 			   uint8_t const rand[MILENAGE_RAND_SIZE])
 {
-	uint8_t		mac_a[8], ak_buff[MILENAGE_AK_SIZE];
-	uint8_t		sqn_buff[MILENAGE_SQN_SIZE];
-	uint8_t		*p = autn;
-	size_t		i;
+	milenage_umts_vector_t	vector = { .sqn = sqn };
 
-	if ((milenage_f1(mac_a, NULL, opc, ki, rand,
-			 uint48_to_buff(sqn_buff, sqn), amf) < 0) ||
-	    (milenage_f2345(res, ik, ck, ak_buff, NULL, opc, ki, rand) < 0)) return -1;
+	memcpy(vector.rand, rand, sizeof(vector.rand));
 
-	/*
-	 *	AUTN = (SQN ^ AK) || AMF || MAC_A
-	 */
-	for (i = 0; i < sizeof(sqn_buff); i++) *p++ = sqn_buff[i] ^ ak_buff[i];
-	memcpy(p, amf, MILENAGE_AMF_SIZE);
-	p += MILENAGE_AMF_SIZE;
-	memcpy(p, mac_a, sizeof(mac_a));
+	if (milenage_umts_generate_multi(&vector, 1, opc, amf, ki) < 0) return -1;
 
-	/*
-	 *	Output the anonymity key if required
-	 */
-	if (ak) memcpy(ak, ak_buff, sizeof(ak_buff));
+	memcpy(autn, vector.autn, sizeof(vector.autn));
+	if (ik) memcpy(ik, vector.ik, sizeof(vector.ik));
+	if (ck) memcpy(ck, vector.ck, sizeof(vector.ck));
+	if (ak) memcpy(ak, vector.ak, sizeof(vector.ak));
+	if (res) memcpy(res, vector.res, sizeof(vector.res));
 
 	return 0;
 }
@@ -370,6 +500,64 @@ void milenage_gsm_from_umts(uint8_t sres[MILENAGE_SRES_SIZE],
 #endif	/* GSM_MILENAGE_ALT_SRES */
 }
 
+/** Generate multiple GSM-Milenage (3GPP TS 55.205) authentication triplets for one subscriber
+ *
+ * As with #milenage_umts_generate_multi, the subscriber key is expanded
+ * once, and the AES operations for all of the vectors are done together.
+ *
+ * @param[in,out] vectors	rand is read from each vector, sres and kc are written.
+ * @param[in] num		Number of vectors.  At most #MILENAGE_VECTORS_MAX.
+ * @param[in] opc		128-bit operator variant algorithm configuration field (encr.).
+ * @param[in] ki		128-bit subscriber key.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int milenage_gsm_generate_multi(milenage_gsm_vector_t *vectors, size_t num,
+				uint8_t const opc[MILENAGE_OPC_SIZE],
+				uint8_t const ki[MILENAGE_KI_SIZE])
+{
+	uint8_t		temp[MILENAGE_VECTORS_MAX][16];
+	uint8_t		in[MILENAGE_VECTORS_MAX][3][16];	/* f2 and f5, f3, f4 */
+	uint8_t		out[MILENAGE_VECTORS_MAX][3][16];
+	EVP_CIPHER_CTX	*evp_ctx;
+	size_t		i, j, k;
+
+	if (num > MILENAGE_VECTORS_MAX) {
+		fr_strerror_printf("Too many vectors, expected <= %u, got %zu", MILENAGE_VECTORS_MAX, num);
+		return -1;
+	}
+
+	evp_ctx = EVP_CIPHER_CTX_new();
+	if (!evp_ctx) {
+		fr_tls_log_strerror_printf("Failed allocating EVP context");
+		return -1;
+	}
+
+	/* TEMP = E_K(RAND XOR OP_C) */
+	for (i = 0; i < num; i++) for (j = 0; j < 16; j++) temp[i][j] = vectors[i].rand[j] ^ opc[j];
+
+	if ((aes_128_ecb_init(evp_ctx, ki) < 0) || (aes_128_encrypt_blocks(evp_ctx, temp[0], temp[0], num) < 0)) {
+	error:
+		EVP_CIPHER_CTX_free(evp_ctx);
+		return -1;
+	}
+
+	for (i = 0; i < num; i++) milenage_f234_input(in[i], temp[i], opc);
+
+	if (aes_128_encrypt_blocks(evp_ctx, in[0][0], out[0][0], num * 3) < 0) goto error;
+	EVP_CIPHER_CTX_free(evp_ctx);
+
+	for (i = 0; i < num; i++) {
+		for (k = 0; k < 3; k++) for (j = 0; j < 16; j++) out[i][k][j] ^= opc[j];
+
+		/* res (f2) is the second half of the first block, then ik (f4), ck (f3) */
+		milenage_gsm_from_umts(vectors[i].sres, vectors[i].kc, out[i][2], out[i][1], out[i][0] + 8);
+	}
+
+	return 0;
+}
+
 /** Generate GSM-Milenage (3GPP TS 55.205) authentication triplet
  *
  * @param[out] sres	Buffer for SRES = 32-bit SRES.
@@ -387,11 +575,14 @@ int milenage_gsm_generate(uint8_t sres[MILENAGE_SRES_SIZE],
 			  uint8_t const ki[MILENAGE_KI_SIZE],
 			  uint8_t const rand[MILENAGE_RAND_SIZE])
 {
-	uint8_t		res[MILENAGE_RES_SIZE], ck[MILENAGE_CK_SIZE], ik[MILENAGE_IK_SIZE];
+	milenage_gsm_vector_t	vector;
 
-	if (milenage_f2345(res, ik, ck, NULL, NULL, opc, ki, rand)) return -1;
+	memcpy(vector.rand, rand, sizeof(vector.rand));
 
-	milenage_gsm_from_umts(sres, kc, ik, ck, res);
+	if (milenage_gsm_generate_multi(&vector, 1, opc, ki) < 0) return -1;
+
+	memcpy(sres, vector.sres, sizeof(vector.sres));
+	memcpy(kc, vector.kc, sizeof(vector.kc));
 
 	return 0;
 }
@@ -635,9 +826,60 @@ void test_set_19(void)
 	TEST_CHECK(memcmp(ak_resync, ak_resync, sizeof(ak_resync_out)) == 0);
 }
 
+/*
+ *	Batched generation must give the same results as generating
+ *	vectors one at a time.
+ */
+void test_multi(void)
+{
+	uint8_t ki[]		= { 0x46, 0x5b, 0x5c, 0xe8, 0xb1, 0x99, 0xb4, 0x9f,
+				    0xaa, 0x5f, 0x0a, 0x2e, 0xe2, 0x38, 0xa6, 0xbc };
+	uint8_t amf[]		= { 0xb9, 0xb9 };
+	uint8_t opc[]		= { 0xcd, 0x63, 0xcb, 0x71, 0x95, 0x4a, 0x9f, 0x4e,
+				    0x48, 0xa5, 0x99, 0x4e, 0x37, 0xa0, 0x2b, 0xaf };
+
+	milenage_umts_vector_t	umts[5];
+	milenage_gsm_vector_t	gsm[5];
+	size_t			i;
+
+	for (i = 0; i < NUM_ELEMENTS(umts); i++) {
+		memset(umts[i].rand, 0x23 + i, sizeof(umts[i].rand));
+		umts[i].sqn = 0xff9bb4d0b607 + (i * 32);
+		memcpy(gsm[i].rand, umts[i].rand, sizeof(gsm[i].rand));
+	}
+
+	TEST_CHECK(milenage_umts_generate_multi(umts, NUM_ELEMENTS(umts), opc, amf, ki) == 0);
+	TEST_CHECK(milenage_gsm_generate_multi(gsm, NUM_ELEMENTS(gsm), opc, ki) == 0);
+
+	for (i = 0; i < NUM_ELEMENTS(umts); i++) {
+		uint8_t	autn[MILENAGE_AUTN_SIZE], ik[MILENAGE_IK_SIZE], ck[MILENAGE_CK_SIZE];
+		uint8_t	ak[MILENAGE_AK_SIZE], res[MILENAGE_RES_SIZE];
+		uint8_t	sqn[MILENAGE_SQN_SIZE], mac_a[MILENAGE_MAC_A_SIZE];
+		uint8_t	sres[MILENAGE_SRES_SIZE], kc[MILENAGE_KC_SIZE];
+
+		uint48_to_buff(sqn, umts[i].sqn);
+
+		TEST_CHECK(milenage_f1(mac_a, NULL, opc, ki, umts[i].rand, sqn, amf) == 0);
+		TEST_CHECK(milenage_f2345(res, ik, ck, ak, NULL, opc, ki, umts[i].rand) == 0);
+		milenage_gsm_from_umts(sres, kc, ik, ck, res);
+
+		TEST_CHECK(memcmp(umts[i].autn + 8, mac_a, sizeof(mac_a)) == 0);
+		TEST_CHECK(memcmp(umts[i].res, res, sizeof(res)) == 0);
+		TEST_CHECK(memcmp(umts[i].ik, ik, sizeof(ik)) == 0);
+		TEST_CHECK(memcmp(umts[i].ck, ck, sizeof(ck)) == 0);
+		TEST_CHECK(memcmp(umts[i].ak, ak, sizeof(ak)) == 0);
+		TEST_CHECK(memcmp(gsm[i].sres, sres, sizeof(sres)) == 0);
+		TEST_CHECK(memcmp(gsm[i].kc, kc, sizeof(kc)) == 0);
+
+		TEST_CHECK(milenage_umts_generate(autn, ik, ck, ak, res, opc, amf, ki, umts[i].sqn, umts[i].rand) == 0);
+		TEST_CHECK(memcmp(umts[i].autn, autn, sizeof(autn)) == 0);
+	}
+}
+
 TEST_LIST = {
 	{ "test_set_1",		test_set_1 },
 	{ "test_set_19",	test_set_19 },
+	{ "test_multi",		test_multi },
 	{ NULL }
 };
 #endif
@@ -8,12 +8,14 @@ SOURCES	:= \
 	base.c \
 	bio.c \
 	cache.c \
+	cache_shared.c \
 	conf.c \
 	ctx.c \
 	engine.c \
 	log.c \
 	pairs.c \
 	session.c \
+	ticket.c \
 	utils.c \
 	verify.c \
 	virtual_server.c
@@ -27,6 +27,7 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 
 #ifdef WITH_TLS
 #include <freeradius-devel/util/atexit.h>
+#include <freeradius-devel/util/dlist.h>
 
 #include "bio.h"
 
@@ -42,10 +43,44 @@ struct fr_tls_bio_dbuff_s {
 	bool			free_buff;	//!< Free the talloced buffer when this structure is freed.
 };
 
+/** A segment of a chain BIO
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< Entry in the list of segments holding data,
+						///< or the list of free segments.
+	size_t			start;		//!< Offset of the first byte not yet read.
+	size_t			end;		//!< Offset of the first byte not yet written.
+	uint8_t			data[];		//!< Segment data.
+} tls_bio_segment_t;
+
+/** Holds the state of a segment chain BIO
+ *
+ * Data written to the BIO is appended to a chain of fixed size
+ * segments, and reads consume segments from the head of the chain.
+ * Nothing is ever reallocated or moved, so a record which arrives in
+ * many EAP fragments is copied exactly once on its way into OpenSSL,
+ * and a record OpenSSL produces is copied exactly once on its way out.
+ *
+ * Segments which have been read are kept for reuse.
+ */
+struct fr_tls_bio_chain_s {
+	BIO			*bio;		//!< The BIO OpenSSL reads from or writes to.
+	fr_dlist_head_t		segments;	//!< Segments holding data, oldest first.
+	fr_dlist_head_t		free;		//!< Empty segments.
+	size_t			segment_size;	//!< Size of the data area of each segment.
+	size_t			used;		//!< Bytes written but not yet read.
+	size_t			max;		//!< Maximum bytes which may be buffered (0 for unlimited).
+};
+
 /** Template for the thread local request log BIOs
  */
 static BIO_METHOD	*tls_bio_talloc_meth;
 
+/** Template for segment chain BIOs
+ */
+static BIO_METHOD	*tls_bio_chain_meth;
+
 /** Thread local aggregation BIO
  */
 static _Thread_local	fr_tls_bio_dbuff_t		*tls_bio_talloc_agg;
@@ -357,6 +392,211 @@ BIO *fr_tls_bio_dbuff_thread_local(TALLOC_CTX *ctx, size_t init, size_t max)
 	return tls_bio_talloc_agg->bio;
 }
 
+/** Get an empty segment, from the free list if possible
+ *
+ */
+static tls_bio_segment_t *tls_bio_chain_segment(fr_tls_bio_chain_t *bc)
+{
+	tls_bio_segment_t *seg;
+
+	seg = fr_dlist_pop_head(&bc->free);
+	if (seg) return seg;
+
+	seg = talloc_zero_size(bc, sizeof(*seg) + bc->segment_size);
+	if (!seg) return NULL;
+	talloc_set_type(seg, tls_bio_segment_t);
+
+	return seg;
+}
+
+/** Append BIO_write() data to the chain
+ *
+ * @param[in] bio	that was written to.
+ * @param[in] in	data being written to BIO.
+ * @param[in] len	Length of data being written.
+ * @return
+ *	- The amount of data written.
+ *	- -1 if the BIO is full.
+ */
+static int _tls_bio_chain_write_cb(BIO *bio, char const *in, int len)
+{
+	fr_tls_bio_chain_t	*bc = talloc_get_type_abort(BIO_get_data(bio), fr_tls_bio_chain_t);
+	tls_bio_segment_t	*seg;
+	size_t			to_write = (size_t)len, written = 0, n;
+
+	BIO_clear_retry_flags(bio);
+
+	if (bc->max && ((bc->used + to_write) > bc->max)) to_write = bc->max - bc->used;
+	if ((to_write == 0) && (len > 0)) return -1;
+
+	seg = fr_dlist_tail(&bc->segments);
+	while (written < to_write) {
+		if (!seg || (seg->end == bc->segment_size)) {
+			seg = tls_bio_chain_segment(bc);
+			if (!seg) break;
+			fr_dlist_insert_tail(&bc->segments, seg);
+		}
+
+		n = bc->segment_size - seg->end;
+		if (n > (to_write - written)) n = to_write - written;
+
+		memcpy(seg->data + seg->end, in + written, n);
+		seg->end += n;
+		written += n;
+	}
+	bc->used += written;
+
+	return (int)written;
+}
+
+/** Serves BIO_read() from the head of the chain
+ *
+ * @param[in] bio	performing the read operation.
+ * @param[out] buf	to write data to.
+ * @param[in] size	of data to write (maximum).
+ * @return
+ *	- The amount of data written.
+ *	- -1 if there's no data, and the caller should retry later.
+ */
+static int _tls_bio_chain_read_cb(BIO *bio, char *buf, int size)
+{
+	fr_tls_bio_chain_t	*bc = talloc_get_type_abort(BIO_get_data(bio), fr_tls_bio_chain_t);
+	tls_bio_segment_t	*seg;
+	size_t			copied = 0, n;
+
+	BIO_clear_retry_flags(bio);
+
+	if (bc->used == 0) {
+		BIO_set_retry_read(bio);
+		return -1;
+	}
+
+	while ((copied < (size_t)size) && (seg = fr_dlist_head(&bc->segments))) {
+		n = seg->end - seg->start;
+		if (n > ((size_t)size - copied)) n = (size_t)size - copied;
+
+		memcpy(buf + copied, seg->data + seg->start, n);
+		seg->start += n;
+		copied += n;
+
+		if (seg->start == seg->end) {
+			fr_dlist_remove(&bc->segments, seg);
+			seg->start = seg->end = 0;
+			fr_dlist_insert_head(&bc->free, seg);
+		}
+	}
+	bc->used -= copied;
+
+	return (int)copied;
+}
+
+/** Discard all the data in the chain
+ *
+ */
+static void tls_bio_chain_reset(fr_tls_bio_chain_t *bc)
+{
+	tls_bio_segment_t *seg;
+
+	while ((seg = fr_dlist_pop_head(&bc->segments))) {
+		seg->start = seg->end = 0;
+		fr_dlist_insert_head(&bc->free, seg);
+	}
+	bc->used = 0;
+}
+
+/** Answer the control operations OpenSSL performs on its BIOs
+ *
+ */
+static long _tls_bio_chain_ctrl_cb(BIO *bio, int cmd, UNUSED long num, UNUSED void *ptr)
+{
+	fr_tls_bio_chain_t	*bc = talloc_get_type_abort(BIO_get_data(bio), fr_tls_bio_chain_t);
+
+	switch (cmd) {
+	case BIO_CTRL_RESET:
+		tls_bio_chain_reset(bc);
+		return 1;
+
+	case BIO_CTRL_EOF:
+		return (bc->used == 0);
+
+	case BIO_CTRL_PENDING:
+		return (long)bc->used;
+
+	case BIO_CTRL_WPENDING:
+		return 0;
+
+	case BIO_CTRL_DUP:
+	case BIO_CTRL_FLUSH:
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+/** Free the chain when OpenSSL frees the BIO
+ *
+ */
+static int _tls_bio_chain_destroy_cb(BIO *bio)
+{
+	fr_tls_bio_chain_t *bc = BIO_get_data(bio);
+
+	if (!bc) return 1;
+
+	BIO_set_data(bio, NULL);
+	BIO_set_init(bio, 0);
+	talloc_free(bc);
+
+	return 1;
+}
+
+/** Allocate a BIO which buffers data in a chain of fixed size segments
+ *
+ * Used in place of a memory BIO for the network side of a TLS session.
+ *
+ * @note The BIO owns the chain.  It's freed by BIO_free(), which is
+ *	usually called by SSL_free() once the BIO has been passed to
+ *	SSL_set_bio().
+ *
+ * @param[in] segment_size	size of each segment.
+ * @param[in] init		how much memory to preallocate.
+ * @param[in] max		the maximum amount of data to buffer (0 for unlimited).
+ * @return
+ *	- A new BIO.
+ *	- NULL on error.
+ */
+BIO *fr_tls_bio_chain_alloc(size_t segment_size, size_t init, size_t max)
+{
+	fr_tls_bio_chain_t	*bc;
+	tls_bio_segment_t	*seg;
+	size_t			i;
+
+	bc = talloc_zero(NULL, fr_tls_bio_chain_t);
+	if (!bc) return NULL;
+
+	fr_dlist_talloc_init(&bc->segments, tls_bio_segment_t, entry);
+	fr_dlist_talloc_init(&bc->free, tls_bio_segment_t, entry);
+	bc->segment_size = segment_size;
+	bc->max = max;
+
+	for (i = 0; i < init; i += segment_size) {
+		seg = tls_bio_chain_segment(bc);
+		if (!seg) {
+		error:
+			talloc_free(bc);
+			return NULL;
+		}
+		fr_dlist_insert_tail(&bc->free, seg);
+	}
+
+	bc->bio = BIO_new(tls_bio_chain_meth);
+	if (!bc->bio) goto error;
+	BIO_set_data(bc->bio, bc);
+	BIO_set_init(bc->bio, 1);
+
+	return bc->bio;
+}
+
 /** Initialise the BIO logging meths which are used to create thread local logging BIOs
  *
  */
@@ -380,6 +620,14 @@ int fr_tls_bio_init(void)
 	BIO_meth_set_read(tls_bio_talloc_meth, _tls_bio_talloc_read_cb);
 	BIO_meth_set_gets(tls_bio_talloc_meth, _tls_bio_talloc_gets_cb);
 
+	tls_bio_chain_meth = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "fr_tls_bio_chain_t");
+	if (unlikely(!tls_bio_chain_meth)) return -1;
+
+	BIO_meth_set_write(tls_bio_chain_meth, _tls_bio_chain_write_cb);
+	BIO_meth_set_read(tls_bio_chain_meth, _tls_bio_chain_read_cb);
+	BIO_meth_set_ctrl(tls_bio_chain_meth, _tls_bio_chain_ctrl_cb);
+	BIO_meth_set_destroy(tls_bio_chain_meth, _tls_bio_chain_destroy_cb);
+
 	return 0;
 }
 
@@ -392,5 +640,10 @@ void fr_tls_bio_free(void)
 		BIO_meth_free(tls_bio_talloc_meth);
 		tls_bio_talloc_meth = NULL;
 	}
+
+	if (tls_bio_chain_meth) {
+		BIO_meth_free(tls_bio_chain_meth);
+		tls_bio_chain_meth = NULL;
+	}
 }
 #endif /* WITH_TLS */
@@ -30,6 +30,8 @@ RCSIDH(bio_h, "$Id$")
 
 typedef struct fr_tls_bio_dbuff_s fr_tls_bio_dbuff_t;
 
+typedef struct fr_tls_bio_chain_s fr_tls_bio_chain_t;
+
 uint8_t		*fr_tls_bio_dbuff_finalise(fr_tls_bio_dbuff_t *bd);
 
 char		*fr_tls_bio_dbuff_finalise_bstr(fr_tls_bio_dbuff_t *bd);
@@ -51,6 +53,8 @@ void		fr_tls_bio_dbuff_thread_local_clear(void);
 
 BIO		*fr_tls_bio_dbuff_thread_local(TALLOC_CTX *ctx, size_t init, size_t max);
 
+BIO		*fr_tls_bio_chain_alloc(size_t segment_size, size_t init, size_t max);
+
 int		fr_tls_bio_init(void);
 
 void		fr_tls_bio_free(void);
@@ -115,8 +115,6 @@ static int tls_cache_app_data_set(request_t *request, SSL_SESSION *sess)
 {
 	fr_dbuff_t		dbuff;
 	fr_dbuff_uctx_talloc_t	tctx;
-	fr_dcursor_t		dcursor;
-	fr_pair_t		*vp;
 	ssize_t			slen;
 	int			ret;
 
@@ -136,15 +134,11 @@ static int tls_cache_app_data_set(request_t *request, SSL_SESSION *sess)
 	 *	Encode the session-state contents and
 	 *	add it to the ticket.
 	 */
-	for (vp = fr_dcursor_init(&dcursor, &request->session_state_pairs);
-	     vp;
-	     vp = fr_dcursor_current(&dcursor)) {
-		slen = fr_internal_encode_pair(&dbuff, &dcursor, NULL);
-		if (slen < 0) {
-			RPERROR("Failed serialising session-state list");
-			fr_dbuff_free_talloc(&dbuff);
-			return 0;
-		}
+	slen = fr_internal_encode_list(&dbuff, &request->session_state_pairs, NULL);
+	if (slen < 0) {
+		RPERROR("Failed serialising session-state list");
+		fr_dbuff_free_talloc(&dbuff);
+		return 0;
 	}
 
 	RHEXDUMP4(fr_dbuff_start(&dbuff), fr_dbuff_used(&dbuff), "session-ticket application data");
@@ -169,7 +163,6 @@ static int tls_cache_app_data_get(request_t *request, SSL_SESSION *sess)
 	size_t			data_len;
 	fr_dbuff_t		dbuff;
 	fr_pair_list_t		tmp;
-	fr_dcursor_t		cursor;
 
 	/*
 	 *	Extract the session-state list from the ticket.
@@ -180,7 +173,6 @@ static int tls_cache_app_data_get(request_t *request, SSL_SESSION *sess)
 	}
 
 	fr_pair_list_init(&tmp);
-	fr_dcursor_init(&cursor, &tmp);
 	fr_dbuff_init(&dbuff, data, data_len);
 
 	RHEXDUMP4(fr_dbuff_start(&dbuff), fr_dbuff_len(&dbuff), "session application data");
@@ -191,13 +183,9 @@ static int tls_cache_app_data_get(request_t *request, SSL_SESSION *sess)
 	 *	It's very important that we decode _all_ attributes,
 	 *	or disallow session resumption.
 	 */
-	while (fr_dbuff_remaining(&dbuff) > 0) {
-		if (fr_internal_decode_pair_dbuff(request->session_state_ctx, &cursor,
-					    	  request->dict, &dbuff, NULL) < 0) {
-			fr_pair_list_free(&tmp);
-			RPEDEBUG("Failed decoding session-state");
-			return -1;
-		}
+	if (fr_internal_decode_list_dbuff(request->session_state_ctx, &tmp, request->dict, &dbuff, NULL) < 0) {
+		RPEDEBUG("Failed decoding session-state");
+		return -1;
 	}
 
 	RDEBUG2("Restoring &session-state[*] from session");
@@ -254,40 +242,32 @@ static void tls_cache_delete_request(SSL_SESSION *sess)
 	ASYNC_pause_job();	/* Jumps back to SSL_read() in session.c */
 }
 
-/** Process the result of `session load { ... }`
+/** Deserialize a persisted session, and make it available to tls_cache_load_cb
+ *
+ * @param[in] request		The current request.
+ * @param[in] tls_session	The current TLS session.
+ * @param[in] data		Serialized session.
+ * @param[in] data_len		Length of data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static unlang_action_t tls_cache_load_result(UNUSED rlm_rcode_t *p_result, UNUSED int *priority,
-					     request_t *request, void *uctx)
+static int tls_cache_load_deserialize(request_t *request, fr_tls_session_t *tls_session,
+				      uint8_t const *data, size_t data_len)
 {
-	fr_tls_session_t	*tls_session = talloc_get_type_abort(uctx, fr_tls_session_t);
 	fr_tls_cache_t		*tls_cache = tls_session->cache;
-	fr_pair_t		*vp;
 	uint8_t const		*q, **p;
 	SSL_SESSION		*sess;
 
-	vp = fr_pair_find_by_da(&request->reply_pairs, attr_tls_packet_type, 0);
-	if (!vp || (vp->vp_uint32 != enum_tls_packet_type_success->vb_uint32)) {
-		RWDEBUG("Failed acquiring session data");
-	error:
-		tls_cache->load.state = FR_TLS_CACHE_LOAD_FAILED;
-		return UNLANG_ACTION_CALCULATE_RESULT;
-	}
-
-	vp = fr_pair_find_by_da(&request->reply_pairs, attr_tls_session_data, 0);
-	if (!vp) {
-		RWDEBUG("No cached session found");
-		goto error;
-	}
-
-	q = vp->vp_octets;	/* openssl will mutate q, so we can't use vp_octets directly */
+	q = data;	/* openssl will mutate q, so we can't use data directly */
 	p = (unsigned char const **)&q;
 
-	sess = d2i_SSL_SESSION(NULL, p, vp->vp_length);
+	sess = d2i_SSL_SESSION(NULL, p, data_len);
 	if (!sess) {
 		fr_tls_log_error(request, "Failed loading persisted session");
-		goto error;
+		return -1;
 	}
-	RDEBUG3("Read %zu bytes of session data.  Session deserialized successfully", vp->vp_length);
+	RDEBUG3("Read %zu bytes of session data.  Session deserialized successfully", data_len);
 	if (RDEBUG_ENABLED3) SSL_SESSION_print(fr_tls_request_log_bio(request, L_DBG, L_DBG_LVL_3), sess);
 
 	/*
@@ -304,6 +284,71 @@ static unlang_action_t tls_cache_load_result(UNUSED rlm_rcode_t *p_result, UNUSE
 	tls_cache->load.state = FR_TLS_CACHE_LOAD_RETRIEVED;
 	tls_cache->load.sess = sess;	/* This is consumed in tls_cache_load_cb */
 
+	return 0;
+}
+
+/** Load a session from the shared cache
+ *
+ * This is done synchronously from tls_cache_load_cb, so doesn't
+ * need a subrequest.
+ *
+ * @param[in] request		The current request.
+ * @param[in] tls_session	The current TLS session.
+ * @param[in] sc		Shared cache to load the session from.
+ * @return
+ *	- 0 if the session was loaded.
+ *	- -1 if the session wasn't found, or failed to load.
+ */
+static int tls_cache_load_shared(request_t *request, fr_tls_session_t *tls_session, fr_tls_cache_shared_t *sc)
+{
+	fr_tls_cache_t		*tls_cache = tls_session->cache;
+	uint8_t			*data;
+	int			ret;
+
+	ret = fr_tls_cache_shared_load(NULL, &data, sc, tls_cache->load.id, talloc_array_length(tls_cache->load.id));
+	if (ret < 0) {
+		RPWDEBUG("Failed loading session from shared cache");
+		return -1;
+	}
+	if (ret == 0) {
+		RDEBUG2("No session found in shared cache");
+		return -1;
+	}
+
+	ret = tls_cache_load_deserialize(request, tls_session, data, talloc_array_length(data));
+	talloc_free(data);
+	if (ret < 0) return -1;
+
+	RDEBUG2("Loaded session from shared cache");
+
+	return 0;
+}
+
+/** Process the result of `session load { ... }`
+ */
+static unlang_action_t tls_cache_load_result(UNUSED rlm_rcode_t *p_result, UNUSED int *priority,
+					     request_t *request, void *uctx)
+{
+	fr_tls_session_t	*tls_session = talloc_get_type_abort(uctx, fr_tls_session_t);
+	fr_tls_cache_t		*tls_cache = tls_session->cache;
+	fr_pair_t		*vp;
+
+	vp = fr_pair_find_by_da(&request->reply_pairs, attr_tls_packet_type, 0);
+	if (!vp || (vp->vp_uint32 != enum_tls_packet_type_success->vb_uint32)) {
+		RWDEBUG("Failed acquiring session data");
+	error:
+		tls_cache->load.state = FR_TLS_CACHE_LOAD_FAILED;
+		return UNLANG_ACTION_CALCULATE_RESULT;
+	}
+
+	vp = fr_pair_find_by_da(&request->reply_pairs, attr_tls_session_data, 0);
+	if (!vp) {
+		RWDEBUG("No cached session found");
+		goto error;
+	}
+
+	if (tls_cache_load_deserialize(request, tls_session, vp->vp_octets, vp->vp_length) < 0) goto error;
+
 	return UNLANG_ACTION_CALCULATE_RESULT;
 }
 
@@ -419,6 +464,59 @@ unlang_action_t tls_cache_store_push(request_t *request, fr_tls_conf_t *conf, fr
 	 */
 	if (tls_cache_app_data_set(request, sess) < 0) return UNLANG_ACTION_FAIL;
 
+	/*
+	 *	Serialize the session
+	 */
+	len = i2d_SSL_SESSION(sess, NULL);	/* find out what length data we need */
+	if (len < 1) {
+		/* something went wrong */
+		fr_tls_log_strerror_printf(NULL);	/* Drain the OpenSSL error stack */
+		RPWDEBUG("Session serialisation failed, couldn't determine required buffer length");
+		tls_cache_store_state_reset(tls_cache);
+		return UNLANG_ACTION_FAIL;
+	}
+
+	MEM(data = talloc_array(NULL, uint8_t, len));
+
+	/* openssl mutates &p */
+	p = data;
+	ret = i2d_SSL_SESSION(sess, &p);	/* Serialize as ASN.1 */
+	if (ret != len) {
+		fr_tls_log_strerror_printf(NULL);	/* Drain the OpenSSL error stack */
+		RPWDEBUG("Session serialisation failed");
+		talloc_free(data);
+		tls_cache_store_state_reset(tls_cache);
+		return UNLANG_ACTION_FAIL;
+	}
+
+	/*
+	 *	Write the session to the shared cache.
+	 *	If there's no virtual server to call
+	 *	we're done.
+	 */
+	if (conf->cache.shared.cache) {
+		unsigned int	id_len;
+		uint8_t const	*id;
+		bool		stored;
+
+		id = SSL_SESSION_get_id(sess, &id_len);
+		stored = (fr_tls_cache_shared_store(conf->cache.shared.cache, id, id_len,
+						    (time_t)(SSL_SESSION_get_time(sess) + SSL_get_timeout(sess)),
+						    data, len) == 0);
+		if (stored) {
+			RDEBUG2("Stored session in shared cache");
+		} else {
+			RPWDEBUG("Failed storing session in shared cache");
+		}
+
+		if (!conf->cache.virtual_server) {
+			talloc_free(data);
+			tls_cache_store_state_reset(tls_cache);
+			if (stored) tls_cache->store.state = FR_TLS_CACHE_STORE_PERSISTED;	/* Avoid spurious clear calls */
+			return UNLANG_ACTION_CALCULATE_RESULT;
+		}
+	}
+
 	MEM(child = unlang_subrequest_alloc(request, dict_tls));
 	request = child;
 
@@ -442,40 +540,19 @@ unlang_action_t tls_cache_store_push(request_t *request, fr_tls_conf_t *conf, fr
 	MEM(pair_update_request(&vp, attr_tls_session_ttl) >= 0);
 	vp->vp_time_delta = fr_time_delta_from_nsec(expires - now);
 
-	/*
-	 *	Serialize the session
-	 */
-	len = i2d_SSL_SESSION(sess, NULL);	/* find out what length data we need */
-	if (len < 1) {
-		/* something went wrong */
-		fr_tls_log_strerror_printf(NULL);	/* Drain the OpenSSL error stack */
-		RPWDEBUG("Session serialisation failed, couldn't determine required buffer length");
-	error:
-		tls_cache_store_state_reset(tls_cache);
-		talloc_free(child);
-		return UNLANG_ACTION_FAIL;
-	}
-
 	MEM(pair_update_request(&vp, attr_tls_session_data) >= 0);
-	MEM(data = talloc_array(vp, uint8_t, len));
-
-	/* openssl mutates &p */
-	p = data;
-	ret = i2d_SSL_SESSION(sess, &p);	/* Serialize as ASN.1 */
-	if (ret != len) {
-		fr_tls_log_strerror_printf(NULL);	/* Drain the OpenSSL error stack */
-		RPWDEBUG("Session serialisation failed");
-		talloc_free(data);
-		goto error;
-	}
-	fr_pair_value_memdup_buffer_shallow(vp, data, true);
+	fr_pair_value_memdup_buffer_shallow(vp, talloc_steal(vp, data), true);
 
 	/*
 	 *	Allocate a child, and set it up to call
 	 *      the TLS virtual server.
 	 */
 	ua = fr_tls_call_push(child, tls_cache_store_result, conf, tls_session);
-	if (ua < 0) goto error;
+	if (ua < 0) {
+		tls_cache_store_state_reset(tls_cache);
+		talloc_free(child);
+		return UNLANG_ACTION_FAIL;
+	}
 
 	return ua;
 }
@@ -523,6 +600,18 @@ unlang_action_t tls_cache_clear_push(request_t *request, fr_tls_conf_t *conf, fr
 	fr_assert(tls_cache->clear.state == FR_TLS_CACHE_CLEAR_REQUESTED);
 	fr_assert(tls_cache->clear.id);
 
+	if (conf->cache.shared.cache) {
+		if (fr_tls_cache_shared_delete(conf->cache.shared.cache, tls_cache->clear.id,
+					       talloc_array_length(tls_cache->clear.id)) < 0) {
+			RPWDEBUG("Failed deleting session from shared cache - security may be compromised");
+		}
+
+		if (!conf->cache.virtual_server) {
+			tls_cache_clear_state_reset(tls_cache);
+			return UNLANG_ACTION_CALCULATE_RESULT;
+		}
+	}
+
 	MEM(child = unlang_subrequest_alloc(request, dict_tls));
 	request = child;
 
@@ -565,6 +654,7 @@ unlang_action_t fr_tls_cache_pending_push(request_t *request, fr_tls_session_t *
 {
 	fr_tls_cache_t *tls_cache = tls_session->cache;
 	fr_tls_conf_t *conf = fr_tls_session_conf(tls_session->ssl);
+	unlang_action_t ua;
 
 	if (!tls_cache) return UNLANG_ACTION_CALCULATE_RESULT;	/* No caching allowed */
 
@@ -594,7 +684,8 @@ unlang_action_t fr_tls_cache_pending_push(request_t *request, fr_tls_session_t *
 			    (memcmp(tls_cache->clear.id, id, len) == 0)) tls_cache_store_state_reset(tls_cache);
 		}
 
-		return tls_cache_clear_push(request, conf, tls_session);
+		ua = tls_cache_clear_push(request, conf, tls_session);
+		if (ua != UNLANG_ACTION_CALCULATE_RESULT) return ua;
 	}
 
 	if (tls_cache->store.state == FR_TLS_CACHE_STORE_REQUESTED) {
@@ -670,11 +761,13 @@ static SSL_SESSION *tls_cache_load_cb(SSL *ssl,
 {
 	fr_tls_session_t	*tls_session;
 	fr_tls_cache_t		*tls_cache;
+	fr_tls_conf_t		*conf;
 	request_t		*request;
 
 	tls_session = fr_tls_session(ssl);
 	request = fr_tls_session_request(tls_session->ssl);
 	tls_cache = tls_session->cache;
+	conf = fr_tls_session_conf(tls_session->ssl);
 
 	/*
 	 *	Request was cancelled, don't return any session and hopefully
@@ -705,9 +798,23 @@ again:
 	case FR_TLS_CACHE_LOAD_INIT:
 		fr_assert(!tls_cache->load.id);
 
-		tls_cache->load.state = FR_TLS_CACHE_LOAD_REQUESTED;
 		MEM(tls_cache->load.id = talloc_typed_memdup(tls_cache, (uint8_t const *)key, key_len));
 
+		/*
+		 *	The shared cache can be read synchronously,
+		 *	so try it before calling the virtual server.
+		 */
+		if (conf->cache.shared.cache) {
+			if (tls_cache_load_shared(request, tls_session, conf->cache.shared.cache) == 0) goto again;
+
+			if (!conf->cache.virtual_server) {
+				tls_cache->load.state = FR_TLS_CACHE_LOAD_FAILED;
+				goto again;
+			}
+		}
+
+		tls_cache->load.state = FR_TLS_CACHE_LOAD_REQUESTED;
+
 		RDEBUG3("Requested session load - ID %pV", fr_box_octets_buffer(tls_cache->load.id));
 		ASYNC_pause_job();	/* Jumps back to SSL_read() in session.c */
 
@@ -1194,15 +1301,10 @@ int fr_tls_cache_ctx_init(SSL_CTX *ctx, fr_tls_cache_conf_t const *cache_conf)
 		if (!(cache_conf->mode & FR_TLS_CACHE_STATEFUL)) tls_cache_disable_statefull_resumption(ctx);
 
 		/*
-		 *	Ensure the same keys are used across all threads
+		 *	Ensure the same keys are used across all
+		 *	threads, and rotated on schedule.
 		 */
-		if (SSL_CTX_set_tlsext_ticket_keys(ctx,
-						   UNCONST(uint8_t *, cache_conf->session_ticket_key_rand),
-						   sizeof(cache_conf->session_ticket_key_rand)) != 1) {
-			fr_tls_log_strerror_printf(NULL);
-			PERROR("Failed setting session ticket keys");
-			return -1;
-		}
+		if (fr_tls_ticket_ctx_init(ctx) < 0) return -1;
 
 		/*
 		 *	These callbacks embed and extract the
@@ -111,6 +111,21 @@ void		fr_tls_cache_session_alloc(fr_tls_session_t *tls_session);
 
 int		fr_tls_cache_ctx_init(SSL_CTX *ctx, fr_tls_cache_conf_t const *cache_conf);
 
+fr_tls_cache_shared_t *fr_tls_cache_shared_alloc(TALLOC_CTX *ctx, char const *filename,
+						 uint32_t max_entries, size_t max_session_size);
+
+int		fr_tls_cache_shared_store(fr_tls_cache_shared_t *sc, uint8_t const *id, size_t id_len,
+					  time_t expires, uint8_t const *data, size_t data_len);
+
+int		fr_tls_cache_shared_load(TALLOC_CTX *ctx, uint8_t **out,
+					 fr_tls_cache_shared_t *sc, uint8_t const *id, size_t id_len);
+
+int		fr_tls_cache_shared_delete(fr_tls_cache_shared_t *sc, uint8_t const *id, size_t id_len);
+
+fr_tls_ticket_keys_t *fr_tls_ticket_keys_alloc(TALLOC_CTX *ctx, fr_tls_cache_conf_t const *cache_conf);
+
+int		fr_tls_ticket_ctx_init(SSL_CTX *ctx);
+
 #ifdef __cplusplus
 }
 #endif
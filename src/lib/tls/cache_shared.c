@@ -0,0 +1,494 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file tls/cache_shared.c
+ * @brief Shared memory store for stateful TLS sessions
+ *
+ * Serialized sessions are stored in a fixed size table, in memory mapped
+ * with MAP_SHARED, so that all threads, and any processes mapping the same
+ * file, see the same sessions.  If a filename is configured, sessions also
+ * persist across restarts.
+ *
+ * The table is split into stripes, each protected by its own process-shared
+ * mutex.  Within a stripe the table is set associative.  A session can only
+ * live in one of #TLS_CACHE_SHARED_WAYS consecutive slots, starting at a slot
+ * derived from the hash of its ID.  When all those slots are in use, the
+ * session which expires soonest is evicted.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
+
+#ifdef WITH_TLS
+#define LOG_PREFIX "tls - "
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include "base.h"
+#include "cache.h"
+
+#define TLS_CACHE_SHARED_MAGIC		"FRTLSSC1"
+#define TLS_CACHE_SHARED_STRIPES	64	//!< Number of independently locked stripes.
+#define TLS_CACHE_SHARED_WAYS		8	//!< Slots a given session may be stored in.
+
+/** Describes the layout of the mapping
+ *
+ * If any of these fields differ from our configuration when an existing
+ * file is mapped by the first process to use it, all sessions are discarded.
+ */
+typedef struct {
+	char			magic[8];		//!< Written last, once the table is initialised.
+	uint32_t		num_stripes;		//!< Number of stripes.
+	uint32_t		slots_per_stripe;	//!< Number of slots in each stripe.
+	uint32_t		slot_size;		//!< Size of each slot, including its header.
+	uint32_t		max_session_size;	//!< Largest serialized session a slot can hold.
+} tls_cache_shared_hdr_t;
+
+/** Lock protecting one stripe of slots
+ *
+ * Padded so that stripes don't share cache lines.
+ */
+typedef union {
+	pthread_mutex_t		mutex;
+	uint8_t			pad[128];
+} tls_cache_shared_stripe_t;
+
+/** A single serialized session
+ *
+ * Expiry uses wall clock time, as it must remain valid across restarts.
+ */
+typedef struct {
+	int64_t			expires;		//!< Unix time the session expires.  0 if the slot is free.
+	uint32_t		data_len;		//!< Length of the serialized session.
+	uint8_t			id_len;			//!< Length of the session ID.
+	uint8_t			id[SSL_MAX_SSL_SESSION_ID_LENGTH];	//!< Session ID.
+	uint8_t			data[];			//!< Serialized session.
+} tls_cache_shared_slot_t;
+
+struct fr_tls_cache_shared_s {
+	int			fd;			//!< File the table is mapped from, or -1.  Held open
+							///< so we keep our shared lock on it.
+	uint8_t			*map;			//!< Start of the mapping.
+	size_t			map_len;		//!< Length of the mapping.
+
+	tls_cache_shared_hdr_t	*hdr;			//!< Layout of the table.
+	tls_cache_shared_stripe_t *stripes;		//!< Stripe locks.
+	uint8_t			*slots;			//!< Start of the first slot.
+};
+
+static inline CC_HINT(always_inline)
+tls_cache_shared_slot_t *tls_cache_shared_slot(fr_tls_cache_shared_t *sc, uint32_t stripe, uint32_t slot)
+{
+	uint64_t idx = ((uint64_t)stripe * sc->hdr->slots_per_stripe) + slot;
+
+	return (tls_cache_shared_slot_t *)(sc->slots + (idx * sc->hdr->slot_size));
+}
+
+/** Lock the stripe an ID belongs to
+ *
+ * @param[out] stripe	Index of the stripe.
+ * @param[out] first	First slot in the stripe the ID may be stored in.
+ * @param[in] sc	Shared cache.
+ * @param[in] id	to find the stripe for.
+ * @param[in] id_len	Length of id.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the lock couldn't be acquired.
+ */
+static int tls_cache_shared_lock(uint32_t *stripe, uint32_t *first,
+				 fr_tls_cache_shared_t *sc, uint8_t const *id, size_t id_len)
+{
+	uint32_t	hash = fr_hash(id, id_len);
+	int		ret;
+
+	*stripe = hash % sc->hdr->num_stripes;
+	*first = (hash / sc->hdr->num_stripes) % sc->hdr->slots_per_stripe;
+
+	ret = pthread_mutex_lock(&sc->stripes[*stripe].mutex);
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+	/*
+	 *	Another process died holding the lock.  The
+	 *	stripe may contain a partially written slot,
+	 *	so discard its contents.
+	 */
+	if (ret == EOWNERDEAD) {
+		uint32_t i;
+
+		WARN("Process holding shared session cache lock died, clearing stripe %u", *stripe);
+
+		for (i = 0; i < sc->hdr->slots_per_stripe; i++) tls_cache_shared_slot(sc, *stripe, i)->expires = 0;
+		pthread_mutex_consistent(&sc->stripes[*stripe].mutex);
+		ret = 0;
+	}
+#endif
+	if (ret != 0) {
+		fr_strerror_printf("Failed locking shared session cache: %s", fr_syserror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+static inline CC_HINT(always_inline)
+void tls_cache_shared_unlock(fr_tls_cache_shared_t *sc, uint32_t stripe)
+{
+	pthread_mutex_unlock(&sc->stripes[stripe].mutex);
+}
+
+/** Find the slot holding an ID
+ *
+ * Must be called with the stripe locked.
+ */
+static tls_cache_shared_slot_t *tls_cache_shared_find(fr_tls_cache_shared_t *sc, uint32_t stripe, uint32_t first,
+						       uint8_t const *id, size_t id_len, int64_t now)
+{
+	uint32_t i;
+
+	for (i = 0; i < TLS_CACHE_SHARED_WAYS; i++) {
+		tls_cache_shared_slot_t *slot;
+
+		slot = tls_cache_shared_slot(sc, stripe, (first + i) % sc->hdr->slots_per_stripe);
+		if (slot->expires <= now) continue;
+		if ((slot->id_len == id_len) && (memcmp(slot->id, id, id_len) == 0)) return slot;
+	}
+
+	return NULL;
+}
+
+/** Store a serialized session
+ *
+ * Replaces any existing session with the same ID.
+ *
+ * @param[in] sc		Shared cache.
+ * @param[in] id		Session ID.
+ * @param[in] id_len		Length of id.
+ * @param[in] expires		Unix time the session expires.
+ * @param[in] data		Serialized session.
+ * @param[in] data_len		Length of data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_tls_cache_shared_store(fr_tls_cache_shared_t *sc, uint8_t const *id, size_t id_len,
+			      time_t expires, uint8_t const *data, size_t data_len)
+{
+	tls_cache_shared_slot_t	*slot, *victim = NULL;
+	uint32_t		stripe, first, i;
+	int64_t			now = time(NULL);
+
+	if (id_len > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+		fr_strerror_printf("Session ID too long (%zu bytes)", id_len);
+		return -1;
+	}
+
+	if (data_len > sc->hdr->max_session_size) {
+		fr_strerror_printf("Session too large for shared cache (%zu bytes), max_session_size is %u bytes",
+				   data_len, sc->hdr->max_session_size);
+		return -1;
+	}
+
+	if (tls_cache_shared_lock(&stripe, &first, sc, id, id_len) < 0) return -1;
+
+	/*
+	 *	Reuse the slot holding the same ID, otherwise
+	 *	take a free slot, or evict the session which
+	 *	will expire soonest.
+	 */
+	victim = tls_cache_shared_find(sc, stripe, first, id, id_len, now);
+	if (!victim) for (i = 0; i < TLS_CACHE_SHARED_WAYS; i++) {
+		slot = tls_cache_shared_slot(sc, stripe, (first + i) % sc->hdr->slots_per_stripe);
+		if (slot->expires <= now) {
+			victim = slot;
+			break;
+		}
+		if (!victim || (slot->expires < victim->expires)) victim = slot;
+	}
+
+	victim->expires = expires;
+	victim->data_len = data_len;
+	victim->id_len = id_len;
+	memcpy(victim->id, id, id_len);
+	memcpy(victim->data, data, data_len);
+
+	tls_cache_shared_unlock(sc, stripe);
+
+	return 0;
+}
+
+/** Retrieve a serialized session
+ *
+ * The session is copied out so the stripe lock isn't held while it's
+ * deserialized.
+ *
+ * @param[in] ctx		to allocate the copy in.
+ * @param[out] out		Copy of the serialized session.
+ * @param[in] sc		Shared cache.
+ * @param[in] id		Session ID.
+ * @param[in] id_len		Length of id.
+ * @return
+ *	- 1 if the session was found.
+ *	- 0 if the session wasn't found, or has expired.
+ *	- -1 on failure.
+ */
+int fr_tls_cache_shared_load(TALLOC_CTX *ctx, uint8_t **out,
+			     fr_tls_cache_shared_t *sc, uint8_t const *id, size_t id_len)
+{
+	tls_cache_shared_slot_t	*slot;
+	uint32_t		stripe, first;
+	int64_t			now = time(NULL);
+
+	*out = NULL;
+
+	if (id_len > SSL_MAX_SSL_SESSION_ID_LENGTH) return 0;
+
+	if (tls_cache_shared_lock(&stripe, &first, sc, id, id_len) < 0) return -1;
+
+	slot = tls_cache_shared_find(sc, stripe, first, id, id_len, now);
+	if (slot) MEM(*out = talloc_typed_memdup(ctx, slot->data, slot->data_len));
+
+	tls_cache_shared_unlock(sc, stripe);
+
+	return slot ? 1 : 0;
+}
+
+/** Remove a session
+ *
+ * @param[in] sc		Shared cache.
+ * @param[in] id		Session ID.
+ * @param[in] id_len		Length of id.
+ * @return
+ *	- 1 if the session was removed.
+ *	- 0 if the session wasn't found.
+ *	- -1 on failure.
+ */
+int fr_tls_cache_shared_delete(fr_tls_cache_shared_t *sc, uint8_t const *id, size_t id_len)
+{
+	tls_cache_shared_slot_t	*slot;
+	uint32_t		stripe, first;
+
+	if (id_len > SSL_MAX_SSL_SESSION_ID_LENGTH) return 0;
+
+	if (tls_cache_shared_lock(&stripe, &first, sc, id, id_len) < 0) return -1;
+
+	slot = tls_cache_shared_find(sc, stripe, first, id, id_len, time(NULL));
+	if (slot) slot->expires = 0;
+
+	tls_cache_shared_unlock(sc, stripe);
+
+	return slot ? 1 : 0;
+}
+
+static int _tls_cache_shared_free(fr_tls_cache_shared_t *sc)
+{
+	if (sc->map) munmap(sc->map, sc->map_len);
+	if (sc->fd >= 0) close(sc->fd);
+
+	return 0;
+}
+
+/** Initialise the stripe locks of a mapping
+ *
+ * Must only be called when no other process has the table mapped.
+ */
+static int tls_cache_shared_init_locks(fr_tls_cache_shared_t *sc)
+{
+	pthread_mutexattr_t	attr;
+	uint32_t		i;
+	int			ret;
+
+	pthread_mutexattr_init(&attr);
+	ret = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+	if (ret == 0) ret = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+	if (ret != 0) {
+		fr_strerror_printf("Failed setting shared session cache lock attributes: %s", fr_syserror(ret));
+		pthread_mutexattr_destroy(&attr);
+		return -1;
+	}
+
+	for (i = 0; i < sc->hdr->num_stripes; i++) {
+		ret = pthread_mutex_init(&sc->stripes[i].mutex, &attr);
+		if (ret != 0) {
+			fr_strerror_printf("Failed initialising shared session cache lock: %s", fr_syserror(ret));
+			pthread_mutexattr_destroy(&attr);
+			return -1;
+		}
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	return 0;
+}
+
+/** Check whether a mapping has the layout we expect
+ *
+ */
+static inline CC_HINT(always_inline)
+bool tls_cache_shared_layout_match(fr_tls_cache_shared_t *sc, tls_cache_shared_hdr_t const *layout)
+{
+	return (memcmp(sc->hdr->magic, TLS_CACHE_SHARED_MAGIC, sizeof(sc->hdr->magic)) == 0) &&
+	       (sc->hdr->num_stripes == layout->num_stripes) &&
+	       (sc->hdr->slots_per_stripe == layout->slots_per_stripe) &&
+	       (sc->hdr->slot_size == layout->slot_size) &&
+	       (sc->hdr->max_session_size == layout->max_session_size);
+}
+
+/** Map a shared session cache
+ *
+ * Every process using the file holds a shared flock() on it.  The first
+ * process to map the file gets an exclusive lock instead.  It reinitialises
+ * the stripe locks, which may have been left locked if the server stopped
+ * unexpectedly, and if the layout of the file doesn't match the
+ * configuration, it discards all stored sessions.
+ *
+ * @param[in] ctx		to allocate the cache in.
+ * @param[in] filename		to map.  If NULL, anonymous shared memory is used.
+ * @param[in] max_entries	Maximum number of sessions to store.
+ * @param[in] max_session_size	Largest serialized session to store.
+ * @return
+ *	- A new shared cache.
+ *	- NULL on failure.
+ */
+fr_tls_cache_shared_t *fr_tls_cache_shared_alloc(TALLOC_CTX *ctx, char const *filename,
+						 uint32_t max_entries, size_t max_session_size)
+{
+	fr_tls_cache_shared_t	*sc;
+	tls_cache_shared_hdr_t	layout = {
+					.num_stripes = TLS_CACHE_SHARED_STRIPES,
+					.max_session_size = max_session_size
+				};
+	size_t			stripes_len;
+	bool			first = true;
+
+	layout.slots_per_stripe = ROUND_UP_DIV(max_entries, TLS_CACHE_SHARED_STRIPES);
+	if (layout.slots_per_stripe < TLS_CACHE_SHARED_WAYS) layout.slots_per_stripe = TLS_CACHE_SHARED_WAYS;
+	layout.slot_size = ROUND_UP(sizeof(tls_cache_shared_slot_t) + max_session_size, sizeof(int64_t));
+
+	MEM(sc = talloc_zero(ctx, fr_tls_cache_shared_t));
+	sc->fd = -1;
+	talloc_set_destructor(sc, _tls_cache_shared_free);
+
+	stripes_len = ROUND_UP(sizeof(tls_cache_shared_hdr_t), sizeof(tls_cache_shared_stripe_t)) +
+		      (sizeof(tls_cache_shared_stripe_t) * layout.num_stripes);
+	sc->map_len = stripes_len + ((size_t)layout.slot_size * layout.slots_per_stripe * layout.num_stripes);
+
+	if (!filename) {
+		sc->map = mmap(NULL, sc->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	} else {
+		struct stat buf;
+
+		sc->fd = open(filename, O_RDWR | O_CREAT, 0600);
+		if (sc->fd < 0) {
+			fr_strerror_printf("Failed opening shared session cache \"%s\": %s",
+					   filename, fr_syserror(errno));
+		error:
+			talloc_free(sc);
+			return NULL;
+		}
+
+		if (flock(sc->fd, LOCK_EX | LOCK_NB) < 0) {
+			if (errno != EWOULDBLOCK) {
+			lock_error:
+				fr_strerror_printf("Failed locking shared session cache \"%s\": %s",
+						   filename, fr_syserror(errno));
+				goto error;
+			}
+
+			/*
+			 *	Blocks until the process holding the
+			 *	exclusive lock has initialised the file.
+			 */
+			if (flock(sc->fd, LOCK_SH) < 0) goto lock_error;
+			first = false;
+		}
+
+		if (fstat(sc->fd, &buf) < 0) {
+			fr_strerror_printf("Failed checking shared session cache \"%s\": %s",
+					   filename, fr_syserror(errno));
+			goto error;
+		}
+
+		if ((size_t)buf.st_size != sc->map_len) {
+			if (!first) {
+			in_use:
+				fr_strerror_printf("Shared session cache \"%s\" is in use by another process "
+						   "with a different max_entries or max_session_size", filename);
+				goto error;
+			}
+
+			if (ftruncate(sc->fd, sc->map_len) < 0) {
+				fr_strerror_printf("Failed resizing shared session cache \"%s\": %s",
+						   filename, fr_syserror(errno));
+				goto error;
+			}
+		}
+
+		sc->map = mmap(NULL, sc->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, sc->fd, 0);
+	}
+	if (sc->map == MAP_FAILED) {
+		sc->map = NULL;
+		fr_strerror_printf("Failed mapping shared session cache: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	sc->hdr = (tls_cache_shared_hdr_t *)sc->map;
+	sc->stripes = (tls_cache_shared_stripe_t *)(sc->map + ROUND_UP(sizeof(tls_cache_shared_hdr_t),
+								       sizeof(tls_cache_shared_stripe_t)));
+	sc->slots = sc->map + stripes_len;
+
+	if (!first) {
+		if (!tls_cache_shared_layout_match(sc, &layout)) goto in_use;
+	} else {
+		if (filename && tls_cache_shared_layout_match(sc, &layout)) {
+			DEBUG2("Using existing sessions in shared session cache \"%s\"", filename);
+		} else {
+			memset(sc->map, 0, sc->map_len);
+			memcpy(sc->hdr, &layout, sizeof(*sc->hdr));
+		}
+
+		if (tls_cache_shared_init_locks(sc) < 0) goto error;
+
+		/*
+		 *	Written last, so that a partially
+		 *	initialised file is never reused.
+		 */
+		memcpy(sc->hdr->magic, TLS_CACHE_SHARED_MAGIC, sizeof(sc->hdr->magic));
+
+		/*
+		 *	Let other processes map the file.
+		 */
+		if ((sc->fd >= 0) && (flock(sc->fd, LOCK_SH) < 0)) goto lock_error;
+	}
+
+	DEBUG2("Shared session cache has %u slots of %u bytes",
+	       layout.slots_per_stripe * layout.num_stripes, layout.slot_size);
+
+	return sc;
+}
+#endif /* WITH_TLS */
@@ -77,6 +77,23 @@ static fr_table_num_sorted_t const verify_mode_table[] = {
 };
 static size_t verify_mode_table_len = NUM_ELEMENTS(verify_mode_table);
 
+static CONF_PARSER tls_cache_shared_config[] = {
+	{ FR_CONF_OFFSET("enable", FR_TYPE_BOOL, fr_tls_cache_conf_t, shared.enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_OUTPUT, fr_tls_cache_conf_t, shared.filename) },
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, fr_tls_cache_conf_t, shared.max_entries), .dflt = "16384" },
+	{ FR_CONF_OFFSET("max_session_size", FR_TYPE_SIZE, fr_tls_cache_conf_t, shared.max_session_size), .dflt = "4096" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static CONF_PARSER tls_cache_ticket_config[] = {
+	{ FR_CONF_OFFSET("secret", FR_TYPE_STRING | FR_TYPE_SECRET, fr_tls_cache_conf_t, ticket.secret) },
+	{ FR_CONF_OFFSET("rotation", FR_TYPE_TIME_DELTA, fr_tls_cache_conf_t, ticket.rotation), .dflt = "3600" },
+	{ FR_CONF_OFFSET("grace", FR_TYPE_TIME_DELTA, fr_tls_cache_conf_t, ticket.grace) },
+
+	CONF_PARSER_TERMINATOR
+};
+
 static CONF_PARSER tls_cache_config[] = {
 	{ FR_CONF_OFFSET("mode", FR_TYPE_UINT32, fr_tls_cache_conf_t, mode),
 			 .func = cf_table_parse_int,
@@ -94,6 +111,9 @@ static CONF_PARSER tls_cache_config[] = {
 	{ FR_CONF_OFFSET("require_perfect_forward_secrecy", FR_TYPE_BOOL, fr_tls_cache_conf_t, require_pfs), .dflt = "no" },
 #endif
 
+	{ FR_CONF_POINTER("shared", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) tls_cache_shared_config },
+	{ FR_CONF_POINTER("ticket", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) tls_cache_ticket_config },
+
 	/*
 	 *	Deprecated
 	 */
@@ -172,6 +192,7 @@ CONF_PARSER fr_tls_server_config[] = {
 	{ FR_CONF_OFFSET("psk_query", FR_TYPE_STRING, fr_tls_conf_t, psk_query) },
 #endif
 	{ FR_CONF_OFFSET("dh_file", FR_TYPE_FILE_INPUT, fr_tls_conf_t, dh_file) },
+	{ FR_CONF_OFFSET("async_engine", FR_TYPE_STRING, fr_tls_conf_t, async_engine) },
 	{ FR_CONF_OFFSET("fragment_size", FR_TYPE_UINT32, fr_tls_conf_t, fragment_size), .dflt = "1024" },
 	{ FR_CONF_OFFSET("padding", FR_TYPE_UINT32, fr_tls_conf_t, padding_block_size), },
 
@@ -352,6 +373,16 @@ fr_tls_conf_t *fr_tls_conf_alloc(TALLOC_CTX *ctx)
 	return conf;
 }
 
+/** Whether a virtual server contains all the sections needed for stateful session resumption
+ *
+ */
+static bool tls_conf_session_sections(CONF_SECTION *server)
+{
+	return cf_section_find(server, "load", "session") &&
+	       cf_section_find(server, "store", "session") &&
+	       cf_section_find(server, "clear", "session");
+}
+
 fr_tls_conf_t *fr_tls_conf_parse_server(CONF_SECTION *cs)
 {
 	fr_tls_conf_t *conf;
@@ -399,27 +430,36 @@ fr_tls_conf_t *fr_tls_conf_parse_server(CONF_SECTION *cs)
 		break;
 
 	case FR_TLS_CACHE_STATEFUL:
-		if (!conf->virtual_server) {
-			ERROR("A virtual_server must be set when cache.mode = \"stateful\"");
-			goto error;
-		}
-
-		if (!cf_section_find(conf->virtual_server, "load", "session")) {
-			ERROR("Specified virtual_server must contain a \"load session { ... }\" section "
-			      "when cache.mode = \"stateful\"");
-			goto error;
-		}
-
-		if (!cf_section_find(conf->virtual_server, "store", "session")) {
-			ERROR("Specified virtual_server must contain a \"store session { ... }\" section "
-			      "when cache.mode = \"stateful\"");
-			goto error;
-		}
-
-		if (!cf_section_find(conf->virtual_server, "clear", "session")) {
-			ERROR("Specified virtual_server must contain a \"clear session { ... }\" section "
-			      "when cache.mode = \"stateful\"");
-			goto error;
+		/*
+		 *	With a shared cache, the virtual server
+		 *	is optional, and used as a fallback.
+		 */
+		if (conf->cache.shared.enable) {
+			conf->cache.virtual_server = conf->virtual_server && tls_conf_session_sections(conf->virtual_server);
+		} else {
+			if (!conf->virtual_server) {
+				ERROR("A virtual_server or session.shared must be set when cache.mode = \"stateful\"");
+				goto error;
+			}
+
+			if (!cf_section_find(conf->virtual_server, "load", "session")) {
+				ERROR("Specified virtual_server must contain a \"load session { ... }\" section "
+				      "when cache.mode = \"stateful\"");
+				goto error;
+			}
+
+			if (!cf_section_find(conf->virtual_server, "store", "session")) {
+				ERROR("Specified virtual_server must contain a \"store session { ... }\" section "
+				      "when cache.mode = \"stateful\"");
+				goto error;
+			}
+
+			if (!cf_section_find(conf->virtual_server, "clear", "session")) {
+				ERROR("Specified virtual_server must contain a \"clear session { ... }\" section "
+				      "when cache.mode = \"stateful\"");
+				goto error;
+			}
+			conf->cache.virtual_server = true;
 		}
 
 		if (conf->tls_min_version >= (float)1.3) {
@@ -429,30 +469,35 @@ fr_tls_conf_t *fr_tls_conf_parse_server(CONF_SECTION *cs)
 		break;
 
 	case FR_TLS_CACHE_AUTO:
-		if (!conf->virtual_server) {
-			WARN("A virtual_server must be provided for stateful caching. "
-			     "cache.mode = \"auto\" rewritten to cache.mode = \"stateless\"");
-		cache_stateless:
-			conf->cache.mode = FR_TLS_CACHE_STATELESS;
-			break;
-		}
-
-		if (!cf_section_find(conf->virtual_server, "load", "session")) {
-			WARN("Specified virtual_server missing \"load session { ... }\" section. "
-			     "cache.mode = \"auto\" rewritten to cache.mode = \"stateless\"");
-			goto cache_stateless;
-		}
-
-		if (!cf_section_find(conf->virtual_server, "store", "session")) {
-			WARN("Specified virtual_server missing \"store session { ... }\" section. "
-			     "cache.mode = \"auto\" rewritten to cache.mode = \"stateless\"");
-			goto cache_stateless;
-		}
-
-		if (!cf_section_find(conf->virtual_server, "clear", "session")) {
-			WARN("Specified virtual_server missing \"clear cache { ... }\" section. "
-			     "cache.mode = \"auto\" rewritten to cache.mode = \"stateless\"");
-			goto cache_stateless;
+		if (conf->cache.shared.enable) {
+			conf->cache.virtual_server = conf->virtual_server && tls_conf_session_sections(conf->virtual_server);
+		} else {
+			if (!conf->virtual_server) {
+				WARN("A virtual_server must be provided for stateful caching. "
+				     "cache.mode = \"auto\" rewritten to cache.mode = \"stateless\"");
+			cache_stateless:
+				conf->cache.mode = FR_TLS_CACHE_STATELESS;
+				break;
+			}
+
+			if (!cf_section_find(conf->virtual_server, "load", "session")) {
+				WARN("Specified virtual_server missing \"load session { ... }\" section. "
+				     "cache.mode = \"auto\" rewritten to cache.mode = \"stateless\"");
+				goto cache_stateless;
+			}
+
+			if (!cf_section_find(conf->virtual_server, "store", "session")) {
+				WARN("Specified virtual_server missing \"store session { ... }\" section. "
+				     "cache.mode = \"auto\" rewritten to cache.mode = \"stateless\"");
+				goto cache_stateless;
+			}
+
+			if (!cf_section_find(conf->virtual_server, "clear", "session")) {
+				WARN("Specified virtual_server missing \"clear cache { ... }\" section. "
+				     "cache.mode = \"auto\" rewritten to cache.mode = \"stateless\"");
+				goto cache_stateless;
+			}
+			conf->cache.virtual_server = true;
 		}
 
 		if (conf->tls_min_version >= (float)1.3) {
@@ -464,10 +509,34 @@ fr_tls_conf_t *fr_tls_conf_parse_server(CONF_SECTION *cs)
 	}
 
 	/*
-	 *	Generate random, ephemeral, session-ticket keys.
+	 *	Map the shared session cache.  This is
+	 *	shared by all threads using this config.
+	 */
+	if ((conf->cache.mode & FR_TLS_CACHE_STATEFUL) && conf->cache.shared.enable) {
+		FR_INTEGER_BOUND_CHECK("session.shared.max_entries", conf->cache.shared.max_entries, >=, 64);
+		FR_SIZE_BOUND_CHECK("session.shared.max_session_size", conf->cache.shared.max_session_size, >=, (size_t)256);
+		FR_SIZE_BOUND_CHECK("session.shared.max_session_size", conf->cache.shared.max_session_size, <=, (size_t)65535);
+
+		conf->cache.shared.cache = fr_tls_cache_shared_alloc(conf, conf->cache.shared.filename,
+								     conf->cache.shared.max_entries,
+								     conf->cache.shared.max_session_size);
+		if (!conf->cache.shared.cache) {
+			PERROR("Failed creating shared session cache");
+			goto error;
+		}
+	}
+
+	/*
+	 *	Derive the session-ticket keys.  These are
+	 *	shared by all threads using this config, and
+	 *	by any other servers with the same secret.
 	 */
 	if (conf->cache.mode & FR_TLS_CACHE_STATELESS) {
-		fr_rand_buffer(conf->cache.session_ticket_key_rand, sizeof(conf->cache.session_ticket_key_rand));
+		FR_TIME_DELTA_BOUND_CHECK("session.ticket.rotation", conf->cache.ticket.rotation, >=, fr_time_delta_from_sec(60));
+		FR_TIME_DELTA_BOUND_CHECK("session.ticket.rotation", conf->cache.ticket.rotation, <=, fr_time_delta_from_sec(86400 * 7));
+
+		conf->cache.ticket.keys = fr_tls_ticket_keys_alloc(conf, &conf->cache);
+		if (!conf->cache.ticket.keys) goto error;
 	}
 
 	/*
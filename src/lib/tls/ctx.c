@@ -30,6 +30,7 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #ifdef WITH_TLS
 #define LOG_PREFIX "tls - "
 
+#include <freeradius-devel/tls/engine.h>
 #include <freeradius-devel/tls/log.h>
 #include <freeradius-devel/util/base16.h>
 #include <freeradius-devel/util/debug.h>
@@ -447,6 +448,33 @@ SSL_CTX *fr_tls_ctx_alloc(fr_tls_conf_t const *conf, bool client)
 	 */
 	SSL_CTX_set_ex_data(ctx, FR_TLS_EX_INDEX_CONF, UNCONST(void *, conf));
 
+	/*
+	 *	Public key operations are performed by the
+	 *	engine for any keys loaded after this point.
+	 *
+	 *	Engines such as QAT pause the async job when
+	 *	an operation is submitted, and tell us when
+	 *	it's complete via an async fd.  The worker
+	 *	processes other requests in the meantime.
+	 */
+	if (conf->async_engine) {
+		ENGINE *e;
+
+		if (fr_tls_engine(&e, conf->async_engine, NULL, true) < 0) {
+			PERROR("Failed loading async_engine \"%s\"", conf->async_engine);
+			SSL_CTX_free(ctx);
+			return NULL;
+		}
+
+		if (ENGINE_set_default(e, ENGINE_METHOD_RSA | ENGINE_METHOD_DSA | ENGINE_METHOD_DH |
+				       ENGINE_METHOD_EC | ENGINE_METHOD_PKEY_METHS) != 1) {
+			fr_tls_log_error(NULL, "Failed setting async_engine \"%s\" as the default",
+					 conf->async_engine);
+			SSL_CTX_free(ctx);
+			return NULL;
+		}
+	}
+
 	/*
 	 *	Identify the type of certificates that needs to be loaded
 	 */
@@ -33,6 +33,7 @@
 #include <freeradius-devel/util/base16.h>
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/pair_legacy.h>
+#include <freeradius-devel/util/syserror.h>
 
 #include <freeradius-devel/protocol/freeradius/freeradius.internal.h>
 
@@ -45,6 +46,7 @@
 
 #include "attrs.h"
 #include "base.h"
+#include "bio.h"
 #include "log.h"
 
 static char const *tls_version_str[] = {
@@ -183,6 +185,7 @@ static char const *tls_handshake_type_str[] = {
  */
 inline static void record_init(fr_tls_record_t *record)
 {
+	record->start = 0;
 	record->used = 0;
 }
 
@@ -192,6 +195,7 @@ inline static void record_init(fr_tls_record_t *record)
  */
 inline static void record_close(fr_tls_record_t *record)
 {
+	record->start = 0;
 	record->used = 0;
 }
 
@@ -204,12 +208,23 @@ inline static void record_close(fr_tls_record_t *record)
  */
 inline static unsigned int record_from_buff(fr_tls_record_t *record, void const *in, unsigned int inlen)
 {
-	unsigned int added = FR_TLS_MAX_RECORD_SIZE - record->used;
+	unsigned int added;
 
+	/*
+	 *	Only shift unread data to the start of
+	 *	the buffer if we'd otherwise run out of
+	 *	space.
+	 */
+	if ((record->start > 0) && ((record->start + record->used + inlen) > FR_TLS_MAX_RECORD_SIZE)) {
+		memmove(record->data, record->data + record->start, record->used);
+		record->start = 0;
+	}
+
+	added = FR_TLS_MAX_RECORD_SIZE - (record->start + record->used);
 	if (added > inlen) added = inlen;
 	if (added == 0) return 0;
 
-	memcpy(record->data + record->used, in, added);
+	memcpy(record->data + record->start + record->used, in, added);
 	record->used += added;
 
 	return added;
@@ -228,14 +243,16 @@ inline static unsigned int record_to_buff(fr_tls_record_t *record, void *out, un
 
 	if (taken > outlen) taken = outlen;
 	if (taken == 0) return 0;
-	if (out) memcpy(out, record->data, taken);
-
-	record->used -= taken;
+	if (out) memcpy(out, record->data + record->start, taken);
 
 	/*
-	 *	This is pretty bad...
+	 *	Advance past the data we've taken, rather
+	 *	than moving the remainder.  When a record
+	 *	is split into many fragments, moving the
+	 *	remainder each time is quadratic.
 	 */
-	if (record->used > 0) memmove(record->data, record->data + taken, record->used);
+	record->used -= taken;
+	record->start = (record->used > 0) ? record->start + taken : 0;
 
 	return taken;
 }
@@ -849,7 +866,8 @@ int fr_tls_session_recv(request_t *request, fr_tls_session_t *tls_session)
 	 *	Decrypt the complete record.
 	 */
 	if (tls_session->dirty_in.used) {
-		ret = BIO_write(tls_session->into_ssl, tls_session->dirty_in.data, tls_session->dirty_in.used);
+		ret = BIO_write(tls_session->into_ssl, tls_session->dirty_in.data + tls_session->dirty_in.start,
+				tls_session->dirty_in.used);
 		if (ret != (int) tls_session->dirty_in.used) {
 			record_init(&tls_session->dirty_in);
 			REDEBUG("Failed writing %zd bytes to SSL BIO: %d", tls_session->dirty_in.used, ret);
@@ -953,19 +971,21 @@ int fr_tls_session_send(request_t *request, fr_tls_session_t *tls_session)
 	 */
 	if (tls_session->clean_in.used > 0) {
 		if (RDEBUG_ENABLED3) {
-			RHEXDUMP3(tls_session->clean_in.data, tls_session->clean_in.used,
+			RHEXDUMP3(tls_session->clean_in.data + tls_session->clean_in.start, tls_session->clean_in.used,
 				 "TLS application data to encrypt (%zu bytes)", tls_session->clean_in.used);
 		} else {
 			RDEBUG2("TLS application data to encrypt (%zu bytes)", tls_session->clean_in.used);
 		}
 
-		ret = SSL_write(tls_session->ssl, tls_session->clean_in.data, tls_session->clean_in.used);
+		ret = SSL_write(tls_session->ssl, tls_session->clean_in.data + tls_session->clean_in.start,
+				tls_session->clean_in.used);
 		record_to_buff(&tls_session->clean_in, NULL, ret);
 
 		/* Get the dirty data from Bio to send it */
 		ret = BIO_read(tls_session->from_ssl, tls_session->dirty_out.data,
 			       sizeof(tls_session->dirty_out.data));
 		if (ret > 0) {
+			tls_session->dirty_out.start = 0;
 			tls_session->dirty_out.used = ret;
 			ret = 0;
 		} else {
@@ -1016,6 +1036,7 @@ static void fr_tls_session_alert_send(request_t *request, fr_tls_session_t *sess
 	session->dirty_out.data[5] = session->pending_alert_level;
 	session->dirty_out.data[6] = session->pending_alert_description;
 
+	session->dirty_out.start = 0;
 	session->dirty_out.used = 7;
 
 	session->pending_alert = false;
@@ -1143,6 +1164,7 @@ static unlang_action_t tls_session_async_handshake_done_round(UNUSED rlm_rcode_t
 		ret = BIO_read(tls_session->from_ssl, tls_session->dirty_out.data,
 			       sizeof(tls_session->dirty_out.data));
 		if (ret > 0) {
+			tls_session->dirty_out.start = 0;
 			tls_session->dirty_out.used = ret;
 		} else if (BIO_should_retry(tls_session->from_ssl)) {
 			record_init(&tls_session->dirty_in);
@@ -1176,6 +1198,89 @@ static unlang_action_t tls_session_async_handshake_done_round(UNUSED rlm_rcode_t
 	return UNLANG_ACTION_CALCULATE_RESULT;
 }
 
+/** An engine has completed an asynchronous operation
+ *
+ * Stops waiting on the async fds, and resumes the handshake.
+ */
+static void tls_session_async_fd_read(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_tls_session_t	*tls_session = talloc_get_type_abort(uctx, fr_tls_session_t);
+	request_t		*request = fr_tls_session_request(tls_session->ssl);
+
+	RDEBUG3("Engine completed async operation");
+
+	TALLOC_FREE(tls_session->async_fds);
+	unlang_interpret_mark_runnable(request);
+}
+
+/** An async fd errored out
+ *
+ * Resume the handshake anyway, SSL_read() will tell us what went wrong.
+ */
+static void tls_session_async_fd_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+				       int fd_errno, void *uctx)
+{
+	fr_tls_session_t	*tls_session = talloc_get_type_abort(uctx, fr_tls_session_t);
+	request_t		*request = fr_tls_session_request(tls_session->ssl);
+
+	RERROR("Error on async fd: %s", fr_syserror(fd_errno));
+
+	TALLOC_FREE(tls_session->async_fds);
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Wait for an engine to complete an asynchronous operation
+ *
+ * Engines which offload crypto operations (e.g. QAT) pause the async job
+ * when an operation is submitted, and signal an fd when it completes.
+ * Rather than blocking the worker, we insert the fds into the request's
+ * event list, and yield until one of them is readable.
+ *
+ * @param[in] request		The current request.
+ * @param[in] tls_session	that's waiting on the engine.
+ * @return
+ *	- UNLANG_ACTION_YIELD if we're waiting on the engine.
+ *	- UNLANG_ACTION_CALCULATE_RESULT if there's nothing to wait on.
+ *	- UNLANG_ACTION_FAIL on error.
+ */
+static unlang_action_t tls_session_async_fd_wait(request_t *request, fr_tls_session_t *tls_session)
+{
+	size_t	num_fds = 0, i;
+
+	if (!SSL_waiting_for_async(tls_session->ssl)) return UNLANG_ACTION_CALCULATE_RESULT;
+
+	if (SSL_get_all_async_fds(tls_session->ssl, NULL, &num_fds) != 1) {
+		fr_tls_log_error(request, "Failed retrieving async fds");
+		return UNLANG_ACTION_FAIL;
+	}
+	if (!num_fds) return UNLANG_ACTION_CALCULATE_RESULT;
+
+	fr_assert(!tls_session->async_fds);
+	MEM(tls_session->async_fds = talloc_array(tls_session, OSSL_ASYNC_FD, num_fds));
+	if (SSL_get_all_async_fds(tls_session->ssl, tls_session->async_fds, &num_fds) != 1) {
+		fr_tls_log_error(request, "Failed retrieving async fds");
+	error:
+		TALLOC_FREE(tls_session->async_fds);
+		return UNLANG_ACTION_FAIL;
+	}
+
+	/*
+	 *	The events are bound to the array, so freeing
+	 *	it removes them from the event list.
+	 */
+	for (i = 0; i < num_fds; i++) {
+		if (fr_event_fd_insert(tls_session->async_fds, request->el, tls_session->async_fds[i],
+				       tls_session_async_fd_read, NULL, tls_session_async_fd_error, tls_session) < 0) {
+			RPERROR("Failed inserting async fd");
+			goto error;
+		}
+	}
+
+	RDEBUG3("Waiting for engine to complete async operation");
+
+	return UNLANG_ACTION_YIELD;
+}
+
 /** Try very hard to get the SSL * into a consistent state where it's not yielded
  *
  * ...because if it's yielded, we'll probably leak thread contexts and all kinds of memory.
@@ -1192,6 +1297,8 @@ static void tls_session_async_handshake_signal(UNUSED request_t *request, fr_sta
 
 	if (action != FR_SIGNAL_CANCEL) return;
 
+	TALLOC_FREE(tls_session->async_fds);
+
 	/*
 	 *	If SSL_get_error returns SSL_ERROR_WANT_ASYNC
 	 *	it means we're yielded in the middle of a
@@ -1319,6 +1426,23 @@ static unlang_action_t tls_session_async_handshake_cont(rlm_rcode_t *p_result, i
 			if (unlang_function_clear(request) < 0) goto error;
 			goto error;
 
+		case UNLANG_ACTION_PUSHED_CHILD:
+			return ua;
+
+		default:
+			break;
+		}
+
+		/*
+		 *	Finally, the job may have been paused by
+		 *	an engine performing a crypto operation.
+		 */
+		ua = tls_session_async_fd_wait(request, tls_session);
+		switch (ua) {
+		case UNLANG_ACTION_FAIL:
+			if (unlang_function_clear(request) < 0) goto error;
+			goto error;
+
 		default:
 			return ua;
 		}
@@ -1393,7 +1517,8 @@ static unlang_action_t tls_session_async_handshake(rlm_rcode_t *p_result, int *p
 	 *	or continue the TLS handshake.
 	 */
 	if (tls_session->dirty_in.used) {
-		ret = BIO_write(tls_session->into_ssl, tls_session->dirty_in.data, tls_session->dirty_in.used);
+		ret = BIO_write(tls_session->into_ssl, tls_session->dirty_in.data + tls_session->dirty_in.start,
+				tls_session->dirty_in.used);
 		if (ret != (int)tls_session->dirty_in.used) {
 			REDEBUG("Failed writing %zd bytes to TLS BIO: %d", tls_session->dirty_in.used, ret);
 			record_init(&tls_session->dirty_in);
@@ -1587,9 +1712,13 @@ fr_tls_session_t *fr_tls_session_alloc_server(TALLOC_CTX *ctx, SSL_CTX *ssl_ctx,
 	 *	This means that all SSL IO is done to/from memory,
 	 *	and we can update those BIOs from the packets we've
 	 *	received.
+	 *
+	 *	The BIOs buffer data in chains of segments, so
+	 *	record fragments can be appended as they arrive
+	 *	without the buffer being reallocated.
 	 */
-	MEM(tls_session->into_ssl = BIO_new(BIO_s_mem()));
-	MEM(tls_session->from_ssl = BIO_new(BIO_s_mem()));
+	MEM(tls_session->into_ssl = fr_tls_bio_chain_alloc(FR_TLS_BIO_SEGMENT_SIZE, FR_TLS_BIO_PREALLOC, 0));
+	MEM(tls_session->from_ssl = fr_tls_bio_chain_alloc(FR_TLS_BIO_SEGMENT_SIZE, FR_TLS_BIO_PREALLOC, 0));
 	SSL_set_bio(tls_session->ssl, tls_session->into_ssl, tls_session->from_ssl);
 
 	/*
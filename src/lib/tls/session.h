@@ -61,9 +61,18 @@ extern "C" {
  */
 typedef struct {
 	uint8_t		data[FR_TLS_MAX_RECORD_SIZE];
-	size_t 		used;
+	size_t		start;			//!< Offset of the first unread byte.  Lets fragments
+						///< be read out without shifting the remaining data.
+	size_t 		used;			//!< Unread bytes, starting at data + start.
 } fr_tls_record_t;
 
+/*
+ *	Segment size and preallocation for the BIOs which
+ *	carry the network side of a TLS session.
+ */
+#define FR_TLS_BIO_SEGMENT_SIZE	4096
+#define FR_TLS_BIO_PREALLOC	FR_TLS_MAX_RECORD_SIZE
+
 typedef enum {
 	TLS_INFO_ORIGIN_RECORD_RECEIVED,
 	TLS_INFO_ORIGIN_RECORD_SENT
@@ -113,6 +122,8 @@ struct fr_tls_session_s {
 	fr_tls_record_t 	dirty_in;			//!< Encrypted data to decrypt.
 	fr_tls_record_t 	dirty_out;			//!< Encrypted data that's been decrypted.
 	int			last_ret;			//!< Last result returned by SSL_read().
+	OSSL_ASYNC_FD		*async_fds;			//!< fds we're waiting on for an engine to
+								///< complete an asynchronous operation.
 
 	void 			(*record_init)(fr_tls_record_t *buf);
 	void 			(*record_close)(fr_tls_record_t *buf);
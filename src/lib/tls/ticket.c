@@ -0,0 +1,327 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file tls/ticket.c
+ * @brief Rotating session-ticket keys
+ *
+ * Session-ticket keys are derived from a secret, and the current key period.
+ * The key period is the current (wall clock) time, divided by the rotation
+ * interval.  Every server configured with the same secret derives the same
+ * keys without any coordination, so tickets issued by one server can be used
+ * to resume sessions on any other.
+ *
+ * The key name embedded in each ticket is a tag derived from the secret,
+ * followed by the key period the ticket was encrypted in.  When a ticket is
+ * presented, the key is derived again from the period in the key name.
+ * Tickets encrypted in previous key periods are accepted for the grace
+ * period, and are re-issued with the current key.
+ *
+ * If no secret is configured, a random one is generated at startup, and
+ * tickets can only be used with the server that issued them.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
+
+#ifdef WITH_TLS
+#define LOG_PREFIX "tls - "
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/net.h>
+#include <freeradius-devel/util/rand.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  include <openssl/core_names.h>
+#endif
+
+#include "base.h"
+#include "cache.h"
+#include "log.h"
+
+#define TLS_TICKET_TAG_LEN	8	//!< Length of the secret's tag, at the start of the key name.
+#define TLS_TICKET_KEY_LEN	32	//!< Length of the AES and HMAC keys.
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX tls_ticket_mac_ctx_t;
+#else
+typedef HMAC_CTX tls_ticket_mac_ctx_t;
+#endif
+
+/** Key material and statistics for session-tickets
+ *
+ */
+struct fr_tls_ticket_keys_s {
+	uint8_t			secret[SHA256_DIGEST_LENGTH];	//!< All keys are derived from this.
+	uint8_t			tag[TLS_TICKET_TAG_LEN];	//!< Identifies tickets encrypted with keys
+								///< derived from our secret.
+	uint64_t		rotation;		//!< Length of a key period in seconds.
+	uint64_t		grace;			//!< How many previous key periods are accepted.
+
+	atomic_uint_fast64_t	epoch;			//!< Key period tickets were last issued in.
+
+	atomic_uint_fast64_t	issued;			//!< Tickets issued in this key period.
+	atomic_uint_fast64_t	current;		//!< Tickets decrypted with the current key.
+	atomic_uint_fast64_t	previous;		//!< Tickets decrypted with a previous key.
+	atomic_uint_fast64_t	rejected;		//!< Tickets with unknown or expired keys.
+};
+
+/** Derive key material for a given key period
+ *
+ * @param[out] out	Where to write the key.  Must be SHA256_DIGEST_LENGTH bytes.
+ * @param[in] keys	containing the secret.
+ * @param[in] label	Distinguishes the different keys derived for a period.
+ * @param[in] epoch	Key period to derive the key for.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int tls_ticket_key_derive(uint8_t out[static SHA256_DIGEST_LENGTH],
+				 fr_tls_ticket_keys_t const *keys, char label, uint64_t epoch)
+{
+	uint8_t		in[1 + sizeof(uint64_t)];
+	unsigned int	len = SHA256_DIGEST_LENGTH;
+
+	in[0] = (uint8_t)label;
+	fr_net_from_uint64(in + 1, epoch);
+
+	if (!HMAC(EVP_sha256(), keys->secret, sizeof(keys->secret), in, sizeof(in), out, &len)) return -1;
+
+	return 0;
+}
+
+/** Initialise the ticket MAC with the key for a key period
+ *
+ */
+static int tls_ticket_mac_init(tls_ticket_mac_ctx_t *hctx, uint8_t const *key, size_t key_len)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	OSSL_PARAM params[] = {
+		OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, UNCONST(uint8_t *, key), key_len),
+		OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, UNCONST(char *, "SHA256"), 0),
+		OSSL_PARAM_construct_end()
+	};
+
+	return EVP_MAC_CTX_set_params(hctx, params);
+#else
+	return HMAC_Init_ex(hctx, key, key_len, EVP_sha256(), NULL);
+#endif
+}
+
+/** Log statistics for the previous key period, and reset them
+ *
+ * Only the thread which changes the epoch logs the statistics.
+ */
+static void tls_ticket_keys_rotate(fr_tls_ticket_keys_t *keys, uint64_t now)
+{
+	uint64_t	last = atomic_load_explicit(&keys->epoch, memory_order_relaxed);
+	uint64_t	issued, current, previous, rejected;
+
+	if (last == now) return;
+	if (!atomic_compare_exchange_strong(&keys->epoch, &last, now)) return;
+
+	issued = atomic_exchange(&keys->issued, 0);
+	current = atomic_exchange(&keys->current, 0);
+	previous = atomic_exchange(&keys->previous, 0);
+	rejected = atomic_exchange(&keys->rejected, 0);
+
+	if (!last) return;	/* First ticket we've issued */
+
+	INFO("Rotated session-ticket key.  Previous key period: %" PRIu64 " tickets issued, "
+	     "%" PRIu64 " resumed with the current key, %" PRIu64 " resumed with previous keys, "
+	     "%" PRIu64 " rejected", issued, current, previous, rejected);
+}
+
+/** Called by OpenSSL to set up the cipher and MAC contexts for a session-ticket
+ *
+ * @param[in] ssl	session the ticket is for.
+ * @param[in,out] key_name	Written when encrypting, read when decrypting.
+ * @param[in,out] iv		Written when encrypting, read when decrypting.
+ * @param[in] ctx	Cipher context to initialise.
+ * @param[in] hctx	MAC context to initialise.
+ * @param[in] enc	1 if we're encrypting a new ticket, 0 if we're decrypting one.
+ * @return
+ *	- 2 the ticket was decrypted, but should be re-issued with the current key.
+ *	- 1 the contexts were set up.
+ *	- 0 the key in the ticket is unknown, a full handshake is needed.
+ *	- -1 on error.
+ */
+static int tls_ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char *iv,
+			     EVP_CIPHER_CTX *ctx, tls_ticket_mac_ctx_t *hctx, int enc)
+{
+	fr_tls_conf_t		*conf = fr_tls_session_conf(ssl);
+	fr_tls_ticket_keys_t	*keys = conf->cache.ticket.keys;
+	request_t		*request = fr_tls_session_request_bound(ssl) ? fr_tls_session_request(ssl) : NULL;
+	uint64_t		now = (uint64_t)time(NULL) / keys->rotation;
+	uint64_t		epoch;
+	uint8_t			aes_key[SHA256_DIGEST_LENGTH], hmac_key[SHA256_DIGEST_LENGTH];
+	int			ret = 1;
+
+	if (enc) {
+		tls_ticket_keys_rotate(keys, now);
+
+		memcpy(key_name, keys->tag, TLS_TICKET_TAG_LEN);
+		fr_net_from_uint64(key_name + TLS_TICKET_TAG_LEN, now);
+
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) {
+			ROPTIONAL(RERROR, ERROR, "Failed generating session-ticket IV");
+			return -1;
+		}
+		epoch = now;
+	} else {
+		if (memcmp(key_name, keys->tag, TLS_TICKET_TAG_LEN) != 0) {
+			ROPTIONAL(RDEBUG2, DEBUG2, "Session-ticket was issued with a different secret");
+		reject:
+			atomic_fetch_add_explicit(&keys->rejected, 1, memory_order_relaxed);
+			return 0;
+		}
+
+		/*
+		 *	Allow one period in the future, to
+		 *	account for small differences between
+		 *	the clocks of different servers.
+		 */
+		epoch = fr_net_to_uint64(key_name + TLS_TICKET_TAG_LEN);
+		if ((epoch > (now + 1)) || ((epoch + keys->grace) < now)) {
+			ROPTIONAL(RDEBUG2, DEBUG2, "Session-ticket key has expired");
+			goto reject;
+		}
+	}
+
+	if ((tls_ticket_key_derive(aes_key, keys, 'A', epoch) < 0) ||
+	    (tls_ticket_key_derive(hmac_key, keys, 'H', epoch) < 0)) {
+	error:
+		fr_tls_log_strerror_printf(NULL);
+		ROPTIONAL(RPERROR, PERROR, "Failed initialising session-ticket key");
+		ret = -1;
+		goto done;
+	}
+
+	if (enc) {
+		if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, aes_key, iv) != 1) goto error;
+	} else {
+		if (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, aes_key, iv) != 1) goto error;
+	}
+	if (tls_ticket_mac_init(hctx, hmac_key, TLS_TICKET_KEY_LEN) != 1) goto error;
+
+	if (enc) {
+		atomic_fetch_add_explicit(&keys->issued, 1, memory_order_relaxed);
+	} else if (epoch != now) {
+		ROPTIONAL(RDEBUG2, DEBUG2, "Session-ticket was issued with a previous key, re-issuing");
+		atomic_fetch_add_explicit(&keys->previous, 1, memory_order_relaxed);
+		ret = 2;
+	} else {
+		atomic_fetch_add_explicit(&keys->current, 1, memory_order_relaxed);
+	}
+
+done:
+	OPENSSL_cleanse(aes_key, sizeof(aes_key));
+	OPENSSL_cleanse(hmac_key, sizeof(hmac_key));
+
+	return ret;
+}
+
+/** Wipe the secret when the keys are freed
+ *
+ */
+static int _tls_ticket_keys_free(fr_tls_ticket_keys_t *keys)
+{
+	OPENSSL_cleanse(keys->secret, sizeof(keys->secret));
+
+	return 0;
+}
+
+/** Allocate session-ticket keys
+ *
+ * @param[in] ctx		to allocate the keys in.
+ * @param[in] cache_conf	containing the secret, rotation interval and grace period.
+ * @return
+ *	- New session-ticket keys.
+ *	- NULL on error.
+ */
+fr_tls_ticket_keys_t *fr_tls_ticket_keys_alloc(TALLOC_CTX *ctx, fr_tls_cache_conf_t const *cache_conf)
+{
+	fr_tls_ticket_keys_t	*keys;
+	uint8_t			tag[SHA256_DIGEST_LENGTH];
+	unsigned int		len = sizeof(keys->secret);
+	uint64_t		grace;
+
+	MEM(keys = talloc_zero(ctx, fr_tls_ticket_keys_t));
+
+	if (cache_conf->ticket.secret) {
+		if (!EVP_Digest(cache_conf->ticket.secret, talloc_array_length(cache_conf->ticket.secret) - 1,
+				keys->secret, &len, EVP_sha256(), NULL)) {
+			fr_tls_log_strerror_printf(NULL);
+			PERROR("Failed hashing session-ticket secret");
+		error:
+			talloc_free(keys);
+			return NULL;
+		}
+	} else {
+		fr_rand_buffer(keys->secret, sizeof(keys->secret));
+	}
+
+	if (tls_ticket_key_derive(tag, keys, 'T', 0) < 0) {
+		fr_tls_log_strerror_printf(NULL);
+		PERROR("Failed deriving session-ticket tag");
+		goto error;
+	}
+	memcpy(keys->tag, tag, sizeof(keys->tag));
+
+	keys->rotation = fr_time_delta_to_sec(cache_conf->ticket.rotation);
+	grace = cache_conf->ticket.grace ? fr_time_delta_to_sec(cache_conf->ticket.grace) : cache_conf->lifetime;
+	keys->grace = (grace + keys->rotation - 1) / keys->rotation;
+
+	talloc_set_destructor(keys, _tls_ticket_keys_free);
+
+	return keys;
+}
+
+/** Set the callback used to encrypt and decrypt session-tickets
+ *
+ * @param[in] ctx	to set the callback for.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_tls_ticket_ctx_init(SSL_CTX *ctx)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	if (SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, tls_ticket_key_cb) != 1) {
+#else
+	if (SSL_CTX_set_tlsext_ticket_key_cb(ctx, tls_ticket_key_cb) != 1) {
+#endif
+		fr_tls_log_strerror_printf(NULL);
+		PERROR("Failed setting session-ticket key callback");
+		return -1;
+	}
+
+	return 0;
+}
+#endif /* WITH_TLS */
@@ -211,6 +211,37 @@ static bool pass2_fixup_tmpl(TALLOC_CTX *ctx, tmpl_t **vpt_p, CONF_ITEM const *c
 	return true;
 }
 
+/** Bind a specialised comparison function to a condition
+ *
+ * When an attribute is compared to a literal, both data types are
+ * known once the condition has been fixed up, and the literal has
+ * already been cast to the attribute's data type.  So we pick the
+ * comparison function now, instead of on every evaluation.
+ *
+ * The function is always passed the attribute's own data.  IPv4
+ * addresses compared to a prefix are cast to a prefix by the parser,
+ * but the specialised function checks the address directly.
+ */
+static void pass2_cond_cmp_bind(fr_cond_t *c)
+{
+	map_t		*map;
+	fr_type_t	type;
+
+	if (c->type != COND_TYPE_MAP) return;
+	if (c->pass2_fixup != PASS2_FIXUP_NONE) return;
+
+	map = c->data.map;
+
+	if (!tmpl_is_attr(map->lhs)) return;
+	if (!tmpl_is_data(map->rhs) || !fr_type_is_null(map->rhs->cast)) return;
+
+	type = tmpl_da(map->lhs)->type;
+	if (!fr_type_is_null(map->lhs->cast) &&
+	    ((type != FR_TYPE_IPV4_ADDR) || (map->lhs->cast != FR_TYPE_IPV4_PREFIX))) return;
+
+	c->cmp = fr_value_box_cmp_op_func(map->op, type, tmpl_value_type(map->rhs));
+}
+
 static bool pass2_fixup_cond_map(fr_cond_t *c, CONF_ITEM *ci, fr_dict_t const *dict)
 {
 	tmpl_t	*vpt;
@@ -1969,12 +2000,6 @@ static unlang_t *compile_switch(unlang_t *parent, unlang_compile_t *unlang_ctx,
 		return NULL;
 	}
 
-	if (tmpl_is_data(gext->vpt)) {
-		cf_log_err(cs, "Cannot use constant data for 'switch' statement");
-		talloc_free(g);
-		return NULL;
-	}
-
 	if (!tmpl_is_attr(gext->vpt)) (void) tmpl_cast_set(gext->vpt, FR_TYPE_STRING);
 
 	type = FR_TYPE_STRING;
@@ -1983,6 +2008,9 @@ static unlang_t *compile_switch(unlang_t *parent, unlang_compile_t *unlang_ctx,
 
 	} else if (tmpl_is_attr(gext->vpt)) {
 		type = tmpl_da(gext->vpt)->type;
+
+	} else if (tmpl_is_data(gext->vpt)) {
+		type = tmpl_value_type(gext->vpt);
 	}
 
 	htype = fr_htrie_hint(type);
@@ -1993,6 +2021,13 @@ static unlang_t *compile_switch(unlang_t *parent, unlang_compile_t *unlang_ctx,
 		return NULL;
 	}
 
+	/*
+	 *	'case' values are only ever looked up exactly, so
+	 *	strings and octets are hashed instead of being put
+	 *	into a tree.
+	 */
+	if (htype == FR_HTRIE_RB) htype = FR_HTRIE_HASH;
+
 	gext->ht = fr_htrie_alloc(gext, htype,
 				  (fr_hash_t) case_hash,
 				  (fr_cmp_t) case_cmp,
@@ -2092,6 +2127,45 @@ static unlang_t *compile_switch(unlang_t *parent, unlang_compile_t *unlang_ctx,
 		g->num_children++;
 	}
 
+	/*
+	 *	Constant data, usually from a configuration
+	 *	expansion.  The same 'case' is always taken, so
+	 *	pick it now, and throw the others away.  At run
+	 *	time the remaining 'case' is the default.
+	 */
+	if (tmpl_is_data(gext->vpt)) {
+		unlang_t	*found, *child, *next;
+		unlang_case_t	my_case = (unlang_case_t) {
+					.group = (unlang_group_t) {
+						.self = (unlang_t) {
+							.type = UNLANG_TYPE_CASE,
+						},
+					},
+					.vpt = gext->vpt,
+				};
+
+		found = fr_htrie_find(gext->ht, &my_case);
+		if (!found) found = gext->default_case;
+		if (!found) {
+			cf_log_debug_prefix(cs, "Skipping '%s' as no 'case' matches", c->debug_name);
+			talloc_free(g);
+			return UNLANG_IGNORE;
+		}
+
+		TALLOC_FREE(gext->ht);
+
+		for (child = g->children; child; child = next) {
+			next = child->next;
+			if (child != found) talloc_free(child);
+		}
+
+		found->next = NULL;
+		g->children = found;
+		g->tail = &found->next;
+		g->num_children = 1;
+		gext->default_case = found;
+	}
+
 	compile_action_defaults(c, unlang_ctx);
 
 	return c;
@@ -2174,6 +2248,9 @@ static unlang_t *compile_case(unlang_t *parent, unlang_compile_t *unlang_ctx, CO
  			if (tmpl_is_attr(switch_gext->vpt)) da = tmpl_da(switch_gext->vpt);
 
 			if (fr_type_is_null(cast_type) && da) cast_type = da->type;
+			if (fr_type_is_null(cast_type) && tmpl_is_data(switch_gext->vpt)) {
+				cast_type = tmpl_value_type(switch_gext->vpt);
+			}
 
 			if (tmpl_cast_in_place(vpt, cast_type, da) < 0) {
 				cf_log_perr(cs, "Invalid argument for 'case' statement");
@@ -2503,6 +2580,7 @@ static unlang_t *compile_if_subsection(unlang_t *parent, unlang_compile_t *unlan
 			case COND_TYPE_MAP:
 				if (!pass2_fixup_cond_map(leaf, cf_section_to_item(cs),
 							  unlang_ctx->rules->dict_def)) return false;
+				pass2_cond_cmp_bind(leaf);
 				break;
 
 			default:
@@ -2756,6 +2834,16 @@ static unlang_t *compile_load_balance_subsection(unlang_t *parent, unlang_compil
 		case TMPL_TYPE_EXEC:
 			break;
 		}
+
+		/*
+		 *	Build the lookup table now, so that each key
+		 *	is always sent to the same child.
+		 */
+		if (unlang_load_balance_table_build(gext) < 0) {
+			cf_log_perr(cs, "Failed building load-balance table");
+			talloc_free(g);
+			return NULL;
+		}
 	}
 
 	return c;
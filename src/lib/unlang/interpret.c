@@ -27,6 +27,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/server/cond.h>
+#include <freeradius-devel/unlang/call.h>
 #include <freeradius-devel/unlang/xlat.h>
 
 #include "interpret_priv.h"
@@ -34,6 +35,8 @@ RCSID("$Id$")
 #include "parallel_priv.h"
 #include "unlang_priv.h"
 
+#include <ctype.h>
+
 /** The default interpreter instance for this thread
  */
 static _Thread_local unlang_interpret_t *intp_thread_default;
@@ -55,6 +58,59 @@ static fr_table_num_ordered_t const unlang_frame_action_table[] = {
 };
 static size_t unlang_frame_action_table_len = NUM_ELEMENTS(unlang_frame_action_table);
 
+/** Whether the time spent in each instruction is recorded
+ *
+ * Changed with `set unlang profile (on|off|memory)` in radmin.
+ */
+bool unlang_profile = false;
+
+/** Whether the memory allocated by each instruction is recorded
+ *
+ * talloc has no allocation hooks, so this walks the request's talloc
+ * tree before and after every instruction, and records the difference.
+ * That is allocations minus frees, for memory parented by the request.
+ * The walk is O(n) in the number of blocks, so this is much more
+ * expensive than profiling time alone.
+ *
+ * Enabled with `set unlang profile memory` in radmin, or `-A` in
+ * unit_test_module.
+ */
+bool unlang_profile_memory = false;
+
+/** How much memory a request may use before the module which exceeded it fails
+ *
+ * Set by `soft_request_memory` in the main config.  0 means no limit.
+ */
+size_t unlang_request_memory_soft = 0;
+
+/** How much memory a request may use before it's stopped
+ *
+ * Set by `max_request_memory` in the main config.  0 means no limit.
+ */
+size_t unlang_request_memory_hard = 0;
+
+/** Time spent in one instruction, by one interpreter
+ *
+ */
+typedef struct {
+	unlang_t const		*instruction;	//!< Which was executed.
+	uint64_t		calls;		//!< Number of times it was executed.
+	fr_time_delta_t		running;	//!< Time spent running it, and its children.
+	fr_time_delta_t		yielded;	//!< Time spent yielded, waiting for I/O or subrequests.
+	int64_t			blocks;		//!< Net talloc blocks allocated under the request.
+	int64_t			bytes;		//!< Net talloc bytes allocated under the request.
+} unlang_profile_node_t;
+
+/** Memory used by requests running in one virtual server, in one interpreter
+ *
+ */
+typedef struct {
+	CONF_SECTION const	*server_cs;	//!< Virtual server, or NULL for requests outside one.
+	size_t			hwm;		//!< Most memory used by any one request.
+	uint64_t		soft;		//!< Number of requests which exceeded the soft budget.
+	uint64_t		hard;		//!< Number of requests stopped by the hard budget.
+} unlang_memory_node_t;
+
 #ifndef NDEBUG
 static void instruction_dump(request_t *request, unlang_t const *instruction)
 {
@@ -189,6 +245,220 @@ int unlang_interpret_push(request_t *request, unlang_t const *instruction,
 	return 0;
 }
 
+static uint32_t profile_node_hash(void const *data)
+{
+	unlang_profile_node_t const *node = data;
+
+	return fr_hash(&node->instruction, sizeof(node->instruction));
+}
+
+static int8_t profile_node_cmp(void const *one, void const *two)
+{
+	unlang_profile_node_t const *a = one, *b = two;
+
+	return CMP(a->instruction, b->instruction);
+}
+
+/** Find or create the profile node for an instruction
+ *
+ * Only the thread which owns the interpreter modifies the table, so
+ * lookups don't need the mutex.  Inserts do, as radmin may be reading
+ * the table at the same time.
+ */
+static unlang_profile_node_t *profile_node_get(unlang_interpret_t *intp, unlang_t const *instruction)
+{
+	unlang_profile_node_t	*node;
+
+	if (unlikely(!intp->profile)) {
+		intp->profile = fr_hash_table_open_alloc(intp, profile_node_hash, profile_node_cmp, NULL);
+		if (!intp->profile) return NULL;
+	}
+
+	node = fr_hash_table_find(intp->profile, &(unlang_profile_node_t){ .instruction = instruction });
+	if (unlikely(!node)) {
+		node = talloc_zero(intp->profile, unlang_profile_node_t);
+		if (!node) return NULL;
+		node->instruction = instruction;
+
+		pthread_mutex_lock(&intp->profile_mutex);
+		if (!fr_hash_table_insert(intp->profile, node)) {
+			pthread_mutex_unlock(&intp->profile_mutex);
+			talloc_free(node);
+			return NULL;
+		}
+		pthread_mutex_unlock(&intp->profile_mutex);
+	}
+
+	return node;
+}
+
+/** Add the time and memory used by an instruction to the interpreter's profile
+ *
+ */
+static void profile_record(unlang_interpret_t *intp, unlang_t const *instruction,
+			   fr_time_delta_t elapsed, fr_time_delta_t yielded, int64_t blocks, int64_t bytes)
+{
+	unlang_profile_node_t	*node;
+
+	node = profile_node_get(intp, instruction);
+	if (!node) return;
+
+	node->calls++;
+	node->running += elapsed - yielded;
+	node->yielded += yielded;
+	node->blocks += blocks;
+	node->bytes += bytes;
+}
+
+/** Start timing the instruction in a frame, if it isn't already being timed
+ *
+ */
+static inline CC_HINT(always_inline) void frame_profile_start(request_t *request, unlang_stack_t *stack,
+							      unlang_stack_frame_t *frame)
+{
+	if (!unlang_profile || frame->prof_start || !frame->instruction) return;
+
+	frame->prof_start = fr_time();
+	frame->prof_yielded = stack->yielded;
+
+	if (unlang_profile_memory) {
+		frame->prof_blocks = talloc_total_blocks(request);
+		frame->prof_bytes = talloc_total_size(request);
+	}
+}
+
+/** Record the time taken by the instruction in a frame, which has just finished
+ *
+ */
+static inline CC_HINT(always_inline) void frame_profile_end(request_t *request, unlang_stack_t *stack,
+							    unlang_stack_frame_t *frame)
+{
+	int64_t blocks = 0, bytes = 0;
+
+	if (!frame->prof_start) return;
+
+	/*
+	 *	prof_blocks is zero if memory profiling was enabled
+	 *	after the instruction started.
+	 */
+	if (unlang_profile_memory && frame->prof_blocks) {
+		blocks = (int64_t) talloc_total_blocks(request) - (int64_t) frame->prof_blocks;
+		bytes = (int64_t) talloc_total_size(request) - (int64_t) frame->prof_bytes;
+
+		RDEBUG2("%s allocated %" PRId64 " blocks, %" PRId64 " bytes",
+			frame->instruction->debug_name, blocks, bytes);
+	}
+
+	profile_record(stack->intp, frame->instruction,
+		       fr_time() - frame->prof_start, stack->yielded - frame->prof_yielded, blocks, bytes);
+	frame->prof_start = 0;
+	frame->prof_blocks = 0;
+}
+
+static uint32_t memory_node_hash(void const *data)
+{
+	unlang_memory_node_t const *node = data;
+
+	return fr_hash(&node->server_cs, sizeof(node->server_cs));
+}
+
+static int8_t memory_node_cmp(void const *one, void const *two)
+{
+	unlang_memory_node_t const *a = one, *b = two;
+
+	return CMP(a->server_cs, b->server_cs);
+}
+
+/** Find or create the memory node for a virtual server
+ *
+ * As with #profile_node_get, only inserts need the mutex.
+ */
+static unlang_memory_node_t *memory_node_get(unlang_interpret_t *intp, CONF_SECTION const *server_cs)
+{
+	unlang_memory_node_t	*node;
+
+	if (unlikely(!intp->memory)) {
+		intp->memory = fr_hash_table_open_alloc(intp, memory_node_hash, memory_node_cmp, NULL);
+		if (!intp->memory) return NULL;
+	}
+
+	node = fr_hash_table_find(intp->memory, &(unlang_memory_node_t){ .server_cs = server_cs });
+	if (unlikely(!node)) {
+		node = talloc_zero(intp->memory, unlang_memory_node_t);
+		if (!node) return NULL;
+		node->server_cs = server_cs;
+
+		pthread_mutex_lock(&intp->profile_mutex);
+		if (!fr_hash_table_insert(intp->memory, node)) {
+			pthread_mutex_unlock(&intp->profile_mutex);
+			talloc_free(node);
+			return NULL;
+		}
+		pthread_mutex_unlock(&intp->profile_mutex);
+	}
+
+	return node;
+}
+
+/** Charge the memory used by a request to its owner, and check it against the budgets
+ *
+ * Children which aren't detachable, such as EAP tunnels, are allocated
+ * in their parent's talloc context, so their memory is charged to the
+ * outermost request which owns them.  Detachable subrequests have their
+ * own context, and their own budget.
+ *
+ * As with memory profiling, talloc has no allocation hooks, so this walks
+ * the owner's talloc tree.  It's only called when a module call finishes,
+ * which is where nearly all of a request's memory is allocated.
+ *
+ * @param[in] request		which has just finished a module call.
+ * @param[in] stack		of the request.
+ * @param[in] instruction	the module call which finished.
+ * @return
+ *	- 0 if the request is within its budget.
+ *	- 1 if the request has just exceeded the soft budget.
+ *	- -1 if the request has exceeded the hard budget.
+ */
+static int memory_budget_check(request_t *request, unlang_stack_t *stack, unlang_t const *instruction)
+{
+	request_t		*owner = request;
+	unlang_memory_node_t	*node = NULL;
+	size_t			used;
+
+	while (owner->parent && !request_is_detachable(owner)) owner = owner->parent;
+
+	used = talloc_total_size(owner);
+	if (used > owner->memory_hwm) {
+		owner->memory_hwm = used;
+
+		node = memory_node_get(stack->intp, unlang_call_current(request));
+		if (node && (used > node->hwm)) node->hwm = used;
+	}
+
+	if (unlang_request_memory_hard && (used > unlang_request_memory_hard)) {
+		RERROR("Request is using %zu bytes of memory, which exceeds max_request_memory (%zu bytes).  "
+		       "Stopping request", used, unlang_request_memory_hard);
+		if (!node) node = memory_node_get(stack->intp, unlang_call_current(request));
+		if (node) node->hard++;
+
+		owner->master_state = REQUEST_STOP_PROCESSING;
+		request->master_state = REQUEST_STOP_PROCESSING;
+		return -1;
+	}
+
+	if (unlang_request_memory_soft && (used > unlang_request_memory_soft) && !owner->memory_warned) {
+		RWARN("Request is using %zu bytes of memory, which exceeds soft_request_memory (%zu bytes).  "
+		      "Failing %s", used, unlang_request_memory_soft, instruction->debug_name);
+		if (!node) node = memory_node_get(stack->intp, unlang_call_current(request));
+		if (node) node->soft++;
+
+		owner->memory_warned = true;
+		return 1;
+	}
+
+	return 0;
+}
+
 /** Update the current result after each instruction, and after popping each stack frame
  *
  * @param[in] request		The current request.
@@ -395,6 +665,7 @@ unlang_frame_action_t frame_eval(request_t *request, unlang_stack_frame_t *frame
 		 *	should be evaluated again.
 		 */
 		repeatable_clear(frame);
+		frame_profile_start(request, stack, frame);
 		ua = frame->process(result, request, frame);
 
 		RDEBUG4("** [%i] %s << %s (%d)", stack->depth, __FUNCTION__,
@@ -403,6 +674,33 @@ unlang_frame_action_t frame_eval(request_t *request, unlang_stack_frame_t *frame
 		fr_assert(*priority >= -1);
 		fr_assert(*priority <= MOD_PRIORITY_MAX);
 
+		/*
+		 *	Sections which pushed children, or yielded,
+		 *	are still running.
+		 */
+		if ((ua != UNLANG_ACTION_PUSHED_CHILD) && (ua != UNLANG_ACTION_YIELD)) frame_profile_end(request, stack, frame);
+
+		/*
+		 *	Charge whatever the module allocated to the
+		 *	request, and fail the module, or stop the
+		 *	request, if it's over budget.
+		 */
+		if ((unlang_request_memory_soft || unlang_request_memory_hard) &&
+		    (instruction->type == UNLANG_TYPE_MODULE) &&
+		    ((ua == UNLANG_ACTION_CALCULATE_RESULT) || (ua == UNLANG_ACTION_FAIL))) {
+			switch (memory_budget_check(request, stack, instruction)) {
+			case 1:
+				ua = UNLANG_ACTION_FAIL;
+				break;
+
+			case -1:
+				goto do_stop;
+
+			default:
+				break;
+			}
+		}
+
 		switch (ua) {
 		/*
 		 *	The request is now defunct, and we should not
@@ -539,6 +837,11 @@ CC_HINT(hot) rlm_rcode_t unlang_interpret(request_t *request)
 	RDEBUG4("** [%i] %s - interpret entered", stack->depth, __FUNCTION__);
 	intp->funcs.resume(request, intp->uctx);
 
+	if (stack->yielded_at) {
+		stack->yielded += fr_time() - stack->yielded_at;
+		stack->yielded_at = 0;
+	}
+
 	for (;;) {
 		RDEBUG4("** [%i] %s - frame action %s", stack->depth, __FUNCTION__,
 			fr_table_str_by_value(unlang_frame_action_table, fa, "<INVALID>"));
@@ -593,6 +896,8 @@ CC_HINT(hot) rlm_rcode_t unlang_interpret(request_t *request)
 				continue;
 			}
 
+			frame_profile_end(request, stack, frame);
+
 			/*
 			 *	Close out the section we entered earlier
 			 */
@@ -644,6 +949,7 @@ CC_HINT(hot) rlm_rcode_t unlang_interpret(request_t *request)
 
 		case UNLANG_FRAME_ACTION_YIELD:
 			RDEBUG4("** [%i] %s - interpret yielding", stack->depth, __FUNCTION__);
+			if (unlang_profile) stack->yielded_at = fr_time();
 			intp->funcs.yield(request, intp->uctx);
 			return stack->result;
 		}
@@ -1221,6 +1527,13 @@ finish:
 	return XLAT_ACTION_DONE;
 }
 
+static int _unlang_interpret_free(unlang_interpret_t *intp)
+{
+	pthread_mutex_destroy(&intp->profile_mutex);
+
+	return 0;
+}
+
 /** Initialize a unlang compiler / interpret.
  *
  * @param[in] ctx	to bind lifetime of the interpret to.
@@ -1257,6 +1570,8 @@ unlang_interpret_t *unlang_interpret_init(TALLOC_CTX *ctx,
 		.funcs = *funcs,
 		.uctx = uctx
 	};
+	pthread_mutex_init(&intp->profile_mutex, NULL);
+	talloc_set_destructor(intp, _unlang_interpret_free);
 
  	return intp;
 }
@@ -1318,3 +1633,274 @@ void unlang_interpret_init_global(void)
 	xlat = xlat_register(NULL, "interpreter", unlang_interpret_xlat, false);
 	xlat_func_args(xlat, unlang_interpret_xlat_args);
 }
+
+/** Add one interpreter's profile to another's
+ *
+ * Used for temporary interpreters, such as the ones created by
+ * #unlang_interpret_synchronous, so that their profile isn't lost
+ * when they're freed.
+ *
+ * @param[in] dst	to add the profile to.
+ * @param[in] src	to take the profile from.
+ */
+void unlang_interpret_profile_merge(unlang_interpret_t *dst, unlang_interpret_t *src)
+{
+	unlang_profile_node_t	*node, *dst_node;
+	fr_hash_iter_t		iter;
+
+	if (!src->profile) return;
+
+	for (node = fr_hash_table_iter_init(src->profile, &iter);
+	     node;
+	     node = fr_hash_table_iter_next(src->profile, &iter)) {
+		dst_node = profile_node_get(dst, node->instruction);
+		if (!dst_node) return;
+
+		dst_node->calls += node->calls;
+		dst_node->running += node->running;
+		dst_node->yielded += node->yielded;
+		dst_node->blocks += node->blocks;
+		dst_node->bytes += node->bytes;
+	}
+}
+
+/** A copy of a profile node, so that radmin doesn't block the worker while printing
+ *
+ */
+typedef struct {
+	unlang_t const		*instruction;
+	uint64_t		calls;
+	fr_time_delta_t		running;
+	fr_time_delta_t		yielded;
+	fr_time_delta_t		children;	//!< Running time of the instructions beneath this one.
+	int64_t			blocks;
+	int64_t			bytes;
+} profile_copy_t;
+
+static int profile_copy_cmp(void const *one, void const *two)
+{
+	profile_copy_t const *a = one, *b = two;
+
+	return CMP(a->instruction, b->instruction);
+}
+
+static int profile_copy_running_cmp(void const *one, void const *two)
+{
+	profile_copy_t const *a = one, *b = two;
+
+	return CMP(b->running, a->running);
+}
+
+/** Print the path to an instruction, from the outermost section
+ *
+ * ';' and whitespace are replaced, so that the output can be read
+ * by flame graph tools.
+ */
+static void profile_path_print(FILE *fp, unlang_t const *instruction, int depth)
+{
+	char const *p;
+
+	if (instruction->parent && (depth < UNLANG_STACK_MAX)) {
+		profile_path_print(fp, instruction->parent, depth + 1);
+		fputc(';', fp);
+	}
+
+	for (p = instruction->debug_name; *p; p++) fputc(((*p == ';') || isspace((uint8_t) *p)) ? '_' : *p, fp);
+}
+
+/** Print the time spent in each instruction
+ *
+ * @param[in] fp	to write the profile to.
+ * @param[in] fp_err	to write errors to.
+ * @param[in] intp	whose profile we're printing.
+ * @param[in] folded	If true, print one line per instruction in "folded stack"
+ *			format, with the time (in nanoseconds) spent running the
+ *			instruction itself, excluding its children.  This can be
+ *			passed directly to flamegraph.pl.
+ *			If false, print the call count, running time and yielded
+ *			time for each instruction, most expensive first.  If
+ *			memory was profiled, also print the net talloc blocks
+ *			and bytes each call allocated under the request.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int unlang_interpret_profile_print(FILE *fp, FILE *fp_err, unlang_interpret_t *intp, bool folded)
+{
+	profile_copy_t		*copy;
+	unlang_profile_node_t	*node;
+	fr_hash_iter_t		iter;
+	size_t			i, num = 0;
+	bool			memory = false;
+
+	if (!intp->profile) {
+		fprintf(fp_err, "No instructions have been profiled.  Use 'set unlang profile on'.\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&intp->profile_mutex);
+	copy = talloc_array(NULL, profile_copy_t, fr_hash_table_num_elements(intp->profile));
+	if (!copy) {
+		pthread_mutex_unlock(&intp->profile_mutex);
+		return -1;
+	}
+
+	for (node = fr_hash_table_iter_init(intp->profile, &iter);
+	     node;
+	     node = fr_hash_table_iter_next(intp->profile, &iter)) {
+		copy[num++] = (profile_copy_t){
+			.instruction = node->instruction,
+			.calls = node->calls,
+			.running = node->running,
+			.yielded = node->yielded,
+			.blocks = node->blocks,
+			.bytes = node->bytes
+		};
+		if (node->blocks || node->bytes) memory = true;
+	}
+	pthread_mutex_unlock(&intp->profile_mutex);
+
+	/*
+	 *	Sum the running time of each instruction into its
+	 *	parent, so that we can print the time the parent
+	 *	spent on its own.
+	 */
+	qsort(copy, num, sizeof(copy[0]), profile_copy_cmp);
+	for (i = 0; i < num; i++) {
+		profile_copy_t *parent;
+
+		if (!copy[i].instruction->parent) continue;
+
+		parent = bsearch(&(profile_copy_t){ .instruction = copy[i].instruction->parent },
+				 copy, num, sizeof(copy[0]), profile_copy_cmp);
+		if (parent) parent->children += copy[i].running;
+	}
+
+	if (folded) {
+		for (i = 0; i < num; i++) {
+			fr_time_delta_t self = copy[i].running - copy[i].children;
+
+			if (self <= 0) continue;
+
+			profile_path_print(fp, copy[i].instruction, 0);
+			fprintf(fp, " %" PRId64 "\n", self);
+		}
+		talloc_free(copy);
+		return 0;
+	}
+
+	qsort(copy, num, sizeof(copy[0]), profile_copy_running_cmp);
+	for (i = 0; i < num; i++) {
+		fprintf(fp, "calls %" PRIu64 " running %" PRId64 "ns self %" PRId64 "ns avg %" PRId64 "ns yielded %" PRId64 "ns\t",
+			copy[i].calls, copy[i].running, copy[i].running - copy[i].children,
+			copy[i].calls ? copy[i].running / (fr_time_delta_t) copy[i].calls : 0, copy[i].yielded);
+		if (memory && copy[i].calls) {
+			fprintf(fp, "blocks/call %.1f bytes/call %.1f\t",
+				(double) copy[i].blocks / copy[i].calls, (double) copy[i].bytes / copy[i].calls);
+		}
+		profile_path_print(fp, copy[i].instruction, 0);
+		fputc('\n', fp);
+	}
+	talloc_free(copy);
+
+	return 0;
+}
+
+/** Add one interpreter's memory high-water marks to another's
+ *
+ * @param[in] dst	to add the high-water marks to.
+ * @param[in] src	to take the high-water marks from.
+ */
+void unlang_interpret_memory_merge(unlang_interpret_t *dst, unlang_interpret_t *src)
+{
+	unlang_memory_node_t	*node, *dst_node;
+	fr_hash_iter_t		iter;
+
+	if (!src->memory) return;
+
+	for (node = fr_hash_table_iter_init(src->memory, &iter);
+	     node;
+	     node = fr_hash_table_iter_next(src->memory, &iter)) {
+		dst_node = memory_node_get(dst, node->server_cs);
+		if (!dst_node) return;
+
+		if (node->hwm > dst_node->hwm) dst_node->hwm = node->hwm;
+		dst_node->soft += node->soft;
+		dst_node->hard += node->hard;
+	}
+}
+
+/** Print the most memory used by a request in each virtual server
+ *
+ * The first line is the total for the interpreter, i.e. the worker.
+ *
+ * @param[in] fp	to write the high-water marks to.
+ * @param[in] fp_err	to write errors to.
+ * @param[in] intp	whose high-water marks we're printing.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int unlang_interpret_memory_print(FILE *fp, FILE *fp_err, unlang_interpret_t *intp)
+{
+	unlang_memory_node_t	*node;
+	fr_hash_iter_t		iter;
+	size_t			hwm = 0;
+	uint64_t		soft = 0, hard = 0;
+
+	if (!intp->memory) {
+		fprintf(fp_err, "No request memory has been recorded.  Set 'soft_request_memory' "
+			"or 'max_request_memory'.\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&intp->profile_mutex);
+	for (node = fr_hash_table_iter_init(intp->memory, &iter);
+	     node;
+	     node = fr_hash_table_iter_next(intp->memory, &iter)) {
+		if (node->hwm > hwm) hwm = node->hwm;
+		soft += node->soft;
+		hard += node->hard;
+	}
+	fprintf(fp, "total\thwm %zu soft %" PRIu64 " hard %" PRIu64 "\n", hwm, soft, hard);
+
+	for (node = fr_hash_table_iter_init(intp->memory, &iter);
+	     node;
+	     node = fr_hash_table_iter_next(intp->memory, &iter)) {
+		fprintf(fp, "server %s\thwm %zu soft %" PRIu64 " hard %" PRIu64 "\n",
+			node->server_cs ? cf_section_name2(node->server_cs) : "<none>",
+			node->hwm, node->soft, node->hard);
+	}
+	pthread_mutex_unlock(&intp->profile_mutex);
+
+	return 0;
+}
+
+static int cmd_set_unlang_profile(UNUSED FILE *fp, UNUSED FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
+{
+	unlang_profile_memory = (strcmp(info->argv[0], "memory") == 0);
+	unlang_profile = unlang_profile_memory || (strcmp(info->argv[0], "on") == 0);
+
+	return 0;
+}
+
+fr_cmd_table_t unlang_cmd_table[] = {
+	{
+		.parent = "set",
+		.name = "unlang",
+		.help = "Change interpreter settings.",
+		.read_only = false,
+	},
+
+	{
+		.parent = "set unlang",
+		.name = "profile",
+		.syntax = "(on|off|memory)",
+		.func = cmd_set_unlang_profile,
+		.help = "Enable or disable recording the time spent in each module call and section.  "
+			"'memory' also records the talloc memory each one allocates, which is much slower.",
+		.read_only = false,
+	},
+
+	CMD_TABLE_END
+};
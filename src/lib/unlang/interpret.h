@@ -28,6 +28,7 @@
 extern "C" {
 #endif
 
+#include <freeradius-devel/server/command.h>
 #include <freeradius-devel/server/request.h>
 #include <freeradius-devel/unlang/action.h>
 
@@ -165,7 +166,21 @@ void			unlang_interpret_stack_result_set(request_t *request, rlm_rcode_t code);
 
 TALLOC_CTX		*unlang_interpret_frame_talloc_ctx(request_t *request);
 
+int			unlang_interpret_profile_print(FILE *fp, FILE *fp_err, unlang_interpret_t *intp, bool folded);
+
+void			unlang_interpret_profile_merge(unlang_interpret_t *dst, unlang_interpret_t *src) CC_HINT(nonnull);
+
+int			unlang_interpret_memory_print(FILE *fp, FILE *fp_err, unlang_interpret_t *intp);
+
+void			unlang_interpret_memory_merge(unlang_interpret_t *dst, unlang_interpret_t *src) CC_HINT(nonnull);
+
 void			unlang_interpret_init_global(void);
+
+extern bool		unlang_profile;
+extern bool		unlang_profile_memory;
+extern size_t		unlang_request_memory_soft;
+extern size_t		unlang_request_memory_hard;
+extern fr_cmd_table_t	unlang_cmd_table[];
 #ifdef __cplusplus
 }
 #endif
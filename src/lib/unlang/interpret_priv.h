@@ -25,7 +25,9 @@
  */
 
 #include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/unlang/interpret.h>
+#include <pthread.h>
 #include "interpret_priv.h"
 
 #ifdef __cplusplus
@@ -36,6 +38,13 @@ struct unlang_interpret_s {
 	fr_event_list_t		*el;
 	unlang_request_func_t	funcs;
 	void			*uctx;
+
+	fr_hash_table_t		*profile;	//!< Time spent in each instruction, keyed by #unlang_t.
+						///< Only the owning thread inserts nodes.
+	fr_hash_table_t		*memory;	//!< Memory used by requests in each virtual server.
+						///< Inserts are also protected by profile_mutex.
+	pthread_mutex_t		profile_mutex;	//!< Held when inserting nodes, and by radmin
+						///< when reading them.
 };
 
 static inline void interpret_child_init(request_t *request)
@@ -278,6 +278,24 @@ rlm_rcode_t unlang_interpret_synchronous(request_t *request)
 		DEBUG3("%u runnable, %u yielded", fr_heap_num_elements(intps->runnable), intps->yielded);
 	}
 
+	/*
+	 *	Keep the profile of the temporary interpreter.
+	 */
+	if (unlang_profile) {
+		unlang_interpret_t *profile_intp = old_intp ? old_intp : unlang_interpret_get_thread_default();
+
+		if (profile_intp) unlang_interpret_profile_merge(profile_intp, intps->intp);
+	}
+
+	/*
+	 *	...and its memory high-water marks.
+	 */
+	if (unlang_request_memory_soft || unlang_request_memory_hard) {
+		unlang_interpret_t *memory_intp = old_intp ? old_intp : unlang_interpret_get_thread_default();
+
+		if (memory_intp) unlang_interpret_memory_merge(memory_intp, intps->intp);
+	}
+
 	talloc_free(intps);
 	unlang_interpret_set(request, old_intp);
 	request->el = old_el;
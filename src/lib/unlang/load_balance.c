@@ -31,6 +31,38 @@
 
 #define unlang_redundant_load_balance unlang_load_balance
 
+/** Find the next child to fail over to, by walking the lookup table
+ *
+ * The entries following the key's slot are a key-specific permutation of
+ * the children.  When a child fails, the requests it was handling are
+ * therefore spread across the remaining children, instead of all landing
+ * on its next sibling.
+ *
+ * @return
+ *	- The next child which hasn't been run.
+ *	- redundant->found if all of the children have been run.
+ */
+static unlang_t *load_balance_ring_next(unlang_frame_state_redundant_t *redundant,
+					unlang_load_balance_t *gext, unlang_group_t *g)
+{
+	uint32_t i;
+
+	if (!redundant->tried) MEM(redundant->tried = talloc_zero_array(redundant, bool, g->num_children));
+
+	redundant->tried[gext->table[redundant->slot]] = true;
+
+	for (i = 1; i < gext->table_size; i++) {
+		uint32_t slot = (redundant->slot + i) % gext->table_size;
+
+		if (redundant->tried[gext->table[slot]]) continue;
+
+		redundant->slot = slot;
+		return gext->children[gext->table[slot]];
+	}
+
+	return redundant->found;
+}
+
 static unlang_action_t unlang_load_balance_next(rlm_rcode_t *p_result, request_t *request,
 						unlang_stack_frame_t *frame)
 {
@@ -50,15 +82,6 @@ static unlang_action_t unlang_load_balance_next(rlm_rcode_t *p_result, request_t
 		redundant->child = redundant->found;
 
 	} else {
-		/*
-		 *	child is NULL on the first pass.  But if it's
-		 *	back to the found one, then we're done.
-		 */
-		if (redundant->child == redundant->found) {
-			/* DON'T change p_result, as it is taken from the child */
-			return UNLANG_ACTION_CALCULATE_RESULT;
-		}
-
 		RDEBUG4("%s resuming", frame->instruction->debug_name);
 
 		/*
@@ -70,13 +93,34 @@ static unlang_action_t unlang_load_balance_next(rlm_rcode_t *p_result, request_t
 		fr_assert(frame->instruction->type != UNLANG_TYPE_LOAD_BALANCE); /* this is never called again */
 
 		/*
-		 *	If the current child says "return", then do
+		 *	If the child we ran says "return", then do
 		 *	so.
 		 */
 		if (redundant->child->actions[*p_result] == MOD_ACTION_RETURN) {
 			/* DON'T change p_result, as it is taken from the child */
 			return UNLANG_ACTION_CALCULATE_RESULT;
 		}
+
+		/*
+		 *	Use the next child, wrapping around to the
+		 *	beginning.  Keyed sections instead use the
+		 *	next child from the key's slot in the lookup
+		 *	table.
+		 */
+		if (redundant->ring) {
+			redundant->child = load_balance_ring_next(redundant, unlang_group_to_load_balance(g), g);
+		} else {
+			redundant->child = redundant->child->next;
+			if (!redundant->child) redundant->child = g->children;
+		}
+
+		/*
+		 *	Back to the found one, so we're done.
+		 */
+		if (redundant->child == redundant->found) {
+			/* DON'T change p_result, as it is taken from the child */
+			return UNLANG_ACTION_CALCULATE_RESULT;
+		}
 	}
 
 	/*
@@ -87,19 +131,6 @@ static unlang_action_t unlang_load_balance_next(rlm_rcode_t *p_result, request_t
 		return UNLANG_ACTION_STOP_PROCESSING;
 	}
 
-	/*
-	 *	Now that we've pushed this child, make the next call
-	 *	use the next child, wrapping around to the beginning.
-	 *
-	 *	@todo - track the one we chose, and if it fails, do
-	 *	the load-balancing again, except this time skipping
-	 *	the failed module.  AND, keep track of multiple failed
-	 *	modules in the unlang_frame_state_redundant_t
-	 *	structure.
-	 */
-	redundant->child = redundant->child->next;
-	if (!redundant->child) redundant->child = g->children;
-
 	repeatable_set(frame);
 
 	return UNLANG_ACTION_PUSHED_CHILD;
@@ -126,7 +157,7 @@ static unlang_action_t unlang_load_balance(rlm_rcode_t *p_result, request_t *req
 					  unlang_frame_state_redundant_t);
 
 	if (gext && gext->vpt) {
-		uint32_t hash, start;
+		uint32_t start;
 		ssize_t slen;
 		char const *p = NULL;
 		char buffer[1024];
@@ -176,23 +207,20 @@ static unlang_action_t unlang_load_balance(rlm_rcode_t *p_result, request_t *req
 				goto randomly_choose;
 			}
 
-			hash = fr_hash(p, slen);
+			/*
+			 *	The lookup table means that adding or
+			 *	removing a child moves as few keys as
+			 *	possible to a different child.
+			 */
+			redundant->slot = fr_hash(p, slen) % gext->table_size;
+			redundant->ring = true;
 
-			start = hash % g->num_children;;
+			start = gext->table[redundant->slot];
 		}
 
 		RDEBUG3("load-balance starting at child %d", (int) start);
 
-		count = 0;
-		for (redundant->child = redundant->found = g->children;
-		     redundant->child != NULL;
-		     redundant->child = redundant->child->next) {
-			count++;
-			if (count == start) {
-				redundant->found = redundant->child;
-				break;
-			}
-		}
+		redundant->found = gext->children[start];
 
 	} else {
 	randomly_choose:
@@ -246,6 +274,96 @@ static unlang_action_t unlang_load_balance(rlm_rcode_t *p_result, request_t *req
 	return unlang_load_balance_next(p_result, request, frame);
 }
 
+/** Build the Maglev lookup table for a keyed load-balance section
+ *
+ * Each child has a preferred permutation of the table entries, which is
+ * derived from its name.  The children take turns claiming their next
+ * preferred free entry until the table is full.  As the permutation
+ * depends only on the child's name, adding or removing a child changes
+ * very few entries, and most keys continue to be sent to the same child.
+ *
+ * See "Maglev: A Fast and Reliable Software Network Load Balancer" (NSDI '16).
+ *
+ * @param[in] gext	to build the table for.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int unlang_load_balance_table_build(unlang_load_balance_t *gext)
+{
+	/*
+	 *	The table should have about 100 entries per child
+	 *	in order to keep the load evenly spread.
+	 */
+	static uint32_t const	primes[] = { 251, 509, 1021, 2039, 4093, 8191, 16381, 32749, 65521 };
+
+	unlang_group_t		*g = unlang_load_balance_to_group(gext);
+	unlang_t		*child;
+	uint32_t		*offset, *skip, *next;
+	uint32_t		i, j, filled = 0;
+
+	for (i = 0; i < (NUM_ELEMENTS(primes) - 1); i++) {
+		if (primes[i] >= (g->num_children * 100)) break;
+	}
+	gext->table_size = primes[i];
+
+	if (g->num_children > gext->table_size) {
+		fr_strerror_printf("Too many children (%u), the maximum is %u", g->num_children, gext->table_size);
+		return -1;
+	}
+
+	MEM(gext->children = talloc_array(gext, unlang_t *, g->num_children));
+	MEM(gext->table = talloc_array(gext, uint16_t, gext->table_size));
+	MEM(offset = talloc_array(NULL, uint32_t, g->num_children * 3));
+	skip = offset + g->num_children;
+	next = skip + g->num_children;
+
+	for (child = g->children, i = 0; child != NULL; child = child->next, i++) {
+		char const	*name = child->name ? child->name : child->debug_name;
+		uint32_t	hash, dup = 0;
+
+		/*
+		 *	Children with the same name (e.g. multiple
+		 *	"group" sections) are told apart by which one
+		 *	they are.
+		 */
+		for (j = 0; j < i; j++) {
+			char const *other = gext->children[j]->name ? gext->children[j]->name :
+								       gext->children[j]->debug_name;
+
+			if (strcmp(name, other) == 0) dup++;
+		}
+
+		gext->children[i] = child;
+
+		hash = fr_hash_update(&dup, sizeof(dup), fr_hash_string(name));
+		offset[i] = hash % gext->table_size;
+		skip[i] = (fr_hash_update(&hash, sizeof(hash), hash) % (gext->table_size - 1)) + 1;
+		next[i] = 0;
+	}
+	fr_assert(i == g->num_children);
+
+	memset(gext->table, 0xff, sizeof(gext->table[0]) * gext->table_size);
+
+	while (filled < gext->table_size) {
+		for (i = 0; (i < g->num_children) && (filled < gext->table_size); i++) {
+			uint32_t slot;
+
+			do {
+				slot = (uint32_t) ((offset[i] + ((uint64_t) next[i] * skip[i])) % gext->table_size);
+				next[i]++;
+			} while (gext->table[slot] != UINT16_MAX);
+
+			gext->table[slot] = i;
+			filled++;
+		}
+	}
+
+	talloc_free(offset);
+
+	return 0;
+}
+
 void unlang_load_balance_init(void)
 {
 	unlang_register(UNLANG_TYPE_LOAD_BALANCE,
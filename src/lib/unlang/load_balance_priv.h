@@ -32,6 +32,9 @@ extern "C" {
 typedef struct {
 	unlang_group_t	group;
 	tmpl_t		*vpt;
+	unlang_t	**children;	//!< Children of a keyed section, indexed by position.
+	uint16_t	*table;		//!< Maglev lookup table, mapping key hashes to children.
+	uint32_t	table_size;	//!< Number of entries in the table (always prime).
 } unlang_load_balance_t;
 
 /** State of a redundant operation
@@ -40,6 +43,9 @@ typedef struct {
 typedef struct {
 	unlang_t 		*child;
 	unlang_t		*found;
+	bool			ring;		//!< Fail over by walking the lookup table.
+	uint32_t		slot;		//!< Table entry which selected the current child.
+	bool			*tried;		//!< Children which have already been run.
 } unlang_frame_state_redundant_t;
 
 /** Cast a group structure to the load_balance keyword extension
@@ -58,6 +64,8 @@ static inline unlang_group_t *unlang_load_balance_to_group(unlang_load_balance_t
 	return (unlang_group_t *)load_balance;
 }
 
+int unlang_load_balance_table_build(unlang_load_balance_t *gext);
+
 #ifdef __cplusplus
 }
 #endif
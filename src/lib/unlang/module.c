@@ -31,6 +31,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/request_data.h>
 #include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/probe.h>
 
 #include "module_priv.h"
 #include "subrequest_priv.h"
@@ -657,6 +658,8 @@ static unlang_action_t unlang_module_done(rlm_rcode_t *p_result, request_t *requ
 	if (state->p_result) *state->p_result = rcode;	/* Inform our caller if we have one */
 	*p_result = rcode;
 
+	FR_PROBE3(module_exit, request->number, frame->instruction->name, rcode);
+
 	return UNLANG_ACTION_CALCULATE_RESULT;
 }
 
@@ -848,6 +851,8 @@ static unlang_action_t unlang_module(rlm_rcode_t *p_result, request_t *request,
 	 */
 	state->thread->total_calls++;
 
+	FR_PROBE2(module_enter, request->number, mc->instance->name);
+
 	caller = request->module;
 	request->module = mc->instance->name;
 	safe_lock(mc->instance);	/* Noop unless instance->mutex set */
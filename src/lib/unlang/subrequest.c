@@ -109,7 +109,16 @@ static unlang_action_t unlang_subrequest_parent_resume(rlm_rcode_t *p_result, re
 			return UNLANG_ACTION_CALCULATE_RESULT;
 		}
 		while ((extent = fr_dlist_tail(&leaf))) {
-			fr_pair_list_copy(extent->list_ctx, extent->list, &child->reply_pairs);
+			/*
+			 *	The child is freed below, so the last
+			 *	destination can take its reply pairs
+			 *	without duplicating them.
+			 */
+			if (fr_dlist_prev(&leaf, extent)) {
+				fr_pair_list_copy(extent->list_ctx, extent->list, &child->reply_pairs);
+			} else {
+				fr_pair_list_steal(extent->list_ctx, extent->list, &child->reply_pairs);
+			}
 			fr_dlist_talloc_free_tail(&leaf);
 		}
 	}
@@ -61,6 +61,15 @@ static unlang_action_t unlang_switch(rlm_rcode_t *p_result, request_t *request,
 	switch_g = unlang_generic_to_group(frame->instruction);
 	switch_gext = unlang_group_to_switch(switch_g);
 
+	/*
+	 *	Constant data was matched when the 'switch' was
+	 *	compiled, and the matching 'case' is all that's left.
+	 */
+	if (tmpl_is_data(switch_gext->vpt)) {
+		found = switch_gext->default_case;
+		goto do_null_case;
+	}
+
 	found = NULL;
 
 	/*
@@ -253,6 +253,15 @@ struct unlang_stack_frame_s {
 								///< result stored in the lower stack frame should
 								///< be replaced.
 	uint8_t			uflags;				//!< Unwind markers
+
+	fr_time_t		prof_start;			//!< When the current instruction started running,
+								///< or 0 if it's not being profiled.
+	fr_time_delta_t		prof_yielded;			//!< Value of stack->yielded when the
+								///< current instruction started.
+	size_t			prof_blocks;			//!< talloc blocks under the request when the
+								///< current instruction started.
+	size_t			prof_bytes;			//!< talloc bytes under the request when the
+								///< current instruction started.
 };
 
 /** An unlang stack associated with a request
@@ -266,6 +275,8 @@ typedef struct {
 	int			depth;				//!< Current depth we're executing at.
 	uint8_t			unwind;				//!< Unwind to this frame if it exists.
 								///< This is used for break and return.
+	fr_time_t		yielded_at;			//!< When the stack last yielded, if profiling.
+	fr_time_delta_t		yielded;			//!< Total time the stack has spent yielded.
 	unlang_stack_frame_t	frame[UNLANG_STACK_MAX];	//!< The stack...
 } unlang_stack_t;
 
@@ -396,6 +407,34 @@ static inline void frame_cleanup(unlang_stack_frame_t *frame)
  */
 static inline void frame_next(unlang_stack_t *stack, unlang_stack_frame_t *frame)
 {
+	unlang_op_t	*op, *next_op;
+
+	/*
+	 *	Straight line code is mostly runs of module calls,
+	 *	which all have the same fixed size state.  Zero the
+	 *	state we already have instead of freeing it and
+	 *	allocating an identical chunk for the next sibling.
+	 */
+	if (frame->next && frame->state) {
+		op = &unlang_ops[frame->instruction->type];
+		next_op = &unlang_ops[frame->next->type];
+
+		if (!op->frame_state_pool_size && !next_op->frame_state_pool_size &&
+		    next_op->frame_state_size && (op->frame_state_size == next_op->frame_state_size)) {
+			frame->uflags &= UNWIND_FLAG_TOP_FRAME;
+			talloc_free_children(frame->state);
+			memset(frame->state, 0, next_op->frame_state_size);
+			talloc_set_name_const(frame->state,
+					      next_op->frame_state_name ? next_op->frame_state_name : __location__);
+
+			frame->instruction = frame->next;
+			frame->next = frame->instruction->next;
+			frame->process = next_op->interpret;
+			frame->signal = next_op->signal;
+			return;
+		}
+	}
+
 	frame_cleanup(frame);
 	frame->instruction = frame->next;
 
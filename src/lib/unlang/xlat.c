@@ -180,6 +180,131 @@ int unlang_xlat_event_timeout_add(request_t *request, fr_unlang_xlat_timeout_t c
 	return 0;
 }
 
+/** Call the callback registered for a read I/O event
+ *
+ * @param[in] el	containing the event (not passed to the callback).
+ * @param[in] fd	the I/O event occurred on.
+ * @param[in] flags	from kevent.
+ * @param[in] ctx	unlang_xlat_event_t structure holding callbacks.
+ */
+static void unlang_xlat_event_fd_read_handler(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *ctx)
+{
+	unlang_xlat_event_t *ev = talloc_get_type_abort(ctx, unlang_xlat_event_t);
+	void *mutable_ctx;
+	void *mutable_inst;
+
+	fr_assert(ev->fd == fd);
+
+	memcpy(&mutable_ctx, &ev->ctx, sizeof(mutable_ctx));
+	memcpy(&mutable_inst, &ev->inst, sizeof(mutable_inst));
+
+	ev->fd_read(ev->request, mutable_inst, ev->thread, mutable_ctx, fd);
+}
+
+/** Call the callback registered for a write I/O event
+ *
+ * @param[in] el	containing the event (not passed to the callback).
+ * @param[in] fd	the I/O event occurred on.
+ * @param[in] flags	from kevent.
+ * @param[in] ctx	unlang_xlat_event_t structure holding callbacks.
+ */
+static void unlang_xlat_event_fd_write_handler(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *ctx)
+{
+	unlang_xlat_event_t *ev = talloc_get_type_abort(ctx, unlang_xlat_event_t);
+	void *mutable_ctx;
+	void *mutable_inst;
+
+	fr_assert(ev->fd == fd);
+
+	memcpy(&mutable_ctx, &ev->ctx, sizeof(mutable_ctx));
+	memcpy(&mutable_inst, &ev->inst, sizeof(mutable_inst));
+
+	ev->fd_write(ev->request, mutable_inst, ev->thread, mutable_ctx, fd);
+}
+
+/** Call the callback registered for an I/O error event
+ *
+ * @param[in] el	containing the event (not passed to the callback).
+ * @param[in] fd	the I/O event occurred on.
+ * @param[in] flags	from kevent.
+ * @param[in] fd_errno	from kevent.
+ * @param[in] ctx	unlang_xlat_event_t structure holding callbacks.
+ */
+static void unlang_xlat_event_fd_error_handler(UNUSED fr_event_list_t *el, int fd,
+					       UNUSED int flags, UNUSED int fd_errno, void *ctx)
+{
+	unlang_xlat_event_t *ev = talloc_get_type_abort(ctx, unlang_xlat_event_t);
+	void *mutable_ctx;
+	void *mutable_inst;
+
+	fr_assert(ev->fd == fd);
+
+	memcpy(&mutable_ctx, &ev->ctx, sizeof(mutable_ctx));
+	memcpy(&mutable_inst, &ev->inst, sizeof(mutable_inst));
+
+	ev->fd_error(ev->request, mutable_inst, ev->thread, mutable_ctx, fd);
+}
+
+/** Add I/O callbacks for an xlat handler
+ *
+ * Used when an xlat needs to wait on a file descriptor.  Typically the callbacks
+ * are set, and then the xlat returns unlang_xlat_yield().
+ *
+ * @note The callbacks are automatically removed when the xlat is cancelled or resumed.
+ *
+ * @param[in] request	the request.
+ * @param[in] read	callback.  Called when the fd is readable.  May be NULL.
+ * @param[in] write	callback.  Called when the fd is writable.  May be NULL.
+ * @param[in] error	callback.  Called if the fd enters an error state.  May be NULL.
+ * @param[in] ctx	passed to the callbacks.
+ * @param[in] fd	to watch.
+ * @return
+ *	- <0 on error
+ *	- 0 on success
+ */
+int unlang_xlat_event_fd_add(request_t *request,
+			     fr_unlang_xlat_fd_event_t read,
+			     fr_unlang_xlat_fd_event_t write,
+			     fr_unlang_xlat_fd_event_t error,
+			     void const *ctx, int fd)
+{
+	unlang_stack_t			*stack = request->stack;
+	unlang_stack_frame_t		*frame = &stack->frame[stack->depth];
+	unlang_xlat_event_t		*ev;
+	unlang_frame_state_xlat_t	*state = talloc_get_type_abort(frame->state, unlang_frame_state_xlat_t);
+
+	fr_assert(stack->depth > 0);
+	fr_assert(frame->instruction->type == UNLANG_TYPE_XLAT);
+
+	if (!state->event_ctx) MEM(state->event_ctx = talloc_zero(state, bool));
+
+	ev = talloc_zero(state->event_ctx, unlang_xlat_event_t);
+	if (!ev) return -1;
+
+	ev->request = request;
+	ev->fd = fd;
+	ev->fd_read = read;
+	ev->fd_write = write;
+	ev->fd_error = error;
+	ev->inst = state->exp->call.inst;
+	ev->thread = xlat_thread_instance_find(state->exp);
+	ev->ctx = ctx;
+
+	if (fr_event_fd_insert(request, request->el, fd,
+			       ev->fd_read ? unlang_xlat_event_fd_read_handler : NULL,
+			       ev->fd_write ? unlang_xlat_event_fd_write_handler : NULL,
+			       ev->fd_error ? unlang_xlat_event_fd_error_handler : NULL,
+			       ev) < 0) {
+		RPEDEBUG("Failed inserting fd event");
+		talloc_free(ev);
+		return -1;
+	}
+
+	talloc_set_destructor(ev, _unlang_xlat_event_free);
+
+	return 0;
+}
+
 /** Push a pre-compiled xlat onto the stack for evaluation
  *
  * @param[in] ctx		To allocate value boxes and values in.
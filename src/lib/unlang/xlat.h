@@ -370,6 +370,8 @@ int		xlat_func_mono(xlat_t *xlat, xlat_arg_parser_t const *arg) CC_HINT(nonnull)
 
 void		xlat_internal(xlat_t *xlat);
 
+void		xlat_func_pure(xlat_t *xlat);
+
 /** Set a callback for global instantiation of xlat functions
  *
  * @param[in] _xlat		function to set the callback for (as returned by xlat_register).
@@ -441,6 +443,12 @@ void		xlat_instances_free(void);
 int		unlang_xlat_event_timeout_add(request_t *request, fr_unlang_xlat_timeout_t callback,
 					      void const *ctx, fr_time_t when);
 
+int		unlang_xlat_event_fd_add(request_t *request,
+					 fr_unlang_xlat_fd_event_t read,
+					 fr_unlang_xlat_fd_event_t write,
+					 fr_unlang_xlat_fd_event_t error,
+					 void const *ctx, int fd);
+
 int		unlang_xlat_push(TALLOC_CTX *ctx, fr_value_box_list_t *out,
 				 request_t *request, xlat_exp_t const *exp, bool top_frame)
 				 CC_HINT(warn_unused_result);
@@ -115,20 +115,29 @@ static int8_t xlat_cmp(void const *one, void const *two)
  */
 xlat_t *xlat_func_find(char const *in, ssize_t inlen)
 {
-	char buffer[256];
+	char	buffer[256];
+	xlat_t	*xlat;
 
 	if (!xlat_root) return NULL;
 
-	if (inlen < 0) {
-		return fr_rb_find(xlat_root, &(xlat_t){ .name = in });
+	if (inlen >= 0) {
+		if ((size_t) inlen >= sizeof(buffer)) return NULL;
+
+		memcpy(buffer, in, inlen);
+		buffer[inlen] = '\0';
+		in = buffer;
 	}
 
-	if ((size_t) inlen >= sizeof(buffer)) return NULL;
+	xlat = fr_rb_find(xlat_root, &(xlat_t){ .name = in });
+	if (xlat) return xlat;
 
-	memcpy(buffer, in, inlen);
-	buffer[inlen] = '\0';
+	/*
+	 *	Module xlats are usually named after the module
+	 *	instance, which may not have been loaded yet.
+	 */
+	if (!module_lazy_bootstrap(in)) return NULL;
 
-	return fr_rb_find(xlat_root, &(xlat_t){ .name = buffer });
+	return fr_rb_find(xlat_root, &(xlat_t){ .name = in });
 }
 
 
@@ -405,6 +414,22 @@ void xlat_internal(xlat_t *xlat)
 	xlat->internal = true;
 }
 
+/** Mark an xlat function as pure
+ *
+ * The output of a pure function depends only on its arguments.  It mustn't
+ * read or modify the request, or yield.  The results of calls are memoised
+ * for the lifetime of the request, so policies that expand the same digest
+ * several times only do the work once.
+ *
+ * @param[in] xlat to mark as pure.
+ */
+void xlat_func_pure(xlat_t *xlat)
+{
+	fr_assert(!xlat->needs_async);
+
+	xlat->pure = true;
+}
+
 /** Set global instantiation/detach callbacks
  *
  * All functions registered must be needs_async.
@@ -2699,7 +2724,7 @@ static xlat_action_t xlat_func_sub_regex(TALLOC_CTX *ctx, fr_dcursor_t *out,
 	/*
 	 *	Process the substitution
 	 */
-	if (regex_compile(NULL, &pattern, regex, regex_len, &flags, false, true) <= 0) {
+	if (regex_compile_cached(&pattern, regex, regex_len, &flags, false) <= 0) {
 		RPEDEBUG("Failed compiling regex");
 		return XLAT_ACTION_FAIL;
 	}
@@ -2710,15 +2735,12 @@ static xlat_action_t xlat_func_sub_regex(TALLOC_CTX *ctx, fr_dcursor_t *out,
 			     rep_vb->vb_strvalue, rep_vb->vb_length, NULL) < 0) {
 		RPEDEBUG("Failed performing substitution");
 		talloc_free(vb);
-		talloc_free(pattern);
 		return XLAT_ACTION_FAIL;
 	}
 	fr_value_box_bstrdup_buffer_shallow(NULL, vb, NULL, buff, subject_vb->tainted);
 
 	fr_dcursor_append(out, vb);
 
-	talloc_free(pattern);
-
 	return XLAT_ACTION_DONE;
 }
 #endif
@@ -3093,12 +3115,18 @@ do { \
 	xlat_func_args(xlat, _args); \
 } while (0)
 
+#define XLAT_REGISTER_PURE_ARGS(_xlat, _func, _args) \
+do { \
+	XLAT_REGISTER_ARGS(_xlat, _func, _args); \
+	xlat_func_pure(xlat); \
+} while (0)
+
 	XLAT_REGISTER_ARGS("concat", xlat_func_concat, xlat_func_concat_args);
 	XLAT_REGISTER_ARGS("debug", xlat_func_debug, xlat_func_debug_args);
 	XLAT_REGISTER_ARGS("debug_attr", xlat_func_debug_attr, xlat_func_debug_attr_args);
 	XLAT_REGISTER_ARGS("explode", xlat_func_explode, xlat_func_explode_args);
-	XLAT_REGISTER_ARGS("hmacmd5", xlat_func_hmac_md5, xlat_hmac_args);
-	XLAT_REGISTER_ARGS("hmacsha1", xlat_func_hmac_sha1, xlat_hmac_args);
+	XLAT_REGISTER_PURE_ARGS("hmacmd5", xlat_func_hmac_md5, xlat_hmac_args);
+	XLAT_REGISTER_PURE_ARGS("hmacsha1", xlat_func_hmac_sha1, xlat_hmac_args);
 	XLAT_REGISTER_ARGS("integer", xlat_func_integer, xlat_func_integer_args);
 	XLAT_REGISTER_ARGS("join", xlat_func_join, xlat_func_join_args);
 	XLAT_REGISTER_ARGS("length", xlat_func_length, xlat_func_length_args);
@@ -3114,13 +3142,19 @@ do { \
 	xlat_func_mono(xlat, &_arg); \
 } while (0)
 
-	XLAT_REGISTER_MONO("base64", xlat_func_base64_encode, xlat_func_base64_encode_arg);
-	XLAT_REGISTER_MONO("base64decode", xlat_func_base64_decode, xlat_func_base64_decode_arg);
+#define XLAT_REGISTER_PURE_MONO(_xlat, _func, _arg) \
+do { \
+	XLAT_REGISTER_MONO(_xlat, _func, _arg); \
+	xlat_func_pure(xlat); \
+} while (0)
+
+	XLAT_REGISTER_PURE_MONO("base64", xlat_func_base64_encode, xlat_func_base64_encode_arg);
+	XLAT_REGISTER_PURE_MONO("base64decode", xlat_func_base64_decode, xlat_func_base64_decode_arg);
 	XLAT_REGISTER_MONO("bin", xlat_func_bin, xlat_func_bin_arg);
 	XLAT_REGISTER_MONO("hex", xlat_func_hex, xlat_func_hex_arg);
 	XLAT_REGISTER_MONO("map", xlat_func_map, xlat_func_map_arg);
-	XLAT_REGISTER_MONO("md4", xlat_func_md4, xlat_func_md4_arg);
-	XLAT_REGISTER_MONO("md5", xlat_func_md5, xlat_func_md5_arg);
+	XLAT_REGISTER_PURE_MONO("md4", xlat_func_md4, xlat_func_md4_arg);
+	XLAT_REGISTER_PURE_MONO("md5", xlat_func_md5, xlat_func_md5_arg);
 	xlat_register(NULL, "module", xlat_func_module, false);
 	XLAT_REGISTER_MONO("pack", xlat_func_pack, xlat_func_pack_arg);
 	XLAT_REGISTER_MONO("rand", xlat_func_rand, xlat_func_rand_arg);
@@ -3128,28 +3162,28 @@ do { \
 #if defined(HAVE_REGEX_PCRE) || defined(HAVE_REGEX_PCRE2)
 	xlat_register(NULL, "regex", xlat_func_regex, false);
 #endif
-	XLAT_REGISTER_MONO("sha1", xlat_func_sha1, xlat_func_sha_arg);
+	XLAT_REGISTER_PURE_MONO("sha1", xlat_func_sha1, xlat_func_sha_arg);
 
 #ifdef HAVE_OPENSSL_EVP_H
-	XLAT_REGISTER_MONO("sha2_224", xlat_func_sha2_224, xlat_func_sha_arg);
-	XLAT_REGISTER_MONO("sha2_256", xlat_func_sha2_256, xlat_func_sha_arg);
-	XLAT_REGISTER_MONO("sha2_384", xlat_func_sha2_384, xlat_func_sha_arg);
-	XLAT_REGISTER_MONO("sha2_512", xlat_func_sha2_512, xlat_func_sha_arg);
+	XLAT_REGISTER_PURE_MONO("sha2_224", xlat_func_sha2_224, xlat_func_sha_arg);
+	XLAT_REGISTER_PURE_MONO("sha2_256", xlat_func_sha2_256, xlat_func_sha_arg);
+	XLAT_REGISTER_PURE_MONO("sha2_384", xlat_func_sha2_384, xlat_func_sha_arg);
+	XLAT_REGISTER_PURE_MONO("sha2_512", xlat_func_sha2_512, xlat_func_sha_arg);
 
-	XLAT_REGISTER_MONO("blake2s_256", xlat_func_blake2s_256, xlat_func_sha_arg);
-	XLAT_REGISTER_MONO("blake2b_512", xlat_func_blake2b_512, xlat_func_sha_arg);
+	XLAT_REGISTER_PURE_MONO("blake2s_256", xlat_func_blake2s_256, xlat_func_sha_arg);
+	XLAT_REGISTER_PURE_MONO("blake2b_512", xlat_func_blake2b_512, xlat_func_sha_arg);
 
 #  if OPENSSL_VERSION_NUMBER >= 0x10101000L
-	XLAT_REGISTER_MONO("sha3_224", xlat_func_sha3_224, xlat_func_sha_arg);
-	XLAT_REGISTER_MONO("sha3_256", xlat_func_sha3_256, xlat_func_sha_arg);
-	XLAT_REGISTER_MONO("sha3_384", xlat_func_sha3_384, xlat_func_sha_arg);
-	XLAT_REGISTER_MONO("sha3_512", xlat_func_sha3_512, xlat_func_sha_arg);
+	XLAT_REGISTER_PURE_MONO("sha3_224", xlat_func_sha3_224, xlat_func_sha_arg);
+	XLAT_REGISTER_PURE_MONO("sha3_256", xlat_func_sha3_256, xlat_func_sha_arg);
+	XLAT_REGISTER_PURE_MONO("sha3_384", xlat_func_sha3_384, xlat_func_sha_arg);
+	XLAT_REGISTER_PURE_MONO("sha3_512", xlat_func_sha3_512, xlat_func_sha_arg);
 #  endif
 #endif
 
 	XLAT_REGISTER_MONO("string", xlat_func_string, xlat_func_string_arg);
 	XLAT_REGISTER_MONO("strlen", xlat_func_strlen, xlat_func_strlen_arg);
-	XLAT_REGISTER_ARGS("sub", xlat_func_sub, xlat_func_sub_args);
+	XLAT_REGISTER_PURE_ARGS("sub", xlat_func_sub, xlat_func_sub_args);
 	XLAT_REGISTER_MONO("tolower", xlat_func_tolower, xlat_change_case_arg);
 	XLAT_REGISTER_MONO("toupper", xlat_func_toupper, xlat_change_case_arg);
 	XLAT_REGISTER_MONO("urlquote", xlat_func_urlquote, xlat_func_urlquote_arg);
@@ -39,6 +39,10 @@ RCSID("$Id$")
 
 #include <ctype.h>
 
+#ifndef XLAT_EVAL_CACHE_SIZE
+#  define XLAT_EVAL_CACHE_SIZE	(256)
+#endif
+
 static bool done_init = false;
 
 static fr_dict_t const *dict_freeradius;
@@ -987,6 +991,192 @@ xlat_action_t xlat_frame_eval_resume(TALLOC_CTX *ctx, fr_dcursor_t *out,
 
 	return xa;
 }
+/** A memoised call to a pure xlat function
+ *
+ */
+typedef struct {
+	xlat_t const		*func;			//!< Function that was called.
+	uint32_t		hash;			//!< Of func and the arguments.
+	fr_value_box_list_t const *args;		//!< Arguments to compare.  Points to args_copy,
+							///< or to the live arguments in a lookup key.
+	fr_value_box_list_t	args_copy;		//!< Copy of the processed arguments.
+	fr_value_box_list_t	result;			//!< Copy of the boxes the function produced.
+} xlat_memo_t;
+
+/** Identifies the memo table in the request data
+ */
+static int const xlat_memo_id = 0;
+
+static uint32_t xlat_memo_args_hash(fr_value_box_list_t const *args, uint32_t hash)
+{
+	fr_value_box_t const	*vb = NULL;
+	uint32_t		vb_hash;
+
+	while ((vb = fr_dlist_next(args, vb))) {
+		hash = fr_hash_update(&vb->type, sizeof(vb->type), hash);
+		hash = fr_hash_update(&vb->tainted, sizeof(vb->tainted), hash);
+
+		if (vb->type == FR_TYPE_GROUP) {
+			hash = xlat_memo_args_hash(&vb->vb_group, hash);
+			continue;
+		}
+
+		vb_hash = fr_value_box_hash(vb);
+		hash = fr_hash_update(&vb_hash, sizeof(vb_hash), hash);
+	}
+
+	return hash;
+}
+
+static int8_t xlat_memo_args_cmp(fr_value_box_list_t const *a, fr_value_box_list_t const *b)
+{
+	fr_value_box_t const	*a_vb = NULL, *b_vb = NULL;
+	int8_t			ret;
+
+	for (;;) {
+		a_vb = fr_dlist_next(a, a_vb);
+		b_vb = fr_dlist_next(b, b_vb);
+
+		if (!a_vb || !b_vb) return CMP(a_vb != NULL, b_vb != NULL);
+
+		ret = CMP(a_vb->type, b_vb->type);
+		if (ret != 0) return ret;
+
+		ret = CMP(a_vb->tainted, b_vb->tainted);
+		if (ret != 0) return ret;
+
+		if (a_vb->type == FR_TYPE_GROUP) {
+			ret = xlat_memo_args_cmp(&a_vb->vb_group, &b_vb->vb_group);
+		} else {
+			ret = fr_value_box_cmp(a_vb, b_vb);
+		}
+		if (ret != 0) return ret;
+	}
+}
+
+static uint32_t xlat_memo_hash(void const *data)
+{
+	xlat_memo_t const *memo = data;
+
+	return memo->hash;
+}
+
+static int8_t xlat_memo_cmp(void const *one, void const *two)
+{
+	xlat_memo_t const *a = one, *b = two;
+	int8_t ret;
+
+	ret = CMP(a->func, b->func);
+	if (ret != 0) return ret;
+
+	return xlat_memo_args_cmp(a->args, b->args);
+}
+
+/** Find a memoised result for a call to a pure function, and copy it to out
+ *
+ * @param[in] ctx	to allocate the copies of the result in.
+ * @param[out] out	where to append the copies of the result.
+ * @param[out] memo_out	If there's no memoised result, a new entry holding
+ *			a copy of the arguments, for #xlat_memo_add.  The
+ *			copy has to be made before the function is called
+ *			as functions may modify their arguments.
+ * @param[in] request	the call is being made in.
+ * @param[in] func	being called.
+ * @param[in] args	processed arguments for the call.
+ * @return
+ *	- true if out was populated from a previous call.
+ *	- false if the function needs to be called.
+ */
+static bool xlat_memo_find(TALLOC_CTX *ctx, fr_dcursor_t *out, xlat_memo_t **memo_out,
+			   request_t *request, xlat_t const *func, fr_value_box_list_t *args)
+{
+	fr_hash_table_t		*ht;
+	xlat_memo_t		*memo, key;
+	fr_value_box_t const	*vb = NULL;
+	fr_value_box_t		*copy;
+
+	*memo_out = NULL;
+
+	key = (xlat_memo_t){
+		.func = func,
+		.hash = xlat_memo_args_hash(args, fr_hash(&func, sizeof(func))),
+		.args = args
+	};
+
+	ht = request_data_reference(request, &xlat_memo_id, 0);
+	if (ht && (memo = fr_hash_table_find(ht, &key))) {
+		while ((vb = fr_dlist_next(&memo->result, vb))) {
+			MEM(copy = fr_value_box_alloc_null(ctx));
+			if (unlikely(fr_value_box_copy(copy, copy, vb) < 0)) {
+				talloc_free(copy);
+				return false;
+			}
+			fr_dcursor_append(out, copy);
+		}
+		return true;
+	}
+
+	MEM(memo = talloc(request, xlat_memo_t));
+	*memo = (xlat_memo_t){
+		.func = func,
+		.hash = key.hash
+	};
+	fr_value_box_list_init(&memo->args_copy);
+	fr_value_box_list_init(&memo->result);
+	memo->args = &memo->args_copy;
+
+	if (fr_value_box_list_acopy(memo, &memo->args_copy, args) < 0) {
+		talloc_free(memo);
+		return false;
+	}
+	*memo_out = memo;
+
+	return false;
+}
+
+/** Remember the result of a call to a pure function for the rest of the request
+ *
+ * @param[in] request	the call was made in.
+ * @param[in] memo	from #xlat_memo_find.  Inserted into the memo table
+ *			of the request, or freed.
+ * @param[in] result	list the function appended to.
+ * @param[in] prev	last box in result before the call.
+ */
+static void xlat_memo_add(request_t *request, xlat_memo_t *memo,
+			  fr_value_box_list_t const *result, fr_value_box_t const *prev)
+{
+	fr_hash_table_t		*ht;
+	fr_value_box_t const	*vb;
+	fr_value_box_t		*copy;
+
+	for (vb = prev ? fr_dlist_next(result, prev) : fr_dlist_head(result);
+	     vb;
+	     vb = fr_dlist_next(result, vb)) {
+		MEM(copy = fr_value_box_alloc_null(memo));
+		if (unlikely(fr_value_box_copy(copy, copy, vb) < 0)) {
+		error:
+			talloc_free(memo);
+			return;
+		}
+		fr_dlist_insert_tail(&memo->result, copy);
+	}
+
+	ht = request_data_reference(request, &xlat_memo_id, 0);
+	if (!ht) {
+		ht = fr_hash_table_talloc_alloc(request, xlat_memo_t, xlat_memo_hash, xlat_memo_cmp, NULL);
+		if (!ht) goto error;
+
+		if (request_data_talloc_add(request, &xlat_memo_id, 0, fr_hash_table_t, ht,
+					    true, false, false) < 0) {
+			talloc_free(ht);
+			goto error;
+		}
+	}
+
+	talloc_steal(ht, memo);
+	if (!fr_hash_table_insert(ht, memo)) goto error;
+}
+
 /** Process the result of a previous nested expansion
  *
  * @param[in] ctx		to allocate value boxes in.
@@ -1025,10 +1215,10 @@ xlat_action_t xlat_frame_eval_repeat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 
 			if (!fr_dlist_empty(result)) {
 				VALUE_BOX_TALLOC_LIST_VERIFY(result);
-				result_str = fr_value_box_list_aprint(NULL, result, NULL, NULL);
+				result_str = fr_value_box_list_aprint(request_arena(request), result, NULL, NULL);
 				if (!result_str) return XLAT_ACTION_FAIL;
 			} else {
-				result_str = talloc_typed_strdup(NULL, "");
+				result_str = talloc_typed_strdup(request_arena(request), "");
 			}
 
 			MEM(value = fr_value_box_alloc_null(ctx));
@@ -1076,6 +1266,7 @@ xlat_action_t xlat_frame_eval_repeat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 			xlat_action_t		xa;
 			xlat_thread_inst_t	*thread_inst;
 			fr_value_box_list_t	result_copy;
+			xlat_memo_t		*memo = NULL;
 
 			thread_inst = xlat_thread_instance_find(node);
 
@@ -1098,7 +1289,7 @@ xlat_action_t xlat_frame_eval_repeat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 			 *	Need to copy the input list in case
 			 *	the async function mucks with it.
 			 */
-			if (RDEBUG_ENABLED2) fr_value_box_list_acopy(NULL, &result_copy, result);
+			if (RDEBUG_ENABLED2) fr_value_box_list_acopy(request_arena(request), &result_copy, result);
 			xa = xlat_process_args(ctx, result, request, node->call.func->input_type, node->call.func->args);
 			if (xa == XLAT_ACTION_FAIL) {
 				fr_dlist_talloc_free(&result_copy);
@@ -1106,8 +1297,23 @@ xlat_action_t xlat_frame_eval_repeat(TALLOC_CTX *ctx, fr_dcursor_t *out,
 			}
 			VALUE_BOX_TALLOC_LIST_VERIFY(result);
 
-			xa = node->call.func->func.async(ctx, out, request,
-							 node->call.inst->data, thread_inst->data, result);
+			if (node->call.func->pure &&
+			    xlat_memo_find(ctx, out, &memo, request, node->call.func, result)) {
+				RDEBUG4("Using memoised result of %s", node->call.func->name);
+				xa = XLAT_ACTION_DONE;
+			} else {
+				fr_value_box_t *prev = fr_dlist_tail(out->dlist);
+
+				xa = node->call.func->func.async(ctx, out, request,
+								 node->call.inst->data, thread_inst->data, result);
+				if (memo) {
+					if (xa == XLAT_ACTION_DONE) {
+						xlat_memo_add(request, memo, out->dlist, prev);
+					} else {
+						talloc_free(memo);
+					}
+				}
+			}
 			VALUE_BOX_TALLOC_LIST_VERIFY(result);
 
 			if (RDEBUG_ENABLED2) xlat_debug_log_expansion(request, *in, &result_copy);
@@ -1518,7 +1724,7 @@ static char *xlat_sync_eval(TALLOC_CTX *ctx, request_t *request, xlat_exp_t cons
 			fr_value_box_list_t	result;
 			xlat_action_t		action;
 			fr_dcursor_t		out;
-			TALLOC_CTX		*pool = talloc_new(NULL);
+			TALLOC_CTX		*pool = talloc_new(request_arena(request));
 
 			fr_value_box_list_init (&result);
 			fr_dcursor_init(&out, &result);
@@ -1563,7 +1769,7 @@ static char *xlat_sync_eval(TALLOC_CTX *ctx, request_t *request, xlat_exp_t cons
 		 */
 		if (node->call.func->type == XLAT_FUNC_NORMAL) {
 			fr_value_box_list_t	result;
-			TALLOC_CTX	*pool = talloc_new(NULL);
+			TALLOC_CTX	*pool = talloc_new(request_arena(request));
 			fr_value_box_list_init(&result);
 			/*
 			 *	Use the unlang stack to evaluate
@@ -1876,6 +2082,156 @@ static ssize_t _xlat_eval_compiled(TALLOC_CTX *ctx, char **out, size_t outlen, r
 	return len;
 }
 
+/*
+ *########################################
+ *#        RUNTIME EXPANSION CACHE       #
+ *########################################
+ */
+
+/** A format string tokenized at runtime
+ *
+ */
+typedef struct {
+	char const		*fmt;		//!< Copy of the format string.
+	size_t			len;		//!< Length of the format string.
+	fr_dict_t const		*dict;		//!< Default dictionary the string was tokenized with.
+
+	xlat_exp_t		*node;		//!< The tokenized and instantiated expansion.
+	unsigned int		in_use;		//!< Evaluations in progress.  Entries in use aren't evicted.
+	fr_dlist_t		entry;		//!< Entry in the LRU list.
+} xlat_eval_cache_entry_t;
+
+/** Thread local cache of format strings tokenized at runtime
+ *
+ * Strings which come from data, rather than the configuration, e.g. with
+ * %{xlat:...}, or via xlat_eval() in modules, would otherwise be tokenized
+ * and instantiated every time they were evaluated.
+ *
+ * Ephemeral expansions can't be evaluated by more than one request at a
+ * time, but _xlat_eval() runs each expansion to completion, so only
+ * nested evaluations within the same request can overlap.  Those pin the
+ * entry with in_use.
+ */
+typedef struct {
+	fr_hash_table_t		*ht;		//!< Entries by format string and dictionary.
+	fr_dlist_head_t		lru;		//!< Most recently used entry at the head.
+} xlat_eval_cache_t;
+
+static _Thread_local xlat_eval_cache_t *xlat_eval_cache;
+
+static uint32_t xlat_eval_cache_hash(void const *data)
+{
+	xlat_eval_cache_entry_t const	*c = data;
+
+	return fr_hash_update(&c->dict, sizeof(c->dict), fr_hash(c->fmt, c->len));
+}
+
+static int8_t xlat_eval_cache_cmp(void const *one, void const *two)
+{
+	xlat_eval_cache_entry_t const	*a = one, *b = two;
+	int				ret;
+
+	ret = CMP(a->len, b->len);
+	if (ret != 0) return ret;
+
+	ret = CMP(a->dict, b->dict);
+	if (ret != 0) return ret;
+
+	ret = memcmp(a->fmt, b->fmt, a->len);
+	return CMP(ret, 0);
+}
+
+static void _xlat_eval_cache_free_on_exit(void *arg)
+{
+	talloc_free(arg);
+}
+
+/** Find or create the cache entry for a format string
+ *
+ * @param[out] out	The entry, which has been marked as in use.
+ * @param[in] request	the string is being evaluated for.
+ * @param[in] fmt	to tokenize.
+ * @return
+ *	- >0 on success.
+ *	- 0 for a zero length expansion, or failed instantiation.  No entry is returned.
+ *	- <0 the negative offset of the parse failure.  No entry is returned.
+ */
+static ssize_t xlat_eval_cache_find(xlat_eval_cache_entry_t **out, request_t *request, char const *fmt)
+{
+	xlat_eval_cache_t	*cache = xlat_eval_cache;
+	xlat_eval_cache_entry_t	*c, find;
+	ssize_t			slen;
+
+	*out = NULL;
+
+	if (unlikely(!cache)) {
+		MEM(cache = talloc_zero(NULL, xlat_eval_cache_t));
+		MEM(cache->ht = fr_hash_table_alloc(cache, xlat_eval_cache_hash, xlat_eval_cache_cmp, NULL));
+		fr_dlist_talloc_init(&cache->lru, xlat_eval_cache_entry_t, entry);
+
+		fr_atexit_thread_local(xlat_eval_cache, _xlat_eval_cache_free_on_exit, cache);
+		xlat_eval_cache = cache;
+	}
+
+	find = (xlat_eval_cache_entry_t){
+		.fmt = fmt,
+		.len = strlen(fmt),
+		.dict = request->dict
+	};
+
+	c = fr_hash_table_find(cache->ht, &find);
+	if (c) {
+		fr_dlist_remove(&cache->lru, c);
+		fr_dlist_insert_head(&cache->lru, c);
+
+		c->in_use++;
+		*out = c;
+		return c->len;
+	}
+
+	MEM(c = talloc_zero(cache, xlat_eval_cache_entry_t));
+
+	slen = xlat_tokenize_ephemeral(c, &c->node, NULL,
+				       &FR_SBUFF_IN(fmt, find.len),
+				       NULL, &(tmpl_rules_t){ .dict_def = request->dict });
+	if (slen <= 0) {
+		talloc_free(c);
+		return slen;
+	}
+
+	MEM(c->fmt = talloc_memdup(c, fmt, find.len));
+	c->len = find.len;
+	c->dict = find.dict;
+
+	/*
+	 *	Evict the least recently used expansion which
+	 *	isn't being evaluated.
+	 */
+	if (fr_dlist_num_elements(&cache->lru) >= XLAT_EVAL_CACHE_SIZE) {
+		xlat_eval_cache_entry_t *old;
+
+		for (old = fr_dlist_tail(&cache->lru); old; old = fr_dlist_prev(&cache->lru, old)) {
+			if (old->in_use) continue;
+
+			fr_dlist_remove(&cache->lru, old);
+			fr_hash_table_delete(cache->ht, old);
+			talloc_free(old);
+			break;
+		}
+	}
+
+	if (!fr_hash_table_insert(cache->ht, c)) {
+		talloc_free(c);
+		fr_strerror_const("Failed inserting expansion into cache");
+		return 0;
+	}
+	fr_dlist_insert_head(&cache->lru, c);
+
+	c->in_use++;
+	*out = c;
+	return slen;
+}
+
 static ssize_t _xlat_eval(TALLOC_CTX *ctx, char **out, size_t outlen, request_t *request, char const *fmt,
 			  xlat_escape_legacy_t escape, void const *escape_ctx) CC_HINT(nonnull (2, 4, 5));
 
@@ -1895,8 +2251,8 @@ static ssize_t _xlat_eval(TALLOC_CTX *ctx, char **out, size_t outlen, request_t
 static ssize_t _xlat_eval(TALLOC_CTX *ctx, char **out, size_t outlen, request_t *request, char const *fmt,
 			  xlat_escape_legacy_t escape, void const *escape_ctx)
 {
-	ssize_t len;
-	xlat_exp_t *node;
+	ssize_t			len;
+	xlat_eval_cache_entry_t	*c;
 
 	RDEBUG2("EXPAND %s", fmt);
 	RINDENT();
@@ -1904,9 +2260,7 @@ static ssize_t _xlat_eval(TALLOC_CTX *ctx, char **out, size_t outlen, request_t
 	/*
 	 *	Give better errors than the old code.
 	 */
-	len = xlat_tokenize_ephemeral(ctx, &node, NULL,
-				      &FR_SBUFF_IN(fmt, strlen(fmt)),
-				      NULL, &(tmpl_rules_t){ .dict_def = request->dict });
+	len = xlat_eval_cache_find(&c, request, fmt);
 	if (len == 0) {
 		if (*out) {
 			**out = '\0';
@@ -1924,8 +2278,8 @@ static ssize_t _xlat_eval(TALLOC_CTX *ctx, char **out, size_t outlen, request_t
 		return -1;
 	}
 
-	len = _xlat_eval_compiled(ctx, out, outlen, request, node, escape, escape_ctx);
-	talloc_free(node);
+	len = _xlat_eval_compiled(ctx, out, outlen, request, c->node, escape, escape_ctx);
+	c->in_use--;
 
 	REXDENT();
 	RDEBUG2("--> %s", *out);
@@ -70,6 +70,8 @@ typedef struct xlat_s {
 	void			*thread_uctx;		//!< uctx to pass to instantiation functions.
 
 	bool			needs_async;		//!< If true, then it requires async operation
+	bool			pure;			//!< Output depends only on the arguments, so
+							///< results are memoised per request.
 
 	size_t			buf_len;		//!< Length of output buffer to pre-allocate.
 	void			*mod_inst;		//!< Module instance passed to xlat
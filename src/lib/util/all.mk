@@ -3,13 +3,20 @@ SUBMAKEFILES := \
 	cursor_tests.mk \
 	dbuff_tests.mk \
 	dcursor_tests.mk \
+	digest_perf_test.mk \
 	dlist_tests.mk \
+	hash_tests.mk \
 	heap_tests.mk \
+	hist_tests.mk \
+	inet_tests.mk \
 	libfreeradius-util.mk \
+	limiter_tests.mk \
 	pair_legacy_tests.mk \
 	pair_list_perf_test.mk \
 	pair_tests.mk \
+	print_tests.mk \
 	rb_tests.mk \
 	sbuff_tests.mk \
-	strerror_tests.mk
+	strerror_tests.mk \
+	timer_wheel_tests.mk
 
@@ -0,0 +1,316 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Identify, tune and report on the malloc implementation
+ *
+ * talloc allocates every chunk with malloc(), and has no hooks to
+ * replace it.  Instead, a caching allocator with per-thread caches
+ * (jemalloc or tcmalloc) is selected by linking the server against
+ * it, or by preloading it at startup with LD_PRELOAD.  Every malloc()
+ * in the process then uses it, including talloc's, libraries', and
+ * those of long lived and cross-thread structures.
+ *
+ * We find out which allocator is in use by looking for its extension
+ * API, so we can tune it, and report its statistics.
+ *
+ * @file src/lib/util/allocator.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/allocator.h>
+#include <freeradius-devel/util/strerror.h>
+
+#ifdef HAVE_MALLOC_H
+#  include <malloc.h>
+#endif
+#include <dlfcn.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#ifndef RTLD_DEFAULT
+#  define RTLD_DEFAULT ((void *) 0)
+#endif
+
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 33)))
+#  define HAVE_MALLINFO2
+#endif
+
+typedef int (*jemalloc_mallctl_t)(char const *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen);
+typedef int (*tcmalloc_property_t)(char const *property, size_t *value);
+typedef void (*tcmalloc_release_t)(void);
+
+static pthread_once_t		allocator_once = PTHREAD_ONCE_INIT;
+static fr_allocator_type_t	allocator_type;
+
+static jemalloc_mallctl_t	je_mallctl;
+static tcmalloc_property_t	tc_property;
+static tcmalloc_release_t	tc_release;
+
+static _Atomic(uint64_t)	allocator_version;
+
+/** Look for the extension API of each allocator we know about
+ *
+ */
+static void _allocator_detect(void)
+{
+	je_mallctl = (jemalloc_mallctl_t)(uintptr_t) dlsym(RTLD_DEFAULT, "mallctl");
+	if (!je_mallctl) je_mallctl = (jemalloc_mallctl_t)(uintptr_t) dlsym(RTLD_DEFAULT, "je_mallctl");
+	if (je_mallctl) {
+		allocator_type = FR_ALLOCATOR_JEMALLOC;
+		return;
+	}
+
+	tc_property = (tcmalloc_property_t)(uintptr_t) dlsym(RTLD_DEFAULT, "MallocExtension_GetNumericProperty");
+	if (tc_property) {
+		tc_release = (tcmalloc_release_t)(uintptr_t) dlsym(RTLD_DEFAULT, "MallocExtension_ReleaseFreeMemory");
+		allocator_type = FR_ALLOCATOR_TCMALLOC;
+		return;
+	}
+
+#ifdef __GLIBC__
+	allocator_type = FR_ALLOCATOR_GLIBC;
+#else
+	allocator_type = FR_ALLOCATOR_SYSTEM;
+#endif
+}
+
+/** Return the malloc implementation in use
+ *
+ */
+fr_allocator_type_t fr_allocator_type(void)
+{
+	pthread_once(&allocator_once, _allocator_detect);
+
+	return allocator_type;
+}
+
+/** Return the name of a malloc implementation
+ *
+ */
+char const *fr_allocator_name(fr_allocator_type_t type)
+{
+	switch (type) {
+	case FR_ALLOCATOR_GLIBC:
+		return "glibc";
+
+	case FR_ALLOCATOR_JEMALLOC:
+		return "jemalloc";
+
+	case FR_ALLOCATOR_TCMALLOC:
+		return "tcmalloc";
+
+	default:
+		return "system";
+	}
+}
+
+/** Apply tuning to the allocator
+ *
+ * Must be called before any threads are created, as some allocators
+ * only read their settings when a thread first allocates.
+ *
+ * @param[in] conf	to apply.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the allocator can't be tuned this way.
+ */
+int fr_allocator_init(fr_allocator_conf_t const *conf)
+{
+	if (!conf->arenas) return 0;
+
+	switch (fr_allocator_type()) {
+#if defined(HAVE_MALLOC_H) && defined(M_ARENA_MAX)
+	case FR_ALLOCATOR_GLIBC:
+		if (mallopt(M_ARENA_MAX, (int) conf->arenas) != 1) {
+			fr_strerror_printf("Failed setting the maximum number of malloc arenas to %u", conf->arenas);
+			return -1;
+		}
+		return 0;
+#endif
+
+	case FR_ALLOCATOR_JEMALLOC:
+		fr_strerror_const("jemalloc creates its arenas at startup, use MALLOC_CONF=narenas:N instead");
+		return -1;
+
+	default:
+		fr_strerror_printf("The %s allocator doesn't support setting the number of arenas",
+				   fr_allocator_name(fr_allocator_type()));
+		return -1;
+	}
+}
+
+static size_t jemalloc_stat(char const *name)
+{
+	size_t	value = 0, len = sizeof(value);
+
+	if (je_mallctl(name, &value, &len, NULL, 0) != 0) return 0;
+
+	return value;
+}
+
+static size_t tcmalloc_stat(char const *name)
+{
+	size_t	value = 0;
+
+	if (!tc_property(name, &value)) return 0;
+
+	return value;
+}
+
+/** Take a snapshot of the allocator's statistics
+ *
+ * @param[out] stats	to write the statistics to.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the allocator doesn't provide statistics.
+ */
+int fr_allocator_stats(fr_allocator_stats_t *stats)
+{
+	*stats = (fr_allocator_stats_t) {
+		.type = fr_allocator_type()
+	};
+
+	switch (stats->type) {
+	case FR_ALLOCATOR_JEMALLOC:
+	{
+		uint64_t	epoch = 1;
+		size_t		len = sizeof(epoch);
+		unsigned	narenas = 0;
+		size_t		narenas_len = sizeof(narenas);
+
+		/*
+		 *	jemalloc caches its statistics, and only
+		 *	refreshes them when the epoch is advanced.
+		 */
+		if (je_mallctl("epoch", &epoch, &len, &epoch, len) != 0) {
+			fr_strerror_const("Failed refreshing jemalloc statistics");
+			return -1;
+		}
+		stats->version = epoch;
+
+		stats->allocated = jemalloc_stat("stats.allocated");
+		stats->active = jemalloc_stat("stats.active");
+		stats->resident = jemalloc_stat("stats.resident");
+		stats->mapped = jemalloc_stat("stats.mapped");
+		if (stats->active > stats->allocated) stats->free = stats->active - stats->allocated;
+
+		if (je_mallctl("arenas.narenas", &narenas, &narenas_len, NULL, 0) == 0) stats->arenas = narenas;
+		return 0;
+	}
+
+	case FR_ALLOCATOR_TCMALLOC:
+		stats->version = atomic_fetch_add_explicit(&allocator_version, 1, memory_order_relaxed) + 1;
+		stats->allocated = tcmalloc_stat("generic.current_allocated_bytes");
+		stats->mapped = tcmalloc_stat("generic.heap_size");
+		stats->free = tcmalloc_stat("tcmalloc.pageheap_free_bytes");
+		stats->thread_cache = tcmalloc_stat("tcmalloc.current_total_thread_cache_bytes");
+		if (stats->mapped > tcmalloc_stat("tcmalloc.pageheap_unmapped_bytes")) {
+			stats->resident = stats->mapped - tcmalloc_stat("tcmalloc.pageheap_unmapped_bytes");
+		}
+		stats->active = stats->resident;
+		return 0;
+
+#ifdef HAVE_MALLOC_H
+	case FR_ALLOCATOR_GLIBC:
+	{
+#  ifdef HAVE_MALLINFO2
+		struct mallinfo2	mi = mallinfo2();
+#  else
+		struct mallinfo		mi = mallinfo();
+#  endif
+
+		stats->version = atomic_fetch_add_explicit(&allocator_version, 1, memory_order_relaxed) + 1;
+		stats->allocated = (size_t) mi.uordblks + (size_t) mi.hblkhd;
+		stats->free = (size_t) mi.fordblks;
+		stats->mapped = (size_t) mi.arena + (size_t) mi.hblkhd;
+		stats->active = stats->mapped;
+		stats->resident = stats->mapped;
+		return 0;
+	}
+#endif
+
+	default:
+		fr_strerror_printf("The %s allocator doesn't provide statistics", fr_allocator_name(stats->type));
+		return -1;
+	}
+}
+
+/** Print a snapshot of allocator statistics
+ *
+ */
+void fr_allocator_stats_print(FILE *fp, fr_allocator_stats_t const *stats)
+{
+	fprintf(fp, "allocator\t%s\n", fr_allocator_name(stats->type));
+	fprintf(fp, "version\t\t%" PRIu64 "\n", stats->version);
+	fprintf(fp, "allocated\t%zu\n", stats->allocated);
+	fprintf(fp, "active\t\t%zu\n", stats->active);
+	fprintf(fp, "resident\t%zu\n", stats->resident);
+	fprintf(fp, "mapped\t\t%zu\n", stats->mapped);
+	fprintf(fp, "free\t\t%zu\n", stats->free);
+	fprintf(fp, "thread_cache\t%zu\n", stats->thread_cache);
+	fprintf(fp, "arenas\t\t%u\n", stats->arenas);
+}
+
+/** Return free memory held by the allocator to the operating system
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the allocator doesn't support it.
+ */
+int fr_allocator_trim(void)
+{
+	switch (fr_allocator_type()) {
+	case FR_ALLOCATOR_JEMALLOC:
+	{
+		char	name[64];
+
+		/*
+		 *	MALLCTL_ARENAS_ALL
+		 */
+		snprintf(name, sizeof(name), "arena.%u.purge", 4096);
+		if (je_mallctl(name, NULL, NULL, NULL, 0) != 0) {
+			fr_strerror_const("Failed purging jemalloc arenas");
+			return -1;
+		}
+		return 0;
+	}
+
+	case FR_ALLOCATOR_TCMALLOC:
+		if (!tc_release) break;
+		tc_release();
+		return 0;
+
+#ifdef HAVE_MALLOC_H
+	case FR_ALLOCATOR_GLIBC:
+		(void) malloc_trim(0);
+		return 0;
+#endif
+
+	default:
+		break;
+	}
+
+	fr_strerror_printf("The %s allocator doesn't support trimming", fr_allocator_name(fr_allocator_type()));
+	return -1;
+}
@@ -0,0 +1,84 @@
+#pragma once
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Identify, tune and report on the malloc implementation
+ *
+ * @file src/lib/util/allocator.h
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(allocator_h, "$Id$")
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** The malloc implementation talloc, and everything else, allocates from
+ *
+ */
+typedef enum {
+	FR_ALLOCATOR_SYSTEM = 0,			//!< Unknown libc malloc.
+	FR_ALLOCATOR_GLIBC,				//!< glibc ptmalloc.
+	FR_ALLOCATOR_JEMALLOC,				//!< jemalloc, linked or preloaded.
+	FR_ALLOCATOR_TCMALLOC				//!< gperftools tcmalloc, linked or preloaded.
+} fr_allocator_type_t;
+
+/** Allocator tuning, applied at startup before any threads are created
+ *
+ */
+typedef struct {
+	uint32_t		arenas;			//!< Maximum number of arenas.  0 for the
+							///< allocator's default.
+} fr_allocator_conf_t;
+
+/** A snapshot of allocator statistics
+ *
+ * Values the allocator doesn't provide are 0.
+ */
+typedef struct {
+	uint64_t		version;		//!< Increases with every snapshot.  Two snapshots
+							///< with the same version are the same data.
+	fr_allocator_type_t	type;			//!< Allocator the statistics are for.
+	size_t			allocated;		//!< Bytes handed out to the application.
+	size_t			active;			//!< Bytes in pages with allocations in them.
+	size_t			resident;		//!< Bytes of physical memory the allocator holds.
+	size_t			mapped;			//!< Bytes of address space the allocator holds.
+	size_t			free;			//!< Bytes held by the allocator, but not allocated.
+	size_t			thread_cache;		//!< Bytes in per-thread caches.
+	uint32_t		arenas;			//!< Number of arenas.
+} fr_allocator_stats_t;
+
+fr_allocator_type_t	fr_allocator_type(void);
+
+char const		*fr_allocator_name(fr_allocator_type_t type);
+
+int			fr_allocator_init(fr_allocator_conf_t const *conf) CC_HINT(nonnull);
+
+int			fr_allocator_stats(fr_allocator_stats_t *stats) CC_HINT(nonnull);
+
+void			fr_allocator_stats_print(FILE *fp, fr_allocator_stats_t const *stats) CC_HINT(nonnull);
+
+int			fr_allocator_trim(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -60,6 +60,7 @@ RCSIDH(libradius_h, "$Id$")
 #include <freeradius-devel/util/rand.h>
 #include <freeradius-devel/util/rb.h>
 #include <freeradius-devel/util/regex.h>
+#include <freeradius-devel/util/resolve.h>
 #include <freeradius-devel/util/sha1.h>
 #include <freeradius-devel/util/snprintf.h>
 #include <freeradius-devel/util/socket.h>
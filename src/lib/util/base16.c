@@ -25,6 +25,17 @@ RCSID("$Id$")
 #include <freeradius-devel/util/base16.h>
 #define us(x) (uint8_t) x
 
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+/** Maximum number of input bytes the vector encoder converts per copy to the output buffer
+ *
+ */
+#ifndef BASE16_VECTOR_CHUNK
+#  define BASE16_VECTOR_CHUNK	128
+#endif
+
 /** lower case encode alphabet for base16
  *
  */
@@ -101,6 +112,67 @@ uint8_t const fr_base16_alphabet_decode_mc[UINT8_MAX] = {
 	F128(103, UINT8_MAX), F16(231, UINT8_MAX), F8(247, UINT8_MAX)
 };
 
+#ifdef __SSE2__
+/** Encode 16 bytes as 32 hexits
+ *
+ * @param[out] out		Where to write the hexits.
+ * @param[in] in		Bytes to encode.
+ * @param[in] alpha_offset	Added to hexits > 9, after '0' has been added.
+ *				Selects upper or lower case.
+ */
+static inline CC_HINT(always_inline) void base16_encode_block(char out[static 32], uint8_t const in[static 16],
+								 char alpha_offset)
+{
+	__m128i const	mask = _mm_set1_epi8(0x0f);
+	__m128i const	nine = _mm_set1_epi8(9);
+	__m128i const	zero = _mm_set1_epi8('0');
+	__m128i const	alpha = _mm_set1_epi8(alpha_offset);
+	__m128i		v = _mm_loadu_si128((__m128i const *)in);
+	__m128i		hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+	__m128i		lo = _mm_and_si128(v, mask);
+	__m128i		a = _mm_unpacklo_epi8(hi, lo);
+	__m128i		b = _mm_unpackhi_epi8(hi, lo);
+
+	a = _mm_add_epi8(_mm_add_epi8(a, zero), _mm_and_si128(_mm_cmpgt_epi8(a, nine), alpha));
+	b = _mm_add_epi8(_mm_add_epi8(b, zero), _mm_and_si128(_mm_cmpgt_epi8(b, nine), alpha));
+
+	_mm_storeu_si128((__m128i *)out, a);
+	_mm_storeu_si128((__m128i *)(out + 16), b);
+}
+
+/** Decode 16 mixed case hexits to 8 bytes
+ *
+ * @param[out] out		Where to write the bytes.
+ * @param[in] in		Hexits to decode.
+ * @return
+ *	- true if all the input was valid, and out was written.
+ *	- false if any of the input wasn't a hexit.
+ */
+static inline CC_HINT(always_inline) bool base16_decode_block(uint8_t out[static 8], char const in[static 16])
+{
+	__m128i		v = _mm_loadu_si128((__m128i const *)in);
+	__m128i		digit = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+	__m128i		alpha = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+	__m128i		is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+	__m128i		is_alpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(5)), alpha);
+	__m128i		w;
+
+	if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xffff) return false;
+
+	w = _mm_or_si128(_mm_and_si128(digit, is_digit),
+			 _mm_and_si128(_mm_add_epi8(alpha, _mm_set1_epi8(10)), is_alpha));
+
+	/*
+	 *	Each 16bit lane is now <low hexit><high hexit>,
+	 *	combine them into one byte, and pack the lanes.
+	 */
+	w = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(w, 4), _mm_set1_epi16(0x00f0)), _mm_srli_epi16(w, 8));
+	_mm_storel_epi64((__m128i *)out, _mm_packus_epi16(w, w));
+
+	return true;
+}
+#endif
+
 /** Convert binary data to a hex string
  *
  * Ascii encoded hex string will not be prefixed with '0x'
@@ -117,6 +189,38 @@ ssize_t fr_base16_encode_nstd(fr_sbuff_t *out, fr_dbuff_t *in, char const alphab
 	fr_sbuff_t	our_out = FR_SBUFF_NO_ADVANCE(out);
 	fr_dbuff_t	our_in = FR_DBUFF(in);
 
+#ifdef __SSE2__
+	char		alpha_offset = 0;
+
+	if (alphabet == fr_base16_alphabet_encode_lc) {
+		alpha_offset = 'a' - '0' - 10;
+	} else if (alphabet == fr_base16_alphabet_encode_uc) {
+		alpha_offset = 'A' - '0' - 10;
+	}
+
+	/*
+	 *	Encode whole blocks while there's space for them,
+	 *	leaving the tail, and any out of space errors, to
+	 *	the loop below.
+	 */
+	while (alpha_offset && (fr_dbuff_extend_lowat(NULL, &our_in, 16) >= 16)) {
+		char	buffer[BASE16_VECTOR_CHUNK * 2];
+		size_t	len, i;
+
+		len = fr_sbuff_extend_lowat(NULL, &our_out, 32) / 2;
+		if (len > BASE16_VECTOR_CHUNK) len = BASE16_VECTOR_CHUNK;
+		if (len > fr_dbuff_remaining(&our_in)) len = fr_dbuff_remaining(&our_in);
+		len &= ~(size_t)0x0f;
+		if (!len) break;
+
+		for (i = 0; i < len; i += 16) base16_encode_block(buffer + (i * 2), fr_dbuff_current(&our_in) + i,
+								  alpha_offset);
+
+		FR_SBUFF_IN_BSTRNCPY_RETURN(&our_out, buffer, len * 2);
+		fr_dbuff_advance(&our_in, len);
+	}
+#endif
+
 	while (fr_dbuff_extend(&our_in)) {
 		uint8_t a = *fr_dbuff_current(&our_in);
 
@@ -147,6 +251,32 @@ ssize_t fr_base16_decode_nstd(fr_sbuff_parse_error_t *err, fr_dbuff_t *out, fr_s
 	fr_sbuff_t	our_in = FR_SBUFF_NO_ADVANCE(in);
 	fr_dbuff_t	our_out = FR_DBUFF(out);
 
+#ifdef __SSE2__
+	/*
+	 *	Decode whole blocks until we find something which
+	 *	isn't a hexit, or run short of space, then let the
+	 *	loop below deal with it.
+	 */
+	while ((alphabet == fr_base16_alphabet_decode_mc) && (fr_sbuff_extend_lowat(NULL, &our_in, 16) >= 16)) {
+		uint8_t	buffer[BASE16_VECTOR_CHUNK];
+		size_t	len, i;
+
+		len = fr_dbuff_extend_lowat(NULL, &our_out, 8);
+		if (len > BASE16_VECTOR_CHUNK) len = BASE16_VECTOR_CHUNK;
+		if (len > (fr_sbuff_remaining(&our_in) / 2)) len = fr_sbuff_remaining(&our_in) / 2;
+		len &= ~(size_t)0x07;
+
+		for (i = 0; i < len; i += 8) {
+			if (!base16_decode_block(buffer + i, fr_sbuff_current(&our_in) + (i * 2))) break;
+		}
+		if (!i) break;
+
+		FR_DBUFF_IN_MEMCPY_RETURN(&our_out, buffer, i);
+		fr_sbuff_advance(&our_in, i * 2);
+		if (i < len) break;
+	}
+#endif
+
 	while (fr_sbuff_extend_lowat(NULL, &our_in, 2) >= 2) {
 		char	*p = fr_sbuff_current(&our_in);
 		bool	a, b;
@@ -158,6 +288,7 @@ ssize_t fr_base16_decode_nstd(fr_sbuff_parse_error_t *err, fr_dbuff_t *out, fr_s
 		   		if (err) *err = FR_SBUFF_PARSE_ERROR_TRAILING;
 		   		return -fr_sbuff_used(&our_in);
 		   	}
+			break;
 		}
 
 		FR_DBUFF_IN_BYTES_RETURN(&our_out, (alphabet[us(p[0])] << 4) | alphabet[us(p[1])]);
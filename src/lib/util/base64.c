@@ -30,6 +30,25 @@ RCSID("$Id$")
 #include <freeradius-devel/util/value.h>
 #define us(x) (uint8_t) x
 
+/*
+ *	Build the SSSE3 block codecs if the compiler lets us target
+ *	the instructions per function.  We still check at runtime
+ *	that the CPU has them.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 5)))
+#  define BASE64_HAVE_SSSE3
+#  include <cpuid.h>
+#  include <immintrin.h>
+#endif
+
+/** Maximum number of blocks the vector codecs convert per copy to the output buffer
+ *
+ * A block is 12 bytes of binary data, or 16 base64 chars.
+ */
+#ifndef BASE64_VECTOR_BLOCKS
+#  define BASE64_VECTOR_BLOCKS	16
+#endif
+
 char const fr_base64_alphabet_encode[UINT8_MAX] = {
 	[62] = '+',
 	[63] = '/',
@@ -312,6 +331,135 @@ uint8_t const fr_base64_url_alphabet_decode[UINT8_MAX] = {
 	F4(251, UINT8_MAX)
 };
 
+#ifdef BASE64_HAVE_SSSE3
+/** Check whether the CPU supports SSSE3
+ *
+ * Racing threads all get the same answer, so there's no need for locking.
+ */
+static bool base64_ssse3_available(void)
+{
+	static int	available = -1;
+
+	if (available < 0) {
+		unsigned int eax, ebx, ecx, edx;
+
+		available = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1 << 9));	/* SSSE3 */
+	}
+
+	return available;
+}
+
+/** Encode blocks of 12 bytes as 16 base64 chars
+ *
+ * Reads 4 bytes past the end of the last block.
+ *
+ * @param[out] out	Where to write blocks * 16 chars.
+ * @param[in] in	Data to encode, must be at least (blocks * 12) + 4 bytes.
+ * @param[in] blocks	How many blocks to encode.
+ * @param[in] c62	Char to use for 62, which differs between alphabets.
+ * @param[in] c63	Char to use for 63, which differs between alphabets.
+ */
+__attribute__((target("ssse3")))
+static void base64_encode_ssse3(char *out, uint8_t const *in, size_t blocks, char c62, char c63)
+{
+	__m128i const	shuffle = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+	__m128i const	offset = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+					       '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+					       c62 - 62, c63 - 63, 'A', 0, 0);
+	size_t		i;
+
+	for (i = 0; i < blocks; i++) {
+		__m128i	v, idx, res;
+
+		/*
+		 *	Split each 3 bytes into 4 six bit indexes,
+		 *	one per byte.
+		 */
+		v = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(in + (i * 12))), shuffle);
+		idx = _mm_or_si128(_mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)),
+						   _mm_set1_epi32(0x04000040)),
+				   _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)),
+						   _mm_set1_epi32(0x01000010)));
+
+		/*
+		 *	Map each range of indexes to the offset
+		 *	which turns it into a char.
+		 *	0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10,
+		 *	62 -> 11, 63 -> 12.
+		 */
+		res = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+		res = _mm_or_si128(res, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx), _mm_set1_epi8(13)));
+		res = _mm_add_epi8(_mm_shuffle_epi8(offset, res), idx);
+
+		_mm_storeu_si128((__m128i *)(out + (i * 16)), res);
+	}
+}
+
+/** Decode blocks of 16 base64 chars to 12 bytes
+ *
+ * Writes 4 bytes past the end of the last block.
+ *
+ * @param[out] out	Where to write the data, must be at least (blocks * 12) + 4 bytes.
+ * @param[in] in	Chars to decode.
+ * @param[in] blocks	How many blocks to decode.
+ * @param[in] url	Use the URL safe alphabet.
+ * @return The number of blocks decoded.  Less than blocks if a block
+ *	contained chars outside of the alphabet.
+ */
+__attribute__((target("ssse3")))
+static size_t base64_decode_ssse3(uint8_t *out, char const *in, size_t blocks, bool url)
+{
+	/*
+	 *	Which high nibbles are valid for each low nibble, as
+	 *	a bitmap, and what to add to each high nibble to get
+	 *	the index.  The char for 63 is the only one which
+	 *	shares its high nibble with chars which need a
+	 *	different offset, so it's fixed up separately.
+	 */
+#define V(_x) ((char)(_x))
+	__m128i const	valid = url ?
+				_mm_setr_epi8(V(0xa8), V(0xf8), V(0xf8), V(0xf8), V(0xf8), V(0xf8), V(0xf8), V(0xf8),
+					      V(0xf8), V(0xf8), V(0xf0), 0x50, 0x50, 0x54, 0x50, 0x70) :
+				_mm_setr_epi8(V(0xa8), V(0xf8), V(0xf8), V(0xf8), V(0xf8), V(0xf8), V(0xf8), V(0xf8),
+					      V(0xf8), V(0xf8), V(0xf0), 0x54, 0x50, 0x50, 0x50, 0x54);
+	__m128i const	shift = _mm_setr_epi8(0, 0, url ? 62 - '-' : 62 - '+', 52 - '0', -'A', -'A', 26 - 'a', 26 - 'a',
+					      0, 0, 0, 0, 0, 0, 0, 0);
+	__m128i const	c63 = _mm_set1_epi8(url ? '_' : '/');
+	__m128i const	c63_fixup = _mm_set1_epi8(url ? (63 - '_') - -'A' : (63 - '/') - (62 - '+'));
+	__m128i const	bit = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, V(0x80),
+					    0, 0, 0, 0, 0, 0, 0, 0);
+	__m128i const	nibble = _mm_set1_epi8(0x0f);
+	__m128i const	pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+#undef V
+	size_t		i;
+
+	for (i = 0; i < blocks; i++) {
+		__m128i	v = _mm_loadu_si128((__m128i const *)(in + (i * 16)));
+		__m128i	hi = _mm_and_si128(_mm_srli_epi32(v, 4), nibble);
+		__m128i	lo = _mm_and_si128(v, nibble);
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(_mm_shuffle_epi8(valid, lo),
+								       _mm_shuffle_epi8(bit, hi)),
+						     _mm_setzero_si128()))) break;
+
+		v = _mm_add_epi8(v, _mm_add_epi8(_mm_shuffle_epi8(shift, hi),
+						 _mm_and_si128(_mm_cmpeq_epi8(v, c63), c63_fixup)));
+
+		/*
+		 *	Merge the four six bit indexes in each 32bit
+		 *	lane into 24 bits, then pack the lanes.
+		 */
+		v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+		v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+		v = _mm_shuffle_epi8(v, pack);
+
+		_mm_storeu_si128((__m128i *)(out + (i * 12)), v);
+	}
+
+	return i;
+}
+#endif
+
 /** Base 64 encode binary data
  *
  * Base64 encode in bytes to base64, writing to out.
@@ -332,6 +480,31 @@ ssize_t fr_base64_encode_nstd(fr_sbuff_t *out, fr_dbuff_t *in,
 
 	fr_strerror_const("Insufficient buffer space");
 
+#ifdef BASE64_HAVE_SSSE3
+	/*
+	 *	Encode whole blocks while there's space for them,
+	 *	leaving the tail, padding, and any out of space
+	 *	errors to the loop below.
+	 */
+	if (((alphabet == fr_base64_alphabet_encode) || (alphabet == fr_base64_url_alphabet_encode)) &&
+	    base64_ssse3_available()) {
+		while (fr_dbuff_extend_lowat(NULL, &our_in, 16) >= 16) {
+			char	buffer[BASE64_VECTOR_BLOCKS * 16];
+			size_t	blocks;
+
+			blocks = fr_sbuff_extend_lowat(NULL, &our_out, 16) / 16;
+			if (blocks > BASE64_VECTOR_BLOCKS) blocks = BASE64_VECTOR_BLOCKS;
+			if (blocks > ((fr_dbuff_remaining(&our_in) - 4) / 12)) blocks = (fr_dbuff_remaining(&our_in) - 4) / 12;
+			if (!blocks) break;
+
+			base64_encode_ssse3(buffer, fr_dbuff_current(&our_in), blocks, alphabet[62], alphabet[63]);
+
+			FR_SBUFF_IN_BSTRNCPY_RETURN(&our_out, buffer, blocks * 16);
+			fr_dbuff_advance(&our_in, blocks * 12);
+		}
+	}
+#endif
+
 	for (;;) {
 		uint8_t a, b, c;
 
@@ -407,6 +580,35 @@ ssize_t	fr_base64_decode_nstd(fr_sbuff_parse_error_t *err, fr_dbuff_t *out, fr_s
 	fr_sbuff_marker_t	m_final;
 	uint8_t			pad;
 
+#ifdef BASE64_HAVE_SSSE3
+	/*
+	 *	Decode whole blocks until we find something which
+	 *	isn't in the alphabet, or run short of space, then
+	 *	let the loops below deal with it.
+	 */
+	if (((alphabet == fr_base64_alphabet_decode) || (alphabet == fr_base64_url_alphabet_decode)) &&
+	    base64_ssse3_available()) {
+		while (fr_sbuff_extend_lowat(NULL, &our_in, 16) >= 16) {
+			uint8_t	buffer[(BASE64_VECTOR_BLOCKS * 12) + 4];
+			size_t	blocks, decoded;
+
+			blocks = fr_dbuff_extend_lowat(NULL, &our_out, 12) / 12;
+			if (blocks > BASE64_VECTOR_BLOCKS) blocks = BASE64_VECTOR_BLOCKS;
+			if (blocks > (fr_sbuff_remaining(&our_in) / 16)) blocks = fr_sbuff_remaining(&our_in) / 16;
+			if (!blocks) break;
+
+			decoded = base64_decode_ssse3(buffer, fr_sbuff_current(&our_in), blocks,
+						      alphabet == fr_base64_url_alphabet_decode);
+			if (!decoded) break;
+
+			if (fr_dbuff_in_memcpy(&our_out, buffer, decoded * 12) != (ssize_t)(decoded * 12)) goto oob;
+			fr_sbuff_advance(&our_in, decoded * 16);
+
+			if (decoded < blocks) break;
+		}
+	}
+#endif
+
 	/*
 	 *	Process complete 24bit quanta
 	 */
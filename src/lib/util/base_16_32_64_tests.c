@@ -5,6 +5,8 @@
 #include "base32.h"
 #include "base64.h"
 
+#include <freeradius-devel/util/time.h>
+
 typedef struct {
 	struct {
 		char const *str;
@@ -243,6 +245,166 @@ static void test_base64_decode(void)
 	}
 }
 
+/*
+ *	Inputs long enough for the vector codecs, with tails of every
+ *	length.  Copies of the alphabets don't match the vector
+ *	codecs' checks, so they give us scalar output to compare
+ *	against.
+ */
+#define BASE_LONG_MAX	300
+
+static void base_random_fill(uint8_t *buffer, size_t len)
+{
+	size_t	i;
+
+	for (i = 0; i < len; i++) buffer[i] = (uint8_t)rand();
+}
+
+static void test_base16_long(void)
+{
+	uint8_t		in[BASE_LONG_MAX], decoded[BASE_LONG_MAX];
+	char		fast[(BASE_LONG_MAX * 2) + 1], slow[(BASE_LONG_MAX * 2) + 1];
+	char		alphabet[UINT8_MAX];
+	size_t		len;
+
+	memcpy(alphabet, fr_base16_alphabet_encode_lc, sizeof(alphabet));
+	base_random_fill(in, sizeof(in));
+
+	for (len = 0; len <= BASE_LONG_MAX; len++) {
+		TEST_CHECK_SLEN(fr_base16_encode(&FR_SBUFF_OUT(fast, sizeof(fast)), &FR_DBUFF_TMP(in, len)),
+				(ssize_t)(len * 2));
+		TEST_CHECK_SLEN(fr_base16_encode_nstd(&FR_SBUFF_OUT(slow, sizeof(slow)), &FR_DBUFF_TMP(in, len),
+						      alphabet), (ssize_t)(len * 2));
+		TEST_CHECK_STRCMP(fast, slow);
+
+		TEST_CHECK_SLEN(fr_base16_decode(NULL, &FR_DBUFF_TMP(decoded, sizeof(decoded)),
+						 &FR_SBUFF_IN(fast, len * 2), true), (ssize_t)len);
+		TEST_CHECK(memcmp(in, decoded, len) == 0);
+		TEST_MSG("round trip failed for length %zu", len);
+	}
+
+	/*
+	 *	Invalid chars in the middle of a block stop the decode
+	 */
+	fr_base16_encode(&FR_SBUFF_OUT(fast, sizeof(fast)), &FR_DBUFF_TMP(in, 64));
+	fast[37] = 'g';
+	TEST_CHECK_SLEN(fr_base16_decode(NULL, &FR_DBUFF_TMP(decoded, sizeof(decoded)),
+					 &FR_SBUFF_IN(fast, 128), false), 18);
+	TEST_CHECK(memcmp(in, decoded, 18) == 0);
+
+	/*
+	 *	Output too small for even one block
+	 */
+	TEST_CHECK(fr_base16_encode(&FR_SBUFF_OUT(fast, 21), &FR_DBUFF_TMP(in, 64)) < 0);
+}
+
+static void test_base64_long(void)
+{
+	uint8_t		in[BASE_LONG_MAX], decoded[BASE_LONG_MAX + 2];
+	char		fast[FR_BASE64_ENC_LENGTH(BASE_LONG_MAX) + 1], slow[FR_BASE64_ENC_LENGTH(BASE_LONG_MAX) + 1];
+	char		alphabet[UINT8_MAX];
+	size_t		len;
+
+	memcpy(alphabet, fr_base64_url_alphabet_encode, sizeof(alphabet));
+	base_random_fill(in, sizeof(in));
+
+	for (len = 0; len <= BASE_LONG_MAX; len++) {
+		ssize_t	slen;
+
+		slen = fr_base64_encode(&FR_SBUFF_OUT(fast, sizeof(fast)), &FR_DBUFF_TMP(in, len), true);
+		TEST_CHECK_SLEN(slen, (ssize_t)FR_BASE64_ENC_LENGTH(len));
+
+		TEST_CHECK_SLEN(fr_base64_decode(&FR_DBUFF_TMP(decoded, sizeof(decoded)),
+						 &FR_SBUFF_IN(fast, (size_t)slen), true, true), (ssize_t)len);
+		TEST_CHECK(memcmp(in, decoded, len) == 0);
+		TEST_MSG("round trip failed for length %zu", len);
+
+		slen = fr_base64_encode_nstd(&FR_SBUFF_OUT(fast, sizeof(fast)), &FR_DBUFF_TMP(in, len),
+					     false, fr_base64_url_alphabet_encode);
+		TEST_CHECK_SLEN(fr_base64_encode_nstd(&FR_SBUFF_OUT(slow, sizeof(slow)), &FR_DBUFF_TMP(in, len),
+						      false, alphabet), slen);
+		TEST_CHECK_STRCMP(fast, slow);
+
+		TEST_CHECK_SLEN(fr_base64_decode_nstd(NULL, &FR_DBUFF_TMP(decoded, sizeof(decoded)),
+						      &FR_SBUFF_IN(fast, (size_t)slen), false, true,
+						      fr_base64_url_alphabet_decode), (ssize_t)len);
+		TEST_CHECK(memcmp(in, decoded, len) == 0);
+		TEST_MSG("URL safe round trip failed for length %zu", len);
+	}
+
+	/*
+	 *	Invalid chars in the middle of a block stop the decode
+	 */
+	fr_base64_encode(&FR_SBUFF_OUT(fast, sizeof(fast)), &FR_DBUFF_TMP(in, 96), true);
+	fast[70] = '-';
+	TEST_CHECK_SLEN(fr_base64_decode(&FR_DBUFF_TMP(decoded, sizeof(decoded)),
+					 &FR_SBUFF_IN(fast, 128), false, false), 52);
+	TEST_CHECK(memcmp(in, decoded, 52) == 0);
+}
+
+/*
+ *	Compare the speed of the vector and scalar codecs, for
+ *	sizes typical of attributes, cache entries and REST bodies.
+ */
+#define BASE_BENCH_BYTES	(1 << 24)
+
+static void base_bench(void)
+{
+	static size_t const	sizes[] = { 16, 64, 253, 1024, 4096 };
+	static uint8_t		in[4096], decoded[4096];
+	static char		encoded[(4096 * 2) + 1];
+	char			alphabet16[UINT8_MAX], alphabet64[UINT8_MAX];
+	uint8_t			alphabet16_decode[UINT8_MAX], alphabet64_decode[UINT8_MAX];
+	size_t			i;
+
+	memcpy(alphabet16, fr_base16_alphabet_encode_lc, sizeof(alphabet16));
+	memcpy(alphabet16_decode, fr_base16_alphabet_decode_mc, sizeof(alphabet16_decode));
+	memcpy(alphabet64, fr_base64_alphabet_encode, sizeof(alphabet64));
+	memcpy(alphabet64_decode, fr_base64_alphabet_decode, sizeof(alphabet64_decode));
+
+	fr_time_start();
+	base_random_fill(in, sizeof(in));
+
+#define BENCH(_name, _len, _expr) \
+do { \
+	fr_time_t	_start = fr_time(); \
+	size_t		_r, _reps = BASE_BENCH_BYTES / (_len); \
+	for (_r = 0; _r < _reps; _r++) (void)(_expr); \
+	_name = fr_time() - _start; \
+} while (0)
+
+	for (i = 0; i < NUM_ELEMENTS(sizes); i++) {
+		size_t		len = sizes[i];
+		size_t		enc_len = FR_BASE64_ENC_LENGTH(len);
+		fr_time_delta_t	fast_enc, slow_enc, fast_dec, slow_dec;
+
+		BENCH(fast_enc, len, fr_base16_encode(&FR_SBUFF_OUT(encoded, sizeof(encoded)), &FR_DBUFF_TMP(in, len)));
+		BENCH(slow_enc, len, fr_base16_encode_nstd(&FR_SBUFF_OUT(encoded, sizeof(encoded)),
+							   &FR_DBUFF_TMP(in, len), alphabet16));
+		BENCH(fast_dec, len, fr_base16_decode(NULL, &FR_DBUFF_TMP(decoded, sizeof(decoded)),
+						      &FR_SBUFF_IN(encoded, len * 2), true));
+		BENCH(slow_dec, len, fr_base16_decode_nstd(NULL, &FR_DBUFF_TMP(decoded, sizeof(decoded)),
+							   &FR_SBUFF_IN(encoded, len * 2), true, alphabet16_decode));
+
+		TEST_MSG_ALWAYS("base16 size=%zu encode_mbs=%0.1f (scalar %0.1f) decode_mbs=%0.1f (scalar %0.1f)", len,
+				(double)BASE_BENCH_BYTES * 1000 / fast_enc, (double)BASE_BENCH_BYTES * 1000 / slow_enc,
+				(double)BASE_BENCH_BYTES * 1000 / fast_dec, (double)BASE_BENCH_BYTES * 1000 / slow_dec);
+
+		BENCH(fast_enc, len, fr_base64_encode(&FR_SBUFF_OUT(encoded, sizeof(encoded)), &FR_DBUFF_TMP(in, len), true));
+		BENCH(slow_enc, len, fr_base64_encode_nstd(&FR_SBUFF_OUT(encoded, sizeof(encoded)),
+							   &FR_DBUFF_TMP(in, len), true, alphabet64));
+		BENCH(fast_dec, len, fr_base64_decode(&FR_DBUFF_TMP(decoded, sizeof(decoded)),
+						      &FR_SBUFF_IN(encoded, enc_len), true, true));
+		BENCH(slow_dec, len, fr_base64_decode_nstd(NULL, &FR_DBUFF_TMP(decoded, sizeof(decoded)),
+							   &FR_SBUFF_IN(encoded, enc_len), true, true, alphabet64_decode));
+
+		TEST_MSG_ALWAYS("base64 size=%zu encode_mbs=%0.1f (scalar %0.1f) decode_mbs=%0.1f (scalar %0.1f)", len,
+				(double)BASE_BENCH_BYTES * 1000 / fast_enc, (double)BASE_BENCH_BYTES * 1000 / slow_enc,
+				(double)BASE_BENCH_BYTES * 1000 / fast_dec, (double)BASE_BENCH_BYTES * 1000 / slow_dec);
+	}
+#undef BENCH
+}
+
 TEST_LIST = {
 	{ "base16_encode",		test_base16_encode },
 	{ "base16_decode",		test_base16_decode },
@@ -254,5 +416,9 @@ TEST_LIST = {
 
 	{ "base64_encode",		test_base64_encode },
 	{ "base64_decode",		test_base64_decode },
+
+	{ "base16_long",		test_base16_long },
+	{ "base64_long",		test_base64_long },
+	{ "base_bench",			base_bench },
 	{ NULL }
 };
@@ -51,6 +51,9 @@ extern fr_ext_t const fr_dict_enum_ext_def;
 typedef struct {
 	fr_hash_table_t		*child_by_name;			//!< Namespace at this level in the hierarchy.
 	fr_dict_attr_t const	**children;			//!< Children of this attribute.
+	fr_dict_attr_t const	**by_num;			//!< Children directly indexed by number.
+	unsigned int		by_num_len;			//!< Every number below this is in by_num.
+	unsigned int		num_children;			//!< Number of children added.
 } fr_dict_attr_ext_children_t;
 
 /** Attribute extension - Holds a reference to an attribute in another dictionary
@@ -77,14 +77,6 @@ bool const fr_dict_attr_allowed_chars[UINT8_MAX + 1] = {
 	['z'] = true
 };
 
-/*
- *	Create the hash of the name.
- *
- *	We copy the hash function here because it's substantially faster.
- */
-#define FNV_MAGIC_INIT (0x811c9dc5)
-#define FNV_MAGIC_PRIME (0x01000193)
-
 static void hash_pool_free(void *to_free)
 {
 	talloc_free(to_free);
@@ -99,20 +91,7 @@ static void hash_pool_free(void *to_free)
  */
 static uint32_t dict_hash_name(char const *name, size_t len)
 {
-	uint32_t hash = FNV_MAGIC_INIT;
-
-	char const *p = name, *q = name + len;
-
-	while (p < q) {
-		int c = *(unsigned char const *)p;
-		if (isalpha(c)) c = tolower(c);
-
-		hash *= FNV_MAGIC_PRIME;
-		hash ^= (uint32_t)(c & 0xff);
-		p++;
-	}
-
-	return hash;
+	return fr_hash_case(name, len);
 }
 
 /** Wrap name hash function for fr_dict_protocol_t
@@ -484,8 +463,8 @@ static inline CC_HINT(always_inline) int dict_attr_namespace_init(fr_dict_attr_t
 	 *	namespace hash table.
 	 */
 	if (!ext->namespace) {
-		ext->namespace = fr_hash_table_talloc_alloc(*da_p, fr_dict_attr_t,
-							    dict_attr_name_hash, dict_attr_name_cmp, NULL);
+		ext->namespace = fr_hash_table_open_talloc_alloc(*da_p, fr_dict_attr_t,
+							         dict_attr_name_hash, dict_attr_name_cmp, NULL);
 		if (!ext->namespace) {
 			fr_strerror_printf("Failed allocating \"namespace\" table");
 			return -1;
@@ -917,6 +896,77 @@ bool dict_attr_can_have_children(fr_dict_attr_t const *da)
 	return false;
 }
 
+/** Child numbers below this are always directly indexed
+ *
+ * Above this, the direct index only grows while at least one in
+ * #DICT_CHILD_INDEX_DENSITY entries would be used.  Sparse spaces,
+ * like vendors in a VSA, are searched through the hashed bins instead.
+ */
+#define DICT_CHILD_INDEX_MIN		(UINT8_MAX + 1)
+#define DICT_CHILD_INDEX_DENSITY	(32)
+#define DICT_CHILD_INDEX_MAX		(UINT16_MAX + 1)
+
+/** Record a new child in the direct index of its parent
+ *
+ * The index holds the same child a search of the bins would return,
+ * i.e. the first in its bin with a matching number.
+ *
+ * @param[in] parent	to allocate the index in.
+ * @param[in] ext	children extension of the parent.
+ * @param[in] child	which was just inserted into the bins.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure (memory allocation error).
+ */
+static int dict_attr_child_index(fr_dict_attr_t const *parent, fr_dict_attr_ext_children_t *ext,
+				 fr_dict_attr_t const *child)
+{
+	fr_dict_attr_t const	*bin;
+
+	ext->num_children++;
+
+	if (child->attr >= ext->by_num_len) {
+		size_t	new_len = DICT_CHILD_INDEX_MIN, i;
+
+		while (new_len <= child->attr) new_len <<= 1;
+
+		/*
+		 *	Too sparse, or too large.  Lookups of
+		 *	this number go through the bins.
+		 */
+		if ((new_len > DICT_CHILD_INDEX_MAX) ||
+		    ((new_len > DICT_CHILD_INDEX_MIN) &&
+		     (new_len > ((size_t)ext->num_children * DICT_CHILD_INDEX_DENSITY)))) return 0;
+
+		talloc_free(ext->by_num);
+		ext->by_num_len = 0;
+		ext->by_num = talloc_zero_array(parent, fr_dict_attr_t const *, new_len);
+		if (unlikely(!ext->by_num)) {
+			fr_strerror_const("Out of memory");
+			return -1;
+		}
+		ext->by_num_len = new_len;
+
+		/*
+		 *	Walk the bins in order, so the first
+		 *	child with a given number wins.
+		 */
+		for (i = 0; i <= UINT8_MAX; i++) {
+			for (bin = ext->children[i]; bin; bin = bin->next) {
+				if ((bin->attr < new_len) && !ext->by_num[bin->attr]) ext->by_num[bin->attr] = bin;
+			}
+		}
+		return 0;
+	}
+
+	for (bin = ext->children[child->attr & 0xff]; bin; bin = bin->next) {
+		if (bin->attr == child->attr) break;
+	}
+	ext->by_num[child->attr] = bin;
+
+	return 0;
+}
+
 /** Add a child to a parent.
  *
  * @param[in] parent	we're adding a child to.
@@ -1027,7 +1077,7 @@ int dict_attr_child_add(fr_dict_attr_t *parent, fr_dict_attr_t *child)
 	child->next = *this;
 	*this = child;
 
-	return 0;
+	return dict_attr_child_index(parent, fr_dict_attr_ext(parent, FR_DICT_ATTR_EXT_CHILDREN), child);
 }
 
 /** Add an attribute to the name table for an attribute
@@ -1142,8 +1192,9 @@ int fr_dict_attr_add(fr_dict_t *dict, fr_dict_attr_t const *parent,
 		     char const *name, int attr, fr_type_t type, fr_dict_attr_flags_t const *flags)
 {
 	fr_dict_attr_t		*n;
-	fr_dict_attr_t const	*old;
+	fr_dict_attr_t const	*old = NULL;
 	fr_dict_attr_flags_t	our_flags = *flags;
+	fr_hash_table_t		*namespace;
 
 	if (unlikely(dict->read_only)) {
 		fr_strerror_printf("%s dictionary has been marked as read only", fr_dict_root(dict)->name);
@@ -1155,13 +1206,21 @@ int fr_dict_attr_add(fr_dict_t *dict, fr_dict_attr_t const *parent,
 	 */
 	if (!dict_attr_fields_valid(dict, parent, name, &attr, type, &our_flags)) return -1;
 
-	n = dict_attr_alloc(dict->pool, parent, name, attr, type, &(dict_attr_args_t){ .flags = &our_flags});
-	if (!n) return -1;
-
 #define FLAGS_EQUAL(_x) (old->flags._x == flags->_x)
 
-	old = fr_dict_attr_by_name(NULL, parent, name);
+	/*
+	 *	Look for duplicates before allocating anything.
+	 *	Almost every attribute loaded is new, so this
+	 *	searches the namespace directly, instead of
+	 *	formatting a "not found" error for each one via
+	 *	fr_dict_attr_by_name().
+	 */
+	namespace = dict_attr_namespace(parent);
+	if (namespace) old = fr_hash_table_find(namespace, &(fr_dict_attr_t) { .name = name });
 	if (old) {
+		old = dict_attr_alias(NULL, old);
+		if (unlikely(!old)) return -1;
+
 		/*
 		 *	Don't bother inserting exact duplicates.
 		 */
@@ -1170,7 +1229,12 @@ int fr_dict_attr_add(fr_dict_t *dict, fr_dict_attr_t const *parent,
 		    ((old->attr == (unsigned int) attr) || ((attr < 0) && old->flags.internal))) {
 			return 0;
 		}
+	}
+
+	n = dict_attr_alloc(dict->pool, parent, name, attr, type, &(dict_attr_args_t){ .flags = &our_flags});
+	if (!n) return -1;
 
+	if (old) {
 		/*
 		 *	We have the same name, but different
 		 *	properties.  That's an error.
@@ -1262,15 +1326,15 @@ int dict_attr_enum_add_name(fr_dict_attr_t *da, char const *name,
 	 *	Initialise enumv hash tables
 	 */
 	if (!ext->value_by_name || !ext->name_by_value) {
-		ext->value_by_name = fr_hash_table_talloc_alloc(da, fr_dict_enum_t, dict_enum_name_hash,
-								dict_enum_name_cmp, hash_pool_free);
+		ext->value_by_name = fr_hash_table_open_talloc_alloc(da, fr_dict_enum_t, dict_enum_name_hash,
+								     dict_enum_name_cmp, hash_pool_free);
 		if (!ext->value_by_name) {
 			fr_strerror_printf("Failed allocating \"value_by_name\" table");
 			return -1;
 		}
 
-		ext->name_by_value = fr_hash_table_talloc_alloc(da, fr_dict_enum_t, dict_enum_value_hash,
-								dict_enum_value_cmp, NULL);
+		ext->name_by_value = fr_hash_table_open_talloc_alloc(da, fr_dict_enum_t, dict_enum_value_hash,
+								     dict_enum_value_cmp, NULL);
 		if (!ext->name_by_value) {
 			fr_strerror_printf("Failed allocating \"name_by_value\" table");
 			return -1;
@@ -2675,9 +2739,9 @@ fr_dict_attr_t const *fr_dict_attr_by_name(fr_dict_attr_err_t *err, fr_dict_attr
  */
 fr_dict_attr_t *dict_attr_child_by_num(fr_dict_attr_t const *parent, unsigned int attr)
 {
-	fr_dict_attr_t const *bin;
-	fr_dict_attr_t const **children;
-	fr_dict_attr_t const *ref;
+	fr_dict_attr_t const		*bin;
+	fr_dict_attr_t const		*ref;
+	fr_dict_attr_ext_children_t	*ext;
 
 	DA_VERIFY(parent);
 
@@ -2687,16 +2751,27 @@ fr_dict_attr_t *dict_attr_child_by_num(fr_dict_attr_t const *parent, unsigned in
 	ref = fr_dict_attr_ref(parent);
 	if (ref) parent = ref;
 
-	children = dict_attr_children(parent);
-	if (!children) return NULL;
+	ext = fr_dict_attr_ext(parent, FR_DICT_ATTR_EXT_CHILDREN);
+	if (!ext || !ext->children) return NULL;
+
+	/*
+	 *	Dense number spaces are directly indexed.
+	 */
+	if (attr < ext->by_num_len) {
+		fr_dict_attr_t *out;
+
+		memcpy(&out, &ext->by_num[attr], sizeof(out));
+
+		return out;
+	}
 
 	/*
 	 *	Child arrays may be trimmed back to save memory.
 	 *	Check that so we don't SEGV.
 	 */
-	if ((attr & 0xff) > talloc_array_length(children)) return NULL;
+	if ((attr & 0xff) >= talloc_array_length(ext->children)) return NULL;
 
-	bin = children[attr & 0xff];
+	bin = ext->children[attr & 0xff];
 	for (;;) {
 		if (!bin) return NULL;
 		if (bin->attr == attr) {
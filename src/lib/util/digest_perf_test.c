@@ -0,0 +1,218 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Known answer and performance tests for the MD4, MD5 and SHA1 digests
+ *
+ * @file src/lib/util/digest_perf_test.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <freeradius-devel/util/acutest.h>
+
+/*
+ *	So we can compare the SHA extensions transform
+ *	against the portable one.
+ */
+#include "sha1.c"
+
+#include <freeradius-devel/util/md4.h>
+#include <freeradius-devel/util/md5.h>
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/time.h>
+
+#define DIGEST_REPS	(100000)
+
+static uint8_t const abc[] = "abc";
+
+static void test_md4_known_answer(void)
+{
+	uint8_t		out[MD4_DIGEST_LENGTH];
+	uint8_t const	expected[] = {
+		0xa4, 0x48, 0x01, 0x7a, 0xaf, 0x21, 0xd8, 0x52,
+		0x5f, 0xc1, 0x0a, 0xe8, 0x7a, 0xa6, 0x72, 0x9d
+	};
+
+	fr_md4_calc(out, abc, sizeof(abc) - 1);
+	TEST_CHECK(memcmp(out, expected, sizeof(out)) == 0);
+}
+
+static void test_md5_known_answer(void)
+{
+	uint8_t		out[MD5_DIGEST_LENGTH];
+	uint8_t const	expected[] = {
+		0x90, 0x01, 0x50, 0x98, 0x3c, 0xd2, 0x4f, 0xb0,
+		0xd6, 0x96, 0x3f, 0x7d, 0x28, 0xe1, 0x7f, 0x72
+	};
+
+	fr_md5_calc(out, abc, sizeof(abc) - 1);
+	TEST_CHECK(memcmp(out, expected, sizeof(out)) == 0);
+}
+
+/** Contexts handed out at the same time must be distinct, even past the end of the free list
+ *
+ */
+static void test_md5_ctx_free_list(void)
+{
+	fr_md5_ctx_t	*ctx[16];
+	size_t		i, j;
+
+	for (i = 0; i < NUM_ELEMENTS(ctx); i++) {
+		ctx[i] = fr_md5_ctx_alloc(false);
+		TEST_ASSERT(ctx[i] != NULL);
+		for (j = 0; j < i; j++) TEST_CHECK(ctx[i] != ctx[j]);
+	}
+
+	for (i = 0; i < NUM_ELEMENTS(ctx); i++) {
+		fr_md5_ctx_free(&ctx[i]);
+		TEST_CHECK(ctx[i] == NULL);
+	}
+}
+
+static void test_sha1_known_answer(void)
+{
+	fr_sha1_ctx	ctx;
+	uint8_t		out[SHA1_DIGEST_LENGTH];
+	uint8_t		block[1000];
+	size_t		i;
+	uint8_t const	expected_abc[] = {
+		0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e,
+		0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d
+	};
+	uint8_t const	expected_million[] = {
+		0x34, 0xaa, 0x97, 0x3c, 0xd4, 0xc4, 0xda, 0xa4, 0xf6, 0x1e,
+		0xeb, 0x2b, 0xdb, 0xad, 0x27, 0x31, 0x65, 0x34, 0x01, 0x6f
+	};
+
+	fr_sha1_init(&ctx);
+	fr_sha1_update(&ctx, abc, sizeof(abc) - 1);
+	fr_sha1_final(out, &ctx);
+	TEST_CHECK(memcmp(out, expected_abc, sizeof(out)) == 0);
+
+	/*
+	 *	One million 'a's, fed in pieces which aren't a
+	 *	multiple of the block size.
+	 */
+	memset(block, 'a', sizeof(block));
+	fr_sha1_init(&ctx);
+	for (i = 0; i < 1000; i++) fr_sha1_update(&ctx, block, sizeof(block));
+	fr_sha1_final(out, &ctx);
+	TEST_CHECK(memcmp(out, expected_million, sizeof(out)) == 0);
+}
+
+/** Check every transform the CPU supports gives the same answer as the portable one
+ *
+ */
+static void test_sha1_transform(void)
+{
+	uint32_t	state_local[5], state_other[5];
+	uint8_t		block[64];
+	size_t		i, j;
+
+	for (i = 0; i < NUM_ELEMENTS(state_local); i++) state_local[i] = state_other[i] = fr_rand();
+
+	for (i = 0; i < 1000; i++) {
+		for (j = 0; j < sizeof(block); j++) block[j] = fr_rand();
+
+		fr_sha1_local_transform(state_local, block);
+		fr_sha1_transform(state_other, block);
+	}
+
+	TEST_CHECK(memcmp(state_local, state_other, sizeof(state_local)) == 0);
+	TEST_MSG_ALWAYS("transform=%s", (sha1_transform == fr_sha1_local_transform) ? "local" : "sha-ni");
+}
+
+static void digest_perf(char const *name, size_t len, void (*calc)(uint8_t *out, uint8_t const *in, size_t inlen))
+{
+	uint8_t		in[1024];
+	uint8_t		out[SHA1_DIGEST_LENGTH];
+	size_t		i;
+	fr_time_t	start, end;
+
+	fr_assert(len <= sizeof(in));
+
+	memset(in, 0x5a, sizeof(in));
+
+	start = fr_time();
+	for (i = 0; i < DIGEST_REPS; i++) {
+		calc(out, in, len);
+		in[0] = out[0];		/* Stop the compiler eliding the calls */
+	}
+	end = fr_time();
+
+	TEST_MSG_ALWAYS("digest=%s", name);
+	TEST_MSG_ALWAYS("input_length=%zu", len);
+	TEST_MSG_ALWAYS("repetitions=%d", DIGEST_REPS);
+	TEST_MSG_ALWAYS("used=%"PRId64, end - start);
+	TEST_MSG_ALWAYS("per_sec=%0.0lf", DIGEST_REPS / ((double)(end - start) / NSEC));
+}
+
+static void md4_calc(uint8_t *out, uint8_t const *in, size_t inlen)
+{
+	fr_md4_calc(out, in, inlen);
+}
+
+static void md5_calc(uint8_t *out, uint8_t const *in, size_t inlen)
+{
+	fr_md5_ctx_t *ctx;
+
+	ctx = fr_md5_ctx_alloc(false);
+	fr_md5_update(ctx, in, inlen);
+	fr_md5_final(out, ctx);
+	fr_md5_ctx_free(&ctx);
+}
+
+static void sha1_calc(uint8_t *out, uint8_t const *in, size_t inlen)
+{
+	fr_sha1_ctx ctx;
+
+	fr_sha1_init(&ctx);
+	fr_sha1_update(&ctx, in, inlen);
+	fr_sha1_final(out, &ctx);
+}
+
+#define perf_func(_digest, _len) \
+static void test_ ## _digest ## _perf_ ## _len(void)\
+{\
+	digest_perf(#_digest, _len, _digest ## _calc);\
+}
+
+#define perf_funcs(_digest) \
+	perf_func(_digest, 16) \
+	perf_func(_digest, 64) \
+	perf_func(_digest, 1024)
+
+perf_funcs(md4)
+perf_funcs(md5)
+perf_funcs(sha1)
+
+#define perf_tests(_digest) \
+	{ #_digest "_perf_16", test_ ## _digest ## _perf_16},\
+	{ #_digest "_perf_64", test_ ## _digest ## _perf_64},\
+	{ #_digest "_perf_1024", test_ ## _digest ## _perf_1024},
+
+TEST_LIST = {
+	{ "md4_known_answer",	test_md4_known_answer },
+	{ "md5_known_answer",	test_md5_known_answer },
+	{ "md5_ctx_free_list",	test_md5_ctx_free_list },
+	{ "sha1_known_answer",	test_sha1_known_answer },
+	{ "sha1_transform",	test_sha1_transform },
+
+	perf_tests(md4)
+	perf_tests(md5)
+	perf_tests(sha1)
+
+	{ NULL }
+};
@@ -0,0 +1,6 @@
+TARGET := digest_perf_test
+SOURCES := digest_perf_test.c
+
+TGT_INSTALLDIR	:=
+TGT_LDLIBS	:= $(LIBS)
+TGT_PREREQS	:= libfreeradius-util.la
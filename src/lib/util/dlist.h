@@ -54,6 +54,8 @@ typedef struct {
 					///< validation.
 	fr_dlist_t	entry;		//!< Struct holding the head and tail of the list.
 	size_t		num_elements;
+	uint32_t	generation;	//!< Incremented whenever the list is modified, so that
+					///< derived data such as indexes can detect staleness.
 } fr_dlist_head_t;
 
 
@@ -235,6 +237,7 @@ static inline void _fr_dlist_init(fr_dlist_head_t *list_head, size_t offset, cha
 	list_head->offset = offset;
 	list_head->type = type;
 	list_head->num_elements = 0;
+	list_head->generation = 0;
 }
 
 /** Efficiently remove all elements in a dlist
@@ -245,6 +248,7 @@ static inline void fr_dlist_clear(fr_dlist_head_t *list_head)
 {
 	fr_dlist_entry_init(&list_head->entry);
 	list_head->num_elements = 0;
+	list_head->generation++;
 }
 
 /** Insert an item into the head of a list
@@ -278,6 +282,7 @@ static inline CC_HINT(nonnull(1)) void fr_dlist_insert_head(fr_dlist_head_t *lis
 	head->next = entry;
 
 	list_head->num_elements++;
+	list_head->generation++;
 }
 
 /** Insert an item into the tail of a list
@@ -311,6 +316,7 @@ static inline CC_HINT(nonnull(1)) void fr_dlist_insert_tail(fr_dlist_head_t *lis
 	head->prev = entry;
 
 	list_head->num_elements++;
+	list_head->generation++;
 }
 
 /** Insert an item after an item already in the list
@@ -345,6 +351,7 @@ static inline CC_HINT(nonnull(1)) void fr_dlist_insert_after(fr_dlist_head_t *li
 	fr_dlist_entry_link_after(pos_entry, entry);
 
 	list_head->num_elements++;
+	list_head->generation++;
 }
 
 /** Insert an item before an item already in the list
@@ -379,6 +386,7 @@ static inline CC_HINT(nonnull(1)) void fr_dlist_insert_before(fr_dlist_head_t *l
 	fr_dlist_entry_link_before(pos_entry, entry);
 
 	list_head->num_elements++;
+	list_head->generation++;
 }
 
 /** Return the HEAD item of a list or NULL if the list is empty
@@ -558,6 +566,7 @@ static inline CC_HINT(nonnull(1)) void *fr_dlist_remove(fr_dlist_head_t *list_he
 	entry->prev = entry->next = entry;
 
 	list_head->num_elements--;
+	list_head->generation++;
 
 	if (prev == head) return NULL;	/* Works with fr_dlist_next so that the next item is the list HEAD */
 
@@ -622,6 +631,7 @@ static inline void *fr_dlist_replace(fr_dlist_head_t *list_head, void *item, voi
 	ptr_entry = fr_dlist_item_to_entry(list_head->offset, ptr);
 
 	fr_dlist_entry_replace(item_entry, ptr_entry);
+	list_head->generation++;
 
 	return item;
 }
@@ -693,9 +703,11 @@ static inline CC_HINT(nonnull) void fr_dlist_move(fr_dlist_head_t *list_dst, fr_
 	dst->prev = src->prev;
 
 	list_dst->num_elements += list_src->num_elements;
+	list_dst->generation++;
 
 	fr_dlist_entry_init(src);
 	list_src->num_elements = 0;
+	list_src->generation++;
 }
 
 /** Merge two lists, inserting the source at the head of the destination
@@ -730,9 +742,11 @@ static inline CC_HINT(nonnull) void fr_dlist_move_head(fr_dlist_head_t *list_dst
 	dst->next = src->next;
 
 	list_dst->num_elements += list_src->num_elements;
+	list_dst->generation++;
 
 	fr_dlist_entry_init(src);
 	list_src->num_elements = 0;
+	list_src->generation++;
 }
 
 /** Free the first item in the list
@@ -936,6 +950,7 @@ static inline void fr_dlist_sort(fr_dlist_head_t *list, fr_cmp_t cmp)
 
 	if (fr_dlist_num_elements(list) <= 1) return;
 
+	list->generation++;
 	head = fr_dlist_head(list);
 	/* NULL terminate existing list */
 	list->entry.prev->next = NULL;
@@ -39,6 +39,7 @@ RCSID("$Id$")
 #include <freeradius-devel/util/table.h>
 #include <freeradius-devel/util/talloc.h>
 #include <freeradius-devel/util/time.h>
+#include <freeradius-devel/util/timer_wheel.h>
 #include <freeradius-devel/util/token.h>
 
 #include <sys/stat.h>
@@ -105,6 +106,7 @@ struct fr_event_timer {
 
 	fr_event_timer_t const	**parent;		//!< Previous timer.
 	int32_t			heap_id;	       	//!< Where to store opaque heap data.
+	fr_timer_wheel_entry_t	wheel_entry;		//!< Where to store opaque timer wheel data.
 	fr_dlist_t		entry;			//!< in linked list of event timers
 
 #ifndef NDEBUG
@@ -347,6 +349,8 @@ typedef struct {
  */
 struct fr_event_list {
 	fr_heap_t		*times;			//!< of timer events to be executed.
+	fr_timer_wheel_t	*wheel;			//!< of timer events to be executed, used instead
+							///< of the heap if set.
 	fr_rb_tree_t		*fds;			//!< Tree used to track FDs with filters in kqueue.
 #ifdef LOCAL_PID
 	fr_heap_t		*pids;			//!< PIDs to wait for
@@ -382,20 +386,55 @@ struct fr_event_list {
 #endif
 };
 
-/** Compare two timer events to see which one should occur first
+/** Insert a timer event into the heap or timer wheel
+ *
+ */
+static inline CC_HINT(always_inline) int event_timer_insert(fr_event_list_t *el, fr_event_timer_t *ev)
+{
+	if (el->wheel) return fr_timer_wheel_insert(el->wheel, ev, ev->when);
+
+	return fr_heap_insert(el->times, ev);
+}
+
+/** Remove a timer event from the heap or timer wheel
+ *
+ */
+static inline CC_HINT(always_inline) int event_timer_extract(fr_event_list_t *el, fr_event_timer_t *ev)
+{
+	if (el->wheel) return fr_timer_wheel_extract(el->wheel, ev);
+
+	return fr_heap_extract(el->times, ev);
+}
+
+/** Return the number of timer events in the heap or timer wheel
+ *
+ */
+static inline CC_HINT(always_inline) uint32_t event_timer_num(fr_event_list_t *el)
+{
+	if (el->wheel) return fr_timer_wheel_num_elements(el->wheel);
+
+	return fr_heap_num_elements(el->times);
+}
+
+/** Return when the next timer event should be run
+ *
+ * For timer wheels this may be earlier than the next event.
  *
- * @param[in] a the first timer event.
- * @param[in] b the second timer event.
  * @return
- *	- +1 if a should occur later than b.
- *	- -1 if a should occur earlier than b.
- *	- 0 if both events occur at the same time.
+ *	- true if there are timer events.
+ *	- false if there are no timer events.
  */
-static int8_t fr_event_timer_cmp(void const *a, void const *b)
+static inline CC_HINT(always_inline) bool event_timer_next(fr_event_list_t *el, fr_time_t *when)
 {
-	fr_event_timer_t const	*ev_a = a, *ev_b = b;
+	fr_event_timer_t *ev;
+
+	if (el->wheel) return fr_timer_wheel_next(el->wheel, when);
+
+	ev = fr_heap_peek(el->times);
+	if (!ev) return false;
 
-	return fr_time_cmp(ev_a->when, ev_b->when);
+	*when = ev->when;
+	return true;
 }
 
 /** Compare two file descriptor handles
@@ -441,7 +480,7 @@ uint64_t fr_event_list_num_timers(fr_event_list_t *el)
 {
 	if (unlikely(!el)) return -1;
 
-	return fr_heap_num_elements(el->times);
+	return event_timer_num(el);
 }
 
 /** Return the kq associated with an event list.
@@ -1179,7 +1218,7 @@ static int _event_timer_free(fr_event_timer_t *ev)
 	if (fr_dlist_entry_in_list(&ev->entry)) {
 		(void) fr_dlist_remove(&el->ev_to_add, ev);
 	} else {
-		int		ret = fr_heap_extract(el->times, ev);
+		int		ret = event_timer_extract(el, ev);
 		char const	*err_file = "not-available";
 		int		err_line = 0;
 
@@ -1296,7 +1335,7 @@ int _fr_event_timer_at(NDEBUG_LOCATION_ARGS
 			char const	*err_file = "not-available";
 			int		err_line = 0;
 
-			ret = fr_heap_extract(el->times, ev);
+			ret = event_timer_extract(el, ev);
 
 #ifndef NDEBUG
 			err_file = ev->file;
@@ -1331,7 +1370,7 @@ int _fr_event_timer_at(NDEBUG_LOCATION_ARGS
 		 *	multiple times.
 		 */
 		if (!fr_dlist_entry_in_list(&ev->entry)) fr_dlist_insert_head(&el->ev_to_add, ev);
-	} else if (unlikely(fr_heap_insert(el->times, ev) < 0)) {
+	} else if (unlikely(event_timer_insert(el, ev) < 0)) {
 		fr_strerror_const_push("Failed inserting event");
 		talloc_set_destructor(ev, NULL);
 		*ev_p = NULL;
@@ -1687,6 +1726,19 @@ int fr_event_timer_run(fr_event_list_t *el, fr_time_t *when)
 
 	if (unlikely(!el)) return 0;
 
+	/*
+	 *	The timer wheel only gives us events which
+	 *	are due.
+	 */
+	if (el->wheel) {
+		ev = fr_timer_wheel_peek(el->wheel, *when);
+		if (!ev) {
+			if (!fr_timer_wheel_next(el->wheel, when)) *when = 0;
+			return 0;
+		}
+		goto run;
+	}
+
 	if (fr_heap_num_elements(el->times) == 0) {
 		*when = 0;
 		return 0;
@@ -1706,6 +1758,8 @@ int fr_event_timer_run(fr_event_list_t *el, fr_time_t *when)
 		return 0;
 	}
 
+run:
+
 	callback = ev->callback;
 	memcpy(&uctx, &ev->uctx, sizeof(uctx));
 
@@ -1737,7 +1791,7 @@ int fr_event_corral(fr_event_list_t *el, fr_time_t now, bool wait)
 	fr_event_pre_t		*pre;
 	int			num_fd_events;
 	bool			timer_event_ready = false;
-	fr_event_timer_t	*ev;
+	fr_time_t		next;
 #ifdef LOCAL_PID
 	fr_event_pid_t		*pid;
 	fr_heap_iter_t		iter;
@@ -1767,13 +1821,12 @@ int fr_event_corral(fr_event_list_t *el, fr_time_t now, bool wait)
 	 *	events are in the past.  Or, we wait for a future
 	 *	timer event.
 	 */
-	ev = fr_heap_peek(el->times);
-	if (ev) {
-		if (ev->when <= el->now) {
+	if (event_timer_next(el, &next)) {
+		if (next <= el->now) {
 			timer_event_ready = true;
 
 		} else if (wait) {
-			when = ev->when - el->now;
+			when = next - el->now;
 
 		} /* else we're not waiting, leave "when == 0" */
 
@@ -2146,7 +2199,7 @@ service:
 	 *	Run all of the timer events.  Note that these can add
 	 *	new timers!
 	 */
-	if (fr_heap_num_elements(el->times) > 0) {
+	if (event_timer_num(el) > 0) {
 		do {
 			when = el->now;
 		} while (fr_event_timer_run(el, &when) == 1);
@@ -2168,7 +2221,7 @@ service:
 	 */
 	while ((ev = fr_dlist_head(&el->ev_to_add)) != NULL) {
 		(void)fr_dlist_remove(&el->ev_to_add, ev);
-		if (unlikely(fr_heap_insert(el->times, ev) < 0)) {
+		if (unlikely(event_timer_insert(el, ev) < 0)) {
 			talloc_free(ev);
 			fr_assert_msg(0, "failed inserting heap event: %s", fr_strerror());	/* Die in debug builds */
 		}
@@ -2240,6 +2293,16 @@ static int _event_list_free(fr_event_list_t *el)
 {
 	fr_event_timer_t const *ev;
 
+	if (el->wheel) {
+		fr_timer_wheel_iter_t	iter;
+		fr_event_timer_t const	*next;
+
+		for (ev = fr_timer_wheel_iter_init(el->wheel, &iter); ev != NULL; ev = next) {
+			next = fr_timer_wheel_iter_next(el->wheel, &iter);
+			fr_event_timer_delete(&ev);
+		}
+	}
+
 	while ((ev = fr_heap_peek(el->times)) != NULL) fr_event_timer_delete(&ev);
 
 	talloc_free_children(el);
@@ -2272,7 +2335,12 @@ fr_event_list_t *fr_event_list_alloc(TALLOC_CTX *ctx, fr_event_status_cb_t statu
 	el->kq = -1;	/* So destructor can be used before kqueue() provides us with fd */
 	talloc_set_destructor(el, _event_list_free);
 
-	el->times = fr_heap_talloc_alloc(el, fr_event_timer_cmp, fr_event_timer_t, heap_id);
+	/*
+	 *	Timers are ordered by "when" alone, so use the keyed
+	 *	heap, which doesn't dereference the timers on every
+	 *	comparison.
+	 */
+	el->times = fr_heap_keyed_talloc_alloc(el, fr_event_timer_t, heap_id, when);
 	if (!el->times) {
 		fr_strerror_const("Failed allocating event heap");
 	error:
@@ -2332,12 +2400,50 @@ void fr_event_list_set_time_func(fr_event_list_t *el, fr_event_time_source_t fun
 	el->time = func;
 }
 
+/** Use a hierarchical timer wheel for the timer events of an event list
+ *
+ * Inserting and deleting timer events becomes O(1), instead of O(log n).
+ * The cost is that timer events may run up to one tick of "resolution"
+ * later than they were scheduled for.  They will never run early.
+ *
+ * Any existing timer events are moved to the timer wheel.
+ *
+ * @param[in] el		to use the timer wheel for.
+ * @param[in] resolution	Length of one tick of the timer wheel.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_event_list_set_timer_wheel(fr_event_list_t *el, fr_time_delta_t resolution)
+{
+	fr_event_timer_t *ev;
+
+	if (el->wheel) {
+		fr_strerror_const("Event list already uses a timer wheel");
+		return -1;
+	}
+
+	el->wheel = fr_timer_wheel_talloc_alloc(el, resolution, el->time(), fr_event_timer_t, wheel_entry);
+	if (!el->wheel) {
+		fr_strerror_const_push("Failed allocating timer wheel");
+		return -1;
+	}
+
+	while ((ev = fr_heap_pop(el->times)) != NULL) {
+		if (unlikely(fr_timer_wheel_insert(el->wheel, ev, ev->when) < 0)) {
+			fr_assert_msg(0, "failed inserting timer wheel event: %s", fr_strerror());
+		}
+	}
+
+	return 0;
+}
+
 /** Return whether the event loop has any active events
  *
  */
 bool fr_event_list_empty(fr_event_list_t *el)
 {
-	return !fr_heap_num_elements(el->times) && !fr_rb_num_elements(el->fds);
+	return !event_timer_num(el) && !fr_rb_num_elements(el->fds);
 }
 
 #ifdef WITH_EVENT_DEBUG
@@ -2383,6 +2489,7 @@ static int event_timer_location_cmp(void const *one, void const *two)
 void fr_event_report(fr_event_list_t *el, fr_time_t now, void *uctx)
 {
 	fr_heap_iter_t		iter;
+	fr_timer_wheel_iter_t	wheel_iter;
 	fr_event_timer_t const	*ev;
 	size_t			i;
 
@@ -2408,9 +2515,9 @@ void fr_event_report(fr_event_list_t *el, fr_time_t now, void *uctx)
 	 *	Show which events are due, when they're due,
 	 *	and where they were allocated
 	 */
-	for (ev = fr_heap_iter_init(el->times, &iter);
+	for (ev = el->wheel ? fr_timer_wheel_iter_init(el->wheel, &wheel_iter) : fr_heap_iter_init(el->times, &iter);
 	     ev != NULL;
-	     ev = fr_heap_iter_next(el->times, &iter)) {
+	     ev = el->wheel ? fr_timer_wheel_iter_next(el->wheel, &wheel_iter) : fr_heap_iter_next(el->times, &iter)) {
 		fr_time_delta_t diff = ev->when - now;
 
 		for (i = 0; i < NUM_ELEMENTS(decades); i++) {
@@ -2475,6 +2582,7 @@ void fr_event_report(fr_event_list_t *el, fr_time_t now, void *uctx)
 void fr_event_timer_dump(fr_event_list_t *el)
 {
 	fr_heap_iter_t		iter;
+	fr_timer_wheel_iter_t	wheel_iter;
 	fr_event_timer_t 	*ev;
 	fr_time_t		now;
 
@@ -2482,9 +2590,9 @@ void fr_event_timer_dump(fr_event_list_t *el)
 
 	EVENT_DEBUG("Time is now %"PRId64"", now);
 
-	for (ev = fr_heap_iter_init(el->times, &iter);
+	for (ev = el->wheel ? fr_timer_wheel_iter_init(el->wheel, &wheel_iter) : fr_heap_iter_init(el->times, &iter);
 	     ev;
-	     ev = fr_heap_iter_next(el->times, &iter)) {
+	     ev = el->wheel ? fr_timer_wheel_iter_next(el->wheel, &wheel_iter) : fr_heap_iter_next(el->times, &iter)) {
 		(void)talloc_get_type_abort(ev, fr_event_timer_t);
 		EVENT_DEBUG("%s[%u]: %p time=%" PRId64 " (%c), callback=%p",
 			    ev->file, ev->line, ev, ev->when, now > ev->when ? '<' : '>', ev->callback);
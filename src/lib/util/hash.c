@@ -35,6 +35,15 @@ RCSID("$Id$")
 #include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/talloc.h>
 
+#include <fcntl.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
 /*
  *	A reasonable number of buckets to start off with.
  *	Should be a power of two.
@@ -48,6 +57,14 @@ struct fr_hash_entry_s {
 	void 			*data;
 };
 
+/** A slot in an open addressing table
+ *
+ */
+typedef struct {
+	uint32_t		key;		//!< Full hash of the data.
+	void			*data;
+} fr_hash_slot_t;
+
 struct fr_hash_table_s {
 	uint32_t		num_elements;	//!< Number of elements in the hash table.
 	uint32_t		num_buckets;	//!< Number of buckets (how long the array is) - power of 2 */
@@ -62,6 +79,13 @@ struct fr_hash_table_s {
 
 	fr_hash_entry_t		null;
 	fr_hash_entry_t		**buckets;	//!< Array of hash buckets.
+
+	bool			open;		//!< Use open addressing instead of chaining.
+						///< For open tables num_buckets is the number
+						///< of slots, and mask is the number of groups - 1.
+	uint32_t		num_deleted;	//!< Number of slots marked as deleted.
+	uint8_t			*ctrl;		//!< Control byte for each slot.
+	fr_hash_slot_t		*slots;		//!< Array of slots.
 };
 
 #ifdef TESTING
@@ -257,7 +281,9 @@ static int _fr_hash_table_free(fr_hash_table_t *ht)
 	uint32_t i;
 	fr_hash_entry_t *node, *next;
 
-	if (ht->free) {
+	if (ht->free && ht->open) {
+		for (i = 0; i < ht->num_buckets; i++) if (!(ht->ctrl[i] & 0x80)) ht->free(ht->slots[i].data);
+	} else if (ht->free) {
 		for (i = 0; i < ht->num_buckets; i++) {
 			if (ht->buckets[i]) for (node = ht->buckets[i];
 						 node != &ht->null;
@@ -273,13 +299,18 @@ static int _fr_hash_table_free(fr_hash_table_t *ht)
 	return 0;
 }
 
+static int open_resize(fr_hash_table_t *ht, uint32_t num_slots);
+
 /*
  *	Create the table.
  *
- *	Memory usage in bytes is (20/3) * number of entries.
+ *	Memory usage in bytes is (20/3) * number of entries for
+ *	chained tables, and between 20 and 40 bytes per entry
+ *	for open tables.
  */
 fr_hash_table_t *_fr_hash_table_alloc(TALLOC_CTX *ctx,
 				      char const *type,
+				      fr_hash_table_flags_t flags,
 				      fr_hash_t hash_func,
 				      fr_cmp_t cmp_func,
 				      fr_free_t free_func)
@@ -290,6 +321,21 @@ fr_hash_table_t *_fr_hash_table_alloc(TALLOC_CTX *ctx,
 	if (!ht) return NULL;
 	talloc_set_destructor(ht, _fr_hash_table_free);
 
+	if (flags & FR_HASH_TABLE_OPEN_ADDRESSING) {
+		*ht = (fr_hash_table_t){
+			.type = type,
+			.free = free_func,
+			.hash = hash_func,
+			.cmp = cmp_func,
+			.open = true
+		};
+		if (unlikely(open_resize(ht, FR_HASH_NUM_BUCKETS) < 0)) {
+			talloc_free(ht);
+			return NULL;
+		}
+		return ht;
+	}
+
 	*ht = (fr_hash_table_t){
 		.type = type,
 		.free = free_func,
@@ -400,6 +446,247 @@ static void fr_hash_table_grow(fr_hash_table_t *ht)
 #endif
 }
 
+/*
+ *	Open addressing tables.
+ *
+ *	The slots are split into groups of HASH_GROUP_WIDTH.  Each slot
+ *	has a control byte, which holds the low 7 bits of the hash of
+ *	the data in the slot, or marks the slot as empty or deleted.
+ *	A lookup examines the control bytes of a whole group at once,
+ *	and only looks at the slots (and calls the comparison
+ *	function) when the 7 bits of the key match.  Most lookups
+ *	touch one cache line of control bytes and one slot.
+ */
+#define HASH_GROUP_WIDTH	(16)
+#define HASH_CTRL_EMPTY		((uint8_t)0x80)
+#define HASH_CTRL_DELETED	((uint8_t)0xfe)
+#define HASH_H1(_key)		((_key) >> 7)		//!< Selects the first group to probe.
+#define HASH_H2(_key)		((uint8_t)((_key) & 0x7f))	//!< Stored in the control byte.
+
+/*
+ *	Tables are resized when they are more than 7/8 full,
+ *	including deleted slots.
+ */
+#define HASH_MAX_LOAD(_slots)	(((_slots) >> 3) * 7)
+
+/** Return a bitmask of the control bytes in a group which match a value
+ *
+ */
+static inline CC_HINT(always_inline) uint32_t hash_group_match(uint8_t const *ctrl, uint8_t value)
+{
+#ifdef __SSE2__
+	__m128i group = _mm_loadu_si128((__m128i const *)ctrl);
+
+	return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)value)));
+#else
+	uint32_t	mask = 0;
+	int		i;
+
+	for (i = 0; i < HASH_GROUP_WIDTH; i++) if (ctrl[i] == value) mask |= (1 << i);
+
+	return mask;
+#endif
+}
+
+/** Return a bitmask of the control bytes in a group which are empty or deleted
+ *
+ */
+static inline CC_HINT(always_inline) uint32_t hash_group_match_free(uint8_t const *ctrl)
+{
+#ifdef __SSE2__
+	return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((__m128i const *)ctrl));
+#else
+	uint32_t	mask = 0;
+	int		i;
+
+	for (i = 0; i < HASH_GROUP_WIDTH; i++) if (ctrl[i] & 0x80) mask |= (1 << i);
+
+	return mask;
+#endif
+}
+
+/** Find the slot holding data
+ *
+ * @return
+ *	- The slot.
+ *	- NULL if no slot holds matching data.
+ */
+static inline CC_HINT(always_inline) fr_hash_slot_t *open_find(fr_hash_table_t *ht, uint32_t key, void const *data)
+{
+	uint32_t	group = HASH_H1(key) & ht->mask;
+	uint32_t	step;
+	uint8_t		h2 = HASH_H2(key);
+
+	for (step = 0; step <= ht->mask; step++) {
+		uint8_t const	*ctrl = ht->ctrl + (group * HASH_GROUP_WIDTH);
+		uint32_t	match = hash_group_match(ctrl, h2);
+
+		while (match) {
+			fr_hash_slot_t *slot = &ht->slots[(group * HASH_GROUP_WIDTH) + __builtin_ctz(match)];
+
+			if ((slot->key == key) && (!ht->cmp || (ht->cmp(data, slot->data) == 0))) return slot;
+
+			match &= match - 1;
+		}
+
+		/*
+		 *	The data would have been inserted
+		 *	into the first group with a free slot.
+		 */
+		if (hash_group_match(ctrl, HASH_CTRL_EMPTY)) return NULL;
+
+		group = (group + step + 1) & ht->mask;	/* Triangular probing visits every group */
+	}
+
+	return NULL;
+}
+
+/** Find the first free slot for a key
+ *
+ */
+static uint32_t open_find_free(fr_hash_table_t *ht, uint32_t key)
+{
+	uint32_t	group = HASH_H1(key) & ht->mask;
+	uint32_t	step;
+
+	for (step = 0; step <= ht->mask; step++) {
+		uint32_t free_mask = hash_group_match_free(ht->ctrl + (group * HASH_GROUP_WIDTH));
+
+		if (free_mask) return (group * HASH_GROUP_WIDTH) + __builtin_ctz(free_mask);
+
+		group = (group + step + 1) & ht->mask;
+	}
+
+	fr_assert_fail("Hash table has no free slots");	/* Load factor means this shouldn't happen */
+	return 0;
+}
+
+/** Allocate a new set of slots, and move all the data into them
+ *
+ * @param[in] ht	to resize.
+ * @param[in] num_slots	the new number of slots.  Must be a power of 2.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int open_resize(fr_hash_table_t *ht, uint32_t num_slots)
+{
+	uint8_t		*ctrl, *old_ctrl = ht->ctrl;
+	fr_hash_slot_t	*slots, *old_slots = ht->slots;
+	uint32_t	i, old_num_slots = ht->num_buckets;
+
+	ctrl = talloc_array(ht, uint8_t, num_slots);
+	if (unlikely(!ctrl)) return -1;
+	slots = talloc_array(ht, fr_hash_slot_t, num_slots);
+	if (unlikely(!slots)) {
+		talloc_free(ctrl);
+		return -1;
+	}
+	memset(ctrl, HASH_CTRL_EMPTY, num_slots);
+
+	ht->ctrl = ctrl;
+	ht->slots = slots;
+	ht->num_buckets = num_slots;
+	ht->mask = (num_slots / HASH_GROUP_WIDTH) - 1;
+	ht->next_grow = HASH_MAX_LOAD(num_slots);
+	ht->num_deleted = 0;
+
+	for (i = 0; i < old_num_slots && old_ctrl; i++) {
+		uint32_t j;
+
+		if (old_ctrl[i] & 0x80) continue;
+
+		j = open_find_free(ht, old_slots[i].key);
+		ctrl[j] = old_ctrl[i];
+		slots[j] = old_slots[i];
+	}
+
+	talloc_free(old_ctrl);
+	talloc_free(old_slots);
+
+	return 0;
+}
+
+static bool open_insert(fr_hash_table_t *ht, void const *data)
+{
+	uint32_t	key = ht->hash(data);
+	uint32_t	i;
+
+	if (open_find(ht, key, data)) return false;	/* already in the table, can't insert it */
+
+	/*
+	 *	Grow the table if it's too full.  If it's
+	 *	mostly deleted slots, rehash it at the same
+	 *	size to remove them.
+	 */
+	if ((ht->num_elements + ht->num_deleted) >= ht->next_grow) {
+		uint32_t num_slots = ht->num_buckets;
+
+		if (ht->num_elements >= (ht->next_grow >> 1)) num_slots *= GROW_FACTOR;
+
+		/*
+		 *	Keep going if we can't allocate memory, but
+		 *	never fill the last free slot.
+		 */
+		if ((open_resize(ht, num_slots) < 0) &&
+		    ((ht->num_elements + ht->num_deleted + 1) >= ht->num_buckets)) return false;
+	}
+
+	i = open_find_free(ht, key);
+	if (ht->ctrl[i] == HASH_CTRL_DELETED) ht->num_deleted--;
+
+	ht->ctrl[i] = HASH_H2(key);
+	ht->slots[i] = (fr_hash_slot_t){
+		.key = key,
+		.data = UNCONST(void *, data)
+	};
+	ht->num_elements++;
+
+	return true;
+}
+
+static void *open_remove(fr_hash_table_t *ht, void const *data)
+{
+	fr_hash_slot_t	*slot;
+	uint32_t	i;
+
+	slot = open_find(ht, ht->hash(data), data);
+	if (!slot) return NULL;
+
+	i = slot - ht->slots;
+
+	/*
+	 *	If the group still has an empty slot, then it has
+	 *	never been full, and no lookups probe past it.  So
+	 *	the slot can be marked empty.  Otherwise, lookups
+	 *	need to carry on to the next group.
+	 */
+	if (hash_group_match(ht->ctrl + (i & ~(HASH_GROUP_WIDTH - 1)), HASH_CTRL_EMPTY)) {
+		ht->ctrl[i] = HASH_CTRL_EMPTY;
+	} else {
+		ht->ctrl[i] = HASH_CTRL_DELETED;
+		ht->num_deleted++;
+	}
+	ht->num_elements--;
+
+	return slot->data;
+}
+
+static void *open_iter_next(fr_hash_table_t *ht, fr_hash_iter_t *iter)
+{
+	uint32_t i;
+
+	for (i = iter->bucket; i < ht->num_buckets; i++) {
+		if (ht->ctrl[i] & 0x80) continue;
+
+		iter->bucket = i + 1;
+		return ht->slots[i].data;
+	}
+	iter->bucket = ht->num_buckets;
+
+	return NULL;
+}
+
 /*
  *	Internal find a node routine.
  */
@@ -430,6 +717,12 @@ void *fr_hash_table_find(fr_hash_table_t *ht, void const *data)
 {
 	fr_hash_entry_t *node;
 
+	if (ht->open) {
+		fr_hash_slot_t *slot = open_find(ht, ht->hash(data), data);
+
+		return slot ? slot->data : NULL;
+	}
+
 	node = hash_table_find(ht, ht->hash(data), data);
 	if (!node) return NULL;
 
@@ -449,6 +742,12 @@ void *fr_hash_table_find_by_key(fr_hash_table_t *ht, uint32_t key, void const *d
 {
 	fr_hash_entry_t *node;
 
+	if (ht->open) {
+		fr_hash_slot_t *slot = open_find(ht, key, data);
+
+		return slot ? slot->data : NULL;
+	}
+
 	node = hash_table_find(ht, key, data);
 	if (!node) return NULL;
 
@@ -475,6 +774,8 @@ bool fr_hash_table_insert(fr_hash_table_t *ht, void const *data)
 	if (ht->type) (void)_talloc_get_type_abort(data, ht->type, __location__);
 #endif
 
+	if (ht->open) return open_insert(ht, data);
+
 	key = ht->hash(data);
 	entry = key & ht->mask;
 	reversed = reverse(key);
@@ -526,20 +827,28 @@ bool fr_hash_table_insert(fr_hash_table_t *ht, void const *data)
 int fr_hash_table_replace(void **old, fr_hash_table_t *ht, void const *data)
 {
 	fr_hash_entry_t *node;
+	void		**found;
 
-	node = hash_table_find(ht, ht->hash(data), data);
-	if (!node) {
+	if (ht->open) {
+		fr_hash_slot_t *slot = open_find(ht, ht->hash(data), data);
+
+		found = slot ? &slot->data : NULL;
+	} else {
+		node = hash_table_find(ht, ht->hash(data), data);
+		found = node ? &node->data : NULL;
+	}
+	if (!found) {
 		if (old) *old = NULL;
 		return fr_hash_table_insert(ht, data) ? 1 : -1;
 	}
 
 	if (old) {
-		*old = node->data;
+		*old = *found;
 	} else if (ht->free) {
-		ht->free(node->data);
+		ht->free(*found);
 	}
 
-	node->data = UNCONST(void *, data);
+	*found = UNCONST(void *, data);
 
 	return 0;
 }
@@ -561,6 +870,8 @@ void *fr_hash_table_remove(fr_hash_table_t *ht, void const *data)
 	void			*old;
 	fr_hash_entry_t		*node;
 
+	if (ht->open) return open_remove(ht, data);
+
 	key = ht->hash(data);
 	entry = key & ht->mask;
 	reversed = reverse(key);
@@ -623,6 +934,8 @@ void *fr_hash_table_iter_next(fr_hash_table_t *ht, fr_hash_iter_t *iter)
 	fr_hash_entry_t *node;
 	uint32_t	i;
 
+	if (ht->open) return open_iter_next(ht, iter);
+
 	/*
 	 *	Return the next element in the bucket
 	 */
@@ -672,7 +985,7 @@ void *fr_hash_table_iter_next(fr_hash_table_t *ht, fr_hash_iter_t *iter)
  */
 void *fr_hash_table_iter_init(fr_hash_table_t *ht, fr_hash_iter_t *iter)
 {
-	iter->bucket = ht->num_buckets;
+	iter->bucket = ht->open ? 0 : ht->num_buckets;
 	iter->node = &ht->null;
 
 	return fr_hash_table_iter_next(ht, iter);
@@ -709,12 +1022,16 @@ int fr_hash_table_flatten(TALLOC_CTX *ctx, void **out[], fr_hash_table_t *ht)
  * This must be called if the table will be read by multiple threads without
  * synchronisation.  Synchronisation is still required for updates.
  *
+ * Open tables never modify themselves on lookup, so there's nothing to do.
+ *
  * @param[in] ht	to fill.
  */
 void fr_hash_table_fill(fr_hash_table_t *ht)
 {
 	int i;
 
+	if (ht->open) return;
+
 	for (i = ht->num_buckets - 1; i >= 0; i--) if (!ht->buckets[i]) fr_hash_table_fixup(ht, i);
 }
 
@@ -729,6 +1046,20 @@ int fr_hash_table_info(fr_hash_table_t *ht)
 
 	if (!ht) return 0;
 
+	if (ht->open) {
+		uint32_t j, displaced = 0;
+
+		for (j = 0; j < ht->num_buckets; j++) {
+			if (ht->ctrl[j] & 0x80) continue;
+			if ((j / HASH_GROUP_WIDTH) != (HASH_H1(ht->slots[j].key) & ht->mask)) displaced++;
+		}
+
+		printf("HASH TABLE %p\tslots: %d\t(%d deleted)\n", ht, ht->num_buckets, ht->num_deleted);
+		printf("\tnum entries %d\tnot in first group %d\n\n", ht->num_elements, displaced);
+
+		return 0;
+	}
+
 	uninitialized = collisions = 0;
 	memset(array, 0, sizeof(array));
 
@@ -793,95 +1124,316 @@ int fr_hash_table_info(fr_hash_table_t *ht)
 #endif
 
 
-#define FNV_MAGIC_INIT (0x811c9dc5)
-#define FNV_MAGIC_PRIME (0x01000193)
-
 /*
- *	A fast hash function.  For details, see:
+ *	Constants for the hash functions below.  These are the
+ *	default secrets from wyhash, which are odd, and have 32
+ *	bits set in each byte position.
+ */
+#define HASH_S0 (0xa0761d6478bd642fULL)
+#define HASH_S1 (0xe7037ed1a0b428dbULL)
+#define HASH_S2 (0x8ebc6af09c88c6e3ULL)
+#define HASH_S3 (0x589965cc75374cc3ULL)
+
+/** Seed for #fr_hash_seeded, randomised when the library is loaded
  *
- *	http://www.isthe.com/chongo/tech/comp/fnv/
+ */
+static uint64_t hash_seed = HASH_S2;
+static uint64_t hash_seed_mixed;		//!< hash_seed after hash_seed_mix().
+
+/** Multiply two 64bit integers, writing the low half of the product to a, and the high half to b
  *
- *	Which also includes public domain source.  We've re-written
- *	it here for our purposes.
  */
-uint32_t fr_hash(void const *data, size_t size)
+static inline CC_HINT(always_inline) void hash_mum(uint64_t *a, uint64_t *b)
 {
-	uint8_t const *p = data;
-	uint8_t const *q = p + size;
-	uint32_t      hash = FNV_MAGIC_INIT;
+#ifdef HAVE_128BIT_INTEGERS
+	uint128_t r = (uint128_t)*a * *b;
+
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32), c = t < rl;
+	uint64_t lo = t + (rm1 << 32);
+
+	c += lo < t;
+	*a = lo;
+	*b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
 
-	/*
-	 *	FNV-1 hash each octet in the buffer
-	 */
-	while (p != q) {
-		/*
-		 *	XOR the 8-bit quantity into the bottom of
-		 *	the hash.
-		 */
-		hash ^= (uint32_t) (*p++);
+/** Multiply two 64bit integers, returning the XOR of the high and low halves of the product
+ *
+ */
+static inline CC_HINT(always_inline) uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+	hash_mum(&a, &b);
+
+	return a ^ b;
+}
+
+/** Read a little endian 64bit integer from an unaligned buffer
+ *
+ * The byte order is fixed so that hashes are the same on
+ * every platform.
+ */
+static inline CC_HINT(always_inline) uint64_t hash_read64(uint8_t const *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+#ifdef WORDS_BIGENDIAN
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static inline CC_HINT(always_inline) uint64_t hash_read32(uint8_t const *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+#ifdef WORDS_BIGENDIAN
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+/** Scramble a seed before it is used to hash data
+ *
+ */
+static inline CC_HINT(always_inline) uint64_t hash_seed_mix(uint64_t seed)
+{
+	return seed ^ hash_mix(seed ^ HASH_S0, HASH_S1);
+}
+
+/** Fast hash, which processes 16 or 48 bytes per round
+ *
+ * Based on wyhash by Wang Yi, which is in the public domain.  Keys
+ * of up to 16 bytes (most RADIUS attributes) are hashed with only
+ * two multiplications.
+ *
+ * @param[in] data	to hash.
+ * @param[in] size	of the data.
+ * @param[in] seed	produced by hash_seed_mix().
+ * @return a 64bit hash of the data.
+ */
+static inline CC_HINT(always_inline) uint64_t hash64(void const *data, size_t size, uint64_t seed)
+{
+	uint8_t const	*p = data;
+	uint64_t	a, b;
+
+	if (likely(size <= 16)) {
+		if (likely(size >= 4)) {
+			/*
+			 *	Overlapping reads cover all of the data
+			 */
+			a = (hash_read32(p) << 32) | hash_read32(p + ((size >> 3) << 2));
+			b = (hash_read32(p + size - 4) << 32) | hash_read32(p + size - 4 - ((size >> 3) << 2));
+		} else if (likely(size > 0)) {
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[size >> 1] << 8) | p[size - 1];
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		size_t i = size;
+
+		if (unlikely(i > 48)) {
+			uint64_t see1 = seed, see2 = seed;
+
+			do {
+				seed = hash_mix(hash_read64(p) ^ HASH_S1, hash_read64(p + 8) ^ seed);
+				see1 = hash_mix(hash_read64(p + 16) ^ HASH_S2, hash_read64(p + 24) ^ see1);
+				see2 = hash_mix(hash_read64(p + 32) ^ HASH_S3, hash_read64(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (likely(i > 48));
+
+			seed ^= see1 ^ see2;
+		}
+
+		while (unlikely(i > 16)) {
+			seed = hash_mix(hash_read64(p) ^ HASH_S1, hash_read64(p + 8) ^ seed);
+			p += 16;
+			i -= 16;
+		}
 
 		/*
-		 *	Multiple by 32-bit magic FNV prime, mod 2^32
-		 */
-		hash *= FNV_MAGIC_PRIME;
-#if 0
-		/*
-		 *	Potential optimization.
+		 *	The last 16 bytes, which may overlap
+		 *	with the previous round.
 		 */
-		hash += (hash<<1) + (hash<<4) + (hash<<7) + (hash<<8) + (hash<<24);
-#endif
-    }
+		a = hash_read64(p + i - 16);
+		b = hash_read64(p + i - 8);
+	}
+
+	a ^= HASH_S1;
+	b ^= seed;
+	hash_mum(&a, &b);
 
-    return hash;
+	return hash_mix(a ^ HASH_S0 ^ size, b ^ HASH_S1);
 }
 
-/*
- *	Continue hashing data.
+/** Hash data with a 64bit seed
+ *
+ * Don't use for cryptography, just for hashing internal data.
+ *
+ * @param[in] data	to hash.
+ * @param[in] size	of the data.
+ * @param[in] seed	to start from.  Different seeds produce
+ *			unrelated hashes for the same data.
+ * @return a 64bit hash of the data.
  */
-uint32_t fr_hash_update(void const *data, size_t size, uint32_t hash)
+uint64_t fr_hash64(void const *data, size_t size, uint64_t seed)
 {
-	uint8_t const *p = data;
-	uint8_t const *q;
+	return hash64(data, size, hash_seed_mix(seed));
+}
 
+/** Fold a 64bit hash into 32bits
+ *
+ */
+static inline CC_HINT(always_inline) uint32_t hash_fold(uint64_t hash)
+{
+	return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/** Hash data with a fixed seed
+ *
+ * The result is the same for every process, and every platform, so
+ * this function should be used where the hash controls behaviour
+ * which should be consistent between servers, such as load
+ * balancing.
+ */
+uint32_t fr_hash(void const *data, size_t size)
+{
+	return hash_fold(hash64(data, size, hash_seed_mix(HASH_S3)));	/* Seed is folded at compile time */
+}
+
+/** Continue hashing data
+ *
+ * @param[in] data	to add to the hash.
+ * @param[in] size	of the data.
+ * @param[in] hash	of the previous data.
+ * @return the new hash.
+ */
+uint32_t fr_hash_update(void const *data, size_t size, uint32_t hash)
+{
 	if (size == 0) return hash;	/* Avoid ubsan issues with access NULL pointer */
 
- 	q = p + size;
-	while (p < q) {
-		hash *= FNV_MAGIC_PRIME;
-		hash ^= (uint32_t) (*p++);
-	}
+	return hash_fold(fr_hash64(data, size, hash));
+}
 
-	return hash;
+/** Hash data with a seed which is randomised when the server starts
+ *
+ * Use this for hash tables keyed on data which may be controlled
+ * by an attacker, such as the User-Name.  The random seed means that
+ * an attacker can't craft many keys which fall into the same hash
+ * bucket.
+ *
+ * The hashes differ from process to process, so they must not be
+ * stored or sent to other servers.
+ */
+uint32_t fr_hash_seeded(void const *data, size_t size)
+{
+	return hash_fold(hash64(data, size, hash_seed_mixed));
 }
 
-/*
- *	Hash a C string, so we loop over it once.
+/** Randomise the seed for #fr_hash_seeded
+ *
+ * This is run when the library is loaded, before any hash tables
+ * have been created.
  */
-uint32_t fr_hash_string(char const *p)
+static void hash_seed_init(void) CC_HINT(constructor);
+static void hash_seed_init(void)
 {
-	uint32_t      hash = FNV_MAGIC_INIT;
+	int		fd;
+	uint64_t	seed = 0;
 
-	while (*p) {
-		hash *= FNV_MAGIC_PRIME;
-		hash ^= (uint32_t) (*p++);
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd >= 0) {
+		if (read(fd, &seed, sizeof(seed)) != sizeof(seed)) seed = 0;
+		close(fd);
 	}
 
-	return hash;
+	/*
+	 *	Not great, but better than a fixed seed.
+	 */
+	if (!seed) {
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		seed = ((uint64_t)tv.tv_sec << 32) ^ (uint64_t)tv.tv_usec ^ ((uint64_t)getpid() << 16);
+	}
+
+	hash_seed = seed;
+	hash_seed_mixed = hash_seed_mix(hash_seed);
 }
 
-/** Hash a C string, converting all chars to lowercase
+/** Convert upper case ASCII letters in a word to lower case
  *
+ * Each byte with a value 'A'-'Z' has 0x20 added to it.  Other
+ * bytes are left alone.
  */
-uint32_t fr_hash_case_string(char const *p)
+static inline CC_HINT(always_inline) uint64_t hash_tolower64(uint64_t w)
 {
-	uint32_t      hash = FNV_MAGIC_INIT;
+	uint64_t heptets = w & 0x7f7f7f7f7f7f7f7fULL;
+	uint64_t ge_a = heptets + 0x3f3f3f3f3f3f3f3fULL;	/* High bit set if byte >= 'A' */
+	uint64_t gt_z = heptets + 0x2525252525252525ULL;	/* High bit set if byte > 'Z' */
+	uint64_t upper = (ge_a ^ gt_z) & ~w & 0x8080808080808080ULL;
 
-	while (*p) {
-		hash *= FNV_MAGIC_PRIME;
-		hash ^= (uint32_t) (tolower(*p++));
-	}
+	return w | (upper >> 2);
+}
+
+/** Hash data, ignoring the case of ASCII letters
+ *
+ * @param[in] data	to hash.
+ * @param[in] size	of the data.
+ * @return the case insensitive hash.
+ */
+uint32_t fr_hash_case(void const *data, size_t size)
+{
+	uint8_t const	*p = data, *end = p + size;
+	uint8_t		buffer[256];
+	uint64_t	hash = HASH_S3;
+
+	/*
+	 *	Lower case the data a chunk at a time,
+	 *	and hash each chunk.
+	 */
+	do {
+		size_t	len = (size_t)(end - p), i;
+		uint64_t w;
+
+		if (len > sizeof(buffer)) len = sizeof(buffer);
 
-	return hash;
+		for (i = 0; (i + 8) <= len; i += 8) {
+			memcpy(&w, p + i, sizeof(w));
+			w = hash_tolower64(w);
+			memcpy(buffer + i, &w, sizeof(w));
+		}
+		for (; i < len; i++) buffer[i] = ((p[i] >= 'A') && (p[i] <= 'Z')) ? p[i] + ('a' - 'A') : p[i];
+
+		hash = fr_hash64(buffer, len, hash);
+		p += len;
+	} while (p < end);
+
+	return hash_fold(hash);
+}
+
+/** Hash a C string
+ *
+ */
+uint32_t fr_hash_string(char const *p)
+{
+	return fr_hash(p, strlen(p));
+}
+
+/** Hash a C string, converting all chars to lowercase
+ *
+ */
+uint32_t fr_hash_case_string(char const *p)
+{
+	return fr_hash_case(p, strlen(p));
 }
 
 /** Check hash table is sane
@@ -893,9 +1445,28 @@ void fr_hash_table_verify(fr_hash_table_t *ht)
 	void		*ptr;
 
 	(void)talloc_get_type_abort(ht, fr_hash_table_t);
-	(void)talloc_get_type_abort(ht->buckets, fr_hash_entry_t *);
 
-	fr_assert(talloc_array_length(ht->buckets) == ht->num_buckets);
+	if (ht->open) {
+		uint32_t i, used = 0, deleted = 0;
+
+		fr_assert(talloc_array_length(ht->ctrl) == ht->num_buckets);
+		fr_assert(talloc_array_length(ht->slots) == ht->num_buckets);
+
+		for (i = 0; i < ht->num_buckets; i++) {
+			if (ht->ctrl[i] == HASH_CTRL_DELETED) {
+				deleted++;
+			} else if (!(ht->ctrl[i] & 0x80)) {
+				fr_assert(ht->ctrl[i] == HASH_H2(ht->slots[i].key));
+				used++;
+			}
+		}
+		fr_assert(used == ht->num_elements);
+		fr_assert(deleted == ht->num_deleted);
+	} else {
+		(void)talloc_get_type_abort(ht->buckets, fr_hash_entry_t *);
+
+		fr_assert(talloc_array_length(ht->buckets) == ht->num_buckets);
+	}
 
 	/*
 	 *	Check talloc headers on all data
@@ -913,7 +1484,7 @@ void fr_hash_table_verify(fr_hash_table_t *ht)
 /*
  *  cc -g -DTESTING -I ../include hash.c -o hash
  *
- *  ./hash
+ *  ./hash [open]
  */
 static uint32_t hash_int(void const *data)
 {
@@ -927,7 +1498,11 @@ int main(int argc, char **argv)
 	fr_hash_table_t *ht;
 	int *array;
 
-	ht = fr_hash_table_alloc(NULL, hash_int, NULL, NULL);
+	if ((argc > 1) && (strcmp(argv[1], "open") == 0)) {
+		ht = fr_hash_table_open_alloc(NULL, hash_int, NULL, NULL);
+	} else {
+		ht = fr_hash_table_alloc(NULL, hash_int, NULL, NULL);
+	}
 	if (!ht) {
 		fprintf(stderr, "Hash create failed\n");
 		fr_exit(1);
@@ -47,25 +47,45 @@ typedef struct {
  *	Fast hash, which isn't too bad.  Don't use for cryptography,
  *	just for hashing internal data.
  */
+uint64_t fr_hash64(void const *data, size_t size, uint64_t seed);
 uint32_t fr_hash(void const *, size_t);
 uint32_t fr_hash_update(void const *data, size_t size, uint32_t hash);
+uint32_t fr_hash_seeded(void const *data, size_t size);
+uint32_t fr_hash_case(void const *data, size_t size);
 uint32_t fr_hash_string(char const *p);
 uint32_t fr_hash_case_string(char const *p);
 
 typedef struct fr_hash_table_s fr_hash_table_t;
 typedef int (*fr_hash_table_walk_t)(void *data, void *uctx);
 
+/** Options for hash tables
+ *
+ */
+typedef enum {
+	FR_HASH_TABLE_CHAINED = 0x00,			//!< Buckets with chains of entries.
+	FR_HASH_TABLE_OPEN_ADDRESSING = 0x01		//!< Flat array of slots, probed a group
+							///< of control bytes at a time.  Faster
+							///< lookups, and no allocation per entry.
+} fr_hash_table_flags_t;
+
 #define		fr_hash_table_alloc(_ctx, _hash_node, _cmp_node, _free_node) \
-		_fr_hash_table_alloc(_ctx, NULL, _hash_node, _cmp_node, _free_node)
+		_fr_hash_table_alloc(_ctx, NULL, FR_HASH_TABLE_CHAINED, _hash_node, _cmp_node, _free_node)
 
 #define		fr_hash_table_talloc_alloc(_ctx, _type, _hash_node, _cmp_node, _free_node) \
-		_fr_hash_table_alloc(_ctx, #_type, _hash_node, _cmp_node, _free_node)
+		_fr_hash_table_alloc(_ctx, #_type, FR_HASH_TABLE_CHAINED, _hash_node, _cmp_node, _free_node)
+
+#define		fr_hash_table_open_alloc(_ctx, _hash_node, _cmp_node, _free_node) \
+		_fr_hash_table_alloc(_ctx, NULL, FR_HASH_TABLE_OPEN_ADDRESSING, _hash_node, _cmp_node, _free_node)
+
+#define		fr_hash_table_open_talloc_alloc(_ctx, _type, _hash_node, _cmp_node, _free_node) \
+		_fr_hash_table_alloc(_ctx, #_type, FR_HASH_TABLE_OPEN_ADDRESSING, _hash_node, _cmp_node, _free_node)
 
 fr_hash_table_t *_fr_hash_table_alloc(TALLOC_CTX *ctx,
 				      char const *type,
+				      fr_hash_table_flags_t flags,
 				      fr_hash_t hash_node,
 				      fr_cmp_t cmp_node,
-				      fr_free_t free_node) CC_HINT(nonnull(3,4));
+				      fr_free_t free_node) CC_HINT(nonnull(4,5));
 
 void		*fr_hash_table_find(fr_hash_table_t *ht, void const *data) CC_HINT(nonnull);
 
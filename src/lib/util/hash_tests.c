@@ -0,0 +1,380 @@
+#include <freeradius-devel/util/acutest.h>
+
+#include "hash.c"
+
+#include <freeradius-devel/util/time.h>
+
+#define HASH_TEST_MAX_LEN	(600)
+
+/** The FNV-1 hash which was used before fr_hash64, for comparison
+ *
+ */
+static uint32_t hash_fnv(void const *data, size_t size)
+{
+	uint8_t const	*p = data, *q = p + size;
+	uint32_t	hash = 0x811c9dc5;
+
+	while (p != q) {
+		hash ^= (uint32_t) (*p++);
+		hash *= 0x01000193;
+	}
+
+	return hash;
+}
+
+static void hash_random_fill(uint8_t *buffer, size_t len)
+{
+	size_t	i;
+
+	static bool	done_init = false;
+
+	if (!done_init) {
+		srand((unsigned int)time(NULL));
+		done_init = true;
+	}
+
+	for (i = 0; i < len; i++) buffer[i] = rand() & 0xff;
+}
+
+/*
+ *	Hashes must not depend on the alignment of the data,
+ *	and every byte of the data must affect the result.
+ */
+static void hash_test_lengths(void)
+{
+	uint8_t		buffer[HASH_TEST_MAX_LEN + 1], copy[HASH_TEST_MAX_LEN + 1];
+	size_t		len, i;
+
+	hash_random_fill(buffer, sizeof(buffer));
+	memcpy(copy + 1, buffer, HASH_TEST_MAX_LEN);
+
+	for (len = 0; len <= HASH_TEST_MAX_LEN; len++) {
+		uint64_t hash = fr_hash64(buffer, len, 0);
+
+		TEST_CHECK(hash == fr_hash64(copy + 1, len, 0));
+		TEST_MSG("unaligned hash differs for length %zu", len);
+
+		TEST_CHECK(fr_hash(buffer, len) == fr_hash(copy + 1, len));
+
+		for (i = 0; i < len; i++) {
+			buffer[i] ^= 0x01;
+			TEST_CHECK(fr_hash64(buffer, len, 0) != hash);
+			TEST_MSG("flipping bit 0 of byte %zu didn't change hash for length %zu", i, len);
+			buffer[i] ^= 0x01;
+		}
+
+		if (len > 0) {
+			TEST_CHECK(fr_hash64(buffer, len, 0) != fr_hash64(buffer, len - 1, 0));
+			TEST_MSG("hash of length %zu matches hash of length %zu", len, len - 1);
+		}
+	}
+}
+
+static void hash_test_seeded(void)
+{
+	uint8_t		buffer[64];
+	uint64_t	old_seed = hash_seed_mixed;
+	uint32_t	hash;
+
+	hash_random_fill(buffer, sizeof(buffer));
+
+	TEST_CASE("fixed seed");
+	TEST_CHECK(fr_hash(buffer, sizeof(buffer)) == fr_hash(buffer, sizeof(buffer)));
+	TEST_CHECK(fr_hash64(buffer, sizeof(buffer), 1) != fr_hash64(buffer, sizeof(buffer), 2));
+
+	TEST_CASE("random seed");
+	hash = fr_hash_seeded(buffer, sizeof(buffer));
+	TEST_CHECK(hash == fr_hash_seeded(buffer, sizeof(buffer)));
+
+	hash_seed_mixed = hash_seed_mix(hash_seed + 1);
+	TEST_CHECK(hash != fr_hash_seeded(buffer, sizeof(buffer)));
+	TEST_MSG("changing the seed didn't change the hash");
+	hash_seed_mixed = old_seed;
+
+	TEST_CASE("update");
+	hash = fr_hash(buffer, 16);
+	TEST_CHECK(fr_hash_update(buffer + 16, 0, hash) == hash);
+	TEST_CHECK(fr_hash_update(buffer + 16, 16, hash) != hash);
+}
+
+static void hash_test_case(void)
+{
+	char		buffer[HASH_TEST_MAX_LEN], lower[HASH_TEST_MAX_LEN];
+	size_t		len, i;
+
+	TEST_CHECK(fr_hash_case_string("User-Name") == fr_hash_case_string("user-name"));
+	TEST_CHECK(fr_hash_case_string("User-Name") == fr_hash_case_string("USER-NAME"));
+	TEST_CHECK(fr_hash_case_string("User-Name") != fr_hash_case_string("User-Namf"));
+	TEST_CHECK(fr_hash_case_string("User-Name") == fr_hash_string("user-name"));
+
+	/*
+	 *	The characters either side of 'A' - 'Z' must
+	 *	not be changed.
+	 */
+	TEST_CHECK(fr_hash_case_string("@[@[@[@[@[") != fr_hash_case_string("`{`{`{`{`{"));
+
+	/*
+	 *	Compare against a byte at a time conversion, over
+	 *	the chunk boundaries.
+	 */
+	for (len = 0; len < sizeof(buffer); len++) {
+		for (i = 0; i < len; i++) {
+			buffer[i] = 0x20 + (rand() % 0x60);
+			lower[i] = ((buffer[i] >= 'A') && (buffer[i] <= 'Z')) ? buffer[i] + ('a' - 'A') : buffer[i];
+		}
+
+		TEST_CHECK(fr_hash_case(buffer, len) == fr_hash_case(lower, len));
+		TEST_MSG("case insensitive hash differs for length %zu", len);
+
+		if (len <= 256) {
+			TEST_CHECK(fr_hash_case(buffer, len) == fr_hash(lower, len));
+			TEST_MSG("case insensitive hash doesn't match hash of lower case data for length %zu", len);
+		}
+	}
+}
+
+/*
+ *	Keys which differ only slightly should be spread evenly
+ *	over the buckets of a hash table.
+ */
+#define HASH_TEST_KEYS		(1 << 17)
+#define HASH_TEST_BUCKETS	(1 << 10)
+
+static void hash_test_distribution(void)
+{
+	uint32_t	*buckets;
+	uint32_t	i, max = 0;
+	char		name[32];
+
+	buckets = calloc(HASH_TEST_BUCKETS, sizeof(buckets[0]));
+
+	for (i = 0; i < HASH_TEST_KEYS; i++) {
+		size_t len = snprintf(name, sizeof(name), "user%u@example.com", i);
+
+		buckets[fr_hash_seeded(name, len) & (HASH_TEST_BUCKETS - 1)]++;
+	}
+
+	for (i = 0; i < HASH_TEST_BUCKETS; i++) if (buckets[i] > max) max = buckets[i];
+
+	/*
+	 *	The expected number of keys per bucket is 128.
+	 */
+	TEST_CHECK(max < 200);
+	TEST_MSG("bucket has %u keys, expected about %u", max, HASH_TEST_KEYS / HASH_TEST_BUCKETS);
+
+	free(buckets);
+}
+
+/*
+ *	Tables of integers, for exercising both kinds of table.
+ */
+static uint32_t hash_test_int_hash(void const *data)
+{
+	return fr_hash(data, sizeof(uint32_t));
+}
+
+static int8_t hash_test_int_cmp(void const *a, void const *b)
+{
+	uint32_t const *my_a = a, *my_b = b;
+
+	return CMP(*my_a, *my_b);
+}
+
+#define HASH_TABLE_TEST_SIZE	(1 << 16)
+
+static void hash_test_table(fr_hash_table_flags_t flags)
+{
+	fr_hash_table_t	*ht;
+	uint32_t	*array, *p, i, count;
+	fr_hash_iter_t	iter;
+
+	ht = _fr_hash_table_alloc(NULL, NULL, flags, hash_test_int_hash, hash_test_int_cmp, NULL);
+	TEST_CHECK(ht != NULL);
+
+	array = talloc_array(NULL, uint32_t, HASH_TABLE_TEST_SIZE);
+	for (i = 0; i < HASH_TABLE_TEST_SIZE; i++) array[i] = i;
+
+	TEST_CASE("insertions");
+	for (i = 0; i < HASH_TABLE_TEST_SIZE; i++) TEST_CHECK(fr_hash_table_insert(ht, &array[i]));
+	TEST_CHECK(fr_hash_table_num_elements(ht) == HASH_TABLE_TEST_SIZE);
+
+	TEST_CHECK(!fr_hash_table_insert(ht, &array[0]));
+	TEST_MSG("element inserted twice");
+	fr_hash_table_verify(ht);
+
+	TEST_CASE("lookups");
+	for (i = 0; i < HASH_TABLE_TEST_SIZE; i++) {
+		p = fr_hash_table_find(ht, &i);
+		TEST_CHECK(p == &array[i]);
+		TEST_MSG("failed finding %u", i);
+
+		TEST_CHECK(fr_hash_table_find_by_key(ht, hash_test_int_hash(&i), &i) == &array[i]);
+	}
+	i = HASH_TABLE_TEST_SIZE;
+	TEST_CHECK(fr_hash_table_find(ht, &i) == NULL);
+
+	TEST_CASE("deletions");
+	for (i = 0; i < HASH_TABLE_TEST_SIZE; i += 2) TEST_CHECK(fr_hash_table_remove(ht, &array[i]) == &array[i]);
+	TEST_CHECK(fr_hash_table_remove(ht, &array[0]) == NULL);
+	TEST_CHECK(fr_hash_table_num_elements(ht) == HASH_TABLE_TEST_SIZE / 2);
+	fr_hash_table_verify(ht);
+
+	for (i = 0; i < HASH_TABLE_TEST_SIZE; i++) {
+		p = fr_hash_table_find(ht, &i);
+		TEST_CHECK(p == ((i & 0x01) ? &array[i] : NULL));
+		TEST_MSG("unexpected result finding %u", i);
+	}
+
+	TEST_CASE("iteration");
+	count = 0;
+	for (p = fr_hash_table_iter_init(ht, &iter);
+	     p;
+	     p = fr_hash_table_iter_next(ht, &iter)) {
+		TEST_CHECK((*p & 0x01) != 0);
+		count++;
+	}
+	TEST_CHECK(count == HASH_TABLE_TEST_SIZE / 2);
+	TEST_MSG("iterated over %u elements, expected %u", count, HASH_TABLE_TEST_SIZE / 2);
+
+	/*
+	 *	Churn the table, so open tables have to deal with
+	 *	deleted slots.
+	 */
+	TEST_CASE("churn");
+	for (count = 0; count < 8; count++) {
+		for (i = 0; i < HASH_TABLE_TEST_SIZE; i += 2) TEST_CHECK(fr_hash_table_insert(ht, &array[i]));
+		for (i = 0; i < HASH_TABLE_TEST_SIZE; i += 2) TEST_CHECK(fr_hash_table_delete(ht, &array[i]));
+	}
+	TEST_CHECK(fr_hash_table_num_elements(ht) == HASH_TABLE_TEST_SIZE / 2);
+	fr_hash_table_verify(ht);
+
+	for (i = 1; i < HASH_TABLE_TEST_SIZE; i += 2) TEST_CHECK(fr_hash_table_find(ht, &i) == &array[i]);
+
+	TEST_CASE("replace");
+	TEST_CHECK(fr_hash_table_replace((void **)&p, ht, &array[1]) == 0);
+	TEST_CHECK(p == &array[1]);
+	TEST_CHECK(fr_hash_table_replace((void **)&p, ht, &array[0]) == 1);
+	TEST_CHECK(p == NULL);
+	TEST_CHECK(fr_hash_table_find(ht, &array[0]) == &array[0]);
+
+	talloc_free(ht);
+	talloc_free(array);
+}
+
+static void hash_test_table_chained(void)
+{
+	hash_test_table(FR_HASH_TABLE_CHAINED);
+}
+
+static void hash_test_table_open(void)
+{
+	hash_test_table(FR_HASH_TABLE_OPEN_ADDRESSING);
+}
+
+/*
+ *	Compare the speed of the hashes for key sizes typical of
+ *	RADIUS.  IPv4 addresses, MAC addresses, State, Message-
+ *	Authenticator, User-Name, and the largest attributes.
+ */
+#define HASH_BENCH_REPS		(1 << 20)
+
+static void hash_bench(void)
+{
+	static size_t const	sizes[] = { 4, 6, 16, 20, 32, 64, 128, 253 };
+	uint8_t			buffer[256];
+	size_t			i;
+	uint32_t		r;
+	volatile uint32_t	sink = 0;
+
+	fr_time_start();
+	hash_random_fill(buffer, sizeof(buffer));
+
+	for (i = 0; i < NUM_ELEMENTS(sizes); i++) {
+		fr_time_t	start;
+		fr_time_delta_t	fnv, hash64;
+
+		start = fr_time();
+		for (r = 0; r < HASH_BENCH_REPS; r++) {
+			buffer[0] = r;
+			sink += hash_fnv(buffer, sizes[i]);
+		}
+		fnv = fr_time() - start;
+
+		start = fr_time();
+		for (r = 0; r < HASH_BENCH_REPS; r++) {
+			buffer[0] = r;
+			sink += fr_hash(buffer, sizes[i]);
+		}
+		hash64 = fr_time() - start;
+
+		TEST_MSG_ALWAYS("size=%zu fnv_ns=%0.2f hash_ns=%0.2f", sizes[i],
+				(double)fnv / HASH_BENCH_REPS, (double)hash64 / HASH_BENCH_REPS);
+	}
+	(void)sink;
+}
+
+/*
+ *	Compare lookup speed of the two kinds of table, for
+ *	hits and misses, at different sizes.
+ */
+#define HASH_TABLE_BENCH_LOOKUPS	(1 << 22)
+
+static void hash_table_bench(void)
+{
+	static uint32_t const	sizes[] = { 64, 1024, 1 << 16, 1 << 20 };
+	static fr_hash_table_flags_t const	flags[] = { FR_HASH_TABLE_CHAINED, FR_HASH_TABLE_OPEN_ADDRESSING };
+	static char const	*names[] = { "chained", "open" };
+	uint32_t		*array, i, j, r, k;
+	volatile uintptr_t	sink = 0;
+
+	fr_time_start();
+
+	array = talloc_array(NULL, uint32_t, sizes[NUM_ELEMENTS(sizes) - 1]);
+	for (i = 0; i < sizes[NUM_ELEMENTS(sizes) - 1]; i++) array[i] = i;
+
+	for (i = 0; i < NUM_ELEMENTS(sizes); i++) {
+		for (j = 0; j < NUM_ELEMENTS(flags); j++) {
+			fr_hash_table_t	*ht;
+			fr_time_t	start;
+			fr_time_delta_t	hit, miss;
+
+			ht = _fr_hash_table_alloc(NULL, NULL, flags[j], hash_test_int_hash, hash_test_int_cmp, NULL);
+			for (k = 0; k < sizes[i]; k++) fr_hash_table_insert(ht, &array[k]);
+			fr_hash_table_fill(ht);
+
+			start = fr_time();
+			for (r = 0; r < HASH_TABLE_BENCH_LOOKUPS; r++) {
+				k = (r * 2654435761U) & (sizes[i] - 1);
+				sink += (uintptr_t)fr_hash_table_find(ht, &k);
+			}
+			hit = fr_time() - start;
+
+			start = fr_time();
+			for (r = 0; r < HASH_TABLE_BENCH_LOOKUPS; r++) {
+				k = sizes[i] + r;
+				sink += (uintptr_t)fr_hash_table_find(ht, &k);
+			}
+			miss = fr_time() - start;
+
+			TEST_MSG_ALWAYS("table=%s elements=%u hit_ns=%0.2f miss_ns=%0.2f", names[j], sizes[i],
+					(double)hit / HASH_TABLE_BENCH_LOOKUPS, (double)miss / HASH_TABLE_BENCH_LOOKUPS);
+
+			talloc_free(ht);
+		}
+	}
+	(void)sink;
+
+	talloc_free(array);
+}
+
+TEST_LIST = {
+	{ "hash_test_lengths",		hash_test_lengths	},
+	{ "hash_test_seeded",		hash_test_seeded	},
+	{ "hash_test_case",		hash_test_case		},
+	{ "hash_test_distribution",	hash_test_distribution	},
+	{ "hash_test_table_chained",	hash_test_table_chained	},
+	{ "hash_test_table_open",	hash_test_table_open	},
+	{ "hash_bench",			hash_bench		},
+	{ "hash_table_bench",		hash_table_bench	},
+	{ NULL }
+};
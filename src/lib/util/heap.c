@@ -34,8 +34,21 @@ RCSID("$Id$")
  *	of the minimum element.  The heap entry can contain an "int"
  *	field that holds the entries position in the heap.  The offset
  *	of the field is held inside of the heap structure.
+ *
+ *	Keyed heaps are 4-ary, and store a copy of the element's
+ *	64bit key next to the pointer.  Comparisons don't dereference
+ *	the elements, and the array is laid out so that the children
+ *	of a node all sit in one cache line.
  */
 
+/** A node in a keyed heap
+ *
+ */
+typedef struct {
+	int64_t		key;			//!< Copy of the key from the element.
+	void		*data;			//!< The element.
+} fr_heap_slot_t;
+
 struct fr_heap_s {
 	size_t		size;			//!< Number of nodes allocated.
 	size_t		offset;			//!< Offset of heap index in element structure.
@@ -46,6 +59,11 @@ struct fr_heap_s {
 	fr_heap_cmp_t	cmp;			//!< Comparator function.
 
 	void		**p;			//!< Array of nodes.
+
+	bool		keyed;			//!< Use the keyed 4-ary layout.
+	size_t		key_offset;		//!< Offset of the int64_t key in element structure.
+	fr_heap_slot_t	*slots;			//!< Array of nodes for keyed heaps.
+	uint8_t		*slots_buff;		//!< Allocation which slots points into.
 };
 
 /*
@@ -58,6 +76,16 @@ struct fr_heap_s {
 /* #define HEAP_RIGHT(_x) (2 * (_x) + 2 ) */
 #define	HEAP_SWAP(_a, _b) { void *_tmp = _a; _a = _b; _b = _tmp; }
 
+/*
+ *	Children of i in a keyed heap are 4i+1 to 4i+4.  The slots
+ *	array starts KEYED_ARITY - 1 slots into a cache line, so that
+ *	each group of children is cache line aligned.
+ */
+#define KEYED_ARITY		4
+#define KEYED_PARENT(_x)	(((_x) - 1) / KEYED_ARITY)
+#define KEYED_FIRST(_x)		((KEYED_ARITY * (_x)) + 1)
+#define KEYED_CACHE_LINE	64
+
 static void fr_heap_bubble(fr_heap_t *hp, int32_t child);
 
 fr_heap_t *_fr_heap_alloc(TALLOC_CTX *ctx, fr_heap_cmp_t cmp, char const *type, size_t offset)
@@ -81,6 +109,70 @@ fr_heap_t *_fr_heap_alloc(TALLOC_CTX *ctx, fr_heap_cmp_t cmp, char const *type,
 	return fh;
 }
 
+/** (Re)allocate the slots for a keyed heap, keeping the existing nodes
+ *
+ */
+static int keyed_resize(fr_heap_t *hp, size_t n_size)
+{
+	uint8_t		*buff;
+	uintptr_t	base;
+	fr_heap_slot_t	*slots;
+
+	buff = talloc_array(hp, uint8_t, ((n_size + KEYED_ARITY - 1) * sizeof(fr_heap_slot_t)) + KEYED_CACHE_LINE);
+	if (!buff) {
+		fr_strerror_printf("Failed expanding heap to %zu elements (%zu bytes)",
+				   n_size, (n_size * sizeof(fr_heap_slot_t)));
+		return -1;
+	}
+
+	base = ((uintptr_t)buff + (KEYED_CACHE_LINE - 1)) & ~((uintptr_t)KEYED_CACHE_LINE - 1);
+	slots = ((fr_heap_slot_t *)base) + (KEYED_ARITY - 1);
+
+	if (hp->slots) memcpy(slots, hp->slots, hp->num_elements * sizeof(fr_heap_slot_t));
+	talloc_free(hp->slots_buff);
+
+	hp->slots_buff = buff;
+	hp->slots = slots;
+	hp->size = n_size;
+
+	return 0;
+}
+
+/** Create a 4-ary heap ordered by an int64_t key in each element
+ *
+ * Elements are ordered by the key alone, smallest first.  The key is
+ * copied into the heap on insert, so it must not be changed while
+ * the element is in the heap.  Extract the element, update the key,
+ * and insert it again.
+ *
+ * @param[in] ctx		Talloc ctx to allocate heap in.
+ * @param[in] talloc_type	of elements, or NULL.
+ * @param[in] offset		of the heap index in the element.
+ * @param[in] key_offset	of the int64_t key in the element.
+ * @return
+ *	- A new heap.
+ *	- NULL on error.
+ */
+fr_heap_t *_fr_heap_keyed_alloc(TALLOC_CTX *ctx, char const *talloc_type, size_t offset, size_t key_offset)
+{
+	fr_heap_t *fh;
+
+	fh = talloc_zero(ctx, fr_heap_t);
+	if (!fh) return NULL;
+
+	fh->type = talloc_type;
+	fh->offset = offset;
+	fh->keyed = true;
+	fh->key_offset = key_offset;
+
+	if (keyed_resize(fh, 2048) < 0) {
+		talloc_free(fh);
+		return NULL;
+	}
+
+	return fh;
+}
+
 static inline CC_HINT(always_inline) CC_HINT(nonnull) int32_t index_get(fr_heap_t *hp, void *data)
 {
 	return *((int32_t const *)(((uint8_t const *)data) + hp->offset));
@@ -94,6 +186,64 @@ static inline CC_HINT(always_inline) CC_HINT(nonnull) void index_set(fr_heap_t *
 #define OFFSET_SET(_heap, _idx) index_set(_heap, _heap->p[_idx], _idx);
 #define OFFSET_RESET(_heap, _idx) index_set(_heap, _heap->p[_idx], -1);
 
+static inline CC_HINT(always_inline) CC_HINT(nonnull) int64_t key_get(fr_heap_t *hp, void *data)
+{
+	return *((int64_t const *)(((uint8_t const *)data) + hp->key_offset));
+}
+
+/** Move a hole up from child, until slot can be placed in it
+ *
+ */
+static inline CC_HINT(always_inline) void keyed_sift_up(fr_heap_t *hp, int32_t child, fr_heap_slot_t slot)
+{
+	while (child > 0) {
+		int32_t parent = KEYED_PARENT(child);
+
+		if (hp->slots[parent].key <= slot.key) break;
+
+		hp->slots[child] = hp->slots[parent];
+		index_set(hp, hp->slots[child].data, child);
+		child = parent;
+	}
+
+	hp->slots[child] = slot;
+	index_set(hp, slot.data, child);
+}
+
+/** Move a hole down from parent, until slot can be placed in it
+ *
+ */
+static inline CC_HINT(always_inline) void keyed_sift_down(fr_heap_t *hp, int32_t parent, fr_heap_slot_t slot)
+{
+	int32_t num = hp->num_elements;
+
+	for (;;) {
+		int32_t first = KEYED_FIRST(parent), last, min, i;
+
+		if (first >= num) break;
+
+		last = first + KEYED_ARITY;
+		if (last > num) last = num;
+
+		/*
+		 *	All the children are in one cache line.
+		 */
+		min = first;
+		for (i = first + 1; i < last; i++) {
+			if (hp->slots[i].key < hp->slots[min].key) min = i;
+		}
+
+		if (hp->slots[min].key >= slot.key) break;
+
+		hp->slots[parent] = hp->slots[min];
+		index_set(hp, hp->slots[parent].data, parent);
+		parent = min;
+	}
+
+	hp->slots[parent] = slot;
+	index_set(hp, slot.data, parent);
+}
+
 /** Insert a new element into the heap
  *
  * Insert element in heap. Normally, p != NULL, we insert p in a
@@ -126,7 +276,8 @@ int fr_heap_insert(fr_heap_t *hp, void *data)
 	 *	     function
 	 */
 	child = index_get(hp, data);
-	if ((child > 0) || ((child == 0) && (hp->num_elements > 0) && (data == hp->p[0]))) {
+	if ((child > 0) || ((child == 0) && (hp->num_elements > 0) &&
+			    (data == (hp->keyed ? hp->slots[0].data : hp->p[0])))) {
 		fr_strerror_const("Node is already in the heap");
 		return -1;
 	}
@@ -159,6 +310,11 @@ int fr_heap_insert(fr_heap_t *hp, void *data)
 			}
 		}
 
+		if (hp->keyed) {
+			if (keyed_resize(hp, n_size) < 0) return -1;
+			goto insert;
+		}
+
 		n = talloc_realloc(hp, hp->p, void *, n_size);
 		if (!n) {
 			fr_strerror_printf("Failed expanding heap to %zu elements (%zu bytes)",
@@ -169,6 +325,13 @@ int fr_heap_insert(fr_heap_t *hp, void *data)
 		hp->p = n;
 	}
 
+insert:
+	if (hp->keyed) {
+		hp->num_elements++;
+		keyed_sift_up(hp, child, (fr_heap_slot_t){ .key = key_get(hp, data), .data = data });
+		return 0;
+	}
+
 	hp->p[child] = data;
 	hp->num_elements++;
 
@@ -217,7 +380,7 @@ int fr_heap_extract(fr_heap_t *hp, void *data)
 	 *	Extract element.  Default is the first one (pop)
 	 */
 	if (!data) {
-		if (unlikely((hp->num_elements == 0) || !hp->p[0])) {
+		if (unlikely((hp->num_elements == 0) || !(hp->keyed ? hp->slots[0].data : hp->p[0]))) {
 			fr_strerror_const("Tried to extract element from empty heap");
 			return -1;
 		}
@@ -233,14 +396,34 @@ int fr_heap_extract(fr_heap_t *hp, void *data)
 			return -1;
 		}
 
-		if (unlikely(data != hp->p[parent])) {
+		if (unlikely(data != (hp->keyed ? hp->slots[parent].data : hp->p[parent]))) {
 			fr_strerror_printf("Invalid heap index.  Expected data %p at offset %i, got %p", data,
-					   parent, hp->p[parent]);
+					   parent, hp->keyed ? hp->slots[parent].data : hp->p[parent]);
 			return -1;
 		}
 	}
 	max = hp->num_elements - 1;
 
+	if (hp->keyed) {
+		fr_heap_slot_t last;
+
+		index_set(hp, hp->slots[parent].data, -1);
+		hp->num_elements--;
+		if (parent == max) return 0;
+
+		/*
+		 *	Fill the hole with the last node, and move it
+		 *	whichever way it needs to go.
+		 */
+		last = hp->slots[max];
+		if ((parent > 0) && (last.key < hp->slots[KEYED_PARENT(parent)].key)) {
+			keyed_sift_up(hp, parent, last);
+		} else {
+			keyed_sift_down(hp, parent, last);
+		}
+		return 0;
+	}
+
 	OFFSET_RESET(hp, parent);
 	child = HEAP_LEFT(parent);
 	while (child <= max) {
@@ -280,7 +463,7 @@ void *fr_heap_peek(fr_heap_t *hp)
 {
 	if (!hp || (hp->num_elements == 0)) return NULL;
 
-	return hp->p[0];
+	return hp->keyed ? hp->slots[0].data : hp->p[0];
 }
 
 void *fr_heap_pop(fr_heap_t *hp)
@@ -289,7 +472,7 @@ void *fr_heap_pop(fr_heap_t *hp)
 
 	if (hp->num_elements == 0) return NULL;
 
-	data = hp->p[0];
+	data = hp->keyed ? hp->slots[0].data : hp->p[0];
 	(void) fr_heap_extract(hp, data);
 
 	return data;
@@ -303,7 +486,7 @@ void *fr_heap_peek_tail(fr_heap_t *hp)
 	/*
 	 *	If this is NULL, we have a problem.
 	 */
-	return hp->p[hp->num_elements - 1];
+	return hp->keyed ? hp->slots[hp->num_elements - 1].data : hp->p[hp->num_elements - 1];
 }
 
 uint32_t fr_heap_num_elements(fr_heap_t *hp)
@@ -330,7 +513,7 @@ void *fr_heap_iter_init(fr_heap_t *hp, fr_heap_iter_t *iter)
 
 	if (unlikely(!hp) || (hp->num_elements == 0)) return NULL;
 
-	return hp->p[0];
+	return hp->keyed ? hp->slots[0].data : hp->p[0];
 }
 
 /** Get the next entry in a heap
@@ -351,5 +534,5 @@ void *fr_heap_iter_next(fr_heap_t *hp, fr_heap_iter_t *iter)
 	if ((*iter + 1) >= hp->num_elements) return NULL;
 	*iter += 1;
 
-	return hp->p[*iter];
+	return hp->keyed ? hp->slots[*iter].data : hp->p[*iter];
 }
@@ -67,8 +67,38 @@ typedef struct fr_heap_s fr_heap_t;
 #define fr_heap_talloc_alloc(_ctx, _cmp, _talloc_type, _field) \
 	_fr_heap_alloc(_ctx, _cmp, #_talloc_type, (size_t)offsetof(_talloc_type, _field))
 
+/** Creates a 4-ary heap ordered by an int64_t (e.g. #fr_time_t) key in each element
+ *
+ * The key is stored in the heap next to the element pointer, so
+ * comparisons don't touch the elements.  Use this for large heaps
+ * with a simple time ordering.
+ *
+ * @param[in] _ctx		Talloc ctx to allocate heap in.
+ * @param[in] _type		Of elements.
+ * @param[in] _field		to store heap indexes in.
+ * @param[in] _key_field	int64_t field to order by.
+ */
+#define fr_heap_keyed_alloc(_ctx, _type, _field, _key_field) \
+	_fr_heap_keyed_alloc(_ctx, NULL, (size_t)offsetof(_type, _field), (size_t)offsetof(_type, _key_field))
+
+/** Creates a keyed heap that verifies elements are of a specific talloc type
+ *
+ * @param[in] _ctx		Talloc ctx to allocate heap in.
+ * @param[in] _talloc_type	of elements.
+ * @param[in] _field		to store heap indexes in.
+ * @param[in] _key_field	int64_t field to order by.
+ * @return
+ *	- A new heap.
+ *	- NULL on error.
+ */
+#define fr_heap_keyed_talloc_alloc(_ctx, _talloc_type, _field, _key_field) \
+	_fr_heap_keyed_alloc(_ctx, #_talloc_type, (size_t)offsetof(_talloc_type, _field), \
+			     (size_t)offsetof(_talloc_type, _key_field))
+
 fr_heap_t	*_fr_heap_alloc(TALLOC_CTX *ctx, fr_heap_cmp_t cmp, char const *talloc_type, size_t offset) CC_HINT(nonnull(2));
 
+fr_heap_t	*_fr_heap_keyed_alloc(TALLOC_CTX *ctx, char const *talloc_type, size_t offset, size_t key_offset);
+
 /** Check if an entry is inserted into a heap
  *
  */
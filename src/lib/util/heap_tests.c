@@ -2,16 +2,15 @@
 
 #include "heap.c"
 
+#include <freeradius-devel/util/time.h>
+
 static bool fr_heap_check(fr_heap_t *hp, void *data)
 {
-	int i;
-
-	if (!hp || (hp->num_elements == 0)) return false;
+	fr_heap_iter_t	iter;
+	void		*p;
 
-	for (i = 0; i < hp->num_elements; i++) {
-		if (hp->p[i] == data) {
-			return true;
-		}
+	for (p = fr_heap_iter_init(hp, &iter); p; p = fr_heap_iter_next(hp, &iter)) {
+		if (p == data) return true;
 	}
 
 	return false;
@@ -20,6 +19,7 @@ static bool fr_heap_check(fr_heap_t *hp, void *data)
 typedef struct {
 	int	data;
 	int32_t	heap;		/* for the heap */
+	int64_t	key;		/* copy of data, for keyed heaps */
 } heap_thing;
 
 
@@ -35,9 +35,16 @@ static int8_t heap_cmp(void const *one, void const *two)
 	return (a->data > b->data) - (a->data < b->data);
 }
 
+static fr_heap_t *heap_test_alloc(bool keyed)
+{
+	if (keyed) return fr_heap_keyed_alloc(NULL, heap_thing, heap, key);
+
+	return fr_heap_alloc(NULL, heap_cmp, heap_thing, heap);
+}
+
 #define HEAP_TEST_SIZE (4096)
 
-static void heap_test(int skip)
+static void heap_test(int skip, bool keyed)
 {
 	fr_heap_t	*hp;
 	int		i;
@@ -52,7 +59,7 @@ static void heap_test(int skip)
 		done_init = true;
 	}
 
-	hp = fr_heap_alloc(NULL, heap_cmp, heap_thing, heap);
+	hp = heap_test_alloc(keyed);
 	TEST_CHECK(hp != NULL);
 
 	array = malloc(sizeof(heap_thing) * HEAP_TEST_SIZE);
@@ -60,7 +67,11 @@ static void heap_test(int skip)
 	/*
 	 *	Initialise random values
 	 */
-	for (i = 0; i < HEAP_TEST_SIZE; i++) array[i].data = rand() % 65537;
+	for (i = 0; i < HEAP_TEST_SIZE; i++) {
+		array[i].data = rand() % 65537;
+		array[i].key = array[i].data;
+		array[i].heap = 0;
+	}
 
 #if 0
 	for (i = 0; i < HEAP_TEST_SIZE; i++) {
@@ -100,14 +111,23 @@ static void heap_test(int skip)
 	}
 
 	left = fr_heap_num_elements(hp);
-	for (i = 0; i < left; i++) {
-		heap_thing *t;
+	{
+		int last = -1;
 
-		TEST_CHECK((t = fr_heap_peek(hp)) != NULL);
-		TEST_MSG("expected %i elements remaining in the heap", left - i);
+		for (i = 0; i < left; i++) {
+			heap_thing *t;
 
-		TEST_CHECK(fr_heap_extract(hp, NULL) >= 0);
-		TEST_MSG("failed extracting %i", i);
+			TEST_CHECK((t = fr_heap_peek(hp)) != NULL);
+			TEST_MSG("expected %i elements remaining in the heap", left - i);
+			if (!t) break;
+
+			TEST_CHECK(t->data >= last);
+			TEST_MSG("element with value %i popped after %i", t->data, last);
+			last = t->data;
+
+			TEST_CHECK(fr_heap_extract(hp, NULL) >= 0);
+			TEST_MSG("failed extracting %i", i);
+		}
 	}
 
 	TEST_CHECK((ret = fr_heap_num_elements(hp)) == 0);
@@ -119,22 +139,37 @@ static void heap_test(int skip)
 
 static void heap_test_skip_0(void)
 {
-	heap_test(1);
+	heap_test(1, false);
 }
 
 static void heap_test_skip_2(void)
 {
-	heap_test(2);
+	heap_test(2, false);
 }
 
 static void heap_test_skip_10(void)
 {
-	heap_test(10);
+	heap_test(10, false);
+}
+
+static void heap_keyed_test_skip_0(void)
+{
+	heap_test(1, true);
+}
+
+static void heap_keyed_test_skip_2(void)
+{
+	heap_test(2, true);
+}
+
+static void heap_keyed_test_skip_10(void)
+{
+	heap_test(10, true);
 }
 
 #define HEAP_CYCLE_SIZE (1600000)
 
-static void heap_cycle(void)
+static void heap_cycle(bool keyed)
 {
 	fr_heap_t	*hp;
 	int		i;
@@ -150,7 +185,7 @@ static void heap_cycle(void)
 		done_init = true;
 	}
 
-	hp = fr_heap_alloc(NULL, heap_cmp, heap_thing, heap);
+	hp = heap_test_alloc(keyed);
 	TEST_CHECK(hp != NULL);
 
 	array = malloc(sizeof(heap_thing) * HEAP_CYCLE_SIZE);
@@ -159,7 +194,11 @@ static void heap_cycle(void)
 	/*
 	 *	Initialise random values
 	 */
-	for (i = 0; i < HEAP_CYCLE_SIZE; i++) array[i].data = rand() % 65537;
+	for (i = 0; i < HEAP_CYCLE_SIZE; i++) {
+		array[i].data = rand() % 65537;
+		array[i].key = array[i].data;
+		array[i].heap = 0;
+	}
 
 	TEST_CASE("insertions");
 	for (i = 0; i < HEAP_CYCLE_SIZE; i++) {
@@ -216,6 +255,75 @@ static void heap_cycle(void)
 	free(remaining);
 }
 
+static void heap_cycle_binary(void)
+{
+	heap_cycle(false);
+}
+
+static void heap_cycle_keyed(void)
+{
+	heap_cycle(true);
+}
+
+/*
+ *	Compare the binary and keyed heaps, with the access pattern
+ *	of a timer list.  Elements are inserted with random times,
+ *	then the heap is churned by popping the first element and
+ *	inserting it again with a later time.
+ */
+#define HEAP_BENCH_OPS		(1 << 22)
+
+static void heap_bench(void)
+{
+	static int32_t const	sizes[] = { 1024, 1 << 16, 1 << 20 };
+	static char const	*names[] = { "binary", "keyed" };
+	heap_thing		*array;
+	int32_t			i;
+	size_t			j;
+
+	fr_time_start();
+
+	array = talloc_array(NULL, heap_thing, sizes[NUM_ELEMENTS(sizes) - 1]);
+
+	for (j = 0; j < NUM_ELEMENTS(sizes); j++) {
+		int k;
+
+		for (k = 0; k < 2; k++) {
+			fr_heap_t	*hp;
+			fr_time_t	start;
+			fr_time_delta_t	insert, churn;
+
+			hp = heap_test_alloc(k == 1);
+			for (i = 0; i < sizes[j]; i++) {
+				array[i].data = rand() % (sizes[j] * 4);
+				array[i].key = array[i].data;
+				array[i].heap = -1;
+			}
+
+			start = fr_time();
+			for (i = 0; i < sizes[j]; i++) fr_heap_insert(hp, &array[i]);
+			insert = fr_time() - start;
+
+			start = fr_time();
+			for (i = 0; i < HEAP_BENCH_OPS; i++) {
+				heap_thing *t = fr_heap_pop(hp);
+
+				t->data += rand() % (sizes[j] * 4);
+				t->key = t->data;
+				fr_heap_insert(hp, t);
+			}
+			churn = fr_time() - start;
+
+			TEST_MSG_ALWAYS("heap=%s elements=%i insert_ns=%0.2f churn_ns=%0.2f", names[k], sizes[j],
+					(double)insert / sizes[j], (double)churn / HEAP_BENCH_OPS);
+
+			talloc_free(hp);
+		}
+	}
+
+	talloc_free(array);
+}
+
 TEST_LIST = {
 	/*
 	 *	Basic tests
@@ -223,7 +331,17 @@ TEST_LIST = {
 	{ "heap_test_skip_0",		heap_test_skip_0	},
 	{ "heap_test_skip_2",		heap_test_skip_2	},
 	{ "heap_test_skip_10",		heap_test_skip_10	},
-	{ "heap_cycle",			heap_cycle		},
+	{ "heap_cycle",			heap_cycle_binary	},
+
+	/*
+	 *	4-ary heap, with the keys inline
+	 */
+	{ "heap_keyed_test_skip_0",	heap_keyed_test_skip_0	},
+	{ "heap_keyed_test_skip_2",	heap_keyed_test_skip_2	},
+	{ "heap_keyed_test_skip_10",	heap_keyed_test_skip_10	},
+	{ "heap_keyed_cycle",		heap_cycle_keyed	},
+
+	{ "heap_bench",			heap_bench		},
 	{ NULL }
 };
 
@@ -0,0 +1,165 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Log-linear histograms, for recording latencies
+ *
+ * Values are put into buckets by their most significant bit, and then
+ * by the next (FR_HIST_SUB_BITS - 1) bits.  So the buckets are linear
+ * within each power of two, and the relative error is constant.
+ *
+ * @file src/lib/util/hist.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/hist.h>
+
+/** Return the bucket which a value is recorded in
+ *
+ */
+size_t fr_hist_index(uint64_t value)
+{
+	int	msb, shift;
+
+	if (value < (FR_HIST_SUB_HALF * 2)) return value;
+
+	msb = 63 - __builtin_clzll(value);
+	shift = msb - FR_HIST_SUB_BITS + 1;
+
+	return ((size_t) shift << (FR_HIST_SUB_BITS - 1)) + (value >> shift);
+}
+
+/** Return the highest value which is recorded in a bucket
+ *
+ */
+uint64_t fr_hist_value(size_t idx)
+{
+	int		shift;
+	uint64_t	sub;
+
+	if (idx < (FR_HIST_SUB_HALF * 2)) return idx;
+
+	shift = (idx >> (FR_HIST_SUB_BITS - 1)) - 1;
+	sub = idx - ((size_t) shift << (FR_HIST_SUB_BITS - 1));
+
+	return ((sub + 1) << shift) - 1;
+}
+
+/** Record a value
+ *
+ */
+void fr_hist_add(fr_hist_t *hist, uint64_t value)
+{
+	hist->count[fr_hist_index(value)]++;
+	if (!hist->total || (value < hist->min)) hist->min = value;
+	if (value > hist->max) hist->max = value;
+	hist->total++;
+	hist->sum += value;
+	hist->sum_sq += (double) value * value;
+}
+
+/** Add the values recorded in one histogram to another
+ *
+ */
+void fr_hist_merge(fr_hist_t *to, fr_hist_t const *from)
+{
+	size_t i;
+
+	if (!from->total) return;
+
+	for (i = 0; i < FR_HIST_NUM_BUCKETS; i++) to->count[i] += from->count[i];
+	if (!to->total || (from->min < to->min)) to->min = from->min;
+	if (from->max > to->max) to->max = from->max;
+	to->total += from->total;
+	to->sum += from->sum;
+	to->sum_sq += from->sum_sq;
+}
+
+/** Return the value at a percentile
+ *
+ * @param[in] hist	to search.
+ * @param[in] pct	percentile, 0 to 100.
+ * @return
+ *	- 0 if no values have been recorded.
+ *	- the highest value in the bucket which holds the percentile,
+ *	  clamped to the recorded minimum and maximum.
+ */
+uint64_t fr_hist_percentile(fr_hist_t const *hist, double pct)
+{
+	uint64_t	want, seen = 0;
+	size_t		i;
+
+	if (!hist->total) return 0;
+
+	want = (uint64_t) ((pct * hist->total) / 100 + 0.5);
+	if (want < 1) want = 1;
+
+	for (i = 0; i < FR_HIST_NUM_BUCKETS; i++) {
+		seen += hist->count[i];
+		if (seen >= want) {
+			uint64_t value = fr_hist_value(i);
+
+			if (value < hist->min) return hist->min;
+			return (value > hist->max) ? hist->max : value;
+		}
+	}
+
+	return hist->max;
+}
+
+/** Return how many values were recorded in the buckets up to, and including, the one holding value
+ *
+ */
+uint64_t fr_hist_count_le(fr_hist_t const *hist, uint64_t value)
+{
+	uint64_t	count = 0;
+	size_t		i, idx;
+
+	idx = fr_hist_index(value);
+	for (i = 0; (i <= idx) && (i < FR_HIST_NUM_BUCKETS); i++) count += hist->count[i];
+
+	return count;
+}
+
+double fr_hist_mean(fr_hist_t const *hist)
+{
+	if (!hist->total) return 0;
+
+	return hist->sum / hist->total;
+}
+
+/** Return the standard deviation of the recorded values
+ *
+ * The square root is done with Newton's method, so that we don't
+ * need libm.
+ */
+double fr_hist_stddev(fr_hist_t const *hist)
+{
+	double	mean, var, r;
+	int	i;
+
+	if (!hist->total) return 0;
+
+	mean = hist->sum / hist->total;
+	var = (hist->sum_sq / hist->total) - (mean * mean);
+	if (var <= 0) return 0;
+
+	r = var;
+	for (i = 0; i < 64; i++) r = (r + (var / r)) / 2;
+
+	return r;
+}
@@ -0,0 +1,75 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Log-linear histograms, for recording latencies
+ *
+ * @file src/lib/util/hist.h
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(hist_h, "$Id$")
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *	There are 2^(FR_HIST_SUB_BITS - 1) linear buckets for each
+ *	power of two, which gives an error of less than 2% for any
+ *	recorded value.  Values below 2^FR_HIST_SUB_BITS are exact.
+ */
+#define FR_HIST_SUB_BITS	7
+#define FR_HIST_SUB_HALF	(1 << (FR_HIST_SUB_BITS - 1))
+#define FR_HIST_NUM_BUCKETS	((64 - FR_HIST_SUB_BITS + 2) * FR_HIST_SUB_HALF)
+
+/** A histogram of unsigned 64-bit values
+ *
+ * The structure is fixed size, and may be allocated with talloc_zero(),
+ * or zeroed and used in place.  It is not thread-safe.  Threads should
+ * record into their own histograms, and merge them with #fr_hist_merge.
+ */
+typedef struct {
+	uint64_t		count[FR_HIST_NUM_BUCKETS];
+	uint64_t		total;		//!< Number of values recorded.
+	uint64_t		min;		//!< Smallest value recorded.
+	uint64_t		max;		//!< Largest value recorded.
+	double			sum;		//!< For the mean.
+	double			sum_sq;		//!< For the standard deviation.
+} fr_hist_t;
+
+size_t		fr_hist_index(uint64_t value);
+
+uint64_t	fr_hist_value(size_t idx);
+
+void		fr_hist_add(fr_hist_t *hist, uint64_t value) CC_HINT(nonnull);
+
+void		fr_hist_merge(fr_hist_t *to, fr_hist_t const *from) CC_HINT(nonnull);
+
+uint64_t	fr_hist_percentile(fr_hist_t const *hist, double pct) CC_HINT(nonnull);
+
+uint64_t	fr_hist_count_le(fr_hist_t const *hist, uint64_t value) CC_HINT(nonnull);
+
+double		fr_hist_mean(fr_hist_t const *hist) CC_HINT(nonnull);
+
+double		fr_hist_stddev(fr_hist_t const *hist) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
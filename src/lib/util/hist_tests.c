@@ -0,0 +1,100 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for log-linear histograms
+ *
+ * @file src/lib/util/hist_tests.c
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+#include <freeradius-devel/util/acutest.h>
+
+#include "hist.c"
+
+/*
+ *	Every value must land in a bucket whose upper bound is no
+ *	smaller than the value, and within 2% of it.
+ */
+static void hist_index_bounds(void)
+{
+	uint64_t	value;
+	size_t		idx;
+
+	for (value = 0; value < (1 << 20); value += 7) {
+		idx = fr_hist_index(value);
+
+		TEST_CHECK(idx < FR_HIST_NUM_BUCKETS);
+		TEST_CHECK(fr_hist_value(idx) >= value);
+		TEST_MSG("value %" PRIu64 " bucket %zu upper %" PRIu64, value, idx, fr_hist_value(idx));
+		TEST_CHECK((fr_hist_value(idx) - value) <= ((value / 50) + 1));
+	}
+
+	TEST_CHECK(fr_hist_index(UINT64_MAX) < FR_HIST_NUM_BUCKETS);
+	TEST_CHECK(fr_hist_value(fr_hist_index(UINT64_MAX)) == UINT64_MAX);
+}
+
+static void hist_percentiles(void)
+{
+	fr_hist_t	hist = {};
+	uint64_t	i, p50, p99;
+
+	TEST_CHECK(fr_hist_percentile(&hist, 50) == 0);
+
+	for (i = 1; i <= 10000; i++) fr_hist_add(&hist, i);
+
+	TEST_CHECK(hist.total == 10000);
+	TEST_CHECK(hist.min == 1);
+	TEST_CHECK(hist.max == 10000);
+	TEST_CHECK(fr_hist_percentile(&hist, 0) == 1);
+	TEST_CHECK(fr_hist_percentile(&hist, 100) == 10000);
+
+	p50 = fr_hist_percentile(&hist, 50);
+	TEST_CHECK((p50 >= 5000) && (p50 <= 5100));
+	TEST_MSG("p50 %" PRIu64, p50);
+
+	p99 = fr_hist_percentile(&hist, 99);
+	TEST_CHECK((p99 >= 9900) && (p99 <= 10000));
+	TEST_MSG("p99 %" PRIu64, p99);
+
+	TEST_CHECK(fr_hist_count_le(&hist, 100) == 100);
+	TEST_CHECK(fr_hist_mean(&hist) == 5000.5);
+}
+
+static void hist_merged(void)
+{
+	fr_hist_t	a = {}, b = {};
+
+	fr_hist_add(&a, 10);
+	fr_hist_add(&a, 20);
+	fr_hist_add(&b, 5);
+	fr_hist_add(&b, 1000);
+
+	fr_hist_merge(&a, &b);
+
+	TEST_CHECK(a.total == 4);
+	TEST_CHECK(a.min == 5);
+	TEST_CHECK(a.max == 1000);
+	TEST_CHECK(fr_hist_percentile(&a, 25) == 5);
+	TEST_CHECK(fr_hist_stddev(&a) > 0);
+}
+
+TEST_LIST = {
+	{ "hist_index_bounds",	hist_index_bounds },
+	{ "hist_percentiles",	hist_percentiles },
+	{ "hist_merged",	hist_merged },
+
+	{ NULL }
+};
@@ -0,0 +1,7 @@
+TARGET		:= hist_tests
+
+SOURCES		:= hist_tests.c
+
+TGT_LDLIBS	:= $(LIBS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(GPERFTOOLS_LDFLAGS)
+TGT_PREREQS	:= libfreeradius-util.a
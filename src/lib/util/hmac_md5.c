@@ -149,6 +149,100 @@ void fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *in, size_t in
 }
 #endif /* HAVE_OPENSSL_EVP_H */
 
+static int _hmac_md5_key_free(fr_hmac_md5_key_t *hkey)
+{
+	fr_md5_ctx_free(&hkey->inner);
+	fr_md5_ctx_free(&hkey->outer);
+
+	return 0;
+}
+
+/** Absorb the padded key blocks for a key which will be used many times
+ *
+ * For short messages most of the cost of an HMAC-MD5 is hashing the two
+ * padded key blocks.  When the key is fixed, e.g. a RADIUS shared secret,
+ * that can be done once, and #fr_hmac_md5_with_key then only has to hash
+ * the message.
+ *
+ * @param[in] ctx	to allocate the key in.
+ * @param[in] key	to precompute the HMAC state for.
+ * @param[in] key_len	of key.
+ * @return
+ *	- The precomputed key.
+ *	- NULL on error.
+ */
+fr_hmac_md5_key_t *fr_hmac_md5_key_alloc(TALLOC_CTX *ctx, uint8_t const *key, size_t key_len)
+{
+	fr_hmac_md5_key_t	*hkey;
+	uint8_t			k_ipad[64];
+	uint8_t			k_opad[64];
+	uint8_t			tk[16];
+	int			i;
+
+	hkey = talloc_zero(ctx, fr_hmac_md5_key_t);
+	if (!hkey) return NULL;
+	talloc_set_destructor(hkey, _hmac_md5_key_free);
+
+	hkey->inner = fr_md5_ctx_alloc(false);
+	hkey->outer = fr_md5_ctx_alloc(false);
+	if (!hkey->inner || !hkey->outer) {
+		talloc_free(hkey);
+		return NULL;
+	}
+
+	/* if key is longer than 64 bytes reset it to key=MD5(key) */
+	if (key_len > 64) {
+		fr_md5_calc(tk, key, key_len);
+
+		key = tk;
+		key_len = 16;
+	}
+
+	memset(k_ipad, 0, sizeof(k_ipad));
+	memset(k_opad, 0, sizeof(k_opad));
+	memcpy(k_ipad, key, key_len);
+	memcpy(k_opad, key, key_len);
+
+	for (i = 0; i < 64; i++) {
+		k_ipad[i] ^= 0x36;
+		k_opad[i] ^= 0x5c;
+	}
+
+	fr_md5_update(hkey->inner, k_ipad, sizeof(k_ipad));
+	fr_md5_update(hkey->outer, k_opad, sizeof(k_opad));
+
+	return hkey;
+}
+
+/** Calculate HMAC-MD5 using a precomputed key
+ *
+ * Produces the same digest as #fr_hmac_md5 with the key passed to
+ * #fr_hmac_md5_key_alloc.  The key is not modified, so it may be
+ * shared between threads.
+ *
+ * @param[out] digest	Caller digest to be filled in.
+ * @param[in] in	Pointer to data stream.
+ * @param[in] inlen	length of data stream.
+ * @param[in] key	from #fr_hmac_md5_key_alloc.
+ */
+void fr_hmac_md5_with_key(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *in, size_t inlen,
+			  fr_hmac_md5_key_t const *key)
+{
+	fr_md5_ctx_t	*ctx;
+
+	ctx = fr_md5_ctx_alloc(true);
+
+	fr_md5_ctx_copy(ctx, key->inner);
+	fr_md5_update(ctx, in, inlen);
+	fr_md5_final(digest, ctx);
+
+	fr_md5_ctx_copy(ctx, key->outer);
+	fr_md5_update(ctx, digest, MD5_DIGEST_LENGTH);
+	fr_md5_final(digest, ctx);
+
+	fr_md5_ctx_free(&ctx);
+}
+
 /*
 Test Vectors (Trailing '\0' of a character string not included in test):
 
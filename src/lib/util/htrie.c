@@ -102,7 +102,7 @@ fr_htrie_t *fr_htrie_alloc(TALLOC_CTX *ctx,
 			return NULL;
 		}
 
-		ht->store = fr_hash_table_alloc(ht, hash_data, cmp_data, free_data);
+		ht->store = fr_hash_table_open_alloc(ht, hash_data, cmp_data, free_data);
 		if (unlikely(!ht->store)) {
 		error:
 			talloc_free(ht);
@@ -117,7 +117,7 @@ fr_htrie_t *fr_htrie_alloc(TALLOC_CTX *ctx,
 			return NULL;
 		}
 
-		ht->store = fr_rb_alloc(ht, cmp_data, free_data);
+		ht->store = fr_rb_pool_alloc(ht, cmp_data, free_data);
 		if (unlikely(!ht->store)) goto error;
 		ht->funcs = default_funcs[type];
 		return ht;
@@ -22,6 +22,7 @@
  */
 #include <freeradius-devel/util/inet.h>
 #include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/resolve.h>
 #include <freeradius-devel/util/strerror.h>
 #include <freeradius-devel/util/syserror.h>
 #include <freeradius-devel/util/value.h>
@@ -51,6 +52,360 @@
 bool fr_reverse_lookups = false;		//!< IP -> hostname lookups?
 bool fr_hostname_lookups = true;		//!< hostname -> IP lookups?
 
+/*
+ *	Lookup tables for the presentation format printers and parsers
+ *	below.  These are called for every IP address we print into a
+ *	log message, SQL query or detail file, so we avoid going through
+ *	inet_ntop(), inet_pton() and snprintf().
+ */
+static char const inet_hex_char[] = "0123456789abcdef";
+
+/** Decimal pairs "00" to "99"
+ *
+ */
+static char const inet_dec_pair[] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+/** Value of a hex digit plus one, so that zero means "not a hex digit"
+ *
+ */
+static uint8_t const inet_hex_value[UINT8_MAX + 1] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+
+#define INET_IS_DIGIT(_c)	((unsigned int)((_c) - '0') < 10)
+
+/** Print a number between 0 and 255 in decimal
+ *
+ * @param[out] p	Where to write the digits.  Must have space for three.
+ * @param[in] num	to print.
+ * @return a pointer to the byte after the last digit written.
+ */
+static inline CC_HINT(always_inline) char *inet_dec_print(char *p, unsigned int num)
+{
+	if (num >= 100) {
+		*p++ = '0' + (num / 100);
+		num %= 100;
+		memcpy(p, &inet_dec_pair[num * 2], 2);
+		return p + 2;
+	}
+
+	if (num >= 10) {
+		memcpy(p, &inet_dec_pair[num * 2], 2);
+		return p + 2;
+	}
+
+	*p++ = '0' + num;
+	return p;
+}
+
+/** Print an IPv4 address in dotted quad notation
+ *
+ * @param[out] p	Where to write the address.  Must have space for
+ *			INET_ADDRSTRLEN - 1 bytes.  Is not \0 terminated.
+ * @param[in] addr	in network order.
+ * @return a pointer to the byte after the last char written.
+ */
+static char *ipv4_addr_to_str(char *p, uint8_t const addr[static 4])
+{
+	p = inet_dec_print(p, addr[0]);
+	*p++ = '.';
+	p = inet_dec_print(p, addr[1]);
+	*p++ = '.';
+	p = inet_dec_print(p, addr[2]);
+	*p++ = '.';
+	return inet_dec_print(p, addr[3]);
+}
+
+/** Print an IPv6 address in the canonical form produced by inet_ntop()
+ *
+ * The longest run of two or more zero words is replaced with "::",
+ * picking the first run if there's a tie.  IPv4 compatible and IPv4
+ * mapped addresses have their last 32 bits printed as a dotted quad.
+ *
+ * @param[out] p	Where to write the address.  Must have space for
+ *			INET6_ADDRSTRLEN - 1 bytes.  Is not \0 terminated.
+ * @param[in] addr	in network order.
+ * @return a pointer to the byte after the last char written.
+ */
+static char *ipv6_addr_to_str(char *p, uint8_t const addr[static 16])
+{
+	uint16_t	words[8];
+	int		i;
+	int		best_base = -1, best_len = 0, cur_base = -1, cur_len = 0;
+
+	for (i = 0; i < 8; i++) {
+		words[i] = (addr[i * 2] << 8) | addr[(i * 2) + 1];
+
+		if (words[i] == 0) {
+			if (cur_base < 0) cur_base = i;
+			cur_len++;
+			continue;
+		}
+
+		if ((cur_base >= 0) && (cur_len > best_len)) {
+			best_base = cur_base;
+			best_len = cur_len;
+		}
+		cur_base = -1;
+		cur_len = 0;
+	}
+	if ((cur_base >= 0) && (cur_len > best_len)) {
+		best_base = cur_base;
+		best_len = cur_len;
+	}
+	if (best_len < 2) best_base = -1;
+
+	for (i = 0; i < 8; i++) {
+		uint16_t word = words[i];
+
+		if (i == best_base) {
+			*p++ = ':';
+			i += best_len - 1;
+			continue;
+		}
+		if (i != 0) *p++ = ':';
+
+		/*
+		 *	::a.b.c.d and ::ffff:a.b.c.d
+		 */
+		if ((i == 6) && (best_base == 0) &&
+		    ((best_len == 6) || ((best_len == 5) && (words[5] == 0xffff)))) {
+			return ipv4_addr_to_str(p, addr + 12);
+		}
+
+		if (word >= 0x1000) *p++ = inet_hex_char[word >> 12];
+		if (word >= 0x100) *p++ = inet_hex_char[(word >> 8) & 0x0f];
+		if (word >= 0x10) *p++ = inet_hex_char[(word >> 4) & 0x0f];
+		*p++ = inet_hex_char[word & 0x0f];
+	}
+	if ((best_base >= 0) && ((best_base + best_len) == 8)) *p++ = ':';
+
+	return p;
+}
+
+/** Parse an IPv4 address in strict dotted quad notation
+ *
+ * Accepts exactly what inet_pton(AF_INET, ...) accepts.  Four
+ * decimal octets, without leading zeros.
+ *
+ * @param[out] out	Where to write the address in network order.
+ * @param[in] p		Start of the string to parse.
+ * @param[in] end	of the string to parse.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the string is not a dotted quad.
+ */
+static int ipv4_addr_from_str(uint8_t out[static 4], char const *p, char const *end)
+{
+	uint8_t		tmp[4];
+	int		i;
+
+	for (i = 0; i < 4; i++) {
+		unsigned int octet;
+
+		if ((p >= end) || !INET_IS_DIGIT(*p)) return -1;
+		octet = *p++ - '0';
+
+		/*
+		 *	No leading zeros, and no more than 255.
+		 *	Three digits at most, as the first can't be zero.
+		 */
+		if (octet == 0) {
+			if ((p < end) && INET_IS_DIGIT(*p)) return -1;
+		} else {
+			while ((p < end) && INET_IS_DIGIT(*p)) {
+				octet = (octet * 10) + (*p++ - '0');
+				if (octet > 255) return -1;
+			}
+		}
+		tmp[i] = octet;
+
+		if (i == 3) break;
+		if ((p >= end) || (*p != '.')) return -1;
+		p++;
+	}
+	if (p != end) return -1;
+
+	memcpy(out, tmp, sizeof(tmp));
+	return 0;
+}
+
+/** Parse an IPv6 address in presentation format
+ *
+ * Accepts exactly what inet_pton(AF_INET6, ...) accepts.  Up to
+ * eight groups of one to four hex digits, a single "::", and
+ * optionally an IPv4 address in dotted quad notation at the end.
+ *
+ * @param[out] out	Where to write the address in network order.
+ * @param[in] p		Start of the string to parse.
+ * @param[in] end	of the string to parse.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the string is not an IPv6 address.
+ */
+static int ipv6_addr_from_str(uint8_t out[static 16], char const *p, char const *end)
+{
+	uint8_t		tmp[16] = { 0 };
+	uint8_t		*q = tmp, *q_end = tmp + sizeof(tmp), *colon = NULL;
+	char const	*token;
+	unsigned int	val = 0;
+	int		digits = 0;
+
+	if (p >= end) return -1;
+
+	/*
+	 *	A leading colon must be part of a "::"
+	 */
+	if (*p == ':') {
+		p++;
+		if ((p >= end) || (*p != ':')) return -1;
+	}
+
+	token = p;
+	while (p < end) {
+		uint8_t c = *p++;
+		uint8_t hex = inet_hex_value[c];
+
+		if (hex) {
+			if (digits == 4) return -1;
+			val = (val << 4) | (hex - 1);
+			digits++;
+			continue;
+		}
+
+		if (c == ':') {
+			token = p;
+			if (digits == 0) {
+				if (colon) return -1;	/* Only one "::" */
+				colon = q;
+				continue;
+			}
+			if (p >= end) return -1;	/* Trailing single colon */
+			if ((q + 2) > q_end) return -1;
+
+			*q++ = val >> 8;
+			*q++ = val & 0xff;
+			digits = 0;
+			val = 0;
+			continue;
+		}
+
+		/*
+		 *	The last 32 bits may be a dotted quad
+		 */
+		if ((c == '.') && ((q + 4) <= q_end) && (ipv4_addr_from_str(q, token, end) == 0)) {
+			q += 4;
+			digits = 0;
+			break;
+		}
+
+		return -1;
+	}
+
+	if (digits > 0) {
+		if ((q + 2) > q_end) return -1;
+
+		*q++ = val >> 8;
+		*q++ = val & 0xff;
+	}
+
+	if (colon) {
+		size_t n = q - colon;
+
+		if (q == q_end) return -1;	/* "::" must stand for at least one group */
+
+		memmove(q_end - n, colon, n);
+		memset(colon, 0, (q_end - n) - colon);
+		q = q_end;
+	}
+	if (q != q_end) return -1;
+
+	memcpy(out, tmp, sizeof(tmp));
+	return 0;
+}
+
+/** Print the address portion of a #fr_ipaddr_t, without any scope
+ *
+ * @param[out] out	Where to write the \0 terminated address.
+ * @param[in] outlen	of out.
+ * @param[in] addr	to print.
+ * @return
+ *	- The length of the string written to out.
+ *	- -1 on error, with errno set as inet_ntop() would.
+ */
+static ssize_t inet_addr_to_str(char *out, size_t outlen, fr_ipaddr_t const *addr)
+{
+	char	buffer[INET6_ADDRSTRLEN];
+	size_t	len;
+
+	switch (addr->af) {
+	case AF_INET:
+		len = ipv4_addr_to_str(buffer, (uint8_t const *)&addr->addr.v4.s_addr) - buffer;
+		break;
+
+	case AF_INET6:
+		len = ipv6_addr_to_str(buffer, addr->addr.v6.s6_addr) - buffer;
+		break;
+
+	default:
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+
+	if (len >= outlen) {
+		errno = ENOSPC;
+		return -1;
+	}
+	memcpy(out, buffer, len);
+	out[len] = '\0';
+
+	return len;
+}
+
+/** Parse an IPv4 or IPv6 address without doing any hostname resolution
+ *
+ * @param[out] out	Where to write the address.  Only af, addr, prefix
+ *			and scope_id are set.
+ * @param[in] af	AF_INET, AF_INET6, or AF_UNSPEC to guess from the
+ *			contents of the string.
+ * @param[in] str	to parse.
+ * @param[in] len	of str.
+ * @return
+ *	- 0 on success.
+ *	- -1 if str isn't an address of the right family.
+ */
+static int inet_addr_from_str(fr_ipaddr_t *out, int af, char const *str, size_t len)
+{
+	if (af == AF_UNSPEC) af = memchr(str, ':', len) ? AF_INET6 : AF_INET;
+
+	switch (af) {
+	case AF_INET:
+		if (ipv4_addr_from_str((uint8_t *)&out->addr.v4.s_addr, str, str + len) < 0) return -1;
+		out->prefix = 32;
+		break;
+
+	case AF_INET6:
+		if (ipv6_addr_from_str(out->addr.v6.s6_addr, str, str + len) < 0) return -1;
+		out->prefix = 128;
+		break;
+
+	default:
+		return -1;
+	}
+	out->af = af;
+	out->scope_id = 0;
+
+	return 0;
+}
+
 /** Determine if an address is the INADDR_ANY address for its address family
  *
  * @param ipaddr to check.
@@ -237,42 +592,44 @@ void fr_ipaddr_mask(fr_ipaddr_t *addr, uint8_t prefix)
  */
 int fr_inet_hton(fr_ipaddr_t *out, int af, char const *hostname, bool fallback)
 {
-	int ret;
-	struct addrinfo hints, *ai = NULL, *alt = NULL, *res = NULL;
-
 	/*
-	 *	Avoid alloc for IP addresses.  This helps us debug
-	 *	memory errors when using talloc.
+	 *	Numeric addresses never need to go near the resolver.
+	 *	This also avoids alloc for IP addresses, which helps
+	 *	us debug memory errors when using talloc.
 	 */
-	if (!fr_hostname_lookups) {
-#ifdef HAVE_STRUCT_SOCKADDR_IN6
-		if (af == AF_UNSPEC) {
-			char const *p;
-
-			for (p = hostname; *p != '\0'; p++) {
-				if ((*p == ':') ||
-				    (*p == '[') ||
-				    (*p == ']')) {
-					af = AF_INET6;
-					break;
-				}
-			}
-		}
-#endif
+	if (inet_addr_from_str(out, af, hostname, strlen(hostname)) == 0) return 0;
 
-		if (af == AF_UNSPEC) af = AF_INET;
+	if (!fr_hostname_lookups) {
+		fr_strerror_printf("\"%s\" is not a valid IP address and "
+				   "hostname lookups are disabled", hostname);
+		return -1;
+	}
 
-		if (inet_pton(af, hostname, &(out->addr)) == 0) {
-			fr_strerror_printf("\"%s\" is not a valid IP address and "
-					   "hostname lookups are disabled", hostname);
-			return -1;
-		}
-		out->af = af;
-		out->prefix = 32;
-		out->scope_id = 0;
+	/*
+	 *	Go through the cache, which calls fr_inet_getaddrinfo()
+	 *	if it doesn't have a recent answer.
+	 */
+	return fr_resolve(out, af, hostname, fallback);
+}
 
-		return 0;
-	}
+/** Resolve a hostname with getaddrinfo(), bypassing the cache
+ *
+ * Takes the same arguments as #fr_inet_hton, and ignores
+ * #fr_hostname_lookups.  This may block for as long as the system
+ * resolver does.
+ *
+ * @param[out] out Where to write result.
+ * @param[in] af To search for in preference.
+ * @param[in] hostname to search for.
+ * @param[in] fallback to the other address family, if no records matching af, found.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_inet_getaddrinfo(fr_ipaddr_t *out, int af, char const *hostname, bool fallback)
+{
+	int ret;
+	struct addrinfo hints, *ai = NULL, *alt = NULL, *res = NULL;
 
 	memset(&hints, 0, sizeof(hints));
 
@@ -346,7 +703,8 @@ char const *fr_inet_ntoh(fr_ipaddr_t const *src, char *out, size_t outlen)
 	 *	No DNS lookups
 	 */
 	if (!fr_reverse_lookups) {
-		return inet_ntop(src->af, &(src->addr), out, outlen);
+		if (inet_addr_to_str(out, outlen, src) < 0) return NULL;
+		return out;
 	}
 
 	if (fr_ipaddr_to_sockaddr(&ss, &salen, src, 0) < 0) return NULL;
@@ -522,7 +880,7 @@ int fr_inet_pton4(fr_ipaddr_t *out, char const *value, ssize_t inlen, bool resol
 			out->addr.v4.s_addr = htonl(strtoul(value, NULL, 0));
 
 		} else if (!resolve) {
-			if (inet_pton(AF_INET, value, &out->addr.v4.s_addr) <= 0) {
+			if (ipv4_addr_from_str((uint8_t *)&out->addr.v4.s_addr, value, value + strlen(value)) < 0) {
 				fr_strerror_printf("Failed to parse IPv4 address string \"%s\"", value);
 				return -1;
 			}
@@ -645,7 +1003,7 @@ int fr_inet_pton6(fr_ipaddr_t *out, char const *value, ssize_t inlen, bool resol
 		if ((value[0] == '*') && (value[1] == '\0')) {
 			out->addr.v6 = (struct in6_addr)IN6ADDR_ANY_INIT;
 		} else if (!resolve) {
-			if (inet_pton(AF_INET6, value, out->addr.v6.s6_addr) <= 0) {
+			if (ipv6_addr_from_str(out->addr.v6.s6_addr, value, value + strlen(value)) < 0) {
 				fr_strerror_printf("Failed to parse IPv6 address string \"%s\"", value);
 				return -1;
 			}
@@ -665,10 +1023,7 @@ int fr_inet_pton6(fr_ipaddr_t *out, char const *value, ssize_t inlen, bool resol
 	if (inlen < 0) memcpy(buffer, value, p - value);
 
 	if (!resolve) {
-		buffer[p - value] = '\0';
-		ret = inet_pton(AF_INET6, buffer, out->addr.v6.s6_addr);
-		buffer[p - value] = '/';
-		if (ret <= 0) {
+		if (ipv6_addr_from_str(out->addr.v6.s6_addr, buffer, buffer + (p - value)) < 0) {
 			fr_strerror_printf("Failed to parse IPv6 address string \"%s\"", value);
 			return -1;
 		}
@@ -964,18 +1319,20 @@ do_port:
 char *fr_inet_ntop(char out[static FR_IPADDR_STRLEN], size_t outlen, fr_ipaddr_t const *addr)
 {
 	char	*p;
+	ssize_t	slen;
 	size_t	len;
 
 	out[0] = '\0';
 
-	if (inet_ntop(addr->af, &addr->addr, out, outlen) == NULL) {
+	slen = inet_addr_to_str(out, outlen, addr);
+	if (slen < 0) {
 		fr_strerror_printf("%s", fr_syserror(errno));
 		return NULL;
 	}
 
 	if ((addr->af == AF_INET) || (addr->scope_id == 0)) return out;
 
-	p = out + strlen(out);
+	p = out + slen;
 
 #ifdef WITH_IFINDEX_NAME_RESOLUTION
 	{
@@ -1018,20 +1375,26 @@ char *fr_inet_ntop(char out[static FR_IPADDR_STRLEN], size_t outlen, fr_ipaddr_t
  */
 char *fr_inet_ntop_prefix(char out[static FR_IPADDR_PREFIX_STRLEN], size_t outlen, fr_ipaddr_t const *addr)
 {
+	char	buffer[4 + 1];		/* "/255" */
 	char	*p;
-	size_t	len;
+	size_t	len, used;
 
 	if (fr_inet_ntop(out, outlen, addr) == NULL) return NULL;
 
-	p = out + strlen(out);
+	used = strlen(out);
 
-	len = snprintf(p, outlen - (p - out), "/%i", addr->prefix);
-	if (is_truncated(len + (p - out), outlen)) {
+	buffer[0] = '/';
+	len = inet_dec_print(buffer + 1, addr->prefix) - buffer;
+	if ((used + len) >= outlen) {
 		fr_strerror_printf("Address buffer too small, needed %zu bytes, have %zu bytes",
-				   (p - out) + len, outlen);
+				   used + len, outlen);
 		return NULL;
 	}
 
+	p = out + used;
+	memcpy(p, buffer, len);
+	p[len] = '\0';
+
 	return out;
 }
 
@@ -1099,6 +1462,68 @@ uint8_t *fr_inet_ifid_pton(uint8_t out[static 8], char const *ifid_str)
 	return out;
 }
 
+/** Print an ethernet address in colon notation
+ *
+ * @param[out] out	Where to write the \0 terminated address.
+ * @param[in] ether	address to print.
+ * @return a pointer to out.
+ */
+char *fr_inet_ethernet_ntop(char out[static FR_ETHERNET_STRLEN], uint8_t const ether[static 6])
+{
+	char	*p = out;
+	int	i;
+
+	for (i = 0; i < 6; i++) {
+		if (i != 0) *p++ = ':';
+		*p++ = inet_hex_char[ether[i] >> 4];
+		*p++ = inet_hex_char[ether[i] & 0x0f];
+	}
+	*p = '\0';
+
+	return out;
+}
+
+/** Parse an ethernet address in colon notation
+ *
+ * Octets are one or two hex digits, separated by colons.  A single
+ * digit octet must be followed by a colon.  Fewer than six octets
+ * may be given, in which case the remaining bytes of out are left
+ * untouched.
+ *
+ * @param[out] out	Where to write the binary address.
+ * @param[in] str	\0 terminated string to parse.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_inet_ethernet_pton(uint8_t out[static 6], char const *str)
+{
+	uint8_t const	*p = (uint8_t const *)str;
+	uint8_t		hi, lo;
+	size_t		len = 0;
+
+	while (*p) {
+		if (p[1] == ':') {
+			hi = 1;
+			lo = inet_hex_value[p[0]];
+			p += 2;
+		} else if ((p[1] != '\0') && ((p[2] == ':') || (p[2] == '\0'))) {
+			hi = inet_hex_value[p[0]];
+			lo = inet_hex_value[p[1]];
+			p += 2;
+			if (*p == ':') p++;
+		} else {
+			return -1;
+		}
+
+		if (!hi || !lo || (len >= 6)) return -1;
+
+		out[len++] = ((hi - 1) << 4) | (lo - 1);
+	}
+
+	return 0;
+}
+
 #ifdef SIOCGIFADDR
 /** Retrieve the primary IP address associated with an interface
  *
@@ -92,6 +92,10 @@ extern struct in6_addr fr_inet_link_local6;
  */
 #define FR_IPADDR_PREFIX_STRLEN (FR_IPADDR_STRLEN + 1 + 4)
 
+/** Space for an ethernet address in colon notation, and a \0
+ */
+#define FR_ETHERNET_STRLEN (sizeof("00:00:00:00:00:00"))
+
 extern bool	fr_reverse_lookups;	/* do IP -> hostname lookups? */
 extern bool	fr_hostname_lookups; /* do hostname -> IP lookups? */
 
@@ -112,6 +116,8 @@ void	fr_ipaddr_mask(fr_ipaddr_t *addr, uint8_t prefix);
  */
 int	fr_inet_hton(fr_ipaddr_t *out, int af, char const *hostname, bool fallback);
 
+int	fr_inet_getaddrinfo(fr_ipaddr_t *out, int af, char const *hostname, bool fallback);
+
 char const *fr_inet_ntoh(fr_ipaddr_t const *src, char *out, size_t outlen);
 
 int	fr_inet_pton4(fr_ipaddr_t *out, char const *value, ssize_t inlen, bool resolve, bool fallback, bool mask);
@@ -131,6 +137,10 @@ char	*fr_inet_ifid_ntop(char *out, size_t outlen, uint8_t const *ifid);
 
 uint8_t	*fr_inet_ifid_pton(uint8_t out[static 8], char const *ifid_str);
 
+char	*fr_inet_ethernet_ntop(char out[static FR_ETHERNET_STRLEN], uint8_t const ether[static 6]);
+
+int	fr_inet_ethernet_pton(uint8_t out[static 6], char const *str);
+
 /*
  *	ifindex and if_name resolution
  */
@@ -0,0 +1,398 @@
+#include <freeradius-devel/util/acutest.h>
+
+#include "inet.c"
+
+#include <freeradius-devel/util/time.h>
+
+#include <arpa/inet.h>
+
+#define INET_TEST_RANDOM	(1 << 18)
+
+static void inet_random_fill(uint8_t *buffer, size_t len)
+{
+	size_t	i;
+
+	static bool	done_init = false;
+
+	if (!done_init) {
+		srand((unsigned int)time(NULL));
+		done_init = true;
+	}
+
+	for (i = 0; i < len; i++) buffer[i] = rand() & 0xff;
+}
+
+/** Check fr_inet_ntop() and fr_inet_pton() against the libc functions
+ *
+ */
+static void inet_check_addr(int af, uint8_t const *addr)
+{
+	fr_ipaddr_t	ipaddr, parsed;
+	char		ours[FR_IPADDR_STRLEN], theirs[FR_IPADDR_STRLEN];
+	size_t		len = (af == AF_INET) ? 4 : 16;
+
+	memset(&ipaddr, 0, sizeof(ipaddr));
+	ipaddr.af = af;
+	ipaddr.prefix = (af == AF_INET) ? 32 : 128;
+	memcpy(&ipaddr.addr, addr, len);
+
+	TEST_CHECK(inet_ntop(af, addr, theirs, sizeof(theirs)) != NULL);
+	TEST_CHECK(fr_inet_ntop(ours, sizeof(ours), &ipaddr) != NULL);
+	TEST_CHECK(strcmp(ours, theirs) == 0);
+	TEST_MSG("libc %s, ours %s", theirs, ours);
+
+	if (af == AF_INET) {
+		TEST_CHECK(fr_inet_pton4(&parsed, ours, -1, false, false, false) == 0);
+	} else {
+		TEST_CHECK(fr_inet_pton6(&parsed, ours, -1, false, false, false) == 0);
+	}
+	TEST_CHECK(fr_ipaddr_cmp(&parsed, &ipaddr) == 0);
+	TEST_MSG("failed round trip of %s", ours);
+}
+
+/*
+ *	Every value of every octet, then random addresses.
+ */
+static void inet_test_ipv4_print(void)
+{
+	uint8_t		addr[4];
+	int		i, j;
+
+	for (i = 0; i < 4; i++) {
+		for (j = 0; j < 256; j++) {
+			memset(addr, 0x80, sizeof(addr));
+			addr[i] = j;
+			inet_check_addr(AF_INET, addr);
+		}
+	}
+
+	for (i = 0; i < INET_TEST_RANDOM; i++) {
+		inet_random_fill(addr, sizeof(addr));
+		inet_check_addr(AF_INET, addr);
+	}
+}
+
+/*
+ *	Every combination of zero and non-zero words, so that we
+ *	exercise all the "::" compression and IPv4 embedding rules,
+ *	with words of every width.
+ */
+static void inet_test_ipv6_print(void)
+{
+	static uint16_t const	words[] = { 0x1, 0xf, 0x10, 0xff, 0x100, 0xfff, 0x1000, 0xffff };
+	uint8_t			addr[16];
+	unsigned int		zero, i, j;
+
+	for (zero = 0; zero < 256; zero++) {
+		for (j = 0; j < NUM_ELEMENTS(words) * 4; j++) {
+			inet_random_fill(addr, sizeof(addr));
+
+			for (i = 0; i < 8; i++) {
+				uint16_t word;
+
+				if (zero & (1 << i)) {
+					word = 0;
+				} else if (j < NUM_ELEMENTS(words)) {
+					word = words[j];
+				} else if (j & 0x01) {
+					word = words[(j + i) % NUM_ELEMENTS(words)];
+				} else {
+					word = (addr[i * 2] << 8) | addr[(i * 2) + 1];
+					if (!word) word = 1;
+				}
+
+				addr[i * 2] = word >> 8;
+				addr[(i * 2) + 1] = word & 0xff;
+			}
+			inet_check_addr(AF_INET6, addr);
+		}
+	}
+
+	for (i = 0; i < INET_TEST_RANDOM; i++) {
+		inet_random_fill(addr, sizeof(addr));
+		inet_check_addr(AF_INET6, addr);
+	}
+}
+
+static void inet_test_prefix_print(void)
+{
+	fr_ipaddr_t	ipaddr;
+	char		ours[FR_IPADDR_PREFIX_STRLEN], theirs[FR_IPADDR_PREFIX_STRLEN];
+	char		addr[INET6_ADDRSTRLEN];
+	int		i;
+
+	for (i = 0; i <= 128; i++) {
+		memset(&ipaddr, 0, sizeof(ipaddr));
+		ipaddr.af = (i <= 32) ? AF_INET : AF_INET6;
+		ipaddr.prefix = i;
+		inet_random_fill((uint8_t *)&ipaddr.addr, (i <= 32) ? 4 : 16);
+
+		TEST_CHECK(inet_ntop(ipaddr.af, &ipaddr.addr, addr, sizeof(addr)) != NULL);
+		snprintf(theirs, sizeof(theirs), "%s/%i", addr, i);
+
+		TEST_CHECK(fr_inet_ntop_prefix(ours, sizeof(ours), &ipaddr) != NULL);
+		TEST_CHECK(strcmp(ours, theirs) == 0);
+		TEST_MSG("expected %s, got %s", theirs, ours);
+	}
+
+	/*
+	 *	Buffer sizes which don't leave room for the prefix
+	 */
+	ipaddr.af = AF_INET;
+	ipaddr.prefix = 24;
+	memcpy(&ipaddr.addr.v4.s_addr, (uint8_t[]){ 192, 0, 2, 1 }, 4);
+	TEST_CHECK(fr_inet_ntop_prefix(ours, sizeof("192.0.2.1/24"), &ipaddr) != NULL);
+	TEST_CHECK(fr_inet_ntop_prefix(ours, sizeof("192.0.2.1/24") - 1, &ipaddr) == NULL);
+	TEST_CHECK(fr_inet_ntop(ours, sizeof("192.0.2.1") - 1, &ipaddr) == NULL);
+}
+
+/** Compare our strict parsers with inet_pton() for a string
+ *
+ */
+static void inet_check_parse(char const *str, size_t len)
+{
+	uint8_t		ours[16], theirs[16];
+	int		ret;
+
+	ret = inet_pton(AF_INET, str, theirs);
+	TEST_CHECK((ipv4_addr_from_str(ours, str, str + len) == 0) == (ret > 0));
+	TEST_MSG("IPv4 \"%s\" libc %i", str, ret);
+	if (ret > 0) TEST_CHECK(memcmp(ours, theirs, 4) == 0);
+
+	ret = inet_pton(AF_INET6, str, theirs);
+	TEST_CHECK((ipv6_addr_from_str(ours, str, str + len) == 0) == (ret > 0));
+	TEST_MSG("IPv6 \"%s\" libc %i", str, ret);
+	if (ret > 0) TEST_CHECK(memcmp(ours, theirs, 16) == 0);
+}
+
+/*
+ *	Known edge cases, then random strings which are mostly
+ *	made up of characters which can appear in addresses.
+ */
+static void inet_test_parse_malformed(void)
+{
+	static char const	*strs[] = {
+		"", ".", "1", "1.2.3", "1.2.3.4", "1.2.3.4.", "1.2.3.4.5", "01.2.3.4", "0.0.0.0", "00.0.0.0",
+		"255.255.255.255", "256.0.0.0", "1.2.3.2555", "1..2.3", " 1.2.3.4", "1.2.3.4 ", "1.2.3.-4",
+		":", "::", ":::", "::1", "1::", "1:::2", ":1::2", "1::2:", "1:2:3:4:5:6:7:8", "1:2:3:4:5:6:7:8:9",
+		"1:2:3:4:5:6:7::", "::2:3:4:5:6:7:8", "1:2:3:4:5:6:7::8", "1::2::3", "12345::", "0000:0::",
+		"::1.2.3.4", "::ffff:1.2.3.4", "1:2:3:4:5:6:1.2.3.4", "1:2:3:4:5:6:7:1.2.3.4", "::1.2.3",
+		"::1.2.3.4:5", "::01.2.3.4", "1.2.3.4::", "::1.2.3.4.5", "a.2.3.4", "::a.2.3.4", "::1.2.3.256",
+		"fe80::1%eth0", "[::1]", "::G", "::ffff:ffff:ffff:ffff:ffff:ffff:ffff"
+	};
+	static char const	chars[] = "0123456789abcdefABCDEFG:.:.:";
+	char			buffer[48];
+	size_t			i, j, len;
+
+	for (i = 0; i < NUM_ELEMENTS(strs); i++) inet_check_parse(strs[i], strlen(strs[i]));
+
+	for (i = 0; i < INET_TEST_RANDOM; i++) {
+		len = rand() % 24;
+		for (j = 0; j < len; j++) buffer[j] = chars[rand() % (sizeof(chars) - 1)];
+		buffer[len] = '\0';
+
+		inet_check_parse(buffer, len);
+	}
+}
+
+/*
+ *	Take valid addresses, and change, drop or duplicate a character.
+ */
+static void inet_test_parse_mutated(void)
+{
+	static char const	chars[] = "0123456789abcdefG:.";
+	uint8_t			addr[16];
+	char			buffer[INET6_ADDRSTRLEN + 2];
+	size_t			i, len, pos;
+
+	for (i = 0; i < INET_TEST_RANDOM; i++) {
+		int af = (i & 0x01) ? AF_INET6 : AF_INET;
+
+		inet_random_fill(addr, sizeof(addr));
+		if (i & 0x02) memset(addr + (rand() % 8), 0, 8);
+		if (i & 0x04) memcpy(addr, (uint8_t[]){ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff }, 12);
+
+		inet_ntop(af, addr, buffer, sizeof(buffer));
+		len = strlen(buffer);
+		pos = rand() % len;
+
+		switch (rand() % 3) {
+		case 0:
+			buffer[pos] = chars[rand() % (sizeof(chars) - 1)];
+			break;
+
+		case 1:
+			memmove(buffer + pos, buffer + pos + 1, len - pos);
+			len--;
+			break;
+
+		case 2:
+			memmove(buffer + pos + 1, buffer + pos, len - pos + 1);
+			len++;
+			break;
+		}
+
+		inet_check_parse(buffer, len);
+	}
+}
+
+/*
+ *	fr_inet_hton() must not need the resolver for numeric addresses.
+ */
+static void inet_test_hton_numeric(void)
+{
+	fr_ipaddr_t	ipaddr;
+	bool		lookups = fr_hostname_lookups;
+
+	fr_hostname_lookups = false;
+
+	TEST_CHECK(fr_inet_hton(&ipaddr, AF_UNSPEC, "192.0.2.1", false) == 0);
+	TEST_CHECK((ipaddr.af == AF_INET) && (ipaddr.prefix == 32));
+
+	TEST_CHECK(fr_inet_hton(&ipaddr, AF_UNSPEC, "2001:db8::1", false) == 0);
+	TEST_CHECK((ipaddr.af == AF_INET6) && (ipaddr.prefix == 128));
+
+	TEST_CHECK(fr_inet_hton(&ipaddr, AF_INET, "2001:db8::1", false) < 0);
+	TEST_CHECK(fr_inet_hton(&ipaddr, AF_INET6, "192.0.2.1", false) < 0);
+	TEST_CHECK(fr_inet_hton(&ipaddr, AF_UNSPEC, "localhost", false) < 0);
+
+	fr_hostname_lookups = lookups;
+}
+
+static void inet_test_ethernet(void)
+{
+	static struct {
+		char const	*str;
+		int		ret;
+		uint8_t		ether[6];
+	} const			tests[] = {
+		{ "00:11:22:33:44:55",	0, { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55 } },
+		{ "aa:BB:cc:DD:ee:FF",	0, { 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff } },
+		{ "1:2:3:4:5:6",	-1 },	/* Single digit octets need a trailing ':' */
+		{ "1:2:3:4:5:",		0, { 0x01, 0x02, 0x03, 0x04, 0x05, 0x00 } },
+		{ "0a:0b",		0, { 0x0a, 0x0b, 0x00, 0x00, 0x00, 0x00 } },
+		{ "00:11:22:33:44:55:66", -1 },
+		{ "00:11:22:33:44:5g",	-1 },
+		{ "001122334455",	-1 },
+		{ "00::11",		-1 },
+	};
+	uint8_t			ether[6];
+	char			ours[FR_ETHERNET_STRLEN], theirs[FR_ETHERNET_STRLEN];
+	size_t			i;
+
+	for (i = 0; i < NUM_ELEMENTS(tests); i++) {
+		memset(ether, 0, sizeof(ether));
+		TEST_CHECK(fr_inet_ethernet_pton(ether, tests[i].str) == tests[i].ret);
+		TEST_MSG("parsing \"%s\"", tests[i].str);
+		if (tests[i].ret == 0) TEST_CHECK(memcmp(ether, tests[i].ether, sizeof(ether)) == 0);
+	}
+
+	for (i = 0; i < INET_TEST_RANDOM; i++) {
+		uint8_t parsed[6];
+
+		inet_random_fill(ether, sizeof(ether));
+		snprintf(theirs, sizeof(theirs), "%02x:%02x:%02x:%02x:%02x:%02x",
+			 ether[0], ether[1], ether[2], ether[3], ether[4], ether[5]);
+
+		TEST_CHECK(strcmp(fr_inet_ethernet_ntop(ours, ether), theirs) == 0);
+		TEST_MSG("expected %s, got %s", theirs, ours);
+
+		TEST_CHECK(fr_inet_ethernet_pton(parsed, ours) == 0);
+		TEST_CHECK(memcmp(parsed, ether, sizeof(ether)) == 0);
+	}
+}
+
+/*
+ *	Compare the speed of our printers and parsers with libc.
+ */
+#define INET_BENCH_ADDRS	(1 << 10)
+#define INET_BENCH_REPS		(1 << 10)
+
+typedef char inet_bench_str_t[FR_IPADDR_STRLEN];
+
+static void inet_bench(void)
+{
+	static int const	afs[] = { AF_INET, AF_INET6 };
+	fr_ipaddr_t		*addrs;
+	inet_bench_str_t	*strs;
+	char			buffer[FR_IPADDR_STRLEN];
+	size_t			i, j, r;
+	volatile size_t		sink = 0;
+
+	fr_time_start();
+
+	addrs = talloc_zero_array(NULL, fr_ipaddr_t, INET_BENCH_ADDRS);
+	strs = talloc_zero_array(NULL, inet_bench_str_t, INET_BENCH_ADDRS);
+
+	for (i = 0; i < NUM_ELEMENTS(afs); i++) {
+		fr_time_t	start;
+		fr_time_delta_t	libc_ntop, ntop, libc_pton, pton;
+
+		for (j = 0; j < INET_BENCH_ADDRS; j++) {
+			addrs[j].af = afs[i];
+			addrs[j].prefix = (afs[i] == AF_INET) ? 32 : 128;
+			inet_random_fill((uint8_t *)&addrs[j].addr, sizeof(addrs[j].addr));
+			if ((afs[i] == AF_INET6) && (j & 0x01)) memset(addrs[j].addr.v6.s6_addr + 4, 0, 8);
+			inet_ntop(afs[i], &addrs[j].addr, strs[j], sizeof(strs[j]));
+		}
+
+		start = fr_time();
+		for (r = 0; r < INET_BENCH_REPS; r++) {
+			for (j = 0; j < INET_BENCH_ADDRS; j++) {
+				sink += (size_t)inet_ntop(afs[i], &addrs[j].addr, buffer, sizeof(buffer));
+			}
+		}
+		libc_ntop = fr_time() - start;
+
+		start = fr_time();
+		for (r = 0; r < INET_BENCH_REPS; r++) {
+			for (j = 0; j < INET_BENCH_ADDRS; j++) {
+				sink += (size_t)fr_inet_ntop(buffer, sizeof(buffer), &addrs[j]);
+			}
+		}
+		ntop = fr_time() - start;
+
+		start = fr_time();
+		for (r = 0; r < INET_BENCH_REPS; r++) {
+			for (j = 0; j < INET_BENCH_ADDRS; j++) {
+				sink += inet_pton(afs[i], strs[j], buffer);
+			}
+		}
+		libc_pton = fr_time() - start;
+
+		start = fr_time();
+		for (r = 0; r < INET_BENCH_REPS; r++) {
+			for (j = 0; j < INET_BENCH_ADDRS; j++) {
+				fr_ipaddr_t ipaddr;
+
+				sink += (afs[i] == AF_INET) ?
+					fr_inet_pton4(&ipaddr, strs[j], -1, false, false, false) :
+					fr_inet_pton6(&ipaddr, strs[j], -1, false, false, false);
+			}
+		}
+		pton = fr_time() - start;
+
+		TEST_MSG_ALWAYS("%s libc_ntop_ns=%0.2f ntop_ns=%0.2f libc_pton_ns=%0.2f pton_ns=%0.2f",
+				(afs[i] == AF_INET) ? "ipv4" : "ipv6",
+				(double)libc_ntop / (INET_BENCH_ADDRS * INET_BENCH_REPS),
+				(double)ntop / (INET_BENCH_ADDRS * INET_BENCH_REPS),
+				(double)libc_pton / (INET_BENCH_ADDRS * INET_BENCH_REPS),
+				(double)pton / (INET_BENCH_ADDRS * INET_BENCH_REPS));
+	}
+	(void)sink;
+
+	talloc_free(strs);
+	talloc_free(addrs);
+}
+
+TEST_LIST = {
+	{ "inet_test_ipv4_print",	inet_test_ipv4_print		},
+	{ "inet_test_ipv6_print",	inet_test_ipv6_print		},
+	{ "inet_test_prefix_print",	inet_test_prefix_print		},
+	{ "inet_test_parse_malformed",	inet_test_parse_malformed	},
+	{ "inet_test_parse_mutated",	inet_test_parse_mutated		},
+	{ "inet_test_hton_numeric",	inet_test_hton_numeric		},
+	{ "inet_test_ethernet",		inet_test_ethernet		},
+	{ "inet_bench",			inet_bench			},
+	{ NULL }
+};
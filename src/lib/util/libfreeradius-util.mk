@@ -6,6 +6,7 @@
 TARGET		:= libfreeradius-util.a
 
 SOURCES		:= \
+		   allocator.c \
 		   atexit.c \
 		   base16.c \
 		   base32.c \
@@ -34,12 +35,14 @@ SOURCES		:= \
 		   getaddrinfo.c \
 		   hash.c \
 		   heap.c \
+		   hist.c \
 		   hmac_md5.c \
 		   hmac_sha1.c \
 		   htrie.c \
 		   hw.c \
 		   inet.c \
 		   isaac.c \
+		   limiter.c \
 		   log.c \
 		   md4.c \
 		   md5.c \
@@ -58,6 +61,7 @@ SOURCES		:= \
 		   proto.c \
 		   rand.c \
 		   rb.c \
+		   resolve.c \
 		   regex.c \
 		   retry.c \
 		   sbuff.c \
@@ -72,7 +76,9 @@ SOURCES		:= \
 		   syserror.c \
 		   table.c \
 		   talloc.c \
+		   thread_pool.c \
 		   time.c \
+		   timer_wheel.c \
 		   timeval.c \
 		   token.c \
 		   trie.c \
@@ -0,0 +1,142 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Adaptive concurrency limits
+ *
+ * A gradient limiter, in the style of Netflix's "gradient2".  The
+ * limit on in-flight requests is scaled by the ratio of the long term
+ * average latency to the short term average.  When latency is at its
+ * usual level, the limit grows by roughly its square root each
+ * sample, which leaves room for a small queue.  When the short term
+ * latency rises above (tolerance * long term), the limit shrinks,
+ * and excess requests are refused instead of being queued.
+ *
+ * The long term average slowly follows the short term one, so a
+ * permanent change in latency (e.g. a slower backend) eventually
+ * becomes the new normal.  When latency drops sharply, the long term
+ * average is pulled down quickly, so that the limit can grow again.
+ *
+ * @file src/lib/util/limiter.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/limiter.h>
+
+/*
+ *	Number of samples in the short and long term averages.
+ */
+#define LIMITER_SHORT_WINDOW	(10)
+#define LIMITER_LONG_WINDOW	(600)
+
+/*
+ *	How quickly the limit moves towards its new value.
+ */
+#define LIMITER_SMOOTHING	(0.2)
+
+/** Integer square root, as we don't link with libm
+ *
+ */
+static uint32_t limiter_sqrt(uint32_t value)
+{
+	uint32_t	root = 0, bit = 1U << 30;
+
+	while (bit > value) bit >>= 2;
+
+	while (bit) {
+		if (value >= root + bit) {
+			value -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return root;
+}
+
+/** Initialise a limiter
+ *
+ * @param[out] l	to initialise.
+ * @param[in] conf	to use.  Must stay valid for the lifetime of the limiter.
+ */
+void fr_limiter_init(fr_limiter_t *l, fr_limiter_conf_t const *conf)
+{
+	uint32_t initial = conf->initial;
+
+	if (initial < conf->min) initial = conf->min;
+	if (conf->max && (initial > conf->max)) initial = conf->max;
+
+	*l = (fr_limiter_t){
+		.conf = conf,
+		.limit = initial
+	};
+}
+
+/** Update the limit with the latency of a request which has completed
+ *
+ * @param[in] l		to update.
+ * @param[in] rtt	time the request took.
+ * @param[in] inflight	number of requests in flight when it completed.
+ */
+void fr_limiter_sample(fr_limiter_t *l, fr_time_delta_t rtt, uint32_t inflight)
+{
+	fr_limiter_conf_t const	*conf = l->conf;
+	double			gradient, limit;
+
+	if (!fr_limiter_enabled(l)) return;
+	if (rtt <= 0) rtt = 1;
+
+	l->samples++;
+
+	if (l->samples == 1) {
+		l->long_rtt = l->short_rtt = rtt;
+		return;
+	}
+
+	l->short_rtt += (rtt - l->short_rtt) / LIMITER_SHORT_WINDOW;
+	l->long_rtt += (l->short_rtt - l->long_rtt) / LIMITER_LONG_WINDOW;
+
+	/*
+	 *	Latency has dropped a lot, so whatever was slowing us
+	 *	down has gone.  Don't wait for the long term average
+	 *	to catch up.
+	 */
+	if (l->long_rtt > (2 * l->short_rtt)) l->long_rtt *= 0.95;
+
+	/*
+	 *	We're not using the limit we have, so we've learned
+	 *	nothing about whether it should be higher.
+	 */
+	gradient = (conf->tolerance * l->long_rtt) / l->short_rtt;
+	if (gradient > 1.0) {
+		if (inflight < (l->limit / 2)) return;
+		gradient = 1.0;
+	} else if (gradient < 0.5) {
+		gradient = 0.5;
+	}
+
+	limit = (l->limit * gradient) + limiter_sqrt((uint32_t) l->limit);
+	limit = (l->limit * (1 - LIMITER_SMOOTHING)) + (limit * LIMITER_SMOOTHING);
+
+	if (limit < conf->min) limit = conf->min;
+	if (limit > conf->max) limit = conf->max;
+	if (limit < 1) limit = 1;
+
+	l->limit = limit;
+}
@@ -0,0 +1,108 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Adaptive concurrency limits
+ *
+ * @file src/lib/util/limiter.h
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(limiter_h, "$Id$")
+
+#include <freeradius-devel/util/time.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Configuration for an adaptive concurrency limiter
+ *
+ * A zero max disables the limiter.
+ */
+typedef struct {
+	uint32_t		min;		//!< The limit never goes below this.
+	uint32_t		max;		//!< The limit never goes above this.
+	uint32_t		initial;	//!< Limit to start with.
+	float			tolerance;	//!< How much latency may rise above the
+						///< long term average before the limit is cut.
+						///< e.g. 2.0 allows twice the usual latency.
+} fr_limiter_conf_t;
+
+/** State of an adaptive concurrency limiter
+ *
+ * The limit tracks how many requests can be in flight before
+ * latency starts to rise.  The owner counts its own in-flight
+ * requests, asks #fr_limiter_allow before admitting another one,
+ * and calls #fr_limiter_sample with the latency of each one which
+ * completes.
+ *
+ * Not thread-safe.  Each thread should have its own limiter.
+ */
+typedef struct {
+	fr_limiter_conf_t const	*conf;
+
+	double			limit;		//!< Current limit on in-flight requests.
+	double			long_rtt;	//!< Long term average latency, in nanoseconds.
+	double			short_rtt;	//!< Short term average latency, in nanoseconds.
+
+	uint64_t		samples;	//!< Number of latencies sampled.
+	uint64_t		rejected;	//!< Number of requests which were refused.
+} fr_limiter_t;
+
+void		fr_limiter_init(fr_limiter_t *l, fr_limiter_conf_t const *conf) CC_HINT(nonnull);
+
+void		fr_limiter_sample(fr_limiter_t *l, fr_time_delta_t rtt, uint32_t inflight) CC_HINT(nonnull);
+
+/** Whether the limiter is enabled
+ *
+ */
+static inline bool fr_limiter_enabled(fr_limiter_t const *l)
+{
+	return l->conf && (l->conf->max > 0);
+}
+
+/** Check whether another request may be admitted
+ *
+ * @param[in] l		to check.
+ * @param[in] inflight	number of requests currently in flight, not
+ *			including the new one.
+ * @return
+ *	- true if the request may be admitted.
+ *	- false if it should be refused.  This is counted.
+ */
+static inline bool fr_limiter_allow(fr_limiter_t *l, uint32_t inflight)
+{
+	if (!fr_limiter_enabled(l) || (inflight < (uint32_t) l->limit)) return true;
+
+	l->rejected++;
+	return false;
+}
+
+/** Return the current limit
+ *
+ */
+static inline uint32_t fr_limiter_limit(fr_limiter_t const *l)
+{
+	return (uint32_t) l->limit;
+}
+
+#ifdef __cplusplus
+}
+#endif
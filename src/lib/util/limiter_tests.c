@@ -0,0 +1,137 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for adaptive concurrency limits
+ *
+ * @file src/lib/util/limiter_tests.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <freeradius-devel/util/acutest.h>
+
+#include "limiter.c"
+
+static fr_limiter_conf_t const conf = {
+	.min = 4,
+	.max = 1000,
+	.initial = 20,
+	.tolerance = 2.0
+};
+
+static void limiter_disabled(void)
+{
+	fr_limiter_conf_t	off = { .max = 0 };
+	fr_limiter_t		l;
+
+	fr_limiter_init(&l, &off);
+
+	TEST_CHECK(!fr_limiter_enabled(&l));
+	TEST_CHECK(fr_limiter_allow(&l, 1000000));
+	TEST_CHECK(l.rejected == 0);
+}
+
+static void limiter_allow(void)
+{
+	fr_limiter_t	l;
+
+	fr_limiter_init(&l, &conf);
+
+	TEST_CHECK(fr_limiter_limit(&l) == 20);
+	TEST_CHECK(fr_limiter_allow(&l, 19));
+	TEST_CHECK(!fr_limiter_allow(&l, 20));
+	TEST_CHECK(l.rejected == 1);
+}
+
+/*
+ *	Steady latency with the limit in use, so it should grow, up
+ *	to the maximum.
+ */
+static void limiter_grow(void)
+{
+	fr_limiter_t	l;
+	int		i;
+
+	fr_limiter_init(&l, &conf);
+
+	for (i = 0; i < 100; i++) fr_limiter_sample(&l, fr_time_delta_from_msec(10), fr_limiter_limit(&l));
+	TEST_CHECK(fr_limiter_limit(&l) > 20);
+	TEST_MSG("limit %u", fr_limiter_limit(&l));
+
+	for (i = 0; i < 10000; i++) fr_limiter_sample(&l, fr_time_delta_from_msec(10), fr_limiter_limit(&l));
+	TEST_CHECK(fr_limiter_limit(&l) == conf.max);
+}
+
+/*
+ *	Steady latency, but hardly anything in flight.  The limit
+ *	should stay where it is.
+ */
+static void limiter_idle(void)
+{
+	fr_limiter_t	l;
+	int		i;
+
+	fr_limiter_init(&l, &conf);
+
+	for (i = 0; i < 1000; i++) fr_limiter_sample(&l, fr_time_delta_from_msec(10), 1);
+	TEST_CHECK(fr_limiter_limit(&l) == 20);
+}
+
+/*
+ *	Latency jumps to well beyond the tolerance.  The limit should
+ *	fall to the minimum, and then recover when latency returns to
+ *	normal.
+ */
+static void limiter_shrink(void)
+{
+	fr_limiter_t	l;
+	int		i;
+	uint32_t	before;
+
+	fr_limiter_init(&l, &conf);
+
+	for (i = 0; i < 200; i++) fr_limiter_sample(&l, fr_time_delta_from_msec(10), fr_limiter_limit(&l));
+	before = fr_limiter_limit(&l);
+
+	for (i = 0; i < 100; i++) fr_limiter_sample(&l, fr_time_delta_from_msec(100), fr_limiter_limit(&l));
+	TEST_CHECK(fr_limiter_limit(&l) < before);
+	TEST_MSG("before %u after %u", before, fr_limiter_limit(&l));
+	TEST_CHECK(fr_limiter_limit(&l) >= conf.min);
+
+	for (i = 0; i < 1000; i++) fr_limiter_sample(&l, fr_time_delta_from_msec(10), fr_limiter_limit(&l));
+	TEST_CHECK(fr_limiter_limit(&l) > conf.min);
+}
+
+static void limiter_sqrt_values(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < 100000; i++) {
+		uint32_t root = limiter_sqrt(i);
+
+		TEST_CHECK((root * root <= i) && ((root + 1) * (root + 1) > i));
+	}
+}
+
+TEST_LIST = {
+	{ "limiter_disabled",	limiter_disabled },
+	{ "limiter_allow",	limiter_allow },
+	{ "limiter_grow",	limiter_grow },
+	{ "limiter_idle",	limiter_idle },
+	{ "limiter_shrink",	limiter_shrink },
+	{ "limiter_sqrt",	limiter_sqrt_values },
+
+	{ NULL }
+};
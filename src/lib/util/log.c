@@ -32,6 +32,9 @@ RCSID("$Id$")
 #include <freeradius-devel/util/value.h>
 
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #ifdef HAVE_FEATURES_H
 #  include <features.h>
 #endif
@@ -240,6 +243,405 @@ TALLOC_CTX *fr_log_pool_init(void)
 	return pool;
 }
 
+/** A per-thread ring of log messages waiting to be written
+ *
+ * Each ring has one producer, the thread which owns it, and one consumer,
+ * the log writer thread.  So neither side needs a lock.
+ *
+ * Rings are never freed while the writer is running.  When a thread exits
+ * its ring is released, and may be picked up by a new thread.
+ */
+typedef struct fr_log_ring_s fr_log_ring_t;
+struct fr_log_ring_s {
+	fr_log_ring_t		*next;		//!< Next ring in the list of all rings.
+	atomic_bool		in_use;		//!< Whether a thread owns this ring.
+	_Atomic(size_t)		head;		//!< Total bytes written by the producer.
+	_Atomic(size_t)		tail;		//!< Total bytes consumed by the writer.
+	_Atomic(uint64_t)	dropped;	//!< Messages discarded because the ring was full.
+	size_t			size;		//!< Size of the buffer.  Always a power of 2.
+	uint8_t			*buffer;	//!< Message headers and text.
+};
+
+/** Precedes every message in a ring
+ *
+ */
+typedef struct {
+	fr_log_t const		*log;		//!< Where the message is going.
+	fr_log_type_t		type;		//!< Type of message, for the syslog priority.
+	size_t			len;		//!< Length of the message which follows.
+} fr_log_ring_hdr_t;
+
+#define LOG_ASYNC_BATCH_SIZE	65536	//!< Largest single write made by the log writer.
+
+static _Atomic(fr_log_ring_t *)	log_rings;		//!< All rings, most recently created first.
+static _Thread_local fr_log_ring_t *log_ring;		//!< The ring owned by this thread.
+static atomic_bool		log_async;		//!< Whether messages are queued for the writer.
+static atomic_bool		log_writer_sleeping;	//!< Writer is waiting for a wakeup.
+static atomic_bool		log_writer_stop;	//!< Writer should drain the rings and exit.
+static size_t			log_ring_size;		//!< Size of each ring.
+static pthread_t		log_writer;		//!< The log writer thread.
+static int			log_wakeup[2] = { -1, -1 };	//!< Pipe used to wake the writer.
+
+#ifdef HAVE_SYSLOG_H
+/** Map a log message type to a syslog priority
+ *
+ */
+static int log_syslog_priority(fr_log_type_t type)
+{
+	switch (type) {
+	case L_INFO:
+		return LOG_INFO;
+
+	case L_WARN:
+		return LOG_WARNING;
+
+	case L_ERR:
+		return LOG_ERR;
+
+	case L_AUTH:
+		return LOG_AUTH | LOG_INFO;
+
+	default:
+		return LOG_DEBUG;
+	}
+}
+#endif
+
+static inline CC_HINT(always_inline) void log_ring_copy_in(fr_log_ring_t *ring, size_t pos, void const *data, size_t len)
+{
+	size_t	offset = pos & (ring->size - 1);
+	size_t	first = ring->size - offset;
+
+	if (first > len) first = len;
+
+	memcpy(ring->buffer + offset, data, first);
+	if (len > first) memcpy(ring->buffer, ((uint8_t const *)data) + first, len - first);
+}
+
+static inline CC_HINT(always_inline) void log_ring_copy_out(fr_log_ring_t *ring, size_t pos, void *out, size_t len)
+{
+	size_t	offset = pos & (ring->size - 1);
+	size_t	first = ring->size - offset;
+
+	if (first > len) first = len;
+
+	memcpy(out, ring->buffer + offset, first);
+	if (len > first) memcpy(((uint8_t *)out) + first, ring->buffer, len - first);
+}
+
+/** Give up ownership of a ring when its thread exits
+ *
+ */
+static void _log_ring_release(void *arg)
+{
+	fr_log_ring_t *ring = arg;
+
+	atomic_store(&ring->in_use, false);
+	log_ring = NULL;
+}
+
+/** Return the ring owned by this thread, creating one if needed
+ *
+ */
+static fr_log_ring_t *log_ring_get(void)
+{
+	fr_log_ring_t	*ring;
+
+	if (likely(log_ring != NULL)) return log_ring;
+
+	/*
+	 *	Use a ring left behind by a thread which has
+	 *	exited, if there is one.
+	 */
+	for (ring = atomic_load(&log_rings); ring; ring = ring->next) {
+		bool expected = false;
+
+		if (atomic_compare_exchange_strong(&ring->in_use, &expected, true)) goto done;
+	}
+
+	ring = talloc_zero(NULL, fr_log_ring_t);
+	if (!ring) return NULL;
+
+	ring->size = log_ring_size;
+	ring->buffer = talloc_array(ring, uint8_t, ring->size);
+	if (!ring->buffer) {
+		talloc_free(ring);
+		return NULL;
+	}
+	atomic_init(&ring->in_use, true);
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->dropped, 0);
+
+	ring->next = atomic_load(&log_rings);
+	while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring));
+
+done:
+	fr_atexit_thread_local(log_ring, _log_ring_release, ring);
+
+	return ring;
+}
+
+/** Queue a formatted message for the log writer
+ *
+ * @return
+ *	- true if the message was queued, or dropped because the ring was full.
+ *	- false if the caller should write the message itself.
+ */
+static bool log_ring_push(fr_log_t const *log, fr_log_type_t type, char const *msg, size_t len)
+{
+	fr_log_ring_t		*ring;
+	fr_log_ring_hdr_t	hdr = { .log = log, .type = type, .len = len };
+	size_t			head, tail;
+
+	ring = log_ring_get();
+	if (unlikely(!ring)) return false;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	/*
+	 *	Never block the caller waiting for the writer.
+	 */
+	if ((ring->size - (head - tail)) < (sizeof(hdr) + len)) {
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return true;
+	}
+
+	log_ring_copy_in(ring, head, &hdr, sizeof(hdr));
+	log_ring_copy_in(ring, head + sizeof(hdr), msg, len);
+	atomic_store_explicit(&ring->head, head + sizeof(hdr) + len, memory_order_release);
+
+	/*
+	 *	Only make a system call if the writer is idle.
+	 */
+	if (atomic_load_explicit(&log_writer_sleeping, memory_order_acquire) &&
+	    atomic_exchange(&log_writer_sleeping, false)) {
+		uint8_t c = 0;
+
+		if (write(log_wakeup[1], &c, 1) < 0) { /* Writer wakes up anyway */ }
+	}
+
+	return true;
+}
+
+/** Write out a batch of messages for a single file descriptor
+ *
+ */
+static void log_batch_flush(int fd, uint8_t const *batch, size_t *len)
+{
+	size_t	done = 0;
+
+	while (done < *len) {
+		ssize_t	slen;
+
+		slen = write(fd, batch + done, *len - done);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		done += slen;
+	}
+
+	*len = 0;
+}
+
+/** Drain the rings, combining messages into large writes
+ *
+ */
+static void *log_writer_thread(UNUSED void *arg)
+{
+	uint8_t		*batch;
+	char		*msg;
+	size_t		batch_len = 0;
+	int		batch_fd = -1;
+	uint64_t	reported = 0;
+	struct pollfd	pfd = { .fd = log_wakeup[0], .events = POLLIN };
+
+	batch = talloc_array(NULL, uint8_t, LOG_ASYNC_BATCH_SIZE);
+	msg = talloc_array(batch, char, log_ring_size + 1);
+	if (!batch || !msg) {
+		talloc_free(batch);
+		return NULL;
+	}
+
+	while (true) {
+		fr_log_ring_t	*ring;
+		bool		found = false, stop;
+		uint64_t	dropped = 0;
+
+		stop = atomic_load(&log_writer_stop);
+
+		for (ring = atomic_load(&log_rings); ring; ring = ring->next) {
+			size_t	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+			size_t	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+			dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+
+			while (tail != head) {
+				fr_log_ring_hdr_t	hdr;
+
+				log_ring_copy_out(ring, tail, &hdr, sizeof(hdr));
+				tail += sizeof(hdr);
+
+#ifdef HAVE_SYSLOG_H
+				if (hdr.log->dst == L_DST_SYSLOG) {
+					if (batch_len) log_batch_flush(batch_fd, batch, &batch_len);
+
+					log_ring_copy_out(ring, tail, msg, hdr.len);
+					msg[hdr.len] = '\0';
+					syslog(log_syslog_priority(hdr.type), "%s", msg);
+				} else
+#endif
+				if (hdr.len > LOG_ASYNC_BATCH_SIZE) {
+					if (batch_len) log_batch_flush(batch_fd, batch, &batch_len);
+
+					log_ring_copy_out(ring, tail, msg, hdr.len);
+					batch_len = hdr.len;
+					log_batch_flush(hdr.log->fd, (uint8_t *)msg, &batch_len);
+
+				} else {
+					if (batch_len && ((batch_fd != hdr.log->fd) ||
+							  ((batch_len + hdr.len) > LOG_ASYNC_BATCH_SIZE))) {
+						log_batch_flush(batch_fd, batch, &batch_len);
+					}
+
+					log_ring_copy_out(ring, tail, batch + batch_len, hdr.len);
+					batch_fd = hdr.log->fd;
+					batch_len += hdr.len;
+				}
+
+				tail += hdr.len;
+				found = true;
+			}
+
+			atomic_store_explicit(&ring->tail, tail, memory_order_release);
+		}
+
+		if (batch_len) log_batch_flush(batch_fd, batch, &batch_len);
+
+		/*
+		 *	This goes through our own ring, and is
+		 *	written on the next pass.
+		 */
+		if (dropped != reported) {
+			fr_log(&default_log, L_WARN, __FILE__, __LINE__,
+			       "Log rings full, discarded %" PRIu64 " message(s)", dropped - reported);
+			reported = dropped;
+			continue;
+		}
+
+		if (found) continue;
+		if (stop) break;
+
+		/*
+		 *	Wait for a producer to wake us.  Check the
+		 *	rings one more time after announcing that
+		 *	we're asleep, in case we missed a message.
+		 *	The timeout covers any other races.
+		 */
+		atomic_store(&log_writer_sleeping, true);
+		for (ring = atomic_load(&log_rings); ring; ring = ring->next) {
+			if (atomic_load(&ring->head) != atomic_load(&ring->tail)) break;
+		}
+		if (!ring && !atomic_load(&log_writer_stop)) {
+			uint8_t	drain[64];
+
+			if ((poll(&pfd, 1, 100) > 0) && (read(log_wakeup[0], drain, sizeof(drain)) < 0)) {
+				/* Nothing to do */
+			}
+		}
+		atomic_store(&log_writer_sleeping, false);
+	}
+
+	talloc_free(batch);
+
+	return NULL;
+}
+
+/** Write log messages from a background thread
+ *
+ * Messages are still formatted by the thread which logs them, but are then
+ * copied into a lock free ring owned by that thread.  A single writer thread
+ * drains all of the rings, combining consecutive messages for the same file
+ * into one write.  If a ring is full, messages are discarded and counted,
+ * rather than making the caller wait.
+ *
+ * Must be called after the process has daemonized.
+ *
+ * @param[in] ring_size	Size of each thread's ring in bytes.  Rounded up to a
+ *			power of 2.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_log_async_start(size_t ring_size)
+{
+	int	ret;
+
+	if (atomic_load(&log_async)) return 0;
+
+	log_ring_size = 65536;
+	while (log_ring_size < ring_size) log_ring_size <<= 1;
+
+	if (pipe(log_wakeup) < 0) {
+		fr_strerror_printf("Failed creating log writer pipe: %s", fr_syserror(errno));
+		return -1;
+	}
+	(void) fcntl(log_wakeup[0], F_SETFL, O_NONBLOCK);
+	(void) fcntl(log_wakeup[1], F_SETFL, O_NONBLOCK);
+
+	atomic_store(&log_writer_stop, false);
+
+	ret = pthread_create(&log_writer, NULL, log_writer_thread, NULL);
+	if (ret != 0) {
+		fr_strerror_printf("Failed creating log writer thread: %s", fr_syserror(ret));
+		close(log_wakeup[0]);
+		close(log_wakeup[1]);
+		log_wakeup[0] = log_wakeup[1] = -1;
+		return -1;
+	}
+
+	atomic_store(&log_async, true);
+
+	return 0;
+}
+
+/** Write any queued messages, and go back to writing messages directly
+ *
+ */
+void fr_log_async_stop(void)
+{
+	uint8_t		c = 0;
+
+	if (!atomic_load(&log_async)) return;
+
+	atomic_store(&log_async, false);
+	atomic_store(&log_writer_stop, true);
+	if (write(log_wakeup[1], &c, 1) < 0) { /* Writer wakes up anyway */ }
+
+	pthread_join(log_writer, NULL);
+
+	close(log_wakeup[0]);
+	close(log_wakeup[1]);
+	log_wakeup[0] = log_wakeup[1] = -1;
+}
+
+/** Return the number of messages discarded because a ring was full
+ *
+ */
+uint64_t fr_log_async_dropped(void)
+{
+	fr_log_ring_t	*ring;
+	uint64_t	dropped = 0;
+
+	for (ring = atomic_load(&log_rings); ring; ring = ring->next) {
+		dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+	}
+
+	return dropped;
+}
+
 /** Send a server log message to its destination
  *
  * @param[in] log	destination.
@@ -416,43 +818,18 @@ int fr_vlog(fr_log_t const *log, fr_log_type_t type, char const *file, int line,
 
 #ifdef HAVE_SYSLOG_H
 	case L_DST_SYSLOG:
-	{
-		int syslog_priority;
-
-		switch (type) {
-		case L_DBG:
-		case L_DBG_INFO:
-		case L_DBG_WARN:
-		case L_DBG_ERR:
-		case L_DBG_ERR_REQ:
-		case L_DBG_WARN_REQ:
-			syslog_priority= LOG_DEBUG;
-			break;
-
-		case L_INFO:
-			syslog_priority = LOG_INFO;
-			break;
-
-		case L_WARN:
-			syslog_priority = LOG_WARNING;
-			break;
-
-		case L_ERR:
-			syslog_priority = LOG_ERR;
-			break;
-
-		case L_AUTH:
-			syslog_priority = LOG_AUTH | LOG_INFO;
-			break;
+		if (atomic_load_explicit(&log_async, memory_order_relaxed)) {
+			buffer = talloc_asprintf(pool, "%s%s%s", fmt_time, fmt_time[0] ? ": " : "", fmt_msg);
+			if (log_ring_push(log, type, buffer, talloc_array_length(buffer) - 1)) break;
 		}
-		syslog(syslog_priority,
+
+		syslog(log_syslog_priority(type),
 		       "%s"	/* time */
 		       "%s"	/* time sep */
 		       "%s",	/* message */
 		       fmt_time,
 		       fmt_time[0] ? ": " : "",
 		       fmt_msg);
-	}
 		break;
 #endif
 
@@ -482,6 +859,9 @@ int fr_vlog(fr_log_t const *log, fr_log_type_t type, char const *file, int line,
 				 	 colourise ? VTC_RESET : "");
 
 		len = talloc_array_length(buffer) - 1;
+		if (atomic_load_explicit(&log_async, memory_order_relaxed) &&
+		    log_ring_push(log, type, buffer, len)) break;
+
 		wrote = write(log->fd, buffer, len);
 		if (wrote < len) ret = -1;
 	}
@@ -147,6 +147,12 @@ static inline bool fr_rate_limit_enabled(void)
 
 int	fr_log_init(fr_log_t *log, bool daemonize);
 
+int	fr_log_async_start(size_t ring_size);
+
+void	fr_log_async_stop(void);
+
+uint64_t fr_log_async_dropped(void);
+
 TALLOC_CTX	*fr_log_pool_init(void);
 
 int	fr_vlog(fr_log_t const *log, fr_log_type_t lvl, char const *file, int line, char const *fmt, va_list ap)
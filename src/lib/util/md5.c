@@ -17,11 +17,20 @@ RCSID("$Id$")
  */
 #include <freeradius-devel/util/md5.h>
 
-/** The thread local free list
+#define ARRAY_SIZE (8)
+typedef struct {
+	bool		used;
+	fr_md5_ctx_t	*md_ctx;
+} fr_md5_free_list_t;
+
+/** The thread local free list for the local MD5 implementation
+ *
+ * Callers such as the RADIUS encoder need several contexts at once,
+ * so a single thread local ctx isn't enough to avoid heap allocations.
  *
  * Any entries remaining in the list will be freed when the thread is joined
  */
-static _Thread_local fr_md5_ctx_t * md5_ctx;
+static _Thread_local fr_md5_free_list_t * md5_local_array;
 
 /*
  *	If we have OpenSSL's EVP API available, then build wrapper functions.
@@ -30,11 +39,6 @@ static _Thread_local fr_md5_ctx_t * md5_ctx;
  *	be operating in FIPS mode where MD5 digest functions are unavailable.
  */
 #ifdef HAVE_OPENSSL_EVP_H
-#define ARRAY_SIZE (8)
-typedef struct {
-	bool		used;
-	fr_md5_ctx_t	*md_ctx;
-} fr_md5_free_list_t;
 static _Thread_local fr_md5_free_list_t * md5_array;
 
 #  include <openssl/evp.h>
@@ -361,15 +365,17 @@ static void fr_md5_local_ctx_copy(fr_md5_ctx_t *dst, fr_md5_ctx_t const *src)
 
 static void _md5_ctx_local_free_on_exit(void *arg)
 {
-	talloc_free(arg);
+	talloc_free(arg);	/* Contexts are parented by the free list */
 }
 
 /** @copydoc fr_md5_ctx_alloc
  *
  */
-static fr_md5_ctx_t *fr_md5_local_ctx_alloc(bool thread_local)
+static fr_md5_ctx_t *fr_md5_local_ctx_alloc(UNUSED bool thread_local)
 {
-	fr_md5_ctx_local_t *ctx_local;
+	int			i;
+	fr_md5_ctx_local_t	*ctx_local;
+	fr_md5_free_list_t	*free_list;
 
 #ifdef HAVE_OPENSSL_EVP_H
 	if (unlikely(have_openssl_md5 == -1)) {
@@ -400,28 +406,45 @@ static fr_md5_ctx_t *fr_md5_local_ctx_alloc(bool thread_local)
 #endif
 
 	/*
-	 *	Use the thread local ctx to avoid heap allocations.
+	 *	As with the OpenSSL free list, entries are marked
+	 *	as used while they're out, so it's safe to hold one
+	 *	across a yield point, and callers asking for a
+	 *	private ctx get one from the free list too.
 	 */
-	if (thread_local) {
-		if (unlikely(!md5_ctx)) {
-			ctx_local = talloc(NULL, fr_md5_ctx_local_t);
-			if (unlikely(!ctx_local)) return NULL;
+	if (unlikely(!md5_local_array)) {
+		free_list = talloc_zero_array(NULL, fr_md5_free_list_t, ARRAY_SIZE);
+		if (unlikely(!free_list)) {
+		oom:
+			fr_strerror_const("Out of memory");
+			return NULL;
+		}
+
+		fr_atexit_thread_local(md5_local_array, _md5_ctx_local_free_on_exit, free_list);
+
+		for (i = 0; i < ARRAY_SIZE; i++) {
+			ctx_local = talloc(free_list, fr_md5_ctx_local_t);
+			if (unlikely(!ctx_local)) goto oom;
 			fr_md5_local_ctx_reset(ctx_local);
-			fr_atexit_thread_local(md5_ctx, _md5_ctx_local_free_on_exit, ctx_local);
-		} else {
-			ctx_local = md5_ctx;
+			free_list[i].md_ctx = ctx_local;
 		}
-	/*
-	 *	If the MD5 ctx might be used across a yield point
-	 *	shared should be set to false, and new contexts
-	 *	should be allocated.
-	 */
 	} else {
-		ctx_local = talloc(NULL, fr_md5_ctx_local_t);
-		if (unlikely(!ctx_local)) return NULL;
-		fr_md5_local_ctx_reset(ctx_local);
+		free_list = md5_local_array;
 	}
 
+	for (i = 0; i < ARRAY_SIZE; i++) {
+		if (free_list[i].used) continue;
+
+		free_list[i].used = true;
+		return free_list[i].md_ctx;
+	}
+
+	/*
+	 *	No more free contexts, just allocate a new one.
+	 */
+	ctx_local = talloc(NULL, fr_md5_ctx_local_t);
+	if (unlikely(!ctx_local)) goto oom;
+	fr_md5_local_ctx_reset(ctx_local);
+
 	return ctx_local;
 }
 
@@ -430,10 +453,16 @@ static fr_md5_ctx_t *fr_md5_local_ctx_alloc(bool thread_local)
  */
 static void fr_md5_local_ctx_free(fr_md5_ctx_t **ctx)
 {
-	if (md5_ctx && (md5_ctx == *ctx)) {
-		fr_md5_local_ctx_reset(*ctx);
-		*ctx = NULL;
-		return;	/* Don't free the thread_local ctx */
+	int			i;
+	fr_md5_free_list_t	*free_list = md5_local_array;
+
+	if (free_list) for (i = 0; i < ARRAY_SIZE; i++) {
+		if (free_list[i].md_ctx == *ctx) {
+			free_list[i].used = false;
+			fr_md5_local_ctx_reset(*ctx);
+			*ctx = NULL;
+			return;	/* Don't free the thread_local ctx */
+		}
 	}
 
 	talloc_free(*ctx);
@@ -523,6 +523,51 @@ int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
 }
 #endif
 
+#ifndef HAVE_RECVMMSG
+/** Emulates the real recvmmsg in userland
+ *
+ * As with sendmmsg, this doesn't save any system calls, but it means
+ * callers can use the same batched receive code on all platforms.
+ *
+ * Only the first read may block.  Reading stops at the first datagram
+ * which can't be read without blocking.  Any error
+ * is only returned if no datagrams could be read.
+ *
+ * @param[in] sockfd	to read packets from.
+ * @param[in] msgvec	a pointer to an array of mmsghdr structures.
+ *			The size of this array is specified in vlen.
+ * @param[in] vlen	Length of msgvec.
+ * @param[in] flags	same as for recvmsg(2).
+ * @param[in] timeout	ignored.
+ * @return
+ *	- >= 0 The number of messages received.
+ *	- < 0 on error.  Only returned if first operation errors.
+ */
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, UNUSED struct timespec *timeout)
+{
+	unsigned int i;
+
+	for (i = 0; i < vlen; i++) {
+		ssize_t slen;
+
+		/*
+		 *	Only the first read may block.  After that,
+		 *	return whatever we already have.
+		 */
+		slen = recvmsg(sockfd, &msgvec[i].msg_hdr, (i == 0) ? flags : (flags | MSG_DONTWAIT));
+		if (slen < 0) {
+			msgvec[i].msg_len = 0;
+
+			if (i == 0) return -1;
+			return i;
+		}
+		msgvec[i].msg_len = (unsigned int)slen;	/* Number of bytes received */
+	}
+
+	return i;
+}
+#endif
+
 /*
  *	So we don't have ifdef's in the rest of the code
  */
@@ -34,6 +34,13 @@ RCSID("$Id$")
 
 #include <ctype.h>
 
+/** Largest value which fr_pair_copy() allocates along with the pair
+ *
+ * Most string attributes (User-Name, Called-Station-Id, etc.) are
+ * shorter than this.
+ */
+#define FR_PAIR_POOL_VALUE_MAX	(128)
+
 /** Initialise a pair list header
  *
  * @param[in,out] list to initialise
@@ -41,6 +48,7 @@ RCSID("$Id$")
 void fr_pair_list_init(fr_pair_list_t *list)
 {
 	fr_dlist_talloc_init(&list->head, fr_pair_t, entry);
+	list->index = NULL;
 }
 
 /** Free a fr_pair_t
@@ -95,24 +103,258 @@ fr_pair_list_t *fr_pair_list_alloc(TALLOC_CTX *ctx)
 	return pl;
 }
 
-/** Dynamically allocate a new attribute with no #fr_dict_attr_t assigned
+/** Lists shorter than this are always searched linearly
  *
- * This is not the function you're looking for (unless you're binding
- * unknown attributes to pairs, and need to pre-allocate the memory).
- * You probably want #fr_pair_afrom_da instead.
+ * Below this length, walking the list is cheaper than hashing
+ * the da and probing the index.
+ */
+#ifndef FR_PAIR_LIST_INDEX_MIN
+#  define FR_PAIR_LIST_INDEX_MIN	(16)
+#endif
+
+/** An entry in a pair list index
  *
- * @note You must assign a #fr_dict_attr_t before freeing this #fr_pair_t.
+ */
+typedef struct {
+	fr_dict_attr_t const	*da;		//!< NULL if the slot is empty.
+	fr_pair_t		*vp;		//!< First pair with this da.  NULL if all pairs
+						///< with this da were removed after the index was built.
+} fr_pair_list_index_slot_t;
+
+/** Maps each da in a pair list to the first pair which has that da
  *
- * @param[in] ctx	to allocate the pair list in.
+ * The index is built on the first search after the list grows past
+ * #FR_PAIR_LIST_INDEX_MIN, and is kept up to date by #fr_pair_append,
+ * #fr_pair_prepend, #fr_pair_remove and #fr_pair_delete.  Any other
+ * modification of the list changes the generation of the list head,
+ * which causes the index to be rebuilt on the next search.
+ */
+struct fr_pair_list_index_s {
+	fr_dlist_head_t const		*list;		//!< The index was enabled for, in case
+							///< the list header is copied.
+	uint32_t			generation;	//!< Of the list head when the index was last
+							///< brought up to date.
+	bool				built;		//!< Whether the slots describe the list.
+	uint32_t			used;		//!< Number of slots with a da.
+	fr_pair_list_index_slot_t	*slots;		//!< Open addressed table, size is a power of 2.
+};
+
+/** Enable an index of pairs by da for a list
+ *
+ * The index makes #fr_pair_find_by_da O(1) for long lists which
+ * are searched many times, such as the request lists.
+ *
+ * Indexes must only be enabled for lists which are not searched by
+ * multiple threads concurrently, as searches may rebuild the index.
+ *
+ * If the pairs in an indexed list have their da changed in place,
+ * #fr_pair_list_index_invalidate must be called.
+ *
+ * @param[in] ctx	to allocate the index in.  Must not be freed
+ *			before the list.
+ * @param[in] list	to enable the index for.
  * @return
- *	- A new #fr_pair_t.
- *	- NULL if an error occurred.
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-fr_pair_t *fr_pair_alloc_null(TALLOC_CTX *ctx)
+int fr_pair_list_index_enable(TALLOC_CTX *ctx, fr_pair_list_t *list)
+{
+	fr_pair_list_index_t *idx;
+
+	if (list->index && (list->index->list == &list->head)) return 0;
+
+	idx = talloc_zero(ctx, fr_pair_list_index_t);
+	if (unlikely(!idx)) {
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+	idx->list = &list->head;
+	list->index = idx;
+
+	return 0;
+}
+
+/** Invalidate the index of a list, so that it's rebuilt on the next search
+ *
+ * @param[in] list	whose index should be invalidated.
+ */
+void fr_pair_list_index_invalidate(fr_pair_list_t const *list)
+{
+	if (list->index) list->index->built = false;
+}
+
+/** Return the index of a list if it's enabled and up to date
+ *
+ */
+static inline fr_pair_list_index_t *pair_list_index_current(fr_pair_list_t const *list)
+{
+	fr_pair_list_index_t *idx = list->index;
+
+	if (!idx || !idx->built || (idx->list != &list->head) ||
+	    (idx->generation != list->head.generation)) return NULL;
+
+	return idx;
+}
+
+/** Find the slot for a da, which may be empty
+ *
+ */
+static inline fr_pair_list_index_slot_t *pair_list_index_slot(fr_pair_list_index_t *idx, fr_dict_attr_t const *da)
+{
+	size_t mask = talloc_array_length(idx->slots) - 1;
+	size_t i = (size_t)((((uint64_t)(uintptr_t)da) * UINT64_C(0x9e3779b97f4a7c15)) >> 32) & mask;
+
+	while (idx->slots[i].da && (idx->slots[i].da != da)) i = (i + 1) & mask;
+
+	return &idx->slots[i];
+}
+
+/** Add a pair to the index of a list
+ *
+ * @param[in] idx	to add the pair to.
+ * @param[in] vp	being added.
+ * @param[in] first	whether vp was inserted at the head of the list.
+ * @return
+ *	- true if the index is still usable.
+ *	- false if the index must be rebuilt.
+ */
+static bool pair_list_index_add(fr_pair_list_index_t *idx, fr_pair_t *vp, bool first)
+{
+	fr_pair_list_index_slot_t *slot;
+
+	/*
+	 *	Keep the table at most half full, so probe
+	 *	sequences stay short.
+	 */
+	if (((idx->used + 1) * 2) > talloc_array_length(idx->slots)) return false;
+
+	slot = pair_list_index_slot(idx, vp->da);
+	if (!slot->da) {
+		slot->da = vp->da;
+		slot->vp = vp;
+		idx->used++;
+	} else if (first || !slot->vp) {
+		slot->vp = vp;
+	}
+
+	return true;
+}
+
+/** (Re)build the index of a list from scratch
+ *
+ */
+static int pair_list_index_build(fr_pair_list_t const *list)
+{
+	fr_pair_list_index_t	*idx = list->index;
+	fr_pair_t		*vp = NULL;
+	size_t			size = 32;
+
+	while (size < (fr_dlist_num_elements(&list->head) * 2)) size <<= 1;
+
+	if (talloc_array_length(idx->slots) < size) {
+		fr_pair_list_index_slot_t *slots;
+
+		slots = talloc_realloc(idx, idx->slots, fr_pair_list_index_slot_t, size);
+		if (unlikely(!slots)) {
+			idx->built = false;
+			return -1;
+		}
+		idx->slots = slots;
+	}
+	memset(idx->slots, 0, talloc_array_length(idx->slots) * sizeof(idx->slots[0]));
+	idx->used = 0;
+
+	while ((vp = fr_dlist_next(&list->head, vp))) (void)pair_list_index_add(idx, vp, false);
+
+	idx->generation = list->head.generation;
+	idx->built = true;
+
+	return 0;
+}
+
+/** Update the index of a list after inserting a pair
+ *
+ */
+static inline void pair_list_index_insert(fr_pair_list_t *list, fr_pair_list_index_t *idx, fr_pair_t *vp, bool first)
+{
+	if (!idx) return;
+
+	if (!pair_list_index_add(idx, vp, first)) {
+		idx->built = false;
+		return;
+	}
+	idx->generation = list->head.generation;
+}
+
+/** Update the index of a list before removing a pair
+ *
+ * If vp is the first pair with its da, the next pair with the same da
+ * takes its place in the index.
+ */
+static inline void pair_list_index_remove(fr_pair_list_t *list, fr_pair_list_index_t *idx, fr_pair_t *vp)
+{
+	fr_pair_list_index_slot_t	*slot;
+	fr_pair_t			*next;
+
+	if (!idx) return;
+
+	slot = pair_list_index_slot(idx, vp->da);
+	if (slot->vp != vp) return;
+
+	for (next = fr_dlist_next(&list->head, vp);
+	     next && (next->da != vp->da);
+	     next = fr_dlist_next(&list->head, next));
+	slot->vp = next;
+}
+
+/** Find the first pair with a da using the index of a list
+ *
+ * @param[out] out	First pair with da, or NULL if there is none.
+ * @param[in] list	to search in.
+ * @param[in] da	to search for.
+ * @return
+ *	- true if out was set from the index.
+ *	- false if the list must be searched linearly.
+ */
+static inline bool pair_list_index_find(fr_pair_t **out, fr_pair_list_t const *list, fr_dict_attr_t const *da)
+{
+	fr_pair_list_index_t		*idx = list->index;
+	fr_pair_list_index_slot_t	*slot;
+
+	if (!idx || (fr_dlist_num_elements(&list->head) < FR_PAIR_LIST_INDEX_MIN) ||
+	    (idx->list != &list->head)) return false;
+
+	if (!pair_list_index_current(list) && (pair_list_index_build(list) < 0)) return false;
+
+	slot = pair_list_index_slot(idx, da);
+	if (unlikely(slot->vp && (slot->vp->da != da))) {
+		idx->built = false;
+		return false;
+	}
+	*out = slot->vp;
+
+	return true;
+}
+
+/** Allocate a pair, optionally with space for its value buffer
+ *
+ * @param[in] ctx		to allocate the pair in.
+ * @param[in] value_size	if > 0, the pair is allocated as a pool
+ *				large enough to hold one extra chunk of
+ *				this size.  Allocating the value buffer
+ *				in the pair then doesn't need another
+ *				call to malloc.
+ */
+static inline CC_HINT(always_inline) fr_pair_t *pair_alloc_null(TALLOC_CTX *ctx, size_t value_size)
 {
 	fr_pair_t *vp;
 
-	vp = talloc_zero(ctx, fr_pair_t);
+	if (value_size) {
+		vp = talloc_pooled_object(ctx, fr_pair_t, 1, value_size);
+		if (vp) memset(vp, 0, sizeof(*vp));
+	} else {
+		vp = talloc_zero(ctx, fr_pair_t);
+	}
 	if (!vp) {
 		fr_strerror_printf("Out of memory");
 		return NULL;
@@ -127,6 +369,24 @@ fr_pair_t *fr_pair_alloc_null(TALLOC_CTX *ctx)
 	return vp;
 }
 
+/** Dynamically allocate a new attribute with no #fr_dict_attr_t assigned
+ *
+ * This is not the function you're looking for (unless you're binding
+ * unknown attributes to pairs, and need to pre-allocate the memory).
+ * You probably want #fr_pair_afrom_da instead.
+ *
+ * @note You must assign a #fr_dict_attr_t before freeing this #fr_pair_t.
+ *
+ * @param[in] ctx	to allocate the pair list in.
+ * @return
+ *	- A new #fr_pair_t.
+ *	- NULL if an error occurred.
+ */
+fr_pair_t *fr_pair_alloc_null(TALLOC_CTX *ctx)
+{
+	return pair_alloc_null(ctx, 0);
+}
+
 /** A special allocation function which disables child autofree
  *
  * This is intended to allocate root attributes for requests.
@@ -179,26 +439,12 @@ fr_pair_t *fr_pair_root_afrom_da(TALLOC_CTX *ctx, fr_dict_attr_t const *da)
 	return vp;
 }
 
-/** Dynamically allocate a new attribute and assign a #fr_dict_attr_t
- *
- * @note Will duplicate any unknown attributes passed as the da.
- *
- * @param[in] ctx	for allocated memory, usually a pointer to a #fr_radius_packet_t
- * @param[in] da	Specifies the dictionary attribute to build the #fr_pair_t from.
- * @return
- *	- A new #fr_pair_t.
- *	- NULL if an error occurred.
- * @hidecallergraph
- */
-fr_pair_t *fr_pair_afrom_da(TALLOC_CTX *ctx, fr_dict_attr_t const *da)
+static fr_pair_t *pair_afrom_da(TALLOC_CTX *ctx, fr_dict_attr_t const *da, size_t value_size)
 {
 	fr_pair_t *vp;
 
-	vp = fr_pair_alloc_null(ctx);
-	if (!vp) {
-		fr_strerror_printf("Out of memory");
-		return NULL;
-	}
+	vp = pair_alloc_null(ctx, value_size);
+	if (!vp) return NULL;
 
 	/*
 	 *	If we get passed an unknown da, we need to ensure that
@@ -228,6 +474,22 @@ fr_pair_t *fr_pair_afrom_da(TALLOC_CTX *ctx, fr_dict_attr_t const *da)
 	return vp;
 }
 
+/** Dynamically allocate a new attribute and assign a #fr_dict_attr_t
+ *
+ * @note Will duplicate any unknown attributes passed as the da.
+ *
+ * @param[in] ctx	for allocated memory, usually a pointer to a #fr_radius_packet_t
+ * @param[in] da	Specifies the dictionary attribute to build the #fr_pair_t from.
+ * @return
+ *	- A new #fr_pair_t.
+ *	- NULL if an error occurred.
+ * @hidecallergraph
+ */
+fr_pair_t *fr_pair_afrom_da(TALLOC_CTX *ctx, fr_dict_attr_t const *da)
+{
+	return pair_afrom_da(ctx, da, 0);
+}
+
 /** Create a new valuepair
  *
  * If attr and vendor match a dictionary entry then a VP with that #fr_dict_attr_t
@@ -283,13 +545,31 @@ fr_pair_t *fr_pair_afrom_child_num(TALLOC_CTX *ctx, fr_dict_attr_t const *parent
  */
 fr_pair_t *fr_pair_copy(TALLOC_CTX *ctx, fr_pair_t const *vp)
 {
-	fr_pair_t *n;
+	fr_pair_t	*n;
+	size_t		value_size = 0;
 
 	if (!vp) return NULL;
 
 	VP_VERIFY(vp);
 
-	n = fr_pair_afrom_da(ctx, vp->da);
+	/*
+	 *	Short strings and octets are copied into the same
+	 *	allocation as the pair.
+	 */
+	if ((vp->type != VT_XLAT) && !vp->da->flags.is_unknown) switch (vp->vp_type) {
+	case FR_TYPE_STRING:
+		if (vp->vp_length < FR_PAIR_POOL_VALUE_MAX) value_size = vp->vp_length + 1;
+		break;
+
+	case FR_TYPE_OCTETS:
+		if (vp->vp_length && (vp->vp_length <= FR_PAIR_POOL_VALUE_MAX)) value_size = vp->vp_length;
+		break;
+
+	default:
+		break;
+	}
+
+	n = pair_afrom_da(ctx, vp->da, value_size);
 	if (!n) return NULL;
 
 	n->op = vp->op;
@@ -540,6 +820,15 @@ fr_pair_t *fr_pair_find_by_da(fr_pair_list_t const *list, fr_dict_attr_t const *
 
 	if (!da) return NULL;
 
+	/*
+	 *	Start from the first matching pair
+	 *	if the list is indexed.
+	 */
+	if (pair_list_index_find(&vp, list, da)) {
+		if (!vp || (n == 0)) return vp;
+		n--;
+	}
+
 	while ((vp = fr_pair_list_next(list, vp))) {
 		if (da == vp->da) {
 			if (n == 0) return vp;
@@ -691,6 +980,8 @@ void *fr_pair_list_tail(fr_pair_list_t const *list)
  */
 int fr_pair_prepend(fr_pair_list_t *list, fr_pair_t *to_add)
 {
+	fr_pair_list_index_t *idx;
+
 	VP_VERIFY(to_add);
 
 	if (fr_dlist_entry_in_list(&to_add->entry)) {
@@ -698,7 +989,9 @@ int fr_pair_prepend(fr_pair_list_t *list, fr_pair_t *to_add)
 		return -1;
 	}
 
+	idx = pair_list_index_current(list);
 	fr_dlist_insert_head(&list->head, to_add);
+	pair_list_index_insert(list, idx, to_add, true);
 
 	return 0;
 }
@@ -715,6 +1008,8 @@ int fr_pair_prepend(fr_pair_list_t *list, fr_pair_t *to_add)
  */
 int fr_pair_append(fr_pair_list_t *list, fr_pair_t *to_add)
 {
+	fr_pair_list_index_t *idx;
+
 	VP_VERIFY(to_add);
 
 	if (fr_dlist_entry_in_list(&to_add->entry)) {
@@ -722,7 +1017,9 @@ int fr_pair_append(fr_pair_list_t *list, fr_pair_t *to_add)
 		return -1;
 	}
 
+	idx = pair_list_index_current(list);
 	fr_dlist_insert_tail(&list->head, to_add);
+	pair_list_index_insert(list, idx, to_add, false);
 
 	return 0;
 }
@@ -927,10 +1224,14 @@ int fr_pair_delete_by_da(fr_pair_list_t *list, fr_dict_attr_t const *da)
  */
 fr_pair_t *fr_pair_remove(fr_pair_list_t *list, fr_pair_t *vp)
 {
-	fr_pair_t *prev;
+	fr_pair_t		*prev;
+	fr_pair_list_index_t	*idx;
 
 	prev = fr_pair_list_prev(list, vp);
+	idx = pair_list_index_current(list);
+	pair_list_index_remove(list, idx, vp);
 	fr_dlist_remove(&list->head, vp);
+	if (idx) idx->generation = list->head.generation;
 
 	return prev;
 }
@@ -943,10 +1244,14 @@ fr_pair_t *fr_pair_remove(fr_pair_list_t *list, fr_pair_t *vp)
  */
 fr_pair_t *fr_pair_delete(fr_pair_list_t *list, fr_pair_t *vp)
 {
-	fr_pair_t *prev;
+	fr_pair_t		*prev;
+	fr_pair_list_index_t	*idx;
 
 	prev = fr_pair_list_prev(list, vp);
+	idx = pair_list_index_current(list);
+	pair_list_index_remove(list, idx, vp);
 	fr_dlist_remove(&list->head, vp);
+	if (idx) idx->generation = list->head.generation;
 	talloc_free(vp);
 
 	return prev;
@@ -1422,6 +1727,34 @@ int fr_pair_list_copy(TALLOC_CTX *ctx, fr_pair_list_t *to, fr_pair_list_t const
 	return cnt;
 }
 
+/** Move all pairs from one list to another, changing their talloc ctx
+ *
+ * Cheaper alternative to #fr_pair_list_copy for when the source list is
+ * about to be freed, i.e. when returning attributes from a child request.
+ * No pairs are duplicated, nested pairs move along with their parent.
+ *
+ * @param[in] ctx	to move #fr_pair_t (s) into.
+ * @param[in] to	where to move attributes to.
+ * @param[in] from	whence to move #fr_pair_t (s).  Will be empty on return.
+ * @return the number of attributes moved.
+ */
+int fr_pair_list_steal(TALLOC_CTX *ctx, fr_pair_list_t *to, fr_pair_list_t *from)
+{
+	fr_pair_t	*vp;
+	int		cnt = 0;
+
+	for (vp = fr_pair_list_head(from);
+	     vp;
+	     vp = fr_pair_list_next(from, vp), cnt++) {
+		VP_VERIFY(vp);
+		(void)talloc_steal(ctx, vp);
+	}
+
+	fr_pair_list_append(to, from);
+
+	return cnt;
+}
+
 /** Duplicate pairs in a list matching the specified da
  *
  * Copy all pairs from 'from' matching the specified da.
@@ -62,8 +62,12 @@ typedef enum value_type {
 
 typedef struct value_pair_s fr_pair_t;
 
+typedef struct fr_pair_list_index_s fr_pair_list_index_t;
+
 typedef struct {
         fr_dlist_head_t head;
+        fr_pair_list_index_t *index;				//!< Optional index of pairs by da.
+								///< See #fr_pair_list_index_enable.
 } fr_pair_list_t;
 
 /** Stores an attribute, a value and various bits of other data
@@ -192,6 +196,10 @@ bool		fr_pair_list_empty(fr_pair_list_t const *list) CC_HINT(nonnull);
 
 size_t		fr_pair_list_len(fr_pair_list_t const *list) CC_HINT(nonnull);
 
+int		fr_pair_list_index_enable(TALLOC_CTX *ctx, fr_pair_list_t *list) CC_HINT(nonnull(2));
+
+void		fr_pair_list_index_invalidate(fr_pair_list_t const *list) CC_HINT(nonnull);
+
 /* Searching and list modification */
 int		fr_pair_to_unknown(fr_pair_t *vp);
 void		*fr_pair_iter_next_by_da(fr_dlist_head_t *list, void *to_eval, void *uctx);
@@ -229,6 +237,114 @@ static inline fr_pair_t *fr_dcursor_iter_by_ancestor_init(fr_dcursor_t *cursor,
 	return fr_dcursor_talloc_iter_init(cursor, &list->head, fr_pair_iter_next_by_ancestor, da, fr_pair_t);
 }
 
+/** @name Fast path iteration
+ *
+ * These walk the list directly, instead of making an indirect call to an
+ * #fr_dcursor_iter_t for every step, so the compiler can inline the whole
+ * loop.  They should be used where a cursor isn't otherwise needed,
+ * i.e. the loop doesn't insert or remove pairs, and the position isn't
+ * passed to another function.
+ *
+ * @{
+ */
+
+/** Return vp, or the first pair after it, which is of the specified #fr_dict_attr_t
+ *
+ * @param[in] list	vp is in.
+ * @param[in] vp	to start searching from.  May be NULL.
+ * @param[in] da	to search for.
+ * @return
+ *	- The first matching pair.
+ *	- NULL if no pairs match.
+ */
+static inline fr_pair_t *fr_pair_list_seek_by_da(fr_pair_list_t const *list, fr_pair_t const *vp,
+						 fr_dict_attr_t const *da)
+{
+	while (vp && (vp->da != da)) vp = fr_dlist_next(&list->head, vp);
+
+	return UNCONST(fr_pair_t *, vp);
+}
+
+/** Return vp, or the first pair after it, which is a descendent of the specified #fr_dict_attr_t
+ *
+ * @param[in] list	vp is in.
+ * @param[in] vp	to start searching from.  May be NULL.
+ * @param[in] da	who's descendents to search for.
+ * @return
+ *	- The first matching pair.
+ *	- NULL if no pairs match.
+ */
+static inline fr_pair_t *fr_pair_list_seek_by_ancestor(fr_pair_list_t const *list, fr_pair_t const *vp,
+						       fr_dict_attr_t const *da)
+{
+	while (vp && !fr_dict_attr_common_parent(da, vp->da, true)) vp = fr_dlist_next(&list->head, vp);
+
+	return UNCONST(fr_pair_t *, vp);
+}
+
+/** Return vp, or the first pair after it, which is an immediate child of the specified #fr_dict_attr_t
+ *
+ * @param[in] list	vp is in.
+ * @param[in] vp	to start searching from.  May be NULL.
+ * @param[in] parent	of the attributes to search for.
+ * @return
+ *	- The first matching pair.
+ *	- NULL if no pairs match.
+ */
+static inline fr_pair_t *fr_pair_list_seek_by_parent(fr_pair_list_t const *list, fr_pair_t const *vp,
+						     fr_dict_attr_t const *parent)
+{
+	while (vp && (vp->da->parent != parent)) vp = fr_dlist_next(&list->head, vp);
+
+	return UNCONST(fr_pair_t *, vp);
+}
+
+/** Iterate over all the pairs in a list
+ *
+ * @param[in] _list	to iterate over.
+ * @param[in] _iter	Name of iteration variable.
+ *			Will be declared in the scope of the loop.
+ */
+#define fr_pair_list_foreach(_list, _iter) \
+	fr_dlist_foreach(&(_list)->head, fr_pair_t, _iter)
+
+/** Iterate over the pairs in a list which are of the specified #fr_dict_attr_t
+ *
+ * @param[in] _list	to iterate over.
+ * @param[in] _iter	Name of iteration variable.
+ *			Will be declared in the scope of the loop.
+ * @param[in] _da	to search for.
+ */
+#define fr_pair_list_foreach_by_da(_list, _iter, _da) \
+	for (fr_pair_t *_iter = fr_pair_list_seek_by_da(_list, fr_dlist_head(&(_list)->head), _da); \
+	     _iter; \
+	     _iter = fr_pair_list_seek_by_da(_list, fr_dlist_next(&(_list)->head, _iter), _da))
+
+/** Iterate over the pairs in a list which are descendents of the specified #fr_dict_attr_t
+ *
+ * @param[in] _list	to iterate over.
+ * @param[in] _iter	Name of iteration variable.
+ *			Will be declared in the scope of the loop.
+ * @param[in] _da	who's descendents to search for.
+ */
+#define fr_pair_list_foreach_by_ancestor(_list, _iter, _da) \
+	for (fr_pair_t *_iter = fr_pair_list_seek_by_ancestor(_list, fr_dlist_head(&(_list)->head), _da); \
+	     _iter; \
+	     _iter = fr_pair_list_seek_by_ancestor(_list, fr_dlist_next(&(_list)->head, _iter), _da))
+
+/** Iterate over the pairs in a list which are immediate children of the specified #fr_dict_attr_t
+ *
+ * @param[in] _list	to iterate over.
+ * @param[in] _iter	Name of iteration variable.
+ *			Will be declared in the scope of the loop.
+ * @param[in] _parent	of the attributes to search for.
+ */
+#define fr_pair_list_foreach_by_parent(_list, _iter, _parent) \
+	for (fr_pair_t *_iter = fr_pair_list_seek_by_parent(_list, fr_dlist_head(&(_list)->head), _parent); \
+	     _iter; \
+	     _iter = fr_pair_list_seek_by_parent(_list, fr_dlist_next(&(_list)->head, _iter), _parent))
+/** @} */
+
 /** @hidecallergraph */
 unsigned int	fr_pair_count_by_da(fr_pair_list_t const *list, fr_dict_attr_t const *da) CC_HINT(nonnull);
 
@@ -283,6 +399,7 @@ bool 		fr_pair_validate_relaxed(fr_pair_t const *failed[2], fr_pair_list_t *filt
 
 /* Lists */
 int		fr_pair_list_copy(TALLOC_CTX *ctx, fr_pair_list_t *to, fr_pair_list_t const *from);
+int		fr_pair_list_steal(TALLOC_CTX *ctx, fr_pair_list_t *to, fr_pair_list_t *from);
 int		fr_pair_list_copy_by_da(TALLOC_CTX *ctx, fr_pair_list_t *to,
 					fr_pair_list_t *from, fr_dict_attr_t const *da, unsigned int count);
 int		fr_pair_list_copy_by_ancestor(TALLOC_CTX *ctx, fr_pair_list_t *to,
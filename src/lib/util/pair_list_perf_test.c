@@ -46,6 +46,12 @@ static void pair_list_perf_init(void);
 #undef WITH_VERIFY_PTR
 #endif
 
+/*
+ *	Index lists of any length, so the indexed tests
+ *	show where the index starts beating a linear search.
+ */
+#define FR_PAIR_LIST_INDEX_MIN	(0)
+
 #include "pair.c"
 #include <freeradius-devel/util/dict_test.h>
 #include <freeradius-devel/server/base.h>
@@ -264,7 +270,7 @@ static void do_test_fr_pair_append(unsigned int len, unsigned int reps, fr_pair_
 	TEST_MSG_ALWAYS("per_sec=%0.0lf", (reps * len)/((double)used / NSEC));
 }
 
-static void do_test_fr_pair_find_by_da(unsigned int len, unsigned int reps, fr_pair_t *source_vps[])
+static void pair_list_find_by_da(unsigned int len, unsigned int reps, fr_pair_t *source_vps[], bool indexed)
 {
 	fr_pair_list_t		test_vps;
 	unsigned int		i, j;
@@ -274,6 +280,7 @@ static void do_test_fr_pair_find_by_da(unsigned int len, unsigned int reps, fr_p
 	size_t			input_count = talloc_array_length(source_vps);
 
 	fr_pair_list_init(&test_vps);
+	if (indexed) TEST_CHECK(fr_pair_list_index_enable(autofree, &test_vps) == 0);
 
 	/*
 	 *  Initialise the test list
@@ -304,7 +311,17 @@ static void do_test_fr_pair_find_by_da(unsigned int len, unsigned int reps, fr_p
 	TEST_MSG_ALWAYS("per_sec=%0.0lf", (reps * len)/((double)used / NSEC));
 }
 
-static void do_test_find_nth(unsigned int len, unsigned int reps, fr_pair_t *source_vps[])
+static void do_test_fr_pair_find_by_da(unsigned int len, unsigned int reps, fr_pair_t *source_vps[])
+{
+	pair_list_find_by_da(len, reps, source_vps, false);
+}
+
+static void do_test_fr_pair_find_by_da_indexed(unsigned int len, unsigned int reps, fr_pair_t *source_vps[])
+{
+	pair_list_find_by_da(len, reps, source_vps, true);
+}
+
+static void pair_list_find_nth(unsigned int len, unsigned int reps, fr_pair_t *source_vps[], bool indexed)
 {
 	fr_pair_list_t	  	test_vps;
 	unsigned int		i, j, nth_item;
@@ -314,6 +331,7 @@ static void do_test_find_nth(unsigned int len, unsigned int reps, fr_pair_t *sou
 	size_t			input_count = talloc_array_length(source_vps);
 
 	fr_pair_list_init(&test_vps);
+	if (indexed) TEST_CHECK(fr_pair_list_index_enable(autofree, &test_vps) == 0);
 
 	/*
 	 *  Initialise the test list
@@ -346,6 +364,16 @@ static void do_test_find_nth(unsigned int len, unsigned int reps, fr_pair_t *sou
 	TEST_MSG_ALWAYS("per_sec=%0.0lf", (reps * len)/((double)used / NSEC));
 }
 
+static void do_test_find_nth(unsigned int len, unsigned int reps, fr_pair_t *source_vps[])
+{
+	pair_list_find_nth(len, reps, source_vps, false);
+}
+
+static void do_test_find_nth_indexed(unsigned int len, unsigned int reps, fr_pair_t *source_vps[])
+{
+	pair_list_find_nth(len, reps, source_vps, true);
+}
+
 static void do_test_fr_pair_list_free(unsigned int len, unsigned int reps, fr_pair_t *source_vps[])
 {
 	fr_pair_list_t  test_vps;
@@ -387,11 +415,22 @@ static void test_ ## _func ## _ ## _count(void)\
 	test_func(_func, 80, source_vps_0) \
 	test_func(_func, 100, source_vps_0)
 
+#define crossover_funcs(_func) \
+	test_func(_func, 4, source_vps_0) \
+	test_func(_func, 8, source_vps_0) \
+	test_func(_func, 12, source_vps_0) \
+	test_func(_func, 16, source_vps_0)
+
 test_funcs(fr_pair_append)
 test_funcs(fr_pair_find_by_da)
+test_funcs(fr_pair_find_by_da_indexed)
 test_funcs(find_nth)
+test_funcs(find_nth_indexed)
 test_funcs(fr_pair_list_free)
 
+crossover_funcs(fr_pair_find_by_da)
+crossover_funcs(fr_pair_find_by_da_indexed)
+
 #define repetition_tests(_func) \
 	{ #_func "_20", test_ ## _func ## _20},\
 	{ #_func "_40", test_ ## _func ## _40},\
@@ -399,10 +438,20 @@ test_funcs(fr_pair_list_free)
 	{ #_func "_80", test_ ## _func ## _80},\
 	{ #_func "_100", test_ ## _func ## _100},\
 
+#define crossover_tests(_func) \
+	{ #_func "_4", test_ ## _func ## _4},\
+	{ #_func "_8", test_ ## _func ## _8},\
+	{ #_func "_12", test_ ## _func ## _12},\
+	{ #_func "_16", test_ ## _func ## _16},\
+
 TEST_LIST = {
 	repetition_tests(fr_pair_append)
+	crossover_tests(fr_pair_find_by_da)
 	repetition_tests(fr_pair_find_by_da)
+	crossover_tests(fr_pair_find_by_da_indexed)
+	repetition_tests(fr_pair_find_by_da_indexed)
 	repetition_tests(find_nth)
+	repetition_tests(find_nth_indexed)
 	repetition_tests(fr_pair_list_free)
 
 	{ NULL }
@@ -143,6 +143,53 @@ static void test_fr_pair_copy(void)
 	talloc_free(copy);
 }
 
+static void test_fr_pair_copy_value(void)
+{
+	fr_pair_t	*vp, *copy;
+	char		buffer[256];
+
+	TEST_CASE("Copying a short string");
+	TEST_CHECK((vp = fr_pair_afrom_da(autofree, fr_dict_attr_test_string)) != NULL);
+	TEST_CHECK(fr_pair_value_strdup(vp, "bob") == 0);
+	TEST_CHECK((copy = fr_pair_copy(autofree, vp)) != NULL);
+	VP_VERIFY(copy);
+	TEST_CHECK(strcmp(copy->vp_strvalue, "bob") == 0);
+	TEST_CHECK(talloc_parent(copy->vp_strvalue) == copy);
+
+	TEST_CASE("Replacing the value of the copy");
+	memset(buffer, 'a', sizeof(buffer) - 1);
+	buffer[sizeof(buffer) - 1] = '\0';
+	TEST_CHECK(fr_pair_value_strdup(copy, buffer) == 0);
+	TEST_CHECK(copy->vp_length == sizeof(buffer) - 1);
+	talloc_free(copy);
+
+	TEST_CASE("Copying a long string");
+	TEST_CHECK(fr_pair_value_strdup(vp, buffer) == 0);
+	TEST_CHECK((copy = fr_pair_copy(autofree, vp)) != NULL);
+	TEST_CHECK(strcmp(copy->vp_strvalue, buffer) == 0);
+	talloc_free(copy);
+	talloc_free(vp);
+
+	TEST_CASE("Copying short octets");
+	TEST_CHECK((vp = fr_pair_afrom_da(autofree, fr_dict_attr_test_octets)) != NULL);
+	TEST_CHECK(fr_pair_value_memdup(vp, (uint8_t const *)"\x01\x02\x03", 3, false) == 0);
+	TEST_CHECK((copy = fr_pair_copy(autofree, vp)) != NULL);
+	VP_VERIFY(copy);
+	TEST_CHECK((copy->vp_length == 3) && (memcmp(copy->vp_octets, "\x01\x02\x03", 3) == 0));
+
+	TEST_CASE("Stealing the value out of the copy");
+	{
+		uint8_t const *octets = talloc_steal(autofree, copy->vp_octets);
+
+		copy->vp_octets = NULL;
+		copy->vp_length = 0;
+		talloc_free(copy);
+		TEST_CHECK(memcmp(octets, "\x01\x02\x03", 3) == 0);
+		talloc_free(UNCONST(uint8_t *, octets));
+	}
+	talloc_free(vp);
+}
+
 static void test_fr_pair_steal(void)
 {
 	fr_pair_t  *vp;
@@ -161,6 +208,48 @@ static void test_fr_pair_steal(void)
 	TEST_CHECK(talloc_parent(vp) == autofree);
 }
 
+static void test_fr_pair_list_foreach_by_da(void)
+{
+	fr_pair_t	*vp;
+	fr_dcursor_t	cursor;
+	unsigned int	expected = 0, found = 0;
+
+	for (vp = fr_dcursor_iter_by_da_init(&cursor, &test_pairs, fr_dict_attr_test_uint32);
+	     vp;
+	     vp = fr_dcursor_next(&cursor)) expected++;
+
+	TEST_CASE("Searching for fr_dict_attr_test_uint32 using fr_pair_list_foreach_by_da()");
+	fr_pair_list_foreach_by_da(&test_pairs, match, fr_dict_attr_test_uint32) {
+		TEST_CHECK(match->da == fr_dict_attr_test_uint32);
+		found++;
+	}
+
+	TEST_CASE("Expected the same number of pairs as fr_dcursor_iter_by_da_init()");
+	TEST_CHECK(found == expected);
+	TEST_MSG("Expected %u, got %u", expected, found);
+}
+
+static void test_fr_pair_list_foreach_by_ancestor(void)
+{
+	fr_pair_t	*vp;
+	fr_dcursor_t	cursor;
+	unsigned int	expected = 0, found = 0;
+
+	for (vp = fr_dcursor_iter_by_ancestor_init(&cursor, &test_pairs, fr_dict_attr_test_tlv);
+	     vp;
+	     vp = fr_dcursor_next(&cursor)) expected++;
+
+	TEST_CASE("Searching for descendents of fr_dict_attr_test_tlv using fr_pair_list_foreach_by_ancestor()");
+	fr_pair_list_foreach_by_ancestor(&test_pairs, match, fr_dict_attr_test_tlv) {
+		TEST_CHECK(fr_dict_attr_common_parent(fr_dict_attr_test_tlv, match->da, true) != NULL);
+		found++;
+	}
+
+	TEST_CASE("Expected the same number of pairs as fr_dcursor_iter_by_ancestor_init()");
+	TEST_CHECK(found == expected);
+	TEST_MSG("Expected %u, got %u", expected, found);
+}
+
 static void test_fr_pair_to_unknown(void)
 {
 	fr_pair_t *vp;
@@ -240,6 +329,55 @@ static void test_fr_pair_find_by_da(void)
 	TEST_CHECK(vp && vp->da == fr_dict_attr_test_tlv_string);
 }
 
+static void test_fr_pair_find_by_da_indexed(void)
+{
+	fr_pair_list_t	list;
+	fr_pair_t	*vp, *first, *second;
+	fr_dcursor_t	cursor;
+	int		i;
+
+	fr_pair_list_init(&list);
+	TEST_CHECK(fr_pair_list_index_enable(autofree, &list) == 0);
+
+	TEST_CASE("Populate a list long enough to be indexed");
+	for (i = 0; i < 64; i++) {
+		TEST_CHECK(fr_pair_append_by_da(autofree, &vp, &list, fr_dict_attr_test_uint32) == 0);
+		vp->vp_uint32 = i;
+	}
+	TEST_CHECK(fr_pair_append_by_da(autofree, &first, &list, fr_dict_attr_test_string) == 0);
+	TEST_CHECK(fr_pair_append_by_da(autofree, &second, &list, fr_dict_attr_test_string) == 0);
+
+	TEST_CASE("Index finds the first and nth instances");
+	TEST_CHECK(fr_pair_find_by_da(&list, fr_dict_attr_test_string, 0) == first);
+	TEST_CHECK(fr_pair_find_by_da(&list, fr_dict_attr_test_string, 1) == second);
+	TEST_CHECK(fr_pair_find_by_da(&list, fr_dict_attr_test_string, 2) == NULL);
+	TEST_CHECK(fr_pair_find_by_da(&list, fr_dict_attr_test_octets, 0) == NULL);
+	vp = fr_pair_find_by_da(&list, fr_dict_attr_test_uint32, 5);
+	TEST_CHECK(vp && (vp->vp_uint32 == 5));
+
+	TEST_CASE("Index is maintained on removal");
+	fr_pair_delete(&list, first);
+	TEST_CHECK(fr_pair_find_by_da(&list, fr_dict_attr_test_string, 0) == second);
+	fr_pair_remove(&list, second);
+	TEST_CHECK(fr_pair_find_by_da(&list, fr_dict_attr_test_string, 0) == NULL);
+
+	TEST_CASE("Index is maintained on insertion");
+	fr_pair_append(&list, second);
+	TEST_CHECK(fr_pair_find_by_da(&list, fr_dict_attr_test_string, 0) == second);
+	TEST_CHECK(fr_pair_prepend_by_da(autofree, &first, &list, fr_dict_attr_test_string) == 0);
+	TEST_CHECK(fr_pair_find_by_da(&list, fr_dict_attr_test_string, 0) == first);
+
+	TEST_CASE("Index is rebuilt after modification through a cursor");
+	fr_dcursor_init(&cursor, &list);
+	vp = fr_dcursor_remove(&cursor);
+	TEST_CHECK(vp == first);
+	talloc_free(vp);
+	TEST_CHECK(fr_pair_find_by_da(&list, fr_dict_attr_test_string, 0) == second);
+
+	fr_pair_list_free(&list);
+	TEST_CHECK(fr_pair_find_by_da(&list, fr_dict_attr_test_string, 0) == NULL);
+}
+
 static void test_fr_pair_find_by_child_num(void)
 {
 	fr_pair_t *vp;
@@ -421,6 +559,36 @@ static void test_fr_pair_list_copy(void)
 	fr_pair_list_free(&local_pairs);
 }
 
+static void test_fr_pair_list_steal(void)
+{
+	TALLOC_CTX	*ctx = talloc_new(autofree), *dst_ctx = talloc_new(autofree);
+	fr_pair_list_t	copy_pairs, local_pairs;
+	fr_pair_t	*vp;
+
+	fr_pair_list_init(&copy_pairs);
+	fr_pair_list_init(&local_pairs);
+
+	TEST_CASE("Copy 'test_pairs' into 'copy_pairs'");
+	TEST_CHECK(fr_pair_list_copy(ctx, &copy_pairs, &test_pairs) > 0);
+
+	TEST_CASE("Steal 'copy_pairs' into 'local_pairs'");
+	TEST_CHECK(fr_pair_list_steal(dst_ctx, &local_pairs, &copy_pairs) == (int)fr_pair_list_len(&test_pairs));
+	TEST_CHECK(fr_pair_list_empty(&copy_pairs));
+
+	TEST_CASE("Check if 'local_pairs' == 'test_pairs' using fr_pair_list_cmp()");
+	TEST_CHECK(fr_pair_list_cmp(&local_pairs, &test_pairs) == 0);
+
+	TEST_CASE("Pairs must survive freeing the original ctx");
+	talloc_free(ctx);
+	for (vp = fr_pair_list_head(&local_pairs); vp; vp = fr_pair_list_next(&local_pairs, vp)) {
+		TEST_CHECK(talloc_parent(vp) == dst_ctx);
+		VP_VERIFY(vp);
+	}
+	TEST_CHECK(fr_pair_list_cmp(&local_pairs, &test_pairs) == 0);
+
+	talloc_free(dst_ctx);
+}
+
 static void test_fr_pair_list_copy_by_da(void)
 {
 	fr_dcursor_t   cursor;
@@ -1122,13 +1290,17 @@ TEST_LIST = {
 	{ "fr_pair_afrom_da",                     test_fr_pair_afrom_da },
 	{ "fr_pair_afrom_child_num",              test_fr_pair_afrom_child_num },
 	{ "fr_pair_copy",                         test_fr_pair_copy },
+	{ "fr_pair_copy_value",                   test_fr_pair_copy_value },
 	{ "fr_pair_steal",                        test_fr_pair_steal },
 
 	/* Searching and list modification */
 	{ "fr_dcursor_iter_by_da_init",           test_fr_dcursor_iter_by_da_init },
 	{ "fr_dcursor_iter_by_ancestor_init",     test_fr_dcursor_iter_by_ancestor_init },
+	{ "fr_pair_list_foreach_by_da",           test_fr_pair_list_foreach_by_da },
+	{ "fr_pair_list_foreach_by_ancestor",     test_fr_pair_list_foreach_by_ancestor },
 	{ "fr_pair_to_unknown",                   test_fr_pair_to_unknown },
 	{ "fr_pair_find_by_da",                   test_fr_pair_find_by_da },
+	{ "fr_pair_find_by_da_indexed",           test_fr_pair_find_by_da_indexed },
 	{ "fr_pair_find_by_child_num",            test_fr_pair_find_by_child_num },
 	{ "fr_pair_append",                       test_fr_pair_append },
 	{ "fr_pair_prepend_by_da",                test_fr_pair_prepend_by_da },
@@ -1143,6 +1315,7 @@ TEST_LIST = {
 
 	/* Lists */
 	{ "fr_pair_list_copy",                    test_fr_pair_list_copy },
+	{ "fr_pair_list_steal",                   test_fr_pair_list_steal },
 	{ "fr_pair_list_copy_by_da",              test_fr_pair_list_copy_by_da },
 	{ "fr_pair_list_copy_by_ancestor",        test_fr_pair_list_copy_by_ancestor },
 	{ "fr_pair_list_sort",                    test_fr_pair_list_sort },
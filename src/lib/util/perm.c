@@ -22,10 +22,48 @@
  */
 RCSID("$Id$")
 
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/perm.h>
 #include <freeradius-devel/util/strerror.h>
 #include <freeradius-devel/util/syserror.h>
 
+#include <pthread.h>
+
+typedef enum {
+	PERM_CACHE_PASSWD = 0,				//!< Entry is a struct passwd.
+	PERM_CACHE_GROUP				//!< Entry is a struct group.
+} perm_cache_type_t;
+
+/** A cached passwd or group lookup
+ *
+ */
+typedef struct {
+	perm_cache_type_t	type;			//!< What kind of entry this is.
+	char const		*name;			//!< User or group name we looked up.
+	fr_time_t		expires;		//!< When the entry should be looked up again.
+	void			*data;			//!< struct passwd or struct group, or NULL
+							///< if the user or group doesn't exist.
+	fr_hash_table_t		*members;		//!< Names of group members.
+	fr_dlist_t		entry;			//!< Entry in the LRU list.
+} perm_cache_entry_t;
+
+/** Process wide cache of NSS lookups
+ *
+ * With NSS backed by LDAP or sssd, each lookup can be a round
+ * trip to another process, or another server.
+ */
+static struct {
+	pthread_mutex_t		mutex;			//!< Protects everything below.
+	fr_hash_table_t		*ht;			//!< Entries by type and name.
+	fr_dlist_head_t		lru;			//!< Most recently used first.
+	fr_time_delta_t		lifetime;		//!< How long found entries are cached for.
+	fr_time_delta_t		negative_lifetime;	//!< How long missing entries are cached for.
+	uint32_t		max_entries;		//!< How many entries we cache.
+} perm_cache = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
 /** Convert mode_t into humanly readable permissions flags
  *
  * @author Jonathan Leffler.
@@ -59,6 +97,325 @@ char const *fr_perm_mode_to_oct(char out[static 5], mode_t mode)
 	return out;
 }
 
+static uint32_t perm_cache_entry_hash(void const *data)
+{
+	perm_cache_entry_t const *entry = data;
+
+	return fr_hash_update(&entry->type, sizeof(entry->type), fr_hash_string(entry->name));
+}
+
+static int8_t perm_cache_entry_cmp(void const *one, void const *two)
+{
+	perm_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = CMP(a->type, b->type);
+	if (ret != 0) return ret;
+
+	ret = strcmp(a->name, b->name);
+	return CMP(ret, 0);
+}
+
+static uint32_t perm_member_hash(void const *data)
+{
+	return fr_hash_string(data);
+}
+
+static int8_t perm_member_cmp(void const *one, void const *two)
+{
+	int ret = strcmp(one, two);
+
+	return CMP(ret, 0);
+}
+
+static int _perm_cache_entry_free(perm_cache_entry_t *entry)
+{
+	fr_dlist_remove(&perm_cache.lru, entry);
+
+	return 0;
+}
+
+static void perm_cache_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
+static int perm_getpwnam(TALLOC_CTX *ctx, struct passwd **out, char const *name);
+static int perm_getgrnam(TALLOC_CTX *ctx, struct group **out, char const *name);
+
+/** Enable or disable the cache of passwd and group lookups
+ *
+ * Lookups by name, including those done by #fr_perm_user_in_group, are
+ * cached for the rest of the process.  Lookups by uid and gid are not.
+ *
+ * @param[in] lifetime		How long to cache users and groups which exist.
+ *				Zero disables the cache, and frees any cached entries.
+ * @param[in] negative_lifetime	How long to cache users and groups which don't exist.
+ * @param[in] max_entries	Maximum number of entries.  When the cache is full the
+ *				least recently used entry is removed.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_perm_cache_init(fr_time_delta_t lifetime, fr_time_delta_t negative_lifetime, uint32_t max_entries)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&perm_cache.mutex);
+
+	if (!lifetime || !max_entries) {
+		TALLOC_FREE(perm_cache.ht);
+		goto done;
+	}
+
+	if (!perm_cache.ht) {
+		perm_cache.ht = fr_hash_table_talloc_alloc(NULL, perm_cache_entry_t,
+							   perm_cache_entry_hash, perm_cache_entry_cmp,
+							   perm_cache_entry_free);
+		if (!perm_cache.ht) {
+			ret = -1;
+			goto done;
+		}
+		fr_dlist_talloc_init(&perm_cache.lru, perm_cache_entry_t, entry);
+	}
+
+	perm_cache.lifetime = lifetime;
+	perm_cache.negative_lifetime = negative_lifetime;
+	perm_cache.max_entries = max_entries;
+
+done:
+	pthread_mutex_unlock(&perm_cache.mutex);
+
+	return ret;
+}
+
+/** Find an unexpired entry, and mark it as recently used
+ *
+ * @note Must be called with the mutex held.
+ */
+static perm_cache_entry_t *perm_cache_find(perm_cache_type_t type, char const *name)
+{
+	perm_cache_entry_t *entry;
+
+	entry = fr_hash_table_find(perm_cache.ht, &(perm_cache_entry_t){ .type = type, .name = name });
+	if (!entry) return NULL;
+
+	if (fr_time() >= entry->expires) {
+		fr_hash_table_delete(perm_cache.ht, entry);
+		return NULL;
+	}
+
+	fr_dlist_remove(&perm_cache.lru, entry);
+	fr_dlist_insert_head(&perm_cache.lru, entry);
+
+	return entry;
+}
+
+/** Add the result of a lookup, evicting the least recently used entry if necessary
+ *
+ * @note Must be called with the mutex held.
+ *
+ * @param[in] type	of entry.
+ * @param[in] name	which was looked up.
+ * @param[in] data	result of the lookup, or NULL if it doesn't exist.
+ *			Will be freed, or parented by the entry.
+ */
+static perm_cache_entry_t *perm_cache_add(perm_cache_type_t type, char const *name, void *data)
+{
+	perm_cache_entry_t	*entry, *old;
+	char			**member;
+
+	entry = talloc_zero(NULL, perm_cache_entry_t);
+	if (!entry) {
+	oom:
+		talloc_free(data);
+		return NULL;
+	}
+	entry->type = type;
+	entry->name = talloc_strdup(entry, name);
+	if (!entry->name) {
+	error:
+		talloc_free(entry);
+		goto oom;
+	}
+	entry->data = talloc_steal(entry, data);
+	entry->expires = fr_time() + (data ? perm_cache.lifetime : perm_cache.negative_lifetime);
+
+	/*
+	 *	Index the members, so that membership checks don't
+	 *	need to walk the whole list.
+	 */
+	if (data && (type == PERM_CACHE_GROUP)) {
+		entry->members = fr_hash_table_open_alloc(entry, perm_member_hash, perm_member_cmp, NULL);
+		if (!entry->members) goto error;
+
+		for (member = ((struct group *)data)->gr_mem; *member; member++) {
+			if (!fr_hash_table_insert(entry->members, *member) &&
+			    !fr_hash_table_find(entry->members, *member)) goto error;
+		}
+	}
+
+	/*
+	 *	Another thread may have looked this up at the
+	 *	same time.
+	 */
+	old = fr_hash_table_find(perm_cache.ht, entry);
+	if (old) fr_hash_table_delete(perm_cache.ht, old);
+
+	if (!fr_hash_table_insert(perm_cache.ht, entry)) {
+		talloc_free(entry);
+		return NULL;
+	}
+	fr_dlist_insert_head(&perm_cache.lru, entry);
+	talloc_set_destructor(entry, _perm_cache_entry_free);
+
+	while (fr_hash_table_num_elements(perm_cache.ht) > perm_cache.max_entries) {
+		fr_hash_table_delete(perm_cache.ht, fr_dlist_tail(&perm_cache.lru));
+	}
+
+	return entry;
+}
+
+/** Copy a passwd entry, so that it doesn't reference a cache entry
+ *
+ */
+static struct passwd *perm_passwd_copy(TALLOC_CTX *ctx, struct passwd const *in)
+{
+	struct passwd	*out;
+	char		*p;
+	size_t		len;
+
+	len = sizeof(*out);
+	len += strlen(in->pw_name) + 1;
+	len += strlen(in->pw_passwd) + 1;
+	len += strlen(in->pw_gecos) + 1;
+	len += strlen(in->pw_dir) + 1;
+	len += strlen(in->pw_shell) + 1;
+
+	out = (struct passwd *)talloc_zero_array(ctx, uint8_t, len);
+	if (!out) return NULL;
+	talloc_set_type(out, struct passwd);
+
+	*out = *in;
+	p = (char *)(out + 1);
+
+#define COPY(_field) do { \
+		len = strlen(in->_field) + 1; \
+		memcpy(p, in->_field, len); \
+		out->_field = p; \
+		p += len; \
+	} while (0)
+
+	COPY(pw_name);
+	COPY(pw_passwd);
+	COPY(pw_gecos);
+	COPY(pw_dir);
+	COPY(pw_shell);
+
+	return out;
+}
+
+/** Copy a group entry, so that it doesn't reference a cache entry
+ *
+ */
+static struct group *perm_group_copy(TALLOC_CTX *ctx, struct group const *in)
+{
+	struct group	*out;
+	char		*p, **member;
+	size_t		len, num = 0;
+
+	len = sizeof(*out);
+	len += strlen(in->gr_name) + 1;
+	len += strlen(in->gr_passwd) + 1;
+	for (member = in->gr_mem; *member; member++) {
+		len += strlen(*member) + 1;
+		num++;
+	}
+	len += (num + 1) * sizeof(char *);
+
+	out = (struct group *)talloc_zero_array(ctx, uint8_t, len);
+	if (!out) return NULL;
+	talloc_set_type(out, struct group);
+
+	*out = *in;
+	out->gr_mem = (char **)(out + 1);
+	p = (char *)(out->gr_mem + num + 1);
+
+	COPY(gr_name);
+	COPY(gr_passwd);
+
+	for (num = 0, member = in->gr_mem; *member; member++, num++) {
+		len = strlen(*member) + 1;
+		memcpy(p, *member, len);
+		out->gr_mem[num] = p;
+		p += len;
+	}
+	out->gr_mem[num] = NULL;
+
+#undef COPY
+
+	return out;
+}
+
+/** Look up a name in the cache, or resolve it and add the result
+ *
+ * @note Returns with the mutex held, unless there was an error.
+ *
+ * @return
+ *	- The entry.  entry->data is NULL if the user or group doesn't exist.
+ *	- NULL on error, with the mutex released.
+ */
+static perm_cache_entry_t *perm_cache_get(perm_cache_type_t type, char const *name)
+{
+	perm_cache_entry_t	*entry;
+	void			*data;
+	int			ret;
+
+	pthread_mutex_lock(&perm_cache.mutex);
+
+	entry = perm_cache_find(type, name);
+	if (entry) return entry;
+
+	/*
+	 *	Don't hold the mutex while we call NSS, as that
+	 *	may take some time.
+	 */
+	pthread_mutex_unlock(&perm_cache.mutex);
+
+	if (type == PERM_CACHE_PASSWD) {
+		ret = perm_getpwnam(NULL, (struct passwd **)&data, name);
+	} else {
+		ret = perm_getgrnam(NULL, (struct group **)&data, name);
+	}
+
+	/*
+	 *	Only cache "doesn't exist", not errors.
+	 */
+	if ((ret < 0) && (errno != 0)) return NULL;
+
+	pthread_mutex_lock(&perm_cache.mutex);
+
+	/*
+	 *	The cache may have been disabled while we weren't
+	 *	holding the mutex.
+	 */
+	if (!perm_cache.ht) {
+		pthread_mutex_unlock(&perm_cache.mutex);
+		talloc_free(data);
+		fr_strerror_const("Cache was disabled");
+		return NULL;
+	}
+
+	entry = perm_cache_add(type, name, data);
+	if (!entry) {
+		pthread_mutex_unlock(&perm_cache.mutex);
+		fr_strerror_const("Out of memory");
+		return NULL;
+	}
+
+	return entry;
+}
+
 /** Resolve a uid to a passwd entry
  *
  * Resolves a uid to a passwd entry. The memory to hold the
@@ -135,7 +492,7 @@ int fr_perm_getpwuid(TALLOC_CTX *ctx, struct passwd **out, uid_t uid)
  *	- 0 on success.
  *	- -1 on failure.
  */
-int fr_perm_getpwnam(TALLOC_CTX *ctx, struct passwd **out, char const *name)
+static int perm_getpwnam(TALLOC_CTX *ctx, struct passwd **out, char const *name)
 {
 	static size_t len;
 	uint8_t *buff;
@@ -261,7 +618,7 @@ int fr_perm_getgrgid(TALLOC_CTX *ctx, struct group **out, gid_t gid)
  *	- 0 on success.
  *	- -1 on failure.
  */
-int fr_perm_getgrnam(TALLOC_CTX *ctx, struct group **out, char const *name)
+static int perm_getgrnam(TALLOC_CTX *ctx, struct group **out, char const *name)
 {
 	static size_t len;
 	uint8_t *buff;
@@ -311,6 +668,173 @@ int fr_perm_getgrnam(TALLOC_CTX *ctx, struct group **out, char const *name)
 	return 0;
 }
 
+/** Resolve a username to a passwd entry
+ *
+ * Resolves a username to a passwd entry. The memory to hold the
+ * passwd entry is talloced under ctx, and must be freed when no
+ * longer required.
+ *
+ * If #fr_perm_cache_init has been called, the result may come
+ * from the cache.
+ *
+ * @param ctx to allocate passwd entry in.
+ * @param out Where to write pointer to entry.
+ * @param name to resolve.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_perm_getpwnam(TALLOC_CTX *ctx, struct passwd **out, char const *name)
+{
+	perm_cache_entry_t	*entry;
+	bool			found;
+
+	if (!perm_cache.ht) return perm_getpwnam(ctx, out, name);
+
+	*out = NULL;
+
+	entry = perm_cache_get(PERM_CACHE_PASSWD, name);
+	if (!entry) return -1;
+
+	found = (entry->data != NULL);
+	if (found) *out = perm_passwd_copy(ctx, entry->data);
+	pthread_mutex_unlock(&perm_cache.mutex);
+
+	if (!found) {
+		fr_strerror_const("Non-existent user");
+		errno = 0;
+		return -1;
+	}
+
+	if (!*out) {
+		fr_strerror_const("Out of memory");
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Resolve a group name to a group database entry
+ *
+ * Resolves a group name to a group database entry.
+ * The memory to hold the group entry is talloced under ctx,
+ * and must be freed when no longer required.
+ *
+ * If #fr_perm_cache_init has been called, the result may come
+ * from the cache.
+ *
+ * @param ctx to allocate passwd entry in.
+ * @param out Where to write pointer to entry.
+ * @param name to resolve.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_perm_getgrnam(TALLOC_CTX *ctx, struct group **out, char const *name)
+{
+	perm_cache_entry_t	*entry;
+	bool			found;
+
+	if (!perm_cache.ht) return perm_getgrnam(ctx, out, name);
+
+	*out = NULL;
+
+	entry = perm_cache_get(PERM_CACHE_GROUP, name);
+	if (!entry) return -1;
+
+	found = (entry->data != NULL);
+	if (found) *out = perm_group_copy(ctx, entry->data);
+	pthread_mutex_unlock(&perm_cache.mutex);
+
+	if (!found) {
+		fr_strerror_const("Non-existent group");
+		errno = 0;
+		return -1;
+	}
+
+	if (!*out) {
+		fr_strerror_const("Out of memory");
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Check whether a user is a member of a group
+ *
+ * The user is a member if the group is their primary group, or if
+ * they're listed as a member of the group.
+ *
+ * If #fr_perm_cache_init has been called, the group members are
+ * kept in a hash table, so the check doesn't walk the list of
+ * members.
+ *
+ * @param[in] ctx	for temporary allocations.
+ * @param[in] user	name of the user.
+ * @param[in] group	name of the group.
+ * @return
+ *	- 1 if the user is a member.
+ *	- 0 if the user is not a member.
+ *	- -1 if either the user or group can't be resolved.
+ */
+int fr_perm_user_in_group(TALLOC_CTX *ctx, char const *user, char const *group)
+{
+	struct passwd		*pwd;
+	struct group		*grp;
+	perm_cache_entry_t	*entry;
+	char			**member;
+	int			ret = 0;
+
+	if (fr_perm_getpwnam(ctx, &pwd, user) < 0) return -1;
+
+	if (perm_cache.ht) {
+		entry = perm_cache_get(PERM_CACHE_GROUP, group);
+		if (!entry) {
+			talloc_free(pwd);
+			return -1;
+		}
+
+		if (!entry->data) {
+			pthread_mutex_unlock(&perm_cache.mutex);
+			fr_strerror_const("Non-existent group");
+			talloc_free(pwd);
+			return -1;
+		}
+
+		grp = entry->data;
+		ret = (pwd->pw_gid == grp->gr_gid) || fr_hash_table_find(entry->members, pwd->pw_name);
+		pthread_mutex_unlock(&perm_cache.mutex);
+
+		talloc_free(pwd);
+		return ret;
+	}
+
+	if (perm_getgrnam(ctx, &grp, group) < 0) {
+		talloc_free(pwd);
+		return -1;
+	}
+
+	if (pwd->pw_gid == grp->gr_gid) {
+		ret = 1;
+
+	} else {
+		for (member = grp->gr_mem; *member; member++) {
+			if (strcmp(*member, pwd->pw_name) == 0) {
+				ret = 1;
+				break;
+			}
+		}
+	}
+
+	/* lifo */
+	talloc_free(grp);
+	talloc_free(pwd);
+
+	return ret;
+}
+
 /** Resolve a user name to a GID
  *
  * @param[in] ctx	TALLOC_CTX for temporary allocations.
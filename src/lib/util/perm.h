@@ -29,6 +29,7 @@ RCSIDH(perm_h, "$Id$")
 #include <grp.h>
 
 #include <freeradius-devel/util/talloc.h>
+#include <freeradius-devel/util/time.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -46,6 +47,10 @@ int		fr_perm_getgrgid(TALLOC_CTX *ctx, struct group **out, gid_t gid) CC_HINT(no
 
 int		fr_perm_getgrnam(TALLOC_CTX *ctx, struct group **out, char const *name) CC_HINT(nonnull(2,3));
 
+int		fr_perm_cache_init(fr_time_delta_t lifetime, fr_time_delta_t negative_lifetime, uint32_t max_entries);
+
+int		fr_perm_user_in_group(TALLOC_CTX *ctx, char const *user, char const *group) CC_HINT(nonnull(2,3));
+
 int		fr_perm_uid_from_str(TALLOC_CTX *ctx, uid_t *out, char const *name) CC_HINT(nonnull(2,3));
 
 int		fr_perm_gid_from_str(TALLOC_CTX *ctx, gid_t *out, char const *name) CC_HINT(nonnull(2,3));
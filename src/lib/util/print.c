@@ -33,6 +33,17 @@ RCSID("$Id$")
 #include <ctype.h>
 #include <string.h>
 
+/*
+ *	Build the SSSE3 validator if the compiler lets us target the
+ *	instructions per function.  We still check at runtime that
+ *	the CPU has them.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 5)))
+#  define UTF8_HAVE_SSSE3
+#  include <cpuid.h>
+#  include <immintrin.h>
+#endif
+
 /** Checks for utf-8, taken from http://www.w3.org/International/questions/qa-forms-utf-8
  *
  * @param[in] str	input string.
@@ -139,6 +150,154 @@ inline size_t fr_utf8_char(uint8_t const *str, ssize_t inlen)
 	return 0;
 }
 
+#ifdef UTF8_HAVE_SSSE3
+/** Check whether the CPU supports SSSE3
+ *
+ * Racing threads all get the same answer, so there's no need for locking.
+ */
+static bool utf8_ssse3_available(void)
+{
+	static int	available = -1;
+
+	if (available < 0) {
+		unsigned int eax, ebx, ecx, edx;
+
+		available = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1 << 9));	/* SSSE3 */
+	}
+
+	return available;
+}
+
+/** Back up to the start of a char which doesn't end before p
+ *
+ */
+static inline CC_HINT(always_inline) uint8_t const *utf8_char_start(uint8_t const *start, uint8_t const *p)
+{
+	int i;
+
+	for (i = 1; (i <= 3) && ((p - i) >= start); i++) {
+		uint8_t c = p[-i];
+
+		if (c < 0x80) break;			/* ASCII */
+		if (c < 0xc0) continue;			/* Continuation */
+
+		if (((c >= 0xf0) ? 4 : (c >= 0xe0) ? 3 : 2) > i) return p - i;
+		break;
+	}
+
+	return p;
+}
+
+/*
+ *	Error bits for each invalid combination of a byte and the byte
+ *	which follows it.
+ */
+#define UTF8_TOO_SHORT		(1 << 0)	//!< Lead byte followed by a lead byte or ASCII.
+#define UTF8_TOO_LONG		(1 << 1)	//!< ASCII followed by a continuation byte.
+#define UTF8_OVERLONG_3		(1 << 2)	//!< 0xe0 followed by 0x80..0x9f.
+#define UTF8_TOO_LARGE		(1 << 3)	//!< > U+10FFFF.
+#define UTF8_SURROGATE		(1 << 4)	//!< 0xed followed by 0xa0..0xbf.
+#define UTF8_OVERLONG_2		(1 << 5)	//!< 0xc0 or 0xc1.
+#define UTF8_TOO_LARGE_1000	(1 << 6)	//!< 0xf5.. followed by 0x80..0x8f.
+#define UTF8_OVERLONG_4		(1 << 6)	//!< 0xf0 followed by 0x80..0x8f.
+#define UTF8_TWO_CONTS		(1 << 7)	//!< Continuation byte followed by a continuation byte.
+#define UTF8_CARRY		(UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+/** Validate a string 16 bytes at a time
+ *
+ * Uses the lookup method from Keiser and Lemire, "Validating UTF-8
+ * In Less Than One Instruction Per Byte".  Each byte, and the high
+ * nibble of the byte after it, are looked up in three tables of
+ * error bits, and the results ANDed.  Anything left over is an
+ * error, unless it's the expected continuation of a three or four
+ * byte char.  We also reject the control chars which fr_utf8_char()
+ * rejects.
+ *
+ * @param[in] p		where to start.
+ * @param[in] end	of the string.
+ * @return Where validation stopped.  Everything before it is valid.
+ *	Backed up to the start of the char containing the first error,
+ *	or of the last char if it continues past the blocks we checked.
+ */
+__attribute__((target("ssse3")))
+static uint8_t const *utf8_validate_ssse3(uint8_t const *p, uint8_t const *end)
+{
+#define V(_x) ((char)(_x))
+	__m128i const	byte_1_high = _mm_setr_epi8(
+				UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+				UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+				V(UTF8_TWO_CONTS), V(UTF8_TWO_CONTS), V(UTF8_TWO_CONTS), V(UTF8_TWO_CONTS),
+				UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+				UTF8_TOO_SHORT,
+				UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+				UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4);
+	__m128i const	byte_1_low = _mm_setr_epi8(
+				V(UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4),
+				V(UTF8_CARRY | UTF8_OVERLONG_2),
+				V(UTF8_CARRY),
+				V(UTF8_CARRY),
+				V(UTF8_CARRY | UTF8_TOO_LARGE),
+				V(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+				V(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+				V(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+				V(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+				V(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+				V(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+				V(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+				V(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+				V(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE),
+				V(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+				V(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000));
+	__m128i const	byte_2_high = _mm_setr_epi8(
+				UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+				UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+				V(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 |
+				  UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4),
+				V(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE),
+				V(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE),
+				V(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE),
+				UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT);
+	__m128i const	nibble = _mm_set1_epi8(0x0f);
+	__m128i const	third = _mm_set1_epi8(0xe0 - 0x80);
+	__m128i const	fourth = _mm_set1_epi8(0xf0 - 0x80);
+	__m128i const	high = _mm_set1_epi8(V(0x80));
+	__m128i const	control = _mm_set1_epi8(0x1f);
+	__m128i const	del = _mm_set1_epi8(0x7f);
+#undef V
+	uint8_t const	*start = p;
+	__m128i		prev = _mm_setzero_si128();
+
+	while ((end - p) >= 16) {
+		__m128i	in = _mm_loadu_si128((__m128i const *)p);
+		__m128i	prev1 = _mm_alignr_epi8(in, prev, 15);
+		__m128i	err;
+
+		err = _mm_and_si128(_mm_and_si128(_mm_shuffle_epi8(byte_1_high,
+								   _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+						  _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, nibble))),
+				    _mm_shuffle_epi8(byte_2_high, _mm_and_si128(_mm_srli_epi16(in, 4), nibble)));
+
+		/*
+		 *	Two continuation bytes in a row are only
+		 *	valid as part of a three or four byte char.
+		 */
+		err = _mm_xor_si128(err, _mm_and_si128(_mm_or_si128(_mm_subs_epu8(_mm_alignr_epi8(in, prev, 14), third),
+								    _mm_subs_epu8(_mm_alignr_epi8(in, prev, 13), fourth)),
+						       high));
+
+		err = _mm_or_si128(err, _mm_cmpeq_epi8(_mm_min_epu8(in, control), in));
+		err = _mm_or_si128(err, _mm_cmpeq_epi8(in, del));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(err, _mm_setzero_si128())) != 0xffff) break;
+
+		prev = in;
+		p += 16;
+	}
+
+	return utf8_char_start(start, p);
+}
+#endif
+
 /** Validate a complete UTF8 string
  *
  * @param[in] str	input string.
@@ -158,13 +317,22 @@ ssize_t fr_utf8_str(uint8_t const *str, ssize_t inlen)
 	p = str;
 	end = p + len;
 
-	do {
+#ifdef UTF8_HAVE_SSSE3
+	/*
+	 *	Skip everything the vector validator says is fine,
+	 *	and let fr_utf8_char() find exactly where any error
+	 *	is.
+	 */
+	if ((len >= 16) && utf8_ssse3_available()) p = utf8_validate_ssse3(p, end);
+#endif
+
+	while (p < end) {
 		size_t clen;
 
 		clen = fr_utf8_char(p, end - p);
-		if (clen == 0) return end - p;
+		if (clen == 0) return p - str;
 		p += clen;
-	} while (p < end);
+	}
 
 	return inlen;
 }
@@ -0,0 +1,162 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for UTF8 validation
+ *
+ * @file src/lib/util/print_tests.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <freeradius-devel/util/acutest.h>
+#include <freeradius-devel/util/acutest_helpers.h>
+
+#include "print.h"
+
+#include <freeradius-devel/util/time.h>
+
+#define UTF8_TEST_MAX_LEN	(256)
+
+/** Validate one char at a time, for comparison
+ *
+ */
+static ssize_t utf8_str_slow(uint8_t const *str, size_t len)
+{
+	uint8_t const	*p = str, *end = str + len;
+
+	while (p < end) {
+		size_t clen;
+
+		clen = fr_utf8_char(p, end - p);
+		if (clen == 0) return p - str;
+		p += clen;
+	}
+
+	return len;
+}
+
+static char const *utf8_chars[] = {
+	"a", "~", "\xc2\x80", "\xdf\xbf", "\xe0\xa0\x80", "\xe2\x82\xac", "\xed\x9f\xbf", "\xef\xbf\xbf",
+	"\xf0\x90\x80\x80", "\xf0\x9f\x98\x80", "\xf4\x8f\xbf\xbf"
+};
+
+/** Fill a buffer with random valid chars
+ *
+ */
+static size_t utf8_random_fill(uint8_t *buffer, size_t len)
+{
+	size_t	used = 0;
+
+	for (;;) {
+		char const	*chr = utf8_chars[rand() % NUM_ELEMENTS(utf8_chars)];
+		size_t		chr_len = strlen(chr);
+
+		if ((used + chr_len) > len) return used;
+
+		memcpy(buffer + used, chr, chr_len);
+		used += chr_len;
+	}
+}
+
+static void test_utf8_str_valid(void)
+{
+	uint8_t	buffer[UTF8_TEST_MAX_LEN];
+	size_t	len, i;
+
+	for (i = 0; i < 1000; i++) {
+		len = utf8_random_fill(buffer, rand() % sizeof(buffer));
+
+		TEST_CHECK_SLEN(fr_utf8_str(buffer, len), (ssize_t)len);
+	}
+
+	TEST_CHECK_SLEN(fr_utf8_str((uint8_t const *)"", 0), 0);
+	TEST_CHECK_SLEN(fr_utf8_str((uint8_t const *)"0123456789abcdef0123456789abcdef", -1), -1);
+}
+
+/*
+ *	Errors at every offset, including ones which span blocks, must
+ *	be reported at the same place as the char by char check.
+ */
+static void test_utf8_str_invalid(void)
+{
+	static uint8_t const	bad[] = { 0x00, 0x1f, 0x7f, 0x80, 0xbf, 0xc0, 0xc1, 0xe0, 0xed, 0xf4, 0xf5, 0xff };
+	uint8_t			buffer[UTF8_TEST_MAX_LEN];
+	size_t			len, i, j;
+
+	for (i = 0; i < 1000; i++) {
+		len = utf8_random_fill(buffer, rand() % sizeof(buffer));
+		if (!len) continue;
+
+		for (j = 0; j < NUM_ELEMENTS(bad); j++) {
+			size_t	offset = rand() % len;
+			uint8_t	save = buffer[offset];
+
+			buffer[offset] = bad[j];
+			TEST_CHECK_SLEN(fr_utf8_str(buffer, len), utf8_str_slow(buffer, len));
+			TEST_MSG("byte 0x%02x at offset %zu of %zu", bad[j], offset, len);
+			buffer[offset] = save;
+		}
+
+		/*
+		 *	Truncated chars at the end
+		 */
+		TEST_CHECK_SLEN(fr_utf8_str(buffer, len - 1), utf8_str_slow(buffer, len - 1));
+	}
+}
+
+/*
+ *	Compare the speed of whole string and char by char validation,
+ *	for sizes typical of Class and Chargeable-User-Identity.
+ */
+#define UTF8_BENCH_BYTES	(1 << 24)
+
+static void utf8_bench(void)
+{
+	static size_t const	sizes[] = { 16, 32, 64, 128, 253 };
+	uint8_t			buffer[UTF8_TEST_MAX_LEN];
+	size_t			i;
+	volatile ssize_t	sink = 0;
+
+	fr_time_start();
+
+	for (i = 0; i < NUM_ELEMENTS(sizes); i++) {
+		fr_time_t	start;
+		fr_time_delta_t	fast, slow;
+		size_t		len, r, reps;
+
+		len = utf8_random_fill(buffer, sizes[i]);
+		reps = UTF8_BENCH_BYTES / len;
+
+		start = fr_time();
+		for (r = 0; r < reps; r++) sink += fr_utf8_str(buffer, len);
+		fast = fr_time() - start;
+
+		start = fr_time();
+		for (r = 0; r < reps; r++) sink += utf8_str_slow(buffer, len);
+		slow = fr_time() - start;
+
+		TEST_MSG_ALWAYS("size=%zu str_mbs=%0.1f char_mbs=%0.1f", len,
+				(double)UTF8_BENCH_BYTES * 1000 / fast, (double)UTF8_BENCH_BYTES * 1000 / slow);
+	}
+	(void)sink;
+}
+
+TEST_LIST = {
+	{ "utf8_str_valid",		test_utf8_str_valid },
+	{ "utf8_str_invalid",		test_utf8_str_invalid },
+	{ "utf8_bench",			utf8_bench },
+
+	{ NULL }
+};
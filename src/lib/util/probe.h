@@ -0,0 +1,58 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Static tracepoints (USDT probes) for external tracers
+ *
+ * When <sys/sdt.h> is available, each FR_PROBE*() site compiles to a
+ * single nop, plus a note in the ELF file which tells tracers such as
+ * bpftrace, perf, or SystemTap where the probe is.  A tracer which
+ * attaches to the probe replaces the nop with a trap.  When nothing is
+ * attached, the cost is the nop, and keeping the arguments live.
+ *
+ * Arguments should therefore be values which the caller has already
+ * calculated.  Do not call functions, or build strings, just to pass
+ * them to a probe.
+ *
+ * All probes are in the "freeradius" provider.  e.g.
+ *
+ @verbatim
+   bpftrace -e 'usdt:/usr/sbin/radiusd:freeradius:worker_reply { @[arg1] = hist(arg2); }'
+ @endverbatim
+ *
+ * When <sys/sdt.h> is not available, the probes compile to nothing.
+ *
+ * @file src/lib/util/probe.h
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(probe_h, "$Id$")
+
+#ifdef HAVE_SYS_SDT_H
+#  include <sys/sdt.h>
+
+#  define FR_PROBE(_name)			DTRACE_PROBE(freeradius, _name)
+#  define FR_PROBE1(_name, _a)			DTRACE_PROBE1(freeradius, _name, _a)
+#  define FR_PROBE2(_name, _a, _b)		DTRACE_PROBE2(freeradius, _name, _a, _b)
+#  define FR_PROBE3(_name, _a, _b, _c)		DTRACE_PROBE3(freeradius, _name, _a, _b, _c)
+#  define FR_PROBE4(_name, _a, _b, _c, _d)	DTRACE_PROBE4(freeradius, _name, _a, _b, _c, _d)
+#else
+#  define FR_PROBE(_name)			do { } while (0)
+#  define FR_PROBE1(_name, _a)			do { } while (0)
+#  define FR_PROBE2(_name, _a, _b)		do { } while (0)
+#  define FR_PROBE3(_name, _a, _b, _c)		do { } while (0)
+#  define FR_PROBE4(_name, _a, _b, _c, _d)	do { } while (0)
+#endif
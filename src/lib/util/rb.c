@@ -76,6 +76,49 @@ static void _node_heap_free(fr_rb_tree_t const *tree, fr_rb_node_t *node, bool f
 	talloc_free(node);
 }
 
+/** Nodes are allocated this many at a time for pooled trees
+ */
+#define RB_NODE_POOL_SLAB	64
+
+/** Take a fr_rb_node_t from the tree's free list, allocating a new slab if it's empty
+ */
+static fr_rb_node_t *_node_pool_alloc(fr_rb_tree_t const *tree, UNUSED void *data)
+{
+	fr_rb_tree_t	*t = UNCONST(fr_rb_tree_t *, tree);
+	fr_rb_node_t	*node;
+
+	if (!t->free_nodes) {
+		fr_rb_node_t	*slab;
+		size_t		i;
+
+		slab = talloc_array(t->node_ctx, fr_rb_node_t, RB_NODE_POOL_SLAB);
+		if (unlikely(!slab)) return NULL;
+
+		for (i = 0; i < RB_NODE_POOL_SLAB - 1; i++) slab[i].right = &slab[i + 1];
+		slab[i].right = NULL;
+
+		t->free_nodes = slab;
+	}
+
+	node = t->free_nodes;
+	t->free_nodes = node->right;
+
+	return node;	/* Initialised by the caller */
+}
+
+/** Return a fr_rb_node_t to the tree's free list
+ */
+static void _node_pool_free(fr_rb_tree_t const *tree, fr_rb_node_t *node, bool free_data)
+{
+	fr_rb_tree_t	*t = UNCONST(fr_rb_tree_t *, tree);
+
+	if (free_data) node_data_free(tree, node);
+
+	node->data = NULL;
+	node->right = t->free_nodes;
+	t->free_nodes = node;
+}
+
 /** Walks the tree to delete all nodes Does NOT re-balance it!
  *
  */
@@ -119,6 +162,7 @@ static int _tree_free(fr_rb_tree_t *tree)
 #endif
 	tree->root = NIL;
 	tree->num_elements = 0;
+	tree->free_nodes = NULL;	/* Freed with the children */
 
 	/*
 	 *	Ensure all dependents on the tree run their
@@ -218,6 +262,33 @@ fr_rb_tree_t *_fr_rb_alloc(TALLOC_CTX *ctx,
 	return tree;
 }
 
+/** Alloc a new RED-BLACK tree which keeps a free list of nodes
+ *
+ * Nodes are allocated in slabs, and deleted nodes are kept for reuse,
+ * so a tree with a stable number of elements stops allocating.  Node
+ * memory is only returned when the tree is freed.
+ *
+ * @param[in] ctx		to allocate the tree in.
+ * @param[in] type		Talloc type of structures being inserted, may be NULL.
+ * @param[in] data_cmp		Comparator function for ordering data in the tree.
+ * @param[in] data_free		Free function to call whenever data is deleted or replaced.
+ * @return
+ *      - A new tree on success.
+ *	- NULL on failure.
+ */
+fr_rb_tree_t *_fr_rb_pool_alloc(TALLOC_CTX *ctx, char const *type, fr_cmp_t data_cmp, fr_free_t data_free)
+{
+	fr_rb_tree_t *tree;
+
+	tree = _fr_rb_alloc(ctx, -1, type, data_cmp, data_free);
+	if (unlikely(!tree)) return NULL;
+
+	tree->node_alloc = _node_pool_alloc;
+	tree->node_free = _node_pool_free;
+
+	return tree;
+}
+
 /** Rotate Node x to left
  *
  */
@@ -86,6 +86,7 @@ struct fr_rb_tree_s {
 
 	rb_node_alloc_t		node_alloc;	//!< Callback to allocate a new node.
 	rb_node_free_t		node_free;	//!< Callback to free a node.
+	fr_rb_node_t		*free_nodes;	//!< Unused nodes, for pooled trees.
 
 	/*
 	 *	Try and pack these more efficiently
@@ -275,9 +276,55 @@ int _fr_rb_init(fr_rb_tree_t *tree, TALLOC_CTX *node_ctx,
 			fr_rb_node_t: _fr_rb_alloc(_ctx, offsetof(_type, _field), NULL, _data_cmp, _data_free) \
 		)
 
+/** Allocs a red black tree that verifies elements are of a specific talloc type
+ *
+ * This variant allocates #fr_rb_node_t in slabs, and keeps deleted nodes
+ * on a free list for reuse.
+ *
+ * It is suitable for trees which can't use inline nodes, but which see
+ * a lot of inserts and deletes.
+ *
+ * @param[in] _ctx		to tie tree lifetime to.
+ *				If ctx is freed, tree will free any nodes, calling the
+ *				free function if set.
+ * @param[in] _type		of item being stored in the tree, e.g. fr_value_box_t.
+ * @param[in] _data_cmp		Callback to compare two #_type.
+ * @param[in] _data_free	Optional function used to free data if tree nodes are
+ *				deleted or replaced.
+ * @return
+ *	- A new rbtree on success.
+ *	- NULL on failure.
+ */
+#define		fr_rb_pool_talloc_alloc(_ctx, _type, _data_cmp, _data_free) \
+		_fr_rb_pool_alloc(_ctx, #_type, _data_cmp, _data_free)
+
+/** Allocs a red black tree which keeps a free list of nodes
+ *
+ * This variant allocates #fr_rb_node_t in slabs, and keeps deleted nodes
+ * on a free list for reuse.
+ *
+ * It is suitable for trees which can't use inline nodes, but which see
+ * a lot of inserts and deletes.
+ *
+ * @param[in] _ctx		to tie tree lifetime to.
+ *				If ctx is freed, tree will free any nodes, calling the
+ *				free function if set.
+ * @param[in] _data_cmp		Callback to compare two items.
+ * @param[in] _data_free	Optional function used to free data if tree nodes are
+ *				deleted or replaced.
+ * @return
+ *	- A new rbtree on success.
+ *	- NULL on failure.
+ */
+#define		fr_rb_pool_alloc(_ctx, _data_cmp, _data_free) \
+		_fr_rb_pool_alloc(_ctx, NULL, _data_cmp, _data_free)
+
 fr_rb_tree_t	*_fr_rb_alloc(TALLOC_CTX *ctx, ssize_t offset, char const *type,
 			      fr_cmp_t data_cmp, fr_free_t data_free) CC_HINT(warn_unused_result);
 
+fr_rb_tree_t	*_fr_rb_pool_alloc(TALLOC_CTX *ctx, char const *type,
+				   fr_cmp_t data_cmp, fr_free_t data_free) CC_HINT(warn_unused_result);
+
 /** @hidecallergraph */
 void		*fr_rb_find(fr_rb_tree_t const *tree, void const *data) CC_HINT(nonnull);
 
@@ -212,11 +212,60 @@ static void test_fr_rb_iter_delete(void)
 	talloc_free(t);
 }
 
+/*
+ *	Pooled trees should reuse nodes, and not allocate once the
+ *	number of elements is stable.
+ */
+static void test_fr_rb_pool(void)
+{
+	fr_rb_tree_t 		*t;
+	fr_rb_tree_test_node_t	*array;
+	fr_rb_tree_test_node_t	*p;
+	fr_rb_iter_inorder_t	iter;
+	size_t			i, blocks;
+	uint32_t		last;
+
+	t = fr_rb_pool_alloc(NULL, fr_rb_tree_test_cmp, NULL);
+	TEST_CHECK(t != NULL);
+
+	array = talloc_array(NULL, fr_rb_tree_test_node_t, 1000);
+	for (i = 0; i < 1000; i++) {
+		array[i].num = i;
+		TEST_CHECK(fr_rb_insert(t, &array[i]));
+	}
+	blocks = talloc_total_blocks(t);
+
+	/*
+	 *	Churn the tree.
+	 */
+	for (i = 0; i < 1000; i += 2) TEST_CHECK(fr_rb_delete(t, &array[i]));
+	TEST_CHECK(fr_rb_num_elements(t) == 500);
+
+	for (i = 0; i < 1000; i += 2) TEST_CHECK(fr_rb_insert(t, &array[i]));
+	TEST_CHECK(fr_rb_num_elements(t) == 1000);
+
+	TEST_CHECK(talloc_total_blocks(t) == blocks);
+	TEST_MSG("expected %zu blocks, got %zu", blocks, talloc_total_blocks(t));
+
+	for (p = fr_rb_iter_init_inorder(&iter, t), i = 0, last = 0;
+	     p;
+	     p = fr_rb_iter_next_inorder(&iter), i++) {
+		TEST_CHECK((i == 0) || (p->num > last));
+		TEST_CHECK(fr_rb_find(t, p) == p);
+		last = p->num;
+	}
+	TEST_CHECK(i == 1000);
+
+	talloc_free(t);
+	talloc_free(array);
+}
+
 TEST_LIST = {
 	{ "fr_rb_iter_inorder",            test_fr_rb_iter_inorder },
 	{ "fr_rb_iter_preorder",           test_fr_rb_iter_preorder },
 	{ "fr_rb_iter_postorder",          test_fr_rb_iter_postorder },
 	{ "fr_rb_iter_delete",             test_fr_rb_iter_delete },
+	{ "fr_rb_pool",                    test_fr_rb_pool },
 
 	{ NULL }
 };
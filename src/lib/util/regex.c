@@ -29,6 +29,8 @@ RCSID("$Id$")
 #include <freeradius-devel/util/strerror.h>
 #include <freeradius-devel/util/talloc.h>
 #include <freeradius-devel/util/atexit.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/table.h>
 #include <freeradius-devel/util/talloc.h>
 
@@ -41,6 +43,10 @@ RCSID("$Id$")
 #endif
 #endif
 
+#ifndef FR_REGEX_CACHE_SIZE
+#  define FR_REGEX_CACHE_SIZE	(128)
+#endif
+
 /*
  *######################################
  *#      FUNCTIONS FOR LIBPCRE2        #
@@ -1299,4 +1305,193 @@ ssize_t regex_flags_print(fr_sbuff_t *sbuff, fr_regex_flags_t const flags[static
 
 	return fr_sbuff_set(sbuff, &our_sbuff);
 }
+
+/*
+ *########################################
+ *#         RUNTIME REGEX CACHE          #
+ *########################################
+ */
+
+/** A compiled expression in the runtime cache
+ *
+ */
+typedef struct {
+	char const		*pattern;	//!< Copy of the pattern.
+	size_t			len;		//!< Length of the pattern.
+	fr_regex_flags_t	flags;		//!< Flags the pattern was compiled with.
+	bool			subcaptures;	//!< Whether subcapture data is stored.
+
+	regex_t			*preg;		//!< The compiled expression.
+	fr_dlist_t		entry;		//!< Entry in the LRU list.
+} fr_regex_cache_entry_t;
+
+/** Thread local cache of expressions compiled at runtime
+ *
+ */
+typedef struct {
+	fr_hash_table_t		*ht;		//!< Entries by pattern and flags.
+	fr_dlist_head_t		lru;		//!< Most recently used entry at the head.
+	uint64_t		hits;		//!< Lookups that found a compiled expression.
+	uint64_t		misses;		//!< Lookups that had to compile the expression.
+} fr_regex_cache_t;
+
+static _Thread_local fr_regex_cache_t *fr_regex_cache;
+
+static uint32_t regex_cache_hash(void const *data)
+{
+	fr_regex_cache_entry_t const	*c = data;
+	uint32_t			hash;
+
+	hash = fr_hash(c->pattern, c->len);
+	hash = fr_hash_update(&c->flags, sizeof(c->flags), hash);
+	return fr_hash_update(&c->subcaptures, sizeof(c->subcaptures), hash);
+}
+
+static int8_t regex_cache_cmp(void const *one, void const *two)
+{
+	fr_regex_cache_entry_t const	*a = one, *b = two;
+	int				ret;
+
+	ret = CMP(a->len, b->len);
+	if (ret != 0) return ret;
+
+	ret = CMP(a->subcaptures, b->subcaptures);
+	if (ret != 0) return ret;
+
+	ret = memcmp(&a->flags, &b->flags, sizeof(a->flags));
+	if (ret != 0) return CMP(ret, 0);
+
+	ret = memcmp(a->pattern, b->pattern, a->len);
+	return CMP(ret, 0);
+}
+
+static void _regex_cache_free_on_exit(void *arg)
+{
+	talloc_free(arg);
+}
+
+/** Compile an expression at runtime, reusing a previous compilation if possible
+ *
+ * Expressions are compiled as if they were compiled on startup, i.e. they are
+ * run through the JIT if it's available.  The most recently used #FR_REGEX_CACHE_SIZE
+ * expressions are kept per thread, so patterns which come from expansions don't
+ * need to be recompiled every time they're evaluated.
+ *
+ * @note The expression is owned by the cache and must not be freed.  It remains
+ *	 valid until the next call to this function in the same thread.
+ *
+ * @param[out] out		Where to write a pointer to the compiled expression.
+ * @param[in] pattern		to compile.
+ * @param[in] len		of pattern.
+ * @param[in] flags		controlling matching.  May be NULL.
+ * @param[in] subcaptures	Whether to compile the regular expression to store
+ *				subcapture data.
+ * @return
+ *	- >= 1 on success.
+ *	- <= 0 on error.  Negative value is offset of parse error.
+ */
+ssize_t regex_compile_cached(regex_t **out, char const *pattern, size_t len,
+			     fr_regex_flags_t const *flags, bool subcaptures)
+{
+	fr_regex_cache_t	*cache = fr_regex_cache;
+	fr_regex_cache_entry_t	*c, find;
+	ssize_t			slen;
+
+	*out = NULL;
+
+	if (unlikely(!cache)) {
+		cache = talloc_zero(NULL, fr_regex_cache_t);
+		if (!cache) {
+		oom:
+			fr_strerror_const("Out of memory");
+			return 0;
+		}
+		cache->ht = fr_hash_table_alloc(cache, regex_cache_hash, regex_cache_cmp, NULL);
+		if (!cache->ht) {
+			talloc_free(cache);
+			goto oom;
+		}
+		fr_dlist_talloc_init(&cache->lru, fr_regex_cache_entry_t, entry);
+
+		fr_atexit_thread_local(fr_regex_cache, _regex_cache_free_on_exit, cache);
+		fr_regex_cache = cache;
+	}
+
+	find = (fr_regex_cache_entry_t){
+		.pattern = pattern,
+		.len = len,
+		.subcaptures = subcaptures
+	};
+	if (flags) find.flags = *flags;
+
+	c = fr_hash_table_find(cache->ht, &find);
+	if (c) {
+		cache->hits++;
+		fr_dlist_remove(&cache->lru, c);
+		fr_dlist_insert_head(&cache->lru, c);
+
+		*out = c->preg;
+		return len;
+	}
+	cache->misses++;
+
+	c = talloc_zero(cache, fr_regex_cache_entry_t);
+	if (!c) goto oom;
+
+	slen = regex_compile(c, &c->preg, pattern, len, flags, subcaptures, false);
+	if (slen <= 0) {
+		talloc_free(c);
+		return slen;
+	}
+#if defined(HAVE_REGEX_PCRE) || defined(HAVE_REGEX_PCRE2)
+	c->preg->cached = true;
+#endif
+	c->pattern = talloc_memdup(c, pattern, len);
+	if (!c->pattern) {
+		talloc_free(c);
+		goto oom;
+	}
+	c->len = len;
+	c->flags = find.flags;
+	c->subcaptures = subcaptures;
+
+	/*
+	 *	Evict the least recently used expression.
+	 *	Any captures still referencing it keep it
+	 *	alive, see regex_sub_to_request().
+	 */
+	if (fr_dlist_num_elements(&cache->lru) >= FR_REGEX_CACHE_SIZE) {
+		fr_regex_cache_entry_t *old = fr_dlist_tail(&cache->lru);
+
+		fr_dlist_remove(&cache->lru, old);
+		fr_hash_table_delete(cache->ht, old);
+		talloc_free(old);
+	}
+
+	if (!fr_hash_table_insert(cache->ht, c)) {
+		talloc_free(c);
+		fr_strerror_const("Failed inserting expression into cache");
+		return 0;
+	}
+	fr_dlist_insert_head(&cache->lru, c);
+
+	*out = c->preg;
+	return slen;
+}
+
+/** Return the number of hits and misses for the runtime regex cache of this thread
+ *
+ * @param[out] hits	Lookups which found a compiled expression.
+ * @param[out] misses	Lookups which had to compile the expression.
+ */
+void regex_cache_stats(uint64_t *hits, uint64_t *misses)
+{
+	if (!fr_regex_cache) {
+		*hits = *misses = 0;
+		return;
+	}
+
+	*hits = fr_regex_cache->hits;
+	*misses = fr_regex_cache->misses;
+}
 #endif
@@ -68,6 +68,7 @@ typedef struct {
 	bool			precompiled;	//!< Whether this regex was precompiled,
 						///< or compiled for one off evaluation.
 	bool			jitd;		//!< Whether JIT data is available.
+	bool			cached;		//!< Whether this regex is owned by the runtime cache.
 } regex_t;
 /*
  *######################################
@@ -113,6 +114,7 @@ typedef struct {
 
 	bool			precompiled;	//!< Whether this regex was precompiled, or compiled for one off evaluation.
 	bool			jitd;		//!< Whether JIT data is available.
+	bool			cached;		//!< Whether this regex is owned by the runtime cache.
 } regex_t;
 /*
  *######################################
@@ -182,6 +184,9 @@ int		regex_substitute(TALLOC_CTX *ctx, char **out, size_t max_out, regex_t *preg
 		     		 char const *replacement, size_t replacement_len,
 				 fr_regmatch_t *regmatch);
 #endif
+ssize_t		regex_compile_cached(regex_t **out, char const *pattern, size_t len,
+				     fr_regex_flags_t const *flags, bool subcaptures);
+void		regex_cache_stats(uint64_t *hits, uint64_t *misses);
 uint32_t	regex_subcapture_count(regex_t const *preg);
 fr_regmatch_t	*regex_match_data_alloc(TALLOC_CTX *ctx, uint32_t count);
 #  ifdef __cplusplus
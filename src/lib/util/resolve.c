@@ -0,0 +1,658 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Cached, and optionally asynchronous, hostname resolution
+ *
+ * All hostname to address lookups made through #fr_inet_hton go through
+ * a single cache, shared by every thread.  Successful and failed lookups
+ * are both cached, for #fr_resolve_ttl and #fr_resolve_negative_ttl
+ * respectively.
+ *
+ * getaddrinfo() doesn't tell us the TTL of the records it found, so the
+ * TTL is fixed.
+ *
+ * Lookups which miss the cache are done by the caller in #fr_resolve,
+ * or by a small pool of resolver threads in #fr_resolve_async.  The
+ * resolver threads also refresh entries which are still being used
+ * shortly before they expire, so that busy names never miss the cache.
+ *
+ * @file src/lib/util/resolve.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/resolve.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define RESOLVE_THREADS		4		//!< Number of resolver threads.
+#define RESOLVE_CACHE_MAX	4096		//!< Maximum number of cached names.
+
+fr_time_delta_t	fr_resolve_ttl = (fr_time_delta_t) 300 * NSEC;
+fr_time_delta_t	fr_resolve_negative_ttl = (fr_time_delta_t) 30 * NSEC;
+bool		fr_resolve_prefetch = true;
+
+/** A cached lookup
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< In the LRU list.
+
+	char const		*hostname;
+	int			af;
+	bool			fallback;
+
+	int			ret;			//!< 0 if the lookup succeeded, -1 if it failed.
+	fr_ipaddr_t		ipaddr;			//!< Found if the lookup succeeded.
+	char			*error;			//!< Why the lookup failed.
+
+	fr_time_t		expires;
+	bool			refreshing;		//!< A prefetch has been queued.
+} fr_resolve_entry_t;
+
+/** A lookup for the resolver threads
+ *
+ * Jobs are not parented by the query, as they're shared between threads.
+ * Whichever of the query or the resolver thread is last to finish with
+ * the job frees it.
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< In the queue.
+
+	char			*hostname;
+	int			af;
+	bool			fallback;
+
+	int			fd;			//!< Write end of the query's pipe, or -1 for a prefetch.
+	bool			orphaned;		//!< The query was freed before the lookup finished.
+	bool			done;
+
+	int			ret;
+	fr_ipaddr_t		ipaddr;
+	char			error[256];
+} fr_resolve_job_t;
+
+struct fr_resolve_query_s {
+	fr_resolve_job_t	*job;
+	fr_event_list_t		*el;
+	int			fd;			//!< Read end of the pipe.
+
+	fr_resolve_cb_t		cb;
+	void			*uctx;
+};
+
+static pthread_mutex_t		resolve_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		resolve_cond = PTHREAD_COND_INITIALIZER;
+
+static TALLOC_CTX		*resolve_ctx;		//!< Parent of the cache entries.
+static fr_hash_table_t		*resolve_cache;
+static fr_dlist_head_t		resolve_lru;		//!< Most recently used at the head.
+
+static fr_dlist_head_t		resolve_queue;		//!< Jobs for the resolver threads.
+static pthread_t		resolve_thread[RESOLVE_THREADS];
+static int			resolve_threads_running;
+static bool			resolve_stop;
+
+static uint32_t resolve_entry_hash(void const *data)
+{
+	fr_resolve_entry_t const *entry = data;
+	uint32_t hash;
+
+	hash = fr_hash_string(entry->hostname);
+	hash = fr_hash_update(&entry->af, sizeof(entry->af), hash);
+	return fr_hash_update(&entry->fallback, sizeof(entry->fallback), hash);
+}
+
+static int8_t resolve_entry_cmp(void const *one, void const *two)
+{
+	fr_resolve_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = CMP(a->af, b->af);
+	if (ret != 0) return ret;
+
+	ret = CMP(a->fallback, b->fallback);
+	if (ret != 0) return ret;
+
+	ret = strcmp(a->hostname, b->hostname);
+	return CMP(ret, 0);
+}
+
+/** Remove an entry from the cache, and free it
+ *
+ * Must be called with resolve_mutex held.
+ */
+static void resolve_entry_delete(fr_resolve_entry_t *entry)
+{
+	fr_dlist_remove(&resolve_lru, entry);
+	fr_hash_table_remove(resolve_cache, entry);
+	talloc_free(entry);
+}
+
+static int _resolve_job_free(fr_resolve_job_t *job)
+{
+	if (job->fd >= 0) close(job->fd);
+	return 0;
+}
+
+/** Whether a hostname is an IP address, which getaddrinfo() resolves without blocking
+ *
+ */
+static bool resolve_is_address(char const *hostname)
+{
+	uint8_t buff[sizeof(struct in6_addr)];
+
+	return (inet_pton(AF_INET, hostname, buff) == 1) || (inet_pton(AF_INET6, hostname, buff) == 1);
+}
+
+/** Find an unexpired entry
+ *
+ * Must be called with resolve_mutex held.
+ */
+static fr_resolve_entry_t *resolve_cache_find(int af, char const *hostname, bool fallback, fr_time_t now)
+{
+	fr_resolve_entry_t *entry, my_entry;
+
+	if (!resolve_cache) return NULL;
+
+	my_entry.hostname = hostname;
+	my_entry.af = af;
+	my_entry.fallback = fallback;
+
+	entry = fr_hash_table_find(resolve_cache, &my_entry);
+	if (!entry) return NULL;
+
+	if (entry->expires <= now) {
+		resolve_entry_delete(entry);
+		return NULL;
+	}
+
+	fr_dlist_remove(&resolve_lru, entry);
+	fr_dlist_insert_head(&resolve_lru, entry);
+
+	return entry;
+}
+
+/** Add or update an entry
+ *
+ * Must be called with resolve_mutex held.
+ */
+static void resolve_cache_store(int af, char const *hostname, bool fallback,
+				int ret, fr_ipaddr_t const *ipaddr, char const *error, fr_time_t now)
+{
+	fr_resolve_entry_t *entry, my_entry;
+	fr_time_delta_t ttl = (ret == 0) ? fr_resolve_ttl : fr_resolve_negative_ttl;
+
+	if (ttl <= 0) return;
+
+	if (!resolve_cache) {
+		resolve_ctx = talloc_init_const("resolve_cache");
+		if (!resolve_ctx) return;
+
+		resolve_cache = fr_hash_table_alloc(resolve_ctx, resolve_entry_hash, resolve_entry_cmp, NULL);
+		if (!resolve_cache) {
+			TALLOC_FREE(resolve_ctx);
+			return;
+		}
+		fr_dlist_talloc_init(&resolve_lru, fr_resolve_entry_t, entry);
+	}
+
+	my_entry.hostname = hostname;
+	my_entry.af = af;
+	my_entry.fallback = fallback;
+
+	entry = fr_hash_table_find(resolve_cache, &my_entry);
+	if (entry) {
+		fr_dlist_remove(&resolve_lru, entry);
+		TALLOC_FREE(entry->error);
+	} else {
+		entry = talloc_zero(resolve_ctx, fr_resolve_entry_t);
+		if (!entry) return;
+
+		entry->hostname = talloc_strdup(entry, hostname);
+		entry->af = af;
+		entry->fallback = fallback;
+
+		if (!fr_hash_table_insert(resolve_cache, entry)) {
+			talloc_free(entry);
+			return;
+		}
+	}
+
+	entry->ret = ret;
+	if (ret == 0) {
+		entry->ipaddr = *ipaddr;
+	} else {
+		entry->error = talloc_strdup(entry, error ? error : "Unknown error");
+	}
+	entry->expires = now + ttl;
+	entry->refreshing = false;
+	fr_dlist_insert_head(&resolve_lru, entry);
+
+	while (fr_hash_table_num_elements(resolve_cache) > RESOLVE_CACHE_MAX) {
+		resolve_entry_delete(fr_dlist_tail(&resolve_lru));
+	}
+}
+
+/** Return the result of a cached lookup
+ *
+ */
+static int resolve_entry_result(fr_ipaddr_t *out, fr_resolve_entry_t const *entry)
+{
+	if (entry->ret < 0) {
+		fr_strerror_printf("%s", entry->error);
+		return -1;
+	}
+
+	*out = entry->ipaddr;
+	return 0;
+}
+
+/** Do lookups for the resolver queue
+ *
+ */
+static void *resolve_thread_main(UNUSED void *arg)
+{
+	sigset_t sigset;
+
+	/*
+	 *	Signals go to the main thread.
+	 */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+	pthread_mutex_lock(&resolve_mutex);
+	for (;;) {
+		fr_resolve_job_t	*job;
+		fr_ipaddr_t		ipaddr;
+		int			ret;
+		char			error[sizeof(job->error)] = "";
+
+		while (!resolve_stop && (fr_dlist_num_elements(&resolve_queue) == 0)) {
+			pthread_cond_wait(&resolve_cond, &resolve_mutex);
+		}
+		if (resolve_stop) break;
+
+		job = fr_dlist_pop_head(&resolve_queue);
+		pthread_mutex_unlock(&resolve_mutex);
+
+		ret = fr_inet_getaddrinfo(&ipaddr, job->af, job->hostname, job->fallback);
+		if (ret < 0) strlcpy(error, fr_strerror(), sizeof(error));
+
+		pthread_mutex_lock(&resolve_mutex);
+		resolve_cache_store(job->af, job->hostname, job->fallback, ret, &ipaddr, error, fr_time());
+
+		job->ret = ret;
+		job->ipaddr = ipaddr;
+		strlcpy(job->error, error, sizeof(job->error));
+		job->done = true;
+
+		/*
+		 *	Prefetches have nobody waiting, and orphaned
+		 *	jobs have nobody waiting any more.
+		 */
+		if ((job->fd < 0) || job->orphaned) {
+			talloc_free(job);
+			continue;
+		}
+
+		if (write(job->fd, "", 1) < 0) {
+			fr_strerror_printf("Failed signalling resolver result: %s", fr_syserror(errno));
+		}
+	}
+	pthread_mutex_unlock(&resolve_mutex);
+
+	return NULL;
+}
+
+/** Queue a job for the resolver threads, starting them if necessary
+ *
+ * Must be called with resolve_mutex held.
+ */
+static int resolve_enqueue(fr_resolve_job_t *job)
+{
+	if (resolve_stop) {
+		fr_strerror_const("Resolver is shutting down");
+		return -1;
+	}
+
+	if (resolve_threads_running == 0) {
+		int i;
+
+		fr_dlist_talloc_init(&resolve_queue, fr_resolve_job_t, entry);
+
+		for (i = 0; i < RESOLVE_THREADS; i++) {
+			int ret;
+
+			ret = pthread_create(&resolve_thread[i], NULL, resolve_thread_main, NULL);
+			if (ret != 0) {
+				fr_strerror_printf("Failed creating resolver thread: %s", fr_syserror(ret));
+				break;
+			}
+			resolve_threads_running++;
+		}
+		if (resolve_threads_running == 0) return -1;
+	}
+
+	fr_dlist_insert_tail(&resolve_queue, job);
+	pthread_cond_signal(&resolve_cond);
+
+	return 0;
+}
+
+/** Refresh an entry in the background, if it's about to expire
+ *
+ * Must be called with resolve_mutex held.
+ */
+static void resolve_prefetch(fr_resolve_entry_t *entry, fr_time_t now)
+{
+	fr_resolve_job_t *job;
+
+	if (!fr_resolve_prefetch || entry->refreshing || (entry->ret < 0)) return;
+
+	/*
+	 *	Refresh during the last tenth of the TTL.
+	 */
+	if ((entry->expires - now) > (fr_resolve_ttl / 10)) return;
+
+	job = talloc_zero(NULL, fr_resolve_job_t);
+	if (!job) return;
+
+	job->hostname = talloc_strdup(job, entry->hostname);
+	job->af = entry->af;
+	job->fallback = entry->fallback;
+	job->fd = -1;
+	talloc_set_destructor(job, _resolve_job_free);
+
+	if (resolve_enqueue(job) < 0) {
+		talloc_free(job);
+		return;
+	}
+
+	entry->refreshing = true;
+}
+
+/** Resolve a hostname, using the cache
+ *
+ * Names which aren't in the cache are resolved by the caller, which may
+ * block.  Use #fr_resolve_async from event loops.
+ *
+ * @param[out] out Where to write result.
+ * @param[in] af To search for in preference.
+ * @param[in] hostname to search for.
+ * @param[in] fallback to the other address family, if no records matching af, found.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_resolve(fr_ipaddr_t *out, int af, char const *hostname, bool fallback)
+{
+	fr_resolve_entry_t	*entry;
+	fr_time_t		now;
+	int			ret;
+	char const		*error = NULL;
+
+	if (resolve_is_address(hostname)) return fr_inet_getaddrinfo(out, af, hostname, fallback);
+
+	now = fr_time();
+
+	pthread_mutex_lock(&resolve_mutex);
+	entry = resolve_cache_find(af, hostname, fallback, now);
+	if (entry) {
+		ret = resolve_entry_result(out, entry);
+		resolve_prefetch(entry, now);
+		pthread_mutex_unlock(&resolve_mutex);
+		return ret;
+	}
+	pthread_mutex_unlock(&resolve_mutex);
+
+	ret = fr_inet_getaddrinfo(out, af, hostname, fallback);
+	if (ret < 0) error = fr_strerror_peek();
+
+	pthread_mutex_lock(&resolve_mutex);
+	resolve_cache_store(af, hostname, fallback, ret, out, error, fr_time());
+	pthread_mutex_unlock(&resolve_mutex);
+
+	return ret;
+}
+
+static int _resolve_query_free(fr_resolve_query_t *query)
+{
+	pthread_mutex_lock(&resolve_mutex);
+	if (query->job->done) {
+		talloc_free(query->job);
+	} else {
+		query->job->orphaned = true;
+	}
+	pthread_mutex_unlock(&resolve_mutex);
+
+	fr_event_fd_delete(query->el, query->fd, FR_EVENT_FILTER_IO);
+	close(query->fd);
+
+	return 0;
+}
+
+static void resolve_query_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	fr_resolve_query_t	*query = talloc_get_type_abort(uctx, fr_resolve_query_t);
+	fr_resolve_job_t	*job = query->job;
+	uint8_t			buff;
+
+	if (read(fd, &buff, sizeof(buff)) < 0) {
+		if ((errno == EAGAIN) || (errno == EINTR)) return;
+	}
+
+	pthread_mutex_lock(&resolve_mutex);
+	if (!job->done) {
+		pthread_mutex_unlock(&resolve_mutex);
+		return;
+	}
+	pthread_mutex_unlock(&resolve_mutex);
+
+	/*
+	 *	The job is done, so the resolver thread has finished
+	 *	with it, and we can read it without the lock.
+	 */
+	if (job->ret < 0) {
+		query->cb(NULL, job->error, query->uctx);
+	} else {
+		query->cb(&job->ipaddr, NULL, query->uctx);
+	}
+
+	talloc_free(query);
+}
+
+static void resolve_query_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+				int fd_errno, void *uctx)
+{
+	fr_resolve_query_t *query = talloc_get_type_abort(uctx, fr_resolve_query_t);
+
+	query->cb(NULL, fr_syserror(fd_errno), query->uctx);
+
+	talloc_free(query);
+}
+
+/** Resolve a hostname without blocking
+ *
+ * If the answer is cached (or hostname is an IP address) it's returned
+ * immediately.  Otherwise the lookup is done by a resolver thread, and
+ * cb is called from el when it completes.
+ *
+ * @param[out] out	Where to write the address, if it's available immediately.
+ * @param[out] query	The pending lookup.  Free it to cancel the lookup.  May be NULL.
+ * @param[in] ctx	to allocate the query in.
+ * @param[in] el	to call cb from.
+ * @param[in] af	To search for in preference.
+ * @param[in] hostname	to search for.
+ * @param[in] fallback	to the other address family, if no records matching af, found.
+ * @param[in] cb	to call when the lookup completes.
+ * @param[in] uctx	passed to cb.
+ * @return
+ *	- 1 if out has been written.
+ *	- 0 if the lookup is pending, and cb will be called.
+ *	- -1 on failure, including a cached failure.
+ */
+int fr_resolve_async(fr_ipaddr_t *out, fr_resolve_query_t **query, TALLOC_CTX *ctx, fr_event_list_t *el,
+		     int af, char const *hostname, bool fallback, fr_resolve_cb_t cb, void *uctx)
+{
+	fr_resolve_entry_t	*entry;
+	fr_resolve_query_t	*q;
+	fr_resolve_job_t	*job;
+	fr_time_t		now;
+	int			fds[2];
+
+	if (query) *query = NULL;
+
+	if (resolve_is_address(hostname)) {
+		if (fr_inet_getaddrinfo(out, af, hostname, fallback) < 0) return -1;
+		return 1;
+	}
+
+	now = fr_time();
+
+	pthread_mutex_lock(&resolve_mutex);
+	entry = resolve_cache_find(af, hostname, fallback, now);
+	if (entry) {
+		int ret;
+
+		ret = resolve_entry_result(out, entry);
+		resolve_prefetch(entry, now);
+		pthread_mutex_unlock(&resolve_mutex);
+
+		return (ret < 0) ? -1 : 1;
+	}
+	pthread_mutex_unlock(&resolve_mutex);
+
+	if (pipe(fds) < 0) {
+		fr_strerror_printf("Failed creating resolver pipe: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	if ((fr_nonblock(fds[0]) < 0) || (fr_nonblock(fds[1]) < 0)) {
+	error_close:
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	job = talloc_zero(NULL, fr_resolve_job_t);
+	if (!job) {
+		fr_strerror_const("Out of memory");
+		goto error_close;
+	}
+	job->hostname = talloc_strdup(job, hostname);
+	job->af = af;
+	job->fallback = fallback;
+	job->fd = fds[1];
+	talloc_set_destructor(job, _resolve_job_free);
+
+	q = talloc_zero(ctx, fr_resolve_query_t);
+	if (!q) {
+		fr_strerror_const("Out of memory");
+		talloc_free(job);
+		close(fds[0]);
+		return -1;
+	}
+	q->job = job;
+	q->el = el;
+	q->fd = fds[0];
+	q->cb = cb;
+	q->uctx = uctx;
+
+	if (fr_event_fd_insert(q, el, q->fd, resolve_query_read, NULL, resolve_query_error, q) < 0) {
+		talloc_free(job);
+		close(q->fd);
+		talloc_free(q);
+		return -1;
+	}
+
+	pthread_mutex_lock(&resolve_mutex);
+	if (resolve_enqueue(job) < 0) {
+		pthread_mutex_unlock(&resolve_mutex);
+
+		fr_event_fd_delete(el, q->fd, FR_EVENT_FILTER_IO);
+		talloc_free(job);
+		close(q->fd);
+		talloc_free(q);
+		return -1;
+	}
+	pthread_mutex_unlock(&resolve_mutex);
+
+	talloc_set_destructor(q, _resolve_query_free);
+	if (query) *query = q;
+
+	return 0;
+}
+
+/** Discard all cached lookups
+ *
+ */
+void fr_resolve_flush(void)
+{
+	pthread_mutex_lock(&resolve_mutex);
+	resolve_cache = NULL;
+	TALLOC_FREE(resolve_ctx);
+	pthread_mutex_unlock(&resolve_mutex);
+}
+
+/** Stop the resolver threads, and discard the cache
+ *
+ * Any queries which are still pending will never complete.
+ */
+void fr_resolve_free(void)
+{
+	fr_resolve_job_t	*job;
+	int			i;
+
+	pthread_mutex_lock(&resolve_mutex);
+	resolve_stop = true;
+	pthread_cond_broadcast(&resolve_cond);
+	pthread_mutex_unlock(&resolve_mutex);
+
+	for (i = 0; i < resolve_threads_running; i++) pthread_join(resolve_thread[i], NULL);
+
+	pthread_mutex_lock(&resolve_mutex);
+	if (resolve_threads_running > 0) {
+		while ((job = fr_dlist_pop_head(&resolve_queue))) {
+			if ((job->fd < 0) || job->orphaned) {
+				talloc_free(job);
+				continue;
+			}
+
+			/*
+			 *	The query still points to the job, and
+			 *	will free it when the query is freed.
+			 */
+			strlcpy(job->error, "Resolver is shutting down", sizeof(job->error));
+			job->ret = -1;
+			job->done = true;
+		}
+	}
+	resolve_threads_running = 0;
+	resolve_stop = false;
+	pthread_mutex_unlock(&resolve_mutex);
+
+	fr_resolve_flush();
+}
@@ -0,0 +1,62 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Cached, and optionally asynchronous, hostname resolution
+ *
+ * @file src/lib/util/resolve.h
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(resolve_h, "$Id$")
+
+#include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/inet.h>
+#include <freeradius-devel/util/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern fr_time_delta_t	fr_resolve_ttl;			//!< How long successful lookups are cached for.
+extern fr_time_delta_t	fr_resolve_negative_ttl;	//!< How long failed lookups are cached for.
+extern bool		fr_resolve_prefetch;		//!< Refresh busy entries in the background.
+
+typedef struct fr_resolve_query_s fr_resolve_query_t;
+
+/** Called when an asynchronous lookup completes
+ *
+ * The query is freed once the callback returns, and must not be freed
+ * by the callback.
+ *
+ * @param[in] ipaddr	The address found, or NULL if the lookup failed.
+ * @param[in] error	Why the lookup failed, or NULL if it succeeded.
+ * @param[in] uctx	passed to #fr_resolve_async.
+ */
+typedef void (*fr_resolve_cb_t)(fr_ipaddr_t const *ipaddr, char const *error, void *uctx);
+
+int	fr_resolve(fr_ipaddr_t *out, int af, char const *hostname, bool fallback);
+
+int	fr_resolve_async(fr_ipaddr_t *out, fr_resolve_query_t **query, TALLOC_CTX *ctx, fr_event_list_t *el,
+			 int af, char const *hostname, bool fallback, fr_resolve_cb_t cb, void *uctx);
+
+void	fr_resolve_flush(void);
+
+void	fr_resolve_free(void);
+
+#ifdef __cplusplus
+}
+#endif
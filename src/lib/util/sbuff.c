@@ -35,6 +35,10 @@ RCSID("$Id$")
 #include <stdint.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
 static _Thread_local char *sbuff_scratch;
 
 static_assert(sizeof(long long) >= sizeof(int64_t), "long long must be as wide or wider than an int64_t");
@@ -544,6 +548,134 @@ static inline bool fr_sbuff_terminal_search(fr_sbuff_t *in, char const *p,
 	return false;
 }
 
+/** Maximum number of distinct stop bytes the vector scan compares against
+ *
+ * Terminal sets with more distinct first bytes than this fall back to the
+ * scalar table scan.
+ */
+#ifndef SBUFF_SCAN_CHARS_MAX
+#  define SBUFF_SCAN_CHARS_MAX	16
+#endif
+
+/** Minimum number of bytes which must be available before we try the vector scan
+ *
+ * Most tokens are short, and collecting the stop bytes isn't free.
+ */
+#ifndef SBUFF_SCAN_VECTOR_MIN
+#  define SBUFF_SCAN_VECTOR_MIN	32
+#endif
+
+/** State for skipping runs of bytes which can't start a terminal or escape sequence
+ *
+ */
+typedef struct {
+	uint8_t const		*idx;				//!< Terminal fast path index.
+	fr_sbuff_term_t const	*tt;				//!< Terminals the index was populated from.
+	char			escape_chr;			//!< Escape char, or '\0' if there isn't one.
+	int			num;				//!< Number of distinct stop bytes.  -1 if not yet
+								///< collected, 0 if there are too many to vectorise.
+	uint8_t			chr[SBUFF_SCAN_CHARS_MAX];	//!< Distinct stop bytes.
+} sbuff_scan_t;
+
+static uint8_t const sbuff_scan_no_terminals[UINT8_MAX + 1];
+
+/** Initialise a scan context
+ *
+ * @param[out] scan		to initialise.
+ * @param[in] idx		Fastpath index, populated by fr_sbuff_terminal_idx_init.
+ * @param[in] tt		Terminals the index was populated from.  May be NULL.
+ * @param[in] escape_chr	Escape char, or '\0' if there isn't one.
+ */
+static inline CC_HINT(always_inline) void sbuff_scan_init(sbuff_scan_t *scan, uint8_t const idx[static UINT8_MAX + 1],
+							  fr_sbuff_term_t const *tt, char escape_chr)
+{
+	scan->idx = tt ? idx : sbuff_scan_no_terminals;
+	scan->tt = tt;
+	scan->escape_chr = escape_chr;
+	scan->num = -1;
+}
+
+#ifdef __SSE2__
+/** Collect the distinct first bytes of the terminals, and the escape char
+ *
+ */
+static void sbuff_scan_chars_init(sbuff_scan_t *scan)
+{
+	size_t	i;
+	int	j;
+
+	scan->num = 0;
+
+	if (scan->escape_chr != '\0') scan->chr[scan->num++] = (uint8_t)scan->escape_chr;
+
+	for (i = 0; scan->tt && (i < scan->tt->len); i++) {
+		uint8_t c = (uint8_t)scan->tt->elem[i].str[0];
+
+		for (j = 0; j < scan->num; j++) if (scan->chr[j] == c) break;
+		if (j < scan->num) continue;
+
+		if (scan->num == SBUFF_SCAN_CHARS_MAX) {
+			scan->num = 0;
+			return;
+		}
+		scan->chr[scan->num++] = c;
+	}
+}
+
+/** Compare 16 bytes at a time against the stop bytes
+ *
+ * @return a pointer to the first stop byte, or to the start of the
+ *	last, incomplete, block.
+ */
+static char const *sbuff_scan_vector(sbuff_scan_t const *scan, char const *p, char const *end)
+{
+	__m128i	needle[SBUFF_SCAN_CHARS_MAX];
+	int	i;
+
+	for (i = 0; i < scan->num; i++) needle[i] = _mm_set1_epi8((char)scan->chr[i]);
+
+	while ((end - p) >= 16) {
+		__m128i		block = _mm_loadu_si128((__m128i const *)p);
+		__m128i		match = _mm_cmpeq_epi8(block, needle[0]);
+		uint32_t	mask;
+
+		for (i = 1; i < scan->num; i++) match = _mm_or_si128(match, _mm_cmpeq_epi8(block, needle[i]));
+
+		mask = (uint32_t)_mm_movemask_epi8(match);
+		if (mask) return p + __builtin_ctz(mask);
+
+		p += 16;
+	}
+
+	return p;
+}
+#endif
+
+/** Skip over bytes which can't start a terminal or an escape sequence
+ *
+ * Only looks at data already in the buffer, and never goes past end.
+ * The byte returned may still not be a terminal, callers must check
+ * it with fr_sbuff_terminal_search.
+ *
+ * @param[in] scan	context, initialised with sbuff_scan_init.
+ * @param[in] p		where to start.
+ * @param[in] end	where to stop.
+ * @return a pointer to the first byte which needs closer examination, or end.
+ */
+static inline CC_HINT(always_inline) char const *sbuff_scan(sbuff_scan_t *scan, char const *p, char const *end)
+{
+#ifdef __SSE2__
+	if ((end - p) >= SBUFF_SCAN_VECTOR_MIN) {
+		if (scan->num < 0) sbuff_scan_chars_init(scan);
+		if (scan->num > 0) p = sbuff_scan_vector(scan, p, end);
+	}
+#endif
+
+	while ((p < end) && !scan->idx[(uint8_t)*p] && (*p != scan->escape_chr)) p++;
+
+	return p;
+}
+
 /** Compare two terminal elements for ordering purposes
  *
  * @param[in] one      	first terminal to compare.
@@ -771,6 +903,7 @@ size_t fr_sbuff_out_bstrncpy_until(fr_sbuff_t *out, fr_sbuff_t *in, size_t len,
 	uint8_t		idx[UINT8_MAX + 1];		/* Fast path index */
 	size_t		needle_len = 1;
 	char		escape_chr = u_rules ? u_rules->chr : '\0';
+	sbuff_scan_t	scan;
 
 	CHECK_SBUFF_INIT(in);
 
@@ -779,6 +912,7 @@ size_t fr_sbuff_out_bstrncpy_until(fr_sbuff_t *out, fr_sbuff_t *in, size_t len,
 	 *	figure out the longest needle.
 	 */
 	fr_sbuff_terminal_idx_init(&needle_len, idx, tt);
+	sbuff_scan_init(&scan, idx, tt, escape_chr);
 
 	while (fr_sbuff_used_total(&our_in) < len) {
 		char	*p;
@@ -790,15 +924,24 @@ size_t fr_sbuff_out_bstrncpy_until(fr_sbuff_t *out, fr_sbuff_t *in, size_t len,
 		end = CONSTRAINED_END(&our_in, len, fr_sbuff_used_total(&our_in));
 
 		if (escape_chr == '\0') {
-			while ((p < end) && !fr_sbuff_terminal_search(in, p, idx, tt, needle_len)) p++;
+			while (p < end) {
+				p = UNCONST(char *, sbuff_scan(&scan, p, end));
+				if ((p == end) || fr_sbuff_terminal_search(in, p, idx, tt, needle_len)) break;
+				p++;
+			}
 		} else {
 			while (p < end) {
 				if (do_escape) {
 					do_escape = false;
-				} else if (*p == escape_chr) {
-					do_escape = true;
-				} else if (fr_sbuff_terminal_search(in, p, idx, tt, needle_len)) {
-					break;
+				} else {
+					p = UNCONST(char *, sbuff_scan(&scan, p, end));
+					if (p == end) break;
+
+					if (*p == escape_chr) {
+						do_escape = true;
+					} else if (fr_sbuff_terminal_search(in, p, idx, tt, needle_len)) {
+						break;
+					}
 				}
 				p++;
 			}
@@ -844,6 +987,7 @@ size_t fr_sbuff_out_unescape_until(fr_sbuff_t *out, fr_sbuff_t *in, size_t len,
 
 	uint8_t				idx[UINT8_MAX + 1];			/* Fast path index */
 	size_t				needle_len = 1;
+	sbuff_scan_t			scan;
 
 	fr_sbuff_extend_status_t	status = FR_SBUFF_EXTENDABLE;		/* Tracks if we can extend */
 
@@ -871,6 +1015,7 @@ size_t fr_sbuff_out_unescape_until(fr_sbuff_t *out, fr_sbuff_t *in, size_t len,
 	 *	figure out the longest needle.
 	 */
 	fr_sbuff_terminal_idx_init(&needle_len, idx, tt);
+	sbuff_scan_init(&scan, idx, tt, u_rules->chr);
 
 	/*
 	 *	...while we have remaining data
@@ -879,6 +1024,21 @@ size_t fr_sbuff_out_unescape_until(fr_sbuff_t *out, fr_sbuff_t *in, size_t len,
 		if (fr_sbuff_was_extended(status)) fr_sbuff_marker_update_end(&end, len);
 		if (!fr_sbuff_diff(&our_in, &end)) break;	/* Reached the end */
 
+		/*
+		 *	Skip runs of bytes which can't start an
+		 *	escape sequence or a terminal, they're
+		 *	copied out with the rest of the chunk.
+		 */
+		if (!do_escape) {
+			char const *p = fr_sbuff_current(&our_in);
+			char const *q = sbuff_scan(&scan, p, fr_sbuff_current(&end));
+
+			if (q != p) {
+				fr_sbuff_set(&our_in, q);
+				continue;
+			}
+		}
+
 		if (do_escape) {
 			do_escape = false;
 
@@ -1484,21 +1644,39 @@ ssize_t fr_sbuff_in_escape(fr_sbuff_t *sbuff, char const *in, size_t inlen, fr_s
 
 	our_sbuff = FR_SBUFF_NO_ADVANCE(sbuff);
 	while (p < end) {
-		size_t	clen;
-		uint8_t	c = (uint8_t)*p;
-		char	sub;
+		char const	*q = p;
+		size_t		clen;
+		uint8_t		c;
+		char		sub;
 
 		/*
+		 *	Find the run of chars which don't need
+		 *	escaping, and copy it in one go.
+		 *
 		 *	We don't support escaping UTF8 sequences
 		 *	as they're not used anywhere in our
 		 *	grammar.
 		 */
-		if (e_rules->do_utf8 && ((clen = fr_utf8_char((uint8_t const *)p, end - p)) > 1)) {
-			FR_SBUFF_IN_BSTRNCPY_RETURN(&our_sbuff, p, clen);
-			p += clen;
-			continue;
+		while (q < end) {
+			c = (uint8_t)*q;
+
+			if (e_rules->do_utf8 && (c >= 0x80) && ((clen = fr_utf8_char((uint8_t const *)q, end - q)) > 1)) {
+				q += clen;
+				continue;
+			}
+
+			if (e_rules->subs[c] || e_rules->esc[c]) break;
+			q++;
 		}
 
+		if (q > p) {
+			FR_SBUFF_IN_BSTRNCPY_RETURN(&our_sbuff, p, q - p);
+			p = q;
+			if (p == end) break;
+		}
+
+		c = (uint8_t)*p;
+
 		/*
 		 *	Check if there's a special substitution
 		 *	like 0x0a -> \n.
@@ -1672,6 +1850,7 @@ size_t fr_sbuff_adv_until(fr_sbuff_t *sbuff, size_t len, fr_sbuff_term_t const *
 
 	uint8_t		idx[UINT8_MAX + 1];		/* Fast path index */
 	size_t		needle_len = 1;
+	sbuff_scan_t	scan;
 
 	CHECK_SBUFF_INIT(sbuff);
 
@@ -1680,6 +1859,7 @@ size_t fr_sbuff_adv_until(fr_sbuff_t *sbuff, size_t len, fr_sbuff_term_t const *
 	 *	figure out the longest needle.
 	 */
 	fr_sbuff_terminal_idx_init(&needle_len, idx, tt);
+	sbuff_scan_init(&scan, idx, tt, escape_chr);
 
 	while (total < len) {
 		char *end;
@@ -1690,15 +1870,24 @@ size_t fr_sbuff_adv_until(fr_sbuff_t *sbuff, size_t len, fr_sbuff_term_t const *
 		p = sbuff->p;
 
 		if (escape_chr == '\0') {
-			while ((p < end) && !fr_sbuff_terminal_search(sbuff, p, idx, tt, needle_len)) p++;
+			while (p < end) {
+				p = sbuff_scan(&scan, p, end);
+				if ((p == end) || fr_sbuff_terminal_search(sbuff, p, idx, tt, needle_len)) break;
+				p++;
+			}
 		} else {
 			while (p < end) {
 				if (do_escape) {
 					do_escape = false;
-				} else if (*p == escape_chr) {
-					do_escape = true;
-				} else if (fr_sbuff_terminal_search(sbuff, p, idx, tt, needle_len)) {
-					break;
+				} else {
+					p = sbuff_scan(&scan, p, end);
+					if (p == end) break;
+
+					if (*p == escape_chr) {
+						do_escape = true;
+					} else if (fr_sbuff_terminal_search(sbuff, p, idx, tt, needle_len)) {
+						break;
+					}
 				}
 				p++;
 			}
@@ -1157,6 +1157,74 @@ static void test_adv_until(void)
 	TEST_CHECK(sbuff.p == (sbuff.start + 5));
 }
 
+/*
+ *	Inputs long enough to use the vectorised scan, with terminals
+ *	and escapes at every offset within a block.
+ */
+static void test_scan_long(void)
+{
+	char				in[130 + 1];
+	char				out[130 + 1];
+	fr_sbuff_t			sbuff;
+	fr_sbuff_term_t const		*tt = &FR_SBUFF_TERMS(L("\""), L("%{"));
+	fr_sbuff_unescape_rules_t	rules = {
+						.chr = '\\',
+						.subs = { ['"'] = '"', ['\\'] = '\\' }
+					};
+	size_t				i;
+
+	for (i = 2; i < sizeof(in) - 1; i++) {
+		memset(in, 'a', sizeof(in) - 1);
+		in[sizeof(in) - 1] = '\0';
+		in[i / 2] = '%';		/* Not a terminal on its own */
+		in[i] = '"';
+
+		TEST_CASE("adv_until stops at terminal");
+		fr_sbuff_init(&sbuff, in, sizeof(in));
+		TEST_CHECK_LEN(fr_sbuff_adv_until(&sbuff, SIZE_MAX, tt, '\0'), i);
+
+		TEST_CASE("adv_until stops at length constraint");
+		fr_sbuff_init(&sbuff, in, sizeof(in));
+		TEST_CHECK_LEN(fr_sbuff_adv_until(&sbuff, i - 1, tt, '\0'), i - 1);
+
+		TEST_CASE("bstrncpy_until stops at terminal");
+		fr_sbuff_init(&sbuff, in, sizeof(in));
+		TEST_CHECK_LEN(fr_sbuff_out_bstrncpy_until(&FR_SBUFF_OUT(out, sizeof(out)), &sbuff, SIZE_MAX, tt, NULL), i);
+		TEST_CHECK(strlen(out) == i);
+
+		TEST_CASE("'%{' terminal in long string");
+		in[i / 2 + 1] = '{';
+		fr_sbuff_init(&sbuff, in, sizeof(in));
+		TEST_CHECK_LEN(fr_sbuff_adv_until(&sbuff, SIZE_MAX, tt, '\0'), i / 2);
+		in[i / 2 + 1] = (i / 2 + 1 == i) ? '"' : 'a';
+
+		/*
+		 *	Escaped terminal immediately before the real one
+		 */
+		in[i - 2] = '\\';
+		in[i - 1] = '"';
+
+		TEST_CASE("adv_until skips escaped terminal");
+		fr_sbuff_init(&sbuff, in, sizeof(in));
+		TEST_CHECK_LEN(fr_sbuff_adv_until(&sbuff, SIZE_MAX, tt, '\\'), i);
+
+		if (i / 2 >= i - 2) continue;	/* '%' was overwritten */
+
+		TEST_CASE("bstrncpy_until skips escaped terminal");
+		fr_sbuff_init(&sbuff, in, sizeof(in));
+		TEST_CHECK_LEN(fr_sbuff_out_bstrncpy_until(&FR_SBUFF_OUT(out, sizeof(out)), &sbuff, SIZE_MAX,
+							   tt, &rules), i);
+
+		TEST_CASE("unescape_until skips escaped terminal");
+		fr_sbuff_init(&sbuff, in, sizeof(in));
+		TEST_CHECK_LEN(fr_sbuff_out_unescape_until(&FR_SBUFF_OUT(out, sizeof(out)), &sbuff, SIZE_MAX,
+							   tt, &rules), i - 1);
+		TEST_CHECK(fr_sbuff_used(&sbuff) == i);
+		TEST_CHECK(out[i - 2] == '"');
+		TEST_CHECK(out[i / 2] == '%');
+	}
+}
+
 static void test_adv_to_utf8(void)
 {
 	fr_sbuff_t	sbuff;
@@ -1463,6 +1531,7 @@ TEST_LIST = {
 	{ "fr_sbuff_adv_past_whitespace",	test_adv_past_whitespace },
 	{ "fr_sbuff_adv_past_allowed",		test_adv_past_allowed },
 	{ "fr_sbuff_adv_until",			test_adv_until },
+	{ "fr_sbuff_scan_long",			test_scan_long },
 
 	/*
 	 *	Token searching
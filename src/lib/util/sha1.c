@@ -11,8 +11,20 @@ RCSID("$Id$")
 #include <freeradius-devel/util/sha1.h>
 
 #include <arpa/inet.h>
+#include <stdbool.h>
 
 #ifndef WITH_OPENSSL_SHA1
+/*
+ *	Build the SHA extensions version of the transform if
+ *	the compiler lets us target the instructions per function.
+ *	We still check at runtime that the CPU has them.
+ */
+#  if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 5)))
+#    define SHA1_HAVE_SHANI
+#    include <cpuid.h>
+#    include <immintrin.h>
+#  endif
+
 #  define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
 
 /* blk0() and blk() perform the initial expand. */
@@ -33,7 +45,7 @@ RCSID("$Id$")
 
 /* Hash a single 512-bit block. This is the core of the algorithm. */
 
-void fr_sha1_transform(uint32_t state[static 5], uint8_t const buffer[static 64])
+static void fr_sha1_local_transform(uint32_t state[static 5], uint8_t const buffer[static 64])
 {
 	uint32_t a, b, c, d, e;
 	typedef union {
@@ -89,6 +101,134 @@ void fr_sha1_transform(uint32_t state[static 5], uint8_t const buffer[static 64]
 }
 
 
+#  ifdef SHA1_HAVE_SHANI
+/*
+ *	Hash a single 512-bit block using the x86 SHA extensions.
+ *
+ *	Each sha1rnds4 performs four rounds, with the message schedule
+ *	for the next four rounds being computed by sha1msg1/sha1msg2
+ *	in parallel.
+ */
+#    define SHANI_ROUNDS(_k, _e_in, _e_out, _m, _m1, _m2, _m3) \
+	_e_in = _mm_sha1nexte_epu32(_e_in, _m); \
+	_e_out = abcd; \
+	_m1 = _mm_sha1msg2_epu32(_m1, _m); \
+	abcd = _mm_sha1rnds4_epu32(abcd, _e_in, (_k) / 5); \
+	_m3 = _mm_sha1msg1_epu32(_m3, _m); \
+	_m2 = _mm_xor_si128(_m2, _m)
+
+__attribute__((target("sha,sse4.1")))
+static void fr_sha1_shani_transform(uint32_t state[static 5], uint8_t const buffer[static 64])
+{
+	__m128i		abcd, abcd_save, e0, e0_save, e1;
+	__m128i		msg0, msg1, msg2, msg3;
+	__m128i const	mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((__m128i const *) state), 0x1b);
+	e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+	abcd_save = abcd;
+	e0_save = e0;
+
+	/* Rounds 0-3 */
+	msg0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (buffer + 0)), mask);
+	e0 = _mm_add_epi32(e0, msg0);
+	e1 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+	/* Rounds 4-7 */
+	msg1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (buffer + 16)), mask);
+	e1 = _mm_sha1nexte_epu32(e1, msg1);
+	e0 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+	msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+	/* Rounds 8-11 */
+	msg2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (buffer + 32)), mask);
+	e0 = _mm_sha1nexte_epu32(e0, msg2);
+	e1 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+	msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+	msg0 = _mm_xor_si128(msg0, msg2);
+
+	/* Rounds 12-79 */
+	msg3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (buffer + 48)), mask);
+	SHANI_ROUNDS( 3, e1, e0, msg3, msg0, msg1, msg2);
+	SHANI_ROUNDS( 4, e0, e1, msg0, msg1, msg2, msg3);
+	SHANI_ROUNDS( 5, e1, e0, msg1, msg2, msg3, msg0);
+	SHANI_ROUNDS( 6, e0, e1, msg2, msg3, msg0, msg1);
+	SHANI_ROUNDS( 7, e1, e0, msg3, msg0, msg1, msg2);
+	SHANI_ROUNDS( 8, e0, e1, msg0, msg1, msg2, msg3);
+	SHANI_ROUNDS( 9, e1, e0, msg1, msg2, msg3, msg0);
+	SHANI_ROUNDS(10, e0, e1, msg2, msg3, msg0, msg1);
+	SHANI_ROUNDS(11, e1, e0, msg3, msg0, msg1, msg2);
+	SHANI_ROUNDS(12, e0, e1, msg0, msg1, msg2, msg3);
+	SHANI_ROUNDS(13, e1, e0, msg1, msg2, msg3, msg0);
+	SHANI_ROUNDS(14, e0, e1, msg2, msg3, msg0, msg1);
+	SHANI_ROUNDS(15, e1, e0, msg3, msg0, msg1, msg2);
+	SHANI_ROUNDS(16, e0, e1, msg0, msg1, msg2, msg3);
+	SHANI_ROUNDS(17, e1, e0, msg1, msg2, msg3, msg0);
+	SHANI_ROUNDS(18, e0, e1, msg2, msg3, msg0, msg1);
+	SHANI_ROUNDS(19, e1, e0, msg3, msg0, msg1, msg2);
+
+	/* Add the working vars back into state */
+	e0 = _mm_sha1nexte_epu32(e0, e0_save);
+	abcd = _mm_add_epi32(abcd, abcd_save);
+
+	_mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1b));
+	state[4] = _mm_extract_epi32(e0, 3);
+}
+
+/** Check whether the CPU supports the SHA extensions
+ *
+ */
+static bool fr_sha1_shani_available(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+	if (!(ecx & (1 << 19))) return false;		/* SSE4.1 */
+
+	if (__get_cpuid_max(0, NULL) < 7) return false;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+	return (ebx & (1 << 29)) != 0;			/* SHA */
+}
+#  endif
+
+typedef void (*fr_sha1_transform_func_t)(uint32_t state[static 5], uint8_t const buffer[static 64]);
+
+static void fr_sha1_transform_select(uint32_t state[static 5], uint8_t const buffer[static 64]);
+
+/** Which transform to use, picked the first time we hash anything
+ *
+ * Racing threads all pick the same function, so there's no need for locking.
+ */
+static fr_sha1_transform_func_t sha1_transform = fr_sha1_transform_select;
+
+static void fr_sha1_transform_select(uint32_t state[static 5], uint8_t const buffer[static 64])
+{
+#  ifdef SHA1_HAVE_SHANI
+	if (fr_sha1_shani_available()) {
+		sha1_transform = fr_sha1_shani_transform;
+	} else
+#  endif
+	{
+		sha1_transform = fr_sha1_local_transform;
+	}
+
+	sha1_transform(state, buffer);
+}
+
+/** Hash a single 512-bit block
+ *
+ * Uses the SHA extensions if the CPU has them.
+ */
+void fr_sha1_transform(uint32_t state[static 5], uint8_t const buffer[static 64])
+{
+	sha1_transform(state, buffer);
+}
+
 /* fr_sha1_init - Initialize new context */
 
 void fr_sha1_init(fr_sha1_ctx* context)
@@ -123,9 +263,9 @@ void fr_sha1_update(fr_sha1_ctx *context, uint8_t const *in, size_t len)
 	context->count[1] += (len >> 29);
 	if ((j + len) > 63) {
 		memcpy(&context->buffer[j], in, (i = 64-j));
-		fr_sha1_transform(context->state, context->buffer);
+		sha1_transform(context->state, context->buffer);
 		for ( ; i + 63 < len; i += 64) {
-			fr_sha1_transform(context->state, &in[i]);
+			sha1_transform(context->state, &in[i]);
 		}
 		j = 0;
 	} else {
@@ -146,10 +286,16 @@ void fr_sha1_final(uint8_t digest[static SHA1_DIGEST_LENGTH], fr_sha1_ctx *conte
 		finalcount[i] = (uint8_t)((context->count[(i >= 4 ? 0 : 1)] >> ((3-(i & 3)) * 8) ) & 255);  /* Endian independent */
 	}
 
-	fr_sha1_update(context, (unsigned char const *) "\200", 1);
+	/*
+	 *	Pad with 0x80 then zeros, so there's 8 bytes left
+	 *	in the block for the length.  Done as a single update
+	 *	rather than a byte at a time.
+	 */
+	{
+		static uint8_t const	padding[64] = { 0x80 };
+		size_t			used = (context->count[0] >> 3) & 63;
 
-	while ((context->count[0] & 504) != 448) {
-		fr_sha1_update(context, (unsigned char const *) "\0", 1);
+		fr_sha1_update(context, padding, (used < 56) ? (56 - used) : (120 - used));
 	}
 	fr_sha1_update(context, finalcount, 8);  /* Should cause a fr_sha1_transform() */
 	for (i = 0; i < 20; i++) {
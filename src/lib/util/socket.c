@@ -44,6 +44,10 @@
 
 #include <ifaddrs.h>
 
+#ifdef __linux__
+#  include <linux/filter.h>
+#endif
+
 /** Resolve a named service to a port
  *
  * @param[in] proto	The protocol. Either IPPROTO_TCP or IPPROTO_UDP.
@@ -1046,3 +1050,131 @@ done:
 #endif
 	return 0;
 }
+
+#ifdef SO_ATTACH_FILTER
+/*
+ *	Largest program the kernel accepts.
+ */
+#  ifndef BPF_MAXINSNS
+#    define BPF_MAXINSNS 4096
+#  endif
+
+/** Append the instructions to match one rule
+ *
+ * For each 32 bit word of the address that the prefix covers,
+ * load the word from the packet's source address, mask it, and
+ * skip to the next rule if it doesn't match.  If all the words
+ * match, return the rule's verdict.
+ */
+static size_t socket_filter_rule(struct sock_filter *code, int af, fr_socket_filter_rule_t const *rule)
+{
+	uint8_t const	*addr = (af == AF_INET) ? (uint8_t const *)&rule->network.addr.v4.s_addr :
+						  rule->network.addr.v6.s6_addr;
+	uint32_t	src_off = (af == AF_INET) ? 12 : 8;	/* Offset of the source address in the IP header */
+	uint8_t		prefix = rule->network.prefix;
+	size_t		words = (prefix + 31) / 32;
+	size_t		i, len = 0, skip;
+
+	/*
+	 *	Instructions to skip if a word doesn't
+	 *	match.  Each word takes ld, [and], jeq.
+	 */
+	skip = 1;					/* ret */
+	for (i = 0; i < words; i++) skip += ((prefix - (i * 32)) >= 32) ? 2 : 3;
+
+	for (i = 0; i < words; i++) {
+		uint32_t	bits = ((prefix - (i * 32)) >= 32) ? 32 : (prefix - (i * 32));
+		uint32_t	mask = (bits == 32) ? UINT32_MAX : ~(UINT32_MAX >> bits);
+		uint32_t	word;
+
+		word = ((uint32_t)addr[i * 4] << 24) | ((uint32_t)addr[(i * 4) + 1] << 16) |
+		       ((uint32_t)addr[(i * 4) + 2] << 8) | addr[(i * 4) + 3];
+
+		code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + src_off + (i * 4));
+		skip--;
+		if (bits < 32) {
+			code[len++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_AND | BPF_K, mask);
+			skip--;
+		}
+		skip--;
+		code[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, word & mask, 0, skip);
+	}
+
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, rule->accept ? UINT32_MAX : 0);
+
+	return len;
+}
+#endif
+
+/** Drop packets from unwanted sources in the kernel
+ *
+ * Attaches a socket filter which checks the source address of each
+ * packet against a list of rules.  The first rule which matches decides
+ * whether the packet is accepted.  Packets which match no rule are
+ * dropped.  Dropped packets never reach the socket's receive queue, so
+ * they cost no system calls, allocations or lookups.
+ *
+ * Calling this function again replaces the filter.
+ *
+ * @param[in] sockfd	to filter packets on.  Must be a UDP or TCP socket.
+ * @param[in] af	of the socket.  Rules for other families are ignored.
+ * @param[in] rules	to check the source address against, in order.
+ * @param[in] num_rules	number of rules.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, or if filters aren't supported.
+ */
+int fr_socket_filter_networks(int sockfd, int af, fr_socket_filter_rule_t const *rules, size_t num_rules)
+{
+#ifdef SO_ATTACH_FILTER
+	struct sock_filter	*code;
+	struct sock_fprog	prog;
+	size_t			i, len = 0;
+
+	if ((af != AF_INET) && (af != AF_INET6)) {
+		fr_strerror_printf("Unsupported address family %i", af);
+		return -1;
+	}
+
+	/*
+	 *	Each rule takes at most 4 words of
+	 *	ld, and, jeq, and one return.
+	 */
+	code = talloc_array(NULL, struct sock_filter, (num_rules * 13) + 1);
+	if (!code) {
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+
+	for (i = 0; i < num_rules; i++) {
+		if (rules[i].network.af != af) continue;
+
+		len += socket_filter_rule(code + len, af, &rules[i]);
+	}
+	code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+	if (len > BPF_MAXINSNS) {
+		fr_strerror_printf("Too many networks to filter, the filter needs %zu instructions, "
+				   "but the kernel allows %u", len, BPF_MAXINSNS);
+		talloc_free(code);
+		return -1;
+	}
+
+	prog = (struct sock_fprog) {
+		.len = len,
+		.filter = code
+	};
+
+	if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+		fr_strerror_printf("Failed attaching socket filter: %s", fr_syserror(errno));
+		talloc_free(code);
+		return -1;
+	}
+	talloc_free(code);
+
+	return 0;
+#else
+	fr_strerror_const("Socket filters are not supported on this platform");
+	return -1;
+#endif
+}
@@ -312,6 +312,16 @@ int		fr_socket_server_tcp(fr_ipaddr_t const *ipaddr, uint16_t *port, char const
 
 int		fr_socket_bind(int sockfd, fr_ipaddr_t const *ipaddr, uint16_t *port, char const *interface);
 
+/** One rule of a source address filter
+ *
+ */
+typedef struct {
+	fr_ipaddr_t	network;		//!< Source network the rule matches.
+	bool		accept;			//!< Whether matching packets are accepted or dropped.
+} fr_socket_filter_rule_t;
+
+int		fr_socket_filter_networks(int sockfd, int af, fr_socket_filter_rule_t const *rules, size_t num_rules);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,420 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Bounded pool of threads for running CPU intensive jobs off the event loop
+ *
+ * Jobs are submitted by a client, which is bound to the event loop of
+ * the submitting thread.  When a job completes it's placed on the
+ * client's list of completed jobs, and a byte is written to a pipe
+ * the client's event loop is watching.  The completion callback then
+ * runs in the submitting thread, so it's free to resume requests.
+ *
+ * @file src/lib/util/thread_pool.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/util/thread_pool.h>
+
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+struct fr_thread_pool_s {
+	pthread_mutex_t		mutex;		//!< Protects everything below, and all client
+						///< and job state shared with the pool threads.
+	pthread_cond_t		work;		//!< Signalled when a job is queued or on shutdown.
+	pthread_cond_t		idle;		//!< Signalled when a client has no outstanding jobs.
+
+	fr_dlist_head_t		queue;		//!< Jobs waiting for a thread.
+	uint32_t		max_queued;	//!< Maximum length of the queue.
+
+	pthread_t		*threads;	//!< Array of pool threads.
+	unsigned int		num_threads;	//!< How many threads were started.
+	bool			shutdown;	//!< Tells the threads to exit.
+
+	fr_thread_pool_stats_t	stats;
+};
+
+struct fr_thread_pool_client_s {
+	fr_thread_pool_t	*pool;		//!< We submit jobs to.
+	fr_event_list_t		*el;		//!< Completion callbacks run in.
+	int			fd[2];		//!< Pipe used to wake the event loop.
+
+	fr_dlist_head_t		done;		//!< Jobs which have completed.
+	uint32_t		outstanding;	//!< Jobs queued or running.
+};
+
+typedef enum {
+	THREAD_POOL_JOB_QUEUED = 0,		//!< Waiting for a thread.
+	THREAD_POOL_JOB_RUNNING,		//!< Being run by a thread.
+	THREAD_POOL_JOB_DONE			//!< On the client's done list.
+} fr_thread_pool_job_state_t;
+
+struct fr_thread_pool_job_s {
+	fr_dlist_t		entry;		//!< Entry in the pool queue, or client done list.
+	fr_thread_pool_client_t	*client;	//!< Which submitted this job.
+
+	fr_thread_pool_run_t	run;		//!< Run in a pool thread.
+	fr_thread_pool_done_t	done;		//!< Run in the client's event loop.
+	void			*uctx;		//!< Passed to both callbacks.
+
+	fr_thread_pool_job_state_t state;
+	bool			cancelled;	//!< Don't call done, just free the job.
+
+	fr_time_t		queued;		//!< When the job was submitted.
+	fr_time_delta_t		wait;		//!< How long the job was queued for.
+	fr_time_delta_t		run_time;	//!< How long the job took to run.
+};
+
+static void *thread_pool_thread(void *arg)
+{
+	fr_thread_pool_t	*pool = talloc_get_type_abort(arg, fr_thread_pool_t);
+	sigset_t		sigset;
+
+	/*
+	 *	Signals are handled by the main thread only.
+	 */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		fr_thread_pool_job_t	*job;
+		fr_thread_pool_client_t	*client;
+		fr_time_t		start;
+
+		while (!pool->shutdown && fr_dlist_empty(&pool->queue)) pthread_cond_wait(&pool->work, &pool->mutex);
+		if (pool->shutdown) break;
+
+		job = fr_dlist_pop_head(&pool->queue);
+		job->state = THREAD_POOL_JOB_RUNNING;
+
+		start = fr_time();
+		job->wait = start - job->queued;
+		pool->stats.depth--;
+		pool->stats.wait_total += job->wait;
+		if (job->wait > pool->stats.wait_max) pool->stats.wait_max = job->wait;
+		pthread_mutex_unlock(&pool->mutex);
+
+		job->run(job->uctx);
+
+		pthread_mutex_lock(&pool->mutex);
+		job->run_time = fr_time() - start;
+		job->state = THREAD_POOL_JOB_DONE;
+		pool->stats.completed++;
+		pool->stats.run_total += job->run_time;
+
+		/*
+		 *	Only wake the client if it doesn't
+		 *	already have a wakeup pending.  If the
+		 *	pipe is full, one is pending anyway.
+		 *
+		 *	The write is done with the mutex held
+		 *	so the client can't be freed under us.
+		 */
+		client = job->client;
+		if (fr_dlist_empty(&client->done) && (write(client->fd[1], "", 1) < 0)) {
+			fr_assert(errno == EAGAIN);
+		}
+		fr_dlist_insert_tail(&client->done, job);
+
+		if (--client->outstanding == 0) pthread_cond_broadcast(&pool->idle);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+static int _thread_pool_free(fr_thread_pool_t *pool)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	fr_assert_msg(fr_dlist_empty(&pool->queue), "Thread pool freed with jobs still queued");
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->num_threads; i++) pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->idle);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->mutex);
+
+	return 0;
+}
+
+/** Start a pool of threads
+ *
+ * @param[in] ctx		to allocate the pool in.  Freeing the pool stops
+ *				the threads, and must only be done after all of
+ *				its clients have been freed.
+ * @param[in] threads		How many threads to start.
+ * @param[in] max_queued	Maximum number of jobs waiting for a thread.
+ *				Submissions to a full queue fail.
+ * @return
+ *	- A new thread pool.
+ *	- NULL on error.
+ */
+fr_thread_pool_t *fr_thread_pool_alloc(TALLOC_CTX *ctx, unsigned int threads, uint32_t max_queued)
+{
+	fr_thread_pool_t	*pool;
+	int			ret;
+
+	if (!threads) {
+		fr_strerror_const("Thread pool must have at least one thread");
+		return NULL;
+	}
+
+	pool = talloc_zero(ctx, fr_thread_pool_t);
+	if (!pool) {
+	oom:
+		fr_strerror_const("Out of memory");
+		return NULL;
+	}
+	pool->threads = talloc_array(pool, pthread_t, threads);
+	if (!pool->threads) {
+		talloc_free(pool);
+		goto oom;
+	}
+	pool->max_queued = max_queued;
+	fr_dlist_init(&pool->queue, fr_thread_pool_job_t, entry);
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+	talloc_set_destructor(pool, _thread_pool_free);
+
+	while (pool->num_threads < threads) {
+		ret = pthread_create(&pool->threads[pool->num_threads], NULL, thread_pool_thread, pool);
+		if (ret != 0) {
+			fr_strerror_printf("Failed creating thread pool thread: %s", fr_syserror(ret));
+			talloc_free(pool);
+			return NULL;
+		}
+		pool->num_threads++;
+	}
+
+	return pool;
+}
+
+/** Copy the current statistics of a thread pool
+ *
+ * @param[out] stats	Where to write the statistics.
+ * @param[in] pool	to get statistics for.
+ */
+void fr_thread_pool_stats(fr_thread_pool_stats_t *stats, fr_thread_pool_t *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	*stats = pool->stats;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/** Run the completion callbacks of jobs which have finished
+ *
+ */
+static void thread_pool_client_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	fr_thread_pool_client_t	*client = talloc_get_type_abort(uctx, fr_thread_pool_client_t);
+	fr_thread_pool_job_t	*job;
+	fr_dlist_head_t		done;
+	uint8_t			buffer[64];
+
+	while (read(fd, buffer, sizeof(buffer)) > 0);
+
+	fr_dlist_init(&done, fr_thread_pool_job_t, entry);
+
+	pthread_mutex_lock(&client->pool->mutex);
+	fr_dlist_move(&done, &client->done);
+	pthread_mutex_unlock(&client->pool->mutex);
+
+	while ((job = fr_dlist_pop_head(&done))) {
+		if (!job->cancelled) job->done(job->uctx, job->wait, job->run_time);
+		talloc_free(job);
+	}
+}
+
+static int _thread_pool_client_free(fr_thread_pool_client_t *client)
+{
+	fr_thread_pool_t	*pool = client->pool;
+	fr_thread_pool_job_t	*job;
+
+	/*
+	 *	Jobs which haven't started yet can just
+	 *	be removed.  We have to wait for running
+	 *	jobs, as they have a pointer to us.
+	 */
+	pthread_mutex_lock(&pool->mutex);
+	for (job = fr_dlist_head(&pool->queue); job; ) {
+		fr_thread_pool_job_t *next = fr_dlist_next(&pool->queue, job);
+
+		if (job->client == client) {
+			fr_dlist_remove(&pool->queue, job);
+			fr_dlist_insert_tail(&client->done, job);
+			pool->stats.depth--;
+			client->outstanding--;
+		}
+		job = next;
+	}
+	while (client->outstanding > 0) pthread_cond_wait(&pool->idle, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+
+	/*
+	 *	Nothing's left to resume, so every
+	 *	remaining job is treated as cancelled.
+	 */
+	while ((job = fr_dlist_pop_head(&client->done))) talloc_free(job);
+
+	fr_event_fd_delete(client->el, client->fd[0], FR_EVENT_FILTER_IO);
+	close(client->fd[0]);
+	close(client->fd[1]);
+
+	return 0;
+}
+
+/** Allocate a client, allowing jobs to be submitted from the thread running el
+ *
+ * @param[in] ctx	to allocate the client in.  If freed with jobs
+ *			outstanding, it blocks until running jobs complete.
+ * @param[in] pool	to submit jobs to.
+ * @param[in] el	to run completion callbacks in.
+ * @return
+ *	- A new client.
+ *	- NULL on error.
+ */
+fr_thread_pool_client_t *fr_thread_pool_client_alloc(TALLOC_CTX *ctx, fr_thread_pool_t *pool, fr_event_list_t *el)
+{
+	fr_thread_pool_client_t	*client;
+
+	client = talloc_zero(ctx, fr_thread_pool_client_t);
+	if (!client) {
+		fr_strerror_const("Out of memory");
+		return NULL;
+	}
+	client->pool = pool;
+	client->el = el;
+	fr_dlist_init(&client->done, fr_thread_pool_job_t, entry);
+
+	if (pipe(client->fd) < 0) {
+		fr_strerror_printf("Failed creating thread pool client pipe: %s", fr_syserror(errno));
+		talloc_free(client);
+		return NULL;
+	}
+
+	if ((fr_nonblock(client->fd[0]) < 0) || (fr_nonblock(client->fd[1]) < 0)) {
+		fr_strerror_printf("Failed making thread pool client pipe non-blocking: %s", fr_syserror(errno));
+	error:
+		close(client->fd[0]);
+		close(client->fd[1]);
+		talloc_free(client);
+		return NULL;
+	}
+
+	if (fr_event_fd_insert(client, el, client->fd[0],
+			       thread_pool_client_read, NULL, NULL, client) < 0) goto error;
+
+	talloc_set_destructor(client, _thread_pool_client_free);
+
+	return client;
+}
+
+/** Submit a job to a thread pool
+ *
+ * @param[in] client	to submit the job with.  done is called in the
+ *			client's event loop.
+ * @param[in] run	Called in one of the pool threads.
+ * @param[in] done	Called when run has completed.
+ * @param[in] uctx	Passed to run and done.  This is parented by the job
+ *			and freed with it, so must only be accessed by run
+ *			until done is called.
+ * @return
+ *	- A handle which can be passed to #fr_thread_pool_cancel until done is called.
+ *	- NULL if the queue is full, or on error.
+ */
+fr_thread_pool_job_t *fr_thread_pool_submit(fr_thread_pool_client_t *client,
+					    fr_thread_pool_run_t run, fr_thread_pool_done_t done, void *uctx)
+{
+	fr_thread_pool_t	*pool = client->pool;
+	fr_thread_pool_job_t	*job;
+	TALLOC_CTX		*parent = talloc_parent(uctx);
+
+	job = talloc_zero(client, fr_thread_pool_job_t);
+	if (!job) {
+		fr_strerror_const("Out of memory");
+		return NULL;
+	}
+	job->client = client;
+	job->run = run;
+	job->done = done;
+	job->uctx = uctx;
+	job->queued = fr_time();
+
+	/*
+	 *	Must be done before the job is visible to the
+	 *	pool threads, as run may allocate in uctx.
+	 */
+	talloc_steal(job, uctx);
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->stats.depth >= pool->max_queued) {
+		pool->stats.overflow++;
+		pthread_mutex_unlock(&pool->mutex);
+		talloc_steal(parent, uctx);
+		talloc_free(job);
+		fr_strerror_printf("Thread pool queue is full (%u jobs)", pool->max_queued);
+		return NULL;
+	}
+
+	fr_dlist_insert_tail(&pool->queue, job);
+	client->outstanding++;
+	pool->stats.submitted++;
+	if (++pool->stats.depth > pool->stats.depth_max) pool->stats.depth_max = pool->stats.depth;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->mutex);
+
+	return job;
+}
+
+/** Cancel a job, so its completion callback won't be called
+ *
+ * The job's uctx is freed, immediately if it hadn't started running,
+ * or otherwise once it has completed.
+ *
+ * @param[in] job	to cancel.
+ */
+void fr_thread_pool_cancel(fr_thread_pool_job_t *job)
+{
+	fr_thread_pool_client_t	*client = job->client;
+	fr_thread_pool_t	*pool = client->pool;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (job->state == THREAD_POOL_JOB_QUEUED) {
+		fr_dlist_remove(&pool->queue, job);
+		pool->stats.depth--;
+		client->outstanding--;
+		pthread_mutex_unlock(&pool->mutex);
+		talloc_free(job);
+		return;
+	}
+	job->cancelled = true;
+	pthread_mutex_unlock(&pool->mutex);
+}
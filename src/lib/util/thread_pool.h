@@ -0,0 +1,87 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Bounded pool of threads for running CPU intensive jobs off the event loop
+ *
+ * @file src/lib/util/thread_pool.h
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(thread_pool_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/build.h>
+#include <freeradius-devel/missing.h>
+#include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/talloc.h>
+#include <freeradius-devel/util/time.h>
+
+typedef struct fr_thread_pool_s fr_thread_pool_t;
+typedef struct fr_thread_pool_client_s fr_thread_pool_client_t;
+typedef struct fr_thread_pool_job_s fr_thread_pool_job_t;
+
+/** Run a job in one of the pool's threads
+ *
+ * Must not log to a request, or allocate memory in any talloc ctx
+ * shared with the submitting thread.
+ *
+ * @param[in] uctx	passed to #fr_thread_pool_submit.
+ */
+typedef void (*fr_thread_pool_run_t)(void *uctx);
+
+/** Called in the submitting thread's event loop once a job has completed
+ *
+ * @param[in] uctx	passed to #fr_thread_pool_submit.  Freed when this
+ *			callback returns, unless it's stolen.
+ * @param[in] wait	How long the job was queued for.
+ * @param[in] run	How long the job took to run.
+ */
+typedef void (*fr_thread_pool_done_t)(void *uctx, fr_time_delta_t wait, fr_time_delta_t run);
+
+/** Statistics for a thread pool
+ *
+ */
+typedef struct {
+	uint64_t		submitted;	//!< Jobs accepted.
+	uint64_t		completed;	//!< Jobs which have run.
+	uint64_t		overflow;	//!< Jobs refused because the queue was full.
+	uint32_t		depth;		//!< Jobs currently queued.
+	uint32_t		depth_max;	//!< Most jobs ever queued at once.
+	fr_time_delta_t		wait_total;	//!< Total time jobs spent queued.
+	fr_time_delta_t		wait_max;	//!< Longest time any job spent queued.
+	fr_time_delta_t		run_total;	//!< Total time spent running jobs.
+} fr_thread_pool_stats_t;
+
+fr_thread_pool_t	*fr_thread_pool_alloc(TALLOC_CTX *ctx, unsigned int threads, uint32_t max_queued);
+
+void			fr_thread_pool_stats(fr_thread_pool_stats_t *stats, fr_thread_pool_t *pool) CC_HINT(nonnull);
+
+fr_thread_pool_client_t	*fr_thread_pool_client_alloc(TALLOC_CTX *ctx, fr_thread_pool_t *pool, fr_event_list_t *el)
+			CC_HINT(nonnull(2,3));
+
+fr_thread_pool_job_t	*fr_thread_pool_submit(fr_thread_pool_client_t *client,
+					       fr_thread_pool_run_t run, fr_thread_pool_done_t done, void *uctx)
+			CC_HINT(nonnull);
+
+void			fr_thread_pool_cancel(fr_thread_pool_job_t *job) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,426 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Hierarchical timer wheels
+ *
+ * @file src/lib/util/timer_wheel.c
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/util/timer_wheel.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/debug.h>
+
+/*
+ *	Time is split into ticks of "resolution" length.  An element
+ *	expires on the first tick at or after its expiry time, so
+ *	elements are never returned early, but may be returned up to
+ *	one tick late.
+ *
+ *	The wheel has TW_LEVELS levels of TW_SLOTS slots.  An element
+ *	is placed in the level given by the highest bit in which its
+ *	tick differs from the current tick.  Each time the lower
+ *	levels wrap around, the current slot of the next level up is
+ *	"cascaded", and its elements are re-inserted into the lower
+ *	levels.  Elements beyond the top level go into an overflow
+ *	list, which is cascaded when the top level wraps.
+ *
+ *	Insert and extract are O(1).  Each element is cascaded at most
+ *	once per level.
+ */
+#define TW_BITS		(8)
+#define TW_SLOTS	(1 << TW_BITS)
+#define TW_MASK		(TW_SLOTS - 1)
+#define TW_LEVELS	(4)
+
+#define LIST_EXPIRED	(0)
+#define LIST_OVERFLOW	(1 + (TW_LEVELS * TW_SLOTS))
+#define LIST_SLOT(_level, _slot) (1 + ((_level) * TW_SLOTS) + (_slot))
+#define NUM_LISTS	(LIST_OVERFLOW + 1)
+
+#define LEVEL_SHIFT(_level) (TW_BITS * (_level))
+
+struct fr_timer_wheel_s {
+	fr_time_delta_t		resolution;		//!< Length of a tick.
+	uint64_t		tick;			//!< Next tick to process.
+
+	size_t			offset;			//!< Offset of the #fr_timer_wheel_entry_t in elements.
+	char const		*type;			//!< Type of elements.
+
+	uint32_t		num_elements;		//!< Number of elements in the wheel.
+	uint32_t		level_num[TW_LEVELS + 1]; //!< Number of elements in each level, and overflow.
+
+	fr_dlist_head_t		lists[NUM_LISTS];	//!< Expired list, slots, and overflow list.
+};
+
+static inline CC_HINT(always_inline) CC_HINT(nonnull)
+fr_timer_wheel_entry_t *entry_get(fr_timer_wheel_t const *tw, void *data)
+{
+	return (fr_timer_wheel_entry_t *)(((uint8_t *)data) + tw->offset);
+}
+
+/** Return the level a list belongs to, or TW_LEVELS for the overflow list
+ *
+ */
+static inline CC_HINT(always_inline) unsigned int list_level(unsigned int list)
+{
+	if (list == LIST_OVERFLOW) return TW_LEVELS;
+
+	return (list - 1) / TW_SLOTS;
+}
+
+/** Return the first tick at or after tick, on which the slots of a level are cascaded
+ *
+ */
+static inline CC_HINT(always_inline) uint64_t level_boundary(uint64_t tick, unsigned int level)
+{
+	uint64_t mask = (((uint64_t) 1) << LEVEL_SHIFT(level)) - 1;
+
+	return (tick + mask) & ~mask;
+}
+
+fr_timer_wheel_t *_fr_timer_wheel_alloc(TALLOC_CTX *ctx, fr_time_delta_t resolution, fr_time_t now,
+					char const *type, size_t offset)
+{
+	fr_timer_wheel_t	*tw;
+	unsigned int		i;
+
+	if (resolution <= 0) {
+		fr_strerror_const("Timer wheel resolution must be greater than zero");
+		return NULL;
+	}
+
+	tw = talloc_zero(ctx, fr_timer_wheel_t);
+	if (!tw) return NULL;
+
+	tw->resolution = resolution;
+	tw->tick = (now > 0) ? ((uint64_t) now / resolution) : 0;
+	tw->offset = offset;
+	tw->type = type;
+
+	for (i = 0; i < NUM_LISTS; i++) {
+		_fr_dlist_init(&tw->lists[i], offset + offsetof(fr_timer_wheel_entry_t, entry), type);
+	}
+
+	return tw;
+}
+
+/** Link an element into the list for its tick
+ *
+ */
+static inline CC_HINT(nonnull) void wheel_link(fr_timer_wheel_t *tw, void *data, fr_timer_wheel_entry_t *e)
+{
+	uint64_t	diff;
+	unsigned int	level;
+
+	if (e->tick < tw->tick) {
+		e->list = LIST_EXPIRED;
+		fr_dlist_insert_tail(&tw->lists[LIST_EXPIRED], data);
+		return;
+	}
+
+	diff = e->tick ^ tw->tick;
+	for (level = 0; level < TW_LEVELS; level++) {
+		if (diff < (((uint64_t) 1) << LEVEL_SHIFT(level + 1))) break;
+	}
+
+	if (level == TW_LEVELS) {
+		e->list = LIST_OVERFLOW;
+	} else {
+		e->list = LIST_SLOT(level, (e->tick >> LEVEL_SHIFT(level)) & TW_MASK);
+	}
+	tw->level_num[level]++;
+
+	fr_dlist_insert_tail(&tw->lists[e->list], data);
+}
+
+/** Re-insert all of the elements in a list
+ *
+ */
+static void wheel_cascade(fr_timer_wheel_t *tw, unsigned int list)
+{
+	fr_dlist_head_t	*head = &tw->lists[list];
+	void		*data;
+
+	tw->level_num[list_level(list)] -= fr_dlist_num_elements(head);
+
+	/*
+	 *	Elements may be re-inserted into the list we're
+	 *	emptying, so detach it first.
+	 */
+	if (list == LIST_OVERFLOW) {
+		fr_dlist_head_t	tmp;
+
+		_fr_dlist_init(&tmp, head->offset, head->type);
+		fr_dlist_move(&tmp, head);
+
+		while ((data = fr_dlist_pop_head(&tmp))) wheel_link(tw, data, entry_get(tw, data));
+		return;
+	}
+
+	while ((data = fr_dlist_pop_head(head))) wheel_link(tw, data, entry_get(tw, data));
+}
+
+/** Process all ticks up to and including the one for "now"
+ *
+ * Elements which have expired are moved to the expired list.
+ */
+static void wheel_advance(fr_timer_wheel_t *tw, fr_time_t now)
+{
+	uint64_t	now_tick;
+	unsigned int	level;
+
+	if (now < 0) return;
+	now_tick = (uint64_t) now / tw->resolution;
+
+	while (tw->tick <= now_tick) {
+		fr_dlist_head_t	*slot;
+		void		*data;
+
+		/*
+		 *	Nothing in level 0, skip forward to the
+		 *	next tick on which anything can happen.
+		 */
+		if (!tw->level_num[0]) {
+			uint64_t next;
+
+			for (level = 1; (level <= TW_LEVELS) && !tw->level_num[level]; level++);
+
+			next = (level > TW_LEVELS) ? (now_tick + 1) : level_boundary(tw->tick, level);
+			if (next > tw->tick) {
+				tw->tick = (next < (now_tick + 1)) ? next : (now_tick + 1);
+				continue;
+			}
+		}
+
+		/*
+		 *	The lower levels have wrapped, cascade the
+		 *	current slots of the higher levels, from the
+		 *	top down.
+		 */
+		if ((tw->tick & TW_MASK) == 0) {
+			for (level = 1;
+			     (level < TW_LEVELS) && !((tw->tick >> LEVEL_SHIFT(level)) & TW_MASK);
+			     level++);
+
+			for (/* nothing */; level > 0; level--) {
+				if (level == TW_LEVELS) {
+					wheel_cascade(tw, LIST_OVERFLOW);
+					continue;
+				}
+				wheel_cascade(tw, LIST_SLOT(level, (tw->tick >> LEVEL_SHIFT(level)) & TW_MASK));
+			}
+		}
+
+		slot = &tw->lists[LIST_SLOT(0, tw->tick & TW_MASK)];
+		tw->level_num[0] -= fr_dlist_num_elements(slot);
+		while ((data = fr_dlist_pop_head(slot))) {
+			entry_get(tw, data)->list = LIST_EXPIRED;
+			fr_dlist_insert_tail(&tw->lists[LIST_EXPIRED], data);
+		}
+
+		tw->tick++;
+	}
+}
+
+/** Insert an element into the timer wheel
+ *
+ * @param[in] tw	to insert the element into.
+ * @param[in] data	to insert.
+ * @param[in] when	the element expires.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the element is already in a timer wheel.
+ */
+int fr_timer_wheel_insert(fr_timer_wheel_t *tw, void *data, fr_time_t when)
+{
+	fr_timer_wheel_entry_t *e = entry_get(tw, data);
+
+#ifndef TALLOC_GET_TYPE_ABORT_NOOP
+	if (tw->type) (void)_talloc_get_type_abort(data, tw->type, __location__);
+#endif
+
+	if (unlikely(fr_dlist_entry_in_list(&e->entry))) {
+		fr_strerror_const("Element is already in the timer wheel");
+		return -1;
+	}
+
+	e->tick = (when > 0) ? (((uint64_t) when + tw->resolution - 1) / tw->resolution) : 0;
+	wheel_link(tw, data, e);
+	tw->num_elements++;
+
+	return 0;
+}
+
+/** Remove an element from the timer wheel
+ *
+ * @param[in] tw	to remove the element from.
+ * @param[in] data	to remove.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the element is not in the timer wheel.
+ */
+int fr_timer_wheel_extract(fr_timer_wheel_t *tw, void *data)
+{
+	fr_timer_wheel_entry_t *e = entry_get(tw, data);
+
+	if (unlikely(!fr_dlist_entry_in_list(&e->entry) || (e->list >= NUM_LISTS))) {
+		fr_strerror_const("Element is not in the timer wheel");
+		return -1;
+	}
+
+	if (e->list != LIST_EXPIRED) tw->level_num[list_level(e->list)]--;
+	(void) fr_dlist_remove(&tw->lists[e->list], data);
+	tw->num_elements--;
+
+	return 0;
+}
+
+/** Return an element which has expired, without removing it
+ *
+ * @param[in] tw	to peek at.
+ * @param[in] now	the current time.
+ * @return
+ *	- An element which expired at or before "now".
+ *	- NULL if no elements have expired.
+ */
+void *fr_timer_wheel_peek(fr_timer_wheel_t *tw, fr_time_t now)
+{
+	wheel_advance(tw, now);
+
+	return fr_dlist_head(&tw->lists[LIST_EXPIRED]);
+}
+
+/** Remove and return an element which has expired
+ *
+ * @param[in] tw	to pop an element from.
+ * @param[in] now	the current time.
+ * @return
+ *	- An element which expired at or before "now".
+ *	- NULL if no elements have expired.
+ */
+void *fr_timer_wheel_pop(fr_timer_wheel_t *tw, fr_time_t now)
+{
+	void *data;
+
+	wheel_advance(tw, now);
+
+	data = fr_dlist_pop_head(&tw->lists[LIST_EXPIRED]);
+	if (data) tw->num_elements--;
+
+	return data;
+}
+
+/** Return when the next element may expire
+ *
+ * The time returned may be earlier than the expiry time of
+ * any element, but it is never later.  It is the time at
+ * which the caller should next call #fr_timer_wheel_pop.
+ *
+ * @param[in] tw	to check.
+ * @param[out] when	the next element may expire.
+ * @return
+ *	- true if there are elements in the wheel.
+ *	- false if the wheel is empty.
+ */
+bool fr_timer_wheel_next(fr_timer_wheel_t *tw, fr_time_t *when)
+{
+	void		*data;
+	unsigned int	level, slot;
+
+	if (!tw->num_elements) return false;
+
+	data = fr_dlist_head(&tw->lists[LIST_EXPIRED]);
+	if (data) {
+		*when = entry_get(tw, data)->tick * tw->resolution;
+		return true;
+	}
+
+	/*
+	 *	Elements in level 0 are all in the current or
+	 *	later slots.
+	 */
+	if (tw->level_num[0]) {
+		for (slot = tw->tick & TW_MASK; slot < TW_SLOTS; slot++) {
+			if (fr_dlist_empty(&tw->lists[LIST_SLOT(0, slot)])) continue;
+
+			*when = ((tw->tick & ~((uint64_t) TW_MASK)) + slot) * tw->resolution;
+			return true;
+		}
+	}
+
+	/*
+	 *	Otherwise wake up when the lowest level which has
+	 *	elements is next cascaded.
+	 */
+	for (level = 1; (level <= TW_LEVELS) && !tw->level_num[level]; level++);
+	if (!fr_cond_assert(level <= TW_LEVELS)) return false;
+
+	*when = level_boundary(tw->tick, level) * tw->resolution;
+	return true;
+}
+
+/** Return the number of elements in the timer wheel
+ *
+ */
+uint32_t fr_timer_wheel_num_elements(fr_timer_wheel_t const *tw)
+{
+	return tw->num_elements;
+}
+
+static inline CC_HINT(always_inline) void *iter_seek(fr_timer_wheel_t *tw, fr_timer_wheel_iter_t *iter)
+{
+	while (!iter->item && (++iter->list < NUM_LISTS)) iter->item = fr_dlist_head(&tw->lists[iter->list]);
+
+	return iter->item;
+}
+
+/** Iterate over the elements of a timer wheel
+ *
+ * The elements are not returned in any particular order.
+ *
+ * @param[in] tw	to iterate over.
+ * @param[in] iter	to initialise.
+ * @return
+ *	- The first element.
+ *	- NULL if the wheel is empty.
+ */
+void *fr_timer_wheel_iter_init(fr_timer_wheel_t *tw, fr_timer_wheel_iter_t *iter)
+{
+	iter->list = LIST_EXPIRED;
+	iter->item = fr_dlist_head(&tw->lists[LIST_EXPIRED]);
+
+	return iter_seek(tw, iter);
+}
+
+/** Get the next element of a timer wheel
+ *
+ * @param[in] tw	to iterate over.
+ * @param[in] iter	previously initialised with #fr_timer_wheel_iter_init
+ * @return
+ *	- The next element.
+ *	- NULL if there are no more elements.
+ */
+void *fr_timer_wheel_iter_next(fr_timer_wheel_t *tw, fr_timer_wheel_iter_t *iter)
+{
+	if (!iter->item) return NULL;
+
+	iter->item = fr_dlist_next(&tw->lists[iter->list], iter->item);
+
+	return iter_seek(tw, iter);
+}
@@ -0,0 +1,183 @@
+#include <freeradius-devel/util/acutest.h>
+
+#include "timer_wheel.c"
+
+typedef struct {
+	fr_time_t		when;
+	bool			popped;
+	fr_timer_wheel_entry_t	wheel;		/* for the timer wheel */
+} wheel_thing;
+
+#define WHEEL_TEST_SIZE (4096)
+
+static wheel_thing *wheel_things_alloc(fr_time_t start, fr_time_delta_t range)
+{
+	wheel_thing	*array;
+	int		i;
+
+	static bool	done_init = false;
+
+	if (!done_init) {
+		srand((unsigned int)time(NULL));
+		done_init = true;
+	}
+
+	array = calloc(WHEEL_TEST_SIZE, sizeof(wheel_thing));
+	for (i = 0; i < WHEEL_TEST_SIZE; i++) {
+		array[i].when = start + (((((fr_time_delta_t) rand()) << 31) | rand()) % range);
+	}
+
+	return array;
+}
+
+/*
+ *	Step through time, checking that elements are
+ *	never returned early, and never more than one
+ *	tick late.
+ */
+static void wheel_test_expiry(fr_time_delta_t resolution, fr_time_delta_t range)
+{
+	fr_timer_wheel_t	*tw;
+	wheel_thing		*array, *t;
+	fr_timer_wheel_iter_t	iter;
+	fr_time_t		now = 1000000;
+	int			i, popped = 0;
+
+	tw = fr_timer_wheel_alloc(NULL, resolution, now, wheel_thing, wheel);
+	TEST_CHECK(tw != NULL);
+
+	array = wheel_things_alloc(now, range);
+
+	TEST_CASE("insertions");
+	for (i = 0; i < WHEEL_TEST_SIZE; i++) {
+		TEST_CHECK(fr_timer_wheel_insert(tw, &array[i], array[i].when) == 0);
+	}
+	TEST_CHECK(fr_timer_wheel_num_elements(tw) == WHEEL_TEST_SIZE);
+
+	TEST_CHECK(fr_timer_wheel_insert(tw, &array[0], array[0].when) < 0);
+	TEST_MSG("element inserted twice");
+
+	TEST_CASE("expiry");
+	while (fr_timer_wheel_num_elements(tw) > 0) {
+		now += rand() % (range / 64 + 1);
+
+		while ((t = fr_timer_wheel_pop(tw, now)) != NULL) {
+			TEST_CHECK(t->when <= now);
+			TEST_MSG("element popped early: when %" PRId64 " now %" PRId64, t->when, now);
+			TEST_CHECK(!t->popped);
+			t->popped = true;
+			popped++;
+		}
+
+		for (t = fr_timer_wheel_iter_init(tw, &iter);
+		     t;
+		     t = fr_timer_wheel_iter_next(tw, &iter)) {
+			TEST_CHECK(t->when > (now - resolution));
+			TEST_MSG("element not popped: when %" PRId64 " now %" PRId64, t->when, now);
+		}
+	}
+
+	TEST_CHECK(popped == WHEEL_TEST_SIZE);
+	TEST_MSG("popped %i elements, expected %i", popped, WHEEL_TEST_SIZE);
+
+	talloc_free(tw);
+	free(array);
+}
+
+static void wheel_test_expiry_short(void)
+{
+	wheel_test_expiry(1000, 1000 * 200);
+}
+
+static void wheel_test_expiry_levels(void)
+{
+	wheel_test_expiry(1, ((fr_time_delta_t) 1) << 30);
+}
+
+static void wheel_test_expiry_overflow(void)
+{
+	wheel_test_expiry(1, ((fr_time_delta_t) 1) << 40);
+}
+
+/*
+ *	Check that removed elements are never returned.
+ */
+static void wheel_test_extract(void)
+{
+	fr_timer_wheel_t	*tw;
+	wheel_thing		*array, *t;
+	fr_time_t		now = 1000000;
+	int			i, popped = 0;
+
+	tw = fr_timer_wheel_alloc(NULL, 1000, now, wheel_thing, wheel);
+	TEST_CHECK(tw != NULL);
+
+	array = wheel_things_alloc(now, ((fr_time_delta_t) 1) << 36);
+
+	for (i = 0; i < WHEEL_TEST_SIZE; i++) {
+		TEST_CHECK(fr_timer_wheel_insert(tw, &array[i], array[i].when) == 0);
+	}
+
+	TEST_CASE("deletions");
+	for (i = 0; i < WHEEL_TEST_SIZE; i += 2) {
+		TEST_CHECK(fr_timer_wheel_extract(tw, &array[i]) == 0);
+		TEST_MSG("element %i removal failed", i);
+	}
+	TEST_CHECK(fr_timer_wheel_extract(tw, &array[0]) < 0);
+	TEST_MSG("element removed twice");
+
+	TEST_CHECK(fr_timer_wheel_num_elements(tw) == WHEEL_TEST_SIZE / 2);
+
+	/*
+	 *	Follow the wheel's idea of when to wake up.
+	 */
+	TEST_CASE("next");
+	while (fr_timer_wheel_next(tw, &now)) {
+		while ((t = fr_timer_wheel_pop(tw, now)) != NULL) {
+			TEST_CHECK(((t - array) & 0x01) != 0);
+			TEST_MSG("removed element %i was popped", (int)(t - array));
+			TEST_CHECK(t->when <= now);
+			popped++;
+		}
+	}
+
+	TEST_CHECK(popped == WHEEL_TEST_SIZE / 2);
+	TEST_MSG("popped %i elements, expected %i", popped, WHEEL_TEST_SIZE / 2);
+
+	talloc_free(tw);
+	free(array);
+}
+
+/*
+ *	Elements in the past are returned immediately.
+ */
+static void wheel_test_past(void)
+{
+	fr_timer_wheel_t	*tw;
+	wheel_thing		thing = { .when = 10 };
+	fr_time_t		when;
+
+	tw = fr_timer_wheel_alloc(NULL, 1000, 1000000, wheel_thing, wheel);
+	TEST_CHECK(tw != NULL);
+
+	TEST_CHECK(fr_timer_wheel_insert(tw, &thing, thing.when) == 0);
+	TEST_CHECK(fr_timer_wheel_next(tw, &when));
+	TEST_CHECK(when <= 1000000);
+	TEST_CHECK(fr_timer_wheel_peek(tw, 1000000) == &thing);
+	TEST_CHECK(fr_timer_wheel_pop(tw, 1000000) == &thing);
+	TEST_CHECK(!fr_timer_wheel_next(tw, &when));
+
+	talloc_free(tw);
+}
+
+TEST_LIST = {
+	/*
+	 *	Basic tests
+	 */
+	{ "wheel_test_expiry_short",	wheel_test_expiry_short		},
+	{ "wheel_test_expiry_levels",	wheel_test_expiry_levels	},
+	{ "wheel_test_expiry_overflow",	wheel_test_expiry_overflow	},
+	{ "wheel_test_extract",		wheel_test_extract		},
+	{ "wheel_test_past",		wheel_test_past			},
+	{ NULL }
+};
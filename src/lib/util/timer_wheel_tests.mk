@@ -0,0 +1,7 @@
+TARGET		:= timer_wheel_tests
+
+SOURCES		:= timer_wheel_tests.c
+
+TGT_LDLIBS	:= $(LIBS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(GPERFTOOLS_LDFLAGS)
+TGT_PREREQS	:= libfreeradius-util.a
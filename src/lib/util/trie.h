@@ -84,6 +84,15 @@ bool		fr_trie_delete(fr_trie_t *ft, void const *data) CC_HINT(nonnull);
 
 uint32_t	fr_trie_num_elements(fr_trie_t *ft) CC_HINT(nonnull); /* always returns 0 */
 
+/*
+ *	Read-only tries, for fast lookups of fixed length keys.
+ */
+typedef struct fr_trie_frozen_s fr_trie_frozen_t;
+
+fr_trie_frozen_t *fr_trie_freeze(TALLOC_CTX *ctx, fr_trie_t const *ft, size_t keylen) CC_HINT(nonnull(2));
+
+void		*fr_trie_frozen_lookup_by_key(fr_trie_frozen_t const *ff, void const *key, size_t keylen) CC_HINT(nonnull);
+
 #ifdef __cplusplus
 }
 #endif
@@ -28,6 +28,12 @@ RCSID("$Id$")
 #include <freeradius-devel/util/syserror.h>
 #include <freeradius-devel/util/udp.h>
 
+#ifdef HAVE_LINUX_IO_URING_H
+#  include <linux/io_uring.h>
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#endif
+
 #define FR_DEBUG_STRERROR_PRINTF if (fr_debug_lvl) fr_strerror_printf
 
 /** Send a packet via a UDP socket.
@@ -213,3 +219,895 @@ done:
 
 	return slen;
 }
+
+struct udp_recv_batch_s {
+	int			sockfd;		//!< Socket the local address was retrieved for.
+	struct sockaddr_storage	local;		//!< Local address of the socket, from getsockname().
+	socklen_t		local_len;	//!< Length of the local address.
+
+	unsigned int		num;		//!< Maximum number of datagrams to read in one call.
+	unsigned int		count;		//!< How many datagrams the last read returned.
+	unsigned int		next;		//!< Next datagram to return to the caller.
+	size_t			packet_size;	//!< Maximum size of a datagram.
+	fr_time_t		when;		//!< When the last read completed.
+	unsigned int		truncated;	//!< Datagrams discarded because they didn't fit.
+
+	struct mmsghdr		*mmsgvec;	//!< Message headers passed to recvmmsg().
+	struct iovec		*iov;		//!< One per message, pointing into buffer.
+	struct sockaddr_storage	*src;		//!< Source address of each message.
+	uint8_t			*cbuf;		//!< Auxiliary data for each message.
+	uint8_t			*buffer;	//!< Datagram data for all messages.
+
+#ifdef HAVE_LINUX_IO_URING_H
+	bool			use_uring;	//!< Read packets with io_uring.
+	struct udp_uring_s	*uring;		//!< io_uring state, created by the reading thread.
+#endif
+};
+
+/** Point the message headers at the batch's own buffers
+ *
+ */
+static void udp_recv_batch_init_headers(udp_recv_batch_t *batch)
+{
+	unsigned int i;
+
+	for (i = 0; i < batch->num; i++) {
+		batch->iov[i].iov_base = batch->buffer + (i * batch->packet_size);
+		batch->iov[i].iov_len = batch->packet_size;
+
+		batch->mmsgvec[i].msg_hdr.msg_iov = &batch->iov[i];
+		batch->mmsgvec[i].msg_hdr.msg_iovlen = 1;
+		batch->mmsgvec[i].msg_hdr.msg_name = &batch->src[i];
+		batch->mmsgvec[i].msg_hdr.msg_control = batch->cbuf + (i * UDPFROMTO_CMSG_SIZE);
+	}
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+/*
+ *	Reading packets with io_uring.
+ *
+ *	A single multishot recvmsg() request is submitted for the
+ *	socket.  The kernel writes each datagram into a buffer from
+ *	a ring of buffers we've registered with it, and posts a
+ *	completion.  The completions are in memory shared with the
+ *	kernel, so reaping them doesn't need a system call.
+ *
+ *	The ring is created with IORING_SETUP_DEFER_TASKRUN, so the
+ *	kernel only reads from the socket when we ask it to reap
+ *	completions.  Until then, the packets stay in the socket,
+ *	which stays readable.  The event loop can therefore keep
+ *	watching the socket as it does now, and each readable event
+ *	costs one io_uring_enter() for up to a whole batch of packets.
+ */
+typedef struct udp_uring_s {
+	int			fd;		//!< io_uring file descriptor.
+	int			sockfd;		//!< Socket the multishot request reads from.
+	bool			armed;		//!< Whether the multishot request is active.
+	uint32_t		to_submit;	//!< Number of SQEs waiting to be submitted.
+
+	void			*sq_ring;	//!< Submission queue ring.
+	size_t			sq_ring_size;
+	void			*cq_ring;	//!< Completion queue ring.  May be the same as sq_ring.
+	size_t			cq_ring_size;
+	struct io_uring_sqe	*sqes;		//!< Submission queue entries.
+	size_t			sqes_size;
+
+	uint32_t		*sq_tail;
+	uint32_t		*sq_mask;
+	uint32_t		*sq_array;
+	uint32_t		*cq_head;
+	uint32_t		*cq_tail;
+	uint32_t		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	struct io_uring_buf_ring *br;		//!< Ring of buffers the kernel reads packets into.
+	size_t			br_size;
+	uint16_t		br_tail;	//!< Our copy of the buffer ring tail.
+	uint16_t		br_mask;
+
+	uint8_t			*bufs;		//!< Memory for the packet buffers.
+	size_t			buf_size;	//!< Size of one packet buffer.
+
+	uint16_t		*bids;		//!< Buffers handed out in the current batch.
+	unsigned int		num_bids;
+
+	struct msghdr		msg;		//!< Tells the kernel how to lay out each buffer.
+} udp_uring_t;
+
+static int _udp_uring_free(udp_uring_t *ur)
+{
+	if (ur->fd >= 0) close(ur->fd);
+	if (ur->sqes) munmap(ur->sqes, ur->sqes_size);
+	if (ur->cq_ring && (ur->cq_ring != ur->sq_ring)) munmap(ur->cq_ring, ur->cq_ring_size);
+	if (ur->sq_ring) munmap(ur->sq_ring, ur->sq_ring_size);
+	if (ur->br) munmap(ur->br, ur->br_size);
+
+	return 0;
+}
+
+static void *udp_uring_mmap(int fd, size_t size, off_t offset)
+{
+	void *ptr;
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+	if (ptr == MAP_FAILED) return NULL;
+
+	return ptr;
+}
+
+/** Give a packet buffer back to the kernel
+ *
+ */
+static inline CC_HINT(always_inline) void udp_uring_buf_add(udp_uring_t *ur, uint16_t bid)
+{
+	struct io_uring_buf *buf = &ur->br->bufs[ur->br_tail & ur->br_mask];
+
+	buf->addr = (uintptr_t)(ur->bufs + (bid * ur->buf_size));
+	buf->len = ur->buf_size;
+	buf->bid = bid;
+	ur->br_tail++;
+}
+
+/** Create an io_uring, and register packet buffers with it
+ *
+ * With IORING_SETUP_SINGLE_ISSUER, only the thread which creates the ring
+ * may use it.
+ */
+static udp_uring_t *udp_uring_alloc(TALLOC_CTX *ctx, unsigned int num, size_t packet_size)
+{
+	udp_uring_t		*ur;
+	struct io_uring_params	p;
+	struct io_uring_buf_reg	reg;
+	unsigned int		nbufs, i;
+
+	/*
+	 *	Enough buffers for a full batch which is being
+	 *	processed, and a full batch which the kernel is
+	 *	reading into.
+	 */
+	for (nbufs = 1; (nbufs < (num * 2)) && (nbufs < 32768); nbufs <<= 1);
+
+	ur = talloc_zero(ctx, udp_uring_t);
+	if (!ur) {
+	oom:
+		fr_strerror_const("Out of memory");
+		talloc_free(ur);
+		return NULL;
+	}
+	ur->fd = -1;
+	ur->sockfd = -1;
+	talloc_set_destructor(ur, _udp_uring_free);
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	p.cq_entries = nbufs * 2;
+
+	ur->fd = syscall(__NR_io_uring_setup, 2, &p);
+	if (ur->fd < 0) {
+		fr_strerror_printf("Failed creating io_uring: %s", fr_syserror(errno));
+	error:
+		talloc_free(ur);
+		return NULL;
+	}
+
+	ur->sq_ring_size = p.sq_off.array + (p.sq_entries * sizeof(uint32_t));
+	ur->cq_ring_size = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->cq_ring_size > ur->sq_ring_size) ur->sq_ring_size = ur->cq_ring_size;
+		ur->cq_ring_size = ur->sq_ring_size;
+	}
+
+	ur->sq_ring = udp_uring_mmap(ur->fd, ur->sq_ring_size, IORING_OFF_SQ_RING);
+	if (!ur->sq_ring) {
+	mmap_error:
+		fr_strerror_printf("Failed mapping io_uring: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ur->cq_ring = ur->sq_ring;
+	} else {
+		ur->cq_ring = udp_uring_mmap(ur->fd, ur->cq_ring_size, IORING_OFF_CQ_RING);
+		if (!ur->cq_ring) goto mmap_error;
+	}
+
+	ur->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = udp_uring_mmap(ur->fd, ur->sqes_size, IORING_OFF_SQES);
+	if (!ur->sqes) goto mmap_error;
+
+	ur->sq_tail = (uint32_t *)((uint8_t *)ur->sq_ring + p.sq_off.tail);
+	ur->sq_mask = (uint32_t *)((uint8_t *)ur->sq_ring + p.sq_off.ring_mask);
+	ur->sq_array = (uint32_t *)((uint8_t *)ur->sq_ring + p.sq_off.array);
+	ur->cq_head = (uint32_t *)((uint8_t *)ur->cq_ring + p.cq_off.head);
+	ur->cq_tail = (uint32_t *)((uint8_t *)ur->cq_ring + p.cq_off.tail);
+	ur->cq_mask = (uint32_t *)((uint8_t *)ur->cq_ring + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)((uint8_t *)ur->cq_ring + p.cq_off.cqes);
+
+	/*
+	 *	Each buffer holds the recvmsg header, the source
+	 *	address, the control messages, and the packet.
+	 */
+	ur->msg.msg_namelen = sizeof(struct sockaddr_storage);
+	ur->msg.msg_controllen = UDPFROMTO_CMSG_SIZE;
+	ur->buf_size = sizeof(struct io_uring_recvmsg_out) + ur->msg.msg_namelen + ur->msg.msg_controllen + packet_size;
+
+	ur->bufs = talloc_array(ur, uint8_t, nbufs * ur->buf_size);
+	ur->bids = talloc_array(ur, uint16_t, nbufs);
+	if (!ur->bufs || !ur->bids) goto oom;
+
+	/*
+	 *	The buffer ring must be page aligned.
+	 */
+	ur->br_size = nbufs * sizeof(struct io_uring_buf);
+	ur->br = mmap(NULL, ur->br_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (ur->br == MAP_FAILED) {
+		ur->br = NULL;
+		goto mmap_error;
+	}
+	ur->br_mask = nbufs - 1;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)ur->br;
+	reg.ring_entries = nbufs;
+	reg.bgid = 0;
+
+	if (syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		fr_strerror_printf("Failed registering io_uring buffers: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	for (i = 0; i < nbufs; i++) udp_uring_buf_add(ur, i);
+	__atomic_store_n(&ur->br->tail, ur->br_tail, __ATOMIC_RELEASE);
+
+	return ur;
+}
+
+/** Queue a multishot recvmsg() request for a socket
+ *
+ */
+static void udp_uring_arm(udp_uring_t *ur, int sockfd)
+{
+	uint32_t		tail = *ur->sq_tail;
+	uint32_t		idx = tail & *ur->sq_mask;
+	struct io_uring_sqe	*sqe = &ur->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = sockfd;
+	sqe->addr = (uintptr_t)&ur->msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+
+	ur->sq_array[idx] = idx;
+	__atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	ur->sockfd = sockfd;
+	ur->to_submit++;
+	ur->armed = true;
+}
+
+/** Whether there are completions which haven't been reaped
+ *
+ */
+static inline CC_HINT(always_inline) bool udp_uring_pending(udp_uring_t const *ur)
+{
+	return (*ur->cq_head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE));
+}
+
+/** Move completed reads into the batch
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the kernel can't do multishot reads for us.
+ */
+static int udp_uring_reap(udp_recv_batch_t *batch, udp_uring_t *ur)
+{
+	uint32_t	head = *ur->cq_head;
+	uint32_t	tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+	int		ret = 0;
+
+	while ((head != tail) && (batch->count < batch->num)) {
+		struct io_uring_cqe		*cqe = &ur->cqes[head & *ur->cq_mask];
+		struct io_uring_recvmsg_out	*out;
+		uint8_t				*buf, *payload;
+		struct msghdr			*msgh;
+		unsigned int			i;
+		uint16_t			bid;
+
+		head++;
+
+		if (!(cqe->flags & IORING_CQE_F_MORE)) ur->armed = false;
+
+		/*
+		 *	Running out of buffers just stops the
+		 *	multishot request.  Anything else means
+		 *	it's not going to work.
+		 */
+		if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+			if ((cqe->res < 0) && (cqe->res != -ENOBUFS)) {
+				fr_strerror_printf("io_uring read failed: %s", fr_syserror(-cqe->res));
+				ret = -1;
+			}
+			continue;
+		}
+
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		ur->bids[ur->num_bids++] = bid;
+
+		buf = ur->bufs + (bid * ur->buf_size);
+		if ((cqe->res < 0) ||
+		    ((size_t)cqe->res < (sizeof(*out) + ur->msg.msg_namelen + ur->msg.msg_controllen))) continue;
+
+		out = (struct io_uring_recvmsg_out *)buf;
+		payload = buf + sizeof(*out) + ur->msg.msg_namelen + ur->msg.msg_controllen;
+
+		i = batch->count++;
+		msgh = &batch->mmsgvec[i].msg_hdr;
+
+		msgh->msg_namelen = (out->namelen < ur->msg.msg_namelen) ? out->namelen : ur->msg.msg_namelen;
+		memcpy(&batch->src[i], buf + sizeof(*out), msgh->msg_namelen);
+
+		msgh->msg_control = buf + sizeof(*out) + ur->msg.msg_namelen;
+		msgh->msg_controllen = (out->controllen < ur->msg.msg_controllen) ? out->controllen : ur->msg.msg_controllen;
+		msgh->msg_flags = out->flags;
+
+		batch->iov[i].iov_base = payload;
+		batch->mmsgvec[i].msg_len = cqe->res - (payload - buf);
+	}
+
+	__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+
+	return ret;
+}
+
+/** Read a batch of packets using io_uring
+ *
+ * @return
+ *	- > 0 the number of packets read.
+ *	- 0 if no packets were available.
+ *	- < 0 if io_uring can't be used.
+ */
+static int udp_recv_batch_uring(udp_recv_batch_t *batch, int sockfd)
+{
+	udp_uring_t	*ur = batch->uring;
+	unsigned int	i;
+	int		tries;
+
+	if (!ur) {
+		ur = batch->uring = udp_uring_alloc(batch, batch->num, batch->packet_size);
+		if (!ur) return -1;
+	}
+
+	/*
+	 *	The request can't be moved to a different socket.
+	 */
+	if ((ur->sockfd >= 0) && (ur->sockfd != sockfd)) {
+		fr_strerror_const("io_uring socket changed");
+		return -1;
+	}
+
+	/*
+	 *	The caller is done with the previous batch, so the
+	 *	kernel can have its buffers back.
+	 */
+	if (ur->num_bids) {
+		for (i = 0; i < ur->num_bids; i++) udp_uring_buf_add(ur, ur->bids[i]);
+		__atomic_store_n(&ur->br->tail, ur->br_tail, __ATOMIC_RELEASE);
+		ur->num_bids = 0;
+	}
+
+	/*
+	 *	Try twice, as the multishot request may have stopped
+	 *	when it ran out of buffers, and need restarting.
+	 */
+	for (tries = 0; tries < 2; tries++) {
+		if (!udp_uring_pending(ur)) {
+			if (!ur->armed) udp_uring_arm(ur, sockfd);
+
+			if (syscall(__NR_io_uring_enter, ur->fd, ur->to_submit, 0, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+				if ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY)) return 0;
+
+				fr_strerror_printf("Failed reading from io_uring: %s", fr_syserror(errno));
+				return -1;
+			}
+			ur->to_submit = 0;
+		}
+
+		if (udp_uring_reap(batch, ur) < 0) return -1;
+		if (batch->count || ur->armed) break;
+	}
+
+	batch->when = fr_time();
+
+	return batch->count;
+}
+#endif
+
+/** Allocate a structure for batched reads of UDP packets
+ *
+ * @param[in] ctx		to allocate the batch in.
+ * @param[in] num		maximum number of datagrams to read in one system call.
+ * @param[in] packet_size	maximum size of a datagram.  Larger datagrams are discarded.
+ * @return
+ *	- A new batch structure.
+ *	- NULL on error.
+ */
+udp_recv_batch_t *udp_recv_batch_alloc(TALLOC_CTX *ctx, unsigned int num, size_t packet_size)
+{
+	udp_recv_batch_t	*batch;
+
+	if (!num || !packet_size) {
+		fr_strerror_const("Invalid arguments");
+		return NULL;
+	}
+
+	batch = talloc_zero(ctx, udp_recv_batch_t);
+	if (!batch) {
+	oom:
+		fr_strerror_const("Out of memory");
+		talloc_free(batch);
+		return NULL;
+	}
+
+	batch->sockfd = -1;
+	batch->num = num;
+	batch->packet_size = packet_size;
+
+	batch->mmsgvec = talloc_zero_array(batch, struct mmsghdr, num);
+	batch->iov = talloc_zero_array(batch, struct iovec, num);
+	batch->src = talloc_zero_array(batch, struct sockaddr_storage, num);
+	batch->cbuf = talloc_zero_array(batch, uint8_t, num * UDPFROMTO_CMSG_SIZE);
+	batch->buffer = talloc_array(batch, uint8_t, num * packet_size);
+	if (!batch->mmsgvec || !batch->iov || !batch->src || !batch->cbuf || !batch->buffer) goto oom;
+
+	/*
+	 *	The buffers don't move, so we only need to point the
+	 *	message headers at them once.
+	 */
+	udp_recv_batch_init_headers(batch);
+
+	return batch;
+}
+
+/** Read packets for a batch with io_uring, instead of recvmmsg()
+ *
+ * The io_uring is created by the first call to udp_recv_batch(), as
+ * only the thread which creates it can use it.  This function checks
+ * that the kernel supports what we need.
+ *
+ * If io_uring fails later, the batch goes back to using recvmmsg().
+ *
+ * @param[in] batch		to use io_uring for.
+ * @return
+ *	- 0 on success.
+ *	- -1 if io_uring isn't available.
+ */
+int udp_recv_batch_io_uring(udp_recv_batch_t *batch)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	udp_uring_t *ur;
+
+	ur = udp_uring_alloc(NULL, 1, batch->packet_size);
+	if (!ur) return -1;
+	talloc_free(ur);
+
+	batch->use_uring = true;
+	return 0;
+#else
+	fr_strerror_const("io_uring is not supported on this platform");
+	return -1;
+#endif
+}
+
+/** Read as many UDP packets as are available, up to the size of the batch
+ *
+ * Any packets which haven't yet been returned by udp_recv_batch_next()
+ * are discarded.
+ *
+ * @param[in] batch		to read packets into.
+ * @param[in] sockfd		we're reading from.  Must be an unconnected socket.
+ * @return
+ *	- > 0 the number of packets read.
+ *	- 0 if no packets were available.
+ *	- < 0 on failure.
+ */
+int udp_recv_batch(udp_recv_batch_t *batch, int sockfd)
+{
+	unsigned int	i;
+	int		ret;
+
+	batch->count = batch->next = 0;
+
+	/*
+	 *	recvmmsg() doesn't give us the destination port, so
+	 *	we need the local address of the socket.  It doesn't
+	 *	change, so only ask for it once.
+	 */
+	if (batch->sockfd != sockfd) {
+		batch->local_len = sizeof(batch->local);
+		if (getsockname(sockfd, (struct sockaddr *)&batch->local, &batch->local_len) < 0) {
+			fr_strerror_printf("Failed getting socket name: %s", fr_syserror(errno));
+			return -1;
+		}
+		batch->sockfd = sockfd;
+	}
+
+#ifdef HAVE_LINUX_IO_URING_H
+	if (batch->use_uring) {
+		ret = udp_recv_batch_uring(batch, sockfd);
+		if (ret >= 0) return ret;
+
+		/*
+		 *	Don't try again, and go back to our own
+		 *	buffers.
+		 */
+		batch->use_uring = false;
+		TALLOC_FREE(batch->uring);
+		batch->count = 0;
+		udp_recv_batch_init_headers(batch);
+	}
+#endif
+
+	/*
+	 *	recvmmsg() overwrites these, so they have to be reset
+	 *	on every read.
+	 */
+	for (i = 0; i < batch->num; i++) {
+		batch->mmsgvec[i].msg_hdr.msg_namelen = sizeof(batch->src[i]);
+		batch->mmsgvec[i].msg_hdr.msg_controllen = UDPFROMTO_CMSG_SIZE;
+		batch->mmsgvec[i].msg_hdr.msg_flags = 0;
+		batch->mmsgvec[i].msg_len = 0;
+	}
+
+	ret = recvmmsg(sockfd, batch->mmsgvec, batch->num, 0, NULL);
+	if (ret < 0) {
+		if ((errno == EWOULDBLOCK) || (errno == EAGAIN) || (errno == EINTR)) return 0;
+
+		fr_strerror_printf("Failed reading socket: %s", fr_syserror(errno));
+		return ret;
+	}
+
+	batch->count = ret;
+	batch->when = fr_time();
+
+	return ret;
+}
+
+/** Return the next packet from a batch
+ *
+ * Empty packets, and packets with unknown address families are silently skipped.
+ * Packets which were truncated because they didn't fit in the buffer are
+ * skipped, and counted.  See udp_recv_batch_truncated().
+ *
+ * @param[in] batch		to return packets from.
+ * @param[out] socket_out	Information about the src/dst address of the packet
+ *				and the interface it was received on.
+ * @param[out] data		where the packet data is.  The data is only valid until
+ *				the next call to udp_recv_batch().
+ * @param[out] when		the packet was received.
+ * @return
+ *	- > 0 the length of the packet.
+ *	- 0 if there are no more packets in the batch.
+ */
+ssize_t udp_recv_batch_next(udp_recv_batch_t *batch,
+			    fr_socket_t *socket_out, uint8_t **data, fr_time_t *when)
+{
+	while (batch->next < batch->count) {
+		unsigned int		i = batch->next++;
+		struct msghdr		*msgh = &batch->mmsgvec[i].msg_hdr;
+		struct sockaddr_storage	dst;
+		socklen_t		sizeof_dst = batch->local_len;
+		fr_time_t		recv_time;
+
+		if (!batch->mmsgvec[i].msg_len) continue;
+
+		if (msgh->msg_flags & MSG_TRUNC) {
+			batch->truncated++;
+			continue;
+		}
+
+		*socket_out = (fr_socket_t){
+			.fd = batch->sockfd,
+			.proto = IPPROTO_UDP
+		};
+
+		/*
+		 *	The destination IP address may be more
+		 *	specific than the one we're bound to.
+		 */
+		memcpy(&dst, &batch->local, sizeof(dst));
+		recvfromto_cmsg_parse(msgh, &socket_out->inet.ifindex,
+				      (struct sockaddr *)&dst, &sizeof_dst, &recv_time);
+
+		if ((fr_ipaddr_from_sockaddr(&socket_out->inet.src_ipaddr, &socket_out->inet.src_port,
+					     &batch->src[i], msgh->msg_namelen) < 0) ||
+		    (fr_ipaddr_from_sockaddr(&socket_out->inet.dst_ipaddr, &socket_out->inet.dst_port,
+					     &dst, sizeof_dst) < 0)) {
+			FR_DEBUG_STRERROR_PRINTF("Unknown address family");
+			continue;
+		}
+
+		*data = batch->iov[i].iov_base;
+		if (when) *when = recv_time ? recv_time : batch->when;
+
+		return batch->mmsgvec[i].msg_len;
+	}
+
+	return 0;
+}
+
+/** Whether there are packets in the batch which haven't been returned
+ *
+ * @param[in] batch		to check.
+ * @return
+ *	- true if udp_recv_batch_next() will return more packets.
+ *	- false if the batch is empty.
+ */
+bool udp_recv_batch_pending(udp_recv_batch_t const *batch)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	if (batch->uring && udp_uring_pending(batch->uring)) return true;
+#endif
+
+	return (batch->next < batch->count);
+}
+
+/** Return the number of truncated datagrams discarded since the last call
+ *
+ * @param[in] batch		to check.
+ * @return the number of datagrams discarded by udp_recv_batch_next().
+ */
+unsigned int udp_recv_batch_truncated(udp_recv_batch_t *batch)
+{
+	unsigned int truncated = batch->truncated;
+
+	batch->truncated = 0;
+	return truncated;
+}
+
+struct udp_send_batch_s {
+	int			sockfd;		//!< Socket the queued datagrams will be written to.
+	bool			local_any;	//!< Whether the socket is bound to a wildcard address.
+
+	unsigned int		num;		//!< Maximum number of datagrams to queue.
+	unsigned int		count;		//!< Number of datagrams queued.
+	size_t			packet_size;	//!< Maximum size of a queued datagram.
+
+	struct mmsghdr		*mmsgvec;	//!< Message headers passed to sendmmsg().
+	struct iovec		*iov;		//!< One per message, pointing into buffer.
+	struct sockaddr_storage	*dst;		//!< Destination address of each message.
+	uint8_t			*cbuf;		//!< Auxiliary data for each message.
+	uint8_t			*buffer;	//!< Datagram data for all messages.
+};
+
+/** Allocate a structure for batched writes of UDP packets
+ *
+ * @param[in] ctx		to allocate the batch in.
+ * @param[in] num		maximum number of datagrams to write in one system call.
+ * @param[in] packet_size	maximum size of a datagram.  Larger datagrams are
+ *				written directly.
+ * @return
+ *	- A new batch structure.
+ *	- NULL on error.
+ */
+udp_send_batch_t *udp_send_batch_alloc(TALLOC_CTX *ctx, unsigned int num, size_t packet_size)
+{
+	udp_send_batch_t	*batch;
+	unsigned int		i;
+
+	if (!num || !packet_size) {
+		fr_strerror_const("Invalid arguments");
+		return NULL;
+	}
+
+	batch = talloc_zero(ctx, udp_send_batch_t);
+	if (!batch) {
+	oom:
+		fr_strerror_const("Out of memory");
+		talloc_free(batch);
+		return NULL;
+	}
+
+	batch->sockfd = -1;
+	batch->num = num;
+	batch->packet_size = packet_size;
+
+	batch->mmsgvec = talloc_zero_array(batch, struct mmsghdr, num);
+	batch->iov = talloc_zero_array(batch, struct iovec, num);
+	batch->dst = talloc_zero_array(batch, struct sockaddr_storage, num);
+	batch->cbuf = talloc_zero_array(batch, uint8_t, num * UDPFROMTO_CMSG_SIZE);
+	batch->buffer = talloc_array(batch, uint8_t, num * packet_size);
+	if (!batch->mmsgvec || !batch->iov || !batch->dst || !batch->cbuf || !batch->buffer) goto oom;
+
+	for (i = 0; i < num; i++) {
+		batch->iov[i].iov_base = batch->buffer + (i * packet_size);
+
+		batch->mmsgvec[i].msg_hdr.msg_iov = &batch->iov[i];
+		batch->mmsgvec[i].msg_hdr.msg_iovlen = 1;
+		batch->mmsgvec[i].msg_hdr.msg_name = &batch->dst[i];
+	}
+
+	return batch;
+}
+
+/** Queue a UDP packet for writing
+ *
+ * The packet data is copied, so the caller can free it as soon as this
+ * function returns.  If the batch is full, it is flushed first.
+ *
+ * UDP doesn't guarantee delivery, so if the socket still can't take
+ * any more packets, the oldest queued packets are discarded, and the
+ * caller is expected to retransmit, or rely on the client doing so.
+ *
+ * @param[in] batch		to add the packet to.
+ * @param[in] socket		to write the packet to.  The packet is sent to the dst
+ *				address, from the src address.
+ * @param[in] data		to write.
+ * @param[in] data_len		length of data to write.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int udp_send_batch_add(udp_send_batch_t *batch, fr_socket_t const *socket, void const *data, size_t data_len)
+{
+	struct sockaddr_storage	src;
+	socklen_t		sizeof_src, sizeof_dst;
+	unsigned int		i;
+
+	if (unlikely(socket->proto != IPPROTO_UDP)) {
+		fr_strerror_printf("Invalid proto type %u", socket->proto);
+		return -1;
+	}
+
+	/*
+	 *	All of the packets in a batch have to go to the same
+	 *	socket, and have to fit in the buffers.
+	 */
+	if ((batch->count > 0) && (socket->fd != batch->sockfd)) (void) udp_send_batch_flush(batch);
+
+	if (data_len > batch->packet_size) {
+		void *packet;
+
+		(void) udp_send_batch_flush(batch);
+
+		memcpy(&packet, &data, sizeof(packet)); /* const issues */
+		return (udp_send(socket, UDP_FLAGS_NONE, packet, data_len) < 0) ? -1 : 0;
+	}
+
+	/*
+	 *	The socket is still full after a flush.  Make room
+	 *	by discarding the queued packets.
+	 */
+	if ((batch->count == batch->num) && (udp_send_batch_flush(batch) < 0)) batch->count = 0;
+
+	/*
+	 *	Starting a new batch.  We only need to set the source
+	 *	address if the socket is bound to a wildcard address.
+	 *	Otherwise the OS will use the address we're bound to.
+	 */
+	if (batch->count == 0) {
+		if (batch->sockfd != socket->fd) {
+			struct sockaddr_storage	local;
+			socklen_t		sizeof_local = sizeof(local);
+
+			if (getsockname(socket->fd, (struct sockaddr *)&local, &sizeof_local) < 0) {
+				fr_strerror_printf("Failed getting socket name: %s", fr_syserror(errno));
+				return -1;
+			}
+
+			switch (local.ss_family) {
+			case AF_INET:
+				batch->local_any = (((struct sockaddr_in *)&local)->sin_addr.s_addr == INADDR_ANY);
+				break;
+
+#ifdef AF_INET6
+			case AF_INET6:
+				batch->local_any = IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6 *)&local)->sin6_addr);
+				break;
+#endif
+
+			default:
+				batch->local_any = false;
+				break;
+			}
+		}
+		batch->sockfd = socket->fd;
+	}
+
+	i = batch->count;
+
+	if (fr_ipaddr_to_sockaddr(&batch->dst[i], &sizeof_dst,
+				  &socket->inet.dst_ipaddr, socket->inet.dst_port) < 0) return -1;
+	batch->mmsgvec[i].msg_hdr.msg_namelen = sizeof_dst;
+
+	if (batch->local_any) {
+		if (fr_ipaddr_to_sockaddr(&src, &sizeof_src,
+					  &socket->inet.src_ipaddr, socket->inet.src_port) < 0) return -1;
+
+		sendfromto_cmsg_build(&batch->mmsgvec[i].msg_hdr, batch->cbuf + (i * UDPFROMTO_CMSG_SIZE),
+				      socket->inet.ifindex, (struct sockaddr *)&src);
+	} else {
+		sendfromto_cmsg_build(&batch->mmsgvec[i].msg_hdr, NULL, 0, NULL);
+	}
+
+	memcpy(batch->iov[i].iov_base, data, data_len);
+	batch->iov[i].iov_len = data_len;
+	batch->count++;
+
+	return 0;
+}
+
+/** Write all queued UDP packets
+ *
+ * Packets which the OS refuses to send (e.g. because the destination is
+ * unreachable) are discarded.  If the socket can't take any more packets,
+ * the unsent packets remain queued for the next flush.
+ *
+ * @param[in] batch		to write.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the socket would block, and packets are still queued.
+ */
+int udp_send_batch_flush(udp_send_batch_t *batch)
+{
+	unsigned int	sent = 0, i;
+	int		ret;
+
+	while (sent < batch->count) {
+		ret = sendmmsg(batch->sockfd, batch->mmsgvec + sent, batch->count - sent, 0);
+		if (ret >= 0) {
+			sent += ret;
+			continue;
+		}
+
+		if (errno == EINTR) continue;
+
+		if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) {
+			int my_errno = errno;
+
+			/*
+			 *	Move the unsent packets to the start
+			 *	of the batch.  Each message header
+			 *	always points to its own buffers, so
+			 *	we copy the data, and not the
+			 *	headers.
+			 */
+			for (i = 0; sent && ((sent + i) < batch->count); i++) {
+				struct msghdr *to = &batch->mmsgvec[i].msg_hdr;
+				struct msghdr *from = &batch->mmsgvec[sent + i].msg_hdr;
+
+				memcpy(batch->iov[i].iov_base, batch->iov[sent + i].iov_base, batch->iov[sent + i].iov_len);
+				batch->iov[i].iov_len = batch->iov[sent + i].iov_len;
+
+				batch->dst[i] = batch->dst[sent + i];
+				to->msg_namelen = from->msg_namelen;
+
+				if (from->msg_controllen) {
+					memcpy(batch->cbuf + (i * UDPFROMTO_CMSG_SIZE), from->msg_control, from->msg_controllen);
+					to->msg_control = batch->cbuf + (i * UDPFROMTO_CMSG_SIZE);
+				} else {
+					to->msg_control = NULL;
+				}
+				to->msg_controllen = from->msg_controllen;
+			}
+			batch->count -= sent;
+
+			errno = my_errno;
+			fr_strerror_printf("udp_send_batch_flush failed: %s", fr_syserror(errno));
+			return -1;
+		}
+
+		/*
+		 *	The first packet couldn't be sent.  Skip it,
+		 *	and keep going with the rest.
+		 */
+		fr_strerror_printf("udp_send_batch_flush failed: %s", fr_syserror(errno));
+		sent++;
+	}
+
+	batch->count = 0;
+
+	return 0;
+}
@@ -30,6 +30,7 @@ extern "C" {
 #include <freeradius-devel/build.h>
 #include <freeradius-devel/missing.h>
 #include <freeradius-devel/util/inet.h>
+#include <freeradius-devel/util/talloc.h>
 #include <freeradius-devel/util/time.h>
 #include <freeradius-devel/util/udpfromto.h>
 
@@ -46,6 +47,35 @@ ssize_t udp_recv_peek(int sockfd, void *data, size_t data_len, int flags, fr_ipa
 ssize_t udp_recv(int sockfd, int flags,
 		 fr_socket_t *socket_out, void *data, size_t data_len, fr_time_t *when);
 
+/** State for reading multiple datagrams from a socket with a single system call
+ *
+ */
+typedef struct udp_recv_batch_s udp_recv_batch_t;
+
+udp_recv_batch_t *udp_recv_batch_alloc(TALLOC_CTX *ctx, unsigned int num, size_t packet_size);
+
+int	udp_recv_batch_io_uring(udp_recv_batch_t *batch);
+
+int	udp_recv_batch(udp_recv_batch_t *batch, int sockfd);
+
+ssize_t	udp_recv_batch_next(udp_recv_batch_t *batch,
+			    fr_socket_t *socket_out, uint8_t **data, fr_time_t *when);
+
+bool	udp_recv_batch_pending(udp_recv_batch_t const *batch);
+
+unsigned int udp_recv_batch_truncated(udp_recv_batch_t *batch);
+
+/** State for writing multiple datagrams to a socket with a single system call
+ *
+ */
+typedef struct udp_send_batch_s udp_send_batch_t;
+
+udp_send_batch_t *udp_send_batch_alloc(TALLOC_CTX *ctx, unsigned int num, size_t packet_size);
+
+int	udp_send_batch_add(udp_send_batch_t *batch, fr_socket_t const *socket, void const *data, size_t data_len);
+
+int	udp_send_batch_flush(udp_send_batch_t *batch);
+
 #ifdef __cplusplus
 }
 #endif
@@ -162,6 +162,82 @@ int udpfromto_init(int s)
 	return setsockopt(s, proto, flag, &opt, sizeof(opt));
 }
 
+/** Extract the destination address, interface and timestamp from a received message
+ *
+ * Used by recvfromto(), and by callers using recvmmsg() directly, which need to
+ * process the auxiliary data for each message they received.
+ *
+ * @param[in] msgh	as populated by recvmsg() or recvmmsg().
+ * @param[out] ifindex	The interface which received the datagram (may be NULL).
+ * @param[in,out] to	Where to write the destination address.  Must be initialised
+ *			with the local address of the socket, as only the IP address
+ *			is updated.
+ * @param[out] to_len	Length of the destination address.
+ * @param[out] when	the packet was received (may be NULL).  Set to 0 if no
+ *			timestamp was found.
+ */
+void recvfromto_cmsg_parse(struct msghdr *msgh, int *ifindex,
+			   struct sockaddr *to, socklen_t *to_len, fr_time_t *when)
+{
+	struct cmsghdr		*cmsg;
+
+	if (ifindex) *ifindex = 0;
+	if (when) *when = 0;
+
+	/* Process auxiliary received data in msgh */
+	for (cmsg = CMSG_FIRSTHDR(msgh);
+	     cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(msgh, cmsg)) {
+
+#ifdef IP_PKTINFO
+		if ((cmsg->cmsg_level == SOL_IP) &&
+		    (cmsg->cmsg_type == IP_PKTINFO)) {
+			struct in_pktinfo *i = (struct in_pktinfo *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in *)to)->sin_addr = i->ipi_addr;
+			*to_len = sizeof(struct sockaddr_in);
+
+			if (ifindex) *ifindex = i->ipi_ifindex;
+
+			continue;
+		}
+#endif
+
+#ifdef IP_RECVDSTADDR
+		if ((cmsg->cmsg_level == IPPROTO_IP) &&
+		    (cmsg->cmsg_type == IP_RECVDSTADDR)) {
+			struct in_addr *i = (struct in_addr *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in *)to)->sin_addr = *i;
+
+			*to_len = sizeof(struct sockaddr_in);
+
+			continue;
+		}
+#endif
+
+#ifdef IPV6_PKTINFO
+		if ((cmsg->cmsg_level == IPPROTO_IPV6) &&
+		    (cmsg->cmsg_type == IPV6_PKTINFO)) {
+			struct in6_pktinfo *i = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+
+			((struct sockaddr_in6 *)to)->sin6_addr = i->ipi6_addr;
+			*to_len = sizeof(struct sockaddr_in6);
+
+			if (ifindex) *ifindex = i->ipi6_ifindex;
+
+			continue;
+		}
+#endif
+
+#ifdef SO_TIMESTAMP
+		if (when && (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SO_TIMESTAMP)) {
+			*when = fr_time_from_timeval((struct timeval *)CMSG_DATA(cmsg));
+		}
+#endif
+	}
+}
+
 /** Read a packet from a file descriptor, retrieving additional header information
  *
  * Abstracts away the complexity of using the complexity of using recvmsg().
@@ -196,9 +272,8 @@ int recvfromto(int fd, void *buf, size_t len, int flags,
 	       fr_time_t *when)
 {
 	struct msghdr		msgh;
-	struct cmsghdr		*cmsg;
 	struct iovec		iov;
-	char			cbuf[256];
+	uint8_t			cbuf[UDPFROMTO_CMSG_SIZE];
 	int			ret;
 	struct sockaddr_storage	si;
 	socklen_t		si_len = sizeof(si);
@@ -299,65 +374,97 @@ int recvfromto(int fd, void *buf, size_t len, int flags,
 
 	if (from_len) *from_len = msgh.msg_namelen;
 
-	if (ifindex) *ifindex = 0;
-	if (when) *when = 0;
+	recvfromto_cmsg_parse(&msgh, ifindex, to, to_len, when);
 
-	/* Process auxiliary received data in msgh */
-	for (cmsg = CMSG_FIRSTHDR(&msgh);
-	     cmsg != NULL;
-	     cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+	if (when && !*when) *when = fr_time();
 
-#ifdef IP_PKTINFO
-		if ((cmsg->cmsg_level == SOL_IP) &&
-		    (cmsg->cmsg_type == IP_PKTINFO)) {
-			struct in_pktinfo *i = (struct in_pktinfo *) CMSG_DATA(cmsg);
+	return ret;
+}
 
-			((struct sockaddr_in *)to)->sin_addr = i->ipi_addr;
-			*to_len = sizeof(struct sockaddr_in);
+/** Add the source address and outbound interface to a message which is about to be sent
+ *
+ * Used by sendfromto(), and by callers using sendmmsg() directly, which need to
+ * set the source address for each message they send.
+ *
+ * If the source address can't be set on this platform, the message is left unchanged,
+ * and the OS will pick the source address.
+ *
+ * @param[in,out] msgh	to add the control data to.
+ * @param[in] cbuf	Where to write the control data.  Must be at least
+ *			#UDPFROMTO_CMSG_SIZE bytes.
+ * @param[in] ifindex	The interface on which to send the datagram.
+ *			If automatic interface selection is desired, value should be 0.
+ * @param[in] from	The source address.  May be NULL.
+ */
+void sendfromto_cmsg_build(struct msghdr *msgh, uint8_t *cbuf, int ifindex, struct sockaddr const *from)
+{
+	msgh->msg_control = NULL;
+	msgh->msg_controllen = 0;
 
-			if (ifindex) *ifindex = i->ipi_ifindex;
+	if (!from) return;
 
-			break;
-		}
-#endif
+	memset(cbuf, 0, UDPFROMTO_CMSG_SIZE);
 
-#ifdef IP_RECVDSTADDR
-		if ((cmsg->cmsg_level == IPPROTO_IP) &&
-		    (cmsg->cmsg_type == IP_RECVDSTADDR)) {
-			struct in_addr *i = (struct in_addr *) CMSG_DATA(cmsg);
+# if defined(IP_PKTINFO) || defined(IP_SENDSRCADDR)
+	if (from->sa_family == AF_INET) {
+		struct sockaddr_in const *s4 = (struct sockaddr_in const *) from;
 
-			((struct sockaddr_in *)to)->sin_addr = *i;
+#  ifdef IP_PKTINFO
+		struct cmsghdr *cmsg;
+		struct in_pktinfo *pkt;
 
-			*to_len = sizeof(struct sockaddr_in);
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
 
-			break;
-		}
-#endif
+		cmsg = CMSG_FIRSTHDR(msgh);
+		cmsg->cmsg_level = SOL_IP;
+		cmsg->cmsg_type = IP_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
 
-#ifdef IPV6_PKTINFO
-		if ((cmsg->cmsg_level == IPPROTO_IPV6) &&
-		    (cmsg->cmsg_type == IPV6_PKTINFO)) {
-			struct in6_pktinfo *i = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+		pkt = (struct in_pktinfo *) CMSG_DATA(cmsg);
+		memset(pkt, 0, sizeof(*pkt));
+		pkt->ipi_spec_dst = s4->sin_addr;
+		pkt->ipi_ifindex = ifindex;
 
-			((struct sockaddr_in6 *)to)->sin6_addr = i->ipi6_addr;
-			*to_len = sizeof(struct sockaddr_in6);
+#  elif defined(IP_SENDSRCADDR)
+		struct cmsghdr *cmsg;
+		struct in_addr *in;
 
-			if (ifindex) *ifindex = i->ipi6_ifindex;
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*in));
 
-			break;
-		}
-#endif
+		cmsg = CMSG_FIRSTHDR(msgh);
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_SENDSRCADDR;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(*in));
 
-#ifdef SO_TIMESTAMP
-		if (when && (cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == SO_TIMESTAMP)) {
-			*when = fr_time_from_timeval((struct timeval *)CMSG_DATA(cmsg));
-		}
-#endif
+		in = (struct in_addr *) CMSG_DATA(cmsg);
+		*in = s4->sin_addr;
+#  endif
 	}
+#endif
 
-	if (when && !*when) *when = fr_time();
+#  if defined(IPV6_PKTINFO)
+	if (from->sa_family == AF_INET6) {
+		struct sockaddr_in6 const *s6 = (struct sockaddr_in6 const *) from;
 
-	return ret;
+		struct cmsghdr *cmsg;
+		struct in6_pktinfo *pkt;
+
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
+
+		cmsg = CMSG_FIRSTHDR(msgh);
+		cmsg->cmsg_level = IPPROTO_IPV6;
+		cmsg->cmsg_type = IPV6_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
+
+		pkt = (struct in6_pktinfo *) CMSG_DATA(cmsg);
+		memset(pkt, 0, sizeof(*pkt));
+		pkt->ipi6_addr = s6->sin6_addr;
+		pkt->ipi6_ifindex = ifindex;
+	}
+#  endif	/* IPV6_PKTINFO */
 }
 
 /** Send packet via a file descriptor, setting the src address and outbound interface
@@ -385,7 +492,7 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 {
 	struct msghdr	msgh;
 	struct iovec	iov;
-	char		cbuf[256];
+	uint8_t		cbuf[UDPFROMTO_CMSG_SIZE];
 
 	/*
 	 *	Unknown address family, die.
@@ -443,8 +550,7 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 	 */
 	if (!from || (from_len == 0)) return sendto(fd, buf, len, flags, to, to_len);
 
-	/* Set up control buffer iov and msgh structures. */
-	memset(&cbuf, 0, sizeof(cbuf));
+	/* Set up iov and msgh structures. */
 	memset(&msgh, 0, sizeof(msgh));
 	memset(&iov, 0, sizeof(iov));
 	iov.iov_base = buf;
@@ -455,66 +561,7 @@ int sendfromto(int fd, void *buf, size_t len, int flags,
 	msgh.msg_name = to;
 	msgh.msg_namelen = to_len;
 
-# if defined(IP_PKTINFO) || defined(IP_SENDSRCADDR)
-	if (from->sa_family == AF_INET) {
-		struct sockaddr_in *s4 = (struct sockaddr_in *) from;
-
-#  ifdef IP_PKTINFO
-		struct cmsghdr *cmsg;
-		struct in_pktinfo *pkt;
-
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
-
-		cmsg = CMSG_FIRSTHDR(&msgh);
-		cmsg->cmsg_level = SOL_IP;
-		cmsg->cmsg_type = IP_PKTINFO;
-		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
-
-		pkt = (struct in_pktinfo *) CMSG_DATA(cmsg);
-		memset(pkt, 0, sizeof(*pkt));
-		pkt->ipi_spec_dst = s4->sin_addr;
-		pkt->ipi_ifindex = ifindex;
-
-#  elif defined(IP_SENDSRCADDR)
-		struct cmsghdr *cmsg;
-		struct in_addr *in;
-
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*in));
-
-		cmsg = CMSG_FIRSTHDR(&msgh);
-		cmsg->cmsg_level = IPPROTO_IP;
-		cmsg->cmsg_type = IP_SENDSRCADDR;
-		cmsg->cmsg_len = CMSG_LEN(sizeof(*in));
-
-		in = (struct in_addr *) CMSG_DATA(cmsg);
-		*in = s4->sin_addr;
-#  endif
-	}
-#endif
-
-#  if defined(IPV6_PKTINFO)
-	if (from->sa_family == AF_INET6) {
-		struct sockaddr_in6 *s6 = (struct sockaddr_in6 *) from;
-
-		struct cmsghdr *cmsg;
-		struct in6_pktinfo *pkt;
-
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
-
-		cmsg = CMSG_FIRSTHDR(&msgh);
-		cmsg->cmsg_level = IPPROTO_IPV6;
-		cmsg->cmsg_type = IPV6_PKTINFO;
-		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
-
-		pkt = (struct in6_pktinfo *) CMSG_DATA(cmsg);
-		memset(pkt, 0, sizeof(*pkt));
-		pkt->ipi6_addr = s6->sin6_addr;
-		pkt->ipi6_ifindex = ifindex;
-	}
-#  endif	/* IPV6_PKTINFO */
+	sendfromto_cmsg_build(&msgh, cbuf, ifindex, from);
 
 	return sendmsg(fd, &msgh, flags);
 }
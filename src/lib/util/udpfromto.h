@@ -34,17 +34,28 @@ extern "C" {
 #include <freeradius-devel/util/time.h>
 
 #include <netinet/in.h>
+#include <sys/socket.h>
 #include <stddef.h>
 #include <stdlib.h>
 
+/** Size of the buffer required for the auxiliary data of a single message
+ *
+ */
+#define UDPFROMTO_CMSG_SIZE	(256)
+
 int	udpfromto_init(int s);
 
+void	recvfromto_cmsg_parse(struct msghdr *msgh, int *ifindex,
+			      struct sockaddr *to, socklen_t *to_len, fr_time_t *when);
+
 int	recvfromto(int s, void *buf, size_t len, int flags,
 		   int *ifindex,
 	       	   struct sockaddr *from, socklen_t *fromlen,
 		   struct sockaddr *to, socklen_t *tolen,
 		   fr_time_t *when);
 
+void	sendfromto_cmsg_build(struct msghdr *msgh, uint8_t *cbuf, int ifindex, struct sockaddr const *from);
+
 int	sendfromto(int s, void *buf, size_t len, int flags,
 		   int ifindex,
 		   struct sockaddr *from, socklen_t fromlen,
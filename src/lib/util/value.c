@@ -591,7 +591,7 @@ int fr_value_box_cmp(fr_value_box_t const *a, fr_value_box_t const *b)
 		break;
 
 	case FR_TYPE_UINT32:
-		CHECK(int32);
+		CHECK(uint32);
 		break;
 
 	case FR_TYPE_UINT64:
@@ -895,7 +895,236 @@ int fr_value_box_cmp_op(fr_token_t op, fr_value_box_t const *a, fr_value_box_t c
 	}
 }
 
-static char const hextab[] = "0123456789abcdef";
+/*
+ *	Comparisons specialised for an operator and a data type.
+ *
+ *	These must give the same result as fr_value_box_cmp_op().
+ */
+#define CMP_OP_FUNC(_name, _field, _op) \
+static int cmp_op_##_name(fr_value_box_t const *a, fr_value_box_t const *b) \
+{ \
+	return (a->datum._field _op b->datum._field); \
+}
+
+#define CMP_OP_FUNCS(_field) \
+CMP_OP_FUNC(_field##_eq, _field, ==) \
+CMP_OP_FUNC(_field##_ne, _field, !=) \
+CMP_OP_FUNC(_field##_lt, _field, <) \
+CMP_OP_FUNC(_field##_gt, _field, >) \
+CMP_OP_FUNC(_field##_le, _field, <=) \
+CMP_OP_FUNC(_field##_ge, _field, >=) \
+static fr_value_box_cmp_op_func_t const cmp_op_##_field[] = { \
+	cmp_op_##_field##_eq, cmp_op_##_field##_ne, \
+	cmp_op_##_field##_lt, cmp_op_##_field##_gt, \
+	cmp_op_##_field##_le, cmp_op_##_field##_ge \
+};
+
+CMP_OP_FUNCS(uint8)
+CMP_OP_FUNCS(uint16)
+CMP_OP_FUNCS(uint32)
+CMP_OP_FUNCS(uint64)
+CMP_OP_FUNCS(int8)
+CMP_OP_FUNCS(int16)
+CMP_OP_FUNCS(int32)
+CMP_OP_FUNCS(int64)
+CMP_OP_FUNCS(size)
+CMP_OP_FUNCS(date)
+CMP_OP_FUNCS(time_delta)
+
+/*
+ *	Fixed size values where only equality is cheap.
+ */
+static int cmp_op_ip_eq(fr_value_box_t const *a, fr_value_box_t const *b)
+{
+	return (memcmp(&a->vb_ip, &b->vb_ip, sizeof(a->vb_ip)) == 0);
+}
+
+static int cmp_op_ip_ne(fr_value_box_t const *a, fr_value_box_t const *b)
+{
+	return (memcmp(&a->vb_ip, &b->vb_ip, sizeof(a->vb_ip)) != 0);
+}
+
+static int cmp_op_ether_eq(fr_value_box_t const *a, fr_value_box_t const *b)
+{
+	return (memcmp(a->vb_ether, b->vb_ether, sizeof(a->vb_ether)) == 0);
+}
+
+static int cmp_op_ether_ne(fr_value_box_t const *a, fr_value_box_t const *b)
+{
+	return (memcmp(a->vb_ether, b->vb_ether, sizeof(a->vb_ether)) != 0);
+}
+
+static int cmp_op_ifid_eq(fr_value_box_t const *a, fr_value_box_t const *b)
+{
+	return (memcmp(a->vb_ifid, b->vb_ifid, sizeof(a->vb_ifid)) == 0);
+}
+
+static int cmp_op_ifid_ne(fr_value_box_t const *a, fr_value_box_t const *b)
+{
+	return (memcmp(a->vb_ifid, b->vb_ifid, sizeof(a->vb_ifid)) != 0);
+}
+
+/*
+ *	Variable length values are only equal if their lengths are.
+ */
+static int cmp_op_octets_eq(fr_value_box_t const *a, fr_value_box_t const *b)
+{
+	if (a->vb_length != b->vb_length) return 0;
+
+	return (memcmp(a->vb_octets, b->vb_octets, a->vb_length) == 0);
+}
+
+static int cmp_op_octets_ne(fr_value_box_t const *a, fr_value_box_t const *b)
+{
+	return !cmp_op_octets_eq(a, b);
+}
+
+/*
+ *	&Framed-IP-Address < 192.0.2/24
+ */
+static int cmp_op_ipv4_in_prefix(fr_value_box_t const *a, fr_value_box_t const *b)
+{
+	uint32_t mask;
+
+	if (b->vb_ip.prefix >= 32) return 0;
+	if (b->vb_ip.prefix == 0) return 1;
+
+	mask = htonl(~(uint32_t)0 << (32 - b->vb_ip.prefix));
+
+	return ((a->vb_ip.addr.v4.s_addr & mask) == (b->vb_ip.addr.v4.s_addr & mask));
+}
+
+/*
+ *	&Framed-IP-Address <= 192.0.2/24
+ */
+static int cmp_op_ipv4_in_prefix_le(fr_value_box_t const *a, fr_value_box_t const *b)
+{
+	if (b->vb_ip.prefix == 32) return (a->vb_ip.addr.v4.s_addr == b->vb_ip.addr.v4.s_addr);
+
+	return cmp_op_ipv4_in_prefix(a, b);
+}
+
+/** Return a comparison function specialised for an operator and data types
+ *
+ * Conditions whose data types are known when they're compiled can
+ * use the returned function instead of #fr_value_box_cmp_op, and
+ * skip its checks of the data types and operator on every call.
+ *
+ * @param[in] op	to use in comparison.
+ * @param[in] a_type	of the first value which will be compared.
+ * @param[in] b_type	of the second value which will be compared.
+ * @return
+ *	- The specialised comparison function.
+ *	- NULL if there isn't one, and #fr_value_box_cmp_op should be used.
+ */
+fr_value_box_cmp_op_func_t fr_value_box_cmp_op_func(fr_token_t op, fr_type_t a_type, fr_type_t b_type)
+{
+	int i;
+
+	switch (op) {
+	case T_OP_CMP_EQ:
+		i = 0;
+		break;
+
+	case T_OP_NE:
+		i = 1;
+		break;
+
+	case T_OP_LT:
+		i = 2;
+		break;
+
+	case T_OP_GT:
+		i = 3;
+		break;
+
+	case T_OP_LE:
+		i = 4;
+		break;
+
+	case T_OP_GE:
+		i = 5;
+		break;
+
+	default:
+		return NULL;
+	}
+
+	if (a_type != b_type) {
+		if ((a_type != FR_TYPE_IPV4_ADDR) || (b_type != FR_TYPE_IPV4_PREFIX)) return NULL;
+
+		switch (op) {
+		case T_OP_LT:
+			return cmp_op_ipv4_in_prefix;
+
+		case T_OP_LE:
+			return cmp_op_ipv4_in_prefix_le;
+
+		default:
+			return NULL;
+		}
+	}
+
+	switch (a_type) {
+	case FR_TYPE_UINT8:
+		return cmp_op_uint8[i];
+
+	case FR_TYPE_UINT16:
+		return cmp_op_uint16[i];
+
+	case FR_TYPE_UINT32:
+		return cmp_op_uint32[i];
+
+	case FR_TYPE_UINT64:
+		return cmp_op_uint64[i];
+
+	case FR_TYPE_INT8:
+		return cmp_op_int8[i];
+
+	case FR_TYPE_INT16:
+		return cmp_op_int16[i];
+
+	case FR_TYPE_INT32:
+		return cmp_op_int32[i];
+
+	case FR_TYPE_INT64:
+		return cmp_op_int64[i];
+
+	case FR_TYPE_SIZE:
+		return cmp_op_size[i];
+
+	case FR_TYPE_DATE:
+		return cmp_op_date[i];
+
+	case FR_TYPE_TIME_DELTA:
+		return cmp_op_time_delta[i];
+
+	case FR_TYPE_IPV4_ADDR:
+	case FR_TYPE_IPV6_ADDR:
+		if (op == T_OP_CMP_EQ) return cmp_op_ip_eq;
+		if (op == T_OP_NE) return cmp_op_ip_ne;
+		return NULL;
+
+	case FR_TYPE_ETHERNET:
+		if (op == T_OP_CMP_EQ) return cmp_op_ether_eq;
+		if (op == T_OP_NE) return cmp_op_ether_ne;
+		return NULL;
+
+	case FR_TYPE_IFID:
+		if (op == T_OP_CMP_EQ) return cmp_op_ifid_eq;
+		if (op == T_OP_NE) return cmp_op_ifid_ne;
+		return NULL;
+
+	case FR_TYPE_STRING:
+	case FR_TYPE_OCTETS:
+		if (op == T_OP_CMP_EQ) return cmp_op_octets_eq;
+		if (op == T_OP_NE) return cmp_op_octets_ne;
+		return NULL;
+
+	default:
+		return NULL;
+	}
+}
 
 /** Convert a string value with escape sequences into its binary form
  *
@@ -4639,9 +4868,6 @@ parse:
 
 	case FR_TYPE_ETHERNET:
 	{
-		char const *c1, *c2, *cp;
-		size_t p_len = 0;
-
 		/*
 		 *	Convert things which are obviously integers to Ethernet addresses
 		 *
@@ -4661,26 +4887,9 @@ parse:
 			break;
 		}
 
-		cp = in;
-		while (*cp) {
-			if (cp[1] == ':') {
-				c1 = hextab;
-				c2 = memchr(hextab, tolower((int) cp[0]), 16);
-				cp += 2;
-			} else if ((cp[1] != '\0') && ((cp[2] == ':') || (cp[2] == '\0'))) {
-				c1 = memchr(hextab, tolower((int) cp[0]), 16);
-				c2 = memchr(hextab, tolower((int) cp[1]), 16);
-				cp += 2;
-				if (*cp == ':') cp++;
-			} else {
-				c1 = c2 = NULL;
-			}
-			if (!c1 || !c2 || (p_len >= sizeof(dst->vb_ether))) {
-				fr_strerror_printf("failed to parse Ethernet address \"%s\"", in);
-				return -1;
-			}
-			dst->vb_ether[p_len] = ((c1-hextab)<<4) + (c2-hextab);
-			p_len++;
+		if (fr_inet_ethernet_pton(dst->vb_ether, in) < 0) {
+			fr_strerror_printf("failed to parse Ethernet address \"%s\"", in);
+			return -1;
 		}
 	}
 		break;
@@ -4832,10 +5041,8 @@ ssize_t fr_value_box_print(fr_sbuff_t *out, fr_value_box_t const *data, fr_sbuff
 		break;
 
 	case FR_TYPE_ETHERNET:
-		FR_SBUFF_IN_SPRINTF_RETURN(&our_out, "%02x:%02x:%02x:%02x:%02x:%02x",
-					   data->vb_ether[0], data->vb_ether[1],
-					   data->vb_ether[2], data->vb_ether[3],
-					   data->vb_ether[4], data->vb_ether[5]);
+		FR_SBUFF_IN_BSTRNCPY_RETURN(&our_out, fr_inet_ethernet_ntop(buf, data->vb_ether),
+					    FR_ETHERNET_STRLEN - 1);
 		break;
 
 	case FR_TYPE_BOOL:
@@ -5241,19 +5448,21 @@ char *fr_value_box_list_aprint(TALLOC_CTX *ctx, fr_value_box_list_t const *list,
 
 /** Hash the contents of a value box
  *
+ * The hash is seeded randomly at startup, as value boxes often
+ * hold data sent by clients.
  */
 uint32_t fr_value_box_hash(fr_value_box_t const *vb)
 {
 	switch (vb->type) {
 	case FR_TYPE_FIXED_SIZE:
-		return fr_hash(((uint8_t const *)vb) + fr_value_box_offsets[vb->type],
+		return fr_hash_seeded(((uint8_t const *)vb) + fr_value_box_offsets[vb->type],
 				      fr_value_box_field_sizes[vb->type]);
 
 	case FR_TYPE_STRING:
-		return fr_hash(vb->vb_strvalue, vb->vb_length);
+		return fr_hash_seeded(vb->vb_strvalue, vb->vb_length);
 
 	case FR_TYPE_OCTETS:
-		return fr_hash(vb->vb_octets, vb->vb_length);
+		return fr_hash_seeded(vb->vb_octets, vb->vb_length);
 
 	default:
 		break;
@@ -616,6 +616,18 @@ int		fr_value_box_cmp(fr_value_box_t const *a, fr_value_box_t const *b);
 
 int		fr_value_box_cmp_op(fr_token_t op, fr_value_box_t const *a, fr_value_box_t const *b);
 
+/** Comparison specialised for one operator, and one pair of data types
+ *
+ * @param[in] a Value to compare.
+ * @param[in] b Value to compare.
+ * @return
+ *	- 1 if true
+ *	- 0 if false
+ */
+typedef int (*fr_value_box_cmp_op_func_t)(fr_value_box_t const *a, fr_value_box_t const *b);
+
+fr_value_box_cmp_op_func_t fr_value_box_cmp_op_func(fr_token_t op, fr_type_t a_type, fr_type_t b_type);
+
 /*
  *	Conversion
  */
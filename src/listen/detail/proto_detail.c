@@ -22,11 +22,13 @@
  * @copyright 2017 Arran Cudbard-Bell (a.cudbardb@freeradius.org)
  * @copyright 2016 Alan DeKok (aland@freeradius.org)
  */
+#include <freeradius-devel/internal/internal.h>
 #include <freeradius-devel/io/application.h>
 #include <freeradius-devel/io/listen.h>
 #include <freeradius-devel/io/schedule.h>
 #include <freeradius-devel/radius/radius.h>
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/detail.h>
 #include <freeradius-devel/server/virtual_servers.h>
 #include <freeradius-devel/util/debug.h>
 
@@ -186,6 +188,89 @@ static int transport_parse(TALLOC_CTX *ctx, void *out, UNUSED void *parent,
 /** Decode the packet, and set the request->process function
  *
  */
+/** Set the original src/dst ip/port, and protocol from a decoded pair
+ *
+ */
+static int decode_packet_pair(request_t *request, fr_pair_t const *vp)
+{
+	if ((vp->da == attr_packet_src_ip_address) ||
+	    (vp->da == attr_packet_src_ipv6_address)) {
+		request->packet->socket.inet.src_ipaddr = vp->vp_ip;
+	} else if ((vp->da == attr_packet_dst_ip_address) ||
+		   (vp->da == attr_packet_dst_ipv6_address)) {
+		request->packet->socket.inet.dst_ipaddr = vp->vp_ip;
+	} else if (vp->da == attr_packet_src_port) {
+		request->packet->socket.inet.src_port = vp->vp_uint16;
+	} else if (vp->da == attr_packet_dst_port) {
+		request->packet->socket.inet.dst_port = vp->vp_uint16;
+	} else if (vp->da == attr_protocol) {
+		request->dict = fr_dict_by_protocol_num(vp->vp_uint32);
+		if (!request->dict) {
+			REDEBUG("Invalid protocol: %pP", vp);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Decode a binary detail record
+ *
+ * The record has already been validated by the reader, so we only need
+ * to decode the pairs.
+ */
+static int decode_binary(request_t *request, uint8_t const *data, size_t data_len)
+{
+	fr_pair_list_t		tmp_list;
+	fr_pair_t		*vp;
+	fr_dbuff_t		dbuff;
+	uint32_t		payload_len;
+
+	if (data_len < FR_DETAIL_HDR_LEN) {
+		REDEBUG("Truncated binary detail record");
+		return -1;
+	}
+
+	payload_len = fr_net_to_uint32(data + FR_DETAIL_HDR_LENGTH);
+	if (payload_len > (data_len - FR_DETAIL_HDR_LEN)) {
+		REDEBUG("Binary detail record payload length %u exceeds record length %zu",
+			payload_len, data_len - FR_DETAIL_HDR_LEN);
+		return -1;
+	}
+
+	fr_pair_list_init(&tmp_list);
+	fr_dbuff_init(&dbuff, data + FR_DETAIL_HDR_LEN, payload_len);
+	if (fr_internal_decode_list_dbuff(request->request_ctx, &tmp_list, request->dict, &dbuff, NULL) < 0) {
+		RPEDEBUG("Failed decoding binary detail record");
+		return -1;
+	}
+
+	for (vp = fr_pair_list_head(&tmp_list);
+	     vp;
+	     vp = fr_pair_list_next(&tmp_list, vp)) {
+		if (decode_packet_pair(request, vp) < 0) {
+			fr_pair_list_free(&tmp_list);
+			return -1;
+		}
+	}
+
+	/*
+	 *	The original time at which we received the
+	 *	packet.  We need this to properly calculate
+	 *	Acct-Delay-Time.
+	 */
+	vp = fr_pair_afrom_da(request->request_ctx, attr_packet_original_timestamp);
+	if (vp) {
+		vp->vp_date = ((fr_time_t) fr_net_to_uint32(data + FR_DETAIL_HDR_TIMESTAMP)) * NSEC;
+		vp->type = VT_DATA;
+		fr_pair_append(&tmp_list, vp);
+	}
+
+	fr_pair_list_append(&request->request_pairs, &tmp_list);
+
+	return 0;
+}
+
 static int mod_decode(void const *instance, request_t *request, uint8_t *const data, size_t data_len)
 {
 	proto_detail_t const	*inst = talloc_get_type_abort_const(instance, proto_detail_t);
@@ -212,6 +297,12 @@ static int mod_decode(void const *instance, request_t *request, uint8_t *const d
 	request->reply->socket.inet.src_ipaddr = request->packet->socket.inet.src_ipaddr;
 	request->reply->socket.inet.dst_ipaddr = request->packet->socket.inet.src_ipaddr;
 
+	if (fr_detail_is_binary(data, data_len)) {
+		if (decode_binary(request, data, data_len) < 0) return -1;
+
+		return inst->app_io->decode(inst->app_io_instance, request, data, data_len);
+	}
+
 	end = data + data_len;
 
 	MPRINT("HEADER %s", data);
@@ -306,25 +397,7 @@ static int mod_decode(void const *instance, request_t *request, uint8_t *const d
 		/*
 		 *	Set the original src/dst ip/port
 		 */
-		if (vp) {
-			if ((vp->da == attr_packet_src_ip_address) ||
-			    (vp->da == attr_packet_src_ipv6_address)) {
-				request->packet->socket.inet.src_ipaddr = vp->vp_ip;
-			} else if ((vp->da == attr_packet_dst_ip_address) ||
-				   (vp->da == attr_packet_dst_ipv6_address)) {
-				request->packet->socket.inet.dst_ipaddr = vp->vp_ip;
-			} else if (vp->da == attr_packet_src_port) {
-				request->packet->socket.inet.src_port = vp->vp_uint16;
-			} else if (vp->da == attr_packet_dst_port) {
-				request->packet->socket.inet.dst_port = vp->vp_uint16;
-			} else if (vp->da == attr_protocol) {
-				request->dict = fr_dict_by_protocol_num(vp->vp_uint32);
-				if (!request->dict) {
-					REDEBUG("Invalid protocol: %pP", vp);
-					goto error;
-				}
-			}
-		}
+		if (vp && (decode_packet_pair(request, vp) < 0)) goto error;
 
 	next:
 		lineno++;
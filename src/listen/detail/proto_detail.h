@@ -89,15 +89,20 @@ struct proto_detail_work_s {
 	bool				track_progress;		//!< do we track progress by writing?
 	bool				retransmit;		//!< are we retransmitting on error?
 	bool				immediate;		//!< start reading the detail files immediately
+	bool				session_order;		//!< don't process records for the same
+								///< session in parallel.
 
 	int				mode;			//!< O_RDWR or O_RDONLY
 
 	fr_rb_node_t			filename_node;		//!< for dedup
 
 	RADCLIENT			*client;		//!< so the rest of the server doesn't complain
+
+	fr_dict_attr_t const		*attr_acct_session_id;	//!< for ordering binary records.
 };
 
 typedef struct proto_detail_work_thread_s proto_detail_work_thread_t;
+typedef struct fr_detail_entry_s fr_detail_entry_t;
 
 struct proto_detail_work_thread_s {
 	char const			*name;			//!< debug name for printing
@@ -114,6 +119,10 @@ struct proto_detail_work_thread_s {
 	char const			*filename_work;		//!< work file name
 	fr_dlist_head_t			list;			//!< for retransmissions
 
+	fr_rb_tree_t			*sessions;		//!< outstanding entries, keyed on session.
+	fr_detail_entry_t		*blocked;		//!< entry waiting for an outstanding entry
+								///< for the same session to complete.
+
 	uint32_t       			outstanding;		//!< number of currently outstanding records;
 	fr_time_delta_t			lock_interval;		//!< interval between trying the locks.
 
@@ -133,6 +142,10 @@ struct proto_detail_work_thread_s {
 	off_t				header_offset;		//!< offset of the current header we're reading
 	off_t				read_offset;		//!< where we're reading from in filename_work
 
+	uint8_t				*map;			//!< mmap of a binary format file.  NULL for
+								///< text format files.
+	size_t				map_len;		//!< length of the mapped region.
+
 	fr_event_timer_t const		*ev;			//!< for detail file timers.
 
 	pthread_mutex_t			worker_mutex;		//!< for the workers
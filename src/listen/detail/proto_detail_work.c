@@ -23,7 +23,9 @@
  * @copyright 2017 Alan DeKok (aland@deployingradius.com)
  */
 #include <netdb.h>
+#include <freeradius-devel/internal/internal.h>
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/detail.h>
 #include <freeradius-devel/server/protocol.h>
 #include <freeradius-devel/io/base.h>
 #include <freeradius-devel/io/application.h>
@@ -34,6 +36,7 @@
 #include "proto_detail.h"
 
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #ifndef NDEBUG
@@ -51,7 +54,9 @@
 #define MPRINT(_x, ...)
 #endif
 
-typedef struct {
+#define SESSION_ID_PREFIX "\tAcct-Session-Id = "
+
+struct fr_detail_entry_s {
 	proto_detail_work_thread_t	*parent;		//!< talloc_parent is SLOW!
 	fr_time_t			timestamp;		//!< when we read the entry.
 	off_t				done_offset;		//!< where we're tracking the status
@@ -64,7 +69,12 @@ typedef struct {
 	fr_retry_t			retry;			//!< our retry timers
 	fr_event_timer_t const		*ev;			//!< retransmission timer
 	fr_dlist_t			entry;			//!< for the retransmission list
-} fr_detail_entry_t;
+
+	uint32_t			session_hash;		//!< hash of Acct-Session-Id.
+	bool				has_session;		//!< whether the record has an Acct-Session-Id.
+	bool				in_sessions;		//!< whether we're in the sessions tree.
+	fr_rb_node_t			session_node;		//!< for the sessions tree.
+};
 
 static CONF_PARSER limit_config[] = {
 	{ FR_CONF_OFFSET("initial_rtx_time", FR_TYPE_TIME_DELTA, proto_detail_work_t, retry_config.irt), .dflt = STRINGIFY(2) },
@@ -79,6 +89,7 @@ static CONF_PARSER limit_config[] = {
 	 */
 	{ FR_CONF_OFFSET("max_rtx_duration", FR_TYPE_TIME_DELTA, proto_detail_work_t, retry_config.mrd), .dflt = STRINGIFY(0) },
 	{ FR_CONF_OFFSET("maximum_outstanding", FR_TYPE_UINT32, proto_detail_work_t, max_outstanding), .dflt = STRINGIFY(1) },
+	{ FR_CONF_OFFSET("session_order", FR_TYPE_BOOL, proto_detail_work_t, session_order), .dflt = "yes" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -143,6 +154,243 @@ static fr_event_update_t resume_read[] = {
 	{ 0 }
 };
 
+static int8_t session_cmp(void const *one, void const *two)
+{
+	fr_detail_entry_t const *a = one, *b = two;
+
+	return CMP(a->session_hash, b->session_hash);
+}
+
+/** Check whether an entry has to wait for another entry for the same session
+ *
+ * If it doesn't have to wait, the entry is recorded as outstanding for its
+ * session.
+ *
+ * @return
+ *	- true if the entry must wait.
+ *	- false if the entry can be processed now.
+ */
+static bool work_session_wait(proto_detail_work_thread_t *thread, fr_detail_entry_t *track)
+{
+	if (!thread->sessions || !track->has_session) return false;
+
+	if (fr_rb_find(thread->sessions, track)) return true;
+
+	if (fr_rb_insert(thread->sessions, track)) track->in_sessions = true;
+
+	return false;
+}
+
+/** Park an entry until the outstanding entry for the same session completes
+ *
+ * The entry counts as outstanding, and reading is paused until it's
+ * been released.
+ */
+static void work_session_block(proto_detail_work_thread_t *thread, fr_detail_entry_t *track,
+			       uint8_t const *buffer, size_t packet_len)
+{
+	fr_assert(!thread->blocked);
+
+	if (!track->packet) {
+		track->packet = talloc_memdup(track, buffer, packet_len);
+		track->packet_len = packet_len;
+	}
+
+	DEBUG("%s - packet %d waiting for an earlier packet from the same session",
+	      thread->name, track->id);
+
+	thread->blocked = track;
+	thread->outstanding++;
+
+	if (!thread->paused) {
+		(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, pause_read);
+		thread->paused = true;
+	}
+}
+
+/** Remove a completed entry from the sessions tree, and release any entry waiting on it
+ *
+ * The released entry is queued as if it were a retransmission, so that it's
+ * the next packet returned by mod_read().
+ */
+static void work_session_release(proto_detail_work_thread_t *thread, fr_detail_entry_t *track)
+{
+	fr_detail_entry_t *blocked = thread->blocked;
+
+	if (!track->in_sessions) return;
+
+	fr_rb_delete(thread->sessions, track);
+	track->in_sessions = false;
+
+	if (!blocked || (blocked->session_hash != track->session_hash)) return;
+
+	thread->blocked = NULL;
+	if (fr_rb_insert(thread->sessions, blocked)) blocked->in_sessions = true;
+	fr_dlist_insert_tail(&thread->list, blocked);
+}
+
+/** Find the Acct-Session-Id in a binary record
+ *
+ */
+static void work_session_binary(proto_detail_work_t const *inst, fr_detail_entry_t *track,
+				uint8_t const *record, size_t record_len)
+{
+	fr_pair_list_t	list;
+	fr_pair_t	*vp;
+	fr_dbuff_t	dbuff;
+
+	if (!inst->attr_acct_session_id) return;
+
+	fr_pair_list_init(&list);
+	fr_dbuff_init(&dbuff, record + FR_DETAIL_HDR_LEN, record_len - FR_DETAIL_HDR_LEN);
+	if (fr_internal_decode_list_dbuff(NULL, &list, inst->parent->dict, &dbuff, NULL) < 0) return;
+
+	vp = fr_pair_find_by_da(&list, inst->attr_acct_session_id, 0);
+	if (vp) {
+		track->session_hash = fr_hash(vp->vp_ptr, vp->vp_length);
+		track->has_session = true;
+	}
+	fr_pair_list_free(&list);
+}
+
+/** Read the next record from a binary format file
+ *
+ * Records are scanned directly from the mapped file, so there's no
+ * per-line parsing, and no leftover data to manage.  Records which have
+ * already been marked as done, or which fail validation are skipped.
+ */
+static ssize_t mod_read_binary(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread,
+			       void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len,
+			       size_t *leftover, uint32_t *priority)
+{
+	fr_detail_entry_t	*track;
+	uint8_t const		*p, *end;
+	size_t			record_len = 0;
+	uint32_t		payload_len;
+
+	fr_assert(*leftover == 0);
+
+	p = thread->map + thread->read_offset;
+	end = thread->map + thread->map_len;
+
+	while (p < end) {
+		if ((size_t)(end - p) < FR_DETAIL_HDR_LEN) {
+			ERROR("proto_detail (%s): Truncated record header at offset %zu in file %s",
+			      thread->name, (size_t)(p - thread->map), thread->filename_work);
+			p = end;
+			break;
+		}
+
+		/*
+		 *	If the header is corrupt, we can't find the
+		 *	start of the next record, so give up on the
+		 *	rest of the file.
+		 */
+		if (!fr_detail_is_binary(p, end - p) || (p[FR_DETAIL_HDR_VERSION] != FR_DETAIL_VERSION)) {
+			ERROR("proto_detail (%s): Malformed record header at offset %zu in file %s",
+			      thread->name, (size_t)(p - thread->map), thread->filename_work);
+			p = end;
+			break;
+		}
+
+		payload_len = fr_net_to_uint32(p + FR_DETAIL_HDR_LENGTH);
+		if (payload_len > (size_t)(end - (p + FR_DETAIL_HDR_LEN))) {
+			ERROR("proto_detail (%s): Truncated record at offset %zu in file %s",
+			      thread->name, (size_t)(p - thread->map), thread->filename_work);
+			p = end;
+			break;
+		}
+		record_len = FR_DETAIL_HDR_LEN + payload_len;
+
+		if (p[FR_DETAIL_HDR_FLAGS] & FR_DETAIL_FLAG_DONE) {
+		skip:
+			p += record_len;
+			record_len = 0;
+			continue;
+		}
+
+		if (fr_detail_checksum(p + FR_DETAIL_HDR_LEN, payload_len) != fr_net_to_uint32(p + FR_DETAIL_HDR_CHECKSUM)) {
+			ERROR("proto_detail (%s): Checksum mismatch for record at offset %zu in file %s",
+			      thread->name, (size_t)(p - thread->map), thread->filename_work);
+			goto skip;
+		}
+
+		if ((record_len > inst->parent->max_packet_size) || (record_len > buffer_len)) {
+			DEBUG("Ignoring 'too large' entry at offset %zu of %s",
+			      (size_t)(p - thread->map), thread->filename_work);
+			DEBUG("Entry size %zu is greater than allowed maximum %u",
+			      record_len, inst->parent->max_packet_size);
+			goto skip;
+		}
+
+		break;
+	}
+
+	if (record_len) {
+		memcpy(buffer, p, record_len);
+
+		track = talloc_zero(thread, fr_detail_entry_t);
+		track->parent = thread;
+		track->timestamp = fr_time();
+		track->id = thread->count++;
+		track->done_offset = (p - thread->map) + FR_DETAIL_HDR_FLAGS;
+		if (inst->retransmit) {
+			track->packet = talloc_memdup(track, buffer, record_len);
+			track->packet_len = record_len;
+		}
+
+		if (thread->sessions) work_session_binary(inst, track, p, record_len);
+
+		p += record_len;
+
+		*packet_ctx = track;
+		*recv_time_p = track->timestamp;
+		*priority = inst->parent->priority;
+	}
+
+	thread->read_offset = p - thread->map;
+
+	/*
+	 *	No more records, so close the file once the
+	 *	outstanding ones have been processed.
+	 */
+	if (p == end) {
+		thread->eof = true;
+		thread->closing = true;
+	}
+
+	if (!record_len) {
+		/*
+		 *	Every remaining record was skipped, and
+		 *	there are no replies to wait for, so
+		 *	there's nothing to trigger the close.
+		 */
+		if (thread->closing && !thread->outstanding) {
+			DEBUG("%s - No more records to process", thread->name);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (work_session_wait(thread, *packet_ctx)) {
+		work_session_block(thread, *packet_ctx, buffer, record_len);
+		*packet_ctx = NULL;
+		return 0;
+	}
+
+	thread->outstanding++;
+
+	/*
+	 *	Pause reading until such time as we need more packets.
+	 */
+	if (!thread->paused && (thread->outstanding >= inst->max_outstanding)) {
+		(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, pause_read);
+		thread->paused = true;
+	}
+
+	return record_len;
+}
+
 static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len, size_t *leftover, uint32_t *priority, UNUSED bool *is_dup)
 {
 	proto_detail_work_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_detail_work_t);
@@ -154,6 +402,8 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	uint8_t				*partial, *end, *next, *p, *record_end;
 	uint8_t				*stopped_search;
 	off_t				done_offset;
+	uint32_t			session_hash = 0;
+	bool				has_session = false;
 
 	fr_assert(*leftover < buffer_len);
 	fr_assert(thread->fd >= 0);
@@ -210,6 +460,20 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 		return 0;
 	}
 
+	/*
+	 *	Don't read past a record which is waiting for an
+	 *	earlier record from the same session.
+	 */
+	if (thread->blocked) {
+		fr_assert(thread->paused);
+		return 0;
+	}
+
+	if (thread->map) {
+		return mod_read_binary(inst, thread, packet_ctx, recv_time_p, buffer, buffer_len,
+				       leftover, priority);
+	}
+
 	/*
 	 *	If we've cached leftover data from the ring buffer,
 	 *	copy it back.
@@ -478,6 +742,16 @@ redo:
 		    (memcmp(p, "\tTimestamp", 10) == 0)) {
 			p++;
 			done_offset = thread->header_offset + (p - buffer);
+			continue;
+		}
+
+		if (thread->sessions && !has_session &&
+		    ((size_t)(record_end - p) > (sizeof(SESSION_ID_PREFIX) - 1)) &&
+		    (memcmp(p, SESSION_ID_PREFIX, sizeof(SESSION_ID_PREFIX) - 1) == 0)) {
+			uint8_t const *value = p + sizeof(SESSION_ID_PREFIX) - 1;
+
+			session_hash = fr_hash(value, strnlen((char const *) value, record_end - value));
+			has_session = true;
 		}
 	}
 
@@ -490,6 +764,8 @@ redo:
 	track->id = thread->count++;
 
 	track->done_offset = done_offset;
+	track->session_hash = session_hash;
+	track->has_session = has_session;
 	if (inst->retransmit) {
 		track->packet = talloc_memdup(track, buffer, packet_len);
 		track->packet_len = packet_len;
@@ -500,6 +776,24 @@ redo:
 	 */
 	thread->header_offset += packet_len;
 
+	/*
+	 *	An earlier packet for the same session is still
+	 *	being processed.  Hold on to this one, and keep the
+	 *	rest of the buffer for when we're resumed.
+	 */
+	if (work_session_wait(thread, track)) {
+		work_session_block(thread, track, buffer, packet_len);
+
+		if (*leftover) {
+			memmove(buffer, buffer + packet_len, *leftover);
+			(void) lseek(thread->fd, thread->read_offset - 1, SEEK_SET);
+		}
+
+		if (thread->eof) thread->closing = (*leftover == 0);
+		thread->last_search = 0;
+		return 0;
+	}
+
 	*packet_ctx = track;
 	*recv_time_p = track->timestamp;
 	*priority = inst->parent->priority;
@@ -550,7 +844,7 @@ static void work_retransmit(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, vo
 
 	fr_dlist_insert_tail(&thread->list, track);
 
-	if (thread->paused && (thread->outstanding < thread->inst->max_outstanding)) {
+	if (thread->paused && !thread->blocked && (thread->outstanding < thread->inst->max_outstanding)) {
 		(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, resume_read);
 		thread->paused = false;
 	}
@@ -625,6 +919,18 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 
 	} else if (inst->track_progress && (track->done_offset > 0)) {
 	mark_done:
+		/*
+		 *	Binary records have a flag in the header.
+		 */
+		if (thread->map) {
+			uint8_t flags = thread->map[track->done_offset] | FR_DETAIL_FLAG_DONE;
+
+			if (pwrite(thread->fd, &flags, sizeof(flags), track->done_offset) < 0) {
+				ERROR("%s - Failed marking entry as done: %s", thread->name, fr_syserror(errno));
+			}
+			goto free_track;
+		}
+
 		/*
 		 *	Seek to the entry, mark it as done, and then seek to
 		 *	the point in the file where we were reading from.
@@ -639,10 +945,15 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 free_track:
 	thread->outstanding--;
 
+	work_session_release(thread, track);
+
 	/*
 	 *	If we need to read some more packet, let's do so.
+	 *
+	 *	If a packet was waiting on this one, it's now on the
+	 *	retransmission list, and will be read next.
 	 */
-	if (thread->paused && (thread->outstanding < inst->max_outstanding)) {
+	if (thread->paused && !thread->blocked && (thread->outstanding < inst->max_outstanding)) {
 		(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, resume_read);
 		thread->paused = false;
 
@@ -682,6 +993,15 @@ static int mod_open(fr_listen_t *li)
 
 	fr_dlist_init(&thread->list, fr_detail_entry_t, entry);
 
+	/*
+	 *	Only needed if more than one packet can be
+	 *	outstanding.
+	 */
+	if (inst->session_order && (inst->max_outstanding > 1) && !thread->sessions) {
+		MEM(thread->sessions = fr_rb_inline_talloc_alloc(thread, fr_detail_entry_t, session_node,
+								 session_cmp, NULL));
+	}
+
 	/*
 	 *	Open the file if we haven't already been given one.
 	 */
@@ -714,6 +1034,32 @@ static int mod_open(fr_listen_t *li)
 		thread->file_size = 1;
 	}
 
+	/*
+	 *	Binary format files are mapped, and records are
+	 *	read directly from the map.
+	 */
+	{
+		uint8_t		magic[FR_DETAIL_MAGIC_LEN];
+		struct stat	buf;
+
+		if ((pread(thread->fd, magic, sizeof(magic), 0) == sizeof(magic)) &&
+		    fr_detail_is_binary(magic, sizeof(magic))) {
+			if (fstat(thread->fd, &buf) < 0) {
+				cf_log_err(inst->cs, "Failed examining %s: %s", thread->filename_work, fr_syserror(errno));
+				return -1;
+			}
+
+			thread->map_len = buf.st_size;
+			thread->map = mmap(NULL, thread->map_len, PROT_READ, MAP_SHARED, thread->fd, 0);
+			if (thread->map == MAP_FAILED) {
+				thread->map = NULL;
+				cf_log_err(inst->cs, "Failed mapping %s: %s", thread->filename_work, fr_syserror(errno));
+				return -1;
+			}
+			thread->file_size = buf.st_size;
+		}
+	}
+
 	fr_assert(thread->name == NULL);
 	fr_assert(thread->filename_work != NULL);
 	thread->name = talloc_typed_asprintf(thread, "detail_work reading file %s", thread->filename_work);
@@ -744,6 +1090,11 @@ static int mod_close_internal(proto_detail_work_thread_t *thread)
 
 	unlink(thread->filename_work);
 
+	if (thread->map) {
+		(void) munmap(thread->map, thread->map_len);
+		thread->map = NULL;
+	}
+
 	close(thread->fd);
 	thread->fd = -1;
 
@@ -832,6 +1183,11 @@ static int mod_instantiate(void *instance, UNUSED CONF_SECTION *cs)
 	client->longname = client->shortname = client->secret = inst->filename;
 	client->nas_type = talloc_strdup(client, "other");
 
+	if (inst->parent->dict) {
+		inst->attr_acct_session_id = fr_dict_attr_by_name(NULL, fr_dict_root(inst->parent->dict),
+								  "Acct-Session-Id");
+	}
+
 	return 0;
 }
 
@@ -237,14 +237,20 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 	if (!thread->connection) {
 		uint8_t const *code, *sid;
 		dhcp_packet_t *packet = (dhcp_packet_t *) buffer;
+		fr_dhcpv4_option_index_t idx;
 #ifdef WITH_IFINDEX_IPADDR_RESOLUTION
 		fr_ipaddr_t primary;
 #endif
 
 		/*
 		 *	This isn't available in the packet header.
+		 *	Index the options, as we may need more than
+		 *	one of them.
 		 */
-		code = fr_dhcpv4_packet_get_option(packet, buffer_len, attr_message_type);
+		code = NULL;
+		if (fr_dhcpv4_option_index_init(&idx, buffer, buffer_len) == 0) {
+			code = fr_dhcpv4_option_index_get(&idx, attr_message_type->attr);
+		}
 		if (!code || (code[1] < 1) || (code[2] == 0) || (code[2] > FR_DHCP_LEASE_ACTIVE)) {
 			WARN("Silently discarding reply due to invalid or missing message type");
 			return 0;
@@ -270,7 +276,7 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 			socket.inet.src_ipaddr = primary;
 #endif
 		} else if (((code[2] == FR_DHCP_OFFER) || (code[2] == FR_DHCP_ACK)) &&
-			   ((sid = fr_dhcpv4_packet_get_option(packet, buffer_len, attr_dhcp_server_identifier)) != NULL) &&
+			   ((sid = fr_dhcpv4_option_index_get(&idx, attr_dhcp_server_identifier->attr)) != NULL) &&
 			   (sid[1] == 4)) {
 			memcpy(&socket.inet.src_ipaddr.addr.v4.s_addr, sid + 2, 4);
 		}
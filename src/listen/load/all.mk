@@ -1,3 +1,4 @@
 SUBMAKEFILES := \
 	proto_load.mk \
+	proto_load_replay.mk \
 	proto_load_step.mk \
@@ -202,13 +202,17 @@ static int mod_decode(void const *instance, request_t *request, uint8_t *const d
 
 /*
  *	We don't need to encode any of the replies.  We just go "yeah, it's fine".
+ *
+ *	The transport is told the reply code, and the request code,
+ *	so that it can keep statistics per packet type.
  */
 static ssize_t mod_encode(UNUSED void const *instance, request_t *request, uint8_t *buffer, size_t buffer_len)
 {
-	if (buffer_len < 1) return -1;
+	if (buffer_len < 2) return -1;
 
-	*buffer = request->reply->code;
-	return 1;
+	buffer[0] = request->reply->code;
+	buffer[1] = request->packet->code;
+	return 2;
 }
 
 /** Open listen sockets/connect to external event source
@@ -0,0 +1,627 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_load_replay.c
+ * @brief Replay captured traffic from a detail file
+ *
+ * The packets in the detail file are sent with the same spacing as
+ * they were originally received, as given by their "Timestamp"
+ * lines.  The spacing is divided by "speed", so "speed = 10" replays
+ * an hour of traffic in six minutes.
+ *
+ * Detail files only record the time to the second.  Packets which
+ * were received in the same second are spread evenly over it.
+ *
+ * @copyright 2021 The FreeRADIUS server project.
+ */
+#include <ctype.h>
+#include <fcntl.h>
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/protocol.h>
+#include <freeradius-devel/radius/radius.h>
+#include <freeradius-devel/io/base.h>
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/schedule.h>
+#include <freeradius-devel/io/load.h>
+#include <freeradius-devel/util/debug.h>
+
+#include "proto_load.h"
+
+extern fr_app_io_t proto_load_replay;
+
+typedef struct proto_load_replay_s proto_load_replay_t;
+
+/** One packet from the detail file
+ *
+ */
+typedef struct {
+	fr_time_delta_t			offset;			//!< from the first packet, before scaling.
+	uint32_t			code;			//!< packet code
+	fr_pair_list_t			pair_list;		//!< attributes of the packet
+} proto_load_replay_entry_t;
+
+typedef struct {
+	fr_event_list_t			*el;			//!< event list
+	fr_network_t			*nr;			//!< network handler
+
+	char const			*name;			//!< socket name
+	bool				done;
+	bool				suspended;
+
+	fr_time_t			start;			//!< when the current pass through the file started
+	fr_time_t			recv_time;		//!< recv time of the last packet
+	uint32_t			next;			//!< next entry to send
+	uint32_t			current;		//!< entry being read by mod_read()
+
+	uint64_t			sent;			//!< total packets sent
+	uint64_t			received;		//!< total replies received
+
+	proto_load_replay_t const      	*inst;
+	fr_load_latency_t		*latency;		//!< latency histograms per packet type
+	fr_event_timer_t const		*ev;			//!< for sending packets
+	fr_event_timer_t const		*stats_ev;		//!< for writing statistics
+
+	fr_listen_t			*parent;		//!< master IO handler
+} proto_load_replay_thread_t;
+
+struct proto_load_replay_s {
+	proto_load_t			*parent;
+
+	CONF_SECTION			*cs;			//!< our configuration
+
+	char const     			*filename;		//!< detail file to replay
+	double				speed;			//!< how much faster than real time to replay
+	bool				repeat;			//!< start again at the end of the file
+
+	char const			*histogram;		//!< where to write latency histograms
+	char const			*histogram_format_str;
+	fr_load_latency_format_t	histogram_format;	//!< CSV or JSON
+
+	proto_load_replay_entry_t	*entries;		//!< talloc array of packets
+	uint32_t			num_entries;
+
+	RADCLIENT			*client;		//!< static client
+};
+
+
+static const CONF_PARSER replay_listen_config[] = {
+	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_INPUT | FR_TYPE_REQUIRED | FR_TYPE_NOT_EMPTY, proto_load_replay_t, filename) },
+	{ FR_CONF_OFFSET("speed", FR_TYPE_FLOAT64, proto_load_replay_t, speed), .dflt = "1.0" },
+	{ FR_CONF_OFFSET("repeat", FR_TYPE_BOOL, proto_load_replay_t, repeat) },
+
+	{ FR_CONF_OFFSET("histogram", FR_TYPE_STRING, proto_load_replay_t, histogram) },
+	{ FR_CONF_OFFSET("histogram_format", FR_TYPE_STRING, proto_load_replay_t, histogram_format_str), .dflt = "json" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+
+static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len, size_t *leftover, UNUSED uint32_t *priority, UNUSED bool *is_dup)
+{
+	proto_load_replay_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_load_replay_t);
+	proto_load_replay_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_load_replay_thread_t);
+	fr_io_address_t			*address, **address_p;
+
+	if (thread->done) return -1;
+
+	/*
+	 *	Suspend reading on the FD, because we let the timers
+	 *	take over the replay.
+	 */
+	if (!thread->suspended) {
+		static fr_event_update_t pause_read[] = {
+			FR_EVENT_SUSPEND(fr_event_io_func_t, read),
+			{ 0 }
+		};
+
+		if (fr_event_filter_update(thread->el, li->fd, FR_EVENT_FILTER_IO, pause_read) < 0) {
+			fr_assert(0);
+		}
+
+		thread->suspended = true;
+	}
+
+	*leftover = 0;
+
+	address_p = (fr_io_address_t **) packet_ctx;
+	address = *address_p;
+
+	memset(address, 0, sizeof(*address));
+	address->socket.inet.src_ipaddr.af = AF_INET;
+	address->socket.inet.dst_ipaddr.af = AF_INET;
+	address->radclient = inst->client;
+
+	*recv_time_p = thread->recv_time;
+
+	/*
+	 *	The "packet" is the index of the entry to decode.
+	 */
+	if (buffer_len < sizeof(thread->current)) {
+		DEBUG2("proto_load_replay read buffer is too small for input packet");
+		return 0;
+	}
+
+	memcpy(buffer, &thread->current, sizeof(thread->current));
+
+	DEBUG2("proto_load_replay - reading packet %u for %s", thread->current, thread->name);
+
+	return sizeof(thread->current);
+}
+
+/** Write the latency histograms
+ *
+ *  The file is re-written each time, so that it always holds the
+ *  histograms for the whole replay.
+ */
+static void write_histogram(proto_load_replay_thread_t *thread)
+{
+	proto_load_replay_t const	*inst = thread->inst;
+	char				*out;
+	int				fd;
+
+	if (!inst->histogram) return;
+
+	out = fr_load_latency_print(thread, thread->latency, inst->parent->attr_packet_type, inst->histogram_format);
+	if (!out) return;
+
+	fd = open(inst->histogram, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		DEBUG("Failed opening %s - %s", inst->histogram, fr_syserror(errno));
+		talloc_free(out);
+		return;
+	}
+
+	if (write(fd, out, talloc_array_length(out) - 1) < 0) {
+		DEBUG("Failed writing to %s - %s", inst->histogram, fr_syserror(errno));
+	}
+
+	close(fd);
+	talloc_free(out);
+}
+
+static void write_stats(fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	proto_load_replay_thread_t	*thread = uctx;
+
+	write_histogram(thread);
+
+	if (thread->done) return;
+
+	(void) fr_event_timer_in(thread, el, &thread->stats_ev, NSEC, write_stats, thread);
+}
+
+static ssize_t mod_write(fr_listen_t *li, UNUSED void *packet_ctx, fr_time_t request_time,
+			 uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
+{
+	proto_load_replay_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_load_replay_thread_t);
+
+	/*
+	 *	proto_load encodes the reply code, followed by the
+	 *	request code.
+	 */
+	fr_load_latency_add(thread->latency, (buffer_len >= 2) ? buffer[1] : thread->inst->parent->code,
+			    fr_time() - request_time);
+
+	thread->received++;
+
+	/*
+	 *	Everything has been sent, and all of the replies have
+	 *	come back.
+	 */
+	if (!thread->inst->repeat && (thread->next >= thread->inst->num_entries) &&
+	    (thread->received == thread->sent)) {
+		thread->done = true;
+		write_histogram(thread);
+		INFO("%s - replayed %" PRIu64 " packets", thread->name, thread->sent);
+	}
+
+	return buffer_len;
+}
+
+/** Scale an offset from the start of the file by the replay speed
+ *
+ */
+static inline fr_time_t replay_time(proto_load_replay_thread_t *thread, uint32_t idx)
+{
+	return thread->start + (fr_time_delta_t) (thread->inst->entries[idx].offset / thread->inst->speed);
+}
+
+/** Send all of the packets which are due, and wait for the next one
+ *
+ */
+static void replay_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	fr_listen_t			*li = uctx;
+	proto_load_replay_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_load_replay_thread_t);
+	proto_load_replay_t const	*inst = thread->inst;
+
+	for (;;) {
+		fr_time_t when;
+
+		/*
+		 *	Start again one (scaled) second after the last
+		 *	packet, which is the resolution of the file.
+		 */
+		if (thread->next >= inst->num_entries) {
+			if (!inst->repeat) return;
+
+			thread->next = 0;
+			thread->start = now + (fr_time_delta_t) (NSEC / inst->speed);
+		}
+
+		when = replay_time(thread, thread->next);
+		if (when > now) break;
+
+		/*
+		 *	The request time is when the packet should
+		 *	have been sent, so that a slow server shows up
+		 *	in the latency.  It has to be unique, as the
+		 *	master IO handler uses it to find the request.
+		 */
+		if (when <= thread->recv_time) when = thread->recv_time + 1;
+		thread->recv_time = when;
+		thread->current = thread->next++;
+		thread->sent++;
+
+		/*
+		 *	Tell the network side to call our read routine.
+		 */
+		fr_network_listen_read(thread->nr, thread->parent);
+	}
+
+	if (fr_event_timer_at(thread, el, &thread->ev, replay_time(thread, thread->next), replay_timer, li) < 0) {
+		ERROR("%s - Failed inserting replay timer", thread->name);
+	}
+}
+
+/** Open a replay listener
+ *
+ */
+static int mod_open(fr_listen_t *li)
+{
+	proto_load_replay_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_load_replay_t);
+	proto_load_replay_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_load_replay_thread_t);
+
+	fr_ipaddr_t			ipaddr;
+
+	/*
+	 *	We never read or write to this file, but we need a
+	 *	readable FD in order to bootstrap the process.
+	 */
+	li->fd = open(inst->filename, O_RDONLY);
+
+	memset(&ipaddr, 0, sizeof(ipaddr));
+	ipaddr.af = AF_INET;
+	li->app_io_addr = fr_socket_addr_alloc_inet_src(li, IPPROTO_UDP, 0, &ipaddr, 0);
+
+	fr_assert((cf_parent(inst->cs) != NULL) && (cf_parent(cf_parent(inst->cs)) != NULL));	/* listen { ... } */
+
+	thread->name = talloc_typed_asprintf(thread, "load_replay from filename %s", inst->filename);
+	thread->parent = talloc_parent(li);
+
+	return 0;
+}
+
+
+/** Decode the packet
+ *
+ */
+static int mod_decode(void const *instance, request_t *request, uint8_t *const data, size_t data_len)
+{
+	proto_load_replay_t const	*inst = talloc_get_type_abort_const(instance, proto_load_replay_t);
+	fr_io_track_t const		*track = talloc_get_type_abort_const(request->async->packet_ctx, fr_io_track_t);
+	fr_io_address_t const  		*address = track->address;
+	proto_load_replay_entry_t const	*entry;
+	uint32_t			idx;
+
+	if (data_len < sizeof(idx)) return -1;
+
+	memcpy(&idx, data, sizeof(idx));
+	if (idx >= inst->num_entries) return -1;
+
+	entry = &inst->entries[idx];
+
+	request->dict = inst->parent->dict;
+
+	/*
+	 *	Hacks for now until we have a lower-level decode routine.
+	 */
+	request->packet->code = entry->code;
+	request->packet->id = fr_rand() & 0xff;
+	request->reply->id = request->packet->id;
+	memset(request->packet->vector, 0, sizeof(request->packet->vector));
+
+	request->packet->data = talloc_zero_array(request->packet, uint8_t, 1);
+	request->packet->data_len = 1;
+
+	(void) fr_pair_list_copy(request->request_ctx, &request->request_pairs, &entry->pair_list);
+
+	request->client = UNCONST(RADCLIENT *, address->radclient);
+
+	request->packet->socket = address->socket;
+	fr_socket_addr_swap(&request->reply->socket, &address->socket);
+
+	REQUEST_VERIFY(request);
+
+	return 0;
+}
+
+/** Set the event list for a new socket
+ *
+ * @param[in] li the listener
+ * @param[in] el the event list
+ * @param[in] nr context from the network side
+ */
+static void mod_event_list_set(fr_listen_t *li, fr_event_list_t *el, void *nr)
+{
+	proto_load_replay_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_load_replay_t);
+	proto_load_replay_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_load_replay_thread_t);
+
+	thread->el = el;
+	thread->nr = nr;
+	thread->inst = inst;
+
+	thread->latency = fr_load_latency_alloc(thread);
+	if (!thread->latency) return;
+
+	if (!inst->num_entries) {
+		WARN("%s - No packets to replay", thread->name);
+		thread->done = true;
+		return;
+	}
+
+	thread->start = fr_time();
+
+	if (fr_event_timer_at(thread, el, &thread->ev, replay_time(thread, 0), replay_timer, li) < 0) {
+		ERROR("%s - Failed inserting replay timer", thread->name);
+		return;
+	}
+
+	if (inst->histogram) (void) fr_event_timer_in(thread, el, &thread->stats_ev, NSEC, write_stats, thread);
+}
+
+static char const *mod_name(fr_listen_t *li)
+{
+	proto_load_replay_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_load_replay_thread_t);
+
+	return thread->name;
+}
+
+
+static int mod_bootstrap(void *instance, CONF_SECTION *cs)
+{
+	proto_load_replay_t	*inst = talloc_get_type_abort(instance, proto_load_replay_t);
+	dl_module_inst_t const	*dl_inst;
+	int			format;
+
+	/*
+	 *	Find the dl_module_inst_t holding our instance data
+	 *	so we can find out what the parent of our instance
+	 *	was.
+	 */
+	dl_inst = dl_module_instance_by_data(instance);
+	fr_assert(dl_inst);
+
+	inst->parent = talloc_get_type_abort(dl_inst->parent->data, proto_load_t);
+
+	inst->cs = cs;
+
+	if ((inst->speed < 0.001) || (inst->speed > 1000000)) {
+		cf_log_err(cs, "Invalid value for 'speed' - must be between 0.001 and 1000000");
+		return -1;
+	}
+
+	format = fr_table_value_by_str(fr_load_latency_format_table, inst->histogram_format_str, -1);
+	if (format < 0) {
+		cf_log_err(cs, "Invalid value for 'histogram_format' - must be 'csv' or 'json'");
+		return -1;
+	}
+	inst->histogram_format = format;
+
+	return 0;
+}
+
+static RADCLIENT *mod_client_find(fr_listen_t *li, UNUSED fr_ipaddr_t const *ipaddr, UNUSED int ipproto)
+{
+	proto_load_replay_t const       *inst = talloc_get_type_abort_const(li->app_io_instance, proto_load_replay_t);
+
+	return inst->client;
+}
+
+/** Finish an entry read from the detail file
+ *
+ */
+static void replay_entry_done(proto_load_replay_t *inst, proto_load_replay_entry_t *entry, time_t timestamp)
+{
+	fr_pair_t *vp;
+
+	entry->offset = (fr_time_delta_t) timestamp * NSEC;
+
+	vp = fr_pair_find_by_da(&entry->pair_list, inst->parent->attr_packet_type, 0);
+	entry->code = vp ? vp->vp_uint32 : inst->parent->code;
+
+	inst->num_entries++;
+}
+
+/** Read the detail file
+ *
+ *  Each entry starts with a date line, followed by one attribute per
+ *  line, each beginning with a tab.  Entries end with a blank line.
+ *  The "Timestamp" line gives the time at which the packet was
+ *  received.
+ */
+static int replay_file_read(proto_load_replay_t *inst, CONF_SECTION *cs)
+{
+	FILE				*fp;
+	char				buffer[8192];
+	proto_load_replay_entry_t	*entry = NULL;
+	time_t				timestamp = 0, first = 0;
+	bool				have_first = false;
+	int				lineno = 0;
+	uint32_t			i, j;
+
+	fp = fopen(inst->filename, "r");
+	if (!fp) {
+		cf_log_err(cs, "Failed reading %s - %s", inst->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	inst->entries = talloc_array(inst, proto_load_replay_entry_t, 64);
+	if (!inst->entries) {
+	oom:
+		cf_log_err(cs, "Out of memory");
+		fclose(fp);
+		return -1;
+	}
+
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		char		*p = buffer;
+		fr_pair_list_t	tmp_list;
+
+		lineno++;
+
+		/*
+		 *	Blank lines end the current entry.
+		 */
+		while (isspace((uint8_t) *p)) p++;
+		if (!*p) {
+			if (entry) replay_entry_done(inst, entry, timestamp);
+			entry = NULL;
+			continue;
+		}
+
+		/*
+		 *	The date line starts an entry, and is otherwise
+		 *	ignored.  So is anything before the first entry.
+		 */
+		if (p == buffer) {
+			if (entry) replay_entry_done(inst, entry, timestamp);
+			entry = NULL;
+
+			if (inst->num_entries == talloc_array_length(inst->entries)) {
+				proto_load_replay_entry_t *entries;
+
+				entries = talloc_realloc(inst, inst->entries, proto_load_replay_entry_t,
+							 inst->num_entries * 2);
+				if (!entries) goto oom;
+				inst->entries = entries;
+			}
+
+			entry = &inst->entries[inst->num_entries];
+			memset(entry, 0, sizeof(*entry));
+			fr_pair_list_init(&entry->pair_list);
+			continue;
+		}
+
+		if (!entry) continue;
+
+		if (strncasecmp(p, "Timestamp = ", 12) == 0) {
+			timestamp = atol(p + 12);
+			if (!have_first) {
+				first = timestamp;
+				have_first = true;
+			}
+			timestamp -= first;
+			if (timestamp < 0) timestamp = 0;
+			continue;
+		}
+
+		if ((strncasecmp(p, "Donestamp", 9) == 0) ||
+		    (strncasecmp(p, "Request-Authenticator", 21) == 0)) continue;
+
+		fr_pair_list_init(&tmp_list);
+		if ((fr_pair_list_afrom_str(inst, inst->parent->dict, p, strlen(p), &tmp_list) <= 0) ||
+		    fr_pair_list_empty(&tmp_list)) {
+			cf_log_warn(cs, "%s[%d]: Ignoring line - %s", inst->filename, lineno, fr_strerror());
+			fr_pair_list_free(&tmp_list);
+			continue;
+		}
+
+		fr_pair_list_append(&entry->pair_list, &tmp_list);
+	}
+
+	if (entry) replay_entry_done(inst, entry, timestamp);
+
+	fclose(fp);
+
+	/*
+	 *	Spread the packets from each second evenly over that
+	 *	second.  The entries are in the order they were
+	 *	written, so timestamps can go backwards slightly.
+	 *	Those packets are sent along with their neighbours.
+	 */
+	for (i = 0; i < inst->num_entries; i = j) {
+		fr_time_delta_t second = inst->entries[i].offset;
+		uint32_t	k, n;
+
+		for (j = i + 1; (j < inst->num_entries) && (inst->entries[j].offset <= second); j++) {
+			inst->entries[j].offset = second;
+		}
+
+		n = j - i;
+		for (k = 1; k < n; k++) inst->entries[i + k].offset += (NSEC * (fr_time_delta_t) k) / n;
+	}
+
+	return 0;
+}
+
+static int mod_instantiate(void *instance, CONF_SECTION *cs)
+{
+	proto_load_replay_t	*inst = talloc_get_type_abort(instance, proto_load_replay_t);
+	RADCLIENT		*client;
+
+	inst->client = client = talloc_zero(inst, RADCLIENT);
+	if (!inst->client) return 0;
+
+	client->ipaddr.af = AF_INET;
+	client->src_ipaddr = client->ipaddr;
+
+	client->longname = client->shortname = inst->filename;
+	client->secret = talloc_strdup(client, "testing123");
+	client->nas_type = talloc_strdup(client, "load");
+	client->use_connected = false;
+
+	if (replay_file_read(inst, cs) < 0) return -1;
+
+	cf_log_debug(cs, "Read %u packets from %s", inst->num_entries, inst->filename);
+
+	return 0;
+}
+
+fr_app_io_t proto_load_replay = {
+	.magic			= RLM_MODULE_INIT,
+	.name			= "load_replay",
+	.config			= replay_listen_config,
+	.inst_size		= sizeof(proto_load_replay_t),
+	.thread_inst_size	= sizeof(proto_load_replay_thread_t),
+	.bootstrap		= mod_bootstrap,
+	.instantiate		= mod_instantiate,
+
+	.default_message_size	= 4096,
+	.track_duplicates	= false,
+
+	.open			= mod_open,
+	.read			= mod_read,
+	.write			= mod_write,
+	.event_list_set		= mod_event_list_set,
+	.client_find		= mod_client_find,
+	.get_name      		= mod_name,
+
+	.decode			= mod_decode,
+};
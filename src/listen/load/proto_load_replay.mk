@@ -0,0 +1,9 @@
+TARGETNAME	:= proto_load_replay
+
+ifneq "$(TARGETNAME)" ""
+TARGET		:= $(TARGETNAME).a
+endif
+
+SOURCES		:= proto_load_replay.c
+
+TGT_PREREQS	:= libfreeradius-util.a
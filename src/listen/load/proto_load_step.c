@@ -54,6 +54,7 @@ typedef struct {
 	fr_load_t			*l;			//!< load generation handler
 	fr_load_config_t		load;			//!< load configuration
 	fr_stats_t			stats;			//!< statistics for this socket
+	fr_load_latency_t		*latency;		//!< latency histograms per packet type
 
 	int				fd;			//!< for CSV files
 	fr_event_timer_t const		*ev;			//!< for writing statistics
@@ -77,12 +78,18 @@ struct proto_load_step_s {
 	fr_load_config_t		load;			//!< load configuration
 	bool				repeat;			//!, do we repeat the load generation
 	char const     			*csv;			//!< where to write CSV stats
+
+	char const			*histogram;		//!< where to write latency histograms
+	char const			*histogram_format_str;
+	fr_load_latency_format_t	histogram_format;	//!< CSV or JSON
 };
 
 
 static const CONF_PARSER load_listen_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_INPUT | FR_TYPE_REQUIRED | FR_TYPE_NOT_EMPTY, proto_load_step_t, filename) },
 	{ FR_CONF_OFFSET("csv", FR_TYPE_STRING, proto_load_step_t, csv) },
+	{ FR_CONF_OFFSET("histogram", FR_TYPE_STRING, proto_load_step_t, histogram) },
+	{ FR_CONF_OFFSET("histogram_format", FR_TYPE_STRING, proto_load_step_t, histogram_format_str), .dflt = "json" },
 
 	{ FR_CONF_OFFSET("max_attributes", FR_TYPE_UINT32, proto_load_step_t, max_attributes), .dflt = STRINGIFY(RADIUS_MAX_ATTRIBUTES) } ,
 
@@ -156,12 +163,50 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 }
 
 
+/** Write the latency histograms
+ *
+ *  The file is re-written each time, so that it always holds the
+ *  histograms for the whole test.
+ */
+static void write_histogram(proto_load_step_thread_t *thread)
+{
+	proto_load_step_t const	*inst = thread->inst;
+	char			*out;
+	int			fd;
+
+	if (!inst->histogram) return;
+
+	out = fr_load_latency_print(thread, thread->latency, inst->parent->attr_packet_type, inst->histogram_format);
+	if (!out) return;
+
+	fd = open(inst->histogram, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		DEBUG("Failed opening %s - %s", inst->histogram, fr_syserror(errno));
+		talloc_free(out);
+		return;
+	}
+
+	if (write(fd, out, talloc_array_length(out) - 1) < 0) {
+		DEBUG("Failed writing to %s - %s", inst->histogram, fr_syserror(errno));
+	}
+
+	close(fd);
+	talloc_free(out);
+}
+
 static ssize_t mod_write(fr_listen_t *li, UNUSED void *packet_ctx, fr_time_t request_time,
-			 UNUSED uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
+			 uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
 {
 	proto_load_step_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_load_step_thread_t);
 	fr_load_reply_t state;
 
+	/*
+	 *	proto_load encodes the reply code, followed by the
+	 *	request code.
+	 */
+	fr_load_latency_add(thread->latency, (buffer_len >= 2) ? buffer[1] : thread->inst->code,
+			    fr_time() - request_time);
+
 	/*
 	 *	@todo - share a stats interface with the parent?  or
 	 *	put the stats in the listener, so that proto_radius
@@ -176,6 +221,8 @@ static ssize_t mod_write(fr_listen_t *li, UNUSED void *packet_ctx, fr_time_t req
 	 */
 	state = fr_load_generator_have_reply(thread->l, request_time);
 	if (state == FR_LOAD_DONE) {
+		write_histogram(thread);
+
 		if (!thread->inst->repeat) {
 			thread->done = true;
 		} else {
@@ -244,6 +291,10 @@ static void write_stats(fr_event_list_t *el, fr_time_t now, void *uctx)
 
 	(void) fr_event_timer_in(thread, el, &thread->ev, NSEC, write_stats, thread);
 
+	write_histogram(thread);
+
+	if (thread->fd < 0) return;
+
 	len = fr_load_generator_stats_sprint(thread->l, now, buffer, sizeof(buffer));
 	if (write(thread->fd, buffer, len) < 0) {
 		DEBUG("Failed writing to %s - %s", thread->inst->csv, fr_syserror(errno));
@@ -315,12 +366,21 @@ static void mod_event_list_set(fr_listen_t *li, fr_event_list_t *el, void *nr)
 	thread->nr = nr;
 	thread->inst = inst;
 	thread->load = inst->load;
+	thread->fd = -1;
+
+	thread->latency = fr_load_latency_alloc(thread);
+	if (!thread->latency) return;
 
 	thread->l = fr_load_generator_create(thread, el, &thread->load, mod_generate, li);
 	if (!thread->l) return;
 
 	(void) fr_load_generator_start(thread->l);
 
+	if (inst->histogram && !inst->csv) {
+		(void) fr_event_timer_in(thread, thread->el, &thread->ev, NSEC, write_stats, thread);
+		return;
+	}
+
 	if (!inst->csv) return;
 
 	thread->fd = open(inst->csv, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
@@ -349,6 +409,7 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 {
 	proto_load_step_t	*inst = talloc_get_type_abort(instance, proto_load_step_t);
 	dl_module_inst_t const	*dl_inst;
+	int			format;
 
 	/*
 	 *	Find the dl_module_inst_t holding our instance data
@@ -381,6 +442,13 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 	FR_INTEGER_BOUND_CHECK("max_backlog", inst->load.milliseconds, >=, 1);
 	FR_INTEGER_BOUND_CHECK("max_backlog", inst->load.milliseconds, <, 100000);
 
+	format = fr_table_value_by_str(fr_load_latency_format_table, inst->histogram_format_str, -1);
+	if (format < 0) {
+		cf_log_err(cs, "Invalid value for 'histogram_format' - must be 'csv' or 'json'");
+		return -1;
+	}
+	inst->histogram_format = format;
+
 	return 0;
 }
 
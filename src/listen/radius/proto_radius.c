@@ -28,8 +28,17 @@
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/protocol/radius/freeradius.h>
 #include "proto_radius.h"
 
+#include <pthread.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 extern fr_app_t proto_radius;
 
 static int type_parse(TALLOC_CTX *ctx, void *out, UNUSED void *parent, CONF_ITEM *ci, CONF_PARSER const *rule);
@@ -44,6 +53,11 @@ static CONF_PARSER const limit_config[] = {
 	{ FR_CONF_OFFSET("max_clients", FR_TYPE_UINT32, proto_radius_t, io.max_clients), .dflt = "256" } ,
 	{ FR_CONF_OFFSET("max_pending_packets", FR_TYPE_UINT32, proto_radius_t, io.max_pending_packets), .dflt = "256" } ,
 
+	{ FR_CONF_OFFSET("max_packet_rate", FR_TYPE_UINT32, proto_radius_t, io.max_packet_rate), .dflt = "0" } ,
+	{ FR_CONF_OFFSET("max_packet_burst", FR_TYPE_UINT32, proto_radius_t, io.max_packet_burst), .dflt = "0" } ,
+	{ FR_CONF_OFFSET("max_network_packet_rate", FR_TYPE_UINT32, proto_radius_t, io.max_network_packet_rate), .dflt = "0" } ,
+	{ FR_CONF_OFFSET("rate_limit_defer", FR_TYPE_BOOL, proto_radius_t, io.rate_limit_defer), .dflt = "no" } ,
+
 	/*
 	 *	For performance tweaking.  NOT for normal humans.
 	 */
@@ -68,6 +82,20 @@ static const CONF_PARSER priority_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER overload_config[] = {
+	{ FR_CONF_OFFSET("reject", FR_TYPE_BOOL, proto_radius_t, overload_reject), .dflt = "no" },
+	{ FR_CONF_OFFSET("reply_message", FR_TYPE_STRING, proto_radius_t, overload_reply_message) },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static const CONF_PARSER status_server_config[] = {
+	{ FR_CONF_OFFSET("network", FR_TYPE_BOOL, proto_radius_t, status_network), .dflt = "no" },
+	{ FR_CONF_OFFSET("interval", FR_TYPE_TIME_DELTA, proto_radius_t, status_interval), .dflt = "1.0" },
+
+	CONF_PARSER_TERMINATOR
+};
+
 /** How to parse a RADIUS listen section
  *
  */
@@ -83,8 +111,20 @@ static CONF_PARSER const proto_radius_config[] = {
 	 */
 	{ FR_CONF_OFFSET("tunnel_password_zeros", FR_TYPE_BOOL, proto_radius_t, tunnel_password_zeros) } ,
 
+	/*
+	 *	Open one SO_REUSEPORT socket per network thread.
+	 */
+	{ FR_CONF_OFFSET("network_shards", FR_TYPE_BOOL, proto_radius_t, io.network_shards) } ,
+
+	/*
+	 *	Re-use the encoded attributes of identical replies.
+	 */
+	{ FR_CONF_OFFSET("reply_cache", FR_TYPE_UINT32, proto_radius_t, reply_cache), .dflt = "0" } ,
+
 	{ FR_CONF_POINTER("limit", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) limit_config },
 	{ FR_CONF_POINTER("priority", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) priority_config },
+	{ FR_CONF_POINTER("overload", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) overload_config },
+	{ FR_CONF_POINTER("status_server", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) status_server_config },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -97,13 +137,23 @@ fr_dict_autoload_t proto_radius_dict[] = {
 	{ NULL }
 };
 
+static fr_dict_attr_t const *attr_message_authenticator;
 static fr_dict_attr_t const *attr_packet_type;
+static fr_dict_attr_t const *attr_reply_message;
 static fr_dict_attr_t const *attr_user_name;
+static fr_dict_attr_t const *attr_freeradius_stats4_name;
+static fr_dict_attr_t const *attr_freeradius_stats4_packet_counters;
+static fr_dict_attr_t const *attr_freeradius_stats4_type;
 
 extern fr_dict_attr_autoload_t proto_radius_dict_attr[];
 fr_dict_attr_autoload_t proto_radius_dict_attr[] = {
+	{ .out = &attr_message_authenticator, .name = "Message-Authenticator", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
 	{ .out = &attr_packet_type, .name = "Packet-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius},
+	{ .out = &attr_reply_message, .name = "Reply-Message", .type = FR_TYPE_STRING, .dict = &dict_radius},
 	{ .out = &attr_user_name, .name = "User-Name", .type = FR_TYPE_STRING, .dict = &dict_radius},
+	{ .out = &attr_freeradius_stats4_name, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-Name", .type = FR_TYPE_STRING, .dict = &dict_radius },
+	{ .out = &attr_freeradius_stats4_packet_counters, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-Packet-Counters", .type = FR_TYPE_TLV, .dict = &dict_radius },
+	{ .out = &attr_freeradius_stats4_type, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius },
 	{ NULL }
 };
 
@@ -216,7 +266,11 @@ static int mod_decode(void const *instance, request_t *request, uint8_t *const d
 	request->reply->id = data[1];
 	memcpy(request->packet->vector, data + 4, sizeof(request->packet->vector));
 
-	request->packet->data = talloc_memdup(request->packet, data, data_len);
+	if (request->async->zero_copy) {
+		request->packet->data = data;
+	} else {
+		request->packet->data = talloc_memdup(request->packet, data, data_len);
+	}
 	request->packet->data_len = data_len;
 
 	/*
@@ -289,6 +343,199 @@ static int mod_decode(void const *instance, request_t *request, uint8_t *const d
 	return inst->io.app_io->decode(inst->io.app_io_instance, request, data, data_len);
 }
 
+/** A previously encoded reply
+ *
+ */
+typedef struct {
+	uint32_t		hash;		//!< Of the packet code and the encodable attributes.
+	uint8_t			code;		//!< Packet code.
+	fr_pair_list_t		vps;		//!< Copy of the encodable attributes.
+	uint8_t			*data;		//!< Encoded packet, before it was signed.
+	size_t			data_len;	//!< Length of the encoded packet.
+} proto_radius_reply_t;
+
+typedef struct proto_radius_reply_cache_s proto_radius_reply_cache_t;
+
+/** Encoded replies, indexed by hash
+ *
+ *  Replies are often identical except for the ID and authenticator,
+ *  e.g. an Access-Accept with a fixed VLAN and Session-Timeout, or an
+ *  empty Accounting-Response.  These only depend on the code and on
+ *  the attributes, and not on the client or the request, so one
+ *  cache per thread is shared by all clients of a listener.
+ */
+struct proto_radius_reply_cache_s {
+	proto_radius_t const	*inst;		//!< Listener the cache is for, and sized by.
+	uint32_t		size;		//!< Number of entries.
+	proto_radius_reply_t	*entries;	//!< Direct mapped, new replies overwrite old ones.
+	proto_radius_reply_cache_t *next;	//!< Cache of the next listener.
+};
+
+static _Thread_local proto_radius_reply_cache_t *reply_caches;
+
+static void _reply_cache_free_on_exit(void *arg)
+{
+	talloc_free(arg);
+}
+
+/** Add an attribute, and any children, to the hash of a reply
+ *
+ * @return
+ *	- true if the attribute can be cached.
+ *	- false if it's encrypted, as that depends on the request.
+ */
+static bool reply_cache_hash(uint32_t *hash, fr_pair_t const *vp)
+{
+	fr_pair_t const *child;
+
+	if (flag_encrypted(&vp->da->flags)) return false;
+
+	*hash = fr_hash_update(&vp->da, sizeof(vp->da), *hash);
+
+	switch (vp->da->type) {
+	case FR_TYPE_STRUCTURAL:
+		for (child = fr_pair_list_head(&vp->vp_group);
+		     child;
+		     child = fr_pair_list_next(&vp->vp_group, child)) {
+			if (!reply_cache_hash(hash, child)) return false;
+		}
+		break;
+
+	default:
+		*hash = fr_hash_update(&(uint32_t){ fr_value_box_hash(&vp->data) }, sizeof(uint32_t), *hash);
+		break;
+	}
+
+	return true;
+}
+
+/** Find this thread's reply cache for a listener, creating it if needed
+ *
+ */
+static proto_radius_reply_cache_t *reply_cache_get(proto_radius_t const *inst)
+{
+	proto_radius_reply_cache_t	*cache, **tail;
+	uint32_t			i;
+
+	for (tail = &reply_caches; *tail; tail = &(*tail)->next) {
+		if ((*tail)->inst == inst) return *tail;
+	}
+
+	MEM(cache = talloc_zero(NULL, proto_radius_reply_cache_t));
+	MEM(cache->entries = talloc_zero_array(cache, proto_radius_reply_t, inst->reply_cache));
+	cache->inst = inst;
+	cache->size = inst->reply_cache;
+	for (i = 0; i < cache->size; i++) fr_pair_list_init(&cache->entries[i].vps);
+
+	fr_atexit_thread_local(*tail, _reply_cache_free_on_exit, cache);
+
+	return cache;
+}
+
+/** Find an encoded reply with the same code and attributes as this one
+ *
+ * @param[out] slot	Where the reply should be cached, or NULL if it can't be.
+ * @param[out] hash	Of the reply.
+ * @param[in] cache	of the listener.
+ * @param[in] request	the reply is for.
+ * @param[out] buffer	to copy the encoded reply into.
+ * @param[in] buffer_len	length of the buffer.
+ * @return
+ *	- >0 length of the encoded reply, which still needs to be signed.
+ *	- 0 if there is no matching reply.
+ */
+static ssize_t reply_cache_find(proto_radius_reply_t **slot, uint32_t *hash, proto_radius_reply_cache_t *cache,
+				request_t *request, uint8_t *buffer, size_t buffer_len)
+{
+	proto_radius_reply_t	*entry;
+	fr_pair_t		*vp, *cached;
+
+	*slot = NULL;
+
+	/*
+	 *	Protocol-Error contains the original packet code.
+	 */
+	if (request->reply->code == FR_RADIUS_CODE_PROTOCOL_ERROR) return 0;
+
+	/*
+	 *	Only hash the attributes which will be encoded, so
+	 *	that internal attributes don't prevent a match.
+	 */
+	*hash = fr_hash_update(&request->reply->code, sizeof(request->reply->code), 0);
+	fr_radius_foreach_encodable(&request->reply_pairs, encodable, dict_radius) {
+		if (!reply_cache_hash(hash, encodable)) return 0;
+	}
+
+	entry = &cache->entries[*hash % cache->size];
+	*slot = entry;
+
+	if (!entry->data || (entry->hash != *hash) || (entry->code != request->reply->code)) return 0;
+
+	/*
+	 *	The hash matches, check that the attributes do, too.
+	 */
+	for (vp = fr_radius_seek_encodable(&request->reply_pairs, fr_pair_list_head(&request->reply_pairs),
+					   dict_radius),
+	     cached = fr_pair_list_head(&entry->vps);
+	     vp && cached;
+	     vp = fr_radius_seek_encodable(&request->reply_pairs, fr_pair_list_next(&request->reply_pairs, vp),
+					   dict_radius),
+	     cached = fr_pair_list_next(&entry->vps, cached)) {
+		if (vp->da != cached->da) return 0;
+
+		switch (vp->da->type) {
+		case FR_TYPE_STRUCTURAL:
+			if (fr_pair_list_cmp(&vp->vp_group, &cached->vp_group) != 0) return 0;
+			break;
+
+		default:
+			if (fr_value_box_cmp(&vp->data, &cached->data) != 0) return 0;
+			break;
+		}
+	}
+	if (vp || cached) return 0;
+
+	if (entry->data_len > buffer_len) return 0;
+
+	memcpy(buffer, entry->data, entry->data_len);
+	buffer[1] = request->reply->id;
+
+	RDEBUG3("Using cached encoding of reply");
+
+	return entry->data_len;
+}
+
+/** Remember an encoded reply
+ *
+ */
+static void reply_cache_insert(proto_radius_reply_cache_t *cache, proto_radius_reply_t *entry, uint32_t hash,
+			       request_t *request, uint8_t const *data, size_t data_len)
+{
+	fr_pair_t	*copy;
+
+	fr_pair_list_free(&entry->vps);
+	TALLOC_FREE(entry->data);
+
+	fr_radius_foreach_encodable(&request->reply_pairs, vp, dict_radius) {
+		copy = fr_pair_copy(cache, vp);
+		if (!copy) {
+			fr_pair_list_free(&entry->vps);
+			return;
+		}
+		fr_pair_append(&entry->vps, copy);
+	}
+
+	entry->data = talloc_memdup(cache, data, data_len);
+	if (!entry->data) {
+		fr_pair_list_free(&entry->vps);
+		return;
+	}
+
+	entry->hash = hash;
+	entry->code = request->reply->code;
+	entry->data_len = data_len;
+}
+
 static ssize_t mod_encode(void const *instance, request_t *request, uint8_t *buffer, size_t buffer_len)
 {
 	proto_radius_t const	*inst = talloc_get_type_abort_const(instance, proto_radius_t);
@@ -296,6 +543,9 @@ static ssize_t mod_encode(void const *instance, request_t *request, uint8_t *buf
 	fr_io_address_t const  	*address = track->address;
 	ssize_t			data_len;
 	RADCLIENT const		*client;
+	proto_radius_reply_cache_t	*cache = NULL;
+	proto_radius_reply_t	*slot = NULL;
+	uint32_t		hash = 0;
 
 	/*
 	 *	Process layer NAK, or "Do not respond".
@@ -367,16 +617,27 @@ static ssize_t mod_encode(void const *instance, request_t *request, uint8_t *buf
 		request->reply->socket.inet.src_ipaddr = client->src_ipaddr;
 	}
 
-	data_len = fr_radius_encode(buffer, buffer_len, request->packet->data,
-				    client->secret, talloc_array_length(client->secret) - 1,
-				    request->reply->code, request->reply->id, &request->reply_pairs);
-	if (data_len < 0) {
-		RPEDEBUG("Failed encoding RADIUS reply");
-		return -1;
+	data_len = 0;
+	if (inst->reply_cache) {
+		cache = reply_cache_get(inst);
+		data_len = reply_cache_find(&slot, &hash, cache, request, buffer, buffer_len);
+	}
+
+	if (!data_len) {
+		data_len = fr_radius_encode(buffer, buffer_len, request->packet->data,
+					    client->secret, talloc_array_length(client->secret) - 1,
+					    request->reply->code, request->reply->id, &request->reply_pairs);
+		if (data_len < 0) {
+			RPEDEBUG("Failed encoding RADIUS reply");
+			return -1;
+		}
+
+		if (slot) reply_cache_insert(cache, slot, hash, request, buffer, data_len);
 	}
 
 	if (fr_radius_sign(buffer, request->packet->data,
-			   (uint8_t const *) client->secret, talloc_array_length(client->secret) - 1) < 0) {
+			   (uint8_t const *) client->secret, talloc_array_length(client->secret) - 1,
+			   client->secret_hmac) < 0) {
 		RPEDEBUG("Failed signing RADIUS reply");
 		return -1;
 	}
@@ -425,6 +686,176 @@ static int mod_priority_set(void const *instance, uint8_t const *buffer, UNUSED
 	return inst->priorities[buffer[0]];
 }
 
+/** Reply to a request which the worker refused because it's overloaded
+ *
+ * Accounting and CoA clients will retransmit, so they get no reply.
+ * NASes often retransmit Access-Requests to another server when
+ * there's no reply, which only moves the load around, so we can
+ * reject them instead.
+ */
+static int mod_overload(void const *instance, request_t *request)
+{
+	proto_radius_t const	*inst = talloc_get_type_abort_const(instance, proto_radius_t);
+	fr_pair_t		*vp;
+
+	if (!inst->overload_reject || (request->packet->code != FR_RADIUS_CODE_ACCESS_REQUEST)) return -1;
+
+	request->reply->code = FR_RADIUS_CODE_ACCESS_REJECT;
+
+	if (inst->overload_reply_message) {
+		MEM(pair_append_reply(&vp, attr_reply_message) >= 0);
+		fr_pair_value_strdup(vp, inst->overload_reply_message);
+	}
+
+	return 0;
+}
+
+/** Reply to Status-Server from the network thread
+ *
+ *  Monitoring systems send Status-Server often, and expect a reply
+ *  even when the server is busy.  The reply only depends on the
+ *  counters, so it's encoded at most once per interval, and each
+ *  reply is a copy which is then signed for the client.
+ */
+typedef struct proto_radius_status_s {
+	atomic_uint_fast64_t	received[FR_RADIUS_CODE_MAX];	//!< Requests received by this listener.
+
+	pthread_mutex_t		mutex;				//!< Protects the fields below, as there may
+								///< be multiple network threads.
+	fr_time_t		encoded;			//!< When the reply was encoded.
+	uint8_t			data[MAX_PACKET_LEN];		//!< Encoded reply, before it was signed.
+	size_t			data_len;			//!< Length of the encoded reply.
+} proto_radius_status_t;
+
+static int _status_free(proto_radius_status_t *status)
+{
+	pthread_mutex_destroy(&status->mutex);
+
+	return 0;
+}
+
+/** Encode a reply containing the current counters
+ *
+ * @note Must be called with the mutex held.
+ */
+static int status_encode(proto_radius_t const *inst, proto_radius_status_t *status, uint8_t const *packet)
+{
+	fr_pair_list_t		vps;
+	fr_pair_t		*vp;
+	fr_dict_attr_t const	*da;
+	char const		*name;
+	ssize_t			slen;
+	unsigned int		i;
+
+	fr_pair_list_init(&vps);
+
+	MEM(vp = fr_pair_afrom_da(NULL, attr_freeradius_stats4_type));
+	vp->vp_uint32 = FR_STATS4_TYPE_VALUE_LISTENER;
+	fr_pair_append(&vps, vp);
+
+	name = cf_section_name2(inst->io.server_cs);
+	if (name) {
+		MEM(vp = fr_pair_afrom_da(NULL, attr_freeradius_stats4_name));
+		fr_pair_value_strdup(vp, name);
+		fr_pair_append(&vps, vp);
+	}
+
+	for (i = 0; i < FR_RADIUS_CODE_MAX; i++) {
+		uint64_t received = atomic_load_explicit(&status->received[i], memory_order_relaxed);
+
+		if (!received) continue;
+
+		da = fr_dict_attr_child_by_num(attr_freeradius_stats4_packet_counters, i);
+		if (!da) continue;
+
+		MEM(vp = fr_pair_afrom_da(NULL, da));
+		vp->vp_uint64 = received;
+		fr_pair_append(&vps, vp);
+	}
+
+	/*
+	 *	Filled in when the reply is signed.
+	 */
+	MEM(vp = fr_pair_afrom_da(NULL, attr_message_authenticator));
+	fr_pair_value_memdup(vp, (uint8_t const[RADIUS_AUTH_VECTOR_LENGTH]){ 0 }, RADIUS_AUTH_VECTOR_LENGTH, false);
+	fr_pair_append(&vps, vp);
+
+	/*
+	 *	There are no encrypted attributes, so the encoding
+	 *	doesn't depend on the client's secret.
+	 */
+	slen = fr_radius_encode(status->data, sizeof(status->data), packet, "", 0,
+				FR_RADIUS_CODE_ACCESS_ACCEPT, packet[1], &vps);
+	fr_pair_list_free(&vps);
+	if (slen < 0) {
+		PERROR("Failed encoding reply to Status-Server");
+		status->data_len = 0;
+		return -1;
+	}
+
+	status->data_len = slen;
+	status->encoded = fr_time();
+
+	return 0;
+}
+
+/** Reply to Status-Server without sending it to a worker
+ *
+ *  Also counts the packets which are reported in the reply.
+ */
+static ssize_t mod_status(void const *instance, void *packet_ctx, uint8_t *packet, size_t packet_len,
+			  uint8_t *buffer, size_t buffer_len)
+{
+	proto_radius_t const	*inst = talloc_get_type_abort_const(instance, proto_radius_t);
+	fr_io_track_t const	*track = talloc_get_type_abort_const(packet_ctx, fr_io_track_t);
+	RADCLIENT const		*client = track->address->radclient;
+	proto_radius_status_t	*status = inst->status;
+	size_t			len = packet_len;
+	ssize_t			data_len;
+
+	if (!status) return 0;
+
+	fr_assert(packet[0] < FR_RADIUS_CODE_MAX);
+	atomic_fetch_add_explicit(&status->received[packet[0]], 1, memory_order_relaxed);
+
+	if (packet[0] != FR_RADIUS_CODE_STATUS_SERVER) return 0;
+
+	/*
+	 *	Anything we don't like goes to the worker, which will
+	 *	complain about it.
+	 */
+	if (!client->active || !fr_radius_ok(packet, &len, 0, true, NULL) ||
+	    (fr_radius_verify(packet, NULL, (uint8_t const *) client->secret, talloc_array_length(client->secret) - 1,
+			      client->secret_hmac) < 0)) return 0;
+
+	pthread_mutex_lock(&status->mutex);
+	if (!status->data_len || ((fr_time() - status->encoded) >= inst->status_interval)) {
+		if (status_encode(inst, status, packet) < 0) {
+			pthread_mutex_unlock(&status->mutex);
+			return 0;
+		}
+	}
+
+	data_len = status->data_len;
+	if ((size_t) data_len > buffer_len) {
+		pthread_mutex_unlock(&status->mutex);
+		return 0;
+	}
+	memcpy(buffer, status->data, data_len);
+	pthread_mutex_unlock(&status->mutex);
+
+	buffer[1] = packet[1];
+
+	if (fr_radius_sign(buffer, packet,
+			   (uint8_t const *) client->secret, talloc_array_length(client->secret) - 1,
+			   client->secret_hmac) < 0) {
+		PERROR("Failed signing reply to Status-Server");
+		return 0;
+	}
+
+	return data_len;
+}
+
 /** Open listen sockets/connect to external event source
  *
  * @param[in] instance	Ctx data for this application.
@@ -481,6 +912,20 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 1024);
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65535);
 
+	if (inst->status_network) {
+		if (!inst->allowed[FR_RADIUS_CODE_STATUS_SERVER]) {
+			cf_log_err(conf, "'status_server { network = yes }' requires 'type = Status-Server'");
+			return -1;
+		}
+
+		FR_TIME_DELTA_BOUND_CHECK("status_server.interval", inst->status_interval, >=, fr_time_delta_from_msec(10));
+		FR_TIME_DELTA_BOUND_CHECK("status_server.interval", inst->status_interval, <=, fr_time_delta_from_sec(60));
+
+		MEM(inst->status = talloc_zero(inst, proto_radius_status_t));
+		pthread_mutex_init(&inst->status->mutex, NULL);
+		talloc_set_destructor(inst->status, _status_free);
+	}
+
 	/*
 	 *	Instantiate the master io submodule
 	 */
@@ -579,5 +1024,7 @@ fr_app_t proto_radius = {
 	.open			= mod_open,
 	.decode			= mod_decode,
 	.encode			= mod_encode,
-	.priority		= mod_priority_set
+	.priority		= mod_priority_set,
+	.overload		= mod_overload,
+	.status			= mod_status
 };
@@ -37,6 +37,15 @@ typedef struct {
 
 	bool				tunnel_password_zeros;		//!< check for trailing zeroes in Tunnel-Password.
 
+	uint32_t			reply_cache;			//!< number of encoded replies to cache per thread.
+
+	bool				overload_reject;		//!< reject Access-Requests when overloaded.
+	char const			*overload_reply_message;	//!< Reply-Message to send with the reject.
+
+	bool				status_network;			//!< answer Status-Server in the network thread.
+	fr_time_delta_t			status_interval;		//!< how often to update the reply.
+	struct proto_radius_status_s	*status;			//!< pre-encoded reply to Status-Server.
+
 	uint32_t			priorities[FR_RADIUS_CODE_MAX];	//!< priorities for individual packets
 
 	char				**allowed_types;		//!< names for for 'type = ...'
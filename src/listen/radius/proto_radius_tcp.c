@@ -43,6 +43,9 @@ typedef struct {
 
 	fr_io_address_t			*connection;		//!< for connected sockets.
 
+	size_t				complete;		//!< bytes of complete packets left in the buffer,
+								///< after the packet being returned.
+
 	fr_stats_t			stats;			//!< statistics for this socket
 } proto_radius_tcp_thread_t;
 
@@ -107,13 +110,34 @@ static ssize_t mod_read(fr_listen_t *li, UNUSED void **packet_ctx, fr_time_t *re
 	proto_radius_tcp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_tcp_thread_t);
 	ssize_t				data_size;
 	size_t				packet_len, in_buffer;
+	uint8_t const			*p, *end;
 	decode_fail_t			reason;
 
+	/*
+	 *	A previous read left complete packets in the buffer.
+	 *	Return the next one without reading from the socket.
+	 *	Its framing has already been checked.
+	 */
+	if (thread->complete) {
+		fr_assert(*leftover >= thread->complete);
+
+		in_buffer = *leftover;
+		packet_len = (buffer[2] << 8) | buffer[3];
+		thread->complete -= packet_len;
+		goto have_packet;
+	}
+
 	/*
 	 *      Read data into the buffer.
 	 */
 	data_size = read(thread->sockfd, buffer + *leftover, buffer_len - *leftover);
 	if (data_size < 0) {
+		/*
+		 *	Nothing more to read.  Keep any partial
+		 *	packet, and wait for the rest of it.
+		 */
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
 		PDEBUG2("proto_radius_tcp got read error %zd", data_size);
 		return data_size;
 	}
@@ -152,9 +176,16 @@ static ssize_t mod_read(fr_listen_t *li, UNUSED void **packet_ctx, fr_time_t *re
 	}
 
 	/*
-	 *	Figure out how large the RADIUS packet is.
+	 *	Figure out how large the RADIUS packet is.  If the
+	 *	length can never fit into the buffer, we would wait
+	 *	forever for the rest of the packet.
 	 */
 	packet_len = (buffer[2] << 8) | buffer[3];
+	if ((packet_len < 20) || (packet_len > buffer_len) || (packet_len > inst->max_packet_size)) {
+		DEBUG2("proto_radius_tcp got a packet with invalid length %zu", packet_len);
+		thread->stats.total_malformed_requests++;
+		return -1;
+	}
 
 	/*
 	 *	We don't have a complete RADIUS packet.  Tell the
@@ -165,13 +196,40 @@ static ssize_t mod_read(fr_listen_t *li, UNUSED void **packet_ctx, fr_time_t *re
 		return 0;
 	}
 
+	/*
+	 *	Find all of the complete packets in the buffer, in one
+	 *	pass.  The caller splits them into consecutive
+	 *	messages without copying them, and calls us again for
+	 *	each one.  Only the partial packet at the end of the
+	 *	buffer has to be read again.
+	 *
+	 *	Packets with bad framing end the scan.  They are
+	 *	rejected when they reach the start of the buffer.
+	 */
+	p = buffer + packet_len;
+	end = buffer + in_buffer;
+	while ((end - p) >= 20) {
+		size_t len = (p[2] << 8) | p[3];
+
+		if ((p[0] == 0) || (p[0] > FR_RADIUS_CODE_MAX) ||
+		    (len < 20) || (len > inst->max_packet_size) || ((size_t) (end - p) < len)) break;
+
+		p += len;
+	}
+	thread->complete = (p - buffer) - packet_len;
+
+have_packet:
 	/*
 	 *	We've read more than one packet.  Tell the caller that
 	 *	there's more data available, and return only one packet.
 	 */
-	if (in_buffer > packet_len) {
-		*leftover = in_buffer - packet_len;
-	}
+	*leftover = in_buffer - packet_len;
+
+	/*
+	 *	Tell the network side to keep reading packets from
+	 *	the buffer, even if the socket isn't readable.
+	 */
+	li->read_pending = (thread->complete > 0);
 
 	/*
 	 *      If it's not a RADIUS packet, ignore it.
@@ -23,6 +23,9 @@
  * @copyright 2016 Alan DeKok (aland@deployingradius.com)
  */
 #include <netdb.h>
+#ifdef __linux__
+#  include <linux/filter.h>
+#endif
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/protocol.h>
 #include <freeradius-devel/util/udp.h>
@@ -44,7 +47,13 @@ typedef struct {
 
 	fr_io_address_t			*connection;		//!< for connected sockets.
 
+	udp_recv_batch_t		*batch;			//!< for reading multiple packets at once.
+	udp_send_batch_t		*send_batch;		//!< for writing multiple packets at once.
+
 	fr_stats_t			stats;			//!< statistics for this socket
+
+	fr_event_timer_t const		*filter_ev;		//!< when to next re-check the kernel filter.
+	uint64_t			filter_version;		//!< of the client lists the filter was built from.
 } proto_radius_udp_thread_t;
 
 typedef struct {
@@ -61,12 +70,17 @@ typedef struct {
 	uint32_t			max_packet_size;	//!< for message ring buffer.
 	uint32_t			max_attributes;		//!< Limit maximum decodable attributes.
 
+	uint32_t			recv_batch;		//!< How many packets to read per system call.
+	uint32_t			send_batch;		//!< How many packets to write per system call.
+
 	uint16_t			port;			//!< Port to listen on.
 
 	bool				recv_buff_is_set;	//!< Whether we were provided with a recv_buff
 	bool				send_buff_is_set;	//!< Whether we were provided with a send_buff
 	bool				dynamic_clients;	//!< whether we have dynamic clients
 	bool				dedup_authenticator;	//!< dedup using the request authenticator
+	bool				io_uring;		//!< read packets with io_uring.
+	bool				kernel_filter;		//!< drop packets from unknown clients in the kernel.
 
 	RADCLIENT_LIST			*clients;		//!< local clients
 
@@ -104,6 +118,11 @@ static const CONF_PARSER udp_listen_config[] = {
 	{ FR_CONF_OFFSET("max_packet_size", FR_TYPE_UINT32, proto_radius_udp_t, max_packet_size), .dflt = "4096" } ,
        	{ FR_CONF_OFFSET("max_attributes", FR_TYPE_UINT32, proto_radius_udp_t, max_attributes), .dflt = STRINGIFY(RADIUS_MAX_ATTRIBUTES) } ,
 
+	{ FR_CONF_OFFSET("recv_batch", FR_TYPE_UINT32, proto_radius_udp_t, recv_batch), .dflt = "1" } ,
+	{ FR_CONF_OFFSET("send_batch", FR_TYPE_UINT32, proto_radius_udp_t, send_batch), .dflt = "1" } ,
+	{ FR_CONF_OFFSET("io_uring", FR_TYPE_BOOL, proto_radius_udp_t, io_uring), .dflt = "no" } ,
+	{ FR_CONF_OFFSET("kernel_filter", FR_TYPE_BOOL, proto_radius_udp_t, kernel_filter), .dflt = "no" } ,
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -134,7 +153,40 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	 */
 	flags = UDP_FLAGS_CONNECTED * (thread->connection != NULL);
 
-	data_size = udp_recv(thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	if (thread->batch) {
+		uint8_t		*data;
+
+		/*
+		 *	Refill the batch when it's empty.  If the
+		 *	kernel has nothing for us, we're done.
+		 */
+		if (!udp_recv_batch_pending(thread->batch)) {
+			data_size = udp_recv_batch(thread->batch, thread->sockfd);
+			if (data_size <= 0) goto done;
+		}
+
+		data_size = udp_recv_batch_next(thread->batch, &address->socket, &data, recv_time_p);
+		thread->stats.total_malformed_requests += udp_recv_batch_truncated(thread->batch);
+		if (data_size > 0) {
+			/*
+			 *	Don't pass a truncated packet up the stack.
+			 */
+			if ((size_t) data_size > buffer_len) {
+				li->read_pending = udp_recv_batch_pending(thread->batch);
+
+				DEBUG2("proto_radius_udp got 'too long' packet size %zd > %zu", data_size, buffer_len);
+				thread->stats.total_malformed_requests++;
+				return 0;
+			}
+
+			memcpy(buffer, data, data_size);
+		}
+
+	done:
+		li->read_pending = udp_recv_batch_pending(thread->batch);
+	} else {
+		data_size = udp_recv(thread->sockfd, flags, &address->socket, buffer, buffer_len, recv_time_p);
+	}
 	if (data_size < 0) {
 		PDEBUG2("proto_radius_udp got read error");
 		return data_size;
@@ -193,6 +245,21 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 }
 
 
+/** Write a packet, or queue it if we're batching writes.
+ *
+ */
+static ssize_t mod_send(proto_radius_udp_thread_t *thread, fr_socket_t const *socket, int flags,
+			uint8_t *buffer, size_t buffer_len)
+{
+	if (thread->send_batch) {
+		if (udp_send_batch_add(thread->send_batch, socket, buffer, buffer_len) < 0) return -1;
+
+		return buffer_len;
+	}
+
+	return udp_send(socket, flags, buffer, buffer_len);
+}
+
 static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t request_time,
 			 uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
 {
@@ -235,7 +302,7 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 
 			memcpy(&packet, &track->reply, sizeof(packet)); /* const issues */
 
-			(void) udp_send(&socket, flags, packet, track->reply_len);
+			(void) mod_send(thread, &socket, flags, (uint8_t *) packet, track->reply_len);
 		}
 
 		return buffer_len;
@@ -250,7 +317,7 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 	 *	Only write replies if they're RADIUS packets.
 	 *	sometimes we want to NOT send a reply...
 	 */
-	data_size = udp_send(&socket, flags, buffer, buffer_len);
+	data_size = mod_send(thread, &socket, flags, buffer, buffer_len);
 
 	/*
 	 *	This socket is dead.  That's an error...
@@ -269,6 +336,19 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 }
 
 
+/** Write any queued packets
+ *
+ */
+static int mod_flush(fr_listen_t *li)
+{
+	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
+
+	if (!thread->send_batch) return 0;
+
+	return udp_send_batch_flush(thread->send_batch);
+}
+
+
 static int mod_connection_set(fr_listen_t *li, fr_io_address_t *connection)
 {
 	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
@@ -288,6 +368,81 @@ static void mod_network_get(void *instance, int *ipproto, bool *dynamic_clients,
 }
 
 
+/** Add rules for a set of networks to a kernel filter
+ *
+ */
+static void filter_rules_add(fr_socket_filter_rule_t **rules, fr_ipaddr_t const *networks, size_t num, int af, bool accept)
+{
+	size_t	i, used = talloc_array_length(*rules);
+
+	for (i = 0; i < num; i++) {
+		if (networks[i].af != af) continue;
+
+		MEM(*rules = talloc_realloc(NULL, *rules, fr_socket_filter_rule_t, used + 1));
+		(*rules)[used++] = (fr_socket_filter_rule_t) {
+			.network = networks[i],
+			.accept = accept
+		};
+	}
+}
+
+/** Tell the kernel to drop packets which can't be from a known client
+ *
+ *  The rules mirror what mod_client_find() and the master I/O
+ *  handler do in user space.  Local clients, then global clients
+ *  are accepted.  If we have dynamic clients, "deny" networks are
+ *  dropped and "allow" networks are accepted.  Everything else is
+ *  dropped.
+ */
+static void mod_filter_attach(proto_radius_udp_t const *inst, proto_radius_udp_thread_t *thread)
+{
+	fr_socket_filter_rule_t	*rules;
+	fr_ipaddr_t		*networks;
+	int			num;
+
+	thread->filter_version = client_list_version();
+
+	MEM(rules = talloc_array(NULL, fr_socket_filter_rule_t, 0));
+
+	if (inst->clients) {
+		num = client_list_networks(rules, &networks, inst->clients, inst->ipaddr.af, IPPROTO_UDP);
+		if (num < 0) goto fail;
+		filter_rules_add(&rules, networks, num, inst->ipaddr.af, true);
+	}
+
+	num = client_list_networks(rules, &networks, NULL, inst->ipaddr.af, IPPROTO_UDP);
+	if (num < 0) goto fail;
+	filter_rules_add(&rules, networks, num, inst->ipaddr.af, true);
+
+	if (inst->dynamic_clients) {
+		filter_rules_add(&rules, inst->deny, talloc_array_length(inst->deny), inst->ipaddr.af, false);
+		filter_rules_add(&rules, inst->allow, talloc_array_length(inst->allow), inst->ipaddr.af, true);
+	}
+
+	if (fr_socket_filter_networks(thread->sockfd, inst->ipaddr.af, rules, talloc_array_length(rules)) < 0) {
+	fail:
+		PWARN("Failed attaching kernel filter, unknown clients will be dropped by the server");
+	}
+
+	talloc_free(rules);
+}
+
+/** Re-build the kernel filter when clients are added or removed
+ *
+ */
+static void mod_filter_check(fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_listen_t			*li = talloc_get_type_abort(uctx, fr_listen_t);
+	proto_radius_udp_t const       	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_radius_udp_t);
+	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
+
+	if (client_list_version() != thread->filter_version) mod_filter_attach(inst, thread);
+
+	if (fr_event_timer_in(thread, el, &thread->filter_ev, fr_time_delta_from_sec(1), mod_filter_check, li) < 0) {
+		PWARN("Failed scheduling kernel filter check, new clients may be dropped");
+	}
+}
+
 /** Open a UDP listener for RADIUS
  *
  */
@@ -351,6 +506,68 @@ static int mod_open(fr_listen_t *li)
 
 	thread->sockfd = sockfd;
 
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+	/*
+	 *	When the socket is one of several shards, tell the
+	 *	kernel to pick the shard by hashing the source IP.
+	 *	The default hash includes the source port, which
+	 *	means that one NAS could end up on multiple shards,
+	 *	and therefore multiple network threads.
+	 */
+	if (li->num_shards > 1) {
+		struct sock_filter	code[] = {
+			/* A = last 32 bits of the source IP */
+			BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+				 SKF_NET_OFF + ((inst->ipaddr.af == AF_INET6) ? 20 : 12)),
+			/* A = A % num_shards */
+			BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, li->num_shards),
+			/* return A */
+			BPF_STMT(BPF_RET | BPF_A, 0),
+		};
+		struct sock_fprog	prog = {
+			.len = NUM_ELEMENTS(code),
+			.filter = code,
+		};
+
+		if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+			WARN("Failed attaching shard selection filter, packets will be "
+			     "distributed by source IP and port: %s", fr_syserror(errno));
+		}
+	}
+#endif
+
+	/*
+	 *	Drop packets from unknown clients before they're
+	 *	copied to user space.
+	 */
+	if (inst->kernel_filter) mod_filter_attach(inst, thread);
+
+	/*
+	 *	Only the main socket reads multiple packets at a
+	 *	time.  Connected sockets are fed by it.
+	 */
+	if (!thread->connection && ((inst->recv_batch > 1) || inst->io_uring)) {
+		thread->batch = udp_recv_batch_alloc(thread, inst->recv_batch, inst->max_packet_size);
+		if (!thread->batch) {
+			close(sockfd);
+			PERROR("Failed allocating receive batch");
+			goto error;
+		}
+
+		if (inst->io_uring && (udp_recv_batch_io_uring(thread->batch) < 0)) {
+			PWARN("Not using io_uring");
+		}
+	}
+
+	if (inst->send_batch > 1) {
+		thread->send_batch = udp_send_batch_alloc(thread, inst->send_batch, proto_radius_udp.default_message_size);
+		if (!thread->send_batch) {
+			close(sockfd);
+			PERROR("Failed allocating send batch");
+			goto error;
+		}
+	}
+
 	fr_assert((cf_parent(inst->cs) != NULL) && (cf_parent(cf_parent(inst->cs)) != NULL));	/* listen { ... } */
 
 	thread->name = fr_app_io_socket_name(thread, &proto_radius_udp,
@@ -361,6 +578,19 @@ static int mod_open(fr_listen_t *li)
 	return 0;
 }
 
+/** Periodically re-check the kernel filter
+ *
+ */
+static void mod_event_list_set(fr_listen_t *li, fr_event_list_t *el, UNUSED void *nr)
+{
+	proto_radius_udp_t const       	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_radius_udp_t);
+	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
+
+	if (!inst->kernel_filter || thread->connection) return;
+
+	mod_filter_check(el, fr_time(), li);
+}
+
 /** Set the file descriptor for this socket.
  *
  */
@@ -415,6 +645,22 @@ static int mod_compare(void const *instance, UNUSED void *thread_instance, UNUSE
 }
 
 
+static uint32_t mod_track_hash(void const *instance, void const *packet)
+{
+	proto_radius_udp_t const	*inst = talloc_get_type_abort_const(instance, proto_radius_udp_t);
+	uint8_t const			*p = packet;
+	uint32_t			hash;
+
+	/*
+	 *	Code and ID, which are the fields mod_compare() always
+	 *	checks.
+	 */
+	hash = fr_hash(p, 2);
+	if (inst->dedup_authenticator) hash = fr_hash_update(p + 4, RADIUS_AUTH_VECTOR_LENGTH, hash);
+
+	return hash;
+}
+
 static char const *mod_name(fr_listen_t *li)
 {
 	proto_radius_udp_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_radius_udp_thread_t);
@@ -453,6 +699,12 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 20);
 	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65536);
 
+	FR_INTEGER_BOUND_CHECK("recv_batch", inst->recv_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("recv_batch", inst->recv_batch, <=, 1024);
+
+	FR_INTEGER_BOUND_CHECK("send_batch", inst->send_batch, >=, 1);
+	FR_INTEGER_BOUND_CHECK("send_batch", inst->send_batch, <=, 1024);
+
 	if (!inst->port) {
 		struct servent *s;
 
@@ -540,11 +792,14 @@ fr_app_io_t proto_radius_udp = {
 	.track_duplicates	= true,
 
 	.open			= mod_open,
+	.event_list_set		= mod_event_list_set,
 	.read			= mod_read,
 	.write			= mod_write,
+	.flush			= mod_flush,
 	.fd_set			= mod_fd_set,
 	.track			= mod_track_create,
 	.compare		= mod_compare,
+	.hash			= mod_track_hash,
 	.connection_set		= mod_connection_set,
 	.network_get		= mod_network_get,
 	.client_find		= mod_client_find,
@@ -304,7 +304,7 @@ static int mod_decode(void const *instance, request_t *request, uint8_t *const d
 		    ((pkt->hdr.flags & FR_FLAGS_VALUE_UNENCRYPTED) == 0) &&
 		    RDEBUG_ENABLED2 &&
 		    ((vp = fr_pair_find_by_da(&request->request_pairs, attr_tacacs_user_name, 0)) != NULL) &&
-		    (fr_utf8_str((uint8_t const *) vp->vp_strvalue, vp->vp_length) < 0)) {
+		    (fr_utf8_str((uint8_t const *) vp->vp_strvalue, vp->vp_length) != (ssize_t)vp->vp_length)) {
 			RWDEBUG("Unprintable characters in the %s. "
 				"Double-check the shared secret on the server "
 				"and the TACACS+ Client!", attr_tacacs_user_name->name);
@@ -0,0 +1 @@
+SUBMAKEFILES := proto_tftp.mk proto_tftp_udp.mk
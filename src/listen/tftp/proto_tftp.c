@@ -0,0 +1,374 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_tftp.c
+ * @brief TFTP master protocol handler.
+ *
+ * Only read and write requests are passed to the virtual server.  The
+ * data transfer for an accepted read request is done entirely by the
+ * transport, in the network thread.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/module.h>
+#include <freeradius-devel/server/virtual_servers.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/debug.h>
+#include "proto_tftp.h"
+
+extern fr_app_t proto_tftp;
+
+/** How to parse a TFTP listen section
+ *
+ */
+static CONF_PARSER const proto_tftp_config[] = {
+	{ FR_CONF_OFFSET("num_messages", FR_TYPE_UINT32, proto_tftp_t, num_messages) } ,
+
+	CONF_PARSER_TERMINATOR
+};
+
+static fr_dict_t const *dict_tftp;
+
+extern fr_dict_autoload_t proto_tftp_dict[];
+fr_dict_autoload_t proto_tftp_dict[] = {
+	{ .out = &dict_tftp, .proto = "tftp" },
+	{ NULL }
+};
+
+static fr_dict_attr_t const *attr_tftp_opcode;
+static fr_dict_attr_t const *attr_tftp_filename;
+static fr_dict_attr_t const *attr_tftp_error_code;
+
+extern fr_dict_attr_autoload_t proto_tftp_dict_attr[];
+fr_dict_attr_autoload_t proto_tftp_dict_attr[] = {
+	{ .out = &attr_tftp_opcode, .name = "Opcode", .type = FR_TYPE_UINT16, .dict = &dict_tftp},
+	{ .out = &attr_tftp_filename, .name = "Filename", .type = FR_TYPE_STRING, .dict = &dict_tftp},
+	{ .out = &attr_tftp_error_code, .name = "Error-Code", .type = FR_TYPE_UINT16, .dict = &dict_tftp},
+	{ NULL }
+};
+
+/** Decode the packet
+ *
+ */
+static int mod_decode(UNUSED void const *instance, request_t *request, uint8_t *const data, size_t data_len)
+{
+	fr_socket_t const	*socket = talloc_get_type_abort_const(request->async->packet_ctx, fr_socket_t);
+	fr_dcursor_t		cursor;
+
+	/*
+	 *	Set the request dictionary so that we can do
+	 *	generic->protocol attribute conversions as
+	 *	the request runs through the server.
+	 */
+	request->dict = dict_tftp;
+
+	fr_dcursor_init(&cursor, &request->request_pairs);
+	if (fr_tftp_decode(request->request_ctx, data, data_len, &cursor) < 0) {
+		RPEDEBUG("Failed decoding packet");
+		return -1;
+	}
+
+	/*
+	 *	The transport only gives us requests, and the request
+	 *	opcodes have the same values as the packet types.
+	 */
+	request->packet->code = fr_net_to_uint16(data);
+	fr_assert((request->packet->code == FR_PACKET_TYPE_VALUE_READ_REQUEST) ||
+		  (request->packet->code == FR_PACKET_TYPE_VALUE_WRITE_REQUEST));
+
+	request->packet->socket = *socket;
+	request->packet->data = talloc_memdup(request->packet, data, data_len);
+	request->packet->data_len = data_len;
+
+	REQUEST_VERIFY(request);
+
+	if (RDEBUG_ENABLED) {
+		RDEBUG("Received TFTP %s from %pV:%u to %pV:%u via socket %s",
+		       fr_tftp_codes[request->packet->code],
+		       fr_box_ipaddr(socket->inet.src_ipaddr), socket->inet.src_port,
+		       fr_box_ipaddr(socket->inet.dst_ipaddr), socket->inet.dst_port,
+		       request->async->listen->name);
+
+		log_request_pair_list(L_DBG_LVL_1, request, NULL, &request->request_pairs, NULL);
+	}
+
+	return 0;
+}
+
+/** Encode the reply
+ *
+ * A "Data" reply tells the transport to start sending the file.  We
+ * give it back the original read request, with the filename replaced
+ * by the one from the reply list, if policy set one.  The transport
+ * then does the option negotiation itself.
+ */
+static ssize_t mod_encode(UNUSED void const *instance, request_t *request, uint8_t *buffer, size_t buffer_len)
+{
+	fr_dbuff_t		work_dbuff = FR_DBUFF_TMP(buffer, buffer_len);
+	fr_pair_t		*vp;
+	uint8_t const		*mode, *end;
+	ssize_t			slen;
+
+	/*
+	 *	Process layer NAK, never respond, or "Do not respond".
+	 */
+	if ((buffer_len == 1) ||
+	    (request->reply->code == FR_PACKET_TYPE_VALUE_DO_NOT_RESPOND) ||
+	    (request->reply->code == 0) || (request->reply->code >= FR_TFTP_MAX_CODE)) {
+		*buffer = false;
+		return 1;
+	}
+
+	switch (request->reply->code) {
+	case FR_PACKET_TYPE_VALUE_DATA:
+		if (request->packet->code != FR_PACKET_TYPE_VALUE_READ_REQUEST) {
+			REDEBUG("Cannot send %s in reply to %s",
+				fr_tftp_codes[request->reply->code], fr_tftp_codes[request->packet->code]);
+			return -1;
+		}
+
+		vp = fr_pair_find_by_da(&request->reply_pairs, attr_tftp_filename, 0);
+		if (!vp) vp = fr_pair_find_by_da(&request->request_pairs, attr_tftp_filename, 0);
+		if (!vp || !vp->vp_length || memchr(vp->vp_strvalue, '\0', vp->vp_length)) {
+			REDEBUG("Cannot send %s without a valid %s",
+				fr_tftp_codes[request->reply->code], attr_tftp_filename->name);
+			return -1;
+		}
+
+		/*
+		 *	Skip the opcode and filename of the original
+		 *	request.  The decoder has already checked that
+		 *	the mode and options are well formed.
+		 */
+		end = request->packet->data + request->packet->data_len;
+		mode = memchr(request->packet->data + 2, '\0', end - (request->packet->data + 2));
+		fr_assert(mode != NULL);
+		mode++;
+
+		FR_DBUFF_IN_RETURN(&work_dbuff, (uint16_t) FR_OPCODE_VALUE_READ_REQUEST);
+		FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, vp->vp_strvalue, vp->vp_length);
+		FR_DBUFF_IN_BYTES_RETURN(&work_dbuff, '\0');
+		FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, mode, end - mode);
+
+		slen = fr_dbuff_used(&work_dbuff);
+		break;
+
+	case FR_PACKET_TYPE_VALUE_ERROR:
+		/*
+		 *	Policy only has to say "no".  Fill in the
+		 *	rest of the packet.
+		 */
+		MEM(pair_update_reply(&vp, attr_tftp_opcode) >= 0);
+		vp->vp_uint16 = FR_OPCODE_VALUE_ERROR;
+
+		if (!fr_pair_find_by_da(&request->reply_pairs, attr_tftp_error_code, 0)) {
+			MEM(pair_append_reply(&vp, attr_tftp_error_code) >= 0);
+			vp->vp_uint16 = FR_ERROR_CODE_VALUE_ACCESS_VIOLATION;
+		}
+
+		slen = fr_tftp_encode(&work_dbuff, &request->reply_pairs);
+		if (slen <= 0) {
+			RPEDEBUG("Failed encoding reply");
+			return -1;
+		}
+		break;
+
+	default:
+		REDEBUG("Cannot send TFTP %s", fr_tftp_codes[request->reply->code]);
+		return -1;
+	}
+
+	if (RDEBUG_ENABLED) {
+		RDEBUG("Sending %s to %pV:%u via socket %s",
+		       fr_tftp_codes[request->reply->code],
+		       fr_box_ipaddr(request->packet->socket.inet.src_ipaddr), request->packet->socket.inet.src_port,
+		       request->async->listen->name);
+
+		log_request_pair_list(L_DBG_LVL_1, request, NULL, &request->reply_pairs, NULL);
+	}
+
+	return slen;
+}
+
+/** Open listen sockets/connect to external event source
+ *
+ * @param[in] instance	Ctx data for this application.
+ * @param[in] sc	to add our file descriptor to.
+ * @param[in] conf	Listen section parsed to give us instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_open(void *instance, fr_schedule_t *sc, UNUSED CONF_SECTION *conf)
+{
+	fr_listen_t	*li;
+	proto_tftp_t 	*inst = talloc_get_type_abort(instance, proto_tftp_t);
+
+	/*
+	 *	Build the #fr_listen_t.  This describes the complete
+	 *	path, data takes from the socket to the decoder and
+	 *	back again.
+	 */
+	li = talloc_zero(inst, fr_listen_t);
+	talloc_set_destructor(li, fr_io_listen_free);
+
+	li->app = &proto_tftp;
+	li->app_instance = instance;
+	li->server_cs = inst->server_cs;
+
+	/*
+	 *	Set configurable parameters for message ring buffer.
+	 */
+	li->default_message_size = PROTO_TFTP_MAX_REQUEST_SIZE;
+	li->num_messages = inst->num_messages;
+
+	li->app_io = inst->app_io;
+	li->app_io_instance = inst->app_io_instance;
+	if (li->app_io->thread_inst_size) {
+		li->thread_instance = talloc_zero_array(NULL, uint8_t, li->app_io->thread_inst_size);
+		talloc_set_name(li->thread_instance, "proto_%s_thread_t", inst->app_io->name);
+	}
+
+	if (inst->app_io->open(li) < 0) {
+		talloc_free(li);
+		return -1;
+	}
+	fr_assert(li->fd >= 0);
+
+	li->name = inst->app_io->get_name(li);
+
+	if (!fr_schedule_listen_add(sc, li)) {
+		talloc_free(li);
+		return -1;
+	}
+
+	inst->listen = li;	/* Probably won't need it, but doesn't hurt */
+	inst->sc = sc;
+
+	return 0;
+}
+
+/** Instantiate the application
+ *
+ * Instantiate I/O and type submodules.
+ *
+ * @param[in] instance	Ctx data for this application.
+ * @param[in] conf	Listen section parsed to give us instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	proto_tftp_t		*inst = talloc_get_type_abort(instance, proto_tftp_t);
+
+	if (inst->app_io->instantiate &&
+	    (inst->app_io->instantiate(inst->app_io_instance,
+				       inst->app_io_conf) < 0)) {
+		cf_log_err(conf, "Instantiation failed for \"%s\"", inst->app_io->name);
+		return -1;
+	}
+
+	if (!inst->num_messages) inst->num_messages = 256;
+
+	FR_INTEGER_BOUND_CHECK("num_messages", inst->num_messages, >=, 32);
+	FR_INTEGER_BOUND_CHECK("num_messages", inst->num_messages, <=, 65535);
+
+	return 0;
+}
+
+/** Bootstrap the application
+ *
+ * Bootstrap I/O and type submodules.
+ *
+ * @param[in] instance	Ctx data for this application.
+ * @param[in] conf	Listen section parsed to give us instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_bootstrap(void *instance, CONF_SECTION *conf)
+{
+	proto_tftp_t 		*inst = talloc_get_type_abort(instance, proto_tftp_t);
+	dl_module_inst_t	*parent_inst;
+
+	/*
+	 *	Ensure that the server CONF_SECTION is always set.
+	 */
+	inst->server_cs = cf_item_to_section(cf_parent(conf));
+	inst->cs = conf;
+
+	parent_inst = cf_data_value(cf_data_find(inst->cs, dl_module_inst_t, "proto_tftp"));
+	fr_assert(parent_inst);
+
+	/*
+	 *	Transfers are handled by the transport, so there's
+	 *	only one of them.
+	 */
+	if (dl_module_instance(inst->cs, &inst->io_submodule, inst->cs,
+			       parent_inst, "udp", DL_MODULE_TYPE_SUBMODULE) < 0) {
+		cf_log_perr(inst->cs, "Failed to load proto_tftp_udp");
+		return -1;
+	}
+
+	/*
+	 *	Bootstrap the I/O module
+	 */
+	inst->app_io = (fr_app_io_t const *) inst->io_submodule->module->common;
+	inst->app_io_instance = inst->io_submodule->data;
+	inst->app_io_conf = conf;
+
+	if (inst->app_io->bootstrap && (inst->app_io->bootstrap(inst->app_io_instance,
+								inst->app_io_conf) < 0)) {
+		cf_log_err(inst->app_io_conf, "Bootstrap failed for \"%s\"", inst->app_io->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_load(void)
+{
+	if (fr_tftp_init() < 0) {
+		PERROR("Failed initialising protocol library");
+		return -1;
+	}
+	return 0;
+}
+
+static void mod_unload(void)
+{
+	fr_tftp_free();
+}
+
+fr_app_t proto_tftp = {
+	.magic			= RLM_MODULE_INIT,
+	.name			= "tftp",
+	.config			= proto_tftp_config,
+	.inst_size		= sizeof(proto_tftp_t),
+	.dict			= &dict_tftp,
+
+	.onload			= mod_load,
+	.unload			= mod_unload,
+	.bootstrap		= mod_bootstrap,
+	.instantiate		= mod_instantiate,
+	.open			= mod_open,
+	.decode			= mod_decode,
+	.encode			= mod_encode,
+};
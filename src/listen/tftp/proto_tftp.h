@@ -0,0 +1,61 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/*
+ * $Id$
+ *
+ * @file proto_tftp.h
+ * @brief Structures for the TFTP protocol
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/tftp/tftp.h>
+
+/** Largest request we accept
+ *
+ * RFC 2347 limits requests with options to 512 octets.  We allow some
+ * slack for clients which send long vendor options.
+ */
+#define PROTO_TFTP_MAX_REQUEST_SIZE	(1024)
+
+/** Largest reply we encode
+ *
+ * Replies to read requests carry the (possibly rewritten) filename
+ * back to the transport, so leave room for a long path.
+ */
+#define PROTO_TFTP_MAX_REPLY_SIZE	(PROTO_TFTP_MAX_REQUEST_SIZE + 4096)
+
+typedef struct {
+	CONF_SECTION			*server_cs;			//!< server CS for this listener
+	CONF_SECTION			*cs;				//!< my configuration
+
+	dl_module_inst_t	       	*io_submodule;			//!< As provided by the transport_parse
+									///< callback.  Broken out into the
+									///< app_io_* fields below for convenience.
+
+	CONF_SECTION			*app_io_conf;			//!< for the APP IO
+	fr_app_io_t const		*app_io;			//!< Easy access to the app_io handle.
+	void				*app_io_instance;		//!< Easy access to the app_io instance.
+
+	uint32_t			num_messages;			//!< for message ring buffer
+
+	fr_schedule_t			*sc;				//!< the scheduler, where we insert new readers
+
+	fr_listen_t			*listen;			//!< The listener structure which describes
+									//!< the I/O path.
+} proto_tftp_t;
@@ -0,0 +1,958 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_tftp_udp.c
+ * @brief TFTP handler for UDP.
+ *
+ * Read and write requests are passed to the worker, which decides
+ * whether or not the file is sent.  Everything after that happens here,
+ * in the network thread:
+ *
+ *  - Transfers are kept in a tree keyed by the client address and port,
+ *    and are served from the listening socket.  ACKs and ERRORs for
+ *    them never leave the network thread.
+ *  - The blksize, tsize, timeout and windowsize options are negotiated
+ *    (RFC 2347, 2348, 2349 and 7440), so that one round trip can carry
+ *    many blocks.
+ *  - Files are served from a cache of memory mapped files, bounded by
+ *    'cache_size', and shared by all of the transfers in the thread.
+ *  - Data blocks for all of the transfers are written with sendmmsg(),
+ *    and the batch is flushed once per read, or timer, event.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <netdb.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/protocol.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/rb.h>
+#include <freeradius-devel/util/udp.h>
+#include <freeradius-devel/io/base.h>
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/schedule.h>
+#include <freeradius-devel/util/debug.h>
+
+#include "proto_tftp.h"
+
+extern fr_app_io_t proto_tftp_udp;
+
+/** Maximum number of datagrams we read, or write, in one go
+ *
+ */
+#define PROTO_TFTP_UDP_BATCH	(64)
+
+/** The option acknowledgement opcode (RFC 2347)
+ *
+ * It isn't in the dictionary, as the decoder never sees it.
+ */
+#define PROTO_TFTP_OPCODE_OACK	(6)
+
+typedef struct proto_tftp_udp_thread_s proto_tftp_udp_thread_t;
+
+typedef struct {
+	CONF_SECTION			*cs;			//!< our configuration
+
+	fr_ipaddr_t			ipaddr;			//!< IP address to listen on.
+
+	char const			*interface;		//!< Interface to bind to.
+	char const			*port_name;		//!< Name of the port for getservent().
+
+	uint32_t			recv_buff;		//!< How big the kernel's receive buffer should be.
+
+	uint16_t			port;			//!< Port to listen on.
+
+	bool				recv_buff_is_set;	//!< Whether we were provided with a receive
+								//!< buffer value.
+
+	char const			*directory;		//!< Files are served from here.
+	size_t				cache_size;		//!< Maximum size of the mapped files we keep.
+	fr_time_delta_t			cache_lifetime;		//!< How long before we check a cached
+								///< file for changes.
+
+	uint32_t			max_block_size;		//!< Largest blksize we agree to.
+	uint32_t			max_window_size;	//!< Largest windowsize we agree to.
+	fr_time_delta_t			timeout;		//!< Before we retransmit.
+	uint32_t			max_retransmits;	//!< Before we give up on a client.
+	uint32_t			max_transfers;		//!< Maximum number of concurrent transfers.
+} proto_tftp_udp_t;
+
+/** A file in the content cache
+ *
+ */
+typedef struct {
+	fr_rb_node_t			node;			//!< Entry in the cache, keyed by path.
+	fr_dlist_t			entry;			//!< Entry in the LRU list.
+
+	proto_tftp_udp_thread_t		*thread;		//!< The thread which owns the cache.
+
+	char const			*path;			//!< Full path of the file.
+	uint8_t				*data;			//!< Memory mapped contents, NULL if empty.
+	size_t				size;			//!< Of the file.
+
+	dev_t				dev;			//!< To check if the file has changed.
+	ino_t				ino;
+	time_t				mtime;
+
+	fr_time_t			checked;		//!< When we last checked the file.
+	uint32_t			refs;			//!< Number of transfers using the file.
+	bool				cached;			//!< Whether the file is in the cache.
+} proto_tftp_file_t;
+
+/** An active transfer
+ *
+ * Block numbers are kept as 64-bit values, so that files of more than
+ * 65535 blocks work.  The 16-bit block number in the packets is
+ * allowed to roll over.
+ */
+typedef struct {
+	fr_rb_node_t			node;			//!< Entry in the tree of transfers, keyed by
+								///< client address and port.
+
+	proto_tftp_udp_thread_t		*thread;		//!< The thread which owns the transfer.
+	fr_socket_t			socket;			//!< From our address, to the client.
+
+	proto_tftp_file_t		*file;			//!< Being sent.
+
+	uint64_t			num_blocks;		//!< Including the final short, or empty, block.
+	uint64_t			acked;			//!< Highest block acknowledged by the client.
+	uint64_t			sent;			//!< Highest block sent.
+
+	uint16_t			block_size;		//!< Negotiated blksize.
+	uint16_t			window_size;		//!< Negotiated windowsize.
+	fr_time_delta_t			timeout;		//!< Negotiated timeout.
+
+	uint8_t				*oack;			//!< Option acknowledgement, until the client
+								///< acknowledges it.
+	size_t				oack_len;		//!< Length of the option acknowledgement.
+
+	uint32_t			retransmits;		//!< Since the client last made progress.
+	fr_event_timer_t const		*ev;			//!< Retransmission timer.
+} proto_tftp_transfer_t;
+
+struct proto_tftp_udp_thread_s {
+	char const			*name;			//!< socket name
+	int				sockfd;
+
+	proto_tftp_udp_t const		*inst;			//!< Our configuration.
+	fr_event_list_t			*el;			//!< For retransmission timers.
+
+	udp_send_batch_t		*batch;			//!< Outgoing packets, for all transfers.
+	uint8_t				*packet;		//!< Where packets are built.
+
+	fr_rb_tree_t			*transfers;		//!< Active transfers.
+	uint32_t			num_transfers;		//!< Number of active transfers.
+
+	fr_rb_tree_t			*files;			//!< Cached files, keyed by path.
+	fr_dlist_head_t			lru;			//!< Cached files, most recently used first.
+	size_t				cached;			//!< Total size of the cached files.
+
+	uint32_t			reads;			//!< Packets read since we last gave other sockets
+								///< a chance.
+};
+
+static const CONF_PARSER udp_listen_config[] = {
+	{ FR_CONF_OFFSET("ipaddr", FR_TYPE_COMBO_IP_ADDR, proto_tftp_udp_t, ipaddr) },
+	{ FR_CONF_OFFSET("ipv4addr", FR_TYPE_IPV4_ADDR, proto_tftp_udp_t, ipaddr) },
+	{ FR_CONF_OFFSET("ipv6addr", FR_TYPE_IPV6_ADDR, proto_tftp_udp_t, ipaddr) },
+
+	{ FR_CONF_OFFSET("interface", FR_TYPE_STRING, proto_tftp_udp_t, interface) },
+	{ FR_CONF_OFFSET("port_name", FR_TYPE_STRING, proto_tftp_udp_t, port_name) },
+
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, proto_tftp_udp_t, port) },
+	{ FR_CONF_OFFSET_IS_SET("recv_buff", FR_TYPE_UINT32, proto_tftp_udp_t, recv_buff) },
+
+	{ FR_CONF_OFFSET("directory", FR_TYPE_STRING | FR_TYPE_REQUIRED | FR_TYPE_NOT_EMPTY, proto_tftp_udp_t, directory) },
+	{ FR_CONF_OFFSET("cache_size", FR_TYPE_SIZE, proto_tftp_udp_t, cache_size), .dflt = "67108864" },
+	{ FR_CONF_OFFSET("cache_lifetime", FR_TYPE_TIME_DELTA, proto_tftp_udp_t, cache_lifetime), .dflt = "10" },
+
+	{ FR_CONF_OFFSET("max_block_size", FR_TYPE_UINT32, proto_tftp_udp_t, max_block_size), .dflt = "1468" },
+	{ FR_CONF_OFFSET("max_window_size", FR_TYPE_UINT32, proto_tftp_udp_t, max_window_size), .dflt = "64" },
+	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, proto_tftp_udp_t, timeout), .dflt = "1" },
+	{ FR_CONF_OFFSET("max_retransmits", FR_TYPE_UINT32, proto_tftp_udp_t, max_retransmits), .dflt = "5" },
+	{ FR_CONF_OFFSET("max_transfers", FR_TYPE_UINT32, proto_tftp_udp_t, max_transfers), .dflt = "4096" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static int8_t file_cmp(void const *one, void const *two)
+{
+	proto_tftp_file_t const *a = one, *b = two;
+	int ret;
+
+	ret = strcmp(a->path, b->path);
+	return CMP(ret, 0);
+}
+
+static int8_t transfer_cmp(void const *one, void const *two)
+{
+	proto_tftp_transfer_t const *a = one, *b = two;
+	int8_t ret;
+
+	ret = CMP(a->socket.inet.dst_port, b->socket.inet.dst_port);
+	if (ret != 0) return ret;
+
+	return fr_ipaddr_cmp(&a->socket.inet.dst_ipaddr, &b->socket.inet.dst_ipaddr);
+}
+
+static int _file_free(proto_tftp_file_t *file)
+{
+	if (file->data) (void) munmap(file->data, file->size);
+
+	return 0;
+}
+
+/** Remove a file from the cache
+ *
+ * Transfers which are still sending the file keep it until they're done.
+ */
+static void file_evict(proto_tftp_file_t *file)
+{
+	proto_tftp_udp_thread_t *thread = file->thread;
+
+	if (file->cached) {
+		(void) fr_rb_delete(thread->files, file);
+		fr_dlist_remove(&thread->lru, file);
+		thread->cached -= file->size;
+		file->cached = false;
+	}
+
+	if (!file->refs) talloc_free(file);
+}
+
+static void file_release(proto_tftp_file_t *file)
+{
+	fr_assert(file->refs > 0);
+
+	if (--file->refs > 0) return;
+
+	if (!file->cached) talloc_free(file);
+}
+
+/** Find a file in the cache, or map it and add it to the cache
+ *
+ * @param[in] thread		which owns the cache.
+ * @param[in] filename		from the read request, relative to 'directory'.
+ * @param[out] error_code	to send to the client if we fail.
+ * @return
+ *	- The file, with a reference held for the caller.
+ *	- NULL on error.
+ */
+static proto_tftp_file_t *file_acquire(proto_tftp_udp_thread_t *thread, char const *filename, uint16_t *error_code)
+{
+	proto_tftp_udp_t const	*inst = thread->inst;
+	proto_tftp_file_t	*file, *old, *prev;
+	char const		*p;
+	char			*path;
+	struct stat		st;
+	fr_time_t		now = fr_time();
+	int			fd;
+
+	/*
+	 *	Names are relative to the directory, and can't
+	 *	escape from it.
+	 */
+	while (*filename == '/') filename++;
+
+	for (p = filename; p; p = strchr(p, '/')) {
+		if (*p == '/') p++;
+
+		if ((p[0] == '.') && (p[1] == '.') && ((p[2] == '/') || (p[2] == '\0'))) {
+			DEBUG("Refusing to send \"%s\", as it is outside of the directory", filename);
+			*error_code = FR_ERROR_CODE_VALUE_ACCESS_VIOLATION;
+			return NULL;
+		}
+	}
+
+	MEM(path = talloc_asprintf(NULL, "%s/%s", inst->directory, filename));
+
+	file = fr_rb_find(thread->files, &(proto_tftp_file_t){ .path = path });
+	if (file) {
+		if ((now - file->checked) < inst->cache_lifetime) goto found;
+
+		/*
+		 *	Still the same file, keep using the mapping.
+		 */
+		if ((stat(path, &st) == 0) && (st.st_dev == file->dev) && (st.st_ino == file->ino) &&
+		    (st.st_mtime == file->mtime) && ((size_t) st.st_size == file->size)) {
+			file->checked = now;
+			goto found;
+		}
+
+		DEBUG2("File \"%s\" has changed, removing it from the cache", path);
+		file_evict(file);
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		DEBUG("Failed opening \"%s\": %s", path, fr_syserror(errno));
+		*error_code = (errno == ENOENT) ? FR_ERROR_CODE_VALUE_FILE_NOT_FOUND : FR_ERROR_CODE_VALUE_ACCESS_VIOLATION;
+		talloc_free(path);
+		return NULL;
+	}
+
+	if ((fstat(fd, &st) < 0) || !S_ISREG(st.st_mode)) {
+		DEBUG("Refusing to send \"%s\", as it is not a regular file", path);
+		*error_code = FR_ERROR_CODE_VALUE_ACCESS_VIOLATION;
+	error:
+		close(fd);
+		talloc_free(path);
+		return NULL;
+	}
+
+	MEM(file = talloc_zero(thread, proto_tftp_file_t));
+	file->thread = thread;
+	file->size = st.st_size;
+	file->dev = st.st_dev;
+	file->ino = st.st_ino;
+	file->mtime = st.st_mtime;
+	file->checked = now;
+
+	if (file->size) {
+		void *data;
+
+		data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			ERROR("Failed mapping \"%s\": %s", path, fr_syserror(errno));
+			talloc_free(file);
+			*error_code = FR_ERROR_CODE_VALUE_NOT_DEFINED;
+			goto error;
+		}
+#ifdef MADV_SEQUENTIAL
+		(void) madvise(data, file->size, MADV_SEQUENTIAL);
+#endif
+		file->data = data;
+	}
+	close(fd);
+
+	file->path = talloc_steal(file, path);
+	talloc_set_destructor(file, _file_free);
+
+	/*
+	 *	Make room by discarding the least recently used files
+	 *	which aren't being sent.  Files which are too large
+	 *	for the cache are still sent, they just aren't kept.
+	 */
+	if (file->size <= inst->cache_size) {
+		for (old = fr_dlist_tail(&thread->lru);
+		     old && ((thread->cached + file->size) > inst->cache_size);
+		     old = prev) {
+			prev = fr_dlist_prev(&thread->lru, old);
+			if (!old->refs) file_evict(old);
+		}
+
+		if ((thread->cached + file->size) <= inst->cache_size) {
+			(void) fr_rb_insert(thread->files, file);
+			fr_dlist_insert_head(&thread->lru, file);
+			thread->cached += file->size;
+			file->cached = true;
+		}
+	}
+
+	file->refs++;
+	return file;
+
+found:
+	talloc_free(path);
+
+	fr_dlist_remove(&thread->lru, file);
+	fr_dlist_insert_head(&thread->lru, file);
+
+	file->refs++;
+	return file;
+}
+
+/** Queue an ERROR packet
+ *
+ */
+static void error_send(proto_tftp_udp_thread_t *thread, fr_socket_t const *socket, uint16_t error_code, char const *msg)
+{
+	size_t		len = strlen(msg);
+
+	fr_assert((len + 5) <= (thread->inst->max_block_size + 4));
+
+	fr_net_from_uint16(thread->packet, FR_OPCODE_VALUE_ERROR);
+	fr_net_from_uint16(thread->packet + 2, error_code);
+	memcpy(thread->packet + 4, msg, len + 1);
+
+	(void) udp_send_batch_add(thread->batch, socket, thread->packet, len + 5);
+}
+
+/** Queue a DATA packet
+ *
+ */
+static void block_send(proto_tftp_transfer_t *transfer, uint64_t block)
+{
+	proto_tftp_udp_thread_t	*thread = transfer->thread;
+	size_t			offset = (block - 1) * transfer->block_size;
+	size_t			len;
+
+	fr_assert((block > 0) && (block <= transfer->num_blocks));
+	fr_assert(offset <= transfer->file->size);
+
+	len = transfer->file->size - offset;
+	if (len > transfer->block_size) len = transfer->block_size;
+
+	fr_net_from_uint16(thread->packet, FR_OPCODE_VALUE_DATA);
+	fr_net_from_uint16(thread->packet + 2, (uint16_t) block);
+	if (len) memcpy(thread->packet + 4, transfer->file->data + offset, len);
+
+	(void) udp_send_batch_add(thread->batch, &transfer->socket, thread->packet, len + 4);
+}
+
+static void transfer_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx);
+
+/** Send the option acknowledgement, or the next window of blocks
+ *
+ * Everything after the last block the client acknowledged is sent.
+ */
+static void transfer_send(proto_tftp_transfer_t *transfer)
+{
+	proto_tftp_udp_thread_t	*thread = transfer->thread;
+	uint64_t		block, last;
+
+	if (transfer->oack) {
+		(void) udp_send_batch_add(thread->batch, &transfer->socket, transfer->oack, transfer->oack_len);
+	} else {
+		last = transfer->acked + transfer->window_size;
+		if (last > transfer->num_blocks) last = transfer->num_blocks;
+
+		for (block = transfer->acked + 1; block <= last; block++) block_send(transfer, block);
+
+		transfer->sent = last;
+	}
+
+	if (fr_event_timer_in(transfer, thread->el, &transfer->ev, transfer->timeout,
+			      transfer_timeout, transfer) < 0) {
+		PERROR("Failed inserting retransmission timer");
+	}
+}
+
+static void transfer_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	proto_tftp_transfer_t	*transfer = talloc_get_type_abort(uctx, proto_tftp_transfer_t);
+	proto_tftp_udp_thread_t	*thread = transfer->thread;
+
+	if (++transfer->retransmits > thread->inst->max_retransmits) {
+		DEBUG("Giving up on sending \"%s\" to %pV:%u after %u retransmits",
+		      transfer->file->path,
+		      fr_box_ipaddr(transfer->socket.inet.dst_ipaddr), transfer->socket.inet.dst_port,
+		      thread->inst->max_retransmits);
+		talloc_free(transfer);
+		return;
+	}
+
+	transfer_send(transfer);
+	(void) udp_send_batch_flush(thread->batch);
+}
+
+/** Process an ACK from the client
+ *
+ */
+static void transfer_ack(proto_tftp_transfer_t *transfer, uint16_t block)
+{
+	uint64_t	acked;
+
+	/*
+	 *	The client has to acknowledge the options before we
+	 *	send any data.
+	 */
+	if (transfer->oack) {
+		if (block != 0) return;
+
+		TALLOC_FREE(transfer->oack);
+		transfer->retransmits = 0;
+		transfer_send(transfer);
+		return;
+	}
+
+	/*
+	 *	Map the 16-bit block number onto the blocks we've
+	 *	sent.  Anything else is a duplicate, or stale, ACK,
+	 *	which we ignore to avoid the Sorcerer's Apprentice
+	 *	syndrome.
+	 */
+	acked = transfer->acked + (uint16_t) (block - (uint16_t) transfer->acked);
+	if ((acked == transfer->acked) || (acked > transfer->sent)) return;
+
+	transfer->acked = acked;
+	transfer->retransmits = 0;
+
+	if (acked == transfer->num_blocks) {
+		DEBUG2("Sent \"%s\" to %pV:%u",
+		       transfer->file->path,
+		       fr_box_ipaddr(transfer->socket.inet.dst_ipaddr), transfer->socket.inet.dst_port);
+		talloc_free(transfer);
+		return;
+	}
+
+	/*
+	 *	The client either acknowledged the whole window, or
+	 *	told us which block it last received in order (RFC
+	 *	7440 Section 4).  Either way we continue from there.
+	 */
+	transfer_send(transfer);
+}
+
+static int _transfer_free(proto_tftp_transfer_t *transfer)
+{
+	proto_tftp_udp_thread_t	*thread = transfer->thread;
+
+	(void) fr_rb_delete(thread->transfers, transfer);
+	thread->num_transfers--;
+
+	file_release(transfer->file);
+
+	return 0;
+}
+
+/** Add a negotiated option to the option acknowledgement
+ *
+ */
+static uint8_t *oack_add(uint8_t *p, uint8_t const *end, char const *name, uint64_t value)
+{
+	int len;
+
+	len = snprintf((char *) p, end - p, "%s%c%" PRIu64, name, '\0', value);
+	if ((len < 0) || ((p + len + 1) > end)) return p;
+
+	return p + len + 1;
+}
+
+/** Start sending a file to the client
+ *
+ * @param[in] thread	which owns the transfer.
+ * @param[in] socket	from our address, to the client.
+ * @param[in] packet	the read request, as encoded by proto_tftp.
+ * @param[in] packet_len	length of the read request.
+ */
+static void transfer_start(proto_tftp_udp_thread_t *thread, fr_socket_t const *socket,
+			   uint8_t const *packet, size_t packet_len)
+{
+	proto_tftp_udp_t const	*inst = thread->inst;
+	proto_tftp_transfer_t	*transfer;
+	proto_tftp_file_t	*file;
+	uint8_t const		*p, *end, *q;
+	char const		*filename, *mode, *name, *value;
+	uint8_t			oack[PROTO_TFTP_MAX_REQUEST_SIZE + 32];
+	uint8_t			*o, *o_end = oack + sizeof(oack);
+	uint32_t		block_size = 512, window_size = 1;
+	fr_time_delta_t		timeout = inst->timeout;
+	bool			tsize = false;
+	uint16_t		error_code;
+
+	/*
+	 *	Duplicate request, we're already sending the file.
+	 */
+	if (fr_rb_find(thread->transfers, &(proto_tftp_transfer_t){ .socket = *socket })) return;
+
+	if (thread->num_transfers >= inst->max_transfers) {
+		RATE_LIMIT_GLOBAL(WARN, "Refusing transfer, as there are already %u in progress", thread->num_transfers);
+		error_send(thread, socket, FR_ERROR_CODE_VALUE_NOT_DEFINED, "Server busy");
+		return;
+	}
+
+	/*
+	 *	proto_tftp always gives us a well formed request.
+	 */
+	end = packet + packet_len;
+	if ((packet_len < 6) || (end[-1] != '\0')) return;
+
+	filename = (char const *) packet + 2;
+	q = memchr(filename, '\0', end - (uint8_t const *) filename);
+	mode = (char const *) q + 1;
+	q = memchr(mode, '\0', end - (uint8_t const *) mode);
+	if (!q) return;
+	p = q + 1;
+
+	if (strcasecmp(mode, "octet") != 0) {
+		error_send(thread, socket, FR_ERROR_CODE_VALUE_ILLEGAL_OPERATION, "Only octet mode is supported");
+		return;
+	}
+
+	o = oack;
+	fr_net_from_uint16(o, PROTO_TFTP_OPCODE_OACK);
+	o += 2;
+
+	/*
+	 *	Negotiate the options we know about, and ignore the
+	 *	rest (RFC 2347).
+	 */
+	while (p < end) {
+		char		*v_end;
+		unsigned long	num;
+
+		name = (char const *) p;
+		q = memchr(p, '\0', end - p);
+		if (!q || ((q + 1) >= end)) break;
+
+		value = (char const *) q + 1;
+		q = memchr(value, '\0', end - (uint8_t const *) value);
+		if (!q) break;
+		p = q + 1;
+
+		num = strtoul(value, &v_end, 10);
+		if ((v_end == value) || (*v_end != '\0')) continue;
+
+		if (strcasecmp(name, "blksize") == 0) {
+			if ((num < FR_TFTP_BLOCK_MIN_SIZE) || (num > FR_TFTP_BLOCK_MAX_SIZE)) continue;
+
+			block_size = (num < inst->max_block_size) ? num : inst->max_block_size;
+			o = oack_add(o, o_end, "blksize", block_size);
+
+		} else if (strcasecmp(name, "windowsize") == 0) {
+			if ((num < 1) || (num > 65535)) continue;
+
+			window_size = (num < inst->max_window_size) ? num : inst->max_window_size;
+			o = oack_add(o, o_end, "windowsize", window_size);
+
+		} else if (strcasecmp(name, "timeout") == 0) {
+			if ((num < 1) || (num > 255)) continue;
+
+			timeout = fr_time_delta_from_sec(num);
+			o = oack_add(o, o_end, "timeout", num);
+
+		} else if (strcasecmp(name, "tsize") == 0) {
+			tsize = true;
+		}
+	}
+
+	file = file_acquire(thread, filename, &error_code);
+	if (!file) {
+		error_send(thread, socket, error_code, fr_tftp_error_codes[error_code] ?
+			   fr_tftp_error_codes[error_code] : "Failed opening file");
+		return;
+	}
+
+	if (tsize) o = oack_add(o, o_end, "tsize", file->size);
+
+	MEM(transfer = talloc_zero(thread, proto_tftp_transfer_t));
+	transfer->thread = thread;
+	transfer->socket = *socket;
+	transfer->file = file;
+	transfer->block_size = block_size;
+	transfer->window_size = window_size;
+	transfer->timeout = timeout;
+	transfer->num_blocks = (file->size / block_size) + 1;
+
+	if (o > (oack + 2)) {
+		MEM(transfer->oack = talloc_memdup(transfer, oack, o - oack));
+		transfer->oack_len = o - oack;
+	}
+
+	(void) fr_rb_insert(thread->transfers, transfer);
+	thread->num_transfers++;
+	talloc_set_destructor(transfer, _transfer_free);
+
+	DEBUG2("Sending \"%s\" (%zu bytes) to %pV:%u, blksize %u, windowsize %u",
+	       file->path, file->size,
+	       fr_box_ipaddr(socket->inet.dst_ipaddr), socket->inet.dst_port,
+	       block_size, window_size);
+
+	transfer_send(transfer);
+}
+
+static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len,
+			size_t *leftover, UNUSED uint32_t *priority, UNUSED bool *is_dup)
+{
+	proto_tftp_udp_thread_t		*thread = talloc_get_type_abort(li->thread_instance, proto_tftp_udp_thread_t);
+	proto_tftp_transfer_t		*transfer, find;
+	fr_socket_t			socket, *address;
+	ssize_t				data_size;
+	uint16_t			opcode;
+
+	*leftover = 0;		/* always for UDP */
+
+	/*
+	 *	Most packets are ACKs, which we handle here.  Keep
+	 *	reading until the socket is drained, but give the
+	 *	other sockets a chance every so often.
+	 */
+	li->read_pending = (++thread->reads < PROTO_TFTP_UDP_BATCH);
+	if (!li->read_pending) thread->reads = 0;
+
+	data_size = udp_recv(thread->sockfd, UDP_FLAGS_NONE, &socket, buffer, buffer_len, recv_time_p);
+	if (data_size <= 0) {
+		li->read_pending = false;
+		thread->reads = 0;
+		(void) udp_send_batch_flush(thread->batch);
+
+		if (data_size < 0) RATE_LIMIT_GLOBAL(PERROR, "Read error (%zd)", data_size);
+		return data_size;
+	}
+
+	if (data_size < FR_TFTP_HDR_LEN) {
+		RATE_LIMIT_GLOBAL(WARN, "Packet is too small (%zd) to be TFTP - ignoring", data_size);
+		goto done;
+	}
+
+	fr_socket_addr_swap(&find.socket, &socket);
+	transfer = fr_rb_find(thread->transfers, &find);
+
+	opcode = fr_net_to_uint16(buffer);
+	switch (opcode) {
+	case FR_OPCODE_VALUE_ACKNOWLEDGEMENT:
+		if (transfer) transfer_ack(transfer, fr_net_to_uint16(buffer + 2));
+		break;
+
+	case FR_OPCODE_VALUE_ERROR:
+		if (!transfer) break;
+
+		DEBUG("Client %pV:%u aborted the transfer of \"%s\"",
+		      fr_box_ipaddr(socket.inet.src_ipaddr), socket.inet.src_port, transfer->file->path);
+		talloc_free(transfer);
+		break;
+
+	case FR_OPCODE_VALUE_READ_REQUEST:
+	case FR_OPCODE_VALUE_WRITE_REQUEST:
+		/*
+		 *	Retransmitted request, we've already started
+		 *	sending the file.
+		 */
+		if (transfer) break;
+
+		/*
+		 *	Let the virtual server decide what to do.  The
+		 *	address comes back to us in mod_write().
+		 */
+		MEM(address = talloc(thread, fr_socket_t));
+		*address = socket;
+		*packet_ctx = address;
+
+		(void) udp_send_batch_flush(thread->batch);
+
+		DEBUG2("Received %s length %d %s", fr_tftp_codes[opcode], (int) data_size, thread->name);
+		return data_size;
+
+	default:
+		DEBUG3("Ignoring TFTP opcode %u from %pV:%u", opcode,
+		       fr_box_ipaddr(socket.inet.src_ipaddr), socket.inet.src_port);
+		break;
+	}
+
+done:
+	if (!li->read_pending) (void) udp_send_batch_flush(thread->batch);
+
+	return 0;
+}
+
+static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t request_time,
+			 uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
+{
+	proto_tftp_udp_thread_t		*thread = talloc_get_type_abort(li->thread_instance, proto_tftp_udp_thread_t);
+	fr_socket_t			*address = talloc_get_type_abort(packet_ctx, fr_socket_t);
+	fr_socket_t			socket;
+
+	/*
+	 *	Don't write anything.
+	 */
+	if ((buffer_len == 1) || (buffer_len < FR_TFTP_HDR_LEN)) goto done;
+
+	fr_socket_addr_swap(&socket, address);
+
+	switch (fr_net_to_uint16(buffer)) {
+	case FR_OPCODE_VALUE_READ_REQUEST:
+		transfer_start(thread, &socket, buffer, buffer_len);
+		break;
+
+	case FR_OPCODE_VALUE_ERROR:
+		(void) udp_send_batch_add(thread->batch, &socket, buffer, buffer_len);
+		break;
+
+	default:
+		fr_assert(0);
+		break;
+	}
+
+	(void) udp_send_batch_flush(thread->batch);
+
+done:
+	talloc_free(address);
+
+	/*
+	 *	Returning 0 would close the socket.  UDP is
+	 *	unreliable, so we always say the packet was written.
+	 */
+	return buffer_len;
+}
+
+static void mod_event_list_set(fr_listen_t *li, fr_event_list_t *el, UNUSED void *nr)
+{
+	proto_tftp_udp_thread_t		*thread = talloc_get_type_abort(li->thread_instance, proto_tftp_udp_thread_t);
+
+	thread->el = el;
+}
+
+/** Open a UDP listener for TFTP
+ *
+ */
+static int mod_open(fr_listen_t *li)
+{
+	proto_tftp_udp_t const		*inst = talloc_get_type_abort_const(li->app_io_instance, proto_tftp_udp_t);
+	proto_tftp_udp_thread_t		*thread = talloc_get_type_abort(li->thread_instance, proto_tftp_udp_thread_t);
+
+	int				sockfd, rcode;
+	uint16_t			port = inst->port;
+
+	li->fd = sockfd = fr_socket_server_udp(&inst->ipaddr, &port, inst->port_name, true);
+	if (sockfd < 0) {
+		PERROR("Failed opening UDP socket");
+	error:
+		return -1;
+	}
+
+	li->app_io_addr = fr_socket_addr_alloc_inet_src(li, IPPROTO_UDP, 0, &inst->ipaddr, port);
+
+	/*
+	 *	Set SO_REUSEPORT before bind, so that all packets can
+	 *	listen on the same destination IP address.
+	 */
+	{
+		int on = 1;
+
+		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+			ERROR("Failed to set socket 'reuseport': %s", fr_syserror(errno));
+			close(sockfd);
+			return -1;
+		}
+	}
+
+#ifdef SO_RCVBUF
+	if (inst->recv_buff_is_set) {
+		int opt;
+
+		opt = inst->recv_buff;
+		if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(int)) < 0) {
+			WARN("Failed setting 'recv_buf': %s", fr_syserror(errno));
+		}
+	}
+#endif
+
+	rcode = fr_socket_bind(sockfd, &inst->ipaddr, &port, inst->interface);
+	if (rcode < 0) {
+		close(sockfd);
+		PERROR("Failed binding socket");
+		goto error;
+	}
+
+	thread->sockfd = sockfd;
+	thread->inst = inst;
+
+	thread->batch = udp_send_batch_alloc(thread, PROTO_TFTP_UDP_BATCH, inst->max_block_size + 4);
+	if (!thread->batch) {
+		PERROR("Failed allocating send batch");
+		close(sockfd);
+		goto error;
+	}
+	MEM(thread->packet = talloc_array(thread, uint8_t, inst->max_block_size + 4));
+
+	MEM(thread->transfers = fr_rb_inline_talloc_alloc(thread, proto_tftp_transfer_t, node, transfer_cmp, NULL));
+	MEM(thread->files = fr_rb_inline_talloc_alloc(thread, proto_tftp_file_t, node, file_cmp, NULL));
+	fr_dlist_talloc_init(&thread->lru, proto_tftp_file_t, entry);
+
+	fr_assert(cf_parent(inst->cs) != NULL);	/* listen { ... } */
+
+	thread->name = fr_app_io_socket_name(thread, &proto_tftp_udp,
+					     NULL, 0,
+					     &inst->ipaddr, inst->port,
+					     inst->interface);
+
+	return 0;
+}
+
+static char const *mod_name(fr_listen_t *li)
+{
+	proto_tftp_udp_thread_t		*thread = talloc_get_type_abort(li->thread_instance, proto_tftp_udp_thread_t);
+
+	return thread->name;
+}
+
+static int mod_bootstrap(void *instance, CONF_SECTION *cs)
+{
+	proto_tftp_udp_t	*inst = talloc_get_type_abort(instance, proto_tftp_udp_t);
+
+	inst->cs = cs;
+
+	/*
+	 *	Complain if no "ipaddr" is set.
+	 */
+	if (inst->ipaddr.af == AF_UNSPEC) {
+		cf_log_err(cs, "No 'ipaddr' was specified in the 'listen' section");
+		return -1;
+	}
+
+	if (inst->recv_buff_is_set) {
+		FR_INTEGER_BOUND_CHECK("recv_buff", inst->recv_buff, >=, 32);
+		FR_INTEGER_BOUND_CHECK("recv_buff", inst->recv_buff, <=, INT_MAX);
+	}
+
+	/*
+	 *	Clients can always use 512 byte blocks.
+	 */
+	FR_INTEGER_BOUND_CHECK("max_block_size", inst->max_block_size, >=, 512);
+	FR_INTEGER_BOUND_CHECK("max_block_size", inst->max_block_size, <=, FR_TFTP_BLOCK_MAX_SIZE);
+
+	FR_INTEGER_BOUND_CHECK("max_window_size", inst->max_window_size, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_window_size", inst->max_window_size, <=, 65535);
+
+	FR_TIME_DELTA_BOUND_CHECK("timeout", inst->timeout, >=, fr_time_delta_from_msec(100));
+	FR_TIME_DELTA_BOUND_CHECK("timeout", inst->timeout, <=, fr_time_delta_from_sec(255));
+
+	FR_INTEGER_BOUND_CHECK("max_retransmits", inst->max_retransmits, <=, 100);
+	FR_INTEGER_BOUND_CHECK("max_transfers", inst->max_transfers, >=, 1);
+
+	if (!inst->port) {
+		struct servent *s;
+
+		if (!inst->port_name) {
+			inst->port = 69;
+		} else {
+			s = getservbyname(inst->port_name, "udp");
+			if (!s) {
+				cf_log_err(cs, "Unknown value for 'port_name = %s", inst->port_name);
+				return -1;
+			}
+
+			inst->port = ntohs(s->s_port);
+		}
+	}
+
+	return 0;
+}
+
+fr_app_io_t proto_tftp_udp = {
+	.magic			= RLM_MODULE_INIT,
+	.name			= "tftp_udp",
+	.config			= udp_listen_config,
+	.inst_size		= sizeof(proto_tftp_udp_t),
+	.thread_inst_size	= sizeof(proto_tftp_udp_thread_t),
+	.bootstrap		= mod_bootstrap,
+
+	.default_message_size	= PROTO_TFTP_MAX_REQUEST_SIZE,
+	.default_reply_size	= PROTO_TFTP_MAX_REPLY_SIZE,
+
+	.open			= mod_open,
+	.read			= mod_read,
+	.write			= mod_write,
+	.event_list_set		= mod_event_list_set,
+	.get_name      		= mod_name,
+};
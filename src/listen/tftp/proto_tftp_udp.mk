@@ -0,0 +1,9 @@
+TARGETNAME	:= proto_tftp_udp
+
+ifneq "$(TARGETNAME)" ""
+TARGET		:= $(TARGETNAME).a
+endif
+
+SOURCES		:= proto_tftp_udp.c
+
+TGT_PREREQS	:= libfreeradius-tftp.a libfreeradius-io.a
@@ -37,6 +37,13 @@
 
 #define BFD_MAX_SECRET_LENGTH 20
 
+/*
+ *	Interval limits, in milliseconds.  Sub-50ms detection needs
+ *	intervals well below the old 100ms floor.
+ */
+#define BFD_MIN_INTERVAL	10
+#define BFD_MAX_INTERVAL	10000
+
 typedef enum bfd_session_state_t {
 	BFD_STATE_ADMIN_DOWN = 0,
 	BFD_STATE_DOWN,
@@ -224,6 +231,13 @@ typedef struct {
 	uint32_t	max_timeouts;
 	bool		demand;
 
+	bool		dedicated_thread;	//!< Run all sessions for this socket on their own thread.
+	uint32_t	thread_priority;	//!< SCHED_FIFO priority of that thread, 0 for none.
+
+	int		sockfd;			//!< The socket.  Owned by the socket thread, if there is one.
+	fr_event_list_t	*el;			//!< Event list for the socket thread.
+	pthread_t	pthread_id;
+
 	bfd_auth_type_t	auth_type;
 	uint8_t		secret[BFD_MAX_SECRET_LENGTH];
 	size_t		secret_len;
@@ -243,7 +257,7 @@ static int bfd_start_packets(bfd_state_t *session);
 static int bfd_start_control(bfd_state_t *session);
 static int bfd_stop_control(bfd_state_t *session);
 static void bfd_detection_timeout(UNUSED fr_event_list_t *eel, fr_time_t now, void *ctx);
-static int bfd_process(bfd_state_t *session, bfd_packet_t *bfd);
+static int bfd_process(bfd_state_t *session, bfd_packet_t *bfd, fr_time_t when);
 
 static fr_event_list_t *event_list = NULL; /* don't ask */
 
@@ -302,7 +316,7 @@ static void bfd_pipe_recv(UNUSED fr_event_list_t *xel, int fd, UNUSED int flags,
 	num = read(fd, ((uint8_t *) &bfd) + 4, bfd.length - 4);
 	if ((num < 0) || ((num + 4) != bfd.length)) goto fail;
 
-	bfd_process(session, &bfd);
+	bfd_process(session, &bfd, fr_time());
 }
 
 /*
@@ -415,7 +429,7 @@ static void bfd_session_free(void *ctx)
 {
 	bfd_state_t *session = ctx;
 
-	if (event_list != session->el) {
+	if ((event_list != session->el) && (session->pipefd[0] >= 0)) {
 		/*
 		 *	FIXME: this isn't particularly safe.
 		 */
@@ -517,8 +531,8 @@ static bfd_state_t *bfd_new_session(bfd_socket_t *sock, int sockfd,
 
 		rcode = cf_pair_parse(NULL, cs, "min_transmit_interval", FR_ITEM_POINTER(FR_TYPE_UINT32, &number), NULL, T_INVALID);
 		if (rcode == 0) {
-			if (number < 100) number = 100;
-			if (number > 10000) number = 10000;
+			if (number < BFD_MIN_INTERVAL) number = BFD_MIN_INTERVAL;
+			if (number > BFD_MAX_INTERVAL) number = BFD_MAX_INTERVAL;
 
 			session->desired_min_tx_interval = number * 1000;
 		}
@@ -529,8 +543,8 @@ static bfd_state_t *bfd_new_session(bfd_socket_t *sock, int sockfd,
 
 		rcode = cf_pair_parse(NULL, cs, "min_receive_interval", FR_ITEM_POINTER(FR_TYPE_UINT32, &number), NULL, T_INVALID);
 		if (rcode == 0) {
-			if (number < 100) number = 100;
-			if (number > 10000) number = 10000;
+			if (number < BFD_MIN_INTERVAL) number = BFD_MIN_INTERVAL;
+			if (number > BFD_MAX_INTERVAL) number = BFD_MAX_INTERVAL;
 
 			session->required_min_rx_interval = number * 1000;
 		}
@@ -605,6 +619,15 @@ static bfd_state_t *bfd_new_session(bfd_socket_t *sock, int sockfd,
 
 		session->pipefd[0] = session->pipefd[1] = -1;
 		session->pthread_id = pthread_self();
+
+	} else if (sock->el) {
+		/*
+		 *	The socket thread starts the control timers for
+		 *	all of its sessions when it runs.
+		 */
+		session->el = sock->el;
+
+		session->pipefd[0] = session->pipefd[1] = -1;
 	} else {
 		if (!bfd_pthread_create(session)) {
 			fr_rb_delete(sock->session_tree, session);
@@ -1147,7 +1170,7 @@ static void bfd_poll_response(bfd_state_t *session)
 }
 
 
-static int bfd_process(bfd_state_t *session, bfd_packet_t *bfd)
+static int bfd_process(bfd_state_t *session, bfd_packet_t *bfd, fr_time_t when)
 {
 	if (bfd->auth_present &&
 	    (session->auth_type == BFD_AUTH_RESERVED)) {
@@ -1315,9 +1338,11 @@ static int bfd_process(bfd_state_t *session, bfd_packet_t *bfd)
 
 	/*
 	 *	We've received the packet for the purpose of Section
-	 *	6.8.4.
+	 *	6.8.4.  Use the time the kernel received it, so that
+	 *	time spent waiting to be read isn't counted against
+	 *	the peer.
 	 */
-	session->last_recv = fr_time();
+	session->last_recv = when;
 
 	/*
 	 *	We've received a packet, but missed the previous one.
@@ -1398,102 +1423,214 @@ static int bfd_process(bfd_state_t *session, bfd_packet_t *bfd)
  */
 
 /*
- *	Check if an incoming request is "ok"
+ *	Check if an incoming packet is "ok"
  *
  *	It takes packets, not requests.  It sees if the packet looks
- *	OK.  If so, it does a number of sanity checks on it.
+ *	OK.  If so, it does a number of sanity checks on it, and
+ *	returns the session it belongs to.
  */
-static int bfd_socket_recv(rad_listen_t *listener)
+static bfd_state_t *bfd_packet_session(bfd_socket_t *sock, bfd_packet_t *bfd, ssize_t rcode,
+				       struct sockaddr_storage *src, socklen_t sizeof_src)
 {
-	ssize_t		rcode;
-	bfd_socket_t	*sock = listener->data;
 	bfd_state_t	*session;
 	bfd_state_t	my_session;
-	struct sockaddr_storage src;
-	socklen_t	sizeof_src = sizeof(src);
-	bfd_packet_t	bfd;
-
-	rcode = recvfrom(listener->fd, &bfd, sizeof(bfd), 0,
-			 (struct sockaddr *)&src, &sizeof_src);
-	if (rcode < 0) {
-		ERROR("Failed receiving packet: %s", fr_syserror(errno));
-		return 0;
-	}
 
 	if (rcode < 24) {
 		DEBUG("BFD packet is too short (%d < 24)", (int) rcode);
-		return 0;
+		return NULL;
 	}
 
-	if (bfd.version != 1) {
-		DEBUG("BFD packet has wrong version (%d != 1)", bfd.version);
-		return 0;
+	if (bfd->version != 1) {
+		DEBUG("BFD packet has wrong version (%d != 1)", bfd->version);
+		return NULL;
 	}
 
-	if (bfd.length < 24) {
-		DEBUG("BFD packet has wrong length (%d < 24)", bfd.length);
-		return 0;
+	if (bfd->length < 24) {
+		DEBUG("BFD packet has wrong length (%d < 24)", bfd->length);
+		return NULL;
 	}
 
-	if (bfd.length > sizeof(bfd)) {
-		DEBUG("BFD packet has wrong length (%d > %zd)", bfd.length, sizeof(bfd));
-		return 0;
+	if (bfd->length > sizeof(*bfd)) {
+		DEBUG("BFD packet has wrong length (%d > %zd)", bfd->length, sizeof(*bfd));
+		return NULL;
 	}
 
-	if (bfd.auth_present) {
-		if (bfd.length < 26) {
+	if (bfd->auth_present) {
+		if (bfd->length < 26) {
 			DEBUG("BFD packet has wrong length (%d < 26)",
-			      bfd.length);
-			return 0;
+			      bfd->length);
+			return NULL;
 		}
 
-		if (bfd.length < 24 + bfd.auth.basic.auth_len) {
+		if (bfd->length < 24 + bfd->auth.basic.auth_len) {
 			DEBUG("BFD packet is too short (%d < %d)",
-			      bfd.length, 24 + bfd.auth.basic.auth_len);
-			return 0;
+			      bfd->length, 24 + bfd->auth.basic.auth_len);
+			return NULL;
 
 		}
 
-		if (bfd.length != 24 + bfd.auth.basic.auth_len) {
+		if (bfd->length != 24 + bfd->auth.basic.auth_len) {
 			DEBUG("WARNING: What is the extra data?");
 		}
 
 	}
 
-	if (bfd.detect_multi == 0) {
+	if (bfd->detect_multi == 0) {
 		DEBUG("BFD packet has detect_multi == 0");
-		return 0;
+		return NULL;
 	}
 
-	if (bfd.multipoint != 0) {
+	if (bfd->multipoint != 0) {
 		DEBUG("BFD packet has multi != 0");
-		return 0;
+		return NULL;
 	}
 
-	if (bfd.my_disc == 0) {
+	if (bfd->my_disc == 0) {
 		DEBUG("BFD packet has my_disc == 0");
-		return 0;
+		return NULL;
 	}
 
-	if ((bfd.your_disc == 0) &&
-	    !((bfd.state == BFD_STATE_DOWN) ||
-	      (bfd.state == BFD_STATE_ADMIN_DOWN))) {
+	if ((bfd->your_disc == 0) &&
+	    !((bfd->state == BFD_STATE_DOWN) ||
+	      (bfd->state == BFD_STATE_ADMIN_DOWN))) {
 		DEBUG("BFD packet has invalid your-disc / state");
-		return 0;
+		return NULL;
 	}
 
 	/*
 	 *	We SHOULD use "your_disc", but what the heck.
 	 */
 	fr_ipaddr_from_sockaddr(&my_session.socket.inet.dst_ipaddr,
-				&my_session.socket.inet.dst_port, &src, sizeof_src);
+				&my_session.socket.inet.dst_port, src, sizeof_src);
 
 	session = fr_rb_find(sock->session_tree, &my_session);
 	if (!session) {
 		DEBUG("BFD unknown peer");
+		return NULL;
+	}
+
+	return session;
+}
+
+/*
+ *	Read packets on the socket thread.  The socket is
+ *	non-blocking, so we drain it, and then go back to the timers.
+ */
+static void bfd_socket_thread_recv(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *ctx)
+{
+	bfd_socket_t	*sock = ctx;
+
+	for (;;) {
+		ssize_t		rcode;
+		bfd_state_t	*session;
+		struct sockaddr_storage src, dst;
+		socklen_t	sizeof_src = sizeof(src);
+		socklen_t	sizeof_dst = sizeof(dst);
+		bfd_packet_t	bfd;
+		fr_time_t	when;
+
+		rcode = recvfromto(fd, &bfd, sizeof(bfd), 0, NULL,
+				   (struct sockaddr *)&src, &sizeof_src,
+				   (struct sockaddr *)&dst, &sizeof_dst, &when);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+
+			ERROR("Failed receiving packet: %s", fr_syserror(errno));
+			return;
+		}
+
+		session = bfd_packet_session(sock, &bfd, rcode, &src, sizeof_src);
+		if (!session) continue;
+
+		bfd_process(session, &bfd, when);
+	}
+}
+
+static void *bfd_socket_thread(void *ctx)
+{
+	bfd_socket_t		*sock = ctx;
+	bfd_state_t		*session;
+	fr_rb_iter_inorder_t	iter;
+
+	if (sock->thread_priority) {
+		struct sched_param	param = { .sched_priority = sock->thread_priority };
+		int			ret;
+
+		/*
+		 *	Usually needs CAP_SYS_NICE.  Without it we still
+		 *	run, we just compete with the workers for the CPU.
+		 */
+		ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (ret != 0) {
+			WARN("BFD failed setting real-time priority %u: %s", sock->thread_priority,
+			     fr_syserror(ret));
+		}
+	}
+
+	DEBUG("BFD starting socket thread");
+
+	for (session = fr_rb_iter_init_inorder(&iter, sock->session_tree);
+	     session;
+	     session = fr_rb_iter_next_inorder(&iter)) {
+		bfd_start_control(session);
+	}
+
+	fr_event_loop(sock->el);
+
+	return NULL;
+}
+
+static int bfd_socket_thread_start(bfd_socket_t *sock)
+{
+	if (fr_event_fd_insert(sock, sock->el, sock->sockfd,
+			       bfd_socket_thread_recv,
+			       NULL,
+			       NULL,
+			       sock) < 0) {
+		PERROR("Failed inserting file descriptor into event list");
+		return -1;
+	}
+
+	if (fr_schedule_pthread_create(&sock->pthread_id, bfd_socket_thread, sock) < 0) {
+		PERROR("Thread create failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Read a packet when the sessions are run from the main event
+ *	loop, or from per-session threads.
+ */
+static int bfd_socket_recv(rad_listen_t *listener)
+{
+	ssize_t		rcode;
+	bfd_socket_t	*sock = listener->data;
+	bfd_state_t	*session;
+	struct sockaddr_storage src, dst;
+	socklen_t	sizeof_src = sizeof(src);
+	socklen_t	sizeof_dst = sizeof(dst);
+	bfd_packet_t	bfd;
+	fr_time_t	when;
+
+	/*
+	 *	The socket thread reads the packets.
+	 */
+	if (sock->el) return 0;
+
+	rcode = recvfromto(listener->fd, &bfd, sizeof(bfd), 0, NULL,
+			   (struct sockaddr *)&src, &sizeof_src,
+			   (struct sockaddr *)&dst, &sizeof_dst, &when);
+	if (rcode < 0) {
+		ERROR("Failed receiving packet: %s", fr_syserror(errno));
 		return 0;
 	}
 
+	session = bfd_packet_session(sock, &bfd, rcode, &src, sizeof_src);
+	if (!session) return 0;
+
 	if (!event_list) {
 		uint8_t *p = (uint8_t *) &bfd;
 		size_t total = bfd.length;
@@ -1527,7 +1664,7 @@ static int bfd_socket_recv(rad_listen_t *listener)
 		return 0;
 	}
 
-	return bfd_process(session, &bfd);
+	return bfd_process(session, &bfd, when);
 }
 
 static int bfd_parse_ip_port(CONF_SECTION *cs, fr_ipaddr_t *ipaddr, uint16_t *port)
@@ -1661,12 +1798,18 @@ static int bfd_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 
 	if (cf_pair_parse(sock, cs, "interface", FR_ITEM_POINTER(FR_TYPE_STRING, &sock->interface), NULL, T_INVALID) < 0) return -1;
 
+	if (cf_pair_parse(sock, cs, "min_transmit_interval", FR_ITEM_POINTER(FR_TYPE_UINT32,
+			  &sock->min_tx_interval), "1000", T_BARE_WORD) < 0) return -1;
 	if (cf_pair_parse(sock, cs, "min_receive_interval", FR_ITEM_POINTER(FR_TYPE_UINT32,
 			  &sock->min_rx_interval), "1000", T_BARE_WORD) < 0) return -1;
 	if (cf_pair_parse(sock, cs, "max_timeouts", FR_ITEM_POINTER(FR_TYPE_UINT32,
 			  &sock->max_timeouts), "3", T_BARE_WORD) < 0) return -1;
 	if (cf_pair_parse(sock, cs, "demand", FR_ITEM_POINTER(FR_TYPE_BOOL, &sock->demand),
 			  "no", T_DOUBLE_QUOTED_STRING) < 0) return -1;
+	if (cf_pair_parse(sock, cs, "dedicated_thread", FR_ITEM_POINTER(FR_TYPE_BOOL, &sock->dedicated_thread),
+			  "yes", T_BARE_WORD) < 0) return -1;
+	if (cf_pair_parse(sock, cs, "thread_priority", FR_ITEM_POINTER(FR_TYPE_UINT32,
+			  &sock->thread_priority), "0", T_BARE_WORD) < 0) return -1;
 	if (cf_pair_parse(NULL, cs, "auth_type", FR_ITEM_POINTER(FR_TYPE_STRING, &auth_type_str),
 			  NULL, T_INVALID) < 0) return -1;
 
@@ -1679,11 +1822,13 @@ static int bfd_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 		sock->server_cs = this->server_cs;
 	}
 
-	if (sock->min_tx_interval < 100) sock->min_tx_interval = 100;
-	if (sock->min_tx_interval > 10000) sock->min_tx_interval = 10000;
+	if (sock->min_tx_interval < BFD_MIN_INTERVAL) sock->min_tx_interval = BFD_MIN_INTERVAL;
+	if (sock->min_tx_interval > BFD_MAX_INTERVAL) sock->min_tx_interval = BFD_MAX_INTERVAL;
+
+	if (sock->min_rx_interval < BFD_MIN_INTERVAL) sock->min_rx_interval = BFD_MIN_INTERVAL;
+	if (sock->min_rx_interval > BFD_MAX_INTERVAL) sock->min_rx_interval = BFD_MAX_INTERVAL;
 
-	if (sock->min_rx_interval < 100) sock->min_rx_interval = 100;
-	if (sock->min_rx_interval > 10000) sock->min_rx_interval = 10000;
+	if (sock->thread_priority > 99) sock->thread_priority = 99;
 
 	if (sock->max_timeouts == 0) sock->max_timeouts = 1;
 	if (sock->max_timeouts > 10) sock->max_timeouts = 10;
@@ -1761,13 +1906,29 @@ static int bfd_socket_open(CONF_SECTION *cs, rad_listen_t *this)
 		return -1;
 	}
 
+	sock->sockfd = this->fd;
+
+	/*
+	 *	Run the sessions on their own thread, so that packet
+	 *	timing doesn't depend on how busy the main loop is.
+	 */
+	if (!event_list && sock->dedicated_thread) {
+		sock->el = fr_event_list_alloc(sock, NULL, NULL);
+		if (!sock->el) {
+			ERROR("Failed creating event list");
+			return -1;
+		}
+	}
+
 	/*
 	 *	Bootstrap the initial set of connections.
 	 */
-	if (bfd_init_sessions(cs, sock, this->fd) < 0) {
+	if (bfd_init_sessions(cs, sock, sock->sockfd) < 0) {
 		return -1;
 	}
 
+	if (sock->el && (bfd_socket_thread_start(sock) < 0)) return -1;
+
 	return 0;
 }
 
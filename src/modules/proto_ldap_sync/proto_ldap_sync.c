@@ -74,6 +74,15 @@ typedef struct {
 	fr_time_delta_t			conn_retry_interval;	//!< How long to wait before trying to re-establish
 								//!< a connection.
 
+	fr_time_delta_t			coalesce_window;	//!< How long to collect changes before processing
+								//!< them.  Zero to process each change on its own.
+
+	uint32_t			coalesce_max_entries;	//!< Process the changes early, if this many
+								//!< entries have changed.
+
+	fr_rb_tree_t			*batches;		//!< Changes waiting to be processed, one
+								//!< #proto_ldap_batch_t per sync.
+
 	/*
 	 *	Global config
 	 */
@@ -83,19 +92,50 @@ typedef struct {
 	uint32_t			ldap_debug;		//!< Debug flag for the SDK.
 } proto_ldap_inst_t;
 
+/** Changes received for one sync, which will be processed as a single request
+ *
+ * Multiple changes to the same entry are merged, so only the final state
+ * of each entry is processed.
+ */
+typedef struct {
+	fr_rb_node_t			node;			//!< Entry in the instance's tree of batches.
+	int				sync_id;		//!< The changes were received for.
+
+	request_t			*request;		//!< Holds an LDAP-Sync-Entry for each entry.
+	fr_rb_tree_t			*entries;		//!< #proto_ldap_pending_t, keyed by DN.
+	uint32_t			num_entries;		//!< How many entries have changed.
+
+	uint8_t				*cookie;		//!< Most recent cookie received for the sync.
+								///< Added to the request when it's processed.
+
+	fr_event_timer_t const		*ev;			//!< When to process the batch.
+} proto_ldap_batch_t;
+
+/** The most recent change to an entry
+ *
+ */
+typedef struct {
+	fr_rb_node_t			node;			//!< Entry in the batch's tree of entries.
+	char				*dn;			//!< Of the entry.
+	sync_states_t			state;			//!< What needs doing to our copy of the entry.
+	fr_pair_t			*group;			//!< LDAP-Sync-Entry in the batch request.
+} proto_ldap_pending_t;
+
 typedef enum {
 	LDAP_SYNC_CODE_PRESENT	= SYNC_STATE_PRESENT,
 	LDAP_SYNC_CODE_ADD	= SYNC_STATE_ADD,
 	LDAP_SYNC_CODE_MODIFY	= SYNC_STATE_MODIFY,
 	LDAP_SYNC_CODE_DELETE	= SYNC_STATE_DELETE,
 	LDAP_SYNC_CODE_COOKIE_LOAD,
-	LDAP_SYNC_CODE_COOKIE_STORE
+	LDAP_SYNC_CODE_COOKIE_STORE,
+	LDAP_SYNC_CODE_BATCH
 } ldap_sync_packet_code_t;
 
 static fr_table_num_sorted_t const ldap_sync_code_table[] = {
 	{ L("cookie-load"),	LDAP_SYNC_CODE_COOKIE_LOAD	},
 	{ L("cookie-store"),	LDAP_SYNC_CODE_COOKIE_STORE	},
 	{ L("entry-add"),		LDAP_SYNC_CODE_ADD		},
+	{ L("entry-batch"),	LDAP_SYNC_CODE_BATCH		},
 	{ L("entry-delete"),	LDAP_SYNC_CODE_DELETE		},
 	{ L("entry-modify"),	LDAP_SYNC_CODE_MODIFY		},
 	{ L("entry-present"),	LDAP_SYNC_CODE_PRESENT		}
@@ -183,6 +223,9 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("sync_retry_interval", FR_TYPE_TIME_DELTA, proto_ldap_inst_t, sync_retry_interval), .dflt = "5" },
 	{ FR_CONF_OFFSET("conn_retry_interval", FR_TYPE_TIME_DELTA, proto_ldap_inst_t, conn_retry_interval), .dflt = "5" },
 
+	{ FR_CONF_OFFSET("coalesce_window", FR_TYPE_TIME_DELTA, proto_ldap_inst_t, coalesce_window), .dflt = "0" },
+	{ FR_CONF_OFFSET("coalesce_max_entries", FR_TYPE_UINT32, proto_ldap_inst_t, coalesce_max_entries), .dflt = "10000" },
+
 	/*
 	 *	Areas of the DIT to listen on
 	 */
@@ -209,6 +252,7 @@ fr_dict_autoload_t proto_ldap_sync_dict[] = {
 static fr_dict_attr_t const *attr_ldap_sync_attr;
 static fr_dict_attr_t const *attr_ldap_sync_cookie;
 static fr_dict_attr_t const *attr_ldap_sync_dn;
+static fr_dict_attr_t const *attr_ldap_sync_entry;
 static fr_dict_attr_t const *attr_ldap_sync_entry_dn;
 static fr_dict_attr_t const *attr_ldap_sync_entry_state;
 static fr_dict_attr_t const *attr_ldap_sync_entry_uuid;
@@ -220,6 +264,7 @@ fr_dict_attr_autoload_t proto_ldap_sync_dict_attr[] = {
 	{ .out = &attr_ldap_sync_attr, .name = "LDAP-Sync-Attr", .type = FR_TYPE_STRING, .dict = &dict_freeradius },
 	{ .out = &attr_ldap_sync_cookie, .name = "LDAP-Sync-Cookie", .type = FR_TYPE_OCTETS, .dict = &dict_freeradius },
 	{ .out = &attr_ldap_sync_dn, .name = "LDAP-Sync-DN", .type = FR_TYPE_STRING, .dict = &dict_freeradius },
+	{ .out = &attr_ldap_sync_entry, .name = "LDAP-Sync-Entry", .type = FR_TYPE_GROUP, .dict = &dict_freeradius },
 	{ .out = &attr_ldap_sync_entry_dn, .name = "LDAP-Sync-Entry-DN", .type = FR_TYPE_STRING, .dict = &dict_freeradius },
 	{ .out = &attr_ldap_sync_entry_state, .name = "LDAP-Sync-Entry-State", .type = FR_TYPE_UINT32, .dict = &dict_freeradius },
 	{ .out = &attr_ldap_sync_entry_uuid, .name = "LDAP-Sync-Entry-UUID", .type = FR_TYPE_OCTETS, .dict = &dict_freeradius },
@@ -397,6 +442,11 @@ static void request_running(request_t *request, fr_state_signal_t action)
 			state = "Cookie";
 			break;
 
+		case LDAP_SYNC_CODE_BATCH:
+			verb = "recv";
+			state = "Batch";
+			break;
+
 		default:
 			fr_assert(0);
 			return;
@@ -603,6 +653,280 @@ static void proto_ldap_connection_init(UNUSED fr_event_list_t *el, UNUSED fr_tim
 	return;
 }
 
+static int8_t proto_ldap_batch_cmp(void const *one, void const *two)
+{
+	proto_ldap_batch_t const *a = one, *b = two;
+
+	return CMP(a->sync_id, b->sync_id);
+}
+
+static int8_t proto_ldap_pending_cmp(void const *one, void const *two)
+{
+	proto_ldap_pending_t const *a = one, *b = two;
+
+	return CMP(strcmp(a->dn, b->dn), 0);
+}
+
+/** Process all the changes collected for a sync, as one request
+ *
+ * The most recent cookie is added to the request, so that it can be
+ * stored after the changes have been applied.  If it were stored
+ * separately, a failure to apply the changes would lose them.
+ *
+ * @param[in] inst	of proto_ldap_sync.
+ * @param[in] batch	to process.  Freed on return.
+ */
+static void proto_ldap_batch_flush(proto_ldap_inst_t *inst, proto_ldap_batch_t *batch)
+{
+	request_t *request = batch->request;
+
+	fr_rb_remove(inst->batches, batch);
+	if (batch->ev) fr_event_timer_delete(&batch->ev);
+
+	if (batch->cookie) {
+		fr_pair_t *vp;
+
+		MEM(pair_update_request(&vp, attr_ldap_sync_cookie) >= 0);
+		fr_pair_value_memdup(vp, batch->cookie, talloc_array_length(batch->cookie), true);
+	}
+
+	DEBUG2("Processing %u changed entries for sync %i", batch->num_entries, batch->sync_id);
+
+	talloc_free(batch);
+
+	/*
+	 *	All the changes cancelled each other out.
+	 */
+	if (!fr_pair_find_by_da(&request->request_pairs, attr_ldap_sync_entry, 0) &&
+	    !fr_pair_find_by_da(&request->request_pairs, attr_ldap_sync_cookie, 0)) {
+		talloc_free(request);
+		return;
+	}
+
+//	request_enqueue(request);
+}
+
+/** Process the changes collected for a sync, once the window has passed
+ *
+ * @param[in] el	the event list managing listen event.
+ * @param[in] now	current time.
+ * @param[in] uctx	The batch.
+ */
+static void _proto_ldap_batch_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	proto_ldap_batch_t	*batch = talloc_get_type_abort(uctx, proto_ldap_batch_t);
+	rad_listen_t		*listen = talloc_get_type_abort(talloc_parent(batch), rad_listen_t);
+
+	proto_ldap_batch_flush(talloc_get_type_abort(listen->data, proto_ldap_inst_t), batch);
+}
+
+/** Process any changes collected for a sync
+ *
+ * @param[in] inst	of proto_ldap_sync.
+ * @param[in] sync_id	to process changes for.
+ */
+static void proto_ldap_batch_flush_by_id(proto_ldap_inst_t *inst, int sync_id)
+{
+	proto_ldap_batch_t *batch;
+
+	if (!inst->batches) return;
+
+	batch = fr_rb_find(inst->batches, &(proto_ldap_batch_t){ .sync_id = sync_id });
+	if (batch) proto_ldap_batch_flush(inst, batch);
+}
+
+/** Find or create the batch of changes for a sync
+ *
+ * @param[in] listen	The listener.
+ * @param[in] inst	of proto_ldap_sync.
+ * @param[in] config	of the sync.
+ * @param[in] sync_id	of the sync.
+ * @return
+ *	- The batch.
+ *	- NULL on error.
+ */
+static proto_ldap_batch_t *proto_ldap_batch_get(rad_listen_t *listen, proto_ldap_inst_t *inst,
+						sync_config_t const *config, int sync_id)
+{
+	proto_ldap_batch_t *batch;
+
+	if (!inst->batches) {
+		MEM(inst->batches = fr_rb_inline_alloc(inst, proto_ldap_batch_t, node, proto_ldap_batch_cmp, NULL));
+	}
+
+	batch = fr_rb_find(inst->batches, &(proto_ldap_batch_t){ .sync_id = sync_id });
+	if (batch) return batch;
+
+	MEM(batch = talloc_zero(listen, proto_ldap_batch_t));
+	batch->sync_id = sync_id;
+
+	batch->request = proto_ldap_request_setup(listen, inst, sync_id);
+	if (!batch->request) {
+		talloc_free(batch);
+		return NULL;
+	}
+	proto_ldap_attributes_add(batch->request, config);
+	batch->request->packet->code = LDAP_SYNC_CODE_BATCH;
+
+	MEM(batch->entries = fr_rb_inline_alloc(batch, proto_ldap_pending_t, node, proto_ldap_pending_cmp, NULL));
+
+	if (fr_event_timer_in(batch, inst->el, &batch->ev, inst->coalesce_window,
+			      _proto_ldap_batch_timeout, batch) < 0) {
+		PERROR("Failed inserting event");
+		talloc_free(batch->request);
+		talloc_free(batch);
+		return NULL;
+	}
+
+	fr_rb_insert(inst->batches, batch);
+
+	return batch;
+}
+
+/** Merge a change to an entry with an earlier change in the same batch
+ *
+ * @param[out] out	The state to record for the entry.
+ * @param[in] prev	Earlier change.
+ * @param[in] next	Latest change.
+ * @return
+ *	- true if the entry should be processed.
+ *	- false if the changes cancel out.
+ */
+static bool proto_ldap_state_merge(sync_states_t *out, sync_states_t prev, sync_states_t next)
+{
+	switch (next) {
+	case SYNC_STATE_MODIFY:
+		/*
+		 *	We haven't seen the entry yet, so it's
+		 *	still an add, just with newer attributes.
+		 */
+		*out = (prev == SYNC_STATE_ADD) ? SYNC_STATE_ADD : SYNC_STATE_MODIFY;
+		return true;
+
+	case SYNC_STATE_DELETE:
+		/*
+		 *	Added and removed before we saw it.
+		 */
+		if (prev == SYNC_STATE_ADD) return false;
+		*out = SYNC_STATE_DELETE;
+		return true;
+
+	case SYNC_STATE_ADD:
+		/*
+		 *	Removed and re-added, our copy needs updating.
+		 */
+		*out = (prev == SYNC_STATE_DELETE) ? SYNC_STATE_MODIFY : SYNC_STATE_ADD;
+		return true;
+
+	default:
+		*out = next;
+		return true;
+	}
+}
+
+/** Add a change to the batch for a sync, replacing any earlier change to the same entry
+ *
+ * @param[in] listen	The listener.
+ * @param[in] inst	of proto_ldap_sync.
+ * @param[in] conn	the change was received on.
+ * @param[in] config	of the sync.
+ * @param[in] sync_id	of the sync.
+ * @param[in] uuid	of the entry.
+ * @param[in] msg	containing the entry.
+ * @param[in] state	The type of modification we need to perform to our
+ *			representation of the entry.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int proto_ldap_batch_add(rad_listen_t *listen, proto_ldap_inst_t *inst, fr_ldap_connection_t *conn,
+				sync_config_t const *config, int sync_id,
+				uint8_t const uuid[SYNC_UUID_LENGTH], LDAPMessage *msg, sync_states_t state)
+{
+	proto_ldap_batch_t	*batch;
+	proto_ldap_pending_t	*pending;
+	request_t		*request;
+	fr_ldap_map_exp_t	expanded;
+	fr_pair_list_t		saved;
+	fr_pair_t		*vp;
+	char			*entry_dn;
+
+	/*
+	 *	Without a DN there's nothing to merge on.
+	 */
+	if (!msg || !(entry_dn = ldap_get_dn(conn->handle, msg))) return 1;
+
+	batch = proto_ldap_batch_get(listen, inst, config, sync_id);
+	if (!batch) {
+		ldap_memfree(entry_dn);
+		return -1;
+	}
+	request = batch->request;
+
+	pending = fr_rb_find(batch->entries, &(proto_ldap_pending_t){ .dn = entry_dn });
+	if (pending) {
+		sync_states_t merged;
+
+		/*
+		 *	The earlier change is superseded.
+		 */
+		fr_pair_delete(&request->request_pairs, pending->group);
+		pending->group = NULL;
+
+		if (!proto_ldap_state_merge(&merged, pending->state, state)) {
+			fr_rb_delete(batch->entries, pending);
+			talloc_free(pending);
+			batch->num_entries--;
+			ldap_memfree(entry_dn);
+			return 0;
+		}
+		state = merged;
+	} else {
+		MEM(pending = talloc_zero(batch, proto_ldap_pending_t));
+		MEM(pending->dn = talloc_strdup(pending, entry_dn));
+		fr_rb_insert(batch->entries, pending);
+		batch->num_entries++;
+	}
+	pending->state = state;
+
+	/*
+	 *	Apply the attribute map to an empty request list,
+	 *	and move what it produces into the entry's group.
+	 */
+	fr_pair_list_init(&saved);
+	fr_pair_list_append(&saved, &request->request_pairs);
+
+	MEM(pair_update_request(&vp, attr_ldap_sync_entry_dn) >= 0);
+	fr_pair_value_strdup(vp, entry_dn);
+	ldap_memfree(entry_dn);
+
+	MEM(pair_update_request(&vp, attr_ldap_sync_entry_uuid) >= 0);
+	fr_pair_value_memdup(vp, uuid, SYNC_UUID_LENGTH, true);
+
+	MEM(pair_update_request(&vp, attr_ldap_sync_entry_state) >= 0);
+	vp->vp_uint32 = state;
+
+	if ((fr_ldap_map_expand(&expanded, request, &config->entry_map) < 0) ||
+	    (fr_ldap_map_do(request, conn, NULL, &expanded, msg) < 0)) {
+		fr_pair_list_free(&request->request_pairs);
+		fr_pair_list_append(&request->request_pairs, &saved);
+		fr_rb_delete(batch->entries, pending);
+		talloc_free(pending);
+		batch->num_entries--;
+		return -1;
+	}
+
+	MEM(pending->group = fr_pair_afrom_da(request->request_ctx, attr_ldap_sync_entry));
+	fr_pair_list_steal(pending->group, &pending->group->vp_group, &request->request_pairs);
+
+	fr_pair_list_append(&request->request_pairs, &saved);
+	fr_pair_append(&request->request_pairs, pending->group);
+
+	if (batch->num_entries >= inst->coalesce_max_entries) proto_ldap_batch_flush(inst, batch);
+
+	return 0;
+}
+
 /** Reinitialise a sync with reload_hint=true
  *
  * The server returned an e-refreshRequired code, so we need to restart the sync
@@ -627,6 +951,11 @@ static int _proto_ldap_refresh_required(fr_ldap_connection_t *conn, UNUSED sync_
 
 	DEBUG2("Refresh required");
 
+	/*
+	 *	The changes we've already received are still valid.
+	 */
+	proto_ldap_batch_flush_by_id(inst, sync_id);
+
 	proto_ldap_sync_reinit(inst->el, fr_time(), user_ctx);
 
 	return 0;
@@ -681,6 +1010,18 @@ static int _proto_ldap_cookie_store(UNUSED fr_ldap_connection_t *conn, sync_conf
 	proto_ldap_inst_t	*inst = talloc_get_type_abort(listen->data, proto_ldap_inst_t);
 	request_t			*request;
 	fr_pair_t		*vp;
+	proto_ldap_batch_t	*batch;
+
+	/*
+	 *	If there are changes waiting to be processed, the
+	 *	cookie must only be stored once they have been, so
+	 *	it goes in the same request.
+	 */
+	if (inst->batches && (batch = fr_rb_find(inst->batches, &(proto_ldap_batch_t){ .sync_id = sync_id }))) {
+		talloc_free(batch->cookie);
+		MEM(batch->cookie = talloc_memdup(batch, cookie, talloc_array_length(cookie)));
+		return 0;
+	}
 
 	request = proto_ldap_request_setup(listen, inst, sync_id);
 	if (!request) return -1;
@@ -724,6 +1065,16 @@ static int _proto_ldap_entry(fr_ldap_connection_t *conn, sync_config_t const *co
 	fr_ldap_map_exp_t	expanded;
 	request_t			*request;
 
+	/*
+	 *	Collect changes, and process them together.
+	 */
+	if (inst->coalesce_window) {
+		int ret;
+
+		ret = proto_ldap_batch_add(listen, inst, conn, config, sync_id, uuid, msg, state);
+		if (ret <= 0) return ret;
+	}
+
 	request = proto_ldap_request_setup(listen, inst, sync_id);
 	if (!request) return -1;
 
@@ -740,6 +1091,7 @@ static int _proto_ldap_entry(fr_ldap_connection_t *conn, sync_config_t const *co
 		entry_dn = ldap_get_dn(conn->handle, msg);
 
 		MEM(pair_update_request(&vp, attr_ldap_sync_entry_dn) >= 0);
+		fr_pair_value_strdup(vp, entry_dn);
 		ldap_memfree(entry_dn);
 
 		MEM(pair_update_request(&vp, attr_ldap_sync_entry_uuid) >= 0);
@@ -1226,8 +1578,12 @@ static int proto_ldap_listen_compile(CONF_SECTION *server_cs, UNUSED CONF_SECTIO
 	if (ret < 0) return ret;
 	if (ret > 0) found++;
 
+	ret = ldap_compile_section(server_cs, "recv", "Batch", MOD_AUTHORIZE);
+	if (ret < 0) return ret;
+	if (ret > 0) found++;
+
 	if (found == 0) {
-		cf_log_err(server_cs, "At least one of 'recv [Present|Add|Delete|Modify] { ... }' "
+		cf_log_err(server_cs, "At least one of 'recv [Present|Add|Delete|Modify|Batch] { ... }' "
 			      "sections must be present in virtual server %s", cf_section_name2(server_cs));
 
 		return -1;
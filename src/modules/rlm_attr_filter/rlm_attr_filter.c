@@ -37,6 +37,47 @@ RCSID("$Id$")
 #include	<ctype.h>
 #include	<fcntl.h>
 
+/** All of the rules in an entry which apply to one attribute
+ *
+ */
+typedef struct {
+	fr_dict_attr_t const	*da;			//!< Attribute the rules apply to.
+	fr_pair_list_t		rules;			//!< Check items, in the order they were read.
+	unsigned int		num_rules;		//!< How many check items there are.
+	bool			only_present;		//!< All of the rules are "=*", so any
+							///< instance of the attribute passes.
+} attr_filter_da_t;
+
+/** A filter entry, compiled so that each input attribute can be checked with one lookup
+ *
+ */
+typedef struct {
+	PAIR_LIST const		*pl;			//!< Entry from the "attrs" file.
+	bool			dynamic;		//!< Rules need runtime expansion, so they're
+							///< compiled for every request.
+
+	bool			fall_through;		//!< Entry has "Fall-Through = yes".
+	int			relax_filter;		//!< Value of "Relax-Filter", or -1 if the
+							///< entry doesn't set it.
+	fr_pair_list_t		set;			//!< ":=" items, copied to the output list.
+
+	fr_hash_table_t		*rules;			//!< attr_filter_da_t, keyed by da.
+	uint8_t			allow[256 / 8];		//!< Top level RADIUS attributes which only
+							///< have "=*" rules.
+	unsigned int		vsa_any;		//!< Number of "Vendor-Specific =* ANY" rules,
+							///< which pass any vendor attribute.
+
+	fr_dlist_t		entry;			//!< Entry in a list of entries with the same name.
+} attr_filter_entry_t;
+
+/** All of the entries with one name
+ *
+ */
+typedef struct {
+	char const		*name;			//!< Key to match.
+	fr_dlist_head_t		head;			//!< attr_filter_entry_t, in file order.
+} attr_filter_list_t;
+
 /*
  *	Define a structure with the module configuration, so it can
  *	be used as the instance handle.
@@ -46,6 +87,9 @@ typedef struct {
 	tmpl_t		*key;
 	bool		relaxed;
 	PAIR_LIST_LIST	attrs;
+
+	fr_hash_table_t	*names;			//!< attr_filter_list_t, keyed by name.
+	fr_dlist_head_t	defaults;		//!< DEFAULT attr_filter_entry_t, in file order.
 } rlm_attr_filter_t;
 
 static const CONF_PARSER module_config[] = {
@@ -101,6 +145,242 @@ static void check_pair(request_t *request, fr_pair_t *check_item, fr_pair_t *rep
 	return;
 }
 
+static uint32_t attr_filter_da_hash(void const *data)
+{
+	attr_filter_da_t const *af = data;
+
+	return fr_hash(&af->da, sizeof(af->da));
+}
+
+static int8_t attr_filter_da_cmp(void const *one, void const *two)
+{
+	attr_filter_da_t const *a = one, *b = two;
+
+	return CMP(a->da, b->da);
+}
+
+static uint32_t attr_filter_list_hash(void const *data)
+{
+	attr_filter_list_t const *list = data;
+
+	return fr_hash_string(list->name);
+}
+
+static int8_t attr_filter_list_cmp(void const *one, void const *two)
+{
+	attr_filter_list_t const *a = one, *b = two;
+	int ret;
+
+	ret = strcmp(a->name, b->name);
+	return CMP(ret, 0);
+}
+
+/** Whether a map can be turned into a check item without a request
+ *
+ */
+static bool attr_filter_map_is_static(map_t const *map)
+{
+	if ((map->op == T_OP_CMP_TRUE) || (map->op == T_OP_CMP_FALSE)) return true;
+
+	return map->rhs && (tmpl_is_data(map->rhs) || tmpl_is_unresolved(map->rhs));
+}
+
+/** Create the check item for a static map
+ *
+ * @return
+ *	- 1 if there's no check item, i.e. the operator is "!*".
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int attr_filter_map_to_vp(TALLOC_CTX *ctx, fr_pair_t **out, map_t const *map)
+{
+	fr_pair_t *vp;
+
+	*out = NULL;
+
+	if (map->op == T_OP_CMP_FALSE) return 1;
+
+	MEM(vp = fr_pair_afrom_da(ctx, tmpl_da(map->lhs)));
+	vp->op = map->op;
+
+	if (map->op == T_OP_CMP_TRUE) goto done;
+
+	if (tmpl_is_unresolved(map->rhs)) {
+		if (fr_pair_value_from_str(vp, map->rhs->name, -1, '\0', false) < 0) {
+		error:
+			talloc_free(vp);
+			return -1;
+		}
+		goto done;
+	}
+
+	if (vp->vp_type == tmpl_value_type(map->rhs)) {
+		if (fr_value_box_copy(vp, &vp->data, tmpl_value(map->rhs)) < 0) goto error;
+	} else if (fr_value_box_cast(vp, &vp->data, vp->vp_type, vp->da, tmpl_value(map->rhs)) < 0) {
+		goto error;
+	}
+
+done:
+	*out = vp;
+	return 0;
+}
+
+/** Add a realized check item to a compiled entry
+ *
+ * The item is reparented to the entry, or freed if it isn't needed.
+ */
+static void attr_filter_entry_add(attr_filter_entry_t *entry, fr_pair_t *vp)
+{
+	attr_filter_da_t	*af;
+	fr_dict_attr_t const	*da = vp->da;
+
+	if (da == attr_fall_through) {
+		if (vp->vp_bool) {
+			entry->fall_through = true;
+			talloc_free(vp);
+			return;
+		}
+	} else if (da == attr_relax_filter) {
+		entry->relax_filter = vp->vp_bool;
+	}
+
+	/*
+	 *	SET items are added to the output list without
+	 *	being checked.
+	 */
+	if (vp->op == T_OP_SET) {
+		(void) talloc_steal(entry, vp);
+		fr_pair_append(&entry->set, vp);
+		return;
+	}
+
+	/*
+	 *	Vendor-Specific is special, and matches any VSA if the
+	 *	comparison is always true.
+	 */
+	if ((da == attr_vendor_specific) && (vp->op == T_OP_CMP_TRUE)) entry->vsa_any++;
+
+	af = fr_hash_table_find(entry->rules, &(attr_filter_da_t){ .da = da });
+	if (!af) {
+		MEM(af = talloc_zero(entry, attr_filter_da_t));
+		af->da = da;
+		af->only_present = true;
+		fr_pair_list_init(&af->rules);
+		if (!fr_cond_assert(fr_hash_table_insert(entry->rules, af))) {
+			talloc_free(af);
+			talloc_free(vp);
+			return;
+		}
+	}
+
+	(void) talloc_steal(af, vp);
+	fr_pair_append(&af->rules, vp);
+	af->num_rules++;
+	if (vp->op != T_OP_CMP_TRUE) af->only_present = false;
+
+	/*
+	 *	Most filters are just lists of "Attr =* ANY".  Those
+	 *	turn into a bitmap membership test.
+	 */
+	if ((da->parent == fr_dict_root(dict_radius)) && (da->attr < 256)) {
+		if (af->only_present) {
+			entry->allow[da->attr >> 3] |= (1 << (da->attr & 0x07));
+		} else {
+			entry->allow[da->attr >> 3] &= ~(1 << (da->attr & 0x07));
+		}
+	}
+}
+
+static attr_filter_entry_t *attr_filter_entry_alloc(TALLOC_CTX *ctx, PAIR_LIST const *pl)
+{
+	attr_filter_entry_t *entry;
+
+	MEM(entry = talloc_zero(ctx, attr_filter_entry_t));
+	entry->pl = pl;
+	entry->relax_filter = -1;
+	fr_pair_list_init(&entry->set);
+	MEM(entry->rules = fr_hash_table_open_alloc(entry, attr_filter_da_hash, attr_filter_da_cmp, NULL));
+
+	return entry;
+}
+
+/** Compile the rules of an entry which need runtime values
+ *
+ * Maps which fail to expand are skipped, as before.
+ */
+static attr_filter_entry_t *attr_filter_entry_expand(TALLOC_CTX *ctx, request_t *request, PAIR_LIST const *pl)
+{
+	attr_filter_entry_t	*entry;
+	map_t			*map = NULL;
+
+	entry = attr_filter_entry_alloc(ctx, pl);
+
+	while ((map = fr_dlist_next(&pl->reply, map))) {
+		fr_pair_list_t	tmp_list;
+		fr_pair_t	*vp;
+
+		fr_pair_list_init(&tmp_list);
+		if (map_to_vp(entry, &tmp_list, request, map, NULL) < 0) {
+			RPWARN("Failed parsing map %s for check item, skipping it", map->lhs->name);
+			continue;
+		}
+
+		while ((vp = fr_pair_list_head(&tmp_list))) {
+			fr_pair_remove(&tmp_list, vp);
+			attr_filter_entry_add(entry, vp);
+		}
+	}
+
+	return entry;
+}
+
+/** Check one input attribute against a compiled entry
+ *
+ * @return true if the attribute should be moved to the output list.
+ */
+static bool attr_filter_allowed(request_t *request, attr_filter_entry_t const *entry,
+				fr_pair_t *input_item, bool relax_filter)
+{
+	fr_dict_attr_t const	*da = input_item->da;
+	attr_filter_da_t	*af;
+	int			pass = 0, fail = 0;
+
+	if (entry->vsa_any && (fr_dict_vendor_num_by_da(da) != 0)) pass += entry->vsa_any;
+
+	if ((da->parent == fr_dict_root(dict_radius)) && (da->attr < 256) &&
+	    (entry->allow[da->attr >> 3] & (1 << (da->attr & 0x07)))) {
+		RDEBUG3("Attribute \"%s\" allowed by allow list", da->name);
+		return true;
+	}
+
+	af = fr_hash_table_find(entry->rules, &(attr_filter_da_t){ .da = da });
+	if (af) {
+		if (af->only_present) {
+			pass += af->num_rules;
+		} else {
+			fr_pair_t *check_item;
+
+			for (check_item = fr_pair_list_head(&af->rules);
+			     check_item;
+			     check_item = fr_pair_list_next(&af->rules, check_item)) {
+				check_pair(request, check_item, input_item, &pass, &fail);
+			}
+		}
+	}
+
+	RDEBUG3("Attribute \"%s\" allowed by %i rules, disallowed by %i rules", da->name, pass, fail);
+
+	/*
+	 *  Only move attribute if it passed all rules, or if the config says we
+	 *  should copy unmatched attributes ('relaxed' mode).
+	 */
+	if (fail || (!pass && !relax_filter)) return false;
+
+	if (!pass) RDEBUG3("Attribute \"%s\" allowed by relaxed mode", da->name);
+
+	return true;
+}
+
 static int attr_filter_getfile(TALLOC_CTX *ctx, rlm_attr_filter_t *inst, char const *filename, PAIR_LIST_LIST *pair_list)
 {
 	int rcode;
@@ -160,6 +440,77 @@ static int attr_filter_getfile(TALLOC_CTX *ctx, rlm_attr_filter_t *inst, char co
 	return 0;
 }
 
+/** Compile the entries, and index them by name
+ *
+ */
+static int attr_filter_compile(TALLOC_CTX *ctx, rlm_attr_filter_t *inst)
+{
+	PAIR_LIST *pl = NULL;
+
+	MEM(inst->names = fr_hash_table_alloc(ctx, attr_filter_list_hash, attr_filter_list_cmp, NULL));
+	fr_dlist_talloc_init(&inst->defaults, attr_filter_entry_t, entry);
+
+	while ((pl = fr_dlist_next(&inst->attrs.head, pl))) {
+		attr_filter_entry_t	*entry;
+		attr_filter_list_t	*list;
+		map_t			*map = NULL;
+
+		entry = attr_filter_entry_alloc(ctx, pl);
+
+		while ((map = fr_dlist_next(&pl->reply, map))) {
+			if (!attr_filter_map_is_static(map)) {
+				entry->dynamic = true;
+				break;
+			}
+		}
+
+		/*
+		 *	Expansions, and references to other
+		 *	attributes, have to be done per request.
+		 */
+		if (entry->dynamic) {
+			talloc_free(entry->rules);
+			entry->rules = NULL;
+		} else {
+			map = NULL;
+			while ((map = fr_dlist_next(&pl->reply, map))) {
+				fr_pair_t	*vp;
+				int		ret;
+
+				ret = attr_filter_map_to_vp(entry, &vp, map);
+				if (ret < 0) {
+					PERROR("%s[%d] Invalid value for filter %s",
+					       pl->filename, pl->lineno, map->lhs->name);
+					return -1;
+				}
+				if (ret == 1) continue;
+
+				attr_filter_entry_add(entry, vp);
+			}
+		}
+
+		if (strcmp(pl->name, "DEFAULT") == 0) {
+			fr_dlist_insert_tail(&inst->defaults, entry);
+			continue;
+		}
+
+		list = fr_hash_table_find(inst->names, &(attr_filter_list_t){ .name = pl->name });
+		if (!list) {
+			MEM(list = talloc_zero(ctx, attr_filter_list_t));
+			list->name = pl->name;
+			fr_dlist_talloc_init(&list->head, attr_filter_entry_t, entry);
+
+			if (!fr_hash_table_insert(inst->names, list)) {
+				ERROR("%s[%d] Failed inserting entry %s", pl->filename, pl->lineno, pl->name);
+				return -1;
+			}
+		}
+		fr_dlist_insert_tail(&list->head, entry);
+	}
+
+	return 0;
+}
+
 
 /*
  *	(Re-)read the "attrs" file into memory.
@@ -177,7 +528,7 @@ static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
 		return -1;
 	}
 
-	return 0;
+	return attr_filter_compile(inst, inst);
 }
 
 
@@ -189,13 +540,13 @@ static unlang_action_t CC_HINT(nonnull(1,2)) attr_filter_common(rlm_rcode_t *p_r
 								fr_radius_packet_t *packet, fr_pair_list_t *list)
 {
 	rlm_attr_filter_t const *inst = talloc_get_type_abort_const(instance, rlm_attr_filter_t);
-	fr_pair_list_t	output;
-	PAIR_LIST	*pl = NULL;
-	int		found = 0;
-	int		pass, fail = 0;
-	char const	*keyname = NULL;
-	char		buffer[256];
-	ssize_t		slen;
+	fr_pair_list_t		output;
+	attr_filter_list_t	*names;
+	attr_filter_entry_t	*user_entry, *default_entry;
+	int			found = 0;
+	char const		*keyname = NULL;
+	char			buffer[256];
+	ssize_t			slen;
 
 	if (!packet) {
 		RETURN_MODULE_NOOP;
@@ -215,129 +566,67 @@ static unlang_action_t CC_HINT(nonnull(1,2)) attr_filter_common(rlm_rcode_t *p_r
 	 */
 	fr_pair_list_init(&output);
 
+	names = fr_hash_table_find(inst->names, &(attr_filter_list_t){ .name = keyname });
+	user_entry = names ? fr_dlist_head(&names->head) : NULL;
+	default_entry = fr_dlist_head(&inst->defaults);
+
 	/*
-	 *      Find the attr_filter profile entry for the entry.
+	 *      Walk the entries for the key, and the DEFAULT
+	 *      entries, in the order they were read.
 	 */
-	while ((pl = fr_dlist_next(&inst->attrs.head, pl))) {
-		int fall_through = 0;
-		int relax_filter = inst->relaxed;
-		map_t *map = NULL;
-		fr_pair_list_t tmp_list;
-		fr_pair_t *check_item, *input_item;
-		fr_pair_list_t check_list;
-
-		fr_pair_list_init(&tmp_list);
-		/*
-		 *  If the current entry is NOT a default,
-		 *  AND the realm does NOT match the current entry,
-		 *  then skip to the next entry.
-		 */
-		if ((strcmp(pl->name, "DEFAULT") != 0) &&
-		    (strcmp(keyname, pl->name) != 0))  {
-			continue;
+	while (user_entry || default_entry) {
+		attr_filter_entry_t	*entry, *expanded = NULL;
+		fr_pair_t		*input_item;
+		bool			relax_filter;
+		bool			fall_through;
+
+		if (!default_entry || (user_entry && (user_entry->pl->order < default_entry->pl->order))) {
+			entry = user_entry;
+			user_entry = fr_dlist_next(&names->head, user_entry);
+		} else {
+			entry = default_entry;
+			default_entry = fr_dlist_next(&inst->defaults, default_entry);
 		}
 
-		RDEBUG2("Matched entry %s at line %d", pl->name, pl->lineno);
+		RDEBUG2("Matched entry %s at line %d", entry->pl->name, entry->pl->lineno);
 		found = 1;
 
-		fr_pair_list_init(&check_list);
-
-		while ((map = fr_dlist_next(&pl->reply, map))) {
-			if (map_to_vp(packet, &tmp_list, request, map, NULL) < 0) {
-				RPWARN("Failed parsing map %s for check item, skipping it", map->lhs->name);
-				continue;
-			}
-
-			check_item = fr_pair_list_head(&tmp_list);
-		     	if (check_item->da == attr_fall_through) {
-				if (check_item->vp_uint32 == 1) {
-					fall_through = 1;
-					fr_pair_list_free(&tmp_list);
-					continue;
-				}
-		     	} else if (check_item->da == attr_relax_filter) {
-				relax_filter = check_item->vp_uint32;
-		     	}
-
-			/*
-			 *	Remove pair from temporary list ready to
-			 *	add to the correct destination
-			 */
-			fr_pair_remove(&tmp_list, check_item);
+		if (entry->dynamic) entry = expanded = attr_filter_entry_expand(request, request, entry->pl);
 
-			/*
-			 *    If it is a SET operator, add the attribute to
-			 *    the output list without checking it.
-			 */
-			if (check_item->op == T_OP_SET ) {
-				fr_pair_append(&output, check_item);
-				continue;
-			}
+		/*
+		 *    SET items are added to the output list
+		 *    without checking them.
+		 */
+		if (!fr_pair_list_empty(&entry->set)) (void) fr_pair_list_copy(packet, &output, &entry->set);
 
-			/*
-			 *	Append the realized VP to the check list.
-			 */
-			fr_pair_append(&check_list, check_item);
-		}
+		relax_filter = (entry->relax_filter < 0) ? inst->relaxed : entry->relax_filter;
+		fall_through = entry->fall_through;
 
 		/*
-		 *	Iterate through the input items, comparing
-		 *	each item to every rule, then moving it to the
-		 *	output list only if it matches all rules
-		 *	for that attribute.  IE, Idle-Timeout is moved
+		 *	Iterate through the input items, checking
+		 *	each one against the rules for its attribute,
+		 *	then moving it to the output list only if it
+		 *	matches all of them.  IE, Idle-Timeout is moved
 		 *	only if it matches all rules that describe an
 		 *	Idle-Timeout.
 		 */
 		for (input_item = fr_pair_list_head(list);
 		     input_item;
 		     input_item = fr_pair_list_next(list, input_item)) {
-			pass = fail = 0; /* reset the pass,fail vars for each reply item */
+			fr_pair_t *prev;
 
-			/*
-			 *  Reset the check_item pointer to beginning of the list
-			 */
-			for (check_item = fr_pair_list_head(&check_list);
-			     check_item;
-			     check_item = fr_pair_list_next(&check_list, check_item)) {
-				/*
-				 *  Vendor-Specific is special, and matches any VSA if the
-				 *  comparison is always true.
-				 */
-				if ((check_item->da == attr_vendor_specific) &&
-				    (fr_dict_vendor_num_by_da(input_item->da) != 0) &&
-				    (check_item->op == T_OP_CMP_TRUE)) {
-					pass++;
-					continue;
-				}
-
-				if (input_item->da == check_item->da) {
-					check_pair(request, check_item, input_item, &pass, &fail);
-				}
-			}
+			if (!attr_filter_allowed(request, entry, input_item, relax_filter)) continue;
 
-			RDEBUG3("Attribute \"%s\" allowed by %i rules, disallowed by %i rules",
-				input_item->da->name, pass, fail);
-			/*
-			 *  Only move attribute if it passed all rules, or if the config says we
-			 *  should copy unmatched attributes ('relaxed' mode).
-			 */
-			if (fail == 0 && (pass > 0 || relax_filter)) {
-				fr_pair_t *prev = fr_pair_list_prev(list, input_item);
-
-				if (!pass) {
-					RDEBUG3("Attribute \"%s\" allowed by relaxed mode", input_item->da->name);
-				}
-				fr_pair_remove(list, input_item);
-				fr_assert(input_item != NULL);
-				fr_pair_append(&output, input_item);
-				input_item = prev; /* Set input_item to previous in the list for outer loop */
-			}
+			prev = fr_pair_list_prev(list, input_item);
+			fr_pair_remove(list, input_item);
+			fr_pair_append(&output, input_item);
+			input_item = prev; /* Set input_item to previous in the list for outer loop */
 		}
 
+		talloc_free(expanded);
+
 		/* If we shouldn't fall through, break */
-		if (!fall_through) {
-			break;
-		}
+		if (!fall_through) break;
 	}
 
 	/*
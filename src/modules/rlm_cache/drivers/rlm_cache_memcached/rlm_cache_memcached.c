@@ -19,6 +19,18 @@
  * @file rlm_cache_memcached.c
  * @brief memcached based cache.
  *
+ * Entries are read and written using libmemcached handles from a connection
+ * pool.  If the pipeline is enabled, lookups made by the cache module, and
+ * inserts, are instead sent over a per-thread trunk of connections using
+ * the memcached meta text protocol, so the worker never blocks waiting for
+ * the server.
+ *
+ * All the commands pending on a connection are written in a single batch,
+ * and the server replies to them in the order they were written.  A lookup
+ * of a key which is already being retrieved by the same connection joins
+ * the outstanding command, so a burst of lookups for the same key results
+ * in a single command.
+ *
  * @copyright 2014 The FreeRADIUS server project
  */
 
@@ -28,11 +40,20 @@
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/server/trunk.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/base64.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
 
 #include "../../rlm_cache.h"
 #include "../../serialize.h"
 
+#define MEMCACHED_KEY_MAX	250		//!< Longest key the server accepts.
+#define MEMCACHED_RBUF_SIZE	16384		//!< Initial size of the read buffer, and the
+						///< longest reply line we accept.
+
 typedef struct {
 	memcached_st *handle;
 } rlm_cache_memcached_handle_t;
@@ -40,10 +61,111 @@ typedef struct {
 typedef struct {
 	char const 		*options;	//!< Connection options
 	fr_pool_t	*pool;
+
+	bool			pipeline;	//!< Use the trunk for lookups and inserts.
+	fr_ipaddr_t		server;		//!< Server the trunk connects to.
+	uint16_t		port;		//!< Port of the server.
+	fr_time_delta_t		timeout;	//!< How long to wait for a lookup.
+	size_t			max_batch;	//!< Most data to write to a connection at once.
+	size_t			max_value;	//!< Largest value we'll accept from the server.
+	fr_trunk_conf_t		trunk_conf;	//!< Trunk configuration.
 } rlm_cache_memcached_t;
 
+/** Thread instance
+ *
+ */
+typedef struct {
+	rlm_cache_memcached_t const	*driver;	//!< Driver instance.
+	fr_event_list_t			*el;		//!< Event list for this thread.
+	fr_trunk_t			*trunk;		//!< Connections to the memcached server.
+} rlm_cache_memcached_thread_t;
+
+typedef enum {
+	MEMCACHED_OP_GET = 0,				//!< Retrieve an entry.
+	MEMCACHED_OP_SET				//!< Store an entry.
+} memcached_op_type_t;
+
+typedef struct memcached_op_s memcached_op_t;
+
+/** A command which has been written, and is waiting for the server's reply
+ *
+ * These are kept in the order the commands were written.  Operations which
+ * are cancelled are removed, but the slot stays where it is, so that later
+ * replies continue to match the correct commands.
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< Entry in the handle's list of slots.
+	memcached_op_type_t	type;		//!< Type of command written.
+	char const		*key;		//!< Key, as written.
+	bool			binary;		//!< Key is base64 encoded.
+	bool			joinable;	//!< In the handle's table of outstanding lookups.
+	fr_dlist_head_t		ops;		//!< Operations waiting for the reply.
+} memcached_slot_t;
+
+/** A single lookup or insert
+ *
+ * Used as the preq.  Lookups are allocated in the ctx provided by rlm_cache,
+ * and freeing them cancels the lookup.  Inserts aren't waited for, and are
+ * freed when they complete.
+ */
+struct memcached_op_s {
+	memcached_op_type_t	type;		//!< What we're doing.
+	fr_trunk_request_t	*treq;		//!< Trunk request, NULL once it's been freed.
+	request_t		*request;	//!< Request performing the lookup, NULL for inserts.
+	memcached_slot_t	*slot;		//!< Reply slot, set once the command has been written.
+	fr_dlist_t		entry;		//!< Entry in the slot's list of operations.
+
+	char			*key;		//!< Key, as written.
+	bool			binary;		//!< Key is base64 encoded.
+	char			*cmd;		//!< Command to write.
+	size_t			cmd_len;	//!< Length of the command.
+
+	uint8_t const		*raw_key;	//!< Key of the entry being retrieved.
+	size_t			raw_key_len;	//!< Length of the key.
+	fr_event_timer_t const	*ev;		//!< Lookup timeout.
+	rlm_cache_entry_t	**out;		//!< Where to write the entry found.
+	cache_status_t		*status;	//!< Where to write the result of the lookup.
+};
+
+/** State of a connection to the memcached server
+ *
+ */
+typedef struct {
+	rlm_cache_memcached_t const	*driver;	//!< Driver instance.
+	int			fd;		//!< Connected socket.
+	fr_event_list_t		*el;		//!< Event list the connection's I/O handlers are
+						///< registered with.
+	fr_trunk_connection_t	*tconn;		//!< Trunk connection this handle belongs to.
+	bool			want_write;	//!< The trunk has requests to write.
+
+	fr_dlist_head_t		slots;		//!< Commands waiting for replies.
+	fr_hash_table_t		*gets;		//!< Lookups waiting for replies, which lookups of
+						///< the same key can join.
+
+	uint8_t			*wbuf;		//!< Current batch of data to write.
+	size_t			wbuf_used;	//!< Amount of data in the batch.
+	size_t			wbuf_written;	//!< How much of the batch has been written.
+
+	uint8_t			*rbuf;		//!< Incomplete replies.
+	size_t			rbuf_used;	//!< Amount of data in the read buffer.
+} memcached_handle_t;
+
+static const CONF_PARSER pipeline_config[] = {
+	{ FR_CONF_OFFSET("enable", FR_TYPE_BOOL, rlm_cache_memcached_t, pipeline), .dflt = "no" },
+	{ FR_CONF_OFFSET("server", FR_TYPE_COMBO_IP_ADDR, rlm_cache_memcached_t, server) },
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, rlm_cache_memcached_t, port), .dflt = "11211" },
+	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, rlm_cache_memcached_t, timeout), .dflt = "1.0" },
+	{ FR_CONF_OFFSET("max_batch", FR_TYPE_SIZE, rlm_cache_memcached_t, max_batch), .dflt = "65536" },
+	{ FR_CONF_OFFSET("max_value", FR_TYPE_SIZE, rlm_cache_memcached_t, max_value), .dflt = "1048576" },
+
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_cache_memcached_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER driver_config[] = {
 	{ FR_CONF_OFFSET("options", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_cache_memcached_t, options), .dflt = "--SERVER=localhost" },
+
+	{ FR_CONF_POINTER("pipeline", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) pipeline_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -97,6 +219,591 @@ static void *mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t ti
 	return mandle;
 }
 
+static void memcached_handle_io_update(memcached_handle_t *h);
+
+static uint32_t memcached_slot_hash(void const *data)
+{
+	memcached_slot_t const *slot = data;
+
+	return fr_hash_string(slot->key) ^ slot->binary;
+}
+
+static int8_t memcached_slot_cmp(void const *one, void const *two)
+{
+	memcached_slot_t const *a = one, *b = two;
+	int ret;
+
+	ret = CMP(a->binary, b->binary);
+	if (ret != 0) return ret;
+
+	ret = strcmp(a->key, b->key);
+	return CMP(ret, 0);
+}
+
+/** Write as much of the current batch as the socket will accept
+ *
+ * @param[in] h		to write the batch for.
+ * @return
+ *	- 0 if the batch was written, or the socket would block.
+ *	- -1 on error.  The caller should signal the connection to reconnect.
+ */
+static int memcached_handle_flush(memcached_handle_t *h)
+{
+	ssize_t slen;
+
+	while (h->wbuf_written < h->wbuf_used) {
+		slen = write(h->fd, h->wbuf + h->wbuf_written, h->wbuf_used - h->wbuf_written);
+		if (slen < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+			ERROR("Failed writing to memcached server: %s", fr_syserror(errno));
+			return -1;
+		}
+		h->wbuf_written += slen;
+	}
+
+	h->wbuf_used = h->wbuf_written = 0;
+
+	return 0;
+}
+
+/** Add data to the current batch
+ *
+ */
+static void memcached_handle_append(memcached_handle_t *h, void const *data, size_t data_len)
+{
+	size_t need = h->wbuf_used + data_len;
+
+	if (need > talloc_array_length(h->wbuf)) {
+		size_t len = talloc_array_length(h->wbuf) * 2;
+
+		if (len < need) len = need;
+		MEM(h->wbuf = talloc_realloc(h, h->wbuf, uint8_t, len));
+	}
+
+	memcpy(h->wbuf + h->wbuf_used, data, data_len);
+	h->wbuf_used += data_len;
+}
+
+static void _memcached_conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+				  int fd_errno, void *uctx)
+{
+	fr_trunk_connection_t *tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	ERROR("Connection to memcached server failed: %s", fr_syserror(fd_errno));
+
+	fr_connection_signal_reconnect(tconn->conn, FR_CONNECTION_FAILED);
+}
+
+static void _memcached_conn_readable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t *tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	fr_trunk_connection_signal_readable(tconn);
+}
+
+static void _memcached_conn_writable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	memcached_handle_t	*h = talloc_get_type_abort(tconn->conn->h, memcached_handle_t);
+
+	/*
+	 *	Finish writing the last batch first.  Its
+	 *	requests have already been marked as sent,
+	 *	so the trunk doesn't know about it.
+	 */
+	if (h->wbuf_used) {
+		if (memcached_handle_flush(h) < 0) {
+			fr_connection_signal_reconnect(tconn->conn, FR_CONNECTION_FAILED);
+			return;
+		}
+		if (h->wbuf_used) return;
+
+		memcached_handle_io_update(h);
+	}
+
+	if (h->want_write) fr_trunk_connection_signal_writable(tconn);
+}
+
+/** Register I/O handlers for a connection
+ *
+ * We always read, so we notice if the server closes the connection.  We
+ * write if the trunk has requests for the connection, or the last batch
+ * hasn't been completely written.
+ */
+static void memcached_handle_io_update(memcached_handle_t *h)
+{
+	bool write = h->want_write || (h->wbuf_used > 0);
+
+	if (fr_event_fd_insert(h, h->el, h->fd,
+			       _memcached_conn_readable,
+			       write ? _memcached_conn_writable : NULL,
+			       _memcached_conn_error,
+			       h->tconn) < 0) {
+		PERROR("Failed inserting memcached connection I/O handlers");
+		fr_connection_signal_reconnect(h->tconn->conn, FR_CONNECTION_FAILED);
+	}
+}
+
+/** Inform the handle which events the trunk wants
+ *
+ */
+static void _memcached_conn_notify(fr_trunk_connection_t *tconn, fr_connection_t *conn,
+				   fr_event_list_t *el,
+				   fr_trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	memcached_handle_t *h = talloc_get_type_abort(conn->h, memcached_handle_t);
+
+	h->tconn = tconn;
+	h->el = el;
+	h->want_write = (notify_on == FR_TRUNK_CONN_EVENT_WRITE) || (notify_on == FR_TRUNK_CONN_EVENT_BOTH);
+
+	memcached_handle_io_update(h);
+}
+
+/** Start connecting to the memcached server
+ *
+ */
+static fr_connection_state_t _memcached_conn_init(void **h_out, fr_connection_t *conn, void *uctx)
+{
+	rlm_cache_memcached_thread_t	*t = talloc_get_type_abort(uctx, rlm_cache_memcached_thread_t);
+	rlm_cache_memcached_t const	*driver = t->driver;
+	memcached_handle_t		*h;
+	int				fd;
+
+	DEBUG2("Opening TCP connection to %pV:%u", fr_box_ipaddr(driver->server), driver->port);
+
+	fd = fr_socket_client_tcp(NULL, &driver->server, driver->port, true);
+	if (fd < 0) {
+		PERROR("Failed opening connection to memcached server");
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+	MEM(h = talloc_zero(conn, memcached_handle_t));
+	h->driver = driver;
+	h->fd = fd;
+	fr_dlist_talloc_init(&h->slots, memcached_slot_t, entry);
+	MEM(h->gets = fr_hash_table_alloc(h, memcached_slot_hash, memcached_slot_cmp, NULL));
+	MEM(h->wbuf = talloc_array(h, uint8_t, driver->max_batch));
+	MEM(h->rbuf = talloc_array(h, uint8_t, MEMCACHED_RBUF_SIZE));
+
+	fr_connection_signal_on_fd(conn, fd);
+	*h_out = h;
+
+	return FR_CONNECTION_STATE_CONNECTING;
+}
+
+/** The meta protocol needs no handshake, so the connection's ready as soon as it's established
+ *
+ */
+static fr_connection_state_t _memcached_conn_open(UNUSED fr_event_list_t *el, UNUSED void *h, UNUSED void *uctx)
+{
+	return FR_CONNECTION_STATE_CONNECTED;
+}
+
+static void _memcached_conn_close(UNUSED fr_event_list_t *el, void *h_in, UNUSED void *uctx)
+{
+	memcached_handle_t	*h = talloc_get_type_abort(h_in, memcached_handle_t);
+	memcached_slot_t	*slot;
+	memcached_op_t		*op;
+
+	/*
+	 *	Any operations still waiting for
+	 *	replies will be moved to another
+	 *	connection, and written again.
+	 */
+	while ((slot = fr_dlist_pop_head(&h->slots))) {
+		while ((op = fr_dlist_pop_head(&slot->ops))) op->slot = NULL;
+	}
+
+	talloc_free_children(h);	/* Clear the IO handlers */
+
+	if (shutdown(h->fd, SHUT_RDWR) < 0) {
+		DEBUG3("Failed shutting down connection: %s", fr_syserror(errno));
+	}
+	if (close(h->fd) < 0) {
+		DEBUG3("Failed closing connection: %s", fr_syserror(errno));
+	}
+
+	talloc_free(h);
+}
+
+static fr_connection_t *memcached_conn_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
+					     fr_connection_conf_t const *conf,
+					     char const *log_prefix, void *uctx)
+{
+	return fr_connection_alloc(tconn, el,
+				   &(fr_connection_funcs_t){
+					.init = _memcached_conn_init,
+					.open = _memcached_conn_open,
+					.close = _memcached_conn_close
+				   },
+				   conf, log_prefix, uctx);
+}
+
+/** Write all pending commands for a connection as a single batch
+ *
+ * Lookups of keys which are already being retrieved by this connection
+ * join the outstanding command instead of being written again.  Inserts
+ * remove their key from the table of outstanding lookups, so lookups
+ * queued after an insert see the new value.
+ */
+static void _memcached_request_mux(UNUSED fr_event_list_t *el, fr_trunk_connection_t *tconn,
+				   fr_connection_t *conn, UNUSED void *uctx)
+{
+	memcached_handle_t	*h = talloc_get_type_abort(conn->h, memcached_handle_t);
+	fr_trunk_request_t	*treq;
+
+	/*
+	 *	Don't start a new batch until the
+	 *	previous one has been written.
+	 */
+	if (h->wbuf_used) return;
+
+	while ((fr_trunk_connection_pop_request(&treq, tconn) == 0) && treq) {
+		memcached_op_t		*op = talloc_get_type_abort(treq->preq, memcached_op_t);
+		memcached_slot_t	*slot, find = { .key = op->key, .binary = op->binary };
+
+		if (op->type == MEMCACHED_OP_GET) {
+			slot = fr_hash_table_find(h->gets, &find);
+			if (slot) goto join;
+		}
+
+		if (h->wbuf_used && ((h->wbuf_used + op->cmd_len) > h->driver->max_batch)) break;
+
+		if (op->type == MEMCACHED_OP_SET) {
+			slot = fr_hash_table_remove(h->gets, &find);
+			if (slot) slot->joinable = false;
+		}
+
+		memcached_handle_append(h, op->cmd, op->cmd_len);
+
+		MEM(slot = talloc_zero(h, memcached_slot_t));
+		slot->type = op->type;
+		slot->key = talloc_strdup(slot, op->key);
+		slot->binary = op->binary;
+		fr_dlist_talloc_init(&slot->ops, memcached_op_t, entry);
+		fr_dlist_insert_tail(&h->slots, slot);
+
+		if (op->type == MEMCACHED_OP_GET) {
+			slot->joinable = true;
+			fr_hash_table_insert(h->gets, slot);
+		}
+
+	join:
+		fr_dlist_insert_tail(&slot->ops, op);
+		op->slot = slot;
+
+		fr_trunk_request_signal_sent(treq);
+	}
+
+	if (memcached_handle_flush(h) < 0) {
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	/*
+	 *	Wait for the socket to become
+	 *	writable again.
+	 */
+	if (h->wbuf_used) memcached_handle_io_update(h);
+}
+
+/** Deserialize a value for a lookup
+ *
+ * Each lookup gets its own copy of the entry, as several lookups may
+ * share the same reply.
+ */
+static cache_status_t memcached_entry_decode(memcached_op_t *op, uint8_t const *data, size_t data_len)
+{
+	request_t		*request = op->request;
+	rlm_cache_entry_t	*c;
+	char			*buff;
+
+	RDEBUG2("Retrieved %zu bytes from memcached", data_len);
+	RHEXDUMP4(data, data_len, "cache entry");
+
+	c = talloc_zero(NULL, rlm_cache_entry_t);
+	MEM(buff = talloc_bstrndup(c, (char const *)data, data_len));
+	if (cache_deserialize(c, request->dict, buff, data_len) < 0) {
+		RPERROR("Invalid entry");
+		talloc_free(c);
+		return CACHE_ERROR;
+	}
+	talloc_free(buff);
+
+	c->key = talloc_memdup(c, op->raw_key, op->raw_key_len);
+	c->key_len = op->raw_key_len;
+	*op->out = c;
+
+	return CACHE_OK;
+}
+
+/** Process a single reply from the memcached server
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the connection should be closed.
+ */
+static int memcached_handle_reply(memcached_handle_t *h, char const *line, size_t len,
+				  uint8_t const *data, size_t data_len)
+{
+	memcached_slot_t	*slot;
+	memcached_op_t		*op;
+	cache_status_t		status;
+
+#define REPLY_IS(_str) ((len == (sizeof(_str) - 1)) && (memcmp(line, _str, sizeof(_str) - 1) == 0))
+
+	/*
+	 *	Plain ERROR means the server didn't
+	 *	recognise the command.
+	 */
+	if (REPLY_IS("ERROR")) {
+		ERROR("memcached server doesn't support meta commands (1.6 or later is required)");
+		return -1;
+	}
+
+	slot = fr_dlist_pop_head(&h->slots);
+	if (!slot) {
+		ERROR("Reply from memcached server doesn't match any command");
+		return -1;
+	}
+	if (slot->joinable) fr_hash_table_remove(h->gets, slot);
+
+	if (data && (slot->type == MEMCACHED_OP_GET)) {
+		status = CACHE_OK;
+	} else if (REPLY_IS("HD") && (slot->type == MEMCACHED_OP_SET)) {
+		status = CACHE_OK;
+	} else if (REPLY_IS("EN") && (slot->type == MEMCACHED_OP_GET)) {
+		status = CACHE_MISS;
+	} else {
+		ERROR("memcached server returned error: %.*s", (int)len, line);
+		status = CACHE_ERROR;
+	}
+
+	while ((op = fr_dlist_pop_head(&slot->ops))) {
+		op->slot = NULL;
+
+		if (status == CACHE_ERROR) {
+			fr_trunk_request_signal_fail(op->treq);
+			continue;
+		}
+
+		if (op->type == MEMCACHED_OP_GET) {
+			*op->status = (status == CACHE_OK) ? memcached_entry_decode(op, data, data_len) : status;
+		}
+		fr_trunk_request_signal_complete(op->treq);
+	}
+	talloc_free(slot);
+
+	return 0;
+}
+
+/** Read replies from the memcached server, and match them to commands
+ *
+ */
+static void _memcached_request_demux(UNUSED fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	memcached_handle_t	*h = talloc_get_type_abort(conn->h, memcached_handle_t);
+	ssize_t			slen;
+	uint8_t			*p, *end, *eol, *next;
+	size_t			need = 0;
+
+	slen = read(h->fd, h->rbuf + h->rbuf_used, talloc_array_length(h->rbuf) - h->rbuf_used);
+	if (slen == 0) {
+		ERROR("memcached server closed the connection");
+		goto reconnect;
+	}
+	if (slen < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return;
+
+		ERROR("Failed reading from memcached server: %s", fr_syserror(errno));
+		goto reconnect;
+	}
+	h->rbuf_used += slen;
+
+	p = h->rbuf;
+	end = h->rbuf + h->rbuf_used;
+
+	while ((eol = memchr(p, '\n', end - p))) {
+		size_t		len = eol - p;
+		uint8_t const	*data = NULL;
+		size_t		data_len = 0;
+
+		if ((len > 0) && (p[len - 1] == '\r')) len--;
+		next = eol + 1;
+
+		/*
+		 *	Values follow the VA line.  Wait
+		 *	until we have all of the value.
+		 */
+		if ((len > 3) && (memcmp(p, "VA ", 3) == 0)) {
+			unsigned long	value_len;
+			char		*q;
+
+			value_len = strtoul((char const *)p + 3, &q, 10);
+			if ((q == (char const *)p + 3) || (value_len > h->driver->max_value)) {
+				ERROR("Invalid value length in reply from memcached server");
+				goto reconnect;
+			}
+
+			if ((size_t)(end - next) < (value_len + 2)) {
+				need = (next - p) + value_len + 2;
+				break;
+			}
+
+			data = next;
+			data_len = value_len;
+			next += value_len + 2;
+		}
+
+		if (memcached_handle_reply(h, (char const *)p, len, data, data_len) < 0) goto reconnect;
+
+		p = next;
+	}
+
+	h->rbuf_used = end - p;
+	if (h->rbuf_used && (p != h->rbuf)) memmove(h->rbuf, p, h->rbuf_used);
+
+	/*
+	 *	Make space for the rest of a large value.
+	 */
+	if (need > talloc_array_length(h->rbuf)) {
+		MEM(h->rbuf = talloc_realloc(h, h->rbuf, uint8_t, need));
+		return;
+	}
+
+	if (!need && (h->rbuf_used == talloc_array_length(h->rbuf))) {
+		ERROR("Reply from memcached server is too long");
+		goto reconnect;
+	}
+
+	return;
+
+reconnect:
+	fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+}
+
+/** Detach an operation from its reply slot
+ *
+ * If the command has already been written, the slot stays where it is
+ * so later replies still match the correct commands.
+ */
+static void _memcached_request_cancel(UNUSED fr_connection_t *conn, void *preq,
+				      UNUSED fr_trunk_cancel_reason_t reason, UNUSED void *uctx)
+{
+	memcached_op_t *op = talloc_get_type_abort(preq, memcached_op_t);
+
+	if (!op->slot) return;
+
+	fr_dlist_remove(&op->slot->ops, op);
+	op->slot = NULL;
+}
+
+static void _memcached_request_complete(request_t *request, void *preq, UNUSED void *rctx, UNUSED void *uctx)
+{
+	memcached_op_t *op = talloc_get_type_abort(preq, memcached_op_t);
+
+	op->treq = NULL;
+
+	if (op->type == MEMCACHED_OP_SET) {
+		talloc_free(op);
+		return;
+	}
+
+	fr_event_timer_delete(&op->ev);
+	unlang_interpret_mark_runnable(request);
+}
+
+static void _memcached_request_fail(request_t *request, void *preq, UNUSED void *rctx,
+				    UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
+{
+	memcached_op_t *op = talloc_get_type_abort(preq, memcached_op_t);
+
+	op->treq = NULL;
+
+	if (op->type == MEMCACHED_OP_SET) {
+		ERROR("Failed storing entry");
+		talloc_free(op);
+		return;
+	}
+
+	fr_event_timer_delete(&op->ev);
+	*op->status = CACHE_ERROR;
+	unlang_interpret_mark_runnable(request);
+}
+
+static void _memcached_get_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	memcached_op_t	*op = talloc_get_type_abort(uctx, memcached_op_t);
+	request_t	*request = op->request;
+
+	REDEBUG("Timed out waiting for memcached server");
+
+	if (op->treq) {
+		fr_trunk_request_signal_cancel(op->treq);
+		op->treq = NULL;
+	}
+	*op->status = CACHE_ERROR;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Cancel an operation which is still in progress
+ *
+ */
+static int _memcached_op_free(memcached_op_t *op)
+{
+	if (op->treq) fr_trunk_request_signal_cancel(op->treq);
+
+	return 0;
+}
+
+/** Allocate an operation, and encode its key
+ *
+ * Keys which contain no whitespace or control characters are written as
+ * is.  Other keys are base64 encoded, and written with the 'b' flag, so
+ * the server decodes them, and they refer to the same items as the keys
+ * used with libmemcached.
+ *
+ * @return
+ *	- The new operation.
+ *	- NULL if the key is too long to be written.
+ */
+static memcached_op_t *memcached_op_alloc(TALLOC_CTX *ctx, memcached_op_type_t type,
+					  uint8_t const *key, size_t key_len)
+{
+	memcached_op_t	*op;
+	size_t		i;
+
+	for (i = 0; i < key_len; i++) if ((key[i] <= ' ') || (key[i] >= 0x7f)) break;
+
+	if (i == key_len) {
+		if (key_len > MEMCACHED_KEY_MAX) return NULL;
+
+		MEM(op = talloc_zero(ctx, memcached_op_t));
+		MEM(op->key = talloc_bstrndup(op, (char const *)key, key_len));
+	} else {
+		size_t	len = FR_BASE64_ENC_LENGTH(key_len);
+		ssize_t	slen;
+
+		if (len > MEMCACHED_KEY_MAX) return NULL;
+
+		MEM(op = talloc_zero(ctx, memcached_op_t));
+		MEM(op->key = talloc_array(op, char, len + 1));
+		slen = fr_base64_encode(&FR_SBUFF_OUT(op->key, len + 1), &FR_DBUFF_TMP(key, key_len), true);
+		if (slen < 0) {
+			talloc_free(op);
+			return NULL;
+		}
+		op->binary = true;
+	}
+	op->type = type;
+	talloc_set_destructor(op, _memcached_op_free);
+
+	return op;
+}
+
 /** Create a new rlm_cache_memcached instance
  *
  * @param instance	A uint8_t array of inst_size if inst_size > 0, else NULL,
@@ -135,6 +842,52 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		ERROR("max_entries is not supported by this driver");
 		return -1;
 	}
+
+	if (driver->pipeline) {
+		if (driver->server.af == AF_UNSPEC) {
+			cf_log_err(conf, "pipeline.server must be set when the pipeline is enabled");
+			return -1;
+		}
+
+		FR_SIZE_BOUND_CHECK("pipeline.max_batch", driver->max_batch, >=, (size_t)1024);
+		FR_SIZE_BOUND_CHECK("pipeline.max_value", driver->max_value, >=, (size_t)1024);
+		FR_TIME_DELTA_BOUND_CHECK("pipeline.timeout", driver->timeout, >=, fr_time_delta_from_msec(10));
+	}
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_cache_memcached_t		*driver = instance;
+	rlm_cache_memcached_thread_t	*t = talloc_get_type_abort(thread, rlm_cache_memcached_thread_t);
+
+	if (!driver->pipeline) return 0;
+
+	t->driver = driver;
+	t->el = el;
+	t->trunk = fr_trunk_alloc(t, el,
+				  &(fr_trunk_io_funcs_t){
+					.connection_alloc = memcached_conn_alloc,
+					.connection_notify = _memcached_conn_notify,
+					.request_mux = _memcached_request_mux,
+					.request_demux = _memcached_request_demux,
+					.request_cancel = _memcached_request_cancel,
+					.request_complete = _memcached_request_complete,
+					.request_fail = _memcached_request_fail
+				  },
+				  &driver->trunk_conf, "rlm_cache_memcached", t, false);
+	if (!t->trunk) return -1;
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_cache_memcached_thread_t *t = talloc_get_type_abort(thread, rlm_cache_memcached_thread_t);
+
+	TALLOC_FREE(t->trunk);
+
 	return 0;
 }
 
@@ -182,7 +935,7 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 		return CACHE_ERROR;
 	}
 	RDEBUG2("Retrieved %zu bytes from memcached", len);
-	RDEBUG2("%s", from_store);
+	RHEXDUMP4((uint8_t const *)from_store, len, "cache entry");
 
 	c = talloc_zero(NULL, rlm_cache_entry_t);
 	ret = cache_deserialize(c, request->dict, from_store, len);
@@ -200,32 +953,151 @@ static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
 	return CACHE_OK;
 }
 
+/** Queue a lookup on this thread's trunk
+ *
+ * @copydetails cache_entry_find_async_t
+ */
+static int cache_entry_find_async(TALLOC_CTX *ctx, void **query,
+				  rlm_cache_entry_t **out, cache_status_t *status,
+				  UNUSED rlm_cache_config_t const *config, void *instance,
+				  request_t *request, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_memcached_t		*driver = instance;
+	rlm_cache_memcached_thread_t	*t;
+	memcached_op_t			*op;
+
+	if (!driver->pipeline) return -1;
+
+	t = talloc_get_type_abort(module_thread_by_data(driver)->data, rlm_cache_memcached_thread_t);
+
+	op = memcached_op_alloc(ctx, MEMCACHED_OP_GET, key, key_len);
+	if (!op) return -1;
+
+	op->request = request;
+	op->raw_key = key;
+	op->raw_key_len = key_len;
+	op->out = out;
+	op->status = status;
+	MEM(op->cmd = talloc_asprintf(op, "mg %s%s v\r\n", op->key, op->binary ? " b" : ""));
+	op->cmd_len = talloc_array_length(op->cmd) - 1;
+
+	switch (fr_trunk_request_enqueue(&op->treq, t->trunk, request, op, NULL)) {
+	case FR_TRUNK_ENQUEUE_OK:
+	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
+		break;
+
+	default:
+		RDEBUG2("memcached pipeline unavailable, using pooled connection");
+		talloc_free(op);
+		return -1;
+	}
+
+	if (fr_event_timer_in(op, t->el, &op->ev, driver->timeout, _memcached_get_timeout, op) < 0) {
+		RPERROR("Failed adding lookup timeout");
+		talloc_free(op);	/* Cancels the trunk request */
+		return -1;
+	}
+
+	*query = op;
+
+	return 0;
+}
+
+/** Queue an entry to be written by this thread's trunk
+ *
+ * We don't wait for the server to confirm the entry was stored.  Failures
+ * are logged.
+ *
+ * @return
+ *	- 0 if the entry was queued.
+ *	- -1 if the entry should be written using a pooled connection.
+ */
+static int memcached_pipeline_set(rlm_cache_memcached_t const *driver, request_t *request,
+				  rlm_cache_entry_t const *c, uint8_t const *data, size_t data_len)
+{
+	rlm_cache_memcached_thread_t	*t;
+	memcached_op_t			*op;
+	size_t				hdr_len;
+
+	t = talloc_get_type_abort(module_thread_by_data(driver)->data, rlm_cache_memcached_thread_t);
+
+	op = memcached_op_alloc(t, MEMCACHED_OP_SET, c->key, c->key_len);
+	if (!op) return -1;
+
+	/*
+	 *	The command line and value are
+	 *	written together.
+	 */
+	MEM(op->cmd = talloc_asprintf(op, "ms %s%s %zu T%" PRIu64 "\r\n", op->key, op->binary ? " b" : "",
+				      data_len, fr_unix_time_to_sec(c->expires)));
+	hdr_len = talloc_array_length(op->cmd) - 1;
+	op->cmd_len = hdr_len + data_len + 2;
+	MEM(op->cmd = talloc_realloc(op, op->cmd, char, op->cmd_len + 1));
+	memcpy(op->cmd + hdr_len, data, data_len);
+	memcpy(op->cmd + hdr_len + data_len, "\r\n", 3);
+
+	switch (fr_trunk_request_enqueue(&op->treq, t->trunk, NULL, op, NULL)) {
+	case FR_TRUNK_ENQUEUE_OK:
+	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
+		RDEBUG2("Queued %zu bytes for storage", data_len);
+		return 0;
+
+	default:
+		talloc_free(op);
+		return -1;
+	}
+}
+
 /** Insert a new entry into the data store
  *
  * @copydetails cache_entry_insert_t
  */
-static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *instance,
 					 request_t *request, void *handle, const rlm_cache_entry_t *c)
 {
+	rlm_cache_memcached_t *driver = instance;
 	rlm_cache_memcached_handle_t *mandle = handle;
 
 	memcached_return_t ret;
 
 	TALLOC_CTX *pool;
-	char *to_store;
+	uint8_t *to_store = NULL;
+	size_t to_store_len = 0;
+	char *text;
 
 	pool = talloc_pool(NULL, 1024);
 	if (!pool) return CACHE_ERROR;
 
-	if (cache_serialize(pool, &to_store, c) < 0) {
+	/*
+	 *	Prefer the binary format, it's much cheaper to
+	 *	read back.  Entries it can't represent are
+	 *	stored as text.
+	 */
+	switch (cache_serialize_binary(pool, &to_store, &to_store_len, c)) {
+	case 0:
+		break;
+
+	case 1:
+		if (cache_serialize(pool, &text, c) < 0) goto error;
+		to_store = (uint8_t *)text;
+		to_store_len = talloc_array_length(text) - 1;
+		break;
+
+	default:
+	error:
+		RPERROR("Failed serializing entry");
 		talloc_free(pool);
 
 		return CACHE_ERROR;
 	}
 
+	if (driver->pipeline && (memcached_pipeline_set(driver, request, c, to_store, to_store_len) == 0)) {
+		talloc_free(pool);
+		return CACHE_OK;
+	}
+
 	ret = memcached_set(mandle->handle, (char const *)c->key, c->key_len,
-		            to_store ? to_store : "",
-		            to_store ? talloc_array_length(to_store) - 1 : 0, c->expires, 0);
+		            (char const *)to_store, to_store_len, c->expires, 0);
 	talloc_free(pool);
 	if (ret != MEMCACHED_SUCCESS) {
 		RERROR("Failed storing entry: %s: %s", memcached_strerror(mandle->handle, ret),
@@ -326,9 +1198,15 @@ rlm_cache_driver_t rlm_cache_memcached = {
 	.onload		= mod_load,
 	.instantiate	= mod_instantiate,
 
+	.thread_inst_size	= sizeof(rlm_cache_memcached_thread_t),
+	.thread_inst_type	= "rlm_cache_memcached_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
+
 	.free		= cache_entry_free,
 
 	.find		= cache_entry_find,
+	.find_async	= cache_entry_find_async,
 	.insert		= cache_entry_insert,
 	.expire		= cache_entry_expire,
 
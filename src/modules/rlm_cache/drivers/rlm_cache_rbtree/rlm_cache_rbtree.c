@@ -52,17 +52,6 @@ static int8_t cache_entry_cmp(void const *one, void const *two)
 	return 0;
 }
 
-/** Compare two entries by expiry time
- *
- * There may be multiple entries with the same expiry time.
- */
-static int8_t cache_heap_cmp(void const *one, void const *two)
-{
-	rlm_cache_entry_t const *a = one, *b = two;
-
-	return CMP(a->expires, b->expires);
-}
-
 /** Cleanup a cache_rbtree instance
  *
  */
@@ -111,9 +100,10 @@ static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
 	}
 
 	/*
-	 *	The heap of entries to expire.
+	 *	The heap of entries to expire, ordered by expiry time.
+	 *	There may be multiple entries with the same expiry time.
 	 */
-	driver->heap = fr_heap_talloc_alloc(driver, cache_heap_cmp, rlm_cache_rb_entry_t, heap_id);
+	driver->heap = fr_heap_keyed_talloc_alloc(driver, rlm_cache_rb_entry_t, heap_id, fields.expires);
 	if (!driver->heap) {
 		ERROR("Failed to create heap for the cache");
 		return -1;
@@ -0,0 +1,484 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_cache_sharded.c
+ * @brief Sharded in memory cache with CLOCK eviction.
+ *
+ * Entries are spread over #CACHE_SHARDS independent hash tables by a hash
+ * of their key.  Each shard has its own mutex, so workers operating on
+ * different keys rarely contend.
+ *
+ * Instead of limiting the number of entries, the amount of memory used by
+ * entries can be bounded with `max_size`.  When inserting an entry would
+ * exceed the bound, entries are evicted from the shard using the CLOCK
+ * algorithm.  Entries found by a lookup since the hand last passed them
+ * get a second chance, entries which have expired never do.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#include "../../rlm_cache.h"
+
+/** Number of bits of the key hash used to select a shard
+ *
+ */
+#define CACHE_SHARD_BITS	5
+#define CACHE_SHARDS		(1 << CACHE_SHARD_BITS)
+
+typedef struct {
+	pthread_mutex_t		mutex;		//!< Protect the shard from multiple readers/writers.
+	fr_hash_table_t		*cache;		//!< Table for looking up cache keys.
+	fr_dlist_head_t		clock;		//!< Entries in insertion order.  The CLOCK
+						///< hand is always at the head.
+
+	size_t			size;		//!< Memory used by entries in this shard.
+	size_t			max_size;	//!< Maximum memory entries in this shard may use.
+
+	rlm_cache_stats_t	stats;		//!< Counters for this shard.
+} rlm_cache_shard_t;
+
+typedef struct {
+	size_t			max_size;	//!< Maximum memory all entries may use.
+
+	atomic_uint_fast64_t	entries;	//!< Number of entries in all the shards.
+
+	rlm_cache_shard_t	shards[CACHE_SHARDS];
+} rlm_cache_sharded_t;
+
+typedef struct {
+	rlm_cache_entry_t	fields;		//!< Entry data.
+
+	fr_dlist_t		entry;		//!< Entry in the shard's CLOCK list.
+	size_t			size;		//!< Memory charged to the shard for this entry.
+	bool			referenced;	//!< Found by a lookup since the CLOCK hand passed it.
+} rlm_cache_sharded_entry_t;
+
+/** Records which shard a caller holds the lock for
+ *
+ * The shard isn't known until we see a key, so locking is deferred
+ * until the first operation performed with the handle.
+ */
+typedef struct {
+	rlm_cache_sharded_t	*driver;	//!< Driver instance the handle was acquired from.
+	rlm_cache_shard_t	*locked;	//!< Shard we hold the mutex of, or NULL.
+} rlm_cache_sharded_handle_t;
+
+static const CONF_PARSER driver_config[] = {
+	{ FR_CONF_OFFSET("max_size", FR_TYPE_SIZE, rlm_cache_sharded_t, max_size), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
+static uint32_t cache_entry_hash(void const *data)
+{
+	rlm_cache_entry_t const *c = data;
+
+	return fr_hash(c->key, c->key_len);
+}
+
+/** Compare two entries by key
+ *
+ * There may only be one entry with the same key.
+ */
+static int8_t cache_entry_cmp(void const *one, void const *two)
+{
+	rlm_cache_entry_t const *a = one, *b = two;
+
+	MEMCMP_RETURN(a, b, key, key_len);
+	return 0;
+}
+
+/** Lock the shard holding a key
+ *
+ * Shards are selected using the high bits of the hash, the hash tables
+ * use the low bits.
+ *
+ * If the handle already holds a different shard, it's released first.
+ */
+static rlm_cache_shard_t *cache_shard_lock(rlm_cache_sharded_handle_t *handle, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_shard_t *shard;
+
+	shard = &handle->driver->shards[fr_hash(key, key_len) >> (32 - CACHE_SHARD_BITS)];
+	if (handle->locked == shard) return shard;
+
+	if (handle->locked) pthread_mutex_unlock(&handle->locked->mutex);
+
+	if (pthread_mutex_trylock(&shard->mutex) != 0) {
+		pthread_mutex_lock(&shard->mutex);
+		shard->stats.contended++;
+	}
+	handle->locked = shard;
+
+	return shard;
+}
+
+/** Remove an entry from its shard and free it
+ *
+ * @note Called with the shard mutex held.
+ */
+static void cache_entry_remove(rlm_cache_sharded_t *driver, rlm_cache_shard_t *shard, rlm_cache_sharded_entry_t *c)
+{
+	fr_hash_table_remove(shard->cache, c);
+	fr_dlist_remove(&shard->clock, c);
+	shard->size -= c->size;
+	atomic_fetch_sub_explicit(&driver->entries, 1, memory_order_relaxed);
+
+	talloc_free(c);
+}
+
+/** Evict entries until size additional bytes fit in the shard
+ *
+ * @note Called with the shard mutex held.
+ */
+static void cache_shard_evict(rlm_cache_sharded_t *driver, rlm_cache_shard_t *shard,
+			      size_t size, fr_unix_time_t now)
+{
+	rlm_cache_sharded_entry_t *c;
+
+	while ((shard->size + size) > shard->max_size) {
+		c = fr_dlist_head(&shard->clock);
+		if (!c) return;
+
+		/*
+		 *	Second chance for entries which have been
+		 *	used since the hand last passed them.
+		 */
+		if (c->referenced && (c->fields.expires >= now)) {
+			c->referenced = false;
+			fr_dlist_remove(&shard->clock, c);
+			fr_dlist_insert_tail(&shard->clock, c);
+			continue;
+		}
+
+		cache_entry_remove(driver, shard, c);
+		shard->stats.evictions++;
+	}
+}
+
+/** Cleanup a cache_sharded instance
+ *
+ */
+static int mod_detach(void *instance)
+{
+	rlm_cache_sharded_t	*driver = talloc_get_type_abort(instance, rlm_cache_sharded_t);
+	size_t			i;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		rlm_cache_shard_t		*shard = &driver->shards[i];
+		rlm_cache_sharded_entry_t	*c;
+
+		if (!shard->cache) break;	/* Partially initialised */
+
+		while ((c = fr_dlist_pop_head(&shard->clock))) talloc_free(c);
+		TALLOC_FREE(shard->cache);
+
+		pthread_mutex_destroy(&shard->mutex);
+	}
+
+	return 0;
+}
+
+/** Create a new cache_sharded instance
+ *
+ * @param instance	A uint8_t array of inst_size if inst_size > 0, else NULL,
+ *			this should contain the result of parsing the driver's
+ *			CONF_PARSER array that it specified in the interface struct.
+ * @param conf		section holding driver specific #CONF_PAIR (s).
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_cache_sharded_t	*driver = talloc_get_type_abort(instance, rlm_cache_sharded_t);
+	size_t			i;
+
+	if (driver->max_size && (driver->max_size < (CACHE_SHARDS * 1024))) {
+		cf_log_err(conf, "max_size must be 0 (unbounded) or at least %u bytes", CACHE_SHARDS * 1024);
+		return -1;
+	}
+
+	atomic_init(&driver->entries, 0);
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		rlm_cache_shard_t *shard = &driver->shards[i];
+
+		if (pthread_mutex_init(&shard->mutex, NULL) != 0) {
+			ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+			return -1;
+		}
+
+		shard->cache = fr_hash_table_open_talloc_alloc(driver, rlm_cache_sharded_entry_t,
+							       cache_entry_hash, cache_entry_cmp, NULL);
+		if (!shard->cache) {
+			ERROR("Failed to create cache");
+			pthread_mutex_destroy(&shard->mutex);
+			return -1;
+		}
+
+		fr_dlist_talloc_init(&shard->clock, rlm_cache_sharded_entry_t, entry);
+		shard->max_size = driver->max_size ? driver->max_size / CACHE_SHARDS : SIZE_MAX;
+	}
+
+	return 0;
+}
+
+/** Custom allocation function for the driver
+ *
+ * Allows allocation of cache entry structures with additional fields.
+ *
+ * @copydetails cache_entry_alloc_t
+ */
+static rlm_cache_entry_t *cache_entry_alloc(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					    request_t *request)
+{
+	rlm_cache_sharded_entry_t *c;
+
+	c = talloc_zero(NULL, rlm_cache_sharded_entry_t);
+	if (!c) {
+		RERROR("Failed allocating cache entry");
+		return NULL;
+	}
+
+	return (rlm_cache_entry_t *)c;
+}
+
+/** Locate a cache entry
+ *
+ * The entry remains valid until the handle is released.
+ *
+ * @copydetails cache_entry_find_t
+ */
+static cache_status_t cache_entry_find(rlm_cache_entry_t **out,
+				       UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+				       UNUSED request_t *request, void *handle, uint8_t const *key, size_t key_len)
+{
+	rlm_cache_sharded_handle_t	*our_handle = talloc_get_type_abort(handle, rlm_cache_sharded_handle_t);
+	rlm_cache_shard_t		*shard;
+	rlm_cache_sharded_entry_t	*c;
+
+	shard = cache_shard_lock(our_handle, key, key_len);
+
+	c = fr_hash_table_find(shard->cache, &(rlm_cache_entry_t){ .key = key, .key_len = key_len });
+	if (!c) {
+		shard->stats.misses++;
+		*out = NULL;
+		return CACHE_MISS;
+	}
+	c->referenced = true;
+	shard->stats.hits++;
+
+	*out = (rlm_cache_entry_t *)c;
+
+	return CACHE_OK;
+}
+
+/** Free an entry and remove it from the data store
+ *
+ * @copydetails cache_entry_expire_t
+ */
+static cache_status_t cache_entry_expire(UNUSED rlm_cache_config_t const *config, void *instance,
+					 UNUSED request_t *request, void *handle,
+					 uint8_t const *key, size_t key_len)
+{
+	rlm_cache_sharded_t		*driver = talloc_get_type_abort(instance, rlm_cache_sharded_t);
+	rlm_cache_sharded_handle_t	*our_handle = talloc_get_type_abort(handle, rlm_cache_sharded_handle_t);
+	rlm_cache_shard_t		*shard;
+	rlm_cache_sharded_entry_t	*c;
+
+	shard = cache_shard_lock(our_handle, key, key_len);
+
+	c = fr_hash_table_find(shard->cache, &(rlm_cache_entry_t){ .key = key, .key_len = key_len });
+	if (!c) return CACHE_MISS;
+
+	cache_entry_remove(driver, shard, c);
+
+	return CACHE_OK;
+}
+
+/** Insert a new entry into the data store
+ *
+ * Evicts other entries in the shard if there isn't enough space.
+ *
+ * @copydetails cache_entry_insert_t
+ */
+static cache_status_t cache_entry_insert(UNUSED rlm_cache_config_t const *config, void *instance,
+					 request_t *request, void *handle,
+					 rlm_cache_entry_t const *c)
+{
+	rlm_cache_sharded_t		*driver = talloc_get_type_abort(instance, rlm_cache_sharded_t);
+	rlm_cache_sharded_handle_t	*our_handle = talloc_get_type_abort(handle, rlm_cache_sharded_handle_t);
+	rlm_cache_sharded_entry_t	*new = UNCONST(rlm_cache_sharded_entry_t *, c), *old;
+	rlm_cache_shard_t		*shard;
+	size_t				size;
+
+	shard = cache_shard_lock(our_handle, c->key, c->key_len);
+
+	size = talloc_total_size(new);
+	if (size > shard->max_size) {
+		RWDEBUG("Entry size (%zu bytes) exceeds the space available in a shard (%zu bytes)",
+			size, shard->max_size);
+		return CACHE_ERROR;
+	}
+
+	/*
+	 *	Allow overwriting
+	 */
+	old = fr_hash_table_find(shard->cache, new);
+	if (old) cache_entry_remove(driver, shard, old);
+
+	cache_shard_evict(driver, shard, size, fr_time_to_unix_time(request->packet->timestamp));
+
+	if (!fr_hash_table_insert(shard->cache, new)) {
+		RERROR("Failed adding entry");
+		return CACHE_ERROR;
+	}
+
+	new->size = size;
+	new->referenced = false;
+	fr_dlist_insert_tail(&shard->clock, new);
+
+	shard->size += size;
+	shard->stats.inserts++;
+	atomic_fetch_add_explicit(&driver->entries, 1, memory_order_relaxed);
+
+	return CACHE_OK;
+}
+
+/** Update the TTL of an entry
+ *
+ * Expiry is checked on lookup and eviction, so there's nothing to reindex.
+ *
+ * @copydetails cache_entry_set_ttl_t
+ */
+static cache_status_t cache_entry_set_ttl(UNUSED rlm_cache_config_t const *config, UNUSED void *instance,
+					  UNUSED request_t *request, UNUSED void *handle,
+					  UNUSED rlm_cache_entry_t *c)
+{
+	return CACHE_OK;
+}
+
+/** Return the number of entries in the cache
+ *
+ * Doesn't lock any shards, as the caller may already hold one.
+ *
+ * @copydetails cache_entry_count_t
+ */
+static uint64_t cache_entry_count(UNUSED rlm_cache_config_t const *config, void *instance,
+				  UNUSED request_t *request, UNUSED void *handle)
+{
+	rlm_cache_sharded_t *driver = talloc_get_type_abort(instance, rlm_cache_sharded_t);
+
+	return atomic_load_explicit(&driver->entries, memory_order_relaxed);
+}
+
+/** Allocate a handle
+ *
+ * Shards are locked as keys are presented to the other callbacks.
+ *
+ * @copydetails cache_acquire_t
+ */
+static int cache_acquire(void **handle, UNUSED rlm_cache_config_t const *config, void *instance,
+			 request_t *request)
+{
+	rlm_cache_sharded_t		*driver = talloc_get_type_abort(instance, rlm_cache_sharded_t);
+	rlm_cache_sharded_handle_t	*our_handle;
+
+	MEM(our_handle = talloc_zero(request, rlm_cache_sharded_handle_t));
+	our_handle->driver = driver;
+
+	*handle = our_handle;
+
+	return 0;
+}
+
+/** Release a handle, unlocking any shard it holds
+ *
+ * @copydetails cache_release_t
+ */
+static void cache_release(UNUSED rlm_cache_config_t const *config, UNUSED void *instance, request_t *request,
+			  rlm_cache_handle_t *handle)
+{
+	rlm_cache_sharded_handle_t *our_handle = talloc_get_type_abort(handle, rlm_cache_sharded_handle_t);
+
+	if (our_handle->locked) {
+		pthread_mutex_unlock(&our_handle->locked->mutex);
+		RDEBUG3("Shard mutex released");
+	}
+
+	talloc_free(our_handle);
+}
+
+/** Sum the counters of all shards
+ *
+ * @copydetails cache_stats_t
+ */
+static void cache_stats(rlm_cache_stats_t *stats, UNUSED rlm_cache_config_t const *config, void *instance)
+{
+	rlm_cache_sharded_t	*driver = talloc_get_type_abort(instance, rlm_cache_sharded_t);
+	size_t			i;
+
+	stats->max_size = driver->max_size;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		rlm_cache_shard_t *shard = &driver->shards[i];
+
+		pthread_mutex_lock(&shard->mutex);
+		stats->entries += fr_hash_table_num_elements(shard->cache);
+		stats->size += shard->size;
+		stats->hits += shard->stats.hits;
+		stats->misses += shard->stats.misses;
+		stats->inserts += shard->stats.inserts;
+		stats->evictions += shard->stats.evictions;
+		stats->contended += shard->stats.contended;
+		pthread_mutex_unlock(&shard->mutex);
+	}
+}
+
+extern rlm_cache_driver_t rlm_cache_sharded;
+rlm_cache_driver_t rlm_cache_sharded = {
+	.name		= "rlm_cache_sharded",
+	.magic		= RLM_MODULE_INIT,
+	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
+	.inst_size	= sizeof(rlm_cache_sharded_t),
+	.config		= driver_config,
+	.alloc		= cache_entry_alloc,
+
+	.find		= cache_entry_find,
+	.insert		= cache_entry_insert,
+	.expire		= cache_entry_expire,
+	.set_ttl	= cache_entry_set_ttl,
+	.count		= cache_entry_count,
+
+	.acquire	= cache_acquire,
+	.release	= cache_release,
+
+	.stats		= cache_stats,
+};
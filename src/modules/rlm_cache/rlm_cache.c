@@ -30,12 +30,20 @@ RCSID("$Id$")
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/server/dl_module.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
 
 #include "rlm_cache.h"
 
 extern module_t rlm_cache;
 
+static const CONF_PARSER near_cache_config[] = {
+	{ FR_CONF_OFFSET("enable", FR_TYPE_BOOL, rlm_cache_config_t, near_cache), .dflt = "no" },
+	{ FR_CONF_OFFSET("ttl", FR_TYPE_UINT32, rlm_cache_config_t, near_cache_ttl), .dflt = "5" },
+	{ FR_CONF_OFFSET("max_size", FR_TYPE_SIZE, rlm_cache_config_t, near_cache_max_size), .dflt = "16777216" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("driver", FR_TYPE_STRING, rlm_cache_config_t, driver_name), .dflt = "rlm_cache_rbtree" },
 	{ FR_CONF_OFFSET("key", FR_TYPE_TMPL | FR_TYPE_REQUIRED, rlm_cache_config_t, key) },
@@ -45,6 +53,8 @@ static const CONF_PARSER module_config[] = {
 	/* Should be a type which matches time_t, @fixme before 2038 */
 	{ FR_CONF_OFFSET("epoch", FR_TYPE_INT32, rlm_cache_config_t, epoch), .dflt = "0" },
 	{ FR_CONF_OFFSET("add_stats", FR_TYPE_BOOL, rlm_cache_config_t, stats), .dflt = "no" },
+
+	{ FR_CONF_POINTER("near_cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) near_cache_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -192,7 +202,178 @@ static rlm_rcode_t cache_merge(rlm_cache_t const *inst, request_t *request, rlm_
 		RLM_MODULE_OK;
 }
 
+/** Copy the contents of one cache entry into another
+ *
+ * The maps are copied in full, so the copy remains valid after the
+ * source entry is freed or released back to its driver.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int cache_entry_copy(rlm_cache_entry_t *dst, rlm_cache_entry_t const *src)
+{
+	map_t	*map = NULL, *c_map;
+
+	fr_map_list_init(&dst->maps);
+	dst->key = talloc_memdup(dst, src->key, src->key_len);
+	if (!dst->key) return -1;
+	dst->key_len = src->key_len;
+	dst->created = src->created;
+	dst->expires = src->expires;
+	dst->hits = src->hits;
+
+	while ((map = fr_dlist_next(&src->maps, map))) {
+		if (!tmpl_is_attr(map->lhs) || !tmpl_is_data(map->rhs)) return -1;
+
+		MEM(c_map = talloc_zero(dst, map_t));
+		c_map->op = map->op;
+		fr_map_list_init(&c_map->child);
+
+		MEM(c_map->lhs = tmpl_alloc(c_map, TMPL_TYPE_ATTR, map->lhs->quote, map->lhs->name, map->lhs->len));
+		if (tmpl_attr_copy(c_map->lhs, map->lhs) < 0) return -1;
+
+		MEM(c_map->rhs = tmpl_alloc(c_map, TMPL_TYPE_DATA, map->rhs->quote, map->rhs->name, map->rhs->len));
+		if (fr_value_box_copy(c_map->rhs, tmpl_value(c_map->rhs), tmpl_value(map->rhs)) < 0) return -1;
+
+		fr_dlist_insert_tail(&dst->maps, c_map);
+	}
+
+	return 0;
+}
+
+/** Find an entry in the near cache
+ *
+ * The near cache's handle is only held for the duration of the lookup,
+ * so its locks are never held while the request talks to the main
+ * driver, or yields.
+ *
+ * @return
+ *	- A copy of the entry, allocated with the main driver's allocator.
+ *	- NULL if there was no usable entry.
+ */
+static rlm_cache_entry_t *cache_near_find(rlm_cache_t const *inst, request_t *request,
+					  uint8_t const *key, size_t key_len)
+{
+	void			*near_data = inst->near_inst->dl_inst->data;
+	rlm_cache_handle_t	*handle = NULL;
+	rlm_cache_entry_t	*found, *c = NULL;
+
+	if (inst->near->acquire && (inst->near->acquire(&handle, &inst->config, near_data, request) < 0)) return NULL;
+
+	if (inst->near->find(&found, &inst->config, near_data, request, handle, key, key_len) != CACHE_OK) goto finish;
+
+	if ((found->expires < fr_time_to_unix_time(request->packet->timestamp)) ||
+	    (found->created < fr_unix_time_from_sec(inst->config.epoch))) {
+		inst->near->expire(&inst->config, near_data, request, handle, key, key_len);
+		goto finish;
+	}
+
+	c = cache_alloc(inst, request);
+	if (!c) goto finish;
+
+	if (cache_entry_copy(c, found) < 0) {
+		talloc_free(c);
+		c = NULL;
+		goto finish;
+	}
+
+	RDEBUG3("Found entry for \"%pV\" in near cache", fr_box_strvalue_len((char const *)key, key_len));
+
+finish:
+	if (inst->near->release && handle) inst->near->release(&inst->config, near_data, request, handle);
+
+	return c;
+}
+
+/** Store a copy of an entry in the near cache
+ *
+ * The copy expires after near_cache.ttl seconds, or when the original
+ * does, whichever is sooner.
+ */
+static void cache_near_insert(rlm_cache_t const *inst, request_t *request, rlm_cache_entry_t const *c)
+{
+	void			*near_data = inst->near_inst->dl_inst->data;
+	rlm_cache_handle_t	*handle = NULL;
+	rlm_cache_entry_t	*near;
+	fr_unix_time_t		expires;
+
+	near = inst->near->alloc(&inst->config, near_data, request);
+	if (!near) return;
+
+	if (cache_entry_copy(near, c) < 0) {
+		RDEBUG3("Entry can't be stored in the near cache");
+	error:
+		talloc_free(near);
+		return;
+	}
+
+	expires = fr_time_to_unix_time(request->packet->timestamp) +
+		  fr_time_delta_from_sec(inst->config.near_cache_ttl);
+	if (expires < near->expires) near->expires = expires;
+
+	if (inst->near->acquire && (inst->near->acquire(&handle, &inst->config, near_data, request) < 0)) goto error;
+
+	if (inst->near->insert(&inst->config, near_data, request, handle, near) != CACHE_OK) talloc_free(near);
+
+	if (inst->near->release && handle) inst->near->release(&inst->config, near_data, request, handle);
+}
+
+/** Remove an entry from the near cache
+ *
+ */
+static void cache_near_expire(rlm_cache_t const *inst, request_t *request, uint8_t const *key, size_t key_len)
+{
+	void			*near_data = inst->near_inst->dl_inst->data;
+	rlm_cache_handle_t	*handle = NULL;
+
+	if (inst->near->acquire && (inst->near->acquire(&handle, &inst->config, near_data, request) < 0)) return;
+
+	inst->near->expire(&inst->config, near_data, request, handle, key, key_len);
+
+	if (inst->near->release && handle) inst->near->release(&inst->config, near_data, request, handle);
+}
+
+/** A lookup started by #cache_find which the request yielded for
+ *
+ * When the request resumes, the result is used in place of calling the
+ * driver's find callback.
+ */
+typedef struct {
+	rlm_cache_t const	*inst;			//!< Instance of rlm_cache.
+	uint8_t			*key;			//!< Copy of the expanded key.
+	size_t			key_len;		//!< Length of the key.
+
+	void			*query;			//!< Driver's handle for the lookup.
+	cache_status_t		status;			//!< Result of the lookup.
+	rlm_cache_entry_t	*c;			//!< Entry found by the lookup.
+	bool			used;			//!< The result has been consumed.
+} cache_prefetch_t;
+
+static unlang_action_t mod_cache_it_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					   request_t *request, void *rctx);
+static void mod_cache_it_signal(module_ctx_t const *mctx, request_t *request, void *rctx,
+				fr_state_signal_t action);
+
+/** Free an entry which was found, but never used
+ *
+ */
+static int _cache_prefetch_free(cache_prefetch_t *prefetch)
+{
+	cache_free(prefetch->inst, &prefetch->c);
+
+	return 0;
+}
+
 /** Find a cached entry.
+ *
+ * If prefetch is not NULL, and the driver can look up entries without
+ * blocking, the lookup is started, a pointer to its state is written to
+ * prefetch, and the request yields.  When the request is resumed, the
+ * next call with the same prefetch uses the result of that lookup.
+ *
+ * If the near cache is enabled it's checked before the driver, and
+ * entries found by the driver are copied into it.
  *
  * @return
  *	- #RLM_MODULE_OK on cache hit.
@@ -201,16 +382,57 @@ static rlm_rcode_t cache_merge(rlm_cache_t const *inst, request_t *request, rlm_
  */
 static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out,
 				  rlm_cache_t const *inst, request_t *request,
-				  rlm_cache_handle_t **handle, uint8_t const *key, size_t key_len)
+				  rlm_cache_handle_t **handle, uint8_t const *key, size_t key_len,
+				  cache_prefetch_t **prefetch)
 {
 	cache_status_t ret;
 
-	rlm_cache_entry_t *c;
+	rlm_cache_entry_t *c = NULL;
+	bool near = false;
 
 	*out = NULL;
 
+	/*
+	 *	Check the near cache first, unless we're resuming
+	 *	after a lookup in the main driver.
+	 */
+	if (inst->near && !(prefetch && *prefetch && !(*prefetch)->used)) {
+		c = cache_near_find(inst, request, key, key_len);
+		if (c) {
+			near = true;
+			goto found;
+		}
+	}
+
+	if (prefetch && !*prefetch && inst->driver->find_async) {
+		cache_prefetch_t *p;
+
+		MEM(p = talloc_zero(request, cache_prefetch_t));
+		talloc_set_destructor(p, _cache_prefetch_free);
+		p->inst = inst;
+		MEM(p->key = talloc_memdup(p, key, key_len));
+		p->key_len = key_len;
+		p->status = CACHE_ERROR;
+
+		if (inst->driver->find_async(p, &p->query, &p->c, &p->status,
+					     &inst->config, inst->driver_inst->dl_inst->data,
+					     request, p->key, p->key_len) == 0) {
+			*prefetch = p;
+			return unlang_module_yield(request, mod_cache_it_resume, mod_cache_it_signal, p);
+		}
+		talloc_free(p);
+	}
+
 	for (;;) {
-		ret = inst->driver->find(&c, &inst->config, inst->driver_inst->dl_inst->data, request, *handle, key, key_len);
+		if (prefetch && *prefetch && !(*prefetch)->used) {
+			(*prefetch)->used = true;
+			ret = (*prefetch)->status;
+			c = (*prefetch)->c;
+			(*prefetch)->c = NULL;
+		} else {
+			ret = inst->driver->find(&c, &inst->config, inst->driver_inst->dl_inst->data,
+						 request, *handle, key, key_len);
+		}
 		switch (ret) {
 		case CACHE_RECONNECT:
 			RDEBUG2("Reconnecting...");
@@ -243,13 +465,16 @@ static unlang_action_t cache_find(rlm_rcode_t *p_result, rlm_cache_entry_t **out
 			fr_box_date(fr_time_to_unix_time(request->packet->timestamp -
 							 fr_time_delta_from_sec(c->expires))));
 
-		inst->driver->expire(&inst->config, inst->driver_inst->dl_inst->data, request, handle, c->key, c->key_len);
+		inst->driver->expire(&inst->config, inst->driver_inst->dl_inst->data, request, *handle, c->key, c->key_len);
 		cache_free(inst, &c);
 		RETURN_MODULE_NOTFOUND;	/* Couldn't find a non-expired entry */
 	}
 
+found:
 	RDEBUG2("Found entry for \"%pV\"", fr_box_strvalue_len((char const *)key, key_len));
 
+	if (inst->near && !near) cache_near_insert(inst, request, c);
+
 	c->hits++;
 	*out = c;
 
@@ -268,6 +493,8 @@ static unlang_action_t cache_expire(rlm_rcode_t *p_result,
 				    rlm_cache_handle_t **handle, uint8_t const *key, size_t key_len)
 {
 	RDEBUG2("Expiring cache entry");
+	if (inst->near) cache_near_expire(inst, request, key, key_len);
+
 	for (;;) switch (inst->driver->expire(&inst->config, inst->driver_inst->dl_inst->data, request,
 					      *handle, key, key_len)) {
 	case CACHE_RECONNECT:
@@ -306,7 +533,7 @@ static unlang_action_t cache_insert(rlm_rcode_t *p_result,
 	TALLOC_CTX		*pool;
 
 	if ((inst->config.max_entries > 0) && inst->driver->count &&
-	    (inst->driver->count(&inst->config, inst->driver_inst->dl_inst->data, request, handle) > inst->config.max_entries)) {
+	    (inst->driver->count(&inst->config, inst->driver_inst->dl_inst->data, request, *handle) > inst->config.max_entries)) {
 		RWDEBUG("Cache is full: %d entries", inst->config.max_entries);
 		RETURN_MODULE_FAIL;
 	}
@@ -445,6 +672,7 @@ static unlang_action_t cache_insert(rlm_rcode_t *p_result,
 
 		case CACHE_OK:
 			RDEBUG2("Committed entry, TTL %d seconds", ttl);
+			if (inst->near) cache_near_insert(inst, request, c);
 			cache_free(inst, &c);
 			RETURN_MODULE_RCODE(merge ? RLM_MODULE_UPDATED : RLM_MODULE_OK);
 
@@ -465,6 +693,12 @@ static unlang_action_t cache_set_ttl(rlm_rcode_t *p_result,
 				     rlm_cache_t const *inst, request_t *request,
 				     rlm_cache_handle_t **handle, rlm_cache_entry_t *c)
 {
+	/*
+	 *	Drop any copy in the near cache, it'll be refreshed
+	 *	the next time the entry is found.
+	 */
+	if (inst->near) cache_near_expire(inst, request, c->key, c->key_len);
+
 	/*
 	 *	Call the driver's insert method to overwrite the old entry
 	 */
@@ -525,18 +759,16 @@ static int cache_verify(map_t *map, void *ctx)
 	return 0;
 }
 
-/** Do caching checks
- *
- * Since we can update ANY VP list, we do exactly the same thing for all sections
- * (autz / auth / etc.)
+/** Perform the cache operations for a request
  *
- * If you want to cache something different in different sections, configure
- * another cache module.
+ * The first lookup may yield, if the driver supports non-blocking lookups.
+ * Nothing is changed before that lookup, so when the request resumes, we
+ * start again from the top, and the lookup returns the result in prefetch.
  */
-static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+static unlang_action_t cache_it(rlm_rcode_t *p_result, rlm_cache_t const *inst, request_t *request,
+				uint8_t const *key, size_t key_len, cache_prefetch_t *prefetch)
 {
 	rlm_cache_entry_t	*c = NULL;
-	rlm_cache_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_cache_t);
 
 	rlm_cache_handle_t	*handle;
 
@@ -546,24 +778,10 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 	bool			merge = true, insert = true, expire = false, set_ttl = false;
 	int			exists = -1;
 
-	uint8_t			buffer[1024];
-	uint8_t const		*key;
-	ssize_t			key_len;
 	rlm_rcode_t		rcode = RLM_MODULE_NOOP;
 
 	int			ttl = inst->config.ttl;
 
-	key_len = tmpl_expand((char const **)&key, (char *)buffer, sizeof(buffer),
-			      request, inst->config.key, NULL, NULL);
-	if (key_len < 0) {
-		RETURN_MODULE_FAIL;
-	}
-
-	if (key_len == 0) {
-		REDEBUG("Zero length key string is invalid");
-		RETURN_MODULE_INVALID;
-	}
-
 	/*
 	 *	If Cache-Status-Only == yes, only return whether we found a
 	 *	valid cache entry
@@ -578,7 +796,8 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 			RETURN_MODULE_FAIL;
 		}
 
-		cache_find(&rcode, &c, inst, request, &handle, key, key_len);
+		if (cache_find(&rcode, &c, inst, request, &handle, key, key_len,
+			       &prefetch) == UNLANG_ACTION_YIELD) goto yield;
 		if (rcode == RLM_MODULE_FAIL) goto finish;
 		fr_assert(!inst->driver->acquire || handle);
 
@@ -625,7 +844,8 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 	 *	recording whether the entry existed.
 	 */
 	if (merge) {
-		cache_find(&rcode, &c, inst, request, &handle, key, key_len);
+		if (cache_find(&rcode, &c, inst, request, &handle, key, key_len,
+			       &prefetch) == UNLANG_ACTION_YIELD) goto yield;
 		switch (rcode) {
 		case RLM_MODULE_FAIL:
 			goto finish;
@@ -690,7 +910,8 @@ static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, modu
 	if ((exists < 0) && (insert || set_ttl)) {
 		rlm_rcode_t tmp;
 
-		cache_find(&tmp, &c, inst, request, &handle, key, key_len);
+		if (cache_find(&tmp, &c, inst, request, &handle, key, key_len,
+			       &prefetch) == UNLANG_ACTION_YIELD) goto yield;
 		switch (tmp) {
 		case RLM_MODULE_FAIL:
 			rcode = RLM_MODULE_FAIL;
@@ -797,6 +1018,64 @@ finish:
 	}
 
 	RETURN_MODULE_RCODE(rcode);
+
+yield:
+	cache_release(inst, request, &handle);
+
+	return UNLANG_ACTION_YIELD;
+}
+
+static unlang_action_t mod_cache_it_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					   request_t *request, void *rctx)
+{
+	rlm_cache_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_cache_t);
+	cache_prefetch_t	*prefetch = talloc_get_type_abort(rctx, cache_prefetch_t);
+	unlang_action_t		ua;
+
+	ua = cache_it(p_result, inst, request, prefetch->key, prefetch->key_len, prefetch);
+	talloc_free(prefetch);
+
+	return ua;
+}
+
+static void mod_cache_it_signal(UNUSED module_ctx_t const *mctx, UNUSED request_t *request,
+				void *rctx, fr_state_signal_t action)
+{
+	cache_prefetch_t *prefetch = talloc_get_type_abort(rctx, cache_prefetch_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	talloc_free(prefetch);	/* Cancels the lookup */
+}
+
+/** Do caching checks
+ *
+ * Since we can update ANY VP list, we do exactly the same thing for all sections
+ * (autz / auth / etc.)
+ *
+ * If you want to cache something different in different sections, configure
+ * another cache module.
+ */
+static unlang_action_t CC_HINT(nonnull) mod_cache_it(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_cache_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_cache_t);
+
+	uint8_t			buffer[1024];
+	uint8_t const		*key;
+	ssize_t			key_len;
+
+	key_len = tmpl_expand((char const **)&key, (char *)buffer, sizeof(buffer),
+			      request, inst->config.key, NULL, NULL);
+	if (key_len < 0) {
+		RETURN_MODULE_FAIL;
+	}
+
+	if (key_len == 0) {
+		REDEBUG("Zero length key string is invalid");
+		RETURN_MODULE_INVALID;
+	}
+
+	return cache_it(p_result, inst, request, key, key_len, NULL);
 }
 
 static int mod_xlat_thread_instantiate(UNUSED void *xlat_inst, void *xlat_thread_inst,
@@ -862,16 +1141,14 @@ static xlat_action_t cache_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out, request_t *r
 		return XLAT_ACTION_FAIL;
 	}
 
-	cache_find(&rcode, &c, xti->inst, request, &handle, key, key_len);
+	cache_find(&rcode, &c, xti->inst, request, &handle, key, key_len, NULL);
 	switch (rcode) {
 	case RLM_MODULE_OK:		/* found */
 		break;
 
-	case RLM_MODULE_NOTFOUND:	/* not found */
-		return XLAT_ACTION_FAIL;
-
 	default:
 		talloc_free(target);
+		cache_release(xti->inst, request, &handle);
 		return XLAT_ACTION_FAIL;
 	}
 
@@ -887,13 +1164,75 @@ static xlat_action_t cache_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out, request_t *r
 
 	talloc_free(target);
 
+	cache_free(xti->inst, &c);
+	cache_release(xti->inst, request, &handle);
+
 	/*
 	 *	Check if we found a matching map
 	 */
 	if (!map) return XLAT_ACTION_FAIL;
 
-	cache_free(xti->inst, &c);
-	cache_release(xti->inst, request, &handle);
+	return XLAT_ACTION_DONE;
+}
+
+static fr_table_num_sorted_t const cache_stats_table[] = {
+	{ L("contended"),	offsetof(rlm_cache_stats_t, contended)	},
+	{ L("entries"),		offsetof(rlm_cache_stats_t, entries)	},
+	{ L("evictions"),	offsetof(rlm_cache_stats_t, evictions)	},
+	{ L("hits"),		offsetof(rlm_cache_stats_t, hits)	},
+	{ L("inserts"),		offsetof(rlm_cache_stats_t, inserts)	},
+	{ L("max_size"),	offsetof(rlm_cache_stats_t, max_size)	},
+	{ L("misses"),		offsetof(rlm_cache_stats_t, misses)	},
+	{ L("size"),		offsetof(rlm_cache_stats_t, size)	}
+};
+static size_t cache_stats_table_len = NUM_ELEMENTS(cache_stats_table);
+
+static int cache_stats_xlat_instantiate(void *xlat_inst, UNUSED xlat_exp_t const *exp, void *uctx)
+{
+	*((rlm_cache_t **)xlat_inst) = talloc_get_type_abort(uctx, rlm_cache_t);
+
+	return 0;
+}
+
+static xlat_arg_parser_t const cache_stats_xlat_args[] = {
+	{ .required = true, .single = true, .type = FR_TYPE_STRING },
+	XLAT_ARG_PARSER_TERMINATOR
+};
+
+/** Retrieve a counter from the cache driver
+ *
+ * Example:
+@verbatim
+%(cache_stats:hits)
+@endverbatim
+ *
+ * Valid counters are `entries`, `size`, `max_size`, `hits`, `misses`,
+ * `inserts`, `evictions` and `contended`.
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t cache_stats_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out, request_t *request,
+				      void const *xlat_inst, UNUSED void *xlat_thread_inst,
+				      fr_value_box_list_t *in)
+{
+	rlm_cache_t const		*inst = talloc_get_type_abort_const(*((void const * const *)xlat_inst),
+									    rlm_cache_t);
+	fr_value_box_t			*name = fr_dlist_head(in);
+	fr_value_box_t			*vb;
+	rlm_cache_stats_t		stats = { 0 };
+	int				offset;
+
+	offset = fr_table_value_by_str(cache_stats_table, name->vb_strvalue, -1);
+	if (offset < 0) {
+		REDEBUG("Unknown cache counter \"%pV\"", name);
+		return XLAT_ACTION_FAIL;
+	}
+
+	inst->driver->stats(&stats, &inst->config, inst->driver_inst->dl_inst->data);
+
+	MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_UINT64, NULL, false));
+	vb->vb_uint64 = *((uint64_t *)(((uint8_t *)&stats) + offset));
+	fr_dcursor_append(out, vb);
 
 	return XLAT_ACTION_DONE;
 }
@@ -972,6 +1311,41 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	fr_assert(inst->driver->insert);
 	fr_assert(inst->driver->expire);
 
+	/*
+	 *	Load an in memory driver to hold copies of entries
+	 *	found in the main driver.
+	 */
+	if (inst->config.near_cache) {
+		CONF_SECTION	*near_cs, *cs;
+
+		near_cs = cf_section_find(conf, "near_cache", NULL);
+		fr_assert(near_cs);
+
+		if ((strcmp(inst->config.driver_name, "rlm_cache_rbtree") == 0) ||
+		    (strcmp(inst->config.driver_name, "rlm_cache_sharded") == 0)) {
+			cf_log_err(near_cs, "A near cache can't be used with the in memory driver \"%s\"",
+				   inst->config.driver_name);
+			return -1;
+		}
+
+		if (inst->config.near_cache_ttl == 0) {
+			cf_log_err(near_cs, "ttl must be greater than 0");
+			return -1;
+		}
+
+		MEM(cs = cf_section_alloc(near_cs, near_cs, "sharded", NULL));
+		MEM(cf_pair_alloc(cs, "max_size", talloc_asprintf(cs, "%zu", inst->config.near_cache_max_size),
+				  T_OP_EQ, T_BARE_WORD, T_BARE_WORD));
+
+		inst->near_inst = module_bootstrap(module_by_data(inst), cs);
+		if (!inst->near_inst) {
+			cf_log_err(near_cs, "Failed loading near cache driver");
+			return -1;
+		}
+		inst->near = (rlm_cache_driver_t const *)inst->near_inst->dl_inst->module->common;
+		fr_assert(inst->near->alloc);
+	}
+
 	/*
 	 *	Register the cache xlat function
 	 */
@@ -979,6 +1353,19 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	xlat_func_args(xlat, cache_xlat_args);
 	xlat_async_thread_instantiate_set(xlat, mod_xlat_thread_instantiate, cache_xlat_thread_inst_t, NULL, inst);
 
+	/*
+	 *	Register the stats xlat if the driver keeps counters
+	 */
+	if (inst->driver->stats) {
+		char *stats_name;
+
+		stats_name = talloc_asprintf(NULL, "%s_stats", inst->config.name);
+		xlat = xlat_register(inst, stats_name, cache_stats_xlat, false);
+		xlat_func_args(xlat, cache_stats_xlat_args);
+		xlat_async_instantiate_set(xlat, cache_stats_xlat_instantiate, rlm_cache_t *, NULL, inst);
+		talloc_free(stats_name);
+	}
+
 	return 0;
 }
 
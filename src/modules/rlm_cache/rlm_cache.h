@@ -56,6 +56,10 @@ typedef struct {
 	uint32_t		max_entries;		//!< Maximum entries allowed.
 	int32_t			epoch;			//!< Time after which entries are considered valid.
 	bool			stats;			//!< Generate statistics.
+
+	bool			near_cache;		//!< Keep recently used entries in memory.
+	uint32_t		near_cache_ttl;		//!< How long entries are kept in memory for.
+	size_t			near_cache_max_size;	//!< Most memory the near cache may use.
 } rlm_cache_config_t;
 
 /*
@@ -71,6 +75,10 @@ typedef struct {
 	module_instance_t	*driver_inst;		//!< Driver's instance data.
 	rlm_cache_driver_t const	*driver;		//!< Driver's exported interface.
 
+	module_instance_t	*near_inst;		//!< Near cache driver's instance data.
+	rlm_cache_driver_t const	*near;			//!< Near cache driver's exported interface,
+							//!< NULL if the near cache is disabled.
+
 	fr_map_list_t		maps;			//!< Attribute map applied to users.
 							//!< and profiles.
 	CONF_SECTION		*cs;
@@ -90,6 +98,21 @@ typedef struct {
 	rlm_cache_t		*inst;			//!< Instance of rlm_cache
 } cache_xlat_thread_inst_t;
 
+/** Counters reported by drivers which provide a #cache_stats_t callback
+ *
+ * Counters the driver doesn't track should be left at zero.
+ */
+typedef struct {
+	uint64_t		entries;		//!< Entries currently in the cache.
+	uint64_t		size;			//!< Bytes used by entries currently in the cache.
+	uint64_t		max_size;		//!< Maximum bytes the cache may use, 0 if unbounded.
+	uint64_t		hits;			//!< Lookups which found an entry.
+	uint64_t		misses;			//!< Lookups which didn't find an entry.
+	uint64_t		inserts;		//!< Entries added.
+	uint64_t		evictions;		//!< Entries removed to make space for new entries.
+	uint64_t		contended;		//!< Lock acquisitions which had to wait.
+} rlm_cache_stats_t;
+
 /** Allocate a new cache entry
  *
  */
@@ -135,6 +158,37 @@ typedef cache_status_t	(*cache_entry_find_t)(rlm_cache_entry_t **out, rlm_cache_
 					      void *instance, request_t *request, void *handle,
 					      uint8_t const *key, size_t key_len);
 
+/** Start retrieving an entry from the cache without blocking
+ *
+ * @note This callback is optional.  If it's not provided, or it returns -1,
+ *	#cache_entry_find_t is called instead.
+ *
+ * When the lookup completes, the driver writes the result to status (and
+ * the entry, if one was found, to out) and marks the request as runnable.
+ * The result codes are the same as for #cache_entry_find_t, except
+ * #CACHE_RECONNECT which must not be returned.
+ *
+ * Freeing the query before the lookup completes cancels it.
+ *
+ * @param[in] ctx to allocate the query in.
+ * @param[out] query Where to write a pointer to the driver's handle for the lookup.
+ * @param[out] out Where to write a pointer to the retrieved entry (if there was one).
+ * @param[out] status Where to write the result of the lookup.
+ * @param[in] config for this instance of the rlm_cache module.
+ * @param[in] instance Driver specific instance data.
+ * @param[in] request The current request.
+ * @param[in] key to use to lookup cache entry.  Must remain valid until the
+ *	lookup completes.
+ * @param[in] key_len the length of the key string.
+ * @return
+ *	- 0 if the lookup was started.
+ *	- -1 if the lookup can't be performed without blocking.
+ */
+typedef int		(*cache_entry_find_async_t)(TALLOC_CTX *ctx, void **query,
+						    rlm_cache_entry_t **out, cache_status_t *status,
+						    rlm_cache_config_t const *config, void *instance,
+						    request_t *request, uint8_t const *key, size_t key_len);
+
 /** Insert an entry into the cache
  *
  * Serialize (if necessary) the entry passed to us, and write it to the cache with
@@ -268,6 +322,18 @@ typedef void		(*cache_release_t)(rlm_cache_config_t const *config, void *instanc
 typedef int		(*cache_reconnect_t)(rlm_cache_handle_t **handle, rlm_cache_config_t const *config,
 					     void *instance, request_t *request);
 
+/** Retrieve driver counters
+ *
+ * @note This callback is optional.  If it's provided a `<name>_stats` xlat is registered
+ *	 for each instance of rlm_cache using this driver.
+ *
+ * @param[out] stats Where to write the counters.
+ * @param[in] config for this instance of the rlm_cache module.
+ * @param[in] instance Driver specific instance data.
+ */
+typedef void		(*cache_stats_t)(rlm_cache_stats_t *stats, rlm_cache_config_t const *config,
+					 void *instance);
+
 struct rlm_cache_driver_s {
 	DL_MODULE_COMMON;					//!< Common fields for all loadable modules.
 	FR_MODULE_COMMON;					//!< Common fields for all instantiated modules.
@@ -277,6 +343,8 @@ struct rlm_cache_driver_s {
 	cache_entry_free_t		free;			//!< (optional) Free memory used by an entry.
 
 	cache_entry_find_t		find;			//!< Retrieve an existing cache entry.
+	cache_entry_find_async_t	find_async;		//!< (optional) Start retrieving an existing cache
+								//!< entry without blocking.
 	cache_entry_insert_t		insert;			//!< Add a new entry.
 	cache_entry_expire_t		expire;			//!< Remove an old entry.
 	cache_entry_set_ttl_t		set_ttl;		//!< (Optional) Update the TTL of an entry.
@@ -288,4 +356,6 @@ struct rlm_cache_driver_s {
 	cache_release_t			release;		//!< (optional) Release access to resource acquired
 								//!< with acquire callback.
 	cache_reconnect_t		reconnect;		//!< (optional) Re-initialise resource.
+
+	cache_stats_t			stats;			//!< (optional) Retrieve driver counters.
 };
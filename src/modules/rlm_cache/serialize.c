@@ -25,9 +25,21 @@
  */
 RCSID("$Id$")
 
+#include <freeradius-devel/internal/internal.h>
+
 #include "rlm_cache.h"
 #include "serialize.h"
 
+/*
+ *	Binary entries are an internal encoding header, followed by
+ *
+ *	- Cache-Created and Cache-Expires, as 64 bit integers.
+ *	- For each map, the request reference, list and operator
+ *	  as one byte each, and then the pair in the internal
+ *	  encoding.
+ */
+#define CACHE_MAP_HDR_LEN	3
+
 /** Serialize a cache entry as a humanly readable string
  *
  * @param ctx to alloc new string in. Should be a talloc pool a little bigger
@@ -89,11 +101,157 @@ finish:
 	return 0;
 }
 
+/** Serialize a cache entry using the internal encoding
+ *
+ * This is much cheaper to read back than the text format, as
+ * attribute names and values don't need to be parsed.
+ *
+ * @param[in] ctx	to alloc the buffer in.
+ * @param[out] out	Where to write pointer to serialized cache entry.
+ * @param[out] outlen	Length of the serialized cache entry.
+ * @param[in] c		Cache entry to serialize.
+ * @return
+ *	- 0 on success.
+ *	- 1 if the entry can't be represented in binary, and
+ *	  cache_serialize() should be used instead.
+ *	- -1 on failure.
+ */
+int cache_serialize_binary(TALLOC_CTX *ctx, uint8_t **out, size_t *outlen, rlm_cache_entry_t const *c)
+{
+	fr_dbuff_t		dbuff;
+	fr_dbuff_uctx_talloc_t	tctx;
+	map_t			*map = NULL;
+	fr_pair_list_t		list;
+	fr_dcursor_t		cursor;
+	fr_pair_t		*vp;
+	ssize_t			slen;
+
+	/*
+	 *	Only plain attribute assignments from a single
+	 *	request reference have a binary form.
+	 */
+	while ((map = fr_dlist_next(&c->maps, map))) {
+		if (!tmpl_is_attr(map->lhs) || !tmpl_is_data(map->rhs) ||
+		    (tmpl_request_ref_count(map->lhs) != 1) || (tmpl_num(map->lhs) != NUM_ANY) ||
+		    !fr_type_is_leaf(tmpl_da(map->lhs)->type)) return 1;
+	}
+
+	if (!fr_dbuff_init_talloc(ctx, &dbuff, &tctx, 256, SIZE_MAX)) {
+	oom:
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+
+	if ((fr_internal_encode_header(&dbuff) < 0) ||
+	    (fr_dbuff_in(&dbuff, (uint64_t)c->created) < 0) ||
+	    (fr_dbuff_in(&dbuff, (uint64_t)c->expires) < 0)) {
+	error:
+		fr_dbuff_free_talloc(&dbuff);
+		return -1;
+	}
+
+	fr_pair_list_init(&list);
+	while ((map = fr_dlist_next(&c->maps, map))) {
+		if (fr_dbuff_in_bytes(&dbuff, (uint8_t)tmpl_request(map->lhs),
+				      (uint8_t)tmpl_list(map->lhs), (uint8_t)map->op) < 0) goto error;
+
+		vp = fr_pair_afrom_da(ctx, tmpl_da(map->lhs));
+		if (!vp) {
+			fr_dbuff_free_talloc(&dbuff);
+			goto oom;
+		}
+		if (fr_value_box_copy(vp, &vp->data, tmpl_value(map->rhs)) < 0) {
+			talloc_free(vp);
+			goto error;
+		}
+		fr_pair_append(&list, vp);
+
+		fr_dcursor_init(&cursor, &list);
+		slen = fr_internal_encode_pair(&dbuff, &cursor, NULL);
+		fr_pair_list_free(&list);
+		if (slen < 0) goto error;
+	}
+
+	*out = fr_dbuff_start(&dbuff);
+	*outlen = fr_dbuff_used(&dbuff);
+
+	return 0;
+}
+
+/** Converts a binary cache entry back into a structure
+ *
+ */
+static int cache_deserialize_binary(rlm_cache_entry_t *c, fr_dict_t const *dict, uint8_t const *in, size_t inlen)
+{
+	fr_dbuff_t	dbuff = FR_DBUFF_TMP(in, inlen);
+	uint64_t	created, expires;
+	uint8_t		map_hdr[CACHE_MAP_HDR_LEN];
+	fr_pair_list_t	list;
+	fr_dcursor_t	cursor;
+	fr_pair_t	*vp;
+
+	if (fr_internal_decode_header(&dbuff) < 0) return -1;
+
+	if ((fr_dbuff_out(&created, &dbuff) < 0) || (fr_dbuff_out(&expires, &dbuff) < 0)) {
+	truncated:
+		fr_strerror_const("Cache entry is truncated");
+		return -1;
+	}
+	c->created = created;
+	c->expires = expires;
+
+	fr_pair_list_init(&list);
+	while (fr_dbuff_remaining(&dbuff) > 0) {
+		map_t		*map;
+		tmpl_rules_t	rules = {
+					.dict_def = dict,
+					.prefix = TMPL_ATTR_REF_PREFIX_NO
+				};
+
+		if (fr_dbuff_out_memcpy(map_hdr, &dbuff, sizeof(map_hdr)) < 0) goto truncated;
+
+		if ((map_hdr[0] >= REQUEST_UNKNOWN) || (map_hdr[1] >= PAIR_LIST_UNKNOWN) ||
+		    (map_hdr[2] >= T_TOKEN_LAST)) {
+			fr_strerror_printf("Invalid map header %02x %02x %02x", map_hdr[0], map_hdr[1], map_hdr[2]);
+			return -1;
+		}
+		rules.request_def = map_hdr[0];
+		rules.list_def = map_hdr[1];
+
+		fr_dcursor_init(&cursor, &list);
+		if (fr_internal_decode_pair_dbuff(c, &cursor, dict, &dbuff, NULL) <= 0) {
+		error:
+			fr_pair_list_free(&list);
+			return -1;
+		}
+
+		/*
+		 *	Parents (TLVs, vendors) are decoded too,
+		 *	the map is for the leaf.
+		 */
+		vp = fr_pair_list_head(&list);
+		while (vp && !fr_type_is_leaf(vp->vp_type)) vp = fr_pair_list_head(&vp->vp_group);
+		if (!vp) {
+			fr_strerror_const("Cache entry contains a structural attribute with no value");
+			goto error;
+		}
+
+		if (map_afrom_vp(c, &map, vp, &rules) < 0) goto error;
+		map->op = map_hdr[2];
+		fr_pair_list_free(&list);
+
+		MAP_VERIFY(map);
+		fr_dlist_insert_tail(&c->maps, map);
+	}
+
+	return 0;
+}
+
 /** Converts a serialized cache entry back into a structure
  *
  * @param[in] c		Cache entry to populate (should already be allocated)
  * @param[in] dict	to use for unqualified attributes.
- * @param[in] in	String representation of cache entry.
+ * @param[in] in	String or binary representation of cache entry.
  * @param[in] inlen	Length of string. May be < 0 in which case strlen will be
  *			used to calculate the length of the string.
  * @return
@@ -104,6 +262,10 @@ int cache_deserialize(rlm_cache_entry_t *c, fr_dict_t const *dict, char *in, ssi
 {
 	char		*p, *q;
 
+	if ((inlen >= FR_INTERNAL_HDR_LEN) && (memcmp(in, FR_INTERNAL_MAGIC, FR_INTERNAL_MAGIC_LEN) == 0)) {
+		return cache_deserialize_binary(c, dict, (uint8_t const *)in, inlen);
+	}
+
 	if (inlen < 0) inlen = strlen(in);
 
 	p = in;
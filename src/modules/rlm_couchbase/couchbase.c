@@ -29,6 +29,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/json/base.h>
+#include <freeradius-devel/unlang/interpret.h>
 
 #include "couchbase.h"
 
@@ -182,7 +183,8 @@ void couchbase_http_data_callback(lcb_http_request_t request, lcb_t instance, co
 /** Initialize a Couchbase connection instance
  *
  * Initialize all information relating to a Couchbase instance and configure available method callbacks.
- * This function forces synchronous operation and will wait for a connection or timeout.
+ * Unless an I/O plugin is passed, this function forces synchronous operation and will wait for a
+ * connection or timeout.
  *
  * @param instance Empty (un-allocated) Couchbase instance object.
  * @param host       The Couchbase server or list of servers.
@@ -191,10 +193,12 @@ void couchbase_http_data_callback(lcb_http_request_t request, lcb_t instance, co
  * @param pass       The Couchbase bucket password (NULL if none).
  * @param timeout    Maximum time to wait for obtaining the initial configuration.
  * @param opts       Extra options to configure the libcouchbase.
+ * @param io         I/O plugin driven by the caller's event loop (NULL for the default, blocking, one).
+ *                   Instances created with a plugin must not be passed to the synchronous functions below.
  * @return           Couchbase error object.
  */
 lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const char *bucket, const char *user, const char *pass,
-				      lcb_uint32_t timeout, const couchbase_opts_t *opts)
+				      lcb_uint32_t timeout, const couchbase_opts_t *opts, lcb_io_opt_t io)
 {
 	lcb_error_t error;                      /* couchbase command return */
 	struct lcb_create_st options;           /* init create struct */
@@ -207,6 +211,7 @@ lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const c
 	options.v.v0.bucket = bucket;
 	options.v.v0.user = user;
 	options.v.v0.passwd = pass;
+	options.v.v0.io = io;
 
 	/* create couchbase connection instance */
 	error = lcb_create(instance, &options);
@@ -237,6 +242,10 @@ lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const c
 	lcb_set_store_callback(*instance, couchbase_store_callback);
 	lcb_set_get_callback(*instance, couchbase_get_callback);
 	lcb_set_http_data_callback(*instance, couchbase_http_data_callback);
+
+	/* the caller's event loop completes the connection */
+	if (io) return LCB_SUCCESS;
+
 	/* wait on connection */
 	lcb_wait(*instance);
 
@@ -419,3 +428,264 @@ lcb_error_t couchbase_query_view(lcb_t instance, const void *cookie, const char
 	/* return error */
 	return error;
 }
+
+/** An instance driven by a worker's event list
+ *
+ */
+struct couchbase_async_s {
+	lcb_t			instance;	//!< Couchbase connection instance.
+	couchbase_io_t		*io;		//!< Plugin inserting the instance's events into el.
+	fr_event_list_t		*el;		//!< The worker's event list.
+
+	fr_dlist_head_t		pending;	//!< Ops waiting to be sent.
+	uint32_t		batch_size;	//!< Send the pending ops once there are this many.
+	fr_event_timer_t const	*ev_flush;	//!< Sends the pending ops at the end of this
+						///< event loop iteration.
+};
+
+/** An op has completed
+ *
+ */
+static void couchbase_async_done(couchbase_op_t *op)
+{
+	op->in_flight = false;
+
+	/*
+	 *	Request was cancelled while we were waiting.
+	 */
+	if (!op->request) {
+		if (op->cookie.jobj) json_object_put(op->cookie.jobj);
+		talloc_free(op);
+		return;
+	}
+
+	unlang_interpret_mark_runnable(op->request);
+}
+
+/** Couchbase callback for asynchronous get operations
+ *
+ * @param instance Couchbase connection instance.
+ * @param cbtype   Type of response.
+ * @param rb       Couchbase get response.
+ */
+static void couchbase_async_get_callback(lcb_t instance, UNUSED int cbtype, const lcb_RESPBASE *rb)
+{
+	lcb_RESPGET const	*resp = (lcb_RESPGET const *)rb;
+	couchbase_op_t		*op = UNCONST(couchbase_op_t *, resp->cookie);
+
+	op->error = resp->rc;
+
+	switch (resp->rc) {
+	case LCB_SUCCESS:
+		if (!resp->value || (resp->nvalue <= 1)) break;
+
+		op->cookie.jtok = json_tokener_new();
+		op->cookie.jobj = json_tokener_parse_ex(op->cookie.jtok, resp->value, resp->nvalue);
+		op->cookie.jerr = json_tokener_get_error(op->cookie.jtok);
+		json_tokener_free(op->cookie.jtok);
+		op->cookie.jtok = NULL;
+
+		if (op->cookie.jerr != json_tokener_success) {
+			ERROR("(get_callback) json parsing error: %s", json_tokener_error_desc(op->cookie.jerr));
+			if (op->cookie.jobj) {
+				json_object_put(op->cookie.jobj);
+				op->cookie.jobj = NULL;
+			}
+		}
+		break;
+
+	case LCB_KEY_ENOENT:
+		/* ignored */
+		DEBUG("(get_callback) key does not exist");
+		op->error = LCB_SUCCESS;
+		break;
+
+	default:
+		ERROR("(get_callback) %s (0x%x)", lcb_strerror(instance, resp->rc), resp->rc);
+		break;
+	}
+
+	couchbase_async_done(op);
+}
+
+/** Couchbase callback for asynchronous store operations
+ *
+ * @param instance Couchbase connection instance.
+ * @param cbtype   Type of response.
+ * @param rb       Couchbase store response.
+ */
+static void couchbase_async_store_callback(lcb_t instance, UNUSED int cbtype, const lcb_RESPBASE *rb)
+{
+	couchbase_op_t		*op = UNCONST(couchbase_op_t *, rb->cookie);
+
+	op->error = rb->rc;
+	if (rb->rc != LCB_SUCCESS) ERROR("(store_callback) %s (0x%x)", lcb_strerror(instance, rb->rc), rb->rc);
+
+	couchbase_async_done(op);
+}
+
+/** Send all of the pending ops in one batch
+ *
+ * libcouchbase pipelines everything scheduled between lcb_sched_enter()
+ * and lcb_sched_leave(), so a burst of accounting requests costs one
+ * write per server, rather than one round trip each.
+ */
+static void couchbase_async_flush(couchbase_async_t *cba)
+{
+	couchbase_op_t	*op;
+
+	fr_event_timer_delete(&cba->ev_flush);
+
+	if (fr_dlist_empty(&cba->pending)) return;
+
+	lcb_sched_enter(cba->instance);
+
+	while ((op = fr_dlist_head(&cba->pending))) {
+		fr_dlist_remove(&cba->pending, op);
+
+		if (op->store) {
+			lcb_CMDSTORE cmd = { 0 };
+
+			LCB_CMD_SET_KEY(&cmd, op->key, strlen(op->key));
+			LCB_CMD_SET_VALUE(&cmd, op->document, strlen(op->document));
+			cmd.exptime = op->expire;
+			cmd.operation = LCB_SET;
+
+			DEBUG3("storing document %s", op->key);
+			op->error = lcb_store3(cba->instance, op, &cmd);
+		} else {
+			lcb_CMDGET cmd = { 0 };
+
+			LCB_CMD_SET_KEY(&cmd, op->key, strlen(op->key));
+
+			DEBUG3("fetching document %s", op->key);
+			op->error = lcb_get3(cba->instance, op, &cmd);
+		}
+
+		op->in_flight = true;
+		if (op->error != LCB_SUCCESS) couchbase_async_done(op);
+	}
+
+	lcb_sched_leave(cba->instance);
+}
+
+static void _couchbase_async_flush(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	couchbase_async_flush(talloc_get_type_abort(uctx, couchbase_async_t));
+}
+
+/** Queue an op, to be sent with the next batch
+ *
+ * The request in op must yield, and is marked runnable when the op
+ * completes.  It's never marked runnable from inside this function.
+ *
+ * @param cba Instance to send the op on.
+ * @param op  To send.
+ */
+void couchbase_async_queue(couchbase_async_t *cba, couchbase_op_t *op)
+{
+	/*
+	 *	Send what we have first, so that the caller's own op
+	 *	can't complete before the caller yields.
+	 */
+	if (fr_dlist_num_elements(&cba->pending) >= cba->batch_size) couchbase_async_flush(cba);
+
+	op->cba = cba;
+	op->error = LCB_SUCCESS;
+	op->cookie.jobj = NULL;
+	op->cookie.jerr = json_tokener_success;
+	fr_dlist_insert_tail(&cba->pending, op);
+
+	if (!cba->ev_flush &&
+	    (fr_event_timer_in(cba, cba->el, &cba->ev_flush, 0, _couchbase_async_flush, cba) < 0)) {
+		/*
+		 *	Can't defer it, so send it with the next batch.
+		 */
+		PERROR("Failed scheduling batch");
+	}
+}
+
+/** Stop waiting for an op
+ *
+ * If the op hasn't been sent yet it's discarded.  Otherwise it's freed when
+ * the response arrives.
+ *
+ * @param op To cancel.  Must have been queued with couchbase_async_queue().
+ */
+void couchbase_async_cancel(couchbase_op_t *op)
+{
+	op->request = NULL;
+
+	if (!op->in_flight) {
+		fr_dlist_remove(&op->cba->pending, op);
+		return;
+	}
+
+	/*
+	 *	The request is going away, but libcouchbase still
+	 *	holds a pointer to the op.
+	 */
+	talloc_steal(op->cba, op);
+}
+
+static int _couchbase_async_free(couchbase_async_t *cba)
+{
+	fr_event_timer_delete(&cba->ev_flush);
+
+	/* events and timers are freed by the plugin as libcouchbase releases them */
+	lcb_destroy(cba->instance);
+
+	return 0;
+}
+
+/** Create an instance driven by a worker's event list
+ *
+ * The connection completes in the background.  Ops queued before then are
+ * held by libcouchbase until the cluster configuration has been retrieved.
+ *
+ * @param ctx        To allocate the instance in.
+ * @param el         The worker's event list.
+ * @param host       The Couchbase server or list of servers.
+ * @param bucket     The Couchbase bucket to associate with the instance.
+ * @param user       The Couchbase bucket user (NULL if none).
+ * @param pass       The Couchbase bucket password (NULL if none).
+ * @param timeout    Maximum time to wait for obtaining the initial configuration.
+ * @param opts       Extra options to configure the libcouchbase.
+ * @param batch_size Maximum number of ops to send in one batch.
+ * @return
+ *	- The new instance.
+ *	- NULL on error.
+ */
+couchbase_async_t *couchbase_async_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+					 const char *host, const char *bucket, const char *user, const char *pass,
+					 lcb_uint32_t timeout, const couchbase_opts_t *opts, uint32_t batch_size)
+{
+	couchbase_async_t	*cba;
+	lcb_error_t		error;
+
+	MEM(cba = talloc_zero(ctx, couchbase_async_t));
+	cba->el = el;
+	cba->batch_size = batch_size ? batch_size : 1;
+	fr_dlist_talloc_init(&cba->pending, couchbase_op_t, entry);
+
+	cba->io = couchbase_io_alloc(cba, el);
+	if (!cba->io) {
+	error:
+		talloc_free(cba);
+		return NULL;
+	}
+
+	error = couchbase_init_connection(&cba->instance, host, bucket, user, pass, timeout, opts,
+					  couchbase_io_iops(cba->io));
+	if (error != LCB_SUCCESS) {
+		ERROR("failed to initiate couchbase connection: %s (0x%x)", lcb_strerror(NULL, error), error);
+		if (cba->instance) lcb_destroy(cba->instance);
+		goto error;
+	}
+	talloc_set_destructor(cba, _couchbase_async_free);
+
+	lcb_install_callback3(cba->instance, LCB_CALLBACK_GET, couchbase_async_get_callback);
+	lcb_install_callback3(cba->instance, LCB_CALLBACK_STORE, couchbase_async_store_callback);
+
+	return cba;
+}
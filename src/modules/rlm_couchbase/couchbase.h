@@ -70,6 +70,39 @@ struct couchbase_opts_s {
     couchbase_opts_t *next; 		//!< Linked list.
 };
 
+/** libcouchbase I/O plugin which uses a worker's event list
+ *
+ */
+typedef struct couchbase_io_s couchbase_io_t;
+
+/** An asynchronous libcouchbase instance, owned by one worker thread
+ *
+ */
+typedef struct couchbase_async_s couchbase_async_t;
+
+/** A get or store on an asynchronous instance
+ *
+ * Ops are queued, and sent as a batch at the end of the current
+ * event loop iteration, or as soon as the batch is full.
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< Entry in the list of ops waiting to be sent.
+	couchbase_async_t	*cba;		//!< Instance the op was queued on.
+
+	bool			store;		//!< Store document under key, rather than fetch it.
+	char const		*key;		//!< Document key.
+	char const		*document;	//!< Document body to store.
+	int			expire;		//!< Expiration time for the stored document (0 = never).
+
+	bool			in_flight;	//!< Sent, and waiting for a response.
+	request_t		*request;	//!< Marked runnable when the op completes.
+							///< NULL if the request was cancelled.
+
+	lcb_error_t		error;		//!< Result of the op.  A missing document
+							///< is LCB_SUCCESS, with no cookie.jobj.
+	cookie_t		cookie;		//!< Parsed get response.
+} couchbase_op_t;
+
 extern fr_dict_attr_t const *attr_acct_status_type;
 extern fr_dict_attr_t const *attr_acct_session_time;
 extern fr_dict_attr_t const *attr_event_timestamp;
@@ -92,7 +125,8 @@ void couchbase_http_data_callback(lcb_http_request_t request, lcb_t instance,
 
 /* create a couchbase instance and connect to the cluster */
 lcb_error_t couchbase_init_connection(lcb_t *instance, const char *host, const char *bucket, const char *user,
-					const char *pass, lcb_uint32_t timeout, const couchbase_opts_t *opts);
+					const char *pass, lcb_uint32_t timeout, const couchbase_opts_t *opts,
+					lcb_io_opt_t io);
 
 /* get server statistics */
 lcb_error_t couchbase_server_stats(lcb_t instance, const void *cookie);
@@ -105,3 +139,19 @@ lcb_error_t couchbase_get_key(lcb_t instance, const void *cookie, const char *ke
 
 /* query a couchbase view via http */
 lcb_error_t couchbase_query_view(lcb_t instance, const void *cookie, const char *path, const char *post);
+
+/* create an i/o plugin which uses a worker's event list */
+couchbase_io_t *couchbase_io_alloc(TALLOC_CTX *ctx, fr_event_list_t *el);
+
+lcb_io_opt_t couchbase_io_iops(couchbase_io_t *io);
+
+/* create an instance driven by a worker's event list */
+couchbase_async_t *couchbase_async_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+					 const char *host, const char *bucket, const char *user, const char *pass,
+					 lcb_uint32_t timeout, const couchbase_opts_t *opts, uint32_t batch_size);
+
+/* queue a get or store, and mark the request runnable when it completes */
+void couchbase_async_queue(couchbase_async_t *cba, couchbase_op_t *op);
+
+/* stop waiting for an op which was queued */
+void couchbase_async_cancel(couchbase_op_t *op);
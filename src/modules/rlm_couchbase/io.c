@@ -0,0 +1,277 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief libcouchbase I/O plugin which uses a FreeRADIUS event list.
+ * @file io.c
+ *
+ * libcouchbase asks the plugin to watch sockets and run timers, and
+ * we map those onto the worker's #fr_event_list_t.  Socket I/O itself
+ * is done with libcouchbase's own BSD socket routines.
+ *
+ * Instances using this plugin must never call lcb_wait(), as the
+ * event loop belongs to the worker, not to libcouchbase.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_couchbase - "
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/event.h>
+
+#include "couchbase.h"
+
+/** The plugin
+ *
+ */
+struct couchbase_io_s {
+	struct lcb_io_opt_st	iops;		//!< Handed to lcb_create().
+	fr_event_list_t		*el;		//!< Events and timers are inserted here.
+};
+
+/** A socket libcouchbase wants to be told about
+ *
+ */
+typedef struct {
+	couchbase_io_t		*io;		//!< The plugin this event belongs to.
+	int			fd;		//!< Being watched, or -1.
+	short			flags;		//!< LCB_READ_EVENT and / or LCB_WRITE_EVENT.
+	lcb_ioE_callback	handler;	//!< To call when the socket is ready.
+	void			*uarg;		//!< Passed to handler.
+} couchbase_io_event_t;
+
+/** A timer libcouchbase wants to run
+ *
+ */
+typedef struct {
+	couchbase_io_t		*io;		//!< The plugin this timer belongs to.
+	fr_event_timer_t const	*ev;		//!< Scheduled timer, or NULL.
+	lcb_ioE_callback	handler;	//!< To call when the timer fires.
+	void			*uarg;		//!< Passed to handler.
+} couchbase_io_timer_t;
+
+static inline couchbase_io_t *couchbase_io(lcb_io_opt_t iops)
+{
+	return talloc_get_type_abort(iops->v.v3.cookie, couchbase_io_t);
+}
+
+static void _couchbase_io_readable(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	couchbase_io_event_t	*event = talloc_get_type_abort(uctx, couchbase_io_event_t);
+
+	event->handler(fd, LCB_READ_EVENT, event->uarg);
+}
+
+static void _couchbase_io_writable(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	couchbase_io_event_t	*event = talloc_get_type_abort(uctx, couchbase_io_event_t);
+
+	event->handler(fd, LCB_WRITE_EVENT, event->uarg);
+}
+
+static void _couchbase_io_errored(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	couchbase_io_event_t	*event = talloc_get_type_abort(uctx, couchbase_io_event_t);
+
+	DEBUG4("fd %i errored: %s", fd, fr_syserror(fd_errno));
+
+	event->handler(fd, LCB_ERROR_EVENT, event->uarg);
+}
+
+static void *_couchbase_io_event_create(lcb_io_opt_t iops)
+{
+	couchbase_io_t		*io = couchbase_io(iops);
+	couchbase_io_event_t	*event;
+
+	MEM(event = talloc_zero(io, couchbase_io_event_t));
+	event->io = io;
+	event->fd = -1;
+
+	return event;
+}
+
+static void _couchbase_io_event_cancel(UNUSED lcb_io_opt_t iops, UNUSED lcb_socket_t sock, void *ctx)
+{
+	couchbase_io_event_t	*event = talloc_get_type_abort(ctx, couchbase_io_event_t);
+
+	if (event->fd < 0) return;
+
+	(void) fr_event_fd_delete(event->io->el, event->fd, FR_EVENT_FILTER_IO);
+	event->fd = -1;
+	event->flags = 0;
+}
+
+static int _couchbase_io_event_watch(UNUSED lcb_io_opt_t iops, lcb_socket_t sock, void *ctx,
+				     short flags, void *uarg, lcb_ioE_callback handler)
+{
+	couchbase_io_event_t	*event = talloc_get_type_abort(ctx, couchbase_io_event_t);
+
+	flags &= LCB_RW_EVENT;
+
+	/*
+	 *	A different socket, or nothing to watch.
+	 */
+	if ((event->fd >= 0) && ((event->fd != sock) || !flags)) _couchbase_io_event_cancel(iops, sock, event);
+	if (!flags) return 0;
+
+	event->handler = handler;
+	event->uarg = uarg;
+
+	if ((event->fd == sock) && (event->flags == flags)) return 0;
+
+	/*
+	 *	Inserting an fd which is already in the list
+	 *	replaces the callbacks.
+	 */
+	if (fr_event_fd_insert(event, event->io->el, sock,
+			       (flags & LCB_READ_EVENT) ? _couchbase_io_readable : NULL,
+			       (flags & LCB_WRITE_EVENT) ? _couchbase_io_writable : NULL,
+			       _couchbase_io_errored,
+			       event) < 0) {
+		PERROR("Failed watching fd %i", sock);
+		event->fd = -1;
+		event->flags = 0;
+		return -1;
+	}
+	event->fd = sock;
+	event->flags = flags;
+
+	return 0;
+}
+
+static void _couchbase_io_event_destroy(lcb_io_opt_t iops, void *ctx)
+{
+	couchbase_io_event_t	*event = talloc_get_type_abort(ctx, couchbase_io_event_t);
+
+	_couchbase_io_event_cancel(iops, event->fd, event);
+	talloc_free(event);
+}
+
+static void _couchbase_io_timer_fired(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	couchbase_io_timer_t	*timer = talloc_get_type_abort(uctx, couchbase_io_timer_t);
+
+	timer->handler(-1, 0, timer->uarg);
+}
+
+static void *_couchbase_io_timer_create(lcb_io_opt_t iops)
+{
+	couchbase_io_t		*io = couchbase_io(iops);
+	couchbase_io_timer_t	*timer;
+
+	MEM(timer = talloc_zero(io, couchbase_io_timer_t));
+	timer->io = io;
+
+	return timer;
+}
+
+static int _couchbase_io_timer_schedule(UNUSED lcb_io_opt_t iops, void *ctx, lcb_U32 usec,
+					void *uarg, lcb_ioE_callback handler)
+{
+	couchbase_io_timer_t	*timer = talloc_get_type_abort(ctx, couchbase_io_timer_t);
+
+	timer->handler = handler;
+	timer->uarg = uarg;
+
+	if (fr_event_timer_in(timer, timer->io->el, &timer->ev, fr_time_delta_from_usec(usec),
+			      _couchbase_io_timer_fired, timer) < 0) {
+		PERROR("Failed scheduling timer");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void _couchbase_io_timer_cancel(UNUSED lcb_io_opt_t iops, void *ctx)
+{
+	couchbase_io_timer_t	*timer = talloc_get_type_abort(ctx, couchbase_io_timer_t);
+
+	fr_event_timer_delete(&timer->ev);
+}
+
+static void _couchbase_io_timer_destroy(UNUSED lcb_io_opt_t iops, void *ctx)
+{
+	talloc_free(talloc_get_type_abort(ctx, couchbase_io_timer_t));
+}
+
+/** The worker runs the loop, so there's nothing to start or stop
+ *
+ */
+static void _couchbase_io_loop_noop(UNUSED lcb_io_opt_t iops)
+{
+}
+
+/** Tell libcouchbase which functions to use
+ *
+ */
+static void _couchbase_io_procs(int version, lcb_loopprocs *loop_procs, lcb_timerprocs *timer_procs,
+				lcb_bsdprocs *bsd_procs, lcb_evprocs *ev_procs,
+				UNUSED lcb_completion_procs *completion_procs, lcb_iomodel_t *iomodel)
+{
+	ev_procs->create = _couchbase_io_event_create;
+	ev_procs->destroy = _couchbase_io_event_destroy;
+	ev_procs->cancel = _couchbase_io_event_cancel;
+	ev_procs->watch = _couchbase_io_event_watch;
+
+	timer_procs->create = _couchbase_io_timer_create;
+	timer_procs->destroy = _couchbase_io_timer_destroy;
+	timer_procs->cancel = _couchbase_io_timer_cancel;
+	timer_procs->schedule = _couchbase_io_timer_schedule;
+
+	loop_procs->start = _couchbase_io_loop_noop;
+	loop_procs->stop = _couchbase_io_loop_noop;
+
+	lcb_iops_wire_bsd_impl2(bsd_procs, version);
+
+	*iomodel = LCB_IOMODEL_EVENT;
+}
+
+/** Allocate an I/O plugin which inserts events into the given event list
+ *
+ * @param[in] ctx	to allocate the plugin in.  Must outlive the
+ *			libcouchbase instance which uses it.
+ * @param[in] el	to insert events into.
+ * @return
+ *	- The plugin, pass couchbase_io_iops() to lcb_create().
+ *	- NULL on error.
+ */
+couchbase_io_t *couchbase_io_alloc(TALLOC_CTX *ctx, fr_event_list_t *el)
+{
+	couchbase_io_t	*io;
+
+	io = talloc_zero(ctx, couchbase_io_t);
+	if (!io) return NULL;
+
+	io->el = el;
+	io->iops.version = 3;
+	io->iops.v.v3.cookie = io;
+	io->iops.v.v3.need_cleanup = 0;		/* We free it, not libcouchbase */
+	io->iops.v.v3.get_procs = _couchbase_io_procs;
+
+	return io;
+}
+
+/** Return the libcouchbase view of the plugin
+ *
+ */
+lcb_io_opt_t couchbase_io_iops(couchbase_io_t *io)
+{
+	return &io->iops;
+}
@@ -164,7 +164,7 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout)
 
 	/* create instance */
 	cb_error = couchbase_init_connection(&cb_inst, inst->server, inst->bucket, inst->username,
-					     inst->password, fr_time_delta_to_sec(timeout), opts);
+					     inst->password, fr_time_delta_to_sec(timeout), opts, NULL);
 
 	/* check couchbase instance */
 	if (cb_error != LCB_SUCCESS) {
@@ -691,22 +691,26 @@ static int _get_client_value(char **out, CONF_PAIR const *cp, void *data)
 	return 0;
 }
 
-/** Load client entries from Couchbase client documents on startup
+/** Load client entries from Couchbase client documents
  *
  * This function executes the view defined in the module configuration and loops
  * through all returned rows.  The view is called with "stale=false" to ensure the
  * most accurate data available when the view is called.  This will force an index
- * rebuild on this design document in Couchbase.  However, since this function is only
- * run once at server startup this should not be a concern.
+ * rebuild on this design document in Couchbase.  This is run at server startup, and
+ * then only when the clients are reloaded, so this should not be a concern.
  *
- * @param  inst The module instance.
- * @param  tmpl Default values for new clients.
- * @param  map  The client attribute configuration list.
+ * All the clients are built before any are added, and then the client list is
+ * synced with them, so a reload adds, changes and removes only the clients which
+ * differ from the previous load.
+ *
+ * @param  out     The clients which were loaded.
+ * @param  inst    The module instance.
+ * @param  current The clients which were loaded previously, or NULL.
  * @return
  *	- 0 on success.
- *	- -1 on failure.
+ *	- -1 on failure.  If no clients could be built, the current clients are kept.
  */
-int mod_load_client_documents(rlm_couchbase_t *inst, CONF_SECTION *tmpl, CONF_SECTION *map)
+int mod_load_client_documents(RADCLIENT ***out, rlm_couchbase_t *inst, RADCLIENT * const *current)
 {
 	rlm_couchbase_handle_t *handle = NULL; /* connection pool handle */
 	char vpath[256], vid[MAX_KEY_SIZE], vkey[MAX_KEY_SIZE];  /* view path and fields */
@@ -718,6 +722,10 @@ int mod_load_client_documents(rlm_couchbase_t *inst, CONF_SECTION *tmpl, CONF_SE
 	json_object *jrows = NULL;                               /* json object to hold view rows */
 	CONF_SECTION *client;                                    /* freeradius config list */
 	RADCLIENT *c;                                            /* freeradius client */
+	RADCLIENT **update = NULL;                               /* clients built from the rows */
+	size_t num_update = 0;                                   /* how many clients were built */
+	CONF_SECTION *tmpl = inst->client_tmpl;                  /* default values for new clients */
+	CONF_SECTION *map = inst->client_map;                    /* client attribute configuration */
 
 	/* get handle */
 	handle = fr_pool_connection_get(inst->pool, NULL);
@@ -852,51 +860,55 @@ int mod_load_client_documents(rlm_couchbase_t *inst, CONF_SECTION *tmpl, CONF_SE
 		/* debugging */
 		DEBUG3("cookie->jobj == %s", json_object_to_json_string(cookie->jobj));
 
-		/* allocate conf list */
-		client = tmpl ? cf_section_dup(NULL, NULL, tmpl, "client", vkey, true) :
-				cf_section_alloc(NULL, NULL, "client", vkey);
+		if (inst->client_direct) {
+			/* build the client directly from the document */
+			c = client_afrom_map(NULL, vkey, map, _get_client_value, cookie->jobj);
+			if (!c) {
+				PERROR("failed to allocate client '%s' from '%s'", vkey, vid);
+				/* set return */
+				retval = -1;
+				/* return */
+				goto free_and_return;
+			}
+		} else {
+			/* allocate conf list */
+			client = tmpl ? cf_section_dup(NULL, NULL, tmpl, "client", vkey, true) :
+					cf_section_alloc(NULL, NULL, "client", vkey);
+
+			if (client_map_section(client, map, _get_client_value, cookie->jobj) < 0) {
+				/* free config setion */
+				talloc_free(client);
+				/* set return */
+				retval = -1;
+				/* return */
+				goto free_and_return;
+			}
 
-		if (client_map_section(client, map, _get_client_value, cookie->jobj) < 0) {
-			/* free config setion */
-			talloc_free(client);
-			/* set return */
-			retval = -1;
-			/* return */
-			goto free_and_return;
-		}
+			/*
+			 * @todo These should be parented from something.
+			 */
+			c = client_afrom_cs(NULL, client, false);
+			if (!c) {
+				ERROR("failed to allocate client");
+				/* free config setion */
+				talloc_free(client);
+				/* set return */
+				retval = -1;
+				/* return */
+				goto free_and_return;
+			}
 
-		/*
-		 * @todo These should be parented from something.
-		 */
-		c = client_afrom_cs(NULL, client, false);
-		if (!c) {
-			ERROR("failed to allocate client");
-			/* free config setion */
-			talloc_free(client);
-			/* set return */
-			retval = -1;
-			/* return */
-			goto free_and_return;
+			/*
+			 * Client parents the CONF_SECTION which defined it.
+			 */
+			talloc_steal(c, client);
 		}
 
-		/*
-		 * Client parents the CONF_SECTION which defined it.
-		 */
-		talloc_steal(c, client);
-
-		/* attempt to add client */
-		if (!client_add(NULL, c)) {
-			ERROR("failed to add client '%s' from '%s', possible duplicate?", vkey, vid);
-			/* free client */
-			client_free(c);
-			/* set return */
-			retval = -1;
-			/* return */
-			goto free_and_return;
+		/* grow the array of clients, if needed */
+		if ((num_update % 256) == 0) {
+			MEM(update = talloc_realloc(NULL, update, RADCLIENT *, num_update + 256));
 		}
-
-		/* debugging */
-		DEBUG("client '%s' added", c->longname);
+		update[num_update++] = c;
 
 		/* free json object */
 		if (cookie->jobj) {
@@ -905,8 +917,26 @@ int mod_load_client_documents(rlm_couchbase_t *inst, CONF_SECTION *tmpl, CONF_SE
 		}
 	}
 
+	/* add, change and remove clients in one pass */
+	if (retval == 0) {
+		int changes;
+
+		changes = client_list_sync(NULL, out, current, inst, update, num_update);
+		if (changes < 0) {
+			ERROR("failed to add some clients, possible duplicates?");
+			retval = -1;
+		} else {
+			DEBUG("loaded %zu clients, %i changed", num_update, changes);
+		}
+		num_update = 0;
+	}
+
 	free_and_return:
 
+	/* free clients which weren't synced */
+	while (num_update > 0) client_free(update[--num_update]);
+	talloc_free(update);
+
 	/* free rows */
 	if (jrows) {
 		json_object_put(jrows);
@@ -27,7 +27,9 @@
 RCSIDH(mod_h, "$Id$")
 
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/client.h>
 #include <freeradius-devel/server/pool.h>
+#include <freeradius-devel/server/reload.h>
 
 #include <freeradius-devel/json/base.h>
 
@@ -56,9 +58,19 @@ typedef struct {
 
 	bool			read_clients;		//!< Toggle for loading client records.
 	const char		*client_view;    	//!< Couchbase view that returns client documents.
+	fr_time_delta_t		client_reload_interval;	//!< How often to reload client records.
+
+	CONF_SECTION		*client_tmpl;		//!< Default values for new clients.
+	CONF_SECTION		*client_map;		//!< Client attribute configuration.
+	bool			client_direct;		//!< Build clients without a CONF_SECTION.
+	RADCLIENT		**clients;		//!< Clients which were loaded.  Only modified
+							///< by the thread which (re)loads them.
+	fr_reload_t		*client_reload;		//!< Reloads client records in the background.
 
 	json_object		*map;           	//!< Json object to hold user defined attribute map.
-	fr_pool_t		*pool;			//!< Connection pool.
+	fr_pool_t		*pool;			//!< Connection pool, used when loading clients.
+	fr_time_delta_t		connect_timeout;	//!< How long workers wait for the cluster configuration.
+	uint32_t		batch_size;		//!< Maximum number of operations a worker sends at once.
 	char const		*name;			//!< Module instance name.
 	void			*api_opts;		//!< Couchbase API internal options.
 } rlm_couchbase_t;
@@ -73,6 +85,17 @@ typedef struct {
 	void *cookie;    //!< Couchbase cookie (@p cookie_u @p cookie_t).
 } rlm_couchbase_handle_t;
 
+/** Thread specific instance data
+ *
+ * Each worker has its own Couchbase instance, driven by the worker's
+ * event list, so requests yield rather than blocking the worker.
+ */
+typedef struct {
+	rlm_couchbase_t const	*inst;			//!< Module instance.
+	void			*cba;			//!< Asynchronous Couchbase instance
+							///< (@p couchbase_async_t).
+} rlm_couchbase_thread_t;
+
 /* define functions */
 void *mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout);
 
@@ -90,7 +113,7 @@ int mod_ensure_start_timestamp(json_object *json, fr_pair_list_t *vps);
 
 int mod_client_map_section(CONF_SECTION *client, CONF_SECTION const *map, json_object *json, char const *docid);
 
-int mod_load_client_documents(rlm_couchbase_t *inst, CONF_SECTION *tmpl, CONF_SECTION *map);
+int mod_load_client_documents(RADCLIENT ***out, rlm_couchbase_t *inst, RADCLIENT * const *current);
 
 int mod_build_api_opts(CONF_SECTION *conf, void *instance);
 
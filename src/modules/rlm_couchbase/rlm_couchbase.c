@@ -34,6 +34,7 @@ RCSID("$Id$")
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/base.h>
 #include <freeradius-devel/radius/defs.h>
+#include <freeradius-devel/unlang/module.h>
 
 #include <freeradius-devel/json/base.h>
 
@@ -45,6 +46,7 @@ RCSID("$Id$")
  */
 static const CONF_PARSER client_config[] = {
 	{ FR_CONF_OFFSET("view", FR_TYPE_STRING, rlm_couchbase_t, client_view), .dflt = "_design/client/_view/by_name" },
+	{ FR_CONF_OFFSET("reload_interval", FR_TYPE_TIME_DELTA, rlm_couchbase_t, client_reload_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -56,6 +58,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("bucket", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_couchbase_t, bucket) },
 	{ FR_CONF_OFFSET("username", FR_TYPE_STRING, rlm_couchbase_t, username) },
 	{ FR_CONF_OFFSET("password", FR_TYPE_STRING, rlm_couchbase_t, password) },
+	{ FR_CONF_OFFSET("connect_timeout", FR_TYPE_TIME_DELTA, rlm_couchbase_t, connect_timeout), .dflt = "3.0" },
+	{ FR_CONF_OFFSET("batch_size", FR_TYPE_UINT32, rlm_couchbase_t, batch_size), .dflt = "32" },
 
 	{ FR_CONF_OFFSET("acct_key", FR_TYPE_TMPL, rlm_couchbase_t, acct_key), .dflt = "radacct_%{%{Acct-Unique-Session-Id}:-%{Acct-Session-Id}}", .quote = T_DOUBLE_QUOTED_STRING },
 	{ FR_CONF_OFFSET("doctype", FR_TYPE_STRING, rlm_couchbase_t, doctype), .dflt = "radacct" },
@@ -87,55 +91,35 @@ fr_dict_attr_autoload_t rlm_couchbase_dict_attr[] = {
 	{ NULL }
 };
 
-/** Handle authorization requests using Couchbase document data
+/** Stop waiting for Couchbase if the request is cancelled
  *
- * Attempt to fetch the document assocaited with the requested user by
- * using the deterministic key defined in the configuration.  When a valid
- * document is found it will be parsed and the containing value pairs will be
- * injected into the request.
+ */
+static void mod_signal(UNUSED module_ctx_t const *mctx, UNUSED request_t *request, void *rctx,
+		       fr_state_signal_t action)
+{
+	couchbase_op_t *op = talloc_get_type_abort(rctx, couchbase_op_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	couchbase_async_cancel(op);
+}
+
+/** Apply the user document fetched by mod_authorize
  *
  * @param[out] p_result		Operation status (#rlm_rcode_t).
  * @param[in] mctx		module calling context.
  * @param[in] request		The authorization request.
+ * @param[in] rctx		The get operation.
  */
-static unlang_action_t mod_authorize(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+static unlang_action_t mod_authorize_resume(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx,
+					    request_t *request, void *rctx)
 {
-	rlm_couchbase_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_couchbase_t);		/* our module instance */
-	rlm_couchbase_handle_t	*handle = NULL;			/* connection pool handle */
-	char			buffer[MAX_KEY_SIZE];
-	char const		*dockey;			/* our document key */
-	lcb_error_t		cb_error = LCB_SUCCESS;		/* couchbase error holder */
+	couchbase_op_t		*op = talloc_get_type_abort(rctx, couchbase_op_t);
+	cookie_t		*cookie = &op->cookie;
 	rlm_rcode_t		rcode = RLM_MODULE_OK;		/* return code */
-	ssize_t			slen;
-
-	/* assert packet as not null */
-	fr_assert(request->packet != NULL);
-
-	/* attempt to build document key */
-	slen = tmpl_expand(&dockey, buffer, sizeof(buffer), request, inst->user_key, NULL, NULL);
-	if (slen < 0) RETURN_MODULE_FAIL;
-	if ((dockey == buffer) && is_truncated((size_t)slen, sizeof(buffer))) {
-		REDEBUG("Key too long, expected < " STRINGIFY(sizeof(buffer)) " bytes, got %zi bytes", slen);
-		RETURN_MODULE_FAIL;
-	}
-
-	/* get handle */
-	handle = fr_pool_connection_get(inst->pool, request);
-
-	/* check handle */
-	if (!handle) RETURN_MODULE_FAIL;
-
-	/* set couchbase instance */
-	lcb_t cb_inst = handle->handle;
-
-	/* set cookie */
-	cookie_t *cookie = handle->cookie;
-
-	/* fetch document */
-	cb_error = couchbase_get_key(cb_inst, cookie, dockey);
 
 	/* check error */
-	if (cb_error != LCB_SUCCESS || !cookie->jobj) {
+	if (op->error != LCB_SUCCESS || !cookie->jobj) {
 		/* log error */
 		RERROR("failed to fetch document or parse return");
 		/* set return */
@@ -208,99 +192,107 @@ static unlang_action_t mod_authorize(rlm_rcode_t *p_result, module_ctx_t const *
 
 finish:
 	/* free json object */
-	if (cookie->jobj) {
-		json_object_put(cookie->jobj);
-		cookie->jobj = NULL;
-	}
-
-	/* release handle */
-	if (handle) fr_pool_connection_release(inst->pool, request, handle);
+	if (cookie->jobj) json_object_put(cookie->jobj);
+	talloc_free(op);
 
 	/* return */
 	RETURN_MODULE_RCODE(rcode);
 }
 
-/** Write accounting data to Couchbase documents
+/** Handle authorization requests using Couchbase document data
  *
- * Handle accounting requests and store the associated data into JSON documents
- * in couchbase mapping attribute names to JSON element names per the module configuration.
+ * Attempt to fetch the document assocaited with the requested user by
+ * using the deterministic key defined in the configuration.  When a valid
+ * document is found it will be parsed and the containing value pairs will be
+ * injected into the request.
  *
- * When an existing document already exists for the same accounting section the new attributes
- * will be merged with the currently existing data.  When conflicts arrise the new attribute
- * value will replace or be added to the existing value.
+ * The request yields until the document has been fetched, and
+ * mod_authorize_resume is then called.
  *
- * @param[out] p_result		Result of calling the module.
- * @param mctx			module calling context.
- * @param request		The accounting request object.
+ * @param[out] p_result		Operation status (#rlm_rcode_t).
+ * @param[in] mctx		module calling context.
+ * @param[in] request		The authorization request.
  */
-static unlang_action_t mod_accounting(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+static unlang_action_t mod_authorize(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_couchbase_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_couchbase_t);       /* our module instance */
-	rlm_couchbase_handle_t *handle = NULL;  /* connection pool handle */
-	rlm_rcode_t rcode = RLM_MODULE_OK;      /* return code */
-	fr_pair_t *vp;                         /* radius value pair linked list */
-	char buffer[MAX_KEY_SIZE];
-	char const *dockey;			/* our document key */
-	char document[MAX_VALUE_SIZE];          /* our document body */
-	char element[MAX_KEY_SIZE];             /* mapped radius attribute to element name */
-	int status = 0;                         /* account status type */
-	int docfound = 0;                       /* document found toggle */
-	lcb_error_t cb_error = LCB_SUCCESS;     /* couchbase error holder */
-	ssize_t slen;
-
+	rlm_couchbase_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_couchbase_t);		/* our module instance */
+	rlm_couchbase_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_couchbase_thread_t);
+	couchbase_op_t		*op;
+	char			buffer[MAX_KEY_SIZE];
+	char const		*dockey;			/* our document key */
+	ssize_t			slen;
 
 	/* assert packet as not null */
 	fr_assert(request->packet != NULL);
 
-	/* sanity check */
-	if ((vp = fr_pair_find_by_da(&request->request_pairs, attr_acct_status_type, 0)) == NULL) {
-		/* log debug */
-		RDEBUG2("could not find status type in packet");
-		/* return */
-		RETURN_MODULE_NOOP;
+	/* attempt to build document key */
+	slen = tmpl_expand(&dockey, buffer, sizeof(buffer), request, inst->user_key, NULL, NULL);
+	if (slen < 0) RETURN_MODULE_FAIL;
+	if ((dockey == buffer) && is_truncated((size_t)slen, sizeof(buffer))) {
+		REDEBUG("Key too long, expected < " STRINGIFY(sizeof(buffer)) " bytes, got %zi bytes", slen);
+		RETURN_MODULE_FAIL;
 	}
 
-	/* set status */
-	status = vp->vp_uint32;
-
-	/* acknowledge the request but take no action */
-	if (status == FR_STATUS_ACCOUNTING_ON || status == FR_STATUS_ACCOUNTING_OFF) {
-		/* log debug */
-		RDEBUG2("handling accounting on/off request without action");
-		/* return */
-		RETURN_MODULE_OK;
-	}
+	/* fetch document */
+	MEM(op = talloc_zero(request, couchbase_op_t));
+	op->request = request;
+	op->key = talloc_strdup(op, dockey);
+	couchbase_async_queue(t->cba, op);
 
-	/* get handle */
-	handle = fr_pool_connection_get(inst->pool, request);
+	return unlang_module_yield(request, mod_authorize_resume, mod_signal, op);
+}
 
-	/* check handle */
-	if (!handle) RETURN_MODULE_FAIL;
+/** Store the accounting document built by mod_accounting_resume
+ *
+ * @param[out] p_result		Result of calling the module.
+ * @param mctx			module calling context.
+ * @param request		The accounting request object.
+ * @param rctx			The store operation.
+ */
+static unlang_action_t mod_accounting_stored(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx,
+					     request_t *request, void *rctx)
+{
+	couchbase_op_t	*op = talloc_get_type_abort(rctx, couchbase_op_t);
+	lcb_error_t	cb_error = op->error;
 
-	/* set couchbase instance */
-	lcb_t cb_inst = handle->handle;
+	/* check return */
+	if (cb_error != LCB_SUCCESS) {
+		RERROR("failed to store document (%s): %s (0x%x)", op->key, lcb_strerror(NULL, cb_error), cb_error);
+	}
+	talloc_free(op);
 
-	/* set cookie */
-	cookie_t *cookie = handle->cookie;
+	/* return */
+	RETURN_MODULE_OK;
+}
 
-	/* attempt to build document key */
-	slen = tmpl_expand(&dockey, buffer, sizeof(buffer), request, inst->acct_key, NULL, NULL);
-	if (slen < 0) {
-		rcode = RLM_MODULE_FAIL;
-		goto finish;
-	}
-	if ((dockey == buffer) && is_truncated((size_t)slen, sizeof(buffer))) {
-		REDEBUG("Key too long, expected < " STRINGIFY(sizeof(buffer)) " bytes, got %zi bytes", slen);
-		rcode = RLM_MODULE_FAIL;
-		/* return */
-		goto finish;
-	}
+/** Merge the accounting data into the document fetched by mod_accounting
+ *
+ * @param[out] p_result		Result of calling the module.
+ * @param mctx			module calling context.
+ * @param request		The accounting request object.
+ * @param rctx			The get operation.
+ */
+static unlang_action_t mod_accounting_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					     request_t *request, void *rctx)
+{
+	rlm_couchbase_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_couchbase_t);       /* our module instance */
+	rlm_couchbase_thread_t *t = talloc_get_type_abort(mctx->thread, rlm_couchbase_thread_t);
+	couchbase_op_t *op = talloc_get_type_abort(rctx, couchbase_op_t);
+	cookie_t *cookie = &op->cookie;
+	rlm_rcode_t rcode = RLM_MODULE_OK;      /* return code */
+	fr_pair_t *vp;                         /* radius value pair linked list */
+	char const *document;			/* our document body */
+	char element[MAX_KEY_SIZE];             /* mapped radius attribute to element name */
+	int status = 0;                         /* account status type */
+	int docfound = 0;                       /* document found toggle */
 
-	/* attempt to fetch document */
-	cb_error = couchbase_get_key(cb_inst, cookie, dockey);
+	/* checked by mod_accounting */
+	vp = fr_pair_find_by_da(&request->request_pairs, attr_acct_status_type, 0);
+	fr_assert(vp != NULL);
+	status = vp->vp_uint32;
 
 	/* check error and object */
-	if (cb_error != LCB_SUCCESS || cookie->jerr != json_tokener_success || !cookie->jobj) {
+	if (op->error != LCB_SUCCESS || cookie->jerr != json_tokener_success) {
 		/* log error */
 		RERROR("failed to execute get request or parse returned json object");
 		/* free and reset json object */
@@ -379,8 +371,9 @@ static unlang_action_t mod_accounting(rlm_rcode_t *p_result, module_ctx_t const
 		}
 	}
 
-	/* copy json string to document and check size */
-	if (strlcpy(document, json_object_to_json_string(cookie->jobj), sizeof(document)) >= sizeof(document)) {
+	/* check document size */
+	document = json_object_to_json_string(cookie->jobj);
+	if (strlen(document) >= MAX_VALUE_SIZE) {
 		/* this isn't good */
 		RERROR("could not write json document - insufficient buffer space");
 		/* set return */
@@ -390,32 +383,135 @@ static unlang_action_t mod_accounting(rlm_rcode_t *p_result, module_ctx_t const
 	}
 
 	/* debugging */
-	RDEBUG3("setting '%s' => '%s'", dockey, document);
+	RDEBUG3("setting '%s' => '%s'", op->key, document);
 
-	/* store document/key in couchbase */
-	cb_error = couchbase_set_key(cb_inst, dockey, document, inst->expire);
+	/* store document/key in couchbase, reusing the op */
+	op->store = true;
+	op->document = talloc_strdup(op, document);
+	op->expire = inst->expire;
 
-	/* check return */
-	if (cb_error != LCB_SUCCESS) {
-		RERROR("failed to store document (%s): %s (0x%x)", dockey, lcb_strerror(NULL, cb_error), cb_error);
-	}
+	json_object_put(cookie->jobj);
+	cookie->jobj = NULL;
+
+	couchbase_async_queue(t->cba, op);
+
+	return unlang_module_yield(request, mod_accounting_stored, mod_signal, op);
 
 finish:
 	/* free and reset json object */
-	if (cookie->jobj) {
-		json_object_put(cookie->jobj);
-		cookie->jobj = NULL;
+	if (cookie->jobj) json_object_put(cookie->jobj);
+	talloc_free(op);
+
+	/* return */
+	RETURN_MODULE_RCODE(rcode);
+}
+
+/** Write accounting data to Couchbase documents
+ *
+ * Handle accounting requests and store the associated data into JSON documents
+ * in couchbase mapping attribute names to JSON element names per the module configuration.
+ *
+ * When an existing document already exists for the same accounting section the new attributes
+ * will be merged with the currently existing data.  When conflicts arrise the new attribute
+ * value will replace or be added to the existing value.
+ *
+ * The request yields while the existing document is fetched, and again while the
+ * merged document is stored.  Fetches and stores from concurrent requests are sent
+ * to Couchbase in batches.
+ *
+ * @param[out] p_result		Result of calling the module.
+ * @param mctx			module calling context.
+ * @param request		The accounting request object.
+ */
+static unlang_action_t mod_accounting(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_couchbase_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_couchbase_t);       /* our module instance */
+	rlm_couchbase_thread_t *t = talloc_get_type_abort(mctx->thread, rlm_couchbase_thread_t);
+	couchbase_op_t *op;
+	fr_pair_t *vp;                         /* radius value pair linked list */
+	char buffer[MAX_KEY_SIZE];
+	char const *dockey;			/* our document key */
+	int status = 0;                         /* account status type */
+	ssize_t slen;
+
+
+	/* assert packet as not null */
+	fr_assert(request->packet != NULL);
+
+	/* sanity check */
+	if ((vp = fr_pair_find_by_da(&request->request_pairs, attr_acct_status_type, 0)) == NULL) {
+		/* log debug */
+		RDEBUG2("could not find status type in packet");
+		/* return */
+		RETURN_MODULE_NOOP;
 	}
 
-	/* release our connection handle */
-	if (handle) {
-		fr_pool_connection_release(inst->pool, request, handle);
+	/* set status */
+	status = vp->vp_uint32;
+
+	/* acknowledge the request but take no action */
+	if (status == FR_STATUS_ACCOUNTING_ON || status == FR_STATUS_ACCOUNTING_OFF) {
+		/* log debug */
+		RDEBUG2("handling accounting on/off request without action");
+		/* return */
+		RETURN_MODULE_OK;
 	}
 
-	/* return */
-	RETURN_MODULE_RCODE(rcode);
+	/* attempt to build document key */
+	slen = tmpl_expand(&dockey, buffer, sizeof(buffer), request, inst->acct_key, NULL, NULL);
+	if (slen < 0) RETURN_MODULE_FAIL;
+	if ((dockey == buffer) && is_truncated((size_t)slen, sizeof(buffer))) {
+		REDEBUG("Key too long, expected < " STRINGIFY(sizeof(buffer)) " bytes, got %zi bytes", slen);
+		RETURN_MODULE_FAIL;
+	}
+
+	/* attempt to fetch document */
+	MEM(op = talloc_zero(request, couchbase_op_t));
+	op->request = request;
+	op->key = talloc_strdup(op, dockey);
+	couchbase_async_queue(t->cba, op);
+
+	return unlang_module_yield(request, mod_accounting_resume, mod_signal, op);
+}
+
+/** Create the worker's Couchbase instance
+ *
+ * @param conf     The module configuration.
+ * @param instance The module instance.
+ * @param el       The worker's event list.
+ * @param thread   Thread specific instance data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_couchbase_t		*inst = talloc_get_type_abort(instance, rlm_couchbase_t);
+	rlm_couchbase_thread_t	*t = thread;
+
+	t->inst = inst;
+	t->cba = couchbase_async_alloc(t, el, inst->server, inst->bucket, inst->username, inst->password,
+				       fr_time_delta_to_sec(inst->connect_timeout), inst->api_opts,
+				       inst->batch_size);
+	if (!t->cba) return -1;
+
+	return 0;
 }
 
+/** Close the worker's Couchbase instance
+ *
+ * @param el     The worker's event list.
+ * @param thread Thread specific instance data.
+ * @return 0.
+ */
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_couchbase_thread_t	*t = thread;
+
+	TALLOC_FREE(t->cba);
+
+	return 0;
+}
 
 /** Detach the module
  *
@@ -428,6 +524,9 @@ static int mod_detach(void *instance)
 {
 	rlm_couchbase_t *inst = instance;
 
+	/* stop reloading clients before the pool goes away */
+	TALLOC_FREE(inst->client_reload);
+
 	if (inst->map) json_object_put(inst->map);
 	if (inst->pool) fr_pool_free(inst->pool);
 	if (inst->api_opts) mod_free_api_opts(inst);
@@ -435,6 +534,31 @@ static int mod_detach(void *instance)
 	return 0;
 }
 
+/** Reload client documents in the background
+ *
+ * Called in the reload thread, either every reload_interval, or when
+ * asked to via radmin.  Clients are added to, and removed from, the
+ * live client list as part of the load.
+ *
+ * @param  uctx The module instance.
+ * @return
+ *	- The clients which were loaded.  They replace the previous set,
+ *	  which is then freed.
+ *	- NULL on error.
+ */
+static void *mod_client_reload(void *uctx)
+{
+	rlm_couchbase_t *inst = uctx;
+	RADCLIENT **loaded = NULL;
+
+	/* some clients may have been synced, even on error */
+	if ((mod_load_client_documents(&loaded, inst, inst->clients) < 0) && !loaded) return NULL;
+
+	inst->clients = loaded;
+
+	return loaded;
+}
+
 /** Bootstrap the module
  *
  * Define attributes.
@@ -543,11 +667,28 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 
 		tmpl = cf_section_find(cs, "template", NULL);
 
+		inst->client_tmpl = tmpl;
+		inst->client_map = map;
+
+		/* skip building a config section for each client, if we can */
+		inst->client_direct = client_map_is_direct(tmpl, map);
+
 		/* debugging */
 		DEBUG("preparing to load client documents");
 
 		/* attempt to load clients */
-		if (mod_load_client_documents(inst, tmpl, map) != 0) {
+		if (mod_load_client_documents(&inst->clients, inst, NULL) != 0) {
+			/* fail */
+			talloc_free(inst->clients);
+			return -1;
+		}
+
+		/* allow clients to be reloaded without a restart */
+		inst->client_reload = fr_reload_alloc(inst, inst->name, inst->clients, mod_client_reload, inst,
+						      NULL, 0, inst->client_reload_interval);
+		if (!inst->client_reload) {
+			PERROR("failed starting client reload thread");
+			talloc_free(inst->clients);
 			/* fail */
 			return -1;
 		}
@@ -573,10 +714,13 @@ module_t rlm_couchbase = {
 	.name		= "couchbase",
 	.type		= RLM_TYPE_THREAD_SAFE,
 	.inst_size	= sizeof(rlm_couchbase_t),
+	.thread_inst_size	= sizeof(rlm_couchbase_thread_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.onload		= mod_load,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.detach		= mod_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
@@ -31,6 +31,10 @@ RCSID("$Id$")
 
 #include <freeradius-devel/server/map_proc.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, request_t *request,
 				fr_value_box_list_t *key, fr_map_list_t const *maps);
 
@@ -52,6 +56,9 @@ typedef struct {
 	bool		allow_multiple_keys;
 	bool		multiple_index_fields;
 
+	bool		mmap;		//!< index the file in place, instead of loading it.
+	char const	*index_file;	//!< where the index is saved, for faster restarts.
+
 	int		num_fields;
 	int		used_fields;
 	int		index_field;
@@ -66,6 +73,14 @@ typedef struct {
 	fr_type_t	key_data_type;
 
 	fr_map_list_t	map;		//!< if there is an "update" section in the configuration.
+
+	char const	*data;		//!< the mmap'd CSV file.
+	size_t		data_len;	//!< length of the CSV file.
+
+	uint64_t const	*slots;		//!< open addressed hash table of row offsets.
+	uint64_t	num_slots;	//!< always a power of 2.
+	void		*index_map;	//!< the mmap'd index file, if any.
+	size_t		index_map_len;	//!< length of the index file.
 } rlm_csv_t;
 
 typedef struct rlm_csv_entry_s rlm_csv_entry_t;
@@ -87,13 +102,15 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("allow_multiple_keys", FR_TYPE_BOOL, rlm_csv_t, allow_multiple_keys) },
 	{ FR_CONF_OFFSET("index_field", FR_TYPE_STRING | FR_TYPE_REQUIRED | FR_TYPE_NOT_EMPTY, rlm_csv_t, index_field_name) },
 	{ FR_CONF_OFFSET("key", FR_TYPE_TMPL, rlm_csv_t, key) },
+	{ FR_CONF_OFFSET("mmap", FR_TYPE_BOOL, rlm_csv_t, mmap), .dflt = "no" },
+	{ FR_CONF_OFFSET("index_file", FR_TYPE_STRING, rlm_csv_t, index_file) },
 	CONF_PARSER_TERMINATOR
 };
 
 /*
  *	Allow for quotation marks.
  */
-static bool buf2entry(rlm_csv_t *inst, char *buf, char **out)
+static bool buf2entry(rlm_csv_t const *inst, char *buf, char **out)
 {
 	char *p, *q;
 
@@ -356,6 +373,473 @@ static bool file2csv(CONF_SECTION *conf, rlm_csv_t *inst, int lineno, char *buff
 	return insert_entry(conf, inst, e, lineno);
 }
 
+/*
+ *	With "mmap = yes", the file isn't loaded.  Instead, it's
+ *	mmap'd, and indexed by an open addressed hash table of row
+ *	offsets.  Rows are parsed only when a lookup finds them.
+ *
+ *	Each slot holds the row offset + 1 in the low bits, and some
+ *	bits of the key hash in the high bits, so that most slots for
+ *	other keys can be skipped without looking at the file.  Zero
+ *	means the slot is empty.
+ */
+#define CSV_SLOT_OFFSET_BITS	(40)
+#define CSV_SLOT_OFFSET_MAX	((((uint64_t) 1) << CSV_SLOT_OFFSET_BITS) - 1)
+#define CSV_SLOT_TAG(_hash)	(((uint64_t) ((_hash) >> 8)) << CSV_SLOT_OFFSET_BITS)
+#define CSV_SLOT(_tag, _offset)	((_tag) | ((_offset) + 1))
+#define CSV_SLOT_TAG_OF(_slot)	((_slot) & ~CSV_SLOT_OFFSET_MAX)
+#define CSV_SLOT_OFFSET(_slot)	(((_slot) & CSV_SLOT_OFFSET_MAX) - 1)
+
+/** Header of a saved index file
+ *
+ * The index is only used if everything here matches the CSV file
+ * and the configuration.
+ */
+typedef struct {
+	char		magic[8];
+	uint64_t	csv_size;
+	int64_t		csv_mtime;
+	uint64_t	num_slots;
+	uint32_t	key_type;
+	int32_t		index_field;
+	uint32_t	flags;
+	uint32_t	delimiter;
+} rlm_csv_index_hdr_t;
+
+#define CSV_INDEX_MAGIC		"FRCSVIX1"
+#define CSV_INDEX_HEADER	(1 << 0)
+#define CSV_INDEX_MULTIPLE	(1 << 1)
+
+/** Hash a key for the index
+ *
+ * Not fr_value_box_hash(), as that's seeded per process, and the
+ * index may be saved to disk.
+ */
+static uint32_t csv_key_hash(fr_value_box_t const *key)
+{
+	uint8_t		buffer[64];
+	fr_dbuff_t	dbuff;
+	ssize_t		slen;
+
+	switch (key->type) {
+	case FR_TYPE_STRING:
+		return fr_hash(key->vb_strvalue, key->vb_length);
+
+	case FR_TYPE_OCTETS:
+		return fr_hash(key->vb_octets, key->vb_length);
+
+	default:
+		break;
+	}
+
+	fr_dbuff_init(&dbuff, buffer, sizeof(buffer));
+	slen = fr_value_box_to_network(&dbuff, key);
+	if (slen <= 0) return 0;
+
+	return fr_hash(buffer, slen);
+}
+
+/** Parse a row of the mmap'd file into a temporary entry
+ *
+ * @param[in] ctx	to allocate the entry in.
+ * @param[in] inst	of rlm_csv.
+ * @param[in] offset	of the start of the row.
+ * @param[out] key_str	the key field.  Points into the entry.
+ * @param[in] fields	whether to copy the other fields.
+ * @return
+ *	- the entry on success.
+ *	- NULL if the row is malformed.
+ */
+static rlm_csv_entry_t *csv_row_alloc(TALLOC_CTX *ctx, rlm_csv_t const *inst, uint64_t offset,
+				      char **key_str, bool fields)
+{
+	rlm_csv_entry_t	*e;
+	char const	*start = inst->data + offset, *eol;
+	char		*buffer, *p, *q;
+	int		i;
+
+	MEM(e = (rlm_csv_entry_t *)talloc_zero_array(ctx, uint8_t,
+						     sizeof(*e) + (inst->used_fields * sizeof(e->data[0]))));
+	talloc_set_type(e, rlm_csv_entry_t);
+
+	eol = memchr(start, '\n', inst->data_len - offset);
+	if (!eol) eol = inst->data + inst->data_len;
+
+	MEM(buffer = talloc_bstrndup(e, start, eol - start));
+
+	*key_str = NULL;
+	for (p = buffer, i = 0; p != NULL; p = q, i++) {
+		if (!buf2entry(inst, p, &q)) goto fail;
+
+		if (q) *(q++) = '\0';
+
+		if (i >= inst->num_fields) goto fail;
+
+		if (i == inst->index_field) {
+			*key_str = p;
+			continue;
+		}
+
+		if (!fields || (inst->field_offsets[i] < 0)) continue;
+
+		MEM(e->data[inst->field_offsets[i]] = talloc_typed_strdup(e, p));
+	}
+
+	if ((i < inst->num_fields) || !*key_str) {
+	fail:
+		talloc_free(e);
+		return NULL;
+	}
+
+	return e;
+}
+
+/** Call a function for each key in a key field
+ *
+ * There are multiple keys for /etc/group style files.
+ *
+ * @return
+ *	- <0 on error, or the value returned by the callback.
+ *	- 0 when the callback returned 0 for all keys.
+ */
+static int csv_key_walk(rlm_csv_t const *inst, char *key_str,
+			int (*func)(fr_value_box_t *box, void *uctx), void *uctx)
+{
+	char		*p = key_str, *next;
+	fr_value_box_t	box;
+	int		ret;
+
+	do {
+		next = NULL;
+		if (inst->multiple_index_fields) {
+			next = strchr(p, ',');
+			if (next) *(next++) = '\0';
+
+			if (!*p) continue;
+		}
+
+		if (fr_value_box_from_str(NULL, &box, inst->key_data_type, NULL, p, -1, 0, false) < 0) return -1;
+
+		ret = func(&box, uctx);
+		fr_value_box_clear(&box);
+		if (ret != 0) return ret;
+	} while ((p = next) != NULL);
+
+	return 0;
+}
+
+static int _csv_key_cmp(fr_value_box_t *box, void *uctx)
+{
+	return (fr_value_box_cmp(box, uctx) == 0);
+}
+
+/** See if any of the keys in a key field match
+ *
+ */
+static bool csv_key_match(rlm_csv_t const *inst, char *key_str, fr_value_box_t const *key)
+{
+	return (csv_key_walk(inst, key_str, _csv_key_cmp, UNCONST(fr_value_box_t *, key)) == 1);
+}
+
+typedef struct {
+	CONF_SECTION	*conf;
+	rlm_csv_t	*inst;
+	uint64_t	*slots;
+	uint64_t	mask;
+	uint64_t	offset;
+	int		lineno;
+	bool		duplicate;	//!< the error was a duplicate key.
+} csv_index_ctx_t;
+
+static int _csv_index_insert(fr_value_box_t *box, void *uctx)
+{
+	csv_index_ctx_t	*ctx = uctx;
+	rlm_csv_t	*inst = ctx->inst;
+	uint32_t	hash = csv_key_hash(box);
+	uint64_t	tag = CSV_SLOT_TAG(hash);
+	uint64_t	i;
+
+	for (i = hash & ctx->mask; ctx->slots[i] != 0; i = (i + 1) & ctx->mask) {
+		rlm_csv_entry_t	*e;
+		char		*key_str;
+		bool		match;
+
+		if (inst->allow_multiple_keys || inst->multiple_index_fields ||
+		    (CSV_SLOT_TAG_OF(ctx->slots[i]) != tag)) continue;
+
+		e = csv_row_alloc(NULL, inst, CSV_SLOT_OFFSET(ctx->slots[i]), &key_str, false);
+		if (!e) continue;
+
+		match = csv_key_match(inst, key_str, box);
+		talloc_free(e);
+
+		if (match) {
+			cf_log_err(ctx->conf, "%s[%d]: Multiple entries are disallowed", inst->filename, ctx->lineno);
+			ctx->duplicate = true;
+			return -1;
+		}
+	}
+
+	ctx->slots[i] = CSV_SLOT(tag, ctx->offset);
+
+	return 0;
+}
+
+/** Build the index for an mmap'd file
+ *
+ */
+static uint64_t *csv_index_build(CONF_SECTION *conf, rlm_csv_t *inst, uint64_t *num_slots)
+{
+	char const	*p, *q, *eol, *end = inst->data + inst->data_len;
+	uint64_t	entries = 0;
+	csv_index_ctx_t	ctx = { .conf = conf, .inst = inst, .lineno = 1 };
+
+	/*
+	 *	Size the table so that it's no more than 2/3 full.
+	 */
+	for (p = inst->data; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol) eol = end;
+
+		entries++;
+		if (inst->multiple_index_fields) for (q = p; q < eol; q++) if (*q == ',') entries++;
+	}
+
+	*num_slots = 16;
+	while (*num_slots < (entries + (entries / 2))) *num_slots <<= 1;
+
+	ctx.slots = talloc_zero_array(inst, uint64_t, *num_slots);
+	if (!ctx.slots) {
+		cf_log_err(conf, "Failed allocating index for %s", inst->filename);
+		return NULL;
+	}
+	ctx.mask = *num_slots - 1;
+
+	for (p = inst->data; p < end; p = eol + 1, ctx.lineno++) {
+		rlm_csv_entry_t	*e;
+		char		*key_str;
+
+		eol = memchr(p, '\n', end - p);
+		if (!eol) eol = end;
+
+		if ((ctx.lineno == 1) && inst->header) continue;
+
+		/*
+		 *	Skip blank lines.
+		 */
+		if ((eol == p) || ((eol == (p + 1)) && (*p == '\r'))) continue;
+
+		ctx.offset = p - inst->data;
+
+		e = csv_row_alloc(NULL, inst, ctx.offset, &key_str, false);
+		if (!e) {
+			cf_log_err(conf, "Malformed entry in file %s line %d", inst->filename, ctx.lineno);
+		error:
+			talloc_free(ctx.slots);
+			return NULL;
+		}
+
+		if (csv_key_walk(inst, key_str, _csv_index_insert, &ctx) < 0) {
+			if (!ctx.duplicate) {
+				cf_log_err(conf, "Failed parsing key field in file %s line %d - %s",
+					   inst->filename, ctx.lineno, fr_strerror());
+			}
+			talloc_free(e);
+			goto error;
+		}
+		talloc_free(e);
+	}
+
+	return ctx.slots;
+}
+
+static void csv_index_hdr_init(rlm_csv_index_hdr_t *hdr, rlm_csv_t const *inst, struct stat const *st)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, CSV_INDEX_MAGIC, sizeof(hdr->magic));
+	hdr->csv_size = st->st_size;
+	hdr->csv_mtime = st->st_mtime;
+	hdr->key_type = inst->key_data_type;
+	hdr->index_field = inst->index_field;
+	hdr->flags = (inst->header ? CSV_INDEX_HEADER : 0) | (inst->multiple_index_fields ? CSV_INDEX_MULTIPLE : 0);
+	hdr->delimiter = (uint8_t) *inst->delimiter;
+}
+
+/** Use a saved index, if it matches the CSV file
+ *
+ * @return
+ *	- 0 if the index was loaded.
+ *	- -1 if there's no usable index.
+ */
+static int csv_index_load(rlm_csv_t *inst, rlm_csv_index_hdr_t const *want)
+{
+	int				fd;
+	struct stat			st;
+	void				*map;
+	rlm_csv_index_hdr_t const	*hdr;
+
+	fd = open(inst->index_file, O_RDONLY);
+	if (fd < 0) return -1;
+
+	if ((fstat(fd, &st) < 0) || ((size_t) st.st_size < sizeof(*hdr))) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return -1;
+
+	hdr = map;
+	if ((memcmp(hdr->magic, want->magic, sizeof(hdr->magic)) != 0) ||
+	    (hdr->csv_size != want->csv_size) || (hdr->csv_mtime != want->csv_mtime) ||
+	    (hdr->key_type != want->key_type) || (hdr->index_field != want->index_field) ||
+	    (hdr->flags != want->flags) || (hdr->delimiter != want->delimiter) ||
+	    !hdr->num_slots || ((hdr->num_slots & (hdr->num_slots - 1)) != 0) ||
+	    (((size_t) st.st_size - sizeof(*hdr)) / sizeof(uint64_t) != hdr->num_slots)) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	inst->index_map = map;
+	inst->index_map_len = st.st_size;
+	inst->slots = (uint64_t const *) (hdr + 1);
+	inst->num_slots = hdr->num_slots;
+
+	return 0;
+}
+
+static int csv_write_all(int fd, void const *data, size_t len)
+{
+	uint8_t const *p = data;
+
+	while (len > 0) {
+		ssize_t slen;
+
+		slen = write(fd, p, len);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		p += slen;
+		len -= slen;
+	}
+
+	return 0;
+}
+
+/** Save the index, so that the next start doesn't have to build it
+ *
+ * It's written to a temporary file, and renamed, so that other
+ * servers never see a partial index.
+ */
+static int csv_index_save(rlm_csv_t const *inst, rlm_csv_index_hdr_t const *hdr, uint64_t const *slots)
+{
+	char	*tmp;
+	int	fd;
+
+	MEM(tmp = talloc_asprintf(NULL, "%s.tmp", inst->index_file));
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		fr_strerror_printf("Failed creating %s: %s", tmp, fr_syserror(errno));
+		talloc_free(tmp);
+		return -1;
+	}
+
+	if ((csv_write_all(fd, hdr, sizeof(*hdr)) < 0) ||
+	    (csv_write_all(fd, slots, hdr->num_slots * sizeof(slots[0])) < 0)) {
+		fr_strerror_printf("Failed writing %s: %s", tmp, fr_syserror(errno));
+	error:
+		close(fd);
+		unlink(tmp);
+		talloc_free(tmp);
+		return -1;
+	}
+
+	if (rename(tmp, inst->index_file) < 0) {
+		fr_strerror_printf("Failed renaming %s: %s", tmp, fr_syserror(errno));
+		goto error;
+	}
+
+	close(fd);
+	talloc_free(tmp);
+
+	return 0;
+}
+
+/** mmap the CSV file, and load or build its index
+ *
+ */
+static int csv_mmap_open(CONF_SECTION *conf, rlm_csv_t *inst)
+{
+	int			fd;
+	struct stat		st;
+	rlm_csv_index_hdr_t	hdr;
+	uint64_t		*slots;
+
+	fd = open(inst->filename, O_RDONLY);
+	if (fd < 0) {
+		cf_log_err(conf, "Error opening filename %s: %s", inst->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		cf_log_err(conf, "Error reading filename %s: %s", inst->filename, fr_syserror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if ((uint64_t) st.st_size >= CSV_SLOT_OFFSET_MAX) {
+		cf_log_err(conf, "File %s is too large to index", inst->filename);
+		close(fd);
+		return -1;
+	}
+
+	inst->data = "";
+	inst->data_len = st.st_size;
+	if (inst->data_len) {
+		void *map;
+
+		map = mmap(NULL, inst->data_len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			cf_log_err(conf, "Error mapping filename %s: %s", inst->filename, fr_syserror(errno));
+			close(fd);
+			return -1;
+		}
+		inst->data = map;
+	}
+	close(fd);
+
+	csv_index_hdr_init(&hdr, inst, &st);
+
+	if (inst->index_file && (csv_index_load(inst, &hdr) == 0)) {
+		cf_log_debug(conf, "Using index %s for %s", inst->index_file, inst->filename);
+		goto done;
+	}
+
+	slots = csv_index_build(conf, inst, &hdr.num_slots);
+	if (!slots) return -1;
+
+	inst->slots = slots;
+	inst->num_slots = hdr.num_slots;
+
+	if (inst->index_file && (csv_index_save(inst, &hdr, slots) < 0)) {
+		cf_log_warn(conf, "Failed saving index for %s - %s", inst->filename, fr_strerror());
+	}
+
+done:
+	/*
+	 *	Lookups go wherever the keys are.
+	 */
+#ifdef MADV_RANDOM
+	if (inst->data_len) (void) madvise(UNCONST(char *, inst->data), inst->data_len, MADV_RANDOM);
+#endif
+
+	return 0;
+}
+
 
 static int fieldname2offset(rlm_csv_t const *inst, char const *field_name, int *array_offset)
 {
@@ -556,6 +1040,15 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	/*
+	 *	A hash index can't do prefix matches.
+	 */
+	if (inst->mmap && (htype == FR_HTRIE_TRIE)) {
+		cf_log_err(conf, "'mmap = yes' cannot be used with keys of type '%s'",
+			   fr_table_str_by_value(fr_value_box_type_table, inst->key_data_type, "???"));
+		return -1;
+	}
+
 	inst->trie = fr_htrie_alloc(inst, htype,
 				    (fr_hash_t) csv_hash,
 				    (fr_cmp_t) csv_cmp,
@@ -791,6 +1284,8 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		cf_log_warn(conf, "Ignoring 'key', as no 'update' section has been defined.");
 	}
 
+	if (inst->mmap) return csv_mmap_open(conf, inst);
+
 	/*
 	 *	Re-open the file and read it all.
 	 */
@@ -882,31 +1377,17 @@ static int csv_map_getvalue(TALLOC_CTX *ctx, fr_pair_list_t *out, request_t *req
 }
 
 
-/** Perform a search and map the result of the search to server attributes
+/** Map the fields of one entry to server attributes
  *
- * @param[in] inst	#rlm_csv_t.
- * @param[in,out]	request The current request.
- * @param[in] key	key to look for
- * @param[in] maps	Head of the map list.
  * @return
- *	- #RLM_MODULE_NOOP no rows were returned.
- *	- #RLM_MODULE_UPDATED if one or more #fr_pair_t were added to the #request_t.
+ *	- #RLM_MODULE_UPDATED on success.
  *	- #RLM_MODULE_FAIL if an error occurred.
  */
-static rlm_rcode_t mod_map_apply(rlm_csv_t const *inst, request_t *request,
-				fr_value_box_t const *key, fr_map_list_t const *maps)
+static rlm_rcode_t csv_entry_map(rlm_csv_t const *inst, request_t *request,
+				 rlm_csv_entry_t const *e, fr_map_list_t const *maps)
 {
-	rlm_rcode_t		rcode = RLM_MODULE_UPDATED;
-	rlm_csv_entry_t		*e;
 	map_t const		*map = NULL;
 
-	e = fr_htrie_find(inst->trie, &(rlm_csv_entry_t) { .key = UNCONST(fr_value_box_t *, key) } );
-	if (!e) {
-		rcode = RLM_MODULE_NOOP;
-		goto finish;
-	}
-
-redo:
 	RINDENT();
 	while ((map = fr_dlist_next(maps, map))) {
 		int field;
@@ -919,8 +1400,7 @@ redo:
 			if (tmpl_aexpand(request, &field_name, request, map->rhs, NULL, NULL) < 0) {
 				REXDENT();
 				REDEBUG("Failed expanding RHS at %s", map->lhs->name);
-				rcode = RLM_MODULE_FAIL;
-				goto finish;
+				return RLM_MODULE_FAIL;
 			}
 		} else {
 			field_name = UNCONST(char *, map->rhs->name);
@@ -933,8 +1413,7 @@ redo:
 		if (field < 0) {
 			REXDENT();
 			REDEBUG("No such field name %s", map->rhs->name);
-			rcode = RLM_MODULE_FAIL;
-			goto finish;
+			return RLM_MODULE_FAIL;
 		}
 
 		/*
@@ -943,22 +1422,84 @@ redo:
 		 */
 		if (map_to_request(request, map, csv_map_getvalue, e->data[field]) < 0) {
 			REXDENT();
-			rcode = RLM_MODULE_FAIL;
-			goto finish;
+			return RLM_MODULE_FAIL;
 		}
 	}
-
 	REXDENT();
 
-	if (e->next) {
-		e = e->next;
-		goto redo;
+	return RLM_MODULE_UPDATED;
+}
+
+/** Look up a key in an mmap'd file, and map each matching row
+ *
+ * Matching rows are in the order they appear in the file, as
+ * later rows are always further along the probe sequence.
+ */
+static rlm_rcode_t csv_mmap_apply(rlm_csv_t const *inst, request_t *request,
+				  fr_value_box_t const *key, fr_map_list_t const *maps)
+{
+	rlm_rcode_t	rcode = RLM_MODULE_NOOP;
+	uint32_t	hash = csv_key_hash(key);
+	uint64_t	tag = CSV_SLOT_TAG(hash);
+	uint64_t	mask = inst->num_slots - 1;
+	uint64_t	i;
+
+	for (i = hash & mask; inst->slots[i] != 0; i = (i + 1) & mask) {
+		rlm_csv_entry_t	*e;
+		char		*key_str;
+
+		if (CSV_SLOT_TAG_OF(inst->slots[i]) != tag) continue;
+
+		e = csv_row_alloc(request, inst, CSV_SLOT_OFFSET(inst->slots[i]), &key_str, true);
+		if (!e) {
+			REDEBUG("Malformed entry at offset %" PRIu64 " in file %s",
+				CSV_SLOT_OFFSET(inst->slots[i]), inst->filename);
+			return RLM_MODULE_FAIL;
+		}
+
+		if (!csv_key_match(inst, key_str, key)) {
+			talloc_free(e);
+			continue;
+		}
+
+		rcode = csv_entry_map(inst, request, e, maps);
+		talloc_free(e);
+		if (rcode == RLM_MODULE_FAIL) break;
 	}
 
-finish:
 	return rcode;
 }
 
+/** Perform a search and map the result of the search to server attributes
+ *
+ * @param[in] inst	#rlm_csv_t.
+ * @param[in,out]	request The current request.
+ * @param[in] key	key to look for
+ * @param[in] maps	Head of the map list.
+ * @return
+ *	- #RLM_MODULE_NOOP no rows were returned.
+ *	- #RLM_MODULE_UPDATED if one or more #fr_pair_t were added to the #request_t.
+ *	- #RLM_MODULE_FAIL if an error occurred.
+ */
+static rlm_rcode_t mod_map_apply(rlm_csv_t const *inst, request_t *request,
+				fr_value_box_t const *key, fr_map_list_t const *maps)
+{
+	rlm_rcode_t		rcode;
+	rlm_csv_entry_t		*e;
+
+	if (inst->slots) return csv_mmap_apply(inst, request, key, maps);
+
+	e = fr_htrie_find(inst->trie, &(rlm_csv_entry_t) { .key = UNCONST(fr_value_box_t *, key) } );
+	if (!e) return RLM_MODULE_NOOP;
+
+	do {
+		rcode = csv_entry_map(inst, request, e, maps);
+		if (rcode != RLM_MODULE_UPDATED) return rcode;
+	} while ((e = e->next) != NULL);
+
+	return RLM_MODULE_UPDATED;
+}
+
 
 /** Perform a search and map the result of the search to server attributes
  *
@@ -1041,6 +1582,16 @@ static unlang_action_t CC_HINT(nonnull) mod_process(rlm_rcode_t *p_result, modul
 	RETURN_MODULE_RCODE(rcode);
 }
 
+static int mod_detach(void *instance)
+{
+	rlm_csv_t *inst = instance;
+
+	if (inst->data_len) munmap(UNCONST(char *, inst->data), inst->data_len);
+	if (inst->index_map) munmap(inst->index_map, inst->index_map_len);
+
+	return 0;
+}
+
 extern module_t rlm_csv;
 module_t rlm_csv = {
 	.magic		= RLM_MODULE_INIT,
@@ -1050,6 +1601,7 @@ module_t rlm_csv = {
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
 
 	.method_names = (module_method_names_t[]){
 		{ .name1 = CF_IDENT_ANY,	.name2 = CF_IDENT_ANY,	.method = mod_process },
@@ -30,14 +30,52 @@ RCSID("$Id$")
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/server/map_proc.h>
 #include <freeradius-devel/util/time.h>
+#include <freeradius-devel/util/rb.h>
 
 typedef struct {
 	char const	*xlat_name;		//!< Name of our xlat function.
 	tmpl_t	*delay;			//!< How long we delay for.
 	bool		relative;		//!< Whether the delay is relative to the start of request processing.
 	bool		force_reschedule;	//!< Whether we should force rescheduling of the request.
+	fr_time_delta_t	coalesce;		//!< Round resume times up to a multiple of this.
+	uint32_t	max_pending;		//!< Maximum number of coalesced requests per thread.
 } rlm_delay_t;
 
+typedef struct rlm_delay_bucket_s rlm_delay_bucket_t;
+
+/** Per-thread coalesced delays
+ *
+ */
+typedef struct {
+	rlm_delay_t const	*inst;		//!< Module instance.
+	fr_event_list_t		*el;		//!< To insert bucket timers into.
+	fr_rb_tree_t		*buckets;	//!< Ordered by resume time.
+	fr_dlist_head_t		pending;	//!< All delayed requests, oldest first.
+} rlm_delay_thread_t;
+
+/** All the requests which resume at the same time
+ *
+ */
+struct rlm_delay_bucket_s {
+	fr_rb_node_t		node;		//!< Entry in the thread's bucket tree.
+	fr_time_t		when;		//!< When the requests resume.
+	fr_event_timer_t const	*ev;		//!< One timer for the whole bucket.
+	fr_dlist_head_t		entries;	//!< Requests in this bucket.
+	rlm_delay_thread_t	*t;		//!< Thread we belong to.
+};
+
+/** A delayed request
+ *
+ */
+typedef struct {
+	request_t		*request;	//!< The delayed request.
+	rlm_delay_thread_t	*t;		//!< Thread we belong to.
+	rlm_delay_bucket_t	*bucket;	//!< We're in, or NULL if we've been resumed.
+	fr_time_t		yielded;	//!< When we yielded the request.
+	fr_dlist_t		bucket_entry;	//!< Entry in the bucket.
+	fr_dlist_t		pending_entry;	//!< Entry in the thread's pending list.
+} rlm_delay_entry_t;
+
 /*
  *	A mapping of configuration file names to internal variables.
  */
@@ -45,6 +83,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("delay", FR_TYPE_TMPL, rlm_delay_t, delay) },
 	{ FR_CONF_OFFSET("relative", FR_TYPE_BOOL, rlm_delay_t, relative), .dflt = "no" },
 	{ FR_CONF_OFFSET("force_reschedule", FR_TYPE_BOOL, rlm_delay_t, force_reschedule), .dflt = "no" },
+	{ FR_CONF_OFFSET("coalesce", FR_TYPE_TIME_DELTA, rlm_delay_t, coalesce), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_pending", FR_TYPE_UINT32, rlm_delay_t, max_pending), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -141,6 +181,139 @@ static void mod_delay_cancel(UNUSED module_ctx_t const *mctx, request_t *request
 	(void) unlang_module_timeout_delete(request, rctx);
 }
 
+static int8_t delay_bucket_cmp(void const *one, void const *two)
+{
+	rlm_delay_bucket_t const *a = one, *b = two;
+
+	return fr_time_cmp(a->when, b->when);
+}
+
+/** Remove a request from its bucket, freeing the bucket if it's now empty
+ *
+ */
+static void delay_entry_unlink(rlm_delay_entry_t *entry)
+{
+	rlm_delay_bucket_t	*bucket = entry->bucket;
+
+	if (!bucket) return;
+
+	fr_dlist_remove(&bucket->entries, entry);
+	fr_dlist_remove(&entry->t->pending, entry);
+	entry->bucket = NULL;
+
+	if (!fr_dlist_empty(&bucket->entries)) return;
+
+	(void) fr_rb_remove(entry->t->buckets, bucket);
+	talloc_free(bucket);	/* Also frees the timer */
+}
+
+static int _delay_entry_free(rlm_delay_entry_t *entry)
+{
+	delay_entry_unlink(entry);
+
+	return 0;
+}
+
+/** Called when a bucket's timer fires
+ *
+ * Marks every request in the bucket as resumable.
+ */
+static void _delay_bucket_done(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_delay_bucket_t	*bucket = talloc_get_type_abort(uctx, rlm_delay_bucket_t);
+	rlm_delay_thread_t	*t = bucket->t;
+	rlm_delay_entry_t	*entry;
+
+	(void) fr_rb_remove(t->buckets, bucket);
+
+	while ((entry = fr_dlist_pop_head(&bucket->entries))) {
+		fr_dlist_remove(&t->pending, entry);
+		entry->bucket = NULL;
+
+		unlang_interpret_mark_runnable(entry->request);
+	}
+
+	talloc_free(bucket);
+}
+
+/** Add a request to the bucket for its resume time
+ *
+ * Resume times are rounded up to a multiple of "coalesce", so that
+ * many delayed requests share one timer.  If there are too many
+ * requests pending, the oldest one is resumed early.
+ */
+static int delay_bucket_add(request_t *request, rlm_delay_thread_t *t, rlm_delay_entry_t *entry, fr_time_t resume_at)
+{
+	rlm_delay_t const	*inst = t->inst;
+	rlm_delay_bucket_t	*bucket, find;
+	rlm_delay_entry_t	*oldest;
+
+	find.when = ((resume_at + inst->coalesce - 1) / inst->coalesce) * inst->coalesce;
+
+	bucket = fr_rb_find(t->buckets, &find);
+	if (!bucket) {
+		MEM(bucket = talloc_zero(t, rlm_delay_bucket_t));
+		bucket->when = find.when;
+		bucket->t = t;
+		fr_dlist_talloc_init(&bucket->entries, rlm_delay_entry_t, bucket_entry);
+
+		if (fr_event_timer_at(bucket, t->el, &bucket->ev, bucket->when, _delay_bucket_done, bucket) < 0) {
+			talloc_free(bucket);
+			return -1;
+		}
+
+		if (!fr_rb_insert(t->buckets, bucket)) {
+			talloc_free(bucket);
+			return -1;
+		}
+	}
+
+	entry->t = t;
+	entry->bucket = bucket;
+	fr_dlist_insert_tail(&bucket->entries, entry);
+	fr_dlist_insert_tail(&t->pending, entry);
+	talloc_set_destructor(entry, _delay_entry_free);
+
+	/*
+	 *	Shed the oldest request, and let it continue now.
+	 */
+	if (inst->max_pending && (fr_dlist_num_elements(&t->pending) > inst->max_pending)) {
+		oldest = fr_dlist_head(&t->pending);
+
+		RWARN("Too many delayed requests (%u), resuming request %" PRIu64 " early",
+		      inst->max_pending, oldest->request->number);
+
+		delay_entry_unlink(oldest);
+		unlang_interpret_mark_runnable(oldest->request);
+	}
+
+	return 0;
+}
+
+/** Called when the bucket the request was in has fired
+ *
+ */
+static unlang_action_t mod_delay_bucket_return(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx,
+					       request_t *request, void *rctx)
+{
+	rlm_delay_entry_t	*entry = talloc_get_type_abort(rctx, rlm_delay_entry_t);
+
+	RDEBUG3("Request delayed by %pV", fr_box_time_delta(fr_time() - entry->yielded));
+	talloc_free(entry);
+
+	RETURN_MODULE_OK;
+}
+
+static void mod_delay_bucket_cancel(UNUSED module_ctx_t const *mctx, request_t *request, void *rctx,
+				    fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	RDEBUG2("Cancelling delay");
+
+	talloc_free(talloc_get_type_abort(rctx, rlm_delay_entry_t));
+}
+
 static unlang_action_t CC_HINT(nonnull) mod_delay(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_delay_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_delay_t);
@@ -154,6 +327,33 @@ static unlang_action_t CC_HINT(nonnull) mod_delay(rlm_rcode_t *p_result, module_
 		delay = 0;
 	}
 
+	/*
+	 *	Many requests delayed by similar amounts share a
+	 *	single timer.
+	 */
+	if (inst->coalesce) {
+		rlm_delay_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_delay_thread_t);
+		rlm_delay_entry_t	*entry;
+
+		MEM(entry = talloc_zero(request, rlm_delay_entry_t));
+		entry->request = request;
+		entry->yielded = fr_time();
+
+		if (delay_add(request, &resume_at, entry->yielded, delay,
+			      inst->force_reschedule, inst->relative) != 0) {
+			talloc_free(entry);
+			RETURN_MODULE_NOOP;
+		}
+
+		if (delay_bucket_add(request, t, entry, resume_at) < 0) {
+			RPEDEBUG("Adding event failed");
+			talloc_free(entry);
+			RETURN_MODULE_FAIL;
+		}
+
+		return unlang_module_yield(request, mod_delay_bucket_return, mod_delay_bucket_cancel, entry);
+	}
+
 	/*
 	 *	Record the time that we yielded the request
 	 */
@@ -164,7 +364,7 @@ static unlang_action_t CC_HINT(nonnull) mod_delay(rlm_rcode_t *p_result, module_
 	 *	Setup the delay for this request
 	 */
 	if (delay_add(request, &resume_at, *yielded_at, delay,
-		      inst->force_reschedule, inst->delay) != 0) {
+		      inst->force_reschedule, inst->relative) != 0) {
 		RETURN_MODULE_NOOP;
 	}
 
@@ -298,6 +498,22 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  fr_event_list_t *el, void *thread)
+{
+	rlm_delay_thread_t	*t = talloc_get_type_abort(thread, rlm_delay_thread_t);
+
+	t->inst = talloc_get_type_abort(instance, rlm_delay_t);
+	t->el = el;
+
+	t->buckets = fr_rb_inline_talloc_alloc(t, rlm_delay_bucket_t, node, delay_bucket_cmp, NULL);
+	if (!t->buckets) return -1;
+
+	fr_dlist_talloc_init(&t->pending, rlm_delay_entry_t, pending_entry);
+
+	return 0;
+}
+
 extern module_t rlm_delay;
 module_t rlm_delay = {
 	.magic		= RLM_MODULE_INIT,
@@ -306,6 +522,9 @@ module_t rlm_delay = {
 	.inst_size	= sizeof(rlm_delay_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
+	.thread_inst_size	= sizeof(rlm_delay_thread_t),
+	.thread_inst_type	= "rlm_delay_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
 	.methods = {
 		[MOD_PREACCT]		= mod_delay,
 		[MOD_AUTHORIZE]		= mod_delay,
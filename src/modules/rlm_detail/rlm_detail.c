@@ -26,7 +26,9 @@ RCSID("$Id$")
 #define LOG_PREFIX "rlm_detail (%s) - "
 #define LOG_PREFIX_ARGS inst->name
 
+#include <freeradius-devel/internal/internal.h>
 #include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/detail.h>
 #include <freeradius-devel/server/exfile.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/util/debug.h>
@@ -46,6 +48,22 @@ RCSID("$Id$")
 
 #define DIRLEN	8192		//!< Maximum path length.
 
+/** Detail record formats
+ *
+ */
+typedef enum {
+	DETAIL_FORMAT_INVALID = 0,
+	DETAIL_FORMAT_TEXT,				//!< "Attr = value" lines, one record per block.
+	DETAIL_FORMAT_BINARY				//!< Internal protocol encoded pairs, with a
+							///< record header.  See lib/server/detail.h.
+} detail_format_t;
+
+static fr_table_num_sorted_t const detail_format_table[] = {
+	{ L("binary"),	DETAIL_FORMAT_BINARY	},
+	{ L("text"),	DETAIL_FORMAT_TEXT	}
+};
+static size_t detail_format_table_len = NUM_ELEMENTS(detail_format_table);
+
 /** Instance configuration for rlm_detail
  *
  * Holds the configuration and preparsed data for a instance of rlm_detail.
@@ -63,6 +81,9 @@ typedef struct {
 
 	bool		escape;		//!< do filename escaping, yes / no
 
+	char const	*format_str;	//!< Record format name.
+	detail_format_t	format;		//!< Record format.
+
 	xlat_escape_legacy_t	escape_func; //!< escape function
 
 	exfile_t    	*ef;		//!< Log file handler
@@ -70,6 +91,15 @@ typedef struct {
 	fr_hash_table_t *ht;		//!< Holds suppressed attributes.
 } rlm_detail_t;
 
+/** Thread specific data for rlm_detail
+ *
+ */
+typedef struct {
+	fr_hash_table_t		*prefixes;	//!< Text format line prefixes, by attribute.
+	fr_sbuff_t		out;		//!< Text format record, reused for each request.
+	fr_sbuff_uctx_talloc_t	tctx;		//!< For the record buffer.
+} rlm_detail_thread_t;
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_OUTPUT | FR_TYPE_REQUIRED | FR_TYPE_XLAT, rlm_detail_t, filename), .dflt = "%A/%{Packet-Src-IP-Address}/detail" },
 	{ FR_CONF_OFFSET("header", FR_TYPE_TMPL | FR_TYPE_XLAT | FR_TYPE_NON_BLOCKING, rlm_detail_t, header),
@@ -79,6 +109,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("locking", FR_TYPE_BOOL, rlm_detail_t, locking), .dflt = "no" },
 	{ FR_CONF_OFFSET("escape_filenames", FR_TYPE_BOOL, rlm_detail_t, escape), .dflt = "no" },
 	{ FR_CONF_OFFSET("log_packet_header", FR_TYPE_BOOL, rlm_detail_t, log_srcdst), .dflt = "no" },
+	{ FR_CONF_OFFSET("format", FR_TYPE_STRING | FR_TYPE_NOT_EMPTY, rlm_detail_t, format_str), .dflt = "text" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -139,6 +170,12 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->name = cf_section_name2(conf);
 	if (!inst->name) inst->name = cf_section_name1(conf);
 
+	inst->format = fr_table_value_by_str(detail_format_table, inst->format_str, DETAIL_FORMAT_INVALID);
+	if (inst->format == DETAIL_FORMAT_INVALID) {
+		cf_log_err(conf, "Invalid format \"%s\", expected \"text\" or \"binary\"", inst->format_str);
+		return -1;
+	}
+
 	/*
 	 *	Escape filenames only if asked.
 	 */
@@ -210,37 +247,211 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
-/*
- *	Wrapper for VPs allocated on the stack.
+/** The name part of a text detail line, i.e. "\tAttr-Name = "
+ *
  */
-static void detail_fr_pair_fprint(TALLOC_CTX *ctx, FILE *out, fr_pair_t const *stacked)
+typedef struct {
+	fr_dict_attr_t const	*da;		//!< The prefix is for.
+	char const		*prefix;	//!< Tab, OID, and operator.
+	size_t			len;		//!< Length of the prefix.
+} detail_prefix_t;
+
+static uint32_t detail_prefix_hash(void const *data)
 {
-	fr_pair_t *vp;
+	detail_prefix_t const *p = data;
+
+	return fr_hash(&p->da, sizeof(p->da));
+}
 
-	vp = talloc(ctx, fr_pair_t);
-	if (!vp) return;
+static int8_t detail_prefix_cmp(void const *one, void const *two)
+{
+	detail_prefix_t const *a = one, *b = two;
 
-	memcpy(vp, stacked, sizeof(*vp));
-	vp->op = T_OP_EQ;
-	fr_pair_fprint(out, vp);
-	talloc_free(vp);
+	return CMP(a->da, b->da);
 }
 
+/** Write the name part of a text detail line
+ *
+ * The prefixes for dictionary attributes are cached, so the OID only
+ * has to be printed once per attribute, per thread.  Unknown attributes
+ * are allocated per packet, so their prefixes are always printed.
+ */
+static ssize_t detail_prefix_write(fr_sbuff_t *out, rlm_detail_thread_t *t, fr_dict_attr_t const *da)
+{
+	detail_prefix_t	*p;
+	char		buffer[1024];
+	fr_sbuff_t	sbuff;
+
+	if (!da->flags.is_unknown && !da->flags.is_raw) {
+		p = fr_hash_table_find(t->prefixes, &(detail_prefix_t){ .da = da });
+		if (p) return fr_sbuff_in_bstrncpy(out, p->prefix, p->len);
+	}
 
-/** Write a single detail entry to file pointer
+	sbuff = FR_SBUFF_OUT(buffer, sizeof(buffer));
+	FR_SBUFF_IN_CHAR_RETURN(&sbuff, '\t');
+	if (da->flags.is_raw) FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&sbuff, "raw.");
+	FR_DICT_ATTR_OID_PRINT_RETURN(&sbuff, NULL, da, false);
+	FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&sbuff, " = ");
+
+	if (!da->flags.is_unknown && !da->flags.is_raw) {
+		MEM(p = talloc(t->prefixes, detail_prefix_t));
+		*p = (detail_prefix_t){
+			.da = da,
+			.len = fr_sbuff_used(&sbuff)
+		};
+		MEM(p->prefix = talloc_bstrndup(p, fr_sbuff_start(&sbuff), p->len));
+		if (!fr_hash_table_insert(t->prefixes, p)) talloc_free(p);
+	}
+
+	return fr_sbuff_in_bstrncpy(out, fr_sbuff_start(&sbuff), fr_sbuff_used(&sbuff));
+}
+
+/** Write an unsigned integer in decimal
+ *
+ */
+static ssize_t detail_uint_write(fr_sbuff_t *out, uint64_t num)
+{
+	char	buffer[20];
+	char	*p = buffer + sizeof(buffer);
+
+	do {
+		*--p = '0' + (num % 10);
+		num /= 10;
+	} while (num);
+
+	return fr_sbuff_in_bstrncpy(out, p, (buffer + sizeof(buffer)) - p);
+}
+
+/** Write a signed integer in decimal
+ *
+ */
+static ssize_t detail_int_write(fr_sbuff_t *out, int64_t num)
+{
+	fr_sbuff_t	our_out = FR_SBUFF_NO_ADVANCE(out);
+
+	if (num >= 0) return detail_uint_write(out, (uint64_t) num);
+
+	FR_SBUFF_IN_CHAR_RETURN(&our_out, '-');
+	FR_SBUFF_RETURN(detail_uint_write, &our_out, -((uint64_t) num));
+
+	return fr_sbuff_set(out, &our_out);
+}
+
+/** Write the value part of a text detail line
  *
- * @param[in] out Where to write entry.
+ * The common types are written directly, and strings which don't need
+ * escaping are copied as-is.  Everything else is printed the same way
+ * as fr_pair_print() would.
+ */
+static ssize_t detail_value_write(fr_sbuff_t *out, fr_pair_t const *vp)
+{
+	fr_sbuff_t	our_out = FR_SBUFF_NO_ADVANCE(out);
+	uint8_t const	*ip;
+	size_t		i;
+
+	if (vp->type == VT_XLAT) return fr_pair_print_value_quoted(out, vp, T_DOUBLE_QUOTED_STRING);
+
+	/*
+	 *	Values with enumerations are printed by name.
+	 */
+	if (vp->data.enumv && fr_dict_attr_ext(vp->data.enumv, FR_DICT_ATTR_EXT_ENUMV)) goto print;
+
+	switch (vp->vp_type) {
+	case FR_TYPE_UINT8:
+		return detail_uint_write(out, vp->vp_uint8);
+
+	case FR_TYPE_UINT16:
+		return detail_uint_write(out, vp->vp_uint16);
+
+	case FR_TYPE_UINT32:
+		return detail_uint_write(out, vp->vp_uint32);
+
+	case FR_TYPE_UINT64:
+		return detail_uint_write(out, vp->vp_uint64);
+
+	case FR_TYPE_INT8:
+		return detail_int_write(out, vp->vp_int8);
+
+	case FR_TYPE_INT16:
+		return detail_int_write(out, vp->vp_int16);
+
+	case FR_TYPE_INT32:
+		return detail_int_write(out, vp->vp_int32);
+
+	case FR_TYPE_INT64:
+		return detail_int_write(out, vp->vp_int64);
+
+	case FR_TYPE_IPV4_ADDR:
+		ip = (uint8_t const *) &vp->vp_ipv4addr;
+		FR_SBUFF_RETURN(detail_uint_write, &our_out, ip[0]);
+		for (i = 1; i < 4; i++) {
+			FR_SBUFF_IN_CHAR_RETURN(&our_out, '.');
+			FR_SBUFF_RETURN(detail_uint_write, &our_out, ip[i]);
+		}
+		return fr_sbuff_set(out, &our_out);
+
+	case FR_TYPE_STRING:
+		/*
+		 *	Only printable ASCII which isn't special
+		 *	inside double quotes can be copied as-is.
+		 */
+		for (i = 0; i < vp->vp_length; i++) {
+			uint8_t c = vp->vp_strvalue[i];
+
+			if ((c < 0x20) || (c > 0x7e) || (c == '"') || (c == '\\') || (c == '%')) goto print;
+		}
+		FR_SBUFF_IN_CHAR_RETURN(&our_out, '"');
+		FR_SBUFF_IN_BSTRNCPY_RETURN(&our_out, vp->vp_strvalue, vp->vp_length);
+		FR_SBUFF_IN_CHAR_RETURN(&our_out, '"');
+		return fr_sbuff_set(out, &our_out);
+
+	case FR_TYPE_STRUCTURAL:
+		return fr_pair_print_value_quoted(out, vp, T_DOUBLE_QUOTED_STRING);
+
+	default:
+		break;
+	}
+
+print:
+	return fr_value_box_print_quoted(out, &vp->data, T_DOUBLE_QUOTED_STRING);
+}
+
+/** Write a single text detail line
+ *
+ * Pairs are always written with the '=' operator.
+ */
+static ssize_t detail_pair_write(fr_sbuff_t *out, rlm_detail_thread_t *t, fr_pair_t const *vp)
+{
+	fr_sbuff_t	our_out = FR_SBUFF_NO_ADVANCE(out);
+
+	if (!vp->da) return 0;
+
+	FR_SBUFF_RETURN(detail_prefix_write, &our_out, t, vp->da);
+	FR_SBUFF_RETURN(detail_value_write, &our_out, vp);
+	FR_SBUFF_IN_CHAR_RETURN(&our_out, '\n');
+
+	return fr_sbuff_set(out, &our_out);
+}
+
+/** Write a single detail entry to a file descriptor
+ *
+ * The whole entry is built in the thread's record buffer, then written
+ * with a single write().
+ *
+ * @param[in] fd Where to write entry.
  * @param[in] inst Instance of rlm_detail.
+ * @param[in] t Thread specific data.
  * @param[in] request The current request.
  * @param[in] packet associated with the request (request, reply...).
+ * @param[in] list of pairs to write.
  * @param[in] compat Write out entry in compatibility mode.
  */
-static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
+static int detail_write(int fd, rlm_detail_t const *inst, rlm_detail_thread_t *t, request_t *request,
 			fr_radius_packet_t *packet, fr_pair_list_t *list, bool compat)
 {
-	fr_pair_t *vp;
-	char timestamp[256];
-	char *header;
+	fr_sbuff_t	*out = &t->out;
+	char		timestamp[256];
+	char		*header;
 
 	if (tmpl_expand(&header, timestamp, sizeof(timestamp), request, inst->header, NULL, NULL) < 0) {
 		return -1;
@@ -251,14 +462,17 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
 		return 0;
 	}
 
-#define WRITE(fmt, ...) do {\
-	if (fprintf(out, fmt, ## __VA_ARGS__) < 0) {\
-		RERROR("Failed writing to detail file: %s", fr_syserror(errno));\
+	fr_sbuff_set_to_start(out);
+
+#define WRITE(_func, ...) do {\
+	if (_func(out, ## __VA_ARGS__) < 0) {\
+		RERROR("Failed formatting detail entry");\
 		return -1;\
 	}\
 } while(0)
 
-	WRITE("%s\n", timestamp);
+	WRITE(fr_sbuff_in_strcpy, header);
+	WRITE(fr_sbuff_in_char, '\n');
 
 	/*
 	 *	Write the information to the file.
@@ -274,11 +488,13 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
 		 *	Print out names, if they're OK.
 		 *	Numbers, if not.
 		 */
+		WRITE(fr_sbuff_in_strcpy_literal, "\tPacket-Type = ");
 		if (name) {
-			WRITE("\tPacket-Type = %s\n", name);
+			WRITE(fr_sbuff_in_strcpy, name);
 		} else {
-			WRITE("\tPacket-Type = %u\n", packet->code);
+			WRITE(detail_uint_write, packet->code);
 		}
+		WRITE(fr_sbuff_in_char, '\n');
 	}
 
 	if (inst->log_srcdst) {
@@ -308,8 +524,8 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
 			break;
 		}
 
-		detail_fr_pair_fprint(request, out, &src_vp);
-		detail_fr_pair_fprint(request, out, &dst_vp);
+		WRITE(detail_pair_write, t, &src_vp);
+		WRITE(detail_pair_write, t, &dst_vp);
 
 		src_vp.da = attr_packet_src_port;
 		fr_value_box_shallow(&src_vp.data, packet->socket.inet.src_port, true);
@@ -317,32 +533,20 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
 		dst_vp.da = attr_packet_dst_port;
 		fr_value_box_shallow(&dst_vp.data, packet->socket.inet.dst_port, true);
 
-		detail_fr_pair_fprint(request, out, &src_vp);
-		detail_fr_pair_fprint(request, out, &dst_vp);
+		WRITE(detail_pair_write, t, &src_vp);
+		WRITE(detail_pair_write, t, &dst_vp);
 	}
 
-	{
-		/* Write each attribute/value to the log file */
-		for (vp = fr_pair_list_head(list);
-		     vp;
-		     vp = fr_pair_list_next(list, vp)) {
-			fr_token_t op;
-
-			if (inst->ht && fr_hash_table_find(inst->ht, vp->da)) continue;
+	/* Write each attribute/value to the log file */
+	fr_pair_list_foreach(list, vp) {
+		if (inst->ht && fr_hash_table_find(inst->ht, vp->da)) continue;
 
-			/*
-			 *	Don't print passwords in old format...
-			 */
-			if (compat && (vp->da == attr_user_password)) continue;
+		/*
+		 *	Don't print passwords in old format...
+		 */
+		if (compat && (vp->da == attr_user_password)) continue;
 
-			/*
-			 *	Print all of the attributes, operator should always be '='.
-			 */
-			op = vp->op;
-			vp->op = T_OP_EQ;
-			fr_pair_fprint(out, vp);
-			vp->op = op;
-		}
+		WRITE(detail_pair_write, t, vp);
 	}
 
 	/*
@@ -351,13 +555,168 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
 	 *	dictionary used for decoding.
 	 */
 //	WRITE("\t%s = %s", attr_protocol->name, fr_dict_root(request->dict)->name);
-	WRITE("\tTimestamp = %lu\n", (unsigned long) fr_time_to_sec(request->packet->timestamp));
+	WRITE(fr_sbuff_in_strcpy_literal, "\tTimestamp = ");
+	WRITE(detail_uint_write, fr_time_to_sec(request->packet->timestamp));
+	WRITE(fr_sbuff_in_strcpy_literal, "\n\n");
 
-	WRITE("\n");
+	if (write(fd, fr_sbuff_start(out), fr_sbuff_used(out)) < 0) {
+		RERROR("Failed writing to detail file: %s", fr_syserror(errno));
+		return -1;
+	}
 
 	return 0;
 }
 
+/** Copy a pair allocated on the stack into a list of pairs to encode
+ *
+ */
+static void detail_binary_append(TALLOC_CTX *ctx, fr_pair_list_t *out, fr_pair_t const *stacked)
+{
+	fr_pair_t *vp;
+
+	if (!stacked->da) return;
+
+	MEM(vp = fr_pair_afrom_da(ctx, stacked->da));
+	if (fr_value_box_copy(vp, &vp->data, &stacked->data) < 0) {
+		talloc_free(vp);
+		return;
+	}
+	fr_pair_append(out, vp);
+}
+
+/** Write a single binary detail record to a file descriptor
+ *
+ * The record is written with a single write(), so a reader never sees
+ * a partial header.
+ *
+ * @param[in] fd Where to write the record.
+ * @param[in] inst Instance of rlm_detail.
+ * @param[in] request The current request.
+ * @param[in] packet associated with the request (request, reply...).
+ * @param[in] list of pairs to write.
+ * @param[in] compat Write out entry in compatibility mode.
+ */
+static int detail_write_binary(int fd, rlm_detail_t const *inst, request_t *request,
+			       fr_radius_packet_t *packet, fr_pair_list_t *list, bool compat)
+{
+	fr_dbuff_t		dbuff;
+	fr_dbuff_uctx_talloc_t	tctx;
+	fr_pair_list_t		pairs;
+	fr_pair_t		*vp;
+	ssize_t			slen;
+	uint8_t			*record;
+	size_t			payload_len;
+	int			ret = -1;
+
+	if (fr_pair_list_empty(list)) {
+		RWDEBUG("Skipping empty packet");
+		return 0;
+	}
+
+	/*
+	 *	Gather the pairs to write, applying the same
+	 *	filtering as the text format.
+	 */
+	fr_pair_list_init(&pairs);
+
+	if (!compat) {
+		fr_dict_attr_t const *da;
+
+		da = fr_dict_attr_by_name(NULL, fr_dict_root(request->dict), "Packet-Type");
+		if (da) {
+			MEM(vp = fr_pair_afrom_da(request, da));
+			vp->vp_uint32 = packet->code;
+			fr_pair_append(&pairs, vp);
+		}
+	}
+
+	if (inst->log_srcdst) {
+		fr_pair_t src_vp, dst_vp;
+
+		memset(&src_vp, 0, sizeof(src_vp));
+		memset(&dst_vp, 0, sizeof(dst_vp));
+
+		switch (packet->socket.inet.src_ipaddr.af) {
+		case AF_INET:
+			src_vp.da = attr_packet_src_ipv4_address;
+			fr_value_box_shallow(&src_vp.data, &packet->socket.inet.src_ipaddr, true);
+
+			dst_vp.da = attr_packet_dst_ipv4_address;
+			fr_value_box_shallow(&dst_vp.data, &packet->socket.inet.dst_ipaddr, true);
+			break;
+
+		case AF_INET6:
+			src_vp.da = attr_packet_src_ipv6_address;
+			fr_value_box_shallow(&src_vp.data, &packet->socket.inet.src_ipaddr, true);
+
+			dst_vp.da = attr_packet_dst_ipv6_address;
+			fr_value_box_shallow(&dst_vp.data, &packet->socket.inet.dst_ipaddr, true);
+			break;
+
+		default:
+			break;
+		}
+
+		detail_binary_append(request, &pairs, &src_vp);
+		detail_binary_append(request, &pairs, &dst_vp);
+
+		src_vp.da = attr_packet_src_port;
+		fr_value_box_shallow(&src_vp.data, packet->socket.inet.src_port, true);
+
+		dst_vp.da = attr_packet_dst_port;
+		fr_value_box_shallow(&dst_vp.data, packet->socket.inet.dst_port, true);
+
+		detail_binary_append(request, &pairs, &src_vp);
+		detail_binary_append(request, &pairs, &dst_vp);
+	}
+
+	for (vp = fr_pair_list_head(list);
+	     vp;
+	     vp = fr_pair_list_next(list, vp)) {
+		fr_pair_t *copy;
+
+		if (inst->ht && fr_hash_table_find(inst->ht, vp->da)) continue;
+		if (compat && (vp->da == attr_user_password)) continue;
+
+		MEM(copy = fr_pair_copy(request, vp));
+		copy->op = T_OP_EQ;
+		fr_pair_append(&pairs, copy);
+	}
+
+	/*
+	 *	Reserve space for the header, encode the pairs,
+	 *	then go back and fill in the header.
+	 */
+	MEM(fr_dbuff_init_talloc(request, &dbuff, &tctx, 1024, UINT32_MAX));
+	if (fr_dbuff_memset(&dbuff, 0, FR_DETAIL_HDR_LEN) < 0) {
+		RERROR("Failed allocating detail record");
+		goto finish;
+	}
+
+	slen = fr_internal_encode_list(&dbuff, &pairs, NULL);
+	if (slen < 0) {
+		RPERROR("Failed encoding detail record");
+		goto finish;
+	}
+
+	record = fr_dbuff_start(&dbuff);
+	payload_len = fr_dbuff_used(&dbuff) - FR_DETAIL_HDR_LEN;
+	fr_detail_hdr_encode(record, (uint32_t) fr_time_to_sec(request->packet->timestamp),
+			     record + FR_DETAIL_HDR_LEN, payload_len);
+
+	if (write(fd, record, fr_dbuff_used(&dbuff)) < 0) {
+		RERROR("Failed writing to detail file: %s", fr_syserror(errno));
+		goto finish;
+	}
+	ret = 0;
+
+finish:
+	fr_dbuff_free_talloc(&dbuff);
+	fr_pair_list_free(&pairs);
+
+	return ret;
+}
+
 /*
  *	Do detail, compatible with old accounting
  */
@@ -365,17 +724,16 @@ static unlang_action_t CC_HINT(nonnull) detail_do(rlm_rcode_t *p_result, module_
 						  fr_radius_packet_t *packet, fr_pair_list_t *list,
 						  bool compat)
 {
-	int		outfd, dupfd;
+	int		outfd;
 	char		buffer[DIRLEN];
 
-	FILE		*outfp;
-
 #ifdef HAVE_GRP_H
 	gid_t		gid;
 	char		*endptr;
 #endif
 
-	rlm_detail_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_detail_t);
+	rlm_detail_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_detail_t);
+	rlm_detail_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_detail_thread_t);
 
 	/*
 	 *	Generate the path for the detail file.  Use the same
@@ -410,30 +768,21 @@ static unlang_action_t CC_HINT(nonnull) detail_do(rlm_rcode_t *p_result, module_
 	}
 
 skip_group:
-	outfp = NULL;
-	dupfd = dup(outfd);
-	if (dupfd < 0) {
-		RERROR("Failed to dup() file descriptor for detail file");
-		goto fail;
+	if (inst->format == DETAIL_FORMAT_BINARY) {
+		if (detail_write_binary(outfd, inst, request, packet, list, compat) < 0) {
+			exfile_close(inst->ef, request, outfd);
+			RETURN_MODULE_FAIL;
+		}
+
+		exfile_close(inst->ef, request, outfd);
+		RETURN_MODULE_OK;
 	}
 
-	/*
-	 *	Open the output fp for buffering.
-	 */
-	if ((outfp = fdopen(dupfd, "a")) == NULL) {
-		RERROR("Couldn't open file %s: %s", buffer, fr_syserror(errno));
-	fail:
-		if (outfp) fclose(outfp);
+	if (detail_write(outfd, inst, t, request, packet, list, compat) < 0) {
 		exfile_close(inst->ef, request, outfd);
 		RETURN_MODULE_FAIL;
 	}
 
-	if (detail_write(outfp, inst, request, packet, list, compat) < 0) goto fail;
-
-	/*
-	 *	Flush everything
-	 */
-	fclose(outfp);
 	exfile_close(inst->ef, request, outfd);
 
 	/*
@@ -442,6 +791,17 @@ skip_group:
 	RETURN_MODULE_OK;
 }
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, UNUSED void *instance,
+				  UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_detail_thread_t	*t = talloc_get_type_abort(thread, rlm_detail_thread_t);
+
+	MEM(t->prefixes = fr_hash_table_alloc(t, detail_prefix_hash, detail_prefix_cmp, NULL));
+	MEM(fr_sbuff_init_talloc(t, &t->out, &t->tctx, 4096, SIZE_MAX));
+
+	return 0;
+}
+
 /*
  *	Accounting - write the detail files.
  */
@@ -473,8 +833,10 @@ module_t rlm_detail = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "detail",
 	.inst_size	= sizeof(rlm_detail_t),
+	.thread_inst_size	= sizeof(rlm_detail_thread_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
 		[MOD_PREACCT]		= mod_accounting,
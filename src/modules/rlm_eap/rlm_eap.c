@@ -61,6 +61,12 @@ static fr_table_num_sorted_t const require_identity_realm_table[] = {
 };
 static size_t require_identity_realm_table_len = NUM_ELEMENTS(require_identity_realm_table);
 
+static const CONF_PARSER worker_sessions_config[] = {
+	{ FR_CONF_OFFSET("enable", FR_TYPE_BOOL, rlm_eap_t, worker_sessions), .dflt = "no" },
+	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, rlm_eap_t, worker_session_timeout), .dflt = "30" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("require_identity_realm", FR_TYPE_VOID, rlm_eap_t, require_realm),
 			 .func = cf_table_parse_int,
@@ -74,6 +80,8 @@ static const CONF_PARSER module_config[] = {
 
 	{ FR_CONF_OFFSET("ignore_unknown_eap_types", FR_TYPE_BOOL, rlm_eap_t, ignore_unknown_types), .dflt = "no" },
 
+	{ FR_CONF_POINTER("worker_sessions", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) worker_sessions_config },
+
 	{ FR_CONF_DEPRECATED("timer_expire", FR_TYPE_UINT32, rlm_eap_t, timer_limit), .dflt = "60" },
 	{ FR_CONF_DEPRECATED("cisco_accounting_username_bug", FR_TYPE_BOOL, rlm_eap_t,
 			     cisco_accounting_username_bug), .dflt = "no" },
@@ -812,6 +820,7 @@ static unlang_action_t eap_method_select(rlm_rcode_t *p_result, module_ctx_t con
 static unlang_action_t mod_authenticate(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_eap_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_eap_t);
+	rlm_eap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_eap_thread_t);
 	eap_session_t		*eap_session;
 	eap_packet_raw_t	*eap_packet;
 	unlang_action_t		ua;
@@ -838,7 +847,7 @@ static unlang_action_t mod_authenticate(rlm_rcode_t *p_result, module_ctx_t cons
 	 *	retrieve the existing eap_session from the request
 	 *	data.
 	 */
-	eap_session = eap_session_continue(inst, &eap_packet, request);
+	eap_session = eap_session_continue(inst, t->sessions, &eap_packet, request);
 	if (!eap_session) RETURN_MODULE_INVALID;	/* Don't emit error here, it will mask the real issue */
 
 	/*
@@ -925,6 +934,7 @@ static unlang_action_t mod_authorize(rlm_rcode_t *p_result, module_ctx_t const *
 static unlang_action_t mod_post_auth(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_eap_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_eap_t);
+	rlm_eap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_eap_thread_t);
 	fr_pair_t		*vp;
 	eap_session_t		*eap_session;
 	fr_pair_t		*username;
@@ -967,7 +977,7 @@ static unlang_action_t mod_post_auth(rlm_rcode_t *p_result, module_ctx_t const *
 	 *	data.  This will have been added to the request
 	 *	data by the state API.
 	 */
-	eap_session = eap_session_thaw(request);
+	eap_session = eap_session_thaw(request, t->sessions);
 	if (!eap_session) {
 		RDEBUG3("Failed to get eap_session, probably already removed, not inserting EAP-Failure");
 		RETURN_MODULE_NOOP;
@@ -1133,6 +1143,32 @@ static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 	return 0;
 }
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance,
+				  UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_eap_t const		*inst = talloc_get_type_abort(instance, rlm_eap_t);
+	rlm_eap_thread_t	*t = talloc_get_type_abort(thread, rlm_eap_thread_t);
+
+	if (!inst->worker_sessions) return 0;
+
+	t->sessions = eap_session_table_alloc(t, inst->worker_session_timeout);
+	if (!t->sessions) {
+		ERROR("Failed allocating EAP session table");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_eap_thread_t	*t = talloc_get_type_abort(thread, rlm_eap_thread_t);
+
+	TALLOC_FREE(t->sessions);
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	rlm_eap_t	instance = { .name = "global" };
@@ -1163,6 +1199,10 @@ module_t rlm_eap = {
 	.unload		= mod_unload,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.thread_inst_size	= sizeof(rlm_eap_thread_t),
+	.thread_inst_type	= "rlm_eap_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize,
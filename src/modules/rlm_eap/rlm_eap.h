@@ -69,8 +69,20 @@ typedef struct {
 	fr_dict_enum_t			*auth_type;
 
 	fr_randctx			rand_pool;			//!< Pool of random data.
+
+	bool				worker_sessions;		//!< Park sessions in a per-worker table
+									///< between rounds.
+	fr_time_delta_t			worker_session_timeout;		//!< How long sessions may be parked for.
 } rlm_eap_t;
 
+/** Thread specific data for rlm_eap
+ *
+ */
+typedef struct {
+	eap_session_table_t		*sessions;			//!< Sessions waiting for their next round.
+									///< NULL if worker_sessions is disabled.
+} rlm_eap_thread_t;
+
 /*
  *	EAP Method selection
  */
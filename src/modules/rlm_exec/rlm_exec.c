@@ -31,6 +31,11 @@ RCSID("$Id$")
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/unlang/interpret.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <signal.h>
+#include <sys/wait.h>
 
 /*
  *	Define a structure for our module configuration.
@@ -47,9 +52,22 @@ typedef struct {
 	fr_time_delta_t		timeout;
 	bool			timeout_is_set;
 
+	struct {
+		char const	*program;	//!< Helper to start, with its arguments.
+		uint32_t	children;	//!< Helpers to start per worker thread.
+		uint32_t	max_requests;	//!< Restart a helper after this many requests.
+	} helper;
+
 	tmpl_t	*tmpl;
 } rlm_exec_t;
 
+static const CONF_PARSER helper_config[] = {
+	{ FR_CONF_OFFSET("program", FR_TYPE_STRING, rlm_exec_t, helper.program) },
+	{ FR_CONF_OFFSET("children", FR_TYPE_UINT32, rlm_exec_t, helper.children), .dflt = "2" },
+	{ FR_CONF_OFFSET("max_requests", FR_TYPE_UINT32, rlm_exec_t, helper.max_requests), .dflt = "0" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("wait", FR_TYPE_BOOL, rlm_exec_t, wait), .dflt = "yes" },
 	{ FR_CONF_OFFSET("program", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_exec_t, program) },
@@ -57,6 +75,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("output_pairs", FR_TYPE_STRING, rlm_exec_t, output) },
 	{ FR_CONF_OFFSET("shell_escape", FR_TYPE_BOOL, rlm_exec_t, shell_escape), .dflt = "yes" },
 	{ FR_CONF_OFFSET_IS_SET("timeout", FR_TYPE_TIME_DELTA, rlm_exec_t, timeout) },
+	{ FR_CONF_POINTER("helper", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) helper_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -207,6 +226,21 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	if (inst->helper.program) {
+		if (inst->program) {
+			cf_log_err(conf, "Cannot set both 'program' and 'helper.program'");
+			return -1;
+		}
+
+		if (!inst->wait) {
+			cf_log_err(conf, "Cannot use a helper if wait = no");
+			return -1;
+		}
+
+		FR_INTEGER_BOUND_CHECK("helper.children", inst->helper.children, >=, 1);
+		FR_INTEGER_BOUND_CHECK("helper.children", inst->helper.children, <=, 64);
+	}
+
 	if (!inst->timeout_is_set || !inst->timeout) {
 		/*
 		 *	Pick the shorter one
@@ -367,31 +401,41 @@ static rlm_rcode_t rlm_exec_status2rcode(request_t *request, fr_value_box_t *box
 	return rcode;
 }
 
-static unlang_action_t mod_exec_wait_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
-					    request_t *request, void *rctx)
+/** Add the pairs output by a program to the output list
+ *
+ * @param request	Current request.
+ * @param inst		Module instance.
+ * @param box		Output from the program.  Consumed.
+ */
+static void exec_output_pairs(request_t *request, rlm_exec_t const *inst, fr_value_box_list_t *box)
 {
-	int			status;
-	rlm_exec_ctx_t		*m = talloc_get_type_abort(rctx, rlm_exec_ctx_t);
-	rlm_exec_t const       	*inst = talloc_get_type_abort_const(mctx->instance, rlm_exec_t);
+	TALLOC_CTX	*ctx;
+	fr_pair_list_t	vps, *output_pairs;
 
-	if (inst->output && !fr_dlist_empty(&m->box)) {
-		TALLOC_CTX *ctx;
-		fr_pair_list_t vps, *output_pairs;
-		fr_value_box_t *box = fr_dlist_head(&m->box);
+	if (fr_dlist_empty(box)) return;
 
-		RDEBUG("EXEC GOT -- %pM", &m->box);
+	RDEBUG("EXEC GOT -- %pM", box);
 
-		fr_pair_list_init(&vps);
-		output_pairs = tmpl_list_head(request, inst->output_list);
-		fr_assert(output_pairs != NULL);
+	fr_pair_list_init(&vps);
+	output_pairs = tmpl_list_head(request, inst->output_list);
+	fr_assert(output_pairs != NULL);
 
-		ctx = tmpl_list_ctx(request, inst->output_list);
+	ctx = tmpl_list_ctx(request, inst->output_list);
 
-		fr_pair_list_afrom_box(ctx, &vps, request->dict, box);
-		if (!fr_pair_list_empty(&vps)) fr_pair_list_move(output_pairs, &vps, T_OP_ADD);
+	fr_pair_list_afrom_box(ctx, &vps, request->dict, fr_dlist_head(box));
+	if (!fr_pair_list_empty(&vps)) fr_pair_list_move(output_pairs, &vps, T_OP_ADD);
 
-		fr_dlist_talloc_free(&m->box);	/* has been consumed */
-	}
+	fr_dlist_talloc_free(box);	/* has been consumed */
+}
+
+static unlang_action_t mod_exec_wait_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					    request_t *request, void *rctx)
+{
+	int			status;
+	rlm_exec_ctx_t		*m = talloc_get_type_abort(rctx, rlm_exec_ctx_t);
+	rlm_exec_t const       	*inst = talloc_get_type_abort_const(mctx->instance, rlm_exec_t);
+
+	if (inst->output) exec_output_pairs(request, inst, &m->box);
 
 	status = m->status;
 
@@ -407,6 +451,575 @@ static unlang_action_t mod_exec_wait_resume(rlm_rcode_t *p_result, module_ctx_t
 	RETURN_MODULE_RCODE(rlm_exec_status2rcode(request, fr_dlist_head(&m->box), status));
 }
 
+/*
+ *	Persistent helpers
+ *
+ *	Instead of forking a program for every request, each worker
+ *	thread keeps a number of long running helper processes.
+ *
+ *	For each request, the input pairs are written to a helper's
+ *	stdin, one per line, followed by an empty line.  The helper
+ *	writes its status code (as for the exit status of a program)
+ *	on one line, then any output pairs one per line, followed by an
+ *	empty line.
+ *
+ *	Each helper processes one request at a time.  Requests which
+ *	arrive when all the helpers are busy are queued until one is
+ *	idle.
+ */
+#define EXEC_HELPER_MAX_RESPONSE	(32 * 1024)
+
+typedef struct rlm_exec_thread_s rlm_exec_thread_t;
+typedef struct rlm_exec_helper_call_s rlm_exec_helper_call_t;
+
+/** A long running helper process
+ *
+ */
+typedef struct {
+	rlm_exec_thread_t	*thread;	//!< Thread which owns this helper.
+
+	pid_t			pid;		//!< Of the helper, 0 if it's not running.
+	int			to_child;	//!< For writing queries.
+	int			from_child;	//!< For reading responses.
+	bool			writing;	//!< Waiting for to_child to be writable.
+	fr_event_pid_t const	*ev_pid;	//!< Tells us when the helper exits.
+
+	rlm_exec_helper_call_t	*call;		//!< Call being processed, NULL if idle.
+	bool			discard;	//!< Discard the next response, as its call was cancelled.
+	uint32_t		uses;		//!< Responses read from this helper.
+
+	char			buff[EXEC_HELPER_MAX_RESPONSE];	//!< Response being read.
+	size_t			used;		//!< How much of the buffer has been read.
+} rlm_exec_helper_t;
+
+struct rlm_exec_thread_s {
+	rlm_exec_t const	*inst;		//!< Module instance.
+	fr_event_list_t		*el;		//!< This thread's event list.
+
+	rlm_exec_helper_t	**helpers;	//!< Array of inst->helper.children helpers.
+	fr_dlist_head_t		queue;		//!< Calls waiting for an idle helper.
+};
+
+/** A call to a helper
+ *
+ */
+struct rlm_exec_helper_call_s {
+	fr_dlist_t		entry;		//!< Entry in the queue of calls waiting for a helper.
+
+	rlm_exec_thread_t	*thread;	//!< Thread making the call.
+	request_t		*request;	//!< Request the call is for.
+	rlm_exec_helper_t	*helper;	//!< Processing the call, NULL if it's queued or done.
+	fr_event_timer_t const	*ev;		//!< For timing out the call.
+
+	char			*query;		//!< Input pairs, terminated by an empty line.
+	size_t			query_len;	//!< Length of the query.
+	size_t			written;	//!< How much of the query has been written.
+
+	bool			failed;		//!< The helper died, or timed out, or sent garbage.
+	int			status;		//!< Status code from the helper.
+	fr_value_box_list_t	box;		//!< Output pairs from the helper.
+};
+
+static void exec_helper_dispatch(rlm_exec_thread_t *t);
+
+/** Resume the request a call was made for, after it completed or failed
+ *
+ */
+static void exec_helper_call_done(rlm_exec_helper_call_t *call, bool failed)
+{
+	call->helper = NULL;
+	call->failed = failed;
+
+	fr_event_timer_delete(&call->ev);
+	unlang_interpret_mark_runnable(call->request);
+}
+
+/** Kill a helper, failing any call it's processing
+ *
+ * The helper will be restarted when it's next needed.
+ */
+static void exec_helper_kill(rlm_exec_helper_t *helper)
+{
+	rlm_exec_thread_t	*t = helper->thread;
+
+	if (helper->to_child >= 0) {
+		if (helper->writing) (void) fr_event_fd_delete(t->el, helper->to_child, FR_EVENT_FILTER_IO);
+		close(helper->to_child);
+		helper->to_child = -1;
+		helper->writing = false;
+	}
+
+	if (helper->from_child >= 0) {
+		(void) fr_event_fd_delete(t->el, helper->from_child, FR_EVENT_FILTER_IO);
+		close(helper->from_child);
+		helper->from_child = -1;
+	}
+
+	if (helper->ev_pid) {
+		talloc_const_free(helper->ev_pid);
+		helper->ev_pid = NULL;
+	}
+
+	if (helper->pid > 0) {
+		int status;
+
+		kill(helper->pid, SIGKILL);
+
+		/*
+		 *	Reap the helper in the background if it hasn't
+		 *	exited yet.
+		 */
+		if (waitpid(helper->pid, &status, WNOHANG) != helper->pid) {
+			(void) fr_event_pid_wait(t, t->el, NULL, helper->pid, NULL, NULL);
+		}
+		helper->pid = 0;
+	}
+
+	helper->used = 0;
+	helper->discard = false;
+
+	if (helper->call) {
+		exec_helper_call_done(helper->call, true);
+		helper->call = NULL;
+	}
+}
+
+/** Called when a helper exits
+ *
+ */
+static void exec_helper_exited(UNUSED fr_event_list_t *el, pid_t pid, int status, void *uctx)
+{
+	rlm_exec_helper_t	*helper = talloc_get_type_abort(uctx, rlm_exec_helper_t);
+	rlm_exec_t const	*inst = helper->thread->inst;
+
+	helper->ev_pid = NULL;
+	helper->pid = 0;	/* Already reaped */
+
+	if (WIFEXITED(status)) {
+		ERROR("Helper %u exited with status code %d", pid, WEXITSTATUS(status));
+	} else if (WIFSIGNALED(status)) {
+		ERROR("Helper %u exited due to signal %d", pid, WTERMSIG(status));
+	} else {
+		ERROR("Helper %u exited", pid);
+	}
+
+	if (helper->call) {
+		request_t *request = helper->call->request;
+
+		REDEBUG("Helper exited while processing the request");
+	}
+
+	exec_helper_kill(helper);
+}
+
+static void exec_helper_writable(fr_event_list_t *el, int fd, int flags, void *uctx);
+
+/** Write as much of the current query as the helper will accept
+ *
+ */
+static void exec_helper_write(rlm_exec_helper_t *helper)
+{
+	rlm_exec_thread_t	*t = helper->thread;
+	rlm_exec_t const	*inst = t->inst;
+	rlm_exec_helper_call_t	*call = helper->call;
+	ssize_t			slen;
+
+	while (call->written < call->query_len) {
+		slen = write(helper->to_child, call->query + call->written, call->query_len - call->written);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				if (helper->writing) return;
+
+				if (fr_event_fd_insert(helper, t->el, helper->to_child,
+						       NULL, exec_helper_writable, NULL, helper) < 0) {
+					PERROR("Failed adding event listening for helper %u to be writable", helper->pid);
+					exec_helper_kill(helper);
+					return;
+				}
+				helper->writing = true;
+				return;
+			}
+
+			ERROR("Failed writing to helper %u - %s", helper->pid, fr_syserror(errno));
+			exec_helper_kill(helper);
+			return;
+		}
+
+		call->written += slen;
+	}
+
+	if (helper->writing) {
+		(void) fr_event_fd_delete(t->el, helper->to_child, FR_EVENT_FILTER_IO);
+		helper->writing = false;
+	}
+}
+
+static void exec_helper_writable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	exec_helper_write(talloc_get_type_abort(uctx, rlm_exec_helper_t));
+}
+
+/** Parse a complete response from a helper, and resume the request it was for
+ *
+ */
+static void exec_helper_response(rlm_exec_helper_t *helper, size_t len)
+{
+	rlm_exec_helper_call_t	*call = helper->call;
+	request_t		*request = call->request;
+	char			*p, *end;
+	unsigned long		status;
+
+	/*
+	 *	First line is the status code
+	 */
+	end = helper->buff + len;
+	status = strtoul(helper->buff, &p, 10);
+	if ((p == helper->buff) || (*p != '\n')) {
+		REDEBUG("Helper %u sent an invalid status line", helper->pid);
+		exec_helper_kill(helper);
+		return;
+	}
+	p++;
+
+	call->status = (status > INT_MAX) ? INT_MAX : (int)status;
+
+	/*
+	 *	Everything up to the empty line is output pairs.
+	 */
+	if (p < (end - 2)) {
+		fr_value_box_t	*vb;
+
+		MEM(vb = fr_value_box_alloc_null(call));
+		if (fr_value_box_bstrndup(vb, vb, NULL, p, (end - 2) - p, true) < 0) {
+			talloc_free(vb);
+			exec_helper_kill(helper);
+			return;
+		}
+		fr_dlist_insert_tail(&call->box, vb);
+	}
+
+	RDEBUG3("Helper %u responded with status %d", helper->pid, call->status);
+
+	helper->call = NULL;
+	exec_helper_call_done(call, false);
+}
+
+/** Read a response from a helper
+ *
+ */
+static void exec_helper_read(UNUSED fr_event_list_t *el, int fd, int flags, void *uctx)
+{
+	rlm_exec_helper_t	*helper = talloc_get_type_abort(uctx, rlm_exec_helper_t);
+	rlm_exec_thread_t	*t = helper->thread;
+	rlm_exec_t const	*inst = t->inst;
+	char			*end;
+	size_t			len;
+	ssize_t			slen;
+
+	for (;;) {
+		if (helper->used == sizeof(helper->buff)) {
+			ERROR("Helper %u sent too much output - killing it", helper->pid);
+			goto error;
+		}
+
+		slen = read(fd, helper->buff + helper->used, sizeof(helper->buff) - helper->used);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+
+			ERROR("Failed reading from helper %u - %s", helper->pid, fr_syserror(errno));
+			goto error;
+		}
+
+		if (slen == 0) {
+			ERROR("Helper %u closed its output - killing it", helper->pid);
+		error:
+			exec_helper_kill(helper);
+			exec_helper_dispatch(t);
+			return;
+		}
+
+		helper->used += slen;
+	}
+
+	/*
+	 *	Responses are terminated by an empty line.
+	 */
+	end = memmem(helper->buff, helper->used, "\n\n", 2);
+	if (!end) {
+		if (flags & EV_EOF) {
+			ERROR("Helper %u closed its output - killing it", helper->pid);
+			goto error;
+		}
+		return;
+	}
+	len = (end - helper->buff) + 2;
+
+	/*
+	 *	We only send one query at a time, so the helper
+	 *	shouldn't send anything more.
+	 */
+	if (len != helper->used) {
+		ERROR("Helper %u sent more than one response - killing it", helper->pid);
+		goto error;
+	}
+
+	if (helper->discard) {
+		helper->discard = false;
+
+	} else if (!helper->call) {
+		ERROR("Helper %u sent a response when there was no query - killing it", helper->pid);
+		goto error;
+
+	} else {
+		exec_helper_response(helper, len);
+		if (helper->pid == 0) {	/* Killed because the response was bad */
+			exec_helper_dispatch(t);
+			return;
+		}
+	}
+	helper->used = 0;
+
+	/*
+	 *	Retire helpers which have answered enough queries.
+	 */
+	if (inst->helper.max_requests && (++helper->uses >= inst->helper.max_requests)) {
+		DEBUG2("Helper %u has answered %u queries, restarting it", helper->pid, helper->uses);
+		exec_helper_kill(helper);
+	}
+
+	exec_helper_dispatch(t);
+}
+
+/** Start a helper
+ *
+ */
+static int exec_helper_start(rlm_exec_helper_t *helper)
+{
+	rlm_exec_thread_t	*t = helper->thread;
+	rlm_exec_t const	*inst = t->inst;
+	pid_t			pid;
+
+	pid = radius_start_program(&helper->to_child, &helper->from_child, NULL,
+				   inst->helper.program, NULL, true, NULL, false);
+	if (pid < 0) {
+		ERROR("Failed starting helper \"%s\"", inst->helper.program);
+		return -1;
+	}
+	helper->pid = pid;
+	helper->uses = 0;
+	helper->used = 0;
+
+	if ((fr_nonblock(helper->to_child) < 0) || (fr_nonblock(helper->from_child) < 0)) {
+		PERROR("Failed setting helper %u's pipes to non-blocking", pid);
+	error:
+		exec_helper_kill(helper);
+		return -1;
+	}
+
+	if (fr_event_fd_insert(helper, t->el, helper->from_child, exec_helper_read, NULL, NULL, helper) < 0) {
+		PERROR("Failed adding event listening to helper %u", pid);
+		goto error;
+	}
+
+	if (fr_event_pid_wait(helper, t->el, &helper->ev_pid, pid, exec_helper_exited, helper) < 0) {
+		PERROR("Failed adding watcher for helper %u", pid);
+		goto error;
+	}
+
+	/*
+	 *	The helper exited before we could wait for it
+	 */
+	if (helper->pid == 0) return -1;
+
+	DEBUG2("Started helper %u", pid);
+
+	return 0;
+}
+
+/** Give queued calls to idle helpers, starting helpers if necessary
+ *
+ */
+static void exec_helper_dispatch(rlm_exec_thread_t *t)
+{
+	rlm_exec_helper_call_t	*call;
+	uint32_t		i;
+
+	while (fr_dlist_num_elements(&t->queue) > 0) {
+		rlm_exec_helper_t	*helper = NULL, *stopped = NULL;
+
+		for (i = 0; i < t->inst->helper.children; i++) {
+			if (t->helpers[i]->pid == 0) {
+				if (!stopped) stopped = t->helpers[i];
+				continue;
+			}
+
+			if (!t->helpers[i]->call && !t->helpers[i]->discard) {
+				helper = t->helpers[i];
+				break;
+			}
+		}
+
+		if (!helper) {
+			/*
+			 *	Calls will time out if we can't
+			 *	start a helper.
+			 */
+			if (!stopped || (exec_helper_start(stopped) < 0)) return;
+			helper = stopped;
+		}
+
+		call = fr_dlist_pop_head(&t->queue);
+		call->helper = helper;
+		call->written = 0;
+		helper->call = call;
+
+		exec_helper_write(helper);
+	}
+}
+
+/** Called if a call takes too long
+ *
+ */
+static void exec_helper_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_exec_helper_call_t	*call = talloc_get_type_abort(uctx, rlm_exec_helper_call_t);
+	request_t		*request = call->request;
+
+	if (!call->helper) {
+		REDEBUG("Timeout waiting for an idle helper - failing the request");
+		fr_dlist_remove(&call->thread->queue, call);
+		exec_helper_call_done(call, true);
+		return;
+	}
+
+	REDEBUG("Timeout waiting for helper %u to respond - killing it and failing the request", call->helper->pid);
+	exec_helper_kill(call->helper);
+	exec_helper_dispatch(call->thread);
+}
+
+/** Remove a call from its helper or the queue, if it's cancelled
+ *
+ */
+static int _exec_helper_call_free(rlm_exec_helper_call_t *call)
+{
+	rlm_exec_helper_t	*helper = call->helper;
+
+	fr_dlist_remove(&call->thread->queue, call);
+
+	if (!helper) return 0;
+
+	helper->call = NULL;
+	call->helper = NULL;
+
+	/*
+	 *	The helper still has part of our query to read,
+	 *	and the query is about to be freed.
+	 */
+	if (call->written < call->query_len) {
+		exec_helper_kill(helper);
+		return 0;
+	}
+
+	/*
+	 *	Keep the helper, but ignore its response.
+	 */
+	helper->discard = true;
+
+	return 0;
+}
+
+static unlang_action_t mod_exec_helper_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					      request_t *request, void *rctx)
+{
+	rlm_exec_helper_call_t	*call = talloc_get_type_abort(rctx, rlm_exec_helper_call_t);
+	rlm_exec_t const       	*inst = talloc_get_type_abort_const(mctx->instance, rlm_exec_t);
+	rlm_rcode_t		rcode;
+
+	if (call->failed) {
+		talloc_free(call);
+		RETURN_MODULE_FAIL;
+	}
+
+	if (inst->output) exec_output_pairs(request, inst, &call->box);
+
+	rcode = rlm_exec_status2rcode(request, fr_dlist_head(&call->box), call->status);
+	talloc_free(call);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+static void mod_exec_helper_signal(UNUSED module_ctx_t const *mctx, UNUSED request_t *request,
+				   void *rctx, fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	talloc_free(rctx);
+}
+
+/** Send the input pairs to a helper
+ *
+ */
+static unlang_action_t mod_exec_helper(rlm_rcode_t *p_result, rlm_exec_t const *inst,
+				       rlm_exec_thread_t *t, request_t *request)
+{
+	rlm_exec_helper_call_t	*call;
+	fr_pair_list_t		*input_pairs = NULL;
+	fr_pair_t		*vp;
+	fr_sbuff_t		sbuff;
+	fr_sbuff_uctx_talloc_t	tctx;
+
+	if (inst->input) {
+		input_pairs = tmpl_list_head(request, inst->input_list);
+		if (!input_pairs) RETURN_MODULE_INVALID;
+	}
+
+	if (inst->output) {
+		if (!tmpl_list_head(request, inst->output_list)) RETURN_MODULE_INVALID;
+	}
+
+	MEM(call = talloc_zero(request, rlm_exec_helper_call_t));
+	call->thread = t;
+	call->request = request;
+	fr_value_box_list_init(&call->box);
+	talloc_set_destructor(call, _exec_helper_call_free);
+
+	/*
+	 *	One pair per line, then an empty line.
+	 */
+	fr_sbuff_init_talloc(call, &sbuff, &tctx, 1024, SIZE_MAX);
+	if (input_pairs) {
+		for (vp = fr_pair_list_head(input_pairs);
+		     vp;
+		     vp = fr_pair_list_next(input_pairs, vp)) {
+			if ((fr_pair_print(&sbuff, NULL, vp) < 0) ||
+			    (fr_sbuff_in_char(&sbuff, '\n') < 0)) {
+			fail:
+				REDEBUG("Failed creating query for helper");
+				talloc_free(call);
+				RETURN_MODULE_FAIL;
+			}
+		}
+	}
+	if (fr_sbuff_in_char(&sbuff, '\n') < 0) goto fail;
+
+	call->query = fr_sbuff_buff(&sbuff);
+	call->query_len = fr_sbuff_used(&sbuff);
+
+	if (fr_event_timer_in(call, t->el, &call->ev, inst->timeout, exec_helper_timeout, call) < 0) {
+		RPEDEBUG("Failed adding timeout for helper");
+		talloc_free(call);
+		RETURN_MODULE_FAIL;
+	}
+
+	fr_dlist_insert_tail(&t->queue, call);
+	exec_helper_dispatch(t);
+
+	return unlang_module_yield(request, mod_exec_helper_resume, mod_exec_helper_signal, call);
+}
+
 /*
  *  Dispatch an async exec method
  */
@@ -417,6 +1030,10 @@ static unlang_action_t CC_HINT(nonnull) mod_exec_dispatch(rlm_rcode_t *p_result,
 	fr_pair_list_t		*env_pairs = NULL;
 	TALLOC_CTX		*ctx;
 
+	if (inst->helper.program) {
+		return mod_exec_helper(p_result, inst, talloc_get_type_abort(mctx->thread, rlm_exec_thread_t), request);
+	}
+
 	if (!inst->tmpl) {
 		RDEBUG("This module requires 'program' to be set.");
 		RETURN_MODULE_FAIL;
@@ -457,6 +1074,57 @@ static unlang_action_t CC_HINT(nonnull) mod_exec_dispatch(rlm_rcode_t *p_result,
 }
 
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  fr_event_list_t *el, void *thread)
+{
+	rlm_exec_t		*inst = talloc_get_type_abort(instance, rlm_exec_t);
+	rlm_exec_thread_t	*t = talloc_get_type_abort(thread, rlm_exec_thread_t);
+	uint32_t		i;
+
+	t->inst = inst;
+	t->el = el;
+	fr_dlist_talloc_init(&t->queue, rlm_exec_helper_call_t, entry);
+
+	if (!inst->helper.program) return 0;
+
+	/*
+	 *	Helpers are started when they're first needed,
+	 *	so a broken helper doesn't stop the server
+	 *	from starting.
+	 */
+	MEM(t->helpers = talloc_array(t, rlm_exec_helper_t *, inst->helper.children));
+	for (i = 0; i < inst->helper.children; i++) {
+		MEM(t->helpers[i] = talloc_zero(t->helpers, rlm_exec_helper_t));
+		t->helpers[i]->thread = t;
+		t->helpers[i]->to_child = -1;
+		t->helpers[i]->from_child = -1;
+	}
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_exec_thread_t	*t = talloc_get_type_abort(thread, rlm_exec_thread_t);
+	uint32_t		i;
+
+	if (!t->helpers) return 0;
+
+	for (i = 0; i < t->inst->helper.children; i++) {
+		rlm_exec_helper_t *helper = t->helpers[i];
+
+		if (helper->pid > 0) {
+			pid_t pid = helper->pid;
+
+			exec_helper_kill(helper);
+			(void) waitpid(pid, NULL, 0);
+		}
+	}
+	TALLOC_FREE(t->helpers);
+
+	return 0;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -472,9 +1140,12 @@ module_t rlm_exec = {
 	.name		= "exec",
 	.type		= RLM_TYPE_THREAD_SAFE,
 	.inst_size	= sizeof(rlm_exec_t),
+	.thread_inst_size	= sizeof(rlm_exec_thread_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_exec_dispatch,
 		[MOD_AUTHORIZE]		= mod_exec_dispatch,
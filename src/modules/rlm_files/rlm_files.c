@@ -33,35 +33,78 @@ RCSID("$Id$")
 #include <ctype.h>
 #include <fcntl.h>
 
+/** Entries in a DEFAULT list which require one value of an attribute
+ *
+ */
+typedef struct {
+	fr_value_box_t		value;		//!< Which the check item compares the attribute with.
+	uint64_t		*entries;	//!< Bitset of entries requiring this value.
+} files_index_value_t;
+
+/** DEFAULT entries indexed by an "&request.Attr == value" check item
+ *
+ */
+typedef struct {
+	fr_dict_attr_t const	*da;		//!< Request attribute the entries are indexed by.
+	fr_hash_table_t		*values;	//!< files_index_value_t, by value.
+	uint64_t		*entries;	//!< Bitset of all entries indexed by this attribute.
+} files_index_attr_t;
+
+/** An index of a DEFAULT list, so we only evaluate entries which can match
+ *
+ * Each entry is indexed by the first check item which requires a request
+ * attribute to have a particular value.  An entry whose attribute has
+ * none of the values it requires can't match, so it's skipped.  The other
+ * entries are evaluated in order as before, so the first match is the same.
+ */
+typedef struct {
+	PAIR_LIST const		**entries;	//!< DEFAULT entries, in order.
+	size_t			num_entries;	//!< How many entries there are.
+	size_t			num_words;	//!< Length of each bitset.
+	uint64_t		*unindexed;	//!< Bitset of entries with no check item we can index.
+	files_index_attr_t	*attrs;		//!< Indexed attributes, a talloc array.
+} files_index_t;
+
+/** The entries read from one users file
+ *
+ */
+typedef struct {
+	fr_htrie_t		*tree;		//!< Entries keyed by name.  NULL if there's no file.
+	PAIR_LIST_LIST		*def;		//!< DEFAULT entries.
+	files_index_t		*def_index;	//!< Of the DEFAULT entries.
+} rlm_files_table_t;
+
+/** Everything read from the users files
+ *
+ * Replaced as a whole when the files are reloaded.
+ */
+typedef struct {
+	rlm_files_table_t	common;
+	rlm_files_table_t	users;		//!< autz
+	rlm_files_table_t	auth_users;	//!< authenticate
+	rlm_files_table_t	acct_users;	//!< preacct
+	rlm_files_table_t	postauth_users;	//!< post-authenticate
+} rlm_files_data_t;
+
 typedef struct {
 	tmpl_t *key;
 	fr_type_t	key_data_type;
 
 	char const *filename;
-	fr_htrie_t *common;
-	PAIR_LIST_LIST *common_def;
-
-	/* autz */
 	char const *usersfile;
-	fr_htrie_t *users;
-	PAIR_LIST_LIST *users_def;
-
-	/* authenticate */
 	char const *auth_usersfile;
-	fr_htrie_t *auth_users;
-	PAIR_LIST_LIST *auth_users_def;
-
-	/* preacct */
 	char const *acct_usersfile;
-	fr_htrie_t *acct_users;
-	PAIR_LIST_LIST *acct_users_def;
-
-	/* post-authenticate */
 	char const *postauth_usersfile;
-	fr_htrie_t *postauth_users;
-	PAIR_LIST_LIST *postauth_users_def;
+
+	fr_time_delta_t	reload_interval;	//!< How often to check the files for changes.
+
+	fr_reload_t	*reload;		//!< Reloads the files, and publishes #rlm_files_data_t.
 } rlm_files_t;
 
+typedef struct {
+	fr_reload_reader_t	*reader;	//!< Of the current #rlm_files_data_t.
+} rlm_files_thread_t;
+
 static fr_dict_t const *dict_freeradius;
 static fr_dict_t const *dict_radius;
 
@@ -91,6 +134,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("auth_usersfile", FR_TYPE_FILE_INPUT, rlm_files_t, auth_usersfile) },
 	{ FR_CONF_OFFSET("postauth_usersfile", FR_TYPE_FILE_INPUT, rlm_files_t, postauth_usersfile) },
 	{ FR_CONF_OFFSET("key", FR_TYPE_TMPL | FR_TYPE_NOT_EMPTY, rlm_files_t, key), .dflt = "%{%{Stripped-User-Name}:-%{User-Name}}", .quote = T_DOUBLE_QUOTED_STRING },
+	{ FR_CONF_OFFSET("reload_interval", FR_TYPE_TIME_DELTA, rlm_files_t, reload_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -113,7 +157,232 @@ static int pairlist_to_key(uint8_t **out, size_t *outlen, void const *a)
 	return fr_value_box_to_key(out, outlen, ((PAIR_LIST_LIST const *)a)->box);
 }
 
-static int getusersfile(TALLOC_CTX *ctx, char const *filename, fr_htrie_t **ptree, PAIR_LIST_LIST **pdefault, fr_type_t data_type)
+static uint32_t files_index_value_hash(void const *data)
+{
+	fr_value_box_t const *vb = &((files_index_value_t const *)data)->value;
+
+	/*
+	 *	Only hash the address, so addresses which compare
+	 *	equal always hash the same.
+	 */
+	switch (vb->type) {
+	case FR_TYPE_IPV4_ADDR:
+		return fr_hash(&vb->vb_ip.addr.v4, sizeof(vb->vb_ip.addr.v4));
+
+	case FR_TYPE_IPV6_ADDR:
+		return fr_hash(&vb->vb_ip.addr.v6, sizeof(vb->vb_ip.addr.v6));
+
+	default:
+		return fr_value_box_hash(vb);
+	}
+}
+
+static int8_t files_index_value_cmp(void const *a, void const *b)
+{
+	int ret;
+
+	ret = fr_value_box_cmp(&((files_index_value_t const *)a)->value, &((files_index_value_t const *)b)->value);
+	return CMP(ret, 0);
+}
+
+/** Add an entry to the index, if the check item is "&request.Attr == value"
+ *
+ * @return
+ *	- 0 if the entry was indexed.
+ *	- -1 if the check item can't be used.
+ */
+static int files_index_map(files_index_t *index, map_t const *map, size_t i)
+{
+	fr_dict_attr_t const	*da;
+	fr_value_box_t const	*value;
+	files_index_attr_t	*attr = NULL;
+	files_index_value_t	*found;
+	size_t			j, num_attrs;
+
+	if ((map->op != T_OP_CMP_EQ) || !tmpl_is_attr(map->lhs) || !tmpl_is_data(map->rhs)) return -1;
+
+	if ((tmpl_request_ref_count(map->lhs) != 1) || (tmpl_request(map->lhs) != REQUEST_CURRENT) ||
+	    (tmpl_list(map->lhs) != PAIR_LIST_REQUEST) || (tmpl_attr_count(map->lhs) != 1) ||
+	    (map->lhs->cast != FR_TYPE_NULL) ||
+	    ((tmpl_num(map->lhs) != NUM_ANY) && (tmpl_num(map->lhs) != NUM_ALL))) return -1;
+
+	da = tmpl_da(map->lhs);
+	if (!fr_dict_attr_is_top_level(da)) return -1;
+
+	/*
+	 *	The comparison must be exactly what we'd get from
+	 *	comparing value boxes of the attribute's type.
+	 */
+	value = tmpl_value(map->rhs);
+	if (value->type != da->type) return -1;
+
+	switch (da->type) {
+	case FR_TYPE_STRING:
+	case FR_TYPE_OCTETS:
+	case FR_TYPE_IPV4_ADDR:
+	case FR_TYPE_IPV6_ADDR:
+	case FR_TYPE_ETHERNET:
+	case FR_TYPE_INTEGER_EXCEPT_BOOL:
+		break;
+
+	default:
+		return -1;
+	}
+
+	num_attrs = talloc_array_length(index->attrs);
+	for (j = 0; j < num_attrs; j++) {
+		if (index->attrs[j].da == da) {
+			attr = &index->attrs[j];
+			break;
+		}
+	}
+
+	if (!attr) {
+		MEM(index->attrs = talloc_realloc(index, index->attrs, files_index_attr_t, num_attrs + 1));
+		attr = &index->attrs[num_attrs];
+		*attr = (files_index_attr_t) {
+			.da = da,
+		};
+		MEM(attr->values = fr_hash_table_alloc(index, files_index_value_hash, files_index_value_cmp, NULL));
+		MEM(attr->entries = talloc_zero_array(index, uint64_t, index->num_words));
+	}
+
+	found = fr_hash_table_find(attr->values, &(files_index_value_t){ .value = *value });
+	if (!found) {
+		MEM(found = talloc_zero(attr->values, files_index_value_t));
+		if (fr_value_box_copy(found, &found->value, value) < 0) {
+			talloc_free(found);
+			return -1;
+		}
+		MEM(found->entries = talloc_zero_array(found, uint64_t, index->num_words));
+		if (!fr_hash_table_insert(attr->values, found)) {
+			talloc_free(found);
+			return -1;
+		}
+	}
+
+	found->entries[i / 64] |= ((uint64_t)1) << (i % 64);
+	attr->entries[i / 64] |= ((uint64_t)1) << (i % 64);
+
+	return 0;
+}
+
+/** Build an index of a DEFAULT list
+ *
+ * @return
+ *	- The index.
+ *	- NULL if no entries could be indexed.
+ */
+static files_index_t *files_index_alloc(TALLOC_CTX *ctx, PAIR_LIST_LIST const *default_list)
+{
+	files_index_t	*index;
+	PAIR_LIST	*pl = NULL;
+	size_t		i = 0;
+
+	MEM(index = talloc_zero(ctx, files_index_t));
+	index->num_entries = fr_dlist_num_elements(&default_list->head);
+	index->num_words = ROUND_UP_DIV(index->num_entries, 64);
+	MEM(index->entries = talloc_array(index, PAIR_LIST const *, index->num_entries));
+	MEM(index->unindexed = talloc_zero_array(index, uint64_t, index->num_words));
+	MEM(index->attrs = talloc_array(index, files_index_attr_t, 0));
+
+	while ((pl = fr_dlist_next(&default_list->head, pl))) {
+		map_t const *map = NULL;
+
+		index->entries[i] = pl;
+
+		while ((map = fr_dlist_next(&pl->check, map))) {
+			if (files_index_map(index, map, i) == 0) break;
+		}
+		if (!map) index->unindexed[i / 64] |= ((uint64_t)1) << (i % 64);
+
+		i++;
+	}
+
+	if (talloc_array_length(index->attrs) == 0) {
+		talloc_free(index);
+		return NULL;
+	}
+
+	return index;
+}
+
+/** Find the DEFAULT entries which could match a request
+ *
+ * @param[out] out	Bitset of entries to evaluate.
+ * @param[in] index	of the DEFAULT list.
+ * @param[in] request	to match.
+ */
+static void files_index_candidates(uint64_t *out, files_index_t const *index, request_t *request)
+{
+	size_t i, j, num_attrs = talloc_array_length(index->attrs);
+
+	memcpy(out, index->unindexed, index->num_words * sizeof(*out));
+
+	for (i = 0; i < num_attrs; i++) {
+		files_index_attr_t const	*attr = &index->attrs[i];
+		fr_dcursor_t			cursor;
+		fr_pair_t			*vp;
+
+		/*
+		 *	The check items can't be evaluated if the
+		 *	attribute doesn't exist, and the entry is
+		 *	evaluated as if they weren't there.  So all
+		 *	the entries are candidates.
+		 */
+		vp = fr_dcursor_iter_by_da_init(&cursor, &request->request_pairs, attr->da);
+		if (!vp) {
+			for (j = 0; j < index->num_words; j++) out[j] |= attr->entries[j];
+			continue;
+		}
+
+		for (; vp; vp = fr_dcursor_next(&cursor)) {
+			files_index_value_t const	*found;
+
+			found = fr_hash_table_find(attr->values, &(files_index_value_t){ .value = vp->data });
+			if (!found) continue;
+
+			for (j = 0; j < index->num_words; j++) out[j] |= found->entries[j];
+		}
+	}
+}
+
+/** Get the next DEFAULT entry to evaluate
+ *
+ * @param[in] default_list	of entries.
+ * @param[in] index		of default_list.  May be NULL.
+ * @param[in] candidates	from #files_index_candidates.  NULL if index is NULL.
+ * @param[in,out] next		Position of the next entry, when using the index.
+ * @param[in] prev		entry, or NULL for the first.
+ */
+static PAIR_LIST const *files_default_next(PAIR_LIST_LIST const *default_list, files_index_t const *index,
+					   uint64_t const *candidates, size_t *next, PAIR_LIST const *prev)
+{
+	size_t	i;
+
+	if (!index) return prev ? fr_dlist_next(&default_list->head, prev) : fr_dlist_head(&default_list->head);
+
+	if (!prev) *next = 0;
+
+	for (i = *next; i < index->num_entries; i++) {
+		uint64_t word = candidates[i / 64] >> (i % 64);
+
+		if (!word) {
+			i = ((i / 64) * 64) + 63;	/* Skip the rest of the word */
+			continue;
+		}
+		i += __builtin_ctzll(word);
+		if (i >= index->num_entries) break;
+
+		*next = i + 1;
+		return index->entries[i];
+	}
+
+	*next = index->num_entries;
+	return NULL;
+}
+
+static int getusersfile(TALLOC_CTX *ctx, char const *filename, rlm_files_table_t *table, fr_type_t data_type)
 {
 	int rcode;
 	PAIR_LIST_LIST users;
@@ -124,10 +393,7 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, fr_htrie_t **ptre
 	fr_htrie_type_t htype;
 	fr_value_box_t *box;
 
-	if (!filename) {
-		*ptree = NULL;
-		return 0;
-	}
+	if (!filename) return 0;
 
 	pairlist_list_init(&users);
 	rcode = pairlist_read(ctx, dict_radius, filename, &users, 1);
@@ -279,7 +545,7 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, fr_htrie_t **ptre
 				 *	into the tree, instead make it
 				 *	it's own list.
 				 */
-				*pdefault = default_list;
+				table->def = default_list;
 			}
 
 			/*
@@ -339,7 +605,13 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, fr_htrie_t **ptre
 		fr_dlist_insert_tail(&user_list->head, entry);
 	}
 
-	*ptree = tree;
+	table->tree = tree;
+
+	/*
+	 *	Index the DEFAULT entries, so we don't have to
+	 *	evaluate all of them for every request.
+	 */
+	if (default_list) table->def_index = files_index_alloc(ctx, default_list);
 
 	return 0;
 }
@@ -347,11 +619,35 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, fr_htrie_t **ptre
 
 
 /*
- *	(Re-)read the "users" file into memory.
+ *	(Re-)read the "users" files into memory.
+ *
+ *	Called at instantiation, and in the reload thread.
  */
+static void *files_load(void *uctx)
+{
+	rlm_files_t const	*inst = talloc_get_type_abort_const(uctx, rlm_files_t);
+	rlm_files_data_t	*data;
+
+	MEM(data = talloc_zero(NULL, rlm_files_data_t));
+
+#undef READFILE
+#define READFILE(_x, _y) do { if (getusersfile(data, inst->_x, &data->_y, inst->key_data_type) != 0) { fr_strerror_printf_push("Failed reading %s", inst->_x); talloc_free(data); return NULL; } } while (0)
+
+	READFILE(filename, common);
+	READFILE(usersfile, users);
+	READFILE(acct_usersfile, acct_users);
+	READFILE(auth_usersfile, auth_users);
+	READFILE(postauth_usersfile, postauth_users);
+
+	return data;
+}
+
 static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
-	rlm_files_t *inst = instance;
+	rlm_files_t		*inst = instance;
+	rlm_files_data_t	*data;
+	char const		*files[] = { inst->filename, inst->usersfile, inst->acct_usersfile,
+					     inst->auth_usersfile, inst->postauth_usersfile };
 
 	inst->key_data_type = tmpl_expanded_type(inst->key);
 	if (fr_htrie_hint(inst->key_data_type) == FR_HTRIE_INVALID) {
@@ -360,14 +656,43 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
-#undef READFILE
-#define READFILE(_x, _y, _d) do { if (getusersfile(inst, inst->_x, &inst->_y, &inst->_d, inst->key_data_type) != 0) { ERROR("Failed reading %s", inst->_x); return -1;} } while (0)
+	data = files_load(inst);
+	if (!data) {
+		PERROR("Failed loading users files");
+		return -1;
+	}
 
-	READFILE(filename, common, common_def);
-	READFILE(usersfile, users, users_def);
-	READFILE(acct_usersfile, acct_users, acct_users_def);
-	READFILE(auth_usersfile, auth_users, auth_users_def);
-	READFILE(postauth_usersfile, postauth_users, postauth_users_def);
+	/*
+	 *	Changes to the files are picked up in the
+	 *	background, without blocking the workers.
+	 */
+	inst->reload = fr_reload_alloc(inst, cf_section_name2(conf) ? cf_section_name2(conf) : cf_section_name1(conf),
+				       data, files_load, inst, files, NUM_ELEMENTS(files), inst->reload_interval);
+	if (!inst->reload) {
+		talloc_free(data);
+		cf_log_perr(conf, "Failed starting reload thread");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_files_t		*inst = talloc_get_type_abort(instance, rlm_files_t);
+	rlm_files_thread_t	*t = talloc_get_type_abort(thread, rlm_files_thread_t);
+
+	t->reader = fr_reload_reader_alloc(t, inst->reload);
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_files_thread_t *t = talloc_get_type_abort(thread, rlm_files_thread_t);
+
+	TALLOC_FREE(t->reader);
 
 	return 0;
 }
@@ -376,14 +701,19 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
  *	Common code called by everything below.
  */
 static unlang_action_t file_common(rlm_rcode_t *p_result, rlm_files_t const *inst,
-				   request_t *request, char const *filename, fr_htrie_t *tree, PAIR_LIST_LIST *default_list)
+				   request_t *request, char const *filename, rlm_files_table_t const *table)
 {
+	fr_htrie_t		*tree = table->tree;
+	PAIR_LIST_LIST		*default_list = table->def;
+	files_index_t const	*default_index = table->def_index;
 	PAIR_LIST_LIST const	*user_list;
 	PAIR_LIST const 	*user_pl, *default_pl;
 	bool			found = false;
 	PAIR_LIST_LIST		my_list;
 	uint8_t			key_buffer[16], *key;
 	size_t			keylen = 0;
+	uint64_t		candidates_buffer[16], *candidates = NULL;
+	size_t			default_next = 0;
 
 	if (!tree && !default_list) RETURN_MODULE_NOOP;
 
@@ -435,8 +765,20 @@ static unlang_action_t file_common(rlm_rcode_t *p_result, rlm_files_t const *ins
 		user_list = NULL;
 	}
 
+	/*
+	 *	Only the DEFAULT entries which can match are evaluated.
+	 */
+	if (default_index) {
+		if (default_index->num_words <= NUM_ELEMENTS(candidates_buffer)) {
+			candidates = candidates_buffer;
+		} else {
+			MEM(candidates = talloc_array(request, uint64_t, default_index->num_words));
+		}
+		files_index_candidates(candidates, default_index, request);
+	}
+
 redo:
-	default_pl = default_list ? fr_dlist_head(&default_list->head) : NULL;
+	default_pl = default_list ? files_default_next(default_list, default_index, candidates, &default_next, NULL) : NULL;
 
 	/*
 	 *	Find the entry for the user.
@@ -459,7 +801,7 @@ redo:
 
 		} else if (!user_pl && default_pl) {
 			pl = default_pl;
-			default_pl = fr_dlist_next(&default_list->head, default_pl);
+			default_pl = files_default_next(default_list, default_index, candidates, &default_next, default_pl);
 
 		} else if (user_pl->order < default_pl->order) {
 			pl = user_pl;
@@ -467,7 +809,7 @@ redo:
 
 		} else {
 			pl = default_pl;
-			default_pl = fr_dlist_next(&default_list->head, default_pl);
+			default_pl = files_default_next(default_list, default_index, candidates, &default_next, default_pl);
 		}
 
 		fr_pair_list_init(&list);
@@ -605,6 +947,8 @@ redo:
 		}
 	}
 
+	if (candidates != candidates_buffer) talloc_free(candidates);
+
 	/*
 	 *	See if we succeeded.
 	 */
@@ -624,11 +968,15 @@ redo:
  */
 static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_files_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_files_t);
+	rlm_files_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_files_t);
+	rlm_files_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_files_thread_t);
+	rlm_files_data_t const	*data = fr_reload_enter(t->reader);
+	unlang_action_t		ua;
 
-	return file_common(p_result, inst, request, inst->filename,
-			   inst->users ? inst->users : inst->common,
-			   inst->users ? inst->users_def : inst->common_def);
+	ua = file_common(p_result, inst, request, inst->filename, data->users.tree ? &data->users : &data->common);
+	fr_reload_exit(t->reader);
+
+	return ua;
 }
 
 
@@ -639,29 +987,41 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
  */
 static unlang_action_t CC_HINT(nonnull) mod_preacct(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_files_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_files_t);
+	rlm_files_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_files_t);
+	rlm_files_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_files_thread_t);
+	rlm_files_data_t const	*data = fr_reload_enter(t->reader);
+	unlang_action_t		ua;
+
+	ua = file_common(p_result, inst, request, inst->acct_usersfile, data->acct_users.tree ? &data->acct_users : &data->common);
+	fr_reload_exit(t->reader);
 
-	return file_common(p_result, inst, request, inst->acct_usersfile,
-			   inst->acct_users ? inst->acct_users : inst->common,
-			   inst->acct_users ? inst->acct_users_def : inst->common_def);
+	return ua;
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_files_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_files_t);
+	rlm_files_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_files_t);
+	rlm_files_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_files_thread_t);
+	rlm_files_data_t const	*data = fr_reload_enter(t->reader);
+	unlang_action_t		ua;
 
-	return file_common(p_result, inst, request, inst->auth_usersfile,
-			   inst->auth_users ? inst->auth_users : inst->common,
-			   inst->auth_users ? inst->auth_users_def : inst->common_def);
+	ua = file_common(p_result, inst, request, inst->auth_usersfile, data->auth_users.tree ? &data->auth_users : &data->common);
+	fr_reload_exit(t->reader);
+
+	return ua;
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_files_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_files_t);
+	rlm_files_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_files_t);
+	rlm_files_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_files_thread_t);
+	rlm_files_data_t const	*data = fr_reload_enter(t->reader);
+	unlang_action_t		ua;
+
+	ua = file_common(p_result, inst, request, inst->postauth_usersfile, data->postauth_users.tree ? &data->postauth_users : &data->common);
+	fr_reload_exit(t->reader);
 
-	return file_common(p_result, inst, request, inst->postauth_usersfile,
-			   inst->postauth_users ? inst->postauth_users : inst->common,
-			   inst->postauth_users ? inst->postauth_users_def : inst->common_def);
+	return ua;
 }
 
 
@@ -671,8 +1031,11 @@ module_t rlm_files = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "files",
 	.inst_size	= sizeof(rlm_files_t),
+	.thread_inst_size	= sizeof(rlm_files_thread_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize,
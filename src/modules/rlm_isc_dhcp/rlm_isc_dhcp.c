@@ -41,6 +41,8 @@ fr_dict_autoload_t rlm_isc_dhcp_dict[] = {
 
 static fr_dict_attr_t const *attr_client_hardware_address;
 static fr_dict_attr_t const *attr_your_ip_address;
+static fr_dict_attr_t const *attr_client_ip_address;
+static fr_dict_attr_t const *attr_gateway_ip_address;
 static fr_dict_attr_t const *attr_client_identifier;
 static fr_dict_attr_t const *attr_server_name;
 static fr_dict_attr_t const *attr_boot_filename;
@@ -51,6 +53,8 @@ extern fr_dict_attr_autoload_t rlm_isc_dhcp_dict_attr[];
 fr_dict_attr_autoload_t rlm_isc_dhcp_dict_attr[] = {
 	{ .out = &attr_client_hardware_address, .name = "Client-Hardware-Address", .type = FR_TYPE_ETHERNET, .dict = &dict_dhcpv4},
 	{ .out = &attr_your_ip_address, .name = "Your-IP-Address", .type = FR_TYPE_IPV4_ADDR, .dict = &dict_dhcpv4},
+	{ .out = &attr_client_ip_address, .name = "Client-IP-Address", .type = FR_TYPE_IPV4_ADDR, .dict = &dict_dhcpv4},
+	{ .out = &attr_gateway_ip_address, .name = "Gateway-IP-Address", .type = FR_TYPE_IPV4_ADDR, .dict = &dict_dhcpv4},
 	{ .out = &attr_client_identifier, .name = "Client-Identifier", .type = FR_TYPE_OCTETS, .dict = &dict_dhcpv4},
 	{ .out = &attr_server_name, .name = "Server-Host-Name", .type = FR_TYPE_STRING, .dict = &dict_dhcpv4},
 	{ .out = &attr_boot_filename, .name = "Boot-Filename", .type = FR_TYPE_STRING, .dict = &dict_dhcpv4},
@@ -90,6 +94,15 @@ typedef struct {
 	 */
 	fr_hash_table_t		*hosts_by_ether;       	//!< by MAC address
 	fr_hash_table_t		*hosts_by_uid;		//!< by client identifier
+
+	/*
+	 *	Likewise "subnet" blocks can be nested inside of
+	 *	"group" and "shared-network", but they can't
+	 *	overlap.  So we keep one trie of all subnets, and
+	 *	find the client's subnet with a single longest
+	 *	prefix match, no matter how many subnets there are.
+	 */
+	fr_trie_t		*subnets;		//!< by network
 } rlm_isc_dhcp_t;
 
 /*
@@ -195,7 +208,6 @@ struct rlm_isc_dhcp_info_s {
 	fr_hash_table_t		*hosts_by_ether;  //!< by MAC address
 	fr_hash_table_t		*hosts_by_uid;	//!< by client identifier
 	fr_pair_list_t		options;	//!< DHCP options
-	fr_trie_t		*subnets;
 	rlm_isc_dhcp_info_t	*child;
 	rlm_isc_dhcp_info_t	**last;		//!< pointer to last child
 };
@@ -1529,7 +1541,7 @@ static int parse_host(rlm_isc_dhcp_tokenizer_t *state, rlm_isc_dhcp_info_t *info
  */
 static int parse_subnet(rlm_isc_dhcp_tokenizer_t *state, rlm_isc_dhcp_info_t *info)
 {
-	rlm_isc_dhcp_info_t *parent;
+	rlm_isc_dhcp_info_t *old;
 	int ret, bits;
 	uint32_t netmask = info->argv[1]->vb_ipv4addr;
 
@@ -1559,32 +1571,23 @@ static int parse_subnet(rlm_isc_dhcp_tokenizer_t *state, rlm_isc_dhcp_info_t *in
 	netmask = netmask + (netmask >> 16);
 	bits = netmask & 0x0000003F;
 
-	parent = info->parent;
-	if (parent->subnets) {
-		rlm_isc_dhcp_info_t *old;
-
-		/*
-		 *	Duplicate or overlapping "subnet" entries aren't allowd.
-		 */
-		old = fr_trie_lookup_by_key(parent->subnets, &(info->argv[0]->vb_ipv4addr), bits);
-		if (old) {
-			fr_strerror_printf("subnet %pV netmask %pV' overlaps with existing subnet", info->argv[0], info->argv[1]);
-			return -1;
-
-		}
-	} else {
-		parent->subnets = fr_trie_alloc(parent, NULL, NULL);
-		if (!parent->subnets) return -1;
+	/*
+	 *	Duplicate or overlapping "subnet" entries aren't
+	 *	allowed, even when they're in different sections.
+	 */
+	old = fr_trie_lookup_by_key(state->inst->subnets, &(info->argv[0]->vb_ipv4addr), bits);
+	if (old) {
+		fr_strerror_printf("subnet %pV netmask %pV' overlaps with existing subnet", info->argv[0], info->argv[1]);
+		return -1;
 	}
 
 	/*
-	 *	Add the subnet to the *parents* trie.  That way when
-	 *	we apply the parent, we can look up the subnet in its
-	 *	trie.  And avoid the O(N) issue of having thousands of
-	 *	"subnet" entries in the parent->child list.
+	 *	Add the subnet to the global trie.  That way we can
+	 *	find it with one lookup, and avoid the O(N) issue of
+	 *	having thousands of "subnet" entries in the
+	 *	parent->child list.
 	 */
-
-	ret = fr_trie_insert_by_key(parent->subnets, &(info->argv[0]->vb_ipv4addr), bits, info);
+	ret = fr_trie_insert_by_key(state->inst->subnets, &(info->argv[0]->vb_ipv4addr), bits, info);
 	if (ret < 0) {
 		fr_strerror_printf("Failed inserting 'subnet %pV netmask %pV' into trie",
 				   info->argv[0], info->argv[1]);
@@ -1790,6 +1793,111 @@ static int apply_fixed_ip(rlm_isc_dhcp_t const *inst, request_t *request)
 	return 0;
 }
 
+static int apply(rlm_isc_dhcp_t const *inst, request_t *request, rlm_isc_dhcp_info_t *head);
+
+/** Copy the options from one section to the reply
+ *
+ * @return
+ *	- 0 if the section has no options.
+ *	- 1 if options were applied.
+ *	- -1 on error.
+ */
+static int apply_options(request_t *request, rlm_isc_dhcp_info_t *head)
+{
+	fr_pair_t *vp = NULL;
+
+	if (fr_pair_list_empty(&head->options)) return 0;
+
+	/*
+	 *	Walk over the input list, adding the options
+	 *	only if they don't already exist in the reply.
+	 *
+	 *	Yes, we know that this is O(R*P*D), complexity
+	 *	is (reply VPs * option VPs * depth of options).
+	 *
+	 *	Unless we make the code a lot smarter, this is
+	 *	the best we can do.  Since there are likely
+	 *	only a few options (i.e. less than 100), this
+	 *	is deemed to be OK.
+	 *
+	 *	In order to fix this, we would need to sort
+	 *	all of the options first, sort the reply VPs,
+	 *	then walk over the reply VPs, and look at each
+	 *	option list in turn, seeing if there are
+	 *	options that match.  This would likely be
+	 *	faster.
+	 */
+	for (vp = fr_pair_list_head(&head->options);
+	     vp != NULL;
+	     vp = fr_pair_list_next(&head->options, vp)) {
+		fr_pair_t *reply;
+
+		reply = fr_pair_find_by_da(&request->reply_pairs, vp->da, 0);
+		if (reply) continue;
+
+		/*
+		 *	Copy all of the same options to the
+		 *	reply.
+		 */
+		while (vp) {
+			fr_pair_t *next, *copy;
+
+			copy = fr_pair_copy(request->reply_ctx, vp);
+			if (!copy) return -1;
+
+			fr_pair_append(&request->reply_pairs, copy);
+
+			next = fr_pair_list_next(&head->options, vp);
+			if (!next) break;
+			if (next->da != vp->da) break;
+
+			vp = fr_pair_list_next(&head->options, vp);
+		}
+	}
+
+	/*
+	 *	We applied some options.
+	 */
+	return 1;
+}
+
+/** Apply the subnet the client is on
+ *
+ *	The subnet is found with a longest prefix match on the IP
+ *	we're handing out, or else the relay, or else the client's
+ *	own IP.  Options from the sections which enclose the subnet
+ *	are then applied, so a subnet inside of a "shared-network"
+ *	picks up the shared-network's options.
+ */
+static int apply_subnet(rlm_isc_dhcp_t const *inst, request_t *request)
+{
+	int ret, child_ret;
+	rlm_isc_dhcp_info_t *info, *subnet;
+	fr_pair_t *vp;
+
+	vp = fr_pair_find_by_da(&request->reply_pairs, attr_your_ip_address, 0);
+	if (!vp || !vp->vp_ipv4addr) vp = fr_pair_find_by_da(&request->request_pairs, attr_gateway_ip_address, 0);
+	if (!vp || !vp->vp_ipv4addr) vp = fr_pair_find_by_da(&request->request_pairs, attr_client_ip_address, 0);
+	if (!vp || !vp->vp_ipv4addr) return 0;
+
+	subnet = fr_trie_lookup_by_key(inst->subnets, &vp->vp_ipv4addr, 32);
+	if (!subnet) return 0;
+
+	ret = apply(inst, request, subnet);
+	if (ret < 0) return ret;
+
+	/*
+	 *	The top-level section is applied by our caller.
+	 */
+	for (info = subnet->parent; info && info->parent; info = info->parent) {
+		child_ret = apply_options(request, info);
+		if (child_ret < 0) return child_ret;
+		if (child_ret == 1) ret = 1;
+	}
+
+	return ret;
+}
+
 /** Apply all rules *except* fixed IP
  *
  */
@@ -1797,10 +1905,8 @@ static int apply(rlm_isc_dhcp_t const *inst, request_t *request, rlm_isc_dhcp_in
 {
 	int ret, child_ret;
 	rlm_isc_dhcp_info_t *info;
-	fr_pair_t *yiaddr;
 
 	ret = 0;
-	yiaddr = fr_pair_find_by_da(&request->reply_pairs, attr_your_ip_address, 0);
 
 	/*
 	 *	First, apply any "host" options
@@ -1821,19 +1927,15 @@ static int apply(rlm_isc_dhcp_t const *inst, request_t *request, rlm_isc_dhcp_in
 
 subnet:
 	/*
-	 *	Look in the trie for matching subnets, and apply any
-	 *	subnets that match.
+	 *	Subnets are global, so we only look them up once, from
+	 *	the top-level section.
 	 */
-	if (head->subnets && yiaddr) {
-		info = fr_trie_lookup_by_key(head->subnets, &yiaddr->vp_ipv4addr, 32);
-		if (!info) goto recurse;
-
-		child_ret = apply(inst, request, info);
+	if (head == inst->head) {
+		child_ret = apply_subnet(inst, request);
 		if (child_ret < 0) return child_ret;
 		if (child_ret == 1) ret = 1;
 	}
 
-recurse:
 	for (info = head->child; info != NULL; info = info->next) {
 		if (!info->cmd) return -1; /* internal error */
 
@@ -1850,61 +1952,9 @@ recurse:
 	 *	Now that our children have added options, see if we
 	 *	can add some, too.
 	 */
-	if (!fr_pair_list_empty(&head->options)) {
-		fr_pair_t *vp = NULL;
-
-		/*
-		 *	Walk over the input list, adding the options
-		 *	only if they don't already exist in the reply.
-		 *
-		 *	Yes, we know that this is O(R*P*D), complexity
-		 *	is (reply VPs * option VPs * depth of options).
-		 *
-		 *	Unless we make the code a lot smarter, this is
-		 *	the best we can do.  Since there are likely
-		 *	only a few options (i.e. less than 100), this
-		 *	is deemed to be OK.
-		 *
-		 *	In order to fix this, we would need to sort
-		 *	all of the options first, sort the reply VPs,
-		 *	then walk over the reply VPs, and look at each
-		 *	option list in turn, seeing if there are
-		 *	options that match.  This would likely be
-		 *	faster.
-		 */
-		for (vp = fr_pair_list_head(&head->options);
-		     vp != NULL;
-		     vp = fr_pair_list_next(&head->options, vp)) {
-			fr_pair_t *reply;
-
-			reply = fr_pair_find_by_da(&request->reply_pairs, vp->da, 0);
-			if (reply) continue;
-
-			/*
-			 *	Copy all of the same options to the
-			 *	reply.
-			 */
-			while (vp) {
-				fr_pair_t *next, *copy;
-
-				copy = fr_pair_copy(request->reply_ctx, vp);
-				if (!copy) return -1;
-
-				fr_pair_append(&request->reply_pairs, copy);
-
-				next = fr_pair_list_next(&head->options, vp);
-				if (!next) break;
-				if (next->da != vp->da) break;
-
-				vp = fr_pair_list_next(&head->options, vp);
-			}
-		}
-
-		/*
-		 *	We applied some options.
-		 */
-		ret = 1;
-	}
+	child_ret = apply_options(request, head);
+	if (child_ret < 0) return child_ret;
+	if (child_ret == 1) ret = 1;
 
 	return ret;
 }
@@ -2195,6 +2245,9 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->hosts_by_uid = fr_hash_table_alloc(inst, host_uid_hash, host_uid_cmp, NULL);
 	if (!inst->hosts_by_uid) return -1;
 
+	inst->subnets = fr_trie_alloc(inst, NULL, NULL);
+	if (!inst->subnets) return -1;
+
 	ret = read_file(inst, info, inst->filename);
 	if (ret < 0) {
 		cf_log_err(conf, "%s", fr_strerror());
@@ -83,6 +83,12 @@ typedef struct rlm_json_jpath_cache rlm_json_jpath_cache_t;
 struct rlm_json_jpath_cache {
 	fr_jpath_node_t		*jpath;		//!< First node in jpath expression.
 	rlm_json_jpath_cache_t	*next;		//!< Next jpath cache entry.
+
+	fr_jpath_set_t		*set;		//!< All of the cached jpaths, merged so that they're
+						///< evaluated with one walk of the document.
+						///< Only set in the first entry.
+	int			set_idx;	//!< Where our values are in the output of the set,
+						///< or -1 if we're evaluated separately.
 };
 
 typedef struct {
@@ -329,6 +335,8 @@ static int mod_map_proc_instantiate(CONF_SECTION *cs, UNUSED void *mod_inst, voi
 		return -1;
 	}
 
+	MEM(cache_inst->set = fr_jpath_set_alloc(cache_inst));
+
 	while ((map = fr_dlist_next(maps, map))) {
 		CONF_PAIR	*cp = cf_item_to_pair(map->ci);
 		char const	*p;
@@ -375,6 +383,12 @@ static int mod_map_proc_instantiate(CONF_SECTION *cs, UNUSED void *mod_inst, voi
 			continue;
 		}
 
+		cache->set_idx = -1;
+		if (tmpl_is_attr(map->lhs)) {
+			cache->set_idx = fr_jpath_set_add(cache_inst->set, cache->jpath,
+							  tmpl_da(map->lhs)->type, tmpl_da(map->lhs));
+		}
+
 		/*
 		 *	Slightly weird... This is here because our first
 		 *	list member was pre-allocated and passed to the
@@ -389,6 +403,43 @@ static int mod_map_proc_instantiate(CONF_SECTION *cs, UNUSED void *mod_inst, voi
 	return 0;
 }
 
+/** Converts values which have already been extracted into #fr_pair_t
+ *
+ * @param[in,out] ctx to allocate #fr_pair_t (s).
+ * @param[out] out where to write the resulting #fr_pair_t.
+ * @param[in] request The current request.
+ * @param[in] map to process.
+ * @param[in] uctx The list of values for this map.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int _json_map_proc_get_result(TALLOC_CTX *ctx, fr_pair_list_t *out, request_t *request,
+				     map_t const *map, void *uctx)
+{
+	fr_pair_t			*vp;
+	fr_value_box_list_t		*head = uctx;
+	fr_value_box_t			*value;
+
+	fr_pair_list_free(out);
+
+	for (value = fr_dlist_head(head);
+	     value;
+	     fr_pair_append(out, vp), value = fr_dlist_next(head, value)) {
+		MEM(vp = fr_pair_afrom_da(ctx, tmpl_da(map->lhs)));
+		vp->op = map->op;
+
+		if (fr_value_box_steal(vp, &vp->data, value) < 0) {
+			RPEDEBUG("Copying data to attribute failed");
+			talloc_free(vp);
+			fr_pair_list_free(out);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 /** Converts a string value into a #fr_pair_t
  *
  * @param[in,out] ctx to allocate #fr_pair_t (s).
@@ -403,9 +454,7 @@ static int mod_map_proc_instantiate(CONF_SECTION *cs, UNUSED void *mod_inst, voi
 static int _json_map_proc_get_value(TALLOC_CTX *ctx, fr_pair_list_t *out, request_t *request,
 				    map_t const *map, void *uctx)
 {
-	fr_pair_t			*vp;
 	rlm_json_jpath_to_eval_t	*to_eval = uctx;
-	fr_value_box_t			*value;
 	fr_value_box_list_t		head;
 	int				ret;
 
@@ -421,21 +470,7 @@ static int _json_map_proc_get_value(TALLOC_CTX *ctx, fr_pair_list_t *out, reques
 	if (ret == 0) return 0;
 	fr_assert(!fr_dlist_empty(&head));
 
-	for (value = fr_dlist_head(&head);
-	     value;
-	     fr_pair_append(out, vp), value = fr_dlist_next(&head, value)) {
-		MEM(vp = fr_pair_afrom_da(ctx, tmpl_da(map->lhs)));
-		vp->op = map->op;
-
-		if (fr_value_box_steal(vp, &vp->data, value) < 0) {
-			RPEDEBUG("Copying data to attribute failed");
-			talloc_free(vp);
-			fr_pair_list_free(out);
-			return -1;
-		}
-	}
-
-	return 0;
+	return _json_map_proc_get_result(ctx, out, request, map, &head);
 }
 
 /** Parses a JSON string, and executes jpath queries against it to map values to attributes
@@ -460,6 +495,7 @@ static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, void *proc_inst, request_
 	map_t const			*map = NULL;
 
 	rlm_json_jpath_to_eval_t	to_eval;
+	fr_value_box_list_t		*results = NULL;
 
 	char const			*json_str = NULL;
 	fr_value_box_t			*json_head = fr_dlist_head(json);
@@ -488,6 +524,23 @@ static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, void *proc_inst, request_
 		goto finish;
 	}
 
+	/*
+	 *	Evaluate all of the cached jpaths with one walk of
+	 *	the document.
+	 */
+	if (cache->set && (fr_jpath_set_num(cache->set) > 0)) {
+		unsigned int i, num = fr_jpath_set_num(cache->set);
+
+		MEM(results = talloc_array(request, fr_value_box_list_t, num));
+		for (i = 0; i < num; i++) fr_value_box_list_init(&results[i]);
+
+		if (fr_jpath_set_evaluate(results, results, cache->set, to_eval.root) < 0) {
+			RPEDEBUG("Failed evaluating jpath");
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+	}
+
 	while ((map = fr_dlist_next(maps, map))) {
 		switch (map->rhs->type) {
 		/*
@@ -495,6 +548,16 @@ static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, void *proc_inst, request_
 		 */
 		case TMPL_TYPE_UNRESOLVED:
 		case TMPL_TYPE_DATA:
+			if (cache->set_idx >= 0) {
+				if (map_to_request(request, map, _json_map_proc_get_result,
+						   &results[cache->set_idx]) < 0) {
+					rcode = RLM_MODULE_FAIL;
+					goto finish;
+				}
+				cache = cache->next;
+				break;
+			}
+
 			to_eval.jpath = cache->jpath;
 
 			if (map_to_request(request, map, _json_map_proc_get_value, &to_eval) < 0) {
@@ -541,6 +604,7 @@ static rlm_rcode_t mod_map_proc(UNUSED void *mod_inst, void *proc_inst, request_
 
 
 finish:
+	talloc_free(results);
 	json_object_put(to_eval.root);
 	json_tokener_free(tok);
 
@@ -33,6 +33,14 @@ USES_APPLE_DEPRECATED_API
 #  include <freeradius-devel/server/pool.h>
 #endif
 
+/*
+ *	We only drive the exchanges with the KDC ourselves with MIT
+ *	Kerberos.  Heimdal's stepping API differs.
+ */
+#ifdef HEIMDAL_KRB5
+#  undef HAVE_KRB5_INIT_CREDS_STEP
+#endif
+
 typedef struct {
 	krb5_context	context;
 	krb5_keytab	keytab;
@@ -74,8 +82,31 @@ typedef struct {
 	krb5_principal server;			//!< A structure representing the parsed
 						//!< service_princ.
 #endif
+
+#ifdef HAVE_KRB5_INIT_CREDS_STEP
+	char const		**kdc_server;	//!< KDCs we talk to ourselves, rather than
+						//!< via libkrb5.
+	fr_time_delta_t		kdc_timeout;	//!< How long to wait for each KDC to respond.
+
+	fr_ipaddr_t		*kdc_ipaddr;	//!< Parsed kdc_server addresses.
+	uint16_t		*kdc_port;	//!< Parsed kdc_server ports.
+#endif
 } rlm_krb5_t;
 
+#ifdef HAVE_KRB5_INIT_CREDS_STEP
+#  define KRB5_KDC_PORT		88		//!< Used if a KDC is listed without a port.
+#  define KRB5_KDC_MAX_REPLY	65536		//!< Largest reply we'll accept from a KDC.
+
+/** Thread specific data for rlm_krb5
+ *
+ * Only used when the module talks to the KDCs itself.
+ */
+typedef struct {
+	krb5_context		context;	//!< Used by all the exchanges in this thread.
+	krb5_keytab		keytab;		//!< Used to verify the service ticket.
+} rlm_krb5_thread_t;
+#endif
+
 /*
  *	MIT Kerberos uses comm_err, so the macro just expands to a call
  *	to error_message.
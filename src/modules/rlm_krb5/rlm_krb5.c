@@ -32,11 +32,26 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/net.h>
+#include <freeradius-devel/unlang/base.h>
 #include "krb5.h"
 
+#include <sys/uio.h>
+
+#ifdef HAVE_KRB5_INIT_CREDS_STEP
+static const CONF_PARSER kdc_config[] = {
+	{ FR_CONF_OFFSET("server", FR_TYPE_STRING | FR_TYPE_MULTI, rlm_krb5_t, kdc_server) },
+	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, rlm_krb5_t, kdc_timeout), .dflt = "1.0" },
+	CONF_PARSER_TERMINATOR
+};
+#endif
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("keytab", FR_TYPE_STRING, rlm_krb5_t, keytabname) },
 	{ FR_CONF_OFFSET("service_principal", FR_TYPE_STRING, rlm_krb5_t, service_princ) },
+#ifdef HAVE_KRB5_INIT_CREDS_STEP
+	{ FR_CONF_POINTER("kdc", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) kdc_config },
+#endif
 	CONF_PARSER_TERMINATOR
 };
 
@@ -222,6 +237,31 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	krb5_verify_init_creds_opt_init(inst->vic_options);
 #endif
 
+#ifdef HAVE_KRB5_INIT_CREDS_STEP
+	if (inst->kdc_server) {
+		size_t i, num = talloc_array_length(inst->kdc_server);
+
+		MEM(inst->kdc_ipaddr = talloc_array(inst, fr_ipaddr_t, num));
+		MEM(inst->kdc_port = talloc_array(inst, uint16_t, num));
+
+		for (i = 0; i < num; i++) {
+			if (fr_inet_pton_port(&inst->kdc_ipaddr[i], &inst->kdc_port[i], inst->kdc_server[i],
+					      -1, AF_UNSPEC, true, false) < 0) {
+				cf_log_perr(conf, "Failed parsing KDC \"%s\"", inst->kdc_server[i]);
+				return -1;
+			}
+			if (!inst->kdc_port[i]) inst->kdc_port[i] = KRB5_KDC_PORT;
+		}
+
+		if (inst->kdc_timeout <= 0) {
+			cf_log_err(conf, "KDC timeout must be greater than zero");
+			return -1;
+		}
+
+		DEBUG("Sending requests to %zu KDC(s)", num);
+	}
+#endif
+
 #ifdef KRB5_IS_THREAD_SAFE
 	/*
 	 *	Initialize the socket pool.
@@ -283,33 +323,33 @@ static rlm_rcode_t krb5_parse_user(krb5_principal *client, KRB5_UNUSED rlm_krb5_
  * @param inst of rlm_krb5.
  * @param request Current request.
  * @param ret code from kerberos.
- * @param conn used in the last operation.
+ * @param context used in the last operation.
  */
-static rlm_rcode_t krb5_process_error(rlm_krb5_t const *inst, request_t *request, rlm_krb5_handle_t *conn, int ret)
+static rlm_rcode_t krb5_process_error(rlm_krb5_t const *inst, request_t *request, krb5_context context, int ret)
 {
 	fr_assert(ret != 0);
 
 	if (!fr_cond_assert(inst)) return RLM_MODULE_FAIL;
-	if (!fr_cond_assert(conn)) return RLM_MODULE_FAIL;;	/* Silences warnings */
+	if (!fr_cond_assert(context)) return RLM_MODULE_FAIL;	/* Silences warnings */
 
 	switch (ret) {
 	case KRB5_LIBOS_BADPWDMATCH:
 	case KRB5KRB_AP_ERR_BAD_INTEGRITY:
-		REDEBUG("Provided password was incorrect (%i): %s", ret, rlm_krb5_error(inst, conn->context, ret));
+		REDEBUG("Provided password was incorrect (%i): %s", ret, rlm_krb5_error(inst, context, ret));
 		return RLM_MODULE_REJECT;
 
 	case KRB5KDC_ERR_KEY_EXP:
 	case KRB5KDC_ERR_CLIENT_REVOKED:
 	case KRB5KDC_ERR_SERVICE_REVOKED:
-		REDEBUG("Account has been locked out (%i): %s", ret, rlm_krb5_error(inst, conn->context, ret));
+		REDEBUG("Account has been locked out (%i): %s", ret, rlm_krb5_error(inst, context, ret));
 		return RLM_MODULE_DISALLOW;
 
 	case KRB5KDC_ERR_C_PRINCIPAL_UNKNOWN:
-		RDEBUG2("User not found (%i): %s", ret, rlm_krb5_error(inst, conn->context, ret));
+		RDEBUG2("User not found (%i): %s", ret, rlm_krb5_error(inst, context, ret));
 		return RLM_MODULE_NOTFOUND;
 
 	default:
-		REDEBUG("Error verifying credentials (%i): %s", ret, rlm_krb5_error(inst, conn->context, ret));
+		REDEBUG("Error verifying credentials (%i): %s", ret, rlm_krb5_error(inst, context, ret));
 		return RLM_MODULE_FAIL;
 	}
 }
@@ -367,7 +407,7 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	 */
 	ret = krb5_verify_user_opt(conn->context, client, password->vp_strvalue, &conn->options);
 	if (ret) {
-		rcode = krb5_process_error(inst, request, conn, ret);
+		rcode = krb5_process_error(inst, request, conn->context, ret);
 		goto cleanup;
 	}
 
@@ -407,6 +447,496 @@ cleanup:
 
 #else  /* HEIMDAL_KRB5 */
 
+#  ifdef HAVE_KRB5_INIT_CREDS_STEP
+/** An exchange with the KDCs for one request
+ *
+ * libkrb5 builds the messages and processes the replies, but we send
+ * them, so that the worker isn't blocked waiting for the KDC.
+ */
+typedef struct {
+	rlm_krb5_t const	*inst;
+	rlm_krb5_thread_t	*t;
+	request_t		*request;
+
+	krb5_principal		client;
+	krb5_init_creds_context	icc;		//!< Retrieves the TGT.
+	krb5_creds		tgt;
+	krb5_ccache		ccache;		//!< Holds the TGT, for retrieving the service ticket.
+	krb5_tkt_creds_context	tcc;		//!< Retrieves the service ticket, once we have the TGT.
+
+	krb5_data		out;		//!< The message we're sending to the KDC.
+	bool			tcp;		//!< The KDC said its reply was too big for UDP.
+	uint8_t			*buffer;	//!< Replies are read into this.
+	size_t			received;	//!< How much of a TCP reply we have.
+
+	int			fd;		//!< Socket connected to the current KDC.
+	fr_event_timer_t const	*ev;		//!< When to give up on the current KDC.
+	size_t			kdc;		//!< Index of the current KDC.
+	size_t			tried;		//!< How many KDCs we've tried for this message.
+
+	bool			yielded;	//!< The request is waiting for us.
+	rlm_rcode_t		rcode;
+} rlm_krb5_exchange_t;
+
+static int krb5_exchange_send(rlm_krb5_exchange_t *exch);
+static int krb5_exchange_step(rlm_krb5_exchange_t *exch, krb5_data *in);
+
+/** Close the socket to the current KDC, and stop its timer
+ *
+ */
+static void krb5_exchange_close(rlm_krb5_exchange_t *exch)
+{
+	if (exch->fd >= 0) {
+		(void) fr_event_fd_delete(exch->request->el, exch->fd, FR_EVENT_FILTER_IO);
+		close(exch->fd);
+		exch->fd = -1;
+	}
+
+	if (exch->ev) (void) fr_event_timer_delete(&exch->ev);
+}
+
+static int _krb5_exchange_free(rlm_krb5_exchange_t *exch)
+{
+	krb5_context context = exch->t->context;
+
+	krb5_exchange_close(exch);
+
+	if (exch->tcc) krb5_tkt_creds_free(context, exch->tcc);
+	if (exch->ccache) krb5_cc_destroy(context, exch->ccache);
+	krb5_free_cred_contents(context, &exch->tgt);
+	if (exch->icc) krb5_init_creds_free(context, exch->icc);
+	if (exch->client) krb5_free_principal(context, exch->client);
+	krb5_free_data_contents(context, &exch->out);
+
+	return 0;
+}
+
+/** Finish the exchange, and resume the request
+ *
+ */
+static void krb5_exchange_done(rlm_krb5_exchange_t *exch, rlm_rcode_t rcode)
+{
+	krb5_exchange_close(exch);
+	exch->rcode = rcode;
+	if (exch->yielded) unlang_interpret_mark_runnable(exch->request);
+}
+
+/** Give up on the current KDC, and try the next one
+ *
+ */
+static void krb5_exchange_failover(rlm_krb5_exchange_t *exch)
+{
+	rlm_krb5_t const	*inst = exch->inst;
+	request_t		*request = exch->request;
+	size_t			num = talloc_array_length(inst->kdc_ipaddr);
+
+	krb5_exchange_close(exch);
+
+	if (++exch->tried >= num) {
+		REDEBUG("No response from any KDC");
+		krb5_exchange_done(exch, RLM_MODULE_FAIL);
+		return;
+	}
+
+	exch->kdc = (exch->kdc + 1) % num;
+	RWDEBUG("Failing over to KDC \"%s\"", inst->kdc_server[exch->kdc]);
+
+	if (krb5_exchange_send(exch) < 0) krb5_exchange_failover(exch);
+}
+
+static void krb5_exchange_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_krb5_exchange_t	*exch = talloc_get_type_abort(uctx, rlm_krb5_exchange_t);
+	request_t		*request = exch->request;
+
+	RWDEBUG("Timed out waiting for KDC \"%s\"", exch->inst->kdc_server[exch->kdc]);
+
+	krb5_exchange_failover(exch);
+}
+
+static void krb5_exchange_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	rlm_krb5_exchange_t	*exch = talloc_get_type_abort(uctx, rlm_krb5_exchange_t);
+	request_t		*request = exch->request;
+
+	RWDEBUG("Error talking to KDC \"%s\": %s", exch->inst->kdc_server[exch->kdc], fr_syserror(fd_errno));
+
+	krb5_exchange_failover(exch);
+}
+
+/** Pass a complete reply from the KDC to libkrb5
+ *
+ */
+static void krb5_exchange_reply(rlm_krb5_exchange_t *exch, uint8_t *data, size_t len)
+{
+	krb5_data in = { .data = (char *)data, .length = len };
+
+	/*
+	 *	The next message goes to the same KDC, with a new socket.
+	 */
+	krb5_exchange_close(exch);
+	exch->tried = 0;
+
+	(void) krb5_exchange_step(exch, &in);
+}
+
+static void krb5_exchange_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	rlm_krb5_exchange_t	*exch = talloc_get_type_abort(uctx, rlm_krb5_exchange_t);
+	request_t		*request = exch->request;
+	ssize_t			slen;
+	uint32_t		len;
+
+	if (!exch->tcp) {
+		slen = recv(fd, exch->buffer, KRB5_KDC_MAX_REPLY, 0);
+		if (slen < 0) {
+			if ((errno == EAGAIN) || (errno == EINTR)) return;
+			goto error;
+		}
+
+		krb5_exchange_reply(exch, exch->buffer, slen);
+		return;
+	}
+
+	/*
+	 *	TCP replies are preceded by a 4 octet length.
+	 */
+	slen = recv(fd, exch->buffer + exch->received, KRB5_KDC_MAX_REPLY - exch->received, 0);
+	if (slen == 0) {
+		RWDEBUG("KDC \"%s\" closed the connection", exch->inst->kdc_server[exch->kdc]);
+		krb5_exchange_failover(exch);
+		return;
+	}
+	if (slen < 0) {
+		if ((errno == EAGAIN) || (errno == EINTR)) return;
+		goto error;
+	}
+	exch->received += slen;
+
+	if (exch->received < 4) return;
+
+	len = fr_net_to_uint32(exch->buffer);
+	if (len > (KRB5_KDC_MAX_REPLY - 4)) {
+		REDEBUG("Reply from KDC \"%s\" is too large (%u bytes)", exch->inst->kdc_server[exch->kdc], len);
+		krb5_exchange_failover(exch);
+		return;
+	}
+	if (exch->received < (len + 4)) return;
+
+	krb5_exchange_reply(exch, exch->buffer + 4, len);
+	return;
+
+error:
+	RWDEBUG("Failed reading from KDC \"%s\": %s", exch->inst->kdc_server[exch->kdc], fr_syserror(errno));
+	krb5_exchange_failover(exch);
+}
+
+/** Send the framed message, once the TCP connection is open
+ *
+ */
+static void krb5_exchange_write(fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	rlm_krb5_exchange_t	*exch = talloc_get_type_abort(uctx, rlm_krb5_exchange_t);
+	request_t		*request = exch->request;
+	uint8_t			len[4];
+	struct iovec		iov[2];
+
+	fr_net_from_uint32(len, exch->out.length);
+	iov[0].iov_base = len;
+	iov[0].iov_len = sizeof(len);
+	iov[1].iov_base = exch->out.data;
+	iov[1].iov_len = exch->out.length;
+
+	/*
+	 *	The connection is new, so the whole message will fit
+	 *	in the socket buffer.
+	 */
+	if (writev(fd, iov, 2) != (ssize_t)(sizeof(len) + exch->out.length)) {
+		RWDEBUG("Failed writing to KDC \"%s\": %s", exch->inst->kdc_server[exch->kdc], fr_syserror(errno));
+		krb5_exchange_failover(exch);
+		return;
+	}
+
+	if (fr_event_fd_insert(exch, el, fd, krb5_exchange_read, NULL, krb5_exchange_error, exch) < 0) {
+		RPWDEBUG("Failed listening for KDC reply");
+		krb5_exchange_failover(exch);
+	}
+}
+
+/** Send the current message to the current KDC
+ *
+ * @return
+ *	- 0 if the message was sent (or a connection is being opened).
+ *	- -1 on failure.
+ */
+static int krb5_exchange_send(rlm_krb5_exchange_t *exch)
+{
+	rlm_krb5_t const	*inst = exch->inst;
+	request_t		*request = exch->request;
+	fr_ipaddr_t const	*ipaddr = &inst->kdc_ipaddr[exch->kdc];
+	uint16_t		port = inst->kdc_port[exch->kdc];
+
+	fr_assert(exch->fd < 0);
+
+	exch->received = 0;
+
+	if (!exch->tcp) {
+		exch->fd = fr_socket_client_udp(NULL, NULL, ipaddr, port, true);
+		if (exch->fd < 0) {
+		error:
+			RPWDEBUG("Failed opening socket to KDC \"%s\"", inst->kdc_server[exch->kdc]);
+			return -1;
+		}
+
+		if (send(exch->fd, exch->out.data, exch->out.length, 0) < 0) {
+			RWDEBUG("Failed sending to KDC \"%s\": %s", inst->kdc_server[exch->kdc], fr_syserror(errno));
+			krb5_exchange_close(exch);
+			return -1;
+		}
+
+		if (fr_event_fd_insert(exch, request->el, exch->fd,
+				       krb5_exchange_read, NULL, krb5_exchange_error, exch) < 0) goto error_close;
+	} else {
+		exch->fd = fr_socket_client_tcp(NULL, ipaddr, port, true);
+		if (exch->fd < 0) goto error;
+
+		if (fr_event_fd_insert(exch, request->el, exch->fd,
+				       NULL, krb5_exchange_write, krb5_exchange_error, exch) < 0) goto error_close;
+	}
+
+	if (fr_event_timer_in(exch, request->el, &exch->ev, inst->kdc_timeout, krb5_exchange_timeout, exch) < 0) {
+	error_close:
+		RPWDEBUG("Failed inserting KDC events");
+		krb5_exchange_close(exch);
+		return -1;
+	}
+
+	RDEBUG3("Sent %u bytes to KDC \"%s\" over %s", exch->out.length, inst->kdc_server[exch->kdc],
+		exch->tcp ? "TCP" : "UDP");
+
+	return 0;
+}
+
+/** Check the service ticket against the keytab
+ *
+ * This is what krb5_verify_init_creds() does, after retrieving the
+ * service ticket.  It proves the TGT came from a KDC that knows the
+ * service's key, and not from an impostor.
+ */
+static rlm_rcode_t krb5_exchange_verify(rlm_krb5_exchange_t *exch)
+{
+	rlm_krb5_t const	*inst = exch->inst;
+	request_t		*request = exch->request;
+	krb5_context		context = exch->t->context;
+	krb5_creds		creds;
+	krb5_auth_context	auth_context = NULL;
+	krb5_data		ap_req = { 0 };
+	krb5_error_code		ret;
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+
+	memset(&creds, 0, sizeof(creds));
+
+	ret = krb5_tkt_creds_get_creds(context, exch->tcc, &creds);
+	if (ret) return krb5_process_error(inst, request, context, ret);
+
+	ret = krb5_mk_req_extended(context, &auth_context, 0, NULL, &creds, &ap_req);
+	if (auth_context) krb5_auth_con_free(context, auth_context);
+	auth_context = NULL;
+	if (ret) {
+		rcode = krb5_process_error(inst, request, context, ret);
+		goto finish;
+	}
+
+	/*
+	 *	Don't use a replay cache, the authenticator was only
+	 *	just created.
+	 */
+	ret = krb5_auth_con_init(context, &auth_context);
+	if (ret) {
+		rcode = krb5_process_error(inst, request, context, ret);
+		goto finish;
+	}
+	krb5_auth_con_setflags(context, auth_context, 0);
+
+	ret = krb5_rd_req(context, &auth_context, &ap_req, inst->server, exch->t->keytab, NULL, NULL);
+	if (ret) rcode = krb5_process_error(inst, request, context, ret);
+
+finish:
+	if (auth_context) krb5_auth_con_free(context, auth_context);
+	krb5_free_data_contents(context, &ap_req);
+	krb5_free_cred_contents(context, &creds);
+
+	return rcode;
+}
+
+/** Start retrieving the service ticket with the TGT we just got
+ *
+ */
+static krb5_error_code krb5_exchange_tgt(rlm_krb5_exchange_t *exch)
+{
+	krb5_context		context = exch->t->context;
+	krb5_creds		in_creds;
+	krb5_error_code		ret;
+
+	ret = krb5_init_creds_get_creds(context, exch->icc, &exch->tgt);
+	if (ret) return ret;
+
+	ret = krb5_cc_new_unique(context, "MEMORY", NULL, &exch->ccache);
+	if (ret) return ret;
+
+	ret = krb5_cc_initialize(context, exch->ccache, exch->client);
+	if (ret) return ret;
+
+	ret = krb5_cc_store_cred(context, exch->ccache, &exch->tgt);
+	if (ret) return ret;
+
+	memset(&in_creds, 0, sizeof(in_creds));
+	in_creds.client = exch->client;
+	in_creds.server = exch->inst->server;
+
+	return krb5_tkt_creds_init(context, exch->ccache, &in_creds, 0, &exch->tcc);
+}
+
+/** Pass a reply to libkrb5, and send whatever it wants to send next
+ *
+ * @param[in] exch	The exchange.
+ * @param[in] in	Reply from the KDC, or an empty message to start.
+ * @return
+ *	- 0 if we're waiting for the KDC.
+ *	- 1 if the exchange is complete, and exch->rcode is set.
+ */
+static int krb5_exchange_step(rlm_krb5_exchange_t *exch, krb5_data *in)
+{
+	request_t		*request = exch->request;
+	krb5_context		context = exch->t->context;
+	krb5_data		out = { 0 }, realm = { 0 };
+	unsigned int		flags = 0;
+	krb5_error_code		ret;
+
+	if (!exch->tcc) {
+		ret = krb5_init_creds_step(context, exch->icc, in, &out, &realm, &flags);
+	} else {
+		ret = krb5_tkt_creds_step(context, exch->tcc, in, &out, &realm, &flags);
+	}
+	krb5_free_data_contents(context, &realm);
+
+	/*
+	 *	Send the last message again, over TCP.
+	 */
+	if ((ret == KRB5KRB_ERR_RESPONSE_TOO_BIG) && !exch->tcp) {
+		RDEBUG2("KDC reply is too large for UDP, retrying over TCP");
+		krb5_free_data_contents(context, &out);
+		exch->tcp = true;
+		goto send;
+	}
+
+	if (ret) {
+		krb5_free_data_contents(context, &out);
+		goto error;
+	}
+
+	/*
+	 *	Both KRB5_INIT_CREDS_STEP_FLAG_CONTINUE and
+	 *	KRB5_TKT_CREDS_STEP_FLAG_CONTINUE are 1.
+	 */
+	if (flags & KRB5_INIT_CREDS_STEP_FLAG_CONTINUE) {
+		krb5_free_data_contents(context, &exch->out);
+		exch->out = out;
+
+	send:
+		if (krb5_exchange_send(exch) < 0) {
+			krb5_exchange_failover(exch);
+			return (exch->fd < 0) ? 1 : 0;
+		}
+		return 0;
+	}
+	krb5_free_data_contents(context, &out);
+
+	if (!exch->tcc) {
+		RDEBUG2("Retrieved TGT, retrieving ticket for service principal");
+
+		ret = krb5_exchange_tgt(exch);
+		if (ret) goto error;
+
+		return krb5_exchange_step(exch, &(krb5_data){ 0 });
+	}
+
+	RDEBUG2("Attempting to authenticate against service principal");
+	krb5_exchange_done(exch, krb5_exchange_verify(exch));
+	return 1;
+
+error:
+	krb5_exchange_done(exch, krb5_process_error(exch->inst, request, context, ret));
+	return 1;
+}
+
+static unlang_action_t krb5_exchange_resume(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx,
+					    UNUSED request_t *request, void *rctx)
+{
+	rlm_krb5_exchange_t	*exch = talloc_get_type_abort(rctx, rlm_krb5_exchange_t);
+	rlm_rcode_t		rcode = exch->rcode;
+
+	talloc_free(exch);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+static void krb5_exchange_signal(UNUSED module_ctx_t const *mctx, UNUSED request_t *request,
+				 void *rctx, fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	talloc_free(rctx);
+}
+
+/** Authenticate the user by talking to the KDCs ourselves
+ *
+ */
+static unlang_action_t krb5_exchange_start(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					   request_t *request, fr_pair_t const *password)
+{
+	rlm_krb5_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_krb5_t);
+	rlm_krb5_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_krb5_thread_t);
+	rlm_krb5_exchange_t	*exch;
+	rlm_rcode_t		rcode;
+	krb5_error_code		ret;
+
+	MEM(exch = talloc_zero(request, rlm_krb5_exchange_t));
+	exch->inst = inst;
+	exch->t = t;
+	exch->request = request;
+	exch->fd = -1;
+	exch->rcode = RLM_MODULE_FAIL;
+	talloc_set_destructor(exch, _krb5_exchange_free);
+
+	MEM(exch->buffer = talloc_array(exch, uint8_t, KRB5_KDC_MAX_REPLY));
+
+	rcode = krb5_parse_user(&exch->client, inst, request, t->context);
+	if (rcode != RLM_MODULE_OK) {
+		talloc_free(exch);
+		RETURN_MODULE_RCODE(rcode);
+	}
+
+	ret = krb5_init_creds_init(t->context, exch->client, NULL, NULL, 0, inst->gic_options, &exch->icc);
+	if (!ret) ret = krb5_init_creds_set_password(t->context, exch->icc, password->vp_strvalue);
+	if (ret) {
+		rcode = krb5_process_error(inst, request, t->context, ret);
+		talloc_free(exch);
+		RETURN_MODULE_RCODE(rcode);
+	}
+
+	RDEBUG2("Retrieving and decrypting TGT");
+	if (krb5_exchange_step(exch, &(krb5_data){ 0 }) == 1) {
+		rcode = exch->rcode;
+		talloc_free(exch);
+		RETURN_MODULE_RCODE(rcode);
+	}
+
+	exch->yielded = true;
+	return unlang_module_yield(request, krb5_exchange_resume, krb5_exchange_signal, exch);
+}
+#  endif
+
 /*
  *  Validate userid/passwd (MIT)
  */
@@ -446,6 +976,10 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		RDEBUG2("Login attempt with password");
 	}
 
+#  ifdef HAVE_KRB5_INIT_CREDS_STEP
+	if (inst->kdc_ipaddr) return krb5_exchange_start(p_result, mctx, request, password);
+#  endif
+
 #  ifdef KRB5_IS_THREAD_SAFE
 	conn = fr_pool_connection_get(inst->pool, request);
 	if (!conn) RETURN_MODULE_FAIL;
@@ -472,13 +1006,13 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	ret = krb5_get_init_creds_password(conn->context, &init_creds, client, UNCONST(char *, password->vp_strvalue),
 					   NULL, NULL, 0, NULL, inst->gic_options);
 	if (ret) {
-		rcode = krb5_process_error(inst, request, conn, ret);
+		rcode = krb5_process_error(inst, request, conn->context, ret);
 		goto cleanup;
 	}
 
 	RDEBUG2("Attempting to authenticate against service principal");
 	ret = krb5_verify_init_creds(conn->context, &init_creds, inst->server, conn->keytab, NULL, inst->vic_options);
-	if (ret) rcode = krb5_process_error(inst, request, conn, ret);
+	if (ret) rcode = krb5_process_error(inst, request, conn->context, ret);
 
 cleanup:
 	if (client) krb5_free_principal(conn->context, client);
@@ -492,6 +1026,51 @@ cleanup:
 
 #endif /* MIT_KRB5 */
 
+#ifdef HAVE_KRB5_INIT_CREDS_STEP
+/** Create the context the thread's exchanges with the KDCs use
+ *
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_krb5_t const	*inst = talloc_get_type_abort_const(instance, rlm_krb5_t);
+	rlm_krb5_thread_t	*t = talloc_get_type_abort(thread, rlm_krb5_thread_t);
+	krb5_error_code		ret;
+
+	if (!inst->kdc_ipaddr) return 0;
+
+	ret = krb5_init_context(&t->context);
+	if (ret) {
+		ERROR("Context initialisation failed: %s", rlm_krb5_error(inst, NULL, ret));
+		return -1;
+	}
+
+	ret = inst->keytabname ?
+		krb5_kt_resolve(t->context, inst->keytabname, &t->keytab) :
+		krb5_kt_default(t->context, &t->keytab);
+	if (ret) {
+		ERROR("Resolving keytab failed: %s", rlm_krb5_error(inst, t->context, ret));
+		krb5_free_context(t->context);
+		t->context = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_krb5_thread_t *t = talloc_get_type_abort(thread, rlm_krb5_thread_t);
+
+	if (!t->context) return 0;
+
+	if (t->keytab) krb5_kt_close(t->context, t->keytab);
+	krb5_free_context(t->context);
+
+	return 0;
+}
+#endif
+
 extern module_t rlm_krb5;
 module_t rlm_krb5 = {
 	.magic		= RLM_MODULE_INIT,
@@ -503,6 +1082,12 @@ module_t rlm_krb5 = {
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+#ifdef HAVE_KRB5_INIT_CREDS_STEP
+	.thread_inst_size	= sizeof(rlm_krb5_thread_t),
+	.thread_inst_type	= "rlm_krb5_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
+#endif
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate
 	},
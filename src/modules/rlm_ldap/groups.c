@@ -860,3 +860,236 @@ unlang_action_t rlm_ldap_check_cached(rlm_rcode_t *p_result,
 
 	RETURN_MODULE_NOTFOUND;
 }
+
+/** A cached group membership result
+ *
+ */
+typedef struct {
+	fr_rb_node_t	node;			//!< Entry in the lookup tree.
+	fr_dlist_t	entry;			//!< Entry in the LRU list.  Most recently used at the head.
+	char		*user_dn;		//!< Normalised DN of the user.
+	char		*group;			//!< Group name, or normalised group DN.
+	bool		member;			//!< Whether the user was a member of the group.
+	fr_time_t	expires;		//!< When this entry should no longer be used.
+} ldap_group_cache_entry_t;
+
+/** Membership cache shared by all threads using an rlm_ldap instance
+ *
+ */
+struct ldap_group_cache_s {
+	pthread_mutex_t	mutex;			//!< Protects the tree, the LRU list and entry allocation.
+	fr_rb_tree_t	*tree;			//!< Entries keyed on user DN and group.
+	fr_dlist_head_t	lru;			//!< Entries ordered by last use.
+	uint32_t	max_entries;		//!< Maximum number of entries before we start evicting.
+	fr_time_delta_t	lifetime;		//!< How long a positive result is valid for.
+	fr_time_delta_t	negative_lifetime;	//!< How long a negative result is valid for.
+};
+
+static int8_t ldap_group_cache_cmp(void const *one, void const *two)
+{
+	ldap_group_cache_entry_t const	*a = one, *b = two;
+	int				ret;
+
+	ret = strcmp(a->user_dn, b->user_dn);
+	if (ret != 0) return CMP(ret, 0);
+
+	return CMP(strcmp(a->group, b->group), 0);
+}
+
+static int _ldap_group_cache_free(rlm_ldap_group_cache_t *cache)
+{
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Allocate the cross-request membership cache
+ *
+ * Does nothing if group.membership_cache_size is 0.
+ *
+ * @param[in] inst	rlm_ldap configuration.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int rlm_ldap_group_cache_init(rlm_ldap_t *inst)
+{
+	rlm_ldap_group_cache_t *cache;
+
+	if (inst->group_cache_size == 0) return 0;
+
+	MEM(cache = talloc_zero(inst, rlm_ldap_group_cache_t));
+	if (pthread_mutex_init(&cache->mutex, NULL) != 0) {
+		ERROR("Failed initialising membership cache mutex");
+		talloc_free(cache);
+		return -1;
+	}
+	talloc_set_destructor(cache, _ldap_group_cache_free);
+
+	MEM(cache->tree = fr_rb_inline_talloc_alloc(cache, ldap_group_cache_entry_t, node,
+						    ldap_group_cache_cmp, NULL));
+	fr_dlist_talloc_init(&cache->lru, ldap_group_cache_entry_t, entry);
+	cache->max_entries = inst->group_cache_size;
+	cache->lifetime = inst->group_cache_lifetime;
+	cache->negative_lifetime = inst->group_cache_negative_lifetime;
+
+	inst->group_cache = cache;
+
+	return 0;
+}
+
+/** Unlink and free a cache entry
+ *
+ * Must be called with the cache mutex held.
+ */
+static void ldap_group_cache_entry_free(rlm_ldap_group_cache_t *cache, ldap_group_cache_entry_t *c)
+{
+	fr_rb_delete(cache->tree, c);
+	fr_dlist_remove(&cache->lru, c);
+	talloc_free(c);
+}
+
+/** Check the membership cache for a previous result
+ *
+ * @param[out] p_result		RLM_MODULE_OK if the user is a member, RLM_MODULE_NOTFOUND
+ *				if the user is not a member, RLM_MODULE_INVALID if there's
+ *				no usable entry.
+ * @param[in] inst		rlm_ldap configuration.
+ * @param[in] request		Current request.
+ * @param[in] user_dn		DN of the user.
+ * @param[in] check		vp containing the group value (name or normalised dn).
+ */
+unlang_action_t rlm_ldap_group_cache_find(rlm_rcode_t *p_result, rlm_ldap_t const *inst, request_t *request,
+					  char const *user_dn, fr_pair_t const *check)
+{
+	rlm_ldap_group_cache_t		*cache = inst->group_cache;
+	ldap_group_cache_entry_t	find, *c;
+	char				norm[LDAP_MAX_DN_STR_LEN];
+	bool				member;
+
+	if (!cache || (strlen(user_dn) >= sizeof(norm))) RETURN_MODULE_INVALID;
+
+	fr_ldap_util_normalise_dn(norm, user_dn);
+	find.user_dn = norm;
+	memcpy(&find.group, &check->vp_strvalue, sizeof(find.group));
+
+	pthread_mutex_lock(&cache->mutex);
+	c = fr_rb_find(cache->tree, &find);
+	if (!c) {
+		pthread_mutex_unlock(&cache->mutex);
+		RETURN_MODULE_INVALID;
+	}
+
+	if (fr_time() >= c->expires) {
+		ldap_group_cache_entry_free(cache, c);
+		pthread_mutex_unlock(&cache->mutex);
+		RDEBUG3("Cached membership for \"%pV\" has expired", &check->data);
+		RETURN_MODULE_INVALID;
+	}
+
+	fr_dlist_remove(&cache->lru, c);
+	fr_dlist_insert_head(&cache->lru, c);
+	member = c->member;
+	pthread_mutex_unlock(&cache->mutex);
+
+	if (!member) {
+		RDEBUG2("User is not a member of \"%pV\" (cached)", &check->data);
+		RETURN_MODULE_NOTFOUND;
+	}
+
+	RDEBUG2("User is a member of \"%pV\" (cached)", &check->data);
+	RETURN_MODULE_OK;
+}
+
+/** Record the result of a dynamic membership check
+ *
+ * If the cache is full the least recently used entry is evicted.
+ *
+ * @param[in] inst		rlm_ldap configuration.
+ * @param[in] request		Current request.
+ * @param[in] user_dn		DN of the user.
+ * @param[in] check		vp containing the group value (name or normalised dn).
+ * @param[in] member		Whether the user was found to be a member of the group.
+ */
+void rlm_ldap_group_cache_insert(rlm_ldap_t const *inst, request_t *request,
+				 char const *user_dn, fr_pair_t const *check, bool member)
+{
+	rlm_ldap_group_cache_t		*cache = inst->group_cache;
+	ldap_group_cache_entry_t	*c, *old;
+	fr_time_delta_t			lifetime;
+
+	if (!cache) return;
+
+	lifetime = member ? cache->lifetime : cache->negative_lifetime;
+	if (lifetime == 0) return;
+
+	pthread_mutex_lock(&cache->mutex);
+	c = talloc_zero(cache, ldap_group_cache_entry_t);
+	if (!c) {
+	oom:
+		pthread_mutex_unlock(&cache->mutex);
+		RWDEBUG("Failed allocating membership cache entry");
+		return;
+	}
+	c->user_dn = talloc_strdup(c, user_dn);
+	c->group = talloc_bstrndup(c, check->vp_strvalue, check->vp_length);
+	if (!c->user_dn || !c->group) {
+		talloc_free(c);
+		goto oom;
+	}
+	fr_ldap_util_normalise_dn(c->user_dn, c->user_dn);
+	c->member = member;
+	c->expires = fr_time() + lifetime;
+
+	/*
+	 *	Another thread may have raced us, replace
+	 *	its entry with ours.
+	 */
+	old = fr_rb_find(cache->tree, c);
+	if (old) {
+		ldap_group_cache_entry_free(cache, old);
+	} else if (fr_rb_num_elements(cache->tree) >= cache->max_entries) {
+		ldap_group_cache_entry_free(cache, fr_dlist_tail(&cache->lru));
+	}
+
+	fr_rb_insert(cache->tree, c);
+	fr_dlist_insert_head(&cache->lru, c);
+	pthread_mutex_unlock(&cache->mutex);
+
+	RDEBUG3("Cached %s membership of \"%pV\"", member ? "positive" : "negative", &check->data);
+}
+
+/** Remove entries from the membership cache
+ *
+ * @param[in] inst		rlm_ldap configuration.
+ * @param[in] dn		to remove entries for.  Matches either the user DN or the group.
+ *				If NULL, all entries are removed.
+ * @return The number of entries removed.
+ */
+uint32_t rlm_ldap_group_cache_flush(rlm_ldap_t const *inst, char const *dn)
+{
+	rlm_ldap_group_cache_t		*cache = inst->group_cache;
+	ldap_group_cache_entry_t	*c, *next;
+	char				norm[LDAP_MAX_DN_STR_LEN];
+	uint32_t			count = 0;
+
+	if (!cache) return 0;
+
+	if (dn) {
+		if (strlen(dn) >= sizeof(norm)) return 0;
+		fr_ldap_util_normalise_dn(norm, dn);
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+	for (c = fr_dlist_head(&cache->lru); c; c = next) {
+		next = fr_dlist_next(&cache->lru, c);
+
+		if (dn && (strcmp(c->user_dn, norm) != 0) && (strcmp(c->group, norm) != 0)) continue;
+
+		ldap_group_cache_entry_free(cache, c);
+		count++;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return count;
+}
@@ -32,6 +32,7 @@ RCSID("$Id$")
 USES_APPLE_DEPRECATED_API
 
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/unlang/base.h>
 
 #include "rlm_ldap.h"
 
@@ -121,6 +122,9 @@ static CONF_PARSER group_config[] = {
 	{ FR_CONF_OFFSET("cache_attribute", FR_TYPE_STRING, rlm_ldap_t, cache_attribute) },
 	{ FR_CONF_OFFSET("group_attribute", FR_TYPE_STRING, rlm_ldap_t, group_attribute) },
 	{ FR_CONF_OFFSET("allow_dangling_group_ref", FR_TYPE_BOOL, rlm_ldap_t, allow_dangling_group_refs), .dflt = "no" },
+	{ FR_CONF_OFFSET("membership_cache_size", FR_TYPE_UINT32, rlm_ldap_t, group_cache_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("membership_cache_lifetime", FR_TYPE_TIME_DELTA, rlm_ldap_t, group_cache_lifetime), .dflt = "300" },
+	{ FR_CONF_OFFSET("membership_cache_negative_lifetime", FR_TYPE_TIME_DELTA, rlm_ldap_t, group_cache_negative_lifetime), .dflt = "30" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -227,6 +231,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_POINTER("global", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) global_config },
 
 	{ FR_CONF_OFFSET("tls", FR_TYPE_SUBSECTION, rlm_ldap_t, handle_config), .subcs = (void const *) tls_config },
+
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_ldap_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -286,42 +292,167 @@ static ssize_t ldap_unescape_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t out
 	return fr_ldap_unescape_func(request, *out, outlen, fmt, NULL);
 }
 
-/** Expand an LDAP URL into a query, and return a string result from that query.
+/** Wrapper around the module thread struct for the ldap xlat
+ *
+ */
+typedef struct {
+	rlm_ldap_t const	*inst;			//!< Instance of rlm_ldap.
+	rlm_ldap_thread_t	*t;			//!< rlm_ldap thread instance.
+} ldap_xlat_thread_inst_t;
+
+/** Holds the state of an LDAP xlat query while we wait for the result
  *
- * @ingroup xlat_functions
  */
-static ssize_t ldap_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
-			 void const *mod_inst, UNUSED void const *xlat_inst,
-			 request_t *request, char const *fmt)
+typedef struct {
+	fr_ldap_query_t		*query;			//!< Search multiplexed onto the thread's trunk.
+							///< Freeing it cancels the search.
+	bool			timedout;		//!< res_timeout passed before we got a result.
+} ldap_xlat_rctx_t;
+
+static void ldap_xlat_timeout(request_t *request, UNUSED void *xlat_inst,
+			      UNUSED void *xlat_thread_inst, void *rctx, UNUSED fr_time_t fired)
 {
-	fr_ldap_rcode_t		status;
-	size_t			len = 0;
-	rlm_ldap_t const	*inst = mod_inst;
+	ldap_xlat_rctx_t	*our_rctx = talloc_get_type_abort(rctx, ldap_xlat_rctx_t);
 
-	LDAPURLDesc		*ldap_url;
-	LDAPMessage		*result = NULL;
-	LDAPMessage		*entry = NULL;
+	our_rctx->timedout = true;
+	unlang_interpret_mark_runnable(request);
+}
 
+/** Cancel an outstanding LDAP xlat query
+ *
+ */
+static void ldap_xlat_signal(UNUSED request_t *request, UNUSED void *xlat_inst, UNUSED void *xlat_thread_inst,
+			     void *rctx, fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	talloc_free(talloc_get_type_abort(rctx, ldap_xlat_rctx_t));
+}
+
+/** Retrieve the result of an LDAP xlat query, once the trunk has received it
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t ldap_xlat_resume(TALLOC_CTX *ctx, fr_dcursor_t *out,
+				      request_t *request, UNUSED void const *xlat_inst, UNUSED void *xlat_thread_inst,
+				      UNUSED fr_value_box_list_t *in, void *rctx)
+{
+	ldap_xlat_rctx_t	*our_rctx = talloc_get_type_abort(rctx, ldap_xlat_rctx_t);
+	fr_ldap_query_t		*query = our_rctx->query;
+
+	xlat_action_t		xa = XLAT_ACTION_DONE;
+	LDAPMessage		*entry;
 	struct berval		**values;
 
-	fr_ldap_connection_t	*conn;
-	int			ldap_errno;
+	if (our_rctx->timedout) {
+		REDEBUG("Timeout waiting for LDAP search result");
+		xa = XLAT_ACTION_FAIL;
+		goto finish;
+	}
 
-	char const		*url;
-	char const		**attrs;
+	switch (query->ret) {
+	case LDAP_PROC_SUCCESS:
+		break;
 
-	LDAPControl		*server_ctrls[] = { NULL, NULL };
+	case LDAP_PROC_NO_RESULT:
+		RDEBUG2("Search returned no results");
+		goto finish;
+
+	default:
+		REDEBUG("LDAP search failed");
+		xa = XLAT_ACTION_FAIL;
+		goto finish;
+	}
+
+	/*
+	 *	The connection the result arrived on may have
+	 *	gone by now, and the parsing functions only
+	 *	use the handle to record errors.
+	 */
+	entry = ldap_first_entry(ldap_global_handle, query->result);
+	if (!entry) {
+		RDEBUG2("Search returned no results");
+		goto finish;
+	}
+
+	values = ldap_get_values_len(ldap_global_handle, entry, query->attrs[0]);
+	if (!values) {
+		RDEBUG2("No \"%s\" attributes found in specified object", query->attrs[0]);
+		goto finish;
+	}
 
-	url = fmt;
+	if (values[0]) {
+		fr_value_box_t *vb;
 
-	if (!ldap_is_ldap_url(url)) {
+		MEM(vb = fr_value_box_alloc_null(ctx));
+		fr_value_box_bstrndup(vb, vb, NULL, values[0]->bv_val, values[0]->bv_len, true);
+		fr_dcursor_insert(out, vb);
+	}
+
+	ldap_value_free_len(values);
+
+finish:
+	talloc_free(our_rctx);
+
+	return xa;
+}
+
+/** Escape tainted parts of an LDAP URL
+ *
+ */
+static int ldap_uri_part_escape(request_t *request, fr_value_box_t *vb, UNUSED void *uctx)
+{
+	size_t	outmax = (vb->vb_length * 3) + 1;
+	size_t	outlen;
+	char	escaped[outmax];
+	char	*outbuff;
+
+	fr_assert(vb->type == FR_TYPE_STRING);
+
+	outlen = fr_ldap_escape_func(request, escaped, outmax, vb->vb_strvalue, NULL);
+	if (outlen == vb->vb_length) return 0;
+
+	if (fr_value_box_bstr_realloc(vb, &outbuff, vb, outlen) < 0) return -1;
+	memcpy(outbuff, escaped, outlen);
+
+	return 0;
+}
+
+static xlat_arg_parser_t const ldap_xlat_arg = {
+	.required = true, .concat = true, .type = FR_TYPE_STRING, .func = ldap_uri_part_escape
+};
+
+/** Expand an LDAP URL into a query, and return a string result from that query.
+ *
+ * The search is multiplexed onto one of the thread's trunk connections,
+ * and the request yields until the result arrives, so other requests can
+ * run on this worker while the directory processes the query.
+ *
+ * Example:
+@verbatim
+%{ldap:ldap:///ou=people,dc=example,dc=com?uid?sub?(uid=%{User-Name})}
+@endverbatim
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t ldap_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
+			       request_t *request, void const *xlat_inst, void *xlat_thread_inst,
+			       fr_value_box_list_t *in)
+{
+	ldap_xlat_thread_inst_t	*xt = talloc_get_type_abort(xlat_thread_inst, ldap_xlat_thread_inst_t);
+	fr_value_box_t		*url = fr_dlist_head(in);
+	ldap_xlat_rctx_t	*rctx;
+	LDAPURLDesc		*ldap_url;
+	int			ret;
+
+	if (!ldap_is_ldap_url(url->vb_strvalue)) {
 		REDEBUG("String passed does not look like an LDAP URL");
-		return -1;
+		return XLAT_ACTION_FAIL;
 	}
 
-	if (ldap_url_parse(url, &ldap_url)){
+	if (ldap_url_parse(url->vb_strvalue, &ldap_url)){
 		REDEBUG("Parsing LDAP URL failed");
-		return -1;
+		return XLAT_ACTION_FAIL;
 	}
 
 	/*
@@ -332,64 +463,105 @@ static ssize_t ldap_xlat(UNUSED TALLOC_CTX *ctx, char **out, size_t outlen,
 	    (strcmp(ldap_url->lud_attrs[0], "*") == 0) ||
 	    ldap_url->lud_attrs[1]) {
 		REDEBUG("Bad attributes list in LDAP URL. URL must specify exactly one attribute to retrieve");
-
-		goto free_urldesc;
+		ldap_free_urldesc(ldap_url);
+		return XLAT_ACTION_FAIL;
 	}
 
-	conn = mod_conn_get(inst, request);
-	if (!conn) goto free_urldesc;
+	MEM(rctx = talloc_zero(request, ldap_xlat_rctx_t));
+	MEM(rctx->query = fr_ldap_query_alloc(rctx, request, ldap_url->lud_dn, ldap_url->lud_scope,
+					      ldap_url->lud_filter, (char const * const *)ldap_url->lud_attrs));
 
-	memcpy(&attrs, &ldap_url->lud_attrs, sizeof(attrs));
+	ret = fr_ldap_parse_url_extensions(&rctx->query->serverctrls[0], request, ldap_global_handle,
+					   ldap_url->lud_exts);
+	ldap_free_urldesc(ldap_url);
+	if (ret < 0) goto error;
 
-	if (fr_ldap_parse_url_extensions(&server_ctrls[0], request, conn, ldap_url->lud_exts) < 0) goto free_socket;
+	if (fr_ldap_trunk_search(xt->t->ttrunk, rctx->query) != LDAP_PROC_SUCCESS) goto error;
 
-	status = fr_ldap_search(&result, request, &conn, ldap_url->lud_dn, ldap_url->lud_scope,
-				ldap_url->lud_filter, attrs, server_ctrls, NULL);
+	/*
+	 *	Failed before we had a chance to yield
+	 */
+	if (rctx->query->ret != LDAP_PROC_CONTINUE) return ldap_xlat_resume(ctx, out, request, xlat_inst,
+									   xlat_thread_inst, in, rctx);
 
-#ifdef HAVE_LDAP_CREATE_SORT_CONTROL
-	if (server_ctrls[0]) ldap_control_free(server_ctrls[0]);
-#endif
+	if (unlang_xlat_event_timeout_add(request, ldap_xlat_timeout, rctx,
+					  fr_time() + xt->inst->handle_config.res_timeout) < 0) goto error;
 
-	switch (status) {
-	case LDAP_PROC_SUCCESS:
-		break;
+	return unlang_xlat_yield(request, ldap_xlat_resume, ldap_xlat_signal, rctx);
 
-	default:
-		goto free_socket;
-	}
+error:
+	talloc_free(rctx);
+	return XLAT_ACTION_FAIL;
+}
 
-	fr_assert(conn);
-	fr_assert(result);
+/** Resolves and caches the module's thread instance for use by a specific xlat instance
+ *
+ * @param[in] xlat_inst			UNUSED.
+ * @param[in] xlat_thread_inst		pre-allocated structure to hold pointer to module's
+ *					thread instance.
+ * @param[in] exp			UNUSED.
+ * @param[in] uctx			Module's global instance.  Used to lookup thread
+ *					specific instance.
+ * @return 0.
+ */
+static int ldap_xlat_thread_instantiate(UNUSED void *xlat_inst, void *xlat_thread_inst,
+					UNUSED xlat_exp_t const *exp, void *uctx)
+{
+	rlm_ldap_t		*inst = talloc_get_type_abort(uctx, rlm_ldap_t);
+	ldap_xlat_thread_inst_t	*xt = xlat_thread_inst;
 
-	entry = ldap_first_entry(conn->handle, result);
-	if (!entry) {
-		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
-		REDEBUG("Failed retrieving entry: %s", ldap_err2string(ldap_errno));
-		len = -1;
-		goto free_result;
-	}
+	xt->inst = inst;
+	xt->t = talloc_get_type_abort(module_thread_by_data(inst)->data, rlm_ldap_thread_t);
 
-	values = ldap_get_values_len(conn->handle, entry, ldap_url->lud_attrs[0]);
-	if (!values) {
-		RDEBUG2("No \"%s\" attributes found in specified object", ldap_url->lud_attrs[0]);
-		goto free_result;
-	}
+	return 0;
+}
 
-	if (values[0]->bv_len >= outlen) goto free_values;
+static int ldap_group_cache_flush_xlat_instantiate(void *xlat_inst, UNUSED xlat_exp_t const *exp, void *uctx)
+{
+	*((rlm_ldap_t **)xlat_inst) = talloc_get_type_abort(uctx, rlm_ldap_t);
 
-	memcpy(*out, values[0]->bv_val, values[0]->bv_len + 1);	/* +1 as strlcpy expects buffer size */
-	len = values[0]->bv_len;
+	return 0;
+}
 
-free_values:
-	ldap_value_free_len(values);
-free_result:
-	ldap_msgfree(result);
-free_socket:
-	ldap_mod_conn_release(inst, request, conn);
-free_urldesc:
-	ldap_free_urldesc(ldap_url);
+static xlat_arg_parser_t const ldap_group_cache_flush_xlat_args[] = {
+	{ .concat = true, .type = FR_TYPE_STRING },
+	XLAT_ARG_PARSER_TERMINATOR
+};
+
+/** Remove entries from the membership cache
+ *
+ * Removes any entries where either the user DN or the group matches the
+ * argument, or every entry if no argument is given.  Returns the number of
+ * entries removed.
+ *
+ * Intended to be called from an ldap_sync virtual server when entries are
+ * modified or deleted in the directory.
+ *
+ * Example:
+@verbatim
+%(ldap_group_cache_flush:%{LDAP-Sync-Entry-DN})
+@endverbatim
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t ldap_group_cache_flush_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
+						 request_t *request, void const *xlat_inst,
+						 UNUSED void *xlat_thread_inst,
+						 fr_value_box_list_t *in)
+{
+	rlm_ldap_t const	*inst = talloc_get_type_abort_const(*((void const * const *)xlat_inst), rlm_ldap_t);
+	fr_value_box_t		*dn = fr_dlist_head(in);
+	fr_value_box_t		*vb;
+	uint32_t		count;
+
+	count = rlm_ldap_group_cache_flush(inst, (dn && dn->vb_length) ? dn->vb_strvalue : NULL);
+	RDEBUG2("Removed %u entries from the membership cache", count);
 
-	return len;
+	MEM(vb = fr_value_box_alloc(ctx, FR_TYPE_UINT32, NULL, false));
+	vb->vb_uint32 = count;
+	fr_dcursor_append(out, vb);
+
+	return XLAT_ACTION_DONE;
 }
 
 /*
@@ -480,7 +652,7 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, request_
 	conn = mod_conn_get(inst, request);
 	if (!conn) goto free_expanded;
 
-	if (fr_ldap_parse_url_extensions(&server_ctrls[0], request, conn, ldap_url->lud_exts) < 0) goto free_socket;
+	if (fr_ldap_parse_url_extensions(&server_ctrls[0], request, conn->handle, ldap_url->lud_exts) < 0) goto free_socket;
 
 	status = fr_ldap_search(&result, request, &conn, ldap_url->lud_dn, ldap_url->lud_scope,
 				ldap_url->lud_filter, expanded.attrs, server_ctrls, NULL);
@@ -670,6 +842,28 @@ static int rlm_ldap_groupcmp(void *instance, request_t *request, UNUSED fr_pair_
 
 	fr_assert(conn);
 
+	/*
+	 *	Check if an earlier request already resolved
+	 *	this user's membership of the group.
+	 */
+	if (inst->group_cache) {
+		rlm_rcode_t our_rcode;
+
+		rlm_ldap_group_cache_find(&our_rcode, inst, request, user_dn, check);
+		switch (our_rcode) {
+		case RLM_MODULE_NOTFOUND:
+			found = false;
+			goto finish;
+
+		case RLM_MODULE_OK:
+			found = true;
+			goto finish;
+
+		default:
+			break;
+		}
+	}
+
 	/*
 	 *	Check groupobj user membership
 	 */
@@ -683,7 +877,7 @@ static int rlm_ldap_groupcmp(void *instance, request_t *request, UNUSED fr_pair_
 
 		case RLM_MODULE_OK:
 			found = true;
-			FALL_THROUGH;
+			goto cache;
 
 		default:
 			goto finish;
@@ -705,7 +899,7 @@ static int rlm_ldap_groupcmp(void *instance, request_t *request, UNUSED fr_pair_
 
 		case RLM_MODULE_OK:
 			found = true;
-			FALL_THROUGH;
+			break;
 
 		default:
 			goto finish;
@@ -714,6 +908,13 @@ static int rlm_ldap_groupcmp(void *instance, request_t *request, UNUSED fr_pair_
 
 	fr_assert(conn);
 
+	/*
+	 *	Only definitive results are cached, errors
+	 *	are retried by the next request.
+	 */
+cache:
+	rlm_ldap_group_cache_insert(inst, request, user_dn, check, found);
+
 finish:
 	if (conn) ldap_mod_conn_release(inst, request, conn);
 
@@ -1449,6 +1650,46 @@ static int mod_detach(void *instance)
 	return 0;
 }
 
+/** Create a thread specific trunk of connections to the directory
+ *
+ * Connections are only opened when the first search is enqueued.
+ *
+ * @param[in] conf	section containing the configuration of this module instance.
+ * @param[in] instance	of rlm_ldap_t.
+ * @param[in] el	The event list serviced by this thread.
+ * @param[in] thread	specific data.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_ldap_t		*inst = talloc_get_type_abort(instance, rlm_ldap_t);
+	rlm_ldap_thread_t	*t = talloc_get_type_abort(thread, rlm_ldap_thread_t);
+
+	t->inst = inst;
+	t->el = el;
+	t->ttrunk = fr_ldap_thread_trunk_alloc(t, el, &inst->handle_config, &inst->trunk_conf, inst->name);
+	if (!t->ttrunk) {
+		ERROR("Failed allocating LDAP trunk");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Close all connections in the thread's trunk
+ *
+ */
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_ldap_thread_t	*t = talloc_get_type_abort(thread, rlm_ldap_thread_t);
+
+	TALLOC_FREE(t->ttrunk);
+
+	return 0;
+}
+
 /** Parse an accounting sub section.
  *
  * Allocate a new ldap_acct_section_t and write the config data into it.
@@ -1505,6 +1746,8 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	rlm_ldap_t	*inst = instance;
 	char		buffer[256];
 	char const	*group_attribute;
+	char		*name;
+	xlat_t		*xlat;
 
 	inst->name = cf_section_name2(conf);
 	if (!inst->name) inst->name = cf_section_name1(conf);
@@ -1546,7 +1789,19 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 		inst->cache_da = inst->group_da;	/* Default to the group_da */
 	}
 
-	xlat_register_legacy(inst, inst->name, ldap_xlat, fr_ldap_escape_func, NULL, 0, XLAT_DEFAULT_BUF_LEN);
+	xlat = xlat_register(inst, inst->name, ldap_xlat, true);
+	xlat_func_mono(xlat, &ldap_xlat_arg);
+	xlat_async_thread_instantiate_set(xlat, ldap_xlat_thread_instantiate, ldap_xlat_thread_inst_t, NULL, inst);
+
+	/*
+	 *	%(ldap_group_cache_flush:[<dn>])
+	 */
+	name = talloc_asprintf(NULL, "%s_group_cache_flush", inst->name);
+	xlat = xlat_register(inst, name, ldap_group_cache_flush_xlat, false);
+	xlat_func_args(xlat, ldap_group_cache_flush_xlat_args);
+	xlat_async_instantiate_set(xlat, ldap_group_cache_flush_xlat_instantiate, rlm_ldap_t *, NULL, inst);
+	talloc_free(name);
+
 	xlat_register_legacy(inst, "ldap_escape", ldap_escape_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 	xlat_register_legacy(inst, "ldap_unescape", ldap_unescape_xlat, NULL, NULL, 0, XLAT_DEFAULT_BUF_LEN);
 	map_proc_register(inst, inst->name, mod_map_proc, ldap_map_verify, 0);
@@ -2034,6 +2289,8 @@ if (inst->handle_config.tls_min_version_str) {
 						 ldap_mod_conn_create, NULL, NULL, NULL, NULL);
 	if (!inst->pool) goto error;
 
+	if (rlm_ldap_group_cache_init(inst) < 0) goto error;
+
 	fr_ldap_global_config(inst->ldap_debug, inst->tls_random_file);
 
 	return 0;
@@ -2067,6 +2324,10 @@ module_t rlm_ldap = {
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_ldap_thread_t),
+	.thread_inst_type	= "rlm_ldap_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize,
@@ -18,6 +18,7 @@
 #include <freeradius-devel/ldap/base.h>
 
 typedef struct ldap_inst_s rlm_ldap_t;
+typedef struct ldap_group_cache_s rlm_ldap_group_cache_t;
 
 typedef struct {
 	tmpl_t	*mech;				//!< SASL mech(s) to try.
@@ -112,6 +113,12 @@ struct ldap_inst_s {
 	bool		allow_dangling_group_refs;	//!< Don't error if we fail to resolve a group DN referenced
 														///< from a user object.
 
+	uint32_t	group_cache_size;		//!< Maximum number of membership results to cache.
+							//!< 0 disables the membership cache.
+	fr_time_delta_t	group_cache_lifetime;		//!< How long positive membership results are cached for.
+	fr_time_delta_t	group_cache_negative_lifetime;	//!< How long negative membership results are cached for.
+	rlm_ldap_group_cache_t *group_cache;		//!< Membership results shared between requests.
+
 	/*
 	 *	Profiles
 	 */
@@ -141,6 +148,7 @@ struct ldap_inst_s {
 
 	fr_pool_t	*pool;				//!< Connection pool instance.
 	fr_ldap_config_t handle_config;			//!< Connection configuration instance.
+	fr_trunk_conf_t	trunk_conf;			//!< Trunk configuration for asynchronous searches.
 
 	/*
 	 *	Global config
@@ -151,6 +159,15 @@ struct ldap_inst_s {
 	uint32_t	ldap_debug;			//!< Debug flag for the SDK.
 };
 
+/** Thread specific rlm_ldap data
+ *
+ */
+typedef struct {
+	rlm_ldap_t const	*inst;			//!< Instance of rlm_ldap.
+	fr_ldap_thread_trunk_t	*ttrunk;		//!< Trunk asynchronous searches are multiplexed onto.
+	fr_event_list_t		*el;			//!< Thread event list.
+} rlm_ldap_thread_t;
+
 extern fr_dict_attr_t const *attr_cleartext_password;
 extern fr_dict_attr_t const *attr_crypt_password;
 extern fr_dict_attr_t const *attr_ldap_userdn;
@@ -192,6 +209,16 @@ unlang_action_t rlm_ldap_check_userobj_dynamic(rlm_rcode_t *p_result,
 unlang_action_t rlm_ldap_check_cached(rlm_rcode_t *p_result,
 				      rlm_ldap_t const *inst, request_t *request, fr_pair_t *check);
 
+int rlm_ldap_group_cache_init(rlm_ldap_t *inst);
+
+unlang_action_t rlm_ldap_group_cache_find(rlm_rcode_t *p_result, rlm_ldap_t const *inst, request_t *request,
+					  char const *user_dn, fr_pair_t const *check);
+
+void rlm_ldap_group_cache_insert(rlm_ldap_t const *inst, request_t *request,
+				 char const *user_dn, fr_pair_t const *check, bool member);
+
+uint32_t rlm_ldap_group_cache_flush(rlm_ldap_t const *inst, char const *dn);
+
 /*
  *	conn.c - Connection wrappers.
  */
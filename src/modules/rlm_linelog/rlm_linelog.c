@@ -25,8 +25,11 @@ RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/exfile.h>
+#include <freeradius-devel/server/metrics.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/server/trunk.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/util/perm.h>
 
 #ifdef HAVE_FCNTL_H
@@ -49,6 +52,9 @@ RCSID("$Id$")
 #endif
 
 #include <sys/uio.h>
+#include <stdatomic.h>
+
+#define LINELOG_UDP_BATCH	64		//!< Most datagrams to send with one call to sendmmsg().
 
 typedef enum {
 	LINELOG_DST_INVALID = 0,
@@ -68,11 +74,33 @@ static fr_table_num_sorted_t const linefr_log_dst_table[] = {
 };
 static size_t linefr_log_dst_table_len = NUM_ELEMENTS(linefr_log_dst_table);
 
+typedef enum {
+	LINELOG_FRAMING_INVALID = 0,
+	LINELOG_FRAMING_DELIMITED,			//!< Lines are separated by the delimiter.
+	LINELOG_FRAMING_OCTET_COUNTED,			//!< Lines are prefixed with their length (RFC 6587).
+} linelog_framing_t;
+
+static fr_table_num_sorted_t const linelog_framing_table[] = {
+	{ L("delimited"),	LINELOG_FRAMING_DELIMITED	},
+	{ L("octet-counted"),	LINELOG_FRAMING_OCTET_COUNTED	}
+};
+static size_t linelog_framing_table_len = NUM_ELEMENTS(linelog_framing_table);
+
 typedef struct {
 	fr_ipaddr_t		dst_ipaddr;		//!< Network server.
 	fr_ipaddr_t		src_ipaddr;		//!< Send requests from a given src_ipaddr.
 	uint16_t		port;			//!< Network port.
 	fr_time_delta_t		timeout;		//!< How long to wait for read/write operations.
+
+	char const		*framing_str;		//!< How lines are separated on a stream.
+	linelog_framing_t	framing;		//!< Resolved framing.
+
+	bool			async;			//!< Queue lines on a per-thread trunk, instead
+							///< of writing them while the request waits.
+	size_t			max_batch;		//!< Most data to send at once.
+	size_t			max_buffered;		//!< Most data a thread may have queued before
+							///< new lines are dropped.
+	fr_trunk_conf_t		trunk_conf;		//!< Trunk configuration.
 } linelog_net_t;
 
 /** linelog module instance
@@ -123,6 +151,66 @@ typedef struct {
 	int			sockfd;			//!< File descriptor associated with socket
 } linelog_conn_t;
 
+/** Thread instance, used when lines are sent asynchronously
+ *
+ */
+typedef struct {
+	rlm_linelog_t const	*inst;			//!< Module instance.
+	linelog_net_t const	*net;			//!< Destination lines are sent to.
+	fr_trunk_t		*trunk;			//!< Connections to the destination.
+
+	uint64_t		seq;			//!< Sequence number of the next line, so lines
+							///< are sent in the order they were queued.
+	size_t			buffered;		//!< Bytes of lines queued, and not yet sent.
+
+	struct {
+		uint64_t		queued;			//!< Lines accepted for sending.
+		uint64_t		sent;			//!< Lines written to the destination.
+		uint64_t		dropped;		//!< Lines refused because too much was queued,
+								///< or there was no destination.
+		uint64_t		failed;			//!< Lines which were queued, but couldn't be sent.
+	} stats;
+
+	fr_metrics_source_t	*metrics;		//!< Our statistics, as seen by the metrics exporter.
+} rlm_linelog_thread_t;
+
+/** A line waiting to be sent
+ *
+ * Lines aren't associated with the request that logged them, so they
+ * continue to be sent after the request is done.
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the handle's list of lines being written.
+	rlm_linelog_thread_t	*t;			//!< Thread the line was queued on.
+	fr_trunk_request_t	*treq;			//!< Trunk request for the line.
+	uint64_t		seq;			//!< When the line was queued.
+	uint8_t			*data;			//!< Framed line.
+	size_t			len;			//!< Length of the framed line.
+} linelog_line_t;
+
+/** An asynchronous connection to a TCP or UDP destination
+ *
+ */
+typedef struct {
+	rlm_linelog_t const	*inst;			//!< Module instance.
+	linelog_net_t const	*net;			//!< Destination we're connected to.
+	int			fd;			//!< Connected socket.
+	fr_event_list_t		*el;			//!< Event list the I/O handlers are registered with.
+	fr_trunk_connection_t	*tconn;			//!< Trunk connection this handle belongs to.
+	bool			want_write;		//!< The trunk has lines to write.
+
+	fr_dlist_head_t		batch;			//!< Lines in the write buffer (TCP).
+	uint8_t			*wbuf;			//!< Lines being written (TCP).
+	size_t			wbuf_used;		//!< Amount of data in the write buffer.
+	size_t			wbuf_written;		//!< How much of the write buffer has been written.
+
+	fr_trunk_request_t	*treqs[LINELOG_UDP_BATCH];	//!< Lines being sent (UDP).
+	struct iovec		iov[LINELOG_UDP_BATCH];		//!< One per datagram.
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr		mmsgvec[LINELOG_UDP_BATCH];	//!< Passed to sendmmsg().
+#endif
+} linelog_handle_t;
+
 
 static const CONF_PARSER file_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_OUTPUT | FR_TYPE_XLAT, rlm_linelog_t, file.name) },
@@ -147,6 +235,11 @@ static const CONF_PARSER udp_config[] = {
 	{ FR_CONF_OFFSET("server", FR_TYPE_COMBO_IP_ADDR, linelog_net_t, dst_ipaddr) },
 	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, linelog_net_t, port) },
 	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, linelog_net_t, timeout), .dflt = "1000" },
+
+	{ FR_CONF_OFFSET("async", FR_TYPE_BOOL, linelog_net_t, async), .dflt = "no" },
+	{ FR_CONF_OFFSET("max_batch", FR_TYPE_SIZE, linelog_net_t, max_batch), .dflt = "65536" },
+	{ FR_CONF_OFFSET("max_buffered", FR_TYPE_SIZE, linelog_net_t, max_buffered), .dflt = "1048576" },
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, linelog_net_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -154,6 +247,12 @@ static const CONF_PARSER tcp_config[] = {
 	{ FR_CONF_OFFSET("server", FR_TYPE_COMBO_IP_ADDR, linelog_net_t, dst_ipaddr) },
 	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, linelog_net_t, port) },
 	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, linelog_net_t, timeout), .dflt = "1000" },
+	{ FR_CONF_OFFSET("framing", FR_TYPE_STRING, linelog_net_t, framing_str), .dflt = "delimited" },
+
+	{ FR_CONF_OFFSET("async", FR_TYPE_BOOL, linelog_net_t, async), .dflt = "no" },
+	{ FR_CONF_OFFSET("max_batch", FR_TYPE_SIZE, linelog_net_t, max_batch), .dflt = "65536" },
+	{ FR_CONF_OFFSET("max_buffered", FR_TYPE_SIZE, linelog_net_t, max_buffered), .dflt = "1048576" },
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, linelog_net_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -270,6 +369,551 @@ static void *mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t ti
 	return conn;
 }
 
+static void linelog_handle_io_update(linelog_handle_t *h);
+
+/** Write as much of the TCP write buffer as the socket will accept
+ *
+ * Lines are only marked as complete once all of the buffer has been
+ * written.
+ *
+ * @param[in] h		to write the buffer for.
+ * @return
+ *	- 0 if the buffer was written, or the socket would block.
+ *	- -1 on error.  The caller should signal the connection to reconnect.
+ */
+static int linelog_handle_flush(linelog_handle_t *h)
+{
+	linelog_line_t	*line;
+	ssize_t		slen;
+
+	while (h->wbuf_written < h->wbuf_used) {
+		slen = write(h->fd, h->wbuf + h->wbuf_written, h->wbuf_used - h->wbuf_written);
+		if (slen < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+			ERROR("%s - Failed writing to %pV:%u: %s", h->inst->name,
+			      fr_box_ipaddr(h->net->dst_ipaddr), h->net->port, fr_syserror(errno));
+			return -1;
+		}
+		h->wbuf_written += slen;
+	}
+
+	h->wbuf_used = h->wbuf_written = 0;
+
+	while ((line = fr_dlist_pop_head(&h->batch))) fr_trunk_request_signal_complete(line->treq);
+
+	return 0;
+}
+
+/** Send a batch of datagrams
+ *
+ * @param[in] tconn	the datagrams are being sent over.
+ * @param[in] h		holding the datagrams.
+ * @param[in] queued	how many datagrams there are.
+ * @return
+ *	- The number of datagrams, from the start of the batch, which were
+ *	  sent, or failed.
+ *	- -1 if the connection has been signalled to reconnect.
+ */
+static int linelog_udp_send(fr_trunk_connection_t *tconn, linelog_handle_t *h, int queued)
+{
+	int	sent = 0;
+
+	while (sent < queued) {
+		int	ret;
+
+#ifdef HAVE_SENDMMSG
+		ret = sendmmsg(h->fd, &h->mmsgvec[sent], queued - sent, 0);
+#else
+		ret = (write(h->fd, h->iov[sent].iov_base, h->iov[sent].iov_len) < 0) ? -1 : 1;
+#endif
+		if (ret < 0) switch (errno) {
+		/*
+		 *	Temporary conditions, the rest of
+		 *	the batch is sent later.
+		 */
+#if defined(EWOULDBLOCK) && (EWOULDBLOCK != EAGAIN)
+		case EWOULDBLOCK:
+#endif
+		case EAGAIN:
+		case EINTR:
+		case ENOBUFS:
+		case ENOMEM:
+			return sent;
+
+		/*
+		 *	The collector isn't listening.  The
+		 *	datagram is lost, so carry on.
+		 */
+		case ECONNREFUSED:
+		case EMSGSIZE:
+			ERROR("%s - Failed sending to %pV:%u: %s", h->inst->name,
+			      fr_box_ipaddr(h->net->dst_ipaddr), h->net->port, fr_syserror(errno));
+			fr_trunk_request_signal_fail(h->treqs[sent]);
+			h->treqs[sent] = NULL;
+			return sent + 1;
+
+		default:
+			ERROR("%s - Failed sending to %pV:%u: %s", h->inst->name,
+			      fr_box_ipaddr(h->net->dst_ipaddr), h->net->port, fr_syserror(errno));
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return -1;
+		}
+
+		sent += ret;
+	}
+
+	return sent;
+}
+
+static void _linelog_conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+				int fd_errno, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	linelog_handle_t	*h = talloc_get_type_abort(tconn->conn->h, linelog_handle_t);
+
+	ERROR("%s - Connection to %pV:%u failed: %s", h->inst->name,
+	      fr_box_ipaddr(h->net->dst_ipaddr), h->net->port, fr_syserror(fd_errno));
+
+	fr_connection_signal_reconnect(tconn->conn, FR_CONNECTION_FAILED);
+}
+
+/** Discard anything the destination sends us
+ *
+ * Log collectors don't reply, but reading tells us when a TCP connection
+ * has been closed.
+ */
+static void _linelog_conn_readable(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	linelog_handle_t	*h = talloc_get_type_abort(tconn->conn->h, linelog_handle_t);
+	uint8_t			discard[256];
+	ssize_t			slen;
+
+	while ((slen = read(fd, discard, sizeof(discard))) > 0);
+
+	if (slen == 0) {
+		ERROR("%s - %pV:%u closed the connection", h->inst->name,
+		      fr_box_ipaddr(h->net->dst_ipaddr), h->net->port);
+		fr_connection_signal_reconnect(tconn->conn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	/*
+	 *	ICMP errors for earlier datagrams
+	 *	are reported here.  Ignore them.
+	 */
+	if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR) || (errno == ECONNREFUSED)) return;
+
+	ERROR("%s - Failed reading from %pV:%u: %s", h->inst->name,
+	      fr_box_ipaddr(h->net->dst_ipaddr), h->net->port, fr_syserror(errno));
+	fr_connection_signal_reconnect(tconn->conn, FR_CONNECTION_FAILED);
+}
+
+static void _linelog_conn_writable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	linelog_handle_t	*h = talloc_get_type_abort(tconn->conn->h, linelog_handle_t);
+
+	/*
+	 *	Finish writing the last batch first.
+	 */
+	if (h->wbuf_used) {
+		if (linelog_handle_flush(h) < 0) {
+			fr_connection_signal_reconnect(tconn->conn, FR_CONNECTION_FAILED);
+			return;
+		}
+		if (h->wbuf_used) return;
+
+		linelog_handle_io_update(h);
+	}
+
+	if (h->want_write) fr_trunk_connection_signal_writable(tconn);
+}
+
+/** Register I/O handlers for a connection
+ *
+ */
+static void linelog_handle_io_update(linelog_handle_t *h)
+{
+	bool write = h->want_write || (h->wbuf_used > 0);
+
+	if (fr_event_fd_insert(h, h->el, h->fd,
+			       _linelog_conn_readable,
+			       write ? _linelog_conn_writable : NULL,
+			       _linelog_conn_error,
+			       h->tconn) < 0) {
+		PERROR("%s - Failed inserting connection I/O handlers", h->inst->name);
+		fr_connection_signal_reconnect(h->tconn->conn, FR_CONNECTION_FAILED);
+	}
+}
+
+static void _linelog_conn_notify(fr_trunk_connection_t *tconn, fr_connection_t *conn,
+				 fr_event_list_t *el,
+				 fr_trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	linelog_handle_t *h = talloc_get_type_abort(conn->h, linelog_handle_t);
+
+	h->tconn = tconn;
+	h->el = el;
+	h->want_write = (notify_on == FR_TRUNK_CONN_EVENT_WRITE) || (notify_on == FR_TRUNK_CONN_EVENT_BOTH);
+
+	linelog_handle_io_update(h);
+}
+
+static fr_connection_state_t _linelog_conn_init(void **h_out, fr_connection_t *conn, void *uctx)
+{
+	rlm_linelog_thread_t	*t = talloc_get_type_abort(uctx, rlm_linelog_thread_t);
+	linelog_net_t const	*net = t->net;
+	linelog_handle_t	*h;
+	int			fd;
+
+	if (t->inst->log_dst == LINELOG_DST_TCP) {
+		DEBUG2("%s - Opening TCP connection to %pV:%u", t->inst->name, fr_box_ipaddr(net->dst_ipaddr), net->port);
+		fd = fr_socket_client_tcp(NULL, &net->dst_ipaddr, net->port, true);
+	} else {
+		DEBUG2("%s - Opening UDP connection to %pV:%u", t->inst->name, fr_box_ipaddr(net->dst_ipaddr), net->port);
+		fd = fr_socket_client_udp(NULL, NULL, &net->dst_ipaddr, net->port, true);
+	}
+	if (fd < 0) {
+		PERROR("%s - Failed opening connection", t->inst->name);
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+	MEM(h = talloc_zero(conn, linelog_handle_t));
+	h->inst = t->inst;
+	h->net = net;
+	h->fd = fd;
+	fr_dlist_talloc_init(&h->batch, linelog_line_t, entry);
+	if (t->inst->log_dst == LINELOG_DST_TCP) MEM(h->wbuf = talloc_array(h, uint8_t, net->max_batch));
+
+	fr_connection_signal_on_fd(conn, fd);
+	*h_out = h;
+
+	return FR_CONNECTION_STATE_CONNECTING;
+}
+
+static fr_connection_state_t _linelog_conn_open(UNUSED fr_event_list_t *el, UNUSED void *h, UNUSED void *uctx)
+{
+	return FR_CONNECTION_STATE_CONNECTED;
+}
+
+static void _linelog_conn_close(UNUSED fr_event_list_t *el, void *h_in, UNUSED void *uctx)
+{
+	linelog_handle_t *h = talloc_get_type_abort(h_in, linelog_handle_t);
+
+	talloc_free_children(h);	/* Clear the IO handlers */
+
+	if (shutdown(h->fd, SHUT_RDWR) < 0) DEBUG3("%s - Shutdown failed: %s", h->inst->name, fr_syserror(errno));
+	if (close(h->fd) < 0) DEBUG3("%s - Closing socket failed: %s", h->inst->name, fr_syserror(errno));
+
+	talloc_free(h);
+}
+
+static fr_connection_t *linelog_conn_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
+					   fr_connection_conf_t const *conf,
+					   char const *log_prefix, void *uctx)
+{
+	return fr_connection_alloc(tconn, el,
+				   &(fr_connection_funcs_t){
+					.init = _linelog_conn_init,
+					.open = _linelog_conn_open,
+					.close = _linelog_conn_close
+				   },
+				   conf, log_prefix, uctx);
+}
+
+/** Coalesce pending lines into a single write
+ *
+ * Lines are complete once the whole batch has been written.
+ */
+static void linelog_request_mux_tcp(fr_trunk_connection_t *tconn, fr_connection_t *conn, linelog_handle_t *h)
+{
+	fr_trunk_request_t	*treq;
+
+	/*
+	 *	Don't start a new batch until the
+	 *	previous one has been written.
+	 */
+	if (h->wbuf_used) return;
+
+	while ((fr_trunk_connection_pop_request(&treq, tconn) == 0) && treq) {
+		linelog_line_t *line = talloc_get_type_abort(treq->preq, linelog_line_t);
+
+		if (h->wbuf_used && ((h->wbuf_used + line->len) > talloc_array_length(h->wbuf))) break;
+
+		/*
+		 *	Lines are limited to max_batch
+		 *	when they're queued.
+		 */
+		memcpy(h->wbuf + h->wbuf_used, line->data, line->len);
+		h->wbuf_used += line->len;
+
+		fr_dlist_insert_tail(&h->batch, line);
+		fr_trunk_request_signal_sent(treq);
+	}
+
+	if (linelog_handle_flush(h) < 0) {
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	/*
+	 *	Wait for the socket to become
+	 *	writable again.
+	 */
+	if (h->wbuf_used) linelog_handle_io_update(h);
+}
+
+/** Send pending lines as a batch of datagrams
+ *
+ */
+static void linelog_request_mux_udp(fr_trunk_connection_t *tconn, linelog_handle_t *h)
+{
+	fr_trunk_request_t	*treq;
+	int			i, queued = 0, sent;
+	size_t			total_len = 0;
+
+	while ((queued < LINELOG_UDP_BATCH) && (fr_trunk_connection_pop_request(&treq, tconn) == 0) && treq) {
+		linelog_line_t *line = talloc_get_type_abort(treq->preq, linelog_line_t);
+
+		if (queued && ((total_len + line->len) > h->net->max_batch)) break;
+
+		h->treqs[queued] = treq;
+		h->iov[queued].iov_base = line->data;
+		h->iov[queued].iov_len = line->len;
+#ifdef HAVE_SENDMMSG
+		h->mmsgvec[queued] = (struct mmsghdr){
+			.msg_hdr = {
+				.msg_iov = &h->iov[queued],
+				.msg_iovlen = 1
+			}
+		};
+#endif
+		total_len += line->len;
+		queued++;
+
+		fr_trunk_request_signal_sent(treq);
+	}
+	if (!queued) return;
+
+	sent = linelog_udp_send(tconn, h, queued);
+	if (sent < 0) return;
+
+	for (i = 0; i < sent; i++) if (h->treqs[i]) fr_trunk_request_signal_complete(h->treqs[i]);
+
+	/*
+	 *	Lines that weren't sent go back
+	 *	to the pending queue.
+	 */
+	for (i = sent; i < queued; i++) fr_trunk_request_requeue(h->treqs[i]);
+}
+
+static void _linelog_request_mux(UNUSED fr_event_list_t *el, fr_trunk_connection_t *tconn,
+				 fr_connection_t *conn, UNUSED void *uctx)
+{
+	linelog_handle_t *h = talloc_get_type_abort(conn->h, linelog_handle_t);
+
+	if (h->inst->log_dst == LINELOG_DST_TCP) {
+		linelog_request_mux_tcp(tconn, conn, h);
+	} else {
+		linelog_request_mux_udp(tconn, h);
+	}
+}
+
+/** Remove a line from the write buffer's list, if it's being moved to another connection
+ *
+ */
+static void _linelog_request_conn_release(UNUSED fr_connection_t *conn, void *preq, UNUSED void *uctx)
+{
+	linelog_line_t *line = talloc_get_type_abort(preq, linelog_line_t);
+
+	if (fr_dlist_entry_in_list(&line->entry)) fr_dlist_entry_unlink(&line->entry);
+}
+
+static void _linelog_request_complete(UNUSED request_t *request, void *preq, UNUSED void *rctx, UNUSED void *uctx)
+{
+	linelog_line_t *line = talloc_get_type_abort(preq, linelog_line_t);
+
+	line->t->stats.sent++;
+}
+
+static void _linelog_request_fail(UNUSED request_t *request, void *preq, UNUSED void *rctx,
+				  UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
+{
+	linelog_line_t *line = talloc_get_type_abort(preq, linelog_line_t);
+
+	line->t->stats.failed++;
+}
+
+static void _linelog_request_free(UNUSED request_t *request, void *preq, UNUSED void *uctx)
+{
+	linelog_line_t *line = talloc_get_type_abort(preq, linelog_line_t);
+
+	line->t->buffered -= line->len;
+	talloc_free(line);
+}
+
+/** Send lines in the order they were queued
+ *
+ */
+static int8_t _linelog_request_prioritise(void const *one, void const *two)
+{
+	linelog_line_t const *a = one, *b = two;
+
+	return CMP(a->seq, b->seq);
+}
+
+/** Queue a line to be sent asynchronously
+ *
+ * The request doesn't wait for the line to be written.  If the destination
+ * isn't keeping up, and too much data is already queued, the line is dropped.
+ *
+ * @param[in] t		Thread instance.
+ * @param[in] request	The current request.
+ * @param[in] vector	Line to send.
+ * @param[in] vector_len	Number of elements in the vector.
+ * @return
+ *	- #RLM_MODULE_OK if the line was queued.
+ *	- #RLM_MODULE_FAIL if it was dropped.
+ */
+static rlm_rcode_t linelog_enqueue(rlm_linelog_thread_t *t, request_t *request,
+				   struct iovec const *vector, size_t vector_len)
+{
+	linelog_line_t	*line;
+	size_t		i, len = 0;
+	uint8_t		*p;
+
+	for (i = 0; i < vector_len; i++) len += vector[i].iov_len;
+
+	if (len > t->net->max_batch) {
+		REDEBUG("Line length %zu exceeds max_batch (%zu bytes)", len, t->net->max_batch);
+		t->stats.dropped++;
+		return RLM_MODULE_FAIL;
+	}
+
+	if ((t->buffered + len) > t->net->max_buffered) {
+		RATE_LIMIT_GLOBAL_ROPTIONAL(RWARN, WARN, "%s - Dropping lines, %zu bytes are already queued for "
+					    "%pV:%u", t->inst->name, t->buffered,
+					    fr_box_ipaddr(t->net->dst_ipaddr), t->net->port);
+		t->stats.dropped++;
+		return RLM_MODULE_FAIL;
+	}
+
+	MEM(line = talloc_zero(t, linelog_line_t));
+	MEM(line->data = p = talloc_array(line, uint8_t, len));
+	for (i = 0; i < vector_len; i++) {
+		memcpy(p, vector[i].iov_base, vector[i].iov_len);
+		p += vector[i].iov_len;
+	}
+	line->len = len;
+	line->t = t;
+	line->seq = t->seq++;
+	fr_dlist_entry_init(&line->entry);
+
+	switch (fr_trunk_request_enqueue(&line->treq, t->trunk, NULL, line, line)) {
+	case FR_TRUNK_ENQUEUE_OK:
+	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
+		break;
+
+	default:
+		REDEBUG("Failed queueing line for %pV:%u", fr_box_ipaddr(t->net->dst_ipaddr), t->net->port);
+		talloc_free(line);
+		t->stats.dropped++;
+		return RLM_MODULE_FAIL;
+	}
+
+	t->buffered += len;
+	t->stats.queued++;
+
+	RDEBUG2("Queued %zu bytes", len);
+
+	return RLM_MODULE_OK;
+}
+
+static fr_metric_def_t const linelog_metrics[] = {
+	{ .name = "queued", .help = "Lines accepted for sending.", .type = FR_METRIC_COUNTER },
+	{ .name = "sent", .help = "Lines written to the destination.", .type = FR_METRIC_COUNTER },
+	{ .name = "dropped", .help = "Lines refused because the destination wasn't keeping up.",
+	  .type = FR_METRIC_COUNTER },
+	{ .name = "failed", .help = "Lines which were queued, but couldn't be sent.", .type = FR_METRIC_COUNTER },
+	{ .name = "buffered_bytes", .help = "Data queued, and not yet sent.", .type = FR_METRIC_GAUGE },
+};
+
+static void linelog_metrics_snapshot(uint64_t *values, void const *uctx)
+{
+	rlm_linelog_thread_t const *t = uctx;
+
+	values[0] = t->stats.queued;
+	values[1] = t->stats.sent;
+	values[2] = t->stats.dropped;
+	values[3] = t->stats.failed;
+	values[4] = t->buffered;
+}
+
+static fr_metrics_class_t const linelog_metrics_class = {
+	.name = "linelog",
+	.defs = linelog_metrics,
+	.num_defs = NUM_ELEMENTS(linelog_metrics),
+	.snapshot = linelog_metrics_snapshot
+};
+
+static atomic_uint linelog_thread_instance;
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_linelog_t const	*inst = talloc_get_type_abort_const(instance, rlm_linelog_t);
+	rlm_linelog_thread_t	*t = talloc_get_type_abort(thread, rlm_linelog_thread_t);
+	char			thread_instance[20];
+
+	t->inst = inst;
+
+	switch (inst->log_dst) {
+	case LINELOG_DST_TCP:
+		t->net = &inst->tcp;
+		break;
+
+	case LINELOG_DST_UDP:
+		t->net = &inst->udp;
+		break;
+
+	default:
+		return 0;
+	}
+
+	if (!t->net->async) return 0;
+
+	t->trunk = fr_trunk_alloc(t, el,
+				  &(fr_trunk_io_funcs_t){
+					.connection_alloc = linelog_conn_alloc,
+					.connection_notify = _linelog_conn_notify,
+					.request_prioritise = _linelog_request_prioritise,
+					.request_mux = _linelog_request_mux,
+					.request_conn_release = _linelog_request_conn_release,
+					.request_complete = _linelog_request_complete,
+					.request_fail = _linelog_request_fail,
+					.request_free = _linelog_request_free
+				  },
+				  &t->net->trunk_conf, inst->name, t, false);
+	if (!t->trunk) return -1;
+
+	snprintf(thread_instance, sizeof(thread_instance), "%u", atomic_fetch_add(&linelog_thread_instance, 1));
+	MEM(t->metrics = fr_metrics_source_add(t, &linelog_metrics_class, t,
+					       "module", inst->name, "instance", thread_instance, NULL));
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_linelog_thread_t *t = talloc_get_type_abort(thread, rlm_linelog_thread_t);
+
+	TALLOC_FREE(t->metrics);
+	TALLOC_FREE(t->trunk);	/* Fails any lines which haven't been sent */
+
+	return 0;
+}
+
 static int mod_detach(void *instance)
 {
 	rlm_linelog_t *inst = instance;
@@ -280,6 +924,23 @@ static int mod_detach(void *instance)
 }
 
 
+/** Check the configuration for asynchronous sending
+ *
+ */
+static int linelog_async_check(CONF_SECTION *conf, linelog_net_t *net)
+{
+	FR_SIZE_BOUND_CHECK("max_batch", net->max_batch, >=, (size_t)1024);
+	FR_SIZE_BOUND_CHECK("max_buffered", net->max_buffered, >=, net->max_batch);
+
+	/*
+	 *	Lines are kept while we reconnect,
+	 *	up to max_buffered.
+	 */
+	net->trunk_conf.backlog_on_failed_conn = true;
+
+	return 0;
+}
+
 /*
  *	Instantiate the module.
  */
@@ -384,12 +1045,29 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		break;
 
 	case LINELOG_DST_UDP:
+		if (inst->udp.async) {
+			if (linelog_async_check(conf, &inst->udp) < 0) return -1;
+			break;
+		}
+
 		inst->pool = module_connection_pool_init(cf_section_find(conf, "udp", NULL),
 							 inst, mod_conn_create, NULL, prefix, NULL, NULL);
 		if (!inst->pool) return -1;
 		break;
 
 	case LINELOG_DST_TCP:
+		inst->tcp.framing = fr_table_value_by_str(linelog_framing_table, inst->tcp.framing_str,
+							  LINELOG_FRAMING_INVALID);
+		if (inst->tcp.framing == LINELOG_FRAMING_INVALID) {
+			cf_log_err(conf, "Invalid framing \"%s\"", inst->tcp.framing_str);
+			return -1;
+		}
+
+		if (inst->tcp.async) {
+			if (linelog_async_check(conf, &inst->tcp) < 0) return -1;
+			break;
+		}
+
 		inst->pool = module_connection_pool_init(cf_section_find(conf, "tcp", NULL),
 							 inst, mod_conn_create, NULL, prefix, NULL, NULL);
 		if (!inst->pool) return -1;
@@ -450,6 +1128,7 @@ static size_t linelog_escape_func(UNUSED request_t *request,
 static unlang_action_t CC_HINT(nonnull) mod_do_linelog(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_linelog_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_linelog_t);
+	rlm_linelog_thread_t		*t = talloc_get_type_abort(mctx->thread, rlm_linelog_thread_t);
 	linelog_conn_t			*conn;
 	fr_time_delta_t			timeout = 0;
 	char				buff[4096];
@@ -461,9 +1140,9 @@ static unlang_action_t CC_HINT(nonnull) mod_do_linelog(rlm_rcode_t *p_result, mo
 	ssize_t				slen;
 
 	struct iovec			vector_s[2];
-	struct iovec			*vector = NULL, *vector_p;
+	struct iovec			*vector = NULL, *vector_p, *framed = NULL;
 	size_t				vector_len;
-	bool				with_delim;
+	bool				with_delim, octet_counted;
 
 	buff[0] = '.';	/* force to be in current section (by default) */
 	buff[1] = '\0';
@@ -553,7 +1232,8 @@ static unlang_action_t CC_HINT(nonnull) mod_do_linelog(rlm_rcode_t *p_result, mo
 	}
 
 build_vector:
-	with_delim = (inst->log_dst != LINELOG_DST_SYSLOG) && (inst->delimiter_len > 0);
+	octet_counted = (inst->log_dst == LINELOG_DST_TCP) && (inst->tcp.framing == LINELOG_FRAMING_OCTET_COUNTED);
+	with_delim = (inst->log_dst != LINELOG_DST_SYSLOG) && (inst->delimiter_len > 0) && !octet_counted;
 
 	/*
 	 *	Log all the things!
@@ -638,6 +1318,25 @@ build_vector:
 		goto finish;
 	}
 
+	/*
+	 *	Prefix each message with its length
+	 */
+	if (octet_counted) {
+		size_t i;
+
+		MEM(framed = talloc_array(request, struct iovec, vector_len * 2));
+		for (i = 0; i < vector_len; i++) {
+			char *len_str;
+
+			MEM(len_str = talloc_asprintf(framed, "%zu ", vector_p[i].iov_len));
+			framed[i * 2].iov_base = len_str;
+			framed[i * 2].iov_len = talloc_array_length(len_str) - 1;
+			framed[(i * 2) + 1] = vector_p[i];
+		}
+		vector_p = framed;
+		vector_len *= 2;
+	}
+
 	/*
 	 *	Reserve a handle, write out the data, close the handle
 	 */
@@ -695,6 +1394,8 @@ build_vector:
 		goto do_write;
 
 	case LINELOG_DST_UDP:
+		if (t->trunk) goto do_enqueue;
+
 		if (inst->udp.timeout) {
 			timeout = inst->udp.timeout;
 		}
@@ -703,6 +1404,13 @@ build_vector:
 	case LINELOG_DST_TCP:
 	{
 		int i, num;
+
+		if (t->trunk) {
+		do_enqueue:
+			rcode = linelog_enqueue(t, request, vector_p, vector_len);
+			break;
+		}
+
 		if (inst->tcp.timeout) {
 			timeout = inst->tcp.timeout;
 		}
@@ -781,6 +1489,7 @@ build_vector:
 finish:
 	talloc_free(vpt);
 	talloc_free(vector);
+	talloc_free(framed);
 
 	/* coverity[missing_unlock] */
 	RETURN_MODULE_RCODE(rcode);
@@ -795,8 +1504,11 @@ module_t rlm_linelog = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "linelog",
 	.inst_size	= sizeof(rlm_linelog_t),
+	.thread_inst_size	= sizeof(rlm_linelog_thread_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.detach		= mod_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_do_linelog,
@@ -501,6 +501,8 @@ static int _lua_list_iterator_init(lua_State *L)
 	request_t			*request = fr_lua_util_get_request();
 	fr_dcursor_t		*cursor;
 
+	if (!request) return luaL_error(L, "fr.request is only available when processing a request");
+
 	cursor = (fr_dcursor_t*) lua_newuserdata(L, sizeof(fr_dcursor_t));
 	if (!cursor) {
 		REDEBUG("Failed allocating user data to hold cursor");
@@ -525,6 +527,8 @@ static int _lua_pair_accessor_init(lua_State *L)
 	fr_dict_attr_t const	*da;
 	fr_dict_attr_t		*up;
 
+	if (!request) return luaL_error(L, "fr.request is only available when processing a request");
+
 	attr = lua_tostring(L, -1);
 	if (!attr) {
 		REDEBUG("Failed retrieving field name \"%s\"", attr);
@@ -609,22 +613,25 @@ char const *fr_lua_version(lua_State *L)
 	return version;
 }
 
-/** Check if a given function was loaded into an index in the global table
+/** Check a given function was loaded into an index in the global table, and reference it
  *
- * Also check what was loaded there is a function and that it accepts the correct arguments.
+ * Also check what was loaded there is a function.  The reference lets
+ * us call the function without looking it up by name each time.
  *
- * @param inst Current instance of fr_lua
- * @param L the lua state
- * @param name of function to check.
+ * @param[in] inst	Current instance of fr_lua.
+ * @param[in] L		the lua state.
+ * @param[out] ref	Where to write the registry reference.  LUA_NOREF if name is NULL.
+ * @param[in] name	of function to check.
  * @returns 0 on success (function is present and correct), or -1 on failure.
  */
-static int fr_lua_check_func(rlm_lua_t const *inst, lua_State *L, char const *name)
+static int fr_lua_func_ref(rlm_lua_t const *inst, lua_State *L, int *ref, char const *name)
 {
 	int ret;
 	int type;
 
 	RLM_LUA_STACK_SET();
 
+	*ref = LUA_NOREF;
 	if (name == NULL) return 0;
 
 	lua_getglobal(L, name);
@@ -647,66 +654,23 @@ static int fr_lua_check_func(rlm_lua_t const *inst, lua_State *L, char const *na
 		ret = -1;
 		goto done;
 	}
+	*ref = luaL_ref(L, LUA_REGISTRYINDEX);	/* Pops the function */
 	ret = 0;
 done:
 	RLM_LUA_STACK_RESET();
 	return ret;
 }
 
-/** Resolve a path string to a field value in Lua
- *
- * Parses a string in the format
- * @verbatim obj0[.obj1][.objN] @endverbatim, adding all tables it traverses
- * to the stack.
- *
- * All paths are assumed to start at a global, so the first field
- * will be looked up in the global table.
+/** Setup "fr.request.{}"
  *
+ * Done once per interpreter.  Nothing is copied from the request, the
+ * accessors read the current request's pairs when they're used, and
+ * the accessor for each attribute is cached in the table.
  */
-static int fr_lua_get_field(lua_State *L, request_t *request, char const *field)
+static void _lua_fr_request_register(lua_State *L)
 {
-	char buff[512];
-	char const *p = field, *q;
-
-	q = strchr(p, '.');
-	if (!q) {	/* No field, just global */
-		lua_getglobal(L, p);
-		if (lua_isnil(L, -1)) {
-		does_not_exist:
-			REMARKER(field, p - field, "Field does not exist");
-			return -1;
-		}
-		return 0;
-	}
-
-	if ((size_t) (q - p) >= sizeof(buff)) {
-	too_long:
-		REDEBUG("Field name too long, expected < %zu, got %zu", q - p, sizeof(buff));
-		return -1;
-	}
-
-	strlcpy(buff, p, (q - p) + 1);
-	lua_getglobal(L, buff);
-	if (lua_isnil(L, -1)) goto does_not_exist;
-	p = q + 1;	/* Skip the '.' */
-
-	while ((q = strchr(p, '.'))) {
-		if ((size_t) (q - p) >= sizeof(buff)) goto too_long;
-
-		strlcpy(buff, p, (q - p) + 1);
-		lua_getfield(L, -1, buff);
-		if (lua_isnil(L, -1)) goto does_not_exist;
-		p = q + 1;
-	}
-
-	lua_getfield(L, -1, p);
-	if (lua_isnil(L, -1)) goto does_not_exist;
-
-	return 0;
-}
+	RLM_LUA_STACK_SET();
 
-static void _lua_fr_request_register(lua_State *L, request_t *request)
-{
 	/* fr = {} */
 	lua_getglobal(L, "fr");
 	luaL_checktype(L, -1, LUA_TTABLE);
@@ -714,62 +678,59 @@ static void _lua_fr_request_register(lua_State *L, request_t *request)
 	/* fr = { request {} } */
 	lua_newtable(L);
 
-	if (request) {
-		fr_dcursor_t 	cursor;
-
-		/* Attribute list table */
-		fr_pair_list_sort(&request->request_pairs, fr_pair_cmp_by_da);
-		fr_dcursor_init(&cursor, &request->request_pairs);
+	lua_pushcfunction(L, _lua_list_iterator_init);
+	lua_setfield(L, -2, "pairs");
 
-		/*
-		 *	Setup the environment
-		 */
-		lua_pushlightuserdata(L, &cursor);
-		lua_pushcclosure(L, _lua_list_iterator_init, 1);
-		lua_setfield(L, -2, "pairs");
-
-		lua_newtable(L);		/* Attribute list meta-table */
-		lua_pushinteger(L, PAIR_LIST_REQUEST);
-		lua_pushcclosure(L, _lua_pair_accessor_init, 1);
-		lua_setfield(L, -2, "__index");
-		lua_setmetatable(L, -2);
-	}
+	lua_newtable(L);		/* Attribute list meta-table */
+	lua_pushinteger(L, PAIR_LIST_REQUEST);
+	lua_pushcclosure(L, _lua_pair_accessor_init, 1);
+	lua_setfield(L, -2, "__index");
+	lua_setmetatable(L, -2);
 
 	lua_setfield(L, -2, "request");
+
+	RLM_LUA_STACK_RESET();
 }
 
-unlang_action_t fr_lua_run(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request, char const *funcname)
+/** Call a Lua function
+ *
+ * @param[out] p_result	The rcode the function returned.
+ * @param[in] mctx	The instance, and the thread whose interpreter we use.
+ * @param[in] request	The current request.  May be NULL.
+ * @param[in] funcname	Name of the function, for logging.
+ * @param[in] func_ref	Registry reference to the function, from the thread.
+ */
+unlang_action_t fr_lua_run(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+			   char const *funcname, int func_ref)
 {
 	rlm_lua_t const		*inst = talloc_get_type_abort_const(mctx->instance, rlm_lua_t);
 	rlm_lua_thread_t	*thread = talloc_get_type_abort(mctx->thread, rlm_lua_thread_t);
 	lua_State		*L = thread->interpreter;
 	rlm_rcode_t		rcode = RLM_MODULE_OK;
 
+	RLM_LUA_STACK_SET();
+
 	fr_lua_util_set_inst(inst);
 	fr_lua_util_set_request(request);
 
 	ROPTIONAL(RDEBUG2, DEBUG2, "Calling %s() in interpreter %p", funcname, L);
 
-	_lua_fr_request_register(L, request);
-
 	/*
 	 *	Get the function were going to be calling
 	 */
-	if (fr_lua_get_field(L, request, funcname) < 0) {
+	lua_rawgeti(L, LUA_REGISTRYINDEX, func_ref);
+	if (!lua_isfunction(L, -1)) {
+		int type = lua_type(L, -1);
+
+		ROPTIONAL(RDEBUG2, DEBUG2, "'%s' is not a function, is a %s (%i)", funcname, lua_typename(L, type), type);
 error:
+		RLM_LUA_STACK_RESET();
 		fr_lua_util_set_inst(NULL);
 		fr_lua_util_set_request(NULL);
 
 		RETURN_MODULE_FAIL;
 	}
 
-	if (!lua_isfunction(L, -1)) {
-		int type = lua_type(L, -1);
-
-		ROPTIONAL(RDEBUG2, DEBUG2, "'%s' is not a function, is a %s (%i)", funcname, lua_typename(L, type), type);
-		goto error;
-	}
-
 	if (lua_pcall(L, 0, 1, 0) != 0) {
 		char const *msg = lua_tostring(L, -1);
 
@@ -802,6 +763,7 @@ error:
 	}
 
 done:
+	RLM_LUA_STACK_RESET();
 	fr_lua_util_set_inst(NULL);
 	fr_lua_util_set_request(NULL);
 
@@ -870,17 +832,70 @@ static void fr_lua_rcode_register(lua_State *L, char const *name)
 	}
 }
 
+static int _lua_chunk_write(UNUSED lua_State *L, void const *p, size_t len, void *uctx)
+{
+	uint8_t		**chunk = uctx;
+	size_t		used = talloc_array_length(*chunk);
+
+	MEM(*chunk = talloc_realloc(NULL, *chunk, uint8_t, used + len));
+	memcpy(*chunk + used, p, len);
+
+	return 0;
+}
+
+/** Compile the script once, so each interpreter can load the bytecode
+ *
+ * Also records whether the linked interpreter is LuaJIT.
+ *
+ * @param[in] inst	Current instance of fr_lua.  The bytecode is written
+ *			to inst->chunk.
+ * @return 0 on success else -1.
+ */
+int fr_lua_compile(rlm_lua_t *inst)
+{
+	lua_State	*L;
+
+	L = luaL_newstate();
+	if (!L) {
+		ERROR("Failed initialising Lua state");
+		return -1;
+	}
+	luaL_openlibs(L);
+	inst->jit = fr_lua_isjit(L);
+
+	if (luaL_loadfile(L, inst->module) != 0) {
+		ERROR("Failed loading file: %s", lua_gettop(L) ? lua_tostring(L, -1) : "Unknown error");
+	error:
+		TALLOC_FREE(inst->chunk);
+		lua_close(L);
+		return -1;
+	}
+
+	MEM(inst->chunk = talloc_array(inst, uint8_t, 0));
+	if (lua_dump(L, _lua_chunk_write, &inst->chunk) != 0) {
+		ERROR("Failed compiling file: %s", inst->module);
+		goto error;
+	}
+	lua_close(L);
+
+	DEBUG4("Compiled \"%s\" to %zu bytes of bytecode", inst->module, talloc_array_length(inst->chunk));
+
+	return 0;
+}
+
 /** Initialise a new Lua/LuaJIT interpreter
  *
- * Creates a new lua_State and verifies all required functions have been loaded correctly.
+ * Creates a new lua_State from the precompiled script, and verifies all required
+ * functions have been loaded correctly.
  *
- * @param[in] out	Where to write a pointer to the new state.
+ * @param[out] out	Where to write a pointer to the new state, and references
+ *			to the functions we call.
  * @param[in] instance	Current instance of fr_lua, a talloc marker
  *			context will be inserted into the context of instance
  *			to ensure the interpreter is freed when instance data is freed.
  * @return 0 on success else -1.
  */
-int fr_lua_init(lua_State **out, rlm_lua_t const *instance)
+int fr_lua_init(rlm_lua_thread_t *out, rlm_lua_t const *instance)
 {
 	rlm_lua_t const		*inst = talloc_get_type_abort_const(instance, rlm_lua_t);
 	lua_State		*L;
@@ -898,11 +913,11 @@ int fr_lua_init(lua_State **out, rlm_lua_t const *instance)
 	/*
 	 *	Load the Lua file into our environment.
 	 */
-	if (luaL_loadfile(L, inst->module) != 0) {
+	if (luaL_loadbuffer(L, (char const *)inst->chunk, talloc_array_length(inst->chunk), inst->module) != 0) {
 		ERROR("Failed loading file: %s", lua_gettop(L) ? lua_tostring(L, -1) : "Unknown error");
 
 	error:
-		*out = NULL;
+		out->interpreter = NULL;
 		fr_lua_util_set_inst(NULL);
 		lua_close(L);
 		return -1;
@@ -925,6 +940,7 @@ int fr_lua_init(lua_State **out, rlm_lua_t const *instance)
 	if (inst->jit) {
 		DEBUG4("Initialised new LuaJIT interpreter %p", L);
 		if (fr_lua_util_jit_log_register(inst, L) < 0) goto error;
+		if (fr_lua_util_jit_pair_register(inst, L) < 0) goto error;
 	} else {
 		DEBUG4("Initialised new Lua interpreter %p", L);
 		if (fr_lua_util_log_register(inst, L) < 0) goto error;
@@ -936,20 +952,27 @@ int fr_lua_init(lua_State **out, rlm_lua_t const *instance)
 	 */
 	fr_lua_rcode_register(L, "rcode");
 
+	/*
+	 *	Setup "fr.request.{}"
+	 */
+	_lua_fr_request_register(L);
+
 	/*
 	 *	Verify all the functions were provided.
 	 */
-	if (fr_lua_check_func(inst, L, inst->func_authorize)
-	    || fr_lua_check_func(inst, L, inst->func_authenticate)
-	    || fr_lua_check_func(inst, L, inst->func_preacct)
-	    || fr_lua_check_func(inst, L, inst->func_accounting)
-	    || fr_lua_check_func(inst, L, inst->func_post_auth)
-	    || fr_lua_check_func(inst, L, inst->func_instantiate)
-	    || fr_lua_check_func(inst, L, inst->func_detach)
-	    || fr_lua_check_func(inst, L, inst->func_xlat)) {
+	if (fr_lua_func_ref(inst, L, &out->func_authorize, inst->func_authorize)
+	    || fr_lua_func_ref(inst, L, &out->func_authenticate, inst->func_authenticate)
+	    || fr_lua_func_ref(inst, L, &out->func_preacct, inst->func_preacct)
+	    || fr_lua_func_ref(inst, L, &out->func_accounting, inst->func_accounting)
+	    || fr_lua_func_ref(inst, L, &out->func_post_auth, inst->func_post_auth)
+	    || fr_lua_func_ref(inst, L, &out->func_instantiate, inst->func_instantiate)
+	    || fr_lua_func_ref(inst, L, &out->func_detach, inst->func_detach)
+	    || fr_lua_func_ref(inst, L, &out->func_xlat, inst->func_xlat)) {
 	 	goto error;
 	}
+	lua_settop(L, 0);
 
-	*out = L;
+	fr_lua_util_set_inst(NULL);
+	out->interpreter = L;
 	return 0;
 }
@@ -33,6 +33,26 @@ RCSIDH(lua_h, "$Id$")
 #include <lauxlib.h>
 #include <freeradius-devel/server/base.h>
 
+/** An interpreter, and the functions we call in it
+ *
+ * Functions are resolved once, when the interpreter is created, and
+ * referenced from the Lua registry so calls don't need to look them up.
+ * A reference is LUA_NOREF if the function isn't configured.
+ */
+typedef struct {
+	lua_State	*interpreter;		//!< Thread specific interpreter.
+
+	int		func_instantiate;	//!< Registry reference to the instantiate function.
+	int		func_detach;		//!< Registry reference to the detach function.
+
+	int		func_authorize;		//!< Registry reference to the authorize function.
+	int		func_authenticate;	//!< Registry reference to the authenticate function.
+	int		func_preacct;		//!< Registry reference to the preacct function.
+	int		func_accounting;	//!< Registry reference to the accounting function.
+	int		func_post_auth;		//!< Registry reference to the post_auth function.
+	int		func_xlat;		//!< Registry reference to the xlat function.
+} rlm_lua_thread_t;
+
 /*
  *	Define a structure for our module configuration.
  *
@@ -41,13 +61,14 @@ RCSIDH(lua_h, "$Id$")
  *	be used as the instance handle.
  */
 typedef struct {
-	lua_State	*interpreter;		//!< Interpreter used for single threaded mode, and environment tests.
+	rlm_lua_thread_t *interpreter;		//!< Interpreter used for instantiate, detach, and environment tests.
 	bool 		threads;		//!< Whether to create new interpreters on a per-instance/per-thread
 						//!< basis, or use a single mutex protected interpreter.
 
 	bool 		jit;			//!< Whether the linked interpreter is Lua 5.1 or LuaJIT.
 	const char	*xlat_name;		//!< Name of this instance.
 	const char 	*module;		//!< Full path to lua script to load and execute.
+	uint8_t		*chunk;			//!< The script, compiled once and loaded into each interpreter.
 
 	const char	*func_instantiate;	//!< Name of function to run on instantiation.
 	const char	*func_detach;		//!< Name of function to run on detach.
@@ -60,13 +81,11 @@ typedef struct {
 	const char	*func_xlat;		//!< Name of function to be called for string expansions.
 } rlm_lua_t;
 
-typedef struct {
-	lua_State	*interpreter;		//!< Thread specific interpreter.
-} rlm_lua_thread_t;
-
 /* lua.c */
-int		fr_lua_init(lua_State **out, rlm_lua_t const *instance);
-unlang_action_t fr_lua_run(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request, char const *funcname);
+int		fr_lua_compile(rlm_lua_t *inst);
+int		fr_lua_init(rlm_lua_thread_t *out, rlm_lua_t const *instance);
+unlang_action_t fr_lua_run(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+			   char const *funcname, int func_ref);
 bool		fr_lua_isjit(lua_State *L);
 char const	*fr_lua_version(lua_State *L);
 
@@ -76,7 +95,10 @@ void		fr_lua_util_jit_log_info(char const *msg);
 void		fr_lua_util_jit_log_warn(char const *msg);
 void		fr_lua_util_jit_log_error(char const *msg);
 
+char const	*fr_lua_util_jit_pair_value(char const *name, unsigned int idx, size_t *len);
+
 int		fr_lua_util_jit_log_register(rlm_lua_t const *inst, lua_State *L);
+int		fr_lua_util_jit_pair_register(rlm_lua_t const *inst, lua_State *L);
 int		fr_lua_util_log_register(rlm_lua_t const *inst, lua_State *L);
 void		fr_lua_util_set_inst(rlm_lua_t const *inst);
 rlm_lua_t const	*fr_lua_util_get_inst(void);
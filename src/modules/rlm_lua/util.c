@@ -261,6 +261,95 @@ int fr_lua_util_jit_log_register(rlm_lua_t const *inst, lua_State *L)
 	return 0;
 }
 
+/** Return the value of an attribute in the current request
+ *
+ * Called by LuaJIT through the FFI, so LuaJIT can compile calls to it,
+ * which it can't do for calls through the Lua C API.
+ *
+ * Strings and octets point at the value in the pair itself, other types
+ * are printed to a thread local buffer.  Either is only valid until the
+ * next call.
+ *
+ * @param[in] name	of the attribute.
+ * @param[in] idx	of the instance of the attribute.
+ * @param[out] len	of the value.
+ * @return
+ *	- The value.
+ *	- NULL if there's no request, no such attribute, or it can't be printed.
+ */
+char const *fr_lua_util_jit_pair_value(char const *name, unsigned int idx, size_t *len)
+{
+	static _Thread_local char	buff[256];
+	request_t			*request = fr_lua_request;
+	fr_dict_attr_t const		*da;
+	fr_pair_t			*vp;
+	ssize_t				slen;
+
+	if (!request) return NULL;
+
+	da = fr_dict_attr_by_name(NULL, fr_dict_root(request->dict), name);
+	if (!da) return NULL;
+
+	vp = fr_pair_find_by_da(&request->request_pairs, da, idx);
+	if (!vp) return NULL;
+
+	switch (vp->vp_type) {
+	case FR_TYPE_STRING:
+		*len = vp->vp_length;
+		return vp->vp_strvalue;
+
+	case FR_TYPE_OCTETS:
+		*len = vp->vp_length;
+		return (char const *)vp->vp_octets;
+
+	case FR_TYPE_NON_LEAF:
+		return NULL;
+
+	default:
+		break;
+	}
+
+	slen = fr_value_box_print(&FR_SBUFF_OUT(buff, sizeof(buff)), &vp->data, NULL);
+	if (slen < 0) return NULL;
+
+	*len = (size_t)slen;
+	return buff;
+}
+
+/** Insert FFI functions for reading attributes into the lua environment
+ *
+ * Adds fr.value(name [, idx]) which returns the value of an attribute
+ * in the current request as a string, or nil.  Requires fr_lua to have
+ * been loaded by #fr_lua_util_jit_log_register.
+ *
+ * @param inst Current instance of the fr_lua module.
+ * @param L Lua interpreter.
+ * @return 0 (no arguments).
+ */
+int fr_lua_util_jit_pair_register(rlm_lua_t const *inst, lua_State *L)
+{
+	if (luaL_dostring(L, "\
+		ffi.cdef [[\
+			char const *fr_lua_util_jit_pair_value(char const *name, unsigned int idx, size_t *len);\
+		]]\
+		local _fr_value_len = ffi.new(\"size_t[1]\")\
+		fr.value = function(name, idx)\
+			local p = fr_lua.fr_lua_util_jit_pair_value(name, idx or 0, _fr_value_len)\
+			if p == nil then\
+				return nil\
+			end\
+			return ffi.string(p, _fr_value_len[0])\
+		end\
+		") != 0) {
+		ERROR("Failed setting up FFI: %s",
+		      lua_gettop(L) ? lua_tostring(L, -1) : "Unknown error");
+
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Register utililiary functions in the lua environment
  *
  * @param inst Current instance of the fr_lua module.
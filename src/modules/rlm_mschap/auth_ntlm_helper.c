@@ -0,0 +1,373 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file auth_ntlm_helper.c
+ * @brief NTLM authentication by long running ntlm_auth helper processes
+ *
+ * Rather than running ntlm_auth for every authentication, we keep a
+ * pool of `ntlm_auth --helper-protocol=ntlm-server-1` processes, and
+ * send them one authentication at a time over their stdin.
+ *
+ * The protocol is a set of "key: value" lines, terminated by a line
+ * containing a single '.'.  The response has the same format.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/base16.h>
+#include <freeradius-devel/util/base64.h>
+#include <freeradius-devel/util/debug.h>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "rlm_mschap.h"
+#include "mschap.h"
+#include "auth_ntlm_helper.h"
+
+#define NT_LENGTH 24
+
+/** A running ntlm_auth helper
+ *
+ */
+typedef struct {
+	pid_t		pid;		//!< Of the helper.
+	int		to_child;	//!< The helper's stdin.
+	int		from_child;	//!< The helper's stdout.
+} ntlm_helper_t;
+
+static int _ntlm_helper_free(ntlm_helper_t *helper)
+{
+	close(helper->to_child);
+	close(helper->from_child);
+
+	/*
+	 *	The helper may have been started from a thread pool
+	 *	thread, in which case it inherited a signal mask which
+	 *	blocks SIGTERM.  It holds no state, so just kill it.
+	 */
+	kill(helper->pid, SIGKILL);
+	waitpid(helper->pid, NULL, 0);
+
+	return 0;
+}
+
+/** Start an ntlm_auth helper for the connection pool
+ *
+ * The program isn't expanded, as there's no request.
+ */
+void *ntlm_helper_conn_create(TALLOC_CTX *ctx, void *instance, UNUSED fr_time_delta_t timeout)
+{
+	rlm_mschap_t const	*inst = talloc_get_type_abort_const(instance, rlm_mschap_t);
+	ntlm_helper_t		*helper;
+
+	MEM(helper = talloc_zero(ctx, ntlm_helper_t));
+	helper->to_child = -1;
+	helper->from_child = -1;
+
+	helper->pid = radius_start_program(&helper->to_child, &helper->from_child, NULL,
+					   inst->ntlm_helper, NULL, true, NULL, false);
+	if (helper->pid < 0) {
+		ERROR("Failed starting ntlm_auth helper \"%s\"", inst->ntlm_helper);
+		talloc_free(helper);
+		return NULL;
+	}
+
+	talloc_set_destructor(helper, _ntlm_helper_free);
+
+	return helper;
+}
+
+/** Prepare an MS-CHAP authentication by an ntlm_auth helper
+ *
+ * Everything the helper needs is copied into the #ntlm_helper_auth_t,
+ * so #ntlm_helper_auth_run can be called by a thread which doesn't
+ * own the request.
+ *
+ * @param[in] ctx		to allocate the #ntlm_helper_auth_t in.
+ * @param[in] inst		Module instance.
+ * @param[in] request		The current request.
+ * @param[in] challenge		MS-CHAPv1 challenge.
+ * @param[in] response		NT-Response.
+ * @return
+ *	- A new #ntlm_helper_auth_t.
+ *	- NULL if the username or domain could not be expanded.
+ */
+ntlm_helper_auth_t *ntlm_helper_auth_alloc(TALLOC_CTX *ctx, rlm_mschap_t const *inst, request_t *request,
+					   uint8_t const *challenge, uint8_t const *response)
+{
+	ntlm_helper_auth_t	*ha;
+	char			*username = NULL, *domain = NULL;
+	char			buffer[2048];
+	fr_sbuff_t		sbuff = FR_SBUFF_OUT(buffer, sizeof(buffer));
+
+	/*
+	 *	ntlm_helper_username must be set for this function to be called
+	 */
+	fr_assert(inst->ntlm_helper_username);
+
+	MEM(ha = talloc_zero(ctx, ntlm_helper_auth_t));
+	ha->inst = inst;
+
+	if (tmpl_aexpand(ha, &username, request, inst->ntlm_helper_username, NULL, NULL) < 0) {
+		REDEBUG2("Unable to expand ntlm_auth_helper username");
+	error:
+		talloc_free(ha);
+		return NULL;
+	}
+
+	if (inst->ntlm_helper_domain) {
+		if (tmpl_aexpand(ha, &domain, request, inst->ntlm_helper_domain, NULL, NULL) < 0) {
+			REDEBUG2("Unable to expand ntlm_auth_helper domain");
+			goto error;
+		}
+	} else {
+		RWDEBUG2("No domain specified; authentication may fail because of this");
+	}
+
+	/*
+	 *	The username and domain are sent base64 encoded
+	 *	("key:: value"), so they can't add lines to the query.
+	 */
+	if ((fr_sbuff_in_strcpy_literal(&sbuff, "Username:: ") < 0) ||
+	    (fr_base64_encode(&sbuff, &FR_DBUFF_TMP((uint8_t const *) username, talloc_array_length(username) - 1), true) < 0) ||
+	    (fr_sbuff_in_char(&sbuff, '\n') < 0)) {
+	too_long:
+		REDEBUG("ntlm_auth helper query is too long");
+		goto error;
+	}
+
+	if (domain &&
+	    ((fr_sbuff_in_strcpy_literal(&sbuff, "NT-Domain:: ") < 0) ||
+	     (fr_base64_encode(&sbuff, &FR_DBUFF_TMP((uint8_t const *) domain, talloc_array_length(domain) - 1), true) < 0) ||
+	     (fr_sbuff_in_char(&sbuff, '\n') < 0))) goto too_long;
+
+	if ((fr_sbuff_in_strcpy_literal(&sbuff, "LANMAN-Challenge: ") < 0) ||
+	    (fr_base16_encode(&sbuff, &FR_DBUFF_TMP(challenge, MSCHAP_CHALLENGE_LENGTH)) < 0) ||
+	    (fr_sbuff_in_strcpy_literal(&sbuff, "\nNT-Response: ") < 0) ||
+	    (fr_base16_encode(&sbuff, &FR_DBUFF_TMP(response, NT_LENGTH)) < 0) ||
+	    (fr_sbuff_in_strcpy_literal(&sbuff, "\nRequest-User-Session-Key: Yes\n.\n") < 0)) goto too_long;
+
+	ha->query_len = fr_sbuff_used(&sbuff);
+	MEM(ha->query = talloc_bstrndup(ha, buffer, ha->query_len));
+
+	RDEBUG2("Sending authentication request user \"%pV\" domain \"%pV\" to ntlm_auth helper",
+		fr_box_strvalue_buffer(username), fr_box_strvalue(domain ? domain : ""));
+
+	talloc_free(username);
+	talloc_free(domain);
+
+	return ha;
+}
+
+/** Send a query to an ntlm_auth helper, and wait for its response
+ *
+ * May be called from a thread pool thread, so must not touch the request.
+ *
+ * @param[in] uctx	#ntlm_helper_auth_t to send.
+ */
+void ntlm_helper_auth_run(void *uctx)
+{
+	ntlm_helper_auth_t	*ha = uctx;
+	fr_pool_t		*pool = ha->inst->ntlm_helper_pool;
+	ntlm_helper_t		*helper;
+	fr_time_delta_t		timeout = ha->inst->ntlm_auth_timeout;
+	fr_time_t		start;
+	size_t			written = 0, done = 0;
+
+	helper = fr_pool_connection_get(pool, NULL);
+	if (!helper) {
+		ha->failed = true;
+		ha->fail_msg = "No ntlm_auth helper available";
+		return;
+	}
+
+	while (written < ha->query_len) {
+		ssize_t len;
+
+		len = write(helper->to_child, ha->query + written, ha->query_len - written);
+		if (len < 0) {
+			if (errno == EINTR) continue;
+
+			ha->fail_msg = "Failed writing to ntlm_auth helper";
+			goto error;
+		}
+		written += len;
+	}
+
+	start = fr_time();
+	for (;;) {
+		struct pollfd	pfd = { .fd = helper->from_child, .events = POLLIN };
+		fr_time_delta_t	elapsed = fr_time() - start;
+		ssize_t		len;
+		int		ret;
+
+		if (elapsed >= timeout) {
+			ha->fail_msg = "Timeout waiting for ntlm_auth helper";
+			goto error;
+		}
+
+		ret = poll(&pfd, 1, fr_time_delta_to_msec(timeout - elapsed) + 1);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+
+			ha->fail_msg = "Failed waiting for ntlm_auth helper";
+			goto error;
+		}
+		if (ret == 0) continue;
+
+		if (done >= (sizeof(ha->answer) - 1)) {
+			ha->fail_msg = "Response from ntlm_auth helper is too long";
+			goto error;
+		}
+
+		len = read(helper->from_child, ha->answer + done, sizeof(ha->answer) - 1 - done);
+		if (len < 0) {
+			if (errno == EINTR) continue;
+
+			ha->fail_msg = "Failed reading from ntlm_auth helper";
+			goto error;
+		}
+		if (len == 0) {
+			ha->fail_msg = "ntlm_auth helper exited";
+			goto error;
+		}
+		done += len;
+		ha->answer[done] = '\0';
+
+		/*
+		 *	The response ends with a line containing a single '.'
+		 */
+		if ((done >= 2) && (memcmp(ha->answer + done - 2, ".\n", 2) == 0) &&
+		    ((done == 2) || (ha->answer[done - 3] == '\n'))) break;
+	}
+
+	fr_pool_connection_release(pool, NULL, helper);
+	return;
+
+error:
+	/*
+	 *	We don't know where the helper is in the
+	 *	conversation, so it can't be reused.
+	 */
+	fr_pool_connection_close(pool, NULL, helper);
+	ha->failed = true;
+}
+
+/** Find the value of a key in a helper response
+ *
+ * @return
+ *	- The start of the value, which ends with '\n'.
+ *	- NULL if the key isn't in the response.
+ */
+static char const *ntlm_helper_value(char const *answer, char const *key, size_t key_len)
+{
+	char const *p = answer;
+
+	while (*p) {
+		if (strncmp(p, key, key_len) == 0) return p + key_len;
+
+		p = strchr(p, '\n');
+		if (!p) break;
+		p++;
+	}
+
+	return NULL;
+}
+
+/** Process the response from an ntlm_auth helper
+ *
+ * @param[in] request		The current request.
+ * @param[in] ha		Which has been run by #ntlm_helper_auth_run.
+ * @param[out] nthashhash	The User-Session-Key returned by the helper.
+ * @return
+ *	- 0 success.
+ *	- -1 auth failure.
+ *	- <-1 an MS-CHAP error code, see #mschap_ntlm_auth_error.
+ */
+int ntlm_helper_auth_result(request_t *request, ntlm_helper_auth_t const *ha, uint8_t nthashhash[NT_DIGEST_LENGTH])
+{
+	char const	*p, *q;
+	char		buffer[256];
+
+	if (ha->failed) {
+		REDEBUG("%s", ha->fail_msg);
+		return -1;
+	}
+
+	if (!ntlm_helper_value(ha->answer, "Authenticated: Yes\n", sizeof("Authenticated: Yes\n") - 1)) {
+		p = ntlm_helper_value(ha->answer, "Authentication-Error: ", sizeof("Authentication-Error: ") - 1);
+		if (!p) p = ntlm_helper_value(ha->answer, "Error: ", sizeof("Error: ") - 1);
+		if (!p) {
+			REDEBUG("Invalid output from ntlm_auth helper: expecting 'Authenticated: ' or 'Error: '");
+			return -1;
+		}
+
+		q = strchr(p, '\n');
+		strlcpy(buffer, p, (size_t)(q - p) < sizeof(buffer) ? (size_t)(q - p) + 1 : sizeof(buffer));
+
+		return mschap_ntlm_auth_error(request, buffer);
+	}
+
+	p = ntlm_helper_value(ha->answer, "User-Session-Key: ", sizeof("User-Session-Key: ") - 1);
+	if (!p) {
+		REDEBUG("Invalid output from ntlm_auth helper: expecting 'User-Session-Key: '");
+		return -1;
+	}
+
+	if (fr_base16_decode(NULL, &FR_DBUFF_TMP(nthashhash, NT_DIGEST_LENGTH),
+			     &FR_SBUFF_IN(p, strcspn(p, "\n")), false) != NT_DIGEST_LENGTH) {
+		REDEBUG("Invalid output from ntlm_auth helper: User-Session-Key is not %u hex octets",
+			NT_DIGEST_LENGTH);
+		return -1;
+	}
+
+	RDEBUG2("Authenticated successfully");
+
+	return 0;
+}
+
+/** Check NTLM authentication with an ntlm_auth helper
+ *
+ * Blocks until the helper responds.
+ *
+ * @return
+ *	- 0 success.
+ *	- -1 auth failure.
+ *	- <-1 an MS-CHAP error code, see #mschap_ntlm_auth_error.
+ */
+int do_auth_ntlm_helper(rlm_mschap_t const *inst, request_t *request,
+			uint8_t const *challenge, uint8_t const *response,
+			uint8_t nthashhash[NT_DIGEST_LENGTH])
+{
+	ntlm_helper_auth_t	*ha;
+	int			ret;
+
+	ha = ntlm_helper_auth_alloc(NULL, inst, request, challenge, response);
+	if (!ha) return -1;
+
+	ntlm_helper_auth_run(ha);
+	ret = ntlm_helper_auth_result(request, ha, nthashhash);
+	talloc_free(ha);
+
+	return ret;
+}
@@ -0,0 +1,33 @@
+#pragma once
+/* @copyright 2021 The FreeRADIUS server project */
+RCSIDH(auth_ntlm_helper_h, "$Id$")
+
+/** An MS-CHAP authentication by a long running ntlm_auth helper
+ *
+ * Everything the helper needs is copied here, as the request may be
+ * cancelled while the helper is being called.
+ */
+typedef struct {
+	rlm_mschap_t const	*inst;		//!< Module instance.  Only the helper pool is used by the thread.
+
+	char			*query;		//!< What we send to the helper.
+	size_t			query_len;	//!< Length of the query.
+
+	bool			failed;		//!< Couldn't get a helper, or it didn't respond.
+	char const		*fail_msg;	//!< Why we couldn't talk to the helper.
+	char			answer[1024];	//!< What the helper said.
+} ntlm_helper_auth_t;
+
+void			*ntlm_helper_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout);
+
+ntlm_helper_auth_t	*ntlm_helper_auth_alloc(TALLOC_CTX *ctx, rlm_mschap_t const *inst, request_t *request,
+						uint8_t const *challenge, uint8_t const *response);
+
+void			ntlm_helper_auth_run(void *uctx);
+
+int			ntlm_helper_auth_result(request_t *request, ntlm_helper_auth_t const *ha,
+						uint8_t nthashhash[NT_DIGEST_LENGTH]);
+
+int			do_auth_ntlm_helper(rlm_mschap_t const *inst, request_t *request,
+					    uint8_t const *challenge, uint8_t const *response,
+					    uint8_t nthashhash[NT_DIGEST_LENGTH]);
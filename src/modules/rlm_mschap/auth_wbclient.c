@@ -77,40 +77,56 @@ static char *wbclient_normalise_username(TALLOC_CTX *ctx, struct wbcContext *wb_
 	return res;
 }
 
-/** Check NTLM authentication direct to winbind via Samba's libwbclient library
+/** Free the results of a winbind authentication
  *
+ */
+static int _wbclient_auth_free(wbclient_auth_t *wa)
+{
+	if (wa->info) wbcFreeMemory(wa->info);
+	if (wa->error) wbcFreeMemory(wa->error);
+
+	return 0;
+}
+
+/** Prepare an NTLM authentication against winbind
+ *
+ * Everything winbind needs is copied into the #wbclient_auth_t, so
+ * #wbclient_auth_run can be called by a thread which doesn't own
+ * the request.
+ *
+ * @param[in] ctx		to allocate the #wbclient_auth_t in.
+ * @param[in] inst		Module instance.
+ * @param[in] request		The current request.
+ * @param[in] challenge		MS-CHAPv1 challenge.
+ * @param[in] response		NT-Response.
  * @return
- *	- 0 success.
- *	- -1 auth failure.
- *	- -648 password expired.
+ *	- A new #wbclient_auth_t.
+ *	- NULL if the username or domain could not be expanded.
  */
-int do_auth_wbclient(rlm_mschap_t const *inst, request_t *request,
-		     uint8_t const *challenge, uint8_t const *response,
-		     uint8_t nthashhash[NT_DIGEST_LENGTH])
+wbclient_auth_t *wbclient_auth_alloc(TALLOC_CTX *ctx, rlm_mschap_t const *inst, request_t *request,
+				     uint8_t const *challenge, uint8_t const *response)
 {
-	int				ret = -1;
-	struct wbcContext		*wb_ctx = NULL;
+	wbclient_auth_t			*wa;
 	struct wbcAuthUserParams	*authparams;
-	wbcErr				err;
 	ssize_t				slen;
-	struct wbcAuthUserInfo		*info = NULL;
-	struct wbcAuthErrorInfo		*error = NULL;
-	uint8_t				resp[NT_LENGTH];
 
 	/*
 	 *	wb_username must be set for this function to be called
 	 */
 	fr_assert(inst->wb_username);
 
-	MEM(authparams = talloc_zero_pooled_object(NULL, struct wbcAuthUserParams, 2, 1024));
-	/*
-	 *	Domain first so we don't leave holes in the pool
-	 */
+	MEM(wa = talloc_zero(ctx, wbclient_auth_t));
+	talloc_set_destructor(wa, _wbclient_auth_free);
+	wa->inst = inst;
+	authparams = &wa->authparams;
+
 	if (inst->wb_domain) {
-		slen = tmpl_aexpand(authparams, &authparams->domain_name, request, inst->wb_domain, NULL, NULL);
+		slen = tmpl_aexpand(wa, &authparams->domain_name, request, inst->wb_domain, NULL, NULL);
 		if (slen < 0) {
 			REDEBUG2("Unable to expand winbind_domain");
-			goto finish;
+		error:
+			talloc_free(wa);
+			return NULL;
 		}
 	} else {
 		RWDEBUG2("No domain specified; authentication may fail because of this");
@@ -119,10 +135,10 @@ int do_auth_wbclient(rlm_mschap_t const *inst, request_t *request,
 	/*
 	 *	Get the username and domain from the configuration
 	 */
-	slen = tmpl_aexpand(authparams, &authparams->account_name, request, inst->wb_username, NULL, NULL);
+	slen = tmpl_aexpand(wa, &authparams->account_name, request, inst->wb_username, NULL, NULL);
 	if (slen < 0) {
 		REDEBUG2("Unable to expand winbind_username");
-		goto finish;
+		goto error;
 	}
 
 	/*
@@ -131,8 +147,8 @@ int do_auth_wbclient(rlm_mschap_t const *inst, request_t *request,
 	authparams->level = WBC_AUTH_USER_LEVEL_RESPONSE;
 	authparams->password.response.nt_length = NT_LENGTH;
 
-	memcpy(resp, response, NT_LENGTH);
-	authparams->password.response.nt_data = resp;
+	memcpy(wa->nt_response, response, NT_LENGTH);
+	authparams->password.response.nt_data = wa->nt_response;
 
 	memcpy(authparams->password.response.challenge, challenge, sizeof(authparams->password.response.challenge));
 
@@ -141,81 +157,143 @@ int do_auth_wbclient(rlm_mschap_t const *inst, request_t *request,
 					WBC_MSV1_0_ALLOW_SERVER_TRUST_ACCOUNT;
 
 	/*
-	 * Send auth request across to winbind
+	 *	Retrying with a normalised username means
+	 *	recalculating the MS-CHAPv2 challenge, so copy
+	 *	what we need to do that now.
 	 */
-	wb_ctx = fr_pool_connection_get(inst->wb_pool, request);
-	if (wb_ctx == NULL) {
-		RERROR("Unable to get winbind connection from pool");
-		goto finish;
+	if (inst->wb_retry_with_normalised_username) {
+		fr_pair_t	*vp_challenge, *vp_response;
+
+		vp_challenge = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap_challenge, 0);
+		vp_response = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap2_response, 0);
+
+		if (!vp_challenge || (vp_challenge->vp_length < MSCHAP_PEER_AUTHENTICATOR_CHALLENGE_LENGTH)) {
+			wa->retry_error = "Unable to get MS-CHAP-Challenge";
+		} else if (!vp_response || (vp_response->vp_length < (2 + MSCHAP_PEER_CHALLENGE_LENGTH))) {
+			wa->retry_error = "Unable to get MS-CHAP2-Response";
+		} else {
+			memcpy(wa->auth_challenge, vp_challenge->vp_octets, sizeof(wa->auth_challenge));
+			memcpy(wa->peer_challenge, vp_response->vp_octets + 2, sizeof(wa->peer_challenge));
+		}
 	}
 
 	RDEBUG2("Sending authentication request user \"%pV\" domain \"%pV\"",
 		fr_box_strvalue_buffer(authparams->account_name),
 		fr_box_strvalue_buffer(authparams->domain_name));
 
-	err = wbcCtxAuthenticateUserEx(wb_ctx, authparams, &info, &error);
-	if (err == WBC_ERR_AUTH_ERROR && inst->wb_retry_with_normalised_username) {
-		fr_pair_t 	*vp_response;
-		fr_pair_t	*vp_challenge;
-		fr_pair_t	*vp_chap_user_name;
-		char		*normalised_username = NULL;
+	return wa;
+}
 
-		normalised_username = wbclient_normalise_username(authparams, wb_ctx, authparams->domain_name,
-								  authparams->account_name);
-		if (!normalised_username) goto release;
+/** Send an authentication request to winbind, and wait for the response
+ *
+ * If configured, and authentication fails, the username is normalised
+ * and the authentication retried.
+ *
+ * May be called from a thread pool thread, so must not touch the request.
+ *
+ * @param[in] uctx	#wbclient_auth_t to send.
+ */
+void wbclient_auth_run(void *uctx)
+{
+	wbclient_auth_t			*wa = uctx;
+	struct wbcAuthUserParams	*authparams = &wa->authparams;
+	struct wbcContext		*wb_ctx;
+	char				*normalised_username;
 
-		RDEBUG2("Starting retry, normalised username \"%pV\" -> \"%pV\"",
-			fr_box_strvalue_buffer(authparams->account_name),
-			fr_box_strvalue_buffer(normalised_username));
+	wb_ctx = fr_pool_connection_get(wa->inst->wb_pool, NULL);
+	if (wb_ctx == NULL) {
+		wa->no_conn = true;
+		return;
+	}
 
-		if (talloc_memcmp_bstr(authparams->account_name, normalised_username) == 0) goto release;
+	wa->err = wbcCtxAuthenticateUserEx(wb_ctx, authparams, &wa->info, &wa->error);
+	if ((wa->err != WBC_ERR_AUTH_ERROR) || !wa->inst->wb_retry_with_normalised_username) goto release;
 
-		talloc_const_free(authparams->account_name);
-		authparams->account_name = normalised_username;
+	normalised_username = wbclient_normalise_username(wa, wb_ctx, authparams->domain_name,
+							  authparams->account_name);
+	if (!normalised_username) goto release;
 
-		/* Set MS-CHAP-USER-NAME */
-		MEM(pair_update_request(&vp_chap_user_name, attr_ms_chap_user_name) >= 0);
-		fr_pair_value_bstrdup_buffer(vp_chap_user_name, normalised_username, true);
+	if (talloc_memcmp_bstr(authparams->account_name, normalised_username) == 0) {
+		talloc_free(normalised_username);
+		goto release;
+	}
 
-		RDEBUG2("Retrying authentication request user \"%pV\" domain \"%pV\"",
-			fr_box_strvalue_buffer(authparams->account_name),
-			fr_box_strvalue_buffer(normalised_username));
+	/*
+	 *	The result function logs the retry, and updates
+	 *	MS-CHAP-User-Name.
+	 */
+	wa->normalised_username = normalised_username;
+	if (wa->retry_error) goto release;
 
-		/* Recalculate hash */
-		vp_challenge = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap_challenge, 0);
-		if (!vp_challenge) {
-			RERROR("Unable to get MS-CHAP-Challenge");
-			goto release;
-		}
+	/* Recalculate hash */
+	mschap_challenge_hash(authparams->password.response.challenge,
+			      wa->peer_challenge, wa->auth_challenge,
+			      normalised_username, talloc_array_length(normalised_username) - 1);
 
-		vp_response = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap2_response, 0);
-		if (!vp_response) {
-			RERROR("Unable to get MS-CHAP2-Response");
-			goto release;
-		}
+	talloc_const_free(authparams->account_name);
+	authparams->account_name = normalised_username;
+
+	if (wa->info) {
+		wbcFreeMemory(wa->info);
+		wa->info = NULL;
+	}
+	if (wa->error) {
+		wbcFreeMemory(wa->error);
+		wa->error = NULL;
+	}
 
-		mschap_challenge_hash(authparams->password.response.challenge,
-				      vp_response->vp_octets + 2,
-				      vp_challenge->vp_octets,
-				      vp_chap_user_name->vp_strvalue, vp_chap_user_name->vp_length);
+	wa->retried = true;
+	wa->err = wbcCtxAuthenticateUserEx(wb_ctx, authparams, &wa->info, &wa->error);
 
-		err = wbcCtxAuthenticateUserEx(wb_ctx, authparams, &info, &error);
 release:
-		talloc_free(normalised_username);
+	fr_pool_connection_release(wa->inst->wb_pool, NULL, wb_ctx);
+}
+
+/** Process the result of a winbind authentication
+ *
+ * @param[in] request		The current request.
+ * @param[in] wa		Which has been run by #wbclient_auth_run.
+ * @param[out] nthashhash	The user session key returned by winbind.
+ * @return
+ *	- 0 success.
+ *	- -1 auth failure.
+ *	- -648 password expired.
+ */
+int wbclient_auth_result(request_t *request, wbclient_auth_t const *wa, uint8_t nthashhash[NT_DIGEST_LENGTH])
+{
+	int				ret = -1;
+	struct wbcAuthErrorInfo const	*error = wa->error;
+
+	if (wa->no_conn) {
+		RERROR("Unable to get winbind connection from pool");
+		return -1;
 	}
 
-	fr_pool_connection_release(inst->wb_pool, request, wb_ctx);
+	if (wa->normalised_username) {
+		fr_pair_t	*vp_chap_user_name;
+
+		/* Set MS-CHAP-USER-NAME */
+		MEM(pair_update_request(&vp_chap_user_name, attr_ms_chap_user_name) >= 0);
+		fr_pair_value_bstrdup_buffer(vp_chap_user_name, wa->normalised_username, true);
+
+		if (wa->retried) {
+			RDEBUG2("Retried authentication request with normalised username \"%pV\"",
+				fr_box_strvalue_buffer(wa->normalised_username));
+		} else {
+			RERROR("%s", wa->retry_error);
+		}
+	}
 
 	/*
 	 * Try and give some useful feedback on what happened. There are only
 	 * a few errors that can actually be returned from wbcCtxAuthenticateUserEx.
 	 */
-	switch (err) {
+	switch (wa->err) {
 	case WBC_ERR_SUCCESS:
 		ret = 0;
 		RDEBUG2("Authenticated successfully");
 		/* Grab the nthashhash from the result */
-		memcpy(nthashhash, info->user_session_key, NT_DIGEST_LENGTH);
+		memcpy(nthashhash, wa->info->user_session_key, NT_DIGEST_LENGTH);
 		break;
 
 	case WBC_ERR_WINBIND_NOT_AVAILABLE:
@@ -260,18 +338,38 @@ release:
 		 * neither of which are particularly likely.
 		 */
 		if (error && error->display_string) {
-			REDEBUG2("libwbclient error: wbcErr %d (%s)", err, error->display_string);
+			REDEBUG2("libwbclient error: wbcErr %d (%s)", wa->err, error->display_string);
 		} else {
-			REDEBUG2("libwbclient error: wbcErr %d", err);
+			REDEBUG2("libwbclient error: wbcErr %d", wa->err);
 		}
 		break;
 	}
 
-finish:
-	talloc_free(authparams);
-	if (info) wbcFreeMemory(info);
-	if (error) wbcFreeMemory(error);
-
 	return ret;
 }
 
+/** Check NTLM authentication direct to winbind via Samba's libwbclient library
+ *
+ * Blocks until winbind responds.
+ *
+ * @return
+ *	- 0 success.
+ *	- -1 auth failure.
+ *	- -648 password expired.
+ */
+int do_auth_wbclient(rlm_mschap_t const *inst, request_t *request,
+		     uint8_t const *challenge, uint8_t const *response,
+		     uint8_t nthashhash[NT_DIGEST_LENGTH])
+{
+	wbclient_auth_t	*wa;
+	int		ret;
+
+	wa = wbclient_auth_alloc(NULL, inst, request, challenge, response);
+	if (!wa) return -1;
+
+	wbclient_auth_run(wa);
+	ret = wbclient_auth_result(request, wa, nthashhash);
+	talloc_free(wa);
+
+	return ret;
+}
@@ -2,6 +2,37 @@
 /* @copyright 2015 The FreeRADIUS server project */
 RCSIDH(auth_wbclient_h, "$Id$")
 
-int do_auth_wbclient(rlm_mschap_t const *inst, request_t *request,
-		     uint8_t const *challenge, uint8_t const *response,
-		     uint8_t nthashhash[NT_DIGEST_LENGTH]);
+/** An NTLM authentication against winbind, which may be run by a thread pool
+ *
+ * Everything libwbclient needs is copied here, as the request may be
+ * cancelled while winbind is being called.
+ */
+typedef struct {
+	rlm_mschap_t const		*inst;		//!< Module instance.  Only the pool is used by the thread.
+
+	struct wbcAuthUserParams	authparams;	//!< Strings are parented by this structure.
+	uint8_t				nt_response[24];	//!< Copy of the NT-Response.
+
+	char const			*retry_error;	//!< Why we can't retry with a normalised username.
+	uint8_t				auth_challenge[MSCHAP_PEER_AUTHENTICATOR_CHALLENGE_LENGTH];	//!< For retrying.
+	uint8_t				peer_challenge[MSCHAP_PEER_CHALLENGE_LENGTH];	//!< For retrying.
+
+	bool				no_conn;	//!< Couldn't get a winbind connection.
+	char				*normalised_username;	//!< If it differed from the one we sent.
+	bool				retried;	//!< With the normalised username.
+	wbcErr				err;		//!< What wbcCtxAuthenticateUserEx returned.
+	struct wbcAuthUserInfo		*info;		//!< Freed with this structure.
+	struct wbcAuthErrorInfo		*error;		//!< Freed with this structure.
+} wbclient_auth_t;
+
+wbclient_auth_t	*wbclient_auth_alloc(TALLOC_CTX *ctx, rlm_mschap_t const *inst, request_t *request,
+				     uint8_t const *challenge, uint8_t const *response);
+
+void		wbclient_auth_run(void *uctx);
+
+int		wbclient_auth_result(request_t *request, wbclient_auth_t const *wa,
+				     uint8_t nthashhash[NT_DIGEST_LENGTH]);
+
+int		do_auth_wbclient(rlm_mschap_t const *inst, request_t *request,
+				 uint8_t const *challenge, uint8_t const *response,
+				 uint8_t nthashhash[NT_DIGEST_LENGTH]);
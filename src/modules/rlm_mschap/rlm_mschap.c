@@ -33,6 +33,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/password.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/radius/defs.h>
+#include <freeradius-devel/unlang/base.h>
 
 #include <freeradius-devel/util/base16.h>
 #include <freeradius-devel/util/md4.h>
@@ -47,6 +48,8 @@ RCSID("$Id$")
 #include "mschap.h"
 #include "smbdes.h"
 
+#include "auth_ntlm_helper.h"
+
 #ifdef WITH_AUTH_WINBIND
 #include "auth_wbclient.h"
 #endif
@@ -91,6 +94,19 @@ static const CONF_PARSER winbind_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER ntlm_auth_helper_config[] = {
+	{ FR_CONF_OFFSET("program", FR_TYPE_STRING, rlm_mschap_t, ntlm_helper) },
+	{ FR_CONF_OFFSET("username", FR_TYPE_TMPL, rlm_mschap_t, ntlm_helper_username) },
+	{ FR_CONF_OFFSET("domain", FR_TYPE_TMPL, rlm_mschap_t, ntlm_helper_domain) },
+	CONF_PARSER_TERMINATOR
+};
+
+static const CONF_PARSER thread_pool_config[] = {
+	{ FR_CONF_OFFSET("threads", FR_TYPE_UINT32, rlm_mschap_t, threads), .dflt = "4" },
+	{ FR_CONF_OFFSET("max_queued", FR_TYPE_UINT32, rlm_mschap_t, max_queued), .dflt = "1024" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("normalise", FR_TYPE_BOOL, rlm_mschap_t, normify), .dflt = "yes" },
 
@@ -103,6 +119,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("with_ntdomain_hack", FR_TYPE_BOOL, rlm_mschap_t, with_ntdomain_hack), .dflt = "yes" },
 	{ FR_CONF_OFFSET("ntlm_auth", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_mschap_t, ntlm_auth) },
 	{ FR_CONF_OFFSET("ntlm_auth_timeout", FR_TYPE_TIME_DELTA, rlm_mschap_t, ntlm_auth_timeout) },
+	{ FR_CONF_POINTER("ntlm_auth_helper", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) ntlm_auth_helper_config },
 
 	{ FR_CONF_POINTER("passchange", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) passchange_config },
 	{ FR_CONF_OFFSET("allow_retry", FR_TYPE_BOOL, rlm_mschap_t, allow_retry), .dflt = "yes" },
@@ -114,6 +131,7 @@ static const CONF_PARSER module_config[] = {
 #endif
 
 	{ FR_CONF_POINTER("winbind", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) winbind_config },
+	{ FR_CONF_POINTER("thread_pool", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) thread_pool_config },
 
 	/*
 	 *	These are now in a subsection above.
@@ -1128,6 +1146,98 @@ ntlm_auth_err:
 	return -1;
 }
 
+/** Convert an error from ntlm_auth into an MS-CHAP result
+ *
+ * @param[in] request	The current request.
+ * @param[in] buffer	What ntlm_auth said.  May be modified.
+ * @return
+ *	- -1 auth failure.
+ *	- -2 no logon servers.
+ *	- -647 account locked out.
+ *	- -648 password expired.
+ *	- -691 account disabled.
+ */
+int mschap_ntlm_auth_error(request_t *request, char *buffer)
+{
+	char	*p;
+	int	result;
+
+	/*
+	 *	Do checks for numbers, which are
+	 *	language neutral.  They're also
+	 *	faster.
+	 */
+	p = strcasestr(buffer, "0xC0000");
+	if (p) {
+		result = 0;
+
+		p += 7;
+		if (strcmp(p, "224") == 0) {
+			result = -648;
+
+		} else if (strcmp(p, "234") == 0) {
+			result = -647;
+
+		} else if (strcmp(p, "072") == 0) {
+			result = -691;
+
+		} else if (strcasecmp(p, "05E") == 0) {
+			result = -2;
+		}
+
+		if (result != 0) {
+			REDEBUG2("%s", buffer);
+			return result;
+		}
+
+		/*
+		 *	Else fall through to more ridiculous checks.
+		 */
+	}
+
+	/*
+	 *	Look for variants of expire password.
+	 */
+	if (strcasestr(buffer, "0xC0000224") ||
+	    strcasestr(buffer, "Password expired") ||
+	    strcasestr(buffer, "Password has expired") ||
+	    strcasestr(buffer, "Password must be changed") ||
+	    strcasestr(buffer, "Must change password")) {
+		return -648;
+	}
+
+	if (strcasestr(buffer, "0xC0000234") ||
+	    strcasestr(buffer, "Account locked out")) {
+		REDEBUG2("%s", buffer);
+		return -647;
+	}
+
+	if (strcasestr(buffer, "0xC0000072") ||
+	    strcasestr(buffer, "Account disabled")) {
+		REDEBUG2("%s", buffer);
+		return -691;
+	}
+
+	if (strcasestr(buffer, "0xC000005E") ||
+	    strcasestr(buffer, "No logon servers")) {
+		REDEBUG2("%s", buffer);
+		return -2;
+	}
+
+	if (strcasestr(buffer, "could not obtain winbind separator") ||
+	    strcasestr(buffer, "Reading winbind reply failed")) {
+		REDEBUG2("%s", buffer);
+		return -2;
+	}
+
+	RDEBUG2("External script failed");
+	p = strchr(buffer, '\n');
+	if (p) *p = '\0';
+
+	REDEBUG("External script says: %s", buffer);
+	return -1;
+}
+
 /*
  *	Do the MS-CHAP stuff.
  *
@@ -1188,84 +1298,7 @@ static int CC_HINT(nonnull (1, 2, 4, 5, 6)) do_mschap(rlm_mschap_t const *inst,
 		 */
 		result = radius_exec_program(request, buffer, sizeof(buffer), NULL, request, inst->ntlm_auth, NULL,
 					     true, true, inst->ntlm_auth_timeout);
-		if (result != 0) {
-			char *p;
-
-			/*
-			 *	Do checks for numbers, which are
-			 *	language neutral.  They're also
-			 *	faster.
-			 */
-			p = strcasestr(buffer, "0xC0000");
-			if (p) {
-				result = 0;
-
-				p += 7;
-				if (strcmp(p, "224") == 0) {
-					result = -648;
-
-				} else if (strcmp(p, "234") == 0) {
-					result = -647;
-
-				} else if (strcmp(p, "072") == 0) {
-					result = -691;
-
-				} else if (strcasecmp(p, "05E") == 0) {
-					result = -2;
-				}
-
-				if (result != 0) {
-					REDEBUG2("%s", buffer);
-					return result;
-				}
-
-				/*
-				 *	Else fall through to more ridiculous checks.
-				 */
-			}
-
-			/*
-			 *	Look for variants of expire password.
-			 */
-			if (strcasestr(buffer, "0xC0000224") ||
-			    strcasestr(buffer, "Password expired") ||
-			    strcasestr(buffer, "Password has expired") ||
-			    strcasestr(buffer, "Password must be changed") ||
-			    strcasestr(buffer, "Must change password")) {
-				return -648;
-			}
-
-			if (strcasestr(buffer, "0xC0000234") ||
-			    strcasestr(buffer, "Account locked out")) {
-				REDEBUG2("%s", buffer);
-				return -647;
-			}
-
-			if (strcasestr(buffer, "0xC0000072") ||
-			    strcasestr(buffer, "Account disabled")) {
-				REDEBUG2("%s", buffer);
-				return -691;
-			}
-
-			if (strcasestr(buffer, "0xC000005E") ||
-			    strcasestr(buffer, "No logon servers")) {
-				REDEBUG2("%s", buffer);
-				return -2;
-			}
-
-			if (strcasestr(buffer, "could not obtain winbind separator") ||
-			    strcasestr(buffer, "Reading winbind reply failed")) {
-				REDEBUG2("%s", buffer);
-				return -2;
-			}
-
-			RDEBUG2("External script failed");
-			p = strchr(buffer, '\n');
-			if (p) *p = '\0';
-
-			REDEBUG("External script says: %s", buffer);
-			return -1;
-		}
+		if (result != 0) return mschap_ntlm_auth_error(request, buffer);
 
 		/*
 		 *	Parse the answer as an nthashhash.
@@ -1300,6 +1333,12 @@ static int CC_HINT(nonnull (1, 2, 4, 5, 6)) do_mschap(rlm_mschap_t const *inst,
 
 		break;
 		}
+	case AUTH_NTLMAUTH_HELPER:
+	/*
+	 *	Process auth via a running ntlm_auth helper
+	 */
+		return do_auth_ntlm_helper(inst, request, challenge, response, nthashhash);
+
 #ifdef WITH_AUTH_WINBIND
 	case AUTH_WBCLIENT:
 	/*
@@ -1774,21 +1813,294 @@ static unlang_action_t CC_HINT(nonnull) mschap_process_cpw_request(rlm_rcode_t *
 	RETURN_MODULE_OK;
 }
 
-static CC_HINT(nonnull(1,2,3,4,5,8,9)) unlang_action_t mschap_process_response(rlm_rcode_t *p_result,
-									       int *mschap_version,
-									       uint8_t nthashhash[static NT_DIGEST_LENGTH],
-									       rlm_mschap_t const *inst,
-									       request_t *request,
-									       fr_pair_t *smb_ctrl,
-									       fr_pair_t *nt_password,
-									       fr_pair_t *challenge,
-									       fr_pair_t *response,
-									       MSCHAP_AUTH_METHOD method)
+/** An MS-CHAP authentication in progress
+ *
+ * Holds everything needed to finish the authentication, so that calls
+ * to winbind or an ntlm_auth helper can be made by the thread pool
+ * while the request yields.
+ */
+typedef struct {
+	rlm_mschap_t const	*inst;		//!< Module instance.
+	request_t		*request;	//!< The request being authenticated.
+
+	fr_thread_pool_client_t	*client;	//!< To submit calls to the thread pool, NULL if there isn't one.
+	fr_thread_pool_job_t	*job;		//!< The outstanding call, NULL once it's done.
+	fr_time_delta_t		wait;		//!< How long the call was queued for.
+	fr_time_delta_t		run;		//!< How long the call took.
+
+	MSCHAP_AUTH_METHOD	method;		//!< How to check the response.
+	void			*call;		//!< #ntlm_helper_auth_t or #wbclient_auth_t, if
+						///< the call is being made by the thread pool.
+
+	int			mschap_version;	//!< 1 or 2.
+	uint8_t			nthashhash[NT_DIGEST_LENGTH];
+
+	fr_pair_t		*smb_ctrl;	//!< SMB-Account-Ctrl, may be NULL.
+	fr_pair_t		*nt_password;	//!< Known good password, may be NULL.
+	bool			ephemeral;	//!< Whether we created the nt_password.
+
+	fr_pair_t		*challenge;	//!< MS-CHAP-Challenge.
+	fr_pair_t		*response;	//!< MS-CHAP-Response or MS-CHAP2-Response.
+
+	char const		*username_str;	//!< MS-CHAPv2 username, without the domain.
+	size_t			username_len;	//!< Length of the username.
+	uint8_t const		*peer_challenge;	//!< MS-CHAPv2 peer challenge.
+} mschap_auth_ctx_t;
+
+static int _mschap_auth_ctx_free(mschap_auth_ctx_t *auth_ctx)
+{
+	if (auth_ctx->ephemeral) TALLOC_FREE(auth_ctx->nt_password);
+
+	return 0;
+}
+
+/** Check the result of an MS-CHAP authentication, and add the reply attributes
+ *
+ */
+static unlang_action_t mschap_auth_finish(rlm_rcode_t *p_result, mschap_auth_ctx_t *auth_ctx, int mschap_result)
+{
+	rlm_mschap_t const	*inst = auth_ctx->inst;
+	request_t		*request = auth_ctx->request;
+	fr_pair_t		*response = auth_ctx->response;
+	rlm_rcode_t		rcode;
+
+	/*
+	 *	Check for errors, and add MSCHAP-Error if necessary.
+	 */
+	mschap_error(&rcode, inst, request, *response->vp_octets,
+		     mschap_result, auth_ctx->mschap_version, auth_ctx->smb_ctrl);
+	if (rcode != RLM_MODULE_OK) RETURN_MODULE_RCODE(rcode);
+
+	if (auth_ctx->mschap_version == 2) {
+		char		msch2resp[42];
+		char const	*username_str = auth_ctx->username_str;
+
+#ifdef WITH_AUTH_WINBIND
+		if (inst->wb_retry_with_normalised_username) {
+			fr_pair_t *response_name;
+
+			response_name = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap_user_name, 0);
+			if (response_name) {
+				if (strcmp(username_str, response_name->vp_strvalue)) {
+					RDEBUG2("Normalising username %pV -> %pV",
+						fr_box_strvalue_len(username_str, auth_ctx->username_len),
+						&response_name->data);
+					username_str = response_name->vp_strvalue;
+				}
+			}
+		}
+#endif
+
+		mschap_auth_response(username_str,		/* without the domain */
+				     auth_ctx->username_len,	/* Length of username str */
+				     auth_ctx->nthashhash,	/* nt-hash-hash */
+				     response->vp_octets + 26,	/* peer response */
+				     auth_ctx->peer_challenge,	/* peer challenge */
+				     auth_ctx->challenge->vp_octets,	/* our challenge */
+				     msch2resp);		/* calculated MPPE key */
+		mschap_add_reply(request, *response->vp_octets, attr_ms_chap2_success, msch2resp, 42);
+	}
+
+	/* now create MPPE attributes */
+	if (inst->use_mppe) {
+		fr_pair_t	*vp;
+		uint8_t		mppe_sendkey[34];
+		uint8_t		mppe_recvkey[34];
+
+		switch (auth_ctx->mschap_version) {
+		case 1:
+			RDEBUG2("Generating MS-CHAPv1 MPPE keys");
+			memset(mppe_sendkey, 0, 32);
+
+			/*
+			 *	According to RFC 2548 we
+			 *	should send NT hash.  But in
+			 *	practice it doesn't work.
+			 *	Instead, we should send nthashhash
+			 *
+			 *	This is an error in RFC 2548.
+			 */
+			/*
+			 *	do_mschap cares to zero nthashhash if NT hash
+			 *	is not available.
+			 */
+			memcpy(mppe_sendkey + 8, auth_ctx->nthashhash, NT_DIGEST_LENGTH);
+			mppe_add_reply(inst, request, attr_ms_chap_mppe_keys, mppe_sendkey, 24);	//-V666
+			break;
+
+		case 2:
+			RDEBUG2("Generating MS-CHAPv2 MPPE keys");
+			mppe_chap2_gen_keys128(auth_ctx->nthashhash, response->vp_octets + 26, mppe_sendkey, mppe_recvkey);
+
+			mppe_add_reply(inst, request, attr_ms_mppe_recv_key, mppe_recvkey, 16);
+			mppe_add_reply(inst, request, attr_ms_mppe_send_key, mppe_sendkey, 16);
+			break;
+
+		default:
+			fr_assert(0);
+			break;
+		}
+
+		MEM(pair_update_reply(&vp, attr_ms_mppe_encryption_policy) >= 0);
+		vp->vp_uint32 = inst->require_encryption ? 2 : 1;
+
+		MEM(pair_update_reply(&vp, attr_ms_mppe_encryption_types) >= 0);
+		vp->vp_uint32 = inst->require_strong ? 4 : 6;
+	} /* else we weren't asked to use MPPE */
+
+	RETURN_MODULE_OK;
+}
+
+/** Make a call to winbind or an ntlm_auth helper in a thread pool thread
+ *
+ */
+static void mschap_auth_run(void *uctx)
+{
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(uctx, mschap_auth_ctx_t);
+
+	switch (auth_ctx->method) {
+	case AUTH_NTLMAUTH_HELPER:
+		ntlm_helper_auth_run(auth_ctx->call);
+		break;
+
+#ifdef WITH_AUTH_WINBIND
+	case AUTH_WBCLIENT:
+		wbclient_auth_run(auth_ctx->call);
+		break;
+#endif
+
+	default:
+		fr_assert(0);
+		break;
+	}
+}
+
+/** Convert the result of a call made by #mschap_auth_run
+ *
+ */
+static int mschap_auth_result(mschap_auth_ctx_t *auth_ctx)
+{
+	switch (auth_ctx->method) {
+	case AUTH_NTLMAUTH_HELPER:
+		return ntlm_helper_auth_result(auth_ctx->request, auth_ctx->call, auth_ctx->nthashhash);
+
+#ifdef WITH_AUTH_WINBIND
+	case AUTH_WBCLIENT:
+		return wbclient_auth_result(auth_ctx->request, auth_ctx->call, auth_ctx->nthashhash);
+#endif
+
+	default:
+		fr_assert(0);
+		return -1;
+	}
+}
+
+static void mschap_auth_done(void *uctx, fr_time_delta_t wait, fr_time_delta_t run)
+{
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(uctx, mschap_auth_ctx_t);
+
+	auth_ctx->job = NULL;
+	auth_ctx->wait = wait;
+	auth_ctx->run = run;
+
+	talloc_steal(auth_ctx->request, auth_ctx);
+	unlang_interpret_mark_runnable(auth_ctx->request);
+}
+
+static unlang_action_t mschap_auth_resume(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx,
+					  request_t *request, void *rctx)
+{
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(rctx, mschap_auth_ctx_t);
+	unlang_action_t		ua;
+
+	RDEBUG3("%s responded in %pVs, after queueing for %pVs",
+		auth_ctx->method == AUTH_NTLMAUTH_HELPER ? "ntlm_auth helper" : "winbind",
+		fr_box_time_delta(auth_ctx->run), fr_box_time_delta(auth_ctx->wait));
+
+	ua = mschap_auth_finish(p_result, auth_ctx, mschap_auth_result(auth_ctx));
+	talloc_free(auth_ctx);
+
+	return ua;
+}
+
+static void mschap_auth_signal(UNUSED module_ctx_t const *mctx, UNUSED request_t *request,
+			       void *rctx, fr_state_signal_t action)
+{
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(rctx, mschap_auth_ctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	/*
+	 *	If the call has completed the context is
+	 *	parented by the request, and will be
+	 *	freed with it.
+	 */
+	if (!auth_ctx->job) return;
+
+	/*
+	 *	A running call's context is freed once the call
+	 *	completes, which may be after the request.  Any
+	 *	ephemeral password is freed with the request.
+	 */
+	auth_ctx->ephemeral = false;
+	fr_thread_pool_cancel(auth_ctx->job);
+}
+
+/** Check an MS-CHAP response, yielding if it has to be sent to winbind or an ntlm_auth helper
+ *
+ * @param[out] p_result		The result of the authentication.
+ * @param[in] auth_ctx		The authentication in progress.  If this function yields,
+ *				it's owned by the thread pool, then by the request.
+ * @param[in] challenge		MS-CHAPv1 challenge, 8 octets.
+ * @param[in] nt_response	NT-Response, 24 octets.
+ */
+static unlang_action_t mschap_auth_start(rlm_rcode_t *p_result, mschap_auth_ctx_t *auth_ctx,
+					 uint8_t const *challenge, uint8_t const *nt_response)
+{
+	request_t	*request = auth_ctx->request;
+	rlm_mschap_t const *inst = auth_ctx->inst;
+
+	if (!auth_ctx->client) goto inline_auth;
+
+	switch (auth_ctx->method) {
+	case AUTH_NTLMAUTH_HELPER:
+		auth_ctx->call = ntlm_helper_auth_alloc(auth_ctx, inst, request, challenge, nt_response);
+		break;
+
+#ifdef WITH_AUTH_WINBIND
+	case AUTH_WBCLIENT:
+		auth_ctx->call = wbclient_auth_alloc(auth_ctx, inst, request, challenge, nt_response);
+		break;
+#endif
+
+	default:
+	inline_auth:
+		return mschap_auth_finish(p_result, auth_ctx,
+					  do_mschap(inst, request, auth_ctx->nt_password, challenge, nt_response,
+						    auth_ctx->nthashhash, auth_ctx->method));
+	}
+
+	if (!auth_ctx->call) return mschap_auth_finish(p_result, auth_ctx, -1);
+
+	auth_ctx->job = fr_thread_pool_submit(auth_ctx->client, mschap_auth_run, mschap_auth_done, auth_ctx);
+	if (auth_ctx->job) return unlang_module_yield(request, mschap_auth_resume, mschap_auth_signal, auth_ctx);
+
+	/*
+	 *	Queue is full, make the call ourselves.
+	 */
+	RWDEBUG2("Thread pool queue is full, authenticating inline");
+	mschap_auth_run(auth_ctx);
+
+	return mschap_auth_finish(p_result, auth_ctx, mschap_auth_result(auth_ctx));
+}
+
+static CC_HINT(nonnull) unlang_action_t mschap_process_response(rlm_rcode_t *p_result, mschap_auth_ctx_t *auth_ctx)
 {
-	int			offset;
-	rlm_rcode_t		mschap_result;
+	request_t		*request = auth_ctx->request;
+	fr_pair_t		*challenge = auth_ctx->challenge;
+	fr_pair_t		*response = auth_ctx->response;
 
-	*mschap_version = 1;
+	auth_ctx->mschap_version = 1;
 
 	RDEBUG2("Processing MS-CHAPv1 response");
 
@@ -1817,41 +2129,27 @@ static CC_HINT(nonnull(1,2,3,4,5,8,9)) unlang_action_t mschap_process_response(r
 		RETURN_MODULE_FAIL;
 	}
 
-	offset = 26;
-
 	/*
 	 *	Do the MS-CHAP authentication.
 	 */
-	mschap_result = do_mschap(inst, request, nt_password, challenge->vp_octets,
-				  response->vp_octets + offset, nthashhash, method);
-
-	/*
-	 *	Check for errors, and add MSCHAP-Error if necessary.
-	 */
-	return mschap_error(p_result, inst, request, *response->vp_octets, mschap_result, *mschap_version, smb_ctrl);
+	return mschap_auth_start(p_result, auth_ctx, challenge->vp_octets, response->vp_octets + 26);
 }
 
-static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_response(rlm_rcode_t *p_result,
-										  int *mschap_version,
-									    	  uint8_t nthashhash[static NT_DIGEST_LENGTH],
-									    	  rlm_mschap_t const *inst,
-									    	  request_t *request,
-									    	  fr_pair_t *smb_ctrl,
-									   	  fr_pair_t *nt_password,
-									    	  fr_pair_t *challenge,
-									    	  fr_pair_t *response,
-									    	  MSCHAP_AUTH_METHOD method)
+static unlang_action_t CC_HINT(nonnull) mschap_process_v2_response(rlm_rcode_t *p_result, mschap_auth_ctx_t *auth_ctx)
 {
-		uint8_t		mschap_challenge[16];
-		fr_pair_t	*user_name, *name_vp, *response_name, *peer_challenge_attr;
-		uint8_t const	*peer_challenge;
-		char const	*username_str;
-		size_t		username_len;
-		int		mschap_result;
-		rlm_rcode_t	rcode;
-		char		msch2resp[42];
+		rlm_mschap_t const	*inst = auth_ctx->inst;
+		request_t		*request = auth_ctx->request;
+		fr_pair_t		*challenge = auth_ctx->challenge;
+		fr_pair_t		*response = auth_ctx->response;
+		uint8_t			mschap_challenge[16];
+		fr_pair_t		*user_name, *name_vp, *response_name, *peer_challenge_attr;
+		char const		*username_str;
+		size_t			username_len;
+#ifdef __APPLE__
+		rlm_rcode_t		rcode;
+#endif
 
-		*mschap_version = 2;
+		auth_ctx->mschap_version = 2;
 
 		RDEBUG2("Processing MS-CHAPv2 response");
 
@@ -1918,20 +2216,23 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 		 *  indicates the auth process should continue directly to AD.
 		 *  Otherwise OD will determine auth success/fail.
 		 */
-		if (!nt_password && inst->open_directory) {
+		if (!auth_ctx->nt_password && inst->open_directory) {
 			RDEBUG2("No NT-Password available. Trying OpenDirectory Authentication");
 			rcode = od_mschap_auth(request, challenge, user_name);
 			if (rcode != RLM_MODULE_NOOP) RETURN_MODULE_RCODE(rcode);
 		}
 #endif
-		peer_challenge = response->vp_octets + 2;
+		auth_ctx->peer_challenge = response->vp_octets + 2;
 
 		peer_challenge_attr = fr_pair_find_by_da(&request->control_pairs, attr_ms_chap_peer_challenge, 0);
 		if (peer_challenge_attr) {
 			RDEBUG2("Overriding peer challenge");
-			peer_challenge = peer_challenge_attr->vp_octets;
+			auth_ctx->peer_challenge = peer_challenge_attr->vp_octets;
 		}
 
+		auth_ctx->username_str = username_str;
+		auth_ctx->username_len = username_len;
+
 		/*
 		 *	The old "mschapv2" function has been moved to
 		 *	here.
@@ -1942,44 +2243,11 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 		RDEBUG2("Creating challenge with username \"%pV\"",
 			fr_box_strvalue_len(username_str, username_len));
 		mschap_challenge_hash(mschap_challenge,		/* resulting challenge */
-				      peer_challenge,			/* peer challenge */
+				      auth_ctx->peer_challenge,	/* peer challenge */
 				      challenge->vp_octets,		/* our challenge */
 				      username_str, username_len);	/* user name */
 
-		mschap_result = do_mschap(inst, request, nt_password, mschap_challenge,
-					  response->vp_octets + 26, nthashhash, method);
-
-		/*
-		 *	Check for errors, and add MSCHAP-Error if necessary.
-		 */
-		mschap_error(&rcode, inst, request, *response->vp_octets,
-			     mschap_result, *mschap_version, smb_ctrl);
-		if (rcode != RLM_MODULE_OK) RETURN_MODULE_RCODE(rcode);
-
-#ifdef WITH_AUTH_WINBIND
-		if (inst->wb_retry_with_normalised_username) {
-			response_name = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap_user_name, 0);
-			if (response_name) {
-				if (strcmp(username_str, response_name->vp_strvalue)) {
-					RDEBUG2("Normalising username %pV -> %pV",
-						fr_box_strvalue_len(username_str, username_len),
-						&response_name->data);
-					username_str = response_name->vp_strvalue;
-				}
-			}
-		}
-#endif
-
-		mschap_auth_response(username_str,		/* without the domain */
-				     username_len,		/* Length of username str */
-				     nthashhash,		/* nt-hash-hash */
-				     response->vp_octets + 26,	/* peer response */
-				     peer_challenge,		/* peer challenge */
-				     challenge->vp_octets,	/* our challenge */
-				     msch2resp);		/* calculated MPPE key */
-		mschap_add_reply(request, *response->vp_octets, attr_ms_chap2_success, msch2resp, 42);
-
-		RETURN_MODULE_OK;
+		return mschap_auth_start(p_result, auth_ctx, mschap_challenge, response->vp_octets + 26);
 }
 
 /*
@@ -2001,16 +2269,15 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_mschap_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_mschap_t);
-	fr_pair_t		*challenge = NULL;
-	fr_pair_t		*response = NULL;
+	rlm_mschap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_mschap_thread_t);
+	mschap_auth_ctx_t	*auth_ctx;
 	fr_pair_t		*cpw = NULL;
 	fr_pair_t		*nt_password = NULL, *smb_ctrl;
-	uint8_t			nthashhash[NT_DIGEST_LENGTH];
-	int			mschap_version = 0;
 
 	MSCHAP_AUTH_METHOD	method;
 	bool			ephemeral = false;
 	rlm_rcode_t		rcode = RLM_MODULE_OK;
+	unlang_action_t		ua;
 
 	/*
 	 *	If we have ntlm_auth configured, use it unless told
@@ -2065,6 +2332,19 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	 */
 	if (nt_password_find(&ephemeral, &nt_password, mctx->instance, request) < 0) RETURN_MODULE_FAIL;
 
+	/*
+	 *	From here on the auth_ctx frees any ephemeral password.
+	 */
+	MEM(auth_ctx = talloc_zero(request, mschap_auth_ctx_t));
+	talloc_set_destructor(auth_ctx, _mschap_auth_ctx_free);
+	auth_ctx->inst = inst;
+	auth_ctx->request = request;
+	auth_ctx->client = t->client;
+	auth_ctx->method = method;
+	auth_ctx->smb_ctrl = smb_ctrl;
+	auth_ctx->nt_password = nt_password;
+	auth_ctx->ephemeral = ephemeral;
+
 	/*
 	 *	Check to see if this is a change password request, and process
 	 *	it accordingly if so.
@@ -2091,8 +2371,8 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		 *	password change, add them into the request and then
 		 *	continue with the authentication.
 		 */
-		MEM(pair_update_request(&response, attr_ms_chap2_response) >= 0);
-		MEM(fr_pair_value_mem_alloc(response, &p, 50, cpw->vp_tainted) == 0);
+		MEM(pair_update_request(&auth_ctx->response, attr_ms_chap2_response) >= 0);
+		MEM(fr_pair_value_mem_alloc(auth_ctx->response, &p, 50, cpw->vp_tainted) == 0);
 
 		/* ident & flags */
 		p[0] = cpw->vp_octets[1];
@@ -2101,8 +2381,8 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		memcpy(p + 2, cpw->vp_octets + 18, 48);
 	}
 
-	challenge = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap_challenge, 0);
-	if (!challenge) {
+	auth_ctx->challenge = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap_challenge, 0);
+	if (!auth_ctx->challenge) {
 		REDEBUG("&control.Auth-Type = %s set for a request that does not contain &%s",
 			inst->name, attr_ms_chap_challenge->name);
 		rcode = RLM_MODULE_INVALID;
@@ -2112,22 +2392,10 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	/*
 	 *	We also require an MS-CHAP-Response.
 	 */
-	if ((response = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap_response, 0))) {
-		mschap_process_response(&rcode,
-					&mschap_version, nthashhash,
-					inst, request,
-					smb_ctrl, nt_password,
-					challenge, response,
-					method);
-		if (rcode != RLM_MODULE_OK) goto finish;
-	} else if ((response = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap2_response, 0))) {
-		mschap_process_v2_response(&rcode,
-					   &mschap_version, nthashhash,
-					   inst, request,
-					   smb_ctrl, nt_password,
-					   challenge, response,
-					   method);
-		if (rcode != RLM_MODULE_OK) goto finish;
+	if ((auth_ctx->response = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap_response, 0))) {
+		ua = mschap_process_response(p_result, auth_ctx);
+	} else if ((auth_ctx->response = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap2_response, 0))) {
+		ua = mschap_process_v2_response(p_result, auth_ctx);
 	} else {		/* Neither CHAPv1 or CHAPv2 response: die */
 		REDEBUG("&control.Auth-Type = %s set for a request that does not contain &%s or &%s attributes",
 			inst->name, attr_ms_chap_response->name, attr_ms_chap2_response->name);
@@ -2135,55 +2403,16 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		goto finish;
 	}
 
-	/* now create MPPE attributes */
-	if (inst->use_mppe) {
-		fr_pair_t	*vp;
-		uint8_t		mppe_sendkey[34];
-		uint8_t		mppe_recvkey[34];
-
-		switch (mschap_version) {
-		case 1:
-			RDEBUG2("Generating MS-CHAPv1 MPPE keys");
-			memset(mppe_sendkey, 0, 32);
-
-			/*
-			 *	According to RFC 2548 we
-			 *	should send NT hash.  But in
-			 *	practice it doesn't work.
-			 *	Instead, we should send nthashhash
-			 *
-			 *	This is an error in RFC 2548.
-			 */
-			/*
-			 *	do_mschap cares to zero nthashhash if NT hash
-			 *	is not available.
-			 */
-			memcpy(mppe_sendkey + 8, nthashhash, NT_DIGEST_LENGTH);
-			mppe_add_reply(inst, request, attr_ms_chap_mppe_keys, mppe_sendkey, 24);	//-V666
-			break;
-
-		case 2:
-			RDEBUG2("Generating MS-CHAPv2 MPPE keys");
-			mppe_chap2_gen_keys128(nthashhash, response->vp_octets + 26, mppe_sendkey, mppe_recvkey);
-
-			mppe_add_reply(inst, request, attr_ms_mppe_recv_key, mppe_recvkey, 16);
-			mppe_add_reply(inst, request, attr_ms_mppe_send_key, mppe_sendkey, 16);
-			break;
-
-		default:
-			fr_assert(0);
-			break;
-		}
-
-		MEM(pair_update_reply(&vp, attr_ms_mppe_encryption_policy) >= 0);
-		vp->vp_uint32 = inst->require_encryption ? 2 : 1;
+	/*
+	 *	The thread pool now owns the auth_ctx.
+	 */
+	if (ua == UNLANG_ACTION_YIELD) return ua;
 
-		MEM(pair_update_reply(&vp, attr_ms_mppe_encryption_types) >= 0);
-		vp->vp_uint32 = inst->require_strong ? 4 : 6;
-	} /* else we weren't asked to use MPPE */
+	talloc_free(auth_ctx);
+	return ua;
 
 finish:
-	if (ephemeral) TALLOC_FREE(nt_password);
+	talloc_free(auth_ctx);
 
 	RETURN_MODULE_RCODE(rcode);
 }
@@ -2222,6 +2451,27 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 #endif
 	}
 
+	if (inst->ntlm_helper) {
+		CONF_SECTION	*cs = cf_section_find(conf, "ntlm_auth_helper", NULL);
+		char		log_prefix[128];
+
+		if (!inst->ntlm_helper_username) {
+			cf_log_err(cs, "'username' must be set when using the ntlm_auth helper");
+			return -1;
+		}
+
+		inst->method = AUTH_NTLMAUTH_HELPER;
+
+		snprintf(log_prefix, sizeof(log_prefix), "rlm_mschap (%s) - ntlm_auth helper", inst->name);
+		inst->ntlm_helper_pool = module_connection_pool_init(cs, inst, ntlm_helper_conn_create, NULL,
+								     log_prefix, "modules.mschap.ntlm_auth_helper.pool",
+								     NULL);
+		if (!inst->ntlm_helper_pool) {
+			cf_log_err(cs, "Unable to initialise ntlm_auth helper pool");
+			return -1;
+		}
+	}
+
 	/* preserve existing behaviour: this option overrides all */
 	if (inst->ntlm_auth) {
 		inst->method = AUTH_NTLMAUTH_EXEC;
@@ -2234,6 +2484,9 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	case AUTH_NTLMAUTH_EXEC:
 		DEBUG("Authenticating by calling 'ntlm_auth'");
 		break;
+	case AUTH_NTLMAUTH_HELPER:
+		DEBUG("Authenticating by calling long running 'ntlm_auth' helpers");
+		break;
 #ifdef WITH_AUTH_WINBIND
 	case AUTH_WBCLIENT:
 		DEBUG("Authenticating directly to winbind");
@@ -2258,6 +2511,32 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	/*
+	 *	Calls to winbind and ntlm_auth helpers block, so
+	 *	they're made by a pool of threads while the
+	 *	request yields.
+	 */
+	FR_INTEGER_BOUND_CHECK("thread_pool.threads", inst->threads, <=, 256);
+	FR_INTEGER_BOUND_CHECK("thread_pool.max_queued", inst->max_queued, >=, 1);
+
+	switch (inst->method) {
+	case AUTH_NTLMAUTH_HELPER:
+#ifdef WITH_AUTH_WINBIND
+	case AUTH_WBCLIENT:
+#endif
+		if (!inst->threads) break;
+
+		inst->pool = fr_thread_pool_alloc(inst, inst->threads, inst->max_queued);
+		if (!inst->pool) {
+			cf_log_perr(conf, "Failed creating thread pool");
+			return -1;
+		}
+		break;
+
+	default:
+		break;
+	}
+
 	return 0;
 }
 
@@ -2284,21 +2563,61 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 /*
  *	Tidy up instance
  */
-static int mod_detach(
-#ifndef WITH_AUTH_WINBIND
-		      UNUSED
-#endif
-		      void *instance)
+static int mod_detach(void *instance)
 {
-#ifdef WITH_AUTH_WINBIND
-	rlm_mschap_t *inst = instance;
+	rlm_mschap_t		*inst = instance;
+
+	if (inst->pool) {
+		fr_thread_pool_stats_t	stats;
+
+		fr_thread_pool_stats(&stats, inst->pool);
+		DEBUG("%s - Thread pool made %" PRIu64 " authentication calls, %" PRIu64 " made inline as the "
+		      "queue was full, maximum queue depth %u, maximum queue time %pVs, mean run time %pVs",
+		      inst->name, stats.completed, stats.overflow, stats.depth_max,
+		      fr_box_time_delta(stats.wait_max),
+		      fr_box_time_delta(stats.completed ? stats.run_total / (fr_time_delta_t)stats.completed : 0));
+
+		/*
+		 *	Joins the threads, so must be done before
+		 *	the connection pools are freed.
+		 */
+		TALLOC_FREE(inst->pool);
+	}
+
+	if (inst->ntlm_helper_pool) fr_pool_free(inst->ntlm_helper_pool);
 
+#ifdef WITH_AUTH_WINBIND
 	fr_pool_free(inst->wb_pool);
 #endif
 
 	return 0;
 }
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  fr_event_list_t *el, void *thread)
+{
+	rlm_mschap_t		*inst = talloc_get_type_abort(instance, rlm_mschap_t);
+	rlm_mschap_thread_t	*t = talloc_get_type_abort(thread, rlm_mschap_thread_t);
+
+	if (!inst->pool) return 0;
+
+	t->client = fr_thread_pool_client_alloc(t, inst->pool, el);
+	if (!t->client) {
+		PERROR("%s - Failed connecting to thread pool", inst->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_mschap_thread_t	*t = talloc_get_type_abort(thread, rlm_mschap_thread_t);
+
+	TALLOC_FREE(t->client);
+
+	return 0;
+}
 
 extern module_t rlm_mschap;
 module_t rlm_mschap = {
@@ -2310,6 +2629,9 @@ module_t rlm_mschap = {
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_mschap_thread_t),
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize
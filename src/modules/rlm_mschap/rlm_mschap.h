@@ -6,16 +6,18 @@ RCSIDH(rlm_mschap_h, "$Id$")
 
 #ifdef WITH_AUTH_WINBIND
 #  include <wbclient.h>
+#endif
 
 #include <freeradius-devel/server/pool.h>
-#endif
+#include <freeradius-devel/util/thread_pool.h>
 
 /* Method of authentication we are going to use */
 typedef enum {
 	AUTH_INTERNAL		= 0,
-	AUTH_NTLMAUTH_EXEC	= 1
+	AUTH_NTLMAUTH_EXEC	= 1,
+	AUTH_NTLMAUTH_HELPER	= 2
 #ifdef WITH_AUTH_WINBIND
-	,AUTH_WBCLIENT       	= 2
+	,AUTH_WBCLIENT       	= 3
 #endif
 } MSCHAP_AUTH_METHOD;
 
@@ -62,6 +64,10 @@ typedef struct {
 
 	char const		*ntlm_auth;
 	fr_time_delta_t		ntlm_auth_timeout;
+	char const		*ntlm_helper;		//!< ntlm_auth --helper-protocol=ntlm-server-1 command.
+	tmpl_t			*ntlm_helper_username;
+	tmpl_t			*ntlm_helper_domain;
+	fr_pool_t		*ntlm_helper_pool;	//!< Running ntlm_auth helpers.
 	char const		*ntlm_cpw;
 	char const		*ntlm_cpw_username;
 	char const		*ntlm_cpw_domain;
@@ -79,4 +85,14 @@ typedef struct {
 #ifdef __APPLE__
 	bool			open_directory;
 #endif
+
+	uint32_t		threads;		//!< Number of threads calling winbind or ntlm_auth.
+	uint32_t		max_queued;		//!< Maximum number of calls waiting for a thread.
+	fr_thread_pool_t	*pool;			//!< Threads calling winbind or ntlm_auth.
 } rlm_mschap_t;
+
+typedef struct {
+	fr_thread_pool_client_t	*client;		//!< For submitting calls to the thread pool.
+} rlm_mschap_thread_t;
+
+int mschap_ntlm_auth_error(request_t *request, char *buffer);
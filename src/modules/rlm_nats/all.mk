@@ -0,0 +1,4 @@
+TARGET		:= rlm_nats.a
+SOURCES		:= rlm_nats.c
+
+TGT_PREREQS	:= libfreeradius-internal.a
@@ -0,0 +1,765 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_nats.c
+ * @brief Publish requests to a NATS message bus.
+ *
+ * Each request is encoded with the internal protocol, and published to a
+ * NATS server using the NATS text protocol.  Connections are managed by a
+ * per-thread trunk.
+ *
+ * Publications from all requests which are pending on a connection are
+ * written in a single batch.  Connections are opened in verbose mode, so
+ * the server acknowledges every publication with +OK, in the order they
+ * were written.  The request only resumes once its publication has been
+ * acknowledged, so accounting responses are only sent once the server
+ * has accepted the data.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/internal/internal.h>
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/module.h>
+#include <freeradius-devel/server/trunk.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+
+#define NATS_RBUF_SIZE	16384		//!< Longest protocol line we accept from the server.
+
+/** Module instance
+ *
+ */
+typedef struct {
+	char const		*name;			//!< Instance name.
+
+	fr_ipaddr_t		server;			//!< NATS server to connect to.
+	uint16_t		port;			//!< Port of the NATS server.
+
+	char const		*user;			//!< To authenticate with.
+	char const		*password;		//!< To authenticate with.
+
+	tmpl_t			*subject;		//!< Subject to publish to.
+
+	size_t			max_payload;		//!< Largest publication we'll send.
+	size_t			max_batch;		//!< Most data to write to a connection at once.
+	fr_time_delta_t		timeout;		//!< How long to wait for the server to acknowledge
+							///< a publication.
+
+	fr_trunk_conf_t		trunk_conf;		//!< Trunk configuration.
+
+	char			*connect;		//!< CONNECT message sent when a connection is opened.
+} rlm_nats_t;
+
+/** Thread instance
+ *
+ */
+typedef struct {
+	rlm_nats_t const	*inst;			//!< Module instance.
+	fr_trunk_t		*trunk;			//!< Connections to the NATS server.
+} rlm_nats_thread_t;
+
+typedef struct nats_pub_s nats_pub_t;
+
+/** A publication which has been written, and is waiting for the server's reply
+ *
+ * These are kept in the order the publications were written, and are
+ * retained even if the request is cancelled, so that replies continue to
+ * match the correct publication.
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the handle's list of unacknowledged
+							///< publications.
+	nats_pub_t		*pub;			//!< Publication, or NULL if it's been cancelled.
+} nats_ack_t;
+
+/** A single publication
+ *
+ * Used as both the preq and rctx.
+ */
+struct nats_pub_s {
+	fr_trunk_request_t	*treq;			//!< Trunk request, NULL once it's been freed.
+	request_t		*request;		//!< Request being published.
+	nats_ack_t		*ack;			//!< Reply slot, set once the publication's been written.
+
+	char			*hdr;			//!< PUB protocol line.
+	size_t			hdr_len;		//!< Length of the PUB protocol line.
+	uint8_t const		*payload;		//!< Encoded request.
+	size_t			payload_len;		//!< Length of the encoded request.
+
+	rlm_rcode_t		rcode;			//!< Result of the publication.
+};
+
+/** State of a connection to the NATS server
+ *
+ */
+typedef struct {
+	rlm_nats_t const	*inst;			//!< Module instance.
+	int			fd;			//!< Connected socket.
+	fr_event_list_t		*el;			//!< Event list the connection's I/O handlers are
+							///< registered with.
+	fr_trunk_connection_t	*tconn;			//!< Trunk connection this handle belongs to.
+	bool			want_write;		//!< The trunk has requests to write.
+
+	fr_dlist_head_t		acks;			//!< Publications waiting for +OK or -ERR.
+	unsigned int		ignore_oks;		//!< +OK replies for protocol messages which aren't
+							///< publications.
+
+	uint8_t			*wbuf;			//!< Current batch of data to write.
+	size_t			wbuf_used;		//!< Amount of data in the batch.
+	size_t			wbuf_written;		//!< How much of the batch has been written.
+
+	uint8_t			rbuf[NATS_RBUF_SIZE];	//!< Incomplete replies.
+	size_t			rbuf_used;		//!< Amount of data in the read buffer.
+} nats_handle_t;
+
+static CONF_PARSER const module_config[] = {
+	{ FR_CONF_OFFSET("server", FR_TYPE_COMBO_IP_ADDR | FR_TYPE_REQUIRED, rlm_nats_t, server) },
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, rlm_nats_t, port), .dflt = "4222" },
+	{ FR_CONF_OFFSET("user", FR_TYPE_STRING, rlm_nats_t, user) },
+	{ FR_CONF_OFFSET("password", FR_TYPE_STRING | FR_TYPE_SECRET, rlm_nats_t, password) },
+	{ FR_CONF_OFFSET("subject", FR_TYPE_TMPL, rlm_nats_t, subject), .dflt = "radius.accounting", .quote = T_DOUBLE_QUOTED_STRING },
+	{ FR_CONF_OFFSET("max_payload", FR_TYPE_SIZE, rlm_nats_t, max_payload), .dflt = "1048576" },
+	{ FR_CONF_OFFSET("max_batch", FR_TYPE_SIZE, rlm_nats_t, max_batch), .dflt = "65536" },
+	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, rlm_nats_t, timeout), .dflt = "5.0" },
+
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_nats_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
+	CONF_PARSER_TERMINATOR
+};
+
+static void nats_handle_io_update(nats_handle_t *h);
+
+/** Write as much of the current batch as the socket will accept
+ *
+ * @param[in] h		to write the batch for.
+ * @return
+ *	- 0 if the batch was written, or the socket would block.
+ *	- -1 on error.  The caller should signal the connection to reconnect.
+ */
+static int nats_handle_flush(nats_handle_t *h)
+{
+	ssize_t slen;
+
+	while (h->wbuf_written < h->wbuf_used) {
+		slen = write(h->fd, h->wbuf + h->wbuf_written, h->wbuf_used - h->wbuf_written);
+		if (slen < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+			ERROR("%s - Failed writing to NATS server: %s", h->inst->name, fr_syserror(errno));
+			return -1;
+		}
+		h->wbuf_written += slen;
+	}
+
+	h->wbuf_used = h->wbuf_written = 0;
+
+	return 0;
+}
+
+/** Add data to the current batch
+ *
+ */
+static void nats_handle_append(nats_handle_t *h, void const *data, size_t data_len)
+{
+	size_t need = h->wbuf_used + data_len;
+
+	if (need > talloc_array_length(h->wbuf)) {
+		size_t len = talloc_array_length(h->wbuf) * 2;
+
+		if (len < need) len = need;
+		MEM(h->wbuf = talloc_realloc(h, h->wbuf, uint8_t, len));
+	}
+
+	memcpy(h->wbuf + h->wbuf_used, data, data_len);
+	h->wbuf_used += data_len;
+}
+
+static void _nats_conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+			     int fd_errno, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	nats_handle_t		*h = talloc_get_type_abort(tconn->conn->h, nats_handle_t);
+
+	ERROR("%s - Connection to NATS server failed: %s", h->inst->name, fr_syserror(fd_errno));
+
+	fr_connection_signal_reconnect(tconn->conn, FR_CONNECTION_FAILED);
+}
+
+static void _nats_conn_readable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	fr_trunk_connection_signal_readable(tconn);
+}
+
+static void _nats_conn_writable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	nats_handle_t		*h = talloc_get_type_abort(tconn->conn->h, nats_handle_t);
+
+	/*
+	 *	Finish writing the last batch first.  Its
+	 *	requests have already been marked as sent,
+	 *	so the trunk doesn't know about it.
+	 */
+	if (h->wbuf_used) {
+		if (nats_handle_flush(h) < 0) {
+			fr_connection_signal_reconnect(tconn->conn, FR_CONNECTION_FAILED);
+			return;
+		}
+		if (h->wbuf_used) return;
+
+		nats_handle_io_update(h);
+	}
+
+	if (h->want_write) fr_trunk_connection_signal_writable(tconn);
+}
+
+/** Register I/O handlers for a connection
+ *
+ * We always read, so that PINGs from the server are answered even when
+ * the connection is idle.  We write if the trunk has requests for the
+ * connection, or the last batch hasn't been completely written.
+ */
+static void nats_handle_io_update(nats_handle_t *h)
+{
+	bool write = h->want_write || (h->wbuf_used > 0);
+
+	if (fr_event_fd_insert(h, h->el, h->fd,
+			       _nats_conn_readable,
+			       write ? _nats_conn_writable : NULL,
+			       _nats_conn_error,
+			       h->tconn) < 0) {
+		PERROR("%s - Failed inserting NATS connection I/O handlers", h->inst->name);
+		fr_connection_signal_reconnect(h->tconn->conn, FR_CONNECTION_FAILED);
+	}
+}
+
+/** Inform the handle which events the trunk wants
+ *
+ */
+static void _nats_conn_notify(fr_trunk_connection_t *tconn, fr_connection_t *conn,
+			      fr_event_list_t *el,
+			      fr_trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	nats_handle_t *h = talloc_get_type_abort(conn->h, nats_handle_t);
+
+	h->tconn = tconn;
+	h->el = el;
+	h->want_write = (notify_on == FR_TRUNK_CONN_EVENT_WRITE) || (notify_on == FR_TRUNK_CONN_EVENT_BOTH);
+
+	nats_handle_io_update(h);
+}
+
+/** Start connecting to the NATS server
+ *
+ */
+static fr_connection_state_t _nats_conn_init(void **h_out, fr_connection_t *conn, void *uctx)
+{
+	rlm_nats_thread_t	*t = talloc_get_type_abort(uctx, rlm_nats_thread_t);
+	rlm_nats_t const	*inst = t->inst;
+	nats_handle_t		*h;
+	int			fd;
+
+	DEBUG2("%s - Opening TCP connection to %pV:%u", inst->name, fr_box_ipaddr(inst->server), inst->port);
+
+	fd = fr_socket_client_tcp(NULL, &inst->server, inst->port, true);
+	if (fd < 0) {
+		PERROR("%s - Failed opening connection to NATS server", inst->name);
+		return FR_CONNECTION_STATE_FAILED;
+	}
+
+	MEM(h = talloc_zero(conn, nats_handle_t));
+	h->inst = inst;
+	h->fd = fd;
+	fr_dlist_talloc_init(&h->acks, nats_ack_t, entry);
+	MEM(h->wbuf = talloc_array(h, uint8_t, inst->max_batch));
+
+	fr_connection_signal_on_fd(conn, fd);
+	*h_out = h;
+
+	return FR_CONNECTION_STATE_CONNECTING;
+}
+
+/** Queue the CONNECT message
+ *
+ * The server sends INFO as soon as the TCP connection is established.
+ * We don't need anything from it, so it's ignored by the demux function.
+ */
+static fr_connection_state_t _nats_conn_open(UNUSED fr_event_list_t *el, void *h_in, UNUSED void *uctx)
+{
+	nats_handle_t *h = talloc_get_type_abort(h_in, nats_handle_t);
+
+	nats_handle_append(h, h->inst->connect, talloc_array_length(h->inst->connect) - 1);
+	h->ignore_oks++;
+
+	if (nats_handle_flush(h) < 0) return FR_CONNECTION_STATE_FAILED;
+
+	return FR_CONNECTION_STATE_CONNECTED;
+}
+
+static void _nats_conn_close(UNUSED fr_event_list_t *el, void *h_in, UNUSED void *uctx)
+{
+	nats_handle_t *h = talloc_get_type_abort(h_in, nats_handle_t);
+
+	/*
+	 *	Any publications still waiting for
+	 *	replies will be moved to another
+	 *	connection, and written again.
+	 */
+	fr_dlist_foreach(&h->acks, nats_ack_t, ack) {
+		if (ack->pub) ack->pub->ack = NULL;
+	}
+
+	talloc_free_children(h);	/* Clear the IO handlers */
+
+	if (shutdown(h->fd, SHUT_RDWR) < 0) {
+		DEBUG3("%s - Failed shutting down connection: %s", h->inst->name, fr_syserror(errno));
+	}
+	if (close(h->fd) < 0) {
+		DEBUG3("%s - Failed closing connection: %s", h->inst->name, fr_syserror(errno));
+	}
+
+	talloc_free(h);
+}
+
+static fr_connection_t *nats_conn_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
+					fr_connection_conf_t const *conf,
+					char const *log_prefix, void *uctx)
+{
+	return fr_connection_alloc(tconn, el,
+				   &(fr_connection_funcs_t){
+					.init = _nats_conn_init,
+					.open = _nats_conn_open,
+					.close = _nats_conn_close
+				   },
+				   conf, log_prefix, uctx);
+}
+
+/** Write all pending publications for a connection as a single batch
+ *
+ */
+static void _nats_request_mux(UNUSED fr_event_list_t *el, fr_trunk_connection_t *tconn,
+			      fr_connection_t *conn, UNUSED void *uctx)
+{
+	nats_handle_t		*h = talloc_get_type_abort(conn->h, nats_handle_t);
+	fr_trunk_request_t	*treq;
+
+	/*
+	 *	Don't start a new batch until the
+	 *	previous one has been written.
+	 */
+	if (h->wbuf_used) return;
+
+	while ((fr_trunk_connection_pop_request(&treq, tconn) == 0) && treq) {
+		nats_pub_t	*pub = talloc_get_type_abort(treq->preq, nats_pub_t);
+		nats_ack_t	*ack;
+
+		if (h->wbuf_used && ((h->wbuf_used + pub->hdr_len + pub->payload_len + 2) > h->inst->max_batch)) break;
+
+		nats_handle_append(h, pub->hdr, pub->hdr_len);
+		nats_handle_append(h, pub->payload, pub->payload_len);
+		nats_handle_append(h, "\r\n", 2);
+
+		MEM(ack = talloc_zero(h, nats_ack_t));
+		ack->pub = pub;
+		pub->ack = ack;
+		fr_dlist_insert_tail(&h->acks, ack);
+
+		fr_trunk_request_signal_sent(treq);
+	}
+
+	if (nats_handle_flush(h) < 0) {
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	/*
+	 *	Wait for the socket to become
+	 *	writable again.
+	 */
+	if (h->wbuf_used) nats_handle_io_update(h);
+}
+
+/** Process a single reply from the NATS server
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the connection should be closed.
+ */
+static int nats_handle_reply(nats_handle_t *h, char const *line, size_t len)
+{
+	nats_ack_t	*ack;
+	nats_pub_t	*pub;
+	bool		ok;
+
+	if ((len >= 4) && (strncasecmp(line, "PING", 4) == 0)) {
+		nats_handle_append(h, "PONG\r\n", 6);
+		if (nats_handle_flush(h) < 0) return -1;
+
+		if (h->wbuf_used) nats_handle_io_update(h);
+		return 0;
+	}
+
+	if ((len >= 4) && (strncasecmp(line, "PONG", 4) == 0)) return 0;
+	if ((len >= 4) && (strncasecmp(line, "INFO", 4) == 0)) return 0;
+
+	if ((len >= 3) && (strncasecmp(line, "+OK", 3) == 0)) {
+		ok = true;
+	} else if ((len >= 4) && (strncasecmp(line, "-ERR", 4) == 0)) {
+		ok = false;
+		ERROR("%s - NATS server returned error: %.*s", h->inst->name, (int)len, line);
+	} else {
+		ERROR("%s - Unexpected reply from NATS server: %.*s", h->inst->name, (int)len, line);
+		return -1;
+	}
+
+	/*
+	 *	Errors before we're authenticated, or
+	 *	relating to the CONNECT message are fatal.
+	 */
+	if (h->ignore_oks > 0) {
+		h->ignore_oks--;
+		return ok ? 0 : -1;
+	}
+
+	ack = fr_dlist_head(&h->acks);
+	if (!ack) {
+		ERROR("%s - Reply from NATS server doesn't match any publication", h->inst->name);
+		return -1;
+	}
+	fr_dlist_remove(&h->acks, ack);
+
+	pub = ack->pub;
+	talloc_free(ack);
+
+	if (!pub) return 0;	/* Request cancelled */
+
+	pub->ack = NULL;
+	if (ok) {
+		fr_trunk_request_signal_complete(pub->treq);
+	} else {
+		fr_trunk_request_signal_fail(pub->treq);
+	}
+
+	return 0;
+}
+
+/** Read replies from the NATS server, and match them to publications
+ *
+ */
+static void _nats_request_demux(UNUSED fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	nats_handle_t	*h = talloc_get_type_abort(conn->h, nats_handle_t);
+	ssize_t		slen;
+	uint8_t		*p, *end, *eol;
+
+	slen = read(h->fd, h->rbuf + h->rbuf_used, sizeof(h->rbuf) - h->rbuf_used);
+	if (slen == 0) {
+		ERROR("%s - NATS server closed the connection", h->inst->name);
+		goto reconnect;
+	}
+	if (slen < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return;
+
+		ERROR("%s - Failed reading from NATS server: %s", h->inst->name, fr_syserror(errno));
+		goto reconnect;
+	}
+	h->rbuf_used += slen;
+
+	p = h->rbuf;
+	end = h->rbuf + h->rbuf_used;
+
+	while ((eol = memchr(p, '\n', end - p))) {
+		size_t len = eol - p;
+
+		if ((len > 0) && (p[len - 1] == '\r')) len--;
+
+		if (nats_handle_reply(h, (char const *)p, len) < 0) goto reconnect;
+
+		p = eol + 1;
+	}
+
+	if (p == h->rbuf) {
+		if (h->rbuf_used == sizeof(h->rbuf)) {
+			ERROR("%s - Reply from NATS server is too long", h->inst->name);
+			goto reconnect;
+		}
+		return;
+	}
+
+	h->rbuf_used = end - p;
+	if (h->rbuf_used) memmove(h->rbuf, p, h->rbuf_used);
+
+	return;
+
+reconnect:
+	fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+}
+
+/** Detach a publication from its reply slot
+ *
+ * If the publication has already been written, the slot stays where it is
+ * so later replies still match the correct publications.
+ */
+static void _nats_request_cancel(UNUSED fr_connection_t *conn, void *preq,
+				 UNUSED fr_trunk_cancel_reason_t reason, UNUSED void *uctx)
+{
+	nats_pub_t *pub = talloc_get_type_abort(preq, nats_pub_t);
+
+	if (!pub->ack) return;
+
+	pub->ack->pub = NULL;
+	pub->ack = NULL;
+}
+
+static void _nats_request_complete(request_t *request, void *preq, UNUSED void *rctx, UNUSED void *uctx)
+{
+	nats_pub_t *pub = talloc_get_type_abort(preq, nats_pub_t);
+
+	pub->treq = NULL;
+	pub->rcode = RLM_MODULE_OK;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+static void _nats_request_fail(request_t *request, void *preq, UNUSED void *rctx,
+			       UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
+{
+	nats_pub_t *pub = talloc_get_type_abort(preq, nats_pub_t);
+
+	pub->treq = NULL;
+	pub->rcode = RLM_MODULE_FAIL;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+static void _nats_publish_timeout(UNUSED module_ctx_t const *mctx, request_t *request, void *rctx,
+				  UNUSED fr_time_t fired)
+{
+	nats_pub_t *pub = talloc_get_type_abort(rctx, nats_pub_t);
+
+	REDEBUG("Timed out waiting for NATS server to acknowledge publication");
+
+	if (pub->treq) {
+		fr_trunk_request_signal_cancel(pub->treq);
+		pub->treq = NULL;
+	}
+	pub->rcode = RLM_MODULE_FAIL;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+static void mod_publish_signal(UNUSED module_ctx_t const *mctx, UNUSED request_t *request,
+			       void *rctx, fr_state_signal_t action)
+{
+	nats_pub_t *pub = talloc_get_type_abort(rctx, nats_pub_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	if (pub->treq) {
+		fr_trunk_request_signal_cancel(pub->treq);
+		pub->treq = NULL;
+	}
+
+	talloc_free(pub);
+}
+
+static unlang_action_t mod_publish_resume(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx,
+					  request_t *request, void *rctx)
+{
+	nats_pub_t	*pub = talloc_get_type_abort(rctx, nats_pub_t);
+	rlm_rcode_t	rcode = pub->rcode;
+
+	if (rcode == RLM_MODULE_OK) {
+		RDEBUG2("NATS server acknowledged publication");
+	} else {
+		REDEBUG("Failed publishing to NATS server");
+	}
+
+	talloc_free(pub);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+/** Encode the request, and queue it for publication
+ *
+ * Returns fail without waiting if the trunk is at capacity, so that
+ * policy can fall back to another destination.
+ */
+static unlang_action_t CC_HINT(nonnull) mod_publish(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+						    request_t *request)
+{
+	rlm_nats_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_nats_t);
+	rlm_nats_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_nats_thread_t);
+	nats_pub_t		*pub;
+	char			*subject;
+	fr_dbuff_t		dbuff;
+	fr_dbuff_uctx_talloc_t	tctx;
+	ssize_t			slen;
+
+	MEM(pub = talloc_zero(request, nats_pub_t));
+	pub->request = request;
+	pub->rcode = RLM_MODULE_FAIL;
+
+	if (tmpl_aexpand(pub, &subject, request, inst->subject, NULL, NULL) < 0) {
+		RPEDEBUG("Failed expanding subject");
+	error:
+		talloc_free(pub);
+		RETURN_MODULE_FAIL;
+	}
+
+	if ((*subject == '\0') || strpbrk(subject, " \t\r\n")) {
+		REDEBUG("Invalid subject \"%pV\"", fr_box_strvalue_buffer(subject));
+		goto error;
+	}
+
+	MEM(fr_dbuff_init_talloc(pub, &dbuff, &tctx, 1024, inst->max_payload));
+	slen = fr_internal_encode_list(&dbuff, &request->request_pairs, NULL);
+	if (slen < 0) {
+		RPEDEBUG("Failed encoding request, or request exceeds max_payload (%zu bytes)", inst->max_payload);
+		goto error;
+	}
+	pub->payload = fr_dbuff_start(&dbuff);
+	pub->payload_len = fr_dbuff_used(&dbuff);
+
+	MEM(pub->hdr = talloc_asprintf(pub, "PUB %s %zu\r\n", subject, pub->payload_len));
+	pub->hdr_len = talloc_array_length(pub->hdr) - 1;
+	talloc_free(subject);
+
+	switch (fr_trunk_request_enqueue(&pub->treq, t->trunk, request, pub, pub)) {
+	case FR_TRUNK_ENQUEUE_OK:
+	case FR_TRUNK_ENQUEUE_IN_BACKLOG:
+		break;
+
+	case FR_TRUNK_ENQUEUE_NO_CAPACITY:
+		REDEBUG("Publication queue is full, NATS server isn't keeping up");
+		goto error;
+
+	case FR_TRUNK_ENQUEUE_DST_UNAVAILABLE:
+		REDEBUG("No connections to NATS server available");
+		goto error;
+
+	default:
+		REDEBUG("Failed queueing publication");
+		goto error;
+	}
+
+	if (unlang_module_timeout_add(request, _nats_publish_timeout, pub, fr_time() + inst->timeout) < 0) {
+		REDEBUG("Failed adding publication timeout");
+		fr_trunk_request_signal_cancel(pub->treq);
+		goto error;
+	}
+
+	return unlang_module_yield(request, mod_publish_resume, mod_publish_signal, pub);
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_nats_t		*inst = talloc_get_type_abort(instance, rlm_nats_t);
+	rlm_nats_thread_t	*t = talloc_get_type_abort(thread, rlm_nats_thread_t);
+
+	t->inst = inst;
+	t->trunk = fr_trunk_alloc(t, el,
+				  &(fr_trunk_io_funcs_t){
+					.connection_alloc = nats_conn_alloc,
+					.connection_notify = _nats_conn_notify,
+					.request_mux = _nats_request_mux,
+					.request_demux = _nats_request_demux,
+					.request_cancel = _nats_request_cancel,
+					.request_complete = _nats_request_complete,
+					.request_fail = _nats_request_fail
+				  },
+				  &inst->trunk_conf, inst->name, t, false);
+	if (!t->trunk) return -1;
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_nats_thread_t *t = talloc_get_type_abort(thread, rlm_nats_thread_t);
+
+	TALLOC_FREE(t->trunk);
+
+	return 0;
+}
+
+/** Check a credential can be placed in the CONNECT message without escaping
+ *
+ */
+static int nats_credential_check(CONF_SECTION *conf, char const *name, char const *value)
+{
+	if (!value || !strpbrk(value, "\"\\")) return 0;
+
+	cf_log_err(conf, "\"%s\" must not contain '\"' or '\\'", name);
+	return -1;
+}
+
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_nats_t	*inst = talloc_get_type_abort(instance, rlm_nats_t);
+	char		*connect;
+
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	FR_SIZE_BOUND_CHECK("max_payload", inst->max_payload, >=, (size_t)64);
+	FR_SIZE_BOUND_CHECK("max_batch", inst->max_batch, >=, inst->max_payload);
+	FR_TIME_DELTA_BOUND_CHECK("timeout", inst->timeout, >=, fr_time_delta_from_msec(100));
+
+	if ((nats_credential_check(conf, "user", inst->user) < 0) ||
+	    (nats_credential_check(conf, "password", inst->password) < 0)) return -1;
+
+	/*
+	 *	Verbose mode means the server acknowledges
+	 *	every publication.
+	 */
+	MEM(connect = talloc_typed_asprintf(inst, "CONNECT {\"verbose\":true,\"pedantic\":false,"
+					    "\"name\":\"FreeRADIUS\",\"lang\":\"C\",\"version\":\"%s\"",
+					    RADIUSD_VERSION_STRING));
+	if (inst->user) MEM(connect = talloc_asprintf_append_buffer(connect, ",\"user\":\"%s\"", inst->user));
+	if (inst->password) MEM(connect = talloc_asprintf_append_buffer(connect, ",\"pass\":\"%s\"", inst->password));
+	MEM(inst->connect = talloc_asprintf_append_buffer(connect, "}\r\n"));
+
+	return 0;
+}
+
+/*
+ *	Externally visible module definition.
+ */
+extern module_t rlm_nats;
+module_t rlm_nats = {
+	.magic			= RLM_MODULE_INIT,
+	.name			= "nats",
+	.type			= RLM_TYPE_THREAD_SAFE,
+	.inst_size		= sizeof(rlm_nats_t),
+	.thread_inst_size	= sizeof(rlm_nats_thread_t),
+	.config			= module_config,
+	.instantiate		= mod_instantiate,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
+
+	.methods = {
+		[MOD_PREACCT]		= mod_publish,
+		[MOD_ACCOUNTING]	= mod_publish,
+		[MOD_POST_AUTH]		= mod_publish,
+	},
+};
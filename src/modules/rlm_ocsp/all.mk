@@ -0,0 +1,13 @@
+#  Check to see if we libfreeradius-curl, as that's a hard dependency.
+TARGETNAME	:=
+-include $(top_builddir)/src/lib/curl/all.mk
+TARGET		:=
+
+ifneq "$(TARGETNAME)" ""
+ifneq "$(OPENSSL_LIBS)" ""
+TARGET		:= rlm_ocsp.a
+TGT_PREREQS	:= libfreeradius-curl.a libfreeradius-tls.a
+endif
+endif
+
+SOURCES		:= rlm_ocsp.c
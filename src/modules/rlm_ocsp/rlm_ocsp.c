@@ -0,0 +1,828 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_ocsp.c
+ * @brief Check the revocation status of certificates using OCSP.
+ *
+ * Responses are cached, keyed on the issuer and serial number of the
+ * certificate, until the nextUpdate time given by the responder.  Entries
+ * which are used shortly before they expire are refreshed in the background,
+ * so that frequently used entries are rarely fetched while a request waits.
+ *
+ * Responders are queried asynchronously using libcurl.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
+
+#include <freeradius-devel/curl/base.h>
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/module.h>
+#include <freeradius-devel/tls/log.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/rb.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <openssl/ocsp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <pthread.h>
+
+#define OCSP_MAX_SKEW		(5 * 60)	//!< Leeway allowed in response validity periods.
+#define OCSP_MAX_RESPONSE	65536		//!< Largest response we'll accept.
+
+/** A CA whose certificates we check
+ *
+ */
+typedef struct {
+	X509			*cert;			//!< The issuer's certificate.
+	char			*name;			//!< Subject of the issuer, formatted the same
+							///< way as TLS-Cert.Issuer.
+} rlm_ocsp_issuer_t;
+
+/** Cached certificate status
+ *
+ */
+typedef struct {
+	fr_rb_node_t		node;			//!< Entry in the cache.
+	fr_dlist_t		entry;			//!< Entry in the LRU list.
+
+	uint8_t			*key;			//!< Index of the issuer, followed by the serial.
+
+	int			status;			//!< V_OCSP_CERTSTATUS_* value from the responder.
+	time_t			expires;		//!< When the status must be fetched again.
+	bool			refreshing;		//!< Background refresh in progress.
+} rlm_ocsp_entry_t;
+
+typedef struct {
+	char const		*name;			//!< Instance name.
+
+	char const		*url;			//!< Of the OCSP responder.
+	char const		*issuer_file;		//!< Certificates of the CAs we check.
+
+	tmpl_t			*serial;		//!< Serial number of the certificate to check.
+	tmpl_t			*issuer;		//!< Issuer of the certificate to check.
+
+	fr_time_delta_t		timeout;		//!< How long to wait for the responder.
+	bool			softfail;		//!< Don't fail if the responder is unavailable.
+
+	uint32_t		max_entries;		//!< Maximum number of cached responses.
+	fr_time_delta_t		refresh;		//!< Refresh entries used this close to expiring.
+	fr_time_delta_t		default_ttl;		//!< Cache time for responses without nextUpdate.
+	fr_time_delta_t		max_ttl;		//!< Maximum cache time for any response.
+
+	fr_curl_tls_t		tls;			//!< TLS configuration for https responders.
+
+	rlm_ocsp_issuer_t	*issuers;		//!< Array of issuers loaded from issuer_file.
+	STACK_OF(X509)		*issuer_certs;		//!< Issuer certificates, for response verification.
+	X509_STORE		*store;			//!< Trusted to sign responses.
+
+	pthread_mutex_t		mutex;			//!< Protects the cache, and LRU list.
+	fr_rb_tree_t		*cache;			//!< Cached responses.
+	fr_dlist_head_t		lru;			//!< Most recently used entries at the head.
+} rlm_ocsp_t;
+
+typedef struct {
+	rlm_ocsp_t		*inst;			//!< Instance of the module.
+	fr_curl_handle_t	*mhandle;		//!< Thread specific multi handle.
+	fr_dlist_head_t		refreshing;		//!< Background refreshes in progress.
+} rlm_ocsp_thread_t;
+
+/** An OCSP query, for a request, or a background refresh
+ *
+ */
+typedef struct {
+	rlm_ocsp_thread_t	*t;			//!< Thread which made the query.
+	uint8_t			*key;			//!< Of the cache entry to update.
+	OCSP_CERTID		*id;			//!< Of the certificate we're checking.
+
+	uint8_t			*req;			//!< DER encoded OCSP request.
+	struct curl_slist	*headers;		//!< HTTP headers.
+	fr_curl_io_request_t	*randle;		//!< curl handle performing the query.
+
+	uint8_t			*resp;			//!< DER encoded OCSP response.
+	size_t			resp_len;		//!< Length of the response.
+
+	fr_dlist_t		entry;			//!< Entry in the thread's refreshing list.
+} rlm_ocsp_fetch_t;
+
+static const CONF_PARSER module_config[] = {
+	{ FR_CONF_OFFSET("url", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_ocsp_t, url) },
+	{ FR_CONF_OFFSET("issuer_file", FR_TYPE_FILE_INPUT | FR_TYPE_REQUIRED, rlm_ocsp_t, issuer_file) },
+
+	{ FR_CONF_OFFSET("serial", FR_TYPE_TMPL | FR_TYPE_ATTRIBUTE, rlm_ocsp_t, serial),
+	  .dflt = "&parent.session-state.TLS-Cert[0].Serial", .quote = T_BARE_WORD },
+	{ FR_CONF_OFFSET("issuer", FR_TYPE_TMPL | FR_TYPE_ATTRIBUTE, rlm_ocsp_t, issuer),
+	  .dflt = "&parent.session-state.TLS-Cert[0].Issuer", .quote = T_BARE_WORD },
+
+	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, rlm_ocsp_t, timeout), .dflt = "2.0" },
+	{ FR_CONF_OFFSET("softfail", FR_TYPE_BOOL, rlm_ocsp_t, softfail), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_ocsp_t, max_entries), .dflt = "65536" },
+	{ FR_CONF_OFFSET("refresh", FR_TYPE_TIME_DELTA, rlm_ocsp_t, refresh), .dflt = "300" },
+	{ FR_CONF_OFFSET("default_ttl", FR_TYPE_TIME_DELTA, rlm_ocsp_t, default_ttl), .dflt = "3600" },
+	{ FR_CONF_OFFSET("max_ttl", FR_TYPE_TIME_DELTA, rlm_ocsp_t, max_ttl), .dflt = "86400" },
+
+	{ FR_CONF_OFFSET("tls", FR_TYPE_SUBSECTION, rlm_ocsp_t, tls), .subcs = (void const *) fr_curl_tls_config },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static int8_t ocsp_entry_cmp(void const *one, void const *two)
+{
+	rlm_ocsp_entry_t const	*a = one, *b = two;
+	size_t			a_len = talloc_array_length(a->key), b_len = talloc_array_length(b->key);
+	int			ret;
+
+	ret = CMP(a_len, b_len);
+	if (ret != 0) return ret;
+
+	ret = memcmp(a->key, b->key, a_len);
+	return CMP(ret, 0);
+}
+
+/** Build the key for a cache entry
+ *
+ */
+static uint8_t *ocsp_key_alloc(TALLOC_CTX *ctx, rlm_ocsp_t const *inst, rlm_ocsp_issuer_t const *issuer,
+			       uint8_t const *serial, size_t serial_len)
+{
+	uint8_t		*key;
+	uint32_t	idx = issuer - inst->issuers;
+
+	MEM(key = talloc_array(ctx, uint8_t, sizeof(idx) + serial_len));
+	memcpy(key, &idx, sizeof(idx));
+	memcpy(key + sizeof(idx), serial, serial_len);
+
+	return key;
+}
+
+/** Find the issuer for a certificate
+ *
+ */
+static rlm_ocsp_issuer_t const *ocsp_issuer_find(rlm_ocsp_t const *inst, char const *name)
+{
+	size_t i;
+
+	for (i = 0; i < talloc_array_length(inst->issuers); i++) {
+		if (strcmp(inst->issuers[i].name, name) == 0) return &inst->issuers[i];
+	}
+
+	return NULL;
+}
+
+/** Remove an entry from the cache
+ *
+ * @note Must be called with the mutex held.
+ */
+static void ocsp_cache_remove(rlm_ocsp_t *inst, rlm_ocsp_entry_t *entry)
+{
+	fr_dlist_remove(&inst->lru, entry);
+	fr_rb_remove(inst->cache, entry);
+	talloc_free(entry);
+}
+
+/** Lookup the status of a certificate in the cache
+ *
+ * @param[out] status	of the certificate.
+ * @param[out] refresh	true if the caller should refresh the entry.
+ * @param[in] inst	of rlm_ocsp.
+ * @param[in] key	of the entry.
+ * @return
+ *	- true if a status was found.
+ *	- false if a status was not found.
+ */
+static bool ocsp_cache_find(int *status, bool *refresh, rlm_ocsp_t *inst, uint8_t *key)
+{
+	rlm_ocsp_entry_t	*entry;
+	time_t			now = time(NULL);
+
+	*refresh = false;
+
+	pthread_mutex_lock(&inst->mutex);
+	entry = fr_rb_find(inst->cache, &(rlm_ocsp_entry_t){ .key = key });
+	if (!entry) {
+	notfound:
+		pthread_mutex_unlock(&inst->mutex);
+		return false;
+	}
+
+	if (entry->expires <= now) {
+		ocsp_cache_remove(inst, entry);
+		goto notfound;
+	}
+
+	*status = entry->status;
+
+	/*
+	 *	Only one thread refreshes the entry, the
+	 *	others continue using the cached status.
+	 */
+	if (!entry->refreshing && ((entry->expires - now) <= fr_time_delta_to_sec(inst->refresh))) {
+		entry->refreshing = true;
+		*refresh = true;
+	}
+
+	fr_dlist_remove(&inst->lru, entry);
+	fr_dlist_insert_head(&inst->lru, entry);
+	pthread_mutex_unlock(&inst->mutex);
+
+	return true;
+}
+
+/** Add or update the status of a certificate in the cache
+ *
+ * @param[in] inst	of rlm_ocsp.
+ * @param[in] key	of the entry.
+ * @param[in] status	to store.  If < 0 the entry is not updated, but
+ *			any refresh in progress is marked as complete.
+ * @param[in] expires	when the status must be fetched again.
+ */
+static void ocsp_cache_update(rlm_ocsp_t *inst, uint8_t const *key, int status, time_t expires)
+{
+	rlm_ocsp_entry_t	*entry;
+
+	pthread_mutex_lock(&inst->mutex);
+	entry = fr_rb_find(inst->cache, &(rlm_ocsp_entry_t){ .key = UNCONST(uint8_t *, key) });
+	if (entry) {
+		entry->refreshing = false;
+		if (status < 0) goto done;
+
+		entry->status = status;
+		entry->expires = expires;
+		goto done;
+	}
+
+	if (status < 0) goto done;
+
+	/*
+	 *	Entries aren't parented by the instance,
+	 *	as they're allocated by multiple threads.
+	 */
+	MEM(entry = talloc_zero(NULL, rlm_ocsp_entry_t));
+	MEM(entry->key = talloc_memdup(entry, key, talloc_array_length(key)));
+	entry->status = status;
+	entry->expires = expires;
+
+	fr_rb_insert(inst->cache, entry);
+	fr_dlist_insert_head(&inst->lru, entry);
+
+	if (fr_rb_num_elements(inst->cache) > inst->max_entries) {
+		ocsp_cache_remove(inst, fr_dlist_tail(&inst->lru));
+	}
+
+done:
+	pthread_mutex_unlock(&inst->mutex);
+}
+
+/** Accumulate the response from the responder
+ *
+ */
+static size_t ocsp_response_write(void *ptr, size_t size, size_t nmemb, void *uctx)
+{
+	rlm_ocsp_fetch_t	*fetch = talloc_get_type_abort(uctx, rlm_ocsp_fetch_t);
+	size_t			len = size * nmemb;
+
+	if ((fetch->resp_len + len) > OCSP_MAX_RESPONSE) return 0;	/* Aborts the transfer */
+
+	MEM(fetch->resp = talloc_realloc(fetch, fetch->resp, uint8_t, fetch->resp_len + len));
+	memcpy(fetch->resp + fetch->resp_len, ptr, len);
+	fetch->resp_len += len;
+
+	return len;
+}
+
+/** Parse and verify the response from the responder
+ *
+ * @param[out] status	of the certificate.
+ * @param[out] expires	when the status must be fetched again.
+ * @param[in] request	The current request.  May be NULL for background refreshes.
+ * @param[in] fetch	containing the response.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the response was invalid.
+ */
+static int ocsp_response_parse(int *status, time_t *expires, request_t *request, rlm_ocsp_fetch_t *fetch)
+{
+	rlm_ocsp_t const		*inst = fetch->t->inst;
+	uint8_t const			*p = fetch->resp;
+	OCSP_RESPONSE			*resp;
+	OCSP_BASICRESP			*basic = NULL;
+	ASN1_GENERALIZEDTIME		*this_update, *next_update;
+	int				reason, ret = -1;
+	int				days, secs;
+	int64_t				ttl;
+	long				code = 0;
+
+	if (fetch->randle->result != CURLE_OK) return -1;
+
+	curl_easy_getinfo(fetch->randle->candle, CURLINFO_RESPONSE_CODE, &code);
+	if (code != 200) {
+		ROPTIONAL(REDEBUG, ERROR, "OCSP responder returned HTTP status %li", code);
+		return -1;
+	}
+
+	resp = d2i_OCSP_RESPONSE(NULL, &p, fetch->resp_len);
+	if (!resp) {
+		fr_tls_log_error(request, "Failed parsing OCSP response");
+		return -1;
+	}
+
+	if (OCSP_response_status(resp) != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
+		ROPTIONAL(REDEBUG, ERROR, "OCSP responder returned error: %s",
+			  OCSP_response_status_str(OCSP_response_status(resp)));
+		goto done;
+	}
+
+	basic = OCSP_response_get1_basic(resp);
+	if (!basic) {
+		fr_tls_log_error(request, "Failed parsing OCSP response");
+		goto done;
+	}
+
+	if (OCSP_basic_verify(basic, inst->issuer_certs, inst->store, 0) <= 0) {
+		fr_tls_log_error(request, "OCSP response signature is invalid");
+		goto done;
+	}
+
+	if (OCSP_resp_find_status(basic, fetch->id, status, &reason, NULL, &this_update, &next_update) != 1) {
+		ROPTIONAL(REDEBUG, ERROR, "OCSP response did not contain the status of the certificate");
+		goto done;
+	}
+
+	if (OCSP_check_validity(this_update, next_update, OCSP_MAX_SKEW, -1) != 1) {
+		fr_tls_log_error(request, "OCSP response has expired");
+		goto done;
+	}
+
+	/*
+	 *	Keep the status until the responder says
+	 *	it'll have new information.
+	 */
+	ttl = fr_time_delta_to_sec(inst->default_ttl);
+	if (next_update && ASN1_TIME_diff(&days, &secs, NULL, next_update)) ttl = ((int64_t)days * 86400) + secs;
+	if (ttl > fr_time_delta_to_sec(inst->max_ttl)) ttl = fr_time_delta_to_sec(inst->max_ttl);
+	if (ttl < 0) ttl = 0;
+
+	*expires = time(NULL) + ttl;
+	ret = 0;
+
+done:
+	OCSP_BASICRESP_free(basic);
+	OCSP_RESPONSE_free(resp);
+
+	return ret;
+}
+
+static int _ocsp_fetch_free(rlm_ocsp_fetch_t *fetch)
+{
+	/*
+	 *	Ensure the easy handle is freed before we
+	 *	free the headers it references.
+	 */
+	TALLOC_FREE(fetch->randle);
+	if (fetch->headers) curl_slist_free_all(fetch->headers);
+	OCSP_CERTID_free(fetch->id);
+
+	return 0;
+}
+
+/** Create an OCSP query for a certificate
+ *
+ * @param[in] ctx		to allocate the query in.
+ * @param[in] request		The current request.  May be NULL.
+ * @param[in] t			Thread specific data.
+ * @param[in] issuer		of the certificate.
+ * @param[in] serial		of the certificate.
+ * @param[in] serial_len	Length of the serial.
+ * @return
+ *	- A new query.
+ *	- NULL on error.
+ */
+static rlm_ocsp_fetch_t *ocsp_fetch_alloc(TALLOC_CTX *ctx, request_t *request, rlm_ocsp_thread_t *t,
+					  rlm_ocsp_issuer_t const *issuer, uint8_t const *serial, size_t serial_len)
+{
+	rlm_ocsp_t const	*inst = t->inst;
+	rlm_ocsp_fetch_t	*fetch;
+	fr_curl_io_request_t	*randle;
+	OCSP_REQUEST		*req;
+	ASN1_INTEGER		*asn1_serial;
+	BIGNUM			*bn;
+	uint8_t			*p;
+	int			len;
+
+	MEM(fetch = talloc_zero(ctx, rlm_ocsp_fetch_t));
+	talloc_set_destructor(fetch, _ocsp_fetch_free);
+	fetch->t = t;
+	fetch->key = ocsp_key_alloc(fetch, inst, issuer, serial, serial_len);
+
+	bn = BN_bin2bn(serial, serial_len, NULL);
+	if (!bn) {
+	tls_error:
+		fr_tls_log_error(request, "Failed creating OCSP request");
+	error:
+		talloc_free(fetch);
+		return NULL;
+	}
+	asn1_serial = BN_to_ASN1_INTEGER(bn, NULL);
+	BN_free(bn);
+	if (!asn1_serial) goto tls_error;
+
+	fetch->id = OCSP_cert_id_new(EVP_sha1(), X509_get_subject_name(issuer->cert),
+				     X509_get0_pubkey_bitstr(issuer->cert), asn1_serial);
+	ASN1_INTEGER_free(asn1_serial);
+	if (!fetch->id) goto tls_error;
+
+	/*
+	 *	No nonce, the response is cached, and may be
+	 *	used for many authentications.
+	 */
+	req = OCSP_REQUEST_new();
+	if (!req) goto tls_error;
+	if (!OCSP_request_add0_id(req, OCSP_CERTID_dup(fetch->id))) {
+		OCSP_REQUEST_free(req);
+		goto tls_error;
+	}
+
+	len = i2d_OCSP_REQUEST(req, NULL);
+	if (len <= 0) {
+		OCSP_REQUEST_free(req);
+		goto tls_error;
+	}
+	MEM(fetch->req = p = talloc_array(fetch, uint8_t, len));
+	i2d_OCSP_REQUEST(req, &p);
+	OCSP_REQUEST_free(req);
+
+	MEM(fetch->headers = curl_slist_append(NULL, "Content-Type: application/ocsp-request"));
+
+	randle = fetch->randle = fr_curl_io_request_alloc(fetch);
+	if (!randle) {
+		ROPTIONAL(REDEBUG, ERROR, "Failed allocating curl handle");
+		goto error;
+	}
+	randle->uctx = fetch;
+
+	FR_CURL_ROPTIONAL_SET_OPTION(CURLOPT_URL, inst->url);
+	FR_CURL_ROPTIONAL_SET_OPTION(CURLOPT_PROTOCOLS, (long)(CURLPROTO_HTTP | CURLPROTO_HTTPS));
+	FR_CURL_ROPTIONAL_SET_OPTION(CURLOPT_NOSIGNAL, 1L);
+	FR_CURL_ROPTIONAL_SET_OPTION(CURLOPT_TIMEOUT_MS, (long)fr_time_delta_to_msec(inst->timeout));
+	FR_CURL_ROPTIONAL_SET_OPTION(CURLOPT_POST, 1L);
+	FR_CURL_ROPTIONAL_SET_OPTION(CURLOPT_POSTFIELDS, fetch->req);
+	FR_CURL_ROPTIONAL_SET_OPTION(CURLOPT_POSTFIELDSIZE, (long)len);
+	FR_CURL_ROPTIONAL_SET_OPTION(CURLOPT_HTTPHEADER, fetch->headers);
+	FR_CURL_ROPTIONAL_SET_OPTION(CURLOPT_WRITEFUNCTION, ocsp_response_write);
+	FR_CURL_ROPTIONAL_SET_OPTION(CURLOPT_WRITEDATA, fetch);
+
+	if (fr_curl_easy_tls_init(randle, &inst->tls) < 0) goto error;
+
+	return fetch;
+}
+
+/** A background refresh completed
+ *
+ */
+static void ocsp_refresh_complete(fr_curl_io_request_t *randle)
+{
+	rlm_ocsp_fetch_t	*fetch = talloc_get_type_abort(randle->uctx, rlm_ocsp_fetch_t);
+	int			status;
+	time_t			expires = 0;
+
+	fr_dlist_remove(&fetch->t->refreshing, fetch);
+
+	if (ocsp_response_parse(&status, &expires, NULL, fetch) < 0) {
+		WARN("%s - Failed refreshing OCSP status, using cached status until it expires",
+		     fetch->t->inst->name);
+		status = -1;
+	}
+	ocsp_cache_update(fetch->t->inst, fetch->key, status, expires);
+
+	talloc_free(fetch);
+}
+
+/** Refresh a cache entry, without delaying the current request
+ *
+ */
+static void ocsp_refresh(request_t *request, rlm_ocsp_thread_t *t, rlm_ocsp_issuer_t const *issuer,
+			 uint8_t const *serial, size_t serial_len, uint8_t const *key)
+{
+	rlm_ocsp_fetch_t	*fetch;
+
+	RDEBUG2("OCSP status expires soon, refreshing");
+
+	fetch = ocsp_fetch_alloc(t, NULL, t, issuer, serial, serial_len);
+	if (!fetch) {
+	error:
+		ocsp_cache_update(t->inst, key, -1, 0);
+		return;
+	}
+
+	if (fr_curl_io_background_enqueue(t->mhandle, fetch->randle, ocsp_refresh_complete) < 0) {
+		talloc_free(fetch);
+		goto error;
+	}
+	fr_dlist_insert_tail(&t->refreshing, fetch);
+}
+
+/** Convert a certificate status to an rcode
+ *
+ */
+static unlang_action_t ocsp_status_rcode(rlm_rcode_t *p_result, rlm_ocsp_t const *inst, request_t *request, int status)
+{
+	switch (status) {
+	case V_OCSP_CERTSTATUS_GOOD:
+		RDEBUG2("Certificate is valid");
+		RETURN_MODULE_OK;
+
+	case V_OCSP_CERTSTATUS_REVOKED:
+		REDEBUG("Certificate has been revoked");
+		RETURN_MODULE_REJECT;
+
+	default:
+		if (inst->softfail) {
+			RWDEBUG("Certificate status is unknown, allowing because softfail = yes");
+			RETURN_MODULE_NOOP;
+		}
+		REDEBUG("Certificate status is unknown");
+		RETURN_MODULE_REJECT;
+	}
+}
+
+/** The responder failed to provide a status
+ *
+ */
+static unlang_action_t ocsp_fail(rlm_rcode_t *p_result, rlm_ocsp_t const *inst, request_t *request)
+{
+	if (inst->softfail) {
+		RWDEBUG("Failed checking OCSP status, allowing because softfail = yes");
+		RETURN_MODULE_NOOP;
+	}
+
+	REDEBUG("Failed checking OCSP status");
+	RETURN_MODULE_FAIL;
+}
+
+static unlang_action_t mod_verify_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					 request_t *request, void *rctx)
+{
+	rlm_ocsp_t		*inst = talloc_get_type_abort(mctx->instance, rlm_ocsp_t);
+	rlm_ocsp_fetch_t	*fetch = talloc_get_type_abort(rctx, rlm_ocsp_fetch_t);
+	int			status;
+	time_t			expires;
+
+	if (ocsp_response_parse(&status, &expires, request, fetch) < 0) {
+		talloc_free(fetch);
+		return ocsp_fail(p_result, inst, request);
+	}
+
+	ocsp_cache_update(inst, fetch->key, status, expires);
+	talloc_free(fetch);
+
+	return ocsp_status_rcode(p_result, inst, request, status);
+}
+
+static void mod_verify_signal(module_ctx_t const *mctx, request_t *request, void *rctx, fr_state_signal_t action)
+{
+	rlm_ocsp_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_ocsp_thread_t);
+	rlm_ocsp_fetch_t	*fetch = talloc_get_type_abort(rctx, rlm_ocsp_fetch_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	RDEBUG2("Cancelling OCSP query");
+
+	curl_multi_remove_handle(t->mhandle->mandle, fetch->randle->candle);
+	t->mhandle->transfers--;
+
+	talloc_free(fetch);
+}
+
+/** Check the status of the certificate
+ *
+ */
+static unlang_action_t CC_HINT(nonnull) mod_verify(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_ocsp_t			*inst = talloc_get_type_abort(mctx->instance, rlm_ocsp_t);
+	rlm_ocsp_thread_t		*t = talloc_get_type_abort(mctx->thread, rlm_ocsp_thread_t);
+	fr_pair_t			*serial, *issuer_name;
+	rlm_ocsp_issuer_t const		*issuer;
+	rlm_ocsp_fetch_t		*fetch;
+	uint8_t				*key;
+	int				status;
+	bool				refresh;
+
+	if ((tmpl_find_vp(&serial, request, inst->serial) < 0) || (serial->vp_type != FR_TYPE_OCTETS)) {
+		RDEBUG2("No certificate serial found, not checking OCSP status");
+		RETURN_MODULE_NOOP;
+	}
+
+	if ((tmpl_find_vp(&issuer_name, request, inst->issuer) < 0) || (issuer_name->vp_type != FR_TYPE_STRING)) {
+		RDEBUG2("No certificate issuer found, not checking OCSP status");
+		RETURN_MODULE_NOOP;
+	}
+
+	issuer = ocsp_issuer_find(inst, issuer_name->vp_strvalue);
+	if (!issuer) {
+		RDEBUG2("Issuer \"%pV\" not found in issuer_file, not checking OCSP status", &issuer_name->data);
+		RETURN_MODULE_NOOP;
+	}
+
+	key = ocsp_key_alloc(request, inst, issuer, serial->vp_octets, serial->vp_length);
+	if (ocsp_cache_find(&status, &refresh, inst, key)) {
+		RDEBUG2("Found cached OCSP status");
+		if (refresh) ocsp_refresh(request, t, issuer, serial->vp_octets, serial->vp_length, key);
+		talloc_free(key);
+
+		return ocsp_status_rcode(p_result, inst, request, status);
+	}
+	talloc_free(key);
+
+	RDEBUG2("Querying OCSP responder %s", inst->url);
+
+	fetch = ocsp_fetch_alloc(request, request, t, issuer, serial->vp_octets, serial->vp_length);
+	if (!fetch) return ocsp_fail(p_result, inst, request);
+
+	if (fr_curl_io_request_enqueue(t->mhandle, request, fetch->randle) < 0) {
+		talloc_free(fetch);
+		return ocsp_fail(p_result, inst, request);
+	}
+
+	return unlang_module_yield(request, mod_verify_resume, mod_verify_signal, fetch);
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_ocsp_thread_t	*t = talloc_get_type_abort(thread, rlm_ocsp_thread_t);
+
+	t->inst = talloc_get_type_abort(instance, rlm_ocsp_t);
+	fr_dlist_talloc_init(&t->refreshing, rlm_ocsp_fetch_t, entry);
+
+	t->mhandle = fr_curl_io_init(t, el, false);
+	if (!t->mhandle) return -1;
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_ocsp_thread_t	*t = talloc_get_type_abort(thread, rlm_ocsp_thread_t);
+	rlm_ocsp_fetch_t	*fetch;
+
+	/*
+	 *	Abandon any refreshes in progress, the entries
+	 *	will be refreshed by another thread, or expire.
+	 */
+	while ((fetch = fr_dlist_head(&t->refreshing))) {
+		fr_dlist_remove(&t->refreshing, fetch);
+		curl_multi_remove_handle(t->mhandle->mandle, fetch->randle->candle);
+		ocsp_cache_update(t->inst, fetch->key, -1, 0);
+		talloc_free(fetch);
+	}
+	talloc_free(t->mhandle);
+
+	return 0;
+}
+
+/** Load the certificates of the CAs whose certificates we check
+ *
+ */
+static int ocsp_issuers_load(rlm_ocsp_t *inst, CONF_SECTION *conf)
+{
+	FILE		*fp;
+	X509		*cert;
+	BIO		*bio;
+	size_t		num = 0;
+
+	fp = fopen(inst->issuer_file, "r");
+	if (!fp) {
+		cf_log_err(conf, "Failed opening issuer_file \"%s\": %s", inst->issuer_file, fr_syserror(errno));
+		return -1;
+	}
+
+	MEM(inst->issuer_certs = sk_X509_new_null());
+	MEM(inst->store = X509_STORE_new());
+	MEM(bio = BIO_new(BIO_s_mem()));
+
+	while ((cert = PEM_read_X509(fp, NULL, NULL, NULL))) {
+		rlm_ocsp_issuer_t	*issuer;
+		char			*data;
+		long			len;
+
+		MEM(inst->issuers = talloc_realloc(inst, inst->issuers, rlm_ocsp_issuer_t, num + 1));
+		issuer = &inst->issuers[num++];
+		issuer->cert = cert;
+
+		/*
+		 *	Same format as TLS-Cert.Issuer
+		 */
+		(void) BIO_reset(bio);
+		X509_NAME_print_ex(bio, X509_get_subject_name(cert), 0, XN_FLAG_ONELINE);
+		len = BIO_get_mem_data(bio, &data);
+		MEM(issuer->name = talloc_bstrndup(inst, data, len));
+
+		X509_up_ref(cert);
+		sk_X509_push(inst->issuer_certs, cert);
+		X509_STORE_add_cert(inst->store, cert);
+	}
+	ERR_clear_error();	/* PEM_read_X509 errors at EOF */
+	BIO_free(bio);
+	fclose(fp);
+
+	if (!num) {
+		cf_log_err(conf, "No certificates found in issuer_file \"%s\"", inst->issuer_file);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_ocsp_t	*inst = talloc_get_type_abort(instance, rlm_ocsp_t);
+
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	FR_INTEGER_BOUND_CHECK("max_entries", inst->max_entries, >=, 16);
+	FR_TIME_DELTA_BOUND_CHECK("timeout", inst->timeout, >=, fr_time_delta_from_msec(100));
+	FR_TIME_DELTA_BOUND_CHECK("max_ttl", inst->max_ttl, >=, fr_time_delta_from_sec(1));
+	FR_TIME_DELTA_BOUND_CHECK("default_ttl", inst->default_ttl, <=, inst->max_ttl);
+
+	if (ocsp_issuers_load(inst, conf) < 0) return -1;
+
+	pthread_mutex_init(&inst->mutex, NULL);
+	MEM(inst->cache = fr_rb_inline_talloc_alloc(inst, rlm_ocsp_entry_t, node, ocsp_entry_cmp, NULL));
+	fr_dlist_init(&inst->lru, rlm_ocsp_entry_t, entry);
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_ocsp_t		*inst = talloc_get_type_abort(instance, rlm_ocsp_t);
+	rlm_ocsp_entry_t	*entry;
+	size_t			i;
+
+	if (inst->cache) {
+		while ((entry = fr_dlist_head(&inst->lru))) ocsp_cache_remove(inst, entry);
+		pthread_mutex_destroy(&inst->mutex);
+	}
+
+	for (i = 0; i < talloc_array_length(inst->issuers); i++) X509_free(inst->issuers[i].cert);
+	if (inst->issuer_certs) sk_X509_pop_free(inst->issuer_certs, X509_free);
+	if (inst->store) X509_STORE_free(inst->store);
+
+	return 0;
+}
+
+static int mod_load(void)
+{
+	if (fr_curl_init() < 0) return -1;
+
+	return 0;
+}
+
+static void mod_unload(void)
+{
+	fr_curl_free();
+}
+
+/*
+ *	The module name should be the only globally exported symbol.
+ *	That is, everything else should be 'static'.
+ */
+extern module_t rlm_ocsp;
+module_t rlm_ocsp = {
+	.magic			= RLM_MODULE_INIT,
+	.name			= "ocsp",
+	.type			= RLM_TYPE_THREAD_SAFE,
+	.inst_size		= sizeof(rlm_ocsp_t),
+	.thread_inst_size	= sizeof(rlm_ocsp_thread_t),
+	.config			= module_config,
+	.onload			= mod_load,
+	.unload			= mod_unload,
+	.instantiate		= mod_instantiate,
+	.detach			= mod_detach,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
+	.methods = {
+		[MOD_AUTHORIZE]		= mod_verify,
+	},
+};
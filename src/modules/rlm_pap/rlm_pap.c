@@ -31,16 +31,20 @@ USES_APPLE_DEPRECATED_API
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/password.h>
 #include <freeradius-devel/tls/base.h>
+#include <freeradius-devel/unlang/base.h>
 
 #include <freeradius-devel/util/base64.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/base16.h>
 #include <freeradius-devel/util/md5.h>
+#include <freeradius-devel/util/rb.h>
 #include <freeradius-devel/util/sha1.h>
+#include <freeradius-devel/util/thread_pool.h>
 
 #include <freeradius-devel/protocol/freeradius/freeradius.internal.password.h>
 
 #include <ctype.h>
+#include <pthread.h>
 
 #ifdef HAVE_OPENSSL_EVP_H
 #  include <openssl/evp.h>
@@ -57,12 +61,61 @@ typedef struct {
 	char const		*name;
 	fr_dict_enum_t		*auth_type;
 	bool			normify;
+
+	uint32_t		threads;	//!< Number of threads computing expensive hashes.
+	uint32_t		max_queued;	//!< Maximum number of hashes waiting for a thread.
+	fr_thread_pool_t	*pool;		//!< Threads computing expensive hashes.
+
+	struct {
+		bool			enable;		//!< Whether verified passwords are cached.
+		uint32_t		max_entries;	//!< Maximum number of cached passwords.
+		fr_time_delta_t		lifetime;	//!< How long a password is cached for.
+
+		uint8_t			secret[32];	//!< Random key for the HMAC of cached passwords.
+
+		pthread_mutex_t		mutex;		//!< Protects the tree, LRU list and counters.
+		fr_rb_tree_t		*tree;		//!< Cached passwords.
+		fr_dlist_head_t		lru;		//!< Most recently used entries at the head.
+		uint64_t		hits;		//!< Expensive hashes which weren't computed.
+		uint64_t		misses;		//!< Expensive hashes which were computed.
+	} cache;
 } rlm_pap_t;
 
-typedef unlang_action_t (*pap_auth_func_t)(rlm_rcode_t *p_result, rlm_pap_t const *inst, request_t *request, fr_pair_t const *, fr_pair_t const *);
+/** A password which was recently verified using an expensive hash
+ *
+ * Only the HMAC of the "known good" password and the password is
+ * stored, so the cache can't be used to recover passwords.
+ */
+typedef struct {
+	uint8_t			key[SHA1_DIGEST_LENGTH];	//!< HMAC of the "known good" password and password.
+	fr_time_t		expires;	//!< When the entry must no longer be used.
+	fr_rb_node_t		node;		//!< Entry in the cache.
+	fr_dlist_t		entry;		//!< Entry in the LRU list.
+} pap_cache_entry_t;
+
+typedef struct {
+	fr_thread_pool_client_t	*client;	//!< For submitting hashes to the thread pool.
+} rlm_pap_thread_t;
+
+typedef unlang_action_t (*pap_auth_func_t)(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request, fr_pair_t const *, fr_pair_t const *);
+
+static const CONF_PARSER thread_pool_config[] = {
+	{ FR_CONF_OFFSET("threads", FR_TYPE_UINT32, rlm_pap_t, threads), .dflt = "4" },
+	{ FR_CONF_OFFSET("max_queued", FR_TYPE_UINT32, rlm_pap_t, max_queued), .dflt = "1024" },
+	CONF_PARSER_TERMINATOR
+};
+
+static const CONF_PARSER cache_config[] = {
+	{ FR_CONF_OFFSET("enable", FR_TYPE_BOOL, rlm_pap_t, cache.enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_pap_t, cache.max_entries), .dflt = "16384" },
+	{ FR_CONF_OFFSET("lifetime", FR_TYPE_TIME_DELTA, rlm_pap_t, cache.lifetime), .dflt = "600" },
+	CONF_PARSER_TERMINATOR
+};
 
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("normalise", FR_TYPE_BOOL, rlm_pap_t, normify), .dflt = "yes" },
+	{ FR_CONF_POINTER("thread_pool", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) thread_pool_config },
+	{ FR_CONF_POINTER("cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) cache_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -148,12 +201,298 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 	RETURN_MODULE_UPDATED;
 }
 
+/** Log the result of comparing the password with the "known good" password
+ *
+ */
+static unlang_action_t pap_auth_rcode(rlm_rcode_t *p_result, request_t *request, rlm_rcode_t rcode)
+{
+	switch (rcode) {
+	case RLM_MODULE_REJECT:
+		REDEBUG("Password incorrect");
+		break;
+
+	case RLM_MODULE_OK:
+		RDEBUG2("User authenticated successfully");
+		break;
+
+	default:
+		break;
+	}
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+#if defined(HAVE_CRYPT) || defined(HAVE_OPENSSL_EVP_H)
+typedef struct pap_hash_s pap_hash_t;
+
+/** Compute an expensive hash, either in a thread pool thread or inline
+ *
+ * Must only access the fields of the #pap_hash_t.
+ */
+typedef void (*pap_hash_run_t)(pap_hash_t *ph);
+
+/** Compare a computed hash with the "known good" hash
+ *
+ */
+typedef unlang_action_t (*pap_hash_check_t)(rlm_rcode_t *p_result, request_t *request, pap_hash_t const *ph);
+
+/** An expensive hash, which is computed by the thread pool if there is one
+ *
+ * Everything needed to compute the hash is copied here, as the
+ * request may be cancelled while the hash is being computed.
+ */
+struct pap_hash_s {
+	request_t		*request;	//!< To resume.  Not touched by the thread pool.
+	fr_thread_pool_job_t	*job;		//!< Computing the hash, NULL once it's done.
+
+	pap_hash_run_t		run;		//!< Computes the hash.
+	pap_hash_check_t	check;		//!< Checks the result.
+
+	fr_time_delta_t		wait;		//!< How long the hash was queued for.
+	fr_time_delta_t		run_time;	//!< How long the hash took to compute.
+
+	bool			cacheable;	//!< Whether cache_key has been set.
+	uint8_t			cache_key[SHA1_DIGEST_LENGTH];	//!< Identifies the password in the cache.
+
+	char			*password;	//!< Copy of the User-Password.
+	size_t			password_len;	//!< Length of the User-Password.
+
+	union {
+#ifdef HAVE_CRYPT
+		struct {
+			char		*known_good;	//!< Copy of the Password.Crypt.
+			int		ret;		//!< What fr_crypt_check returned.
+		} crypt;
+#endif
+
+#ifdef HAVE_OPENSSL_EVP_H
+		struct {
+			EVP_MD const	*md;		//!< HMAC digest.
+			uint32_t	iterations;	//!< Number of iterations.
+			uint8_t		*salt;		//!< Decoded salt.
+			size_t		salt_len;	//!< Length of the salt.
+			size_t		digest_len;	//!< Length of the known good and computed digests.
+			uint8_t		known_good[EVP_MAX_MD_SIZE];	//!< Decoded hash component.
+			uint8_t		digest[EVP_MAX_MD_SIZE];	//!< What we computed.
+			bool		failed;		//!< Computing the digest failed.
+		} pbkdf2;
+#endif
+	};
+};
+
+/** Check whether a password was recently verified
+ *
+ */
+static bool pap_cache_find(rlm_pap_t *inst, uint8_t const key[static SHA1_DIGEST_LENGTH])
+{
+	pap_cache_entry_t	*entry, find;
+
+	memcpy(find.key, key, sizeof(find.key));
+
+	pthread_mutex_lock(&inst->cache.mutex);
+	entry = fr_rb_find(inst->cache.tree, &find);
+	if (entry && (entry->expires <= fr_time())) {
+		fr_dlist_remove(&inst->cache.lru, entry);
+		fr_rb_remove(inst->cache.tree, entry);
+		talloc_free(entry);
+		entry = NULL;
+	}
+
+	if (!entry) {
+		inst->cache.misses++;
+		pthread_mutex_unlock(&inst->cache.mutex);
+		return false;
+	}
+
+	inst->cache.hits++;
+	fr_dlist_remove(&inst->cache.lru, entry);
+	fr_dlist_insert_head(&inst->cache.lru, entry);
+	pthread_mutex_unlock(&inst->cache.mutex);
+
+	return true;
+}
+
+/** Record that a password was verified
+ *
+ * The lifetime of existing entries isn't extended, so passwords must
+ * be verified with the expensive hash at least once per lifetime.
+ */
+static void pap_cache_insert(rlm_pap_t *inst, uint8_t const key[static SHA1_DIGEST_LENGTH])
+{
+	pap_cache_entry_t	*entry;
+
+	/*
+	 *	Entries aren't parented by the instance,
+	 *	as they're allocated by multiple threads.
+	 */
+	MEM(entry = talloc_zero(NULL, pap_cache_entry_t));
+	memcpy(entry->key, key, sizeof(entry->key));
+	entry->expires = fr_time() + inst->cache.lifetime;
+
+	pthread_mutex_lock(&inst->cache.mutex);
+	if (!fr_rb_insert(inst->cache.tree, entry)) {
+		pthread_mutex_unlock(&inst->cache.mutex);
+		talloc_free(entry);
+		return;
+	}
+	fr_dlist_insert_head(&inst->cache.lru, entry);
+
+	if (fr_rb_num_elements(inst->cache.tree) > inst->cache.max_entries) {
+		pap_cache_entry_t *oldest = fr_dlist_pop_tail(&inst->cache.lru);
+
+		fr_rb_remove(inst->cache.tree, oldest);
+		talloc_free(oldest);
+	}
+	pthread_mutex_unlock(&inst->cache.mutex);
+}
+
+/** Allocate a new expensive hash
+ *
+ * Isn't parented by the request, as the thread pool takes ownership
+ * of it while the hash is being computed.
+ *
+ * @param[in] mctx		Module calling ctx.
+ * @param[in] request		The current request.
+ * @param[in] known_good	The "known good" password, used to identify
+ *				the password in the cache.
+ * @param[in] known_good_len	Length of the "known good" password.
+ * @param[in] password		to validate.
+ * @param[in] run		Computes the hash.
+ * @param[in] check		Checks the result.
+ */
+static pap_hash_t *pap_hash_alloc(module_ctx_t const *mctx, request_t *request,
+				  uint8_t const *known_good, size_t known_good_len, fr_pair_t const *password,
+				  pap_hash_run_t run, pap_hash_check_t check)
+{
+	rlm_pap_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_pap_t);
+	pap_hash_t	*ph;
+
+	MEM(ph = talloc_zero(NULL, pap_hash_t));
+	ph->request = request;
+	ph->run = run;
+	ph->check = check;
+	MEM(ph->password = talloc_bstrndup(ph, password->vp_strvalue, password->vp_length));
+	ph->password_len = password->vp_length;
+
+	/*
+	 *	Keying the HMAC of the password with an HMAC
+	 *	of the "known good" password means the entry
+	 *	is no longer found if the user's password is
+	 *	changed.
+	 */
+	if (inst->cache.enable) {
+		uint8_t known_good_key[SHA1_DIGEST_LENGTH];
+
+		fr_hmac_sha1(known_good_key, known_good, known_good_len, inst->cache.secret, sizeof(inst->cache.secret));
+		fr_hmac_sha1(ph->cache_key, (uint8_t const *)ph->password, ph->password_len,
+			     known_good_key, sizeof(known_good_key));
+		ph->cacheable = true;
+	}
+
+	return ph;
+}
+
+/** Check a computed hash, caching the password if it matched
+ *
+ */
+static unlang_action_t pap_hash_check(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+				      request_t *request, pap_hash_t *ph)
+{
+	rlm_pap_t	*inst = talloc_get_type_abort(mctx->instance, rlm_pap_t);
+	rlm_rcode_t	rcode;
+
+	ph->check(&rcode, request, ph);
+	if ((rcode == RLM_MODULE_OK) && ph->cacheable) pap_cache_insert(inst, ph->cache_key);
+	talloc_free(ph);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+static void pap_hash_run(void *uctx)
+{
+	pap_hash_t	*ph = uctx;
+
+	ph->run(ph);
+}
+
+static void pap_hash_done(void *uctx, fr_time_delta_t wait, fr_time_delta_t run)
+{
+	pap_hash_t	*ph = talloc_get_type_abort(uctx, pap_hash_t);
+
+	ph->job = NULL;
+	ph->wait = wait;
+	ph->run_time = run;
+
+	talloc_steal(ph->request, ph);
+	unlang_interpret_mark_runnable(ph->request);
+}
+
+static unlang_action_t pap_hash_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+				       request_t *request, void *rctx)
+{
+	pap_hash_t	*ph = talloc_get_type_abort(rctx, pap_hash_t);
+	rlm_rcode_t	rcode;
+
+	RDEBUG3("Hash computed in %pVs, after queueing for %pVs",
+		fr_box_time_delta(ph->run_time), fr_box_time_delta(ph->wait));
+
+	pap_hash_check(&rcode, mctx, request, ph);
+
+	return pap_auth_rcode(p_result, request, rcode);
+}
+
+static void pap_hash_signal(UNUSED module_ctx_t const *mctx, UNUSED request_t *request,
+			    void *rctx, fr_state_signal_t action)
+{
+	pap_hash_t	*ph = talloc_get_type_abort(rctx, pap_hash_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	/*
+	 *	If the job has completed the hash is
+	 *	parented by the request, and will be
+	 *	freed with it.
+	 */
+	if (ph->job) fr_thread_pool_cancel(ph->job);
+}
+
+/** Compute an expensive hash, yielding until the thread pool has done so
+ *
+ * If the password was recently verified the hash isn't computed.
+ * If there's no thread pool, or its queue is full, the hash is
+ * computed inline.
+ */
+static unlang_action_t pap_hash_compute(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					request_t *request, pap_hash_t *ph)
+{
+	rlm_pap_t		*inst = talloc_get_type_abort(mctx->instance, rlm_pap_t);
+	rlm_pap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_pap_thread_t);
+
+	if (ph->cacheable && pap_cache_find(inst, ph->cache_key)) {
+		RDEBUG2("Password was recently verified, not computing hash");
+		talloc_free(ph);
+		RETURN_MODULE_OK;
+	}
+
+	if (t->client) {
+		ph->job = fr_thread_pool_submit(t->client, pap_hash_run, pap_hash_done, ph);
+		if (ph->job) return unlang_module_yield(request, pap_hash_resume, pap_hash_signal, ph);
+
+		RPWDEBUG2("Computing hash inline");
+	}
+
+	ph->run(ph);
+
+	return pap_hash_check(p_result, mctx, request, ph);
+}
+#endif
+
 /*
  *	PAP authentication functions
  */
 
 static unlang_action_t CC_HINT(nonnull) pap_auth_clear(rlm_rcode_t *p_result,
-						       UNUSED rlm_pap_t const *inst, request_t *request,
+						       UNUSED module_ctx_t const *mctx, request_t *request,
 						       fr_pair_t const *known_good, fr_pair_t const *password)
 {
 	if ((known_good->vp_length != password->vp_length) ||
@@ -167,20 +506,37 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_clear(rlm_rcode_t *p_result,
 }
 
 #ifdef HAVE_CRYPT
-static unlang_action_t CC_HINT(nonnull) pap_auth_crypt(rlm_rcode_t *p_result,
-						       UNUSED rlm_pap_t const *inst, request_t *request,
-						       fr_pair_t const *known_good, fr_pair_t const *password)
+static void pap_crypt_run(pap_hash_t *ph)
+{
+	ph->crypt.ret = fr_crypt_check(ph->password, ph->crypt.known_good);
+}
+
+static unlang_action_t CC_HINT(nonnull) pap_crypt_check(rlm_rcode_t *p_result, request_t *request,
+							pap_hash_t const *ph)
 {
-	if (fr_crypt_check(password->vp_strvalue, known_good->vp_strvalue) != 0) {
+	if (ph->crypt.ret != 0) {
 		REDEBUG("Crypt digest does not match \"known good\" digest");
 		RETURN_MODULE_REJECT;
 	}
 	RETURN_MODULE_OK;
 }
+
+static unlang_action_t CC_HINT(nonnull) pap_auth_crypt(rlm_rcode_t *p_result,
+						       module_ctx_t const *mctx, request_t *request,
+						       fr_pair_t const *known_good, fr_pair_t const *password)
+{
+	pap_hash_t	*ph;
+
+	ph = pap_hash_alloc(mctx, request, known_good->vp_octets, known_good->vp_length, password,
+			    pap_crypt_run, pap_crypt_check);
+	MEM(ph->crypt.known_good = talloc_bstrndup(ph, known_good->vp_strvalue, known_good->vp_length));
+
+	return pap_hash_compute(p_result, mctx, request, ph);
+}
 #endif
 
 static unlang_action_t CC_HINT(nonnull) pap_auth_md5(rlm_rcode_t *p_result,
-						     UNUSED rlm_pap_t const *inst, request_t *request,
+						     UNUSED module_ctx_t const *mctx, request_t *request,
 						     fr_pair_t const *known_good, fr_pair_t const *password)
 {
 	uint8_t digest[MD5_DIGEST_LENGTH];
@@ -205,7 +561,7 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_md5(rlm_rcode_t *p_result,
 
 
 static unlang_action_t CC_HINT(nonnull) pap_auth_smd5(rlm_rcode_t *p_result,
-						      UNUSED rlm_pap_t const *inst, request_t *request,
+						      UNUSED module_ctx_t const *mctx, request_t *request,
 						      fr_pair_t const *known_good, fr_pair_t const *password)
 {
 	fr_md5_ctx_t	*md5_ctx;
@@ -237,7 +593,7 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_smd5(rlm_rcode_t *p_result,
 }
 
 static unlang_action_t CC_HINT(nonnull) pap_auth_sha1(rlm_rcode_t *p_result,
-						      UNUSED rlm_pap_t const *inst, request_t *request,
+						      UNUSED module_ctx_t const *mctx, request_t *request,
 						      fr_pair_t const *known_good, fr_pair_t const *password)
 {
 	fr_sha1_ctx	sha1_context;
@@ -264,7 +620,7 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_sha1(rlm_rcode_t *p_result,
 }
 
 static unlang_action_t CC_HINT(nonnull) pap_auth_ssha1(rlm_rcode_t *p_result,
-						       UNUSED rlm_pap_t const *inst, request_t *request,
+						       UNUSED module_ctx_t const *mctx, request_t *request,
 						       fr_pair_t const *known_good, fr_pair_t const *password)
 {
 	fr_sha1_ctx	sha1_context;
@@ -296,7 +652,7 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_ssha1(rlm_rcode_t *p_result,
 
 #ifdef HAVE_OPENSSL_EVP_H
 static unlang_action_t CC_HINT(nonnull) pap_auth_evp_md(rlm_rcode_t *p_result,
-						    	UNUSED rlm_pap_t const *inst, request_t *request,
+						    	UNUSED module_ctx_t const *mctx, request_t *request,
 						    	fr_pair_t const *known_good, fr_pair_t const *password,
 						    	char const *name, EVP_MD const *md)
 {
@@ -324,7 +680,7 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_evp_md(rlm_rcode_t *p_result,
 }
 
 static unlang_action_t CC_HINT(nonnull) pap_auth_evp_md_salted(rlm_rcode_t *p_result,
-							       UNUSED rlm_pap_t const *inst, request_t *request,
+							       UNUSED module_ctx_t const *mctx, request_t *request,
 							       fr_pair_t const *known_good, fr_pair_t const *password,
 							       char const *name, EVP_MD const *md)
 {
@@ -363,10 +719,10 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_evp_md_salted(rlm_rcode_t *p_re
  */
 #define PAP_AUTH_EVP_MD(_func, _new_func, _name, _md) \
 static unlang_action_t CC_HINT(nonnull) _new_func(rlm_rcode_t *p_result, \
-					          rlm_pap_t const *inst, request_t *request, \
+					          module_ctx_t const *mctx, request_t *request, \
 						  fr_pair_t const *known_good, fr_pair_t const *password) \
 { \
-	return _func(p_result, inst, request, known_good, password, _name, _md); \
+	return _func(p_result, mctx, request, known_good, password, _name, _md); \
 }
 
 PAP_AUTH_EVP_MD(pap_auth_evp_md, pap_auth_sha2_224, "SHA2-224", EVP_sha224())
@@ -389,9 +745,38 @@ PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_384, "SSHA3-384", EVP_sha
 PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_512, "SSHA3-512", EVP_sha3_512())
 #  endif
 
+static void pap_pbkdf2_run(pap_hash_t *ph)
+{
+	ph->pbkdf2.failed = (PKCS5_PBKDF2_HMAC(ph->password, (int)ph->password_len,
+					       ph->pbkdf2.salt, (int)ph->pbkdf2.salt_len,
+					       (int)ph->pbkdf2.iterations,
+					       ph->pbkdf2.md,
+					       (int)ph->pbkdf2.digest_len, ph->pbkdf2.digest) == 0);
+}
+
+static unlang_action_t CC_HINT(nonnull) pap_pbkdf2_check(rlm_rcode_t *p_result, request_t *request,
+							 pap_hash_t const *ph)
+{
+	if (ph->pbkdf2.failed) {
+		REDEBUG("PBKDF2 digest failure");
+		RETURN_MODULE_INVALID;
+	}
+
+	if (fr_digest_cmp(ph->pbkdf2.digest, ph->pbkdf2.known_good, ph->pbkdf2.digest_len) != 0) {
+		REDEBUG("PBKDF2 digest does not match \"known good\" digest");
+		REDEBUG3("Salt       : %pH", fr_box_octets(ph->pbkdf2.salt, ph->pbkdf2.salt_len));
+		REDEBUG3("Calculated : %pH", fr_box_octets(ph->pbkdf2.digest, ph->pbkdf2.digest_len));
+		REDEBUG3("Expected   : %pH", fr_box_octets(ph->pbkdf2.known_good, ph->pbkdf2.digest_len));
+		RETURN_MODULE_REJECT;
+	}
+
+	RETURN_MODULE_OK;
+}
+
 /** Validates Crypt::PBKDF2 LDAP format strings
  *
  * @param[out] p_result		The result of comparing the pbkdf2 hash with the password.
+ * @param[in] mctx		Module calling ctx.
  * @param[in] request		The current request.
  * @param[in] str		Raw PBKDF2 string.
  * @param[in] len		Length of string.
@@ -406,7 +791,7 @@ PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_512, "SSHA3-512", EVP_sha
  *	- RLM_MODULE_REJECT
  *	- RLM_MODULE_OK
  */
-static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t *p_result,
+static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t *p_result, module_ctx_t const *mctx,
 								     request_t *request, const uint8_t *str, size_t len,
 								     fr_table_num_sorted_t const hash_names[], size_t hash_names_len,
 								     char scheme_sep, char iter_sep, char salt_sep,
@@ -423,13 +808,12 @@ static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t
 
 	uint32_t		iterations = 0;
 
-	uint8_t			*salt = NULL;
-	size_t			salt_len;
-	uint8_t			hash[EVP_MAX_MD_SIZE];
-	uint8_t			digest[EVP_MAX_MD_SIZE];
+	pap_hash_t		*ph;
 
 	RDEBUG2("Comparing with \"known-good\" PBKDF2-Password");
 
+	ph = pap_hash_alloc(mctx, request, str, len, password, pap_pbkdf2_run, pap_pbkdf2_check);
+
 	if (len <= 1) {
 		REDEBUG("PBKDF2-Password is too short");
 		goto finish;
@@ -560,14 +944,14 @@ static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t
 		goto finish;
 	}
 
-	MEM(salt = talloc_array(request, uint8_t, FR_BASE64_DEC_LENGTH(q - p)));
-	slen = fr_base64_decode(&FR_DBUFF_TMP(salt, talloc_array_length(salt)),
+	MEM(ph->pbkdf2.salt = talloc_array(ph, uint8_t, FR_BASE64_DEC_LENGTH(q - p)));
+	slen = fr_base64_decode(&FR_DBUFF_TMP(ph->pbkdf2.salt, talloc_array_length(ph->pbkdf2.salt)),
 				&FR_SBUFF_IN((char const *) p, (char const *)q), false, false);
 	if (slen <= 0) {
 		RPEDEBUG("Failed decoding PBKDF2-Password salt component");
 		goto finish;
 	}
-	salt_len = (size_t)slen;
+	ph->pbkdf2.salt_len = (size_t)slen;
 
 	p = q + 1;
 
@@ -576,7 +960,7 @@ static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t
 		goto finish;
 	}
 
-	slen = fr_base64_decode(&FR_DBUFF_TMP(hash, sizeof(hash)),
+	slen = fr_base64_decode(&FR_DBUFF_TMP(ph->pbkdf2.known_good, sizeof(ph->pbkdf2.known_good)),
 				&FR_SBUFF_IN((char const *)p, (char const *)end), false, false);
 	if (slen <= 0) {
 		RPEDEBUG("Failed decoding PBKDF2-Password hash component");
@@ -587,45 +971,29 @@ static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t
 		REDEBUG("PBKDF2-Password hash component length is incorrect for hash type, expected %zu, got %zd",
 			digest_len, slen);
 
-		RHEXDUMP2(hash, slen, "hash component");
+		RHEXDUMP2(ph->pbkdf2.known_good, slen, "hash component");
 
 		goto finish;
 	}
 
 	RDEBUG2("PBKDF2 %s: Iterations %u, salt length %zu, hash length %zd",
 		fr_table_str_by_value(pbkdf2_crypt_names, digest_type, "<UNKNOWN>"),
-		iterations, salt_len, slen);
+		iterations, ph->pbkdf2.salt_len, slen);
 
-	/*
-	 *	Hash and compare
-	 */
-	if (PKCS5_PBKDF2_HMAC((char const *)password->vp_octets, (int)password->vp_length,
-			      (unsigned char const *)salt, (int)salt_len,
-			      (int)iterations,
-			      evp_md,
-			      (int)digest_len, (unsigned char *)digest) == 0) {
-		REDEBUG("PBKDF2 digest failure");
-		goto finish;
-	}
+	ph->pbkdf2.md = evp_md;
+	ph->pbkdf2.iterations = iterations;
+	ph->pbkdf2.digest_len = digest_len;
 
-	if (fr_digest_cmp(digest, hash, (size_t)digest_len) != 0) {
-		REDEBUG("PBKDF2 digest does not match \"known good\" digest");
-		REDEBUG3("Salt       : %pH", fr_box_octets(salt, salt_len));
-		REDEBUG3("Calculated : %pH", fr_box_octets(digest, digest_len));
-		REDEBUG3("Expected   : %pH", fr_box_octets(hash, slen));
-		rcode = RLM_MODULE_REJECT;
-	} else {
-		rcode = RLM_MODULE_OK;
-	}
+	return pap_hash_compute(p_result, mctx, request, ph);
 
 finish:
-	talloc_free(salt);
+	talloc_free(ph);
 
 	RETURN_MODULE_RCODE(rcode);
 }
 
 static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_result,
-							       UNUSED rlm_pap_t const *inst,
+							       module_ctx_t const *mctx,
 							       request_t *request,
 							       fr_pair_t const *known_good, fr_pair_t const *password)
 {
@@ -650,7 +1018,7 @@ static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_re
 			q = memchr(p, '}', end - p);
 			p = q + 1;
 		}
-		return pap_auth_pbkdf2_parse(p_result, request, p, end - p,
+		return pap_auth_pbkdf2_parse(p_result, mctx, request, p, end - p,
 					     pbkdf2_crypt_names, pbkdf2_crypt_names_len,
 					     ':', ':', ':', true, password);
 	}
@@ -662,7 +1030,7 @@ static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_re
 	 */
 	if ((size_t)(end - p) >= sizeof("$PBKDF2$") && (memcmp(p, "$PBKDF2$", sizeof("$PBKDF2$") - 1) == 0)) {
 		p += sizeof("$PBKDF2$") - 1;
-		return pap_auth_pbkdf2_parse(p_result, request, p, end - p,
+		return pap_auth_pbkdf2_parse(p_result, mctx, request, p, end - p,
 					     pbkdf2_crypt_names, pbkdf2_crypt_names_len,
 					     ':', ':', '$', false, password);
 	}
@@ -676,7 +1044,7 @@ static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_re
 	 */
 	if ((size_t)(end - p) >= sizeof("$pbkdf2-") && (memcmp(p, "$pbkdf2-", sizeof("$pbkdf2-") - 1) == 0)) {
 		p += sizeof("$pbkdf2-") - 1;
-		return pap_auth_pbkdf2_parse(p_result, request, p, end - p,
+		return pap_auth_pbkdf2_parse(p_result, mctx, request, p, end - p,
 					     pbkdf2_passlib_names, pbkdf2_passlib_names_len,
 					     '$', '$', '$', false, password);
 	}
@@ -688,7 +1056,7 @@ static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_re
 #endif
 
 static unlang_action_t CC_HINT(nonnull) pap_auth_nt(rlm_rcode_t *p_result,
-						    UNUSED rlm_pap_t const *inst, request_t *request,
+						    UNUSED module_ctx_t const *mctx, request_t *request,
 						    fr_pair_t const *known_good, fr_pair_t const *password)
 {
 	ssize_t len;
@@ -724,7 +1092,7 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_nt(rlm_rcode_t *p_result,
 }
 
 static unlang_action_t CC_HINT(nonnull) pap_auth_lm(rlm_rcode_t *p_result,
-						    UNUSED rlm_pap_t const *inst, request_t *request,
+						    UNUSED module_ctx_t const *mctx, request_t *request,
 						    fr_pair_t const *known_good, UNUSED fr_pair_t const *password)
 {
 	uint8_t	digest[MD4_DIGEST_LENGTH];
@@ -754,7 +1122,7 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_lm(rlm_rcode_t *p_result,
 }
 
 static unlang_action_t CC_HINT(nonnull) pap_auth_ns_mta_md5(rlm_rcode_t *p_result,
-							    UNUSED rlm_pap_t const *inst, request_t *request,
+							    UNUSED module_ctx_t const *mctx, request_t *request,
 							    fr_pair_t const *known_good, fr_pair_t const *password)
 {
 	uint8_t digest[128];
@@ -818,7 +1186,7 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_ns_mta_md5(rlm_rcode_t *p_resul
  *
  */
 static unlang_action_t CC_HINT(nonnull) pap_auth_dummy(rlm_rcode_t *p_result,
-						       UNUSED rlm_pap_t const *inst, UNUSED request_t *request,
+						       UNUSED module_ctx_t const *mctx, UNUSED request_t *request,
 						       UNUSED fr_pair_t const *known_good, UNUSED fr_pair_t const *password)
 {
 	RETURN_MODULE_FAIL;
@@ -879,6 +1247,7 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	rlm_rcode_t		rcode = RLM_MODULE_INVALID;
 	pap_auth_func_t		auth_func;
 	bool			ephemeral;
+	unlang_action_t		ua;
 
 	password = fr_pair_find_by_da(&request->request_pairs, attr_user, 0);
 	if (!password) {
@@ -928,22 +1297,20 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	/*
 	 *	Authenticate, and return.
 	 */
-	auth_func(&rcode, inst, request, known_good, password);
+	ua = auth_func(&rcode, mctx, request, known_good, password);
 	if (ephemeral) TALLOC_FREE(known_good);
-	switch (rcode) {
-	case RLM_MODULE_REJECT:
-		REDEBUG("Password incorrect");
-		break;
+	if (ua == UNLANG_ACTION_YIELD) return ua;
 
-	case RLM_MODULE_OK:
-		RDEBUG2("User authenticated successfully");
-		break;
+	return pap_auth_rcode(p_result, request, rcode);
+}
 
-	default:
-		break;
-	}
+static int8_t pap_cache_entry_cmp(void const *one, void const *two)
+{
+	pap_cache_entry_t const	*a = one, *b = two;
+	int			ret;
 
-	RETURN_MODULE_RCODE(rcode);
+	ret = memcmp(a->key, b->key, sizeof(a->key));
+	return CMP(ret, 0);
 }
 
 static int mod_bootstrap(void *instance, CONF_SECTION *conf)
@@ -961,7 +1328,7 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
-static int mod_instantiate(void *instance, UNUSED CONF_SECTION *cs)
+static int mod_instantiate(void *instance, CONF_SECTION *cs)
 {
 	rlm_pap_t	*inst = talloc_get_type_abort(instance, rlm_pap_t);
 
@@ -971,6 +1338,98 @@ static int mod_instantiate(void *instance, UNUSED CONF_SECTION *cs)
 		     inst->name);
 	}
 
+	FR_INTEGER_BOUND_CHECK("thread_pool.threads", inst->threads, <=, 256);
+	FR_INTEGER_BOUND_CHECK("thread_pool.max_queued", inst->max_queued, >=, 1);
+
+	if (inst->cache.enable) {
+		size_t i;
+
+		FR_INTEGER_BOUND_CHECK("cache.max_entries", inst->cache.max_entries, >=, 1);
+		FR_TIME_DELTA_BOUND_CHECK("cache.lifetime", inst->cache.lifetime, >=, fr_time_delta_from_sec(1));
+		FR_TIME_DELTA_BOUND_CHECK("cache.lifetime", inst->cache.lifetime, <=, fr_time_delta_from_sec(86400));
+
+		/*
+		 *	The secret is never written anywhere, so
+		 *	the cache is emptied when the server is
+		 *	restarted.
+		 */
+		for (i = 0; i < sizeof(inst->cache.secret); i += sizeof(uint32_t)) {
+			uint32_t r = fr_rand();
+
+			memcpy(inst->cache.secret + i, &r, sizeof(r));
+		}
+
+		pthread_mutex_init(&inst->cache.mutex, NULL);
+		MEM(inst->cache.tree = fr_rb_inline_talloc_alloc(inst, pap_cache_entry_t, node, pap_cache_entry_cmp, NULL));
+		fr_dlist_init(&inst->cache.lru, pap_cache_entry_t, entry);
+	}
+
+	if (!inst->threads) return 0;
+
+	inst->pool = fr_thread_pool_alloc(inst, inst->threads, inst->max_queued);
+	if (!inst->pool) {
+		cf_log_perr(cs, "Failed starting thread pool");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_pap_t		*inst = talloc_get_type_abort(instance, rlm_pap_t);
+	fr_thread_pool_stats_t	stats;
+	pap_cache_entry_t	*entry;
+
+	if (inst->cache.tree) {
+		DEBUG("%s - Cache found %" PRIu64 " recently verified passwords, and missed %" PRIu64,
+		      inst->name, inst->cache.hits, inst->cache.misses);
+
+		while ((entry = fr_dlist_pop_head(&inst->cache.lru))) {
+			fr_rb_remove(inst->cache.tree, entry);
+			talloc_free(entry);
+		}
+		TALLOC_FREE(inst->cache.tree);
+		pthread_mutex_destroy(&inst->cache.mutex);
+		memset(inst->cache.secret, 0, sizeof(inst->cache.secret));
+	}
+
+	if (!inst->pool) return 0;
+
+	fr_thread_pool_stats(&stats, inst->pool);
+	DEBUG("%s - Thread pool computed %" PRIu64 " hashes, %" PRIu64 " computed inline as the queue was full, "
+	      "maximum queue depth %u, mean queue time %pVs, maximum queue time %pVs, mean run time %pVs",
+	      inst->name, stats.completed, stats.overflow, stats.depth_max,
+	      fr_box_time_delta(stats.completed ? stats.wait_total / (fr_time_delta_t)stats.completed : 0),
+	      fr_box_time_delta(stats.wait_max),
+	      fr_box_time_delta(stats.completed ? stats.run_total / (fr_time_delta_t)stats.completed : 0));
+	TALLOC_FREE(inst->pool);
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_pap_t		*inst = talloc_get_type_abort(instance, rlm_pap_t);
+	rlm_pap_thread_t	*t = talloc_get_type_abort(thread, rlm_pap_thread_t);
+
+	if (!inst->pool) return 0;
+
+	t->client = fr_thread_pool_client_alloc(t, inst->pool, el);
+	if (!t->client) {
+		PERROR("%s - Failed connecting to thread pool", inst->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_pap_thread_t	*t = talloc_get_type_abort(thread, rlm_pap_thread_t);
+
+	TALLOC_FREE(t->client);
+
 	return 0;
 }
 
@@ -1044,11 +1503,15 @@ module_t rlm_pap = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "pap",
 	.inst_size	= sizeof(rlm_pap_t),
+	.thread_inst_size	= sizeof(rlm_pap_thread_t),
 	.onload		= mod_load,
 	.unload		= mod_unload,
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize
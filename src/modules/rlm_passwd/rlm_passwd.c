@@ -152,9 +152,14 @@ static void release_hash_table(struct hashtable * ht){
 	ht->tablesize = 0;
 }
 
+static int _release_hash_table(struct hashtable *ht)
+{
+	release_hash_table(ht);
+	return 0;
+}
+
 static void release_ht(struct hashtable * ht){
 	if (!ht) return;
-	release_hash_table(ht);
 	talloc_free(ht);
 }
 
@@ -172,6 +177,7 @@ static struct hashtable * build_hash_table (char const * file, int num_fields,
 
 	MEM(ht = talloc_zero(NULL, struct hashtable));
 	MEM(ht->filename = talloc_typed_strdup(ht, file));
+	talloc_set_destructor(ht, _release_hash_table);
 
 	ht->tablesize = tablesize;
 	ht->num_fields = num_fields;
@@ -357,7 +363,7 @@ int main(void){
 
 #else  /* TEST */
 typedef struct {
-	struct hashtable	*ht;
+	fr_reload_t		*reload;	//!< Reloads the file, and publishes the hash table.
 	struct mypasswd		*pwd_fmt;
 	char const		*filename;
 	char const		*format;
@@ -370,8 +376,13 @@ typedef struct {
 	uint32_t		listable;
 	fr_dict_attr_t const		*keyattr;
 	bool			ignore_empty;
+	fr_time_delta_t		reload_interval;
 } rlm_passwd_t;
 
+typedef struct {
+	fr_reload_reader_t	*reader;	//!< Of the current hash table.
+} rlm_passwd_thread_t;
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_INPUT | FR_TYPE_REQUIRED, rlm_passwd_t, filename) },
 	{ FR_CONF_OFFSET("format", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_passwd_t, format) },
@@ -384,9 +395,30 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("allow_multiple_keys", FR_TYPE_BOOL, rlm_passwd_t, allow_multiple), .dflt = "no" },
 
 	{ FR_CONF_OFFSET("hash_size", FR_TYPE_UINT32, rlm_passwd_t, hash_size), .dflt = "100" },
+
+	{ FR_CONF_OFFSET("reload_interval", FR_TYPE_TIME_DELTA, rlm_passwd_t, reload_interval), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
+/*
+ *	Build the hash table.  Called at instantiation, and in
+ *	the reload thread.
+ */
+static void *passwd_load(void *uctx)
+{
+	rlm_passwd_t const	*inst = talloc_get_type_abort_const(uctx, rlm_passwd_t);
+	struct hashtable	*ht;
+
+	ht = build_hash_table(inst->filename, inst->num_fields, inst->key_field, inst->listable,
+			      inst->hash_size, inst->ignore_nislike, *inst->delimiter);
+	if (!ht) {
+		fr_strerror_printf("Can't build hashtable from passwd file %s", inst->filename);
+		return NULL;
+	}
+
+	return ht;
+}
+
 static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
 	int			num_fields = 0, key_field = -1, listable = 0;
@@ -396,6 +428,7 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	int			i;
 	fr_dict_attr_t const	*da;
 	rlm_passwd_t		*inst = instance;
+	struct hashtable	*ht;
 
 	fr_assert(inst->filename && *inst->filename);
 	fr_assert(inst->format && *inst->format);
@@ -442,24 +475,13 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
-	inst->ht = build_hash_table(inst->filename, num_fields, key_field, listable,
-				    inst->hash_size, inst->ignore_nislike, *inst->delimiter);
-	if (!inst->ht){
-		ERROR("Can't build hashtable from passwd file");
-		return -1;
-	}
-
 	inst->pwd_fmt = mypasswd_alloc(inst->format, num_fields, &len);
 	if (!inst->pwd_fmt){
 		ERROR("Memory allocation failed");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 	if (!string_to_entry(inst->format, num_fields, ':', inst->pwd_fmt , len)) {
 		ERROR("Unable to convert format entry");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 
@@ -474,8 +496,6 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	}
 	if (!*inst->pwd_fmt->field[key_field]) {
 		cf_log_err(conf, "key field is empty");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 
@@ -483,8 +503,6 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 						  inst->pwd_fmt->field[key_field], true, true);
 	if (!da) {
 		PERROR("Unable to resolve attribute");
-		release_ht(inst->ht);
-		inst->ht = NULL;
 		return -1;
 	}
 
@@ -496,6 +514,24 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	DEBUG3("num_fields: %d key_field %d(%s) listable: %s", num_fields, key_field,
 	       inst->pwd_fmt->field[key_field], listable ? "yes" : "no");
 
+	ht = passwd_load(inst);
+	if (!ht) {
+		PERROR("Failed loading passwd file");
+		return -1;
+	}
+
+	/*
+	 *	Changes to the file are picked up in the
+	 *	background, without blocking the workers.
+	 */
+	inst->reload = fr_reload_alloc(inst, cf_section_name2(conf) ? cf_section_name2(conf) : cf_section_name1(conf),
+				       ht, passwd_load, inst, &inst->filename, 1, inst->reload_interval);
+	if (!inst->reload) {
+		release_ht(ht);
+		cf_log_perr(conf, "Failed starting reload thread");
+		return -1;
+	}
+
 	return 0;
 
 #undef inst
@@ -503,15 +539,32 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 
 static int mod_detach (void *instance) {
 #define inst ((rlm_passwd_t *)instance)
-	if(inst->ht) {
-		release_ht(inst->ht);
-		inst->ht = NULL;
-	}
+	TALLOC_FREE(inst->reload);
 	talloc_free(inst->pwd_fmt);
 	return 0;
 #undef inst
 }
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_passwd_t		*inst = talloc_get_type_abort(instance, rlm_passwd_t);
+	rlm_passwd_thread_t	*t = talloc_get_type_abort(thread, rlm_passwd_thread_t);
+
+	t->reader = fr_reload_reader_alloc(t, inst->reload);
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_passwd_thread_t *t = talloc_get_type_abort(thread, rlm_passwd_thread_t);
+
+	TALLOC_FREE(t->reader);
+
+	return 0;
+}
+
 static void result_add(TALLOC_CTX *ctx, rlm_passwd_t const *inst, request_t *request,
 		       fr_pair_list_t *vps, struct mypasswd * pw, char when, char const *listname)
 {
@@ -533,10 +586,9 @@ static void result_add(TALLOC_CTX *ctx, rlm_passwd_t const *inst, request_t *req
 	}
 }
 
-static unlang_action_t CC_HINT(nonnull) mod_passwd_map(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+static unlang_action_t passwd_map(rlm_rcode_t *p_result, rlm_passwd_t const *inst,
+				  request_t *request, struct hashtable *ht)
 {
-	rlm_passwd_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_passwd_t);
-
 	char			buffer[1024];
 	fr_pair_t		*key, *i;
 	struct mypasswd		*pw, *last_found;
@@ -560,14 +612,14 @@ static unlang_action_t CC_HINT(nonnull) mod_passwd_map(rlm_rcode_t *p_result, mo
 		buffer[0] = '\0';
 #endif
 		fr_pair_print_value_quoted(&FR_SBUFF_OUT(buffer, sizeof(buffer)), i, T_BARE_WORD);
-		pw = get_pw_nam(buffer, inst->ht, &last_found);
+		pw = get_pw_nam(buffer, ht, &last_found);
 		if (!pw) continue;
 
 		do {
 			result_add(request->control_ctx, inst, request, &request->control_pairs, pw, 0, "config");
 			result_add(request->reply_ctx, inst, request, &request->reply_pairs, pw, 1, "reply_items");
 			result_add(request->request_ctx, inst, request, &request->request_pairs, pw, 2, "request_items");
-		} while ((pw = get_next(buffer, inst->ht, &last_found)));
+		} while ((pw = get_next(buffer, ht, &last_found)));
 
 		found++;
 
@@ -579,14 +631,29 @@ static unlang_action_t CC_HINT(nonnull) mod_passwd_map(rlm_rcode_t *p_result, mo
 	RETURN_MODULE_OK;
 }
 
+static unlang_action_t CC_HINT(nonnull) mod_passwd_map(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_passwd_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_passwd_t);
+	rlm_passwd_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_passwd_thread_t);
+	unlang_action_t		ua;
+
+	ua = passwd_map(p_result, inst, request, fr_reload_enter(t->reader));
+	fr_reload_exit(t->reader);
+
+	return ua;
+}
+
 extern module_t rlm_passwd;
 module_t rlm_passwd = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "passwd",
 	.inst_size	= sizeof(rlm_passwd_t),
+	.thread_inst_size	= sizeof(rlm_passwd_thread_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_passwd_map,
 		[MOD_ACCOUNTING]	= mod_passwd_map,
@@ -342,6 +342,387 @@ static XS(XS_radiusd_xlat)
 	XSRETURN(1);
 }
 
+/*
+ *
+ *     Verify that a Perl SV is a string and save it in FreeRadius
+ *     Value Pair Format
+ *
+ */
+static int pairadd_sv(TALLOC_CTX *ctx, request_t *request, fr_pair_list_t *vps, char *key, SV *sv, fr_token_t op,
+		      const char *hash_name, const char *list_name)
+{
+	char		*val;
+	fr_pair_t      *vp;
+	STRLEN		len;
+
+	if (!SvOK(sv)) return -1;
+
+	val = SvPV(sv, len);
+	vp = fr_pair_make(ctx, request->dict, vps, key, NULL, op);
+	if (!vp) {
+	fail:
+		REDEBUG("Failed to create pair %s.%s %s %s", list_name, key,
+			fr_table_str_by_value(fr_tokens_table, op, "<INVALID>"), val);
+		return -1;
+	}
+
+	switch (vp->vp_type) {
+	case FR_TYPE_STRING:
+		fr_pair_value_bstrndup(vp, val, len, true);
+		break;
+
+	case FR_TYPE_OCTETS:
+		fr_pair_value_memdup(vp, (uint8_t const *)val, len, true);
+		break;
+
+	default:
+		if (fr_pair_value_from_str(vp, val, len, '\0', false) < 0) goto fail;
+	}
+
+	VP_VERIFY(vp);
+
+	RDEBUG2("&%s.%s %s $%s{'%s'} -> '%s'", list_name, key, fr_table_str_by_value(fr_tokens_table, op, "<INVALID>"),
+	        hash_name, key, val);
+	return 0;
+}
+
+/*
+ *	%RAD_REQUEST, %RAD_REPLY, %RAD_CONFIG and %RAD_STATE are tied to
+ *	radiusd::PairList objects, which read and write the current
+ *	request's pairs directly.  Only attributes a script uses are
+ *	converted, and assignments are applied as they're made.
+ */
+typedef enum {
+	RLM_PERL_LIST_REQUEST = 0,
+	RLM_PERL_LIST_REPLY,
+	RLM_PERL_LIST_CONTROL,
+	RLM_PERL_LIST_STATE
+} rlm_perl_list_t;
+
+static struct {
+	char const	*hash_name;
+	char const	*list_name;
+} const rlm_perl_lists[] = {
+	[RLM_PERL_LIST_REQUEST]	= { "RAD_REQUEST", "request" },
+	[RLM_PERL_LIST_REPLY]	= { "RAD_REPLY", "reply" },
+	[RLM_PERL_LIST_CONTROL]	= { "RAD_CONFIG", "control" },
+	[RLM_PERL_LIST_STATE]	= { "RAD_STATE", "session-state" }
+};
+
+/** Find the list, and the ctx to allocate pairs in, for a tied hash
+ *
+ */
+static fr_pair_list_t *perl_pair_list(TALLOC_CTX **ctx, request_t *request, rlm_perl_list_t list)
+{
+	switch (list) {
+	case RLM_PERL_LIST_REQUEST:
+		*ctx = request->request_ctx;
+		return &request->request_pairs;
+
+	case RLM_PERL_LIST_REPLY:
+		*ctx = request->reply_ctx;
+		return &request->reply_pairs;
+
+	case RLM_PERL_LIST_CONTROL:
+		*ctx = request->control_ctx;
+		return &request->control_pairs;
+
+	case RLM_PERL_LIST_STATE:
+		*ctx = request->session_state_ctx;
+		return &request->session_state_pairs;
+	}
+
+	return NULL;
+}
+
+/** Convert a pair's value to a Perl string
+ *
+ */
+static SV *perl_vp_to_sv(request_t *request, fr_pair_t const *vp, rlm_perl_list_t list, int i)
+{
+	char const	*hash_name = rlm_perl_lists[list].hash_name;
+	char const	*list_name = rlm_perl_lists[list].list_name;
+	SV		*sv;
+
+	switch (vp->vp_type) {
+	case FR_TYPE_STRING:
+		RDEBUG2("$%s{'%s'}[%i] = &%s.%s -> '%pV'", hash_name, vp->da->name, i,
+		        list_name, vp->da->name, &vp->data);
+		sv = newSVpvn(vp->vp_strvalue, vp->vp_length);
+		break;
+
+	case FR_TYPE_OCTETS:
+		RDEBUG2("$%s{'%s'}[%i] = &%s.%s -> %pV", hash_name, vp->da->name, i,
+		        list_name, vp->da->name, &vp->data);
+		sv = newSVpvn((char const *)vp->vp_octets, vp->vp_length);
+		break;
+
+	default:
+	{
+		char	buffer[1024];
+		ssize_t	slen;
+
+		slen = fr_pair_print_value_quoted(&FR_SBUFF_OUT(buffer, sizeof(buffer)), vp, T_BARE_WORD);
+		if (slen < 0) return NULL;
+
+		RDEBUG2("$%s{'%s'}[%i] = &%s.%s -> '%pV'", hash_name, vp->da->name, i,
+		        list_name, vp->da->name, fr_box_strvalue_len(buffer, (size_t)slen));
+		sv = newSVpvn(buffer, (size_t)slen);
+	}
+		break;
+	}
+
+	SvTAINT(sv);
+	return sv;
+}
+
+/** Get the request, list and attribute a tied hash method was called for
+ *
+ * Croaks if called outside of a call from the server.  *da is NULL if
+ * there's no key, or the key isn't a known attribute.
+ */
+static fr_pair_list_t *perl_pair_list_args(pTHX_ request_t **request_out, TALLOC_CTX **ctx, rlm_perl_list_t *list,
+					   fr_dict_attr_t const **da, SV *self, SV *key)
+{
+	request_t	*request = rlm_perl_request;
+
+	if (!request) croak("%%RAD_* hashes are only available during calls from the server");
+
+	*list = (rlm_perl_list_t)SvIV(SvRV(self));
+	if (da) *da = key ? fr_dict_attr_search_by_qualified_oid(NULL, request->dict,
+								  SvPV_nolen(key), true, true) : NULL;
+	*request_out = request;
+
+	return perl_pair_list(ctx, request, *list);
+}
+
+/*
+ *	$RAD_REQUEST{'User-Name'}
+ *
+ *	Attributes with one instance are strings, attributes with
+ *	more are array refs of strings.
+ */
+static XS(XS_radiusd_pair_list_FETCH)
+{
+	dXSARGS;
+	request_t		*request;
+	TALLOC_CTX		*ctx;
+	rlm_perl_list_t		list;
+	fr_pair_list_t		*head;
+	fr_dict_attr_t const	*da;
+	fr_dcursor_t		cursor;
+	fr_pair_t		*vp;
+	AV			*av;
+	SV			*sv;
+	int			i = 0;
+
+	if (items != 2) croak("Usage: radiusd::PairList::FETCH(self, key)");
+
+	head = perl_pair_list_args(aTHX_ &request, &ctx, &list, &da, ST(0), ST(1));
+	if (!da) XSRETURN_UNDEF;
+
+	vp = fr_dcursor_iter_by_da_init(&cursor, head, da);
+	if (!vp) XSRETURN_UNDEF;
+
+	if (!fr_dcursor_next_peek(&cursor)) {
+		sv = perl_vp_to_sv(request, vp, list, 0);
+		if (!sv) XSRETURN_UNDEF;
+
+		ST(0) = sv_2mortal(sv);
+		XSRETURN(1);
+	}
+
+	av = newAV();
+	do {
+		sv = perl_vp_to_sv(request, vp, list, i);
+		if (sv) {
+			av_push(av, sv);
+			i++;
+		}
+	} while ((vp = fr_dcursor_next(&cursor)));
+
+	ST(0) = sv_2mortal(newRV_noinc((SV *)av));
+	XSRETURN(1);
+}
+
+/*
+ *	$RAD_REPLY{'Reply-Message'} = 'value', replaces all instances.
+ *	$RAD_REPLY{'Reply-Message'} = [ 'a', 'b' ], replaces all instances with one per value.
+ */
+static XS(XS_radiusd_pair_list_STORE)
+{
+	dXSARGS;
+	request_t		*request;
+	TALLOC_CTX		*ctx;
+	rlm_perl_list_t		list;
+	fr_pair_list_t		*head, vps;
+	fr_dict_attr_t const	*da;
+	fr_pair_t		*vp;
+	char			*key;
+	SV			*sv;
+	int			ret = 0;
+
+	if (items != 3) croak("Usage: radiusd::PairList::STORE(self, key, value)");
+
+	head = perl_pair_list_args(aTHX_ &request, &ctx, &list, &da, ST(0), ST(1));
+	key = SvPV_nolen(ST(1));
+	sv = ST(2);
+
+	fr_pair_list_init(&vps);
+	if (SvROK(sv) && (SvTYPE(SvRV(sv)) == SVt_PVAV)) {
+		AV	*av = (AV *)SvRV(sv);
+		I32	len = av_len(av), j;
+
+		for (j = 0; j <= len; j++) {
+			SV **av_sv = av_fetch(av, j, 0);
+
+			if (!av_sv) continue;
+			ret += pairadd_sv(ctx, request, &vps, key, *av_sv, T_OP_ADD,
+					  rlm_perl_lists[list].hash_name, rlm_perl_lists[list].list_name);
+		}
+	} else if (SvOK(sv)) {
+		ret = pairadd_sv(ctx, request, &vps, key, sv, T_OP_EQ,
+				 rlm_perl_lists[list].hash_name, rlm_perl_lists[list].list_name);
+	}
+
+	/*
+	 *	Leave the list alone if any value was bad
+	 */
+	if (ret < 0) {
+		fr_pair_list_free(&vps);
+		XSRETURN_EMPTY;
+	}
+
+	if (!da && (vp = fr_pair_list_head(&vps))) da = vp->da;
+	if (da) fr_pair_delete_by_da(head, da);
+	fr_pair_list_append(head, &vps);
+
+	XSRETURN_EMPTY;
+}
+
+static XS(XS_radiusd_pair_list_DELETE)
+{
+	dXSARGS;
+	request_t		*request;
+	TALLOC_CTX		*ctx;
+	rlm_perl_list_t		list;
+	fr_pair_list_t		*head;
+	fr_dict_attr_t const	*da;
+
+	if (items != 2) croak("Usage: radiusd::PairList::DELETE(self, key)");
+
+	head = perl_pair_list_args(aTHX_ &request, &ctx, &list, &da, ST(0), ST(1));
+	if (da) {
+		RDEBUG2("delete $%s{'%s'}", rlm_perl_lists[list].hash_name, da->name);
+		fr_pair_delete_by_da(head, da);
+	}
+
+	XSRETURN_UNDEF;
+}
+
+static XS(XS_radiusd_pair_list_CLEAR)
+{
+	dXSARGS;
+	request_t		*request;
+	TALLOC_CTX		*ctx;
+	rlm_perl_list_t		list;
+	fr_pair_list_t		*head;
+
+	if (items != 1) croak("Usage: radiusd::PairList::CLEAR(self)");
+
+	head = perl_pair_list_args(aTHX_ &request, &ctx, &list, NULL, ST(0), NULL);
+	RDEBUG2("%%%s = ()", rlm_perl_lists[list].hash_name);
+	fr_pair_list_free(head);
+
+	XSRETURN_EMPTY;
+}
+
+static XS(XS_radiusd_pair_list_EXISTS)
+{
+	dXSARGS;
+	request_t		*request;
+	TALLOC_CTX		*ctx;
+	rlm_perl_list_t		list;
+	fr_pair_list_t		*head;
+	fr_dict_attr_t const	*da;
+
+	if (items != 2) croak("Usage: radiusd::PairList::EXISTS(self, key)");
+
+	head = perl_pair_list_args(aTHX_ &request, &ctx, &list, &da, ST(0), ST(1));
+	if (da && fr_pair_find_by_da(head, da, 0)) XSRETURN_YES;
+
+	XSRETURN_NO;
+}
+
+/*
+ *	keys %RAD_REQUEST, each %RAD_REQUEST etc.
+ *
+ *	The list is sorted so instances of an attribute are together,
+ *	and each attribute name is returned once.
+ */
+static XS(XS_radiusd_pair_list_FIRSTKEY)
+{
+	dXSARGS;
+	request_t		*request;
+	TALLOC_CTX		*ctx;
+	rlm_perl_list_t		list;
+	fr_pair_list_t		*head;
+	fr_pair_t		*vp;
+
+	if (items != 1) croak("Usage: radiusd::PairList::FIRSTKEY(self)");
+
+	head = perl_pair_list_args(aTHX_ &request, &ctx, &list, NULL, ST(0), NULL);
+	fr_pair_list_sort(head, fr_pair_cmp_by_da);
+
+	vp = fr_pair_list_head(head);
+	if (!vp) XSRETURN_UNDEF;
+
+	ST(0) = sv_2mortal(newSVpv(vp->da->name, 0));
+	XSRETURN(1);
+}
+
+static XS(XS_radiusd_pair_list_NEXTKEY)
+{
+	dXSARGS;
+	request_t		*request;
+	TALLOC_CTX		*ctx;
+	rlm_perl_list_t		list;
+	fr_pair_list_t		*head;
+	fr_dict_attr_t const	*da;
+	fr_pair_t		*vp;
+
+	if (items != 2) croak("Usage: radiusd::PairList::NEXTKEY(self, lastkey)");
+
+	head = perl_pair_list_args(aTHX_ &request, &ctx, &list, &da, ST(0), ST(1));
+	if (!da) XSRETURN_UNDEF;
+
+	for (vp = fr_pair_list_head(head); vp && (vp->da != da); vp = fr_pair_list_next(head, vp));
+	while (vp && (vp->da == da)) vp = fr_pair_list_next(head, vp);
+	if (!vp) XSRETURN_UNDEF;
+
+	ST(0) = sv_2mortal(newSVpv(vp->da->name, 0));
+	XSRETURN(1);
+}
+
+/** Tie a %RAD_* hash to a list, if it isn't already
+ *
+ * Done once per interpreter.
+ */
+static void perl_pair_list_tie(pTHX_ rlm_perl_list_t list)
+{
+	HV	*hv = get_hv(rlm_perl_lists[list].hash_name, GV_ADD);
+	SV	*tie;
+
+	if (SvRMAGICAL((SV *)hv) && mg_find((SV *)hv, PERL_MAGIC_tied)) return;
+
+	tie = newRV_noinc(newSViv(list));
+	sv_bless(tie, gv_stashpv("radiusd::PairList", GV_ADD));
+
+	hv_clear(hv);
+	sv_magic((SV *)hv, tie, PERL_MAGIC_tied, NULL, 0);
+	SvREFCNT_dec(tie);				/* sv_magic holds a reference */
+}
+
 static void xs_init(pTHX)
 {
 	char const *file = __FILE__;
@@ -351,6 +732,14 @@ static void xs_init(pTHX)
 
 	newXS("radiusd::log",XS_radiusd_log, "rlm_perl");
 	newXS("radiusd::xlat",XS_radiusd_xlat, "rlm_perl");
+
+	newXS("radiusd::PairList::FETCH", XS_radiusd_pair_list_FETCH, "rlm_perl");
+	newXS("radiusd::PairList::STORE", XS_radiusd_pair_list_STORE, "rlm_perl");
+	newXS("radiusd::PairList::DELETE", XS_radiusd_pair_list_DELETE, "rlm_perl");
+	newXS("radiusd::PairList::CLEAR", XS_radiusd_pair_list_CLEAR, "rlm_perl");
+	newXS("radiusd::PairList::EXISTS", XS_radiusd_pair_list_EXISTS, "rlm_perl");
+	newXS("radiusd::PairList::FIRSTKEY", XS_radiusd_pair_list_FIRSTKEY, "rlm_perl");
+	newXS("radiusd::PairList::NEXTKEY", XS_radiusd_pair_list_NEXTKEY, "rlm_perl");
 }
 
 /** Convert a list of value boxes to a Perl array for passing to subroutines
@@ -838,214 +1227,18 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
-static void perl_vp_to_svpvn_element(request_t *request, AV *av, fr_pair_t const *vp,
-				     int *i, const char *hash_name, const char *list_name)
-{
-
-	SV *sv;
-
-	switch (vp->vp_type) {
-	case FR_TYPE_STRING:
-		RDEBUG2("$%s{'%s'}[%i] = &%s.%s -> '%s'", hash_name, vp->da->name, *i,
-		        list_name, vp->da->name, vp->vp_strvalue);
-		sv = newSVpvn(vp->vp_strvalue, vp->vp_length);
-		break;
-
-	case FR_TYPE_OCTETS:
-		RDEBUG2("$%s{'%s'}[%i] = &%s.%s -> 0x%pH", hash_name, vp->da->name, *i,
-		        list_name, vp->da->name, &vp->data);
-		sv = newSVpvn((char const *)vp->vp_octets, vp->vp_length);
-		break;
-
-	default:
-	{
-		char	buffer[1024];
-		ssize_t	slen;
-
-		slen = fr_pair_print_value_quoted(&FR_SBUFF_OUT(buffer, sizeof(buffer)), vp, T_BARE_WORD);
-		if (slen < 0) return;
-
-		RDEBUG2("$%s{'%s'}[%i] = &%s.%s -> '%pV'", hash_name, vp->da->name, *i,
-		        list_name, vp->da->name, fr_box_strvalue_len(buffer, (size_t)slen));
-		sv = newSVpvn(buffer, (size_t)slen);
-	}
-		break;
-	}
-
-	if (!sv) return;
-	SvTAINT(sv);
-	av_push(av, sv);
-	(*i)++;
-}
-
-/*
- *  	get the vps and put them in perl hash
- *  	If one VP have multiple values it is added as array_ref
- *  	Example for this is Vendor-Specific.Cisco.AVPair that holds multiple values.
- *  	Which will be available as array_ref in $RAD_REQUEST{'Vendor-Specific.Cisco.AVPair'}
- */
-static void perl_store_vps(UNUSED TALLOC_CTX *ctx, request_t *request, fr_pair_list_t *vps, HV *rad_hv,
-			   const char *hash_name, const char *list_name)
-{
-	fr_pair_t *vp;
-
-	hv_undef(rad_hv);
-
-	fr_dcursor_t cursor;
-
-	RINDENT();
-	fr_pair_list_sort(vps, fr_pair_cmp_by_da);
-	for (vp = fr_dcursor_init(&cursor, vps);
-	     vp;
-	     vp = fr_dcursor_next(&cursor)) {
-		fr_pair_t *next;
-		char const *name;
-		name = vp->da->name;
-
-		/*
-		 *	We've sorted by type, then tag, so attributes of the
-		 *	same type/tag should follow on from each other.
-		 */
-		if ((next = fr_dcursor_next_peek(&cursor)) && ATTRIBUTE_EQ(vp, next)) {
-			int i = 0;
-			AV *av;
-
-			av = newAV();
-			perl_vp_to_svpvn_element(request, av, vp, &i, hash_name, list_name);
-			do {
-				perl_vp_to_svpvn_element(request, av, next, &i, hash_name, list_name);
-				fr_dcursor_next(&cursor);
-			} while ((next = fr_dcursor_next_peek(&cursor)) && ATTRIBUTE_EQ(vp, next));
-			(void)hv_store(rad_hv, name, strlen(name), newRV_noinc((SV *)av), 0);
-
-			continue;
-		}
-
-		/*
-		 *	It's a normal single valued attribute
-		 */
-		switch (vp->vp_type) {
-		case FR_TYPE_STRING:
-			RDEBUG2("$%s{'%s'} = &%s.%s -> '%pV'", hash_name, vp->da->name, list_name,
-			       vp->da->name, &vp->data);
-			(void)hv_store(rad_hv, name, strlen(name), newSVpvn(vp->vp_strvalue, vp->vp_length), 0);
-			break;
-
-		case FR_TYPE_OCTETS:
-			RDEBUG2("$%s{'%s'} = &%s.%s -> %pV", hash_name, vp->da->name, list_name,
-			       vp->da->name, &vp->data);
-			(void)hv_store(rad_hv, name, strlen(name),
-				       newSVpvn((char const *)vp->vp_octets, vp->vp_length), 0);
-			break;
-
-		default:
-		{
-			char buffer[1024];
-			ssize_t slen;
-
-			slen = fr_pair_print_value_quoted(&FR_SBUFF_OUT(buffer, sizeof(buffer)), vp, T_BARE_WORD);
-			RDEBUG2("$%s{'%s'} = &%s.%s -> '%pV'", hash_name, vp->da->name,
-			        list_name, vp->da->name, fr_box_strvalue_len(buffer, (size_t)slen));
-			(void)hv_store(rad_hv, name, strlen(name),
-				       newSVpvn(buffer, (size_t)(slen)), 0);
-		}
-			break;
-		}
-	}
-	REXDENT();
-}
-
-/*
- *
- *     Verify that a Perl SV is a string and save it in FreeRadius
- *     Value Pair Format
- *
- */
-static int pairadd_sv(TALLOC_CTX *ctx, request_t *request, fr_pair_list_t *vps, char *key, SV *sv, fr_token_t op,
-		      const char *hash_name, const char *list_name)
-{
-	char		*val;
-	fr_pair_t      *vp;
-	STRLEN		len;
-
-	if (!SvOK(sv)) return -1;
-
-	val = SvPV(sv, len);
-	vp = fr_pair_make(ctx, request->dict, vps, key, NULL, op);
-	if (!vp) {
-	fail:
-		REDEBUG("Failed to create pair %s.%s %s %s", list_name, key,
-			fr_table_str_by_value(fr_tokens_table, op, "<INVALID>"), val);
-		return -1;
-	}
-
-	switch (vp->vp_type) {
-	case FR_TYPE_STRING:
-		fr_pair_value_bstrndup(vp, val, len, true);
-		break;
-
-	case FR_TYPE_OCTETS:
-		fr_pair_value_memdup(vp, (uint8_t const *)val, len, true);
-		break;
-
-	default:
-		if (fr_pair_value_from_str(vp, val, len, '\0', false) < 0) goto fail;
-	}
-
-	VP_VERIFY(vp);
-
-	RDEBUG2("&%s.%s %s $%s{'%s'} -> '%s'", list_name, key, fr_table_str_by_value(fr_tokens_table, op, "<INVALID>"),
-	        hash_name, key, val);
-	return 0;
-}
-
-/*
- *     Gets the content from hashes
- */
-static int get_hv_content(TALLOC_CTX *ctx, request_t *request, HV *my_hv, fr_pair_list_t *vps,
-			  const char *hash_name, const char *list_name)
-{
-	SV		*res_sv, **av_sv;
-	AV		*av;
-	char		*key;
-	I32		key_len, len, i, j;
-	int		ret = 0;
-
-	for (i = hv_iterinit(my_hv); i > 0; i--) {
-		res_sv = hv_iternextsv(my_hv,&key,&key_len);
-		if (SvROK(res_sv) && (SvTYPE(SvRV(res_sv)) == SVt_PVAV)) {
-			av = (AV*)SvRV(res_sv);
-			len = av_len(av);
-			for (j = 0; j <= len; j++) {
-				av_sv = av_fetch(av, j, 0);
-				ret = pairadd_sv(ctx, request, vps, key, *av_sv, T_OP_ADD, hash_name, list_name) + ret;
-			}
-		} else ret = pairadd_sv(ctx, request, vps, key, res_sv, T_OP_EQ, hash_name, list_name) + ret;
-	}
-
-	if (!fr_pair_list_empty(vps)) LIST_VERIFY(vps);
-
-	return ret;
-}
-
 /*
  * 	Call the function_name inside the module
- * 	Store all vps in hashes %RAD_CONFIG %RAD_REPLY %RAD_REQUEST
+ * 	%RAD_CONFIG %RAD_REPLY %RAD_REQUEST %RAD_STATE read and write the request's lists
  *
  */
 static unlang_action_t do_perl(rlm_rcode_t *p_result, void *instance, request_t *request, char const *function_name)
 {
 
 	rlm_perl_t		*inst = instance;
-	fr_pair_list_t		vps;
 	int			exitstatus=0, count;
 	STRLEN			n_a;
 
-	HV			*rad_reply_hv;
-	HV			*rad_config_hv;
-	HV			*rad_request_hv;
-	HV			*rad_state_hv;
-
 	/*
 	 *	Radius has told us to call this function, but none
 	 *	is defined.
@@ -1074,18 +1267,14 @@ static unlang_action_t do_perl(rlm_rcode_t *p_result, void *instance, request_t
 		ENTER;
 		SAVETMPS;
 
-		rad_reply_hv = get_hv("RAD_REPLY", 1);
-		rad_config_hv = get_hv("RAD_CONFIG", 1);
-		rad_request_hv = get_hv("RAD_REQUEST", 1);
-		rad_state_hv = get_hv("RAD_STATE", 1);
-
-		perl_store_vps(request->request_ctx, request, &request->request_pairs, rad_request_hv, "RAD_REQUEST", "request");
-		perl_store_vps(request->reply_ctx, request, &request->reply_pairs, rad_reply_hv, "RAD_REPLY", "reply");
-		perl_store_vps(request->control_ctx, request, &request->control_pairs, rad_config_hv, "RAD_CONFIG", "control");
-		perl_store_vps(request->session_state_ctx, request, &request->session_state_pairs, rad_state_hv, "RAD_STATE", "session-state");
+		perl_pair_list_tie(aTHX_ RLM_PERL_LIST_REQUEST);
+		perl_pair_list_tie(aTHX_ RLM_PERL_LIST_REPLY);
+		perl_pair_list_tie(aTHX_ RLM_PERL_LIST_CONTROL);
+		perl_pair_list_tie(aTHX_ RLM_PERL_LIST_STATE);
 
 		/*
-		 * Store pointer to request structure globally so radiusd::xlat works
+		 * Store pointer to request structure globally so radiusd::xlat
+		 * and the %RAD_* hashes work
 		 */
 		rlm_perl_request = request;
 
@@ -1120,31 +1309,6 @@ static unlang_action_t do_perl(rlm_rcode_t *p_result, void *instance, request_t
 		PUTBACK;
 		FREETMPS;
 		LEAVE;
-
-		fr_pair_list_init(&vps);
-		if ((get_hv_content(request->request_ctx, request, rad_request_hv, &vps, "RAD_REQUEST", "request")) == 0) {
-			fr_pair_list_free(&request->request_pairs);
-			fr_pair_list_append(&request->request_pairs, &vps);
-			fr_pair_list_init(&vps);
-		}
-
-		if ((get_hv_content(request->reply_ctx, request, rad_reply_hv, &vps, "RAD_REPLY", "reply")) == 0) {
-			fr_pair_list_free(&request->reply_pairs);
-			fr_pair_list_append(&request->reply_pairs, &vps);
-			fr_pair_list_init(&vps);
-		}
-
-		if ((get_hv_content(request->control_ctx, request, rad_config_hv, &vps, "RAD_CONFIG", "control")) == 0) {
-			fr_pair_list_free(&request->control_pairs);
-			fr_pair_list_append(&request->control_pairs, &vps);
-			fr_pair_list_init(&vps);
-		}
-
-		if ((get_hv_content(request->session_state_ctx, request, rad_state_hv, &vps, "RAD_STATE", "session-state")) == 0) {
-			fr_pair_list_free(&request->session_state_pairs);
-			fr_pair_list_append(&request->session_state_pairs, &vps);
-			fr_pair_list_init(&vps);
-		}
 	}
 	RETURN_MODULE_RCODE(exitstatus);
 }
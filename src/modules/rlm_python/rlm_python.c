@@ -63,7 +63,11 @@ typedef struct {
 							///< rlm_python module config in the python path.
 	bool		python_path_include_default;	//!< Include the default python path
 							///< in the python path.
+	bool		per_thread_interpreter;	//!< Give each worker thread its own interpreter,
+						///< with its own GIL.
+	char		*path;			//!< Python path built from the python_path options.
 	PyObject	*module;		//!< Local, interpreter specific module.
+	PyTypeObject	*pair_list_type;	//!< freeradius.PairList in the instance's interpreter.
 
 	python_func_def_t
 	instantiate,
@@ -82,35 +86,61 @@ typedef struct {
  *
  * Multiple instances of python create multiple interpreters and each
  * thread must have a PyThreadState per interpreter, to track execution.
+ *
+ * With per_thread_interpreter each thread instead creates its own
+ * interpreter, with its own GIL, and loads its own copy of the functions.
  */
 typedef struct {
+	rlm_python_t const *inst;		//!< Module instance.
 	PyThreadState	*state;			//!< Module instance/thread specific state.
+	bool		own_interpreter;	//!< state belongs to an interpreter only this thread uses.
+	PyObject	*module;		//!< freeradius module in our own interpreter.
+	PyTypeObject	*pair_list_type;	//!< freeradius.PairList in the interpreter we use.
+
+	python_func_def_t
+	instantiate,
+	authorize,
+	authenticate,
+	preacct,
+	accounting,
+	post_auth,
+	detach;
 } rlm_python_thread_t;
 
+/** Lazy, read only view of a request's pairs, passed to Python functions
+ *
+ * Pairs are only converted to (name, value) tuples when they're accessed,
+ * rather than converting every pair in the request for every call.
+ *
+ * The view is only valid for the duration of the call it's passed to.
+ */
+typedef struct {
+	PyObject_HEAD
+	rlm_python_t const	*inst;		//!< Module instance, for logging.
+	request_t		*request;	//!< NULL once the call has returned.
+	fr_pair_list_t		*list;		//!< The pairs we're a view of.
+	Py_ssize_t		len;		//!< Number of pairs in the list.
+
+	Py_ssize_t		last_idx;	//!< Index of last_vp, makes iterating O(n).
+	fr_pair_t		*last_vp;	//!< Pair last accessed by index.
+} python_pair_list_t;
+
 static void		*python_dlhandle;
 static PyThreadState	*global_interpreter;	//!< Our first interpreter.
 
-static rlm_python_t	*current_inst;		//!< Used for communication with inittab functions.
-static CONF_SECTION	*current_conf;		//!< Used for communication with inittab functions.
 static char		*default_path;		//!< The default python path.
 
 /*
- *	As of Python 3.8 the GIL will be per-interpreter
- *	If there are still issues with CEXTs,
- *	multiple interpreters and the GIL at that point
- *	users can build rlm_python against Python 3.8
- *	and the horrible hack of using a single interpreter
- *	for all instances of rlm_python will no longer be
- *	required.
+ *	As of Python 3.12 sub-interpreters may have their own GIL
+ *	(PEP 684), so threads using different interpreters can
+ *	run Python code in parallel.
  *
- *	As Python 3.x module initialisation is significantly
- *	different than Python 2.x initialisation,
- *	it'd be a pain to retain the cext_compat for
- *	Python 3 and as Python 3 users have the option of
- *	using as version of Python which fixes the underlying
- *	issue, we only support using a global interpreter
- *	for Python 2.7 and below.
+ *	Free-threaded builds of Python have no GIL at all, so
+ *	threads sharing an interpreter already run in parallel.
  */
+#if (PY_VERSION_HEX >= 0x030C0000) && !defined(Py_GIL_DISABLED)
+#  define HAVE_PER_INTERPRETER_GIL 1
+#endif
 
 /*
  *	A mapping of configuration file names to internal variables.
@@ -133,6 +163,7 @@ static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("python_path", FR_TYPE_STRING, rlm_python_t, python_path) },
 	{ FR_CONF_OFFSET("python_path_include_conf_dir", FR_TYPE_BOOL, rlm_python_t, python_path_include_conf_dir), .dflt = "yes" },
 	{ FR_CONF_OFFSET("python_path_include_default", FR_TYPE_BOOL, rlm_python_t, python_path_include_default), .dflt = "yes" },
+	{ FR_CONF_OFFSET("per_thread_interpreter", FR_TYPE_BOOL, rlm_python_t, per_thread_interpreter), .dflt = "no" },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -466,58 +497,203 @@ static int mod_populate_vptuple(rlm_python_t const *inst, request_t *request, Py
 	return 0;
 }
 
-static unlang_action_t do_python_single(rlm_rcode_t *p_result,
-					rlm_python_t const *inst, request_t *request, PyObject *p_func, char const *funcname)
+/*
+ *	freeradius.PairList, a lazy view of a request's pairs
+ */
+
+/** Find the pair at a given index in the list
+ *
+ * Remembers the last pair found, so iterating over the list is O(n).
+ */
+static fr_pair_t *python_pair_list_vp(python_pair_list_t *pl, Py_ssize_t idx)
 {
 	fr_pair_t	*vp;
-	PyObject	*p_ret = NULL;
-	PyObject	*p_arg = NULL;
-	int		tuple_len;
-	rlm_rcode_t	rcode = RLM_MODULE_OK;
+	Py_ssize_t	i;
+
+	if (pl->last_vp && (idx >= pl->last_idx)) {
+		vp = pl->last_vp;
+		i = pl->last_idx;
+	} else {
+		vp = fr_pair_list_head(pl->list);
+		i = 0;
+	}
+
+	while (vp && (i < idx)) {
+		vp = fr_pair_list_next(pl->list, vp);
+		i++;
+	}
+	if (!vp) return NULL;
+
+	pl->last_vp = vp;
+	pl->last_idx = idx;
+
+	return vp;
+}
+
+static int python_pair_list_check(python_pair_list_t *pl)
+{
+	if (pl->request) return 0;
+
+	PyErr_SetString(PyExc_RuntimeError, "PairList may only be used during the call it was passed to");
+	return -1;
+}
+
+static Py_ssize_t python_pair_list_length(PyObject *self)
+{
+	python_pair_list_t	*pl = (python_pair_list_t *)self;
+
+	if (python_pair_list_check(pl) < 0) return -1;
+
+	return pl->len;
+}
+
+/** Return the (name, value) tuple at an index
+ *
+ */
+static PyObject *python_pair_list_item(PyObject *self, Py_ssize_t idx)
+{
+	python_pair_list_t	*pl = (python_pair_list_t *)self;
+	fr_pair_t		*vp;
+	PyObject		*pp;
+
+	if (python_pair_list_check(pl) < 0) return NULL;
+
+	if ((idx < 0) || (idx >= pl->len) || !(vp = python_pair_list_vp(pl, idx))) {
+		PyErr_SetString(PyExc_IndexError, "PairList index out of range");
+		return NULL;
+	}
+
+	if ((pp = PyTuple_New(2)) == NULL) return NULL;
 
 	/*
-	 *	We will pass a tuple containing (name, value) tuples
-	 *	We can safely use the Python function to build up a
-	 *	tuple, since the tuple is not used elsewhere.
-	 *
-	 *	Determine the size of our tuple by walking through the packet.
-	 *	If request is NULL, pass None.
+	 *	As with the tuples we used to pass, pairs we
+	 *	can't convert are None.
 	 */
-	tuple_len = 0;
-	if (request != NULL) {
-		tuple_len = fr_pair_list_len(&request->request_pairs);
+	if (mod_populate_vptuple(pl->inst, pl->request, pp, vp) < 0) {
+		Py_DECREF(pp);
+		PyErr_Clear();
+		Py_RETURN_NONE;
 	}
 
-	if (tuple_len == 0) {
+	return pp;
+}
+
+/** Return the (name, value) tuple at an index, or the value of the first pair with a name
+ *
+ */
+static PyObject *python_pair_list_subscript(PyObject *self, PyObject *key)
+{
+	python_pair_list_t	*pl = (python_pair_list_t *)self;
+	fr_dict_attr_t const	*da;
+	fr_pair_t		*vp;
+	PyObject		*pp, *value;
+	char const		*name;
+
+	if (python_pair_list_check(pl) < 0) return NULL;
+
+	if (PyIndex_Check(key)) {
+		Py_ssize_t idx = PyNumber_AsSsize_t(key, PyExc_IndexError);
+
+		if ((idx == -1) && PyErr_Occurred()) return NULL;
+		if (idx < 0) idx += pl->len;
+
+		return python_pair_list_item(self, idx);
+	}
+
+	if (!PyUnicode_Check(key)) {
+		PyErr_SetString(PyExc_TypeError, "PairList indices must be integers or attribute names");
+		return NULL;
+	}
+
+	name = PyUnicode_AsUTF8(key);
+	if (!name) return NULL;
+
+	da = fr_dict_attr_by_name(NULL, fr_dict_root(pl->request->dict), name);
+	if (!da || !(vp = fr_pair_find_by_da(pl->list, da, 0))) {
+		PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
+	}
+
+	if ((pp = PyTuple_New(2)) == NULL) return NULL;
+	if (mod_populate_vptuple(pl->inst, pl->request, pp, vp) < 0) {
+		Py_DECREF(pp);
+		PyErr_SetObject(PyExc_ValueError, key);
+		return NULL;
+	}
+
+	value = PyTuple_GET_ITEM(pp, 1);
+	Py_INCREF(value);
+	Py_DECREF(pp);
+
+	return value;
+}
+
+static void python_pair_list_dealloc(PyObject *self)
+{
+	PyTypeObject *type = Py_TYPE(self);
+
+	type->tp_free(self);
+	Py_DECREF(type);		/* Instances of heap types hold a reference to their type */
+}
+
+static PyType_Slot python_pair_list_slots[] = {
+	{ Py_tp_dealloc, python_pair_list_dealloc },
+	{ Py_sq_length, python_pair_list_length },
+	{ Py_sq_item, python_pair_list_item },
+	{ Py_mp_length, python_pair_list_length },
+	{ Py_mp_subscript, python_pair_list_subscript },
+	{ Py_tp_doc, "Read only view of a request's attributes.\n\n"
+		     "Iterating over it, or indexing it with an integer, gives (name, value) tuples.\n"
+		     "Indexing it with an attribute name gives the value of the first attribute with that name.\n"
+		     "Only valid during the call it was passed to.\n" },
+	{ 0, NULL }
+};
+
+/*
+ *	A heap type, so each interpreter gets its own copy.
+ */
+static PyType_Spec python_pair_list_spec = {
+	.name = "freeradius.PairList",
+	.basicsize = sizeof(python_pair_list_t),
+	.flags = Py_TPFLAGS_DEFAULT,
+	.slots = python_pair_list_slots
+};
+
+static unlang_action_t do_python_single(rlm_rcode_t *p_result, rlm_python_t const *inst,
+					PyTypeObject *pair_list_type, request_t *request,
+					PyObject *p_func, char const *funcname)
+{
+	PyObject		*p_ret = NULL;
+	PyObject		*p_arg = NULL;
+	python_pair_list_t	*pl = NULL;
+	Py_ssize_t		len = 0;
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+
+	/*
+	 *	We pass a view of the request's pairs, which
+	 *	gives (name, value) tuples as they're accessed.
+	 *
+	 *	If request is NULL, or has no pairs, pass None.
+	 */
+	if (request != NULL) len = fr_pair_list_len(&request->request_pairs);
+
+	if (len == 0) {
 		Py_INCREF(Py_None);
 		p_arg = Py_None;
 	} else {
-		int i = 0;
-		if ((p_arg = PyTuple_New(tuple_len)) == NULL) {
+		pl = PyObject_New(python_pair_list_t, pair_list_type);
+		if (!pl) {
 			rcode = RLM_MODULE_FAIL;
 			goto finish;
 		}
-
-		for (vp = fr_pair_list_head(&request->request_pairs);
-		     vp;
-		     vp = fr_pair_list_next(&request->request_pairs, vp), i++) {
-			PyObject *pp;
-
-			/* The inside tuple has two only: */
-			if ((pp = PyTuple_New(2)) == NULL) {
-				rcode = RLM_MODULE_FAIL;
-				goto finish;
-			}
-
-			if (mod_populate_vptuple(inst, request, pp, vp) == 0) {
-				/* Put the tuple inside the container */
-				PyTuple_SET_ITEM(p_arg, i, pp);
-			} else {
-				Py_INCREF(Py_None);
-				PyTuple_SET_ITEM(p_arg, i, Py_None);
-				Py_DECREF(pp);
-			}
-		}
+		pl->inst = inst;
+		pl->request = request;
+		pl->list = &request->request_pairs;
+		pl->len = len;
+		pl->last_idx = 0;
+		pl->last_vp = NULL;
+
+		p_arg = (PyObject *)pl;
 	}
 
 	/* Call Python function. */
@@ -587,6 +763,16 @@ static unlang_action_t do_python_single(rlm_rcode_t *p_result,
 
 finish:
 	if (rcode == RLM_MODULE_FAIL) python_error_log(inst, request);
+
+	/*
+	 *	The function may have kept a reference to the
+	 *	view, which mustn't be used once we return.
+	 */
+	if (pl) {
+		pl->request = NULL;
+		pl->list = NULL;
+		pl->last_vp = NULL;
+	}
 	Py_XDECREF(p_arg);
 	Py_XDECREF(p_ret);
 
@@ -610,7 +796,7 @@ static unlang_action_t do_python(rlm_rcode_t *p_result, rlm_python_t const *inst
 	RDEBUG3("Using thread state %p/%p", inst, this_thread->state);
 
 	PyEval_RestoreThread(this_thread->state);	/* Swap in our local thread state */
-	do_python_single(&rcode, inst, request, p_func, funcname);
+	do_python_single(&rcode, inst, this_thread->pair_list_type, request, p_func, funcname);
 	(void)fr_cond_assert(PyEval_SaveThread() == this_thread->state);
 
 	RETURN_MODULE_RCODE(rcode);
@@ -621,7 +807,7 @@ static unlang_action_t CC_HINT(nonnull) mod_##x(rlm_rcode_t *p_result, module_ct
 { \
 	rlm_python_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_python_t); \
 	rlm_python_thread_t *thread = talloc_get_type_abort(mctx->thread, rlm_python_thread_t); \
-	return do_python(p_result, inst, thread, request, inst->x.function, #x);\
+	return do_python(p_result, inst, thread, request, thread->x.function, #x);\
 }
 
 MOD_FUNC(authenticate)
@@ -647,7 +833,7 @@ static void python_function_destroy(python_func_def_t *def)
 /** Import a user module and load a function from it
  *
  */
-static int python_function_load(rlm_python_t *inst, python_func_def_t *def)
+static int python_function_load(rlm_python_t const *inst, python_func_def_t *def)
 {
 	char const *funcname = "python_function_load";
 
@@ -684,7 +870,7 @@ static int python_function_load(rlm_python_t *inst, python_func_def_t *def)
  *	Parse a configuration section, and populate a dict.
  *	This function is recursively called (allows to have nested dicts.)
  */
-static int python_parse_config(rlm_python_t *inst, CONF_SECTION *cs, int lvl, PyObject *dict)
+static int python_parse_config(rlm_python_t const *inst, CONF_SECTION *cs, int lvl, PyObject *dict)
 {
 	int		indent_section = (lvl * 4);
 	int		indent_item = (lvl + 1) * 4;
@@ -767,20 +953,21 @@ static int python_parse_config(rlm_python_t *inst, CONF_SECTION *cs, int lvl, Py
 /** Make the current instance's config available within the module we're initialising
  *
  */
-static int python_module_import_config(rlm_python_t *inst, CONF_SECTION *conf, PyObject *module)
+static int python_module_import_config(rlm_python_t const *inst, CONF_SECTION const *conf, PyObject *module,
+				       PyObject **dict_out)
 {
-	CONF_SECTION *cs;
+	CONF_SECTION	*cs;
+	PyObject	*dict;
 
 	/*
 	 *	Convert a FreeRADIUS config structure into a python
 	 *	dictionary.
 	 */
-	inst->pythonconf_dict = PyDict_New();
-	if (!inst->pythonconf_dict) {
+	dict = PyDict_New();
+	if (!dict) {
 		ERROR("Unable to create python dict for config");
 	error:
-		Py_XDECREF(inst->pythonconf_dict);
-		inst->pythonconf_dict = NULL;
+		Py_XDECREF(dict);
 		python_error_log(inst, NULL);
 		return -1;
 	}
@@ -788,13 +975,14 @@ static int python_module_import_config(rlm_python_t *inst, CONF_SECTION *conf, P
 	cs = cf_section_find(conf, "config", NULL);
 	if (cs) {
 		DEBUG("Inserting \"config\" section into python environment as radiusd.config");
-		if (python_parse_config(inst, cs, 0, inst->pythonconf_dict) < 0) goto error;
+		if (python_parse_config(inst, cs, 0, dict) < 0) goto error;
 	}
 
 	/*
 	 *	Add module configuration as a dict
 	 */
-	if (PyModule_AddObject(module, "config", inst->pythonconf_dict) < 0) goto error;
+	if (PyModule_AddObject(module, "config", dict) < 0) goto error;
+	*dict_out = dict;
 
 	return 0;
 }
@@ -802,7 +990,7 @@ static int python_module_import_config(rlm_python_t *inst, CONF_SECTION *conf, P
 /** Import integer constants into the module we're initialising
  *
  */
-static int python_module_import_constants(rlm_python_t *inst, PyObject *module)
+static int python_module_import_constants(rlm_python_t const *inst, PyObject *module)
 {
 	size_t i;
 
@@ -841,80 +1029,126 @@ static char *python_path_build(TALLOC_CTX *ctx, rlm_python_t *inst, CONF_SECTION
 /*
  *	Python 3 interpreter initialisation and destruction
  */
-static PyObject *python_module_init(void)
-{
-	rlm_python_t	*inst = current_inst;
-	PyObject	*module;
 
-	static struct PyModuleDef py_module_def = {
-		PyModuleDef_HEAD_INIT,
-		.m_name = "freeradius",
-		.m_doc = "freeRADIUS python module",
-		.m_size = -1,
-		.m_methods = module_methods
-	};
+/** Add our types to the freeradius module
+ *
+ * Called for each interpreter which imports the module.
+ */
+static int python_module_exec(PyObject *module)
+{
+	PyObject	*type;
 
-	fr_assert(inst);
+	type = PyType_FromSpec(&python_pair_list_spec);
+	if (!type) return -1;
 
-	module = PyModule_Create(&py_module_def);
-	if (!module) {
-		python_error_log(inst, NULL);
-		Py_RETURN_NONE;
+	if (PyModule_AddObject(module, "PairList", type) < 0) {
+		Py_DECREF(type);
+		return -1;
 	}
 
-	return module;
+	return 0;
 }
 
-static int python_interpreter_init(rlm_python_t *inst, CONF_SECTION *conf)
+static PyModuleDef_Slot python_module_slots[] = {
+	{ Py_mod_exec, python_module_exec },
+#if PY_VERSION_HEX >= 0x030C0000
+	{ Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED },
+#endif
+#ifdef Py_GIL_DISABLED
+	{ Py_mod_gil, Py_MOD_GIL_NOT_USED },
+#endif
+	{ 0, NULL }
+};
+
+/*
+ *	Multi-phase initialisation, which is required for the
+ *	module to be imported by interpreters with their own GIL.
+ */
+static struct PyModuleDef python_module_def = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "freeradius",
+	.m_doc = "freeRADIUS python module",
+	.m_size = 0,
+	.m_methods = module_methods,
+	.m_slots = python_module_slots
+};
+
+static PyObject *python_module_init(void)
+{
+	return PyModuleDef_Init(&python_module_def);
+}
+
+/** Prepare an interpreter for use by an instance of rlm_python
+ *
+ * Must be called with the interpreter's thread state current.
+ *
+ * @param[in] inst		Module instance.
+ * @param[in] conf		Module configuration.
+ * @param[out] module_out	The freeradius module, in this interpreter.
+ * @param[out] config_out	The config dict.  A borrowed reference.
+ * @param[out] pair_list_type_out	freeradius.PairList, in this interpreter.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int python_interpreter_setup(rlm_python_t const *inst, CONF_SECTION const *conf, PyObject **module_out,
+				    PyObject **config_out, PyTypeObject **pair_list_type_out)
 {
-	char		*path;
 	PyObject	*module;
 	wchar_t	        *wide_path;
 
+	DEBUG3("Setting python path to \"%s\"", inst->path);
+	wide_path = Py_DecodeLocale(inst->path, NULL);
+	PySys_SetPath(wide_path);
+	PyMem_RawFree(wide_path);
+
 	/*
-	 *	python_module_init takes no args, so we need
-	 *	to set these globals so that when it's
-	 *	called during interpreter initialisation
-	 *	it can get at the current instance config.
+	 *	Import the radiusd module into this python
+	 *	environment.  Each interpreter gets its
+	 *	own copy which it can mutate as much as
+	 *      it wants.
 	 */
-	current_inst = inst;
-	current_conf = conf;
+	module = PyImport_ImportModule("freeradius");
+	if (!module) {
+		ERROR("Failed importing \"freeradius\" module into interpreter %p", PyThreadState_Get());
+		python_error_log(inst, NULL);
+		return -1;
+	}
+	if ((python_module_import_config(inst, conf, module, config_out) < 0) ||
+	    (python_module_import_constants(inst, module) < 0)) {
+	error:
+		Py_DECREF(module);
+		return -1;
+	}
+
+	*pair_list_type_out = (PyTypeObject *)PyObject_GetAttrString(module, "PairList");
+	if (!*pair_list_type_out) {
+		ERROR("Failed finding freeradius.PairList");
+		python_error_log(inst, NULL);
+		goto error;
+	}
+	*module_out = module;
 
+	return 0;
+}
+
+static int python_interpreter_init(rlm_python_t *inst, CONF_SECTION *conf)
+{
 	PyEval_RestoreThread(global_interpreter);
 	LSAN_DISABLE(inst->interpreter = Py_NewInterpreter());
 	if (!inst->interpreter) {
 		ERROR("Failed creating new interpreter");
+		PyEval_SaveThread();
 		return -1;
 	}
 	DEBUG3("Created new interpreter %p", inst->interpreter);
 	PyEval_SaveThread();		/* Unlock GIL */
 
 	PyEval_RestoreThread(inst->interpreter);
-
-	path = python_path_build(inst, inst, conf);
-	DEBUG3("Setting python path to \"%s\"", path);
-	wide_path = Py_DecodeLocale(path, NULL);
-	talloc_free(path);
-	PySys_SetPath(wide_path);
-	PyMem_RawFree(wide_path);
-
-	/*
-	 *	Import the radiusd module into this python
-	 *	environment.  Each interpreter gets its
-	 *	own copy which it can mutate as much as
-	 *      it wants.
-	 */
- 	module = PyImport_ImportModule("freeradius");
- 	if (!module) {
- 		ERROR("Failed importing \"freeradius\" module into interpreter %p", inst->interpreter);
- 		return -1;
- 	}
-	if ((python_module_import_config(inst, conf, module) < 0) ||
-	    (python_module_import_constants(inst, module) < 0)) {
-		Py_DECREF(module);
+	if (python_interpreter_setup(inst, conf, &inst->module, &inst->pythonconf_dict, &inst->pair_list_type) < 0) {
+		PyEval_SaveThread();
 		return -1;
 	}
-	inst->module = module;
 	PyEval_SaveThread();
 
 	return 0;
@@ -926,9 +1160,10 @@ static void python_interpreter_free(rlm_python_t *inst, PyThreadState *interp)
 	 *	We incremented the reference count earlier
 	 *	during module initialisation.
 	 */
+	PyEval_RestoreThread(interp);	/* Switches thread state and locks GIL */
+	Py_XDECREF(inst->pair_list_type);
 	Py_XDECREF(inst->module);
 
-	PyEval_RestoreThread(interp);	/* Switches thread state and locks GIL */
 	Py_EndInterpreter(interp);	/* Destroys interpreter (GIL still locked) - sets thread state to NULL */
 	PyThreadState_Swap(global_interpreter);	/* Get a none-null thread state */
 	PyEval_SaveThread();		/* Unlock GIL */
@@ -952,6 +1187,28 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->name = cf_section_name2(conf);
 	if (!inst->name) inst->name = cf_section_name1(conf);
 
+	/*
+	 *	Built once, as dirname() may modify the
+	 *	filename it's passed.
+	 */
+	inst->path = python_path_build(inst, inst, conf);
+
+	if (inst->per_thread_interpreter) {
+#if defined(Py_GIL_DISABLED)
+		INFO("Python is free-threaded, using a shared interpreter instead of per_thread_interpreter");
+		inst->per_thread_interpreter = false;
+#elif !defined(HAVE_PER_INTERPRETER_GIL)
+		WARN("per_thread_interpreter requires Python >= 3.12, using a shared interpreter");
+		inst->per_thread_interpreter = false;
+#else
+		/*
+		 *	Each thread creates its own interpreter
+		 *	and calls instantiate itself.
+		 */
+		return 0;
+#endif
+	}
+
 	if (python_interpreter_init(inst, conf) < 0) return -1;
 
 	/*
@@ -977,7 +1234,7 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	if (inst->instantiate.function) {
 		rlm_rcode_t rcode;
 
-		do_python_single(&rcode, inst, NULL, inst->instantiate.function, "instantiate");
+		do_python_single(&rcode, inst, inst->pair_list_type, NULL, inst->instantiate.function, "instantiate");
 		switch (rcode) {
 		case RLM_MODULE_FAIL:
 		case RLM_MODULE_REJECT:
@@ -1021,7 +1278,7 @@ static int mod_detach(void *instance)
 	if (inst->detach.function) {
 		rlm_rcode_t rcode;
 
-		(void)do_python_single(&rcode, inst, NULL, inst->detach.function, "detach");
+		(void)do_python_single(&rcode, inst, inst->pair_list_type, NULL, inst->detach.function, "detach");
 	}
 
 #define PYTHON_FUNC_DESTROY(_x) python_function_destroy(&inst->_x)
@@ -1044,13 +1301,125 @@ static int mod_detach(void *instance)
 	return 0;
 }
 
-static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+#ifdef HAVE_PER_INTERPRETER_GIL
+/** Create an interpreter with its own GIL for a single thread
+ *
+ * Loads the functions and calls instantiate in the new interpreter.
+ * On return no GIL is held.
+ */
+static int python_thread_interpreter_init(rlm_python_t const *inst, CONF_SECTION const *conf,
+					  rlm_python_thread_t *t)
+{
+	PyThreadState		*main_state, *state = NULL;
+	PyObject		*config_dict;
+	PyStatus		status;
+	PyInterpreterConfig	config = {
+					.use_main_obmalloc = 0,
+					.allow_fork = 0,
+					.allow_exec = 0,
+					.allow_threads = 1,
+					.allow_daemon_threads = 0,
+					.check_multi_interp_extensions = 1,
+					.gil = PyInterpreterConfig_OWN_GIL
+				};
+
+	/*
+	 *	New interpreters must be created from a thread
+	 *	which holds the GIL of the main interpreter, and
+	 *	global_interpreter belongs to the thread which
+	 *	loaded the module.
+	 */
+	main_state = PyThreadState_New(global_interpreter->interp);
+	if (!main_state) {
+		ERROR("Failed initialising local PyThreadState");
+		return -1;
+	}
+	PyEval_RestoreThread(main_state);
+
+	LSAN_DISABLE(status = Py_NewInterpreterFromConfig(&state, &config));
+	if (PyStatus_Exception(status)) {
+		ERROR("Failed creating new interpreter: %s", status.err_msg ? status.err_msg : "unknown error");
+		PyThreadState_Clear(main_state);
+		PyThreadState_DeleteCurrent();
+		return -1;
+	}
+	DEBUG3("Created new interpreter %p", state);
+
+	/*
+	 *	Py_NewInterpreterFromConfig leaves the new
+	 *	interpreter's thread state current.  Release
+	 *	it so we can dispose of the temporary state.
+	 */
+	PyEval_SaveThread();
+	PyEval_RestoreThread(main_state);
+	PyThreadState_Clear(main_state);
+	PyThreadState_DeleteCurrent();
+
+	PyEval_RestoreThread(state);
+	t->state = state;
+	t->own_interpreter = true;
+
+	if (python_interpreter_setup(inst, conf, &t->module, &config_dict, &t->pair_list_type) < 0) {
+	error:
+		PyEval_SaveThread();
+		return -1;
+	}
+
+#define PYTHON_THREAD_FUNC_LOAD(_x) if (python_function_load(inst, &t->_x) < 0) goto error
+	PYTHON_THREAD_FUNC_LOAD(instantiate);
+	PYTHON_THREAD_FUNC_LOAD(authenticate);
+	PYTHON_THREAD_FUNC_LOAD(authorize);
+	PYTHON_THREAD_FUNC_LOAD(preacct);
+	PYTHON_THREAD_FUNC_LOAD(accounting);
+	PYTHON_THREAD_FUNC_LOAD(post_auth);
+	PYTHON_THREAD_FUNC_LOAD(detach);
+
+	if (t->instantiate.function) {
+		rlm_rcode_t rcode;
+
+		do_python_single(&rcode, inst, t->pair_list_type, NULL, t->instantiate.function, "instantiate");
+		switch (rcode) {
+		case RLM_MODULE_FAIL:
+		case RLM_MODULE_REJECT:
+			goto error;
+
+		default:
+			break;
+		}
+	}
+	PyEval_SaveThread();
+
+	return 0;
+}
+#endif
+
+static int mod_thread_instantiate(CONF_SECTION const *conf, void *instance,
 				  UNUSED fr_event_list_t *el, void *thread)
 {
 	PyThreadState		*state;
 	rlm_python_t		*inst = instance;
 	rlm_python_thread_t	*this_thread = thread;
 
+	this_thread->inst = inst;
+
+	/*
+	 *	With a shared interpreter these are borrowed from
+	 *	the instance, which outlives us.  Otherwise only
+	 *	the module and function names are set, and we
+	 *	load the functions into our own interpreter.
+	 */
+	this_thread->instantiate = inst->instantiate;
+	this_thread->authorize = inst->authorize;
+	this_thread->authenticate = inst->authenticate;
+	this_thread->preacct = inst->preacct;
+	this_thread->accounting = inst->accounting;
+	this_thread->post_auth = inst->post_auth;
+	this_thread->detach = inst->detach;
+
+#ifdef HAVE_PER_INTERPRETER_GIL
+	if (inst->per_thread_interpreter) return python_thread_interpreter_init(inst, conf, this_thread);
+#endif
+
 	state = PyThreadState_New(inst->interpreter->interp);
 	if (!state) {
 		ERROR("Failed initialising local PyThreadState");
@@ -1059,6 +1428,8 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instanc
 
 	DEBUG3("Initialised new thread state %p", state);
 	this_thread->state = state;
+	this_thread->module = inst->module;
+	this_thread->pair_list_type = inst->pair_list_type;
 
 	return 0;
 }
@@ -1067,6 +1438,37 @@ static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
 {
 	rlm_python_thread_t	*this_thread = thread;
 
+	if (!this_thread->state) return 0;
+
+#ifdef HAVE_PER_INTERPRETER_GIL
+	if (this_thread->own_interpreter) {
+		rlm_python_t const *inst = this_thread->inst;
+
+		PyEval_RestoreThread(this_thread->state);
+
+		if (this_thread->detach.function) {
+			rlm_rcode_t rcode;
+
+			(void)do_python_single(&rcode, inst, this_thread->pair_list_type, NULL,
+					       this_thread->detach.function, "detach");
+		}
+
+		python_function_destroy(&this_thread->instantiate);
+		python_function_destroy(&this_thread->authorize);
+		python_function_destroy(&this_thread->authenticate);
+		python_function_destroy(&this_thread->preacct);
+		python_function_destroy(&this_thread->accounting);
+		python_function_destroy(&this_thread->post_auth);
+		python_function_destroy(&this_thread->detach);
+
+		Py_XDECREF(this_thread->pair_list_type);
+		Py_XDECREF(this_thread->module);
+
+		Py_EndInterpreter(this_thread->state);	/* Destroys interpreter and its GIL - sets thread state to NULL */
+		return 0;
+	}
+#endif
+
 	PyEval_RestoreThread(this_thread->state);	/* Swap in our local thread state */
 	PyThreadState_Clear(this_thread->state);
 	PyEval_SaveThread();
@@ -402,14 +402,10 @@ static void radius_fixups(rlm_radius_t const *inst, request_t *request)
 	 *	Check for proxy loops.
 	 */
 	if (RDEBUG_ENABLED) {
-		fr_dcursor_t cursor;
+		fr_pair_list_foreach_by_da(&request->request_pairs, proxy, attr_proxy_state) {
+			if (proxy->vp_length != 4) continue;
 
-		for (vp = fr_dcursor_iter_by_da_init(&cursor, &request->request_pairs, attr_proxy_state);
-		     vp;
-		     vp = fr_dcursor_next(&cursor)) {
-			if (vp->vp_length != 4) continue;
-
-			if (memcmp(&inst->proxy_state, vp->vp_octets, 4) == 0) {
+			if (memcmp(&inst->proxy_state, proxy->vp_octets, 4) == 0) {
 				RWARN("Possible proxy loop - please check server configuration.");
 				break;
 			}
@@ -589,7 +585,7 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	 *	These limits are specific to RADIUS, and cannot be over-ridden
 	 */
 	FR_INTEGER_BOUND_CHECK("trunk.per_connection_max", inst->trunk_conf.max_req_per_conn, >=, 2);
-	FR_INTEGER_BOUND_CHECK("trunk.per_connection_max", inst->trunk_conf.max_req_per_conn, <=, 255);
+	FR_INTEGER_BOUND_CHECK("trunk.per_connection_max", inst->trunk_conf.max_req_per_conn, <=, 65535);	/* Further limited by the transport */
 	FR_INTEGER_BOUND_CHECK("trunk.per_connection_target", inst->trunk_conf.target_req_per_conn, <=, inst->trunk_conf.max_req_per_conn / 2);
 
 	FR_TIME_DELTA_BOUND_CHECK("zombie_period", inst->zombie_period, >=, fr_time_delta_from_sec(1));
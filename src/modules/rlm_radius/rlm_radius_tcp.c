@@ -0,0 +1,2338 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_radius_tcp.c
+ * @brief RADIUS TCP and RADIUS/TLS transport
+ *
+ * Many requests are outstanding on each connection at once, and every
+ * packet the trunk has ready is written in a single call.  Replies are
+ * read in large chunks, and every complete packet in the buffer is
+ * processed before reading again.
+ *
+ * As required by RFC 6613, packets are never retransmitted on the
+ * same connection.  A request which gets no reply within
+ * max_rtx_duration fails.  If status checks are configured, they're
+ * only sent when a connection has been quiet for a while, as an
+ * application layer watchdog, instead of after requests time out.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/io/pair.h>
+#include <freeradius-devel/missing.h>
+#include <freeradius-devel/server/connection.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/heap.h>
+
+#ifdef WITH_TLS
+#  include <freeradius-devel/tls/base.h>
+#  include <freeradius-devel/tls/log.h>
+#endif
+
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+
+#include "rlm_radius.h"
+#include "track.h"
+
+/** Static configuration for the module.
+ *
+ */
+typedef struct {
+	rlm_radius_t		*parent;		//!< rlm_radius instance.
+	CONF_SECTION		*config;
+
+	fr_ipaddr_t		dst_ipaddr;		//!< IP of the home server.
+	fr_ipaddr_t		src_ipaddr;		//!< IP we open our socket on.
+	uint16_t		dst_port;		//!< Port of the home server.
+	char const		*secret;		//!< Shared secret.
+	fr_hmac_md5_key_t	*secret_hmac;		//!< HMAC-MD5 state precomputed from the secret.
+
+	char const		*interface;		//!< Interface to bind to.
+
+	uint32_t		recv_buff;		//!< How big the kernel's receive buffer should be.
+	uint32_t		send_buff;		//!< How big the kernel's send buffer should be.
+
+	uint32_t		max_packet_size;	//!< Maximum packet size.
+	uint16_t		max_send_coalesce;	//!< Maximum number of packets to write in one go.
+
+	bool			recv_buff_is_set;	//!< Whether we were provided with a recv_buf
+	bool			send_buff_is_set;	//!< Whether we were provided with a send_buf
+
+	fr_time_delta_t		keepalive_idle;		//!< How long the connection is idle before
+							///< TCP keepalives are sent.
+	fr_time_delta_t		keepalive_interval;	//!< Time between TCP keepalives.
+	uint32_t		keepalive_count;	//!< How many keepalives can go unanswered.
+
+	fr_time_delta_t		watchdog_interval;	//!< Send a status check when there have been
+							///< no replies for this long.
+
+#ifdef WITH_TLS
+	fr_tls_conf_t		*tls_conf;		//!< TLS configuration.  NULL if we're not using TLS.
+#endif
+
+	fr_trunk_conf_t		*trunk_conf;		//!< trunk configuration
+} rlm_radius_tcp_t;
+
+typedef struct {
+	fr_event_list_t		*el;			//!< Event list.
+
+	rlm_radius_tcp_t const	*inst;			//!< our instance
+
+	fr_trunk_t		*trunk;			//!< trunk handler
+
+#ifdef WITH_TLS
+	SSL_CTX			*ssl_ctx;		//!< Thread local SSL_CTX.
+#endif
+} tcp_thread_t;
+
+typedef struct {
+	fr_trunk_request_t	*treq;
+	rlm_rcode_t		rcode;			//!< from the transport
+} tcp_result_t;
+
+typedef struct tcp_request_s tcp_request_t;
+
+/** Track the handle, which is tightly correlated with the FD
+ *
+ */
+typedef struct {
+	char const     		*name;			//!< From IP PORT to IP PORT.
+	char const		*module_name;		//!< the module that opened the connection
+
+	int			fd;			//!< File descriptor.
+#ifdef WITH_TLS
+	SSL			*ssl;			//!< TLS session.  NULL if we're not using TLS.
+#endif
+
+	rlm_radius_tcp_t const	*inst;			//!< Our module instance.
+	tcp_thread_t		*thread;
+	fr_trunk_connection_t	*tconn;			//!< The trunk connection, once we've been told about it.
+
+	fr_ipaddr_t		src_ipaddr;		//!< Source IP address.
+	uint16_t		src_port;		//!< Source port.
+
+	uint8_t			*recv;			//!< Receive buffer.
+	size_t			recv_size;		//!< How big the receive buffer is.
+	size_t			recv_len;		//!< How much data (partial packets) it holds.
+
+	uint8_t			*send;			//!< Packets which have been sent, as far as the
+							///< trunk is concerned, but not yet written.
+	size_t			send_size;		//!< How big the send buffer is.
+	size_t			send_len;		//!< How much data it holds.
+	size_t			send_pos;		//!< How much of that data has been written.
+
+	radius_track_t		*tt;			//!< RADIUS ID tracking structure.
+
+	fr_trunk_connection_event_t events;		//!< What the trunk last asked to be notified of.
+
+	fr_time_t		last_reply;		//!< When we last received a reply, or when the
+							///< connection was opened.
+
+	fr_event_timer_t const	*watchdog_ev;		//!< Checks whether we need to send a status check.
+
+	bool			status_checking;       	//!< whether a status check is outstanding.
+	tcp_request_t		*status_u;		//!< for sending status check packets
+	tcp_result_t		*status_r;		//!< for faking out status checks as real packets
+	request_t		*status_request;
+} tcp_handle_t;
+
+
+/** Connect request_t to local tracking structure
+ *
+ */
+struct tcp_request_s {
+	uint32_t		priority;		//!< copied from request->async->priority
+	fr_time_t		recv_time;		//!< copied from request->async->recv_time
+
+	bool			require_ma;		//!< saved from the original packet.
+	bool			status_check;		//!< is this packet a status check?
+
+	fr_pair_list_t		extra;			//!< VPs for debugging, like Proxy-State.
+
+	uint8_t			code;			//!< Packet code.
+	uint8_t			id;			//!< ID assigned to this packet.
+	uint8_t			*packet;		//!< Packet we write to the network.
+	size_t			packet_len;		//!< Length of the packet.
+
+	fr_time_t		start;			//!< When the packet was encoded.
+
+	radius_track_entry_t	*rr;			//!< ID tracking.
+	fr_event_timer_t const	*ev;			//!< timer for the response window
+};
+
+static const CONF_PARSER module_config[] = {
+	{ FR_CONF_OFFSET("ipaddr", FR_TYPE_COMBO_IP_ADDR, rlm_radius_tcp_t, dst_ipaddr), },
+	{ FR_CONF_OFFSET("ipv4addr", FR_TYPE_IPV4_ADDR, rlm_radius_tcp_t, dst_ipaddr) },
+	{ FR_CONF_OFFSET("ipv6addr", FR_TYPE_IPV6_ADDR, rlm_radius_tcp_t, dst_ipaddr) },
+
+	{ FR_CONF_OFFSET("port", FR_TYPE_UINT16, rlm_radius_tcp_t, dst_port) },
+
+	{ FR_CONF_OFFSET("secret", FR_TYPE_STRING, rlm_radius_tcp_t, secret) },
+
+	{ FR_CONF_OFFSET("interface", FR_TYPE_STRING, rlm_radius_tcp_t, interface) },
+
+	{ FR_CONF_OFFSET_IS_SET("recv_buff", FR_TYPE_UINT32, rlm_radius_tcp_t, recv_buff) },
+	{ FR_CONF_OFFSET_IS_SET("send_buff", FR_TYPE_UINT32, rlm_radius_tcp_t, send_buff) },
+
+	{ FR_CONF_OFFSET("max_packet_size", FR_TYPE_UINT32, rlm_radius_tcp_t, max_packet_size), .dflt = "4096" },
+	{ FR_CONF_OFFSET("max_send_coalesce", FR_TYPE_UINT16, rlm_radius_tcp_t, max_send_coalesce), .dflt = "1024" },
+
+	{ FR_CONF_OFFSET("keepalive_idle", FR_TYPE_TIME_DELTA, rlm_radius_tcp_t, keepalive_idle), .dflt = "30" },
+	{ FR_CONF_OFFSET("keepalive_interval", FR_TYPE_TIME_DELTA, rlm_radius_tcp_t, keepalive_interval), .dflt = "10" },
+	{ FR_CONF_OFFSET("keepalive_count", FR_TYPE_UINT32, rlm_radius_tcp_t, keepalive_count), .dflt = "3" },
+
+	{ FR_CONF_OFFSET("watchdog_interval", FR_TYPE_TIME_DELTA, rlm_radius_tcp_t, watchdog_interval), .dflt = "30" },
+
+	{ FR_CONF_OFFSET("src_ipaddr", FR_TYPE_COMBO_IP_ADDR, rlm_radius_tcp_t, src_ipaddr) },
+	{ FR_CONF_OFFSET("src_ipv4addr", FR_TYPE_IPV4_ADDR, rlm_radius_tcp_t, src_ipaddr) },
+	{ FR_CONF_OFFSET("src_ipv6addr", FR_TYPE_IPV6_ADDR, rlm_radius_tcp_t, src_ipaddr) },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static fr_dict_t const *dict_radius;
+
+extern fr_dict_autoload_t rlm_radius_tcp_dict[];
+fr_dict_autoload_t rlm_radius_tcp_dict[] = {
+	{ .out = &dict_radius, .proto = "radius" },
+	{ NULL }
+};
+
+static fr_dict_attr_t const *attr_acct_delay_time;
+static fr_dict_attr_t const *attr_event_timestamp;
+static fr_dict_attr_t const *attr_extended_attribute_1;
+static fr_dict_attr_t const *attr_message_authenticator;
+static fr_dict_attr_t const *attr_nas_identifier;
+static fr_dict_attr_t const *attr_original_packet_code;
+static fr_dict_attr_t const *attr_proxy_state;
+static fr_dict_attr_t const *attr_user_password;
+static fr_dict_attr_t const *attr_packet_type;
+
+extern fr_dict_attr_autoload_t rlm_radius_tcp_dict_attr[];
+fr_dict_attr_autoload_t rlm_radius_tcp_dict_attr[] = {
+	{ .out = &attr_acct_delay_time, .name = "Acct-Delay-Time", .type = FR_TYPE_UINT32, .dict = &dict_radius},
+	{ .out = &attr_event_timestamp, .name = "Event-Timestamp", .type = FR_TYPE_DATE, .dict = &dict_radius},
+	{ .out = &attr_extended_attribute_1, .name = "Extended-Attribute-1", .type = FR_TYPE_TLV, .dict = &dict_radius},
+	{ .out = &attr_message_authenticator, .name = "Message-Authenticator", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
+	{ .out = &attr_nas_identifier, .name = "NAS-Identifier", .type = FR_TYPE_STRING, .dict = &dict_radius},
+	{ .out = &attr_original_packet_code, .name = "Extended-Attribute-1.Original-Packet-Code", .type = FR_TYPE_UINT32, .dict = &dict_radius},
+	{ .out = &attr_proxy_state, .name = "Proxy-State", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
+	{ .out = &attr_user_password, .name = "User-Password", .type = FR_TYPE_STRING, .dict = &dict_radius},
+	{ .out = &attr_packet_type, .name = "Packet-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius },
+	{ NULL }
+};
+
+/** If we get a reply, the request must come from one of a small
+ * number of packet types.
+ */
+static fr_radius_packet_code_t allowed_replies[FR_RADIUS_CODE_MAX] = {
+	[FR_RADIUS_CODE_ACCESS_ACCEPT]		= FR_RADIUS_CODE_ACCESS_REQUEST,
+	[FR_RADIUS_CODE_ACCESS_CHALLENGE]	= FR_RADIUS_CODE_ACCESS_REQUEST,
+	[FR_RADIUS_CODE_ACCESS_REJECT]		= FR_RADIUS_CODE_ACCESS_REQUEST,
+
+	[FR_RADIUS_CODE_ACCOUNTING_RESPONSE]	= FR_RADIUS_CODE_ACCOUNTING_REQUEST,
+
+	[FR_RADIUS_CODE_COA_ACK]		= FR_RADIUS_CODE_COA_REQUEST,
+	[FR_RADIUS_CODE_COA_NAK]		= FR_RADIUS_CODE_COA_REQUEST,
+
+	[FR_RADIUS_CODE_DISCONNECT_ACK]	= FR_RADIUS_CODE_DISCONNECT_REQUEST,
+	[FR_RADIUS_CODE_DISCONNECT_NAK]	= FR_RADIUS_CODE_DISCONNECT_REQUEST,
+
+	[FR_RADIUS_CODE_PROTOCOL_ERROR]	= FR_RADIUS_CODE_PROTOCOL_ERROR,	/* Any */
+};
+
+/** Turn a reply code into a module rcode;
+ *
+ */
+static rlm_rcode_t radius_code_to_rcode[FR_RADIUS_CODE_MAX] = {
+	[FR_RADIUS_CODE_ACCESS_ACCEPT]		= RLM_MODULE_OK,
+	[FR_RADIUS_CODE_ACCESS_CHALLENGE]	= RLM_MODULE_UPDATED,
+	[FR_RADIUS_CODE_ACCESS_REJECT]		= RLM_MODULE_REJECT,
+
+	[FR_RADIUS_CODE_ACCOUNTING_RESPONSE]	= RLM_MODULE_OK,
+
+	[FR_RADIUS_CODE_COA_ACK]		= RLM_MODULE_OK,
+	[FR_RADIUS_CODE_COA_NAK]		= RLM_MODULE_REJECT,
+
+	[FR_RADIUS_CODE_DISCONNECT_ACK]	= RLM_MODULE_OK,
+	[FR_RADIUS_CODE_DISCONNECT_NAK]	= RLM_MODULE_REJECT,
+
+	[FR_RADIUS_CODE_PROTOCOL_ERROR]	= RLM_MODULE_HANDLED,
+};
+
+static void		conn_readable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx);
+
+static void		conn_writable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx);
+
+static void		conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx);
+
+#ifndef NDEBUG
+/** Log additional information about a tracking entry
+ *
+ * @param[in] te	Tracking entry we're logging information for.
+ * @param[in] log	destination.
+ * @param[in] log_type	Type of log message.
+ * @param[in] file	the logging request was made in.
+ * @param[in] line 	logging request was made on.
+ */
+static void tcp_tracking_entry_log(fr_log_t const *log, fr_log_type_t log_type, char const *file, int line,
+				   radius_track_entry_t *te)
+{
+	request_t			*request;
+
+	if (!te->request) return;	/* Free entry */
+
+	request = talloc_get_type_abort(te->request, request_t);
+
+	fr_log(log, log_type, file, line, "request %s, allocated %s:%u", request->name,
+	       request->alloc_file, request->alloc_line);
+
+	fr_trunk_request_state_log(log, log_type, file, line, talloc_get_type_abort(te->uctx, fr_trunk_request_t));
+}
+#endif
+
+/** Clear out any connection specific resources from a tcp request
+ *
+ */
+static void tcp_request_reset(tcp_request_t *u)
+{
+	TALLOC_FREE(u->packet);
+	fr_pair_list_init(&u->extra);	/* Freed with packet */
+
+	if (u->rr) radius_track_entry_release(&u->rr);
+}
+
+/*
+ *	Status-Server checks.  Manually build the packet, and
+ *	all of its associated glue.
+ */
+static void CC_HINT(nonnull) status_check_alloc(fr_event_list_t *el, tcp_handle_t *h)
+{
+	tcp_request_t		*u;
+	request_t		*request;
+	rlm_radius_tcp_t const	*inst = h->inst;
+	map_t			*map = NULL;
+
+	fr_assert(!h->status_u && !h->status_r && !h->status_request);
+
+	u = talloc_zero(h, tcp_request_t);
+	fr_pair_list_init(&u->extra);
+
+	/*
+	 *	Status checks are prioritized over any other packet
+	 */
+	u->priority = ~(uint32_t) 0;
+	u->status_check = true;
+
+	/*
+	 *	Allocate outside of the free list, for the same
+	 *	reasons as the UDP transport.
+	 */
+	request = request_local_alloc_external(u, NULL);
+	request->async = talloc_zero(request, fr_async_t);
+	talloc_const_free(request->name);
+	request->name = talloc_strdup(request, h->module_name);
+
+	request->el = el;
+	request->packet = fr_radius_packet_alloc(request, false);
+	request->reply = fr_radius_packet_alloc(request, false);
+
+	/*
+	 *	Create the VPs, and ignore any errors
+	 *	creating them.
+	 */
+	while ((map = fr_dlist_next(&inst->parent->status_check_map, map))) {
+		/*
+		 *	Skip things which aren't attributes.
+		 */
+		if (!tmpl_is_attr(map->lhs)) continue;
+
+		/*
+		 *	Ignore internal attributes.
+		 */
+		if (tmpl_da(map->lhs)->flags.internal) continue;
+
+		/*
+		 *	Ignore signalling attributes.  They shouldn't exist.
+		 */
+		if ((tmpl_da(map->lhs) == attr_proxy_state) ||
+		    (tmpl_da(map->lhs) == attr_message_authenticator)) continue;
+
+		/*
+		 *	Allow passwords only in Access-Request packets.
+		 */
+		if ((inst->parent->status_check != FR_RADIUS_CODE_ACCESS_REQUEST) &&
+		    (tmpl_da(map->lhs) == attr_user_password)) continue;
+
+		(void) map_to_request(request, map, map_to_vp, NULL);
+	}
+
+	/*
+	 *	Ensure that there's a NAS-Identifier, if one wasn't
+	 *	already added.
+	 */
+	if (!fr_pair_find_by_da(&request->request_pairs, attr_nas_identifier, 0)) {
+		fr_pair_t *vp;
+
+		MEM(pair_append_request(&vp, attr_nas_identifier) >= 0);
+		fr_pair_value_strdup(vp, "status check - are you alive?");
+	}
+
+	/*
+	 *	Always add an Event-Timestamp, which will be the time
+	 *	at which the packet is sent.
+	 */
+	if (!fr_pair_find_by_da(&request->request_pairs, attr_event_timestamp, 0)) {
+		MEM(pair_append_request(NULL, attr_event_timestamp) >= 0);
+	}
+
+	u->code = inst->parent->status_check;
+	request->packet->code = u->code;
+
+	DEBUG3("%s - Status check packet type will be %s", h->module_name, fr_packet_codes[u->code]);
+	log_request_pair_list(L_DBG_LVL_3, request, NULL, &request->request_pairs, NULL);
+
+	MEM(h->status_r = talloc_zero(request, tcp_result_t));
+	h->status_u = u;
+	h->status_request = request;
+}
+
+/** Read from the connection
+ *
+ * @param[in] h		to read from.
+ * @param[out] buffer	to read into.
+ * @param[in] buflen	how much room there is in the buffer.
+ * @return
+ *	- >0 the number of bytes read.
+ *	- 0 if there's nothing to read.
+ *	- -1 if the connection was closed, or failed.
+ */
+static ssize_t tcp_recv(tcp_handle_t *h, uint8_t *buffer, size_t buflen)
+{
+	ssize_t		slen;
+
+#ifdef WITH_TLS
+	if (h->ssl) {
+		int ret;
+
+		ERR_clear_error();
+		ret = SSL_read(h->ssl, buffer, buflen);
+		if (ret > 0) return ret;
+
+		switch (SSL_get_error(h->ssl, ret)) {
+		/*
+		 *	We only wait for the socket to become
+		 *	readable.  TLS 1.3 doesn't renegotiate,
+		 *	so a read should never need a write.
+		 */
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			return 0;
+
+		case SSL_ERROR_ZERO_RETURN:
+			ERROR("%s - Connection %s closed by the home server", h->module_name, h->name);
+			return -1;
+
+		default:
+			fr_tls_log_strerror_printf("Failed reading from TLS session");
+			PERROR("%s - Connection %s failed", h->module_name, h->name);
+			return -1;
+		}
+	}
+#endif
+
+	slen = read(h->fd, buffer, buflen);
+	if (slen > 0) return slen;
+
+	if (slen == 0) {
+		ERROR("%s - Connection %s closed by the home server", h->module_name, h->name);
+		return -1;
+	}
+
+	switch (errno) {
+#if defined(EWOULDBLOCK) && (EWOULDBLOCK != EAGAIN)
+	case EWOULDBLOCK:
+#endif
+	case EAGAIN:
+	case EINTR:
+		return 0;
+
+	default:
+		ERROR("%s - Failed reading from connection %s: %s", h->module_name, h->name, fr_syserror(errno));
+		return -1;
+	}
+}
+
+/** Write to the connection
+ *
+ * @param[in] h		to write to.
+ * @param[in] buffer	to write.
+ * @param[in] buflen	how much data to write.
+ * @return
+ *	- >0 the number of bytes written.
+ *	- 0 if the connection can't accept more data just now.
+ *	- -1 if the connection failed.
+ */
+static ssize_t tcp_send(tcp_handle_t *h, uint8_t const *buffer, size_t buflen)
+{
+	ssize_t		slen;
+
+#ifdef WITH_TLS
+	if (h->ssl) {
+		int ret;
+
+		/*
+		 *	The session is set up for partial writes, and
+		 *	retries always start with the bytes which
+		 *	weren't written last time.
+		 */
+		ERR_clear_error();
+		ret = SSL_write(h->ssl, buffer, buflen);
+		if (ret > 0) return ret;
+
+		switch (SSL_get_error(h->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			return 0;
+
+		default:
+			fr_tls_log_strerror_printf("Failed writing to TLS session");
+			PERROR("%s - Connection %s failed", h->module_name, h->name);
+			return -1;
+		}
+	}
+#endif
+
+#ifdef MSG_NOSIGNAL
+	slen = send(h->fd, buffer, buflen, MSG_NOSIGNAL);
+#else
+	slen = write(h->fd, buffer, buflen);
+#endif
+	if (slen >= 0) return slen;
+
+	switch (errno) {
+#if defined(EWOULDBLOCK) && (EWOULDBLOCK != EAGAIN)
+	case EWOULDBLOCK:
+#endif
+	case EAGAIN:
+	case EINTR:
+	case ENOBUFS:
+		return 0;
+
+	default:
+		ERROR("%s - Failed writing to connection %s: %s", h->module_name, h->name, fr_syserror(errno));
+		return -1;
+	}
+}
+
+/** Write out as much of the send buffer as the connection will take
+ *
+ * @return
+ *	- 0 if everything was written.
+ *	- 1 if there's data left to write.
+ *	- -1 if the connection failed.
+ */
+static int tcp_flush(tcp_handle_t *h)
+{
+	while (h->send_pos < h->send_len) {
+		ssize_t slen;
+
+		slen = tcp_send(h, h->send + h->send_pos, h->send_len - h->send_pos);
+		if (slen < 0) return -1;
+		if (slen == 0) return 1;
+
+		h->send_pos += slen;
+	}
+
+	h->send_pos = h->send_len = 0;
+
+	return 0;
+}
+
+/** Free a connection handle, closing associated resources
+ *
+ */
+static int _tcp_handle_free(tcp_handle_t *h)
+{
+	fr_assert(h->fd >= 0);
+
+	if (h->status_u) fr_event_timer_delete(&h->status_u->ev);
+
+	fr_event_fd_delete(h->thread->el, h->fd, FR_EVENT_FILTER_IO);
+
+#ifdef WITH_TLS
+	if (h->ssl) {
+		/*
+		 *	Best effort.  We don't wait for the home
+		 *	server to acknowledge the close.
+		 */
+		(void) SSL_shutdown(h->ssl);
+		SSL_free(h->ssl);
+		h->ssl = NULL;
+	}
+#endif
+
+	if (shutdown(h->fd, SHUT_RDWR) < 0) {
+		DEBUG3("%s - Failed shutting down connection %s: %s",
+		       h->module_name, h->name, fr_syserror(errno));
+	}
+
+	if (close(h->fd) < 0) {
+		DEBUG3("%s - Failed closing connection %s: %s",
+		       h->module_name, h->name, fr_syserror(errno));
+	}
+
+	h->fd = -1;
+
+	DEBUG("%s - Connection closed - %s", h->module_name, h->name);
+
+	return 0;
+}
+
+/** Connection errored before it was open
+ *
+ * @param[in] el	The event list signalling.
+ * @param[in] fd	that errored.
+ * @param[in] flags	El flags.
+ * @param[in] fd_errno	The nature of the error.
+ * @param[in] uctx	The connection.
+ */
+static void conn_error_connecting(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	fr_connection_t		*conn = talloc_get_type_abort(uctx, fr_connection_t);
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+
+	ERROR("%s - Connection %s failed: %s", h->module_name, h->name, fr_syserror(fd_errno));
+
+	fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+}
+
+#ifdef WITH_TLS
+/** Continue the TLS handshake
+ *
+ * Called when the socket first becomes writable (i.e. the TCP connection
+ * is open), and then whenever the socket is ready for the next step of
+ * the handshake.
+ */
+static void conn_tls_handshake(fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	fr_connection_t		*conn = talloc_get_type_abort(uctx, fr_connection_t);
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+	int			ret;
+
+	ERR_clear_error();
+	ret = SSL_connect(h->ssl);
+	if (ret == 1) {
+		DEBUG("%s - TLS session established using %s - %s", h->module_name,
+		      SSL_get_version(h->ssl), h->name);
+
+		fr_event_fd_delete(el, fd, FR_EVENT_FILTER_IO);
+		fr_connection_signal_connected(conn);
+		return;
+	}
+
+	switch (SSL_get_error(h->ssl, ret)) {
+	case SSL_ERROR_WANT_READ:
+		if (fr_event_fd_insert(h, el, fd, conn_tls_handshake, NULL, conn_error_connecting, conn) < 0) break;
+		return;
+
+	case SSL_ERROR_WANT_WRITE:
+		if (fr_event_fd_insert(h, el, fd, NULL, conn_tls_handshake, conn_error_connecting, conn) < 0) break;
+		return;
+
+	default:
+		fr_tls_log_strerror_printf("TLS handshake failed");
+		break;
+	}
+
+	PERROR("%s - Failed connecting %s", h->module_name, h->name);
+	fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+}
+#endif
+
+/** Set the socket options for a new connection
+ *
+ */
+static void tcp_socket_options(tcp_handle_t *h, int fd)
+{
+	rlm_radius_tcp_t const	*inst = h->inst;
+	int			opt;
+
+	/*
+	 *	We already write packets in batches, so there's
+	 *	nothing to gain from the kernel delaying them.
+	 */
+	opt = 1;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) < 0) {
+		WARN("%s - Failed setting 'TCP_NODELAY': %s", h->module_name, fr_syserror(errno));
+	}
+
+#ifdef SO_RCVBUF
+	if (inst->recv_buff_is_set) {
+		opt = inst->recv_buff;
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(int)) < 0) {
+			WARN("%s - Failed setting 'SO_RCVBUF': %s", h->module_name, fr_syserror(errno));
+		}
+	}
+#endif
+
+#ifdef SO_SNDBUF
+	if (inst->send_buff_is_set) {
+		opt = inst->send_buff;
+		if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(int)) < 0) {
+			WARN("%s - Failed setting 'SO_SNDBUF', write performance may be sub-optimal: %s",
+			     h->module_name, fr_syserror(errno));
+		}
+	}
+#endif
+
+	/*
+	 *	Let the kernel notice dead connections, so that
+	 *	idle connections don't need status checks.
+	 */
+	if (!inst->keepalive_idle) return;
+
+	opt = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt)) < 0) {
+		WARN("%s - Failed setting 'SO_KEEPALIVE': %s", h->module_name, fr_syserror(errno));
+		return;
+	}
+
+#if defined(TCP_KEEPIDLE)
+	opt = fr_time_delta_to_sec(inst->keepalive_idle);
+	if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &opt, sizeof(opt)) < 0) {
+		WARN("%s - Failed setting 'TCP_KEEPIDLE': %s", h->module_name, fr_syserror(errno));
+	}
+#elif defined(TCP_KEEPALIVE)
+	opt = fr_time_delta_to_sec(inst->keepalive_idle);
+	if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, &opt, sizeof(opt)) < 0) {
+		WARN("%s - Failed setting 'TCP_KEEPALIVE': %s", h->module_name, fr_syserror(errno));
+	}
+#endif
+
+#ifdef TCP_KEEPINTVL
+	opt = fr_time_delta_to_sec(inst->keepalive_interval);
+	if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &opt, sizeof(opt)) < 0) {
+		WARN("%s - Failed setting 'TCP_KEEPINTVL': %s", h->module_name, fr_syserror(errno));
+	}
+#endif
+
+#ifdef TCP_KEEPCNT
+	opt = inst->keepalive_count;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &opt, sizeof(opt)) < 0) {
+		WARN("%s - Failed setting 'TCP_KEEPCNT': %s", h->module_name, fr_syserror(errno));
+	}
+#endif
+}
+
+/** Initialise a new outbound connection
+ *
+ * @param[out] h_out	Where to write the new file descriptor.
+ * @param[in] conn	to initialise.
+ * @param[in] uctx	A #tcp_thread_t
+ */
+static fr_connection_state_t conn_init(void **h_out, fr_connection_t *conn, void *uctx)
+{
+	int			fd;
+	tcp_handle_t		*h;
+	tcp_thread_t		*thread = talloc_get_type_abort(uctx, tcp_thread_t);
+	struct sockaddr_storage	salocal;
+	socklen_t		salen;
+
+	MEM(h = talloc_zero(conn, tcp_handle_t));
+	h->thread = thread;
+	h->inst = thread->inst;
+	h->module_name = h->inst->parent->name;
+	h->src_ipaddr = h->inst->src_ipaddr;
+
+	/*
+	 *	Read as much as we can in one go, so that we
+	 *	get many replies for each system call.
+	 */
+	h->recv_size = h->inst->max_packet_size;
+	if (h->recv_size < 65536) h->recv_size = 65536;
+	MEM(h->recv = talloc_array(h, uint8_t, h->recv_size));
+
+	/*
+	 *	The send buffer always has room for at least one
+	 *	packet.
+	 */
+	h->send_size = h->inst->send_buff_is_set ? h->inst->send_buff : 65536;
+	if (h->send_size < h->inst->max_packet_size) h->send_size = h->inst->max_packet_size;
+	MEM(h->send = talloc_array(h, uint8_t, h->send_size));
+
+	MEM(h->tt = radius_track_alloc(h));
+
+	/*
+	 *	Open the outgoing socket.  The connection completes
+	 *	asynchronously.
+	 */
+	fd = fr_socket_client_tcp(&h->src_ipaddr, &h->inst->dst_ipaddr, h->inst->dst_port, true);
+	if (fd < 0) {
+		PERROR("%s - Failed opening socket", h->module_name);
+		goto fail;
+	}
+	h->fd = fd;
+
+	talloc_set_destructor(h, _tcp_handle_free);
+
+	salen = sizeof(salocal);
+	if ((getsockname(fd, (struct sockaddr *) &salocal, &salen) < 0) ||
+	    (fr_ipaddr_from_sockaddr(&h->src_ipaddr, &h->src_port, &salocal, salen) < 0)) {
+		h->src_port = 0;
+	}
+
+	/*
+	 *	Set the connection name.
+	 */
+	h->name = fr_asprintf(h, "proto %s local %pV port %u remote %pV port %u",
+#ifdef WITH_TLS
+			      h->inst->tls_conf ? "tls" : "tcp",
+#else
+			      "tcp",
+#endif
+			      fr_box_ipaddr(h->src_ipaddr), h->src_port,
+			      fr_box_ipaddr(h->inst->dst_ipaddr), h->inst->dst_port);
+
+	tcp_socket_options(h, fd);
+
+	h->last_reply = fr_time();
+
+	if (h->inst->parent->status_check) status_check_alloc(conn->el, h);
+
+#ifdef WITH_TLS
+	if (h->inst->tls_conf) {
+		h->ssl = SSL_new(thread->ssl_ctx);
+		if (!h->ssl) {
+			fr_tls_log_strerror_printf("Failed allocating TLS session");
+			PERROR("%s - Failed connecting %s", h->module_name, h->name);
+			goto fail;
+		}
+
+		SSL_set_mode(h->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+		SSL_set_connect_state(h->ssl);
+		if (SSL_set_fd(h->ssl, fd) != 1) {
+			fr_tls_log_strerror_printf("Failed binding TLS session to socket");
+			PERROR("%s - Failed connecting %s", h->module_name, h->name);
+			goto fail;
+		}
+
+		/*
+		 *	Start the handshake once the TCP connection
+		 *	is open.
+		 */
+		if (fr_event_fd_insert(h, conn->el, fd, NULL,
+				       conn_tls_handshake, conn_error_connecting, conn) < 0) goto fail;
+
+		*h_out = h;
+		return FR_CONNECTION_STATE_CONNECTING;
+	}
+#endif
+
+	/*
+	 *	Signal the connection as open as soon as it becomes
+	 *	writable.
+	 */
+	fr_connection_signal_on_fd(conn, fd);
+
+	*h_out = h;
+
+	return FR_CONNECTION_STATE_CONNECTING;
+
+fail:
+	talloc_free(h);
+	return FR_CONNECTION_STATE_FAILED;
+}
+
+/** Shutdown/close a file descriptor
+ *
+ */
+static void conn_close(UNUSED fr_event_list_t *el, void *handle, UNUSED void *uctx)
+{
+	tcp_handle_t *h = talloc_get_type_abort(handle, tcp_handle_t);
+
+	/*
+	 *	There's tracking entries still allocated
+	 *	this is bad, they should have all been
+	 *	released.
+	 */
+	if (h->tt && (h->tt->num_requests != 0)) {
+#ifndef NDEBUG
+		radius_track_state_log(&default_log, L_ERR, __FILE__, __LINE__, h->tt, tcp_tracking_entry_log);
+#endif
+		fr_assert_fail("%u tracking entries still allocated at conn close", h->tt->num_requests);
+	}
+
+	DEBUG4("Freeing rlm_radius_tcp handle %p", handle);
+
+	talloc_free(h);
+}
+
+/** Connection failed
+ *
+ * @param[in] handle   	of connection that failed.
+ * @param[in] state	the connection was in when it failed.
+ * @param[in] uctx	UNUSED.
+ */
+static fr_connection_state_t conn_failed(void *handle, fr_connection_state_t state, UNUSED void *uctx)
+{
+	switch (state) {
+	/*
+	 *	If the connection was connected when it failed,
+	 *	stop the watchdog, and any status check.
+	 */
+	case FR_CONNECTION_STATE_CONNECTED:
+	{
+		tcp_handle_t	*h = talloc_get_type_abort(handle, tcp_handle_t); /* h only available if connected */
+
+		if (h->watchdog_ev) (void) fr_event_timer_delete(&h->watchdog_ev);
+		if (h->status_u && h->status_u->ev) (void) fr_event_timer_delete(&h->status_u->ev);
+	}
+		break;
+
+	default:
+		break;
+	}
+
+	return FR_CONNECTION_STATE_INIT;
+}
+
+static fr_connection_t *thread_conn_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
+					  fr_connection_conf_t const *conf,
+					  char const *log_prefix, void *uctx)
+{
+	fr_connection_t		*conn;
+	tcp_thread_t		*thread = talloc_get_type_abort(uctx, tcp_thread_t);
+
+	conn = fr_connection_alloc(tconn, el,
+				   &(fr_connection_funcs_t){
+					.init = conn_init,
+					.close = conn_close,
+					.failed = conn_failed
+				   },
+				   conf,
+				   log_prefix,
+				   thread);
+	if (!conn) {
+		PERROR("%s - Failed allocating state handler for new connection", thread->inst->parent->name);
+		return NULL;
+	}
+
+	return conn;
+}
+
+/** Register for the I/O events we need
+ *
+ * We always read, so that we notice the home server closing the
+ * connection, even when there are no requests outstanding.  We write
+ * when the trunk has requests for us, or when there's data left over
+ * from the last write.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int tcp_events_update(tcp_handle_t *h)
+{
+	fr_event_fd_cb_t	write_fn = NULL;
+
+	if ((h->events & FR_TRUNK_CONN_EVENT_WRITE) || (h->send_pos < h->send_len)) write_fn = conn_writable;
+
+	if (fr_event_fd_insert(h, h->thread->el, h->fd, conn_readable, write_fn, conn_error, h->tconn) < 0) {
+		PERROR("%s - Failed inserting FD event", h->module_name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Standard I/O read function
+ *
+ * Underlying FD in now readable, so call the trunk to read any pending requests
+ * from this connection.
+ *
+ * @param[in] el	The event list signalling.
+ * @param[in] fd	that's now readable.
+ * @param[in] flags	describing the read event.
+ * @param[in] uctx	The trunk connection handle (tconn).
+ */
+static void conn_readable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	fr_trunk_connection_signal_readable(tconn);
+}
+
+/** Standard I/O write function
+ *
+ * Finish writing any data left over from the last write, then call the
+ * trunk to write any pending requests.
+ *
+ * @param[in] el	The event list signalling.
+ * @param[in] fd	that's now writable.
+ * @param[in] flags	describing the write event.
+ * @param[in] uctx	The trunk connection handle (tcon).
+ */
+static void conn_writable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	tcp_handle_t		*h = talloc_get_type_abort(tconn->conn->h, tcp_handle_t);
+
+	if (h->send_pos < h->send_len) {
+		switch (tcp_flush(h)) {
+		case -1:
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+
+		case 1:
+			return;
+
+		default:
+			break;
+		}
+
+		/*
+		 *	Stop watching for writes if the trunk
+		 *	doesn't need them.
+		 */
+		if (!(h->events & FR_TRUNK_CONN_EVENT_WRITE)) {
+			if (tcp_events_update(h) < 0) fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+		}
+	}
+
+	fr_trunk_connection_signal_writable(tconn);
+}
+
+/** Connection errored
+ *
+ * We were signalled by the event loop that a fatal error occurred on this connection.
+ *
+ * @param[in] el	The event list signalling.
+ * @param[in] fd	that errored.
+ * @param[in] flags	El flags.
+ * @param[in] fd_errno	The nature of the error.
+ * @param[in] uctx	The trunk connection handle (tconn).
+ */
+static void conn_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, int fd_errno, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	fr_connection_t		*conn = tconn->conn;
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+
+	ERROR("%s - Connection %s failed: %s", h->module_name, h->name, fr_syserror(fd_errno));
+
+	fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+}
+
+/** Send a status check if the connection has been quiet for too long
+ *
+ * This is the application layer watchdog described in RFC 6613
+ * section 2.6.  It replaces the status checks the UDP transport does
+ * when requests time out.
+ */
+static void watchdog_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(uctx, tcp_handle_t);
+	fr_time_t		when = h->last_reply + h->inst->watchdog_interval;
+
+	/*
+	 *	We've had a reply recently, or we're already
+	 *	waiting for the reply to a status check.
+	 */
+	if (h->status_checking || (when > now)) {
+		if (h->status_checking) when = now + h->inst->watchdog_interval;
+		goto rearm;
+	}
+
+	DEBUG("%s - No replies for %pVs, sending status check on connection %s",
+	      h->module_name, fr_box_time_delta(now - h->last_reply), h->name);
+
+	h->status_checking = true;
+	h->status_r->treq = NULL;
+	if (fr_trunk_request_enqueue_on_conn(&h->status_r->treq, h->tconn, h->status_request,
+					     h->status_u, h->status_r, true) != FR_TRUNK_ENQUEUE_OK) {
+		h->status_checking = false;
+		fr_trunk_connection_signal_reconnect(h->tconn, FR_CONNECTION_FAILED);
+		return;
+	}
+	when = now + h->inst->watchdog_interval;
+
+rearm:
+	if (fr_event_timer_at(h, el, &h->watchdog_ev, when, watchdog_timer, h) < 0) {
+		PERROR("%s - Failed inserting watchdog timer", h->module_name);
+		fr_trunk_connection_signal_reconnect(h->tconn, FR_CONNECTION_FAILED);
+	}
+}
+
+static void thread_conn_notify(fr_trunk_connection_t *tconn, fr_connection_t *conn,
+			       fr_event_list_t *el,
+			       fr_trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+
+	h->tconn = tconn;
+	h->events = notify_on;
+
+	/*
+	 *	Start the watchdog the first time we're told
+	 *	about the connection.
+	 */
+	if (h->status_u && !h->watchdog_ev && h->inst->watchdog_interval) {
+		if (fr_event_timer_at(h, el, &h->watchdog_ev, fr_time() + h->inst->watchdog_interval,
+				      watchdog_timer, h) < 0) {
+			PERROR("%s - Failed inserting watchdog timer", h->module_name);
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+		}
+	}
+
+	/*
+	 *	May free the connection!
+	 */
+	if (tcp_events_update(h) < 0) fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+}
+
+/*
+ *  Return negative numbers to put 'a' at the top of the heap.
+ *  Return positive numbers to put 'b' at the top of the heap.
+ *
+ *  We want the value with the lowest timestamp to be prioritized at
+ *  the top of the heap.
+ */
+static int8_t request_prioritise(void const *one, void const *two)
+{
+	tcp_request_t const *a = one;
+	tcp_request_t const *b = two;
+	int8_t ret;
+
+	/*
+	 *	Prioritise status check packets
+	 */
+	ret = (b->status_check - a->status_check);
+	if (ret != 0) return ret;
+
+	/*
+	 *	Larger priority is more important.
+	 */
+	ret = (a->priority < b->priority) - (a->priority > b->priority);
+	if (ret != 0) return ret;
+
+	/*
+	 *	Smaller timestamp (i.e. earlier) is more important.
+	 */
+	return (a->recv_time > b->recv_time) - (a->recv_time < b->recv_time);
+}
+
+/** Decode response packet data, extracting relevant information and validating the packet
+ *
+ * @param[in] ctx			to allocate pairs in.
+ * @param[out] reply			Pointer to head of pair list to add reply attributes to.
+ * @param[out] response_code		The type of response packet.
+ * @param[in] h				connection handle.
+ * @param[in] request			the request.
+ * @param[in] u				TCP request.
+ * @param[in] request_authenticator	from the original request.
+ * @param[in] data			to decode.
+ * @param[in] data_len			Length of input data.
+ * @return
+ *	- DECODE_FAIL_NONE on success.
+ *	- DECODE_FAIL_* on failure.
+ */
+static decode_fail_t decode(TALLOC_CTX *ctx, fr_pair_list_t *reply, uint8_t *response_code,
+			    tcp_handle_t *h, request_t *request, tcp_request_t *u,
+			    uint8_t const request_authenticator[static RADIUS_AUTH_VECTOR_LENGTH],
+			    uint8_t *data, size_t data_len)
+{
+	rlm_radius_tcp_t const	*inst = h->inst;
+	size_t			packet_len;
+	decode_fail_t		reason;
+	uint8_t			code;
+	uint8_t			original[RADIUS_HEADER_LENGTH];
+	fr_dcursor_t		cursor;
+
+	*response_code = 0;	/* Initialise to keep the rest of the code happy */
+
+	packet_len = data_len;
+	if (!fr_radius_ok(data, &packet_len, inst->parent->max_attributes, false, &reason)) {
+		RWARN("Ignoring malformed packet");
+		return reason;
+	}
+
+	RHEXDUMP3(data, packet_len, "Read packet");
+
+	original[0] = u->code;
+	original[1] = 0;			/* not looked at by fr_radius_verify() */
+	original[2] = 0;
+	original[3] = RADIUS_HEADER_LENGTH;	/* for debugging */
+	memcpy(original + RADIUS_AUTH_VECTOR_OFFSET, request_authenticator, RADIUS_AUTH_VECTOR_LENGTH);
+
+	if (fr_radius_verify(data, original,
+			     (uint8_t const *) inst->secret, talloc_array_length(inst->secret) - 1,
+			     inst->secret_hmac) < 0) {
+		RPWDEBUG("Ignoring response with invalid signature");
+		return DECODE_FAIL_MA_INVALID;
+	}
+
+	code = data[0];
+	if (!code || (code >= FR_RADIUS_CODE_MAX)) {
+		REDEBUG("Unknown reply code %d", code);
+		return DECODE_FAIL_UNKNOWN_PACKET_CODE;
+	}
+
+	if (!allowed_replies[code]) {
+		REDEBUG("%s packet received invalid reply code %s",
+			fr_packet_codes[u->code], fr_packet_codes[code]);
+		return DECODE_FAIL_UNKNOWN_PACKET_CODE;
+	}
+
+	/*
+	 *	Protocol error is allowed as a response to any
+	 *	packet code.
+	 *
+	 *	Status checks accept any response code.
+	 */
+	if (!u->status_check && (code != FR_RADIUS_CODE_PROTOCOL_ERROR)) {
+		if (allowed_replies[code] != (fr_radius_packet_code_t) u->code) {
+			REDEBUG("%s packet received invalid reply code %s",
+				fr_packet_codes[u->code], fr_packet_codes[code]);
+			return DECODE_FAIL_UNKNOWN_PACKET_CODE;
+		}
+	}
+
+	/*
+	 *	Decode the attributes, in the context of the reply.
+	 *	This only fails if the packet is strangely malformed,
+	 *	or if we run out of memory.
+	 */
+	fr_dcursor_init(&cursor, reply);
+	if (fr_radius_decode(ctx, data, packet_len, original,
+			     inst->secret, talloc_array_length(inst->secret) - 1, &cursor) < 0) {
+		REDEBUG("Failed decoding attributes for packet");
+		fr_pair_list_free(reply);
+		return DECODE_FAIL_UNKNOWN;
+	}
+
+	RDEBUG("Received %s ID %d length %ld reply packet on connection %s",
+	       fr_packet_codes[code], data[1], packet_len, h->name);
+	log_request_pair_list(L_DBG_LVL_2, request, NULL, reply, NULL);
+
+	*response_code = code;
+
+	return DECODE_FAIL_NONE;
+}
+
+static int encode(rlm_radius_tcp_t const *inst, request_t *request, tcp_request_t *u, uint8_t id)
+{
+	ssize_t			packet_len;
+	uint8_t			*msg = NULL;
+	int			message_authenticator = u->require_ma * (RADIUS_MESSAGE_AUTHENTICATOR_LENGTH + 2);
+	int			proxy_state = 6;
+
+	fr_assert(inst->parent->allowed[u->code]);
+	fr_assert(!u->packet);
+
+	/*
+	 *	This is essentially free, as this memory was
+	 *	pre-allocated as part of the treq.
+	 */
+	u->packet_len = inst->max_packet_size;
+	MEM(u->packet = talloc_array(u, uint8_t, u->packet_len));
+
+	/*
+	 *	All proxied Access-Request packets MUST have a
+	 *	Message-Authenticator, otherwise they're insecure.
+	 *	Same goes for Status-Server.
+	 *
+	 *	And we set the authentication vector to a random
+	 *	number...
+	 */
+	switch (u->code) {
+	case FR_RADIUS_CODE_ACCESS_REQUEST:
+	case FR_RADIUS_CODE_STATUS_SERVER:
+	{
+		size_t i;
+		uint32_t hash, base;
+
+		message_authenticator = RADIUS_MESSAGE_AUTHENTICATOR_LENGTH + 2;
+
+		base = fr_rand();
+		for (i = 0; i < RADIUS_AUTH_VECTOR_LENGTH; i += sizeof(uint32_t)) {
+			hash = fr_rand() ^ base;
+			memcpy(u->packet + RADIUS_AUTH_VECTOR_OFFSET + i, &hash, sizeof(hash));
+		}
+	}
+		FALL_THROUGH;
+
+	default:
+		break;
+	}
+
+	/*
+	 *	If we're sending a status check packet, update any
+	 *	necessary timestamps.  Also, don't add Proxy-State, as
+	 *	we're originating the packet.
+	 */
+	if (u->status_check) {
+		fr_pair_t *vp;
+
+		proxy_state = 0;
+		vp = fr_pair_find_by_da(&request->request_pairs, attr_event_timestamp, 0);
+		if (vp) vp->vp_date = fr_time_to_unix_time(u->start);
+
+	} else if (inst->parent->originate) {
+		/*
+		 *	We're originating packets instead of proxying
+		 *	them.  We don't add a Proxy-State attribute.
+		 */
+		proxy_state = 0;
+	}
+
+	/*
+	 *	We should have at minimum 64-byte packets, so don't
+	 *	bother doing run-time checks here.
+	 */
+	fr_assert(u->packet_len >= (size_t) (RADIUS_HEADER_LENGTH + proxy_state + message_authenticator));
+
+	/*
+	 *	Encode it, leaving room for Proxy-State and
+	 *	Message-Authenticator if necessary.
+	 */
+	packet_len = fr_radius_encode(u->packet, u->packet_len - (proxy_state + message_authenticator), NULL,
+				      inst->secret, talloc_array_length(inst->secret) - 1,
+				      u->code, id, &request->request_pairs);
+	if (fr_pair_encode_is_error(packet_len)) {
+		RPERROR("Failed encoding packet");
+
+	error:
+		TALLOC_FREE(u->packet);
+		return -1;
+	}
+
+	if (packet_len < 0) {
+		size_t have;
+		size_t need;
+
+		have = u->packet_len - (proxy_state + message_authenticator);
+		need = have - packet_len;
+
+		if (need > RADIUS_MAX_PACKET_SIZE) {
+			RERROR("Failed encoding packet.  Have %zu bytes of buffer, need %zu bytes",
+			       have, need);
+		} else {
+			RERROR("Failed encoding packet.  Have %zu bytes of buffer, need %zu bytes.  "
+			       "Increase 'max_packet_size'", have, need);
+		}
+
+		goto error;
+	}
+	/*
+	 *	The encoded packet should NOT over-run the input buffer.
+	 */
+	fr_assert((size_t) (packet_len + proxy_state + message_authenticator) <= u->packet_len);
+
+	/*
+	 *	Add Proxy-State to the tail end of the packet.
+	 *
+	 *	We need to add it here, and NOT in
+	 *	request->request_pairs, because multiple modules
+	 *	may be sending the packets at the same time.
+	 */
+	if (proxy_state) {
+		uint8_t		*attr = u->packet + packet_len;
+		fr_pair_t	*vp;
+		int		count = 0;
+
+		/*
+		 *	Count how many Proxy-State attributes have
+		 *	*our* magic number.  Note that we also add a
+		 *	counter to each Proxy-State, so we're double
+		 *	sure that it's a loop.
+		 */
+		if (DEBUG_ENABLED) {
+			fr_pair_list_foreach_by_da(&request->request_pairs, proxy, attr_proxy_state) {
+				if ((proxy->vp_length == 5) && (memcmp(proxy->vp_octets, &inst->parent->proxy_state, 4) == 0)) {
+					count++;
+				}
+			}
+
+			/*
+			 *	Some configurations may proxy to
+			 *	ourselves for tests / simplicity.  But
+			 *	warn if there are a large number of
+			 *	identical Proxy-State attributes.
+			 */
+			if (count >= 4) RWARN("Potential proxy loop detected!  Please recheck your configuration.");
+		}
+
+		attr[0] = (uint8_t)attr_proxy_state->attr;
+		attr[1] = 7;
+		memcpy(attr + 2, &inst->parent->proxy_state, 4);
+		attr[6] = count & 0xff;
+		packet_len += 7;
+
+		MEM(vp = fr_pair_afrom_da(u->packet, attr_proxy_state));
+		fr_pair_value_memdup(vp, attr + 2, 5, true);
+		fr_pair_append(&u->extra, vp);
+	}
+
+	/*
+	 *	Add Message-Authenticator manually.
+	 *
+	 *	Note that the length check will always pass, due to
+	 *	the buflen manipulation done above.
+	 */
+	if (message_authenticator) {
+		msg = u->packet + packet_len;
+
+		msg[0] = (uint8_t) attr_message_authenticator->attr;
+		msg[1] = RADIUS_MESSAGE_AUTHENTICATOR_LENGTH + 2;
+		memset(msg + 2, 0,  RADIUS_MESSAGE_AUTHENTICATOR_LENGTH);
+
+		packet_len += msg[1];
+	}
+
+	/*
+	 *	Update the packet header based on the new attributes.
+	 */
+	u->packet[2] = (packet_len >> 8) & 0xff;
+	u->packet[3] = packet_len & 0xff;
+	u->packet_len = packet_len;
+
+	/*
+	 *	Ensure that we update the Acct-Delay-Time based on the
+	 *	time difference between now, and when we originally
+	 *	received the request.
+	 */
+	if ((u->code == FR_RADIUS_CODE_ACCOUNTING_REQUEST) &&
+	    (fr_pair_find_by_da(&request->request_pairs, attr_acct_delay_time, 0) != NULL)) {
+		uint8_t *attr, *end;
+		uint32_t delay;
+
+		/*
+		 *	Change Acct-Delay-Time in the packet, but not
+		 *	in the debug output.  We don't want to edit
+		 *	the incoming VPs, and we want to update the
+		 *	encoded version of Acct-Delay-Time.  So we
+		 *	just walk through the packet to find it.
+		 */
+		end = u->packet + packet_len;
+
+		for (attr = u->packet + RADIUS_HEADER_LENGTH;
+		     attr < end;
+		     attr += attr[1]) {
+			if (attr[0] != attr_acct_delay_time->attr) continue;
+			if (attr[1] != 6) continue;
+
+			/*
+			 *	Add in the time between when
+			 *	we received the packet, and
+			 *	when we're sending the packet.
+			 */
+			memcpy(&delay, attr + 2, 4);
+			delay = ntohl(delay);
+			delay += fr_time_delta_to_sec(u->start - u->recv_time);
+			delay = htonl(delay);
+			memcpy(attr + 2, &delay, 4);
+			break;
+		}
+	}
+
+	/*
+	 *	Only certain types of packet, and those with a
+	 *	message_authenticator need signing.
+	 */
+	if (message_authenticator) goto sign;
+	switch (u->code) {
+	case FR_RADIUS_CODE_ACCOUNTING_REQUEST:
+	case FR_RADIUS_CODE_DISCONNECT_REQUEST:
+	case FR_RADIUS_CODE_COA_REQUEST:
+	sign:
+		/*
+		 *	Now that we're done mangling the packet, sign it.
+		 */
+		if (fr_radius_sign(u->packet, NULL, (uint8_t const *) inst->secret,
+				   talloc_array_length(inst->secret) - 1, inst->secret_hmac) < 0) {
+			RERROR("Failed signing packet");
+			goto error;
+		}
+		break;
+
+	default:
+		break;
+
+	}
+	return 0;
+}
+
+/** Deal with Protocol-Error replies
+ *
+ * There's no negotiation of the response size over TCP, the packet
+ * is simply checked for sanity.
+ */
+static void protocol_error_reply(tcp_request_t *u, tcp_result_t *r, uint8_t const *data)
+{
+	uint8_t const	*attr, *end;
+
+	end = data + ((data[2] << 8) | data[3]);
+
+	for (attr = data + RADIUS_HEADER_LENGTH;
+	     attr < end;
+	     attr += attr[1]) {
+		/*
+		 *	Protocol-Error packets MUST contain an
+		 *	Original-Packet-Code attribute.
+		 *
+		 *	The attribute containing the
+		 *	Original-Packet-Code is an extended
+		 *	attribute.
+		 */
+		if (attr[0] != attr_extended_attribute_1->attr) continue;
+
+		/*
+		 *	ATTR + LEN + EXT-Attr + uint32
+		 */
+		if (attr[1] != 7) continue;
+
+		/*
+		 *	See if there's an Original-Packet-Code.
+		 */
+		if (attr[2] != (uint8_t)attr_original_packet_code->attr) continue;
+
+		/*
+		 *	Has to be an 8-bit number, and it has to
+		 *	match.
+		 */
+		if ((attr[3] != 0) || (attr[4] != 0) || (attr[5] != 0) || (attr[6] != u->code)) {
+			if (r) r->rcode = RLM_MODULE_FAIL;
+			return;
+		}
+	}
+
+	/*
+	 *	The response is valid, but not useful for anything.
+	 */
+	if (r) r->rcode = RLM_MODULE_HANDLED;
+}
+
+/** No reply was received within the response window
+ *
+ */
+static void request_timeout(UNUSED fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	fr_trunk_request_t	*treq = talloc_get_type_abort(uctx, fr_trunk_request_t);
+	tcp_request_t		*u = talloc_get_type_abort(treq->preq, tcp_request_t);
+	tcp_result_t		*r = talloc_get_type_abort(treq->rctx, tcp_result_t);
+	request_t		*request = treq->request;
+	fr_trunk_connection_t	*tconn = treq->tconn;
+	tcp_handle_t		*h;
+
+	fr_assert(treq->state == FR_TRUNK_REQUEST_STATE_SENT);		/* No other states should be timing out */
+	fr_assert(tconn);
+
+	h = talloc_get_type_abort(tconn->conn->h, tcp_handle_t);
+
+	r->rcode = RLM_MODULE_FAIL;
+
+	if (u->status_check) {
+		WARN("%s - No response to status check, closing connection %s", h->module_name, h->name);
+
+		fr_trunk_request_signal_complete(treq);
+		h->status_checking = false;
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	REDEBUG("No response to %s ID %d within %pVs, failing request",
+		fr_packet_codes[u->code], u->id, fr_box_time_delta(now - u->start));
+	fr_trunk_request_signal_complete(treq);
+
+	/*
+	 *	Nothing has come back on this connection for a long
+	 *	time.  The connection, or the home server, is dead.
+	 *	Requests still outstanding on it will be moved to
+	 *	other connections.
+	 */
+	if ((h->last_reply + h->inst->parent->zombie_period) < now) {
+		WARN("%s - No replies for %pVs, closing connection %s", h->module_name,
+		     fr_box_time_delta(now - h->last_reply), h->name);
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+	}
+}
+
+static void request_mux(fr_event_list_t *el,
+			fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+	rlm_radius_tcp_t const	*inst = h->inst;
+	uint16_t		i;
+	fr_time_t		now;
+
+	/*
+	 *	The stream has to stay in order, so the rest of
+	 *	the last batch must be written first.
+	 */
+	switch (tcp_flush(h)) {
+	case -1:
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+		return;
+
+	case 1:
+		return;
+
+	default:
+		break;
+	}
+
+	now = fr_time();
+
+	/*
+	 *	Encode as many packets as will fit into the send
+	 *	buffer, and write them all at once.
+	 */
+	for (i = 0; i < inst->max_send_coalesce; i++) {
+		fr_trunk_request_t	*treq;
+		tcp_request_t		*u;
+		request_t		*request;
+
+ 		if (unlikely(fr_trunk_connection_pop_request(&treq, tconn) < 0)) return;
+
+		/*
+		 *	No more requests to send
+		 */
+		if (!treq) break;
+
+ 		fr_assert((treq->state == FR_TRUNK_REQUEST_STATE_PENDING) ||
+			  (treq->state == FR_TRUNK_REQUEST_STATE_PARTIAL));
+
+		request = treq->request;
+		u = talloc_get_type_abort(treq->preq, tcp_request_t);
+
+		/*
+		 *	The packet may have been encoded last time,
+		 *	and not fitted into the send buffer.
+		 */
+		if (!u->packet) {
+			fr_assert(!u->rr);
+
+			if (unlikely(radius_track_entry_reserve(&u->rr, treq, h->tt, request, u->code, treq) < 0)) {
+#ifndef NDEBUG
+				radius_track_state_log(&default_log, L_ERR, __FILE__, __LINE__,
+						       h->tt, tcp_tracking_entry_log);
+#endif
+				fr_assert_fail("Tracking entry allocation failed: %s", fr_strerror());
+				fr_trunk_request_signal_fail(treq);
+				continue;
+			}
+			u->id = u->rr->id;
+			u->start = now;
+
+			if (encode(inst, request, u, u->id) < 0) {
+				tcp_request_reset(u);
+				fr_trunk_request_signal_fail(treq);
+				continue;
+			}
+			RHEXDUMP3(u->packet, u->packet_len, "Encoded packet");
+
+			/*
+			 *	Remember the authentication vector, which now has the
+			 *	packet signature.
+			 */
+			(void) radius_track_entry_update(u->rr, u->packet + RADIUS_AUTH_VECTOR_OFFSET);
+		}
+
+		if ((h->send_len + u->packet_len) > h->send_size) break;
+
+		RDEBUG("Sending %s ID %d length %ld over connection %s",
+		       fr_packet_codes[u->code], u->id, u->packet_len, h->name);
+		log_request_pair_list(L_DBG_LVL_2, request, NULL, &request->request_pairs, NULL);
+		if (!fr_pair_list_empty(&u->extra)) log_request_pair_list(L_DBG_LVL_2, request, NULL, &u->extra, NULL);
+
+		/*
+		 *	Once the packet is in the send buffer, it's
+		 *	part of the stream, and will be written even if
+		 *	the request is cancelled.
+		 */
+		memcpy(h->send + h->send_len, u->packet, u->packet_len);
+		h->send_len += u->packet_len;
+
+		fr_trunk_request_signal_sent(treq);
+
+		if (fr_event_timer_at(u, el, &u->ev, now + inst->parent->retry[u->code].mrd,
+				      request_timeout, treq) < 0) {
+			RERROR("Failed inserting response timeout for connection");
+			fr_trunk_request_signal_fail(treq);
+			continue;
+		}
+	}
+
+	if (h->send_len == 0) return;	/* No work */
+
+	/*
+	 *	Anything which isn't written now is written when the
+	 *	socket next becomes writable.
+	 */
+	if (tcp_flush(h) < 0) fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+}
+
+/** Process one reply packet
+ *
+ */
+static void tcp_packet_process(tcp_handle_t *h, uint8_t *data, size_t data_len)
+{
+	fr_trunk_request_t	*treq;
+	request_t		*request;
+	tcp_request_t		*u;
+	tcp_result_t		*r;
+	radius_track_entry_t	*rr;
+	decode_fail_t		reason;
+	uint8_t			code = 0;
+	fr_pair_list_t		reply;
+
+	fr_pair_list_init(&reply);
+
+	/*
+	 *	Note that we don't care about packet codes.  All
+	 *	packet codes share the same ID space.
+	 */
+	rr = radius_track_entry_find(h->tt, data[1], NULL);
+	if (!rr) {
+		WARN("%s - Ignoring reply with ID %i that arrived too late",
+		     h->module_name, data[1]);
+		return;
+	}
+
+	treq = talloc_get_type_abort(rr->uctx, fr_trunk_request_t);
+	request = treq->request;
+	fr_assert(request != NULL);
+	u = talloc_get_type_abort(treq->preq, tcp_request_t);
+	r = talloc_get_type_abort(treq->rctx, tcp_result_t);
+
+	/*
+	 *	Validate and decode the incoming packet
+	 */
+	reason = decode(request->reply_ctx, &reply, &code, h, request, u, rr->vector, data, data_len);
+	if (reason != DECODE_FAIL_NONE) return;
+
+	/*
+	 *	Only valid packets are processed, otherwise an
+	 *	attacker could keep a dead connection alive.
+	 */
+	h->last_reply = fr_time();
+
+	/*
+	 *	Status checks can have any reply code, we don't care
+	 *	what it is.  So long as it's signed properly, we
+	 *	accept it.
+	 */
+	if (u == h->status_u) {
+		fr_pair_list_free(&reply);
+		h->status_checking = false;
+		fr_trunk_request_signal_complete(treq);
+		return;
+	}
+
+	/*
+	 *	Handle any state changes, etc. needed by receiving a
+	 *	Protocol-Error reply packet.
+	 *
+	 *	Protocol-Error is permitted as a reply to any
+	 *	packet.
+	 */
+	if (code == FR_RADIUS_CODE_PROTOCOL_ERROR) protocol_error_reply(u, r, data);
+
+	/*
+	 *	Mark up the request as being an Access-Challenge, if
+	 *	required.
+	 *
+	 *	We don't do this for other packet types, because the
+	 *	ok/fail nature of the module return code will
+	 *	automatically result in it the parent request
+	 *	returning an ok/fail packet code.
+	 */
+	if ((u->code == FR_RADIUS_CODE_ACCESS_REQUEST) && (code == FR_RADIUS_CODE_ACCESS_CHALLENGE)) {
+		fr_pair_t	*vp;
+
+		vp = fr_pair_find_by_da(&request->reply_pairs, attr_packet_type, 0);
+		if (!vp) {
+			MEM(vp = fr_pair_afrom_da(request->reply_ctx, attr_packet_type));
+			vp->vp_uint32 = FR_RADIUS_CODE_ACCESS_CHALLENGE;
+			fr_pair_append(&request->reply_pairs, vp);
+		}
+	}
+
+	/*
+	 *	Delete Proxy-State attributes from the reply.
+	 */
+	fr_pair_delete_by_da(&reply, attr_proxy_state);
+
+	/*
+	 *	If the reply has Message-Authenticator, delete
+	 *	it from the proxy reply so that it isn't
+	 *	copied over to our reply.  But also create a
+	 *	reply.Message-Authenticator attribute, so that
+	 *	it ends up in our reply.
+	 */
+	if (fr_pair_find_by_da(&reply, attr_message_authenticator, 0)) {
+		fr_pair_t *vp;
+
+		fr_pair_delete_by_da(&reply, attr_message_authenticator);
+
+		MEM(vp = fr_pair_afrom_da(request->reply_ctx, attr_message_authenticator));
+		(void) fr_pair_value_memdup(vp, (uint8_t const *) "", 1, false);
+		fr_pair_append(&request->reply_pairs, vp);
+	}
+
+	treq->request->reply->code = code;
+	r->rcode = radius_code_to_rcode[code];
+	fr_pair_list_append(&request->reply_pairs, &reply);
+	fr_trunk_request_signal_complete(treq);
+}
+
+static void request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	tcp_handle_t		*h = talloc_get_type_abort(conn->h, tcp_handle_t);
+
+	DEBUG3("%s - Reading data for connection %s", h->module_name, h->name);
+
+	/*
+	 *	Drain the socket.  Each read may return many
+	 *	replies, which are all processed before we read
+	 *	again.
+	 */
+	while (true) {
+		ssize_t		slen;
+		uint8_t		*p, *end;
+
+		slen = tcp_recv(h, h->recv + h->recv_len, h->recv_size - h->recv_len);
+		if (slen < 0) {
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+		}
+		if (slen == 0) return;
+
+		h->recv_len += slen;
+
+		p = h->recv;
+		end = h->recv + h->recv_len;
+
+		while ((end - p) >= RADIUS_HEADER_LENGTH) {
+			size_t packet_len = (p[2] << 8) | p[3];
+
+			/*
+			 *	We can't find the start of the next
+			 *	packet, so the stream is unusable.
+			 */
+			if ((packet_len < RADIUS_HEADER_LENGTH) || (packet_len > h->inst->max_packet_size)) {
+				ERROR("%s - Received packet with invalid length %zu on connection %s",
+				      h->module_name, packet_len, h->name);
+				fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+				return;
+			}
+
+			if ((size_t) (end - p) < packet_len) break;
+
+			tcp_packet_process(h, p, packet_len);
+			p += packet_len;
+		}
+
+		/*
+		 *	Keep any partial packet for the next read.
+		 */
+		h->recv_len = end - p;
+		if (h->recv_len && (p != h->recv)) memmove(h->recv, p, h->recv_len);
+	}
+}
+
+/** Remove the request from any tracking structures
+ *
+ * Packets are never retransmitted over TCP, so a request which is
+ * requeued gets a new ID, and is encoded again.
+ */
+static void request_cancel(UNUSED fr_connection_t *conn, void *preq_to_reset,
+			   fr_trunk_cancel_reason_t reason, UNUSED void *uctx)
+{
+	tcp_request_t	*u = talloc_get_type_abort(preq_to_reset, tcp_request_t);
+
+	if (reason == FR_TRUNK_CANCEL_REASON_REQUEUE) {
+		if (u->ev) (void) fr_event_timer_delete(&u->ev);
+		tcp_request_reset(u);
+	}
+
+	/*
+	 *      Other cancellations are dealt with by
+	 *      request_conn_release as the request is removed
+	 *	from the trunk.
+	 */
+}
+
+/** Clear out anything associated with the handle from the request
+ *
+ */
+static void request_conn_release(UNUSED fr_connection_t *conn, void *preq_to_reset, UNUSED void *uctx)
+{
+	tcp_request_t		*u = talloc_get_type_abort(preq_to_reset, tcp_request_t);
+
+	if (u->ev) (void)fr_event_timer_delete(&u->ev);
+	if (u->packet) tcp_request_reset(u);
+}
+
+/** Write out a canned failure
+ *
+ */
+static void request_fail(request_t *request, void *preq, void *rctx,
+			 NDEBUG_UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
+{
+	tcp_result_t		*r = talloc_get_type_abort(rctx, tcp_result_t);
+	tcp_request_t		*u = talloc_get_type_abort(preq, tcp_request_t);
+
+	fr_assert(!u->rr && !u->packet && fr_pair_list_empty(&u->extra) && !u->ev);	/* Dealt with by request_conn_release */
+
+	fr_assert(state != FR_TRUNK_REQUEST_STATE_INIT);
+
+	if (u->status_check) return;
+
+	r->rcode = RLM_MODULE_FAIL;
+	r->treq = NULL;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Response has already been written to the rctx at this point
+ *
+ */
+static void request_complete(request_t *request, void *preq, void *rctx, UNUSED void *uctx)
+{
+	tcp_result_t		*r = talloc_get_type_abort(rctx, tcp_result_t);
+	tcp_request_t		*u = talloc_get_type_abort(preq, tcp_request_t);
+
+	fr_assert(!u->rr && !u->packet && fr_pair_list_empty(&u->extra) && !u->ev);	/* Dealt with by request_conn_release */
+
+	if (u->status_check) return;
+
+	r->treq = NULL;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Explicitly free resources associated with the protocol request
+ *
+ */
+static void request_free(UNUSED request_t *request, void *preq_to_free, UNUSED void *uctx)
+{
+	tcp_request_t		*u = talloc_get_type_abort(preq_to_free, tcp_request_t);
+
+	fr_assert(!u->rr && !u->packet && fr_pair_list_empty(&u->extra) && !u->ev);	/* Dealt with by request_conn_release */
+
+	/*
+	 *	Don't free status check requests.
+	 */
+	if (u->status_check) return;
+
+	talloc_free(u);
+}
+
+/** Resume execution of the request, returning the rcode set during trunk execution
+ *
+ */
+static unlang_action_t mod_resume(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx, UNUSED request_t *request, void *rctx)
+{
+	tcp_result_t	*r = talloc_get_type_abort(rctx, tcp_result_t);
+	rlm_rcode_t	rcode = r->rcode;
+
+	talloc_free(rctx);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+static void mod_signal(UNUSED module_ctx_t const *mctx, UNUSED request_t *request,
+		       void *rctx, fr_state_signal_t action)
+{
+	tcp_result_t		*r = talloc_get_type_abort(rctx, tcp_result_t);
+
+	/*
+	 *	If we don't have a treq associated with the
+	 *	rctx it's likely because the request was
+	 *	scheduled, but hasn't yet been resumed.
+	 */
+	if (!r->treq) {
+		talloc_free(rctx);
+		return;
+	}
+
+	switch (action) {
+	/*
+	 *	The request is being cancelled, tell the
+	 *	trunk so it can clean up the treq.
+	 */
+	case FR_SIGNAL_CANCEL:
+		fr_trunk_request_signal_cancel(r->treq);
+		r->treq = NULL;
+		talloc_free(r);		/* Should be freed soon anyway, but better to be explicit */
+		return;
+
+	/*
+	 *	Duplicates are ignored.  The transport is
+	 *	reliable, and RFC 6613 forbids retransmitting a
+	 *	packet on the same connection.
+	 */
+	case FR_SIGNAL_DUP:
+	default:
+		return;
+	}
+}
+
+#ifndef NDEBUG
+/** Free a tcp_result_t
+ *
+ * Allows us to set break points for debugging.
+ */
+static int _tcp_result_free(tcp_result_t *r)
+{
+	fr_trunk_request_t	*treq;
+	tcp_request_t		*u;
+
+	if (!r->treq) return 0;
+
+	treq = talloc_get_type_abort(r->treq, fr_trunk_request_t);
+	u = talloc_get_type_abort(treq->preq, tcp_request_t);
+
+	fr_assert_msg(!u->ev, "tcp_result_t freed with active timer");
+
+	return 0;
+}
+#endif
+
+/** Free a tcp_request_t
+ */
+static int _tcp_request_free(tcp_request_t *u)
+{
+	if (u->ev) (void) fr_event_timer_delete(&u->ev);
+
+	fr_assert(u->rr == NULL);
+
+	return 0;
+}
+
+static unlang_action_t mod_enqueue(rlm_rcode_t *p_result, void **rctx_out, UNUSED void *instance, void *thread, request_t *request)
+{
+	tcp_thread_t			*t = talloc_get_type_abort(thread, tcp_thread_t);
+	tcp_result_t			*r;
+	tcp_request_t			*u;
+	fr_trunk_request_t		*treq;
+
+	fr_assert(request->packet->code > 0);
+	fr_assert(request->packet->code < FR_RADIUS_CODE_MAX);
+
+	if (request->packet->code == FR_RADIUS_CODE_STATUS_SERVER) {
+		RWDEBUG("Status-Server is reserved for internal use, and cannot be sent manually.");
+		RETURN_MODULE_NOOP;
+	}
+
+	treq = fr_trunk_request_alloc(t->trunk, request);
+	if (!treq) RETURN_MODULE_FAIL;
+
+	MEM(r = talloc_zero(request, tcp_result_t));
+#ifndef NDEBUG
+	talloc_set_destructor(r, _tcp_result_free);
+#endif
+
+	MEM(u = talloc(treq, tcp_request_t));
+	*u = (tcp_request_t){
+		.code = request->packet->code,
+		.priority = request->async->priority,
+		.recv_time = request->async->recv_time
+	};
+	fr_pair_list_init(&u->extra);
+
+	r->rcode = RLM_MODULE_FAIL;
+
+	/*
+	 *	If the caller asked for a Message-Authenticator,
+	 *	delete theirs (which has a bad value), and remember
+	 *	to add one manually when we encode the packet.
+	 */
+	if (fr_pair_find_by_da(&request->request_pairs, attr_message_authenticator, 0)) {
+		u->require_ma = true;
+		pair_delete_request(attr_message_authenticator);
+	}
+
+	if (fr_trunk_request_enqueue(&treq, t->trunk, request, u, r) < 0) {
+		fr_assert(!u->rr && !u->packet);	/* Should not have been fed to the muxer */
+		fr_trunk_request_free(&treq);		/* Return to the free list */
+		talloc_free(r);
+		RETURN_MODULE_FAIL;
+	}
+
+	r->treq = treq;	/* Remember for signalling purposes */
+
+	talloc_set_destructor(u, _tcp_request_free);
+
+	*rctx_out = r;
+
+	return UNLANG_ACTION_YIELD;
+}
+
+/** Instantiate thread data for the submodule.
+ *
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *tctx)
+{
+	rlm_radius_tcp_t		*inst = talloc_get_type_abort(instance, rlm_radius_tcp_t);
+	tcp_thread_t			*thread = talloc_get_type_abort(tctx, tcp_thread_t);
+
+	static fr_trunk_io_funcs_t	io_funcs = {
+						.connection_alloc = thread_conn_alloc,
+						.connection_notify = thread_conn_notify,
+						.request_prioritise = request_prioritise,
+						.request_mux = request_mux,
+						.request_demux = request_demux,
+						.request_conn_release = request_conn_release,
+						.request_complete = request_complete,
+						.request_fail = request_fail,
+						.request_cancel = request_cancel,
+						.request_free = request_free
+					};
+
+	inst->trunk_conf = &inst->parent->trunk_conf;
+
+	inst->trunk_conf->req_pool_headers = 4;	/* One for the request, one for the buffer, one for the tracking binding, one for Proxy-State VP */
+	inst->trunk_conf->req_pool_size = sizeof(tcp_request_t) + inst->max_packet_size + sizeof(radius_track_entry_t ***) + sizeof(fr_pair_t) + 20;
+
+	thread->el = el;
+	thread->inst = inst;
+
+#ifdef WITH_TLS
+	if (inst->tls_conf) {
+		thread->ssl_ctx = fr_tls_ctx_alloc(inst->tls_conf, true);
+		if (!thread->ssl_ctx) return -1;
+	}
+#endif
+
+	thread->trunk = fr_trunk_alloc(thread, el, &io_funcs,
+				       inst->trunk_conf, inst->parent->name, thread, false);
+	if (!thread->trunk) return -1;
+
+	return 0;
+}
+
+/** Free thread specific data
+ *
+ */
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *tctx)
+{
+	tcp_thread_t			*thread = talloc_get_type_abort(tctx, tcp_thread_t);
+
+	/*
+	 *	Close the connections before the SSL_CTX they use
+	 *	goes away.
+	 */
+	TALLOC_FREE(thread->trunk);
+
+#ifdef WITH_TLS
+	if (thread->ssl_ctx) SSL_CTX_free(thread->ssl_ctx);
+	thread->ssl_ctx = NULL;
+#endif
+
+	return 0;
+}
+
+/** Instantiate the module
+ *
+ * @param[in] instance	data for this module
+ * @param[in] conf	our configuration section parsed to give us instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
+{
+	rlm_radius_t		*parent = talloc_get_type_abort(dl_module_parent_data_by_child_data(instance),
+								rlm_radius_t);
+	rlm_radius_tcp_t	*inst = talloc_get_type_abort(instance, rlm_radius_tcp_t);
+
+	if (!parent) {
+		ERROR("IO module cannot be instantiated directly");
+		return -1;
+	}
+
+	inst->parent = parent;
+
+	/*
+	 *	The home server replies to everything we send over
+	 *	TCP, so there's no point replicating over it.
+	 */
+	if (parent->replicate) {
+		cf_log_err(conf, "'replicate' is not supported by the 'tcp' transport");
+		return -1;
+	}
+
+	if (inst->max_send_coalesce == 0) inst->max_send_coalesce = 1;
+
+	/*
+	 *	Ensure that we have a destination address.
+	 */
+	if (inst->dst_ipaddr.af == AF_UNSPEC) {
+		cf_log_err(conf, "A value must be given for 'ipaddr'");
+		return -1;
+	}
+
+	/*
+	 *	If src_ipaddr isn't set, make sure it's INADDR_ANY, of
+	 *	the same address family as dst_ipaddr.
+	 */
+	if (inst->src_ipaddr.af == AF_UNSPEC) {
+		memset(&inst->src_ipaddr, 0, sizeof(inst->src_ipaddr));
+
+		inst->src_ipaddr.af = inst->dst_ipaddr.af;
+
+		if (inst->src_ipaddr.af == AF_INET) {
+			inst->src_ipaddr.prefix = 32;
+		} else {
+			inst->src_ipaddr.prefix = 128;
+		}
+	}
+
+	else if (inst->src_ipaddr.af != inst->dst_ipaddr.af) {
+		cf_log_err(conf, "The 'ipaddr' and 'src_ipaddr' configuration items must "
+			   "be both of the same address family");
+		return -1;
+	}
+
+	if (!inst->dst_port) {
+		cf_log_err(conf, "A value must be given for 'port'");
+		return -1;
+	}
+
+	/*
+	 *	RFC 6614 says that the secret for RADIUS/TLS is
+	 *	"radsec" unless configured otherwise.
+	 */
+	if (!inst->secret) {
+#ifdef WITH_TLS
+		if (inst->tls_conf) {
+			inst->secret = talloc_typed_strdup(inst, "radsec");
+		} else
+#endif
+		{
+			cf_log_err(conf, "A value must be given for 'secret'");
+			return -1;
+		}
+	}
+
+	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, >=, 64);
+	FR_INTEGER_BOUND_CHECK("max_packet_size", inst->max_packet_size, <=, 65535);
+
+	if (inst->recv_buff_is_set) {
+		FR_INTEGER_BOUND_CHECK("recv_buff", inst->recv_buff, >=, inst->max_packet_size);
+		FR_INTEGER_BOUND_CHECK("recv_buff", inst->recv_buff, <=, (1 << 30));
+	}
+
+	if (inst->send_buff_is_set) {
+		FR_INTEGER_BOUND_CHECK("send_buff", inst->send_buff, >=, inst->max_packet_size);
+		FR_INTEGER_BOUND_CHECK("send_buff", inst->send_buff, <=, (1 << 30));
+	}
+
+	if (inst->keepalive_idle) {
+		FR_TIME_DELTA_BOUND_CHECK("keepalive_idle", inst->keepalive_idle, >=, fr_time_delta_from_sec(1));
+		FR_TIME_DELTA_BOUND_CHECK("keepalive_interval", inst->keepalive_interval, >=, fr_time_delta_from_sec(1));
+		FR_INTEGER_BOUND_CHECK("keepalive_count", inst->keepalive_count, >=, 1);
+	}
+
+	if (inst->watchdog_interval) {
+		FR_TIME_DELTA_BOUND_CHECK("watchdog_interval", inst->watchdog_interval, >=, fr_time_delta_from_sec(1));
+	}
+
+	/*
+	 *	There's only one ID space per connection.
+	 */
+	FR_INTEGER_BOUND_CHECK("trunk.per_connection_max", parent->trunk_conf.max_req_per_conn, <=, 255);
+
+	/*
+	 *	Absorb the secret into the HMAC-MD5 state once,
+	 *	instead of for every packet we sign or verify.
+	 */
+	inst->secret_hmac = fr_hmac_md5_key_alloc(inst, (uint8_t const *) inst->secret,
+						  talloc_array_length(inst->secret) - 1);
+	if (!inst->secret_hmac) {
+		cf_log_err(conf, "Failed precomputing HMAC state for 'secret'");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Bootstrap the module
+ *
+ * Parse the TLS configuration, if there is one.
+ *
+ * @param[in] instance	Ctx data for this module
+ * @param[in] conf    our configuration section parsed to give us instance.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int mod_bootstrap(void *instance, CONF_SECTION *conf)
+{
+	rlm_radius_tcp_t	*inst = talloc_get_type_abort(instance, rlm_radius_tcp_t);
+	CONF_SECTION		*tls_cs;
+
+	(void) talloc_set_type(inst, rlm_radius_tcp_t);
+	inst->config = conf;
+
+	tls_cs = cf_section_find(conf, "tls", NULL);
+	if (!tls_cs) return 0;
+
+#ifdef WITH_TLS
+	inst->tls_conf = fr_tls_conf_parse_client(tls_cs);
+	if (!inst->tls_conf) {
+		cf_log_err(tls_cs, "Failed parsing TLS configuration");
+		return -1;
+	}
+
+	return 0;
+#else
+	cf_log_err(tls_cs, "The server was built without TLS support");
+	return -1;
+#endif
+}
+
+extern rlm_radius_io_t rlm_radius_tcp;
+rlm_radius_io_t rlm_radius_tcp = {
+	.magic			= RLM_MODULE_INIT,
+	.name			= "radius_tcp",
+	.inst_size		= sizeof(rlm_radius_tcp_t),
+
+	.thread_inst_size	= sizeof(tcp_thread_t),
+	.thread_inst_type	= "tcp_thread_t",
+
+	.config			= module_config,
+	.bootstrap		= mod_bootstrap,
+	.instantiate		= mod_instantiate,
+	.thread_instantiate 	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
+
+	.enqueue		= mod_enqueue,
+	.signal			= mod_signal,
+	.resume			= mod_resume,
+};
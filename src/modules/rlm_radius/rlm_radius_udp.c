@@ -50,6 +50,7 @@ typedef struct {
 	fr_ipaddr_t		src_ipaddr;		//!< IP we open our socket on.
 	uint16_t		dst_port;		//!< Port of the home server.
 	char const		*secret;		//!< Shared secret.
+	fr_hmac_md5_key_t	*secret_hmac;		//!< HMAC-MD5 state precomputed from the secret.
 
 	char const		*interface;		//!< Interface to bind to.
 
@@ -58,10 +59,18 @@ typedef struct {
 
 	uint32_t		max_packet_size;	//!< Maximum packet size.
 	uint16_t		max_send_coalesce;	//!< Maximum number of packets to coalesce into one mmsg call.
+	uint16_t		ports;			//!< Number of source ports (and so ID spaces)
+							///< each connection uses.
 
 	bool			recv_buff_is_set;	//!< Whether we were provided with a recv_buf
 	bool			send_buff_is_set;	//!< Whether we were provided with a send_buf
 	bool			replicate;		//!< Copied from parent->replicate
+	bool			passthrough;		//!< Send the original request bytes, instead
+							///< of encoding the request pairs.
+
+	bool			adaptive_retry;		//!< Derive the initial retransmission time
+							///< from measured response times.
+	fr_time_delta_t		adaptive_retry_min;	//!< Lowest initial retransmission time to use.
 
 	fr_trunk_conf_t		*trunk_conf;		//!< trunk configuration
 } rlm_radius_udp_t;
@@ -72,6 +81,10 @@ typedef struct {
 	rlm_radius_udp_t const	*inst;			//!< our instance
 
 	fr_trunk_t		*trunk;			//!< trunk handler
+
+	fr_time_delta_t		srtt;			//!< Smoothed response time of the home server.
+	fr_time_delta_t		rttvar;			//!< Variation in the response time.
+	bool			rtt_valid;		//!< We have at least one response time sample.
 } udp_thread_t;
 
 typedef struct {
@@ -84,8 +97,19 @@ typedef struct udp_request_s udp_request_t;
 typedef struct {
 	struct iovec		out;			//!< Describes buffer to send.
 	fr_trunk_request_t	*treq;			//!< Used for signalling.
+	uint16_t		socket;			//!< Which socket the packet is to be sent on.
 } udp_coalesced_t;
 
+/** One of the source ports used by a connection
+ *
+ * Each socket has its own 256 entry ID space.
+ */
+typedef struct {
+	int			fd;			//!< File descriptor.
+	uint16_t		src_port;		//!< Source port of this socket.
+	radius_track_t		*tt;			//!< RADIUS ID tracking structure for this socket.
+} udp_socket_t;
+
 /** Track the handle, which is tightly correlated with the FD
  *
  */
@@ -121,6 +145,12 @@ typedef struct {
 
 	radius_track_t		*tt;			//!< RADIUS ID tracking structure.
 
+	udp_socket_t		*sockets;		//!< All the sockets of this connection.  The first
+							///< is the one described by fd, src_port and tt above,
+							///< and is the only one used for status checks.
+	uint16_t		num_sockets;		//!< How many sockets there are.
+	int			read_fd;		//!< The socket which was signalled as readable.
+
 	fr_time_t		mrs_time;		//!< Most recent sent time which had a reply.
 	fr_time_t		last_reply;		//!< When we last received a reply.
 	fr_time_t		first_sent;		//!< first time we sent a packet since going idle
@@ -154,12 +184,15 @@ struct udp_request_s {
 
 	uint8_t			code;			//!< Packet code.
 	uint8_t			id;			//!< Last ID assigned to this packet.
+	uint16_t		socket;			//!< Socket the ID was allocated from.
 	uint8_t			*packet;		//!< Packet we write to the network.
 	size_t			packet_len;		//!< Length of the packet.
 
 	radius_track_entry_t	*rr;			//!< ID tracking, resend count, etc.
 	fr_event_timer_t const	*ev;			//!< timer for retransmissions
 	fr_retry_t		retry;			//!< retransmission timers
+	fr_retry_config_t	retry_config;		//!< per-request copy of the timers, when
+							///< the initial retransmission time is adaptive.
 };
 
 static const CONF_PARSER module_config[] = {
@@ -179,6 +212,13 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("max_packet_size", FR_TYPE_UINT32, rlm_radius_udp_t, max_packet_size), .dflt = "4096" },
 	{ FR_CONF_OFFSET("max_send_coalesce", FR_TYPE_UINT16, rlm_radius_udp_t, max_send_coalesce), .dflt = "1024" },
 
+	{ FR_CONF_OFFSET("ports", FR_TYPE_UINT16, rlm_radius_udp_t, ports), .dflt = "1" },
+
+	{ FR_CONF_OFFSET("passthrough", FR_TYPE_BOOL, rlm_radius_udp_t, passthrough), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("adaptive_retry", FR_TYPE_BOOL, rlm_radius_udp_t, adaptive_retry), .dflt = "no" },
+	{ FR_CONF_OFFSET("adaptive_retry_min", FR_TYPE_TIME_DELTA, rlm_radius_udp_t, adaptive_retry_min), .dflt = "0.1" },
+
 	{ FR_CONF_OFFSET("src_ipaddr", FR_TYPE_COMBO_IP_ADDR, rlm_radius_udp_t, src_ipaddr) },
 	{ FR_CONF_OFFSET("src_ipv4addr", FR_TYPE_IPV4_ADDR, rlm_radius_udp_t, src_ipaddr) },
 	{ FR_CONF_OFFSET("src_ipv6addr", FR_TYPE_IPV6_ADDR, rlm_radius_udp_t, src_ipaddr) },
@@ -195,6 +235,8 @@ fr_dict_autoload_t rlm_radius_udp_dict[] = {
 };
 
 static fr_dict_attr_t const *attr_acct_delay_time;
+static fr_dict_attr_t const *attr_chap_challenge;
+static fr_dict_attr_t const *attr_chap_password;
 static fr_dict_attr_t const *attr_error_cause;
 static fr_dict_attr_t const *attr_event_timestamp;
 static fr_dict_attr_t const *attr_extended_attribute_1;
@@ -209,6 +251,8 @@ static fr_dict_attr_t const *attr_packet_type;
 extern fr_dict_attr_autoload_t rlm_radius_udp_dict_attr[];
 fr_dict_attr_autoload_t rlm_radius_udp_dict_attr[] = {
 	{ .out = &attr_acct_delay_time, .name = "Acct-Delay-Time", .type = FR_TYPE_UINT32, .dict = &dict_radius},
+	{ .out = &attr_chap_challenge, .name = "CHAP-Challenge", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
+	{ .out = &attr_chap_password, .name = "CHAP-Password", .type = FR_TYPE_OCTETS, .dict = &dict_radius},
 	{ .out = &attr_error_cause, .name = "Error-Cause", .type = FR_TYPE_UINT32, .dict = &dict_radius },
 	{ .out = &attr_event_timestamp, .name = "Event-Timestamp", .type = FR_TYPE_DATE, .dict = &dict_radius},
 	{ .out = &attr_extended_attribute_1, .name = "Extended-Attribute-1", .type = FR_TYPE_TLV, .dict = &dict_radius},
@@ -691,10 +735,23 @@ static void conn_writable_status_check(fr_event_list_t *el, UNUSED int fd, UNUSE
  */
 static int _udp_handle_free(udp_handle_t *h)
 {
+	uint16_t	i;
+
 	fr_assert(h->fd >= 0);
 
 	if (h->status_u) fr_event_timer_delete(&h->status_u->ev);
 
+	/*
+	 *	The first socket is closed below.
+	 */
+	for (i = 1; i < h->num_sockets; i++) {
+		if (h->sockets[i].fd < 0) continue;
+
+		fr_event_fd_delete(h->thread->el, h->sockets[i].fd, FR_EVENT_FILTER_IO);
+		close(h->sockets[i].fd);
+		h->sockets[i].fd = -1;
+	}
+
 	fr_event_fd_delete(h->thread->el, h->fd, FR_EVENT_FILTER_IO);
 
 	if (shutdown(h->fd, SHUT_RDWR) < 0) {
@@ -714,6 +771,67 @@ static int _udp_handle_free(udp_handle_t *h)
 	return 0;
 }
 
+/** Open the additional source ports of a connection
+ *
+ * The first socket is opened by conn_init().  The others are bound to
+ * the same source address, but each gets its own source port, and
+ * so its own ID space.
+ *
+ * @param[in] h		to open the sockets for.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int udp_sockets_open(udp_handle_t *h)
+{
+	uint16_t	i;
+
+	h->sockets[0] = (udp_socket_t) {
+		.fd = h->fd,
+		.src_port = h->src_port,
+		.tt = h->tt
+	};
+
+	for (i = 1; i < h->num_sockets; i++) h->sockets[i].fd = -1;
+
+	for (i = 1; i < h->num_sockets; i++) {
+		udp_socket_t	*sock = &h->sockets[i];
+		fr_ipaddr_t	src_ipaddr = h->src_ipaddr;
+
+		sock->fd = fr_socket_client_udp(&src_ipaddr, &sock->src_port,
+						&h->inst->dst_ipaddr, h->inst->dst_port, true);
+		if (sock->fd < 0) {
+			PERROR("%s - Failed opening socket %u of %u", h->module_name, i + 1, h->num_sockets);
+			return -1;
+		}
+
+#ifdef SO_RCVBUF
+		if (h->inst->recv_buff_is_set) {
+			int opt = h->inst->recv_buff;
+
+			if (setsockopt(sock->fd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(int)) < 0) {
+				WARN("%s - Failed setting 'SO_RCVBUF': %s", h->module_name, fr_syserror(errno));
+			}
+		}
+#endif
+
+#ifdef SO_SNDBUF
+		if (h->inst->send_buff_is_set) {
+			int opt = h->inst->send_buff;
+
+			if (setsockopt(sock->fd, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(int)) < 0) {
+				WARN("%s - Failed setting 'SO_SNDBUF', write performance may be sub-optimal: %s",
+				     h->module_name, fr_syserror(errno));
+			}
+		}
+#endif
+
+		MEM(sock->tt = radius_track_alloc(h));
+	}
+
+	return 0;
+}
+
 /** Initialise a new outbound connection
  *
  * @param[out] h_out	Where to write the new file descriptor.
@@ -835,6 +953,16 @@ static fr_connection_state_t conn_init(void **h_out, fr_connection_t *conn, void
 #endif
 
 	h->fd = fd;
+	h->read_fd = -1;
+
+	h->num_sockets = h->inst->ports;
+	MEM(h->sockets = talloc_zero_array(h, udp_socket_t, h->num_sockets));
+	if (udp_sockets_open(h) < 0) goto fail;
+
+	if (h->num_sockets > 1) {
+		DEBUG("%s - Connection %s is also using %u other local ports",
+		      h->module_name, h->name, h->num_sockets - 1);
+	}
 
 	/*
 	 *	If we're doing status checks, then we want at least
@@ -879,18 +1007,23 @@ static fr_connection_state_t conn_init(void **h_out, fr_connection_t *conn, void
  */
 static void conn_close(UNUSED fr_event_list_t *el, void *handle, UNUSED void *uctx)
 {
-	udp_handle_t *h = talloc_get_type_abort(handle, udp_handle_t);
+	udp_handle_t	*h = talloc_get_type_abort(handle, udp_handle_t);
+	uint16_t	i;
 
 	/*
 	 *	There's tracking entries still allocated
 	 *	this is bad, they should have all been
 	 *	released.
 	 */
-	if (h->tt && (h->tt->num_requests != 0)) {
+	for (i = 0; i < h->num_sockets; i++) {
+		radius_track_t *tt = h->sockets[i].tt;
+
+		if (!tt || (tt->num_requests == 0)) continue;
+
 #ifndef NDEBUG
-		radius_track_state_log(&default_log, L_ERR, __FILE__, __LINE__, h->tt, udp_tracking_entry_log);
+		radius_track_state_log(&default_log, L_ERR, __FILE__, __LINE__, tt, udp_tracking_entry_log);
 #endif
-		fr_assert_fail("%u tracking entries still allocated at conn close", h->tt->num_requests);
+		fr_assert_fail("%u tracking entries still allocated at conn close", tt->num_requests);
 	}
 
 	DEBUG4("Freeing rlm_radius_udp handle %p", handle);
@@ -992,10 +1125,15 @@ static void conn_discard(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, v
  * @param[in] flags	describing the read event.
  * @param[in] uctx	The trunk connection handle (tconn).
  */
-static void conn_readable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+static void conn_readable(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
 {
 	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+	udp_handle_t		*h = talloc_get_type_abort(tconn->conn->h, udp_handle_t);
 
+	/*
+	 *	Only the socket which is readable is drained.
+	 */
+	h->read_fd = fd;
 	fr_trunk_connection_signal_readable(tconn);
 }
 
@@ -1044,6 +1182,7 @@ static void thread_conn_notify(fr_trunk_connection_t *tconn, fr_connection_t *co
 	udp_handle_t		*h = talloc_get_type_abort(conn->h, udp_handle_t);
 	fr_event_fd_cb_t	read_fn = NULL;
 	fr_event_fd_cb_t	write_fn = NULL;
+	uint16_t		i;
 
 	switch (notify_on) {
 		/*
@@ -1077,12 +1216,27 @@ static void thread_conn_notify(fr_trunk_connection_t *tconn, fr_connection_t *co
 			       write_fn,
 			       conn_error,
 			       tconn) < 0) {
+	fail:
 		PERROR("%s - Failed inserting FD event", h->module_name);
 
 		/*
 		 *	May free the connection!
 		 */
 		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	/*
+	 *	The other sockets are only ever read from.  Writes
+	 *	are driven by the first socket being writable.
+	 */
+	for (i = 1; i < h->num_sockets; i++) {
+		if (!read_fn) {
+			(void) fr_event_fd_delete(el, h->sockets[i].fd, FR_EVENT_FILTER_IO);
+			continue;
+		}
+
+		if (fr_event_fd_insert(h, el, h->sockets[i].fd, read_fn, NULL, conn_error, tconn) < 0) goto fail;
 	}
 }
 
@@ -1161,6 +1315,77 @@ static int8_t request_prioritise(void const *one, void const *two)
 	return (a->recv_time > b->recv_time) - (a->recv_time < b->recv_time);
 }
 
+/** Update the smoothed response time of the home server
+ *
+ * As with TCP (RFC 6298), but with times in nanoseconds.
+ *
+ *	RTTVAR = 3/4 * RTTVAR + 1/4 * |SRTT - R|
+ *	SRTT   = 7/8 * SRTT + 1/8 * R
+ */
+static void udp_rtt_update(udp_thread_t *thread, fr_time_delta_t rtt)
+{
+	fr_time_delta_t delta;
+
+	if (rtt < 0) return;
+
+	if (!thread->rtt_valid) {
+		thread->srtt = rtt;
+		thread->rttvar = rtt / 2;
+		thread->rtt_valid = true;
+		return;
+	}
+
+	delta = thread->srtt - rtt;
+	if (delta < 0) delta = -delta;
+
+	thread->rttvar += (delta - thread->rttvar) / 4;
+	thread->srtt += (rtt - thread->srtt) / 8;
+}
+
+/** Return the retransmission timers to use for a request
+ *
+ * If adaptive_retry is enabled, and we've had a response from the
+ * home server, the initial retransmission time is SRTT + 4 * RTTVAR,
+ * limited to between adaptive_retry_min and the configured
+ * initial_rtx_time.
+ *
+ * The maximum retransmission duration is limited to what remains of
+ * the request's deadline.  The other timers are unchanged.
+ */
+static fr_retry_config_t const *udp_retry_config(udp_handle_t *h, udp_request_t *u, request_t *request)
+{
+	rlm_radius_udp_t const	*inst = h->inst;
+	fr_retry_config_t const	*config = &inst->parent->retry[u->code];
+	fr_time_delta_t		rto;
+
+	fr_time_delta_t		mrd;
+
+	/*
+	 *	Stop retransmitting when the client gives up
+	 *	on the request.
+	 */
+	mrd = u->status_check ? config->mrd : request_deadline_limit(request, config->mrd);
+
+	if (!inst->adaptive_retry || u->status_check || !h->thread->rtt_valid) {
+		if (mrd == config->mrd) return config;
+
+		u->retry_config = *config;
+		u->retry_config.mrd = mrd;
+
+		return &u->retry_config;
+	}
+
+	rto = h->thread->srtt + (4 * h->thread->rttvar);
+	if (rto < inst->adaptive_retry_min) rto = inst->adaptive_retry_min;
+	if ((rto >= config->irt) && (mrd == config->mrd)) return config;
+
+	u->retry_config = *config;
+	if (rto < config->irt) u->retry_config.irt = rto;
+	u->retry_config.mrd = mrd;
+
+	return &u->retry_config;
+}
+
 /** Decode response packet data, extracting relevant information and validating the packet
  *
  * @param[in] ctx			to allocate pairs in.
@@ -1205,7 +1430,8 @@ static decode_fail_t decode(TALLOC_CTX *ctx, fr_pair_list_t *reply, uint8_t *res
 	memcpy(original + RADIUS_AUTH_VECTOR_OFFSET, request_authenticator, RADIUS_AUTH_VECTOR_LENGTH);
 
 	if (fr_radius_verify(data, original,
-			     (uint8_t const *) inst->secret, talloc_array_length(inst->secret) - 1) < 0) {
+			     (uint8_t const *) inst->secret, talloc_array_length(inst->secret) - 1,
+			     inst->secret_hmac) < 0) {
 		RPWDEBUG("Ignoring response with invalid signature");
 		return DECODE_FAIL_MA_INVALID;
 	}
@@ -1265,9 +1491,179 @@ static decode_fail_t decode(TALLOC_CTX *ctx, fr_pair_list_t *reply, uint8_t *res
 	 */
 	if (u->retry.start > h->mrs_time) h->mrs_time = u->retry.start;
 
+	/*
+	 *	Only packets which weren't retransmitted give an
+	 *	unambiguous response time (Karn's algorithm).
+	 */
+	if (inst->adaptive_retry && !u->status_check && (u->retry.count == 1)) {
+		udp_rtt_update(h->thread, fr_time() - u->retry.start);
+	}
+
 	return DECODE_FAIL_NONE;
 }
 
+/** Check that a VSA can be sent as-is
+ *
+ * @return
+ *	- true if none of the vendor attributes are encrypted.
+ *	- false if we don't know.
+ */
+static bool vsa_passthrough_ok(fr_dict_attr_t const *da, uint8_t const *attr)
+{
+	uint8_t const		*p, *end;
+	uint32_t		pen;
+	fr_dict_attr_t const	*vendor;
+	fr_dict_vendor_t const	*dv;
+
+	if (attr[1] < 6) return true;
+
+	pen = fr_net_to_uint32(attr + 2);
+	vendor = fr_dict_attr_child_by_num(da, pen);
+	if (!vendor) return true;	/* nothing we know is encrypted */
+
+	dv = fr_dict_vendor_by_num(dict_radius, pen);
+	if (!dv || dv->continuation || (dv->type != 1) || (dv->length != 1)) return false;
+
+	end = attr + attr[1];
+	for (p = attr + 6; (p + 2) <= end; p += p[1]) {
+		fr_dict_attr_t const *child;
+
+		if (p[1] < 2) return false;
+
+		child = fr_dict_attr_child_by_num(vendor, p[0]);
+		if (child && flag_encrypted(&child->flags)) return false;
+	}
+
+	return true;
+}
+
+/** Copy the attributes of the original request into the outgoing packet
+ *
+ * User-Password and Tunnel-Password are re-encrypted for the home
+ * server's secret, and the original Message-Authenticator is dropped.
+ * The header, Proxy-State and Message-Authenticator are added by the
+ * caller, as for an encoded packet.
+ *
+ * @return
+ *	- >0 the length of the packet.
+ *	- 0 if the packet has to be encoded from the request pairs instead.
+ */
+static ssize_t encode_passthrough(rlm_radius_udp_t const *inst, request_t *request, udp_request_t *u,
+				  uint8_t id, size_t reserved)
+{
+	fr_radius_packet_t const	*packet = request->packet;
+	uint8_t const			*attr, *end;
+	uint8_t				*out;
+	char const			*secret;
+	size_t				secret_len;
+	bool				chap_password = false, chap_challenge = false;
+
+	if ((request->dict != dict_radius) || !request->client || !packet->data ||
+	    (packet->code != u->code) || (packet->data_len < RADIUS_HEADER_LENGTH) ||
+	    ((packet->data_len + reserved) > u->packet_len)) return 0;
+
+	secret = request->client->secret;
+	secret_len = talloc_array_length(secret) - 1;
+
+	u->packet[0] = u->code;
+	u->packet[1] = id;
+
+	/*
+	 *	Access-Request and Status-Server already have a
+	 *	random authenticator.  The others are signed.
+	 */
+	switch (u->code) {
+	case FR_RADIUS_CODE_ACCESS_REQUEST:
+	case FR_RADIUS_CODE_STATUS_SERVER:
+		break;
+
+	default:
+		memset(u->packet + RADIUS_AUTH_VECTOR_OFFSET, 0, RADIUS_AUTH_VECTOR_LENGTH);
+		break;
+	}
+
+	out = u->packet + RADIUS_HEADER_LENGTH;
+	end = packet->data + packet->data_len;
+
+	/*
+	 *	The listener called fr_radius_ok(), so the
+	 *	attributes are well formed.
+	 */
+	for (attr = packet->data + RADIUS_HEADER_LENGTH; attr < end; attr += attr[1]) {
+		fr_dict_attr_t const	*da;
+		size_t			offset = 2;
+
+		if (attr[0] == attr_message_authenticator->attr) continue;
+		if (attr[0] == attr_chap_password->attr) chap_password = true;
+		if (attr[0] == attr_chap_challenge->attr) chap_challenge = true;
+
+		memcpy(out, attr, attr[1]);
+
+		da = fr_dict_attr_child_by_num(fr_dict_root(dict_radius), attr[0]);
+		if (!da) goto next;
+
+		if (da->type == FR_TYPE_VSA) {
+			if (!vsa_passthrough_ok(da, attr)) {
+				RDEBUG3("Can't pass through %s with encrypted attributes", da->name);
+				return 0;
+			}
+			goto next;
+		}
+
+		if (!flag_encrypted(&da->flags)) goto next;
+
+		/*
+		 *	The authenticator of other packets is a
+		 *	signature, so we'd need to work out what the
+		 *	client encrypted with.  Leave that to the
+		 *	decoder.
+		 */
+		if (u->code != FR_RADIUS_CODE_ACCESS_REQUEST) return 0;
+
+		switch (da->flags.subtype) {
+		case FLAG_ENCRYPT_USER_PASSWORD:
+			break;
+
+		case FLAG_TAGGED_TUNNEL_PASSWORD:
+			if ((attr[1] > 2) && (attr[2] < 0x20)) offset++;
+			FALL_THROUGH;
+
+		case FLAG_ENCRYPT_TUNNEL_PASSWORD:
+			break;
+
+		default:
+			RDEBUG3("Can't pass through %s", da->name);
+			return 0;
+		}
+
+		if (fr_radius_password_rekey(out + offset, attr[1] - offset, flag_tunnel_password(&da->flags),
+					     secret, secret_len, packet->data + RADIUS_AUTH_VECTOR_OFFSET,
+					     inst->secret, talloc_array_length(inst->secret) - 1,
+					     u->packet + RADIUS_AUTH_VECTOR_OFFSET) < 0) {
+			RDEBUG3("Can't pass through %s - %s", da->name, fr_strerror());
+			return 0;
+		}
+
+	next:
+		out += attr[1];
+	}
+
+	/*
+	 *	The original authenticator was the CHAP challenge,
+	 *	and the home server won't see it.
+	 */
+	if ((u->code == FR_RADIUS_CODE_ACCESS_REQUEST) && chap_password && !chap_challenge) {
+		if (((size_t) (out - u->packet) + 2 + RADIUS_AUTH_VECTOR_LENGTH + reserved) > u->packet_len) return 0;
+
+		out[0] = (uint8_t) attr_chap_challenge->attr;
+		out[1] = 2 + RADIUS_AUTH_VECTOR_LENGTH;
+		memcpy(out + 2, packet->data + RADIUS_AUTH_VECTOR_OFFSET, RADIUS_AUTH_VECTOR_LENGTH);
+		out += out[1];
+	}
+
+	return out - u->packet;
+}
+
 static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_t *u, uint8_t id)
 {
 	ssize_t			packet_len;
@@ -1349,13 +1745,25 @@ static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_
 	 */
 	fr_assert(u->packet_len >= (size_t) (RADIUS_HEADER_LENGTH + proxy_state + message_authenticator));
 
+	/*
+	 *	Forward the original packet if we can.  There's no
+	 *	original packet for status checks, nor when we're
+	 *	originating packets.
+	 */
+	packet_len = 0;
+	if (inst->passthrough && proxy_state) {
+		packet_len = encode_passthrough(inst, request, u, id, proxy_state + message_authenticator);
+	}
+
 	/*
 	 *	Encode it, leaving room for Proxy-State and
 	 *	Message-Authenticator if necessary.
 	 */
-	packet_len = fr_radius_encode(u->packet, u->packet_len - (proxy_state + message_authenticator), NULL,
-				      inst->secret, talloc_array_length(inst->secret) - 1,
-				      u->code, id, &request->request_pairs);
+	if (!packet_len) {
+		packet_len = fr_radius_encode(u->packet, u->packet_len - (proxy_state + message_authenticator), NULL,
+					      inst->secret, talloc_array_length(inst->secret) - 1,
+					      u->code, id, &request->request_pairs);
+	}
 	if (fr_pair_encode_is_error(packet_len)) {
 		RPERROR("Failed encoding packet");
 
@@ -1396,7 +1804,6 @@ static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_
 	if (proxy_state) {
 		uint8_t		*attr = u->packet + packet_len;
 		fr_pair_t	*vp;
-		fr_dcursor_t	cursor;
 		int		count = 0;
 
 		/*
@@ -1406,10 +1813,8 @@ static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_
 		 *	sure that it's a loop.
 		 */
 		if (DEBUG_ENABLED) {
-			for (vp = fr_dcursor_iter_by_da_init(&cursor, &request->request_pairs, attr_proxy_state);
-			     vp;
-			     vp = fr_dcursor_next(&cursor)) {
-				if ((vp->vp_length == 5) && (memcmp(vp->vp_octets, &inst->parent->proxy_state, 4) == 0)) {
+			fr_pair_list_foreach_by_da(&request->request_pairs, proxy, attr_proxy_state) {
+				if ((proxy->vp_length == 5) && (memcmp(proxy->vp_octets, &inst->parent->proxy_state, 4) == 0)) {
 					count++;
 				}
 			}
@@ -1515,7 +1920,7 @@ static int encode(rlm_radius_udp_t const *inst, request_t *request, udp_request_
 		 *	Now that we're done mangling the packet, sign it.
 		 */
 		if (fr_radius_sign(u->packet, NULL, (uint8_t const *) inst->secret,
-				   talloc_array_length(inst->secret) - 1) < 0) {
+				   talloc_array_length(inst->secret) - 1, inst->secret_hmac) < 0) {
 			RERROR("Failed signing packet");
 			goto error;
 		}
@@ -1747,6 +2152,111 @@ static void request_timeout(fr_event_list_t *el, fr_time_t now, void *uctx)
 	fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
 }
 
+/** Send coalesced datagrams, grouped by the socket they're for
+ *
+ * Consecutive packets for the same socket are written with a single call
+ * to sendmmsg().  We stop at the first socket which doesn't accept all of
+ * its packets, so that everything after the returned count can be placed
+ * back in the pending state.
+ *
+ * @param[in] tconn	the packets are being sent over.
+ * @param[in] h		holding the coalesced packets.
+ * @param[in] queued	how many packets there are.
+ * @return
+ *	- The number of packets, from the start of the coalesced array,
+ *	  which were sent, or failed.
+ *	- -1 if the connection has been signalled to reconnect.
+ */
+static int udp_send_coalesced(fr_trunk_connection_t *tconn, udp_handle_t *h, uint16_t queued)
+{
+	int	sent = 0;
+
+	while (sent < queued) {
+		uint16_t	s = h->coalesced[sent].socket;
+		uint16_t	run;
+		int		ret;
+
+		for (run = 1; (sent + run) < queued; run++) {
+			if (h->coalesced[sent + run].socket != s) break;
+		}
+
+		ret = sendmmsg(h->sockets[s].fd, &h->mmsgvec[sent], run, 0);
+		if (ret < 0) {		/* Error means no messages were sent */
+			/*
+			 *	Temporary conditions
+			 */
+			switch (errno) {
+#if defined(EWOULDBLOCK) && (EWOULDBLOCK != EAGAIN)
+			case EWOULDBLOCK:	/* No outbound packet buffers, maybe? */
+#endif
+			case EAGAIN:		/* No outbound packet buffers, maybe? */
+			case EINTR:		/* Interrupted by signal */
+			case ENOBUFS:		/* No outbound packet buffers, maybe? */
+			case ENOMEM:		/* malloc failure in kernel? */
+				WARN("%s - Failed sending data over connection %s: %s",
+				     h->module_name, h->name, fr_syserror(errno));
+				return sent;
+
+			/*
+			 *	Fatal, request specific conditions
+			 *
+			 *	sendmmsg will only return an error condition if the
+			 *	first packet being sent errors.
+			 *
+			 *	When we get request specific errors, we need to fail
+			 *	the first request in the set, and move the rest of
+			 *	the packets back to the pending state.
+			 */
+			case EMSGSIZE:		/* Packet size exceeds max size allowed on socket */
+				ERROR("%s - Failed sending data over connection %s: %s",
+				      h->module_name, h->name, fr_syserror(errno));
+				fr_trunk_request_signal_fail(h->coalesced[sent].treq);
+				return sent + 1;
+
+			/*
+			 *	Will re-queue any 'sent' requests, so we don't
+			 *	have to do any cleanup.
+			 */
+			default:
+				ERROR("%s - Failed sending data over connection %s: %s",
+				      h->module_name, h->name, fr_syserror(errno));
+				fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+				return -1;
+			}
+		}
+
+		sent += ret;
+		if (ret < run) break;
+	}
+
+	return sent;
+}
+
+/** Pick the socket to allocate a new ID from
+ *
+ * Sockets are filled in order, so that when there are few requests
+ * outstanding, the packets all go out over the first socket, and
+ * can be written with a single call to sendmmsg().
+ *
+ * @param[in] h		to pick a socket from.
+ * @return the index of the first socket with a free ID.
+ */
+static inline uint16_t udp_socket_select(udp_handle_t *h)
+{
+	uint16_t	i;
+
+	for (i = 0; i < h->num_sockets; i++) {
+		if (h->sockets[i].tt->num_requests < UINT8_MAX + 1) return i;
+	}
+
+	/*
+	 *	The trunk shouldn't have given us more requests
+	 *	than we have IDs, so allocation from the first
+	 *	socket will fail, and complain.
+	 */
+	return 0;
+}
+
 static void request_mux(fr_event_list_t *el,
 			fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
 {
@@ -1788,7 +2298,7 @@ static void request_mux(fr_event_list_t *el,
 		 *	Start retransmissions from when the socket is writable.
 		 */
 		if (!u->retry.start) {
-			(void) fr_retry_init(&u->retry, fr_time(), &h->inst->parent->retry[u->code]);
+			(void) fr_retry_init(&u->retry, fr_time(), udp_retry_config(h, u, request));
 			fr_assert(u->retry.rt > 0);
 			fr_assert(u->retry.next > 0);
 		}
@@ -1804,12 +2314,17 @@ static void request_mux(fr_event_list_t *el,
 		 *	the REQUEUE signal was recevied.
 		 */
 		if (!u->packet || !u->can_retransmit) {
+			radius_track_t	*tt;
+
 			fr_assert(!u->rr);
 
-			if (unlikely(radius_track_entry_reserve(&u->rr, treq, h->tt, request, u->code, treq) < 0)) {
+			u->socket = udp_socket_select(h);
+			tt = h->sockets[u->socket].tt;
+
+			if (unlikely(radius_track_entry_reserve(&u->rr, treq, tt, request, u->code, treq) < 0)) {
 #ifndef NDEBUG
 				radius_track_state_log(&default_log, L_ERR, __FILE__, __LINE__,
-						       h->tt, udp_tracking_entry_log);
+						       tt, udp_tracking_entry_log);
 #endif
 				fr_assert_fail("Tracking entry allocation failed: %s", fr_strerror());
 				fr_trunk_request_signal_fail(treq);
@@ -1853,6 +2368,7 @@ static void request_mux(fr_event_list_t *el,
 		h->coalesced[queued].treq = treq;
 		h->coalesced[queued].out.iov_base = u->packet;
 		h->coalesced[queued].out.iov_len = u->packet_len;
+		h->coalesced[queued].socket = u->socket;
 
 		/*
 		 *	Record how much data we have in total.
@@ -1883,53 +2399,8 @@ static void request_mux(fr_event_list_t *el,
 	/*
 	 *	Send the coalesced datagrams
 	 */
-	sent = sendmmsg(h->fd, h->mmsgvec, queued, 0);
-	if (sent < 0) {		/* Error means no messages were sent */
-		sent = 0;
-
-		/*
-		 *	Temporary conditions
-		 */
-		switch (errno) {
-#if defined(EWOULDBLOCK) && (EWOULDBLOCK != EAGAIN)
-		case EWOULDBLOCK:	/* No outbound packet buffers, maybe? */
-#endif
-		case EAGAIN:		/* No outbound packet buffers, maybe? */
-		case EINTR:		/* Interrupted by signal */
-		case ENOBUFS:		/* No outbound packet buffers, maybe? */
-		case ENOMEM:		/* malloc failure in kernel? */
-			WARN("%s - Failed sending data over connection %s: %s",
-			     h->module_name, h->name, fr_syserror(errno));
-			break;
-
-		/*
-		 *	Fatal, request specific conditions
-		 *
-		 *	sendmmsg will only return an error condition if the
-		 *	first packet being sent errors.
-		 *
-		 *	When we get request specific errors, we need to fail
-		 *	the first request in the set, and move the rest of
-		 *	the packets back to the pending state.
-		 */
-		case EMSGSIZE:		/* Packet size exceeds max size allowed on socket */
-			ERROR("%s - Failed sending data over connection %s: %s",
-			      h->module_name, h->name, fr_syserror(errno));
-			fr_trunk_request_signal_fail(h->coalesced[0].treq);
-			sent = 1;
-			break;
-
-		/*
-		 *	Will re-queue any 'sent' requests, so we don't
-		 *	have to do any cleanup.
-		 */
-		default:
-			ERROR("%s - Failed sending data over connection %s: %s",
-			      h->module_name, h->name, fr_syserror(errno));
-			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
-			return;
-		}
-	}
+	sent = udp_send_coalesced(tconn, h, queued);
+	if (sent < 0) return;
 
 	/*
 	 *	For all messages that were actually sent by sendmmsg
@@ -2313,12 +2784,17 @@ static void status_check_reply(fr_trunk_request_t *treq, fr_time_t now)
 	fr_trunk_connection_signal_active(treq->tconn);
 }
 
-static void request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+/** Read and process all the replies waiting on one of a connection's sockets
+ *
+ * @param[in] tconn	the socket belongs to.
+ * @param[in] h		the socket belongs to.
+ * @param[in] sock	to read from.
+ * @return
+ *	- 0 when the socket has been drained.
+ *	- -1 if the connection has been signalled to reconnect.
+ */
+static int udp_socket_demux(fr_trunk_connection_t *tconn, udp_handle_t *h, udp_socket_t *sock)
 {
-	udp_handle_t		*h = talloc_get_type_abort(conn->h, udp_handle_t);;
-
-	DEBUG3("%s - Reading data for connection %s", h->module_name, h->name);
-
 	while (true) {
 		ssize_t			slen;
 
@@ -2339,16 +2815,16 @@ static void request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, U
 		 *	saves a round through the event loop.  If we're not
 		 *	busy, a few extra system calls don't matter.
 		 */
-		slen = read(h->fd, h->buffer, h->buflen);
-		if (slen == 0) return;
+		slen = read(sock->fd, h->buffer, h->buflen);
+		if (slen == 0) return 0;
 
 		if (slen < 0) {
-			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return 0;
 
 			ERROR("%s - Failed reading response from socket: %s",
 			      h->module_name, fr_syserror(errno));
 			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
-			return;
+			return -1;
 		}
 
 		if (slen < RADIUS_HEADER_LENGTH) {
@@ -2359,9 +2835,10 @@ static void request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, U
 
 		/*
 		 *	Note that we don't care about packet codes.  All
-		 *	packet codes share the same ID space.
+		 *	packet codes share the same ID space, but each
+		 *	socket has its own.
 		 */
-		rr = radius_track_entry_find(h->tt, h->buffer[1], NULL);
+		rr = radius_track_entry_find(sock->tt, h->buffer[1], NULL);
 		if (!rr) {
 			WARN("%s - Ignoring reply with ID %i that arrived too late",
 			     h->module_name, h->buffer[1]);
@@ -2468,6 +2945,27 @@ static void request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, U
 	}
 }
 
+static void request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	udp_handle_t		*h = talloc_get_type_abort(conn->h, udp_handle_t);
+	int			read_fd = h->read_fd;
+	uint16_t		i;
+
+	DEBUG3("%s - Reading data for connection %s", h->module_name, h->name);
+
+	h->read_fd = -1;
+
+	/*
+	 *	If we know which socket is readable, only drain
+	 *	that one.  Otherwise check all of them.
+	 */
+	for (i = 0; i < h->num_sockets; i++) {
+		if ((read_fd >= 0) && (h->sockets[i].fd != read_fd)) continue;
+
+		if (udp_socket_demux(tconn, h, &h->sockets[i]) < 0) return;
+	}
+}
+
 /** Remove the request from any tracking structures
  *
  * Frees encoded packets if the request is being moved to a new connection
@@ -2509,6 +3007,7 @@ static void request_conn_release(fr_connection_t *conn, void *preq_to_reset, UNU
 {
 	udp_request_t		*u = talloc_get_type_abort(preq_to_reset, udp_request_t);
 	udp_handle_t		*h = talloc_get_type_abort(conn->h, udp_handle_t);
+	uint16_t		i;
 
 	if (u->ev) (void)fr_event_timer_delete(&u->ev);
 	if (u->packet) udp_request_reset(u);
@@ -2519,7 +3018,10 @@ static void request_conn_release(fr_connection_t *conn, void *preq_to_reset, UNU
 	 *	If there are no outstanding tracking entries
 	 *	allocated then the connection is "idle".
 	 */
-	if (!h->tt || (h->tt->num_requests == 0)) h->last_idle = fr_time();
+	for (i = 0; i < h->num_sockets; i++) {
+		if (h->sockets[i].tt && (h->sockets[i].tt->num_requests != 0)) return;
+	}
+	h->last_idle = fr_time();
 }
 
 /** Clear out anything associated with the handle from the request
@@ -2900,6 +3402,31 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		FR_INTEGER_BOUND_CHECK("send_buff", inst->send_buff, <=, (1 << 30));
 	}
 
+	/*
+	 *	Replicated packets don't need IDs to be tracked, so
+	 *	replicating always uses a single socket.
+	 */
+	if (inst->replicate) inst->ports = 1;
+	FR_INTEGER_BOUND_CHECK("ports", inst->ports, >=, 1);
+	FR_INTEGER_BOUND_CHECK("ports", inst->ports, <=, 256);
+
+	/*
+	 *	Each port has its own ID space, so we can't have
+	 *	more than 255 requests outstanding per port.
+	 */
+	FR_INTEGER_BOUND_CHECK("trunk.per_connection_max", parent->trunk_conf.max_req_per_conn,
+			       <=, inst->ports * UINT8_MAX);
+
+	/*
+	 *	Absorb the secret into the HMAC-MD5 state once,
+	 *	instead of for every packet we sign or verify.
+	 */
+	inst->secret_hmac = fr_hmac_md5_key_alloc(inst, (uint8_t const *) inst->secret,
+						  talloc_array_length(inst->secret) - 1);
+	if (!inst->secret_hmac) {
+		cf_log_err(conf, "Failed precomputing HMAC state for 'secret'");
+		return -1;
+	}
 
 	return 0;
 }
@@ -30,6 +30,8 @@ RCSID("$Id$")
 #include	<freeradius-devel/radius/radius.h>
 
 #include	<fcntl.h>
+#include	<sys/mman.h>
+#include	<sys/stat.h>
 
 #include "config.h"
 
@@ -48,13 +50,26 @@ struct nas_port_s {
 	NAS_PORT 		*next;
 };
 
+/*
+ *	A radutmp file which is mapped into memory, with each session
+ *	stored at a slot chosen by hashing its NAS and port.
+ */
+typedef struct {
+	char		*filename;	//!< Of the mapped file.
+	int		fd;		//!< Used for locking slots.
+	struct radutmp	*slots;		//!< The mapped file.
+	uint32_t	num_slots;	//!< Number of slots in the file.
+} radutmp_table_t;
+
 typedef struct {
 	NAS_PORT	*nas_port_list;
+	radutmp_table_t	*table;		//!< If "slots" is set.
 	char const	*filename;
 	char const	*username;
 	bool		check_nas;
 	uint32_t	permission;
 	bool		caller_id_ok;
+	uint32_t	slots;
 } rlm_radutmp_t;
 
 static const CONF_PARSER module_config[] = {
@@ -63,6 +78,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("check_with_nas", FR_TYPE_BOOL, rlm_radutmp_t, check_nas), .dflt = "yes" },
 	{ FR_CONF_OFFSET("permissions", FR_TYPE_UINT32, rlm_radutmp_t, permission), .dflt = "0644" },
 	{ FR_CONF_OFFSET("caller_id", FR_TYPE_BOOL, rlm_radutmp_t, caller_id_ok), .dflt = "no" },
+	{ FR_CONF_OFFSET("slots", FR_TYPE_UINT32, rlm_radutmp_t, slots), .dflt = "0" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -156,6 +172,251 @@ static unlang_action_t radutmp_zap(rlm_rcode_t *p_result, request_t *request, ch
 	RETURN_MODULE_OK;
 }
 
+static int _radutmp_table_free(radutmp_table_t *table)
+{
+	if (table->slots) munmap(table->slots, table->num_slots * sizeof(struct radutmp));
+	if (table->fd >= 0) close(table->fd);
+
+	return 0;
+}
+
+/*
+ *	Map the radutmp file, creating it with "slots" empty entries
+ *	if necessary.  The last file mapped is kept open.
+ */
+static radutmp_table_t *radutmp_table_open(rlm_radutmp_t *inst, request_t *request, char const *filename)
+{
+	radutmp_table_t	*table;
+	struct stat	st;
+	size_t		len = (size_t) inst->slots * sizeof(struct radutmp);
+	void		*map;
+
+	if (inst->table && (strcmp(inst->table->filename, filename) == 0)) return inst->table;
+
+	TALLOC_FREE(inst->table);
+
+	MEM(table = talloc_zero(inst, radutmp_table_t));
+	table->fd = -1;
+	talloc_set_destructor(table, _radutmp_table_free);
+	MEM(table->filename = talloc_strdup(table, filename));
+
+	table->fd = open(filename, O_RDWR | O_CREAT, inst->permission);
+	if (table->fd < 0) {
+		REDEBUG("Error accessing file %s: %s", filename, fr_syserror(errno));
+	error:
+		talloc_free(table);
+		return NULL;
+	}
+
+	if (fstat(table->fd, &st) < 0) {
+		REDEBUG("Failed reading size of %s: %s", filename, fr_syserror(errno));
+		goto error;
+	}
+
+	/*
+	 *	New files are zeroed, which is the same as every
+	 *	slot being idle.
+	 */
+	if (((size_t) st.st_size < len) && (ftruncate(table->fd, len) < 0)) {
+		REDEBUG("Failed extending %s to %u slots: %s", filename, inst->slots, fr_syserror(errno));
+		goto error;
+	}
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, table->fd, 0);
+	if (map == MAP_FAILED) {
+		REDEBUG("Failed mapping %s: %s", filename, fr_syserror(errno));
+		goto error;
+	}
+	table->slots = map;
+	table->num_slots = inst->slots;
+
+	inst->table = table;
+	return table;
+}
+
+/*
+ *	Lock or unlock one slot.  Other processes using the same file
+ *	lock the same byte ranges.  Readers such as radwho don't lock.
+ */
+static int radutmp_slot_lock(radutmp_table_t *table, uint32_t slot, short type)
+{
+	struct flock fl = {
+		.l_type = type,
+		.l_whence = SEEK_SET,
+		.l_start = (off_t) slot * sizeof(struct radutmp),
+		.l_len = sizeof(struct radutmp)
+	};
+
+	return fcntl(table->fd, (type == F_UNLCK) ? F_SETLK : F_SETLKW, &fl);
+}
+
+/*
+ *	A slot which has never been used ends the search for a session.
+ */
+static inline bool radutmp_slot_unused(struct radutmp const *u)
+{
+	return (u->type == P_IDLE) && (u->nas_address == 0) && (u->time == 0);
+}
+
+/*
+ *	Zap all users on a NAS from a mapped radutmp file.
+ */
+static unlang_action_t radutmp_table_zap(rlm_rcode_t *p_result, request_t *request, radutmp_table_t *table,
+					 uint32_t nasaddr, time_t t)
+{
+	uint32_t	i;
+	struct radutmp	*u;
+
+	for (i = 0; i < table->num_slots; i++) {
+		u = &table->slots[i];
+
+		if ((u->type != P_LOGIN) || (nasaddr != u->nas_address)) continue;
+
+		if (radutmp_slot_lock(table, i, F_WRLCK) < 0) {
+			REDEBUG("Failed to acquire lock on file %s: %s", table->filename, fr_syserror(errno));
+			RETURN_MODULE_FAIL;
+		}
+
+		if ((u->type == P_LOGIN) && (nasaddr == u->nas_address)) {
+			u->type = P_IDLE;
+			u->time = t;
+		}
+
+		(void) radutmp_slot_lock(table, i, F_UNLCK);
+	}
+
+	RETURN_MODULE_OK;
+}
+
+/*
+ *	Update the session for a NAS / port in a mapped radutmp file.
+ *
+ *	The session is stored at the first slot found by linear probing
+ *	from its hash, so this is O(1) no matter how many sessions
+ *	there are.  The first slot probed is locked for the whole
+ *	update, so updates for the same NAS and port are serialised.
+ *	Other slots are locked before they're written.
+ */
+static rlm_rcode_t radutmp_table_update(request_t *request, radutmp_table_t *table, struct radutmp *ut,
+					int status, char const *nas)
+{
+	uint32_t	home, slot, i, found, reuse;
+	struct radutmp	*u;
+	rlm_rcode_t	rcode = RLM_MODULE_OK;
+	int		r;
+
+	home = fr_hash_update(&ut->nas_address, sizeof(ut->nas_address),
+			      fr_hash(&ut->nas_port, sizeof(ut->nas_port))) % table->num_slots;
+
+	if (radutmp_slot_lock(table, home, F_WRLCK) < 0) {
+		REDEBUG("Error acquiring lock on %s: %s", table->filename, fr_syserror(errno));
+		return RLM_MODULE_FAIL;
+	}
+
+again:
+	found = reuse = UINT32_MAX;
+	for (i = 0; i < table->num_slots; i++) {
+		slot = (home + i) % table->num_slots;
+		u = &table->slots[slot];
+
+		if (radutmp_slot_unused(u)) {
+			if (reuse == UINT32_MAX) reuse = slot;
+			break;
+		}
+
+		if ((u->nas_address == ut->nas_address) && (u->nas_port == ut->nas_port)) {
+			found = slot;
+			break;
+		}
+
+		if ((u->type == P_IDLE) && (reuse == UINT32_MAX)) reuse = slot;
+	}
+
+	slot = (found != UINT32_MAX) ? found : reuse;
+	if (slot == UINT32_MAX) {
+		if (status == FR_STATUS_STOP) {
+			RWDEBUG("Logout for NAS %s port %u, but no Login record", nas, ut->nas_port);
+			goto done;
+		}
+
+		REDEBUG("No free slots in %s", table->filename);
+		rcode = RLM_MODULE_FAIL;
+		goto done;
+	}
+	u = &table->slots[slot];
+
+	/*
+	 *	Someone else may have written the slot while we were
+	 *	looking at it, so check it again once it's locked.
+	 */
+	if (slot != home) {
+		if (radutmp_slot_lock(table, slot, F_WRLCK) < 0) {
+			REDEBUG("Error acquiring lock on %s: %s", table->filename, fr_syserror(errno));
+			rcode = RLM_MODULE_FAIL;
+			goto done;
+		}
+
+		if ((found != UINT32_MAX) ?
+		    ((u->nas_address != ut->nas_address) || (u->nas_port != ut->nas_port)) :
+		    (u->type != P_IDLE)) {
+			(void) radutmp_slot_lock(table, slot, F_UNLCK);
+			goto again;
+		}
+	}
+
+	r = 0;
+	if ((found != UINT32_MAX) && !((status == FR_STATUS_STOP) && (u->type == P_IDLE))) {
+		r = 1;
+
+		if ((status == FR_STATUS_STOP) && strncmp(ut->session_id, u->session_id, sizeof(u->session_id)) != 0) {
+			if (u->type == P_LOGIN) {
+				RWDEBUG("Logout entry for NAS %s port %u has wrong ID", nas, u->nas_port);
+			}
+			r = -1;
+
+		} else if ((status == FR_STATUS_START) &&
+			   (strncmp(ut->session_id, u->session_id, sizeof(u->session_id)) == 0) &&
+			   (u->time >= ut->time)) {
+			if (u->type == P_LOGIN) {
+				RIDEBUG("Login entry for NAS %s port %u duplicate", nas, u->nas_port);
+			} else {
+				RWDEBUG("Login entry for NAS %s port %u wrong order", nas, u->nas_port);
+			}
+			r = -1;
+
+		} else if ((status == FR_STATUS_ALIVE) &&
+			   (strncmp(ut->session_id, u->session_id, sizeof(u->session_id)) == 0) &&
+			   (u->type == P_LOGIN)) {
+			/*
+			 *	Keep the original login time.
+			 */
+			ut->time = u->time;
+		}
+	}
+
+	if ((r >= 0) && ((status == FR_STATUS_START) || (status == FR_STATUS_ALIVE))) {
+		ut->type = P_LOGIN;
+		memcpy(u, ut, sizeof(*u));
+	}
+
+	if (status == FR_STATUS_STOP) {
+		if (r > 0) {
+			u->type = P_IDLE;
+			u->time = ut->time;
+			u->delay = ut->delay;
+		} else if (r == 0) {
+			RWDEBUG("Logout for NAS %s port %u, but no Login record", nas, ut->nas_port);
+		}
+	}
+
+	if (slot != home) (void) radutmp_slot_lock(table, slot, F_UNLCK);
+
+done:
+	(void) radutmp_slot_lock(table, home, F_UNLCK);
+
+	return rcode;
+}
+
 /*
  *	Lookup a NAS_PORT in the nas_port_list
  */
@@ -196,6 +457,7 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 	char			*filename = NULL;
 	char			*expanded = NULL;
 	RADCLIENT		*client;
+	radutmp_table_t		*table = NULL;
 
 	if (request->dict != dict_radius) RETURN_MODULE_NOOP;
 
@@ -343,16 +605,32 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 	 *	Hmm... we may not want to zap all of the users when the NAS comes up, because of issues with receiving
 	 *	UDP packets out of order.
 	 */
+	if (inst->slots) {
+		table = radutmp_table_open(inst, request, filename);
+		if (!table) {
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+	}
+
 	if (status == FR_STATUS_ACCOUNTING_ON && (ut.nas_address != htonl(INADDR_NONE))) {
 		RIDEBUG("NAS %s restarted (Accounting-On packet seen)", nas);
-		radutmp_zap(&rcode, request, filename, ut.nas_address, ut.time);
+		if (table) {
+			radutmp_table_zap(&rcode, request, table, ut.nas_address, ut.time);
+		} else {
+			radutmp_zap(&rcode, request, filename, ut.nas_address, ut.time);
+		}
 
 		goto finish;
 	}
 
 	if (status == FR_STATUS_ACCOUNTING_OFF && (ut.nas_address != htonl(INADDR_NONE))) {
 		RIDEBUG("NAS %s rebooted (Accounting-Off packet seen)", nas);
-		radutmp_zap(&rcode, request, filename, ut.nas_address, ut.time);
+		if (table) {
+			radutmp_table_zap(&rcode, request, table, ut.nas_address, ut.time);
+		} else {
+			radutmp_zap(&rcode, request, filename, ut.nas_address, ut.time);
+		}
 
 		goto finish;
 	}
@@ -399,6 +677,11 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 		goto finish;
 	}
 
+	if (table) {
+		rcode = radutmp_table_update(request, table, &ut, status, nas);
+		goto finish;
+	}
+
 	/*
 	 *	Enter into the radutmp file.
 	 */
@@ -44,12 +44,14 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/modpriv.h>
+#include <freeradius-devel/unlang/base.h>
 
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/base16.h>
 
 #include <freeradius-devel/redis/base.h>
 #include <freeradius-devel/redis/cluster.h>
+#include <freeradius-devel/redis/pipeline.h>
 #include "redis_ippool.h"
 
 #include <freeradius-devel/dhcpv4/dhcpv4.h>
@@ -97,9 +99,18 @@ typedef struct {
 	bool			copy_on_update; //!< Copy the address provided by ip_address to the
 						//!< allocated_address_attr if updates are successful.
 
-	fr_redis_cluster_t	*cluster;	//!< Redis cluster.
+	fr_trunk_conf_t		trunk_conf;	//!< Trunk configuration for lease operations.
+
+	fr_redis_cluster_t	*cluster;	//!< Redis cluster.  Used to maintain the slot map.
 } rlm_redis_ippool_t;
 
+/** rlm_redis_ippool thread instance
+ *
+ */
+typedef struct {
+	fr_redis_cluster_thread_t *cluster;	//!< Trunks to each of the cluster's nodes.
+} rlm_redis_ippool_thread_t;
+
 static CONF_PARSER redis_config[] = {
 	REDIS_COMMON_CONFIG,
 	CONF_PARSER_TERMINATOR
@@ -134,6 +145,8 @@ static CONF_PARSER module_config[] = {
 	 *	minimum of config changes.
 	 */
 	{ FR_CONF_POINTER("redis", FR_TYPE_SUBSECTION, NULL), .subcs = redis_config },
+
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_redis_ippool_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -453,200 +466,314 @@ static void ippool_action_print(request_t *request, ippool_action_t action,
 	talloc_free(gateway_str);
 }
 
-/** Execute a script against Redis cluster
+/** A lease operation in progress
  *
- * Handles uploading the script to the server if required.
+ */
+typedef struct {
+	rlm_redis_ippool_t const	*inst;		//!< Instance of rlm_redis_ippool.
+	ippool_action_t			action;		//!< Being performed.
+
+	uint8_t const			*key_prefix;	//!< Name of the pool.
+	size_t				key_prefix_len;	//!< Length of the pool name.
+	uint8_t const			*owner;		//!< Lease owner identifier.
+	size_t				owner_len;	//!< Length of the lease owner identifier.
+	uint8_t const			*gateway_id;	//!< Gateway identifier.
+	size_t				gateway_id_len;	//!< Length of the gateway identifier.
+	fr_ipaddr_t			ip;		//!< Address being updated or released.
+	char const			*ip_str;	//!< Address being updated or released, as a string.
+	uint32_t			expires;	//!< Lease lifetime.
+	unsigned int			now;		//!< Wall time when the operation started.
+
+	fr_redis_trunk_t		*rtrunk;	//!< Trunk to the node responsible for the pool.
+	fr_redis_command_set_t		*cmds;		//!< Command set currently enqueued.
+	bool				script_load;	//!< Whether we're loading the script onto the node.
+	bool				failed;		//!< The command set couldn't be executed.
+
+	redisReply			*replies[5];	//!< Must be equal to the maximum number of
+							///< pipelined commands.
+	size_t				reply_cnt;	//!< Number of replies received.
+} ippool_rctx_t;
+
+static unlang_action_t mod_action_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					 request_t *request, void *rctx);
+
+static int _ippool_rctx_free(ippool_rctx_t *rctx)
+{
+	/*
+	 *	Request was cancelled whilst we were
+	 *	waiting for the results.
+	 */
+	if (rctx->cmds) fr_redis_command_set_signal_cancel(rctx->cmds);
+	fr_redis_pipeline_free(rctx->replies, rctx->reply_cnt);
+
+	return 0;
+}
+
+/** Take ownership of the replies to the command set
  *
- * @note All replies will be freed on error.
+ */
+static void ippool_replies_collect(ippool_rctx_t *rctx, fr_dlist_head_t *completed)
+{
+	fr_dlist_foreach(completed, fr_redis_command_t, cmd) {
+		if (!fr_cond_assert(rctx->reply_cnt < NUM_ELEMENTS(rctx->replies))) break;
+
+		rctx->replies[rctx->reply_cnt++] = fr_redis_command_get_result(cmd);
+	}
+	rctx->cmds = NULL;	/* Freed by the trunk */
+}
+
+/** Got replies for all the commands in a command set
  *
- * @param[out] out		Where to write Redis reply object resulting from the command.
- * @param[in] request		The current request.
- * @param[in] cluster		configuration.
- * @param[in] key		to use to determine the cluster node.
- * @param[in] key_len		length of the key.
- * @param[in] wait_num		If > 0 wait until this many slaves have replicated the data
- *				from the last command.
- * @param[in] wait_timeout	How long to wait for slaves.
- * @param[in] digest		of script.
- * @param[in] script		to upload.
- * @param[in] cmd		EVALSHA command to execute.
- * @param[in] ...		Arguments for the eval command.
- * @return status of the command.
  */
-static fr_redis_rcode_t ippool_script(redisReply **out, request_t *request, fr_redis_cluster_t *cluster,
-				      uint8_t const *key, size_t key_len,
-				      uint32_t wait_num, fr_time_delta_t wait_timeout,
-				      char const digest[], char const *script,
-				      char const *cmd, ...)
+static void _ippool_script_complete(request_t *request, fr_dlist_head_t *completed, void *uctx)
 {
-	fr_redis_conn_t			*conn;
-	redisReply			*replies[5];	/* Must be equal to the maximum number of pipelined commands */
-	size_t				reply_cnt = 0, i;
+	ippool_rctx_t	*rctx = talloc_get_type_abort(uctx, ippool_rctx_t);
 
-	fr_redis_cluster_state_t	state;
-	fr_redis_rcode_t		s_ret, status;
-	unsigned int			pipelined = 0;
+	ippool_replies_collect(rctx, completed);
+	unlang_interpret_mark_runnable(request);
+}
 
-	va_list				ap;
+/** The command set couldn't be executed, or was only partially executed
+ *
+ */
+static void _ippool_script_fail(request_t *request, fr_dlist_head_t *completed, void *uctx)
+{
+	ippool_rctx_t	*rctx = talloc_get_type_abort(uctx, ippool_rctx_t);
 
-	*out = NULL;
+	ippool_replies_collect(rctx, completed);
+	rctx->failed = true;
+	unlang_interpret_mark_runnable(request);
+}
 
-#ifndef NDEBUG
-	memset(replies, 0, sizeof(replies));
-#endif
-
-	va_start(ap, cmd);
-
-	for (s_ret = fr_redis_cluster_state_init(&state, &conn, cluster, request, key, key_len, false);
-	     s_ret == REDIS_RCODE_TRY_AGAIN;	/* Continue */
-	     s_ret = fr_redis_cluster_state_next(&state, &conn, cluster, request, status, &replies[0])) {
-	     	va_list	copy;
-
-	     	RDEBUG3("Calling script 0x%s", digest);
-	     	va_copy(copy, ap);	/* copy or segv */
-		redisvAppendCommand(conn->handle, cmd, copy);
-		va_end(copy);
-		pipelined = 1;
-		if (wait_num) {
-			redisAppendCommand(conn->handle, "WAIT %i %i", wait_num, fr_time_delta_to_msec(wait_timeout));
-			pipelined++;
-		}
-		reply_cnt = fr_redis_pipeline_result(&pipelined, &status,
-						     replies, NUM_ELEMENTS(replies),
-						     conn);
-		if (status != REDIS_RCODE_NO_SCRIPT) continue;
+/** Add the EVALSHA command for the action being performed to a command set
+ *
+ */
+static fr_redis_pipeline_status_t ippool_evalsha_add(fr_redis_command_set_t *cmds, ippool_rctx_t *rctx)
+{
+	char ip_buff[FR_IPADDR_PREFIX_STRLEN];
 
-		/*
-		 *	Clear out the existing reply
-		 */
-		fr_redis_pipeline_free(replies, reply_cnt);
+	switch (rctx->action) {
+	case POOL_ACTION_ALLOCATE:
+		return fr_redis_command_add(cmds, "EVALSHA %s 1 %b %u %u %b %b",
+					    lua_alloc_digest,
+					    rctx->key_prefix, rctx->key_prefix_len,
+					    rctx->now, rctx->expires,
+					    rctx->owner, rctx->owner_len,
+					    rctx->gateway_id, rctx->gateway_id_len);
 
-		/*
-		 *	Last command failed with NOSCRIPT, this means
-		 *	we have to send the Lua script up to the node
-		 *	so it can be cached.
-		 */
-	     	RDEBUG3("Loading script 0x%s", digest);
-		redisAppendCommand(conn->handle, "MULTI");
-		redisAppendCommand(conn->handle, "SCRIPT LOAD %s", script);
-	     	va_copy(copy, ap);	/* copy or segv */
-		redisvAppendCommand(conn->handle, cmd, copy);
-		va_end(copy);
-		redisAppendCommand(conn->handle, "EXEC");
-		pipelined = 4;
-		if (wait_num) {
-			redisAppendCommand(conn->handle, "WAIT %i %i", wait_num, wait_timeout);
-			pipelined++;
+	case POOL_ACTION_UPDATE:
+		if ((rctx->ip.af == AF_INET) && rctx->inst->ipv4_integer) {
+			return fr_redis_command_add(cmds, "EVALSHA %s 1 %b %u %u %u %b %b",
+						    lua_update_digest,
+						    rctx->key_prefix, rctx->key_prefix_len,
+						    rctx->now, rctx->expires,
+						    htonl(rctx->ip.addr.v4.s_addr),
+						    rctx->owner, rctx->owner_len,
+						    rctx->gateway_id, rctx->gateway_id_len);
 		}
 
-		reply_cnt = fr_redis_pipeline_result(&pipelined, &status,
-						     replies, NUM_ELEMENTS(replies),
-						     conn);
-		if (status == REDIS_RCODE_SUCCESS) {
-			if (RDEBUG_ENABLED3) for (i = 0; i < reply_cnt; i++) {
-				fr_redis_reply_print(L_DBG_LVL_3, replies[i], request, i);
-			}
+		IPPOOL_SPRINT_IP(ip_buff, &rctx->ip, rctx->ip.prefix);
+		return fr_redis_command_add(cmds, "EVALSHA %s 1 %b %u %u %s %b %b",
+					    lua_update_digest,
+					    rctx->key_prefix, rctx->key_prefix_len,
+					    rctx->now, rctx->expires,
+					    ip_buff,
+					    rctx->owner, rctx->owner_len,
+					    rctx->gateway_id, rctx->gateway_id_len);
 
-			if (replies[3]->type != REDIS_REPLY_ARRAY) {
-				RERROR("Bad response to EXEC, expected array got %s",
-				       fr_table_str_by_value(redis_reply_types, replies[3]->type, "<UNKNOWN>"));
-			error:
-				fr_redis_pipeline_free(replies, reply_cnt);
-				status = REDIS_RCODE_ERROR;
-				goto finish;
-			}
-			if (replies[3]->elements != 2) {
-				RERROR("Bad response to EXEC, expected 2 result elements, got %zu",
-				       replies[3]->elements);
-				goto error;
-			}
-			if (replies[3]->element[0]->type != REDIS_REPLY_STRING) {
-				RERROR("Bad response to SCRIPT LOAD, expected string got %s",
-				       fr_table_str_by_value(redis_reply_types, replies[3]->element[0]->type, "<UNKNOWN>"));
-				goto error;
-			}
-			if (strcmp(replies[3]->element[0]->str, digest) != 0) {
-				RWDEBUG("Incorrect SHA1 from SCRIPT LOAD, expected %s, got %s",
-					digest, replies[3]->element[0]->str);
-				goto error;
-			}
+	case POOL_ACTION_RELEASE:
+		if ((rctx->ip.af == AF_INET) && rctx->inst->ipv4_integer) {
+			return fr_redis_command_add(cmds, "EVALSHA %s 1 %b %u %u %b",
+						    lua_release_digest,
+						    rctx->key_prefix, rctx->key_prefix_len,
+						    rctx->now,
+						    htonl(rctx->ip.addr.v4.s_addr),
+						    rctx->owner, rctx->owner_len);
 		}
+
+		IPPOOL_SPRINT_IP(ip_buff, &rctx->ip, rctx->ip.prefix);
+		return fr_redis_command_add(cmds, "EVALSHA %s 1 %b %u %s %b",
+					    lua_release_digest,
+					    rctx->key_prefix, rctx->key_prefix_len,
+					    rctx->now,
+					    ip_buff,
+					    rctx->owner, rctx->owner_len);
+
+	default:
+		fr_assert(0);
+		return FR_REDIS_PIPELINE_FAIL;
 	}
-	if (s_ret != REDIS_RCODE_SUCCESS) goto error;
+}
 
-	switch (reply_cnt) {
-	case 2:	/* EVALSHA with wait */
-		if (ippool_wait_check(request, wait_num, replies[1]) < 0) goto error;
-		fr_redis_reply_free(&replies[1]);	/* Free the wait response */
-		break;
+/** Enqueue a script on the trunk of the node responsible for the pool
+ *
+ * Commands from many requests are pipelined on the same connection, so
+ * the worker continues processing other requests while the script executes.
+ *
+ * If rctx->script_load is true, the script is uploaded to the node in
+ * the same transaction as the EVALSHA command, so that it can be cached.
+ *
+ * @param[in] request	The current request.
+ * @param[in] rctx	Lease operation to execute the script for.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int ippool_script_enqueue(request_t *request, ippool_rctx_t *rctx)
+{
+	rlm_redis_ippool_t const	*inst = rctx->inst;
+	fr_redis_command_set_t		*cmds;
+	char const			*digest, *script;
 
-	case 1:	/* EVALSHA */
-		*out = replies[0];
+	switch (rctx->action) {
+	case POOL_ACTION_ALLOCATE:
+		digest = lua_alloc_digest;
+		script = lua_alloc_cmd;
 		break;
 
-	case 5: /* LOADSCRIPT + EVALSHA + WAIT */
-		if (ippool_wait_check(request, wait_num, replies[4]) < 0) goto error;
-		fr_redis_reply_free(&replies[4]);	/* Free the wait response */
-		FALL_THROUGH;
-
-	case 4: /* LOADSCRIPT + EVALSHA */
-		fr_redis_reply_free(&replies[2]);	/* Free the queued cmd response*/
-		fr_redis_reply_free(&replies[1]);	/* Free the queued script load response */
-		fr_redis_reply_free(&replies[0]);	/* Free the queued multi response */
-		*out = replies[3]->element[1];
-		replies[3]->element[1] = NULL;		/* Prevent double free */
-		fr_redis_reply_free(&replies[3]);	/* This works because hiredis checks for NULL elements */
+	case POOL_ACTION_UPDATE:
+		digest = lua_update_digest;
+		script = lua_update_cmd;
 		break;
 
-	case 0:
+	case POOL_ACTION_RELEASE:
+		digest = lua_release_digest;
+		script = lua_release_cmd;
 		break;
+
+	default:
+		fr_assert(0);
+		return -1;
 	}
 
-finish:
-	va_end(ap);
-	return s_ret;
+	MEM(cmds = fr_redis_command_set_alloc(NULL, request, _ippool_script_complete, _ippool_script_fail, rctx));
+
+	if (rctx->script_load) {
+		RDEBUG3("Loading script 0x%s", digest);
+		if ((fr_redis_command_add(cmds, "MULTI") != FR_REDIS_PIPELINE_OK) ||
+		    (fr_redis_command_add(cmds, "SCRIPT LOAD %s", script) != FR_REDIS_PIPELINE_OK)) goto error;
+	}
+
+	RDEBUG3("Calling script 0x%s", digest);
+	if (ippool_evalsha_add(cmds, rctx) != FR_REDIS_PIPELINE_OK) goto error;
+
+	if (rctx->script_load && (fr_redis_command_add(cmds, "EXEC") != FR_REDIS_PIPELINE_OK)) goto error;
+
+	if (inst->wait_num &&
+	    (fr_redis_command_add(cmds, "WAIT %u %u", inst->wait_num,
+				  (unsigned int)fr_time_delta_to_msec(inst->wait_timeout)) != FR_REDIS_PIPELINE_OK)) {
+	error:
+		talloc_free(cmds);
+		return -1;
+	}
+
+	if (redis_command_set_enqueue(rctx->rtrunk, cmds) != FR_REDIS_PIPELINE_OK) {
+		REDEBUG("Failed enqueueing commands");
+		talloc_free(cmds);
+		return -1;
+	}
+	rctx->cmds = cmds;
+
+	return 0;
 }
 
-/** Allocate a new IP address from a pool
+/** Extract the result of the script from the replies
  *
+ * @param[out] out	Where to write the result of the script.
+ *			Must be freed by the caller.
+ * @param[in] request	The current request.
+ * @param[in] rctx	Lease operation holding the replies.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
  */
-static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, request_t *request,
-					    uint8_t const *key_prefix, size_t key_prefix_len,
-					    uint8_t const *owner, size_t owner_len,
-					    uint8_t const *gateway_id, size_t gateway_id_len,
-					    uint32_t expires)
+static int ippool_script_result(redisReply **out, request_t *request, ippool_rctx_t *rctx)
 {
-	struct			timeval now;
-	redisReply		*reply = NULL;
+	rlm_redis_ippool_t const	*inst = rctx->inst;
+	redisReply			**replies = rctx->replies;
+	size_t				expected, i;
+	char const			*digest;
 
-	fr_redis_rcode_t	status;
-	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
+	*out = NULL;
 
-	fr_assert(key_prefix);
-	fr_assert(owner);
+	expected = (rctx->script_load ? 4 : 1) + (inst->wait_num ? 1 : 0);
+	if (rctx->reply_cnt != expected) {
+		REDEBUG("Expected %zu replies, got %zu", expected, rctx->reply_cnt);
+		return -1;
+	}
 
-	now = fr_time_to_timeval(fr_time());
+	for (i = 0; i < rctx->reply_cnt; i++) {
+		if (!replies[i]) {
+			REDEBUG("Connection closed before all replies were received");
+			return -1;
+		}
 
-	/*
-	 *	hiredis doesn't deal well with NULL string pointers
-	 */
-	if (!gateway_id) gateway_id = (uint8_t const *)"";
-
-	status = ippool_script(&reply, request, inst->cluster,
-			       key_prefix, key_prefix_len,
-			       inst->wait_num, inst->wait_timeout,
-			       lua_alloc_digest, lua_alloc_cmd,
-	 		       "EVALSHA %s 1 %b %u %u %b %b",
-	 		       lua_alloc_digest,
-			       key_prefix, key_prefix_len,
-			       (unsigned int)now.tv_sec, expires,
-			       owner, owner_len,
-			       gateway_id, gateway_id_len);
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		if (replies[i]->type == REDIS_REPLY_ERROR) {
+			REDEBUG("Command failed: %s", replies[i]->str);
+			return -1;
+		}
 	}
 
+	if (inst->wait_num && (ippool_wait_check(request, inst->wait_num, replies[expected - 1]) < 0)) return -1;
+
+	if (!rctx->script_load) {
+		*out = replies[0];
+		replies[0] = NULL;		/* Prevent double free */
+		return 0;
+	}
+
+	switch (rctx->action) {
+	case POOL_ACTION_ALLOCATE:
+		digest = lua_alloc_digest;
+		break;
+
+	case POOL_ACTION_UPDATE:
+		digest = lua_update_digest;
+		break;
+
+	default:
+		digest = lua_release_digest;
+		break;
+	}
+
+	if (replies[3]->type != REDIS_REPLY_ARRAY) {
+		RERROR("Bad response to EXEC, expected array got %s",
+		       fr_table_str_by_value(redis_reply_types, replies[3]->type, "<UNKNOWN>"));
+		return -1;
+	}
+	if (replies[3]->elements != 2) {
+		RERROR("Bad response to EXEC, expected 2 result elements, got %zu",
+		       replies[3]->elements);
+		return -1;
+	}
+	if (replies[3]->element[0]->type != REDIS_REPLY_STRING) {
+		RERROR("Bad response to SCRIPT LOAD, expected string got %s",
+		       fr_table_str_by_value(redis_reply_types, replies[3]->element[0]->type, "<UNKNOWN>"));
+		return -1;
+	}
+	if (strcmp(replies[3]->element[0]->str, digest) != 0) {
+		RWDEBUG("Incorrect SHA1 from SCRIPT LOAD, expected %s, got %s",
+			digest, replies[3]->element[0]->str);
+		return -1;
+	}
+	if (replies[3]->element[1]->type == REDIS_REPLY_ERROR) {
+		REDEBUG("Script failed: %s", replies[3]->element[1]->str);
+		return -1;
+	}
+
+	*out = replies[3]->element[1];
+	replies[3]->element[1] = NULL;		/* Prevent double free, hiredis checks for NULL elements */
+
+	return 0;
+}
+
+/** Process the result of allocating a new IP address from a pool
+ *
+ */
+static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, request_t *request, redisReply *reply)
+{
+	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
+
 	fr_assert(reply);
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		REDEBUG("Expected result to be array got \"%s\"",
@@ -798,20 +925,12 @@ finish:
 	return ret;
 }
 
-/** Update an existing IP address in a pool
+/** Process the result of updating an existing IP address in a pool
  *
  */
-static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, request_t *request,
-					  uint8_t const *key_prefix, size_t key_prefix_len,
-					  fr_ipaddr_t *ip,
-					  uint8_t const *owner, size_t owner_len,
-					  uint8_t const *gateway_id, size_t gateway_id_len,
+static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, request_t *request, redisReply *reply,
 					  uint32_t expires)
 {
-	struct			timeval now;
-	redisReply		*reply = NULL;
-
-	fr_redis_rcode_t	status;
 	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
 
 	tmpl_t		range_rhs;
@@ -819,47 +938,6 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, reques
 
 	tmpl_init_shallow(&range_rhs, TMPL_TYPE_DATA, T_DOUBLE_QUOTED_STRING, "", 0);
 
-	now = fr_time_to_timeval(fr_time());
-
-	/*
-	 *	hiredis doesn't deal well with NULL string pointers
-	 */
-	if (!owner) owner = (uint8_t const *)"";
-	if (!gateway_id) gateway_id = (uint8_t const *)"";
-
-	if ((ip->af == AF_INET) && inst->ipv4_integer) {
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_update_digest, lua_update_cmd,
-				       "EVALSHA %s 1 %b %u %u %u %b %b",
-				       lua_update_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec, expires,
-				       htonl(ip->addr.v4.s_addr),
-				       owner, owner_len,
-				       gateway_id, gateway_id_len);
-	} else {
-		char ip_buff[FR_IPADDR_PREFIX_STRLEN];
-
-		IPPOOL_SPRINT_IP(ip_buff, ip, ip->prefix);
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_update_digest, lua_update_cmd,
-				       "EVALSHA %s 1 %b %u %u %s %b %b",
-				       lua_update_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec, expires,
-				       ip_buff,
-				       owner, owner_len,
-				       gateway_id, gateway_id_len);
-	}
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		REDEBUG("Expected result to be array got \"%s\"",
 			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
@@ -940,58 +1018,13 @@ finish:
 	return ret;
 }
 
-/** Release an existing IP address in a pool
+/** Process the result of releasing an existing IP address in a pool
  *
  */
-static ippool_rcode_t redis_ippool_release(rlm_redis_ippool_t const *inst, request_t *request,
-					   uint8_t const *key_prefix, size_t key_prefix_len,
-					   fr_ipaddr_t *ip,
-					   uint8_t const *owner, size_t owner_len)
+static ippool_rcode_t redis_ippool_release(request_t *request, redisReply *reply)
 {
-	struct			timeval now;
-	redisReply		*reply = NULL;
-
-	fr_redis_rcode_t	status;
 	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
 
-	now = fr_time_to_timeval(fr_time());
-
-	/*
-	 *	hiredis doesn't deal well with NULL string pointers
-	 */
-	if (!owner) owner = (uint8_t const *)"";
-
-	if ((ip->af == AF_INET) && inst->ipv4_integer) {
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_release_digest, lua_release_cmd,
-				       "EVALSHA %s 1 %b %u %u %b",
-				       lua_release_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec,
-				       htonl(ip->addr.v4.s_addr),
-				       owner, owner_len);
-	} else {
-		char ip_buff[FR_IPADDR_PREFIX_STRLEN];
-
-		IPPOOL_SPRINT_IP(ip_buff, ip, ip->prefix);
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_release_digest, lua_release_cmd,
-				       "EVALSHA %s 1 %b %u %s %b",
-				       lua_release_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec,
-				       ip_buff,
-				       owner, owner_len);
-	}
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		REDEBUG("Expected result to be array got \"%s\"",
 			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
@@ -1062,17 +1095,192 @@ static inline ssize_t ippool_pool_name(uint8_t const **out, uint8_t buff[], size
 	return slen;
 }
 
-static unlang_action_t mod_action(rlm_rcode_t *p_result, rlm_redis_ippool_t const *inst, request_t *request, ippool_action_t action)
+/** Cancel a lease operation
+ *
+ */
+static void mod_action_signal(UNUSED module_ctx_t const *mctx, UNUSED request_t *request,
+			      void *rctx, fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	talloc_free(rctx);	/* Destructor cancels the command set */
+}
+
+/** Process the replies to a lease operation
+ *
+ */
+static unlang_action_t mod_action_resume(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx,
+					 request_t *request, void *uctx)
+{
+	ippool_rctx_t			*rctx = talloc_get_type_abort(uctx, ippool_rctx_t);
+	rlm_redis_ippool_t const	*inst = rctx->inst;
+	redisReply			*reply;
+	rlm_rcode_t			rcode;
+	size_t				i;
+
+	if (rctx->failed) {
+		REDEBUG("Failed executing lease operation");
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
+
+	if (RDEBUG_ENABLED3) for (i = 0; i < rctx->reply_cnt; i++) {
+		if (rctx->replies[i]) fr_redis_reply_print(L_DBG_LVL_3, rctx->replies[i], request, i);
+	}
+
+	/*
+	 *	Last command failed with NOSCRIPT, this means
+	 *	we have to send the Lua script up to the node
+	 *	so it can be cached.
+	 */
+	if (!rctx->script_load && (rctx->reply_cnt > 0) && rctx->replies[0] &&
+	    (rctx->replies[0]->type == REDIS_REPLY_ERROR) &&
+	    (strncmp(REDIS_ERROR_NO_SCRIPT_STR, rctx->replies[0]->str, sizeof(REDIS_ERROR_NO_SCRIPT_STR) - 1) == 0)) {
+		fr_redis_pipeline_free(rctx->replies, rctx->reply_cnt);
+		rctx->reply_cnt = 0;
+		rctx->script_load = true;
+
+		if (ippool_script_enqueue(request, rctx) < 0) {
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+
+		return unlang_module_yield(request, mod_action_resume, mod_action_signal, rctx);
+	}
+
+	if (ippool_script_result(&reply, request, rctx) < 0) {
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
+
+	switch (rctx->action) {
+	case POOL_ACTION_ALLOCATE:
+		switch (redis_ippool_allocate(inst, request, reply)) {
+		case IPPOOL_RCODE_SUCCESS:
+			RDEBUG2("IP address lease allocated");
+			rcode = RLM_MODULE_UPDATED;
+			break;
+
+		case IPPOOL_RCODE_POOL_EMPTY:
+			RWDEBUG("Pool contains no free addresses");
+			rcode = RLM_MODULE_NOTFOUND;
+			break;
+
+		default:
+			rcode = RLM_MODULE_FAIL;
+			break;
+		}
+		break;
+
+	case POOL_ACTION_UPDATE:
+		switch (redis_ippool_update(inst, request, reply, rctx->expires)) {
+		case IPPOOL_RCODE_SUCCESS:
+			RDEBUG2("Requested IP address' \"%s\" lease updated", rctx->ip_str);
+
+			/*
+			 *	Copy over the input IP address to the reply attribute
+			 */
+			if (inst->copy_on_update) {
+				tmpl_t ip_rhs = {
+					.name = "",
+					.type = TMPL_TYPE_DATA,
+					.quote = T_BARE_WORD,
+				};
+				map_t ip_map = {
+					.lhs = inst->allocated_address_attr,
+					.op = T_OP_SET,
+					.rhs = &ip_rhs
+				};
+
+				fr_value_box_strdup_shallow(&ip_rhs.data.literal, NULL, rctx->ip_str, false);
+
+				if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) {
+					rcode = RLM_MODULE_FAIL;
+					break;
+				}
+			}
+			rcode = RLM_MODULE_UPDATED;
+			break;
+
+		/*
+		 *	It's useful to be able to identify the 'not found' case
+		 *	as we can relay to a server where the IP address might
+		 *	be found.  This extremely useful for migrations.
+		 */
+		case IPPOOL_RCODE_NOT_FOUND:
+			REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", rctx->ip_str);
+			rcode = RLM_MODULE_NOTFOUND;
+			break;
+
+		case IPPOOL_RCODE_EXPIRED:
+			REDEBUG("Requested IP address' \"%s\" lease already expired at time of renewal", rctx->ip_str);
+			rcode = RLM_MODULE_INVALID;
+			break;
+
+		case IPPOOL_RCODE_DEVICE_MISMATCH:
+			REDEBUG("Requested IP address' \"%s\" lease allocated to another device", rctx->ip_str);
+			rcode = RLM_MODULE_INVALID;
+			break;
+
+		default:
+			rcode = RLM_MODULE_FAIL;
+			break;
+		}
+		break;
+
+	case POOL_ACTION_RELEASE:
+		switch (redis_ippool_release(request, reply)) {
+		case IPPOOL_RCODE_SUCCESS:
+			RDEBUG2("IP address \"%s\" released", rctx->ip_str);
+			rcode = RLM_MODULE_UPDATED;
+			break;
+
+		/*
+		 *	It's useful to be able to identify the 'not found' case
+		 *	as we can relay to a server where the IP address might
+		 *	be found.  This extremely useful for migrations.
+		 */
+		case IPPOOL_RCODE_NOT_FOUND:
+			REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", rctx->ip_str);
+			rcode = RLM_MODULE_NOTFOUND;
+			break;
+
+		case IPPOOL_RCODE_DEVICE_MISMATCH:
+			REDEBUG("Requested IP address' \"%s\" lease allocated to another device", rctx->ip_str);
+			rcode = RLM_MODULE_INVALID;
+			break;
+
+		default:
+			rcode = RLM_MODULE_FAIL;
+			break;
+		}
+		break;
+
+	default:
+		fr_assert(0);
+		fr_redis_reply_free(&reply);
+		rcode = RLM_MODULE_FAIL;
+		break;
+	}
+
+finish:
+	talloc_free(rctx);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+static unlang_action_t mod_action(rlm_rcode_t *p_result, rlm_redis_ippool_t const *inst,
+				  rlm_redis_ippool_thread_t *t, request_t *request, ippool_action_t action)
 {
 	uint8_t		key_prefix_buff[IPPOOL_MAX_KEY_PREFIX_SIZE], owner_buff[256], gateway_id_buff[256];
 	uint8_t const	*key_prefix, *owner = NULL, *gateway_id = NULL;
 	size_t		key_prefix_len, owner_len = 0, gateway_id_len = 0;
 	ssize_t		slen;
-	fr_ipaddr_t	ip;
 	char		expires_buff[20];
 	char const	*expires_str;
 	unsigned long	expires = 0;
 	char		*q;
+	ippool_rctx_t	*rctx;
 
 	slen = ippool_pool_name(&key_prefix, (uint8_t *)&key_prefix_buff, sizeof(key_prefix_len), inst, request);
 	if (slen < 0) RETURN_MODULE_FAIL;
@@ -1102,176 +1310,114 @@ static unlang_action_t mod_action(rlm_rcode_t *p_result, rlm_redis_ippool_t cons
 		gateway_id_len = (size_t)slen;
 	}
 
+	MEM(rctx = talloc_zero(request, ippool_rctx_t));
+	talloc_set_destructor(rctx, _ippool_rctx_free);
+	rctx->inst = inst;
+	rctx->action = action;
+	rctx->now = (unsigned int)fr_time_to_sec(fr_time());
+
+	/*
+	 *	hiredis doesn't deal well with NULL string pointers
+	 */
+	MEM(rctx->key_prefix = talloc_memdup(rctx, key_prefix, key_prefix_len));
+	rctx->key_prefix_len = key_prefix_len;
+	MEM(rctx->owner = owner ? talloc_memdup(rctx, owner, owner_len) : talloc_zero(rctx, uint8_t));
+	rctx->owner_len = owner_len;
+	MEM(rctx->gateway_id = gateway_id ? talloc_memdup(rctx, gateway_id, gateway_id_len) : talloc_zero(rctx, uint8_t));
+	rctx->gateway_id_len = gateway_id_len;
+
 	switch (action) {
 	case POOL_ACTION_ALLOCATE:
 		if (tmpl_expand(&expires_str, expires_buff, sizeof(expires_buff),
 				request, inst->offer_time, NULL, NULL) < 0) {
 			REDEBUG("Failed expanding offer_time (%s)", inst->offer_time->name);
+		error:
+			talloc_free(rctx);
 			RETURN_MODULE_FAIL;
 		}
 
 		expires = strtoul(expires_str, &q, 10);
 		if (q != (expires_str + strlen(expires_str))) {
 			REDEBUG("Invalid offer_time.  Must be an integer value");
-			RETURN_MODULE_FAIL;
+			goto error;
 		}
 
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len, NULL,
 				    owner, owner_len, gateway_id, gateway_id_len, expires);
-		switch (redis_ippool_allocate(inst, request, key_prefix, key_prefix_len,
-					      owner, owner_len,
-					      gateway_id, gateway_id_len, (uint32_t)expires)) {
-		case IPPOOL_RCODE_SUCCESS:
-			RDEBUG2("IP address lease allocated");
-			RETURN_MODULE_UPDATED;
-
-		case IPPOOL_RCODE_POOL_EMPTY:
-			RWDEBUG("Pool contains no free addresses");
-			RETURN_MODULE_NOTFOUND;
-
-		default:
-			RETURN_MODULE_FAIL;
-		}
+		break;
 
 	case POOL_ACTION_UPDATE:
+	case POOL_ACTION_RELEASE:
 	{
 		char		ip_buff[INET6_ADDRSTRLEN + 4];
 		char const	*ip_str;
 
-		if (tmpl_expand(&expires_str, expires_buff, sizeof(expires_buff),
-				request, inst->lease_time, NULL, NULL) < 0) {
-			REDEBUG("Failed expanding lease_time (%s)", inst->lease_time->name);
-			RETURN_MODULE_FAIL;
-		}
-
-		expires = strtoul(expires_str, &q, 10);
-		if (q != (expires_str + strlen(expires_str))) {
-			REDEBUG("Invalid expires.  Must be an integer value");
-			RETURN_MODULE_FAIL;
-		}
-
-		if (tmpl_expand(&ip_str, ip_buff, sizeof(ip_buff), request, inst->requested_address, NULL, NULL) < 0) {
-			REDEBUG("Failed expanding requested_address (%s)", inst->requested_address->name);
-			RETURN_MODULE_FAIL;
-		}
-
-		if (fr_inet_pton(&ip, ip_str, -1, AF_UNSPEC, false, true) < 0) {
-			RPEDEBUG("Failed parsing address");
-			RETURN_MODULE_FAIL;
-		}
-
-		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len,
-				    ip_str, owner, owner_len, gateway_id, gateway_id_len, expires);
-		switch (redis_ippool_update(inst, request, key_prefix, key_prefix_len,
-					    &ip, owner, owner_len,
-					    gateway_id, gateway_id_len, (uint32_t)expires)) {
-		case IPPOOL_RCODE_SUCCESS:
-			RDEBUG2("Requested IP address' \"%s\" lease updated", ip_str);
-
-			/*
-			 *	Copy over the input IP address to the reply attribute
-			 */
-			if (inst->copy_on_update) {
-				tmpl_t ip_rhs = {
-					.name = "",
-					.type = TMPL_TYPE_DATA,
-					.quote = T_BARE_WORD,
-				};
-				map_t ip_map = {
-					.lhs = inst->allocated_address_attr,
-					.op = T_OP_SET,
-					.rhs = &ip_rhs
-				};
-
-				fr_value_box_strdup_shallow(&ip_rhs.data.literal, NULL, ip_str, false);
-
-				if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) RETURN_MODULE_FAIL;
+		if (action == POOL_ACTION_UPDATE) {
+			if (tmpl_expand(&expires_str, expires_buff, sizeof(expires_buff),
+					request, inst->lease_time, NULL, NULL) < 0) {
+				REDEBUG("Failed expanding lease_time (%s)", inst->lease_time->name);
+				goto error;
 			}
-			RETURN_MODULE_UPDATED;
 
-		/*
-		 *	It's useful to be able to identify the 'not found' case
-		 *	as we can relay to a server where the IP address might
-		 *	be found.  This extremely useful for migrations.
-		 */
-		case IPPOOL_RCODE_NOT_FOUND:
-			REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", ip_str);
-			RETURN_MODULE_NOTFOUND;
-
-		case IPPOOL_RCODE_EXPIRED:
-			REDEBUG("Requested IP address' \"%s\" lease already expired at time of renewal", ip_str);
-			RETURN_MODULE_INVALID;
-
-		case IPPOOL_RCODE_DEVICE_MISMATCH:
-			REDEBUG("Requested IP address' \"%s\" lease allocated to another device", ip_str);
-			RETURN_MODULE_INVALID;
-
-		default:
-			RETURN_MODULE_FAIL;
+			expires = strtoul(expires_str, &q, 10);
+			if (q != (expires_str + strlen(expires_str))) {
+				REDEBUG("Invalid expires.  Must be an integer value");
+				goto error;
+			}
 		}
-	}
-
-	case POOL_ACTION_RELEASE:
-	{
-		char		ip_buff[INET6_ADDRSTRLEN + 4];
-		char const	*ip_str;
 
 		if (tmpl_expand(&ip_str, ip_buff, sizeof(ip_buff), request, inst->requested_address, NULL, NULL) < 0) {
 			REDEBUG("Failed expanding requested_address (%s)", inst->requested_address->name);
-			RETURN_MODULE_FAIL;
+			goto error;
 		}
 
-		if (fr_inet_pton(&ip, ip_str, -1, AF_UNSPEC, false, true) < 0) {
+		if (fr_inet_pton(&rctx->ip, ip_str, -1, AF_UNSPEC, false, true) < 0) {
 			RPEDEBUG("Failed parsing address");
-			RETURN_MODULE_FAIL;
+			goto error;
 		}
+		MEM(rctx->ip_str = talloc_strdup(rctx, ip_str));
 
 		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len,
-				    ip_str, owner, owner_len, gateway_id, gateway_id_len, 0);
-		switch (redis_ippool_release(inst, request, key_prefix, key_prefix_len,
-					     &ip, owner, owner_len)) {
-		case IPPOOL_RCODE_SUCCESS:
-			RDEBUG2("IP address \"%s\" released", ip_str);
-			RETURN_MODULE_UPDATED;
-
-		/*
-		 *	It's useful to be able to identify the 'not found' case
-		 *	as we can relay to a server where the IP address might
-		 *	be found.  This extremely useful for migrations.
-		 */
-		case IPPOOL_RCODE_NOT_FOUND:
-			REDEBUG("Requested IP address \"%s\" is not a member of the specified pool", ip_str);
-			RETURN_MODULE_NOTFOUND;
-
-		case IPPOOL_RCODE_DEVICE_MISMATCH:
-			REDEBUG("Requested IP address' \"%s\" lease allocated to another device", ip_str);
-			RETURN_MODULE_INVALID;
-
-		default:
-			RETURN_MODULE_FAIL;
-		}
+				    ip_str, owner, owner_len, gateway_id, gateway_id_len, expires);
 	}
+		break;
 
 	case POOL_ACTION_BULK_RELEASE:
 		RDEBUG2("Bulk release not yet implemented");
+		talloc_free(rctx);
 		RETURN_MODULE_NOOP;
 
 	default:
 		fr_assert(0);
-		RETURN_MODULE_FAIL;
+		goto error;
 	}
+	rctx->expires = (uint32_t)expires;
+
+	/*
+	 *	All the keys the scripts operate on include
+	 *	the pool name as a hash tag, so the pool
+	 *	name determines the cluster node.
+	 */
+	rctx->rtrunk = fr_redis_cluster_thread_trunk_by_key(t->cluster, request,
+							    rctx->key_prefix, rctx->key_prefix_len);
+	if (!rctx->rtrunk) goto error;
+
+	if (ippool_script_enqueue(request, rctx) < 0) goto error;
+
+	return unlang_module_yield(request, mod_action_resume, mod_action_signal, rctx);
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
 	fr_pair_t			*vp;
 
 	/*
 	 *	IP-Pool.Action override
 	 */
 	vp = fr_pair_find_by_da(&request->control_pairs, attr_pool_action, 0);
-	if (vp) return mod_action(p_result, inst, request, vp->vp_uint32);
+	if (vp) return mod_action(p_result, inst, t, request, vp->vp_uint32);
 
 	/*
 	 *	Otherwise, guess the action by Acct-Status-Type
@@ -1284,14 +1430,14 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 
 	if ((vp->vp_uint32 == enum_acct_status_type_start->vb_uint32) ||
 	    (vp->vp_uint32 == enum_acct_status_type_interim_update->vb_uint32)) {
-		return mod_action(p_result, inst, request, POOL_ACTION_UPDATE);
+		return mod_action(p_result, inst, t, request, POOL_ACTION_UPDATE);
 
 	} else if (vp->vp_uint32 == enum_acct_status_type_stop->vb_uint32) {
-		return mod_action(p_result, inst, request, POOL_ACTION_RELEASE);
+		return mod_action(p_result, inst, t, request, POOL_ACTION_RELEASE);
 
 	} else if ((vp->vp_uint32 == enum_acct_status_type_on->vb_uint32) ||
 		   (vp->vp_uint32 == enum_acct_status_type_off->vb_uint32)) {
-		return mod_action(p_result, inst, request, POOL_ACTION_BULK_RELEASE);
+		return mod_action(p_result, inst, t, request, POOL_ACTION_BULK_RELEASE);
 
 	}
 
@@ -1301,6 +1447,7 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
 	fr_pair_t			*vp;
 
 	/*
@@ -1308,12 +1455,13 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 	 *	when called in Post-Auth.
 	 */
 	vp = fr_pair_find_by_da(&request->control_pairs, attr_pool_action, 0);
-	return mod_action(p_result, inst, request, vp ? vp->vp_uint32 : POOL_ACTION_ALLOCATE);
+	return mod_action(p_result, inst, t, request, vp ? vp->vp_uint32 : POOL_ACTION_ALLOCATE);
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
 	fr_pair_t			*vp;
 	ippool_action_t			action = POOL_ACTION_ALLOCATE;
 
@@ -1339,12 +1487,13 @@ static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, mod
 	}
 
 run:
-	return mod_action(p_result, inst, request, action);
+	return mod_action(p_result, inst, t, request, action);
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_request(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
 	fr_pair_t			*vp;
 
 	/*
@@ -1353,12 +1502,13 @@ static unlang_action_t CC_HINT(nonnull) mod_request(rlm_rcode_t *p_result, modul
 	 */
 
 	vp = fr_pair_find_by_da(&request->control_pairs, attr_pool_action, 0);
-	return mod_action(p_result, inst, request, vp ? vp->vp_uint32 : POOL_ACTION_UPDATE);
+	return mod_action(p_result, inst, t, request, vp ? vp->vp_uint32 : POOL_ACTION_UPDATE);
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
 	fr_pair_t			*vp;
 
 	/*
@@ -1367,7 +1517,7 @@ static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, modul
 	 */
 
 	vp = fr_pair_find_by_da(&request->control_pairs, attr_pool_action, 0);
-	return mod_action(p_result, inst, request, vp ? vp->vp_uint32 : POOL_ACTION_RELEASE);
+	return mod_action(p_result, inst, t, request, vp ? vp->vp_uint32 : POOL_ACTION_RELEASE);
 }
 
 static int mod_instantiate(void *instance, CONF_SECTION *conf)
@@ -1420,6 +1570,30 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  fr_event_list_t *el, void *thread)
+{
+	rlm_redis_ippool_t		*inst = instance;
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(thread, rlm_redis_ippool_thread_t);
+
+	t->cluster = fr_redis_cluster_thread_alloc(t, el, &inst->trunk_conf, inst->cluster, &inst->conf);
+	if (!t->cluster) {
+		ERROR("Failed allocating cluster thread");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(thread, rlm_redis_ippool_thread_t);
+
+	TALLOC_FREE(t->cluster);
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	fr_redis_version_print();
@@ -1436,6 +1610,10 @@ module_t rlm_redis_ippool = {
 	.config		= module_config,
 	.onload		= mod_load,
 	.instantiate	= mod_instantiate,
+	.thread_inst_size	= sizeof(rlm_redis_ippool_thread_t),
+	.thread_inst_type	= "rlm_redis_ippool_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting,
 		[MOD_AUTHORIZE]		= mod_authorize,
@@ -27,13 +27,16 @@
 RCSID("$Id$")
 #include <freeradius-devel/util/base.h>
 #include <freeradius-devel/server/cf_parse.h>
+#include <freeradius-devel/util/base16.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/sha1.h>
 
 #include "base.h"
 #include "cluster.h"
 #include "redis_ippool.h"
 
 #define MAX_PIPELINED 100000
+#define MAX_BATCH 1000			//!< Addresses passed to each invocation of a Lua script.
 
 /** Pool management actions
  *
@@ -108,6 +111,15 @@ typedef int (*redis_ippool_queue_t)(redis_driver_conf_t *inst, fr_redis_conn_t *
 
 typedef int (*redis_ippool_process_t)(void *out, fr_ipaddr_t const *ipaddr, redisReply const *reply);
 
+/** A Lua script which operates on batches of addresses
+ *
+ */
+typedef struct {
+	char const		*cmd;		//!< Lua script.
+	size_t			cmd_len;	//!< Length of the Lua script.
+	char			digest[(SHA1_DIGEST_LENGTH * 2) + 1];	//!< SHA1 of the script, for EVALSHA.
+} ippool_tool_script_t;
+
 #define IPPOOL_BUILD_IP_KEY_FROM_STR(_buff, _p, _key, _key_len, _ip_str) \
 do { \
 	ssize_t _slen; \
@@ -126,76 +138,133 @@ do { \
 #define EOL "\n"
 
 static char const *name;
-/** Lua script for releasing a lease
+/** Lua script for adding a batch of leases
  *
  * - KEYS[1] The pool name.
- * - ARGV[1] IP address to release.
+ * - ARGV[1] '1' if the range should be set, else '0'.
+ * - ARGV[2] Range identifier.
+ * - ARGV[3...] IP addresses to add.
  *
- * Removes the IP entry in the ZSET, then removes the address hash, and the device key
- * if one exists.
+ * Adds each IP to the ZSET, if it's not already present, and sets the range
+ * on the address hash.
  *
- * Will do nothing if the lease is not found in the ZSET.
+ * Returns
+ * - The number of ip addresses added.
+ */
+static char lua_add_cmd[] =
+	"local added = 0" EOL								/* 1 */
+	"local pool_key = '{' .. KEYS[1] .. '}:"IPPOOL_POOL_KEY"'" EOL			/* 2 */
+	"local address_prefix = '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":'" EOL		/* 3 */
+
+	"for i = 3, #ARGV do" EOL							/* 4 */
+	"  added = added + redis.call('ZADD', pool_key, 'NX', 0, ARGV[i])" EOL		/* 5 */
+	"  if ARGV[1] == '1' then" EOL							/* 6 */
+	"    redis.call('HSET', address_prefix .. ARGV[i], 'range', ARGV[2])" EOL	/* 7 */
+	"  end" EOL									/* 8 */
+	"end" EOL									/* 9 */
+	"return added";									/* 10 */
+
+/** Lua script for releasing a batch of leases
+ *
+ * - KEYS[1] The pool name.
+ * - ARGV[1] Unused.
+ * - ARGV[2] Unused.
+ * - ARGV[3...] IP addresses to release.
+ *
+ * Sets the score of each IP entry in the ZSET to zero, then removes the
+ * device key if one exists.
+ *
+ * Will do nothing for leases not found in the ZSET.
  *
  * Returns
- * - 0 if no ip addresses were removed.
- * - 1 if an ip address was removed.
+ * - The number of ip addresses released.
  */
 static char lua_release_cmd[] =
-	"local found" EOL								/* 1 */
-	"local ret" EOL									/* 2 */
+	"local released = 0" EOL							/* 1 */
+	"local pool_key = '{' .. KEYS[1] .. '}:"IPPOOL_POOL_KEY"'" EOL			/* 2 */
+	"local address_prefix = '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":'" EOL		/* 3 */
+	"local owner_prefix = '{' .. KEYS[1] .. '}:"IPPOOL_OWNER_KEY":'" EOL		/* 4 */
+
+	"for i = 3, #ARGV do" EOL							/* 5 */
 
 	/*
 	 *	Set expiry time to 0
 	 */
-	"ret = redis.call('ZADD', '{' .. KEYS[1] .. '}:"IPPOOL_POOL_KEY"', 'XX', 'CH', 0, ARGV[1])" EOL	/* 3 */
-	"if ret == 0 then" EOL								/* 4 */
-	"  return 0" EOL								/* 5 */
-	"end" EOL									/* 6 */
-	"found = redis.call('HGET', '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":'"
-			    " .. ARGV[1], 'device')" EOL				/* 7 */
-	"if not found then" EOL								/* 8 */
-	"  return ret"	EOL								/* 9 */
-	"end" EOL									/* 10 */
+	"  if redis.call('ZADD', pool_key, 'XX', 'CH', 0, ARGV[i]) == 1 then" EOL	/* 6 */
+	"    local found = redis.call('HGET', address_prefix .. ARGV[i], 'device')" EOL	/* 7 */
+	"    released = released + 1" EOL						/* 8 */
 
 	/*
 	 *	Remove the association between the device and a lease
 	 */
-	"redis.call('DEL', '{' .. KEYS[1] .. '}:"IPPOOL_OWNER_KEY":' .. found)" EOL	/* 11 */
-	"return 1";									/* 12 */
-
-/** Lua script for removing a lease
+	"    if found then" EOL								/* 9 */
+	"      redis.call('DEL', owner_prefix .. found)" EOL				/* 10 */
+	"    end" EOL									/* 11 */
+	"  end" EOL									/* 12 */
+	"end" EOL									/* 13 */
+	"return released";								/* 14 */
+
+/** Lua script for removing a batch of leases
  *
  * - KEYS[1] The pool name.
- * - ARGV[1] IP address to remove.
+ * - ARGV[1] Unused.
+ * - ARGV[2] Unused.
+ * - ARGV[3...] IP addresses to remove.
  *
- * Removes the IP entry in the ZSET, then removes the address hash, and the device key
- * if one exists.
+ * Removes each IP entry in the ZSET, then removes the address hash, and the
+ * device key if one exists.
  *
  * Will work with partially removed IP addresses (where the ZSET entry is absent but other
  * elements weren't cleaned up).
  *
  * Returns
- * - 0 if no ip addresses were removed.
- * - 1 if an ip address was removed.
+ * - The number of ip addresses removed.
  */
 static char lua_remove_cmd[] =
-	"local found" EOL								/* 1 */
-	"local ret" EOL									/* 2 */
-	"local address_key" EOL								/* 3 */
-
-	"ret = redis.call('ZREM', '{' .. KEYS[1] .. '}:"IPPOOL_POOL_KEY"', ARGV[1])" EOL	/* 4 */
-	"address_key = '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":' .. ARGV[1]" EOL	/* 5 */
-	"found = redis.call('HGET', address_key, 'device')" EOL				/* 6 */
-	"redis.call('DEL', address_key)" EOL						/* 7 */
-	"if not found then" EOL								/* 8 */
-	"  return ret"	EOL								/* 9 */
-	"end" EOL									/* 10 */
+	"local removed = 0" EOL								/* 1 */
+	"local pool_key = '{' .. KEYS[1] .. '}:"IPPOOL_POOL_KEY"'" EOL			/* 2 */
+	"local address_prefix = '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":'" EOL		/* 3 */
+	"local owner_prefix = '{' .. KEYS[1] .. '}:"IPPOOL_OWNER_KEY":'" EOL		/* 4 */
+
+	"for i = 3, #ARGV do" EOL							/* 5 */
+	"  local ret = redis.call('ZREM', pool_key, ARGV[i])" EOL			/* 6 */
+	"  local address_key = address_prefix .. ARGV[i]" EOL				/* 7 */
+	"  local found = redis.call('HGET', address_key, 'device')" EOL			/* 8 */
+	"  redis.call('DEL', address_key)" EOL						/* 9 */
 
 	/*
 	 *	Remove the association between the device and a lease
 	 */
-	"redis.call('DEL', '{' .. KEYS[1] .. '}:"IPPOOL_OWNER_KEY":' .. found)" EOL	/* 11 */
-	"return 1" EOL;									/* 12 */
+	"  if found then" EOL								/* 10 */
+	"    redis.call('DEL', owner_prefix .. found)" EOL				/* 11 */
+	"    ret = 1" EOL								/* 12 */
+	"  end" EOL									/* 13 */
+	"  removed = removed + ret" EOL							/* 14 */
+	"end" EOL									/* 15 */
+	"return removed" EOL;								/* 16 */
+
+/** Lua script for changing the range of a batch of leases
+ *
+ * - KEYS[1] The pool name.
+ * - ARGV[1] Unused.
+ * - ARGV[2] Range identifier.
+ * - ARGV[3...] IP addresses to modify.
+ *
+ * Returns
+ * - The number of ip addresses modified.
+ */
+static char lua_modify_cmd[] =
+	"local address_prefix = '{' .. KEYS[1] .. '}:"IPPOOL_ADDRESS_KEY":'" EOL		/* 1 */
+
+	"for i = 3, #ARGV do" EOL							/* 2 */
+	"  redis.call('HSET', address_prefix .. ARGV[i], 'range', ARGV[2])" EOL	/* 3 */
+	"end" EOL									/* 4 */
+	"return #ARGV - 2";								/* 5 */
+
+static ippool_tool_script_t add_script = { .cmd = lua_add_cmd, .cmd_len = sizeof(lua_add_cmd) - 1 };
+static ippool_tool_script_t release_script = { .cmd = lua_release_cmd, .cmd_len = sizeof(lua_release_cmd) - 1 };
+static ippool_tool_script_t remove_script = { .cmd = lua_remove_cmd, .cmd_len = sizeof(lua_remove_cmd) - 1 };
+static ippool_tool_script_t modify_script = { .cmd = lua_modify_cmd, .cmd_len = sizeof(lua_modify_cmd) - 1 };
 
 static NEVER_RETURNS void usage(int ret) {
 	INFO("Usage: %s -adrsm range... [-p prefix_len]... [-x]... [-oShf] server[:port] [pool] [range id]", name);
@@ -381,6 +450,123 @@ static int driver_do_lease(void *out, void *instance, ippool_tool_operation_t co
 	return 0;
 }
 
+/** Apply a Lua script to a range of addresses
+ *
+ * Addresses are passed to the script in batches of MAX_BATCH, and up to
+ * MAX_PIPELINED addresses are sent per round trip, so that large ranges
+ * need thousands, rather than millions of commands.
+ *
+ * All the keys for a pool hash to the same slot, so the whole range is
+ * written to a single node.
+ *
+ * @param[out] out	Where to add the number of addresses modified (uint64_t).
+ * @param[in] instance	of the driver.
+ * @param[in] op	describing the range.
+ * @param[in] script	to apply to the batches of addresses.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int driver_do_lease_batch(void *out, void *instance, ippool_tool_operation_t const *op,
+				 ippool_tool_script_t const *script)
+{
+	redis_driver_conf_t		*inst = talloc_get_type_abort(instance, redis_driver_conf_t);
+	uint64_t			*modified = out;
+
+	bool				more = true;
+	fr_redis_conn_t			*conn;
+
+	fr_redis_cluster_state_t	state;
+	fr_redis_rcode_t		status;
+
+	fr_ipaddr_t			ipaddr = op->start;
+	fr_redis_rcode_t		s_ret = REDIS_RCODE_SUCCESS;
+	redisReply			*replies[((MAX_PIPELINED + MAX_BATCH - 1) / MAX_BATCH) + 1];
+
+	char				ip_buff[MAX_BATCH][FR_IPADDR_PREFIX_STRLEN];
+	char const			*argv[MAX_BATCH + 6];
+	size_t				argv_len[MAX_BATCH + 6];
+
+	/*
+	 *	EVALSHA <digest> 1 <pool> <has range> <range> <address>...
+	 */
+	argv[0] = "EVALSHA";
+	argv_len[0] = sizeof("EVALSHA") - 1;
+	argv[1] = script->digest;
+	argv_len[1] = sizeof(script->digest) - 1;
+	argv[2] = "1";
+	argv_len[2] = 1;
+	argv[3] = (char const *)op->pool;
+	argv_len[3] = op->pool_len;
+	argv[4] = op->range ? "1" : "0";
+	argv_len[4] = 1;
+	argv[5] = op->range ? (char const *)op->range : "";
+	argv_len[5] = op->range ? op->range_len : 0;
+
+	while (more) {
+		fr_ipaddr_t	acked = ipaddr; 	/* Record our progress */
+		size_t		reply_cnt = 0;
+		size_t		i;
+
+		for (s_ret = fr_redis_cluster_state_init(&state, &conn, inst->cluster, NULL,
+							 op->pool, op->pool_len, false);
+		     s_ret == REDIS_RCODE_TRY_AGAIN;
+		     s_ret = fr_redis_cluster_state_next(&state, &conn, inst->cluster, NULL, status, &replies[0])) {
+			unsigned int	pipelined = 0;
+			unsigned int	addresses = 0;
+
+		     	more = true;	/* Reset to true, may have errored last loop */
+			status = REDIS_RCODE_SUCCESS;
+
+			/*
+			 *	If we got a redirect, start back at the beginning of the block.
+			 */
+			ipaddr = acked;
+
+			/*
+			 *	Loading the script is idempotent, and much
+			 *	cheaper than a round trip to recover from
+			 *	NOSCRIPT.
+			 */
+			redisAppendCommand(conn->handle, "SCRIPT LOAD %b", script->cmd, script->cmd_len);
+			pipelined++;
+
+			while (more && (addresses < MAX_PIPELINED)) {
+				size_t argc = 6;
+
+				for (i = 0; (i < MAX_BATCH) && (addresses < MAX_PIPELINED) && more;
+				     i++, addresses++, more = ipaddr_next(&ipaddr, &op->end, op->prefix)) {
+					IPPOOL_SPRINT_IP(ip_buff[i], &ipaddr, op->prefix);
+					argv[argc] = ip_buff[i];
+					argv_len[argc++] = strlen(ip_buff[i]);
+				}
+
+				DEBUG("Processing %s - %s in pool \"%pV\"", ip_buff[0], ip_buff[i - 1],
+				      fr_box_strvalue_len((char const *)op->pool, op->pool_len));
+				redisAppendCommandArgv(conn->handle, argc, argv, argv_len);
+				pipelined++;
+			}
+
+			reply_cnt = fr_redis_pipeline_result(&pipelined, &status, replies, NUM_ELEMENTS(replies), conn);
+			for (i = 0; i < reply_cnt; i++) fr_redis_reply_print(L_DBG_LVL_3, replies[i], NULL, i);
+		}
+		if (s_ret != REDIS_RCODE_SUCCESS) {
+			fr_redis_pipeline_free(replies, reply_cnt);
+			return -1;
+		}
+
+		/*
+		 *	First reply is from SCRIPT LOAD
+		 */
+		for (i = 1; i < reply_cnt; i++) {
+			if (replies[i]->type == REDIS_REPLY_INTEGER) *modified += replies[i]->integer;
+		}
+		fr_redis_pipeline_free(replies, reply_cnt);
+	}
+
+	return 0;
+}
+
 /** Enqueue commands to retrieve lease information
  *
  */
@@ -466,89 +652,12 @@ static inline int driver_show_lease(void *out, void *instance, ippool_tool_opera
 	return driver_do_lease(out, instance, op, _driver_show_lease_enqueue, _driver_show_lease_process);
 }
 
-/** Count the number of leases we released
- *
- */
-static int _driver_release_lease_process(void *out, UNUSED fr_ipaddr_t const *ipaddr, redisReply const *reply)
-{
-	uint64_t *modified = out;
-	/*
-	 *	Record the actual number of addresses released.
-	 *	Leases with a score of zero shouldn't be included,
-	 *	in this count.
-	 */
-	if (reply->type != REDIS_REPLY_INTEGER) return -1;
-
-	*modified += reply->integer;
-
-	return 0;
-}
-
-/** Release a lease by setting its score back to zero
- *
- */
-static int _driver_release_lease_enqueue(UNUSED redis_driver_conf_t *inst, fr_redis_conn_t *conn,
-					 uint8_t const *key_prefix, size_t key_prefix_len,
-					 UNUSED uint8_t const *range, UNUSED size_t range_len,
-					 fr_ipaddr_t *ipaddr, uint8_t prefix)
-{
-	char		ip_buff[FR_IPADDR_PREFIX_STRLEN];
-
-	IPPOOL_SPRINT_IP(ip_buff, ipaddr, prefix);
-
-	DEBUG("Releasing %pV to pool \"%pV\"", ip_buff,
-	      fr_box_strvalue_len((char const *)key_prefix, key_prefix_len));
-	redisAppendCommand(conn->handle, "EVAL %s 1 %b %s", lua_release_cmd, key_prefix, key_prefix_len, ip_buff);
-	return 1;
-}
-
 /** Release a range of leases
  *
  */
 static inline int driver_release_lease(void *out, void *instance, ippool_tool_operation_t const *op)
 {
-	return driver_do_lease(out, instance, op,
-			       _driver_release_lease_enqueue, _driver_release_lease_process);
-}
-
-/** Count the number of leases we removed
- *
- * Because the ZREM and DEL have to occur in a transaction, we need
- * some fancier processing to just count the number of ZREMs.
- */
-static int _driver_remove_lease_process(void *out, UNUSED fr_ipaddr_t const *ipaddr, redisReply const *reply)
-{
-	uint64_t *modified = out;
-	/*
-	 *	Record the actual number of addresses released.
-	 *	Leases with a score of zero shouldn't be included,
-	 *	in this count.
-	 */
-	if (reply->type != REDIS_REPLY_INTEGER) return -1;
-
-	*modified += reply->integer;
-
-	return 0;
-}
-
-/** Enqueue lease removal commands
- *
- * This removes the lease from the expiry heap, and the data associated with
- * the lease.
- */
-static int _driver_remove_lease_enqueue(UNUSED redis_driver_conf_t *inst, fr_redis_conn_t *conn,
-					uint8_t const *key_prefix, size_t key_prefix_len,
-					UNUSED uint8_t const *range, UNUSED size_t range_len,
-					fr_ipaddr_t *ipaddr, uint8_t prefix)
-{
-	char		ip_buff[FR_IPADDR_PREFIX_STRLEN];
-
-	IPPOOL_SPRINT_IP(ip_buff, ipaddr, prefix);
-
-	DEBUG("Removing %s from pool \"%pV\"", ip_buff,
-	      fr_box_strvalue_len((char const *)key_prefix, key_prefix_len));
-	redisAppendCommand(conn->handle, "EVAL %s 1 %b %s", lua_remove_cmd, key_prefix, key_prefix_len, ip_buff);
-	return 1;
+	return driver_do_lease_batch(out, instance, op, &release_script);
 }
 
 /** Remove a range of leases
@@ -556,71 +665,7 @@ static int _driver_remove_lease_enqueue(UNUSED redis_driver_conf_t *inst, fr_red
  */
 static int driver_remove_lease(void *out, void *instance, ippool_tool_operation_t const *op)
 {
-	return driver_do_lease(out, instance, op,
-			       _driver_remove_lease_enqueue, _driver_remove_lease_process);
-}
-
-/** Count the number of leases we actually added
- *
- * This isn't necessarily the same as the number of ZADDs, as leases may
- * already exist.
- */
-static int _driver_add_lease_process(void *out, UNUSED fr_ipaddr_t const *ipaddr, redisReply const *reply)
-{
-	uint64_t *modified = out;
-	/*
-	 *	Record the actual number of addresses modified.
-	 *	Existing addresses won't be included in this
-	 *	count.
-	 */
-	if (reply->type != REDIS_REPLY_ARRAY) return -1;
-
-	if ((reply->elements > 0) && (reply->element[0]->type == REDIS_REPLY_INTEGER)) {
-		*modified += reply->element[0]->integer;
-	}
-	return 0;
-}
-
-/** Enqueue lease addition commands
- *
- */
-static int _driver_add_lease_enqueue(UNUSED redis_driver_conf_t *inst, fr_redis_conn_t *conn,
-				     uint8_t const *key_prefix, size_t key_prefix_len,
-				     uint8_t const *range, size_t range_len,
-				     fr_ipaddr_t *ipaddr, uint8_t prefix)
-{
-	uint8_t		key[IPPOOL_MAX_POOL_KEY_SIZE];
-	uint8_t		*key_p = key;
-	char		ip_buff[FR_IPADDR_PREFIX_STRLEN];
-
-	uint8_t		ip_key[IPPOOL_MAX_IP_KEY_SIZE];
-	uint8_t		*ip_key_p = ip_key;
-
-	int		enqueued = 0;
-
-	IPPOOL_BUILD_KEY(key, key_p, key_prefix, key_prefix_len);
-	IPPOOL_SPRINT_IP(ip_buff, ipaddr, prefix);
-	IPPOOL_BUILD_IP_KEY_FROM_STR(ip_key, ip_key_p, key_prefix, key_prefix_len, ip_buff);
-
-	DEBUG("Adding %s to pool \"%pV\" (%zu)", ip_buff, fr_box_strvalue_len((char *)key, (key_p - key)), key_p - key);
-	redisAppendCommand(conn->handle, "MULTI");
-	enqueued++;
-	redisAppendCommand(conn->handle, "ZADD %b NX %u %s", key, key_p - key, 0, ip_buff);
-	enqueued++;
-
-	/*
-	 *	Only add range if it's not NULL.
-	 *
-	 *	Zero length ranges are allowed, and should be preserved.
-	 */
-	if (range) {
-		redisAppendCommand(conn->handle, "HSET %b range %b", ip_key, ip_key_p - ip_key, range, range_len);
-		enqueued++;
-	}
-	redisAppendCommand(conn->handle, "EXEC");
-	enqueued++;
-
-	return enqueued;
+	return driver_do_lease_batch(out, instance, op, &remove_script);
 }
 
 /** Add a range of prefixes
@@ -628,64 +673,15 @@ static int _driver_add_lease_enqueue(UNUSED redis_driver_conf_t *inst, fr_redis_
  */
 static int driver_add_lease(void *out, void *instance, ippool_tool_operation_t const *op)
 {
-	return driver_do_lease(out, instance, op, _driver_add_lease_enqueue, _driver_add_lease_process);
+	return driver_do_lease_batch(out, instance, op, &add_script);
 }
 
-/** Count the number of leases we modified
- */
-static int _driver_modify_lease_process(void *out, UNUSED fr_ipaddr_t const *ipaddr, redisReply const *reply)
-{
-	uint64_t *modified = out;
-	/*
-	 *	Record the actual number of addresses released.
-	 *	Leases with a score of zero shouldn't be included,
-	 *	in this count.
-	 */
-	if (reply->type != REDIS_REPLY_INTEGER) return -1;
-
-	/*
-	 *	return code is 0 or 1 depending on if its a new
-	 *	field, neither are useful
-	 */
-	*modified += 1;
-
-	return 0;
-}
-
-/** Enqueue lease removal commands
- *
- * This modifys the lease from the expiry heap, and the data associated with
- * the lease.
- */
-static int _driver_modify_lease_enqueue(UNUSED redis_driver_conf_t *inst, fr_redis_conn_t *conn,
-					uint8_t const *key_prefix, size_t key_prefix_len,
-					uint8_t const *range, size_t range_len,
-					fr_ipaddr_t *ipaddr, uint8_t prefix)
-{
-	uint8_t		key[IPPOOL_MAX_POOL_KEY_SIZE];
-	uint8_t		*key_p = key;
-	char		ip_buff[FR_IPADDR_PREFIX_STRLEN];
-
-	uint8_t		ip_key[IPPOOL_MAX_IP_KEY_SIZE];
-	uint8_t		*ip_key_p = ip_key;
-
-	IPPOOL_BUILD_KEY(key, key_p, key_prefix, key_prefix_len);
-	IPPOOL_SPRINT_IP(ip_buff, ipaddr, prefix);
-	IPPOOL_BUILD_IP_KEY_FROM_STR(ip_key, ip_key_p, key_prefix, key_prefix_len, ip_buff);
-
-	DEBUG("Modifying %s in pool \"%pV\"", ip_buff, fr_box_strvalue_len((char const *)key_prefix, key_prefix_len));
-	redisAppendCommand(conn->handle, "HSET %b range %b", ip_key, ip_key_p - ip_key, range, range_len);
-
-	return 1;
-}
-
-/** Remove a range of leases
+/** Change the range of a range of leases
  *
  */
 static int driver_modify_lease(void *out, void *instance, ippool_tool_operation_t const *op)
 {
-	return driver_do_lease(out, instance, op,
-			       _driver_modify_lease_enqueue, _driver_modify_lease_process);
+	return driver_do_lease_batch(out, instance, op, &modify_script);
 }
 
 /** Compare two pool names
@@ -988,6 +984,20 @@ static int driver_get_stats(ippool_tool_stats_t *out, void *instance, uint8_t co
 	return 0;
 }
 
+/** Calculate the SHA1 digest of a script, for use with EVALSHA
+ *
+ */
+static void script_digest(ippool_tool_script_t *script)
+{
+	fr_sha1_ctx	sha1_ctx;
+	uint8_t		digest[SHA1_DIGEST_LENGTH];
+
+	fr_sha1_init(&sha1_ctx);
+	fr_sha1_update(&sha1_ctx, (uint8_t const *)script->cmd, script->cmd_len);
+	fr_sha1_final(digest, &sha1_ctx);
+	fr_base16_encode(&FR_SBUFF_OUT(script->digest, sizeof(script->digest)), &FR_DBUFF_TMP(digest, sizeof(digest)));
+}
+
 /** Driver initialization function
  *
  */
@@ -1017,6 +1027,14 @@ static int driver_init(TALLOC_CTX *ctx, CONF_SECTION *conf, void **instance)
 	}
 	*instance = this;
 
+	/*
+	 *	Pre-Compute the SHA1 hashes of the Lua scripts
+	 */
+	script_digest(&add_script);
+	script_digest(&release_script);
+	script_digest(&remove_script);
+	script_digest(&modify_script);
+
 	return 0;
 }
 
@@ -29,7 +29,7 @@
 /** Handle asynchronous cancellation of a request
  *
  * If we're signalled that the request has been cancelled (FR_SIGNAL_CANCEL).
- * Cleanup any pending state and release the connection handle back into the pool.
+ * Cleanup any pending state and release the easy handle back to the thread's idle list.
  */
 void rest_io_module_action(module_ctx_t const *mctx, request_t *request, void *rctx, fr_state_signal_t action)
 {
@@ -49,13 +49,13 @@ void rest_io_module_action(module_ctx_t const *mctx, request_t *request, void *r
 	t->mhandle->transfers--;
 
 	rest_request_cleanup(mctx->instance, randle);
-	fr_pool_connection_release(t->pool, request, randle);
+	rest_handle_release(t, randle);
 }
 
 /** Handle asynchronous cancellation of a request
  *
  * If we're signalled that the request has been cancelled (FR_SIGNAL_CANCEL).
- * Cleanup any pending state and release the connection handle back into the pool.
+ * Cleanup any pending state and release the easy handle back to the thread's idle list.
  */
 void rest_io_xlat_signal(request_t *request, UNUSED void *instance, void *thread, void *rctx, fr_state_signal_t action)
 {
@@ -67,4 +67,9 @@ void rest_io_xlat_signal(request_t *request, UNUSED void *instance, void *thread
 	fr_curl_io_request_t		*randle = talloc_get_type_abort(our_rctx->handle, fr_curl_io_request_t);
 
 	rest_io_module_action(&(module_ctx_t){ .instance = mod_inst, .thread = t }, request, randle, action);
+
+	/*
+	 *	Requests waiting on our result will fail.
+	 */
+	if ((action == FR_SIGNAL_CANCEL) && our_rctx->call) fr_singleflight_leave(our_rctx->call, request);
 }
@@ -33,7 +33,6 @@ RCSID("$Id$")
 #include <time.h>
 
 #include <freeradius-devel/server/base.h>
-#include <freeradius-devel/server/pool.h>
 #include <freeradius-devel/unlang/call.h>
 #include <freeradius-devel/util/base.h>
 #include <freeradius-devel/util/debug.h>
@@ -240,29 +239,18 @@ static int _mod_conn_free(fr_curl_io_request_t *randle)
 	return 0;
 }
 
-/** Creates a new connection handle for use by the FR connection API.
- *
- * Matches the fr_pool_connection_create_t function prototype, is passed to
- * fr_pool_init, and called when a new connection is required by the
- * connection pool API.
+/** Allocates a new easy handle
  *
  * Creates an instances of fr_curl_io_request_t, and rlm_rest_curl_context_t
  * which hold the context data required for generating requests and parsing
  * responses.
  *
- * If instance->connect_uri is not NULL libcurl will attempt to open a
- * TCP socket to the server specified in the URI. This is done so that when the
- * socket is first used, there will already be a cached TCP connection to the
- * REST server associated with the curl handle.
- *
- * @see fr_pool_init
- * @see fr_pool_connection_create_t
- * @see connection.c
+ * Connections are not bound to the easy handle.  They're held in the
+ * connection cache of the thread's multi handle, so that with HTTP/2
+ * multiple concurrent requests can be multiplexed over them.
  */
-void *rest_mod_conn_create(TALLOC_CTX *ctx, void *instance, UNUSED fr_time_delta_t timeout)
+static fr_curl_io_request_t *rest_handle_alloc(TALLOC_CTX *ctx, rlm_rest_t const *inst)
 {
-	rlm_rest_t const	*inst = talloc_get_type_abort_const(instance, rlm_rest_t);
-
 	fr_curl_io_request_t	*randle = NULL;
 	rlm_rest_curl_context_t	*curl_ctx = NULL;
 
@@ -284,6 +272,37 @@ void *rest_mod_conn_create(TALLOC_CTX *ctx, void *instance, UNUSED fr_time_delta
 	return randle;
 }
 
+/** Get an easy handle to use for a request
+ *
+ * Idle handles are reused where possible, otherwise a new one is
+ * allocated.  There's no limit on the number of handles, outstanding
+ * requests are limited only by the multi handle.
+ *
+ * @param[in] t		Thread instance.
+ * @return
+ *	- A handle to pass to rlm_rest_perform.
+ *	- NULL on error.
+ */
+fr_curl_io_request_t *rest_handle_get(rlm_rest_thread_t *t)
+{
+	fr_curl_io_request_t	*randle;
+
+	randle = fr_dlist_pop_head(&t->idle);
+	if (randle) return randle;
+
+	return rest_handle_alloc(t, t->inst);
+}
+
+/** Return an easy handle to the thread's idle list
+ *
+ * @param[in] t		Thread instance.
+ * @param[in] randle	to release.  Must have been cleaned up with #rest_request_cleanup.
+ */
+void rest_handle_release(rlm_rest_thread_t *t, fr_curl_io_request_t *randle)
+{
+	fr_dlist_insert_head(&t->idle, randle);
+}
+
 /** Copies a pre-expanded xlat string to the output buffer
  *
  * @param[out] out	Char buffer to write encoded data to.
@@ -931,6 +950,171 @@ static fr_pair_t *json_pair_alloc_leaf(UNUSED rlm_rest_t const *instance, UNUSED
 	return vp;
 }
 
+/** Converts the value of a single JSON key into fr_pair_ts and adds them to the request
+ *
+ * @see json_pair_alloc
+ *
+ * @param[in] instance	configuration data.
+ * @param[in] section	configuration data.
+ * @param[in] request	Current request.
+ * @param[in] dst	Attribute reference parsed from the JSON key.
+ * @param[in] value	to convert.  May be a scalar, an array, or an object
+ *			using the expanded syntax.
+ * @param[in,out] max_attrs	counter, decremented after each fr_pair_t is created.
+ * @return
+ *	- 0 on success, or if the value was skipped.
+ *	- -1 if the maximum number of attributes was reached.
+ */
+static int json_pair_alloc_attr(rlm_rest_t const *instance, rlm_rest_section_t const *section,
+				request_t *request, tmpl_t const *dst, json_object *value, int *max_attrs)
+{
+	int		i = 0, elements;
+	struct		json_object *element, *tmp;
+	TALLOC_CTX	*ctx;
+
+	json_flags_t flags = {
+		.op = T_OP_SET,
+		.do_xlat = 1,
+		.is_json = 0
+	};
+
+	request_t		*current = request;
+	fr_pair_list_t		*vps;
+	fr_pair_t		*vp = NULL;
+
+	if (tmpl_request_ptr(&current, tmpl_request(dst)) < 0) {
+		RWDEBUG("Attribute name refers to outer request but not in a tunnel (skipping)");
+		return 0;
+	}
+
+	vps = tmpl_list_head(current, tmpl_list(dst));
+	if (!vps) {
+		RWDEBUG("List not valid in this context (skipping)");
+		return 0;
+	}
+	ctx = tmpl_list_ctx(current, tmpl_list(dst));
+
+	/*
+	 *  Alternative JSON structure which allows operator,
+	 *  and other flags to be specified.
+	 *
+	 *	"<name>":{
+	 *		"do_xlat":<bool>,
+	 *		"is_json":<bool>,
+	 *		"op":"<op>",
+	 *		"value":<value>
+	 *	}
+	 *
+	 *	Where value is a:
+	 *	  - []	Multivalued array
+	 *	  - {}	Nested Valuepair
+	 *	  - *	Integer or string value
+	 */
+	if (json_object_is_type(value, json_type_object)) {
+		/*
+		 *  Process operator if present.
+		 */
+		if (json_object_object_get_ex(value, "op", &tmp)) {
+			flags.op = fr_table_value_by_str(fr_tokens_table, json_object_get_string(tmp), 0);
+			if (!flags.op) {
+				RWDEBUG("Invalid operator value \"%s\" (skipping)",
+					json_object_get_string(tmp));
+				return 0;
+			}
+		}
+
+		/*
+		 *  Process optional do_xlat bool.
+		 */
+		if (json_object_object_get_ex(value, "do_xlat", &tmp)) {
+			flags.do_xlat = json_object_get_boolean(tmp);
+		}
+
+		/*
+		 *  Process optional is_json bool.
+		 */
+		if (json_object_object_get_ex(value, "is_json", &tmp)) {
+			flags.is_json = json_object_get_boolean(tmp);
+		}
+
+		/*
+		 *  Value key must be present if were using the expanded syntax.
+		 */
+		if (!json_object_object_get_ex(value, "value", &tmp)) {
+			RWDEBUG("Value key missing (skipping)");
+			return 0;
+		}
+
+		/*
+		 *  The value field now becomes the key we're operating on
+		 */
+		value = tmp;
+	}
+
+	/*
+	 *  Setup fr_pair_afrom_da / recursion loop.
+	 */
+	if (!flags.is_json && json_object_is_type(value, json_type_array)) {
+		elements = json_object_array_length(value);
+		if (!elements) {
+			RWDEBUG("Zero length value array (skipping)");
+			return 0;
+		}
+		element = json_object_array_get_idx(value, 0);
+	} else {
+		elements = 1;
+		element = value;
+	}
+
+	/*
+	 *  A JSON 'value' key, may have multiple elements, iterate
+	 *  over each of them, creating a new fr_pair_t.
+	 */
+	do {
+		if ((*max_attrs)-- <= 0) {
+			RWDEBUG("At maximum attribute limit");
+			return -1;
+		}
+
+		/*
+		 *  Automagically switch the op for multivalued attributes.
+		 */
+		if (((flags.op == T_OP_SET) || (flags.op == T_OP_EQ)) && (i >= 1)) {
+			flags.op = T_OP_ADD;
+		}
+
+		if (json_object_is_type(element, json_type_object) && !flags.is_json) {
+			/* TODO: Insert nested VP into VP structure...*/
+			RWDEBUG("Found nested VP, these are not yet supported (skipping)");
+
+			continue;
+
+			/*
+			vp = json_pair_alloc(instance, section,
+					   request, value,
+					   level + 1, max_attrs);*/
+		} else {
+			vp = json_pair_alloc_leaf(instance, section, ctx, request,
+						  tmpl_da(dst), &flags, element);
+			if (!vp) continue;
+		}
+		RINDENT();
+		RDEBUG2("&%s:%pP", fr_table_str_by_value(pair_list_table, tmpl_list(dst), ""), vp);
+		REXDENT();
+
+		fr_pair_list_t tmp_list;
+		fr_pair_list_init(&tmp_list);
+		fr_pair_append(&tmp_list, vp);
+		radius_pairmove(current, vps, &tmp_list, false);
+	/*
+	 *  If we call json_object_array_get_idx on something that's not an array
+	 *  the behaviour appears to be to occasionally segfault.
+	 */
+	} while ((++i < elements) && (element = json_object_array_get_idx(value, i)));
+
+	return 0;
+}
+
 /** Processes JSON response and converts it into multiple fr_pair_ts
  *
  * Processes JSON attribute declarations in the format below. Will recurse when
@@ -1005,20 +1189,6 @@ static int json_pair_alloc(rlm_rest_t const *instance, rlm_rest_section_t const
 	 *	Process VP container
 	 */
 	json_object_object_foreach(object, name, value) {
-		int		i = 0, elements;
-		struct		json_object *element, *tmp;
-		TALLOC_CTX	*ctx;
-
-		json_flags_t flags = {
-			.op = T_OP_SET,
-			.do_xlat = 1,
-			.is_json = 0
-		};
-
-		request_t		*current = request;
-		fr_pair_list_t		*vps;
-		fr_pair_t		*vp = NULL;
-
 		TALLOC_FREE(dst);
 
 		/*
@@ -1036,136 +1206,10 @@ static int json_pair_alloc(rlm_rest_t const *instance, rlm_rest_section_t const
 			continue;
 		}
 
-		if (tmpl_request_ptr(&current, tmpl_request(dst)) < 0) {
-			RWDEBUG("Attribute name refers to outer request but not in a tunnel (skipping)");
-			continue;
-		}
-
-		vps = tmpl_list_head(current, tmpl_list(dst));
-		if (!vps) {
-			RWDEBUG("List not valid in this context (skipping)");
-			continue;
-		}
-		ctx = tmpl_list_ctx(current, tmpl_list(dst));
-
-		/*
-		 *  Alternative JSON structure which allows operator,
-		 *  and other flags to be specified.
-		 *
-		 *	"<name>":{
-		 *		"do_xlat":<bool>,
-		 *		"is_json":<bool>,
-		 *		"op":"<op>",
-		 *		"value":<value>
-		 *	}
-		 *
-		 *	Where value is a:
-		 *	  - []	Multivalued array
-		 *	  - {}	Nested Valuepair
-		 *	  - *	Integer or string value
-		 */
-		if (json_object_is_type(value, json_type_object)) {
-			/*
-			 *  Process operator if present.
-			 */
-			if (json_object_object_get_ex(value, "op", &tmp)) {
-				flags.op = fr_table_value_by_str(fr_tokens_table, json_object_get_string(tmp), 0);
-				if (!flags.op) {
-					RWDEBUG("Invalid operator value \"%s\" (skipping)",
-						json_object_get_string(tmp));
-					continue;
-				}
-			}
-
-			/*
-			 *  Process optional do_xlat bool.
-			 */
-			if (json_object_object_get_ex(value, "do_xlat", &tmp)) {
-				flags.do_xlat = json_object_get_boolean(tmp);
-			}
-
-			/*
-			 *  Process optional is_json bool.
-			 */
-			if (json_object_object_get_ex(value, "is_json", &tmp)) {
-				flags.is_json = json_object_get_boolean(tmp);
-			}
-
-			/*
-			 *  Value key must be present if were using the expanded syntax.
-			 */
-			if (!json_object_object_get_ex(value, "value", &tmp)) {
-				RWDEBUG("Value key missing (skipping)");
-				continue;
-			}
-
-			/*
-			 *  The value field now becomes the key we're operating on
-			 */
-			value = tmp;
-		}
-
-		/*
-		 *  Setup fr_pair_afrom_da / recursion loop.
-		 */
-		if (!flags.is_json && json_object_is_type(value, json_type_array)) {
-			elements = json_object_array_length(value);
-			if (!elements) {
-				RWDEBUG("Zero length value array (skipping)");
-				continue;
-			}
-			element = json_object_array_get_idx(value, 0);
-		} else {
-			elements = 1;
-			element = value;
+		if (json_pair_alloc_attr(instance, section, request, dst, value, &max_attrs) < 0) {
+			talloc_free(dst);
+			return max;
 		}
-
-		/*
-		 *  A JSON 'value' key, may have multiple elements, iterate
-		 *  over each of them, creating a new fr_pair_t.
-		 */
-		do {
-			if (max_attrs-- <= 0) {
-				RWDEBUG("At maximum attribute limit");
-				talloc_free(dst);
-				return max;
-			}
-
-			/*
-			 *  Automagically switch the op for multivalued attributes.
-			 */
-			if (((flags.op == T_OP_SET) || (flags.op == T_OP_EQ)) && (i >= 1)) {
-				flags.op = T_OP_ADD;
-			}
-
-			if (json_object_is_type(element, json_type_object) && !flags.is_json) {
-				/* TODO: Insert nested VP into VP structure...*/
-				RWDEBUG("Found nested VP, these are not yet supported (skipping)");
-
-				continue;
-
-				/*
-				vp = json_pair_alloc(instance, section,
-						   request, value,
-						   level + 1, max_attrs);*/
-			} else {
-				vp = json_pair_alloc_leaf(instance, section, ctx, request,
-							  tmpl_da(dst), &flags, element);
-				if (!vp) continue;
-			}
-			RINDENT();
-			RDEBUG2("&%s:%pP", fr_table_str_by_value(pair_list_table, tmpl_list(dst), ""), vp);
-			REXDENT();
-
-			fr_pair_list_t tmp_list;
-			fr_pair_list_init(&tmp_list);
-			fr_pair_append(&tmp_list, vp);
-			radius_pairmove(current, vps, &tmp_list, false);
-		/*
-		 *  If we call json_object_array_get_idx on something that's not an array
-		 *  the behaviour appears to be to occasionally segfault.
-		 */
-		} while ((++i < elements) && (element = json_object_array_get_idx(value, i)));
 	}
 
 	talloc_free(dst);
@@ -1223,6 +1267,333 @@ static int rest_decode_json(rlm_rest_t const *instance, rlm_rest_section_t const
 
 	return ret;
 }
+
+/** States of the incremental JSON decoder
+ *
+ */
+typedef enum {
+	JSON_STREAM_INIT = 0,				//!< Expecting the opening '{'.
+	JSON_STREAM_KEY_START,				//!< Expecting a key, or the closing '}'.
+	JSON_STREAM_KEY,				//!< Inside a key.
+	JSON_STREAM_COLON,				//!< Expecting ':'.
+	JSON_STREAM_VALUE_START,			//!< Expecting the start of a value.
+	JSON_STREAM_VALUE,				//!< Inside a value.
+	JSON_STREAM_VALUE_END,				//!< Expecting ',' or the closing '}'.
+	JSON_STREAM_DONE				//!< Seen the closing '}'.
+} json_stream_state_t;
+
+/** A value captured by the incremental JSON decoder
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the list of captured values.
+	tmpl_t			*dst;			//!< Attribute the value will be assigned to.
+	json_object		*value;			//!< Parsed value.
+} json_stream_attr_t;
+
+/** Incremental JSON decoder state
+ *
+ * Only the top level object is tokenized.  The value of each key that
+ * resolves to an attribute is copied and parsed individually, the
+ * values of all other keys are scanned over without being copied.
+ */
+typedef struct {
+	json_stream_state_t	state;			//!< Where we are in the top level object.
+	bool			in_string;		//!< Inside a string in the current value.
+	bool			escape;			//!< Previous char was a backslash.
+	unsigned int		depth;			//!< Nesting depth within the current value.
+
+	char			*buff;			//!< The current key, or the current value if it's
+							///< being captured.  NULL if the value is being skipped.
+	tmpl_t			*dst;			//!< Attribute the current value will be assigned to.
+
+	fr_dlist_head_t		attrs;			//!< Captured values in the order they were received.
+} rest_json_stream_t;
+
+static int _json_stream_attr_free(json_stream_attr_t *attr)
+{
+	if (attr->value) json_object_put(attr->value);
+
+	return 0;
+}
+
+/** Find the closing quote of a string
+ *
+ * @param[in] js	decoder state.
+ * @param[in] p		where to start searching.
+ * @param[in] end	of the current chunk.
+ * @return
+ *	- Pointer to the closing quote.
+ *	- NULL if the string continues past the end of the chunk.
+ */
+static char const *json_stream_string_end(rest_json_stream_t *js, char const *p, char const *end)
+{
+	while (p < end) {
+		if (js->escape) {
+			js->escape = false;
+		} else if (*p == '\\') {
+			js->escape = true;
+		} else if (*p == '"') {
+			return p;
+		}
+		p++;
+	}
+
+	return NULL;
+}
+
+/** Find the end of a value
+ *
+ * @param[in] js	decoder state.
+ * @param[in] p		where to start searching.
+ * @param[in] end	of the current chunk.
+ * @return
+ *	- Pointer to the first char after the value.
+ *	- NULL if the value continues past the end of the chunk.
+ */
+static char const *json_stream_value_end(rest_json_stream_t *js, char const *p, char const *end)
+{
+	char const *q;
+
+	while (p < end) {
+		if (js->in_string) {
+			q = json_stream_string_end(js, p, end);
+			if (!q) return NULL;
+
+			js->in_string = false;
+			p = q + 1;
+			if (js->depth == 0) return p;
+			continue;
+		}
+
+		switch (*p) {
+		case '"':
+			js->in_string = true;
+			break;
+
+		case '{':
+		case '[':
+			js->depth++;
+			break;
+
+		case '}':
+		case ']':
+			if (js->depth == 0) return p;	/* End of a scalar */
+			if (--js->depth == 0) return p + 1;
+			break;
+
+		case ',':
+			if (js->depth == 0) return p;
+			break;
+
+		default:
+			if ((js->depth == 0) && isspace((uint8_t)*p)) return p;
+			break;
+		}
+		p++;
+	}
+
+	return NULL;
+}
+
+/** Resolve the current key to an attribute
+ *
+ * If the key doesn't resolve, its value will be skipped.
+ */
+static void json_stream_key(request_t *request, rest_json_stream_t *js)
+{
+	RDEBUG2("Parsing attribute \"%s\"", js->buff);
+
+	if (strchr(js->buff, '\\')) {
+		RWDEBUG("Attribute names containing escape sequences are not supported (skipping)");
+	skip:
+		TALLOC_FREE(js->buff);
+		return;
+	}
+
+	if (fr_dlist_num_elements(&js->attrs) >= REST_BODY_MAX_ATTRS) {
+		RWDEBUG("At maximum attribute limit");
+		goto skip;
+	}
+
+	if (tmpl_afrom_attr_str(js, NULL, &js->dst, js->buff,
+				&(tmpl_rules_t){
+					.prefix = TMPL_ATTR_REF_PREFIX_NO,
+					.dict_def = request->dict,
+					.list_def = PAIR_LIST_REPLY
+				}) <= 0) {
+		RPWDEBUG("Failed parsing attribute (skipping)");
+		goto skip;
+	}
+
+	MEM(js->buff = talloc_strdup(js, ""));
+}
+
+/** Parse a captured value and add it to the list of values to convert
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 if the value was malformed.
+ */
+static int json_stream_value(request_t *request, rest_json_stream_t *js)
+{
+	json_stream_attr_t	*attr;
+	json_object		*value;
+
+	value = json_tokener_parse(js->buff);
+	if (!value) {
+		REDEBUG("Malformed JSON value \"%s\"", js->buff);
+		return -1;
+	}
+	TALLOC_FREE(js->buff);
+
+	MEM(attr = talloc_zero(js, json_stream_attr_t));
+	attr->value = value;
+	attr->dst = talloc_steal(attr, js->dst);
+	js->dst = NULL;
+	talloc_set_destructor(attr, _json_stream_attr_free);
+
+	fr_dlist_insert_tail(&js->attrs, attr);
+
+	return 0;
+}
+
+/** Feed a chunk of body data to the incremental JSON decoder
+ *
+ * @param[in] request	Current request.
+ * @param[in] js	decoder state.
+ * @param[in] in	body data.
+ * @param[in] inlen	Length of body data.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the data was malformed.
+ */
+static int rest_json_stream_push(request_t *request, rest_json_stream_t *js, char const *in, size_t inlen)
+{
+	char const *p = in, *end = in + inlen, *q;
+
+	while (p < end) {
+		switch (js->state) {
+		case JSON_STREAM_INIT:
+			if (isspace((uint8_t)*p)) break;
+			if (*p != '{') {
+				REDEBUG("Can't process VP container, expected JSON object");
+				return -1;
+			}
+			js->state = JSON_STREAM_KEY_START;
+			break;
+
+		case JSON_STREAM_KEY_START:
+			if (isspace((uint8_t)*p)) break;
+			if (*p == '}') {
+				js->state = JSON_STREAM_DONE;
+				break;
+			}
+			if (*p != '"') goto malformed;
+
+			MEM(js->buff = talloc_strdup(js, ""));
+			js->state = JSON_STREAM_KEY;
+			break;
+
+		case JSON_STREAM_KEY:
+			q = json_stream_string_end(js, p, end);
+			MEM(js->buff = talloc_strndup_append_buffer(js->buff, p, (q ? q : end) - p));
+			if (!q) return 0;
+
+			js->state = JSON_STREAM_COLON;
+			p = q;
+			break;
+
+		case JSON_STREAM_COLON:
+			if (isspace((uint8_t)*p)) break;
+			if (*p != ':') goto malformed;
+
+			json_stream_key(request, js);
+			js->state = JSON_STREAM_VALUE_START;
+			break;
+
+		case JSON_STREAM_VALUE_START:
+			if (isspace((uint8_t)*p)) break;
+
+			js->depth = 0;
+			js->in_string = false;
+			js->escape = false;
+			js->state = JSON_STREAM_VALUE;
+			continue;	/* First char is part of the value */
+
+		case JSON_STREAM_VALUE:
+			q = json_stream_value_end(js, p, end);
+			if (js->buff) MEM(js->buff = talloc_strndup_append_buffer(js->buff, p, (q ? q : end) - p));
+			if (!q) return 0;
+
+			if (js->buff && (json_stream_value(request, js) < 0)) return -1;
+			TALLOC_FREE(js->dst);
+
+			js->state = JSON_STREAM_VALUE_END;
+			p = q;
+			continue;	/* q is the first char after the value */
+
+		case JSON_STREAM_VALUE_END:
+			if (isspace((uint8_t)*p)) break;
+			if (*p == ',') {
+				js->state = JSON_STREAM_KEY_START;
+				break;
+			}
+			if (*p == '}') {
+				js->state = JSON_STREAM_DONE;
+				break;
+			}
+			goto malformed;
+
+		case JSON_STREAM_DONE:
+			if (isspace((uint8_t)*p)) break;
+		malformed:
+			REDEBUG("Malformed JSON data, unexpected '%c'", *p);
+			return -1;
+		}
+		p++;
+	}
+
+	return 0;
+}
+
+/** Converts the values captured by the incremental JSON decoder into fr_pair_ts
+ *
+ * @see json_pair_alloc
+ *
+ * @param[in] instance	configuration data.
+ * @param[in] section	configuration data.
+ * @param[in,out] request Current request.
+ * @param[in] js	decoder state.
+ * @return
+ *	- The number of #fr_pair_t processed.
+ *	- -1 on unrecoverable error.
+ */
+static int rest_decode_json_stream(rlm_rest_t const *instance, rlm_rest_section_t const *section,
+				   request_t *request, rest_json_stream_t *js)
+{
+	int max_attrs = REST_BODY_MAX_ATTRS;
+
+	switch (js->state) {
+	case JSON_STREAM_INIT:		/* Empty response */
+		return 0;
+
+	case JSON_STREAM_DONE:
+		break;
+
+	default:
+		REDEBUG("Truncated JSON data");
+		return -1;
+	}
+
+	fr_dlist_foreach(&js->attrs, json_stream_attr_t, attr) {
+		if (json_pair_alloc_attr(instance, section, request, attr->dst, attr->value, &max_attrs) < 0) {
+			return REST_BODY_MAX_ATTRS;
+		}
+	}
+
+	return REST_BODY_MAX_ATTRS - max_attrs;
+}
 #endif
 
 /** Processes incoming HTTP header data from libcurl.
@@ -1445,6 +1816,10 @@ static size_t rest_response_header(void *in, size_t size, size_t nmemb, void *us
  * Writes incoming body data to an intermediary buffer for later parsing by
  * one of the decode functions.
  *
+ * JSON bodies which will be converted to attributes are instead passed to
+ * the incremental JSON decoder, so only the values of keys which resolve
+ * to attributes are ever copied.
+ *
  * @param[in] in	Char buffer where inbound header data is written
  * @param[in] size	Multiply by nmemb to get the length of ptr.
  * @param[in] nmemb	Multiply by size to get the length of ptr.
@@ -1498,7 +1873,44 @@ static size_t rest_response_body(void *in, size_t size, size_t nmemb, void *user
 		if (p != end) RDEBUG3("%pV", fr_box_strvalue_len(p, end - p));
 		break;
 
+#ifdef HAVE_JSON
+	case REST_HTTP_BODY_JSON:
+		/*
+		 *  If the body is going to be converted to attributes
+		 *  decode it as it arrives, instead of buffering it.
+		 *  Other responses are buffered so they can be printed.
+		 */
+		if (!ctx->decoder &&
+		    (ctx->buffer || (((ctx->code < 200) || (ctx->code >= 300)) && (ctx->code != 401)))) goto buffer;
+
+		if ((ctx->section->max_body_in > 0) && ((ctx->used + (end - p)) > ctx->section->max_body_in)) {
+			REDEBUG("Incoming data (%zu bytes) exceeds max_body_in (%zu bytes).  "
+				"Forcing body to type 'invalid'", ctx->used + (end - p), ctx->section->max_body_in);
+		invalid:
+			ctx->type = REST_HTTP_BODY_INVALID;
+			TALLOC_FREE(ctx->decoder);
+			break;
+		}
+
+		if (!ctx->decoder) {
+			rest_json_stream_t *js;
+
+			MEM(ctx->decoder = js = talloc_zero(NULL, rest_json_stream_t));
+			fr_dlist_talloc_init(&js->attrs, json_stream_attr_t, entry);
+		}
+
+		if (rest_json_stream_push(request, ctx->decoder, p, end - p) < 0) {
+			REDEBUG("Forcing body to type 'invalid'");
+			goto invalid;
+		}
+		ctx->used += (end - p);
+		break;
+#endif
+
 	default:
+#ifdef HAVE_JSON
+	buffer:
+#endif
 	{
 		char *out_p;
 
@@ -1602,6 +2014,7 @@ static void rest_response_init(rlm_rest_section_t const *section,
 	ctx->alloc = 0;
 	ctx->used = 0;
 	TALLOC_FREE(ctx->buffer);
+	TALLOC_FREE(ctx->decoder);
 }
 
 /** Extracts pointer to buffer containing response data
@@ -1715,7 +2128,7 @@ error:
  *	- 0 on success (all opts configured).
  *	- -1 on failure.
  */
-int rest_request_config(rlm_rest_t const *inst, rlm_rest_thread_t *t, rlm_rest_section_t const *section,
+int rest_request_config(rlm_rest_t const *inst, UNUSED rlm_rest_thread_t *t, rlm_rest_section_t const *section,
 			request_t *request, fr_curl_io_request_t *randle, http_method_t method,
 			http_body_type_t type,
 			char const *uri, char const *username, char const *password)
@@ -1745,6 +2158,15 @@ int rest_request_config(rlm_rest_t const *inst, rlm_rest_thread_t *t, rlm_rest_s
 	 */
 	if (inst->http_negotiation != CURL_HTTP_VERSION_NONE) FR_CURL_SET_OPTION(CURLOPT_HTTP_VERSION, inst->http_negotiation);
 
+#ifdef CURLPIPE_MULTIPLEX
+	/*
+	 *	Wait for an existing connection to confirm
+	 *	whether it can multiplex, instead of opening
+	 *	a new connection for every concurrent request.
+	 */
+	if (inst->multiplex) FR_CURL_SET_OPTION(CURLOPT_PIPEWAIT, 1L);
+#endif
+
 	/*
 	 *	Setup any header options and generic headers.
 	 */
@@ -1769,11 +2191,15 @@ int rest_request_config(rlm_rest_t const *inst, rlm_rest_thread_t *t, rlm_rest_s
 		}
 	}
 
-	timeout = fr_pool_timeout(t->pool);
+	/*
+	 *	Don't wait for the server after the client has
+	 *	given up on the request.
+	 */
+	timeout = request_deadline_limit(request, inst->connect_timeout);
 	RDEBUG3("Connect timeout is %pVs, request timeout is %pVs",
-	        fr_box_time_delta(timeout), fr_box_time_delta(section->timeout));
+	        fr_box_time_delta(timeout), fr_box_time_delta(request_deadline_limit(request, section->timeout)));
 	FR_CURL_SET_OPTION(CURLOPT_CONNECTTIMEOUT_MS, fr_time_delta_to_msec(timeout));
-	FR_CURL_SET_OPTION(CURLOPT_TIMEOUT_MS, fr_time_delta_to_msec(section->timeout));
+	FR_CURL_SET_OPTION(CURLOPT_TIMEOUT_MS, fr_time_delta_to_msec(request_deadline_limit(request, section->timeout)));
 	FR_CURL_SET_OPTION(CURLOPT_PROTOCOLS, (CURLPROTO_HTTP | CURLPROTO_HTTPS));
 
 	/*
@@ -2065,6 +2491,13 @@ int rest_response_decode(rlm_rest_t const *instance, rlm_rest_section_t const *s
 
 	int ret = -1;	/* -Wsometimes-uninitialized */
 
+#ifdef HAVE_JSON
+	/*
+	 *  Body was decoded as it was received.
+	 */
+	if (ctx->response.decoder) return rest_decode_json_stream(instance, section, request, ctx->response.decoder);
+#endif
+
 	if (!ctx->response.buffer) {
 		RDEBUG2("Skipping attribute processing, no valid body data received");
 		return 0;
@@ -28,7 +28,7 @@ RCSIDH(rest_h, "$Id$")
 #include <freeradius-devel/curl/base.h>
 #include <freeradius-devel/curl/config.h>
 #include <freeradius-devel/server/pairmove.h>
-#include <freeradius-devel/server/pool.h>
+#include <freeradius-devel/server/singleflight.h>
 
 /*
  *	The common JSON library (also tells us if we have json-c)
@@ -135,6 +135,9 @@ typedef struct {
 	uint32_t		chunk;		//!< Max chunk-size (mainly for testing the encoders)
 	size_t			max_body_in;	//!< Maximum size of incoming data.
 
+	bool			coalesce;	//!< Share the result of identical in-flight
+						//!< requests (xlat only).
+
 	fr_curl_tls_t		tls;
 } rlm_rest_section_t;
 
@@ -146,14 +149,14 @@ typedef struct {
 
 	char const		*connect_proxy;	//!< Send request via this proxy.
 
+	fr_time_delta_t		connect_timeout;	//!< How long to wait for a connection to be established.
+
 	int			http_negotiation; //!< What HTTP version to negotiate, and how to
 						///< negotiate it.  One or the CURL_HTTP_VERSION_ macros.
 
 	bool			multiplex;	//!< Whether to perform multiple requests using a single
 						///< connection.
 
-	fr_pool_t		*pool;		//!< Pointer to the connection pool.
-
 	rlm_rest_section_t	xlat;		//!< Configuration specific to xlat.
 	rlm_rest_section_t	authorize;	//!< Configuration specific to authorisation.
 	rlm_rest_section_t	authenticate;	//!< Configuration specific to authentication.
@@ -171,9 +174,11 @@ typedef struct {
  */
 typedef struct {
 	rlm_rest_t const	*inst;		//!< Instance of rlm_rest.
-	fr_pool_t		*pool;		//!< Thread specific connection pool.
+	fr_dlist_head_t		idle;		//!< Easy handles not currently in use.  Most recently
+						//!< released at the head.
 	fr_curl_handle_t	*mhandle;	//!< Thread specific multi handle.  Serves as the dispatch
 						//!< and coralling structure for REST requests.
+	fr_singleflight_t	*sf;		//!< In-flight xlat requests, used when coalescing.
 } rlm_rest_thread_t;
 
 /** Wrapper around the module thread stuct for individual xlats
@@ -263,6 +268,7 @@ typedef struct {
 typedef struct {
 	rlm_rest_section_t	section;	//!< Our mutated section config.
 	fr_curl_io_request_t	*handle;	//!< curl easy handle servicing our request.
+	fr_singleflight_call_t	*call;		//!< Coalesced call we're the leader of.
 } rlm_rest_xlat_rctx_t;
 
 extern fr_dict_t const *dict_freeradius;
@@ -279,7 +285,9 @@ typedef size_t (*rest_read_t)(void *ptr, size_t size, size_t nmemb,
 			      void *userdata);
 
 
-void *rest_mod_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delta_t timeout);
+fr_curl_io_request_t *rest_handle_get(rlm_rest_thread_t *t);
+
+void rest_handle_release(rlm_rest_thread_t *t, fr_curl_io_request_t *randle);
 
 /*
  *	Request processing API
@@ -99,6 +99,7 @@ static const CONF_PARSER xlat_config[] = {
 	/* Transfer configuration */
 	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, rlm_rest_section_t, timeout), .dflt = "4.0" },
 	{ FR_CONF_OFFSET("chunk", FR_TYPE_UINT32, rlm_rest_section_t, chunk), .dflt = "0" },
+	{ FR_CONF_OFFSET("coalesce", FR_TYPE_BOOL, rlm_rest_section_t, coalesce), .dflt = "no" },
 
 	/* TLS Parameters */
 	{ FR_CONF_OFFSET("tls", FR_TYPE_SUBSECTION, rlm_rest_section_t, tls), .subcs = (void const *) fr_curl_tls_config },
@@ -106,7 +107,7 @@ static const CONF_PARSER xlat_config[] = {
 };
 
 static const CONF_PARSER module_config[] = {
-	{ FR_CONF_DEPRECATED("connect_timeout", FR_TYPE_TIME_DELTA, rlm_rest_t, connect_timeout) },
+	{ FR_CONF_OFFSET("connect_timeout", FR_TYPE_TIME_DELTA, rlm_rest_t, connect_timeout), .dflt = "3.0" },
 	{ FR_CONF_OFFSET("connect_proxy", FR_TYPE_STRING, rlm_rest_t, connect_proxy) },
 	{ FR_CONF_OFFSET("http_negotiation", FR_TYPE_VOID, rlm_rest_t, http_negotiation),
 	  .func = cf_table_parse_int, .uctx = &(cf_table_parse_ctx_t){ .table = http_negotiation_table, .len = &http_negotiation_table_len }, .dflt = "default" },
@@ -232,6 +233,7 @@ static xlat_action_t rest_xlat_resume(TALLOC_CTX *ctx, fr_dcursor_t *out,
 	ssize_t				len;
 	char const			*body;
 	xlat_action_t			xa = XLAT_ACTION_DONE;
+	fr_value_box_t			*vb = NULL;
 
 	fr_curl_io_request_t		*handle = talloc_get_type_abort(our_rctx->handle, fr_curl_io_request_t);
 	rlm_rest_section_t		*section = &our_rctx->section;
@@ -275,29 +277,95 @@ error:
 
 	len = rest_get_handle_data(&body, handle);
 	if (len > 0) {
-		fr_value_box_t *vb;
-
 		MEM(vb = fr_value_box_alloc_null(ctx));
 		fr_value_box_bstrndup(vb, vb, NULL, body, len, true);
 		fr_dcursor_insert(out, vb);
 	}
 
 finish:
+	/*
+	 *	Hand a copy of the body to any requests
+	 *	waiting on an identical call.
+	 */
+	if (our_rctx->call) {
+		fr_value_box_t *result = NULL;
+
+		if ((xa == XLAT_ACTION_DONE) && vb) {
+			MEM(result = fr_value_box_alloc_null(NULL));
+			if (fr_value_box_copy(result, result, vb) < 0) {
+				talloc_free(result);
+				result = NULL;
+			}
+		}
+
+		fr_singleflight_complete(our_rctx->call, (xa == XLAT_ACTION_DONE) ? 0 : -1, result);
+		fr_singleflight_leave(our_rctx->call, request);
+	}
+
 	rest_request_cleanup(mod_inst, handle);
 
-	fr_pool_connection_release(t->pool, request, handle);
+	rest_handle_release(t, handle);
 
 	talloc_free(our_rctx);
 
 	return xa;
 }
 
+/** Copy the result of an identical call performed by another request
+ *
+ */
+static xlat_action_t rest_xlat_coalesced_resume(TALLOC_CTX *ctx, fr_dcursor_t *out,
+						request_t *request, UNUSED void const *xlat_inst,
+						UNUSED void *xlat_thread_inst, UNUSED fr_value_box_list_t *in, void *rctx)
+{
+	fr_singleflight_call_t		*call = rctx;
+	fr_value_box_t const		*result;
+	fr_value_box_t			*vb;
+	xlat_action_t			xa = XLAT_ACTION_DONE;
+
+	if (fr_singleflight_result((void const **)&result, call) < 0) {
+		REDEBUG("Coalesced REST request failed");
+		xa = XLAT_ACTION_FAIL;
+		goto finish;
+	}
+
+	if (!result) goto finish;
+
+	MEM(vb = fr_value_box_alloc_null(ctx));
+	if (fr_value_box_copy(vb, vb, result) < 0) {
+		RPEDEBUG("Failed copying result of coalesced REST request");
+		talloc_free(vb);
+		xa = XLAT_ACTION_FAIL;
+		goto finish;
+	}
+	fr_dcursor_insert(out, vb);
+
+finish:
+	fr_singleflight_leave(call, request);
+
+	return xa;
+}
+
+/** Stop waiting on an identical call if the request is cancelled
+ *
+ */
+static void rest_xlat_coalesced_signal(request_t *request, UNUSED void *instance, UNUSED void *thread,
+				       void *rctx, fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	fr_singleflight_leave(rctx, request);
+}
+
 /** Simple xlat to read text data from a URL
  *
  * Example:
 @verbatim
 %{rest:http://example.com/}
 @endverbatim
+ *
+ * If coalesce is enabled, concurrent calls with an identical argument
+ * share a single HTTP request.
  *
  * @ingroup xlat_functions
  */
@@ -334,12 +402,38 @@ static xlat_action_t rest_xlat(TALLOC_CTX *ctx, UNUSED fr_dcursor_t *out,
 
 	MEM(rctx = talloc(request, rlm_rest_xlat_rctx_t));
 	section = &rctx->section;
+	rctx->call = NULL;
 
 	/*
 	 *	Section gets modified, so we need our own copy.
 	 */
 	memcpy(&rctx->section, &mod_inst->xlat, sizeof(*section));
 
+	/*
+	 *	The argument is the fully expanded method, URI
+	 *	and body, so it identifies the request.  If
+	 *	an identical one is in flight, wait for its
+	 *	result instead of sending another.
+	 */
+	if (section->coalesce) {
+		fr_singleflight_call_t	*call;
+		bool			leader;
+
+		call = fr_singleflight_join(&leader, t->sf, request, p);
+		if (!call) {
+			REDEBUG("Failed coalescing REST request");
+			talloc_free(rctx);
+			return XLAT_ACTION_FAIL;
+		}
+
+		if (!leader) {
+			talloc_free(rctx);
+			return unlang_xlat_yield(request, rest_xlat_coalesced_resume,
+						 rest_xlat_coalesced_signal, call);
+		}
+		rctx->call = call;
+	}
+
 	RDEBUG2("Expanding URI components");
 
 	/*
@@ -373,8 +467,12 @@ static xlat_action_t rest_xlat(TALLOC_CTX *ctx, UNUSED fr_dcursor_t *out,
 	 */
 	fr_skip_whitespace(p);
 
-	randle = rctx->handle = fr_pool_connection_get(t->pool, request);
-	if (!randle) return XLAT_ACTION_FAIL;
+	randle = rctx->handle = rest_handle_get(t);
+	if (!randle) {
+		if (rctx->call) fr_singleflight_leave(rctx->call, request);
+		talloc_free(rctx);
+		return XLAT_ACTION_FAIL;
+	}
 
 	/*
 	 *  Unescape parts of xlat'd URI, this allows REST servers to be specified by
@@ -384,8 +482,9 @@ static xlat_action_t rest_xlat(TALLOC_CTX *ctx, UNUSED fr_dcursor_t *out,
 	if (len <= 0) {
 	error:
 		rest_request_cleanup(mod_inst, randle);
-		fr_pool_connection_release(t->pool, request, randle);
-		talloc_free(section);
+		rest_handle_release(t, randle);
+		if (rctx->call) fr_singleflight_leave(rctx->call, request);
+		talloc_free(rctx);
 
 		return XLAT_ACTION_FAIL;
 	}
@@ -505,7 +604,7 @@ static unlang_action_t mod_authorize_result(rlm_rcode_t *p_result, module_ctx_t
 finish:
 	rest_request_cleanup(inst, handle);
 
-	fr_pool_connection_release(t->pool, request, handle);
+	rest_handle_release(t, handle);
 
 	RETURN_MODULE_RCODE(rcode);
 }
@@ -527,13 +626,13 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 
 	if (!section->name) RETURN_MODULE_NOOP;
 
-	handle = fr_pool_connection_get(t->pool, request);
+	handle = rest_handle_get(t);
 	if (!handle) RETURN_MODULE_FAIL;
 
 	ret = rlm_rest_perform(inst, t, section, handle, request, NULL, NULL);
 	if (ret < 0) {
 		rest_request_cleanup(inst, handle);
-		fr_pool_connection_release(t->pool, request, handle);
+		rest_handle_release(t, handle);
 
 		RETURN_MODULE_FAIL;
 	}
@@ -620,7 +719,7 @@ static unlang_action_t mod_authenticate_result(rlm_rcode_t *p_result,
 finish:
 	rest_request_cleanup(inst, handle);
 
-	fr_pool_connection_release(t->pool, request, handle);
+	rest_handle_release(t, handle);
 
 	RETURN_MODULE_RCODE(rcode);
 }
@@ -676,14 +775,14 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		RDEBUG2("Login attempt with password");
 	}
 
-	handle = fr_pool_connection_get(t->pool, request);
+	handle = rest_handle_get(t);
 	if (!handle) RETURN_MODULE_FAIL;
 
 	ret = rlm_rest_perform(inst, t, section,
 			       handle, request, username->vp_strvalue, password->vp_strvalue);
 	if (ret < 0) {
 		rest_request_cleanup(inst, handle);
-		fr_pool_connection_release(t->pool, request, handle);
+		rest_handle_release(t, handle);
 
 		RETURN_MODULE_FAIL;
 	}
@@ -738,7 +837,7 @@ static unlang_action_t mod_accounting_result(rlm_rcode_t *p_result,
 finish:
 	rest_request_cleanup(inst, handle);
 
-	fr_pool_connection_release(t->pool, request, handle);
+	rest_handle_release(t, handle);
 
 	RETURN_MODULE_RCODE(rcode);
 }
@@ -757,13 +856,13 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 
 	if (!section->name) RETURN_MODULE_NOOP;
 
-	handle = fr_pool_connection_get(t->pool, request);
+	handle = rest_handle_get(t);
 	if (!handle) RETURN_MODULE_FAIL;
 
 	ret = rlm_rest_perform(inst, t, section, handle, request, NULL, NULL);
 	if (ret < 0) {
 		rest_request_cleanup(inst, handle);
-		fr_pool_connection_release(t->pool, request, handle);
+		rest_handle_release(t, handle);
 
 		RETURN_MODULE_FAIL;
 	}
@@ -818,7 +917,7 @@ static unlang_action_t mod_post_auth_result(rlm_rcode_t *p_result, module_ctx_t
 finish:
 	rest_request_cleanup(inst, handle);
 
-	fr_pool_connection_release(t->pool, request, handle);
+	rest_handle_release(t, handle);
 
 	RETURN_MODULE_RCODE(rcode);
 }
@@ -837,14 +936,14 @@ static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, mod
 
 	if (!section->name) RETURN_MODULE_NOOP;
 
-	handle = fr_pool_connection_get(t->pool, request);
+	handle = rest_handle_get(t);
 	if (!handle) RETURN_MODULE_FAIL;
 
 	ret = rlm_rest_perform(inst, t, section, handle, request, NULL, NULL);
 	if (ret < 0) {
 		rest_request_cleanup(inst, handle);
 
-		fr_pool_connection_release(t->pool, request, handle);
+		rest_handle_release(t, handle);
 
 		RETURN_MODULE_FAIL;
 	}
@@ -1021,38 +1120,23 @@ static int mod_xlat_thread_instantiate(UNUSED void *xlat_inst, void *xlat_thread
  *	- 0 on success.
  *	- -1 on failure.
  */
-static int mod_thread_instantiate(CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
 {
 	rlm_rest_t		*inst = instance;
 	rlm_rest_thread_t	*t = thread;
 	fr_curl_handle_t	*mhandle;
-	CONF_SECTION		*my_conf;
 
 	t->inst = instance;
-
-	/*
-	 *	Temporary hack to make config parsing
-	 *	thread safe.
-	 */
-	my_conf = cf_section_dup(NULL, NULL, conf, cf_section_name1(conf), cf_section_name2(conf), true);
-	t->pool = fr_pool_init(NULL, my_conf, instance, rest_mod_conn_create, NULL, inst->xlat_name);
-	talloc_free(my_conf);
-
-	if (!t->pool) {
-		ERROR("Pool instantiation failed");
-		return -1;
-	}
-
-	if (fr_pool_start(t->pool) < 0) {
-		ERROR("Starting initial connections failed");
-		return -1;
-	}
+	fr_dlist_talloc_init(&t->idle, fr_curl_io_request_t, entry);
 
 	mhandle = fr_curl_io_init(t, el, inst->multiplex);
 	if (!mhandle) return -1;
 
 	t->mhandle = mhandle;
 
+	t->sf = fr_singleflight_alloc(t);
+	if (!t->sf) return -1;
+
 	return 0;
 }
 
@@ -1069,8 +1153,8 @@ static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
 {
 	rlm_rest_thread_t	*t = thread;
 
-	talloc_free(t->mhandle);	/* Ensure this is shutdown before the pool */
-	fr_pool_free(t->pool);
+	fr_dlist_talloc_free(&t->idle);		/* Ensure easy handles are freed before the multihandle */
+	talloc_free(t->mhandle);
 
 	return 0;
 }
@@ -69,6 +69,14 @@ DIAG_ON(strict-prototypes)
 #define HAVE_TLS_VERIFY_OPTIONS 0
 #endif
 
+/*
+ *	MariaDB Connector/C provides a non-blocking API, signalled
+ *	by the MYSQL_WAIT_* flags.
+ */
+#ifdef MYSQL_WAIT_READ
+#  define HAVE_MYSQL_NONBLOCK 1
+#endif
+
 #include "rlm_sql.h"
 
 typedef enum {
@@ -88,6 +96,14 @@ typedef struct {
 	MYSQL		db;
 	MYSQL		*sock;
 	MYSQL_RES	*result;
+	MYSQL_STMT	**stmts;		//!< Prepared statements, indexed by sql_stmt_t id.
+	MYSQL_STMT	*stmt;			//!< Prepared statement the last query was run with.
+#ifdef HAVE_MYSQL_NONBLOCK
+	int		async_status;		//!< MYSQL_WAIT_* events the non-blocking API is waiting for.
+	int		async_err;		//!< Return code of the non-blocking query.
+	bool		async_store;		//!< We're retrieving the result set, not running the query.
+	bool		async_fresh;		//!< Query was just sent, nothing to continue yet.
+#endif
 } rlm_sql_mysql_conn_t;
 
 typedef struct {
@@ -160,6 +176,14 @@ static int _sql_socket_destructor(rlm_sql_mysql_conn_t *conn)
 {
 	DEBUG2("Socket destructor called, closing socket");
 
+	if (conn->stmts) {
+		size_t i;
+
+		for (i = 0; i < talloc_array_length(conn->stmts); i++) {
+			if (conn->stmts[i]) mysql_stmt_close(conn->stmts[i]);
+		}
+	}
+
 	if (conn->sock){
 		mysql_close(conn->sock);
 	}
@@ -231,6 +255,14 @@ static sql_rcode_t sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_config_t *c
 
 	mysql_init(&(conn->db));
 
+#ifdef HAVE_MYSQL_NONBLOCK
+	/*
+	 *	Allows queries to be run with the non-blocking API.
+	 *	The normal blocking calls still work as before.
+	 */
+	mysql_options(&(conn->db), MYSQL_OPT_NONBLOCK, 0);
+#endif
+
 	/*
 	 *	If any of the TLS options are set, configure TLS
 	 *
@@ -441,7 +473,226 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 	return RLM_SQL_OK;
 }
 
-static sql_rcode_t sql_store_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+/** Run a prepared statement, preparing it first if this connection hasn't run it before
+ *
+ */
+static sql_rcode_t sql_query_prepared(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+				      sql_stmt_t const *stmt, char const * const *values)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+	MYSQL_STMT		*mysql_stmt;
+	MYSQL_BIND		bind[stmt->num_params + 1];
+	long long		numbers[stmt->num_params + 1];
+	unsigned long		lengths[stmt->num_params + 1];
+	sql_rcode_t		rcode;
+	unsigned int		i;
+
+	if (!conn->sock) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (stmt->id >= talloc_array_length(conn->stmts)) {
+		size_t		len = talloc_array_length(conn->stmts);
+		MYSQL_STMT	**stmts;
+
+		stmts = talloc_realloc(conn, conn->stmts, MYSQL_STMT *, stmt->id + 1);
+		if (!stmts) return RLM_SQL_ERROR;
+		memset(stmts + len, 0, sizeof(stmts[0]) * ((stmt->id + 1) - len));
+		conn->stmts = stmts;
+	}
+
+	mysql_stmt = conn->stmts[stmt->id];
+	if (!mysql_stmt) {
+		mysql_stmt = mysql_stmt_init(conn->sock);
+		if (!mysql_stmt) {
+			ERROR("Failed allocating statement");
+			return RLM_SQL_ERROR;
+		}
+
+		if (mysql_stmt_prepare(mysql_stmt, stmt->query, strlen(stmt->query)) != 0) {
+			ERROR("Failed preparing statement: %s", mysql_stmt_error(mysql_stmt));
+			rcode = sql_check_error(NULL, mysql_stmt_errno(mysql_stmt));
+			mysql_stmt_close(mysql_stmt);
+			return (rcode == RLM_SQL_OK) ? RLM_SQL_ERROR : rcode;
+		}
+
+		conn->stmts[stmt->id] = mysql_stmt;
+	}
+
+	memset(bind, 0, sizeof(bind));
+	for (i = 0; i < stmt->num_params; i++) {
+		if (!values[i]) {
+			bind[i].buffer_type = MYSQL_TYPE_NULL;
+			continue;
+		}
+
+		if (stmt->numeric[i]) {
+			numbers[i] = strtoll(values[i], NULL, 10);
+			bind[i].buffer_type = MYSQL_TYPE_LONGLONG;
+			bind[i].buffer = &numbers[i];
+			continue;
+		}
+
+		lengths[i] = strlen(values[i]);
+		bind[i].buffer_type = MYSQL_TYPE_STRING;
+		bind[i].buffer = UNCONST(char *, values[i]);
+		bind[i].buffer_length = lengths[i];
+		bind[i].length = &lengths[i];
+	}
+
+	/*
+	 *	Errors and the number of affected rows are
+	 *	retrieved from the statement.
+	 */
+	conn->stmt = mysql_stmt;
+
+	if (mysql_stmt_bind_param(mysql_stmt, bind) || mysql_stmt_execute(mysql_stmt)) {
+		rcode = sql_check_error(NULL, mysql_stmt_errno(mysql_stmt));
+		return (rcode == RLM_SQL_OK) ? RLM_SQL_ERROR : rcode;
+	}
+
+	return RLM_SQL_OK;
+}
+
+#ifdef HAVE_MYSQL_NONBLOCK
+/** Wait for the socket to become writable
+ *
+ * The query is written before control returns to the caller, so we only
+ * ever ask the caller to wait for the socket to become readable.
+ */
+static sql_rcode_t sql_async_wait_write(rlm_sql_mysql_conn_t *conn, rlm_sql_config_t *config)
+{
+	int	sockfd = mysql_get_socket(conn->sock);
+	fd_set	write_fd;
+	int	r;
+
+	do {
+		FD_ZERO(&write_fd);
+		FD_SET(sockfd, &write_fd);
+
+		r = select(sockfd + 1, NULL, &write_fd, NULL,
+			   config->query_timeout ?
+			   &fr_time_delta_to_timeval(fr_time_delta_from_sec(config->query_timeout)) : NULL);
+	} while ((r < 0) && (errno == EINTR));
+
+	if (r == 0) {
+		ERROR("Socket write timeout after %d seconds", config->query_timeout);
+		return RLM_SQL_RECONNECT;
+	}
+	if (r < 0) {
+		ERROR("Failed in select: %s", fr_syserror(errno));
+		return RLM_SQL_RECONNECT;
+	}
+
+	return RLM_SQL_OK;
+}
+
+/** Advance a non-blocking query as far as possible without blocking on reads
+ *
+ * Runs the query, then, if it produced a result set, stores the result
+ * the same way sql_select_query() does.
+ */
+static sql_rcode_t sql_async_advance(bool *busy, rlm_sql_mysql_conn_t *conn, rlm_sql_config_t *config)
+{
+	sql_rcode_t	rcode;
+	char const	*info;
+
+	*busy = false;
+
+	for (;;) {
+		if (conn->async_status & MYSQL_WAIT_WRITE) {
+			rcode = sql_async_wait_write(conn, config);
+			if (rcode != RLM_SQL_OK) return rcode;
+
+			conn->async_status = conn->async_store ?
+					     mysql_store_result_cont(&conn->result, conn->sock, MYSQL_WAIT_WRITE) :
+					     mysql_real_query_cont(&conn->async_err, conn->sock, MYSQL_WAIT_WRITE);
+			continue;
+		}
+
+		if (conn->async_status) {
+			*busy = true;
+			return RLM_SQL_OK;
+		}
+
+		if (conn->async_store) break;
+
+		rcode = sql_check_error(conn->sock, 0);
+		if (rcode != RLM_SQL_OK) return rcode;
+
+		/* Only returns non-null string for INSERTS */
+		info = mysql_info(conn->sock);
+		if (info) DEBUG2("%s", info);
+
+		/*
+		 *	No result set, nothing more to do.
+		 */
+		if (mysql_field_count(conn->sock) == 0) return RLM_SQL_OK;
+
+		conn->async_store = true;
+		conn->async_status = mysql_store_result_start(&conn->result, conn->sock);
+	}
+
+	if (!conn->result) return sql_check_error(conn->sock, 0);
+
+	return RLM_SQL_OK;
+}
+
+static sql_rcode_t sql_query_send(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config, char const *query)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+
+	if (!conn->sock) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	conn->async_store = false;
+	conn->async_fresh = true;
+	conn->async_err = 0;
+	conn->async_status = mysql_real_query_start(&conn->async_err, conn->sock, query, strlen(query));
+
+	return RLM_SQL_OK;
+}
+
+/** Continue a query sent with sql_query_send()
+ *
+ * Called once straight after the query is sent, and then each time the
+ * socket becomes readable.
+ */
+static sql_rcode_t sql_query_result(bool *busy, rlm_sql_handle_t *handle, rlm_sql_config_t *config)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+
+	if (conn->async_fresh) {
+		conn->async_fresh = false;
+	} else if (conn->async_status) {
+		conn->async_status = conn->async_store ?
+				     mysql_store_result_cont(&conn->result, conn->sock, MYSQL_WAIT_READ) :
+				     mysql_real_query_cont(&conn->async_err, conn->sock, MYSQL_WAIT_READ);
+	}
+
+	return sql_async_advance(busy, conn, config);
+}
+
+static int sql_fd(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_mysql_conn_t	*conn = handle->conn;
+
+	if (!conn->sock) return -1;
+
+	return mysql_get_socket(conn->sock);
+}
+#endif
+
+/** Get the result of the last query
+ *
+ * With stream_results, rows are read from the server as they're
+ * fetched, so the connection can't be used for anything else until
+ * they have all been fetched, or the result has been freed.
+ */
+static sql_rcode_t sql_store_result(rlm_sql_handle_t *handle, rlm_sql_config_t *config)
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 	sql_rcode_t rcode;
@@ -453,7 +704,7 @@ static sql_rcode_t sql_store_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_con
 	}
 
 retry_store_result:
-	conn->result = mysql_store_result(conn->sock);
+	conn->result = config->stream_results ? mysql_use_result(conn->sock) : mysql_store_result(conn->sock);
 	if (!conn->result) {
 		rcode = sql_check_error(conn->sock, 0);
 		if (rcode != RLM_SQL_OK) return rcode;
@@ -712,6 +963,16 @@ static size_t sql_error(TALLOC_CTX *ctx, sql_log_entry_t out[], size_t outlen,
 	fr_assert(conn && conn->sock);
 	fr_assert(outlen > 0);
 
+	if (conn->stmt) {
+		error = mysql_stmt_error(conn->stmt);
+		if (!error || (error[0] == '\0')) return 0;
+
+		out[0].type = L_ERR;
+		out[0].msg = talloc_typed_asprintf(ctx, "ERROR %u (%s): %s", mysql_stmt_errno(conn->stmt), error,
+						   mysql_stmt_sqlstate(conn->stmt));
+		return 1;
+	}
+
 	error = mysql_error(conn->sock);
 
 	/*
@@ -773,10 +1034,19 @@ static size_t sql_error(TALLOC_CTX *ctx, sql_log_entry_t out[], size_t outlen,
  */
 static sql_rcode_t sql_finish_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config)
 {
-#if (MYSQL_VERSION_ID >= 40100)
 	rlm_sql_mysql_conn_t	*conn = handle->conn;
+#if (MYSQL_VERSION_ID >= 40100)
 	int			ret;
 	MYSQL_RES		*result;
+#endif
+
+	if (conn->stmt) {
+		mysql_stmt_free_result(conn->stmt);
+		conn->stmt = NULL;
+		return RLM_SQL_OK;
+	}
+
+#if (MYSQL_VERSION_ID >= 40100)
 
 	/*
 	 *	If there's no result associated with the
@@ -821,6 +1091,8 @@ static int sql_affected_rows(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 {
 	rlm_sql_mysql_conn_t *conn = handle->conn;
 
+	if (conn->stmt) return mysql_stmt_affected_rows(conn->stmt);
+
 	return mysql_affected_rows(conn->sock);
 }
 
@@ -845,7 +1117,7 @@ extern rlm_sql_driver_t rlm_sql_mysql;
 rlm_sql_driver_t rlm_sql_mysql = {
 	.name				= "rlm_sql_mysql",
 	.magic				= RLM_MODULE_INIT,
-	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY,
+	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY | RLM_SQL_STREAM_RESULTS,
 	.inst_size			= sizeof(rlm_sql_mysql_t),
 	.onload				= mod_load,
 	.unload				= mod_unload,
@@ -864,5 +1136,11 @@ rlm_sql_driver_t rlm_sql_mysql = {
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
 	.sql_finish_select_query	= sql_finish_query,
-	.sql_escape_func		= sql_escape_func
+	.sql_escape_func		= sql_escape_func,
+	.sql_query_prepared		= sql_query_prepared,
+#ifdef HAVE_MYSQL_NONBLOCK
+	.sql_fd				= sql_fd,
+	.sql_query_send			= sql_query_send,
+	.sql_query_result		= sql_query_result
+#endif
 };
@@ -56,6 +56,13 @@ RCSID("$Id$")
 #  define NAMEDATALEN 64
 #endif
 
+/*
+ *	From catalog/pg_type.h, which isn't part of libpq.
+ */
+#ifndef INT8OID
+#  define INT8OID 20
+#endif
+
 /** PostgreSQL configuration
  *
  */
@@ -72,6 +79,10 @@ typedef struct {
 	int		num_fields;
 	int		affected_rows;
 	char		**row;
+	bool		streaming;		//!< Rows of the current result are being read
+						///< one at a time, in single row mode.
+	bool		*prepared;		//!< Which statements have been prepared on this
+						///< connection, indexed by sql_stmt_t id.
 } rlm_sql_postgres_conn_t;
 
 static CONF_PARSER driver_config[] = {
@@ -254,69 +265,30 @@ static int CC_HINT(nonnull) sql_socket_init(rlm_sql_handle_t *handle, rlm_sql_co
 	return 0;
 }
 
-static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
-					      char const *query)
+/** Discard the rest of a result which is being read in single row mode
+ *
+ */
+static void sql_stream_end(rlm_sql_postgres_conn_t *conn)
+{
+	PGresult	*tmp_result;
+
+	while ((tmp_result = PQgetResult(conn->db)) != NULL) PQclear(tmp_result);
+	conn->streaming = false;
+}
+
+/** Collect the result of a query, once libpq says it's no longer busy
+ *
+ * In single row mode, each result holds one row, and the caller
+ * collects the next one when it has processed the row.
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_query_collect(rlm_sql_handle_t *handle, rlm_sql_config_t *config)
 {
 	rlm_sql_postgres_conn_t	*conn = handle->conn;
 	rlm_sql_postgres_t	*inst = config->driver;
-	fr_time_delta_t		timeout = fr_time_delta_from_sec(config->query_timeout);
-	fr_time_t		start;
-	int			sockfd;
 	PGresult		*tmp_result;
 	int			numfields = 0;
 	ExecStatusType		status;
 
-	if (!conn->db) {
-		ERROR("Socket not connected");
-		return RLM_SQL_RECONNECT;
-	}
-
-	sockfd = PQsocket(conn->db);
-	if (sockfd < 0) {
-		ERROR("Unable to obtain socket: %s", PQerrorMessage(conn->db));
-		return RLM_SQL_RECONNECT;
-	}
-
-	if (!PQsendQuery(conn->db, query)) {
-		ERROR("Failed to send query: %s", PQerrorMessage(conn->db));
-		return RLM_SQL_RECONNECT;
-	}
-
-	/*
-	 *  We try to avoid blocking by waiting until the driver indicates that
-	 *  the result is ready or our timeout expires
-	 */
-	start = fr_time();
-	while (PQisBusy(conn->db)) {
-		int		r;
-		fd_set		read_fd;
-		fr_time_delta_t	elapsed = 0;
-
-		FD_ZERO(&read_fd);
-		FD_SET(sockfd, &read_fd);
-
-		if (config->query_timeout) {
-			elapsed = fr_time() - start;
-			if (elapsed >= timeout) goto too_long;
-		}
-
-		r = select(sockfd + 1, &read_fd, NULL, NULL, config->query_timeout ? &fr_time_delta_to_timeval(timeout - elapsed) : NULL);
-		if (r == 0) {
-		too_long:
-			ERROR("Socket read timeout after %d seconds", config->query_timeout);
-			return RLM_SQL_RECONNECT;
-		}
-		if (r < 0) {
-			if (errno == EINTR) continue;
-			ERROR("Failed in select: %s", fr_syserror(errno));
-			return RLM_SQL_RECONNECT;
-		}
-		if (!PQconsumeInput(conn->db)) {
-			ERROR("Failed reading input: %s", PQerrorMessage(conn->db));
-			return RLM_SQL_RECONNECT;
-		}
-	}
-
 	/*
 	 *  Returns a PGresult pointer or possibly a null pointer.
 	 *  A non-null pointer will generally be returned except in
@@ -328,7 +300,7 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_
 	conn->result = PQgetResult(conn->db);
 
 	/* Discard results for appended queries */
-	while ((tmp_result = PQgetResult(conn->db)) != NULL)
+	if (!conn->streaming) while ((tmp_result = PQgetResult(conn->db)) != NULL)
 		PQclear(tmp_result);
 
 	/*
@@ -354,12 +326,19 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_
 		conn->affected_rows = affected_rows(conn->result);
 		DEBUG2("query affected rows = %i", conn->affected_rows);
 		break;
+#ifdef HAVE_PGRES_SINGLE_TUPLE
 	/*
-	 *  Successful completion of a command returning data (such as a SELECT or SHOW).
+	 *  One row of a result being read in single row mode.
 	 */
-#ifdef HAVE_PGRES_SINGLE_TUPLE
 	case PGRES_SINGLE_TUPLE:
+		conn->cur_row = 0;
+		conn->affected_rows = PQntuples(conn->result);
+		break;
 #endif
+
+	/*
+	 *  Successful completion of a command returning data (such as a SELECT or SHOW).
+	 */
 	case PGRES_TUPLES_OK:
 		conn->cur_row = 0;
 		conn->affected_rows = PQntuples(conn->result);
@@ -385,12 +364,247 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_
 		break;
 	}
 
+	/*
+	 *  Anything other than another row is the end of the result.
+	 */
+#ifdef HAVE_PGRES_SINGLE_TUPLE
+	if (conn->streaming && (status != PGRES_SINGLE_TUPLE)) sql_stream_end(conn);
+#endif
+
 	return sql_classify_error(inst, status, conn->result);;
 }
 
+static CC_HINT(nonnull) sql_rcode_t sql_query_send(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+						   char const *query)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	if (!conn->db) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (PQsocket(conn->db) < 0) {
+		ERROR("Unable to obtain socket: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (!PQsendQuery(conn->db, query)) {
+		ERROR("Failed to send query: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	return RLM_SQL_OK;
+}
+
+/** Read whatever is available on the socket, and collect the result if it's complete
+ *
+ * Called when the socket is readable, after sql_query_send().
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_query_result(bool *busy, rlm_sql_handle_t *handle,
+						     rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	*busy = false;
+
+	if (!PQconsumeInput(conn->db)) {
+		ERROR("Failed reading input: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (PQisBusy(conn->db)) {
+		*busy = true;
+		return RLM_SQL_OK;
+	}
+
+	return sql_query_collect(handle, config);
+}
+
+static int sql_fd(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+
+	if (!conn->db) return -1;
+
+	return PQsocket(conn->db);
+}
+
+/** Wait until libpq has a complete result for us, or the query timeout expires
+ *
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_query_wait(rlm_sql_postgres_conn_t *conn, rlm_sql_config_t *config)
+{
+	fr_time_delta_t		timeout = fr_time_delta_from_sec(config->query_timeout);
+	fr_time_t		start;
+	int			sockfd;
+
+	sockfd = PQsocket(conn->db);
+
+	/*
+	 *  We try to avoid blocking by waiting until the driver indicates that
+	 *  the result is ready or our timeout expires
+	 */
+	start = fr_time();
+	while (PQisBusy(conn->db)) {
+		int		r;
+		fd_set		read_fd;
+		fr_time_delta_t	elapsed = 0;
+
+		FD_ZERO(&read_fd);
+		FD_SET(sockfd, &read_fd);
+
+		if (config->query_timeout) {
+			elapsed = fr_time() - start;
+			if (elapsed >= timeout) goto too_long;
+		}
+
+		r = select(sockfd + 1, &read_fd, NULL, NULL, config->query_timeout ? &fr_time_delta_to_timeval(timeout - elapsed) : NULL);
+		if (r == 0) {
+		too_long:
+			ERROR("Socket read timeout after %d seconds", config->query_timeout);
+			return RLM_SQL_RECONNECT;
+		}
+		if (r < 0) {
+			if (errno == EINTR) continue;
+			ERROR("Failed in select: %s", fr_syserror(errno));
+			return RLM_SQL_RECONNECT;
+		}
+		if (!PQconsumeInput(conn->db)) {
+			ERROR("Failed reading input: %s", PQerrorMessage(conn->db));
+			return RLM_SQL_RECONNECT;
+		}
+	}
+
+	return RLM_SQL_OK;
+}
+
+static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					      char const *query)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+	sql_rcode_t		rcode;
+
+	rcode = sql_query_send(handle, config, query);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	rcode = sql_query_wait(conn, config);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	return sql_query_collect(handle, config);
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+/** Send all the queries in a batch, then read all the results
+ *
+ * Each query is followed by its own sync point, so a query which fails
+ * doesn't cause the rest of the batch to be aborted.
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_query_batch(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+						    rlm_sql_batch_query_t *queries, size_t num)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+	rlm_sql_postgres_t	*inst = config->driver;
+	PGresult		*result;
+	ExecStatusType		status;
+	size_t			i, sent;
+
+	if (!conn->db || (PQsocket(conn->db) < 0)) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (!PQenterPipelineMode(conn->db)) {
+		ERROR("Failed entering pipeline mode: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	for (sent = 0; sent < num; sent++) {
+		DEBUG2("Sending batched query: %s", queries[sent].query);
+
+		if (!PQsendQueryParams(conn->db, queries[sent].query, 0, NULL, NULL, NULL, NULL, 0) ||
+		    !PQpipelineSync(conn->db)) {
+			ERROR("Failed to send query: %s", PQerrorMessage(conn->db));
+			break;
+		}
+	}
+
+	for (i = 0; i < sent; i++) {
+		if (sql_query_wait(conn, config) != RLM_SQL_OK) return RLM_SQL_RECONNECT;
+
+		result = PQgetResult(conn->db);
+		if (!result) {
+			ERROR("Failed getting query result: %s", PQerrorMessage(conn->db));
+			return RLM_SQL_RECONNECT;
+		}
+
+		status = PQresultStatus(result);
+		switch (status) {
+		case PGRES_COMMAND_OK:
+			queries[i].affected = affected_rows(result);
+			break;
+
+		case PGRES_TUPLES_OK:
+			queries[i].affected = PQntuples(result);
+			break;
+
+		default:
+			ERROR("%s", PQresultErrorMessage(result));
+			break;
+		}
+		queries[i].rcode = sql_classify_error(inst, status, result);
+		PQclear(result);
+
+		/*
+		 *  The end of the query's results is marked
+		 *  with a NULL, then comes the sync point.
+		 */
+		while ((result = PQgetResult(conn->db)) != NULL) PQclear(result);
+
+		if (sql_query_wait(conn, config) != RLM_SQL_OK) return RLM_SQL_RECONNECT;
+
+		result = PQgetResult(conn->db);
+		status = result ? PQresultStatus(result) : PGRES_FATAL_ERROR;
+		PQclear(result);
+		if (status != PGRES_PIPELINE_SYNC) {
+			ERROR("Lost synchronisation with server: %s", PQerrorMessage(conn->db));
+			return RLM_SQL_RECONNECT;
+		}
+	}
+
+	if ((sent < num) || !PQexitPipelineMode(conn->db)) return RLM_SQL_RECONNECT;
+
+	return RLM_SQL_OK;
+}
+#endif
+
 static sql_rcode_t sql_select_query(rlm_sql_handle_t * handle, rlm_sql_config_t *config, char const *query)
 {
+#ifdef HAVE_PGRES_SINGLE_TUPLE
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+	sql_rcode_t		rcode;
+
+	if (!config->stream_results) return sql_query(handle, config, query);
+
+	rcode = sql_query_send(handle, config, query);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	/*
+	 *  Must be called straight after the query is sent.
+	 *  If it fails, we just get the whole result at once.
+	 */
+	conn->streaming = (PQsetSingleRowMode(conn->db) == 1);
+
+	rcode = sql_query_wait(conn, config);
+	if (rcode != RLM_SQL_OK) {
+		conn->streaming = false;
+		return rcode;
+	}
+
+	return sql_query_collect(handle, config);
+#else
 	return sql_query(handle, config, query);
+#endif
 }
 
 static sql_rcode_t sql_fields(char const **out[], rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
@@ -411,7 +625,7 @@ static sql_rcode_t sql_fields(char const **out[], rlm_sql_handle_t *handle, UNUS
 	return RLM_SQL_OK;
 }
 
-static sql_rcode_t sql_fetch_row(rlm_sql_row_t *out, rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
+static sql_rcode_t sql_fetch_row(rlm_sql_row_t *out, rlm_sql_handle_t *handle, rlm_sql_config_t *config)
 {
 
 	int records, i, len;
@@ -420,7 +634,28 @@ static sql_rcode_t sql_fetch_row(rlm_sql_row_t *out, rlm_sql_handle_t *handle, U
 	*out = NULL;
 	handle->row = NULL;
 
-	if (conn->cur_row >= PQntuples(conn->result)) return RLM_SQL_NO_MORE_ROWS;
+	if (conn->cur_row >= PQntuples(conn->result)) {
+		sql_rcode_t rcode;
+
+		if (!conn->streaming) return RLM_SQL_NO_MORE_ROWS;
+
+		/*
+		 *  Read the next row from the server.
+		 */
+		PQclear(conn->result);
+		conn->result = NULL;
+
+		rcode = sql_query_wait(conn, config);
+		if (rcode != RLM_SQL_OK) {
+			conn->streaming = false;
+			return rcode;
+		}
+
+		rcode = sql_query_collect(handle, config);
+		if (rcode != RLM_SQL_OK) return rcode;
+
+		if (conn->cur_row >= PQntuples(conn->result)) return RLM_SQL_NO_MORE_ROWS;
+	}
 
 	free_result_row(conn);
 
@@ -462,11 +697,78 @@ static sql_rcode_t sql_free_result(rlm_sql_handle_t * handle, UNUSED rlm_sql_con
 		conn->result = NULL;
 	}
 
+	if (conn->streaming) sql_stream_end(conn);
+
 	free_result_row(conn);
 
 	return 0;
 }
 
+/** Run a prepared statement, preparing it first if this connection hasn't run it before
+ *
+ */
+static CC_HINT(nonnull) sql_rcode_t sql_query_prepared(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+						       sql_stmt_t const *stmt, char const * const *values)
+{
+	rlm_sql_postgres_conn_t	*conn = handle->conn;
+	char			name[NAMEDATALEN];
+	sql_rcode_t		rcode;
+
+	if (!conn->db || (PQsocket(conn->db) < 0)) {
+		ERROR("Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	snprintf(name, sizeof(name), "freeradius_%u", stmt->id);
+
+	if (stmt->id >= talloc_array_length(conn->prepared)) {
+		size_t	len = talloc_array_length(conn->prepared);
+		bool	*prepared;
+
+		prepared = talloc_realloc(conn, conn->prepared, bool, stmt->id + 1);
+		if (!prepared) return RLM_SQL_ERROR;
+		memset(prepared + len, 0, sizeof(prepared[0]) * ((stmt->id + 1) - len));
+		conn->prepared = prepared;
+	}
+
+	if (!conn->prepared[stmt->id]) {
+		Oid		types[stmt->num_params + 1];
+		unsigned int	i;
+
+		/*
+		 *	Let the server infer the type of quoted values,
+		 *	unquoted values are always integers.
+		 */
+		for (i = 0; i < stmt->num_params; i++) types[i] = stmt->numeric[i] ? INT8OID : 0;
+
+		DEBUG2("Preparing statement %s", name);
+
+		if (!PQsendPrepare(conn->db, name, stmt->query, stmt->num_params, types)) {
+			ERROR("Failed to send prepare: %s", PQerrorMessage(conn->db));
+			return RLM_SQL_RECONNECT;
+		}
+
+		rcode = sql_query_wait(conn, config);
+		if (rcode != RLM_SQL_OK) return rcode;
+
+		rcode = sql_query_collect(handle, config);
+		if (rcode != RLM_SQL_OK) return rcode;
+
+		sql_free_result(handle, config);
+		conn->prepared[stmt->id] = true;
+	}
+
+	if (!PQsendQueryPrepared(conn->db, name, stmt->num_params, values, NULL, NULL, 0)) {
+		ERROR("Failed to send query: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_RECONNECT;
+	}
+
+	rcode = sql_query_wait(conn, config);
+	if (rcode != RLM_SQL_OK) return rcode;
+
+	return sql_query_collect(handle, config);
+}
+
 /** Retrieves any errors associated with the connection handle
  *
  * @note Caller will free any memory allocated in ctx.
@@ -657,7 +959,11 @@ extern rlm_sql_driver_t rlm_sql_postgresql;
 rlm_sql_driver_t rlm_sql_postgresql = {
 	.name				= "rlm_sql_postgresql",
 	.magic				= RLM_MODULE_INIT,
-	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY,
+#ifdef HAVE_PGRES_SINGLE_TUPLE
+	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY | RLM_SQL_PLACEHOLDER_NUMBERED | RLM_SQL_STREAM_RESULTS,
+#else
+	.flags				= RLM_SQL_RCODE_FLAGS_ALT_QUERY | RLM_SQL_PLACEHOLDER_NUMBERED,
+#endif
 	.inst_size			= sizeof(rlm_sql_postgres_t),
 	.onload				= mod_load,
 	.config				= driver_config,
@@ -672,5 +978,12 @@ rlm_sql_driver_t rlm_sql_postgresql = {
 	.sql_finish_query		= sql_free_result,
 	.sql_finish_select_query	= sql_free_result,
 	.sql_affected_rows		= sql_affected_rows,
-	.sql_escape_func		= sql_escape_func
+	.sql_escape_func		= sql_escape_func,
+	.sql_fd				= sql_fd,
+	.sql_query_send			= sql_query_send,
+	.sql_query_result		= sql_query_result,
+	.sql_query_prepared		= sql_query_prepared,
+#ifdef LIBPQ_HAS_PIPELINING
+	.sql_query_batch		= sql_query_batch
+#endif
 };
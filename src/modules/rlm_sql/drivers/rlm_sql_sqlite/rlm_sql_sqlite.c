@@ -53,6 +53,8 @@ typedef struct {
 	sqlite3 *db;
 	sqlite3_stmt *statement;
 	int col_count;
+	sqlite3_stmt **stmts;		//!< Prepared statements, indexed by sql_stmt_t id.
+	bool cached;			//!< statement is one of stmts, and must be reset, not finalized.
 } rlm_sql_sqlite_conn_t;
 
 typedef struct {
@@ -386,6 +388,14 @@ static int _sql_socket_destructor(rlm_sql_sqlite_conn_t *conn)
 
 	DEBUG2("Socket destructor called, closing socket");
 
+	if (conn->stmts) {
+		size_t i;
+
+		for (i = 0; i < talloc_array_length(conn->stmts); i++) {
+			if (conn->stmts[i]) (void) sqlite3_finalize(conn->stmts[i]);
+		}
+	}
+
 	if (conn->db) {
 		status = sqlite3_close(conn->db);
 		if (status != SQLITE_OK) WARN("Got SQLite error when closing socket: %s",
@@ -507,6 +517,62 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 	return sql_check_error(conn->db, status);
 }
 
+/** Run a prepared statement, preparing it first if this connection hasn't run it before
+ *
+ */
+static sql_rcode_t sql_query_prepared(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+				      sql_stmt_t const *stmt, char const * const *values)
+{
+	rlm_sql_sqlite_conn_t	*conn = handle->conn;
+	sqlite3_stmt		*statement;
+	sql_rcode_t		rcode;
+	unsigned int		i;
+	int			status;
+
+	if (stmt->id >= talloc_array_length(conn->stmts)) {
+		size_t		len = talloc_array_length(conn->stmts);
+		sqlite3_stmt	**stmts;
+
+		stmts = talloc_realloc(conn, conn->stmts, sqlite3_stmt *, stmt->id + 1);
+		if (!stmts) return RLM_SQL_ERROR;
+		memset(stmts + len, 0, sizeof(stmts[0]) * ((stmt->id + 1) - len));
+		conn->stmts = stmts;
+	}
+
+	statement = conn->stmts[stmt->id];
+	if (!statement) {
+#ifdef HAVE_SQLITE3_PREPARE_V2
+		status = sqlite3_prepare_v2(conn->db, stmt->query, strlen(stmt->query), &statement, NULL);
+#else
+		status = sqlite3_prepare(conn->db, stmt->query, strlen(stmt->query), &statement, NULL);
+#endif
+		rcode = sql_check_error(conn->db, status);
+		if (rcode != RLM_SQL_OK) return rcode;
+
+		conn->stmts[stmt->id] = statement;
+	}
+
+	for (i = 0; i < stmt->num_params; i++) {
+		if (!values[i]) {
+			status = sqlite3_bind_null(statement, i + 1);
+		} else if (stmt->numeric[i]) {
+			status = sqlite3_bind_int64(statement, i + 1, strtoll(values[i], NULL, 10));
+		} else {
+			status = sqlite3_bind_text(statement, i + 1, values[i], -1, SQLITE_TRANSIENT);
+		}
+
+		rcode = sql_check_error(conn->db, status);
+		if (rcode != RLM_SQL_OK) return rcode;
+	}
+
+	conn->statement = statement;
+	conn->cached = true;
+	conn->col_count = 0;
+
+	status = sqlite3_step(conn->statement);
+	return sql_check_error(conn->db, status);
+}
+
 static int sql_num_fields(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	rlm_sql_sqlite_conn_t *conn = handle->conn;
@@ -627,7 +693,13 @@ static sql_rcode_t sql_free_result(rlm_sql_handle_t *handle, UNUSED rlm_sql_conf
 	if (conn->statement) {
 		TALLOC_FREE(handle->row);
 
-		(void) sqlite3_finalize(conn->statement);
+		if (conn->cached) {
+			(void) sqlite3_reset(conn->statement);
+			(void) sqlite3_clear_bindings(conn->statement);
+			conn->cached = false;
+		} else {
+			(void) sqlite3_finalize(conn->statement);
+		}
 		conn->statement = NULL;
 		conn->col_count = 0;
 	}
@@ -831,5 +903,6 @@ rlm_sql_driver_t rlm_sql_sqlite = {
 	.sql_free_result		= sql_free_result,
 	.sql_error			= sql_error,
 	.sql_finish_query		= sql_finish_query,
-	.sql_finish_select_query	= sql_finish_query
+	.sql_finish_select_query	= sql_finish_query,
+	.sql_query_prepared		= sql_query_prepared
 };
@@ -36,6 +36,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/map_proc.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/pairmove.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/table.h>
 
@@ -69,6 +70,8 @@ static const CONF_PARSER type_config[] = {
 static const CONF_PARSER acct_config[] = {
 	{ FR_CONF_OFFSET("reference", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sql_config_t, accounting.reference), .dflt = ".query" },
 	{ FR_CONF_OFFSET("logfile", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sql_config_t, accounting.logfile) },
+	{ FR_CONF_OFFSET("batch_size", FR_TYPE_UINT32, rlm_sql_config_t, accounting.batch_size), .dflt = "0" },
+	{ FR_CONF_OFFSET("batch_window", FR_TYPE_TIME_DELTA, rlm_sql_config_t, accounting.batch_window), .dflt = "0.01" },
 
 	{ FR_CONF_POINTER("type", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) type_config },
 	CONF_PARSER_TERMINATOR
@@ -96,6 +99,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("logfile", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sql_config_t, logfile) },
 	{ FR_CONF_OFFSET("default_user_profile", FR_TYPE_STRING, rlm_sql_config_t, default_profile), .dflt = "" },
 	{ FR_CONF_OFFSET("open_query", FR_TYPE_STRING, rlm_sql_config_t, connect_query) },
+	{ FR_CONF_OFFSET("prepared_statements", FR_TYPE_BOOL, rlm_sql_config_t, prepared_statements), .dflt = "no" },
+	{ FR_CONF_OFFSET("stream_results", FR_TYPE_BOOL, rlm_sql_config_t, stream_results), .dflt = "no" },
 
 	{ FR_CONF_OFFSET("authorize_check_query", FR_TYPE_STRING | FR_TYPE_XLAT | FR_TYPE_NOT_EMPTY, rlm_sql_config_t, authorize_check_query) },
 	{ FR_CONF_OFFSET("authorize_reply_query", FR_TYPE_STRING | FR_TYPE_XLAT | FR_TYPE_NOT_EMPTY, rlm_sql_config_t, authorize_reply_query) },
@@ -158,35 +163,281 @@ static sql_fall_through_t fall_through(fr_pair_list_t *vps)
  */
 static size_t sql_escape_func(request_t *, char *out, size_t outlen, char const *in, void *arg);
 
+/** Holds the state of an SQL xlat query while we wait for the result
+ *
+ */
+typedef struct {
+	rlm_sql_t const		*inst;			//!< Module instance the query is for.
+	request_t		*request;		//!< The current request.
+	rlm_sql_handle_t	*handle;		//!< Connection the query was sent on.
+	char const		*query;			//!< The query, in case it needs to be retried.
+	bool			select;			//!< Whether we want rows, or the number of rows affected.
+	bool			outstanding;		//!< The query has been sent, but the result
+							///< has not yet been read.
+	fr_time_t		deadline;		//!< When we give up waiting for the result.
+	bool			timedout;		//!< The deadline passed before we got a result.
+} sql_xlat_rctx_t;
+
+/** Per-thread queue of accounting queries waiting to be run as a batch
+ *
+ */
+typedef struct {
+	rlm_sql_t const		*inst;			//!< Module instance.
+	fr_event_list_t		*el;			//!< This thread's event list.
+	fr_dlist_head_t		queue;			//!< Queries waiting to be run.
+	fr_event_timer_t const	*ev;			//!< When the current batch will be run,
+							///< if it doesn't fill up first.
+} rlm_sql_thread_t;
+
+/** A query waiting to be run as part of a batch
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the thread's queue.
+	rlm_sql_thread_t	*thread;		//!< Thread the query was queued on.
+	request_t		*request;		//!< Request the query is for.
+	sql_acct_section_t	*section;		//!< Section the query came from.
+	CONF_PAIR		*pair;			//!< Query template, so we can continue with
+							///< the next query in the redundant set.
+	char const		*query;			//!< The expanded query.
+	sql_rcode_t		rcode;			//!< Result of running the query.
+	int			affected;		//!< Number of rows the query affected.
+} sql_batch_entry_t;
+
+/** Release the connection, closing it if a query is still outstanding
+ *
+ */
+static int _sql_xlat_rctx_free(sql_xlat_rctx_t *rctx)
+{
+	if (!rctx->handle) return 0;
+
+	if (rctx->outstanding) {
+		fr_pool_connection_close(rctx->inst->pool, rctx->request, rctx->handle);
+		return 0;
+	}
+
+	fr_pool_connection_release(rctx->inst->pool, rctx->request, rctx->handle);
+
+	return 0;
+}
+
+/** Turn the result of an SQL xlat query into a value box
+ *
+ * For SELECTs, the first value of the first column is returned.
+ * For INSERTS, UPDATEs and DELETEs, the number of rows affected is
+ * returned instead.
+ */
+static xlat_action_t sql_xlat_query_result(TALLOC_CTX *ctx, fr_dcursor_t *out, request_t *request,
+					   rlm_sql_t const *inst, rlm_sql_handle_t **handle,
+					   bool select, sql_rcode_t rcode)
+{
+	rlm_sql_row_t		row;
+	fr_value_box_t		*vb;
+	xlat_action_t		ret = XLAT_ACTION_DONE;
+
+	if (rcode != RLM_SQL_OK) {
+	query_error:
+		RERROR("SQL query failed: %s", fr_table_str_by_value(sql_rcode_description_table, rcode, "<INVALID>"));
+
+		return XLAT_ACTION_FAIL;
+	}
+
+	if (!select) {
+		int numaffected;
+
+		numaffected = (inst->driver->sql_affected_rows)(*handle, inst->config);
+		if (numaffected < 1) {
+			RDEBUG2("SQL query affected no rows");
+			(inst->driver->sql_finish_query)(*handle, inst->config);
+
+			return XLAT_ACTION_DONE;
+		}
+
+		MEM(vb = fr_value_box_alloc_null(ctx));
+		fr_value_box_uint32(vb, NULL, (uint32_t)numaffected, false);
+		fr_dcursor_append(out, vb);
+
+		(inst->driver->sql_finish_query)(*handle, inst->config);
+
+		return XLAT_ACTION_DONE;
+	}
+
+	rcode = rlm_sql_fetch_row(&row, inst, request, handle);
+	switch (rcode) {
+	case RLM_SQL_OK:
+		if (row[0]) break;
+
+		RDEBUG2("NULL value in first column of result");
+		ret = XLAT_ACTION_FAIL;
+		goto finish;
+
+	case RLM_SQL_NO_MORE_ROWS:
+		RDEBUG2("SQL query returned no results");
+		ret = XLAT_ACTION_FAIL;
+		goto finish;
+
+	default:
+		(inst->driver->sql_finish_select_query)(*handle, inst->config);
+		goto query_error;
+	}
+
+	MEM(vb = fr_value_box_alloc_null(ctx));
+	fr_value_box_strdup(vb, vb, NULL, row[0], true);
+	fr_dcursor_append(out, vb);
+
+finish:
+	(inst->driver->sql_finish_select_query)(*handle, inst->config);
+
+	return ret;
+}
+
+static xlat_action_t sql_xlat_resume(TALLOC_CTX *ctx, fr_dcursor_t *out,
+				     request_t *request, UNUSED void const *xlat_inst, UNUSED void *xlat_thread_inst,
+				     UNUSED fr_value_box_list_t *in, void *rctx);
+
+static void sql_xlat_fd_read(request_t *request, UNUSED void *xlat_inst,
+			     UNUSED void *xlat_thread_inst, UNUSED void *rctx, UNUSED int fd)
+{
+	unlang_interpret_mark_runnable(request);
+}
+
+static void sql_xlat_timeout(request_t *request, UNUSED void *xlat_inst,
+			     UNUSED void *xlat_thread_inst, void *rctx, UNUSED fr_time_t fired)
+{
+	sql_xlat_rctx_t *our_rctx = talloc_get_type_abort(rctx, sql_xlat_rctx_t);
+
+	our_rctx->timedout = true;
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Cancel an outstanding SQL xlat query
+ *
+ * The connection is closed, as we can't know what state the query has
+ * left it in.
+ */
+static void sql_xlat_signal(UNUSED request_t *request, UNUSED void *xlat_inst, UNUSED void *xlat_thread_inst,
+			    void *rctx, fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	talloc_free(talloc_get_type_abort(rctx, sql_xlat_rctx_t));
+}
+
+/** Wait for the connection to become readable, or for the deadline to pass
+ *
+ */
+static xlat_action_t sql_xlat_wait(request_t *request, sql_xlat_rctx_t *rctx)
+{
+	rlm_sql_t const	*inst = rctx->inst;
+	int		fd;
+
+	fd = (inst->driver->sql_fd)(rctx->handle, inst->config);
+	if (fd < 0) {
+		REDEBUG("Failed retrieving SQL connection file descriptor");
+		return XLAT_ACTION_FAIL;
+	}
+
+	if (unlang_xlat_event_fd_add(request, sql_xlat_fd_read, NULL, sql_xlat_fd_read, rctx, fd) < 0) {
+		return XLAT_ACTION_FAIL;
+	}
+
+	if (rctx->deadline && (unlang_xlat_event_timeout_add(request, sql_xlat_timeout, rctx, rctx->deadline) < 0)) {
+		return XLAT_ACTION_FAIL;
+	}
+
+	return unlang_xlat_yield(request, sql_xlat_resume, sql_xlat_signal, rctx);
+}
+
+/** Read the result of an SQL xlat query, once the connection is readable
+ *
+ * @ingroup xlat_functions
+ */
+static xlat_action_t sql_xlat_resume(TALLOC_CTX *ctx, fr_dcursor_t *out,
+				     request_t *request, UNUSED void const *xlat_inst, UNUSED void *xlat_thread_inst,
+				     UNUSED fr_value_box_list_t *in, void *rctx)
+{
+	sql_xlat_rctx_t		*our_rctx = talloc_get_type_abort(rctx, sql_xlat_rctx_t);
+	rlm_sql_t const		*inst = our_rctx->inst;
+	sql_rcode_t		rcode;
+	xlat_action_t		xa;
+	bool			busy;
+
+	if (our_rctx->timedout) {
+		RERROR("Timeout waiting for SQL query result");
+		talloc_free(our_rctx);
+		return XLAT_ACTION_FAIL;
+	}
+
+	rcode = rlm_sql_query_result(&busy, inst, request, &our_rctx->handle, our_rctx->query, our_rctx->select);
+	if (busy) {
+		xa = sql_xlat_wait(request, our_rctx);
+		if (xa != XLAT_ACTION_YIELD) talloc_free(our_rctx);
+		return xa;
+	}
+	our_rctx->outstanding = false;
+
+	xa = sql_xlat_query_result(ctx, out, request, inst, &our_rctx->handle, our_rctx->select, rcode);
+	talloc_free(our_rctx);
+
+	return xa;
+}
+
+/** Escape a tainted value for use in an SQL query
+ *
+ */
+static int sql_xlat_escape(request_t *request, fr_value_box_t *vb, void *uctx)
+{
+	size_t	outmax = (vb->vb_length * 3) + 1;
+	size_t	outlen;
+	char	escaped[outmax];
+	char	*outbuff;
+
+	fr_assert(vb->type == FR_TYPE_STRING);
+
+	outlen = sql_escape_for_xlat_func(request, escaped, outmax, vb->vb_strvalue, uctx);
+	if ((outlen == vb->vb_length) && (memcmp(escaped, vb->vb_strvalue, outlen) == 0)) return 0;
+
+	if (fr_value_box_bstr_realloc(vb, &outbuff, vb, outlen) < 0) return -1;
+	memcpy(outbuff, escaped, outlen);
+
+	return 0;
+}
+
 /** Execute an arbitrary SQL query
  *
  * For SELECTs, the first value of the first column will be returned.
  * For INSERTS, UPDATEs and DELETEs, the number of rows affected will
  * be returned instead.
  *
+ * If the driver can send queries without blocking, the request yields
+ * until the result arrives, so other requests can run on this worker.
+ *
 @verbatim
 %{sql:<sql statement>}
 @endverbatim
  *
  * @ingroup xlat_functions
  */
-static ssize_t sql_xlat(UNUSED TALLOC_CTX *ctx, char **out, UNUSED size_t outlen,
-			void const *mod_inst, UNUSED void const *xlat_inst,
-			request_t *request, char const *fmt)
+static xlat_action_t sql_xlat(TALLOC_CTX *ctx, fr_dcursor_t *out,
+			      request_t *request, void const *xlat_inst, void *xlat_thread_inst,
+			      fr_value_box_list_t *in)
 {
+	rlm_sql_t const		*inst = talloc_get_type_abort_const(*((void const * const *)xlat_inst), rlm_sql_t);
+	fr_value_box_t		*arg = fr_dlist_head(in);
+	char const		*query = arg->vb_strvalue;
 	rlm_sql_handle_t	*handle = NULL;
-	rlm_sql_row_t		row;
-	rlm_sql_t const		*inst = mod_inst;
+	sql_xlat_rctx_t		*rctx;
 	sql_rcode_t		rcode;
-	ssize_t			ret = 0;
+	xlat_action_t		xa;
+	bool			select;
 	char const		*p;
 
 	handle = fr_pool_connection_get(inst->pool, request);	/* connection pool should produce error */
-	if (!handle) return 0;
+	if (!handle) return XLAT_ACTION_DONE;
 
-	rlm_sql_query_log(inst, request, NULL, fmt);
+	rlm_sql_query_log(inst, request, NULL, query);
 
-	p = fmt;
+	p = query;
 
 	/*
 	 *	Trim whitespace for the prefix check
@@ -197,71 +448,71 @@ static ssize_t sql_xlat(UNUSED TALLOC_CTX *ctx, char **out, UNUSED size_t outlen
 	 *	If the query starts with any of the following prefixes,
 	 *	then return the number of rows affected
 	 */
-	if ((strncasecmp(p, "insert", 6) == 0) ||
-	    (strncasecmp(p, "update", 6) == 0) ||
-	    (strncasecmp(p, "delete", 6) == 0)) {
-		int numaffected;
-
-		rcode = rlm_sql_query(inst, request, &handle, fmt);
-		if (rcode != RLM_SQL_OK) {
-		query_error:
-			RERROR("SQL query failed: %s", fr_table_str_by_value(sql_rcode_description_table, rcode, "<INVALID>"));
-
-			ret = -1;
-			goto finish;
-		}
-
-		numaffected = (inst->driver->sql_affected_rows)(handle, inst->config);
-		if (numaffected < 1) {
-			RDEBUG2("SQL query affected no rows");
-			(inst->driver->sql_finish_query)(handle, inst->config);
+	select = !((strncasecmp(p, "insert", 6) == 0) ||
+		   (strncasecmp(p, "update", 6) == 0) ||
+		   (strncasecmp(p, "delete", 6) == 0));
 
-			goto finish;
-		}
+	if (!inst->driver->sql_query_send) {
+		rcode = select ? rlm_sql_select_query(inst, request, &handle, query) :
+				 rlm_sql_query(inst, request, &handle, query);
 
-		MEM(*out = talloc_typed_asprintf(request, "%d", numaffected));
-		ret = talloc_array_length(*out) - 1;
+		xa = sql_xlat_query_result(ctx, out, request, inst, &handle, select, rcode);
+		if (handle) fr_pool_connection_release(inst->pool, request, handle);
 
-		(inst->driver->sql_finish_query)(handle, inst->config);
-
-		goto finish;
-	} /* else it's a SELECT statement */
+		return xa;
+	}
 
-	rcode = rlm_sql_select_query(inst, request, &handle, fmt);
-	if (rcode != RLM_SQL_OK) goto query_error;
+	MEM(rctx = talloc_zero(request, sql_xlat_rctx_t));
+	rctx->inst = inst;
+	rctx->request = request;
+	rctx->handle = handle;
+	rctx->select = select;
+	MEM(rctx->query = talloc_strdup(rctx, query));
+	talloc_set_destructor(rctx, _sql_xlat_rctx_free);
 
-	rcode = rlm_sql_fetch_row(&row, inst, request, &handle);
+	rcode = rlm_sql_query_send(inst, request, handle, rctx->query);
 	switch (rcode) {
 	case RLM_SQL_OK:
-		if (row[0]) break;
-
-		RDEBUG2("NULL value in first column of result");
-		(inst->driver->sql_finish_select_query)(handle, inst->config);
-		ret = -1;
-
-		goto finish;
-
-	case RLM_SQL_NO_MORE_ROWS:
-		RDEBUG2("SQL query returned no results");
-		(inst->driver->sql_finish_select_query)(handle, inst->config);
-		ret = -1;
+		break;
 
-		goto finish;
+	/*
+	 *	Let the synchronous code deal with reconnecting.
+	 */
+	case RLM_SQL_RECONNECT:
+		rcode = select ? rlm_sql_select_query(inst, request, &rctx->handle, rctx->query) :
+				 rlm_sql_query(inst, request, &rctx->handle, rctx->query);
+		xa = sql_xlat_query_result(ctx, out, request, inst, &rctx->handle, select, rcode);
+		talloc_free(rctx);
+		return xa;
 
 	default:
-		(inst->driver->sql_finish_select_query)(handle, inst->config);
-		goto query_error;
+		xa = sql_xlat_query_result(ctx, out, request, inst, &rctx->handle, select, rcode);
+		talloc_free(rctx);
+		return xa;
 	}
+	rctx->outstanding = true;
 
-	*out = talloc_bstrndup(request, row[0], strlen(row[0]));
-	ret = talloc_array_length(*out) - 1;
+	/*
+	 *	Give up on the query if the client gives up
+	 *	on the request first.
+	 */
+	if (inst->config->query_timeout || request->deadline) {
+		rctx->deadline = fr_time() +
+				 request_deadline_limit(request, fr_time_delta_from_sec(inst->config->query_timeout));
+	}
 
-	(inst->driver->sql_finish_select_query)(handle, inst->config);
+	/*
+	 *	The driver may already have the result, so check
+	 *	before waiting on the socket.
+	 */
+	return sql_xlat_resume(ctx, out, request, xlat_inst, xlat_thread_inst, in, rctx);
+}
 
-finish:
-	fr_pool_connection_release(inst->pool, request, handle);
+static int sql_xlat_instantiate(void *xlat_inst, UNUSED xlat_exp_t const *exp, void *uctx)
+{
+	*((rlm_sql_t **)xlat_inst) = talloc_get_type_abort(uctx, rlm_sql_t);
 
-	return ret;
+	return 0;
 }
 
 /** Converts a string value into a #fr_pair_t
@@ -395,9 +646,11 @@ static rlm_rcode_t mod_map_proc(void *mod_inst, UNUSED void *proc_inst, request_
 	}
 
 	/*
-	 *	Not every driver provides an sql_num_rows function
+	 *	Not every driver provides an sql_num_rows function,
+	 *	and streamed results don't have a row count until
+	 *	all the rows have been fetched.
 	 */
-	if (inst->driver->sql_num_rows) {
+	if (inst->driver->sql_num_rows && !inst->config->stream_results) {
 		ret = inst->driver->sql_num_rows(handle, inst->config);
 		if (ret == 0) {
 			RDEBUG2("Server returned an empty result");
@@ -987,6 +1240,7 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	rlm_sql_t	*inst = talloc_get_type_abort(instance, rlm_sql_t);
 	CONF_SECTION	*driver_cs;
 	char const	*name;
+	xlat_t		*xlat;
 
 	/*
 	 *	Hack...
@@ -1080,7 +1334,12 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	/*
 	 *	Register the SQL xlat function
 	 */
-	xlat_register_legacy(inst, inst->name, sql_xlat, sql_escape_for_xlat_func, NULL, 0, 0);
+	inst->xlat_arg = (xlat_arg_parser_t){
+		.required = true, .concat = true, .type = FR_TYPE_STRING, .func = sql_xlat_escape, .uctx = inst
+	};
+	xlat = xlat_register(inst, inst->name, sql_xlat, true);
+	xlat_func_mono(xlat, &inst->xlat_arg);
+	xlat_async_instantiate_set(xlat, sql_xlat_instantiate, rlm_sql_t *, NULL, inst);
 
 	/*
 	 *	Register the SQL map processor function
@@ -1091,6 +1350,37 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 }
 
 
+/** Compile the queries in a section, and its subsections, into prepared statements
+ *
+ * The statements are stored on the CONF_PAIR of the query they were compiled from.
+ */
+static void sql_stmt_compile_section(rlm_sql_t *inst, CONF_SECTION *cs)
+{
+	CONF_ITEM	*ci = NULL;
+	CONF_PAIR	*cp;
+	sql_stmt_t	*stmt;
+
+	while ((ci = cf_item_next(cs, ci))) {
+		if (cf_item_is_section(ci)) {
+			sql_stmt_compile_section(inst, cf_item_to_section(ci));
+			continue;
+		}
+
+		if (!cf_item_is_pair(ci)) continue;
+
+		cp = cf_item_to_pair(ci);
+		if (!cf_pair_value(cp)) continue;
+
+		stmt = sql_stmt_compile(inst, inst, cf_pair_value(cp));
+		if (!stmt) {
+			cf_log_debug(cp, "Query can't be run as a prepared statement");
+			continue;
+		}
+
+		cf_data_add(cp, stmt, inst->name, false);
+	}
+}
+
 static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
 	rlm_sql_t *inst = instance;
@@ -1138,6 +1428,24 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	inst->config->postauth.cs = cf_section_find(conf, "post-auth", NULL);
 	inst->config->postauth.reference_cp = (cf_pair_find(inst->config->postauth.cs, "reference") != NULL);
 
+	if (inst->config->stream_results && !(inst->driver->flags & RLM_SQL_STREAM_RESULTS)) {
+		WARN("Ignoring stream_results as driver %s does not support it", inst->driver->name);
+		inst->config->stream_results = false;
+	}
+
+	if (inst->config->prepared_statements) {
+		if (!inst->driver->sql_query_prepared) {
+			WARN("Ignoring prepared_statements as driver %s does not support them", inst->driver->name);
+		} else {
+			if (inst->config->accounting.reference_cp) {
+				sql_stmt_compile_section(inst, inst->config->accounting.cs);
+			}
+			if (inst->config->postauth.reference_cp) {
+				sql_stmt_compile_section(inst, inst->config->postauth.cs);
+			}
+		}
+	}
+
 	/*
 	 *	Cache the SQL-User-Name fr_dict_attr_t, so we can be slightly
 	 *	more efficient about creating SQL-User-Name attributes.
@@ -1177,6 +1485,34 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  fr_event_list_t *el, void *thread)
+{
+	rlm_sql_thread_t	*t = talloc_get_type_abort(thread, rlm_sql_thread_t);
+
+	t->inst = talloc_get_type_abort(instance, rlm_sql_t);
+	t->el = el;
+	fr_dlist_talloc_init(&t->queue, sql_batch_entry_t, entry);
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_sql_thread_t	*t = talloc_get_type_abort(thread, rlm_sql_thread_t);
+
+	/*
+	 *	Any queued requests are being freed too, make
+	 *	sure they don't try to remove themselves from
+	 *	the queue.
+	 */
+	while (fr_dlist_pop_head(&t->queue));
+
+	if (t->ev) fr_event_timer_delete(&t->ev);
+
+	return 0;
+}
+
 static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_rcode_t		rcode = RLM_MODULE_NOOP;
@@ -1422,168 +1758,509 @@ release:
 	RETURN_MODULE_RCODE(rcode);
 }
 
-/*
- *	Generic function for failing between a bunch of queries.
- *
- *	Uses the same principle as rlm_linelog, expanding the 'reference' config
- *	item using xlat to figure out what query it should execute.
- *
- *	If the reference matches multiple config items, and a query fails or
- *	doesn't update any rows, the next matching config item is used.
+/** Process the result of an accounting query
  *
+ * @param[out] rcode	to return if no more queries should be tried.
+ * @param[in] request	the query was run for.
+ * @param[in] sql_ret	the query returned.
+ * @param[in] numaffected	Number of rows the query updated.
+ * @return
+ *	- true if the next query in the redundant set should be tried.
+ *	- false if rcode has been set.
  */
-static unlang_action_t acct_redundant(rlm_rcode_t *p_result, rlm_sql_t const *inst, request_t *request, sql_acct_section_t *section)
+static bool acct_query_next(rlm_rcode_t *rcode, request_t *request, sql_rcode_t sql_ret, int numaffected)
 {
-	rlm_rcode_t		rcode = RLM_MODULE_OK;
-
-	rlm_sql_handle_t	*handle = NULL;
-	int			sql_ret;
-	int			numaffected = 0;
-
-	CONF_ITEM		*item;
-	CONF_PAIR 		*pair;
-	char const		*attr = NULL;
-	char const		*value;
-
-	char			path[FR_MAX_STRING_LEN];
-	char			*p = path;
-	char			*expanded = NULL;
+	RDEBUG2("SQL query returned: %s", fr_table_str_by_value(sql_rcode_description_table, sql_ret, "<INVALID>"));
 
-	fr_assert(section);
+	switch (sql_ret) {
+	/*
+	 *  Query was a success! Now we just need to check if it did anything.
+	 */
+	case RLM_SQL_OK:
+	case RLM_SQL_NO_MORE_ROWS:
+		break;
 
-	if (section->reference[0] != '.') *p++ = '.';
+	/*
+	 *  A general, unrecoverable server fault.
+	 */
+	case RLM_SQL_ERROR:
+	/*
+	 *  If we get RLM_SQL_RECONNECT it means all connections in the pool
+	 *  were exhausted, and we couldn't create a new connection,
+	 *  so we do not need to call fr_pool_connection_release.
+	 */
+	case RLM_SQL_RECONNECT:
+		*rcode = RLM_MODULE_FAIL;
+		return false;
 
-	if (xlat_eval(p, sizeof(path) - (p - path), request, section->reference, NULL, NULL) < 0) {
-		rcode = RLM_MODULE_FAIL;
+	/*
+	 *  Query was invalid, this is a terminal error, but we still need
+	 *  to do cleanup, as the connection handle is still valid.
+	 */
+	case RLM_SQL_QUERY_INVALID:
+		*rcode = RLM_MODULE_INVALID;
+		return false;
 
-		goto finish;
+	/*
+	 *  Driver found an error (like a unique key constraint violation)
+	 *  that hinted it might be a good idea to try an alternative query.
+	 */
+	case RLM_SQL_ALT_QUERY:
+		return true;
 	}
 
 	/*
-	 *	If we can't find a matching config item we do
-	 *	nothing so return RLM_MODULE_NOOP.
+	 *  We need to have updated something for the query to have been
+	 *  counted as successful.
 	 */
-	item = cf_reference_item(NULL, section->cs, path);
-	if (!item) {
-		RWDEBUG("No such configuration item %s", path);
-		rcode = RLM_MODULE_NOOP;
+	RDEBUG2("%i record(s) updated", numaffected);
+	if (numaffected > 0) {
+		*rcode = RLM_MODULE_OK;		/* A query succeeded, were done! */
+		return false;
+	}
 
-		goto finish;
+	return true;
+}
+
+/** Expand an accounting query
+ *
+ * @param[out] out	Where to write the expanded query.
+ * @param[out] rcode	to return if there's no query to run.
+ * @param[in] inst	#rlm_sql_t instance data.
+ * @param[in] request	Current request.
+ * @param[in] handle	to use for escaping.
+ * @param[in] pair	containing the query.
+ * @return
+ *	- 0 on success.
+ *	- -1 if there's no query to run.
+ */
+static int acct_query_expand(char **out, rlm_rcode_t *rcode, rlm_sql_t const *inst, request_t *request,
+			     rlm_sql_handle_t *handle, CONF_PAIR *pair)
+{
+	char const *value;
+
+	value = cf_pair_value(pair);
+	if (!value) {
+	null_query:
+		RDEBUG2("Ignoring null query");
+		*rcode = RLM_MODULE_NOOP;
+		return -1;
 	}
-	if (cf_item_is_section(item)){
-		RWDEBUG("Sections are not supported as references");
-		rcode = RLM_MODULE_NOOP;
 
-		goto finish;
+	if (xlat_aeval(request, out, request, value, inst->sql_escape_func, handle) < 0) {
+		*rcode = RLM_MODULE_FAIL;
+		return -1;
 	}
 
-	pair = cf_item_to_pair(item);
-	attr = cf_pair_attr(pair);
+	if (!**out) {
+		TALLOC_FREE(*out);
+		goto null_query;
+	}
 
-	RDEBUG2("Using query template '%s'", attr);
+	return 0;
+}
 
-	handle = fr_pool_connection_get(inst->pool, request);
-	if (!handle) {
-		rcode = RLM_MODULE_FAIL;
+/** Whether a string is a decimal integer
+ *
+ */
+static bool acct_value_is_integer(char const *value)
+{
+	if (*value == '-') value++;
+	if (!*value) return false;
 
-		goto finish;
-	}
+	while (isdigit((uint8_t) *value)) value++;
 
-	sql_set_user(inst, request, NULL);
+	return (*value == '\0');
+}
 
-	while (true) {
-		value = cf_pair_value(pair);
-		if (!value) {
-			RDEBUG2("Ignoring null query");
-			rcode = RLM_MODULE_NOOP;
+/** Run an accounting query as a prepared statement
+ *
+ * @param[out] sql_ret	The result of the query.
+ * @param[in] inst	#rlm_sql_t instance data.
+ * @param[in] request	Current request.
+ * @param[in] section	the query is from.
+ * @param[in] handle	to run the query on.
+ * @param[in] pair	containing the query.
+ * @return
+ *	- 0 if the query was run.
+ *	- 1 if the query can't be run as a prepared statement, and should be
+ *	  expanded and run as normal.
+ *	- -1 on error.
+ */
+static int acct_query_prepared(sql_rcode_t *sql_ret, rlm_sql_t const *inst, request_t *request,
+			       sql_acct_section_t *section, rlm_sql_handle_t **handle, CONF_PAIR *pair)
+{
+	CONF_DATA const		*cd;
+	sql_stmt_t const	*stmt;
+	char			**values;
+	unsigned int		i;
+	int			ret = 1;
 
-			goto finish;
-		}
+	if (!inst->config->prepared_statements || !inst->driver->sql_query_prepared) return 1;
 
-		if (xlat_aeval(request, &expanded, request, value, inst->sql_escape_func, handle) < 0) {
-			rcode = RLM_MODULE_FAIL;
+	/*
+	 *	The query log needs the complete query.
+	 */
+	if (section->logfile || inst->config->logfile) return 1;
+
+	cd = cf_data_find(pair, sql_stmt_t, inst->name);
+	if (!cd) return 1;
+	stmt = cf_data_value(cd);
 
+	MEM(values = talloc_zero_array(request, char *, stmt->num_params + 1));
+	for (i = 0; i < stmt->num_params; i++) {
+		if (xlat_aeval(values, &values[i], request, stmt->params[i], NULL, NULL) < 0) {
+			ret = -1;
 			goto finish;
 		}
 
-		if (!*expanded) {
-			RDEBUG2("Ignoring null query");
-			rcode = RLM_MODULE_NOOP;
+		if (!stmt->numeric[i]) continue;
 
+		if (strcasecmp(values[i], "NULL") == 0) {
+			TALLOC_FREE(values[i]);
+			continue;
+		}
+
+		if (!acct_value_is_integer(values[i])) {
+			RDEBUG2("\"%s\" is not an integer, running query without prepared statement",
+				values[i]);
 			goto finish;
 		}
+	}
 
-		rlm_sql_query_log(inst, request, section, expanded);
+	*sql_ret = rlm_sql_query_prepared(inst, request, handle, stmt, (char const * const *) values);
+	ret = 0;
 
-		sql_ret = rlm_sql_query(inst, request, &handle, expanded);
-		TALLOC_FREE(expanded);
-		RDEBUG2("SQL query returned: %s", fr_table_str_by_value(sql_rcode_description_table, sql_ret, "<INVALID>"));
+finish:
+	talloc_free(values);
 
-		switch (sql_ret) {
-		/*
-		 *  Query was a success! Now we just need to check if it did anything.
-		 */
-		case RLM_SQL_OK:
+	return ret;
+}
+
+/** Run a set of redundant queries, until one of them updates something
+ *
+ * @param[in] inst	#rlm_sql_t instance data.
+ * @param[in] request	Current request.
+ * @param[in] section	the queries are from.
+ * @param[in] handle	to run the queries on.  May be NULL, if the pool
+ *			couldn't give us one.
+ * @param[in] pair	First query to run.
+ * @return the rcode the module should return.
+ */
+static rlm_rcode_t acct_query_run(rlm_sql_t const *inst, request_t *request, sql_acct_section_t *section,
+				  rlm_sql_handle_t **handle, CONF_PAIR *pair)
+{
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+	char const		*attr = cf_pair_attr(pair);
+	char			*expanded = NULL;
+	sql_rcode_t		sql_ret;
+	int			numaffected = 0;
+
+	if (!*handle) return RLM_MODULE_FAIL;
+
+	while (true) {
+		switch (acct_query_prepared(&sql_ret, inst, request, section, handle, pair)) {
+		case 0:
 			break;
 
-		/*
-		 *  A general, unrecoverable server fault.
-		 */
-		case RLM_SQL_ERROR:
-		/*
-		 *  If we get RLM_SQL_RECONNECT it means all connections in the pool
-		 *  were exhausted, and we couldn't create a new connection,
-		 *  so we do not need to call fr_pool_connection_release.
-		 */
-		case RLM_SQL_RECONNECT:
-			rcode = RLM_MODULE_FAIL;
-			goto finish;
+		case 1:
+			if (acct_query_expand(&expanded, &rcode, inst, request, *handle, pair) < 0) return rcode;
 
-		/*
-		 *  Query was invalid, this is a terminal error, but we still need
-		 *  to do cleanup, as the connection handle is still valid.
-		 */
-		case RLM_SQL_QUERY_INVALID:
-			rcode = RLM_MODULE_INVALID;
-			goto finish;
+			rlm_sql_query_log(inst, request, section, expanded);
 
-		/*
-		 *  Driver found an error (like a unique key constraint violation)
-		 *  that hinted it might be a good idea to try an alternative query.
-		 */
-		case RLM_SQL_ALT_QUERY:
-			goto next;
+			sql_ret = rlm_sql_query(inst, request, handle, expanded);
+			TALLOC_FREE(expanded);
+			break;
+
+		default:
+			return RLM_MODULE_FAIL;
 		}
-		fr_assert(handle);
 
-		/*
-		 *  We need to have updated something for the query to have been
-		 *  counted as successful.
-		 */
-		numaffected = (inst->driver->sql_affected_rows)(handle, inst->config);
-		(inst->driver->sql_finish_query)(handle, inst->config);
-		RDEBUG2("%i record(s) updated", numaffected);
+		if (sql_ret == RLM_SQL_OK) {
+			fr_assert(*handle);
+
+			numaffected = (inst->driver->sql_affected_rows)(*handle, inst->config);
+			(inst->driver->sql_finish_query)(*handle, inst->config);
+		}
+
+		if (!acct_query_next(&rcode, request, sql_ret, numaffected)) return rcode;
 
-		if (numaffected > 0) break;	/* A query succeeded, were done! */
-	next:
 		/*
 		 *  We assume all entries with the same name form a redundant
 		 *  set of queries.
 		 */
 		pair = cf_pair_find_next(section->cs, pair, attr);
-
 		if (!pair) {
 			RDEBUG2("No additional queries configured");
-			rcode = RLM_MODULE_NOOP;
-
-			goto finish;
+			return RLM_MODULE_NOOP;
 		}
 
 		RDEBUG2("Trying next query...");
 	}
+}
+
+/** Remove a batched query from the queue if it hasn't been run yet
+ *
+ */
+static int _sql_batch_entry_free(sql_batch_entry_t *entry)
+{
+	if (fr_dlist_entry_in_list(&entry->entry)) fr_dlist_remove(&entry->thread->queue, entry);
+
+	return 0;
+}
+
+/** Run all the queries in a thread's batch queue, on a single connection
+ *
+ * If the driver can pipeline queries all the queries are sent before any
+ * of the results are read.  Otherwise the queries are run one after another.
+ *
+ * @param[in] t		Thread whose queue should be flushed.
+ * @param[in] current	Request which caused the flush.  It is resumed by
+ *			the caller, all other requests are marked runnable.
+ */
+static void sql_batch_flush(rlm_sql_thread_t *t, request_t *current)
+{
+	rlm_sql_t const		*inst = t->inst;
+	rlm_sql_handle_t	*handle;
+	rlm_sql_batch_query_t	*queries = NULL;
+	sql_batch_entry_t	*entry;
+	size_t			i, num = fr_dlist_num_elements(&t->queue);
+
+	if (t->ev) fr_event_timer_delete(&t->ev);
+
+	if (num == 0) return;
+
+	DEBUG2("Running batch of %zu queries", num);
+
+	handle = fr_pool_connection_get(inst->pool, current);
+
+	if (handle && inst->driver->sql_query_batch) {
+		queries = talloc_array(NULL, rlm_sql_batch_query_t, num);
+		if (queries) {
+			for (entry = fr_dlist_head(&t->queue), i = 0;
+			     entry;
+			     entry = fr_dlist_next(&t->queue, entry), i++) {
+				queries[i] = (rlm_sql_batch_query_t){ .query = entry->query, .rcode = RLM_SQL_RECONNECT };
+			}
+
+			if ((inst->driver->sql_query_batch)(handle, inst->config, queries, num) == RLM_SQL_RECONNECT) {
+				handle = fr_pool_connection_reconnect(inst->pool, current, handle);
+			}
+		}
+	}
+
+	i = 0;
+	while ((entry = fr_dlist_pop_head(&t->queue))) {
+		if (queries) {
+			entry->rcode = queries[i].rcode;
+			entry->affected = queries[i].affected;
+			i++;
+
+			/*
+			 *	The pipeline broke before this query
+			 *	could be run, produce an appropriate
+			 *	error, or try again on the new connection.
+			 */
+			if (entry->rcode != RLM_SQL_RECONNECT) goto done;
+		}
+
+		if (!handle) {
+			entry->rcode = RLM_SQL_RECONNECT;
+			goto done;
+		}
+
+		entry->rcode = rlm_sql_query(inst, entry->request, &handle, entry->query);
+		if (entry->rcode == RLM_SQL_OK) {
+			entry->affected = (inst->driver->sql_affected_rows)(handle, inst->config);
+			(inst->driver->sql_finish_query)(handle, inst->config);
+		}
+
+	done:
+		if (entry->request != current) unlang_interpret_mark_runnable(entry->request);
+	}
+
+	talloc_free(queries);
+	if (handle) fr_pool_connection_release(inst->pool, current, handle);
+}
+
+/** Flush a partial batch when the batch window expires
+ *
+ */
+static void sql_batch_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	rlm_sql_thread_t *t = talloc_get_type_abort(uctx, rlm_sql_thread_t);
+
+	sql_batch_flush(t, NULL);
+}
+
+/** Continue processing an accounting request after its batched query has been run
+ *
+ */
+static unlang_action_t acct_batch_resume(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx,
+					 request_t *request, void *rctx)
+{
+	sql_batch_entry_t	*entry = talloc_get_type_abort(rctx, sql_batch_entry_t);
+	rlm_sql_t const		*inst = entry->thread->inst;
+	sql_acct_section_t	*section = entry->section;
+	CONF_PAIR		*pair = entry->pair;
+	rlm_sql_handle_t	*handle;
+	rlm_rcode_t		rcode;
+
+	RDEBUG2("Batched query returned");
+
+	if (!acct_query_next(&rcode, request, entry->rcode, entry->affected)) {
+		talloc_free(entry);
+		RETURN_MODULE_RCODE(rcode);
+	}
+	talloc_free(entry);
+
+	/*
+	 *	The batched query didn't do anything, run the
+	 *	rest of the redundant set without batching.
+	 */
+	pair = cf_pair_find_next(section->cs, pair, cf_pair_attr(pair));
+	if (!pair) {
+		RDEBUG2("No additional queries configured");
+		RETURN_MODULE_NOOP;
+	}
+
+	RDEBUG2("Trying next query...");
+
+	handle = fr_pool_connection_get(inst->pool, request);
+	sql_set_user(inst, request, NULL);
+
+	rcode = acct_query_run(inst, request, section, &handle, pair);
+
+	fr_pool_connection_release(inst->pool, request, handle);
+	sql_unset_user(inst, request);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+/** Remove the query from the batch if the request is cancelled
+ *
+ */
+static void acct_batch_signal(UNUSED module_ctx_t const *mctx, UNUSED request_t *request, void *rctx,
+			      fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	talloc_free(rctx);
+}
+
+/** Add the first query of a redundant set to the thread's batch, and yield until it's been run
+ *
+ */
+static unlang_action_t acct_batch(rlm_rcode_t *p_result, rlm_sql_t const *inst, rlm_sql_thread_t *t,
+				  request_t *request, sql_acct_section_t *section, CONF_PAIR *pair)
+{
+	rlm_sql_handle_t	*handle;
+	sql_batch_entry_t	*entry;
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+	char			*expanded = NULL;
+	int			ret;
+
+	/*
+	 *	Drivers may need a connection to escape values.
+	 */
+	handle = fr_pool_connection_get(inst->pool, request);
+	if (!handle) RETURN_MODULE_FAIL;
+
+	sql_set_user(inst, request, NULL);
+	ret = acct_query_expand(&expanded, &rcode, inst, request, handle, pair);
+	sql_unset_user(inst, request);
+	fr_pool_connection_release(inst->pool, request, handle);
+
+	if (ret < 0) RETURN_MODULE_RCODE(rcode);
+
+	rlm_sql_query_log(inst, request, section, expanded);
+
+	MEM(entry = talloc_zero(request, sql_batch_entry_t));
+	entry->thread = t;
+	entry->request = request;
+	entry->section = section;
+	entry->pair = pair;
+	entry->query = talloc_steal(entry, expanded);
+	fr_dlist_insert_tail(&t->queue, entry);
+	talloc_set_destructor(entry, _sql_batch_entry_free);
+
+	RDEBUG2("Adding query to batch (%zu of %u): %s",
+		fr_dlist_num_elements(&t->queue), section->batch_size, entry->query);
+
+	if (fr_dlist_num_elements(&t->queue) >= section->batch_size) {
+		sql_batch_flush(t, request);
+		return acct_batch_resume(p_result, NULL, request, entry);
+	}
+
+	if (!t->ev && (fr_event_timer_in(t, t->el, &t->ev, section->batch_window, sql_batch_timeout, t) < 0)) {
+		RPERROR("Failed inserting batch timer");
+		sql_batch_flush(t, request);
+		return acct_batch_resume(p_result, NULL, request, entry);
+	}
+
+	return unlang_module_yield(request, acct_batch_resume, acct_batch_signal, entry);
+}
+
+/*
+ *	Generic function for failing between a bunch of queries.
+ *
+ *	Uses the same principle as rlm_linelog, expanding the 'reference' config
+ *	item using xlat to figure out what query it should execute.
+ *
+ *	If the reference matches multiple config items, and a query fails or
+ *	doesn't update any rows, the next matching config item is used.
+ *
+ *	If the section has batching enabled, the first query is added to the
+ *	thread's batch, and the request yields until the batch has been run.
+ */
+static unlang_action_t acct_redundant(rlm_rcode_t *p_result, rlm_sql_t const *inst, rlm_sql_thread_t *t,
+				      request_t *request, sql_acct_section_t *section)
+{
+	rlm_rcode_t		rcode = RLM_MODULE_OK;
+
+	rlm_sql_handle_t	*handle = NULL;
+
+	CONF_ITEM		*item;
+	CONF_PAIR 		*pair;
+
+	char			path[FR_MAX_STRING_LEN];
+	char			*p = path;
+
+	fr_assert(section);
+
+	if (section->reference[0] != '.') *p++ = '.';
+
+	if (xlat_eval(p, sizeof(path) - (p - path), request, section->reference, NULL, NULL) < 0) {
+		RETURN_MODULE_FAIL;
+	}
+
+	/*
+	 *	If we can't find a matching config item we do
+	 *	nothing so return RLM_MODULE_NOOP.
+	 */
+	item = cf_reference_item(NULL, section->cs, path);
+	if (!item) {
+		RWDEBUG("No such configuration item %s", path);
+		RETURN_MODULE_NOOP;
+	}
+	if (cf_item_is_section(item)){
+		RWDEBUG("Sections are not supported as references");
+		RETURN_MODULE_NOOP;
+	}
+
+	pair = cf_item_to_pair(item);
+
+	RDEBUG2("Using query template '%s'", cf_pair_attr(pair));
+
+	if (t && (section->batch_size > 1)) return acct_batch(p_result, inst, t, request, section, pair);
+
+	handle = fr_pool_connection_get(inst->pool, request);
+	if (!handle) RETURN_MODULE_FAIL;
+
+	sql_set_user(inst, request, NULL);
+
+	rcode = acct_query_run(inst, request, section, &handle, pair);
 
-finish:
-	talloc_free(expanded);
 	fr_pool_connection_release(inst->pool, request, handle);
 	sql_unset_user(inst, request);
 
@@ -1598,7 +2275,7 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 	rlm_sql_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_sql_t);
 
 	if (inst->config->accounting.reference_cp) {
-		return acct_redundant(p_result, inst, request, &inst->config->accounting);
+		return acct_redundant(p_result, inst, mctx->thread, request, &inst->config->accounting);
 	}
 
 	RETURN_MODULE_NOOP;
@@ -1612,7 +2289,7 @@ static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, mod
 	rlm_sql_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_sql_t);
 
 	if (inst->config->postauth.reference_cp) {
-		return acct_redundant(p_result, inst, request, &inst->config->postauth);
+		return acct_redundant(p_result, inst, mctx->thread, request, &inst->config->postauth);
 	}
 
 	RETURN_MODULE_NOOP;
@@ -1633,6 +2310,10 @@ module_t rlm_sql = {
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_sql_thread_t),
+	.thread_inst_type	= "rlm_sql_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
 		[MOD_ACCOUNTING]	= mod_accounting,
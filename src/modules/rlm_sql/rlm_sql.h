@@ -82,6 +82,11 @@ typedef struct {
 
 	char const		*logfile;
 
+	uint32_t		batch_size;			//!< Maximum number of queries to batch together.
+								///< 0 or 1 disables batching.
+	fr_time_delta_t		batch_window;			//!< How long to wait for more queries before
+								///< running a partial batch.
+
 	char const		**query;			/* for xlat parsing */
 } sql_acct_section_t;
 
@@ -125,6 +130,13 @@ typedef struct {
 	char const		*connect_query;			//!< Query executed after establishing
 								//!< new connection.
 
+	bool			prepared_statements;		//!< Run accounting and post-auth queries as
+								///< prepared statements, if the driver supports it.
+
+	bool			stream_results;			//!< Fetch rows from the server as they're processed,
+								///< instead of buffering the whole result, if the
+								///< driver supports it.
+
 	void			*driver;			//!< Where drivers should write a
 								//!< pointer to their configurations.
 
@@ -142,6 +154,30 @@ typedef struct {
 
 typedef struct sql_inst rlm_sql_t;
 
+/** A query run as part of a batch
+ *
+ */
+typedef struct {
+	char const		*query;				//!< Query to execute.
+	sql_rcode_t		rcode;				//!< Result of the query.
+	int			affected;			//!< Number of rows the query affected.
+} rlm_sql_batch_query_t;
+
+/** A query template, compiled into a statement with placeholders
+ *
+ * Each runtime expansion in the template is replaced by a placeholder, and
+ * the expansion becomes the template for the value bound to it.
+ */
+typedef struct {
+	unsigned int		id;				//!< Unique within the module instance, drivers use
+								///< it to index their per-connection caches.
+	char const		*query;				//!< Query text, with placeholders.
+	unsigned int		num_params;			//!< Number of placeholders.
+	char const		**params;			//!< Template for each placeholder's value.
+	bool			*numeric;			//!< The expansion wasn't quoted in the template,
+								///< so the value must be an integer, or NULL.
+} sql_stmt_t;
+
 typedef struct {
 	void			*conn;				//!< Database specific connection handle.
 	rlm_sql_row_t		row;				//!< Row data from the last query.
@@ -160,6 +196,10 @@ extern size_t sql_rcode_table_len;
  */
 #define RLM_SQL_RCODE_FLAGS_ALT_QUERY	1			//!< Can distinguish between other errors and those
 								//!< resulting from a unique key violation.
+#define RLM_SQL_PLACEHOLDER_NUMBERED	2			//!< Placeholders are $1, $2... rather than ?.
+#define RLM_SQL_STREAM_RESULTS		4			//!< Can fetch rows from the server one at a time.
+								//!< The number of rows isn't known until they've
+								//!< all been fetched.
 
 /** Retrieve errors from the last query operation
  *
@@ -210,6 +250,36 @@ typedef struct {
 	sql_rcode_t (*sql_finish_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 	sql_rcode_t (*sql_finish_select_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 
+	/*
+	 *	Optional, for drivers which can run queries without blocking.
+	 */
+	int (*sql_fd)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);		//!< Socket to wait on.
+	sql_rcode_t (*sql_query_send)(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+				      char const *query);				//!< Send a query.
+	sql_rcode_t (*sql_query_result)(bool *busy, rlm_sql_handle_t *handle,
+					rlm_sql_config_t *config);			//!< Read the result.
+
+	/*
+	 *	Optional, for drivers which can send multiple queries
+	 *	before reading any of the results.
+	 *
+	 *	Must set rcode and affected for every query.  Queries which
+	 *	could not be run because the connection failed should be
+	 *	given RLM_SQL_RECONNECT.
+	 */
+	sql_rcode_t (*sql_query_batch)(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+				       rlm_sql_batch_query_t *queries, size_t num);	//!< Run queries in one round trip.
+
+	/*
+	 *	Optional, for drivers which support prepared statements.
+	 *
+	 *	The statement should be prepared the first time it's run on
+	 *	a connection, and reused after that.  A NULL value binds NULL.
+	 *	Results are retrieved and freed as for sql_query.
+	 */
+	sql_rcode_t (*sql_query_prepared)(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+					  sql_stmt_t const *stmt, char const * const *values);	//!< Run a prepared statement.
+
 	xlat_escape_legacy_t	sql_escape_func;
 } rlm_sql_driver_t;
 
@@ -234,6 +304,12 @@ struct sql_inst {
 
 	char const		*name;			//!< Module instance name.
 	fr_dict_attr_t const	*group_da;		//!< Group dictionary attribute.
+
+	xlat_arg_parser_t	xlat_arg;		//!< Argument of the sql xlat.  Per instance
+							///< so the escape function gets the instance.
+
+	unsigned int		num_stmts;		//!< Number of query templates compiled into
+							///< prepared statements.
 };
 
 typedef struct rlm_sql_grouplist_s rlm_sql_grouplist_t;
@@ -248,6 +324,12 @@ void 		rlm_sql_query_log(rlm_sql_t const *inst, request_t *request, sql_acct_sec
 sql_rcode_t	rlm_sql_select_query(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
 sql_rcode_t	rlm_sql_query(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle, char const *query) CC_HINT(nonnull (1, 3, 4));
 int		rlm_sql_fetch_row(rlm_sql_row_t *out, rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle);
+sql_rcode_t	rlm_sql_query_send(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t *handle, char const *query) CC_HINT(nonnull (1, 3, 4));
+sql_rcode_t	rlm_sql_query_result(bool *busy, rlm_sql_t const *inst, request_t *request,
+				     rlm_sql_handle_t **handle, char const *query, bool select) CC_HINT(nonnull (1, 2, 4, 5));
+sql_stmt_t	*sql_stmt_compile(TALLOC_CTX *ctx, rlm_sql_t *inst, char const *query);
+sql_rcode_t	rlm_sql_query_prepared(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle,
+				       sql_stmt_t const *stmt, char const * const *values) CC_HINT(nonnull (1, 3, 4));
 void		rlm_sql_print_error(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t *handle, bool force_debug);
 int		sql_set_user(rlm_sql_t const *inst, request_t *request, char const *username);
 
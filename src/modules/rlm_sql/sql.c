@@ -392,6 +392,70 @@ void rlm_sql_print_error(rlm_sql_t const *inst, request_t *request, rlm_sql_hand
 	talloc_free_children(handle->log_ctx);
 }
 
+/** Log and clean up after a failed query
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle the query failed on.
+ * @param ret from the driver.
+ * @return the rcode the caller should see.
+ */
+static sql_rcode_t sql_query_error(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t *handle, sql_rcode_t ret)
+{
+	switch (ret) {
+	/*
+	 *	These are bad and should make rlm_sql return invalid
+	 */
+	case RLM_SQL_QUERY_INVALID:
+		rlm_sql_print_error(inst, request, handle, false);
+		(inst->driver->sql_finish_query)(handle, inst->config);
+		break;
+
+	/*
+	 *	Server or client errors.
+	 *
+	 *	If the driver claims to be able to distinguish between
+	 *	duplicate row errors and other errors, and we hit a
+	 *	general error treat it as a failure.
+	 *
+	 *	Otherwise rewrite it to RLM_SQL_ALT_QUERY.
+	 */
+	case RLM_SQL_ERROR:
+		if (inst->driver->flags & RLM_SQL_RCODE_FLAGS_ALT_QUERY) {
+			rlm_sql_print_error(inst, request, handle, false);
+			(inst->driver->sql_finish_query)(handle, inst->config);
+			break;
+		}
+		ret = RLM_SQL_ALT_QUERY;
+		FALL_THROUGH;
+
+	/*
+	 *	Driver suggested using an alternative query
+	 */
+	case RLM_SQL_ALT_QUERY:
+		rlm_sql_print_error(inst, request, handle, true);
+		(inst->driver->sql_finish_query)(handle, inst->config);
+		break;
+
+	default:
+		break;
+	}
+
+	return ret;
+}
+
+/** Log and clean up after a failed select query
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle the query failed on.
+ */
+static void sql_select_query_error(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t *handle)
+{
+	rlm_sql_print_error(inst, request, handle, false);
+	(inst->driver->sql_finish_select_query)(handle, inst->config);
+}
+
 /** Call the driver's sql_query method, reconnecting if necessary.
  *
  * @note Caller must call ``(inst->driver->sql_finish_query)(handle, inst->config);``
@@ -450,40 +514,9 @@ sql_rcode_t rlm_sql_query(rlm_sql_t const *inst, request_t *request, rlm_sql_han
 			/* Reconnection succeeded, try again with the new handle */
 			continue;
 
-		/*
-		 *	These are bad and should make rlm_sql return invalid
-		 */
-		case RLM_SQL_QUERY_INVALID:
-			rlm_sql_print_error(inst, request, *handle, false);
-			(inst->driver->sql_finish_query)(*handle, inst->config);
-			break;
-
-		/*
-		 *	Server or client errors.
-		 *
-		 *	If the driver claims to be able to distinguish between
-		 *	duplicate row errors and other errors, and we hit a
-		 *	general error treat it as a failure.
-		 *
-		 *	Otherwise rewrite it to RLM_SQL_ALT_QUERY.
-		 */
-		case RLM_SQL_ERROR:
-			if (inst->driver->flags & RLM_SQL_RCODE_FLAGS_ALT_QUERY) {
-				rlm_sql_print_error(inst, request, *handle, false);
-				(inst->driver->sql_finish_query)(*handle, inst->config);
-				break;
-			}
-			ret = RLM_SQL_ALT_QUERY;
-			FALL_THROUGH;
-
-		/*
-		 *	Driver suggested using an alternative query
-		 */
-		case RLM_SQL_ALT_QUERY:
-			rlm_sql_print_error(inst, request, *handle, true);
-			(inst->driver->sql_finish_query)(*handle, inst->config);
+		default:
+			ret = sql_query_error(inst, request, *handle, ret);
 			break;
-
 		}
 
 		return ret;
@@ -554,8 +587,346 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_t const *inst, request_t *request, rlm_
 		case RLM_SQL_QUERY_INVALID:
 		case RLM_SQL_ERROR:
 		default:
-			rlm_sql_print_error(inst, request, *handle, false);
-			(inst->driver->sql_finish_select_query)(*handle, inst->config);
+			sql_select_query_error(inst, request, *handle);
+			break;
+		}
+
+		return ret;
+	}
+
+	ROPTIONAL(RERROR, ERROR, "Hit reconnection limit");
+
+	return RLM_SQL_ERROR;
+}
+
+
+/** Send a query without waiting for the result
+ *
+ * Only available if the driver provides sql_query_send.  The caller should wait
+ * for the fd returned by the driver's sql_fd method to become readable, then call
+ * #rlm_sql_query_result.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle to query the database with.
+ * @param query to execute. Should not be zero length.
+ * @return
+ *	- #RLM_SQL_OK if the query was sent.
+ *	- #RLM_SQL_RECONNECT if the handle needs reconnecting.
+ *	- #RLM_SQL_QUERY_INVALID on zero length query.
+ */
+sql_rcode_t rlm_sql_query_send(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t *handle, char const *query)
+{
+	fr_assert(inst->driver->sql_query_send);
+
+	if (query[0] == '\0') {
+		if (request) REDEBUG("Zero length query");
+		return RLM_SQL_QUERY_INVALID;
+	}
+
+	ROPTIONAL(RDEBUG2, DEBUG2, "Sending query: %s", query);
+
+	return (inst->driver->sql_query_send)(handle, inst->config, query);
+}
+
+/** Collect the result of a query sent with #rlm_sql_query_send
+ *
+ * Errors are handled as #rlm_sql_query and #rlm_sql_select_query would.
+ * If the connection needs reconnecting, the query is re-run synchronously
+ * on a new handle.
+ *
+ * @param[out] busy	Set to true if the result is not yet complete.  The caller
+ *			should wait on the fd again.
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle the query was sent on.  May change if we reconnect.
+ * @param query that was sent.  Used if we need to retry.
+ * @param select whether this is a select query.
+ * @return the same values as #rlm_sql_query or #rlm_sql_select_query.
+ */
+sql_rcode_t rlm_sql_query_result(bool *busy, rlm_sql_t const *inst, request_t *request,
+				 rlm_sql_handle_t **handle, char const *query, bool select)
+{
+	sql_rcode_t ret;
+
+	fr_assert(inst->driver->sql_query_result);
+
+	ret = (inst->driver->sql_query_result)(busy, *handle, inst->config);
+	if (*busy) return RLM_SQL_OK;
+
+	switch (ret) {
+	case RLM_SQL_OK:
+		break;
+
+	case RLM_SQL_RECONNECT:
+		*handle = fr_pool_connection_reconnect(inst->pool, request, *handle);
+		if (!*handle) return RLM_SQL_RECONNECT;
+
+		return select ? rlm_sql_select_query(inst, request, handle, query) :
+				rlm_sql_query(inst, request, handle, query);
+
+	default:
+		if (select) {
+			sql_select_query_error(inst, request, *handle);
+			break;
+		}
+		ret = sql_query_error(inst, request, *handle, ret);
+		break;
+	}
+
+	return ret;
+}
+
+/** Find the end of an xlat expansion
+ *
+ * @param[in] p	pointing to the '%' which starts the expansion.
+ * @return
+ *	- A pointer to the first char after the expansion.
+ *	- NULL if the expansion isn't one we understand.
+ */
+static char const *sql_stmt_expansion_end(char const *p)
+{
+	char	open, close;
+	int	depth = 0;
+
+	switch (p[1]) {
+	case '{':
+		open = '{';
+		close = '}';
+		break;
+
+	case '(':
+		open = '(';
+		close = ')';
+		break;
+
+	default:
+		if (isalpha((uint8_t) p[1])) return p + 2;
+		return NULL;
+	}
+
+	for (p++; *p; p++) {
+		if (*p == open) depth++;
+		if ((*p == close) && (--depth == 0)) return p + 1;
+	}
+
+	return NULL;
+}
+
+/** Whether a char would join with a placeholder to form a larger token
+ *
+ */
+static inline bool sql_stmt_is_token_char(char c)
+{
+	return isalnum((uint8_t) c) || (c == '_') || (c == '.') || (c == '$') || (c == '@') ||
+	       (c == '\'') || (c == '"') || (c == '`');
+}
+
+/** Add a placeholder, and the template for its value, to a statement
+ *
+ */
+static int sql_stmt_param_add(rlm_sql_t *inst, sql_stmt_t *stmt, char **query,
+			      char const *param, size_t param_len, bool numeric)
+{
+	char const	**params;
+	bool		*is_numeric;
+
+	params = talloc_realloc(stmt, stmt->params, char const *, stmt->num_params + 1);
+	is_numeric = talloc_realloc(stmt, stmt->numeric, bool, stmt->num_params + 1);
+	if (!params || !is_numeric) return -1;
+	stmt->params = params;
+	stmt->numeric = is_numeric;
+
+	stmt->params[stmt->num_params] = talloc_bstrndup(stmt->params, param, param_len);
+	stmt->numeric[stmt->num_params] = numeric;
+	if (!stmt->params[stmt->num_params]) return -1;
+	stmt->num_params++;
+
+	if (inst->driver->flags & RLM_SQL_PLACEHOLDER_NUMBERED) {
+		*query = talloc_asprintf_append_buffer(*query, "$%u", stmt->num_params);
+	} else {
+		*query = talloc_strdup_append_buffer(*query, "?");
+	}
+
+	return *query ? 0 : -1;
+}
+
+/** Compile a query template into a statement with placeholders
+ *
+ * Single quoted string literals containing expansions are replaced by a
+ * placeholder, with the literal's contents as the template for the value.
+ * Expansions outside of string literals must form a complete SQL token,
+ * and are replaced by a placeholder whose value must be an integer or NULL.
+ *
+ * Templates which use expansions in other ways, e.g. to build identifiers,
+ * or in string literals containing escape sequences, can't be converted.
+ *
+ * @param[in] ctx	to allocate the statement in.
+ * @param[in] inst	#rlm_sql_t instance data.
+ * @param[in] query	template to compile.
+ * @return
+ *	- A new statement.
+ *	- NULL if the template can't be compiled (or on OOM).
+ */
+sql_stmt_t *sql_stmt_compile(TALLOC_CTX *ctx, rlm_sql_t *inst, char const *query)
+{
+	sql_stmt_t	*stmt;
+	char		*out;
+	char const	*p = query, *q;
+	bool		expansion, escaped;
+	size_t		len;
+
+	stmt = talloc_zero(ctx, sql_stmt_t);
+	if (!stmt) return NULL;
+
+	out = talloc_strdup(stmt, "");
+	if (!out) goto error;
+
+	while (*p) {
+		switch (*p) {
+		/*
+		 *	A string literal.  If it contains any expansions
+		 *	the whole literal becomes a placeholder.
+		 */
+		case '\'':
+			expansion = escaped = false;
+			for (q = p + 1; *q; q++) {
+				if (*q == '\\') goto error;
+
+				if (*q == '%') {
+					if (q[1] == '%') {
+						q++;
+						continue;
+					}
+
+					q = sql_stmt_expansion_end(q);
+					if (!q) goto error;
+					expansion = true;
+					q--;
+					continue;
+				}
+
+				if (*q != '\'') continue;
+
+				if (q[1] != '\'') break;
+
+				escaped = true;
+				q++;
+			}
+			if (*q != '\'') goto error;
+
+			if (expansion) {
+				if (escaped) goto error;
+				if (sql_stmt_param_add(inst, stmt, &out, p + 1, q - (p + 1), false) < 0) goto error;
+				p = q + 1;
+				continue;
+			}
+
+			/*
+			 *	A constant literal, only "%%" needs translating.
+			 */
+			for (q++; p < q; p++) {
+				out = talloc_strndup_append_buffer(out, p, 1);
+				if (!out) goto error;
+				if ((p[0] == '%') && (p[1] == '%')) p++;
+			}
+			continue;
+
+		/*
+		 *	Quoted identifiers can't be parameterised.
+		 */
+		case '"':
+		case '`':
+			q = strchr(p + 1, *p);
+			if (!q || memchr(p, '%', q - p)) goto error;
+
+			out = talloc_strndup_append_buffer(out, p, (q + 1) - p);
+			if (!out) goto error;
+			p = q + 1;
+			continue;
+
+		case '\\':
+			goto error;
+
+		case '%':
+			if (p[1] == '%') {
+				out = talloc_strdup_append_buffer(out, "%");
+				if (!out) goto error;
+				p += 2;
+				continue;
+			}
+
+			q = sql_stmt_expansion_end(p);
+			if (!q) goto error;
+
+			/*
+			 *	Something like "acct_%{foo}", or "%{foo}bar"
+			 */
+			len = strlen(out);
+			if ((len && sql_stmt_is_token_char(out[len - 1])) || sql_stmt_is_token_char(*q)) goto error;
+
+			if (sql_stmt_param_add(inst, stmt, &out, p, q - p, true) < 0) goto error;
+			p = q;
+			continue;
+
+		default:
+			break;
+		}
+
+		out = talloc_strndup_append_buffer(out, p, 1);
+		if (!out) goto error;
+		p++;
+	}
+
+	stmt->query = out;
+	stmt->id = inst->num_stmts++;
+
+	return stmt;
+
+error:
+	talloc_free(stmt);
+	return NULL;
+}
+
+/** Call the driver's sql_query_prepared method, reconnecting if necessary.
+ *
+ * @note Caller must call ``(inst->driver->sql_finish_query)(handle, inst->config);``
+ *	after they're done with the result.
+ *
+ * @param inst #rlm_sql_t instance data.
+ * @param request Current request.
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ * 	previous reconnection attempt has failed.
+ * @param stmt to execute.
+ * @param values to bind to the statement's placeholders.
+ * @return the same values as #rlm_sql_query.
+ */
+sql_rcode_t rlm_sql_query_prepared(rlm_sql_t const *inst, request_t *request, rlm_sql_handle_t **handle,
+				   sql_stmt_t const *stmt, char const * const *values)
+{
+	int ret = RLM_SQL_ERROR;
+	int i, count;
+
+	fr_assert(*handle);
+	fr_assert(inst->driver->sql_query_prepared);
+
+	count = fr_pool_state(inst->pool)->num;
+
+	for (i = 0; i < (count + 1); i++) {
+		ROPTIONAL(RDEBUG2, DEBUG2, "Executing prepared statement: %s", stmt->query);
+
+		ret = (inst->driver->sql_query_prepared)(*handle, inst->config, stmt, values);
+		switch (ret) {
+		case RLM_SQL_OK:
+			break;
+
+		case RLM_SQL_RECONNECT:
+			*handle = fr_pool_connection_reconnect(inst->pool, request, *handle);
+			if (!*handle) return RLM_SQL_RECONNECT;
+			continue;
+
+		default:
+			ret = sql_query_error(inst, request, *handle, ret);
 			break;
 		}
 
@@ -29,6 +29,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/radius/radius.h>
 
 #include <ctype.h>
 
@@ -71,8 +72,58 @@ typedef struct {
 
 	fr_time_t	reset_time;
 	fr_time_t	last_reset;
+
+	bool		local;		//!< Keep running totals in memory.
+	tmpl_t		*local_session;	//!< Identifies the session an accounting packet is for.
+	tmpl_t		*local_value;	//!< The session's total so far, e.g. Acct-Session-Time.
+	fr_time_delta_t	local_reconcile;	//!< How often totals are re-read from SQL.
+	uint32_t	local_max_entries;	//!< Least recently used totals are discarded after this.
+
+	struct sqlcounter_local_s *totals;	//!< Running totals, if local is enabled.
 } rlm_sqlcounter_t;
 
+/** The last value seen for one of a key's sessions
+ *
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< In the total's list of sessions.
+	char const		*id;		//!< Session identifier.
+	uint64_t		last;		//!< Last value seen for the session.
+} sqlcounter_session_t;
+
+/** The running total for one key
+ *
+ */
+typedef struct {
+	char const		*key;
+	fr_dlist_t		lru;		//!< Most recently used first.
+
+	uint64_t		base;		//!< Value returned by the SQL query.
+	uint64_t		delta;		//!< Added by accounting packets since the query.
+	fr_time_t		loaded;		//!< When base was read.  0 if it's never been read.
+	fr_time_t		period;		//!< The value of last_reset when base was read.
+
+	fr_dlist_head_t		sessions;	//!< Of sqlcounter_session_t.
+} sqlcounter_total_t;
+
+/** Running totals for every key, shared by all workers
+ *
+ */
+typedef struct sqlcounter_local_s {
+	pthread_mutex_t		mutex;
+	fr_hash_table_t		*ht;		//!< Of sqlcounter_total_t, by key.
+	fr_dlist_head_t		lru;		//!< Of sqlcounter_total_t.
+} sqlcounter_local_t;
+
+static const CONF_PARSER local_config[] = {
+	{ FR_CONF_OFFSET("enable", FR_TYPE_BOOL, rlm_sqlcounter_t, local), .dflt = "no" },
+	{ FR_CONF_OFFSET("session", FR_TYPE_TMPL, rlm_sqlcounter_t, local_session), .dflt = "%{Acct-Unique-Session-Id}", .quote = T_DOUBLE_QUOTED_STRING },
+	{ FR_CONF_OFFSET("value", FR_TYPE_TMPL, rlm_sqlcounter_t, local_value), .dflt = "%{%{Acct-Session-Time}:-0}", .quote = T_DOUBLE_QUOTED_STRING },
+	{ FR_CONF_OFFSET("reconcile_interval", FR_TYPE_TIME_DELTA, rlm_sqlcounter_t, local_reconcile), .dflt = "300" },
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_sqlcounter_t, local_max_entries), .dflt = "1048576" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("sql_module_instance", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_sqlcounter_t, sqlmod_inst) },
 
@@ -88,6 +139,8 @@ static const CONF_PARSER module_config[] = {
 
 	/* Attribute to write remaining session to */
 	{ FR_CONF_OFFSET("reply_name", FR_TYPE_TMPL | FR_TYPE_ATTRIBUTE, rlm_sqlcounter_t, reply_attr) },
+
+	{ FR_CONF_POINTER("local", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) local_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -101,11 +154,13 @@ fr_dict_autoload_t rlm_sqlcounter_dict[] = {
 	{ NULL }
 };
 
+static fr_dict_attr_t const *attr_acct_status_type;
 static fr_dict_attr_t const *attr_reply_message;
 static fr_dict_attr_t const *attr_session_timeout;
 
 extern fr_dict_attr_autoload_t rlm_sqlcounter_dict_attr[];
 fr_dict_attr_autoload_t rlm_sqlcounter_dict_attr[] = {
+	{ .out = &attr_acct_status_type, .name = "Acct-Status-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius },
 	{ .out = &attr_reply_message, .name = "Reply-Message", .type = FR_TYPE_STRING, .dict = &dict_radius },
 	{ .out = &attr_session_timeout, .name = "Session-Timeout", .type = FR_TYPE_UINT32, .dict = &dict_radius },
 	{ NULL }
@@ -337,14 +392,15 @@ static ssize_t sqlcounter_expand(char *out, int outlen, rlm_sqlcounter_t const *
 }
 
 
-/*
- *	See if the counter matches.
+/** Run the counter query
+ *
+ * @return
+ *	- 0 on success, with the counter in out.  A result which isn't a
+ *	  number (e.g. the NULL from a SUM() with no rows) is 0.
+ *	- -1 on error.
  */
-static int counter_cmp(void *instance, request_t *request, UNUSED fr_pair_list_t *request_list , fr_pair_t *check)
+static int sqlcounter_query(uint64_t *out, rlm_sqlcounter_t const *inst, request_t *request)
 {
-	rlm_sqlcounter_t const *inst = talloc_get_type_abort_const(instance, rlm_sqlcounter_t);
-	uint64_t counter;
-
 	char query[MAX_QUERY_LEN], subst[MAX_QUERY_LEN];
 	char *expanded = NULL;
 	size_t len;
@@ -358,7 +414,7 @@ static int counter_cmp(void *instance, request_t *request, UNUSED fr_pair_list_t
 
 	/* Then combine that with the name of the module were using to do the query */
 	len = snprintf(query, sizeof(query), "%%{%s:%s}", inst->sqlmod_inst, subst);
-	if (len >= sizeof(query) - 1) {
+	if (len >= (sizeof(query) - 1)) {
 		REDEBUG("Insufficient query buffer space");
 
 		return -1;
@@ -369,11 +425,129 @@ static int counter_cmp(void *instance, request_t *request, UNUSED fr_pair_list_t
 		return -1;
 	}
 
-	if (sscanf(expanded, "%" PRIu64, &counter) != 1) {
-		RDEBUG2("No integer found in string \"%s\"", expanded);
+	if (sscanf(expanded, "%" PRIu64, out) != 1) {
+		RDEBUG2("No integer found in result string \"%s\".  May be first session, setting counter to 0",
+			expanded);
+		*out = 0;
 	}
 	talloc_free(expanded);
 
+	return 0;
+}
+
+static uint32_t sqlcounter_total_hash(void const *data)
+{
+	sqlcounter_total_t const *total = data;
+
+	return fr_hash_string(total->key);
+}
+
+static int8_t sqlcounter_total_cmp(void const *one, void const *two)
+{
+	sqlcounter_total_t const *a = one, *b = two;
+
+	return CMP(strcmp(a->key, b->key), 0);
+}
+
+/** Find or create the running total for a key
+ *
+ * Must be called with the totals locked.  The total is moved to the
+ * head of the LRU list, and the least recently used total is discarded
+ * if there are too many.
+ */
+static sqlcounter_total_t *sqlcounter_total(rlm_sqlcounter_t const *inst, char const *key)
+{
+	sqlcounter_local_t	*local = inst->totals;
+	sqlcounter_total_t	*total, find = { .key = key };
+
+	total = fr_hash_table_find(local->ht, &find);
+	if (total) {
+		fr_dlist_remove(&local->lru, total);
+		fr_dlist_insert_head(&local->lru, total);
+		return total;
+	}
+
+	if (fr_hash_table_num_elements(local->ht) >= inst->local_max_entries) {
+		sqlcounter_total_t *old = fr_dlist_tail(&local->lru);
+
+		fr_dlist_remove(&local->lru, old);
+		fr_hash_table_remove(local->ht, old);
+		talloc_free(old);
+	}
+
+	MEM(total = talloc_zero(local, sqlcounter_total_t));
+	MEM(total->key = talloc_typed_strdup(total, key));
+	fr_dlist_talloc_init(&total->sessions, sqlcounter_session_t, entry);
+	fr_hash_table_insert(local->ht, total);
+	fr_dlist_insert_head(&local->lru, total);
+
+	return total;
+}
+
+/** Get the current value of the counter
+ *
+ * If local totals are enabled, and the total for this key was read
+ * from SQL recently, and in the current period, the query isn't run.
+ */
+static int sqlcounter_value(uint64_t *out, rlm_sqlcounter_t const *inst, request_t *request)
+{
+	sqlcounter_local_t	*local = inst->totals;
+	sqlcounter_total_t	*total;
+	char			*key;
+	fr_time_t		now = fr_time();
+
+	if (!local) return sqlcounter_query(out, inst, request);
+
+	if (tmpl_aexpand(request, &key, request, inst->key, NULL, NULL) < 0) {
+		RPEDEBUG("Failed expanding key");
+		return -1;
+	}
+
+	pthread_mutex_lock(&local->mutex);
+	total = sqlcounter_total(inst, key);
+	if (total->loaded && (total->period == inst->last_reset) &&
+	    ((now - total->loaded) < inst->local_reconcile)) {
+		*out = total->base + total->delta;
+		pthread_mutex_unlock(&local->mutex);
+
+		RDEBUG2("Using running total %" PRIu64 " for \"%s\"", *out, key);
+		talloc_free(key);
+		return 0;
+	}
+	pthread_mutex_unlock(&local->mutex);
+
+	if (sqlcounter_query(out, inst, request) < 0) {
+		talloc_free(key);
+		return -1;
+	}
+
+	/*
+	 *	The query result includes everything accounting
+	 *	has told us about so far.
+	 */
+	pthread_mutex_lock(&local->mutex);
+	total = sqlcounter_total(inst, key);
+	total->base = *out;
+	total->delta = 0;
+	total->loaded = now;
+	total->period = inst->last_reset;
+	pthread_mutex_unlock(&local->mutex);
+
+	talloc_free(key);
+
+	return 0;
+}
+
+/*
+ *	See if the counter matches.
+ */
+static int counter_cmp(void *instance, request_t *request, UNUSED fr_pair_list_t *request_list , fr_pair_t *check)
+{
+	rlm_sqlcounter_t const *inst = talloc_get_type_abort_const(instance, rlm_sqlcounter_t);
+	uint64_t counter;
+
+	if (sqlcounter_value(&counter, inst, request) < 0) return -1;
+
 	if (counter < check->vp_uint64) return -1;
 	if (counter > check->vp_uint64) return 1;
 	return 0;
@@ -394,11 +568,6 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 	char			msg[128];
 	int			ret;
 
-	char query[MAX_QUERY_LEN], subst[MAX_QUERY_LEN];
-	char *expanded = NULL;
-
-	size_t len;
-
 	/*
 	 *	Before doing anything else, see if we have to reset
 	 *	the counters.
@@ -416,32 +585,7 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 		RETURN_MODULE_NOOP;
 	}
 
-	/* First, expand %k, %b and %e in query */
-	if (sqlcounter_expand(subst, sizeof(subst), inst, request, inst->query) <= 0) {
-		REDEBUG("Insufficient query buffer space");
-
-		RETURN_MODULE_FAIL;
-	}
-
-	/* Then combine that with the name of the module were using to do the query */
-	len = snprintf(query, sizeof(query), "%%{%s:%s}", inst->sqlmod_inst, subst);
-	if (len >= (sizeof(query) - 1)) {
-		REDEBUG("Insufficient query buffer space");
-
-		RETURN_MODULE_FAIL;
-	}
-
-	/* Finally, xlat resulting SQL query */
-	if (xlat_aeval(request, &expanded, request, query, NULL, NULL) < 0) {
-		RETURN_MODULE_FAIL;
-	}
-	talloc_free(expanded);
-
-	if (sscanf(expanded, "%" PRIu64, &counter) != 1) {
-		RDEBUG2("No integer found in result string \"%s\".  May be first session, setting counter to 0",
-			expanded);
-		counter = 0;
-	}
+	if (sqlcounter_value(&counter, inst, request) < 0) RETURN_MODULE_FAIL;
 
 	/*
 	 *	Check if check item > counter
@@ -521,6 +665,93 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 	RETURN_MODULE_OK;
 }
 
+/*
+ *	Add accounting data to the running total for the key.
+ *
+ *	The value is the total for the session so far, so only the
+ *	difference from the last value seen for the session is added.
+ */
+static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_sqlcounter_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_sqlcounter_t);
+	sqlcounter_local_t	*local = inst->totals;
+	sqlcounter_total_t	*total;
+	sqlcounter_session_t	*session = NULL;
+	fr_pair_t		*vp;
+	char			*key, *id, *value;
+	uint64_t		num;
+	bool			stop;
+
+	if (!local) RETURN_MODULE_NOOP;
+
+	vp = fr_pair_find_by_da(&request->request_pairs, attr_acct_status_type, 0);
+	if (!vp) RETURN_MODULE_NOOP;
+
+	switch (vp->vp_uint32) {
+	case FR_STATUS_START:
+	case FR_STATUS_ALIVE:
+		stop = false;
+		break;
+
+	case FR_STATUS_STOP:
+		stop = true;
+		break;
+
+	default:
+		RETURN_MODULE_NOOP;
+	}
+
+	if (tmpl_aexpand(request, &key, request, inst->key, NULL, NULL) < 0) {
+		RPEDEBUG("Failed expanding key");
+		RETURN_MODULE_FAIL;
+	}
+	if (tmpl_aexpand(request, &id, request, inst->local_session, NULL, NULL) < 0) {
+		RPEDEBUG("Failed expanding session");
+		RETURN_MODULE_FAIL;
+	}
+	if (tmpl_aexpand(request, &value, request, inst->local_value, NULL, NULL) < 0) {
+		RPEDEBUG("Failed expanding value");
+		RETURN_MODULE_FAIL;
+	}
+
+	if (!*key || !*id) RETURN_MODULE_NOOP;
+
+	if (sscanf(value, "%" PRIu64, &num) != 1) {
+		RWDEBUG("Value \"%s\" is not an integer", value);
+		RETURN_MODULE_NOOP;
+	}
+
+	pthread_mutex_lock(&local->mutex);
+	total = sqlcounter_total(inst, key);
+
+	while ((session = fr_dlist_next(&total->sessions, session))) {
+		if (strcmp(session->id, id) == 0) break;
+	}
+	if (!session) {
+		MEM(session = talloc_zero(total, sqlcounter_session_t));
+		MEM(session->id = talloc_typed_strdup(session, id));
+		fr_dlist_insert_tail(&total->sessions, session);
+	}
+
+	/*
+	 *	The session total only goes down if the NAS
+	 *	restarted it, in which case all of it is new.
+	 */
+	total->delta += (num >= session->last) ? (num - session->last) : num;
+	session->last = num;
+
+	if (stop) {
+		fr_dlist_remove(&total->sessions, session);
+		talloc_free(session);
+	}
+
+	RDEBUG2("Running total for \"%s\" is now %" PRIu64 "%s", key, total->base + total->delta,
+		total->loaded ? "" : " plus the SQL value");
+	pthread_mutex_unlock(&local->mutex);
+
+	RETURN_MODULE_OK;
+}
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -556,6 +787,30 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	if (inst->local) {
+		sqlcounter_local_t *local;
+
+		if (inst->local_max_entries == 0) {
+			cf_log_err(conf, "'max_entries' must be greater than zero");
+			return -1;
+		}
+
+		MEM(local = talloc_zero(inst, sqlcounter_local_t));
+		pthread_mutex_init(&local->mutex, NULL);
+		MEM(local->ht = fr_hash_table_alloc(local, sqlcounter_total_hash, sqlcounter_total_cmp, NULL));
+		fr_dlist_talloc_init(&local->lru, sqlcounter_total_t, lru);
+		inst->totals = local;
+	}
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_sqlcounter_t *inst = talloc_get_type_abort(instance, rlm_sqlcounter_t);
+
+	if (inst->totals) pthread_mutex_destroy(&inst->totals->mutex);
+
 	return 0;
 }
 
@@ -618,8 +873,10 @@ module_t rlm_sqlcounter = {
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
 	.methods = {
-		[MOD_AUTHORIZE]		= mod_authorize
+		[MOD_AUTHORIZE]		= mod_authorize,
+		[MOD_ACCOUNTING]	= mod_accounting
 	},
 };
 
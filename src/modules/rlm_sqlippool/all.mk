@@ -8,7 +8,7 @@ ifneq "${TARGETNAME}" ""
   SUBMAKEFILES	:= 
 endif
 
-SOURCES		:= $(TARGETNAME).c
+SOURCES		:= $(TARGETNAME).c ippool_mem.c
 
 SRC_CFLAGS	:= 
 SRC_CFLAGS	+= -I$(top_builddir)/src/modules/rlm_sql
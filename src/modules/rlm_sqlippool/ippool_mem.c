@@ -0,0 +1,557 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file ippool_mem.c
+ * @brief In-memory IP pools, with changes written back by the caller.
+ *
+ * Each pool keeps its dynamic addresses in a heap ordered by expiry time,
+ * so finding the address which expired longest ago is the same as the
+ * "ORDER BY expiry_time LIMIT 1" of the SQL queries, without any rows
+ * being locked.  Addresses are also indexed by value, and by owner, for
+ * renewals and releases.
+ *
+ * All of the pools share one mutex.  Every operation is a few hash lookups
+ * and at most one heap update, so it's never held for long.
+ *
+ * Whenever a lease changes, the changed callback is called with its new
+ * state, so that it can be written to the database.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/util/heap.h>
+#include <freeradius-devel/util/inet.h>
+
+#include "ippool_mem.h"
+
+#include <pthread.h>
+
+fr_table_num_sorted_t const ippool_mem_status_table[] = {
+	{ L("declined"),	IPPOOL_MEM_STATUS_DECLINED	},
+	{ L("disabled"),	IPPOOL_MEM_STATUS_DISABLED	},
+	{ L("dynamic"),		IPPOOL_MEM_STATUS_DYNAMIC	},
+	{ L("static"),		IPPOOL_MEM_STATUS_STATIC	}
+};
+size_t ippool_mem_status_table_len = NUM_ELEMENTS(ippool_mem_status_table);
+
+typedef struct ippool_mem_pool_s ippool_mem_pool_t;
+
+/** A single address in a pool
+ *
+ */
+typedef struct {
+	ippool_mem_lease_t	pub;		//!< Public state.  Must be first.
+	fr_ipaddr_t		ipaddr;		//!< Parsed address, which we index on.
+	ippool_mem_pool_t	*pool;		//!< Which the address belongs to.
+	int32_t			heap_id;	//!< In the pool's heap of dynamic addresses.
+} ippool_mem_entry_t;
+
+struct ippool_mem_pool_s {
+	char const		*name;		//!< Of the pool.
+	fr_heap_t		*dynamic;	//!< Dynamic addresses, by expiry time.
+	fr_hash_table_t		*by_address;	//!< All addresses.
+	fr_hash_table_t		*by_owner;	//!< Most recently allocated address of each owner.
+};
+
+struct ippool_mem_s {
+	pthread_mutex_t		mutex;		//!< Protects all the pools.
+	fr_hash_table_t		*pools;		//!< By name.
+
+	ippool_mem_changed_t	changed;	//!< Called when a lease changes.
+	void			*uctx;		//!< Passed to changed.
+};
+
+static uint32_t pool_hash(void const *data)
+{
+	return fr_hash_string(((ippool_mem_pool_t const *)data)->name);
+}
+
+static int8_t pool_cmp(void const *a, void const *b)
+{
+	int ret = strcmp(((ippool_mem_pool_t const *)a)->name, ((ippool_mem_pool_t const *)b)->name);
+
+	return CMP(ret, 0);
+}
+
+static uint32_t entry_address_hash(void const *data)
+{
+	fr_ipaddr_t const *ipaddr = &((ippool_mem_entry_t const *)data)->ipaddr;
+
+	if (ipaddr->af == AF_INET) return fr_hash(&ipaddr->addr.v4, sizeof(ipaddr->addr.v4));
+
+	return fr_hash(&ipaddr->addr.v6, sizeof(ipaddr->addr.v6));
+}
+
+static int8_t entry_address_cmp(void const *a, void const *b)
+{
+	return fr_ipaddr_cmp(&((ippool_mem_entry_t const *)a)->ipaddr, &((ippool_mem_entry_t const *)b)->ipaddr);
+}
+
+static uint32_t entry_owner_hash(void const *data)
+{
+	return fr_hash_string(((ippool_mem_entry_t const *)data)->pub.owner);
+}
+
+static int8_t entry_owner_cmp(void const *a, void const *b)
+{
+	int ret = strcmp(((ippool_mem_entry_t const *)a)->pub.owner, ((ippool_mem_entry_t const *)b)->pub.owner);
+
+	return CMP(ret, 0);
+}
+
+static int8_t entry_expires_cmp(void const *a, void const *b)
+{
+	ippool_mem_entry_t const *ea = a, *eb = b;
+
+	return CMP(ea->pub.expires, eb->pub.expires);
+}
+
+static ippool_mem_pool_t *pool_find(ippool_mem_t *mem, char const *name)
+{
+	ippool_mem_pool_t find = { .name = name };
+
+	return fr_hash_table_find(mem->pools, &find);
+}
+
+static ippool_mem_pool_t *pool_find_or_create(ippool_mem_t *mem, char const *name)
+{
+	ippool_mem_pool_t *pool;
+
+	pool = pool_find(mem, name);
+	if (pool) return pool;
+
+	MEM(pool = talloc_zero(mem, ippool_mem_pool_t));
+	MEM(pool->name = talloc_typed_strdup(pool, name));
+	MEM(pool->dynamic = fr_heap_talloc_alloc(pool, entry_expires_cmp, ippool_mem_entry_t, heap_id));
+	MEM(pool->by_address = fr_hash_table_alloc(pool, entry_address_hash, entry_address_cmp, NULL));
+	MEM(pool->by_owner = fr_hash_table_alloc(pool, entry_owner_hash, entry_owner_cmp, NULL));
+
+	if (!fr_hash_table_insert(mem->pools, pool)) {
+		talloc_free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+static ippool_mem_entry_t *entry_find(ippool_mem_pool_t *pool, char const *address)
+{
+	ippool_mem_entry_t find;
+
+	if (!address || !*address) return NULL;
+
+	if (fr_inet_pton(&find.ipaddr, address, -1, AF_UNSPEC, false, true) < 0) return NULL;
+
+	return fr_hash_table_find(pool->by_address, &find);
+}
+
+static ippool_mem_entry_t *entry_find_by_owner(ippool_mem_pool_t *pool, char const *owner)
+{
+	ippool_mem_entry_t find = { .pub.owner = owner };
+
+	if (!owner || !*owner) return NULL;
+
+	return fr_hash_table_find(pool->by_owner, &find);
+}
+
+/** Change the owner and gateway of an address
+ *
+ */
+static void entry_set_owner(ippool_mem_entry_t *entry, char const *owner, char const *gateway)
+{
+	ippool_mem_pool_t *pool = entry->pool;
+
+	if (entry->pub.owner) {
+		if (fr_hash_table_find(pool->by_owner, entry) == entry) fr_hash_table_remove(pool->by_owner, entry);
+		talloc_const_free(entry->pub.owner);
+		entry->pub.owner = NULL;
+	}
+
+	if (entry->pub.gateway) {
+		talloc_const_free(entry->pub.gateway);
+		entry->pub.gateway = NULL;
+	}
+
+	if (owner && *owner) {
+		void *old;
+
+		MEM(entry->pub.owner = talloc_typed_strdup(entry, owner));
+		(void) fr_hash_table_replace(&old, pool->by_owner, entry);
+	}
+
+	if (gateway && *gateway) MEM(entry->pub.gateway = talloc_typed_strdup(entry, gateway));
+}
+
+/** Change when an address expires, keeping the heap in order
+ *
+ */
+static void entry_set_expires(ippool_mem_entry_t *entry, time_t expires)
+{
+	if (fr_heap_entry_inserted(entry->heap_id)) (void) fr_heap_extract(entry->pool->dynamic, entry);
+
+	entry->pub.expires = expires;
+
+	if (entry->pub.status == IPPOOL_MEM_STATUS_DYNAMIC) (void) fr_heap_insert(entry->pool->dynamic, entry);
+}
+
+static inline void entry_changed(ippool_mem_t *mem, ippool_mem_entry_t *entry)
+{
+	if (mem->changed) mem->changed(&entry->pub, mem->uctx);
+}
+
+/** Does the address belong to the owner?
+ *
+ */
+static inline bool entry_owned_by(ippool_mem_entry_t const *entry, char const *owner)
+{
+	if (!entry->pub.owner) return false;
+	if (!owner) return false;
+
+	return (strcmp(entry->pub.owner, owner) == 0);
+}
+
+static int _ippool_mem_free(ippool_mem_t *mem)
+{
+	pthread_mutex_destroy(&mem->mutex);
+
+	return 0;
+}
+
+/** Allocate an empty set of pools
+ *
+ * @param[in] ctx	to allocate the pools in.
+ * @param[in] changed	called whenever a lease changes.  May be NULL.
+ * @param[in] uctx	passed to changed.
+ */
+ippool_mem_t *ippool_mem_alloc(TALLOC_CTX *ctx, ippool_mem_changed_t changed, void *uctx)
+{
+	ippool_mem_t *mem;
+
+	MEM(mem = talloc_zero(ctx, ippool_mem_t));
+	MEM(mem->pools = fr_hash_table_alloc(mem, pool_hash, pool_cmp, NULL));
+	mem->changed = changed;
+	mem->uctx = uctx;
+
+	pthread_mutex_init(&mem->mutex, NULL);
+	talloc_set_destructor(mem, _ippool_mem_free);
+
+	return mem;
+}
+
+/** Add an address, as read from the database
+ *
+ * The changed callback isn't called.
+ *
+ * @param[in] mem	to add the address to.
+ * @param[in] lease	its current state.  The pool is created if necessary.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the address is invalid, or already in the pool.
+ */
+int ippool_mem_add(ippool_mem_t *mem, ippool_mem_lease_t const *lease)
+{
+	ippool_mem_pool_t	*pool;
+	ippool_mem_entry_t	*entry, *existing;
+	int			ret = -1;
+
+	pthread_mutex_lock(&mem->mutex);
+
+	pool = pool_find_or_create(mem, lease->pool);
+	if (!pool) {
+		fr_strerror_printf("Failed creating pool %s", lease->pool);
+		goto done;
+	}
+
+	MEM(entry = talloc_zero(pool, ippool_mem_entry_t));
+	entry->pool = pool;
+	entry->heap_id = -1;
+	entry->pub.pool = pool->name;
+	entry->pub.status = lease->status;
+
+	if (fr_inet_pton(&entry->ipaddr, lease->address, -1, AF_UNSPEC, false, true) < 0) {
+		fr_strerror_printf_push("Invalid address in pool %s", pool->name);
+	error:
+		talloc_free(entry);
+		goto done;
+	}
+	MEM(entry->pub.address = talloc_typed_strdup(entry, lease->address));
+
+	if (!fr_hash_table_insert(pool->by_address, entry)) {
+		fr_strerror_printf("Duplicate address %s in pool %s", lease->address, pool->name);
+		goto error;
+	}
+
+	/*
+	 *	If the owner has several addresses, the one
+	 *	expiring last is its current one.
+	 */
+	if (lease->owner && *lease->owner) {
+		MEM(entry->pub.owner = talloc_typed_strdup(entry, lease->owner));
+
+		existing = fr_hash_table_find(pool->by_owner, entry);
+		if (!existing) {
+			fr_hash_table_insert(pool->by_owner, entry);
+		} else if (existing->pub.expires < lease->expires) {
+			void *old;
+
+			(void) fr_hash_table_replace(&old, pool->by_owner, entry);
+		}
+	}
+	if (lease->gateway && *lease->gateway) MEM(entry->pub.gateway = talloc_typed_strdup(entry, lease->gateway));
+
+	entry_set_expires(entry, lease->expires);
+	ret = 0;
+
+done:
+	pthread_mutex_unlock(&mem->mutex);
+
+	return ret;
+}
+
+/** Allocate an address to an owner
+ *
+ * The same addresses are chosen as the default SQL queries would choose:
+ * the owner's existing address, then the requested address if it's free,
+ * then the dynamic address which expired longest ago.
+ *
+ * @param[out] out		Where to write the address.
+ * @param[in] outlen		Length of out.
+ * @param[in] mem		pools.
+ * @param[in] name		of the pool to allocate from.
+ * @param[in] owner		of the lease.
+ * @param[in] gateway		the owner is behind.
+ * @param[in] requested		address, may be NULL.
+ * @param[in] now		current time.
+ * @param[in] duration		of the lease.
+ * @return
+ *	- IPPOOL_MEM_OK if an address was allocated.
+ *	- IPPOOL_MEM_POOL_FULL if no addresses are free.
+ *	- IPPOOL_MEM_NO_POOL if there's no such pool.
+ */
+ippool_mem_rcode_t ippool_mem_allocate(char *out, size_t outlen, ippool_mem_t *mem,
+				       char const *name, char const *owner, char const *gateway,
+				       char const *requested, time_t now, uint32_t duration)
+{
+	ippool_mem_pool_t	*pool;
+	ippool_mem_entry_t	*entry;
+	ippool_mem_rcode_t	rcode = IPPOOL_MEM_OK;
+
+	pthread_mutex_lock(&mem->mutex);
+
+	pool = pool_find(mem, name);
+	if (!pool) {
+		rcode = IPPOOL_MEM_NO_POOL;
+		goto done;
+	}
+
+	entry = entry_find_by_owner(pool, owner);
+	if (entry && ((entry->pub.status == IPPOOL_MEM_STATUS_DYNAMIC) ||
+		      (entry->pub.status == IPPOOL_MEM_STATUS_STATIC))) goto allocate;
+
+	entry = entry_find(pool, requested);
+	if (entry && (entry->pub.status == IPPOOL_MEM_STATUS_DYNAMIC) && (entry->pub.expires < now)) goto allocate;
+
+	entry = fr_heap_peek(pool->dynamic);
+	if (!entry || (entry->pub.expires >= now)) {
+		rcode = IPPOOL_MEM_POOL_FULL;
+		goto done;
+	}
+
+allocate:
+	entry_set_owner(entry, owner, gateway);
+	entry_set_expires(entry, now + duration);
+	entry_changed(mem, entry);
+
+	strlcpy(out, entry->pub.address, outlen);
+
+done:
+	pthread_mutex_unlock(&mem->mutex);
+
+	return rcode;
+}
+
+/** Extend the lease an owner has on an address
+ *
+ * Any other unexpired addresses the owner was offered are freed.
+ *
+ * @return
+ *	- IPPOOL_MEM_OK if the lease was extended.
+ *	- IPPOOL_MEM_NOTFOUND if the owner doesn't have the address.
+ *	- IPPOOL_MEM_NO_POOL if there's no such pool.
+ */
+ippool_mem_rcode_t ippool_mem_update(ippool_mem_t *mem, char const *name, char const *owner,
+				     char const *address, time_t now, uint32_t duration)
+{
+	ippool_mem_pool_t	*pool;
+	ippool_mem_entry_t	*entry, *offered;
+	ippool_mem_rcode_t	rcode = IPPOOL_MEM_NOTFOUND;
+
+	pthread_mutex_lock(&mem->mutex);
+
+	pool = pool_find(mem, name);
+	if (!pool) {
+		rcode = IPPOOL_MEM_NO_POOL;
+		goto done;
+	}
+
+	entry = entry_find(pool, address);
+
+	offered = entry_find_by_owner(pool, owner);
+	if (offered && (offered != entry) && (offered->pub.expires > now) &&
+	    (offered->pub.status == IPPOOL_MEM_STATUS_DYNAMIC)) {
+		entry_set_owner(offered, NULL, NULL);
+		entry_set_expires(offered, now);
+		entry_changed(mem, offered);
+	}
+
+	if (!entry || !entry_owned_by(entry, owner)) goto done;
+
+	/*
+	 *	Re-index the entry, as it may have been an older
+	 *	address of the owner's.
+	 */
+	if (fr_hash_table_find(pool->by_owner, entry) != entry) {
+		void *old;
+
+		(void) fr_hash_table_replace(&old, pool->by_owner, entry);
+	}
+	entry_set_expires(entry, now + duration);
+	entry_changed(mem, entry);
+	rcode = IPPOOL_MEM_OK;
+
+done:
+	pthread_mutex_unlock(&mem->mutex);
+
+	return rcode;
+}
+
+/** Free an address
+ *
+ * @return
+ *	- IPPOOL_MEM_OK if the address was freed.
+ *	- IPPOOL_MEM_NOTFOUND if the owner doesn't have the address.
+ *	- IPPOOL_MEM_NO_POOL if there's no such pool.
+ */
+ippool_mem_rcode_t ippool_mem_release(ippool_mem_t *mem, char const *name, char const *owner,
+				      char const *address, time_t now)
+{
+	ippool_mem_pool_t	*pool;
+	ippool_mem_entry_t	*entry;
+	ippool_mem_rcode_t	rcode = IPPOOL_MEM_NOTFOUND;
+
+	pthread_mutex_lock(&mem->mutex);
+
+	pool = pool_find(mem, name);
+	if (!pool) {
+		rcode = IPPOOL_MEM_NO_POOL;
+		goto done;
+	}
+
+	entry = entry_find(pool, address);
+	if (!entry || !entry_owned_by(entry, owner)) goto done;
+
+	entry_set_owner(entry, NULL, NULL);
+	entry_set_expires(entry, now);
+	entry_changed(mem, entry);
+	rcode = IPPOOL_MEM_OK;
+
+done:
+	pthread_mutex_unlock(&mem->mutex);
+
+	return rcode;
+}
+
+/** Free all addresses allocated to owners behind a gateway
+ *
+ * This walks the whole pool, but is only done when a NAS restarts.
+ *
+ * @return
+ *	- IPPOOL_MEM_OK if any addresses were freed.
+ *	- IPPOOL_MEM_NOTFOUND if none were.
+ *	- IPPOOL_MEM_NO_POOL if there's no such pool.
+ */
+ippool_mem_rcode_t ippool_mem_bulk_release(ippool_mem_t *mem, char const *name, char const *gateway, time_t now)
+{
+	ippool_mem_pool_t	*pool;
+	ippool_mem_entry_t	*entry;
+	fr_hash_iter_t		iter;
+	ippool_mem_rcode_t	rcode = IPPOOL_MEM_NOTFOUND;
+
+	if (!gateway || !*gateway) return IPPOOL_MEM_NOTFOUND;
+
+	pthread_mutex_lock(&mem->mutex);
+
+	pool = pool_find(mem, name);
+	if (!pool) {
+		rcode = IPPOOL_MEM_NO_POOL;
+		goto done;
+	}
+
+	for (entry = fr_hash_table_iter_init(pool->by_address, &iter);
+	     entry;
+	     entry = fr_hash_table_iter_next(pool->by_address, &iter)) {
+		if (!entry->pub.gateway || (strcmp(entry->pub.gateway, gateway) != 0)) continue;
+
+		entry_set_owner(entry, NULL, NULL);
+		entry_set_expires(entry, now);
+		entry_changed(mem, entry);
+		rcode = IPPOOL_MEM_OK;
+	}
+
+done:
+	pthread_mutex_unlock(&mem->mutex);
+
+	return rcode;
+}
+
+/** Mark an address as declined, so it's never allocated again
+ *
+ * @return
+ *	- IPPOOL_MEM_OK if the address was marked.
+ *	- IPPOOL_MEM_NOTFOUND if the owner doesn't have the address.
+ *	- IPPOOL_MEM_NO_POOL if there's no such pool.
+ */
+ippool_mem_rcode_t ippool_mem_mark(ippool_mem_t *mem, char const *name, char const *owner, char const *address)
+{
+	ippool_mem_pool_t	*pool;
+	ippool_mem_entry_t	*entry;
+	ippool_mem_rcode_t	rcode = IPPOOL_MEM_NOTFOUND;
+
+	pthread_mutex_lock(&mem->mutex);
+
+	pool = pool_find(mem, name);
+	if (!pool) {
+		rcode = IPPOOL_MEM_NO_POOL;
+		goto done;
+	}
+
+	entry = entry_find(pool, address);
+	if (!entry || !entry_owned_by(entry, owner)) goto done;
+
+	entry->pub.status = IPPOOL_MEM_STATUS_DECLINED;
+	entry_set_expires(entry, entry->pub.expires);	/* Removes it from the heap */
+	entry_changed(mem, entry);
+	rcode = IPPOOL_MEM_OK;
+
+done:
+	pthread_mutex_unlock(&mem->mutex);
+
+	return rcode;
+}
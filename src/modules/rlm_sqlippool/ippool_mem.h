@@ -0,0 +1,90 @@
+#pragma once
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file ippool_mem.h
+ * @brief In-memory IP pools, with changes written back by the caller.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(ippool_mem_h, "$Id$")
+
+#include <freeradius-devel/util/table.h>
+#include <freeradius-devel/util/talloc.h>
+
+/** Status of an address, matching the status column of the pool table
+ *
+ */
+typedef enum {
+	IPPOOL_MEM_STATUS_DYNAMIC = 0,		//!< Allocated to owners as needed.
+	IPPOOL_MEM_STATUS_STATIC,		//!< Only ever allocated to its existing owner.
+	IPPOOL_MEM_STATUS_DECLINED,		//!< Marked as in use by something else.
+	IPPOOL_MEM_STATUS_DISABLED		//!< Never allocated.
+} ippool_mem_status_t;
+
+extern fr_table_num_sorted_t const ippool_mem_status_table[];
+extern size_t ippool_mem_status_table_len;
+
+/** Result of an operation on the pools
+ *
+ */
+typedef enum {
+	IPPOOL_MEM_OK = 0,			//!< The lease was allocated or changed.
+	IPPOOL_MEM_NOTFOUND,			//!< No lease matched.
+	IPPOOL_MEM_POOL_FULL,			//!< The pool exists, but has no free addresses.
+	IPPOOL_MEM_NO_POOL			//!< There's no pool with that name.
+} ippool_mem_rcode_t;
+
+/** The current state of a lease, as it should be written to the database
+ *
+ */
+typedef struct {
+	char const		*pool;		//!< Name of the pool.
+	char const		*address;	//!< As it's stored in the database.
+	char const		*owner;		//!< Or NULL if the address is free.
+	char const		*gateway;	//!< Or NULL if the address is free.
+	time_t			expires;	//!< When the lease expires.
+	ippool_mem_status_t	status;
+} ippool_mem_lease_t;
+
+/** Called, with the pools locked, whenever a lease changes
+ *
+ * @param[in] lease	which changed.  Only valid for the duration of the call.
+ * @param[in] uctx	passed to #ippool_mem_alloc.
+ */
+typedef void (*ippool_mem_changed_t)(ippool_mem_lease_t const *lease, void *uctx);
+
+typedef struct ippool_mem_s ippool_mem_t;
+
+ippool_mem_t		*ippool_mem_alloc(TALLOC_CTX *ctx, ippool_mem_changed_t changed, void *uctx);
+
+int			ippool_mem_add(ippool_mem_t *mem, ippool_mem_lease_t const *lease);
+
+ippool_mem_rcode_t	ippool_mem_allocate(char *out, size_t outlen, ippool_mem_t *mem,
+					    char const *pool, char const *owner, char const *gateway,
+					    char const *requested, time_t now, uint32_t duration);
+
+ippool_mem_rcode_t	ippool_mem_update(ippool_mem_t *mem, char const *pool, char const *owner,
+					  char const *address, time_t now, uint32_t duration);
+
+ippool_mem_rcode_t	ippool_mem_release(ippool_mem_t *mem, char const *pool, char const *owner,
+					   char const *address, time_t now);
+
+ippool_mem_rcode_t	ippool_mem_bulk_release(ippool_mem_t *mem, char const *pool, char const *gateway, time_t now);
+
+ippool_mem_rcode_t	ippool_mem_mark(ippool_mem_t *mem, char const *pool, char const *owner, char const *address);
@@ -33,10 +33,18 @@ RCSID("$Id$")
 #include <freeradius-devel/radius/radius.h>
 
 #include <ctype.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
+#include "ippool_mem.h"
 
 #define MAX_QUERY_LEN 4096
 
+typedef struct sqlippool_writer_s sqlippool_writer_t;
+
 /*
  *	Define a structure for our module configuration.
  */
@@ -93,8 +101,73 @@ typedef struct {
 						/* Reserved to handle 255.255.255.254 Requests */
 	char const	*defaultpool;		//!< Default Pool-Name if there is none in the check items.
 
+						/* In-memory pools */
+	bool		memory;			//!< Allocate from memory, and write changes behind.
+	tmpl_t		*memory_owner;		//!< Expansion identifying the owner of a lease.
+	tmpl_t		*memory_gateway;	//!< Expansion identifying the gateway.
+	uint32_t	offer_duration;		//!< How long an allocated address is held for.
+	char const	*memory_journal;	//!< Where changes are recorded until they're written.
+	char const	*memory_load;		//!< SQL query to read every address in every pool.
+	char const	*memory_write;		//!< SQL query to write the state of one address.
+
+	ippool_mem_t	*mem;			//!< The pools, if allocating from memory.
+	sqlippool_writer_t *writer;		//!< Writes changes to the pools back to SQL.
 } rlm_sqlippool_t;
 
+typedef struct {
+	rlm_sqlippool_t		*inst;		//!< Instance data, for thread_detach.
+} rlm_sqlippool_thread_t;
+
+/** A change to a lease, waiting to be written to the database
+ *
+ * Only the latest state of each address is queued, so an address
+ * which changes several times while the database is slow is only
+ * written once.
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< In the writer's queue.
+	ippool_mem_lease_t	lease;		//!< Strings are allocated in this struct.
+} sqlippool_write_t;
+
+/** Writes changes to the in-memory pools back to SQL, in the background
+ *
+ */
+struct sqlippool_writer_s {
+	rlm_sqlippool_t const	*inst;
+
+	pthread_mutex_t		mutex;		//!< Protects everything below.
+	pthread_cond_t		cond;		//!< Signalled when there's work, or on shutdown.
+
+	fr_dlist_head_t		queue;		//!< Of sqlippool_write_t, oldest first.
+	fr_hash_table_t		*pending;	//!< Queued writes by pool and address.
+
+	int			journal_fd;	//!< Every change is appended here, until the
+						///< queue is empty.  -1 if there's no journal.
+
+	bool			started;	//!< The pools have been loaded, and the
+						///< writer thread is running.
+	bool			shutdown;	//!< Tell the writer thread to exit.
+	pthread_t		thread;
+};
+
+/** Journal record header, followed by the pool, address, owner and gateway
+ *
+ */
+typedef struct {
+	int64_t			expires;
+	uint32_t		status;
+	uint16_t		len[4];
+} sqlippool_journal_t;
+
+static CONF_PARSER memory_config[] = {
+	{ FR_CONF_OFFSET("enable", FR_TYPE_BOOL, rlm_sqlippool_t, memory), .dflt = "no" },
+	{ FR_CONF_OFFSET("owner", FR_TYPE_TMPL, rlm_sqlippool_t, memory_owner) },
+	{ FR_CONF_OFFSET("gateway", FR_TYPE_TMPL, rlm_sqlippool_t, memory_gateway) },
+	{ FR_CONF_OFFSET("offer_duration", FR_TYPE_UINT32, rlm_sqlippool_t, offer_duration), .dflt = "10" },
+	{ FR_CONF_OFFSET("journal", FR_TYPE_STRING, rlm_sqlippool_t, memory_journal) },
+	CONF_PARSER_TERMINATOR
+};
+
 static CONF_PARSER message_config[] = {
 	{ FR_CONF_OFFSET("exists", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, log_exists) },
 	{ FR_CONF_OFFSET("success", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, log_success) },
@@ -164,7 +237,13 @@ static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("mark_commit", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, mark_commit) },
 
 
+	{ FR_CONF_OFFSET("memory_load", FR_TYPE_STRING, rlm_sqlippool_t, memory_load) },
+
+	{ FR_CONF_OFFSET("memory_write", FR_TYPE_STRING, rlm_sqlippool_t, memory_write) },
+
+
 	{ FR_CONF_POINTER("messages", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) message_config },
+	{ FR_CONF_POINTER("memory", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) memory_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -372,13 +451,17 @@ static int CC_HINT(nonnull (1, 3, 4, 5)) sqlippool_query1(char *out, int outlen,
 		goto finish;
 	}
 
+	/*
+	 *	No rows, or a NULL from a stored procedure, both
+	 *	mean nothing was found.
+	 */
 	if (!row) {
-		REDEBUG("SQL query did not return any results");
+		RDEBUG2("SQL query did not return any results");
 		goto finish;
 	}
 
 	if (!row[0]) {
-		REDEBUG("The first column of the result was NULL");
+		RDEBUG2("The first column of the result was NULL");
 		goto finish;
 	}
 
@@ -397,6 +480,471 @@ finish:
 	return retval;
 }
 
+/*
+ *	Replace %<whatever> in a query which writes back a lease.
+ *
+ *	%P	pool name
+ *	%I	address
+ *	%O	owner
+ *	%G	gateway
+ *	%E	expiry time, in seconds since the epoch
+ *	%S	status
+ *
+ *	Values are escaped with the SQL module's escape function.
+ */
+static void sqlippool_write_expand(char *out, size_t outlen, char const *fmt, ippool_mem_lease_t const *lease,
+				   rlm_sqlippool_t const *inst, rlm_sql_handle_t *handle)
+{
+	char const	*p;
+	char		*q = out, *end = out + outlen - 1;
+	char		tmp[40];
+
+	for (p = fmt; *p && (q < end); p++) {
+		char const *in;
+
+		if ((p[0] != '%') || !p[1]) {
+			*q++ = *p;
+			continue;
+		}
+
+		switch (*++p) {
+		case 'P':
+			in = lease->pool;
+			break;
+
+		case 'I':
+			in = lease->address;
+			break;
+
+		case 'O':
+			in = lease->owner ? lease->owner : "";
+			break;
+
+		case 'G':
+			in = lease->gateway ? lease->gateway : "";
+			break;
+
+		case 'E':
+			snprintf(tmp, sizeof(tmp), "%" PRId64, (int64_t)lease->expires);
+			in = tmp;
+			break;
+
+		case 'S':
+			in = fr_table_str_by_value(ippool_mem_status_table, lease->status, "dynamic");
+			break;
+
+		default:
+			*q++ = '%';
+			if (q < end) *q++ = *p;
+			continue;
+		}
+
+		q += inst->sql_inst->sql_escape_func(NULL, q, (end - q) + 1, in, handle);
+	}
+	*q = '\0';
+}
+
+static uint32_t sqlippool_write_hash(void const *data)
+{
+	sqlippool_write_t const *w = data;
+
+	return fr_hash_update(w->lease.address, strlen(w->lease.address), fr_hash_string(w->lease.pool));
+}
+
+static int8_t sqlippool_write_cmp(void const *one, void const *two)
+{
+	sqlippool_write_t const *a = one, *b = two;
+	int ret;
+
+	ret = strcmp(a->lease.address, b->lease.address);
+	if (ret != 0) return CMP(ret, 0);
+
+	return CMP(strcmp(a->lease.pool, b->lease.pool), 0);
+}
+
+/** Queue the current state of a lease to be written
+ *
+ * Must be called with the writer locked.
+ */
+static void sqlippool_writer_enqueue(sqlippool_writer_t *writer, ippool_mem_lease_t const *lease)
+{
+	sqlippool_write_t	*w, find;
+
+	find.lease.pool = lease->pool;
+	find.lease.address = lease->address;
+
+	w = fr_hash_table_find(writer->pending, &find);
+	if (w) {
+		talloc_const_free(w->lease.owner);
+		talloc_const_free(w->lease.gateway);
+	} else {
+		MEM(w = talloc_zero(NULL, sqlippool_write_t));
+		MEM(w->lease.pool = talloc_typed_strdup(w, lease->pool));
+		MEM(w->lease.address = talloc_typed_strdup(w, lease->address));
+		fr_hash_table_insert(writer->pending, w);
+		fr_dlist_insert_tail(&writer->queue, w);
+	}
+
+	w->lease.owner = lease->owner ? talloc_typed_strdup(w, lease->owner) : NULL;
+	w->lease.gateway = lease->gateway ? talloc_typed_strdup(w, lease->gateway) : NULL;
+	w->lease.expires = lease->expires;
+	w->lease.status = lease->status;
+
+	pthread_cond_signal(&writer->cond);
+}
+
+/** Take every queued write
+ *
+ * Must be called with the writer locked.
+ */
+static void sqlippool_writer_take(fr_dlist_head_t *batch, sqlippool_writer_t *writer)
+{
+	sqlippool_write_t *w = NULL;
+
+	while ((w = fr_dlist_next(&writer->queue, w))) fr_hash_table_remove(writer->pending, w);
+
+	fr_dlist_move(batch, &writer->queue);
+}
+
+/** Put writes which failed back at the head of the queue
+ *
+ * Writes for addresses which have changed again since are discarded.
+ * Must be called with the writer locked.
+ */
+static void sqlippool_writer_requeue(sqlippool_writer_t *writer, fr_dlist_head_t *batch)
+{
+	sqlippool_write_t *w;
+
+	while ((w = fr_dlist_pop_tail(batch))) {
+		if (fr_hash_table_find(writer->pending, w)) {
+			talloc_free(w);
+			continue;
+		}
+
+		fr_hash_table_insert(writer->pending, w);
+		fr_dlist_insert_head(&writer->queue, w);
+	}
+}
+
+/** Write a batch of lease changes to the database
+ *
+ * Writes are removed from the batch as they succeed.
+ *
+ * @return
+ *	- 0 if everything was written.
+ *	- -1 on error, with what's left in the batch.
+ */
+static int sqlippool_writer_flush(sqlippool_writer_t *writer, fr_dlist_head_t *batch)
+{
+	rlm_sqlippool_t const	*inst = writer->inst;
+	rlm_sql_handle_t	*handle;
+	sqlippool_write_t	*w;
+
+	handle = fr_pool_connection_get(inst->sql_inst->pool, NULL);
+	if (!handle) {
+		ERROR("Failed reserving SQL connection to write %zu lease changes", fr_dlist_num_elements(batch));
+		return -1;
+	}
+
+	while ((w = fr_dlist_head(batch))) {
+		char query[MAX_QUERY_LEN];
+
+		sqlippool_write_expand(query, sizeof(query), inst->memory_write, &w->lease, inst, handle);
+
+		if ((inst->sql_inst->sql_query(inst->sql_inst, NULL, &handle, query) < 0) || !handle) {
+			ERROR("Failed writing address %s in pool %s", w->lease.address, w->lease.pool);
+			if (handle) fr_pool_connection_release(inst->sql_inst->pool, NULL, handle);
+			return -1;
+		}
+		(inst->sql_inst->driver->sql_finish_query)(handle, inst->sql_inst->config);
+
+		fr_dlist_remove(batch, w);
+		talloc_free(w);
+	}
+
+	fr_pool_connection_release(inst->sql_inst->pool, NULL, handle);
+
+	return 0;
+}
+
+/** Append the new state of a lease to the journal
+ *
+ * Must be called with the writer locked.
+ */
+static void sqlippool_journal_append(sqlippool_writer_t *writer, ippool_mem_lease_t const *lease)
+{
+	rlm_sqlippool_t const	*inst = writer->inst;
+	sqlippool_journal_t	hdr;
+	char const		*str[4] = { lease->pool, lease->address, lease->owner, lease->gateway };
+	struct iovec		iov[5];
+	size_t			i, total;
+
+	if (writer->journal_fd < 0) return;
+
+	hdr = (sqlippool_journal_t) {
+		.expires = lease->expires,
+		.status = lease->status
+	};
+	iov[0] = (struct iovec) { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+	total = sizeof(hdr);
+
+	for (i = 0; i < NUM_ELEMENTS(str); i++) {
+		size_t len = str[i] ? strlen(str[i]) : 0;
+
+		if (len > UINT16_MAX) {
+			ERROR("Not journalling address %s in pool %s, values are too long", lease->address, lease->pool);
+			return;
+		}
+		hdr.len[i] = len;
+		iov[i + 1] = (struct iovec) { .iov_base = UNCONST(char *, str[i]), .iov_len = len };
+		total += len;
+	}
+
+	if (writev(writer->journal_fd, iov, NUM_ELEMENTS(iov)) != (ssize_t)total) {
+		ERROR("Failed writing to journal %s: %s", inst->memory_journal, fr_syserror(errno));
+	}
+}
+
+/** Queue every change recorded in the journal
+ *
+ * A truncated record at the end of the journal (from a crash part way
+ * through writing it) is ignored.
+ *
+ * Must be called with the writer locked.
+ */
+static int sqlippool_journal_replay(sqlippool_writer_t *writer)
+{
+	rlm_sqlippool_t const	*inst = writer->inst;
+	struct stat		st;
+	uint8_t			*buff, *p, *end;
+	ssize_t			len;
+	unsigned int		count = 0;
+
+	if (writer->journal_fd < 0) return 0;
+
+	if (fstat(writer->journal_fd, &st) < 0) {
+		ERROR("Failed reading journal %s: %s", inst->memory_journal, fr_syserror(errno));
+		return -1;
+	}
+	if (st.st_size == 0) return 0;
+
+	MEM(buff = talloc_array(NULL, uint8_t, st.st_size));
+	len = pread(writer->journal_fd, buff, st.st_size, 0);
+	if (len < 0) {
+		ERROR("Failed reading journal %s: %s", inst->memory_journal, fr_syserror(errno));
+		talloc_free(buff);
+		return -1;
+	}
+
+	p = buff;
+	end = buff + len;
+	while ((size_t)(end - p) >= sizeof(sqlippool_journal_t)) {
+		sqlippool_journal_t	hdr;
+		ippool_mem_lease_t	lease;
+		char			*str[4];
+		size_t			i, need = 0;
+
+		memcpy(&hdr, p, sizeof(hdr));
+		for (i = 0; i < NUM_ELEMENTS(str); i++) need += hdr.len[i];
+		if ((size_t)(end - p) < (sizeof(hdr) + need)) break;
+		p += sizeof(hdr);
+
+		for (i = 0; i < NUM_ELEMENTS(str); i++) {
+			MEM(str[i] = talloc_bstrndup(buff, (char const *)p, hdr.len[i]));
+			p += hdr.len[i];
+		}
+
+		lease = (ippool_mem_lease_t) {
+			.pool = str[0],
+			.address = str[1],
+			.owner = *str[2] ? str[2] : NULL,
+			.gateway = *str[3] ? str[3] : NULL,
+			.expires = hdr.expires,
+			.status = hdr.status
+		};
+		sqlippool_writer_enqueue(writer, &lease);
+		count++;
+	}
+	talloc_free(buff);
+
+	if (count) INFO("Replaying %u lease changes from journal %s", count, inst->memory_journal);
+
+	return 0;
+}
+
+/** Called by the pools, with them locked, whenever a lease changes
+ *
+ */
+static void sqlippool_memory_changed(ippool_mem_lease_t const *lease, void *uctx)
+{
+	sqlippool_writer_t *writer = talloc_get_type_abort(uctx, sqlippool_writer_t);
+
+	pthread_mutex_lock(&writer->mutex);
+	sqlippool_journal_append(writer, lease);
+	sqlippool_writer_enqueue(writer, lease);
+	pthread_mutex_unlock(&writer->mutex);
+}
+
+static void *sqlippool_writer_thread(void *arg)
+{
+	sqlippool_writer_t	*writer = talloc_get_type_abort(arg, sqlippool_writer_t);
+	rlm_sqlippool_t const	*inst = writer->inst;
+	sigset_t		sigset;
+
+	/*
+	 *	Signals are handled by the main thread only.
+	 */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+	pthread_mutex_lock(&writer->mutex);
+	for (;;) {
+		fr_dlist_head_t	batch;
+		int		ret;
+
+		while (!writer->shutdown && (fr_dlist_num_elements(&writer->queue) == 0)) {
+			pthread_cond_wait(&writer->cond, &writer->mutex);
+		}
+		if (fr_dlist_num_elements(&writer->queue) == 0) break;
+
+		fr_dlist_talloc_init(&batch, sqlippool_write_t, entry);
+		sqlippool_writer_take(&batch, writer);
+		pthread_mutex_unlock(&writer->mutex);
+
+		/*
+		 *	Bound what's lost if we crash before the
+		 *	database has the changes.
+		 */
+		if (writer->journal_fd >= 0) (void) fdatasync(writer->journal_fd);
+
+		ret = sqlippool_writer_flush(writer, &batch);
+
+		pthread_mutex_lock(&writer->mutex);
+		if (ret < 0) {
+			struct timespec ts;
+
+			sqlippool_writer_requeue(writer, &batch);
+
+			/*
+			 *	Whatever's left is still in the journal,
+			 *	and will be written on the next start.
+			 */
+			if (writer->shutdown) {
+				ERROR("Exiting with %zu lease changes not written to the database",
+				      fr_dlist_num_elements(&writer->queue));
+				break;
+			}
+
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += 1;
+			pthread_cond_timedwait(&writer->cond, &writer->mutex, &ts);
+			continue;
+		}
+
+		/*
+		 *	Everything in the journal is in the database.
+		 */
+		if ((fr_dlist_num_elements(&writer->queue) == 0) && (writer->journal_fd >= 0) &&
+		    (ftruncate(writer->journal_fd, 0) < 0)) {
+			ERROR("Failed truncating journal %s: %s", inst->memory_journal, fr_syserror(errno));
+		}
+	}
+	pthread_mutex_unlock(&writer->mutex);
+
+	return NULL;
+}
+
+/** Read every address from the database into the pools
+ *
+ */
+static int sqlippool_memory_load(rlm_sqlippool_t *inst)
+{
+	rlm_sql_handle_t	*handle;
+	rlm_sql_row_t		row;
+	unsigned int		count = 0;
+
+	handle = fr_pool_connection_get(inst->sql_inst->pool, NULL);
+	if (!handle) {
+		ERROR("Failed reserving SQL connection to load pools");
+		return -1;
+	}
+
+	if ((inst->sql_inst->sql_select_query(inst->sql_inst, NULL, &handle, inst->memory_load) != RLM_SQL_OK) ||
+	    !handle) {
+		ERROR("Failed loading pools");
+		if (handle) fr_pool_connection_release(inst->sql_inst->pool, NULL, handle);
+		return -1;
+	}
+
+	while ((inst->sql_inst->sql_fetch_row(&row, inst->sql_inst, NULL, &handle) == RLM_SQL_OK) && row) {
+		ippool_mem_lease_t lease;
+
+		if (!row[0] || !row[1]) continue;
+
+		lease = (ippool_mem_lease_t) {
+			.pool = row[0],
+			.address = row[1],
+			.owner = (row[2] && *row[2]) ? row[2] : NULL,
+			.gateway = (row[3] && *row[3]) ? row[3] : NULL,
+			.expires = row[4] ? (time_t)strtoll(row[4], NULL, 10) : 0,
+			.status = fr_table_value_by_str(ippool_mem_status_table, row[5] ? row[5] : "",
+							IPPOOL_MEM_STATUS_DYNAMIC)
+		};
+
+		if (ippool_mem_add(inst->mem, &lease) < 0) {
+			PWARN("Ignoring address %s in pool %s", lease.address, lease.pool);
+			continue;
+		}
+		count++;
+	}
+
+	if (handle) {
+		(inst->sql_inst->driver->sql_finish_select_query)(handle, inst->sql_inst->config);
+		fr_pool_connection_release(inst->sql_inst->pool, NULL, handle);
+	}
+
+	INFO("Loaded %u addresses", count);
+
+	return 0;
+}
+
+/** Write back anything left in the journal, load the pools, and start the writer
+ *
+ * Must be called with the writer locked.
+ */
+static int sqlippool_memory_start(rlm_sqlippool_t *inst)
+{
+	sqlippool_writer_t	*writer = inst->writer;
+	fr_dlist_head_t		batch;
+	int			ret;
+
+	if (sqlippool_journal_replay(writer) < 0) return -1;
+
+	fr_dlist_talloc_init(&batch, sqlippool_write_t, entry);
+	sqlippool_writer_take(&batch, writer);
+	if (sqlippool_writer_flush(writer, &batch) < 0) {
+		ERROR("Failed writing journal %s to the database", inst->memory_journal);
+		sqlippool_writer_requeue(writer, &batch);
+		return -1;
+	}
+
+	if ((writer->journal_fd >= 0) && (ftruncate(writer->journal_fd, 0) < 0)) {
+		ERROR("Failed truncating journal %s: %s", inst->memory_journal, fr_syserror(errno));
+		return -1;
+	}
+
+	if (sqlippool_memory_load(inst) < 0) return -1;
+
+	ret = pthread_create(&writer->thread, NULL, sqlippool_writer_thread, writer);
+	if (ret != 0) {
+		ERROR("Failed creating writer thread: %s", fr_syserror(ret));
+		return -1;
+	}
+	writer->started = true;
+
+	return 0;
+}
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -460,9 +1008,115 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	if (inst->memory) {
+		sqlippool_writer_t *writer;
+
+		if (!inst->memory_load || !*inst->memory_load || !inst->memory_write || !*inst->memory_write) {
+			cf_log_err(conf, "'memory_load' and 'memory_write' queries must be set to use in-memory pools");
+			return -1;
+		}
+
+		if (!inst->memory_owner) {
+			cf_log_err(conf, "'owner' must be set in the 'memory' section");
+			return -1;
+		}
+
+		MEM(writer = talloc_zero(inst, sqlippool_writer_t));
+		writer->inst = inst;
+		writer->journal_fd = -1;
+		pthread_mutex_init(&writer->mutex, NULL);
+		pthread_cond_init(&writer->cond, NULL);
+		fr_dlist_talloc_init(&writer->queue, sqlippool_write_t, entry);
+		MEM(writer->pending = fr_hash_table_alloc(writer, sqlippool_write_hash, sqlippool_write_cmp, NULL));
+		inst->writer = writer;
+
+		if (inst->memory_journal) {
+			writer->journal_fd = open(inst->memory_journal, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+			if (writer->journal_fd < 0) {
+				cf_log_err(conf, "Failed opening journal %s: %s",
+					   inst->memory_journal, fr_syserror(errno));
+				return -1;
+			}
+		}
+
+		MEM(inst->mem = ippool_mem_alloc(inst, sqlippool_memory_changed, writer));
+	}
+
 	return 0;
 }
 
+/** Load the in-memory pools, the first time any worker starts
+ *
+ * This is done here rather than in mod_instantiate, as the SQL
+ * module isn't guaranteed to have been instantiated before us.
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
+				  UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_sqlippool_t		*inst = talloc_get_type_abort(instance, rlm_sqlippool_t);
+	rlm_sqlippool_thread_t	*t = talloc_get_type_abort(thread, rlm_sqlippool_thread_t);
+	sqlippool_writer_t	*writer = inst->writer;
+	int			ret = 0;
+
+	t->inst = inst;
+	if (!writer) return 0;
+
+	pthread_mutex_lock(&writer->mutex);
+	if (!writer->started) ret = sqlippool_memory_start(inst);
+	pthread_mutex_unlock(&writer->mutex);
+
+	return ret;
+}
+
+/** Write back the remaining changes, and stop the writer thread
+ *
+ */
+static void sqlippool_writer_stop(sqlippool_writer_t *writer)
+{
+	bool	started;
+
+	pthread_mutex_lock(&writer->mutex);
+	started = writer->started;
+	writer->started = false;
+	writer->shutdown = true;
+	pthread_cond_signal(&writer->cond);
+	pthread_mutex_unlock(&writer->mutex);
+
+	if (started) pthread_join(writer->thread, NULL);
+}
+
+/** Stop the writer when the first worker exits
+ *
+ * The SQL module's connection pool may be freed before we're
+ * detached, so the remaining changes must be written now.  Anything
+ * changed by workers which are still exiting stays in the journal.
+ */
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_sqlippool_thread_t	*t = talloc_get_type_abort(thread, rlm_sqlippool_thread_t);
+
+	if (t->inst->writer) sqlippool_writer_stop(t->inst->writer);
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_sqlippool_t		*inst = talloc_get_type_abort(instance, rlm_sqlippool_t);
+	sqlippool_writer_t	*writer = inst->writer;
+
+	if (!writer) return 0;
+
+	sqlippool_writer_stop(writer);
+
+	fr_dlist_talloc_free(&writer->queue);
+	if (writer->journal_fd >= 0) close(writer->journal_fd);
+
+	pthread_cond_destroy(&writer->cond);
+	pthread_mutex_destroy(&writer->mutex);
+
+	return 0;
+}
 
 /*
  *	If we have something to log, then we log it.
@@ -487,6 +1141,140 @@ static unlang_action_t do_logging(rlm_rcode_t *p_result, UNUSED rlm_sqlippool_t
 }
 
 
+/** Expand an optional argument for the in-memory pools
+ *
+ * @return
+ *	- 0 on success, with out set to NULL if there's no value.
+ *	- -1 on error.
+ */
+static int sqlippool_memory_arg(char **out, request_t *request, tmpl_t const *vpt, char const *name)
+{
+	*out = NULL;
+
+	if (!vpt) return 0;
+
+	if (tmpl_aexpand(request, out, request, vpt, NULL, NULL) < 0) {
+		RPEDEBUG("Failed expanding %s", name);
+		return -1;
+	}
+	if (!**out) TALLOC_FREE(*out);
+
+	return 0;
+}
+
+/*
+ *	Allocate an IP address from the in-memory pools.
+ */
+static unlang_action_t sqlippool_memory_alloc(rlm_rcode_t *p_result, rlm_sqlippool_t const *inst,
+					      request_t *request, char const *pool)
+{
+	char			allocation[FR_MAX_STRING_LEN];
+	char			*owner, *gateway = NULL, *requested = NULL;
+	fr_pair_t		*vp;
+
+	if ((sqlippool_memory_arg(&owner, request, inst->memory_owner, "owner") < 0) ||
+	    (sqlippool_memory_arg(&gateway, request, inst->memory_gateway, "gateway") < 0) ||
+	    (sqlippool_memory_arg(&requested, request, inst->requested_address, "requested_address") < 0)) {
+		RETURN_MODULE_FAIL;
+	}
+
+	if (!owner) {
+		REDEBUG("Owner expanded to an empty string");
+		RETURN_MODULE_FAIL;
+	}
+
+	switch (ippool_mem_allocate(allocation, sizeof(allocation), inst->mem, pool, owner, gateway, requested,
+				    time(NULL), inst->offer_duration)) {
+	case IPPOOL_MEM_OK:
+		break;
+
+	case IPPOOL_MEM_NO_POOL:
+		RDEBUG2("IP address could not be allocated as no pool exists with that name");
+		RETURN_MODULE_NOOP;
+
+	default:
+		RDEBUG2("pool appears to be full");
+		return do_logging(p_result, inst, request, inst->log_failed, RLM_MODULE_NOTFOUND);
+	}
+
+	MEM(vp = fr_pair_afrom_da(request->reply_ctx, inst->allocated_address_da));
+	if (fr_pair_value_from_str(vp, allocation, strlen(allocation), '\0', true) < 0) {
+		RDEBUG2("Invalid IP number [%s] in pool %s", allocation, pool);
+		talloc_free(vp);
+		return do_logging(p_result, inst, request, inst->log_failed, RLM_MODULE_NOOP);
+	}
+
+	RDEBUG2("Allocated IP %s", allocation);
+	fr_pair_append(&request->reply_pairs, vp);
+
+	return do_logging(p_result, inst, request, inst->log_success, RLM_MODULE_OK);
+}
+
+typedef enum {
+	SQLIPPOOL_MEMORY_UPDATE = 0,
+	SQLIPPOOL_MEMORY_RELEASE,
+	SQLIPPOOL_MEMORY_BULK_RELEASE,
+	SQLIPPOOL_MEMORY_MARK
+} sqlippool_memory_op_t;
+
+/*
+ *	Update, release or mark a lease in the in-memory pools.
+ */
+static unlang_action_t sqlippool_memory_lease(rlm_rcode_t *p_result, rlm_sqlippool_t const *inst,
+					      request_t *request, sqlippool_memory_op_t op)
+{
+	fr_pair_t		*vp;
+	char const		*pool;
+	char			*owner, *gateway, *address;
+	time_t			now = time(NULL);
+
+	vp = fr_pair_find_by_da(&request->control_pairs, attr_pool_name, 0);
+	if (!vp) {
+		RDEBUG2("No %s defined", attr_pool_name->name);
+		RETURN_MODULE_NOOP;
+	}
+	pool = vp->vp_strvalue;
+
+	if ((sqlippool_memory_arg(&owner, request, inst->memory_owner, "owner") < 0) ||
+	    (sqlippool_memory_arg(&gateway, request, inst->memory_gateway, "gateway") < 0) ||
+	    (sqlippool_memory_arg(&address, request, inst->requested_address, "requested_address") < 0)) {
+		RETURN_MODULE_FAIL;
+	}
+
+	if (op == SQLIPPOOL_MEMORY_BULK_RELEASE) {
+		if (!gateway) {
+			REDEBUG("Gateway expanded to an empty string");
+			RETURN_MODULE_FAIL;
+		}
+		(void) ippool_mem_bulk_release(inst->mem, pool, gateway, now);
+		RETURN_MODULE_OK;
+	}
+
+	if (!owner || !address) {
+		RDEBUG2("No owner or address, nothing to do");
+		RETURN_MODULE_NOOP;
+	}
+
+	switch (op) {
+	case SQLIPPOOL_MEMORY_RELEASE:
+		(void) ippool_mem_release(inst->mem, pool, owner, address, now);
+		RETURN_MODULE_OK;
+
+	case SQLIPPOOL_MEMORY_MARK:
+		(void) ippool_mem_mark(inst->mem, pool, owner, address);
+		RETURN_MODULE_OK;
+
+	default:
+		break;
+	}
+
+	if (ippool_mem_update(inst->mem, pool, owner, address, now, inst->lease_duration) == IPPOOL_MEM_OK) {
+		return do_logging(p_result, inst, request, inst->log_success, RLM_MODULE_OK);
+	}
+
+	return do_logging(p_result, inst, request, inst->log_failed, RLM_MODULE_NOTFOUND);
+}
+
 /*
  *	Allocate an IP number from the pool.
  */
@@ -507,12 +1295,15 @@ static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_
 		return do_logging(p_result, inst, request, inst->log_exists, RLM_MODULE_NOOP);
 	}
 
-	if (fr_pair_find_by_da(&request->control_pairs, attr_pool_name, 0) == NULL) {
+	vp = fr_pair_find_by_da(&request->control_pairs, attr_pool_name, 0);
+	if (!vp) {
 		RDEBUG2("No %s defined", attr_pool_name->name);
 
 		return do_logging(p_result, inst, request, inst->log_nopool, RLM_MODULE_NOOP);
 	}
 
+	if (inst->mem) return sqlippool_memory_alloc(p_result, inst, request, vp->vp_strvalue);
+
 	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
 	if (!handle) {
 		REDEBUG("Failed reserving SQL connection");
@@ -664,6 +1455,8 @@ static unlang_action_t CC_HINT(nonnull) mod_update(rlm_rcode_t *p_result, module
 	rlm_sql_handle_t	*handle;
 	int			affected;
 
+	if (inst->mem) return sqlippool_memory_lease(p_result, inst, request, SQLIPPOOL_MEMORY_UPDATE);
+
 	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
 	if (!handle) {
 		REDEBUG("Failed reserving SQL connection");
@@ -716,6 +1509,8 @@ static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, modul
 	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->instance, rlm_sqlippool_t);
 	rlm_sql_handle_t	*handle;
 
+	if (inst->mem) return sqlippool_memory_lease(p_result, inst, request, SQLIPPOOL_MEMORY_RELEASE);
+
 	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
 	if (!handle) {
 		REDEBUG("Failed reserving SQL connection");
@@ -746,6 +1541,8 @@ static unlang_action_t CC_HINT(nonnull) mod_bulk_release(rlm_rcode_t *p_result,
 	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->instance, rlm_sqlippool_t);
 	rlm_sql_handle_t	*handle;
 
+	if (inst->mem) return sqlippool_memory_lease(p_result, inst, request, SQLIPPOOL_MEMORY_BULK_RELEASE);
+
 	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
 	if (!handle) {
 		REDEBUG("Failed reserving SQL connection");
@@ -777,6 +1574,8 @@ static unlang_action_t CC_HINT(nonnull) mod_mark(rlm_rcode_t *p_result, module_c
 	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->instance, rlm_sqlippool_t);
 	rlm_sql_handle_t	*handle;
 
+	if (inst->mem) return sqlippool_memory_lease(p_result, inst, request, SQLIPPOOL_MEMORY_MARK);
+
 	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
 	if (!handle) {
 		REDEBUG("Failed reserving SQL connection");
@@ -851,6 +1650,11 @@ module_t rlm_sqlippool = {
 	.inst_size	= sizeof(rlm_sqlippool_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
+	.thread_inst_size = sizeof(rlm_sqlippool_thread_t),
+	.thread_inst_type = "rlm_sqlippool_thread_t",
+	.thread_instantiate = mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
+	.detach		= mod_detach,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting,
 		[MOD_POST_AUTH]		= mod_alloc
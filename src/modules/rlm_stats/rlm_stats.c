@@ -41,19 +41,51 @@ RCSID("$Id$")
 
 #include <pthread.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 /*
  *	@todo - MULTI_PROTOCOL - make this protocol agnostic.
  *	Perhaps keep stats in a hash table by (request->dict, request->code) ?
  */
 
+/*
+ *	Latency histograms are log-linear, in microseconds.  Values
+ *	below 16us get a bucket each, and every power of two above
+ *	that is split into 16 buckets, so a bucket is within ~6% of
+ *	the values it holds.
+ */
+#define LATENCY_SUB_BITS	4
+#define LATENCY_SUB		(1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS	36				//!< ~19 hours.
+#define LATENCY_BUCKETS		(LATENCY_SUB + ((LATENCY_MAX_BITS - LATENCY_SUB_BITS) * LATENCY_SUB))
+
+/*
+ *	The request types we keep latency histograms for.
+ */
+static unsigned int const latency_codes[] = {
+	FR_RADIUS_CODE_ACCESS_REQUEST,
+	FR_RADIUS_CODE_ACCOUNTING_REQUEST,
+	FR_RADIUS_CODE_STATUS_SERVER,
+	FR_RADIUS_CODE_DISCONNECT_REQUEST,
+	FR_RADIUS_CODE_COA_REQUEST
+};
+
 typedef struct {
-	pthread_mutex_t		mutex;
-	fr_dict_attr_t const	*type_da;			//!< FreeRADIUS-Stats4-Type
-	fr_dict_attr_t const	*ipv4_da;			//!< FreeRADIUS-Stats4-IPv4-Address
-	fr_dict_attr_t const	*ipv6_da;			//!< FreeRADIUS-Stats4-IPv6-Address
+	atomic_uint_fast64_t	buckets[LATENCY_BUCKETS];
+} rlm_stats_latency_t;
+
+typedef uint64_t rlm_stats_latency_sum_t[LATENCY_BUCKETS];
+
+typedef struct {
+	pthread_mutex_t		mutex;				//!< Protects the list of threads, and stats.
 	fr_dlist_head_t		list;				//!< for threads to know about each other
 
-	uint64_t		stats[FR_RADIUS_CODE_MAX];
+	uint64_t		stats[FR_RADIUS_CODE_MAX];	//!< From threads which have exited.
+	rlm_stats_latency_sum_t	latency[NUM_ELEMENTS(latency_codes)];
 } rlm_stats_t;
 
 typedef struct {
@@ -62,21 +94,27 @@ typedef struct {
 	fr_ipaddr_t		ipaddr;				//!< IP address of this thing
 	fr_time_t		created;			//!< when it was created
 	fr_time_t		last_packet;			//!< when we last saw a packet
-	uint64_t		stats[FR_RADIUS_CODE_MAX];	//!< actual statistic
+	atomic_uint_fast64_t	stats[FR_RADIUS_CODE_MAX];	//!< actual statistic
 } rlm_stats_data_t;
 
+/** Per-thread statistics
+ *
+ * Counters are only written by the thread which owns them, using
+ * relaxed atomics, and are read by any thread handling a statistics
+ * request.  The mutex is only taken by the owner when it adds a new
+ * client or listener to one of the trees, and by readers searching
+ * the trees.
+ */
 typedef struct {
 	rlm_stats_t		*inst;
 
-	fr_time_t		last_global_update;
 	fr_dlist_t		entry;				//!< for threads to know about each other
 
-	fr_time_t		last_manage;			//!< when we deleted old things
-
 	fr_rb_tree_t		*src;				//!< stats by source
 	fr_rb_tree_t		*dst;				//!< stats by destination
 
-	uint64_t		stats[FR_RADIUS_CODE_MAX];
+	atomic_uint_fast64_t	stats[FR_RADIUS_CODE_MAX];
+	rlm_stats_latency_t	latency[NUM_ELEMENTS(latency_codes)];
 
 	pthread_mutex_t		mutex;
 } rlm_stats_thread_t;
@@ -96,160 +134,296 @@ fr_dict_autoload_t rlm_stats_dict[] = {
 static fr_dict_attr_t const *attr_freeradius_stats4_ipv4_address;
 static fr_dict_attr_t const *attr_freeradius_stats4_ipv6_address;
 static fr_dict_attr_t const *attr_freeradius_stats4_type;
+static fr_dict_attr_t const *attr_freeradius_stats4_packet_counters;
+static fr_dict_attr_t const *attr_freeradius_stats4_latency;
+static fr_dict_attr_t const *attr_freeradius_stats4_latency_packet_type;
+static fr_dict_attr_t const *attr_freeradius_stats4_latency_count;
+static fr_dict_attr_t const *attr_freeradius_stats4_latency_p50;
+static fr_dict_attr_t const *attr_freeradius_stats4_latency_p99;
+static fr_dict_attr_t const *attr_freeradius_stats4_latency_max;
 
 extern fr_dict_attr_autoload_t rlm_stats_dict_attr[];
 fr_dict_attr_autoload_t rlm_stats_dict_attr[] = {
 	{ .out = &attr_freeradius_stats4_ipv4_address, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-IPv4-Address", .type = FR_TYPE_IPV4_ADDR, .dict = &dict_radius },
 	{ .out = &attr_freeradius_stats4_ipv6_address, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-IPv6-Address", .type = FR_TYPE_IPV6_ADDR, .dict = &dict_radius },
 	{ .out = &attr_freeradius_stats4_type, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius },
+	{ .out = &attr_freeradius_stats4_packet_counters, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-Packet-Counters", .type = FR_TYPE_TLV, .dict = &dict_radius },
+	{ .out = &attr_freeradius_stats4_latency, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-Latency", .type = FR_TYPE_TLV, .dict = &dict_radius },
+	{ .out = &attr_freeradius_stats4_latency_packet_type, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-Latency.Stats4-Latency-Packet-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius },
+	{ .out = &attr_freeradius_stats4_latency_count, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-Latency.Stats4-Latency-Count", .type = FR_TYPE_UINT64, .dict = &dict_radius },
+	{ .out = &attr_freeradius_stats4_latency_p50, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-Latency.Stats4-Latency-P50", .type = FR_TYPE_UINT64, .dict = &dict_radius },
+	{ .out = &attr_freeradius_stats4_latency_p99, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-Latency.Stats4-Latency-P99", .type = FR_TYPE_UINT64, .dict = &dict_radius },
+	{ .out = &attr_freeradius_stats4_latency_max, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-Latency.Stats4-Latency-Max", .type = FR_TYPE_UINT64, .dict = &dict_radius },
 	{ NULL }
 };
 
-static void coalesce(uint64_t final_stats[FR_RADIUS_CODE_MAX], rlm_stats_thread_t *t,
-		     size_t tree_offset, rlm_stats_data_t *mydata)
+/** Increment a counter which only this thread writes
+ *
+ * A relaxed load and store is enough for readers to see the new
+ * value eventually, and avoids a locked instruction.
+ */
+static inline void stats_inc(atomic_uint_fast64_t *counter)
 {
-	rlm_stats_data_t *stats;
-	rlm_stats_thread_t *other;
-	fr_rb_tree_t **tree;
-	uint64_t local_stats[FR_RADIUS_CODE_MAX];
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1,
+			      memory_order_relaxed);
+}
 
-	tree = (fr_rb_tree_t **) (((uint8_t *) t) + tree_offset);
+static inline uint64_t stats_read(atomic_uint_fast64_t *counter)
+{
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
 
-	/*
-	 *	Bootstrap with my statistics, where we don't need a
-	 *	lock.
-	 */
-	stats = fr_rb_find(*tree, mydata);
-	if (!stats) {
-		memset(final_stats, 0, sizeof(uint64_t) * FR_RADIUS_CODE_MAX);
-	} else {
-		memcpy(final_stats, stats->stats, sizeof(stats->stats));
-	}
+static inline unsigned int latency_bucket(uint64_t usec)
+{
+	unsigned int bits;
 
-	/*
-	 *	Loop over all of the other thread instances, locking
-	 *	them, and adding their statistics in.
-	 */
-	for (other = fr_dlist_head(&t->inst->list);
-	     other != NULL;
-	     other = fr_dlist_next(&t->inst->list, other)) {
-		int i;
+	if (usec < LATENCY_SUB) return usec;
+	if (usec >= ((uint64_t)1 << LATENCY_MAX_BITS)) usec = ((uint64_t)1 << LATENCY_MAX_BITS) - 1;
 
-		pthread_mutex_lock(&other->mutex);
+	bits = fr_high_bit_pos(usec) - 1;
 
-		if (other == t) continue;
+	return LATENCY_SUB + ((bits - LATENCY_SUB_BITS) * LATENCY_SUB) +
+	       ((usec >> (bits - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1));
+}
 
-		tree = (fr_rb_tree_t **) (((uint8_t *) other) + tree_offset);
-		stats = fr_rb_find(*tree, mydata);
-		if (!stats) {
-			continue;
-		}
-		memcpy(&local_stats, stats->stats, sizeof(stats->stats));
+/** The smallest value which falls into a bucket
+ *
+ */
+static inline uint64_t latency_value(unsigned int bucket)
+{
+	unsigned int bits;
 
-		for (i = 0; i < FR_RADIUS_CODE_MAX; i++) {
-			final_stats[i] += local_stats[i];
-		}
+	if (bucket < LATENCY_SUB) return bucket;
 
-		pthread_mutex_unlock(&other->mutex);
+	bits = ((bucket - LATENCY_SUB) / LATENCY_SUB) + LATENCY_SUB_BITS;
+
+	return ((uint64_t)LATENCY_SUB + ((bucket - LATENCY_SUB) % LATENCY_SUB)) << (bits - LATENCY_SUB_BITS);
+}
+
+static int latency_index(unsigned int code)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_ELEMENTS(latency_codes); i++) {
+		if (latency_codes[i] == code) return i;
 	}
+
+	return -1;
 }
 
+/** Find or add the statistics for an address in one of our trees
+ *
+ * Only the owning thread modifies the trees, so it can search them
+ * without locking.  Insertions are locked so that readers in other
+ * threads don't see a half-modified tree.
+ */
+static rlm_stats_data_t *stats_data(rlm_stats_thread_t *t, fr_rb_tree_t *tree, fr_ipaddr_t const *ipaddr, fr_time_t now)
+{
+	rlm_stats_data_t *stats, mydata;
 
-/*
- *	Do the statistics
+	mydata.ipaddr = *ipaddr;
+	stats = fr_rb_find(tree, &mydata);
+	if (stats) return stats;
+
+	MEM(stats = talloc_zero(t, rlm_stats_data_t));
+	stats->ipaddr = *ipaddr;
+	stats->created = now;
+
+	pthread_mutex_lock(&t->mutex);
+	(void) fr_rb_insert(tree, stats);
+	pthread_mutex_unlock(&t->mutex);
+
+	return stats;
+}
+
+/** Count a request and its reply
+ *
  */
-static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+static void stats_update(rlm_stats_thread_t *t, request_t *request)
 {
-	rlm_stats_t		*inst = talloc_get_type_abort(mctx->instance, rlm_stats_t);
-	rlm_stats_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_stats_thread_t);
-	int			i;
-	uint32_t		stats_type;
+	int			src_code, dst_code, idx;
+	fr_time_t		now = fr_time(), recv_time;
+	rlm_stats_data_t	*stats;
 
+	src_code = request->packet->code;
+	if (src_code >= FR_RADIUS_CODE_MAX) src_code = 0;
 
-	fr_pair_t *vp;
-	rlm_stats_data_t mydata;
-	char buffer[64];
-	uint64_t local_stats[NUM_ELEMENTS(inst->stats)];
+	dst_code = request->reply->code;
+	if (dst_code >= FR_RADIUS_CODE_MAX) dst_code = 0;
+
+	recv_time = request->async ? request->async->recv_time : request->packet->timestamp;
+
+	stats_inc(&t->stats[src_code]);
+	stats_inc(&t->stats[dst_code]);
+
+	idx = latency_index(src_code);
+	if ((idx >= 0) && (now > recv_time)) {
+		stats_inc(&t->latency[idx].buckets[latency_bucket(fr_time_delta_to_usec(now - recv_time))]);
+	}
 
 	/*
-	 *	Increment counters only in "send foo" sections.
-	 *
-	 *	i.e. only when we have a reply to send.
-	 *
-	 *	FIXME - Nothing sets request_state anymore
+	 *	Update source statistics
 	 */
-#if 0
-	if (request->request_state == REQUEST_SEND) {
-		int src_code, dst_code;
-		rlm_stats_data_t *stats;
+	stats = stats_data(t, t->src, &request->packet->socket.inet.src_ipaddr, now);
+	stats->last_packet = now;
+	stats_inc(&stats->stats[src_code]);
+	stats_inc(&stats->stats[dst_code]);
 
-		src_code = request->packet->code;
-		if (src_code >= FR_RADIUS_CODE_MAX) src_code = 0;
+	/*
+	 *	Update destination statistics
+	 */
+	stats = stats_data(t, t->dst, &request->packet->socket.inet.dst_ipaddr, now);
+	stats->last_packet = now;
+	stats_inc(&stats->stats[src_code]);
+	stats_inc(&stats->stats[dst_code]);
 
-		dst_code = request->reply->code;
-		if (dst_code >= FR_RADIUS_CODE_MAX) dst_code = 0;
+	/*
+	 *	@todo - periodically clean up old entries.
+	 */
+}
 
-		pthread_mutex_lock(&t->mutex);
-		t->stats[src_code]++;
-		t->stats[dst_code]++;
+/** Add up the global statistics from every thread
+ *
+ * Must be called with inst->mutex held.
+ */
+static void coalesce_global(uint64_t final_stats[FR_RADIUS_CODE_MAX], rlm_stats_latency_sum_t *latency,
+			    rlm_stats_t *inst)
+{
+	rlm_stats_thread_t	*other;
+	size_t			i, j;
 
-		/*
-		 *	Update source statistics
-		 */
-		mydata.ipaddr = request->packet->socket.inet.src_ipaddr;
-		stats = fr_rb_find(t->src, &mydata);
-		if (!stats) {
-			MEM(stats = talloc_zero(t, rlm_stats_data_t));
+	memcpy(final_stats, inst->stats, sizeof(inst->stats));
+	memcpy(latency, inst->latency, sizeof(inst->latency));
 
-			stats->ipaddr = request->packet->socket.inet.src_ipaddr;
-			stats->created = request->async->recv_time;
+	for (other = fr_dlist_head(&inst->list);
+	     other != NULL;
+	     other = fr_dlist_next(&inst->list, other)) {
+		for (i = 0; i < FR_RADIUS_CODE_MAX; i++) final_stats[i] += stats_read(&other->stats[i]);
 
-			(void) fr_rb_insert(t->src, stats);
+		for (i = 0; i < NUM_ELEMENTS(latency_codes); i++) {
+			for (j = 0; j < LATENCY_BUCKETS; j++) {
+				latency[i][j] += stats_read(&other->latency[i].buckets[j]);
+			}
 		}
+	}
+}
+
+/** Add up the statistics for a client or listener from every thread
+ *
+ * Must be called with inst->mutex held.
+ */
+static void coalesce(uint64_t final_stats[FR_RADIUS_CODE_MAX], rlm_stats_t *inst,
+		     size_t tree_offset, rlm_stats_data_t *mydata)
+{
+	rlm_stats_data_t *stats;
+	rlm_stats_thread_t *other;
+	fr_rb_tree_t **tree;
+
+	memset(final_stats, 0, sizeof(uint64_t) * FR_RADIUS_CODE_MAX);
 
-		stats->last_packet = request->async->recv_time;
-		stats->stats[src_code]++;
-		stats->stats[dst_code]++;
+	/*
+	 *	Loop over all of the thread instances, adding their
+	 *	statistics in.  The lock is only held while searching
+	 *	the tree, the counters themselves are atomic.
+	 */
+	for (other = fr_dlist_head(&inst->list);
+	     other != NULL;
+	     other = fr_dlist_next(&inst->list, other)) {
+		int i;
 
-		/*
-		 *	Update destination statistics
-		 */
-		mydata.ipaddr = request->packet->socket.inet.dst_ipaddr;
-		stats = fr_rb_find(t->dst, &mydata);
-		if (!stats) {
-			MEM(stats = talloc_zero(t, rlm_stats_data_t));
+		tree = (fr_rb_tree_t **) (((uint8_t *) other) + tree_offset);
 
-			stats->ipaddr = request->packet->socket.inet.dst_ipaddr;
-			stats->created = request->async->recv_time;
+		pthread_mutex_lock(&other->mutex);
+		stats = fr_rb_find(*tree, mydata);
+		pthread_mutex_unlock(&other->mutex);
+		if (!stats) continue;
 
-			(void) fr_rb_insert(t->dst, stats);
+		for (i = 0; i < FR_RADIUS_CODE_MAX; i++) {
+			final_stats[i] += stats_read(&stats->stats[i]);
 		}
+	}
+}
 
-		stats->last_packet = request->async->recv_time;
-		stats->stats[src_code]++;
-		stats->stats[dst_code]++;
-		pthread_mutex_unlock(&t->mutex);
+/** Add the latency of each type of request to the reply
+ *
+ */
+static void stats_latency_reply(request_t *request, rlm_stats_latency_sum_t *latency)
+{
+	size_t i;
 
-		/*
-		 *	@todo - periodically clean up old entries.
-		 */
+	for (i = 0; i < NUM_ELEMENTS(latency_codes); i++) {
+		fr_pair_t	*tlv, *vp;
+		uint64_t	count = 0, seen = 0, p50 = 0, p99 = 0, max = 0;
+		size_t		j;
 
-		if ((t->last_global_update + NSEC) > request->async->recv_time) {
-			RETURN_MODULE_UPDATED;
+		for (j = 0; j < LATENCY_BUCKETS; j++) {
+			if (!latency[i][j]) continue;
+			count += latency[i][j];
+			max = latency_value(j);
 		}
+		if (!count) continue;
 
-		t->last_global_update = request->async->recv_time;
+		for (j = 0; j < LATENCY_BUCKETS; j++) {
+			if (!latency[i][j]) continue;
 
-		pthread_mutex_lock(&inst->mutex);
-		for (i = 0; i < FR_RADIUS_CODE_MAX; i++) {
-			inst->stats[i] += t->stats[i];
-			t->stats[i] = 0;
+			seen += latency[i][j];
+			if (!p50 && ((seen * 100) >= (count * 50))) p50 = latency_value(j);
+			if ((seen * 100) >= (count * 99)) {
+				p99 = latency_value(j);
+				break;
+			}
 		}
-		pthread_mutex_unlock(&inst->mutex);
 
+		MEM(tlv = fr_pair_afrom_da(request->reply_ctx, attr_freeradius_stats4_latency));
+		fr_pair_append(&request->reply_pairs, tlv);
+
+		MEM(vp = fr_pair_afrom_da(tlv, attr_freeradius_stats4_latency_packet_type));
+		vp->vp_uint32 = latency_codes[i];
+		fr_pair_append(&tlv->vp_group, vp);
+
+		MEM(vp = fr_pair_afrom_da(tlv, attr_freeradius_stats4_latency_count));
+		vp->vp_uint64 = count;
+		fr_pair_append(&tlv->vp_group, vp);
+
+		MEM(vp = fr_pair_afrom_da(tlv, attr_freeradius_stats4_latency_p50));
+		vp->vp_uint64 = p50;
+		fr_pair_append(&tlv->vp_group, vp);
+
+		MEM(vp = fr_pair_afrom_da(tlv, attr_freeradius_stats4_latency_p99));
+		vp->vp_uint64 = p99;
+		fr_pair_append(&tlv->vp_group, vp);
+
+		MEM(vp = fr_pair_afrom_da(tlv, attr_freeradius_stats4_latency_max));
+		vp->vp_uint64 = max;
+		fr_pair_append(&tlv->vp_group, vp);
+	}
+}
+
+
+/*
+ *	Do the statistics
+ */
+static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_stats_t		*inst = talloc_get_type_abort(mctx->instance, rlm_stats_t);
+	rlm_stats_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_stats_thread_t);
+	int			i;
+	uint32_t		stats_type;
+
+
+	fr_pair_t *vp;
+	rlm_stats_data_t mydata;
+	uint64_t local_stats[NUM_ELEMENTS(inst->stats)];
+	rlm_stats_latency_sum_t *latency = NULL;
+
+	/*
+	 *	Increment counters only once we have a reply to send,
+	 *	i.e. when called from "send foo" sections, or post-auth.
+	 */
+	if (request->reply->code != 0) {
+		stats_update(t, request);
 		RETURN_MODULE_UPDATED;
 	}
-#endif
 
 	/*
 	 *	Ignore "authenticate" and anything other than Status-Server
@@ -273,18 +447,10 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 
 	switch (stats_type) {
 	case FR_STATS4_TYPE_VALUE_GLOBAL:			/* global */
-		/*
-		 *	Merge our stats with the global stats, and then copy
-		 *	the global stats to a thread-local variable.
-		 *
-		 *	The copy helps minimize mutex contention.
-		 */
+		MEM(latency = talloc_array(request, rlm_stats_latency_sum_t, NUM_ELEMENTS(latency_codes)));
+
 		pthread_mutex_lock(&inst->mutex);
-		for (i = 0; i < FR_RADIUS_CODE_MAX; i++) {
-			inst->stats[i] += t->stats[i];
-			t->stats[i] = 0;
-		}
-		memcpy(&local_stats, inst->stats, sizeof(inst->stats));
+		coalesce_global(local_stats, latency, inst);
 		pthread_mutex_unlock(&inst->mutex);
 		vp = NULL;
 		break;
@@ -295,7 +461,9 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 		if (!vp) RETURN_MODULE_NOOP;
 
 		mydata.ipaddr = vp->vp_ip;
-		coalesce(local_stats, t, offsetof(rlm_stats_thread_t, src), &mydata);
+		pthread_mutex_lock(&inst->mutex);
+		coalesce(local_stats, inst, offsetof(rlm_stats_thread_t, src), &mydata);
+		pthread_mutex_unlock(&inst->mutex);
 		break;
 
 	case FR_STATS4_TYPE_VALUE_LISTENER:			/* dst */
@@ -304,7 +472,9 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 		if (!vp) RETURN_MODULE_NOOP;
 
 		mydata.ipaddr = vp->vp_ip;
-		coalesce(local_stats, t, offsetof(rlm_stats_thread_t, dst), &mydata);
+		pthread_mutex_lock(&inst->mutex);
+		coalesce(local_stats, inst, offsetof(rlm_stats_thread_t, dst), &mydata);
+		pthread_mutex_unlock(&inst->mutex);
 		break;
 
 	default:
@@ -319,15 +489,12 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 		}
 	}
 
-	strcpy(buffer, "FreeRADIUS-Stats4-");
-
 	for (i = 0; i < FR_RADIUS_CODE_MAX; i++) {
 		fr_dict_attr_t const *da;
 
 		if (!local_stats[i]) continue;
 
-		strlcpy(buffer + 18, fr_packet_codes[i], sizeof(buffer) - 18);
-		da = fr_dict_attr_by_name(NULL, fr_dict_root(dict_radius), buffer);
+		da = fr_dict_attr_child_by_num(attr_freeradius_stats4_packet_counters, i);
 		if (!da) continue;
 
 		MEM(vp = fr_pair_afrom_da(request->reply_ctx, da));
@@ -336,6 +503,11 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 		fr_pair_append(&request->reply_pairs, vp);
 	}
 
+	if (latency) {
+		stats_latency_reply(request, latency);
+		talloc_free(latency);
+	}
+
 	RETURN_MODULE_OK;
 }
 
@@ -389,7 +561,12 @@ static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
 
 	pthread_mutex_lock(&inst->mutex);
 	for (i = 0; i < FR_RADIUS_CODE_MAX; i++) {
-		inst->stats[i] += t->stats[i];
+		inst->stats[i] += stats_read(&t->stats[i]);
+	}
+	for (i = 0; i < (int)NUM_ELEMENTS(latency_codes); i++) {
+		size_t j;
+
+		for (j = 0; j < LATENCY_BUCKETS; j++) inst->latency[i][j] += stats_read(&t->latency[i].buckets[j]);
 	}
 	fr_dlist_remove(&inst->list, t);
 	pthread_mutex_unlock(&inst->mutex);
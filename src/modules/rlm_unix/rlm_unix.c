@@ -55,10 +55,22 @@ static char trans[64] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz012
 typedef struct {
 	char const *name;	//!< Instance name.
 	char const *radwtmp;
+
+	fr_time_delta_t	cache_lifetime;			//!< How long to cache users and groups.
+	fr_time_delta_t	cache_negative_lifetime;	//!< How long to cache missing users and groups.
+	uint32_t	cache_max_entries;		//!< Maximum number of users and groups to cache.
 } rlm_unix_t;
 
+static const CONF_PARSER cache_config[] = {
+	{ FR_CONF_OFFSET("lifetime", FR_TYPE_TIME_DELTA, rlm_unix_t, cache_lifetime), .dflt = "0" },
+	{ FR_CONF_OFFSET("negative_lifetime", FR_TYPE_TIME_DELTA, rlm_unix_t, cache_negative_lifetime), .dflt = "5" },
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_unix_t, cache_max_entries), .dflt = "4096" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("radwtmp", FR_TYPE_FILE_OUTPUT, rlm_unix_t, radwtmp) },
+	{ FR_CONF_POINTER("cache", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) cache_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -104,11 +116,8 @@ fr_dict_attr_autoload_t rlm_unix_dict_attr[] = {
 static int groupcmp(UNUSED void *instance, request_t *request, UNUSED fr_pair_list_t *request_list,
 		    fr_pair_t *check)
 {
-	struct passwd	*pwd;
-	struct group	*grp;
-	char		**member;
-	int		retval = -1;
 	fr_pair_t	*username;
+	int		ret;
 
 	/*
 	 *	No user name, can't compare.
@@ -116,38 +125,13 @@ static int groupcmp(UNUSED void *instance, request_t *request, UNUSED fr_pair_li
 	username = fr_pair_find_by_da(&request->request_pairs, attr_user_name, 0);
 	if (!username) return -1;
 
-	if (fr_perm_getpwnam(request, &pwd, username->vp_strvalue) < 0) {
-		RPEDEBUG("Failed resolving user name");
-		return -1;
-	}
-
-	if (fr_perm_getgrnam(request, &grp, check->vp_strvalue) < 0) {
-		RPEDEBUG("Failed resolving group name");
-		talloc_free(pwd);
+	ret = fr_perm_user_in_group(request, username->vp_strvalue, check->vp_strvalue);
+	if (ret < 0) {
+		RPEDEBUG("Failed resolving user or group name");
 		return -1;
 	}
 
-	/*
-	 *	The users default group isn't the one we're looking for,
-	 *	look through the list of group members.
-	 */
-	if (pwd->pw_gid == grp->gr_gid) {
-		retval = 0;
-
-	} else {
-		for (member = grp->gr_mem; *member && retval; member++) {
-			if (strcmp(*member, pwd->pw_name) == 0) {
-				retval = 0;
-				break;
-			}
-		}
-	}
-
-	/* lifo */
-	talloc_free(grp);
-	talloc_free(pwd);
-
-	return retval;
+	return ret ? 0 : -1;
 }
 
 
@@ -180,6 +164,23 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
+{
+	rlm_unix_t	*inst = instance;
+
+	/*
+	 *	The cache is shared by every instance of the module,
+	 *	and by anything else which resolves users or groups.
+	 */
+	if (inst->cache_lifetime &&
+	    (fr_perm_cache_init(inst->cache_lifetime, inst->cache_negative_lifetime, inst->cache_max_entries) < 0)) {
+		PERROR("Failed initialising user and group cache");
+		return -1;
+	}
+
+	return 0;
+}
+
 
 /*
  *	Pull the users password from where-ever, and add it to
@@ -209,7 +210,12 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, UNU
 	name = username->vp_strvalue;
 	encrypted_pass = NULL;
 
-	if ((pwd = getpwnam(name)) == NULL) {
+	/*
+	 *	Allocated in the request, so it's freed when the
+	 *	request is done.
+	 */
+	if (fr_perm_getpwnam(request, &pwd, name) < 0) {
+		if (errno != 0) RPEDEBUG("Failed resolving user name");
 		RETURN_MODULE_NOTFOUND;
 	}
 	encrypted_pass = pwd->pw_passwd;
@@ -519,6 +525,7 @@ module_t rlm_unix = {
 	.inst_size	= sizeof(rlm_unix_t),
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
+	.instantiate	= mod_instantiate,
 	.methods = {
 		[MOD_AUTHORIZE]		= mod_authorize,
 		[MOD_ACCOUNTING]	= mod_accounting
@@ -31,7 +31,6 @@ RCSID("$Id$")
  */
 static unlang_action_t CC_HINT(nonnull) mod_utf8_clean(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx, request_t *request)
 {
-	size_t		i, len;
 	fr_pair_t	*vp;
 
 	for (vp = fr_pair_list_head(&request->request_pairs);
@@ -39,10 +38,7 @@ static unlang_action_t CC_HINT(nonnull) mod_utf8_clean(rlm_rcode_t *p_result, UN
 	     vp = fr_pair_list_next(&request->request_pairs, vp)) {
 		if (vp->vp_type != FR_TYPE_STRING) continue;
 
-		for (i = 0; i < vp->vp_length; i += len) {
-			len = fr_utf8_char(&vp->vp_octets[i], -1);
-			if (len == 0) RETURN_MODULE_FAIL;
-		}
+		if (fr_utf8_str(vp->vp_octets, vp->vp_length) != (ssize_t)vp->vp_length) RETURN_MODULE_FAIL;
 	}
 
 	RETURN_MODULE_NOOP;
@@ -35,100 +35,142 @@ RCSID("$Id$")
 #include "rlm_winbind.h"
 #include "auth_wbclient_pap.h"
 
-/** PAP authentication direct to winbind via Samba's libwbclient library
+/** Free the results of a winbind authentication
  *
- * @param[in] inst Module instance
- * @param[in] request The current request
- * @param[in] password the User-Password
+ */
+static int _winbind_auth_free(winbind_auth_t *wa)
+{
+	if (wa->info) wbcFreeMemory(wa->info);
+	if (wa->error) wbcFreeMemory(wa->error);
+
+	return 0;
+}
+
+/** Prepare a PAP authentication against winbind
  *
- * @return
- *	- 0	Success
- *	- -1	Authentication failure
- *	- -648	Password expired
+ * Everything winbind needs is copied into the #winbind_auth_t, so
+ * #winbind_auth_run can be called by a thread which doesn't own
+ * the request.
  *
+ * The result is not parented by the request, so it may be handed
+ * to a thread pool.  The caller must free it.
+ *
+ * @param[in] inst	Module instance.
+ * @param[in] request	The current request.
+ * @param[in] password	the User-Password.
+ * @return
+ *	- A new #winbind_auth_t.
+ *	- NULL if the username or domain could not be expanded.
  */
-int do_auth_wbclient_pap(rlm_winbind_t const *inst, request_t *request, fr_pair_t *password)
+winbind_auth_t *winbind_auth_alloc(rlm_winbind_t const *inst, request_t *request, fr_pair_t const *password)
 {
-	int ret = -1;
-	struct wbcContext *wb_ctx;
-	struct wbcAuthUserParams authparams;
-	wbcErr err;
-	int len;
-	struct wbcAuthUserInfo *info = NULL;
-	struct wbcAuthErrorInfo *error = NULL;
-	char user_name_buf[500];
-	char domain_name_buf[500];
-
-	/*
-	 * Clear the auth parameters - this is important, as
-	 * there are options that will cause wbcAuthenticateUserEx
-	 * to bomb out if not zero.
-	 */
-	memset(&authparams, 0, sizeof(authparams));
+	winbind_auth_t	*wa;
+	ssize_t		slen;
 
 	/*
 	 * wb_username must be set for this function to be called
 	 */
 	fr_assert(inst->wb_username);
 
+	MEM(wa = talloc_zero(NULL, winbind_auth_t));
+	talloc_set_destructor(wa, _winbind_auth_free);
+	wa->inst = inst;
+	wa->request = request;
+
 	/*
 	 * Get the username and domain from the configuration
 	 */
-	len = tmpl_expand(&authparams.account_name, user_name_buf, sizeof(user_name_buf),
-			  request, inst->wb_username, NULL, NULL);
-	if (len < 0) {
+	slen = tmpl_aexpand(wa, &wa->account_name, request, inst->wb_username, NULL, NULL);
+	if (slen < 0) {
 		REDEBUG2("Unable to expand winbind_username");
-		goto done;
+	error:
+		talloc_free(wa);
+		return NULL;
 	}
 
 	if (inst->wb_domain) {
-		len = tmpl_expand(&authparams.domain_name, domain_name_buf, sizeof(domain_name_buf),
-				  request, inst->wb_domain, NULL, NULL);
-		if (len < 0) {
+		slen = tmpl_aexpand(wa, &wa->domain_name, request, inst->wb_domain, NULL, NULL);
+		if (slen < 0) {
 			REDEBUG2("Unable to expand winbind_domain");
-			goto done;
+			goto error;
 		}
 	} else {
 		RWDEBUG2("No domain specified; authentication may fail because of this");
 	}
 
+	MEM(wa->password = talloc_bstrndup(wa, password->vp_strvalue, password->vp_length));
 
 	/*
+	 * Clear the auth parameters - this is important, as
+	 * there are options that will cause wbcAuthenticateUserEx
+	 * to bomb out if not zero.
+	 *
 	 * Build the wbcAuthUserParams structure with what we know
 	 */
-	authparams.level = WBC_AUTH_USER_LEVEL_PLAIN;
-	authparams.password.plaintext = password->data.vb_strvalue;
+	memset(&wa->authparams, 0, sizeof(wa->authparams));
+	wa->authparams.account_name = wa->account_name;
+	wa->authparams.domain_name = wa->domain_name;
+	wa->authparams.level = WBC_AUTH_USER_LEVEL_PLAIN;
+	wa->authparams.password.plaintext = wa->password;
 
 	/*
 	 * Parameters documented as part of the MSV1_0_SUBAUTH_LOGON structure
 	 * at https://msdn.microsoft.com/aa378767.aspx
 	 */
-	authparams.parameter_control |= WBC_MSV1_0_CLEARTEXT_PASSWORD_ALLOWED |
-					WBC_MSV1_0_ALLOW_WORKSTATION_TRUST_ACCOUNT |
-					WBC_MSV1_0_ALLOW_SERVER_TRUST_ACCOUNT;
+	wa->authparams.parameter_control |= WBC_MSV1_0_CLEARTEXT_PASSWORD_ALLOWED |
+					    WBC_MSV1_0_ALLOW_WORKSTATION_TRUST_ACCOUNT |
+					    WBC_MSV1_0_ALLOW_SERVER_TRUST_ACCOUNT;
 
-	/*
-	 * Send auth request across to winbind
-	 */
-	wb_ctx = fr_pool_connection_get(inst->wb_pool, request);
+	RDEBUG2("Sending authentication request user='%s' domain='%s'", wa->account_name, wa->domain_name);
+
+	return wa;
+}
+
+/** Send an authentication request to winbind, and wait for the response
+ *
+ * May be called from a thread pool thread, so must not touch the request.
+ *
+ * @param[in] uctx	#winbind_auth_t to send.
+ */
+void winbind_auth_run(void *uctx)
+{
+	winbind_auth_t		*wa = uctx;
+	struct wbcContext	*wb_ctx;
+
+	wb_ctx = fr_pool_connection_get(wa->inst->wb_pool, NULL);
 	if (wb_ctx == NULL) {
-		RERROR("Unable to get winbind connection from pool");
-		goto done;
+		wa->no_conn = true;
+		return;
 	}
 
-	RDEBUG2("Sending authentication request user='%s' domain='%s'", authparams.account_name,
-									authparams.domain_name);
+	wa->err = wbcCtxAuthenticateUserEx(wb_ctx, &wa->authparams, &wa->info, &wa->error);
 
-	err = wbcCtxAuthenticateUserEx(wb_ctx, &authparams, &info, &error);
+	fr_pool_connection_release(wa->inst->wb_pool, NULL, wb_ctx);
+}
 
-	fr_pool_connection_release(inst->wb_pool, request, wb_ctx);
+/** Process the result of a winbind authentication
+ *
+ * @param[in] request	The current request.
+ * @param[in] wa	Which has been run by #winbind_auth_run.
+ * @return
+ *	- 0	Success
+ *	- -1	Authentication failure
+ *	- -648	Password expired
+ */
+int winbind_auth_result(request_t *request, winbind_auth_t const *wa)
+{
+	int ret = -1;
 
+	if (wa->no_conn) {
+		RERROR("Unable to get winbind connection from pool");
+		return -1;
+	}
 
 	/*
 	 * Try and give some useful feedback on what happened. There are only
 	 * a few errors that can actually be returned from wbcCtxAuthenticateUserEx.
 	 */
-	switch (err) {
+	switch (wa->err) {
 	case WBC_ERR_SUCCESS:
 		ret = 0;
 		RDEBUG2("Authenticated successfully");
@@ -145,7 +187,7 @@ int do_auth_wbclient_pap(rlm_winbind_t const *inst, request_t *request, fr_pair_
 		break;
 
 	case WBC_ERR_AUTH_ERROR:
-		if (!error) {
+		if (!wa->error) {
 			REDEBUG2("Authentication failed");
 			break;
 		}
@@ -153,18 +195,18 @@ int do_auth_wbclient_pap(rlm_winbind_t const *inst, request_t *request, fr_pair_
 		/*
 		 * The password needs to be changed, set ret appropriately.
 		 */
-		if (error->nt_status == NT_STATUS_PASSWORD_EXPIRED ||
-		    error->nt_status == NT_STATUS_PASSWORD_MUST_CHANGE) {
+		if (wa->error->nt_status == NT_STATUS_PASSWORD_EXPIRED ||
+		    wa->error->nt_status == NT_STATUS_PASSWORD_MUST_CHANGE) {
 			ret = -648;
 		}
 
 		/*
 		 * Return the NT_STATUS human readable error string, if there is one.
 		 */
-		if (error->display_string) {
-			REDEBUG2("%s [0x%X]", error->display_string, error->nt_status);
+		if (wa->error->display_string) {
+			REDEBUG2("%s [0x%X]", wa->error->display_string, wa->error->nt_status);
 		} else {
-			REDEBUG2("Unknown authentication failure [0x%X]", error->nt_status);
+			REDEBUG2("Unknown authentication failure [0x%X]", wa->error->nt_status);
 		}
 		break;
 
@@ -175,19 +217,14 @@ int do_auth_wbclient_pap(rlm_winbind_t const *inst, request_t *request, fr_pair_
 		 *   WBC_ERR_NO_MEMORY
 		 * neither of which are particularly likely.
 		 */
-		if (error && error->display_string) {
-			REDEBUG2("Failed authenticating user: %s (%s)", error->display_string, wbcErrorString(err));
+		if (wa->error && wa->error->display_string) {
+			REDEBUG2("Failed authenticating user: %s (%s)", wa->error->display_string,
+				 wbcErrorString(wa->err));
 		} else {
-			REDEBUG2("Failed authenticating user: Winbind error (%s)", wbcErrorString(err));
+			REDEBUG2("Failed authenticating user: Winbind error (%s)", wbcErrorString(wa->err));
 		}
 		break;
 	}
 
-
-done:
-	if (info) wbcFreeMemory(info);
-	if (error) wbcFreeMemory(error);
-
 	return ret;
 }
-
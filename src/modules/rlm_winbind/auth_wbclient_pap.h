@@ -4,4 +4,34 @@
 
 RCSIDH(auth_wbclient_h, "$Id$")
 
-int do_auth_wbclient_pap(rlm_winbind_t const *inst, request_t *request, fr_pair_t *password);
+#include <freeradius-devel/util/thread_pool.h>
+
+/** A PAP authentication against winbind, which may be run by a thread pool
+ *
+ * Everything libwbclient needs is copied here, as the request may be
+ * cancelled while winbind is being called.
+ */
+typedef struct {
+	rlm_winbind_t const		*inst;		//!< Module instance.  Only the pool is used by the thread.
+	request_t			*request;	//!< To resume.  Not touched by the thread pool.
+	fr_thread_pool_job_t		*job;		//!< Calling winbind, NULL once it's done.
+
+	char				*account_name;	//!< Expanded username.
+	char				*domain_name;	//!< Expanded domain.
+	char				*password;	//!< Copy of the User-Password.
+	struct wbcAuthUserParams	authparams;	//!< Points to the strings above.
+
+	bool				no_conn;	//!< Couldn't get a winbind connection.
+	wbcErr				err;		//!< What wbcCtxAuthenticateUserEx returned.
+	struct wbcAuthUserInfo		*info;		//!< Freed with this structure.
+	struct wbcAuthErrorInfo		*error;		//!< Freed with this structure.
+
+	fr_time_delta_t			wait;		//!< How long the call was queued for.
+	fr_time_delta_t			run;		//!< How long winbind took to respond.
+} winbind_auth_t;
+
+winbind_auth_t	*winbind_auth_alloc(rlm_winbind_t const *inst, request_t *request, fr_pair_t const *password);
+
+void		winbind_auth_run(void *uctx);
+
+int		winbind_auth_result(request_t *request, winbind_auth_t const *wa);
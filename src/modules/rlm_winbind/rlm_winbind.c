@@ -29,6 +29,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
 
 #include "rlm_winbind.h"
@@ -43,10 +44,17 @@ static const CONF_PARSER group_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER thread_pool_config[] = {
+	{ FR_CONF_OFFSET("threads", FR_TYPE_UINT32, rlm_winbind_t, threads), .dflt = "4" },
+	{ FR_CONF_OFFSET("max_queued", FR_TYPE_UINT32, rlm_winbind_t, max_queued), .dflt = "1024" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("username", FR_TYPE_TMPL, rlm_winbind_t, wb_username) },
 	{ FR_CONF_OFFSET("domain", FR_TYPE_TMPL, rlm_winbind_t, wb_domain) },
 	{ FR_CONF_POINTER("group", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) group_config },
+	{ FR_CONF_POINTER("thread_pool", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) thread_pool_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -376,6 +384,17 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	FR_INTEGER_BOUND_CHECK("thread_pool.threads", inst->threads, <=, 256);
+	FR_INTEGER_BOUND_CHECK("thread_pool.max_queued", inst->max_queued, >=, 1);
+
+	if (inst->threads) {
+		inst->pool = fr_thread_pool_alloc(inst, inst->threads, inst->max_queued);
+		if (!inst->pool) {
+			cf_log_perr(conf, "Failed starting thread pool");
+			return -1;
+		}
+	}
+
 	inst->auth_type = fr_dict_enum_by_name(attr_auth_type, inst->name, -1);
 	if (!inst->auth_type) {
 		WARN("Failed to find 'authenticate %s {...}' section.  Winbind authentication will likely not work",
@@ -447,13 +466,68 @@ no_domain:
  */
 static int mod_detach(void *instance)
 {
-	rlm_winbind_t *inst = instance;
+	rlm_winbind_t		*inst = instance;
+	fr_thread_pool_stats_t	stats;
+
+	if (inst->pool) {
+		fr_thread_pool_stats(&stats, inst->pool);
+		DEBUG("%s - Thread pool made %" PRIu64 " winbind calls, %" PRIu64 " made inline as the queue was full, "
+		      "maximum queue depth %u, mean queue time %pVs, maximum queue time %pVs, mean call time %pVs",
+		      inst->name, stats.completed, stats.overflow, stats.depth_max,
+		      fr_box_time_delta(stats.completed ? stats.wait_total / (fr_time_delta_t)stats.completed : 0),
+		      fr_box_time_delta(stats.wait_max),
+		      fr_box_time_delta(stats.completed ? stats.run_total / (fr_time_delta_t)stats.completed : 0));
+		TALLOC_FREE(inst->pool);
+	}
 
 	fr_pool_free(inst->wb_pool);
 
 	return 0;
 }
 
+/** Connect this worker to the thread pool
+ *
+ * @param[in] conf	Module configuration (unused).
+ * @param[in] instance	This module's instance.
+ * @param[in] el	The worker's event list.
+ * @param[in] thread	This module's thread instance.
+ * @return
+ *	- 0	success
+ *	- -1	failure
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_winbind_t		*inst = talloc_get_type_abort(instance, rlm_winbind_t);
+	rlm_winbind_thread_t	*t = talloc_get_type_abort(thread, rlm_winbind_thread_t);
+
+	if (!inst->pool) return 0;
+
+	t->client = fr_thread_pool_client_alloc(t, inst->pool, el);
+	if (!t->client) {
+		PERROR("%s - Failed connecting to thread pool", inst->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Disconnect this worker from the thread pool
+ *
+ * Blocks until any winbind calls it made have completed.
+ *
+ * @param[in] el	The worker's event list (unused).
+ * @param[in] thread	This module's thread instance.
+ * @return 0
+ */
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_winbind_thread_t	*t = talloc_get_type_abort(thread, rlm_winbind_thread_t);
+
+	TALLOC_FREE(t->client);
+
+	return 0;
+}
+
 
 /** Authorize for libwbclient/winbind authentication
  *
@@ -489,7 +563,69 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 }
 
 
+/** Convert the result of a winbind authentication to a module rcode
+ *
+ */
+static unlang_action_t winbind_auth_rcode(rlm_rcode_t *p_result, request_t *request, winbind_auth_t const *wa)
+{
+	/*
+	 *	No need for many debug outputs or errors as
+	 *	the result function is chatty enough.
+	 */
+	if (winbind_auth_result(request, wa) == 0) {
+		REDEBUG2("User authenticated successfully using winbind");
+		RETURN_MODULE_OK;
+	}
+
+	RETURN_MODULE_REJECT;
+}
+
+static void winbind_auth_done(void *uctx, fr_time_delta_t wait, fr_time_delta_t run)
+{
+	winbind_auth_t	*wa = talloc_get_type_abort(uctx, winbind_auth_t);
+
+	wa->job = NULL;
+	wa->wait = wait;
+	wa->run = run;
+
+	talloc_steal(wa->request, wa);
+	unlang_interpret_mark_runnable(wa->request);
+}
+
+static unlang_action_t winbind_auth_resume(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx,
+					   request_t *request, void *rctx)
+{
+	winbind_auth_t	*wa = talloc_get_type_abort(rctx, winbind_auth_t);
+	unlang_action_t	ua;
+
+	RDEBUG3("winbind responded in %pVs, after queueing for %pVs",
+		fr_box_time_delta(wa->run), fr_box_time_delta(wa->wait));
+
+	ua = winbind_auth_rcode(p_result, request, wa);
+	talloc_free(wa);
+
+	return ua;
+}
+
+static void winbind_auth_signal(UNUSED module_ctx_t const *mctx, UNUSED request_t *request,
+				void *rctx, fr_state_signal_t action)
+{
+	winbind_auth_t	*wa = talloc_get_type_abort(rctx, winbind_auth_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	/*
+	 *	If the call has completed the result is
+	 *	parented by the request, and will be
+	 *	freed with it.
+	 */
+	if (wa->job) fr_thread_pool_cancel(wa->job);
+}
+
 /** Authenticate the user via libwbclient and winbind
+ *
+ * If there's a thread pool, winbind is called by one of its threads,
+ * and the request yields until winbind has responded.
  *
  * @param[out] p_result		The result of the module call.
  * @param[in] mctx		Module instance data.
@@ -498,7 +634,10 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_winbind_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_winbind_t);
+	rlm_winbind_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_winbind_thread_t);
 	fr_pair_t		*username, *password;
+	winbind_auth_t		*wa;
+	unlang_action_t		ua;
 
 	username = fr_pair_find_by_da(&request->request_pairs, attr_user_name, 0);
 	password = fr_pair_find_by_da(&request->request_pairs, attr_user_password, 0);
@@ -534,17 +673,24 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		RDEBUG2("Login attempt with password");
 	}
 
+	wa = winbind_auth_alloc(inst, request, password);
+	if (!wa) RETURN_MODULE_REJECT;
+
+	if (t->client) {
+		wa->job = fr_thread_pool_submit(t->client, winbind_auth_run, winbind_auth_done, wa);
+		if (wa->job) return unlang_module_yield(request, winbind_auth_resume, winbind_auth_signal, wa);
+
+		RWDEBUG2("Thread pool queue is full, calling winbind inline");
+	}
+
 	/*
-	 *	Authenticate and return OK if successful. No need for
-	 *	many debug outputs or errors as the auth function is
-	 *	chatty enough.
+	 *	Authenticate and return OK if successful.
 	 */
-	if (do_auth_wbclient_pap(inst, request, password) == 0) {
-		REDEBUG2("User authenticated successfully using winbind");
-		RETURN_MODULE_OK;
-	}
+	winbind_auth_run(wa);
+	ua = winbind_auth_rcode(p_result, request, wa);
+	talloc_free(wa);
 
-	RETURN_MODULE_REJECT;
+	return ua;
 }
 
 
@@ -562,10 +708,13 @@ module_t rlm_winbind = {
 	.magic		= RLM_MODULE_INIT,
 	.name		= "winbind",
 	.inst_size	= sizeof(rlm_winbind_t),
+	.thread_inst_size	= sizeof(rlm_winbind_thread_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
 	.bootstrap	= mod_bootstrap,
 	.detach		= mod_detach,
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize
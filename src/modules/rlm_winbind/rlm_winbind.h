@@ -4,6 +4,7 @@
 #include "config.h"
 #include <wbclient.h>
 #include <freeradius-devel/server/pool.h>
+#include <freeradius-devel/util/thread_pool.h>
 
 /*
  *      Structure for the module configuration.
@@ -21,4 +22,16 @@ typedef struct {
 	tmpl_t		*group_username;
 	bool			group_add_domain;
 	char const		*group_attribute;
+
+	/* thread pool config */
+	uint32_t		threads;	//!< Number of threads calling winbind.
+	uint32_t		max_queued;	//!< Maximum number of calls waiting for a thread.
+	fr_thread_pool_t	*pool;		//!< Threads calling winbind.
 } rlm_winbind_t;
+
+/*
+ *      Per-worker thread instance.
+ */
+typedef struct {
+	fr_thread_pool_client_t	*client;	//!< For submitting calls to the thread pool.
+} rlm_winbind_thread_t;
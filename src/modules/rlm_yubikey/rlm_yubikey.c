@@ -28,10 +28,12 @@ RCSID("$Id$")
 #include <freeradius-devel/radius/radius.h>
 #include "rlm_yubikey.h"
 
-#ifdef HAVE_YKCLIENT
+#ifdef WITH_YUBIKEY_VALIDATE
 static const CONF_PARSER validation_config[] = {
 	{ FR_CONF_OFFSET("client_id", FR_TYPE_UINT32, rlm_yubikey_t, client_id), .dflt = 0 },
 	{ FR_CONF_OFFSET("api_key", FR_TYPE_STRING | FR_TYPE_SECRET, rlm_yubikey_t, api_key) },
+	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, rlm_yubikey_t, timeout), .dflt = "5.0" },
+	{ FR_CONF_OFFSET("tls", FR_TYPE_SUBSECTION, rlm_yubikey_t, tls), .subcs = (void const *) fr_curl_tls_config },
 	CONF_PARSER_TERMINATOR
 };
 #endif
@@ -41,7 +43,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("split", FR_TYPE_BOOL, rlm_yubikey_t, split), .dflt = "yes" },
 	{ FR_CONF_OFFSET("decrypt", FR_TYPE_BOOL, rlm_yubikey_t, decrypt), .dflt = "no" },
 	{ FR_CONF_OFFSET("validate", FR_TYPE_BOOL, rlm_yubikey_t, validate), .dflt = "no" },
-#ifdef HAVE_YKCLIENT
+#ifdef WITH_YUBIKEY_VALIDATE
 	{ FR_CONF_POINTER("validation", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) validation_config },
 #endif
 	CONF_PARSER_TERMINATOR
@@ -174,12 +176,22 @@ static int mod_load(void)
 		return -1;
 	}
 
+#ifdef WITH_YUBIKEY_VALIDATE
+	if (fr_curl_init() < 0) {
+		fr_dict_autofree(rlm_yubikey_dict);
+		return -1;
+	}
+#endif
+
 	return 0;
 
 }
 
 static void mod_unload(void)
 {
+#ifdef WITH_YUBIKEY_VALIDATE
+	fr_curl_free();
+#endif
 	fr_dict_autofree(rlm_yubikey_dict);
 }
 
@@ -227,7 +239,7 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	}
 
 	if (inst->validate) {
-#ifdef HAVE_YKCLIENT
+#ifdef WITH_YUBIKEY_VALIDATE
 		CONF_SECTION *cs;
 
 		cs = cf_section_find(conf, "validation", CF_IDENT_ANY);
@@ -236,11 +248,11 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 			return -1;
 		}
 
-		if (rlm_yubikey_ykclient_init(cs, inst) < 0) {
+		if (rlm_yubikey_validate_init(cs, inst) < 0) {
 			return -1;
 		}
 #else
-		cf_log_err(conf, "Requires libykclient for OTP validation against Yubicloud servers");
+		cf_log_err(conf, "Requires libfreeradius-curl for OTP validation against Yubicloud servers");
 		return -1;
 #endif
 	}
@@ -248,10 +260,23 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
-#ifdef HAVE_YKCLIENT
-static int mod_detach(void *instance)
+#ifdef WITH_YUBIKEY_VALIDATE
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_yubikey_t const	*inst = talloc_get_type_abort_const(instance, rlm_yubikey_t);
+	rlm_yubikey_thread_t	*t = talloc_get_type_abort(thread, rlm_yubikey_thread_t);
+
+	if (!inst->validate) return 0;
+
+	return rlm_yubikey_validate_thread_init(t, el);
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
 {
-	rlm_yubikey_ykclient_detach((rlm_yubikey_t *) instance);
+	rlm_yubikey_thread_t	*t = talloc_get_type_abort(thread, rlm_yubikey_thread_t);
+
+	if (t->mhandle) rlm_yubikey_validate_thread_detach(t);
+
 	return 0;
 }
 #endif
@@ -437,12 +462,16 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 
 		rlm_yubikey_decrypt(&rcode, inst, request, passcode);
 		if (rcode != RLM_MODULE_OK) RETURN_MODULE_RCODE(rcode);
-		/* Fall-Through to doing ykclient auth in addition to local auth */
+		/* Fall-Through to doing Yubicloud validation in addition to local auth */
 	}
 #endif
 
-#ifdef HAVE_YKCLIENT
-	if (inst->validate) return rlm_yubikey_validate(p_result, inst, request, passcode);
+#ifdef WITH_YUBIKEY_VALIDATE
+	if (inst->validate) {
+		rlm_yubikey_thread_t *t = talloc_get_type_abort(mctx->thread, rlm_yubikey_thread_t);
+
+		return rlm_yubikey_validate(p_result, inst, t, request, passcode);
+	}
 #endif
 	RETURN_MODULE_RCODE(rcode);
 }
@@ -467,8 +496,10 @@ module_t rlm_yubikey = {
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
-#ifdef HAVE_YKCLIENT
-	.detach		= mod_detach,
+#ifdef WITH_YUBIKEY_VALIDATE
+	.thread_inst_size	= sizeof(rlm_yubikey_thread_t),
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 #endif
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
@@ -20,8 +20,8 @@
 
 #include "config.h"
 
-#ifdef HAVE_YKCLIENT
-#include <ykclient.h>
+#ifdef WITH_YUBIKEY_VALIDATE
+#include <freeradius-devel/curl/base.h>
 #endif
 
 #ifdef HAVE_YUBIKEY
@@ -43,17 +43,31 @@ typedef struct {
 	unsigned int		id_len;			//!< The length of the Public ID portion of the OTP string.
 	bool			split;			//!< Split password string into components.
 	bool			decrypt;		//!< Decrypt the OTP string using the yubikey library.
-	bool			validate;		//!< Validate the OTP string using the ykclient library.
+	bool			validate;		//!< Validate the OTP string against Yubicloud servers.
 	char const		**uris;			//!< Yubicloud URLs to validate the token against.
 
-#ifdef HAVE_YKCLIENT
+#ifdef WITH_YUBIKEY_VALIDATE
 	unsigned int		client_id;		//!< Validation API client ID.
-	char const		*api_key;		//!< Validation API signing key.
-	ykclient_t		*ykc;			//!< ykclient configuration.
-	fr_pool_t	*pool;			//!< Connection pool instance.
+	char const		*api_key;		//!< Validation API signing key (base64).
+	uint8_t			*key;			//!< Decoded signing key.
+	size_t			key_len;		//!< Length of the decoded signing key.
+	fr_time_delta_t		timeout;		//!< How long to wait for a validation server.
+	fr_curl_tls_t		tls;			//!< TLS settings for the validation servers.
 #endif
 } rlm_yubikey_t;
 
+#ifdef WITH_YUBIKEY_VALIDATE
+/** Thread specific data
+ *
+ */
+typedef struct {
+	fr_curl_handle_t	*mhandle;		//!< Thread specific multi handle.
+	fr_dlist_head_t		abandoned;		//!< Queries which completed after another server
+							///< answered.  Left to finish so their connections
+							///< can be reused.
+} rlm_yubikey_thread_t;
+#endif
+
 
 /*
  *	decrypt.c - Decryption functions
@@ -61,13 +75,18 @@ typedef struct {
 unlang_action_t rlm_yubikey_decrypt(rlm_rcode_t *p_result, rlm_yubikey_t const *inst, request_t *request, char const *passcode);
 
 /*
- *	validate.c - Connection pool and validation functions
+ *	validate.c - Validation against Yubicloud servers
  */
-int rlm_yubikey_ykclient_init(CONF_SECTION *conf, rlm_yubikey_t *inst);
+#ifdef WITH_YUBIKEY_VALIDATE
+int rlm_yubikey_validate_init(CONF_SECTION *conf, rlm_yubikey_t *inst);
+
+int rlm_yubikey_validate_thread_init(rlm_yubikey_thread_t *t, fr_event_list_t *el);
 
-int rlm_yubikey_ykclient_detach(rlm_yubikey_t *inst);
+void rlm_yubikey_validate_thread_detach(rlm_yubikey_thread_t *t);
 
-unlang_action_t rlm_yubikey_validate(rlm_rcode_t *p_result, rlm_yubikey_t const *inst, request_t *request, char const *passcode);
+unlang_action_t rlm_yubikey_validate(rlm_rcode_t *p_result, rlm_yubikey_t const *inst, rlm_yubikey_thread_t *t,
+				     request_t *request, char const *passcode);
+#endif
 
 extern fr_dict_attr_t const *attr_auth_type;
 extern fr_dict_attr_t const *attr_user_password;
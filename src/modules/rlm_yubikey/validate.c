@@ -1,7 +1,12 @@
 /**
  * $Id$
  * @file rlm_yubikey/validate.c
- * @brief Authentication for yubikey OTP tokens using the ykclient library.
+ * @brief Validation of yubikey OTP tokens against Yubicloud servers.
+ *
+ * Each OTP is sent to all the configured validation servers in parallel,
+ * using the thread's curl multi handle.  The first definitive answer
+ * is used, and the remaining queries are left to complete in the
+ * background so their connections can be reused.
  *
  * @author Arran Cudbard-Bell (a.cudbardb@networkradius.com)
  * @copyright 2013 The FreeRADIUS server project
@@ -12,186 +17,563 @@
 
 #include "rlm_yubikey.h"
 
-#ifdef HAVE_YKCLIENT
-#include <freeradius-devel/server/pool.h>
+#ifdef WITH_YUBIKEY_VALIDATE
+#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/util/base64.h>
+#include <freeradius-devel/util/sha1.h>
+
+#define YUBIKEY_NONCE_LEN	32			//!< In hex chars, the protocol allows 16-40.
+#define YUBIKEY_MAX_RESPONSE	1024			//!< Responses are a handful of short lines.
+#define YUBIKEY_MAX_LINES	16
 
-/** Frees a ykclient handle
+/** The validation servers used if none are configured
+ *
+ */
+static char const *default_uris[] = {
+	"https://api.yubico.com/wsapi/2.0/verify",
+	"https://api2.yubico.com/wsapi/2.0/verify",
+	"https://api3.yubico.com/wsapi/2.0/verify",
+	"https://api4.yubico.com/wsapi/2.0/verify",
+	"https://api5.yubico.com/wsapi/2.0/verify",
+	NULL
+};
+
+/** Statuses which end validation
+ *
+ * Anything else (BACKEND_ERROR, NOT_ENOUGH_ANSWERS, REPLAYED_REQUEST)
+ * is specific to the server which sent it, so we wait for the others.
+ */
+static fr_table_num_sorted_t const yubikey_status_table[] = {
+	{ L("BAD_OTP"),			RLM_MODULE_REJECT	},
+	{ L("BAD_SIGNATURE"),		RLM_MODULE_FAIL		},
+	{ L("MISSING_PARAMETER"),	RLM_MODULE_FAIL		},
+	{ L("NO_SUCH_CLIENT"),		RLM_MODULE_NOTFOUND	},
+	{ L("OK"),			RLM_MODULE_OK		},
+	{ L("OPERATION_NOT_ALLOWED"),	RLM_MODULE_FAIL		},
+	{ L("REPLAYED_OTP"),		RLM_MODULE_REJECT	}
+};
+static size_t yubikey_status_table_len = NUM_ELEMENTS(yubikey_status_table);
+
+typedef struct yubikey_validate_s yubikey_validate_t;
+
+/** A query to a single validation server
+ *
+ */
+typedef struct {
+	yubikey_validate_t	*validate;		//!< Validation this query is part of.
+							///< NULL if the query has been abandoned.
+	rlm_yubikey_thread_t	*t;			//!< Thread the query is running in.
+	fr_curl_io_request_t	*randle;		//!< Performing the query.
+	char const		*uri;			//!< Of the server being queried.
+	char			*url;			//!< URI plus query parameters.
+	char			*resp;			//!< Response body, '\0' terminated.
+	size_t			resp_len;		//!< Length of the response body.
+	bool			pending;		//!< Still in the multi handle.
+	fr_dlist_t		entry;			//!< Entry in the thread's abandoned list.
+} yubikey_query_t;
+
+/** Validation of a single OTP
  *
- * @param[in] yandle rlm_yubikey_handle_t to close and free.
- * @return returns 0.
  */
-static int _mod_conn_free(ykclient_handle_t **yandle)
+struct yubikey_validate_s {
+	rlm_yubikey_t const	*inst;			//!< Module instance.
+	request_t		*request;		//!< Being validated.
+	char const		*otp;			//!< Being validated.
+	char			nonce[YUBIKEY_NONCE_LEN + 1];	//!< Must be echoed back by the server.
+	yubikey_query_t		**queries;		//!< One per validation server.
+	unsigned int		outstanding;		//!< Queries we're waiting on.
+	rlm_rcode_t		rcode;			//!< From the first definitive response.
+	bool			done;			//!< A server has given a definitive response.
+};
+
+static int _yubikey_query_free(yubikey_query_t *query)
 {
-	ykclient_handle_done(yandle);
+	if (query->pending) {
+		curl_multi_remove_handle(query->t->mhandle->mandle, query->randle->candle);
+		query->t->mhandle->transfers--;
+	}
+	TALLOC_FREE(query->randle);
 
 	return 0;
 }
 
-/** Creates a new connection handle for use by the FR connection API.
+/** Accumulate the response from the validation server
  *
- * Matches the fr_pool_connection_create_t function prototype, is passed to
- * fr_pool_init, and called when a new connection is required by the
- * connection pool API.
+ */
+static size_t yubikey_response_write(void *ptr, size_t size, size_t nmemb, void *uctx)
+{
+	yubikey_query_t		*query = talloc_get_type_abort(uctx, yubikey_query_t);
+	size_t			len = size * nmemb;
+
+	if ((query->resp_len + len) > YUBIKEY_MAX_RESPONSE) return 0;	/* Aborts the transfer */
+
+	MEM(query->resp = talloc_realloc(query, query->resp, char, query->resp_len + len + 1));
+	memcpy(query->resp + query->resp_len, ptr, len);
+	query->resp_len += len;
+	query->resp[query->resp_len] = '\0';
+
+	return len;
+}
+
+/** Calculate the signature over a set of sorted key=value pairs
  *
- * @see fr_pool_init
- * @see fr_pool_connection_create_t
- * @see connection.c
  */
-static void *mod_conn_create(TALLOC_CTX *ctx, void *instance, UNUSED fr_time_delta_t timeout)
+static void yubikey_sign(uint8_t digest[static SHA1_DIGEST_LENGTH], rlm_yubikey_t const *inst, char const *params)
 {
-	rlm_yubikey_t const *inst = talloc_get_type_abort_const(instance, rlm_yubikey_t);
-	ykclient_rc status;
-	ykclient_handle_t *yandle, **marker;
+	fr_hmac_sha1(digest, (uint8_t const *)params, strlen(params), inst->key, inst->key_len);
+}
 
-	status = ykclient_handle_init(inst->ykc, &yandle);
-	if (status != YKCLIENT_OK) {
-		ERROR("%s", ykclient_strerror(status));
+static int yubikey_line_cmp(void const *a, void const *b)
+{
+	return strcmp(*(char const * const *)a, *(char const * const *)b);
+}
 
-		return NULL;
+/** Find the value of a key in the response
+ *
+ */
+static char const *yubikey_line_value(char **lines, unsigned int num, char const *key)
+{
+	size_t		len = strlen(key);
+	unsigned int	i;
+
+	for (i = 0; i < num; i++) {
+		if ((strncmp(lines[i], key, len) == 0) && (lines[i][len] == '=')) return lines[i] + len + 1;
 	}
-	marker = talloc(ctx, ykclient_handle_t *);
-	talloc_set_destructor(marker, _mod_conn_free);
-	*marker = yandle;
 
-	return yandle;
+	return NULL;
 }
 
-int rlm_yubikey_ykclient_init(CONF_SECTION *conf, rlm_yubikey_t *inst)
+/** Check the signature of a response
+ *
+ * The signature is calculated over all the key=value pairs except h,
+ * sorted by key, and joined with '&'.
+ */
+static bool yubikey_response_verify(yubikey_validate_t *validate, char **lines, unsigned int num, char const *h)
 {
-	ykclient_rc status;
-	CONF_SECTION *servers;
+	rlm_yubikey_t const	*inst = validate->inst;
+	uint8_t			digest[SHA1_DIGEST_LENGTH];
+	uint8_t			expected[SHA1_DIGEST_LENGTH + 2];
+	char			*params;
+	char			*sorted[YUBIKEY_MAX_LINES];
+	unsigned int		i, j = 0;
+	ssize_t			slen;
+
+	if (!h) return false;
+
+	slen = fr_base64_decode(&FR_DBUFF_TMP(expected, sizeof(expected)), &FR_SBUFF_IN(h, strlen(h)), true, true);
+	if (slen != SHA1_DIGEST_LENGTH) return false;
+
+	for (i = 0; i < num; i++) {
+		if ((lines[i][0] == 'h') && (lines[i][1] == '=')) continue;
+		sorted[j++] = lines[i];
+	}
+	qsort(sorted, j, sizeof(sorted[0]), yubikey_line_cmp);
 
-	int count = 0;
+	MEM(params = talloc_strdup(validate, ""));
+	for (i = 0; i < j; i++) {
+		if (i > 0) MEM(params = talloc_strdup_append_buffer(params, "&"));
+		MEM(params = talloc_strdup_append_buffer(params, sorted[i]));
+	}
 
-	if (!inst->client_id) {
-		ERROR("validation.client_id must be set (to a valid id) when validation is enabled");
+	yubikey_sign(digest, inst, params);
+	talloc_free(params);
 
-		return -1;
+	return fr_digest_cmp(digest, expected, sizeof(digest)) == 0;
+}
+
+/** Process the response from a single validation server
+ *
+ * Sets validate->done and validate->rcode if the response is definitive.
+ */
+static void yubikey_query_process(yubikey_validate_t *validate, yubikey_query_t *query)
+{
+	request_t		*request = validate->request;
+	char			*lines[YUBIKEY_MAX_LINES];
+	unsigned int		num = 0;
+	char			*p, *q;
+	char const		*status, *value;
+	long			code = 0;
+	rlm_rcode_t		rcode;
+
+	if (query->randle->result != CURLE_OK) {
+		RWDEBUG("%s - Query failed: %s", query->uri, curl_easy_strerror(query->randle->result));
+		return;
 	}
 
-	if (!inst->api_key || !*inst->api_key || is_zero(inst->api_key)) {
-		ERROR("validation.api_key must be set (to a valid key) when validation is enabled");
+	curl_easy_getinfo(query->randle->candle, CURLINFO_RESPONSE_CODE, &code);
+	if (code != 200) {
+		RWDEBUG("%s - Query failed: HTTP status %li", query->uri, code);
+		return;
+	}
 
-		return -1;
+	if (!query->resp) {
+		RWDEBUG("%s - Empty response", query->uri);
+		return;
 	}
 
-	DEBUG("Initialising ykclient");
+	/*
+	 *	key=value lines, separated by CRLF
+	 */
+	for (p = query->resp; *p && (num < YUBIKEY_MAX_LINES); p = q) {
+		q = p + strcspn(p, "\r\n");
+		if (*q) *q++ = '\0';
+		while ((*q == '\r') || (*q == '\n')) q++;
 
-	status = ykclient_global_init();
-	if (status != YKCLIENT_OK) {
-yk_error:
-		ERROR("%s", ykclient_strerror(status));
+		if (!strchr(p, '=')) continue;
+		lines[num++] = p;
+	}
 
-		return -1;
+	status = yubikey_line_value(lines, num, "status");
+	if (!status) {
+		RWDEBUG("%s - Response contains no status", query->uri);
+		return;
 	}
 
-	status = ykclient_init(&inst->ykc);
-	if (status != YKCLIENT_OK) goto yk_error;
+	rcode = fr_table_value_by_str(yubikey_status_table, status, RLM_MODULE_NOT_SET);
 
-	servers = cf_section_find(conf, "servers", CF_IDENT_ANY);
-	if (servers) {
-		CONF_PAIR *uri, *first;
-		/*
-		 *	If there were no uris configured we just use the default
-		 *	ykclient uris which point to the yubico servers.
-		 */
-		first = uri = cf_pair_find(servers, "uri");
-		if (!uri) {
-			goto init;
+	/*
+	 *	Servers can't sign responses for clients they
+	 *	don't know about, so only check signatures on
+	 *	successful responses, or if there is one.
+	 */
+	value = yubikey_line_value(lines, num, "h");
+	if ((rcode == RLM_MODULE_OK) || value) {
+		if (!yubikey_response_verify(validate, lines, num, value)) {
+			RWDEBUG("%s - Response has an invalid signature", query->uri);
+			return;
 		}
+	}
 
-		while (uri) {
-			count++;
-			uri = cf_pair_find_next(servers, uri, "uri");
+	if (rcode == RLM_MODULE_OK) {
+		value = yubikey_line_value(lines, num, "otp");
+		if (!value || (strcmp(value, validate->otp) != 0)) {
+			RWDEBUG("%s - Response is for a different OTP", query->uri);
+			return;
 		}
-		inst->uris = talloc_zero_array(inst, char const *, count);
 
-		uri = first;
-		count = 0;
-		while (uri) {
-			inst->uris[count++] = cf_pair_value(uri);
-			uri = cf_pair_find_next(servers, uri, "uri");
-		}
-		if (count) {
-			status = ykclient_set_url_templates(inst->ykc, count, inst->uris);
-			if (status != YKCLIENT_OK) {
-				goto yk_error;
-			}
+		value = yubikey_line_value(lines, num, "nonce");
+		if (!value || (strcmp(value, validate->nonce) != 0)) {
+			RWDEBUG("%s - Response has the wrong nonce", query->uri);
+			return;
 		}
 	}
 
-init:
-	status = ykclient_set_client_b64(inst->ykc, inst->client_id, inst->api_key);
-	if (status != YKCLIENT_OK) {
-		ERROR("%s", ykclient_strerror(status));
+	if (rcode == RLM_MODULE_NOT_SET) {
+		RWDEBUG("%s - Server returned %s, waiting for other servers", query->uri, status);
+		return;
+	}
 
-		return -1;
+	if (rcode == RLM_MODULE_OK) {
+		RDEBUG2("%s - OTP is valid", query->uri);
+	} else {
+		REDEBUG("%s - Server returned %s", query->uri, status);
 	}
 
-	inst->pool = module_connection_pool_init(conf, inst, mod_conn_create, NULL, inst->name, NULL, NULL);
-	if (!inst->pool) {
-		ykclient_done(&inst->ykc);
+	validate->rcode = rcode;
+	validate->done = true;
+}
 
-		return -1;
+/** Leave any queries still in progress to complete in the background
+ *
+ * Removing an easy handle from the multi handle tears down its connection,
+ * which would then have to be re-established for the next OTP.
+ */
+static void yubikey_validate_abandon(yubikey_validate_t *validate)
+{
+	size_t	i;
+
+	for (i = 0; i < talloc_array_length(validate->queries); i++) {
+		yubikey_query_t *query = validate->queries[i];
+
+		if (!query || !query->pending) continue;
+
+		query->validate = NULL;
+		talloc_steal(query->t, query);
+		fr_dlist_insert_tail(&query->t->abandoned, query);
+		validate->queries[i] = NULL;
 	}
+	validate->outstanding = 0;
+}
 
-	return 0;
+/** A query to one of the validation servers completed
+ *
+ */
+static void yubikey_query_complete(fr_curl_io_request_t *randle)
+{
+	yubikey_query_t		*query = talloc_get_type_abort(randle->uctx, yubikey_query_t);
+	yubikey_validate_t	*validate = query->validate;
+
+	query->pending = false;
+
+	/*
+	 *	Another server already answered
+	 */
+	if (!validate) {
+		fr_dlist_remove(&query->t->abandoned, query);
+		talloc_free(query);
+		return;
+	}
+
+	validate->outstanding--;
+	yubikey_query_process(validate, query);
+
+	if (validate->done) {
+		yubikey_validate_abandon(validate);
+	} else if (validate->outstanding > 0) {
+		return;
+	}
+
+	unlang_interpret_mark_runnable(validate->request);
 }
 
-int rlm_yubikey_ykclient_detach(rlm_yubikey_t *inst)
+static unlang_action_t yubikey_validate_resume(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx,
+					       request_t *request, void *rctx)
 {
-	fr_pool_free(inst->pool);
-	ykclient_done(&inst->ykc);
-	ykclient_global_done();
+	yubikey_validate_t	*validate = talloc_get_type_abort(rctx, yubikey_validate_t);
+	rlm_rcode_t		rcode = validate->rcode;
 
-	return 0;
+	if (!validate->done) {
+		REDEBUG("No validation server gave a usable response");
+		rcode = RLM_MODULE_FAIL;
+	}
+	talloc_free(validate);
+
+	RETURN_MODULE_RCODE(rcode);
 }
 
-unlang_action_t rlm_yubikey_validate(rlm_rcode_t *p_result, rlm_yubikey_t const *inst, request_t *request, char const *passcode)
+static void yubikey_validate_signal(UNUSED module_ctx_t const *mctx, request_t *request, void *rctx,
+				    fr_state_signal_t action)
 {
-	rlm_rcode_t rcode = RLM_MODULE_OK;
-	ykclient_rc status;
-	ykclient_handle_t *yandle;
+	yubikey_validate_t	*validate = talloc_get_type_abort(rctx, yubikey_validate_t);
 
-	yandle = fr_pool_connection_get(inst->pool, request);
-	if (!yandle) RETURN_MODULE_FAIL;
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	RDEBUG2("Cancelling OTP validation");
+
+	yubikey_validate_abandon(validate);
+	talloc_free(validate);
+}
+
+/** Build the query parameters, sorted by key, and signed if we have a key
+ *
+ */
+static char *yubikey_params_alloc(yubikey_validate_t *validate)
+{
+	rlm_yubikey_t const	*inst = validate->inst;
+	uint8_t			digest[SHA1_DIGEST_LENGTH];
+	char			h[FR_BASE64_ENC_LENGTH(SHA1_DIGEST_LENGTH) + 1];
+	char			*params, *p;
+	ssize_t			slen;
+
+	MEM(params = talloc_typed_asprintf(validate, "id=%u&nonce=%s&otp=%s",
+					   inst->client_id, validate->nonce, validate->otp));
+	if (!inst->key) return params;
+
+	yubikey_sign(digest, inst, params);
+	slen = fr_base64_encode(&FR_SBUFF_OUT(h, sizeof(h)), &FR_DBUFF_TMP(digest, sizeof(digest)), true);
+	if (slen < 0) {
+		talloc_free(params);
+		return NULL;
+	}
+	h[slen] = '\0';
 
 	/*
-	 *	The libcurl multi-handle interface will tear down the TCP sockets for any partially completed
-	 *	requests when their easy handle is removed from the multistack.
-	 *
-	 *	For performance reasons ykclient will stop processing the request immediately after receiving
-	 *	a response from one of the servers. If we then immediately call ykclient_handle_cleanup
-	 *	the connections are destroyed and will need to be re-established the next time the handle
-	 *	is used.
-	 *
-	 *	To try and prevent this from happening, we leave cleanup until the *next* time
-	 *	the handle is used, by which time the requests will of hopefully completed and the connections
-	 *	can be re-used.
-	 *
+	 *	'+', '/' and '=' need escaping in URLs
 	 */
-	ykclient_handle_cleanup(yandle);
-
-	status = ykclient_request_process(inst->ykc, yandle, passcode);
-	if (status != YKCLIENT_OK) {
-		REDEBUG("%s", ykclient_strerror(status));
-		switch (status) {
-		case YKCLIENT_BAD_OTP:
-		case YKCLIENT_REPLAYED_OTP:
-			rcode = RLM_MODULE_REJECT;
+	MEM(params = talloc_strdup_append_buffer(params, "&h="));
+	for (p = h; *p; p++) {
+		switch (*p) {
+		case '+':
+			MEM(params = talloc_strdup_append_buffer(params, "%2B"));
+			break;
+
+		case '/':
+			MEM(params = talloc_strdup_append_buffer(params, "%2F"));
 			break;
 
-		case YKCLIENT_NO_SUCH_CLIENT:
-			rcode = RLM_MODULE_NOTFOUND;
+		case '=':
+			MEM(params = talloc_strdup_append_buffer(params, "%3D"));
 			break;
 
 		default:
-			rcode = RLM_MODULE_FAIL;
+			MEM(params = talloc_strndup_append_buffer(params, p, 1));
+			break;
 		}
 	}
 
-	fr_pool_connection_release(inst->pool, request, yandle);
+	return params;
+}
 
-	RETURN_MODULE_RCODE(rcode);
+static yubikey_query_t *yubikey_query_alloc(yubikey_validate_t *validate, rlm_yubikey_thread_t *t,
+					    char const *uri, char const *params)
+{
+	rlm_yubikey_t const	*inst = validate->inst;
+	request_t		*request = validate->request;
+	yubikey_query_t		*query;
+	fr_curl_io_request_t	*randle;
+
+	MEM(query = talloc_zero(validate, yubikey_query_t));
+	talloc_set_destructor(query, _yubikey_query_free);
+	query->validate = validate;
+	query->t = t;
+	query->uri = uri;
+	MEM(query->url = talloc_typed_asprintf(query, "%s?%s", uri, params));
+
+	randle = query->randle = fr_curl_io_request_alloc(query);
+	if (!randle) {
+		REDEBUG("Failed allocating curl handle");
+	error:
+		talloc_free(query);
+		return NULL;
+	}
+	randle->uctx = query;
+
+	FR_CURL_REQUEST_SET_OPTION(CURLOPT_URL, query->url);
+	FR_CURL_REQUEST_SET_OPTION(CURLOPT_PROTOCOLS, (long)(CURLPROTO_HTTP | CURLPROTO_HTTPS));
+	FR_CURL_REQUEST_SET_OPTION(CURLOPT_NOSIGNAL, 1L);
+	FR_CURL_REQUEST_SET_OPTION(CURLOPT_TIMEOUT_MS, (long)fr_time_delta_to_msec(inst->timeout));
+	FR_CURL_REQUEST_SET_OPTION(CURLOPT_WRITEFUNCTION, yubikey_response_write);
+	FR_CURL_REQUEST_SET_OPTION(CURLOPT_WRITEDATA, query);
+
+	if (fr_curl_easy_tls_init(randle, &inst->tls) < 0) goto error;
+
+	return query;
+}
+
+/** Validate an OTP against all the configured servers in parallel
+ *
+ * The request is resumed when the first definitive response arrives,
+ * or when all the servers have failed to give one.
+ */
+unlang_action_t rlm_yubikey_validate(rlm_rcode_t *p_result, rlm_yubikey_t const *inst, rlm_yubikey_thread_t *t,
+				     request_t *request, char const *passcode)
+{
+	yubikey_validate_t	*validate;
+	char			*params;
+	size_t			i, num;
+
+	for (num = 0; inst->uris[num]; num++);
+
+	MEM(validate = talloc_zero(request, yubikey_validate_t));
+	validate->inst = inst;
+	validate->request = request;
+	validate->otp = passcode;
+	snprintf(validate->nonce, sizeof(validate->nonce), "%08x%08x%08x%08x",
+		 fr_rand(), fr_rand(), fr_rand(), fr_rand());
+	MEM(validate->queries = talloc_zero_array(validate, yubikey_query_t *, num));
+
+	params = yubikey_params_alloc(validate);
+	if (!params) {
+		REDEBUG("Failed signing validation request");
+	error:
+		yubikey_validate_abandon(validate);
+		talloc_free(validate);
+		RETURN_MODULE_FAIL;
+	}
+
+	for (i = 0; i < num; i++) {
+		yubikey_query_t *query;
+
+		query = yubikey_query_alloc(validate, t, inst->uris[i], params);
+		if (!query) goto error;
+
+		if (fr_curl_io_background_enqueue(t->mhandle, query->randle, yubikey_query_complete) < 0) {
+			talloc_free(query);
+			goto error;
+		}
+		query->pending = true;
+		validate->queries[i] = query;
+		validate->outstanding++;
+
+		RDEBUG2("Validating OTP against %s", inst->uris[i]);
+	}
+	talloc_free(params);
+
+	return unlang_module_yield(request, yubikey_validate_resume, yubikey_validate_signal, validate);
+}
+
+int rlm_yubikey_validate_init(CONF_SECTION *conf, rlm_yubikey_t *inst)
+{
+	CONF_SECTION	*servers;
+	CONF_PAIR	*uri;
+	size_t		len;
+	ssize_t		slen;
+	int		count = 0;
+
+	if (!inst->client_id) {
+		cf_log_err(conf, "validation.client_id must be set (to a valid id) when validation is enabled");
+
+		return -1;
+	}
+
+	if (!inst->api_key || !*inst->api_key || is_zero(inst->api_key)) {
+		cf_log_err(conf, "validation.api_key must be set (to a valid key) when validation is enabled");
+
+		return -1;
+	}
+
+	len = strlen(inst->api_key);
+	MEM(inst->key = talloc_array(inst, uint8_t, FR_BASE64_DEC_LENGTH(len)));
+	slen = fr_base64_decode(&FR_DBUFF_TMP(inst->key, talloc_array_length(inst->key)),
+				&FR_SBUFF_IN(inst->api_key, len), true, true);
+	if (slen <= 0) {
+		cf_log_perr(conf, "validation.api_key is not valid base64");
+
+		return -1;
+	}
+	inst->key_len = (size_t)slen;
+
+	/*
+	 *	If there were no uris configured we just use the
+	 *	default uris which point to the yubico servers.
+	 */
+	servers = cf_section_find(conf, "servers", CF_IDENT_ANY);
+	if (servers) {
+		for (uri = cf_pair_find(servers, "uri"); uri; uri = cf_pair_find_next(servers, uri, "uri")) count++;
+	}
+
+	if (!count) {
+		inst->uris = default_uris;
+
+		return 0;
+	}
+
+	inst->uris = talloc_zero_array(inst, char const *, count + 1);
+
+	count = 0;
+	for (uri = cf_pair_find(servers, "uri"); uri; uri = cf_pair_find_next(servers, uri, "uri")) {
+		char const *value = cf_pair_value(uri);
+		char const *q;
+
+		/*
+		 *	ykclient style templates include the query
+		 *	string, which we now build ourselves.
+		 */
+		q = strchr(value, '?');
+		inst->uris[count++] = q ? talloc_bstrndup(inst->uris, value, q - value) : value;
+	}
+
+	return 0;
+}
+
+int rlm_yubikey_validate_thread_init(rlm_yubikey_thread_t *t, fr_event_list_t *el)
+{
+	fr_dlist_talloc_init(&t->abandoned, yubikey_query_t, entry);
+
+	t->mhandle = fr_curl_io_init(t, el, false);
+	if (!t->mhandle) return -1;
+
+	return 0;
+}
+
+void rlm_yubikey_validate_thread_detach(rlm_yubikey_thread_t *t)
+{
+	yubikey_query_t	*query;
+
+	while ((query = fr_dlist_head(&t->abandoned))) {
+		fr_dlist_remove(&t->abandoned, query);
+		talloc_free(query);
+	}
+	talloc_free(t->mhandle);
 }
 #endif
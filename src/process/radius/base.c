@@ -23,15 +23,26 @@
  * @copyright 2021 Network RADIUS SARL (legal@networkradius.com)
  */
 #include <freeradius-devel/protocol/freeradius/freeradius.internal.h>
+#include <freeradius-devel/internal/internal.h>
 #include <freeradius-devel/radius/radius.h>
 
+#include <freeradius-devel/server/detail.h>
+#include <freeradius-devel/server/exfile.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/unlang/function.h>
+#include <freeradius-devel/unlang/interpret.h>
 #include <freeradius-devel/unlang/module.h>
+#include <freeradius-devel/unlang/subrequest.h>
 #include <freeradius-devel/server/pair.h>
 #include <freeradius-devel/server/protocol.h>
+#include <freeradius-devel/server/request_data.h>
 
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/syserror.h>
 #include <freeradius-devel/server/state.h>
+#include <freeradius-devel/server/state_replicate.h>
+
+#include <sys/stat.h>
 
 static fr_dict_t const *dict_freeradius;
 static fr_dict_t const *dict_radius;
@@ -139,14 +150,29 @@ typedef struct {
 						//!< authenticating server to be identified in packet
 						//!<captures.
 
+	char const	*snapshot;		//!< Where to save sessions on shutdown, and load
+						///< them from on startup.
+
+	fr_state_replicate_conf_t replicate;	//!< Peers to replicate sessions with.
+	fr_state_replicate_t	*replicator;	//!< Sends and receives sessions.
+
 	fr_state_tree_t	*state_tree;		//!< State tree to link multiple requests/responses.
 } process_radius_auth_t;
 
+typedef struct {
+	bool		early_response;		//!< Send the Accounting-Response before running
+						///< the "accounting" section.
+	char const	*journal;		//!< Binary detail file to write requests to before
+						///< responding early.
+	exfile_t	*ef;			//!< Opens and locks the journal.
+} process_radius_acct_t;
+
 typedef struct {
 	CONF_SECTION			*server_cs;	//!< Our virtual server.
 	process_radius_sections_t	sections;	//!< Pointers to various config sections
 							///< we need to execute.
 	process_radius_auth_t		auth;		//!< Authentication configuration.
+	process_radius_acct_t		acct;		//!< Accounting configuration.
 } process_radius_t;
 
 #define PROCESS_PACKET_TYPE		fr_radius_packet_code_t
@@ -160,6 +186,9 @@ static const CONF_PARSER session_config[] = {
 	{ FR_CONF_OFFSET("timeout", FR_TYPE_TIME_DELTA, process_radius_auth_t, session_timeout), .dflt = "15" },
 	{ FR_CONF_OFFSET("max", FR_TYPE_UINT32, process_radius_auth_t, max_session), .dflt = "4096" },
 	{ FR_CONF_OFFSET("state_server_id", FR_TYPE_UINT8, process_radius_auth_t, state_server_id) },
+	{ FR_CONF_OFFSET("snapshot", FR_TYPE_STRING, process_radius_auth_t, snapshot) },
+	{ FR_CONF_OFFSET("replicate", FR_TYPE_SUBSECTION, process_radius_auth_t, replicate),
+	  .subcs = (void const *) fr_state_replicate_config },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -184,9 +213,18 @@ static const CONF_PARSER auth_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER acct_config[] = {
+	{ FR_CONF_OFFSET("early_response", FR_TYPE_BOOL, process_radius_acct_t, early_response), .dflt = "no" },
+	{ FR_CONF_OFFSET("journal", FR_TYPE_FILE_OUTPUT, process_radius_acct_t, journal) },
+
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER config[] = {
 	{ FR_CONF_POINTER("Access-Request", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) auth_config,
 	  .offset = offsetof(process_radius_t, auth), },
+	{ FR_CONF_POINTER("Accounting-Request", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) acct_config,
+	  .offset = offsetof(process_radius_t, acct), },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -665,6 +703,225 @@ RESUME(acct_type)
 	return state->send(p_result, mctx, request, rctx);
 }
 
+/** A journal record for a request which is being processed in the background
+ *
+ */
+typedef struct {
+	exfile_t	*ef;			//!< Opens and locks the journal.
+	char const	*filename;		//!< Of the journal.
+	dev_t		dev;			//!< Device of the journal the record was written to.
+	ino_t		ino;			//!< Inode of the journal the record was written to.
+	off_t		offset;			//!< Of the record in the journal.
+} process_radius_journal_t;
+
+/** Write a request to the journal, as a binary detail record
+ *
+ * The journal isn't kept open.  Instead, we remember which file the
+ * record was written to, so that acct_journal_done() doesn't mark a
+ * record in a different file if a detail reader renames the journal.
+ */
+static process_radius_journal_t *acct_journal_write(TALLOC_CTX *ctx, process_radius_t const *inst, request_t *request)
+{
+	process_radius_journal_t	*journal;
+	fr_dbuff_t			dbuff;
+	fr_dbuff_uctx_talloc_t		tctx;
+	fr_pair_list_t			pairs;
+	fr_pair_t			*vp;
+	uint8_t				*record;
+	int				fd;
+	off_t				offset;
+	struct stat			st;
+
+	fr_pair_list_init(&pairs);
+
+	MEM(vp = fr_pair_afrom_da(request, attr_packet_type));
+	vp->vp_uint32 = request->packet->code;
+	fr_pair_append(&pairs, vp);
+
+	if (fr_pair_list_copy(request, &pairs, &request->request_pairs) < 0) {
+		RPERROR("Failed copying request to journal");
+	error:
+		fr_pair_list_free(&pairs);
+		return NULL;
+	}
+
+	MEM(fr_dbuff_init_talloc(request, &dbuff, &tctx, 1024, UINT32_MAX));
+	if ((fr_dbuff_memset(&dbuff, 0, FR_DETAIL_HDR_LEN) < 0) ||
+	    (fr_internal_encode_list(&dbuff, &pairs, NULL) < 0)) {
+		RPERROR("Failed encoding journal record");
+	free_dbuff:
+		fr_dbuff_free_talloc(&dbuff);
+		goto error;
+	}
+
+	record = fr_dbuff_start(&dbuff);
+	fr_detail_hdr_encode(record, (uint32_t) fr_time_to_sec(request->packet->timestamp),
+			     record + FR_DETAIL_HDR_LEN, fr_dbuff_used(&dbuff) - FR_DETAIL_HDR_LEN);
+
+	/*
+	 *	The journal is locked while it's open, so the end
+	 *	of the file is where the record is written.
+	 */
+	fd = exfile_open(inst->acct.ef, request, inst->acct.journal, 0600);
+	if (fd < 0) {
+		RPERROR("Failed opening journal %s", inst->acct.journal);
+		goto free_dbuff;
+	}
+
+	offset = lseek(fd, 0, SEEK_END);
+	if ((offset < 0) || (fstat(fd, &st) < 0) || (write(fd, record, fr_dbuff_used(&dbuff)) < 0)) {
+		RERROR("Failed writing to journal %s: %s", inst->acct.journal, fr_syserror(errno));
+		exfile_close(inst->acct.ef, request, fd);
+		goto free_dbuff;
+	}
+	exfile_close(inst->acct.ef, request, fd);
+
+	MEM(journal = talloc_zero(ctx, process_radius_journal_t));
+	journal->ef = inst->acct.ef;
+	journal->filename = inst->acct.journal;
+	journal->dev = st.st_dev;
+	journal->ino = st.st_ino;
+	journal->offset = offset;
+
+	fr_dbuff_free_talloc(&dbuff);
+	fr_pair_list_free(&pairs);
+
+	return journal;
+}
+
+/** Mark a journal record as done, so that it isn't replayed
+ *
+ */
+static void acct_journal_done(request_t *request, process_radius_journal_t const *journal)
+{
+	int		fd;
+	struct stat	st;
+	uint8_t		flags = FR_DETAIL_FLAG_DONE;
+
+	fd = exfile_open(journal->ef, request, journal->filename, 0600);
+	if (fd < 0) {
+		RPERROR("Failed opening journal %s", journal->filename);
+		return;
+	}
+
+	/*
+	 *	A detail reader has renamed the journal, and now owns
+	 *	the record.  It will be replayed.
+	 */
+	if ((fstat(fd, &st) < 0) || (st.st_dev != journal->dev) || (st.st_ino != journal->ino)) {
+		RWDEBUG("Journal %s has been rotated - the record will be replayed", journal->filename);
+
+	} else if (pwrite(fd, &flags, sizeof(flags), journal->offset + FR_DETAIL_HDR_FLAGS) < 0) {
+		RERROR("Failed marking journal record as done: %s", fr_syserror(errno));
+	}
+
+	exfile_close(journal->ef, request, fd);
+}
+
+static unlang_action_t acct_background_run(rlm_rcode_t *p_result, UNUSED int *priority, request_t *request, void *uctx)
+{
+	CONF_SECTION *cs = talloc_get_type_abort(uctx, CONF_SECTION);
+
+	RDEBUG2("Running 'accounting %s { ... }' in the background", cf_section_name2(cs));
+
+	if (unlang_interpret_push_section(request, cs, RLM_MODULE_NOOP, UNLANG_SUB_FRAME) < 0) RETURN_MODULE_FAIL;
+
+	return UNLANG_ACTION_PUSHED_CHILD;
+}
+
+/** Mark the journal record as done if the accounting section succeeded
+ *
+ * Records which aren't marked as done are replayed by a detail
+ * listener reading the journal.
+ */
+static unlang_action_t acct_background_done(rlm_rcode_t *p_result, UNUSED int *priority, request_t *request,
+					    UNUSED void *uctx)
+{
+	process_radius_journal_t	*journal;
+
+	switch (request->rcode) {
+	case RLM_MODULE_OK:
+	case RLM_MODULE_UPDATED:
+	case RLM_MODULE_NOOP:
+	case RLM_MODULE_HANDLED:
+		break;
+
+	default:
+		RWDEBUG("Background accounting returned %s - leaving it in the journal to be replayed",
+			fr_table_str_by_value(rcode_table, request->rcode, "<INVALID>"));
+		RETURN_MODULE_RCODE(request->rcode);
+	}
+
+	journal = request_data_reference(request, (void *)acct_journal_write, 0);
+	if (journal) acct_journal_done(request, journal);
+
+	RETURN_MODULE_RCODE(request->rcode);
+}
+
+/** Run the "accounting foo" section in a detached child
+ *
+ * The child has its own copy of the request, so the parent can reply,
+ * and be freed.
+ *
+ * @return
+ *	- 0 if the section will be run in the background.
+ *	- -1 if it should be run as usual.
+ */
+static int acct_background(process_radius_t const *inst, request_t *request, CONF_SECTION *cs)
+{
+	request_t			*child;
+	process_radius_journal_t	*journal = NULL;
+
+	child = request_alloc_internal(NULL, (&(request_init_args_t){ .parent = request, .namespace = dict_radius,
+								       .detachable = true }));
+	if (!child) {
+		RERROR("Failed allocating background request");
+		return -1;
+	}
+
+	/*
+	 *	Don't reply until the request is safely in the journal.
+	 */
+	if (inst->acct.journal) {
+		journal = acct_journal_write(child, inst, request);
+		if (!journal) {
+		error:
+			talloc_free(child);
+			return -1;
+		}
+
+		if (request_data_add(child, (void *)acct_journal_write, 0, journal, false, false, false) < 0) goto error;
+	}
+
+	child->packet->code = request->packet->code;
+	child->packet->id = request->packet->id;
+	child->packet->timestamp = request->packet->timestamp;
+	child->packet->socket = request->packet->socket;
+	child->client = request->client;
+
+	if ((fr_pair_list_copy(child->request_ctx, &child->request_pairs, &request->request_pairs) < 0) ||
+	    (fr_pair_list_copy(child->control_ctx, &child->control_pairs, &request->control_pairs) < 0)) {
+		RPERROR("Failed copying attributes to background request");
+		goto error;
+	}
+
+	/*
+	 *	Push the section before detaching, so that if it
+	 *	fails, we still own the child, and the parent can run
+	 *	the section itself.
+	 */
+	unlang_interpret_set(child, unlang_interpret_get(request));
+	if (unlang_function_push(child, acct_background_run, acct_background_done, NULL,
+				 UNLANG_TOP_FRAME, cs) < 0) {
+		RERROR("Failed starting background request");
+		goto error;
+	}
+
+	if (unlang_subrequest_child_push_and_detach(child) < 0) goto error;
+
+	return 0;
+}
+
 RESUME(accounting_request)
 {
 	rlm_rcode_t			rcode = request->rcode;
@@ -710,6 +967,17 @@ RESUME(accounting_request)
 		goto send_reply;
 	}
 
+	/*
+	 *	Reply now, and run the section in the background.
+	 */
+	if (inst->acct.early_response && (acct_background(inst, request, cs) == 0)) {
+		request->reply->code = FR_RADIUS_CODE_ACCOUNTING_RESPONSE;
+		UPDATE_STATE(reply);
+
+		fr_assert(state->send != NULL);
+		return state->send(p_result, mctx, request, rctx);
+	}
+
 	/*
 	 *	Run the "Acct-Status-Type = foo" section.
 	 *
@@ -799,6 +1067,61 @@ static int mod_instantiate(void *instance, UNUSED CONF_SECTION *process_app_cs)
 	inst->auth.state_tree = fr_state_tree_init(inst, attr_state, main_config->spawn_workers, inst->auth.max_session,
 						   inst->auth.session_timeout, inst->auth.state_server_id,
 						   fr_hash_string(cf_section_name2(inst->server_cs)));
+	if (!inst->auth.state_tree) return -1;
+
+	/*
+	 *	Pick up the sessions of the process we're replacing.
+	 */
+	if (inst->auth.snapshot &&
+	    (fr_state_tree_load(inst->auth.state_tree, dict_radius, inst->auth.snapshot) < 0)) {
+		PWARN("Failed loading sessions from \"%s\"", inst->auth.snapshot);
+	}
+
+	if (inst->auth.replicate.peers) {
+		if (!inst->auth.replicate.secret) {
+			cf_log_err(inst->server_cs, "session { replicate { secret = ... } } must be set");
+			return -1;
+		}
+
+		inst->auth.replicator = fr_state_replicate_alloc(inst, inst->auth.state_tree, dict_radius,
+								 &inst->auth.replicate);
+		if (!inst->auth.replicator) {
+			cf_log_perr(inst->server_cs, "Failed setting up session replication");
+			return -1;
+		}
+	}
+
+	if (inst->acct.journal) {
+		if (!inst->acct.early_response) {
+			cf_log_err(inst->server_cs, "Accounting-Request { journal = ... } requires 'early_response = yes'");
+			return -1;
+		}
+
+		inst->acct.ef = exfile_init(inst, 16, 30, true);
+		if (!inst->acct.ef) {
+			cf_log_err(inst->server_cs, "Failed creating accounting journal handles");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	process_radius_t	*inst = instance;
+
+	/*
+	 *	Stop importing sessions from peers
+	 *	before taking a snapshot.
+	 */
+	TALLOC_FREE(inst->auth.replicator);
+
+	if (!inst->auth.snapshot || !inst->auth.state_tree) return 0;
+
+	if (fr_state_tree_save(inst->auth.state_tree, inst->auth.snapshot) < 0) {
+		PWARN("Failed saving sessions to \"%s\"", inst->auth.snapshot);
+	}
 
 	return 0;
 }
@@ -1147,6 +1470,8 @@ fr_process_module_t process_radius = {
 	.config		= config,
 	.inst_size	= sizeof(process_radius_t),
 
+	.detach		= mod_detach,
+
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 
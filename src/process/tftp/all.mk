@@ -0,0 +1,9 @@
+TARGETNAME	:= process_tftp
+
+ifneq "$(TARGETNAME)" ""
+TARGET		:= $(TARGETNAME).a
+endif
+
+SOURCES		:= base.c
+
+TGT_PREREQS	:= libfreeradius-tftp.a
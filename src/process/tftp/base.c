@@ -0,0 +1,252 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file src/process/tftp/base.c
+ * @brief TFTP processing.
+ *
+ * Only read and write requests are processed.  The file transfer itself
+ * is done by the listener.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <freeradius-devel/server/protocol.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/tftp/tftp.h>
+
+static fr_dict_t const *dict_tftp;
+
+extern fr_dict_autoload_t process_tftp_dict[];
+fr_dict_autoload_t process_tftp_dict[] = {
+	{ .out = &dict_tftp, .proto = "tftp" },
+	{ NULL }
+};
+
+static fr_dict_attr_t const *attr_packet_type;
+
+extern fr_dict_attr_autoload_t process_tftp_dict_attr[];
+fr_dict_attr_autoload_t process_tftp_dict_attr[] = {
+	{ .out = &attr_packet_type, .name = "Packet-Type", .type = FR_TYPE_UINT32, .dict = &dict_tftp},
+	{ NULL }
+};
+
+typedef struct {
+	uint64_t	nothing;		// so that the next field isn't at offset 0
+
+	CONF_SECTION	*read_request;
+	CONF_SECTION	*write_request;
+	CONF_SECTION	*data;
+	CONF_SECTION	*error;
+	CONF_SECTION	*do_not_respond;
+} process_tftp_sections_t;
+
+typedef struct {
+	bool		test;
+
+	process_tftp_sections_t	sections;
+} process_tftp_t;
+
+#define FR_TFTP_PACKET_CODE_VALID(_x) (((_x) > 0) && ((_x) < FR_TFTP_MAX_CODE))
+
+#define PROCESS_PACKET_TYPE		uint32_t
+#define PROCESS_CODE_MAX		FR_TFTP_MAX_CODE
+#define PROCESS_CODE_DO_NOT_RESPOND	FR_PACKET_TYPE_VALUE_DO_NOT_RESPOND
+#define PROCESS_PACKET_CODE_VALID	FR_TFTP_PACKET_CODE_VALID
+#define PROCESS_INST			process_tftp_t
+#include <freeradius-devel/server/process.h>
+
+static fr_process_state_t const process_state[] = {
+	[ FR_PACKET_TYPE_VALUE_READ_REQUEST ] = {
+		.packet_type = {
+			[RLM_MODULE_NOOP] = 	FR_PACKET_TYPE_VALUE_DATA,
+			[RLM_MODULE_OK] = 	FR_PACKET_TYPE_VALUE_DATA,
+			[RLM_MODULE_UPDATED] =	FR_PACKET_TYPE_VALUE_DATA,
+
+			[RLM_MODULE_REJECT] =	FR_PACKET_TYPE_VALUE_ERROR,
+			[RLM_MODULE_FAIL] =	FR_PACKET_TYPE_VALUE_ERROR,
+			[RLM_MODULE_INVALID] =	FR_PACKET_TYPE_VALUE_ERROR,
+			[RLM_MODULE_DISALLOW] =	FR_PACKET_TYPE_VALUE_ERROR,
+			[RLM_MODULE_NOTFOUND] =	FR_PACKET_TYPE_VALUE_ERROR,
+		},
+		.rcode = RLM_MODULE_NOOP,
+		.recv = recv_generic,
+		.resume = resume_recv_generic,
+		.section_offset = PROCESS_CONF_OFFSET(read_request),
+	},
+
+	/*
+	 *	We only serve files.
+	 */
+	[ FR_PACKET_TYPE_VALUE_WRITE_REQUEST ] = {
+		.packet_type = {
+			[RLM_MODULE_NOOP] = 	FR_PACKET_TYPE_VALUE_ERROR,
+			[RLM_MODULE_OK] = 	FR_PACKET_TYPE_VALUE_ERROR,
+			[RLM_MODULE_UPDATED] =	FR_PACKET_TYPE_VALUE_ERROR,
+
+			[RLM_MODULE_REJECT] =	FR_PACKET_TYPE_VALUE_ERROR,
+			[RLM_MODULE_FAIL] =	FR_PACKET_TYPE_VALUE_ERROR,
+			[RLM_MODULE_INVALID] =	FR_PACKET_TYPE_VALUE_ERROR,
+			[RLM_MODULE_DISALLOW] =	FR_PACKET_TYPE_VALUE_ERROR,
+			[RLM_MODULE_NOTFOUND] =	FR_PACKET_TYPE_VALUE_ERROR,
+		},
+		.rcode = RLM_MODULE_NOOP,
+		.recv = recv_generic,
+		.resume = resume_recv_generic,
+		.section_offset = PROCESS_CONF_OFFSET(write_request),
+	},
+
+	[ FR_PACKET_TYPE_VALUE_DATA ] = {
+		.packet_type = {
+			[RLM_MODULE_NOOP] = 	FR_PACKET_TYPE_VALUE_DATA,
+			[RLM_MODULE_OK] = 	FR_PACKET_TYPE_VALUE_DATA,
+			[RLM_MODULE_UPDATED] =	FR_PACKET_TYPE_VALUE_DATA,
+
+			[RLM_MODULE_REJECT] =	FR_PACKET_TYPE_VALUE_ERROR,
+			[RLM_MODULE_FAIL] =	FR_PACKET_TYPE_VALUE_ERROR,
+			[RLM_MODULE_INVALID] =	FR_PACKET_TYPE_VALUE_ERROR,
+			[RLM_MODULE_DISALLOW] =	FR_PACKET_TYPE_VALUE_ERROR,
+			[RLM_MODULE_NOTFOUND] =	FR_PACKET_TYPE_VALUE_ERROR,
+		},
+		.rcode = RLM_MODULE_NOOP,
+		.send = send_generic,
+		.resume = resume_send_generic,
+		.section_offset = PROCESS_CONF_OFFSET(data),
+	},
+
+	[ FR_PACKET_TYPE_VALUE_ERROR ] = {
+		.packet_type = {
+			[RLM_MODULE_NOOP] = 	FR_PACKET_TYPE_VALUE_ERROR,
+			[RLM_MODULE_OK] = 	FR_PACKET_TYPE_VALUE_ERROR,
+			[RLM_MODULE_UPDATED] =	FR_PACKET_TYPE_VALUE_ERROR,
+
+			[RLM_MODULE_REJECT] =	FR_PACKET_TYPE_VALUE_ERROR,
+			[RLM_MODULE_FAIL] =	FR_PACKET_TYPE_VALUE_ERROR,
+			[RLM_MODULE_INVALID] =	FR_PACKET_TYPE_VALUE_ERROR,
+			[RLM_MODULE_DISALLOW] =	FR_PACKET_TYPE_VALUE_ERROR,
+			[RLM_MODULE_NOTFOUND] =	FR_PACKET_TYPE_VALUE_ERROR,
+		},
+		.rcode = RLM_MODULE_NOOP,
+		.send = send_generic,
+		.resume = resume_send_generic,
+		.section_offset = PROCESS_CONF_OFFSET(error),
+	},
+
+	[ FR_PACKET_TYPE_VALUE_DO_NOT_RESPOND ] = {
+		.packet_type = {
+			[RLM_MODULE_NOOP] = 	FR_PACKET_TYPE_VALUE_DO_NOT_RESPOND,
+			[RLM_MODULE_OK] = 	FR_PACKET_TYPE_VALUE_DO_NOT_RESPOND,
+			[RLM_MODULE_UPDATED] =	FR_PACKET_TYPE_VALUE_DO_NOT_RESPOND,
+
+			[RLM_MODULE_REJECT] =	FR_PACKET_TYPE_VALUE_DO_NOT_RESPOND,
+			[RLM_MODULE_FAIL] =	FR_PACKET_TYPE_VALUE_DO_NOT_RESPOND,
+			[RLM_MODULE_INVALID] =	FR_PACKET_TYPE_VALUE_DO_NOT_RESPOND,
+			[RLM_MODULE_DISALLOW] =	FR_PACKET_TYPE_VALUE_DO_NOT_RESPOND,
+			[RLM_MODULE_NOTFOUND] =	FR_PACKET_TYPE_VALUE_DO_NOT_RESPOND,
+		},
+		.rcode = RLM_MODULE_NOOP,
+		.send = send_generic,
+		.resume = resume_send_generic,
+		.section_offset = PROCESS_CONF_OFFSET(do_not_respond),
+	},
+};
+
+/*
+ *	Debug the packet if requested.
+ */
+static void tftp_packet_debug(request_t *request, fr_radius_packet_t const *packet, fr_pair_list_t const *list, bool received)
+{
+	if (!packet) return;
+	if (!RDEBUG_ENABLED) return;
+
+	log_request(L_DBG, L_DBG_LVL_1, request, __FILE__, __LINE__, "%s %s",
+		    received ? "Received" : "Sending",
+		    fr_tftp_codes[packet->code]);
+
+	if (received || request->parent) {
+		log_request_pair_list(L_DBG_LVL_1, request, NULL, list, NULL);
+	} else {
+		log_request_proto_pair_list(L_DBG_LVL_1, request, NULL, list, NULL);
+	}
+}
+
+static unlang_action_t mod_process(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	fr_process_state_t const *state;
+
+	PROCESS_TRACE;
+
+	(void)talloc_get_type_abort_const(mctx->instance, process_tftp_t);
+	fr_assert(PROCESS_PACKET_CODE_VALID(request->packet->code));
+
+	request->component = "tftp";
+	request->module = NULL;
+	fr_assert(request->dict == dict_tftp);
+
+	UPDATE_STATE(packet);
+
+	tftp_packet_debug(request, request->packet, &request->request_pairs, true);
+
+	return state->recv(p_result, mctx, request);
+}
+
+
+static const virtual_server_compile_t compile_list[] = {
+	{
+		.name = "recv",
+		.name2 = "Read-Request",
+		.component = MOD_POST_AUTH,
+		.offset = PROCESS_CONF_OFFSET(read_request),
+	},
+	{
+		.name = "recv",
+		.name2 = "Write-Request",
+		.component = MOD_POST_AUTH,
+		.offset = PROCESS_CONF_OFFSET(write_request),
+	},
+	{
+		.name = "send",
+		.name2 = "Data",
+		.component = MOD_POST_AUTH,
+		.offset = PROCESS_CONF_OFFSET(data),
+	},
+	{
+		.name = "send",
+		.name2 = "Error",
+		.component = MOD_POST_AUTH,
+		.offset = PROCESS_CONF_OFFSET(error),
+	},
+	{
+		.name = "send",
+		.name2 = "Do-Not-Respond",
+		.component = MOD_POST_AUTH,
+		.offset = PROCESS_CONF_OFFSET(do_not_respond),
+	},
+
+	COMPILE_TERMINATOR
+};
+
+
+extern fr_process_module_t process_tftp;
+fr_process_module_t process_tftp = {
+	.magic		= RLM_MODULE_INIT,
+	.name		= "process_tftp",
+	.inst_size	= sizeof(process_tftp_t),
+	.process	= mod_process,
+	.compile_list	= compile_list,
+	.dict		= &dict_tftp,
+};
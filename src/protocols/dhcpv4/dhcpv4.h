@@ -137,6 +137,19 @@ extern fr_dict_attr_t const 	*dhcp_option_82;
 }
 #endif
 
+/** Where each option is in a DHCPv4 packet
+ *
+ * Built with one walk over the options, and over the 'file' and
+ * 'sname' fields if option 52 says they hold options too.
+ */
+typedef struct {
+	uint8_t const		*packet;		//!< The index refers to.
+	size_t			packet_len;		//!< Length of the packet.
+	uint16_t		offset[256];		//!< Of the first instance of each option.
+	uint8_t			count[256];		//!< Instances of each option.  More than one is a long
+							///< option (RFC 3396), and the values are concatenated.
+} fr_dhcpv4_option_index_t;
+
 /** Used as the decoder ctx
  *
  */
@@ -174,6 +187,16 @@ ssize_t		fr_dhcpv4_encode_option(fr_dbuff_t *dbuff, fr_dcursor_t *cursor, void *
  */
 uint8_t const	*fr_dhcpv4_packet_get_option(dhcp_packet_t const *packet, size_t packet_size, fr_dict_attr_t const *da);
 
+int		fr_dhcpv4_option_index_init(fr_dhcpv4_option_index_t *idx, uint8_t const *data, size_t data_len);
+
+static inline uint8_t const *fr_dhcpv4_option_index_get(fr_dhcpv4_option_index_t const *idx, uint8_t code)
+{
+	return idx->count[code] ? idx->packet + idx->offset[code] : NULL;
+}
+
+ssize_t		fr_dhcpv4_option_index_value(uint8_t *out, size_t outlen,
+					     fr_dhcpv4_option_index_t const *idx, uint8_t code);
+
 int		fr_dhcpv4_decode(TALLOC_CTX *ctx, uint8_t const *data, size_t data_len, fr_dcursor_t *cursor, unsigned int *code);
 
 int		fr_dhcpv4_packet_encode(fr_radius_packet_t *packet, fr_pair_list_t *list);
@@ -190,6 +213,16 @@ int		fr_dhcpv4_raw_packet_send(int sockfd, struct sockaddr_ll *p_ll,
 
 fr_radius_packet_t	*fr_dhcv4_raw_packet_recv(int sockfd, struct sockaddr_ll *p_ll,
 						  fr_radius_packet_t *request, fr_pair_list_t *list);
+
+typedef struct fr_dhcpv4_raw_ring_s fr_dhcpv4_raw_ring_t;
+
+fr_dhcpv4_raw_ring_t	*fr_dhcpv4_raw_ring_alloc(TALLOC_CTX *ctx, int ifindex, uint16_t ether_type,
+						  size_t block_size, unsigned int block_nr);
+
+int		fr_dhcpv4_raw_ring_fd(fr_dhcpv4_raw_ring_t const *ring);
+
+ssize_t		fr_dhcpv4_raw_ring_recv(fr_dhcpv4_raw_ring_t *ring, uint8_t const **frame,
+					struct sockaddr_ll const **link_layer);
 #endif
 
 /*
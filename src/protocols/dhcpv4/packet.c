@@ -35,73 +35,182 @@
 #include "dhcpv4.h"
 #include "attrs.h"
 
-/** Retrieve a DHCP option from a raw packet buffer
- *
+/** Walks through the options of a packet, in the order they're interpreted
  *
  */
-uint8_t const *fr_dhcpv4_packet_get_option(dhcp_packet_t const *packet, size_t packet_size, fr_dict_attr_t const *da)
+typedef struct {
+	uint8_t const		*packet;
+	uint8_t const		*p;
+	uint8_t const		*end;
+	int			field;		//!< Which field of the packet we're in.
+	uint8_t			overload;	//!< Value of option 52, if we've seen it.
+	bool			error;		//!< The options were malformed.
+} dhcpv4_option_iter_t;
+
+static void dhcpv4_option_iter_init(dhcpv4_option_iter_t *iter, uint8_t const *data, size_t data_len)
 {
-	int overload = 0;
-	int field = DHCP_OPTION_FIELD;
-	size_t where, size;
-	uint8_t const *data;
-
-	if (packet_size < MIN_PACKET_SIZE) return NULL;
-
-	where = 0;
-	size = packet_size - offsetof(dhcp_packet_t, options);
-	data = &packet->options[where];
+	*iter = (dhcpv4_option_iter_t) {
+		.packet = data,
+		.p = data + offsetof(dhcp_packet_t, options),
+		.end = data + data_len,
+		.field = DHCP_OPTION_FIELD
+	};
+}
 
-	while (where < size) {
-		if (data[0] == 0) return NULL; /* padding */
+/** Return the next option, or NULL when there are no more
+ *
+ */
+static uint8_t const *dhcpv4_option_iter_next(dhcpv4_option_iter_t *iter)
+{
+	uint8_t const *option;
 
-		if (data[0] == 255) { /* end of options */
-			if ((field == DHCP_OPTION_FIELD) && (overload & DHCP_FILE_FIELD)) {
-				data = packet->file;
-				where = 0;
-				size = sizeof(packet->file);
-				field = DHCP_FILE_FIELD;
+	/*
+	 *	Padding, or the end of options, ends the field.
+	 *	Then continue with the fields named by option 52,
+	 *	'file' first.
+	 */
+	while ((iter->p >= iter->end) || (iter->p[0] == 0) || (iter->p[0] == 255)) {
+		switch (iter->field) {
+		case DHCP_OPTION_FIELD:
+			if (iter->overload & DHCP_FILE_FIELD) {
+				iter->p = iter->packet + offsetof(dhcp_packet_t, file);
+				iter->end = iter->p + DHCP_FILE_LEN;
+				iter->field = DHCP_FILE_FIELD;
 				continue;
+			}
+			FALL_THROUGH;
 
-			} else if ((field == DHCP_FILE_FIELD || field == DHCP_OPTION_FIELD) && (overload & DHCP_SNAME_FIELD)) {
-				data = packet->sname;
-				where = 0;
-				size = sizeof(packet->sname);
-				field = DHCP_SNAME_FIELD;
+		case DHCP_FILE_FIELD:
+			if (iter->overload & DHCP_SNAME_FIELD) {
+				iter->p = iter->packet + offsetof(dhcp_packet_t, sname);
+				iter->end = iter->p + DHCP_SNAME_LEN;
+				iter->field = DHCP_SNAME_FIELD;
 				continue;
 			}
+			FALL_THROUGH;
 
+		default:
 			return NULL;
 		}
+	}
 
-		/*
-		 *	We MUST have a real option here.
-		 */
-		if ((where + 2) > size) {
-			fr_strerror_printf("Options overflow field at %u",
-					   (unsigned int) (data - (uint8_t const *) packet));
-			return NULL;
-		}
+	if (((iter->end - iter->p) < 2) || ((iter->p + 2 + iter->p[1]) > iter->end)) {
+		fr_strerror_printf("Option overflows field at %u", (unsigned int) (iter->p - iter->packet));
+		iter->error = true;
+		return NULL;
+	}
 
-		if ((where + 2 + data[1]) > size) {
-			fr_strerror_printf("Option length overflows field at %u",
-					   (unsigned int) (data - (uint8_t const *) packet));
-			return NULL;
-		}
+	option = iter->p;
+	if ((option[0] == 52) && (option[1] > 0)) iter->overload = option[2];
+	iter->p += 2 + option[1];
+
+	return option;
+}
 
-		if (data[0] == da->attr) return data;
+/** Retrieve a DHCP option from a raw packet buffer
+ *
+ *
+ */
+uint8_t const *fr_dhcpv4_packet_get_option(dhcp_packet_t const *packet, size_t packet_size, fr_dict_attr_t const *da)
+{
+	dhcpv4_option_iter_t	iter;
+	uint8_t const		*option;
 
-		if ((data[0] == 52) && (data[1] > 0)) { /* overload sname and/or file */
-			overload = data[2];
-		}
+	if (packet_size < MIN_PACKET_SIZE) return NULL;
 
-		where += data[1] + 2;
-		data += data[1] + 2;
+	dhcpv4_option_iter_init(&iter, (uint8_t const *) packet, packet_size);
+	while ((option = dhcpv4_option_iter_next(&iter))) {
+		if (option[0] == da->attr) return option;
 	}
 
 	return NULL;
 }
 
+/** Build an index of the options in a packet
+ *
+ * Lookups with #fr_dhcpv4_option_index_get are then constant time,
+ * instead of walking the packet each time.
+ *
+ * @param[out] idx		to initialise.  Refers to data, which must
+ *				outlive it.
+ * @param[in] data		of the packet.
+ * @param[in] data_len		of the packet.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the packet is too short, or the options are malformed.
+ */
+int fr_dhcpv4_option_index_init(fr_dhcpv4_option_index_t *idx, uint8_t const *data, size_t data_len)
+{
+	dhcpv4_option_iter_t	iter;
+	uint8_t const		*option;
+
+	if (data_len < MIN_PACKET_SIZE) {
+		fr_strerror_printf("DHCP packet is too small (%zu < %d)", data_len, MIN_PACKET_SIZE);
+		return -1;
+	}
+
+	idx->packet = data;
+	idx->packet_len = data_len;
+	memset(idx->count, 0, sizeof(idx->count));
+
+	dhcpv4_option_iter_init(&iter, data, data_len);
+	while ((option = dhcpv4_option_iter_next(&iter))) {
+		if (!idx->count[option[0]]) idx->offset[option[0]] = option - data;
+		if (idx->count[option[0]] < UINT8_MAX) idx->count[option[0]]++;
+	}
+
+	return iter.error ? -1 : 0;
+}
+
+/** Get the value of an option, concatenating the instances of a long option
+ *
+ * @param[out] out		Where to write the value.
+ * @param[in] outlen		Size of out.
+ * @param[in] idx		of the packet.
+ * @param[in] code		of the option.
+ * @return
+ *	- >= 0 the length of the value.
+ *	- -1 if the option isn't in the packet, or out is too small.
+ */
+ssize_t fr_dhcpv4_option_index_value(uint8_t *out, size_t outlen,
+				     fr_dhcpv4_option_index_t const *idx, uint8_t code)
+{
+	dhcpv4_option_iter_t	iter;
+	uint8_t const		*option;
+	size_t			len = 0;
+
+	option = fr_dhcpv4_option_index_get(idx, code);
+	if (!option) {
+		fr_strerror_printf("Option %u not found", code);
+		return -1;
+	}
+
+	if (idx->count[code] == 1) {
+		if (option[1] > outlen) goto too_small;
+		memcpy(out, option + 2, option[1]);
+		return option[1];
+	}
+
+	/*
+	 *	Start the walk from the beginning, as the option
+	 *	may be split across more than one field.
+	 */
+	dhcpv4_option_iter_init(&iter, idx->packet, idx->packet_len);
+	while ((option = dhcpv4_option_iter_next(&iter))) {
+		if (option[0] != code) continue;
+
+		if ((len + option[1]) > outlen) {
+		too_small:
+			fr_strerror_printf("Output buffer too small for option %u", code);
+			return -1;
+		}
+		memcpy(out + len, option + 2, option[1]);
+		len += option[1];
+	}
+
+	return len;
+}
+
 int fr_dhcpv4_decode(TALLOC_CTX *ctx, uint8_t const *data, size_t data_len, fr_dcursor_t *cursor, unsigned int *code)
 {
 	size_t		i;
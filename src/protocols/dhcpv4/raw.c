@@ -37,6 +37,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #ifdef HAVE_SYS_SOCKET_H
 #  include <sys/socket.h>
@@ -338,4 +339,189 @@ fr_radius_packet_t *fr_dhcv4_raw_packet_recv(int sockfd, struct sockaddr_ll *lin
 
 	return packet;
 }
+
+/** A PACKET_MMAP (TPACKET_V3) receive ring
+ *
+ * The kernel writes frames into blocks of a ring shared with us, and
+ * hands over a whole block at a time.  On a busy L2 segment one wakeup
+ * then delivers many frames, instead of one recvfrom() per frame.
+ */
+struct fr_dhcpv4_raw_ring_s {
+	int			fd;			//!< AF_PACKET socket the ring is attached to.
+	uint8_t			*map;			//!< Start of the mmapped ring.
+	size_t			map_len;		//!< Length of the mapping.
+
+	size_t			block_size;		//!< Size of one block.
+	unsigned int		block_nr;		//!< Number of blocks in the ring.
+
+	unsigned int		block;			//!< Block we're currently reading from.
+	uint8_t			*frame;			//!< Next frame in the current block, or NULL
+							///< if we don't own the current block yet.
+	uint32_t		frames_left;		//!< Frames not yet returned from the current block.
+};
+
+static int _raw_ring_free(fr_dhcpv4_raw_ring_t *ring)
+{
+	if (ring->map) munmap(ring->map, ring->map_len);
+	if (ring->fd >= 0) close(ring->fd);
+
+	return 0;
+}
+
+/** Open a raw socket with a mmapped receive ring
+ *
+ * The socket is bound to a single ethertype, so the kernel filters
+ * out everything else before it reaches the ring (e.g. ETH_P_ARP for
+ * ARP, or ETH_P_IP for DHCP).
+ *
+ * @param[in] ctx		to allocate the ring in.  Freeing the ring closes the socket.
+ * @param[in] ifindex		of the interface we're binding to.
+ * @param[in] ether_type	to receive, in host byte order.
+ * @param[in] block_size	Size of each ring block.  Must be a multiple of the page size.
+ * @param[in] block_nr		Number of blocks in the ring.
+ * @return
+ *	- A new ring on success.
+ *	- NULL on failure.
+ */
+fr_dhcpv4_raw_ring_t *fr_dhcpv4_raw_ring_alloc(TALLOC_CTX *ctx, int ifindex, uint16_t ether_type,
+					       size_t block_size, unsigned int block_nr)
+{
+	fr_dhcpv4_raw_ring_t	*ring;
+	struct tpacket_req3	req;
+	struct sockaddr_ll	link_layer;
+	int			version = TPACKET_V3;
+	long			page_size = sysconf(_SC_PAGESIZE);
+
+	if ((page_size <= 0) || !block_size || (block_size % page_size) || !block_nr) {
+		fr_strerror_printf("Ring block size (%zu) must be a non-zero multiple of the page size (%ld)",
+				   block_size, page_size);
+		return NULL;
+	}
+
+	ring = talloc_zero(ctx, fr_dhcpv4_raw_ring_t);
+	if (!ring) {
+		fr_strerror_const("Out of memory");
+		return NULL;
+	}
+	ring->fd = -1;
+	talloc_set_destructor(ring, _raw_ring_free);
+
+	ring->fd = socket(PF_PACKET, SOCK_RAW, htons(ether_type));
+	if (ring->fd < 0) {
+		fr_strerror_printf("Cannot open socket: %s", fr_syserror(errno));
+	error:
+		talloc_free(ring);
+		return NULL;
+	}
+
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+		fr_strerror_printf("Cannot set TPACKET_V3: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	/*
+	 *	Frames are variable length in V3, the frame size
+	 *	only has to be consistent with the block layout.
+	 *	Blocks are retired after 10ms even if they're not
+	 *	full, so quiet interfaces don't add latency.
+	 */
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = block_size;
+	req.tp_block_nr = block_nr;
+	req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+	req.tp_frame_nr = (block_size * block_nr) / req.tp_frame_size;
+	req.tp_retire_blk_tov = 10;
+
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+		fr_strerror_printf("Cannot create receive ring: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	ring->block_size = block_size;
+	ring->block_nr = block_nr;
+	ring->map_len = block_size * block_nr;
+	ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, 0);
+	if (ring->map == MAP_FAILED) {
+		ring->map = NULL;
+		fr_strerror_printf("Cannot map receive ring: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	memset(&link_layer, 0, sizeof(link_layer));
+	link_layer.sll_family = AF_PACKET;
+	link_layer.sll_protocol = htons(ether_type);
+	link_layer.sll_ifindex = ifindex;
+
+	if (bind(ring->fd, (struct sockaddr *)&link_layer, sizeof(link_layer)) < 0) {
+		fr_strerror_printf("Cannot bind raw socket: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	return ring;
+}
+
+/** Return the file descriptor of a ring
+ *
+ * The descriptor becomes readable when the kernel hands over a block.
+ * It can also be used with fr_dhcpv4_raw_packet_send().
+ */
+int fr_dhcpv4_raw_ring_fd(fr_dhcpv4_raw_ring_t const *ring)
+{
+	return ring->fd;
+}
+
+/** Return the next frame from a receive ring
+ *
+ * This never makes a system call.  When the frames in a block have all
+ * been returned, the block is handed back to the kernel on the following
+ * call.  The caller should loop until this returns 0, and then wait for
+ * the ring's fd to become readable.
+ *
+ * @param[in] ring		to read from.
+ * @param[out] frame		Start of the frame (the ethernet header).  Valid
+ *				until the next call for this ring.
+ * @param[out] link_layer	Where the frame came from.  May be NULL.
+ * @return
+ *	- >0 the captured length of the frame.
+ *	- 0 no frames are available.
+ */
+ssize_t fr_dhcpv4_raw_ring_recv(fr_dhcpv4_raw_ring_t *ring, uint8_t const **frame,
+				struct sockaddr_ll const **link_layer)
+{
+	struct tpacket_block_desc	*block;
+	struct tpacket3_hdr		*hdr;
+
+	for (;;) {
+		block = (struct tpacket_block_desc *)(ring->map + ((size_t)ring->block * ring->block_size));
+
+		if (!ring->frame) {
+			if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+				return 0;
+			}
+
+			ring->frame = (uint8_t *)block + block->hdr.bh1.offset_to_first_pkt;
+			ring->frames_left = block->hdr.bh1.num_pkts;
+		}
+
+		if (ring->frames_left > 0) break;
+
+		/*
+		 *	Everything in this block has been returned,
+		 *	give it back to the kernel and move on.
+		 */
+		__atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		ring->block = (ring->block + 1) % ring->block_nr;
+		ring->frame = NULL;
+	}
+
+	hdr = (struct tpacket3_hdr *)ring->frame;
+	*frame = (uint8_t const *)hdr + hdr->tp_mac;
+	if (link_layer) *link_layer = (struct sockaddr_ll const *)((uint8_t const *)hdr +
+								   TPACKET_ALIGN(sizeof(*hdr)));
+
+	ring->frames_left--;
+	ring->frame += hdr->tp_next_offset;
+
+	return hdr->tp_snaplen;
+}
 #endif
@@ -28,6 +28,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <freeradius-devel/io/test_point.h>
+#include <freeradius-devel/protocol/dhcpv6/rfc3315.h>
 #include <freeradius-devel/util/dbuff.h>
 #include <freeradius-devel/util/dns.h>
 #include <freeradius-devel/util/pair.h>
@@ -751,20 +752,86 @@ static ssize_t encode_vsio_hdr(fr_dbuff_t *dbuff,
 	return fr_dbuff_set(dbuff, &work_dbuff);
 }
 
+/** Encode a Relay-Reply layer from the Relay-Forward it answers
+ *
+ * The header fields and any Interface-ID are copied from the original
+ * message as-is.  Layers below it are copied the same way, until we
+ * reach the client's message, where the reply pairs are encoded.
+ *
+ * @param[out] dbuff	Where to write the Relay-Reply.
+ * @param[in] relay	Relay-Forward message in the original packet.
+ * @param[in] end	of the relay message.
+ * @param[in] vps	to encode as the innermost reply.
+ * @param[in] depth	of this relay message in the original packet.
+ * @return
+ *	- > 0 length of data written.
+ *	- <= 0 on error.
+ */
+static ssize_t encode_relay_saved(fr_dbuff_t *dbuff, uint8_t const *relay, uint8_t const *end,
+				  fr_pair_list_t *vps, int depth)
+{
+	fr_dbuff_t		work_dbuff = FR_DBUFF(dbuff);
+	fr_dbuff_marker_t	len_m;
+	uint8_t const		*option, *inner;
+	uint16_t		inner_len;
+	ssize_t			slen;
+
+	option = fr_dhcpv6_option_find(relay + DHCPV6_RELAY_HDR_LEN, end, attr_relay_message->attr);
+	if (!option) {
+		fr_strerror_const("Original Relay-Forward has no Relay-Message");
+		return PAIR_ENCODE_FATAL_ERROR;
+	}
+	inner = option + DHCPV6_OPT_HDR_LEN;
+	inner_len = DHCPV6_GET_OPTION_LEN(option);
+
+	FR_DBUFF_IN_RETURN(&work_dbuff, (uint8_t)FR_DHCPV6_RELAY_REPLY);
+	FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, relay + 1, DHCPV6_RELAY_HDR_LEN - 1);
+
+	/*
+	 *	RFC 8415 Section 19.3 - the Interface-ID MUST be
+	 *	copied from the Relay-Forward.
+	 */
+	option = fr_dhcpv6_option_find(relay + DHCPV6_RELAY_HDR_LEN, end, FR_INTERFACE_ID);
+	if (option) FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, option, DHCPV6_OPT_HDR_LEN + DHCPV6_GET_OPTION_LEN(option));
+
+	FR_DBUFF_IN_RETURN(&work_dbuff, (uint16_t)attr_relay_message->attr);
+	fr_dbuff_marker(&len_m, &work_dbuff);
+	FR_DBUFF_ADVANCE_RETURN(&work_dbuff, 2);
+
+	if ((inner_len >= DHCPV6_RELAY_HDR_LEN) && (inner[0] == FR_DHCPV6_RELAY_FORWARD) &&
+	    (depth < DHCPV6_MAX_RELAY_NESTING)) {
+		slen = encode_relay_saved(&work_dbuff, inner, inner + inner_len, vps, depth + 1);
+	} else {
+		slen = fr_dhcpv6_encode(&work_dbuff, NULL, 0, 0, vps);
+	}
+	if (slen <= 0) {
+		fr_dbuff_marker_release(&len_m);
+		return slen;
+	}
+
+	fr_dbuff_in(&len_m, (uint16_t)slen);
+	fr_dbuff_marker_release(&len_m);
+
+	return fr_dbuff_set(dbuff, &work_dbuff);
+}
+
 /** Encode a Relay-Message
  *
  *	Header + stuff
  */
 static ssize_t encode_relay_message(fr_dbuff_t *dbuff,
 				    fr_da_stack_t *da_stack, unsigned int depth,
-				    fr_dcursor_t *cursor, UNUSED void *encode_ctx)
+				    fr_dcursor_t *cursor, void *encode_ctx)
 {
 	fr_dbuff_marker_t	start_m;
 	fr_dbuff_marker_t	len_m;
 	ssize_t			slen;
 
 	fr_dict_attr_t const	*da = da_stack->da[depth];
-	fr_pair_t		*vp;
+	fr_pair_t		*vp, *type;
+	fr_dhcpv6_encode_ctx_t	*packet_ctx = encode_ctx;
+	uint8_t const		*inner = NULL;
+	uint8_t const		*option;
 
 	FR_PROTO_STACK_PRINT(da_stack, depth);
 
@@ -788,7 +855,32 @@ static ssize_t encode_relay_message(fr_dbuff_t *dbuff,
 	FR_DBUFF_ADVANCE_RETURN(dbuff, 2);		/* Advanced past the length field */
 
 	vp = fr_dcursor_current(cursor);
-	slen = fr_dhcpv6_encode(dbuff, NULL, 0, 0, &vp->vp_group);
+
+	/*
+	 *	If we're replying to a Relay-Forward which carries
+	 *	another Relay-Forward, the reply may contain only the
+	 *	message for the client.  In that case the intermediate
+	 *	Relay-Reply layers are built from the original packet,
+	 *	instead of making the policy re-create each of them.
+	 */
+	if (packet_ctx && packet_ctx->original && (packet_ctx->original_length >= DHCPV6_RELAY_HDR_LEN) &&
+	    (packet_ctx->original[0] == FR_DHCPV6_RELAY_FORWARD)) {
+		option = fr_dhcpv6_option_find(packet_ctx->original + DHCPV6_RELAY_HDR_LEN,
+					       packet_ctx->original + packet_ctx->original_length,
+					       attr_relay_message->attr);
+		if (option && (DHCPV6_GET_OPTION_LEN(option) >= DHCPV6_RELAY_HDR_LEN) &&
+		    (option[DHCPV6_OPT_HDR_LEN] == FR_DHCPV6_RELAY_FORWARD)) {
+			type = fr_pair_find_by_da(&vp->vp_group, attr_packet_type, 0);
+			if (type && (type->vp_uint32 != FR_DHCPV6_RELAY_REPLY)) inner = option;
+		}
+	}
+
+	if (inner) {
+		slen = encode_relay_saved(dbuff, inner + DHCPV6_OPT_HDR_LEN,
+					  inner + DHCPV6_OPT_HDR_LEN + DHCPV6_GET_OPTION_LEN(inner), &vp->vp_group, 2);
+	} else {
+		slen = fr_dhcpv6_encode(dbuff, NULL, 0, 0, &vp->vp_group);
+	}
 	if (slen <= 0) {
 		fr_dbuff_marker_release(&start_m);
 		return slen;
@@ -314,7 +314,7 @@ static ssize_t internal_decode_pair(TALLOC_CTX *ctx, fr_pair_list_t *head, fr_di
 		FR_PROTO_TRACE("Decoding %s - %s", da->name,
 			       fr_table_str_by_value(fr_value_box_type_table, da->type, "?Unknown?"));
 
-		slen = internal_decode_pair(ctx, head, parent_da, &work_dbuff, decode_ctx);
+		slen = internal_decode_pair(ctx, head, da, &work_dbuff, decode_ctx);
 		if (slen <= 0) goto error;
 		break;
 
@@ -373,6 +373,78 @@ ssize_t fr_internal_decode_pair_dbuff(TALLOC_CTX *ctx, fr_dcursor_t *cursor, fr_
 	return fr_dbuff_set(dbuff, &work_dbuff);
 }
 
+/** Check the header of a stored pair list
+ *
+ * @param[in,out] dbuff		to read the header from.
+ * @return
+ *	- >0 the number of bytes consumed.
+ *	- <0 the header is missing, or for a version we don't understand.
+ */
+ssize_t fr_internal_decode_header(fr_dbuff_t *dbuff)
+{
+	fr_dbuff_t	work_dbuff = FR_DBUFF(dbuff);
+	uint8_t		hdr[FR_INTERNAL_HDR_LEN];
+
+	if (fr_dbuff_out_memcpy(hdr, &work_dbuff, sizeof(hdr)) < 0) {
+		fr_strerror_const("Data is too short to contain a header");
+		return -1;
+	}
+
+	if (memcmp(hdr, FR_INTERNAL_MAGIC, FR_INTERNAL_MAGIC_LEN) != 0) {
+		fr_strerror_const("Data does not start with the internal encoding header");
+		return -1;
+	}
+
+	if (hdr[FR_INTERNAL_MAGIC_LEN] != FR_INTERNAL_VERSION) {
+		fr_strerror_printf("Unsupported internal encoding version %u, expected %u",
+				   hdr[FR_INTERNAL_MAGIC_LEN], FR_INTERNAL_VERSION);
+		return -1;
+	}
+
+	return fr_dbuff_set(dbuff, &work_dbuff);
+}
+
+/** Decode a pair list written by #fr_internal_encode_list
+ *
+ * Either every pair is decoded and added to the output list, or the
+ * output list is left untouched.
+ *
+ * @param[in] ctx		to allocate pairs in.
+ * @param[out] out		list to add the decoded pairs to.
+ * @param[in] dict		to resolve attributes in.
+ * @param[in,out] dbuff		to decode.  All of it is consumed on success.
+ * @param[in] decode_ctx	Additional data, passed to the pair decoder.
+ * @return
+ *	- >0 the number of bytes consumed.
+ *	- <0 on error.
+ */
+ssize_t fr_internal_decode_list_dbuff(TALLOC_CTX *ctx, fr_pair_list_t *out, fr_dict_t const *dict,
+				      fr_dbuff_t *dbuff, void *decode_ctx)
+{
+	fr_pair_list_t	tmp;
+	fr_dcursor_t	cursor;
+	ssize_t		slen;
+	fr_dbuff_t	work_dbuff = FR_DBUFF(dbuff);
+
+	slen = fr_internal_decode_header(&work_dbuff);
+	if (slen < 0) return slen;
+
+	fr_pair_list_init(&tmp);
+	fr_dcursor_init(&cursor, &tmp);
+
+	while (fr_dbuff_remaining(&work_dbuff) > 0) {
+		slen = fr_internal_decode_pair_dbuff(ctx, &cursor, dict, &work_dbuff, decode_ctx);
+		if (slen <= 0) {
+			fr_pair_list_free(&tmp);
+			return slen < 0 ? slen : -1;
+		}
+	}
+
+	fr_pair_list_append(out, &tmp);
+
+	return fr_dbuff_set(dbuff, &work_dbuff);
+}
+
 /*
  *	Test points
  */
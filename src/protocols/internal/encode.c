@@ -275,6 +275,55 @@ ssize_t fr_internal_encode_pair(fr_dbuff_t *dbuff, fr_dcursor_t *cursor, void *e
 	return internal_encode(dbuff, &da_stack, 0, cursor, encode_ctx);
 }
 
+/** Write the header for a stored pair list
+ *
+ * @param[in,out] dbuff		Where to write the header.
+ * @return
+ *	- >0 The number of bytes written to out.
+ *	- <0 an error occurred.
+ */
+ssize_t fr_internal_encode_header(fr_dbuff_t *dbuff)
+{
+	fr_dbuff_t	work_dbuff = FR_DBUFF(dbuff);
+
+	FR_DBUFF_IN_MEMCPY_RETURN(&work_dbuff, (uint8_t const *)FR_INTERNAL_MAGIC, FR_INTERNAL_MAGIC_LEN);
+	FR_DBUFF_IN_BYTES_RETURN(&work_dbuff, FR_INTERNAL_VERSION);
+
+	return fr_dbuff_set(dbuff, &work_dbuff);
+}
+
+/** Encode a pair list, with a header, for storage outside of the server
+ *
+ * This is the format to use for anything which has to be read back
+ * later, possibly by a different version of the server.  The output
+ * can be read with #fr_internal_decode_list_dbuff.
+ *
+ * @param[in,out] dbuff		Where to write encoded data.
+ * @param[in] list		of pairs to encode.
+ * @param[in] encode_ctx	Additional data, passed to #fr_internal_encode_pair.
+ * @return
+ *	- >0 The number of bytes written to out.
+ *	- <0 an error occurred.
+ */
+ssize_t fr_internal_encode_list(fr_dbuff_t *dbuff, fr_pair_list_t *list, void *encode_ctx)
+{
+	fr_dbuff_t	work_dbuff = FR_DBUFF(dbuff);
+	fr_dcursor_t	cursor;
+	ssize_t		slen;
+
+	slen = fr_internal_encode_header(&work_dbuff);
+	if (slen < 0) return slen;
+
+	for (fr_dcursor_init(&cursor, list);
+	     fr_dcursor_current(&cursor);
+	     ) {
+		slen = fr_internal_encode_pair(&work_dbuff, &cursor, encode_ctx);
+		if (slen < 0) return slen;
+	}
+
+	return fr_dbuff_set(dbuff, &work_dbuff);
+}
+
 /*
  *	Test points
  */
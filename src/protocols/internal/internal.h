@@ -41,10 +41,33 @@
  * @copyright 2020 The FreeRADIUS server project
  */
 
+/*
+ *	Header for pair lists stored outside of the server
+ *
+ *	0                   1                   2                   3
+ *	0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *	|      'F'      |      'R'      |      'I'      |    version    |
+ *	+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ */
+#define FR_INTERNAL_MAGIC		"FRI"
+#define FR_INTERNAL_MAGIC_LEN		3
+#define FR_INTERNAL_VERSION		1
+#define FR_INTERNAL_HDR_LEN		(FR_INTERNAL_MAGIC_LEN + 1)
+
 ssize_t fr_internal_encode_pair(fr_dbuff_t *dbuff, fr_dcursor_t *cursor, void *encode_ctx);
 
+ssize_t fr_internal_encode_header(fr_dbuff_t *dbuff);
+
+ssize_t fr_internal_encode_list(fr_dbuff_t *dbuff, fr_pair_list_t *list, void *encode_ctx);
+
 ssize_t fr_internal_decode_pair(TALLOC_CTX *ctx, fr_dcursor_t *cursor, fr_dict_t const *dict,
 				uint8_t const *data, size_t data_len, void *decode_ctx);
 
 ssize_t fr_internal_decode_pair_dbuff(TALLOC_CTX *ctx, fr_dcursor_t *cursor, fr_dict_t const *dict,
 				fr_dbuff_t *dbuff, void *decode_ctx);
+
+ssize_t fr_internal_decode_header(fr_dbuff_t *dbuff);
+
+ssize_t fr_internal_decode_list_dbuff(TALLOC_CTX *ctx, fr_pair_list_t *out, fr_dict_t const *dict,
+				      fr_dbuff_t *dbuff, void *decode_ctx);
@@ -338,12 +338,14 @@ invalid:
  * @param[in] original		request (only if this is a response).
  * @param[in] secret		to sign the packet with.
  * @param[in] secret_len	The length of the secret.
+ * @param[in] hmac_key		HMAC-MD5 state precomputed from the secret with
+ *				#fr_hmac_md5_key_alloc.  May be NULL.
  * @return
  *	- <0 on error
  *	- 0 on success
  */
 int fr_radius_sign(uint8_t *packet, uint8_t const *original,
-		   uint8_t const *secret, size_t secret_len)
+		   uint8_t const *secret, size_t secret_len, fr_hmac_md5_key_t const *hmac_key)
 {
 	uint8_t		*msg, *end;
 	size_t		packet_len = (packet[2] << 8) | packet[3];
@@ -429,7 +431,11 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
 		 *	Message-Authenticator attribute.
 		 */
 		memset(msg + 2, 0, RADIUS_AUTH_VECTOR_LENGTH);
-		fr_hmac_md5(msg + 2, packet, packet_len, secret, secret_len);
+		if (hmac_key) {
+			fr_hmac_md5_with_key(msg + 2, packet, packet_len, hmac_key);
+		} else {
+			fr_hmac_md5(msg + 2, packet, packet_len, secret, secret_len);
+		}
 		break;
 	}
 
@@ -503,6 +509,47 @@ int fr_radius_sign(uint8_t *packet, uint8_t const *original,
  *	- True on success.
  *	- False on failure.
  */
+/** Work out what's wrong with an attribute header which failed validation
+ *
+ */
+static CC_HINT(noinline) decode_fail_t attr_header_fail(uint8_t const *packet, uint8_t const *attr, uint8_t const *end)
+{
+	/*
+	 *	We need at least 2 bytes to check the
+	 *	attribute header.
+	 */
+	if ((end - attr) < 2) {
+		FR_DEBUG_STRERROR_PRINTF("attribute header overflows the packet");
+		return DECODE_FAIL_HEADER_OVERFLOW;
+	}
+
+	/*
+	 *	Attribute number zero is NOT defined.
+	 */
+	if (attr[0] == 0) {
+		FR_DEBUG_STRERROR_PRINTF("invalid attribute 0 at offset %zd", attr - packet);
+		return DECODE_FAIL_INVALID_ATTRIBUTE;
+	}
+
+	/*
+	 *	Attributes are at LEAST as long as the ID & length
+	 *	fields.  Anything shorter is an invalid attribute.
+	 */
+	if (attr[1] < 2) {
+		FR_DEBUG_STRERROR_PRINTF("attribute %u is too short at offset %zd",
+					 attr[0], attr - packet);
+		return DECODE_FAIL_ATTRIBUTE_TOO_SHORT;
+	}
+
+	/*
+	 *	If there are fewer bytes in the packet than in the
+	 *	attribute, it's a bad packet.
+	 */
+	FR_DEBUG_STRERROR_PRINTF("attribute %u data overflows the packet starting at offset %zd",
+				 attr[0], attr - packet);
+	return DECODE_FAIL_ATTRIBUTE_OVERFLOW;
+}
+
 bool fr_radius_ok(uint8_t const *packet, size_t *packet_len_p,
 		  uint32_t max_attributes, bool require_ma, decode_fail_t *reason)
 {
@@ -628,45 +675,21 @@ bool fr_radius_ok(uint8_t const *packet, size_t *packet_len_p,
 
 	while (attr < end) {
 		/*
-		 *	We need at least 2 bytes to check the
-		 *	attribute header.
+		 *	Check the whole attribute header at once, and
+		 *	only work out what's wrong with it if something
+		 *	is.
 		 */
-		if ((end - attr) < 2) {
-			FR_DEBUG_STRERROR_PRINTF("attribute header overflows the packet");
-			failure = DECODE_FAIL_HEADER_OVERFLOW;
+		if (unlikely(((end - attr) < 2) || (attr[0] == 0) || (attr[1] < 2) || ((attr + attr[1]) > end))) {
+			failure = attr_header_fail(packet, attr, end);
 			goto finish;
 		}
 
 		/*
-		 *	Attribute number zero is NOT defined.
+		 *	Stop as soon as we know there are too many,
+		 *	instead of walking the rest of the packet.
 		 */
-		if (attr[0] == 0) {
-			FR_DEBUG_STRERROR_PRINTF("invalid attribute 0 at offset %zd", attr - packet);
-			failure = DECODE_FAIL_INVALID_ATTRIBUTE;
-			goto finish;
-		}
-
-		/*
-		 *	Attributes are at LEAST as long as the ID & length
-		 *	fields.  Anything shorter is an invalid attribute.
-		 */
-		if (attr[1] < 2) {
-			FR_DEBUG_STRERROR_PRINTF("attribute %u is too short at offset %zd",
-						 attr[0], attr - packet);
-			failure = DECODE_FAIL_ATTRIBUTE_TOO_SHORT;
-			goto finish;
-		}
-
-		/*
-		 *	If there are fewer bytes in the packet than in the
-		 *	attribute, it's a bad packet.
-		 */
-		if ((attr + attr[1]) > end) {
-			FR_DEBUG_STRERROR_PRINTF("attribute %u data overflows the packet starting at offset %zd",
-					   attr[0], attr - packet);
-			failure = DECODE_FAIL_ATTRIBUTE_OVERFLOW;
-			goto finish;
-		}
+		num_attributes++;
+		if (unlikely((max_attributes > 0) && (num_attributes > max_attributes))) break;
 
 		/*
 		 *	Sanity check the attributes for length.
@@ -704,18 +727,6 @@ bool fr_radius_ok(uint8_t const *packet, size_t *packet_len_p,
 		}
 
 		attr += attr[1];
-		num_attributes++;	/* seen one more attribute */
-	}
-
-	/*
-	 *	If the attributes add up to a packet, it's allowed.
-	 *
-	 *	If not, we complain, and throw the packet away.
-	 */
-	if (attr != end) {
-		FR_DEBUG_STRERROR_PRINTF("attributes do NOT exactly fill the packet");
-		failure = DECODE_FAIL_ATTRIBUTE_UNDERFLOW;
-		goto finish;
 	}
 
 	/*
@@ -725,12 +736,23 @@ bool fr_radius_ok(uint8_t const *packet, size_t *packet_len_p,
 	 */
 	if ((max_attributes > 0) &&
 	    (num_attributes > max_attributes)) {
-		FR_DEBUG_STRERROR_PRINTF("Possible DoS attack - too many attributes in request (received %d, max %d are allowed).",
-					 num_attributes, max_attributes);
+		FR_DEBUG_STRERROR_PRINTF("Possible DoS attack - too many attributes in request (max %d are allowed).",
+					 max_attributes);
 		failure = DECODE_FAIL_TOO_MANY_ATTRIBUTES;
 		goto finish;
 	}
 
+	/*
+	 *	If the attributes add up to a packet, it's allowed.
+	 *
+	 *	If not, we complain, and throw the packet away.
+	 */
+	if (attr != end) {
+		FR_DEBUG_STRERROR_PRINTF("attributes do NOT exactly fill the packet");
+		failure = DECODE_FAIL_ATTRIBUTE_UNDERFLOW;
+		goto finish;
+	}
+
 	/*
 	 * 	http://www.freeradius.org/rfc/rfc2869.html#EAP-Message
 	 *
@@ -767,12 +789,13 @@ finish:
  * @param original the raw original request (if this is a response)
  * @param secret the shared secret
  * @param secret_len the length of the secret
+ * @param hmac_key HMAC-MD5 state precomputed from the secret, or NULL
  * @return
  *	- <0 on error
  *	- 0 on success
  */
 int fr_radius_verify(uint8_t *packet, uint8_t const *original,
-		     uint8_t const *secret, size_t secret_len)
+		     uint8_t const *secret, size_t secret_len, fr_hmac_md5_key_t const *hmac_key)
 {
 	int rcode;
 	uint8_t *msg, *end;
@@ -828,7 +851,7 @@ int fr_radius_verify(uint8_t *packet, uint8_t const *original,
 	 *	slightly more CPU work than having verify-specific
 	 *	functions, but it ends up being cleaner in the code.
 	 */
-	rcode = fr_radius_sign(packet, original, secret, secret_len);
+	rcode = fr_radius_sign(packet, original, secret, secret_len, hmac_key);
 	if (rcode < 0) {
 		fr_strerror_const_push("Failed calculating correct authenticator");
 		return -1;
@@ -885,10 +908,7 @@ void *fr_radius_next_encodable(fr_dlist_head_t *list, void *to_eval, void *uctx)
 
 	for (c = to_eval; c; c = fr_dlist_next(list, c)) {
 		VP_VERIFY(c);
-		if ((c->da->dict == dict) &&
-		    (!c->da->flags.internal || ((c->da->attr > FR_TAG_BASE) && (c->da->attr < (FR_TAG_BASE + 0x20))))) {
-			break;
-		}
+		if (fr_radius_pair_encodable(c, dict)) break;
 	}
 
 	return c;
@@ -1071,6 +1091,358 @@ ssize_t	fr_radius_decode(TALLOC_CTX *ctx, uint8_t const *packet, size_t packet_l
 	return packet_len;
 }
 
+/** Whether an attribute can be read directly from the packet
+ *
+ * Simple attributes are known, top level, leaf attributes which
+ * #fr_radius_decode_pair_value decodes with nothing more than
+ * #fr_value_box_from_network.
+ */
+static bool attr_is_simple(fr_dict_attr_t const *da, uint8_t const *attr)
+{
+	size_t len = attr[1] - 2;
+
+	if ((len == 0) || (attr[0] == FR_NAS_FILTER_RULE)) return false;
+
+	/*
+	 *	Tags, encryption, concat, abinary, etc.
+	 */
+	if (da->flags.extra || da->flags.subtype) return false;
+
+	if (!fr_type_is_leaf(da->type)) return false;
+
+	switch (da->type) {
+	case FR_TYPE_IPV4_PREFIX:
+	case FR_TYPE_IPV6_PREFIX:
+		return false;
+
+	case FR_TYPE_OCTETS:
+		if (da->flags.length && (len != da->flags.length)) return false;
+		break;
+
+	default:
+		break;
+	}
+
+	return (len >= fr_radius_attr_sizes[da->type][0]) && (len <= fr_radius_attr_sizes[da->type][1]);
+}
+
+/** Whether a VSA can be decoded on its own, and at any time
+ *
+ * The VSA must be from a known vendor which uses the standard format,
+ * and must contain only known attributes which are neither tagged
+ * nor encrypted.  Decoding it then needs neither the secret, nor
+ * the tags of the rest of the packet.
+ *
+ * @return
+ *	- The vendor the VSA belongs to.
+ *	- NULL if the VSA has to be decoded with the rest of the packet.
+ */
+static fr_dict_attr_t const *attr_is_lazy(fr_dict_attr_t const *da, uint8_t const *attr)
+{
+	uint8_t const		*p, *end;
+	uint32_t		pen;
+	fr_dict_attr_t const	*vendor;
+	fr_dict_vendor_t const	*dv;
+
+	if ((da->type != FR_TYPE_VSA) || (attr[1] < 8) || (attr[2] != 0)) return NULL;
+
+	pen = fr_net_to_uint32(attr + 2);
+	vendor = fr_dict_attr_child_by_num(da, pen);
+	if (!vendor) return NULL;
+
+	dv = fr_dict_vendor_by_num(dict_radius, pen);
+	if (!dv || dv->continuation || (dv->type != 1) || (dv->length != 1)) return NULL;
+
+	end = attr + attr[1];
+	for (p = attr + 6; p < end; p += p[1]) {
+		fr_dict_attr_t const *child;
+
+		if (((end - p) < 2) || (p[1] < 2) || (p[1] > (end - p))) return NULL;
+
+		child = fr_dict_attr_child_by_num(vendor, p[0]);
+		if (!child || !fr_type_is_leaf(child->type) ||
+		    flag_has_tag(&child->flags) || flag_encrypted(&child->flags)) return NULL;
+	}
+
+	return vendor;
+}
+
+/** Decode a VSA which was left alone when the packet was packed
+ *
+ * The pairs are added to the end of the packed list.  The packed
+ * attribute records where they are, so they needn't be in packet
+ * order.
+ */
+static int packed_decode_vsa(fr_radius_packed_t *packed, fr_radius_packed_attr_t *pa)
+{
+	uint8_t const	*attr = packed->packet + pa->offset;
+	fr_radius_ctx_t	packet_ctx;
+	fr_pair_list_t	head;
+	fr_dcursor_t	cursor;
+	ssize_t		slen;
+
+	memset(&packet_ctx, 0, sizeof(packet_ctx));
+	packet_ctx.tmp_ctx = talloc_init_const("tmp");
+
+	fr_pair_list_init(&head);
+	fr_dcursor_init(&cursor, &head);
+
+	slen = fr_radius_decode_pair(packed, &cursor, dict_radius, attr, attr[1], &packet_ctx);
+	talloc_free(packet_ctx.tmp_ctx);
+	if (slen < 0) {
+		fr_pair_list_free(&head);
+		return -1;
+	}
+
+	pa->vendor = NULL;
+	pa->vp = fr_pair_list_head(&head);
+	pa->num = fr_pair_list_len(&head);
+	fr_pair_list_append(&packed->vps, &head);
+
+	return 0;
+}
+
+/** Decode a raw RADIUS packet into a packed list
+ *
+ * This is for callers which look at a few attributes of a packet,
+ * and then discard it.  Simple attributes are only located, and
+ * their values are read directly out of the packet by
+ * #fr_radius_packed_value.  VSAs are decoded the first time one of
+ * their vendor's attributes is asked for.  Pairs are created with
+ * #fr_radius_packed_to_pairs, which produces the same pairs as
+ * #fr_radius_decode.
+ *
+ * The caller MUST have called fr_radius_ok() first.
+ *
+ * @param[in] ctx		to allocate the packed list in.
+ * @param[in] packet		to decode.  Must not be freed before the packed list.
+ * @param[in] packet_len	of the packet.
+ * @param[in] original		request, if packet is a response.
+ * @param[in] secret		shared secret.
+ * @param[in] secret_len	of the shared secret.
+ * @return
+ *	- A new packed list.
+ *	- NULL on error.
+ */
+fr_radius_packed_t *fr_radius_decode_packed(TALLOC_CTX *ctx, uint8_t const *packet, size_t packet_len,
+					    uint8_t const *original,
+					    char const *secret, UNUSED size_t secret_len)
+{
+	ssize_t			slen;
+	uint8_t const		*attr, *end;
+	size_t			num = 0;
+	fr_radius_ctx_t		packet_ctx;
+	fr_radius_packed_t	*packed;
+	fr_dcursor_t		cursor;
+
+	attr = packet + RADIUS_HEADER_LENGTH;
+	end = packet + packet_len;
+
+	for (; attr < end; attr += attr[1]) num++;
+
+	packed = talloc_zero(ctx, fr_radius_packed_t);
+	if (unlikely(!packed)) {
+	oom:
+		fr_strerror_const("Out of memory");
+		talloc_free(packed);
+		return NULL;
+	}
+	packed->packet = packet;
+	packed->attrs = talloc_array(packed, fr_radius_packed_attr_t, num);
+	if (unlikely(!packed->attrs)) goto oom;
+	fr_pair_list_init(&packed->vps);
+	fr_dcursor_init(&cursor, &packed->vps);
+
+	memset(&packet_ctx, 0, sizeof(packet_ctx));
+	packet_ctx.tmp_ctx = talloc_init_const("tmp");
+	packet_ctx.secret = secret;
+	memcpy(packet_ctx.vector, original ? original + 4 : packet + 4, sizeof(packet_ctx.vector));
+
+	attr = packet + RADIUS_HEADER_LENGTH;
+	while (attr < end) {
+		fr_radius_packed_attr_t	*pa = &packed->attrs[packed->num_attrs];
+		fr_dict_attr_t const	*da, *vendor;
+		fr_pair_t		*last;
+		size_t			before;
+
+		da = fr_dict_attr_child_by_num(fr_dict_root(dict_radius), attr[0]);
+		if (da && attr_is_simple(da, attr)) {
+			*pa = (fr_radius_packed_attr_t) {
+				.da = da,
+				.offset = attr - packet
+			};
+			packed->num_attrs++;
+			attr += attr[1];
+			continue;
+		}
+
+		if (da && (vendor = attr_is_lazy(da, attr))) {
+			*pa = (fr_radius_packed_attr_t) {
+				.vendor = vendor,
+				.offset = attr - packet
+			};
+			packed->num_attrs++;
+			attr += attr[1];
+			continue;
+		}
+
+		/*
+		 *	Everything else is decoded now, as it
+		 *	may span multiple attributes.
+		 */
+		before = fr_pair_list_len(&packed->vps);
+		last = fr_pair_list_tail(&packed->vps);
+		slen = fr_radius_decode_pair(packed, &cursor, dict_radius, attr, (end - attr), &packet_ctx);
+		if ((slen < 0) || !fr_cond_assert(slen <= (end - attr))) {
+			talloc_free(packet_ctx.tmp_ctx);
+			talloc_free(packet_ctx.tags);
+			talloc_free(packed);
+			return NULL;
+		}
+
+		*pa = (fr_radius_packed_attr_t) {
+			.vp = fr_pair_list_next(&packed->vps, last),
+			.offset = attr - packet,
+			.num = fr_pair_list_len(&packed->vps) - before
+		};
+		if (pa->num) packed->num_attrs++;
+
+		attr += slen;
+		talloc_free_children(packet_ctx.tmp_ctx);
+	}
+
+	talloc_free(packet_ctx.tmp_ctx);
+	talloc_free(packet_ctx.tags);
+
+	return packed;
+}
+
+/** Whether an attribute may be one of the pairs a VSA decodes to
+ *
+ */
+static inline bool da_is_vendor_attr(fr_dict_attr_t const *da, fr_dict_attr_t const *vendor)
+{
+	fr_dict_attr_t const *p;
+
+	for (p = da->parent; p; p = p->parent) {
+		if (p->type == FR_TYPE_VENDOR) return (p == vendor);
+	}
+
+	return false;
+}
+
+/** Get the value of an attribute in a packed list, without creating a pair
+ *
+ * VSAs of the attribute's vendor are decoded, if they haven't been
+ * already.  No other attributes are decoded.
+ *
+ * @param[in] ctx	to allocate any buffers in the value box in.
+ * @param[out] out	Where to write the value.
+ * @param[in] packed	list to search.
+ * @param[in] da	of a leaf attribute to look for.
+ * @param[in] n		Instance of the attribute to return.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the attribute wasn't found, or its value was malformed.
+ */
+int fr_radius_packed_value(TALLOC_CTX *ctx, fr_value_box_t *out, fr_radius_packed_t *packed,
+			   fr_dict_attr_t const *da, unsigned int n)
+{
+	size_t		i;
+
+	for (i = 0; i < packed->num_attrs; i++) {
+		fr_radius_packed_attr_t		*pa = &packed->attrs[i];
+		uint8_t const			*attr;
+
+		if (pa->vendor) {
+			if (!da_is_vendor_attr(da, pa->vendor)) continue;
+			if (packed_decode_vsa(packed, pa) < 0) return -1;
+		}
+
+		if (!pa->da) {
+			fr_pair_t	*vp = pa->vp;
+			unsigned int	j;
+
+			for (j = 0; j < pa->num; j++, vp = fr_pair_list_next(&packed->vps, vp)) {
+				if ((vp->da != da) || !fr_type_is_leaf(vp->vp_type)) continue;
+				if (n > 0) {
+					n--;
+					continue;
+				}
+				return fr_value_box_copy(ctx, out, &vp->data);
+			}
+			continue;
+		}
+
+		if (pa->da != da) continue;
+		if (n > 0) {
+			n--;
+			continue;
+		}
+
+		attr = packed->packet + pa->offset;
+		return fr_value_box_from_network(ctx, out, da->type, da, attr + 2, attr[1] - 2, true) < 0 ? -1 : 0;
+	}
+
+	fr_strerror_printf("No %s attribute found", da->name);
+	return -1;
+}
+
+/** Create pairs for all the attributes in a packed list
+ *
+ * Pairs which were decoded when the list was packed are moved out
+ * of it, so the packed list can only be materialised once.
+ *
+ * @param[in] ctx	to allocate new pairs in.
+ * @param[in] cursor	to append pairs to.
+ * @param[in] packed	list to materialise.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int fr_radius_packed_to_pairs(TALLOC_CTX *ctx, fr_dcursor_t *cursor, fr_radius_packed_t *packed)
+{
+	fr_radius_ctx_t	packet_ctx;
+	size_t		i;
+
+	/*
+	 *	Simple attributes and the remaining VSAs need
+	 *	neither the secret nor the tags.
+	 */
+	memset(&packet_ctx, 0, sizeof(packet_ctx));
+
+	for (i = 0; i < packed->num_attrs; i++) {
+		fr_radius_packed_attr_t const	*pa = &packed->attrs[i];
+		uint8_t const			*attr;
+
+		if (!pa->da && !pa->vendor) {
+			fr_pair_t	*vp = pa->vp;
+			unsigned int	j;
+
+			for (j = 0; j < pa->num; j++) {
+				fr_pair_t *next = fr_pair_list_next(&packed->vps, vp);
+
+				fr_pair_remove(&packed->vps, vp);
+				if (fr_pair_steal(ctx, vp) < 0) return -1;
+				fr_dcursor_append(cursor, vp);
+				vp = next;
+			}
+			continue;
+		}
+
+		attr = packed->packet + pa->offset;
+		if (pa->vendor && !packet_ctx.tmp_ctx) packet_ctx.tmp_ctx = talloc_init_const("tmp");
+		if (fr_radius_decode_pair(ctx, cursor, dict_radius, attr, attr[1], &packet_ctx) < 0) {
+			talloc_free(packet_ctx.tmp_ctx);
+			return -1;
+		}
+	}
+	packed->num_attrs = 0;
+	talloc_free(packet_ctx.tmp_ctx);
+
+	return 0;
+}
+
 int fr_radius_init(void)
 {
 	if (instance_count > 0) {
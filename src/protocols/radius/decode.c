@@ -1829,6 +1829,8 @@ static ssize_t fr_radius_decode_proto(TALLOC_CTX *ctx, fr_pair_list_t *list, uin
 	fr_dcursor_t cursor;
 	fr_pair_t *vp;
 	uint8_t original[20];
+	fr_radius_packed_t *packed;
+	int ret;
 
 	if (!fr_radius_ok(data, &packet_len, 200, false, &reason)) {
 		return -1;
@@ -1859,8 +1861,21 @@ static ssize_t fr_radius_decode_proto(TALLOC_CTX *ctx, fr_pair_list_t *list, uin
 
 	memset(original, 0, 4);
 	memcpy(original + 4, test_ctx->vector, sizeof(test_ctx->vector));
-	return fr_radius_decode(ctx, data, packet_len, original,
-				test_ctx->secret, talloc_array_length(test_ctx->secret) - 1, &cursor);
+
+	/*
+	 *	Go through the packed representation, so that
+	 *	the tests check it produces the same pairs as
+	 *	fr_radius_decode().
+	 */
+	packed = fr_radius_decode_packed(ctx, data, packet_len, original,
+					 test_ctx->secret, talloc_array_length(test_ctx->secret) - 1);
+	if (!packed) return -1;
+
+	ret = fr_radius_packed_to_pairs(ctx, &cursor, packed);
+	talloc_free(packed);
+	if (ret < 0) return -1;
+
+	return packet_len;
 }
 
 /*
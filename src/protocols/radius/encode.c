@@ -71,6 +71,84 @@ void fr_radius_encode_chap_password(uint8_t out[static 1 + RADIUS_CHAP_CHALLENGE
 	fr_md5_ctx_free(&md5_ctx);
 }
 
+/** Re-encrypt a User-Password or Tunnel-Password value for a new secret and authenticator
+ *
+ * Both are MD5 stream ciphers chained over 16 byte blocks, so the
+ * value can be decrypted and encrypted again one block at a time, in
+ * place.  The plaintext is never copied out, and the length of the
+ * value doesn't change.  A Tunnel-Password keeps its salt.
+ *
+ * @param[in,out] value		to re-encrypt.  For Tunnel-Password this starts at the salt.
+ * @param[in] len		of the value.
+ * @param[in] salted		whether the value starts with a Tunnel-Password salt.
+ * @param[in] secret		the value was encrypted with.
+ * @param[in] secret_len	Length of secret.
+ * @param[in] vector		the value was encrypted with.
+ * @param[in] new_secret	to encrypt the value with.
+ * @param[in] new_secret_len	Length of new_secret.
+ * @param[in] new_vector	to encrypt the value with.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the value isn't a whole number of blocks.
+ */
+int fr_radius_password_rekey(uint8_t *value, size_t len, bool salted,
+			     char const *secret, size_t secret_len,
+			     uint8_t const vector[static RADIUS_AUTH_VECTOR_LENGTH],
+			     char const *new_secret, size_t new_secret_len,
+			     uint8_t const new_vector[static RADIUS_AUTH_VECTOR_LENGTH])
+{
+	fr_md5_ctx_t	*md5_ctx, *old_ctx, *new_ctx;
+	uint8_t		old_digest[AUTH_PASS_LEN], new_digest[AUTH_PASS_LEN], prev[AUTH_PASS_LEN];
+	uint8_t const	*salt = NULL;
+	size_t		i, n;
+
+	if (salted) {
+		if (len < 2) goto invalid;
+		salt = value;
+		value += 2;
+		len -= 2;
+	}
+
+	if ((len == 0) || ((len % AUTH_PASS_LEN) != 0)) {
+	invalid:
+		fr_strerror_printf("Encrypted value of %zu bytes is malformed", len);
+		return -1;
+	}
+
+	md5_ctx = fr_md5_ctx_alloc(true);
+	old_ctx = fr_md5_ctx_alloc(false);
+	new_ctx = fr_md5_ctx_alloc(false);
+
+	fr_md5_update(old_ctx, (uint8_t const *) secret, secret_len);
+	fr_md5_update(new_ctx, (uint8_t const *) new_secret, new_secret_len);
+
+	for (n = 0; n < len; n += AUTH_PASS_LEN) {
+		/*
+		 *	The key stream for each block depends on the
+		 *	previous block of ciphertext, which differs
+		 *	between the old and new encryptions.
+		 */
+		fr_md5_ctx_copy(md5_ctx, old_ctx);
+		fr_md5_update(md5_ctx, (n == 0) ? vector : prev, AUTH_PASS_LEN);
+		if ((n == 0) && salt) fr_md5_update(md5_ctx, salt, 2);
+		fr_md5_final(old_digest, md5_ctx);
+
+		fr_md5_ctx_copy(md5_ctx, new_ctx);
+		fr_md5_update(md5_ctx, (n == 0) ? new_vector : value + n - AUTH_PASS_LEN, AUTH_PASS_LEN);
+		if ((n == 0) && salt) fr_md5_update(md5_ctx, salt, 2);
+		fr_md5_final(new_digest, md5_ctx);
+
+		memcpy(prev, value + n, AUTH_PASS_LEN);
+		for (i = 0; i < AUTH_PASS_LEN; i++) value[n + i] ^= old_digest[i] ^ new_digest[i];
+	}
+
+	fr_md5_ctx_free(&md5_ctx);
+	fr_md5_ctx_free(&old_ctx);
+	fr_md5_ctx_free(&new_ctx);
+
+	return 0;
+}
+
 /** "encrypt" a password RADIUS style
  *
  * Input and output buffers can be identical if in-place encryption is needed.
@@ -1021,6 +1099,53 @@ static ssize_t encode_vendor_attr(fr_dbuff_t *dbuff,
 	return fr_dbuff_set(dbuff, &work_dbuff);
 }
 
+/** Encode a run of flat attributes belonging to the same vendor
+ *
+ * Replies often contain many consecutive attributes of one vendor.
+ * Rather than going back through #fr_radius_encode_pair for each of
+ * them, which has to rebuild the da stack, and look up the vendor
+ * again, keep encoding while the next attribute is a direct child of
+ * the same vendor.
+ *
+ * Each attribute still gets its own Vendor-Specific header.
+ */
+static ssize_t encode_vendor_run(fr_dbuff_t *dbuff,
+				 fr_da_stack_t *da_stack, unsigned int depth,
+				 fr_dcursor_t *cursor, void *encode_ctx)
+{
+	fr_dict_attr_t const	*vendor = da_stack->da[depth];
+	fr_pair_t const		*vp;
+	ssize_t			slen;
+	fr_dbuff_t		work_dbuff = FR_DBUFF(dbuff);
+
+	slen = encode_vendor_attr(&work_dbuff, da_stack, depth, cursor, encode_ctx);
+	if (slen <= 0) return slen;
+
+	while ((vp = fr_dcursor_current(cursor)) && (vp->da->parent == vendor)) {
+		VP_VERIFY(vp);
+
+		/*
+		 *	Let fr_radius_encode_pair() produce the
+		 *	error for zero length values.
+		 */
+		if (((vp->vp_type == FR_TYPE_STRING) || (vp->vp_type == FR_TYPE_OCTETS)) &&
+		    (fr_radius_attr_len(vp) == 0)) break;
+
+		/*
+		 *	Keep what we've already encoded.  If the
+		 *	cursor didn't move, the caller retries this
+		 *	attribute and gets the error itself.
+		 */
+		slen = encode_vendor_attr(&work_dbuff, da_stack, depth, cursor, encode_ctx);
+		if (slen <= 0) {
+			if ((slen == PAIR_ENCODE_SKIPPED) && (fr_dcursor_current(cursor) != vp)) continue;
+			break;
+		}
+	}
+
+	return fr_dbuff_set(dbuff, &work_dbuff);
+}
+
 /** Encode a WiMAX attribute
  *
  */
@@ -1131,7 +1256,7 @@ static ssize_t encode_vendor(fr_dbuff_t *dbuff,
 			return encode_wimax(dbuff, da_stack, depth, cursor, encode_ctx);
 		}
 
-		return encode_vendor_attr(dbuff, da_stack, depth, cursor, encode_ctx);
+		return encode_vendor_run(dbuff, da_stack, depth, cursor, encode_ctx);
 	}
 
 	/*
@@ -1662,7 +1787,7 @@ static ssize_t fr_radius_encode_proto(UNUSED TALLOC_CTX *ctx, fr_pair_list_t *vp
 				packet_type, 0, vps);
 	if (slen <= 0) return slen;
 
-	if (fr_radius_sign(data, NULL, (uint8_t const *) test_ctx->secret, talloc_array_length(test_ctx->secret) - 1) < 0) {
+	if (fr_radius_sign(data, NULL, (uint8_t const *) test_ctx->secret, talloc_array_length(test_ctx->secret) - 1, NULL) < 0) {
 		return -1;
 	}
 
@@ -27,7 +27,9 @@
 #include <freeradius-devel/util/packet.h>
 #include <freeradius-devel/util/rand.h>
 #include <freeradius-devel/util/log.h>
+#include <freeradius-devel/util/md5.h>
 #include <freeradius-devel/util/dbuff.h>
+#include <freeradius-devel/protocol/radius/freeradius.internal.h>
 
 #define RADIUS_AUTH_VECTOR_OFFSET      		4
 #define RADIUS_HEADER_LENGTH			20
@@ -105,15 +107,45 @@ enum {
 #define flag_long_extended(_flags)   (!(_flags)->extra && (_flags)->subtype == FLAG_LONG_EXTENDED_ATTR)
 #define flag_tunnel_password(_flags) (!(_flags)->extra && (((_flags)->subtype == FLAG_ENCRYPT_TUNNEL_PASSWORD) || ((_flags)->subtype == FLAG_TAGGED_TUNNEL_PASSWORD)))
 
+/** An attribute in a packed RADIUS packet
+ *
+ */
+typedef struct {
+	fr_dict_attr_t const	*da;		//!< Of a simple attribute, whose value is read directly
+						///< from the packet.  NULL if the attribute was decoded.
+	fr_dict_attr_t const	*vendor;	//!< Of a VSA which will be decoded on first use.
+	fr_pair_t		*vp;		//!< First of the pairs the attribute was decoded to.
+	uint16_t		offset;		//!< Of the attribute header in the packet.
+	uint16_t		num;		//!< Number of decoded pairs the attribute produced.
+} fr_radius_packed_attr_t;
+
+/** A RADIUS packet whose simple attributes have not been decoded into pairs
+ *
+ * Well formed VSAs from known vendors are decoded into pairs the first
+ * time something asks for one of that vendor's attributes.  Attributes
+ * which need more than that (TLVs, tagged, encrypted, concatenated,
+ * extended and malformed attributes) are decoded when the packet is
+ * packed.  All others are described by their location in the packet,
+ * and only become pairs on materialisation.
+ */
+typedef struct {
+	uint8_t const		*packet;	//!< Must not be freed before the packed list.
+	fr_radius_packed_attr_t	*attrs;		//!< In packet order.
+	size_t			num_attrs;
+	fr_pair_list_t		vps;		//!< Pairs decoded from attributes which weren't simple.
+} fr_radius_packed_t;
+
 /*
  *	protocols/radius/base.c
  */
 size_t		fr_radius_attr_len(fr_pair_t const *vp);
 
 int		fr_radius_sign(uint8_t *packet, uint8_t const *original,
-			       uint8_t const *secret, size_t secret_len) CC_HINT(nonnull (1,3));
+			       uint8_t const *secret, size_t secret_len,
+			       fr_hmac_md5_key_t const *hmac_key) CC_HINT(nonnull (1,3));
 int		fr_radius_verify(uint8_t *packet, uint8_t const *original,
-				 uint8_t const *secret, size_t secret_len) CC_HINT(nonnull (1,3));
+				 uint8_t const *secret, size_t secret_len,
+				 fr_hmac_md5_key_t const *hmac_key) CC_HINT(nonnull (1,3));
 bool		fr_radius_ok(uint8_t const *packet, size_t *packet_len_p,
 			     uint32_t max_attributes, bool require_ma, decode_fail_t *reason) CC_HINT(nonnull (1,2));
 
@@ -131,6 +163,16 @@ ssize_t		fr_radius_encode_dbuff(fr_dbuff_t *dbuff, uint8_t const *original,
 ssize_t		fr_radius_decode(TALLOC_CTX *ctx, uint8_t const *packet, size_t packet_len, uint8_t const *original,
 				 char const *secret, UNUSED size_t secret_len, fr_dcursor_t *cursor) CC_HINT(nonnull(1,2,5,7));
 
+fr_radius_packed_t *fr_radius_decode_packed(TALLOC_CTX *ctx, uint8_t const *packet, size_t packet_len,
+					    uint8_t const *original,
+					    char const *secret, UNUSED size_t secret_len) CC_HINT(nonnull(2,5));
+
+int		fr_radius_packed_value(TALLOC_CTX *ctx, fr_value_box_t *out, fr_radius_packed_t *packed,
+				       fr_dict_attr_t const *da, unsigned int n) CC_HINT(nonnull(2,3,4));
+
+int		fr_radius_packed_to_pairs(TALLOC_CTX *ctx, fr_dcursor_t *cursor,
+					  fr_radius_packed_t *packed) CC_HINT(nonnull(2,3));
+
 int		fr_radius_init(void);
 
 void		fr_radius_free(void);
@@ -193,8 +235,59 @@ void		fr_radius_encode_chap_password(uint8_t out[static 1 + RADIUS_CHAP_CHALLENG
 					       uint8_t id, uint8_t const vector[static RADIUS_AUTH_VECTOR_LENGTH],
 					       char const *password, size_t password_len) CC_HINT(nonnull(1,3,4));
 
+int		fr_radius_password_rekey(uint8_t *value, size_t len, bool salted,
+					 char const *secret, size_t secret_len,
+					 uint8_t const vector[static RADIUS_AUTH_VECTOR_LENGTH],
+					 char const *new_secret, size_t new_secret_len,
+					 uint8_t const new_vector[static RADIUS_AUTH_VECTOR_LENGTH]) CC_HINT(nonnull);
+
 ssize_t		fr_radius_encode_pair(fr_dbuff_t *dbuff, fr_dcursor_t *cursor, void *encode_ctx);
 
+/** Whether a pair will be encoded into a RADIUS packet
+ *
+ * @param[in] vp	to check.
+ * @param[in] dict	the RADIUS dictionary.
+ * @return
+ *	- true if the pair is a RADIUS attribute, or a tag group.
+ *	- false if it's internal, or from another protocol.
+ */
+static inline bool fr_radius_pair_encodable(fr_pair_t const *vp, fr_dict_t const *dict)
+{
+	return (vp->da->dict == dict) &&
+	       (!vp->da->flags.internal || ((vp->da->attr > FR_TAG_BASE) && (vp->da->attr < (FR_TAG_BASE + 0x20))));
+}
+
+/** Return vp, or the first pair after it, which will be encoded into a RADIUS packet
+ *
+ * @param[in] list	vp is in.
+ * @param[in] vp	to start searching from.  May be NULL.
+ * @param[in] dict	the RADIUS dictionary.
+ * @return
+ *	- The first encodable pair.
+ *	- NULL if there are no more encodable pairs.
+ */
+static inline fr_pair_t *fr_radius_seek_encodable(fr_pair_list_t const *list, fr_pair_t const *vp,
+						  fr_dict_t const *dict)
+{
+	while (vp && !fr_radius_pair_encodable(vp, dict)) vp = fr_dlist_next(&list->head, vp);
+
+	return UNCONST(fr_pair_t *, vp);
+}
+
+/** Iterate over the pairs in a list which will be encoded into a RADIUS packet
+ *
+ * A fast path alternative to a cursor using fr_radius_next_encodable().
+ *
+ * @param[in] _list	to iterate over.
+ * @param[in] _iter	Name of iteration variable.
+ *			Will be declared in the scope of the loop.
+ * @param[in] _dict	the RADIUS dictionary.
+ */
+#define fr_radius_foreach_encodable(_list, _iter, _dict) \
+	for (fr_pair_t *_iter = fr_radius_seek_encodable(_list, fr_dlist_head(&(_list)->head), _dict); \
+	     _iter; \
+	     _iter = fr_radius_seek_encodable(_list, fr_dlist_next(&(_list)->head, _iter), _dict))
+
 /*
  *	protocols/radius/decode.c
  */
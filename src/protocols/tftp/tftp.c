@@ -113,8 +113,12 @@ int fr_tftp_decode(TALLOC_CTX *ctx, uint8_t const *data, size_t data_len, fr_dcu
 		/* first of all, here we should have always a '\0' */
 		if (*(end - 1) != '\0') goto error_malformed;
 
-		/* first character should be alpha numeric */
-		if (!isalnum(p[0])) {
+		/*
+		 *  Filenames are opaque to us, and boot ROMs commonly
+		 *  ask for things like "/pxelinux.0".  They just can't
+		 *  be empty.
+		 */
+		if (p[0] == '\0') {
 			fr_strerror_printf("Invalid Filename");
 			goto error;
 		}
@@ -159,34 +163,50 @@ int fr_tftp_decode(TALLOC_CTX *ctx, uint8_t const *data, size_t data_len, fr_dcu
 		fr_dcursor_append(cursor, vp);
 		p += 1 /* \0 */;
 
-		if (p >= end) goto done;
-
 		/*
-		 *  Once here, the next 'blksize' is optional.
-		 *  At least: | blksize | \0 | #blksize | \0 |
+		 *  Options (RFC 2347) follow as | name | \0 | value | \0 |
+		 *  pairs, in any order, with case-insensitive names.
+		 *
+		 *  We only have an attribute for 'blksize'.  Others
+		 *  (tsize, timeout, windowsize...) are skipped, so that
+		 *  clients sending them aren't rejected.  The listener
+		 *  negotiates those from the raw packet.
 		 */
-		if ((end - p) < 10) goto error_malformed;
+		while (p < end) {
+			uint8_t const *value;
 
-		if (!memcmp(p, "blksize\0", 8)) {
-			char *p_end = NULL;
-			long blksize;
+			q = memchr(p, '\0', (end - p));
+			if (!q || (q == p)) goto error_malformed;
 
-			p += 8;
+			value = q + 1;
+			if (value >= end) goto error_malformed;
+
+			q = memchr(value, '\0', (end - value));
+			if (!q) goto error_malformed;
+
+			if (((value - p) == 8) && (strncasecmp((char const *)p, "blksize", 7) == 0)) {
+				char *p_end = NULL;
+				long blksize;
+
+				if ((q == value) || ((q - value) > 5)) goto error_malformed;
 
-			if (p >= end || (end - p) < 1 || (end - p) > 6) goto error_malformed;
+				vp = fr_pair_afrom_da(ctx, attr_tftp_block_size);
+				if (!vp) goto error;
 
-			vp = fr_pair_afrom_da(ctx, attr_tftp_block_size);
-			if (!vp) goto error;
+				blksize = strtol((const char *)value, &p_end, 10);
 
-			blksize = strtol((const char *)p, &p_end, 10);
+				if ((value == (const uint8_t *)p_end) ||
+				    (blksize < FR_TFTP_BLOCK_MIN_SIZE) || (blksize > FR_TFTP_BLOCK_MAX_SIZE)) {
+					talloc_free(vp);
+					fr_strerror_printf("Invalid Block-Size %ld value", blksize);
+					goto error;
+				}
 
-			if (p == (const uint8_t *)p_end || blksize > FR_TFTP_BLOCK_MAX_SIZE) {
-				fr_strerror_printf("Invalid Block-Size %ld value", blksize);
-				goto error;
+				vp->vp_uint16 = (uint16_t)blksize;
+				fr_dcursor_append(cursor, vp);
 			}
 
-			vp->vp_uint16 = (uint16_t)blksize;
-			fr_dcursor_append(cursor, vp);
+			p = q + 1;
 		}
 
 		break;
@@ -0,0 +1 @@
+cache_sharded.test:
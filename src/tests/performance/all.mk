@@ -0,0 +1,23 @@
+#
+#	Performance regression tests.
+#
+#	These are not run as part of "make test", as they take a few
+#	minutes, and the results depend on the machine.  Run them with:
+#
+#		make test.performance
+#
+#	and compare the results against an earlier report with:
+#
+#		make test.performance PERF_BASELINE=/path/to/report
+#
+PERF_BUILD_DIR := $(BUILD_DIR)/tests/performance
+
+.PHONY: test.performance
+test.performance: $(BUILD_DIR)/bin/radiusd $(BUILD_DIR)/bin/radclient $(BUILD_DIR)/bin/struct_bench $(BUILD_DIR)/bin/unit_test_attribute | $(BUILD_DIR)/tests
+	${Q}BUILD_DIR=$(abspath $(BUILD_DIR)) src/tests/performance/bench -o $(abspath $(PERF_BUILD_DIR)) $(if $(PERF_BASELINE),-b $(abspath $(PERF_BASELINE)))
+
+.PHONY: clean.test.performance
+clean.test.performance:
+	${Q}rm -rf $(PERF_BUILD_DIR)
+
+clean.test: clean.test.performance
@@ -0,0 +1,240 @@
+/*
+ * atomic_queue_bench.c	Benchmark for atomic queues
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/io/atomic_queue.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/talloc.h>
+#include <freeradius-devel/util/time.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+#define MAX_THREADS	(64)
+#define MAX_BATCH	(256)
+
+/**********************************************************************/
+typedef struct request_s request_t;
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED request_t *request);
+
+void request_verify(UNUSED char const *file, UNUSED int line, UNUSED request_t *request)
+{
+}
+/**********************************************************************/
+
+typedef struct {
+	fr_atomic_queue_t	*aq;
+	pthread_t		pthread_id;
+	int			id;
+	size_t			batch;		//!< 1 means push / pop, otherwise push_n / pop_n.
+	uint64_t		count;		//!< number of items to push, or which we popped.
+	uint64_t		sum;		//!< of the items we popped.
+	atomic_uint64_t		*remaining;	//!< items which haven't been popped yet.
+} bench_thread_t;
+
+static size_t		queue_size = 1024;
+static uint64_t		num_ops = 1000000;
+
+static NEVER_RETURNS void usage(void)
+{
+	fprintf(stderr, "usage: atomic_queue_bench [OPTS]\n");
+	fprintf(stderr, "  -b batch               batch size for push_n / pop_n (default 16).\n");
+	fprintf(stderr, "  -n count               number of items each producer pushes.\n");
+	fprintf(stderr, "  -s size                set queue size.\n");
+	fprintf(stderr, "  -t threads             maximum number of producers, and of consumers.\n");
+
+	fr_exit_now(EXIT_SUCCESS);
+}
+
+static void *producer(void *arg)
+{
+	bench_thread_t	*bt = arg;
+	uint64_t	i, base;
+	void		*data[MAX_BATCH];
+
+	/*
+	 *	Values are never zero, as we can't push NULL.
+	 */
+	base = ((uint64_t) bt->id * bt->count) + 1;
+
+	for (i = 0; i < bt->count; ) {
+		size_t j, num;
+
+		if (bt->batch == 1) {
+			if (fr_atomic_queue_push(bt->aq, (void *) (uintptr_t) (base + i))) i++;
+			continue;
+		}
+
+		num = bt->batch;
+		if (num > (bt->count - i)) num = bt->count - i;
+
+		for (j = 0; j < num; j++) data[j] = (void *) (uintptr_t) (base + i + j);
+
+		i += fr_atomic_queue_push_n(bt->aq, data, num);
+	}
+
+	return NULL;
+}
+
+static void *consumer(void *arg)
+{
+	bench_thread_t	*bt = arg;
+	void		*data[MAX_BATCH];
+
+	while (atomic_load(bt->remaining) > 0) {
+		size_t i, num;
+
+		if (bt->batch == 1) {
+			num = fr_atomic_queue_pop(bt->aq, &data[0]);
+		} else {
+			num = fr_atomic_queue_pop_n(bt->aq, data, bt->batch);
+		}
+		if (!num) continue;
+
+		for (i = 0; i < num; i++) bt->sum += (uintptr_t) data[i];
+		bt->count += num;
+		atomic_fetch_sub(bt->remaining, num);
+	}
+
+	return NULL;
+}
+
+/** Run one benchmark, and check that every item came out exactly once
+ *
+ */
+static int bench_run(TALLOC_CTX *ctx, int num_threads, size_t batch)
+{
+	int			i;
+	fr_atomic_queue_t	*aq;
+	bench_thread_t		producers[MAX_THREADS], consumers[MAX_THREADS];
+	atomic_uint64_t		remaining;
+	uint64_t		total, sum, expected;
+	fr_time_t		start;
+	fr_time_delta_t		elapsed;
+
+	aq = fr_atomic_queue_alloc(ctx, queue_size);
+	if (!aq) {
+		fprintf(stderr, "Failed allocating queue\n");
+		return -1;
+	}
+
+	total = num_ops * num_threads;
+	atomic_init(&remaining, total);
+
+	memset(producers, 0, sizeof(producers));
+	memset(consumers, 0, sizeof(consumers));
+
+	start = fr_time();
+
+	for (i = 0; i < num_threads; i++) {
+		consumers[i].aq = aq;
+		consumers[i].id = i;
+		consumers[i].batch = batch;
+		consumers[i].remaining = &remaining;
+		if (pthread_create(&consumers[i].pthread_id, NULL, consumer, &consumers[i]) != 0) {
+			fprintf(stderr, "Failed creating consumer thread\n");
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		producers[i].aq = aq;
+		producers[i].id = i;
+		producers[i].batch = batch;
+		producers[i].count = num_ops;
+		if (pthread_create(&producers[i].pthread_id, NULL, producer, &producers[i]) != 0) {
+			fprintf(stderr, "Failed creating producer thread\n");
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
+	sum = 0;
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(producers[i].pthread_id, NULL);
+		pthread_join(consumers[i].pthread_id, NULL);
+		sum += consumers[i].sum;
+	}
+
+	elapsed = fr_time() - start;
+	if (elapsed <= 0) elapsed = 1;
+
+	fr_atomic_queue_free(&aq);
+
+	/*
+	 *	Items are 1..total, so we know what the sum should be.
+	 */
+	expected = (total * (total + 1)) / 2;
+	if (sum != expected) {
+		fprintf(stderr, "threads %d batch %zu: sum of popped items is %" PRIu64 ", expected %" PRIu64 "\n",
+			num_threads, batch, sum, expected);
+		return -1;
+	}
+
+	printf("producers %2d consumers %2d batch %3zu: %12.0f ops/sec\n",
+	       num_threads, num_threads, batch,
+	       ((double) total * NSEC) / (double) elapsed);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int			c, threads, max_threads = 4;
+	size_t			batch = 16;
+	TALLOC_CTX		*autofree = talloc_autofree_context();
+
+	while ((c = getopt(argc, argv, "b:hn:s:t:")) != -1) switch (c) {
+		case 'b':
+			batch = atoi(optarg);
+			if ((batch < 1) || (batch > MAX_BATCH)) usage();
+			break;
+
+		case 'n':
+			num_ops = strtoull(optarg, NULL, 10);
+			if (!num_ops) usage();
+			break;
+
+		case 's':
+			queue_size = atoi(optarg);
+			if (!queue_size) usage();
+			break;
+
+		case 't':
+			max_threads = atoi(optarg);
+			if ((max_threads < 1) || (max_threads > MAX_THREADS)) usage();
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	for (threads = 1; threads <= max_threads; threads *= 2) {
+		if (bench_run(autofree, threads, 1) < 0) fr_exit_now(EXIT_FAILURE);
+		if ((batch > 1) && (bench_run(autofree, threads, batch) < 0)) fr_exit_now(EXIT_FAILURE);
+	}
+
+	return 0;
+}
@@ -175,6 +175,50 @@ int main(int argc, char *argv[])
 	}
 #endif
 
+	/*
+	 *	Batches.  Push one more than will fit, and check that
+	 *	only "size" entries are pushed.
+	 */
+	{
+		size_t	num;
+		void	**array;
+
+		array = talloc_array(autofree, void *, size + 1);
+
+		for (i = 0; i <= size; i++) {
+			val = i + OFFSET;
+			array[i] = (void *) val;
+		}
+
+		num = fr_atomic_queue_push_n(aq, array, size + 1);
+		if (num != (size_t) size) {
+			fprintf(stderr, "Batch push expected %d, pushed %zu\n", size, num);
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		memset(array, 0, sizeof(array[0]) * (size + 1));
+
+		num = fr_atomic_queue_pop_n(aq, array, size + 1);
+		if (num != (size_t) size) {
+			fprintf(stderr, "Batch pop expected %d, popped %zu\n", size, num);
+			fr_exit_now(EXIT_FAILURE);
+		}
+
+		for (i = 0; i < size; i++) {
+			val = (intptr_t) array[i];
+			if (val != (i + OFFSET)) {
+				fprintf(stderr, "Batch pop expected %d, got %d\n",
+					i + OFFSET, (int) val);
+				fr_exit_now(EXIT_FAILURE);
+			}
+		}
+
+		if (fr_atomic_queue_pop_n(aq, array, 1) != 0) {
+			fprintf(stderr, "Batch popped an entry past the end of the queue.");
+			fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
 	return ret;
 }
 
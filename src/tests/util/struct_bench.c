@@ -0,0 +1,385 @@
+/*
+ * struct_bench.c	Benchmark for the util lookup structures
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * @copyright 2026 The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/heap.h>
+#include <freeradius-devel/util/htrie.h>
+#include <freeradius-devel/util/rand.h>
+#include <freeradius-devel/util/rb.h>
+#include <freeradius-devel/util/talloc.h>
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/util/trie.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+/*
+ *	Results are printed one per line, as "name<TAB>value", so
+ *	that they can be compared by src/tests/performance/bench.
+ *
+ *	struct.<type>.<op>.<entries>.ns_per_op	time for one operation
+ *	struct.<type>.<entries>.blocks_per_entry	talloc blocks held by the
+ *						structure, per entry
+ */
+
+typedef struct {
+	uint64_t	key;
+	fr_rb_node_t	node;		//!< For the rb tree.
+	int32_t		heap_id;	//!< For the heap.
+} bench_item_t;
+
+typedef struct {
+	char const	*name;
+
+	void		*(*alloc)(TALLOC_CTX *ctx);
+	bool		(*insert)(void *store, bench_item_t *item);
+	bool		(*find)(void *store, bench_item_t *item);
+	bool		(*delete)(void *store, bench_item_t *item);
+} bench_type_t;
+
+static size_t	min_entries = 1000;
+static size_t	max_entries = 1000000;
+
+static NEVER_RETURNS void usage(void)
+{
+	fprintf(stderr, "usage: struct_bench [OPTS] [type ...]\n");
+	fprintf(stderr, "  -m entries             maximum number of entries (default 1000000).\n");
+	fprintf(stderr, "  -s entries             starting number of entries (default 1000).\n");
+	fprintf(stderr, "Where type is one or more of: rb heap heap_keyed hash trie htrie_hash htrie_rb htrie_trie\n");
+
+	fr_exit_now(EXIT_SUCCESS);
+}
+
+static int8_t item_cmp(void const *one, void const *two)
+{
+	bench_item_t const *a = one, *b = two;
+
+	return CMP(a->key, b->key);
+}
+
+static uint32_t item_hash(void const *data)
+{
+	bench_item_t const *item = data;
+
+	return fr_hash(&item->key, sizeof(item->key));
+}
+
+static int item_key(uint8_t **out, size_t *outlen, void const *data)
+{
+	bench_item_t const *item = data;
+
+	*out = UNCONST(uint8_t *, (uint8_t const *)&item->key);
+	*outlen = sizeof(item->key) * 8;
+	return 0;
+}
+
+/*
+ *	rb
+ */
+static void *rb_alloc(TALLOC_CTX *ctx)
+{
+	return fr_rb_inline_alloc(ctx, bench_item_t, node, item_cmp, NULL);
+}
+
+static bool rb_insert(void *store, bench_item_t *item)
+{
+	return fr_rb_insert(store, item);
+}
+
+static bool rb_find(void *store, bench_item_t *item)
+{
+	return (fr_rb_find(store, item) == item);
+}
+
+static bool rb_delete(void *store, bench_item_t *item)
+{
+	return (fr_rb_remove(store, item) == item);
+}
+
+/*
+ *	heap - there's no "find", so "delete" is an extract of an
+ *	arbitrary element, and the heap is emptied with pop.
+ */
+static void *heap_alloc(TALLOC_CTX *ctx)
+{
+	return fr_heap_alloc(ctx, item_cmp, bench_item_t, heap_id);
+}
+
+static void *heap_keyed_alloc(TALLOC_CTX *ctx)
+{
+	return fr_heap_keyed_alloc(ctx, bench_item_t, heap_id, key);
+}
+
+static bool heap_insert(void *store, bench_item_t *item)
+{
+	return (fr_heap_insert(store, item) == 0);
+}
+
+static bool heap_delete(void *store, bench_item_t *item)
+{
+	return (fr_heap_extract(store, item) == 0);
+}
+
+/*
+ *	hash
+ */
+static void *hash_alloc(TALLOC_CTX *ctx)
+{
+	return fr_hash_table_alloc(ctx, item_hash, item_cmp, NULL);
+}
+
+static bool hash_insert(void *store, bench_item_t *item)
+{
+	return fr_hash_table_insert(store, item);
+}
+
+static bool hash_find(void *store, bench_item_t *item)
+{
+	return (fr_hash_table_find(store, item) == item);
+}
+
+static bool hash_delete(void *store, bench_item_t *item)
+{
+	return (fr_hash_table_remove(store, item) == item);
+}
+
+/*
+ *	trie
+ */
+static void *trie_alloc(TALLOC_CTX *ctx)
+{
+	return fr_trie_alloc(ctx, item_key, NULL);
+}
+
+static bool trie_insert(void *store, bench_item_t *item)
+{
+	return (fr_trie_insert_by_key(store, &item->key, sizeof(item->key) * 8, item) == 0);
+}
+
+static bool trie_find(void *store, bench_item_t *item)
+{
+	return (fr_trie_lookup_by_key(store, &item->key, sizeof(item->key) * 8) == item);
+}
+
+static bool trie_delete(void *store, bench_item_t *item)
+{
+	return (fr_trie_remove_by_key(store, &item->key, sizeof(item->key) * 8) == item);
+}
+
+/*
+ *	htrie, with each of its backing stores.
+ */
+static void *htrie_hash_alloc(TALLOC_CTX *ctx)
+{
+	return fr_htrie_alloc(ctx, FR_HTRIE_HASH, item_hash, item_cmp, item_key, NULL);
+}
+
+static void *htrie_rb_alloc(TALLOC_CTX *ctx)
+{
+	return fr_htrie_alloc(ctx, FR_HTRIE_RB, item_hash, item_cmp, item_key, NULL);
+}
+
+static void *htrie_trie_alloc(TALLOC_CTX *ctx)
+{
+	return fr_htrie_alloc(ctx, FR_HTRIE_TRIE, item_hash, item_cmp, item_key, NULL);
+}
+
+static bool htrie_insert(void *store, bench_item_t *item)
+{
+	return fr_htrie_insert(store, item);
+}
+
+static bool htrie_find(void *store, bench_item_t *item)
+{
+	return (fr_htrie_find(store, item) == item);
+}
+
+static bool htrie_delete(void *store, bench_item_t *item)
+{
+	return (fr_htrie_remove(store, item) == item);
+}
+
+static bench_type_t const bench_types[] = {
+	{ .name = "rb",		.alloc = rb_alloc,	   .insert = rb_insert,	   .find = rb_find,    .delete = rb_delete },
+	{ .name = "heap",	.alloc = heap_alloc,	   .insert = heap_insert,			       .delete = heap_delete },
+	{ .name = "heap_keyed",	.alloc = heap_keyed_alloc, .insert = heap_insert,			       .delete = heap_delete },
+	{ .name = "hash",	.alloc = hash_alloc,	   .insert = hash_insert,  .find = hash_find,  .delete = hash_delete },
+	{ .name = "trie",	.alloc = trie_alloc,	   .insert = trie_insert,  .find = trie_find,  .delete = trie_delete },
+	{ .name = "htrie_hash",	.alloc = htrie_hash_alloc, .insert = htrie_insert, .find = htrie_find, .delete = htrie_delete },
+	{ .name = "htrie_rb",	.alloc = htrie_rb_alloc,   .insert = htrie_insert, .find = htrie_find, .delete = htrie_delete },
+	{ .name = "htrie_trie",	.alloc = htrie_trie_alloc, .insert = htrie_insert, .find = htrie_find, .delete = htrie_delete },
+};
+
+static void result_print(char const *type, char const *op, size_t entries, fr_time_delta_t elapsed)
+{
+	printf("struct.%s.%s.%zu.ns_per_op\t%.1f\n", type, op, entries, (double) elapsed / entries);
+}
+
+/** Run one operation over all of the items, in a shuffled order
+ *
+ */
+static int bench_op(bench_type_t const *bt, char const *op, bool (*func)(void *store, bench_item_t *item),
+		    void *store, bench_item_t **order, size_t entries)
+{
+	size_t		i;
+	fr_time_t	start;
+
+	start = fr_time();
+	for (i = 0; i < entries; i++) {
+		if (!func(store, order[i])) {
+			fprintf(stderr, "%s %s failed for entry %zu\n", bt->name, op, i);
+			return -1;
+		}
+	}
+	result_print(bt->name, op, entries, fr_time() - start);
+
+	return 0;
+}
+
+static int bench_run(TALLOC_CTX *ctx, bench_type_t const *bt, bench_item_t *items, bench_item_t **order, size_t entries)
+{
+	TALLOC_CTX	*store_ctx;
+	void		*store;
+	size_t		blocks;
+	size_t		i, j;
+	bench_item_t	*tmp;
+
+	/*
+	 *	Keep the store in its own context, so we can count
+	 *	the blocks it allocates.
+	 */
+	store_ctx = talloc_new(ctx);
+	store = bt->alloc(store_ctx);
+	if (!store) {
+		fprintf(stderr, "Failed allocating %s\n", bt->name);
+		talloc_free(store_ctx);
+		return -1;
+	}
+	blocks = talloc_total_blocks(store_ctx);
+
+	/*
+	 *	Lookups and deletes are done in a different order to
+	 *	inserts, so that they don't just follow the cache.
+	 */
+	for (i = 0; i < entries; i++) order[i] = &items[i];
+
+	if (bench_op(bt, "insert", bt->insert, store, order, entries) < 0) goto error;
+
+	printf("struct.%s.%zu.blocks_per_entry\t%.2f\n", bt->name, entries,
+	       (double)(talloc_total_blocks(store_ctx) - blocks) / entries);
+
+	for (i = entries - 1; i > 0; i--) {
+		j = fr_rand() % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	if (bt->find && (bench_op(bt, "find", bt->find, store, order, entries) < 0)) goto error;
+
+	if (bench_op(bt, "delete", bt->delete, store, order, entries) < 0) {
+	error:
+		talloc_free(store_ctx);
+		return -1;
+	}
+
+	/*
+	 *	For the heap, also time draining it in order.
+	 */
+	if ((bt->alloc == heap_alloc) || (bt->alloc == heap_keyed_alloc)) {
+		fr_time_t start;
+
+		for (i = 0; i < entries; i++) fr_heap_insert(store, &items[i]);
+
+		start = fr_time();
+		for (i = 0; i < entries; i++) (void) fr_heap_pop(store);
+		result_print(bt->name, "pop", entries, fr_time() - start);
+	}
+
+	talloc_free(store_ctx);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int			c, i;
+	size_t			j, entries;
+	TALLOC_CTX		*autofree = talloc_autofree_context();
+	bench_item_t		*items;
+	bench_item_t		**order;
+
+	while ((c = getopt(argc, argv, "hm:s:")) != -1) switch (c) {
+		case 'm':
+			max_entries = strtoull(optarg, NULL, 10);
+			if (!max_entries) usage();
+			break;
+
+		case 's':
+			min_entries = strtoull(optarg, NULL, 10);
+			if (!min_entries) usage();
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (min_entries > max_entries) usage();
+
+	items = talloc_zero_array(autofree, bench_item_t, max_entries);
+	order = talloc_array(autofree, bench_item_t *, max_entries);
+	if (!items || !order) {
+		fprintf(stderr, "Failed allocating %zu entries\n", max_entries);
+		fr_exit_now(EXIT_FAILURE);
+	}
+
+	/*
+	 *	Random keys, but no duplicates.  The top bits are
+	 *	random, and the bottom bits are the index.
+	 */
+	for (j = 0; j < max_entries; j++) {
+		items[j].key = (((uint64_t) fr_rand()) << 32) ^ j;
+		items[j].heap_id = -1;
+	}
+
+	for (j = 0; j < NUM_ELEMENTS(bench_types); j++) {
+		bench_type_t const *bt = &bench_types[j];
+
+		if (argc > 0) {
+			for (i = 0; i < argc; i++) if (strcmp(argv[i], bt->name) == 0) break;
+			if (i == argc) continue;
+		}
+
+		for (entries = min_entries; entries <= max_entries; entries *= 10) {
+			if (bench_run(autofree, bt, items, order, entries) < 0) fr_exit_now(EXIT_FAILURE);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,6 @@
+TARGET := struct_bench
+
+SOURCES		:= struct_bench.c
+
+TGT_PREREQS	:= libfreeradius-util.la
+TGT_LDLIBS	:= $(LIBS)